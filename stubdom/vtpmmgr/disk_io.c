@@ -18,6 +18,17 @@
 
 static uint8_t disk_staging_buf[4096] __attribute__((aligned(4096)));
 
+/*
+ * Sectors written since the last flush, in the order they were written.
+ * A commit writes a handful of sectors, mostly freshly allocated ones in
+ * ascending order, so that queueing them until the barrier lets a run of
+ * neighbours go out in one write rather than one round trip each.
+ */
+#define DISK_WRITE_QUEUE 32
+static uint8_t disk_queue_buf[DISK_WRITE_QUEUE][4096] __attribute__((aligned(4096)));
+static uint32_t disk_queue_pos[DISK_WRITE_QUEUE];
+static int disk_queue_len;
+
 static struct blkfront_dev* blkdev;
 static int blkfront_fd = -1;
 
@@ -32,10 +43,27 @@ int vtpm_storage_init(void) {
 	return 0;
 }
 
+static void disk_queue_flush(void)
+{
+	int i, n, rc;
+
+	for (i = 0; i < disk_queue_len; i += n) {
+		for (n = 1; i + n < disk_queue_len; n++)
+			if (disk_queue_pos[i + n] != disk_queue_pos[i] + n)
+				break;
+		lseek(blkfront_fd, disk_queue_pos[i] * 4096, SEEK_SET);
+		rc = write(blkfront_fd, disk_queue_buf[i], n * 4096);
+		if (rc != n * 4096)
+			abort();
+	}
+	disk_queue_len = 0;
+}
+
 void* disk_read_sector(sector_t sector)
 {
 	uint32_t pos = be32_native(sector);
 	int rc;
+	disk_queue_flush();
 	vtpmloginfo(VTPM_LOG_VTPM, "disk_read_sector %x\n", pos);
 	lseek(blkfront_fd, pos * 4096, SEEK_SET);
 	rc = read(blkfront_fd, disk_staging_buf, 4096);
@@ -48,24 +76,22 @@ void* disk_write_buf(void) { return disk_staging_buf; }
 
 void disk_write_sector(sector_t sector, void* buf, size_t siz)
 {
-	int rc;
-	uint32_t pos = be32_native(sector);
-	lseek(blkfront_fd, pos * 4096, SEEK_SET);
-	if (siz < 4096) {
-		if (buf != disk_staging_buf)
-			memcpy(disk_staging_buf, buf, siz);
-		memset(disk_staging_buf + siz, 0, 4096 - siz);
-		buf = disk_staging_buf;
-	} else if (siz > 4096)
-		abort();
+	uint8_t *dst;
 
-	rc = write(blkfront_fd, buf, 4096);
-	if (rc != 4096)
+	if (siz > 4096)
 		abort();
+	if (disk_queue_len == DISK_WRITE_QUEUE)
+		disk_queue_flush();
+
+	dst = disk_queue_buf[disk_queue_len];
+	memcpy(dst, buf, siz);
+	memset(dst + siz, 0, 4096 - siz);
+	disk_queue_pos[disk_queue_len++] = be32_native(sector);
 }
 
 void disk_write_barrier(void)
 {
+	disk_queue_flush();
 	blkfront_sync(blkdev);
 }
 
@@ -58,6 +58,7 @@ static void mgr_free(struct mem_tpm_mgr *mgr)
 			group_free(mgr->groups[i].v);
 		free(mgr->groups);
 	}
+	free(mgr->seal_cache);
 	free(mgr);
 }
 
@@ -156,7 +157,25 @@ static int parse_root_key(struct mem_tpm_mgr *dst, struct disk_seal_entry *src)
 	return 0;
 }
 
-static struct mem_tpm_mgr *find_root_key(int active_root)
+static void copy_root_key(struct mem_tpm_mgr *dst, const struct mem_tpm_mgr *src)
+{
+	memcpy(&dst->tm_key, &src->tm_key, 16);
+	memcpy(&dst->nv_key, &src->nv_key, 16);
+	memcpy(dst->uuid, src->uuid, 16);
+	dst->nvram_slot = src->nvram_slot;
+	memcpy(&dst->nvram_auth, &src->nvram_auth, sizeof(struct tpm_authdata));
+	dst->counter_index = src->counter_index;
+	memcpy(&dst->counter_auth, &src->counter_auth, sizeof(struct tpm_authdata));
+}
+
+/*
+ * Open the root key from the seal list of a slot.  If @prev, the manager
+ * opened from the other slot, has the same list, its keys are taken as
+ * they are: both slots normally hold the same list, and unsealing is the
+ * slow part of loading.
+ */
+static struct mem_tpm_mgr *find_root_key(int active_root,
+		const struct mem_tpm_mgr *prev)
 {
 	sector_t seal_list = native_be32(active_root);
 	struct disk_seal_list *seal = disk_read_sector(seal_list);
@@ -173,6 +192,20 @@ static struct mem_tpm_mgr *find_root_key(int active_root)
 	dst = calloc(1, sizeof(*dst));
 	dst->active_root = active_root;
 
+	// keep a single-sector list, for writing to the other slot as it is
+	if (seal->next.value == 0) {
+		dst->seal_cache = malloc(sizeof(*seal));
+		if (dst->seal_cache)
+			memcpy(dst->seal_cache, seal, sizeof(*seal));
+	}
+
+	if (prev && prev->seal_cache && dst->seal_cache &&
+	    !memcmp(prev->seal_cache, dst->seal_cache, sizeof(*seal))) {
+		disk_set_used(seal_list, dst);
+		copy_root_key(dst, prev);
+		return dst;
+	}
+
 	for (nr = 0; nr < 100; nr++) {
 		disk_set_used(seal_list, dst);
 		uint32_t nr_seals = be32_native(seal->length);
@@ -563,8 +596,8 @@ int vtpm_load_disk(void)
 		sizeof(struct disk_vtpm_plain), sizeof(struct disk_vtpm_secret),
 		VTPMS_PER_SECTOR, sizeof(struct disk_vtpm_sector));
 
-	struct mem_tpm_mgr *mgr1 = find_root_key(0);
-	struct mem_tpm_mgr *mgr2 = find_root_key(1);
+	struct mem_tpm_mgr *mgr1 = find_root_key(0, NULL);
+	struct mem_tpm_mgr *mgr2 = find_root_key(1, mgr1);
 
 	rc = mgr1 ? load_root_pre(&root1, mgr1) : 0;
 	if (rc) {
@@ -225,6 +225,13 @@ static void disk_write_seal_list(struct mem_tpm_mgr *mgr, struct mem_group *grou
 	if (mgr->root_seals_valid & (1 + mgr->active_root))
 		return;
 
+	// the other slot's list seals the same data: copy it, not the TPM work
+	if (mgr->root_seals_valid && mgr->seal_cache) {
+		disk_write_sector(seal_loc(mgr), mgr->seal_cache, sizeof(*seal));
+		mgr->root_seals_valid |= 1 + mgr->active_root;
+		return;
+	}
+
 	memcpy(&sblob.magic, DISK_ROOT_BOUND_MAGIC, 4);
 	memcpy(sblob.tpm_manager_uuid, mgr->uuid, 16);
 	memcpy(&sblob.nvram_slot, &mgr->nvram_slot, 4);
@@ -265,6 +272,11 @@ static void disk_write_seal_list(struct mem_tpm_mgr *mgr, struct mem_group *grou
 	memcpy(seal->hdr.magic, TPM_MGR_MAGIC, 12);
 	seal->hdr.version = native_be32(TPM_MGR_VERSION);
 
+	if (!mgr->seal_cache)
+		mgr->seal_cache = malloc(sizeof(*seal));
+	if (mgr->seal_cache)
+		memcpy(mgr->seal_cache, seal, sizeof(*seal));
+
 	disk_write_sector(seal_loc(mgr), seal, sizeof(*seal));
 	mgr->root_seals_valid |= 1 + mgr->active_root;
 }
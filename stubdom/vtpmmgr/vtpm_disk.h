@@ -197,6 +197,8 @@ struct mem_tpm_mgr {
 	struct mem_group_hdr *groups;
 
 	int root_seals_valid;
+	/* Copy of the seal list for a slot in root_seals_valid, or NULL */
+	struct disk_seal_list *seal_cache;
 };
 
 int vtpm_storage_init(void);
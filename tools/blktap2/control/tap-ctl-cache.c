@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tap-ctl.h"
+#include "tapdisk-cache.h"
+
+int
+tap_ctl_cache_stats(tap_cache_stats_t *stats)
+{
+	int fd, err;
+	uint64_t i, n;
+	struct stat st;
+	tapdisk_cache_slot_t *slots;
+	tapdisk_cache_header_t *hdr;
+
+	memset(stats, 0, sizeof(*stats));
+
+	fd = shm_open(TAPDISK_CACHE_SHM_NAME, O_RDONLY, 0);
+	if (fd == -1)
+		return -errno;
+
+	err = 0;
+	hdr = MAP_FAILED;
+
+	if (fstat(fd, &st)) {
+		err = -errno;
+		goto out;
+	}
+
+	if (st.st_size < sizeof(*hdr)) {
+		err = -EAGAIN;
+		goto out;
+	}
+
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		err = -errno;
+		goto out;
+	}
+
+	if (hdr->magic != TAPDISK_CACHE_MAGIC ||
+	    hdr->version != TAPDISK_CACHE_VERSION ||
+	    hdr->size != st.st_size) {
+		EPRINTF("unrecognised shared cache %s\n",
+			TAPDISK_CACHE_SHM_NAME);
+		err = -EINVAL;
+		goto out;
+	}
+
+	slots = tapdisk_cache_slots(hdr);
+	n     = (uint64_t)hdr->sets * hdr->ways;
+
+	stats->size  = hdr->size;
+	stats->pages = n;
+	for (i = 0; i < n; i++)
+		if (slots[i].disk)
+			stats->used++;
+
+	stats->lookups   = hdr->stats.lookups;
+	stats->hits      = hdr->stats.hits;
+	stats->inserts   = hdr->stats.inserts;
+	stats->evictions = hdr->stats.evictions;
+	stats->races     = hdr->stats.races;
+
+out:
+	if (hdr != MAP_FAILED)
+		munmap(hdr, st.st_size);
+	close(fd);
+	return err;
+}
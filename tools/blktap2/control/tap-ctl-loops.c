@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "tap-ctl.h"
+
+int
+tap_ctl_loops(const int id, tap_loop_t **_loops, int *_n)
+{
+	int err, sfd, n;
+	tap_loop_t *loops, *loop;
+	tapdisk_message_t message;
+
+	*_loops = NULL;
+	*_n     = 0;
+
+	err = tap_ctl_connect_id(id, &sfd);
+	if (err)
+		return err;
+
+	memset(&message, 0, sizeof(message));
+	message.type   = TAPDISK_MESSAGE_LOOPS;
+	message.cookie = -1;
+
+	err = tap_ctl_write_message(sfd, &message, 2);
+	if (err)
+		goto out;
+
+	n     = 0;
+	loops = NULL;
+
+	do {
+		err = tap_ctl_read_message(sfd, &message, 2);
+		if (err) {
+			err = -EPROTO;
+			break;
+		}
+
+		if (message.type != TAPDISK_MESSAGE_LOOPS_RSP) {
+			EPRINTF("got unexpected result '%s' from %d\n",
+				tapdisk_message_name(message.type), id);
+			err = -EINVAL;
+			break;
+		}
+
+		if (message.u.loop.count == 0)
+			break;
+
+		loop = realloc(loops, (n + 1) * sizeof(*loops));
+		if (!loop) {
+			err = -ENOMEM;
+			break;
+		}
+		loops = loop;
+
+		loop = &loops[n++];
+		loop->id         = message.u.loop.id;
+		loop->vbds       = message.u.loop.vbds;
+		loop->busy_us    = message.u.loop.busy_us;
+		loop->idle_us    = message.u.loop.idle_us;
+		loop->iterations = message.u.loop.iterations;
+		loop->tiocbs     = message.u.loop.tiocbs;
+		loop->iocbs      = message.u.loop.iocbs;
+	} while (1);
+
+	if (err)
+		free(loops);
+	else {
+		*_loops = loops;
+		*_n     = n;
+	}
+
+out:
+	close(sfd);
+	return err;
+}
@@ -31,6 +31,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <inttypes.h>
 
 #include "tap-ctl.h"
 
@@ -702,6 +703,109 @@ usage:
 	return EINVAL;
 }
 
+static void
+tap_cli_loops_usage(FILE *stream)
+{
+	fprintf(stream, "usage: loops <-p pid>\n"
+		"(reports the utilisation of each tapdisk event loop)\n");
+}
+
+static int
+tap_cli_loops(int argc, char **argv)
+{
+	int c, pid, err, i, n;
+	tap_loop_t *loops;
+
+	pid = -1;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_loops_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1)
+		goto usage;
+
+	err = tap_ctl_loops(pid, &loops, &n);
+	if (err)
+		return -err;
+
+	for (i = 0; i < n; i++) {
+		tap_loop_t *loop = &loops[i];
+		uint64_t total = loop->busy_us + loop->idle_us;
+
+		printf("loop=%d vbds=%u iterations=%"PRIu64" "
+		       "busy=%"PRIu64"us idle=%"PRIu64"us util=%u%% "
+		       "requests=%"PRIu64" merged=%"PRIu64"\n",
+		       loop->id, loop->vbds, loop->iterations,
+		       loop->busy_us, loop->idle_us,
+		       total ? (unsigned)(loop->busy_us * 100 / total) : 0,
+		       loop->tiocbs, loop->tiocbs - loop->iocbs);
+	}
+
+	free(loops);
+	return 0;
+
+usage:
+	tap_cli_loops_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_cache_usage(FILE *stream)
+{
+	fprintf(stream, "usage: cache\n"
+		"(reports the host-wide shared read cache)\n");
+}
+
+static int
+tap_cli_cache(int argc, char **argv)
+{
+	int c, err;
+	tap_cache_stats_t stats;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "h")) != -1) {
+		switch (c) {
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_cache_usage(stdout);
+			return 0;
+		}
+	}
+
+	err = tap_ctl_cache_stats(&stats);
+	if (err) {
+		if (err == -ENOENT)
+			printf("no shared cache\n");
+		return -err;
+	}
+
+	printf("size=%"PRIu64"MB pages=%"PRIu64" used=%"PRIu64" "
+	       "lookups=%"PRIu64" hits=%"PRIu64" hit=%u%% "
+	       "inserts=%"PRIu64" evictions=%"PRIu64" races=%"PRIu64"\n",
+	       stats.size >> 20, stats.pages, stats.used,
+	       stats.lookups, stats.hits,
+	       stats.lookups ? (unsigned)(stats.hits * 100 / stats.lookups) : 0,
+	       stats.inserts, stats.evictions, stats.races);
+
+	return 0;
+
+usage:
+	tap_cli_cache_usage(stderr);
+	return EINVAL;
+}
+
 struct command commands[] = {
 	{ .name = "list",         .func = tap_cli_list          },
 	{ .name = "allocate",     .func = tap_cli_allocate      },
@@ -717,6 +821,8 @@ struct command commands[] = {
 	{ .name = "unpause",      .func = tap_cli_unpause       },
 	{ .name = "major",        .func = tap_cli_major         },
 	{ .name = "check",        .func = tap_cli_check         },
+	{ .name = "loops",        .func = tap_cli_loops         },
+	{ .name = "cache",        .func = tap_cli_cache         },
 };
 
 #define print_commands()					\
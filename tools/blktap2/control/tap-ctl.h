@@ -98,4 +98,29 @@ int tap_ctl_unpause(const int id, const int minor, const char *params);
 
 int tap_ctl_blk_major(void);
 
+typedef struct {
+	int         id;
+	unsigned    vbds;
+	uint64_t    busy_us;
+	uint64_t    idle_us;
+	uint64_t    iterations;
+	uint64_t    tiocbs;
+	uint64_t    iocbs;
+} tap_loop_t;
+
+int tap_ctl_loops(const int id, tap_loop_t **loops, int *n);
+
+typedef struct {
+	uint64_t    size;
+	uint64_t    pages;
+	uint64_t    used;
+	uint64_t    lookups;
+	uint64_t    hits;
+	uint64_t    inserts;
+	uint64_t    evictions;
+	uint64_t    races;
+} tap_cache_stats_t;
+
+int tap_ctl_cache_stats(tap_cache_stats_t *stats);
+
 #endif
@@ -29,9 +29,12 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "tapdisk.h"
+#include "tapdisk-cache.h"
 #include "tapdisk-utils.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
@@ -108,6 +111,10 @@ struct block_cache_request {
 	uint64_t                        secs;
 	td_request_t                    treq;
 	block_cache_t                  *cache;
+
+	/* shared cache: the page aligned range actually read */
+	uint64_t                        psec;
+	uint64_t                        psecs;
 };
 
 struct block_cache_stats {
@@ -123,6 +130,9 @@ struct block_cache {
 
 	uint64_t                        sectors;
 
+	/* key in the shared cache, or 0 if this cache is private */
+	uint64_t                        disk;
+
 	block_cache_request_t           requests[BLOCK_CACHE_REQUESTS];
 	block_cache_request_t          *request_free_list[BLOCK_CACHE_REQUESTS];
 	int                             requests_free;
@@ -516,6 +526,433 @@ block_cache_put_request(block_cache_t *cache, block_cache_request_t *breq)
 	cache->request_free_list[cache->requests_free++] = breq;
 }
 
+/*
+ * host-wide shared cache, see tapdisk-cache.h
+ */
+
+#define BLOCK_CACHE_SHM_SECS            (TAPDISK_CACHE_PAGE_SIZE >> RADIX_TREE_NODE_SHIFT)
+#define BLOCK_CACHE_SHM_PAGES           2 /* a page-sized read spans two */
+#define BLOCK_CACHE_SHM_WAIT            100 /* x 10ms for the creator */
+
+static struct {
+	pthread_mutex_t                 lock;
+	int                             users;
+	size_t                          size;
+	tapdisk_cache_header_t         *hdr;
+	tapdisk_cache_slot_t           *slots;
+	char                           *data;
+} block_cache_shm = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#define block_cache_shm_stat(_name)					\
+	__atomic_fetch_add(&block_cache_shm.hdr->stats._name, 1,	\
+			   __ATOMIC_RELAXED)
+
+static inline uint64_t
+block_cache_shm_mix(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+/*
+ * The cache is keyed by the parent image file, which all clones of a
+ * golden image open under whatever path.
+ */
+static uint64_t
+block_cache_shm_disk_id(const char *name)
+{
+	uint64_t id;
+	struct stat st;
+
+	if (stat(name, &st))
+		return 0;
+
+	id = block_cache_shm_mix(st.st_dev);
+	id = block_cache_shm_mix(id ^ st.st_ino);
+	id = block_cache_shm_mix(id ^ st.st_size);
+
+	return id ? : 1;
+}
+
+static int
+block_cache_shm_create(int fd)
+{
+	char *env;
+	size_t slots, data, size;
+	uint64_t budget, pages;
+	uint32_t sets;
+	tapdisk_cache_header_t *hdr;
+
+	budget = TAPDISK_CACHE_DEFAULT_MB;
+	env    = getenv("TAPDISK_CACHE_SIZE");
+	if (env)
+		budget = strtoull(env, NULL, 10);
+
+	pages = (budget << 20) >> TAPDISK_CACHE_PAGE_SHIFT;
+	for (sets = 1; (uint64_t)sets * 2 * TAPDISK_CACHE_WAYS <= pages; )
+		sets <<= 1;
+
+	slots = tapdisk_cache_slots_offset(sets);
+	data  = slots + sets * TAPDISK_CACHE_WAYS * sizeof(tapdisk_cache_slot_t);
+	data  = (data + TAPDISK_CACHE_PAGE_SIZE - 1) &
+		~((size_t)TAPDISK_CACHE_PAGE_SIZE - 1);
+	size  = data + (size_t)sets * TAPDISK_CACHE_WAYS *
+		TAPDISK_CACHE_PAGE_SIZE;
+
+	if (ftruncate(fd, size))
+		return -errno;
+
+	hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		return -errno;
+
+	hdr->version = TAPDISK_CACHE_VERSION;
+	hdr->sets    = sets;
+	hdr->ways    = TAPDISK_CACHE_WAYS;
+	hdr->size    = size;
+	hdr->data    = data;
+	__atomic_store_n(&hdr->magic, TAPDISK_CACHE_MAGIC, __ATOMIC_RELEASE);
+
+	DPRINTF("created shared cache: %u sets, %"PRIu64"MB\n",
+		sets, (uint64_t)(size >> 20));
+
+	munmap(hdr, size);
+	return 0;
+}
+
+static int
+block_cache_shm_map(int fd)
+{
+	int i;
+	struct stat st;
+	tapdisk_cache_header_t *hdr;
+
+	/* another tapdisk may still be setting it up */
+	for (i = 0; i < BLOCK_CACHE_SHM_WAIT; i++) {
+		if (fstat(fd, &st))
+			return -errno;
+
+		if (st.st_size >= sizeof(*hdr)) {
+			hdr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+				   MAP_SHARED, fd, 0);
+			if (hdr == MAP_FAILED)
+				return -errno;
+
+			if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) ==
+			    TAPDISK_CACHE_MAGIC)
+				goto found;
+
+			munmap(hdr, st.st_size);
+		}
+
+		usleep(10000);
+	}
+
+	return -ETIMEDOUT;
+
+found:
+	if (hdr->version != TAPDISK_CACHE_VERSION ||
+	    hdr->size != st.st_size || hdr->ways != TAPDISK_CACHE_WAYS) {
+		munmap(hdr, st.st_size);
+		return -EINVAL;
+	}
+
+	block_cache_shm.hdr   = hdr;
+	block_cache_shm.size  = st.st_size;
+	block_cache_shm.slots = tapdisk_cache_slots(hdr);
+	block_cache_shm.data  = (char *)hdr + hdr->data;
+
+	return 0;
+}
+
+static int
+block_cache_shm_get(void)
+{
+	int fd, err;
+	char *env;
+
+	env = getenv("TAPDISK_CACHE_SIZE");
+	if (env && !strtoull(env, NULL, 10))
+		return -ENOENT;
+
+	pthread_mutex_lock(&block_cache_shm.lock);
+
+	if (block_cache_shm.users++) {
+		err = 0;
+		goto out;
+	}
+
+	fd = shm_open(TAPDISK_CACHE_SHM_NAME, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd != -1) {
+		err = block_cache_shm_create(fd);
+		if (err) {
+			shm_unlink(TAPDISK_CACHE_SHM_NAME);
+			close(fd);
+			goto fail;
+		}
+	} else if (errno == EEXIST)
+		fd = shm_open(TAPDISK_CACHE_SHM_NAME, O_RDWR, 0);
+
+	if (fd == -1) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = block_cache_shm_map(fd);
+	close(fd);
+	if (err)
+		goto fail;
+
+out:
+	pthread_mutex_unlock(&block_cache_shm.lock);
+	return err;
+
+fail:
+	DPRINTF("shared cache unavailable: %d\n", err);
+	block_cache_shm.users--;
+	goto out;
+}
+
+static void
+block_cache_shm_put(void)
+{
+	pthread_mutex_lock(&block_cache_shm.lock);
+
+	if (!--block_cache_shm.users) {
+		munmap(block_cache_shm.hdr, block_cache_shm.size);
+		block_cache_shm.hdr = NULL;
+	}
+
+	pthread_mutex_unlock(&block_cache_shm.lock);
+}
+
+static inline tapdisk_cache_slot_t *
+block_cache_shm_set(uint64_t disk, uint64_t page)
+{
+	uint64_t set;
+
+	set = block_cache_shm_mix(disk ^ block_cache_shm_mix(page)) &
+		(block_cache_shm.hdr->sets - 1);
+
+	return block_cache_shm.slots + set * TAPDISK_CACHE_WAYS;
+}
+
+static inline char *
+block_cache_shm_page(tapdisk_cache_slot_t *slot)
+{
+	return block_cache_shm.data +
+		(size_t)(slot - block_cache_shm.slots) * TAPDISK_CACHE_PAGE_SIZE;
+}
+
+static int
+block_cache_shm_lookup(uint64_t disk, uint64_t page, char *buf)
+{
+	int i;
+	uint32_t seq;
+	tapdisk_cache_slot_t *set, *slot;
+
+	block_cache_shm_stat(lookups);
+
+	set = block_cache_shm_set(disk, page);
+
+	for (i = 0; i < TAPDISK_CACHE_WAYS; i++) {
+		slot = set + i;
+
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		if (__atomic_load_n(&slot->disk, __ATOMIC_RELAXED) != disk ||
+		    __atomic_load_n(&slot->page, __ATOMIC_RELAXED) != page)
+			continue;
+
+		memcpy(buf, block_cache_shm_page(slot),
+		       TAPDISK_CACHE_PAGE_SIZE);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+			block_cache_shm_stat(races);
+			return -EAGAIN;
+		}
+
+		if (!slot->ref)
+			__atomic_store_n(&slot->ref, 1, __ATOMIC_RELAXED);
+
+		block_cache_shm_stat(hits);
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+static void
+block_cache_shm_insert(uint64_t disk, uint64_t page, const char *buf)
+{
+	int i;
+	uint32_t seq, *hand;
+	tapdisk_cache_slot_t *set, *slot;
+
+	set  = block_cache_shm_set(disk, page);
+	hand = &block_cache_shm.hdr->hands[(set - block_cache_shm.slots) /
+					   TAPDISK_CACHE_WAYS];
+
+	for (i = 0; i < TAPDISK_CACHE_WAYS; i++)
+		if (__atomic_load_n(&set[i].disk, __ATOMIC_RELAXED) == disk &&
+		    __atomic_load_n(&set[i].page, __ATOMIC_RELAXED) == page)
+			return;
+
+	/* CLOCK: referenced slots get a second chance */
+	for (i = 0; i < 2 * TAPDISK_CACHE_WAYS; i++) {
+		slot = set + (__atomic_fetch_add(hand, 1, __ATOMIC_RELAXED) %
+			      TAPDISK_CACHE_WAYS);
+
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		if (slot->disk && slot->ref) {
+			__atomic_store_n(&slot->ref, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		if (!__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0,
+						 __ATOMIC_ACQUIRE,
+						 __ATOMIC_RELAXED))
+			continue;
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+
+		if (slot->disk)
+			block_cache_shm_stat(evictions);
+
+		__atomic_store_n(&slot->disk, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&slot->page, page, __ATOMIC_RELAXED);
+		memcpy(block_cache_shm_page(slot), buf,
+		       TAPDISK_CACHE_PAGE_SIZE);
+		__atomic_store_n(&slot->disk, disk, __ATOMIC_RELAXED);
+		__atomic_store_n(&slot->ref, 0, __ATOMIC_RELAXED);
+
+		__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+
+		block_cache_shm_stat(inserts);
+		return;
+	}
+}
+
+static void
+block_cache_shm_populate(td_request_t clone, int err)
+{
+	int i;
+	uint64_t page;
+	block_cache_t *cache;
+	block_cache_request_t *breq;
+
+	breq        = (block_cache_request_t *)clone.cb_data;
+	cache       = breq->cache;
+	breq->secs -= clone.secs;
+	breq->err   = (breq->err ? breq->err : err);
+
+	if (breq->secs)
+		goto out;
+
+	if (!breq->err) {
+		memcpy(breq->treq.buf,
+		       breq->buf + ((breq->treq.sec - breq->psec) <<
+				    RADIX_TREE_NODE_SHIFT),
+		       breq->treq.secs << RADIX_TREE_NODE_SHIFT);
+
+		/* a short page at the end of the image is not kept */
+		for (i = 0; i < breq->psecs / BLOCK_CACHE_SHM_SECS; i++) {
+			page = breq->psec / BLOCK_CACHE_SHM_SECS + i;
+			block_cache_shm_insert(cache->disk, page,
+					       breq->buf +
+					       i * TAPDISK_CACHE_PAGE_SIZE);
+		}
+	}
+
+	td_complete_request(breq->treq, breq->err);
+	free(breq->buf);
+	block_cache_put_request(cache, breq);
+
+out:
+	return;
+}
+
+static void
+block_cache_shm_miss(block_cache_t *cache, td_request_t treq,
+		     uint64_t first, int pages)
+{
+	char *buf;
+	td_request_t clone;
+	block_cache_request_t *breq;
+
+	cache->stats.misses += treq.secs;
+
+	breq = block_cache_get_request(cache);
+	if (!breq)
+		return td_forward_request(treq);
+
+	if (posix_memalign((void **)&buf, TAPDISK_CACHE_PAGE_SIZE,
+			   pages * TAPDISK_CACHE_PAGE_SIZE)) {
+		block_cache_put_request(cache, breq);
+		return td_forward_request(treq);
+	}
+
+	/* read whole pages, so that they can be shared */
+	breq->treq    = treq;
+	breq->err     = 0;
+	breq->buf     = buf;
+	breq->cache   = cache;
+	breq->psec    = first * BLOCK_CACHE_SHM_SECS;
+	breq->psecs   = pages * BLOCK_CACHE_SHM_SECS;
+	if (breq->psec + breq->psecs > cache->sectors)
+		breq->psecs = cache->sectors - breq->psec;
+	breq->secs    = breq->psecs;
+
+	clone         = treq;
+	clone.sec     = breq->psec;
+	clone.secs    = breq->psecs;
+	clone.buf     = buf;
+	clone.cb      = block_cache_shm_populate;
+	clone.cb_data = breq;
+
+	td_forward_request(clone);
+}
+
+static void
+block_cache_shm_read(block_cache_t *cache, td_request_t treq)
+{
+	int i, pages;
+	uint64_t first, last;
+	char buf[BLOCK_CACHE_SHM_PAGES * TAPDISK_CACHE_PAGE_SIZE];
+
+	first = treq.sec / BLOCK_CACHE_SHM_SECS;
+	last  = (treq.sec + treq.secs - 1) / BLOCK_CACHE_SHM_SECS;
+	pages = last - first + 1;
+
+	if (pages > BLOCK_CACHE_SHM_PAGES)
+		return td_forward_request(treq);
+
+	for (i = 0; i < pages; i++)
+		if (block_cache_shm_lookup(cache->disk, first + i,
+					   buf + i * TAPDISK_CACHE_PAGE_SIZE))
+			return block_cache_shm_miss(cache, treq, first, pages);
+
+	cache->stats.hits += treq.secs;
+
+	memcpy(treq.buf,
+	       buf + ((treq.sec - first * BLOCK_CACHE_SHM_SECS) <<
+		      RADIX_TREE_NODE_SHIFT),
+	       treq.secs << RADIX_TREE_NODE_SHIFT);
+
+	td_complete_request(treq, 0);
+}
+
 static int
 block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 {
@@ -558,6 +995,12 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 		"tree: %p, height: %d\n",
 		cache->name, cache->sectors, tree, tree->height);
 
+	if (!block_cache_shm_get()) {
+		cache->disk = block_cache_shm_disk_id(cache->name);
+		if (!cache->disk)
+			block_cache_shm_put();
+	}
+
 	if (mlockall(MCL_CURRENT | MCL_FUTURE))
 		DPRINTF("mlockall failed: %d\n", -errno);
 
@@ -584,6 +1027,11 @@ block_cache_close(td_driver_t *driver)
 	radix_tree_free(tree);
 	free(cache->name);
 
+	if (cache->disk) {
+		block_cache_shm_put();
+		cache->disk = 0;
+	}
+
 	return 0;
 }
 
@@ -722,6 +1170,9 @@ block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 	if (treq.secs > BLOCK_CACHE_NODES_PER_PAGE)
 		return td_forward_request(treq);
 
+	if (cache->disk)
+		return block_cache_shm_read(cache, treq);
+
 	for (i = 0; i < treq.secs; i++) {
 		iov[i] = radix_tree_find_leaf(tree, treq.sec + i);
 		if (!iov[i])
@@ -771,6 +1222,15 @@ block_cache_debug(td_driver_t *driver)
 	WARN("BLOCK CACHE %s\n", cache->name);
 	WARN("reads: %"PRIu64", hits: %"PRIu64", misses: %"PRIu64", prunes: %"PRIu64"\n",
 	     stats->reads, stats->hits, stats->misses, stats->prunes);
+
+	if (cache->disk) {
+		tapdisk_cache_stats_t *shared = &block_cache_shm.hdr->stats;
+
+		WARN("shared: disk 0x%016"PRIx64", lookups: %"PRIu64", "
+		     "hits: %"PRIu64", inserts: %"PRIu64", evictions: %"PRIu64
+		     "\n", cache->disk, shared->lookups, shared->hits,
+		     shared->inserts, shared->evictions);
+	}
 }
 
 struct tap_disk tapdisk_block_cache = {
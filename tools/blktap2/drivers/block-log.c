@@ -482,32 +482,30 @@ static int ctl_get_writes(struct tdlog_state* s, int fd)
 /* get requests from ring */
 static int ctl_kick(struct tdlog_state* s, int fd)
 {
-  RING_IDX reqstart, reqend;
-  log_request_t req;
+  log_request_t reqs[32];
 
   /* XXX testing */
-  RING_IDX rspstart, rspend;
-  log_response_t rsp;
+  log_response_t rsps[32];
   struct log_ctlmsg msg;
+  RING_IDX i, n;
   int rc;
 
-  reqstart = s->bring.req_cons;
-  reqend = s->sring->req_prod;
+  BDPRINTF("ctl: ring kicked (start = %u, end = %u)", s->bring.req_cons,
+	   s->sring->req_prod);
 
-  BDPRINTF("ctl: ring kicked (start = %u, end = %u)", reqstart, reqend);
+  do {
+    RING_COPY_REQUESTS(&s->bring, reqs, 32, n);
 
-  while (reqstart != reqend) {
-    /* XXX actually submit these! */
-    memcpy(&req, RING_GET_REQUEST(&s->bring, reqstart), sizeof(req));
-    BDPRINTF("ctl: read request %"PRIu64":%u", req.sector, req.count);
-    s->bring.req_cons = ++reqstart;
+    for (i = 0; i < n; i++) {
+      /* XXX actually submit these! */
+      BDPRINTF("ctl: read request %"PRIu64":%u", reqs[i].sector,
+	       reqs[i].count);
+      rsps[i].sector = reqs[i].sector;
+      rsps[i].count = reqs[i].count;
+    }
 
-    rsp.sector = req.sector;
-    rsp.count = req.count;
-    memcpy(RING_GET_RESPONSE(&s->bring, s->bring.rsp_prod_pvt), &rsp,
-	   sizeof(rsp));
-    s->bring.rsp_prod_pvt++;
-  }
+    RING_PUT_RESPONSES(&s->bring, rsps, n);
+  } while (n);
 
   RING_PUSH_RESPONSES(&s->bring);
   memset(&msg, 0, sizeof(msg));
@@ -297,9 +297,11 @@ static void encrypt_sectors(struct tdqcow_state *s, int64_t sector_num,
 	}
 }
 
+#define QTRUNCATE_CHUNK (64 << 10)
+
 int qtruncate(int fd, off_t length, int sparse)
 {
-	int ret, i; 
+	int ret, i, n;
 	int current = 0, rem = 0;
 	uint64_t sectors;
 	struct stat st;
@@ -326,11 +328,11 @@ int qtruncate(int fd, off_t length, int sparse)
 	if(st.st_size < sectors * DEFAULT_SECTOR_SIZE) {
 		/*We are extending the file*/
 		if ((ret = posix_memalign((void **)&buf, 
-					  512, DEFAULT_SECTOR_SIZE))) {
+					  4096, QTRUNCATE_CHUNK))) {
 			DPRINTF("posix_memalign failed: %d\n", ret);
 			return -1;
 		}
-		memset(buf, 0x00, DEFAULT_SECTOR_SIZE);
+		memset(buf, 0x00, QTRUNCATE_CHUNK);
 		if (lseek(fd, 0, SEEK_END)==-1) {
 			DPRINTF("Lseek EOF failed (%d), internal error\n",
 				errno);
@@ -346,9 +348,12 @@ int qtruncate(int fd, off_t length, int sparse)
 				return -1;
 			}
 		}
-		for (i = current; i < sectors; i++ ) {
-			ret = write(fd, buf, DEFAULT_SECTOR_SIZE);
-			if (ret != DEFAULT_SECTOR_SIZE) {
+		for (i = current; i < sectors; i += n) {
+			n = sectors - i;
+			if (n > QTRUNCATE_CHUNK / DEFAULT_SECTOR_SIZE)
+				n = QTRUNCATE_CHUNK / DEFAULT_SECTOR_SIZE;
+			ret = write(fd, buf, n * DEFAULT_SECTOR_SIZE);
+			if (ret != n * DEFAULT_SECTOR_SIZE) {
 				DPRINTF("write failed: ret = %d, err = %s\n",
 					ret, strerror(errno));
 				free(buf);
@@ -364,6 +369,73 @@ int qtruncate(int fd, off_t length, int sparse)
 	return 0;
 }
 
+/*
+ * Zero fill the file up to 'end', unless an earlier run already has.
+ */
+static int qcow_extend(struct tdqcow_state *s, uint64_t end)
+{
+	if (end <= s->prealloc_end)
+		return 0;
+
+	if (qtruncate(s->fd, end, s->sparse) != 0) {
+		DPRINTF("ERROR truncating file\n");
+		return -1;
+	}
+
+	s->prealloc_end = end;
+	return 0;
+}
+
+/*
+ * Write back the dirty 4k sectors of cached L2 table 'idx'.
+ */
+static int qcow_flush_l2(struct tdqcow_state *s, int idx)
+{
+	int sector;
+	char *l2_ptr, *tmp_ptr;
+	uint64_t *l2_table;
+
+	if (!s->l2_cache_dirty[idx])
+		return 0;
+
+	if (posix_memalign((void **)&tmp_ptr, 4096, 4096) != 0) {
+		DPRINTF("ERROR allocating memory for L2 table\n");
+		return -1;
+	}
+
+	l2_table = s->l2_cache + ((uint64_t)idx << s->l2_bits);
+
+	for (sector = 0; sector < 64; sector++) {
+		if (!(s->l2_cache_dirty[idx] & (1ULL << sector)))
+			continue;
+
+		l2_ptr = (char *)l2_table + (sector << 12);
+		memcpy(tmp_ptr, l2_ptr, 4096);
+		lseek(s->fd, s->l2_cache_offsets[idx] + (sector << 12),
+		      SEEK_SET);
+		if (write(s->fd, tmp_ptr, 4096) != 4096) {
+			free(tmp_ptr);
+			return -1;
+		}
+
+		s->l2_cache_dirty[idx] &= ~(1ULL << sector);
+	}
+
+	free(tmp_ptr);
+	return 0;
+}
+
+static int qcow_flush_l2_cache(struct tdqcow_state *s)
+{
+	int i, err = 0;
+
+	for (i = 0; i < s->l2_cache_size; i++)
+		if (qcow_flush_l2(s, i))
+			err = -1;
+
+	return err;
+}
+
 /* 'allocate' is:
  *
  * 0 to not allocate.
@@ -382,11 +454,11 @@ static uint64_t get_cluster_offset(struct tdqcow_state *s,
                                    int compressed_size,
                                    int n_start, int n_end)
 {
-	int min_index, i, j, l1_index, l2_index, l2_sector, l1_sector;
+	int min_index, i, l1_index, l2_index, l2_sector, l1_sector;
 	char *tmp_ptr2, *l2_ptr, *l1_ptr;
 	uint64_t *tmp_ptr;
-	uint64_t l2_offset, *l2_table, cluster_offset, tmp;
-	uint32_t min_count;
+	uint64_t l2_offset, *l2_table, cluster_offset, tmp, cluster;
+	uint64_t min_lru;
 	int new_l2_table;
 
 	/*Check L1 table for the extent offset*/
@@ -412,12 +484,9 @@ static uint64_t get_cluster_offset(struct tdqcow_state *s,
 		
 		/*Truncate file for L2 table 
 		 *(initialised to zero in case we crash)*/
-		if (qtruncate(s->fd, 
-			      l2_offset + (s->l2_size * sizeof(uint64_t)),
-			      s->sparse) != 0) {
-			DPRINTF("ERROR truncating file\n");
+		if (qcow_extend(s, 
+				l2_offset + (s->l2_size * sizeof(uint64_t))))
 			return 0;
-		}
 		s->fd_end = l2_offset + (s->l2_size * sizeof(uint64_t));
 
 		/*Update the L1 table entry on disk
@@ -458,30 +527,31 @@ static uint64_t get_cluster_offset(struct tdqcow_state *s,
 	}
 
 	/*Check to see if L2 entry is already cached*/
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
+	for (i = 0; i < s->l2_cache_size; i++) {
 		if (l2_offset == s->l2_cache_offsets[i]) {
-			/* increment the hit count */
-			if (++s->l2_cache_counts[i] == 0xffffffff) {
-				for (j = 0; j < L2_CACHE_SIZE; j++) {
-					s->l2_cache_counts[j] >>= 1;
-				}
-			}
-			l2_table = s->l2_cache + (i << s->l2_bits);
+			s->l2_cache_lru[i] = ++s->l2_cache_seq;
+			min_index = i;
+			l2_table = s->l2_cache + ((uint64_t)i << s->l2_bits);
 			goto found;
 		}
 	}
 
 cache_miss:
-	/* not found: load a new entry in the least used one */
+	/* not found: load a new entry in the least recently used one */
 	min_index = 0;
-	min_count = 0xffffffff;
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
-		if (s->l2_cache_counts[i] < min_count) {
-			min_count = s->l2_cache_counts[i];
+	min_lru = (uint64_t)-1;
+	for (i = 0; i < s->l2_cache_size; i++) {
+		if (s->l2_cache_lru[i] < min_lru) {
+			min_lru = s->l2_cache_lru[i];
 			min_index = i;
 		}
 	}
-	l2_table = s->l2_cache + (min_index << s->l2_bits);
+	l2_table = s->l2_cache + ((uint64_t)min_index << s->l2_bits);
+
+	/* the victim may hold updates of the current write batch */
+	if (qcow_flush_l2(s, min_index))
+		return 0;
+	s->l2_cache_offsets[min_index] = 0;
 
 	/*If extent pre-allocated, read table from disk, 
 	 *otherwise write new table to disk*/
@@ -492,12 +562,9 @@ cache_miss:
 				(s->l2_size * sizeof(uint64_t));
 			cluster_offset = (cluster_offset + s->cluster_size - 1)
 				& ~(s->cluster_size - 1);
-			if (qtruncate(s->fd, cluster_offset + 
-				  (s->cluster_size * s->l2_size), 
-				      s->sparse) != 0) {
-				DPRINTF("ERROR truncating file\n");
+			if (qcow_extend(s, cluster_offset + 
+					(s->cluster_size * s->l2_size)))
 				return 0;
-			}
 			s->fd_end = cluster_offset + 
 				(s->cluster_size * s->l2_size);
 			for (i = 0; i < s->l2_size; i++) {
@@ -519,7 +586,7 @@ cache_miss:
 	
 	/*Update the cache entries*/ 
 	s->l2_cache_offsets[min_index] = l2_offset;
-	s->l2_cache_counts[min_index] = 1;
+	s->l2_cache_lru[min_index] = ++s->l2_cache_seq;
 
 found:
 	/*The extent is split into 's->l2_size' blocks of 
@@ -555,11 +622,22 @@ found:
 				cluster_offset = 
 					(cluster_offset + s->cluster_size - 1) 
 					& ~(s->cluster_size - 1);
-				if (qtruncate(s->fd, cluster_offset + 
-					      s->cluster_size, s->sparse)!=0) {
-					DPRINTF("ERROR truncating file\n");
+
+				/* sequential writers get a growing run of
+				 * clusters zero filled in one go */
+				cluster = offset >> s->cluster_bits;
+				if (cluster != s->last_alloc + 1)
+					s->prealloc_run = 1;
+				else if (((uint64_t)s->prealloc_run <<
+					  (s->cluster_bits + 1)) <=
+					 QCOW_PREALLOC_MAX)
+					s->prealloc_run *= 2;
+				s->last_alloc = cluster;
+
+				if (qcow_extend(s, cluster_offset + 
+						(uint64_t)s->cluster_size *
+						s->prealloc_run))
 					return 0;
-				}
 				s->fd_end = (cluster_offset + s->cluster_size);
 				/* if encrypted, we must initialize the cluster
 				   content which won't be written */
@@ -598,6 +676,12 @@ found:
 		/*For IO_DIRECT we write 4KByte blocks*/
 		l2_sector = (l2_index * sizeof(uint64_t)) >> 12;
 		l2_ptr = (char *)l2_table + (l2_sector << 12);
+
+		/*Batched: written back before the data is submitted*/
+		if (s->l2_defer && l2_sector < 64) {
+			s->l2_cache_dirty[min_index] |= 1ULL << l2_sector;
+			return cluster_offset;
+		}
 		
 		if (posix_memalign((void **)&tmp_ptr2, 4096, 4096) != 0) {
 			DPRINTF("ERROR allocating memory for L1 table\n");
@@ -864,6 +948,60 @@ out:
 	return err;
 }
 
+static void qcow_free_l2_cache(struct tdqcow_state *s)
+{
+	free(s->l2_cache);
+	free(s->l2_cache_offsets);
+	free(s->l2_cache_lru);
+	free(s->l2_cache_dirty);
+	s->l2_cache = NULL;
+	s->l2_cache_offsets = NULL;
+	s->l2_cache_lru = NULL;
+	s->l2_cache_dirty = NULL;
+	s->l2_cache_size = 0;
+}
+
+static int qcow_init_l2_cache(struct tdqcow_state *s)
+{
+	char *env;
+	uint64_t budget, table, size;
+
+	budget = L2_CACHE_BUDGET;
+	env = getenv("TAPDISK_QCOW_L2_CACHE");
+	if (env)
+		budget = strtoull(env, NULL, 10) << 10; /*KB*/
+
+	table = s->l2_size * sizeof(uint64_t);
+	size  = budget / table;
+	if (size < L2_CACHE_SIZE)
+		size = L2_CACHE_SIZE;
+	if (size > s->l1_size)
+		size = s->l1_size > L2_CACHE_SIZE ? s->l1_size : L2_CACHE_SIZE;
+
+	s->l2_cache_size = size;
+	s->l2_cache_seq  = 0;
+
+	/*L2 writes are 4k blocks, which may run past a small last table*/
+	if (posix_memalign((void **)&s->l2_cache, 4096, size * table + 4096)) {
+		s->l2_cache = NULL;
+		goto fail;
+	}
+
+	s->l2_cache_offsets = calloc(size, sizeof(uint64_t));
+	s->l2_cache_lru     = calloc(size, sizeof(uint64_t));
+	s->l2_cache_dirty   = calloc(size, sizeof(uint64_t));
+	if (!s->l2_cache_offsets || !s->l2_cache_lru || !s->l2_cache_dirty)
+		goto fail;
+
+	DPRINTF("QCOW: %d L2 tables cached (%"PRIu64"KB)\n",
+		s->l2_cache_size, (size * table) >> 10);
+	return 0;
+
+fail:
+	qcow_free_l2_cache(s);
+	return -1;
+}
+
 /* Open the disk file and initialize qcow state. */
 int tdqcow_open (td_driver_t *driver, const char *name, td_flag_t flags)
 {
@@ -929,10 +1067,9 @@ int tdqcow_open (td_driver_t *driver, const char *name, td_flag_t flags)
 	if (tdqcow_load_l1_table(s, &header))
 		goto fail;
 
-	/* alloc L2 cache */
-	size = s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t);
-	ret = posix_memalign((void **)&s->l2_cache, 4096, size);
-	if(ret != 0) goto fail;
+	/* alloc L2 cache, as many tables as fit the memory budget */
+	if (qcow_init_l2_cache(s))
+		goto fail;
 
 	size = s->cluster_size;
 	ret = posix_memalign((void **)&s->cluster_cache, 4096, size);
@@ -967,6 +1104,12 @@ int tdqcow_open (td_driver_t *driver, const char *name, td_flag_t flags)
 			goto fail;
 	}
 
+	s->prealloc_end = lseek(fd, 0, SEEK_END);
+	if (s->prealloc_end == (off_t)-1 || s->prealloc_end < s->fd_end)
+		s->prealloc_end = s->fd_end;
+	s->last_alloc   = -2;
+	s->prealloc_run = 1;
+
 	return 0;
 	
 fail:
@@ -974,7 +1117,7 @@ fail:
 
 	free_aio_state(s);
 	free(s->l1_table);
-	free(s->l2_cache);
+	qcow_free_l2_cache(s);
 	free(s->cluster_cache);
 	free(s->cluster_data);
 	close(fd);
@@ -1050,11 +1193,19 @@ done:
 	return;
 }
 
+/*
+ * Clusters of a request are allocated first, their L2 updates written
+ * back together, and only then is any data submitted: the metadata for
+ * a batch hits the disk once, and always ahead of the data it maps.
+ */
+#define QCOW_WRITE_BATCH (MAX_SEGMENTS_PER_REQ * 8 + 1)
+
 void tdqcow_queue_write(td_driver_t *driver, td_request_t treq)
 {
 	struct tdqcow_state   *s  = (struct tdqcow_state *)driver->data;
-	int ret = 0, index_in_cluster, n, i;
+	int ret = 0, index_in_cluster, n, i, nr;
 	uint64_t cluster_offset, sector, nb_sectors;
+	uint64_t offsets[QCOW_WRITE_BATCH];
 	td_callback_t cb;
 	struct qcow_prv* prv;
 	char* buf = treq.buf;
@@ -1062,28 +1213,56 @@ void tdqcow_queue_write(td_driver_t *driver, td_request_t treq)
 
 	sector     = treq.sec;
 	nb_sectors = treq.secs;
-		   
-	/*We store a local record of the request*/
-	while (nb_sectors > 0) {
+
+	/*Allocate clusters and record their offsets*/
+	s->l2_defer = 1;
+	for (nr = 0; nr < QCOW_WRITE_BATCH && nb_sectors > 0; nr++) {
 		index_in_cluster = sector & (s->cluster_sectors - 1);
 		n = s->cluster_sectors - index_in_cluster;
 		if (n > nb_sectors)
 			n = nb_sectors;
 
-		if (s->aio_free_count == 0) {
+		if (s->aio_free_count <= nr) {
+			s->l2_defer = 0;
+			qcow_flush_l2_cache(s);
 			td_complete_request(treq, -EBUSY);
 			return;
 		}
 
-		cluster_offset = get_cluster_offset(s, sector << 9, 1, 0,
-						    index_in_cluster, 
-						    index_in_cluster+n);
-		if (!cluster_offset) {
+		offsets[nr] = get_cluster_offset(s, sector << 9, 1, 0,
+						 index_in_cluster, 
+						 index_in_cluster+n);
+		if (!offsets[nr]) {
 			DPRINTF("Ooops, no write cluster offset!\n");
+			s->l2_defer = 0;
+			qcow_flush_l2_cache(s);
 			td_complete_request(treq, -EIO);
 			return;
 		}
 
+		nb_sectors -= n;
+		sector += n;
+	}
+	s->l2_defer = 0;
+
+	if (qcow_flush_l2_cache(s)) {
+		DPRINTF("ERROR writing L2 tables\n");
+		td_complete_request(treq, -EIO);
+		return;
+	}
+
+	/*Then queue the data*/
+	sector     = treq.sec;
+	nb_sectors = treq.secs;
+
+	for (i = 0; i < nr; i++) {
+		index_in_cluster = sector & (s->cluster_sectors - 1);
+		n = s->cluster_sectors - index_in_cluster;
+		if (n > nb_sectors)
+			n = nb_sectors;
+
+		cluster_offset = offsets[i];
+
 		if (s->crypt_method) {
 			encrypt_sectors(s, sector, s->cluster_data, 
 					(unsigned char *)buf, n, 1,
@@ -1107,6 +1286,15 @@ void tdqcow_queue_write(td_driver_t *driver, td_request_t treq)
 	}
 	s->cluster_cache_offset = -1; /* disable compressed cache */
 
+	/*Requests larger than a batch carry on with the next one*/
+	if (nb_sectors > 0) {
+		clone      = treq;
+		clone.sec  = sector;
+		clone.secs = nb_sectors;
+		clone.buf  = buf;
+		tdqcow_queue_write(driver, clone);
+	}
+
 	return;
 }
 
@@ -1169,7 +1357,7 @@ int tdqcow_close(td_driver_t *driver)
 	free_aio_state(s);
 	free(s->name);
 	free(s->l1_table);
-	free(s->l2_cache);
+	qcow_free_l2_cache(s);
 	free(s->cluster_cache);
 	free(s->cluster_data);
 	close(s->fd);	
@@ -1332,9 +1520,11 @@ static int qcow_make_empty(struct tdqcow_state *s)
 		return -1;
 	}
 
-	memset(s->l2_cache, 0, s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
-	memset(s->l2_cache_offsets, 0, L2_CACHE_SIZE * sizeof(uint64_t));
-	memset(s->l2_cache_counts, 0, L2_CACHE_SIZE * sizeof(uint32_t));
+	memset(s->l2_cache, 0,
+	       (size_t)s->l2_size * s->l2_cache_size * sizeof(uint64_t));
+	memset(s->l2_cache_offsets, 0, s->l2_cache_size * sizeof(uint64_t));
+	memset(s->l2_cache_lru, 0, s->l2_cache_size * sizeof(uint64_t));
+	memset(s->l2_cache_dirty, 0, s->l2_cache_size * sizeof(uint64_t));
 
 	return 0;
 }
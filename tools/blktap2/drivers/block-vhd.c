@@ -109,7 +109,9 @@ unsigned int SPB;
 #endif
 
 /******VHD DEFINES******/
-#define VHD_CACHE_SIZE               32
+#define VHD_CACHE_SIZE               128  /* bitmaps, $TAPDISK_VHD_BITMAPS */
+#define VHD_CACHE_MAX                16384
+#define VHD_READAHEAD                8    /* blocks, $TAPDISK_VHD_READAHEAD */
 
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
 #define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
@@ -197,6 +199,7 @@ struct vhd_bitmap {
 	u32                       blk;
 	u64                       seqno;       /* lru sequence number */
 	vhd_flag_t                status;
+	struct vhd_bitmap        *hnext;       /* s->bm_hash chain */
 
 	char                     *map;         /* map should only be modified
 					        * in finish_bitmap_write */
@@ -229,11 +232,17 @@ struct vhd_state {
 
 	u64                       bm_lru;      /* lru sequence number */
 	u32                       bm_secs;     /* size of bitmap, in sectors */
-	struct vhd_bitmap        *bitmap[VHD_CACHE_SIZE];
+	int                       bm_cache_size;
+	struct vhd_bitmap       **bitmap;
+	struct vhd_bitmap       **bm_hash;     /* cached bitmaps by block */
+	u32                       bm_hash_mask;
+
+	int                       bm_readahead;
+	u32                       bm_ra_blk;   /* block of the last read */
 
 	int                       bm_free_count;
-	struct vhd_bitmap        *bitmap_free[VHD_CACHE_SIZE];
-	struct vhd_bitmap         bitmap_list[VHD_CACHE_SIZE];
+	struct vhd_bitmap       **bitmap_free;
+	struct vhd_bitmap        *bitmap_list;
 
 	int                       vreq_free_count;
 	struct vhd_request       *vreq_free[VHD_REQS_DATA];
@@ -450,35 +459,89 @@ fail:
 	return err;
 }
 
+static int
+vhd_env_int(const char *name, int def, int min, int max)
+{
+	char *env, *end;
+	long val;
+
+	env = getenv(name);
+	if (!env || !*env)
+		return def;
+
+	val = strtol(env, &end, 0);
+	if (*end || val < min || val > max) {
+		EPRINTF("ignoring bad %s '%s'\n", name, env);
+		return def;
+	}
+
+	return val;
+}
+
 static void
 vhd_free_bitmap_cache(struct vhd_state *s)
 {
 	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	for (i = 0; s->bitmap_list && i < s->bm_cache_size; i++) {
 		bm = s->bitmap_list + i;
 		free(bm->map);
 		free(bm->shadow);
-		s->bitmap_free[i] = NULL;
 	}
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	free(s->bitmap_list);
+	free(s->bitmap_free);
+	free(s->bitmap);
+	free(s->bm_hash);
+
+	s->bitmap_list   = NULL;
+	s->bitmap_free   = NULL;
+	s->bitmap        = NULL;
+	s->bm_hash       = NULL;
+	s->bm_cache_size = 0;
+	s->bm_free_count = 0;
 }
 
 static int
 vhd_initialize_bitmap_cache(struct vhd_state *s)
 {
-	int i, err, map_size;
+	int i, err, map_size, size;
 	struct vhd_bitmap *bm;
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	size = vhd_env_int("TAPDISK_VHD_BITMAPS", VHD_CACHE_SIZE,
+			   4, VHD_CACHE_MAX);
+
+	/* no point caching more bitmaps than there are blocks */
+	if (size > s->bat.bat.entries)
+		size = MAX(s->bat.bat.entries, 4);
+
+	s->bm_readahead = vhd_env_int("TAPDISK_VHD_READAHEAD", VHD_READAHEAD,
+				      0, VHD_CACHE_MAX);
+	s->bm_readahead = MIN(s->bm_readahead, size / 4);
+	s->bm_ra_blk    = DD_BLK_UNUSED;
+
+	for (s->bm_hash_mask = 1; s->bm_hash_mask < size; )
+		s->bm_hash_mask <<= 1;
+
+	s->bitmap_list = calloc(size, sizeof(struct vhd_bitmap));
+	s->bitmap_free = calloc(size, sizeof(struct vhd_bitmap *));
+	s->bitmap      = calloc(size, sizeof(struct vhd_bitmap *));
+	s->bm_hash     = calloc(s->bm_hash_mask, sizeof(struct vhd_bitmap *));
+	s->bm_hash_mask--;
 
 	s->bm_lru        = 0;
+	s->bm_cache_size = size;
 	map_size         = vhd_sectors_to_bytes(s->bm_secs);
-	s->bm_free_count = VHD_CACHE_SIZE;
+	s->bm_free_count = size;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	if (!s->bitmap_list || !s->bitmap_free ||
+	    !s->bitmap || !s->bm_hash) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	for (i = 0; i < size; i++) {
 		bm = s->bitmap_list + i;
 
 		err = posix_memalign((void **)&bm->map, 512, map_size);
@@ -664,6 +727,8 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 		s->writes++;
 	}
 
+	td_register_fd(s->vhd.fd);
+
         return 0;
 
  fail:
@@ -760,6 +825,7 @@ _vhd_close(td_driver_t *driver)
 	vhd_log_close(s);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
+	td_unregister_fd(s->vhd.fd);
 	vhd_close(&s->vhd);
 	vhd_free(s);
 
@@ -968,21 +1034,38 @@ init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 	init_vhd_request(s, &bm->req);
 }
 
+static inline struct vhd_bitmap **
+bitmap_hash_chain(struct vhd_state *s, uint32_t block)
+{
+	return &s->bm_hash[(block * 0x9e3779b1U >> 8) & s->bm_hash_mask];
+}
+
 static inline struct vhd_bitmap *
 get_bitmap(struct vhd_state *s, uint32_t block)
 {
-	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->blk == block)
+	for (bm = *bitmap_hash_chain(s, block); bm; bm = bm->hnext)
+		if (bm->blk == block)
 			return bm;
-	}
 
 	return NULL;
 }
 
+static inline void
+unhash_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_bitmap **pp;
+
+	for (pp = bitmap_hash_chain(s, bm->blk); *pp; pp = &(*pp)->hnext)
+		if (*pp == bm) {
+			*pp = bm->hnext;
+			break;
+		}
+
+	bm->hnext = NULL;
+}
+
 static inline void
 lock_bitmap(struct vhd_bitmap *bm)
 {
@@ -1037,7 +1120,7 @@ remove_lru_bitmap(struct vhd_state *s)
 	u64 seq = s->bm_lru;
 	struct vhd_bitmap *bm, *lru = NULL;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	for (i = 0; i < s->bm_cache_size; i++) {
 		bm = s->bitmap[i];
 		if (bm && bm->seqno < seq && !bitmap_locked(bm)) {
 			idx = i;
@@ -1048,6 +1131,7 @@ remove_lru_bitmap(struct vhd_state *s)
 
 	if (lru) {
 		s->bitmap[idx] = NULL;
+		unhash_bitmap(s, lru);
 		ASSERT(!bitmap_in_use(lru));
 	}
 
@@ -1084,7 +1168,7 @@ __bitmap_lru_seqno(struct vhd_state *s)
 
 	if (s->bm_lru == 0xffffffff) {
 		s->bm_lru = 0;
-		for (i = 0; i < VHD_CACHE_SIZE; i++) {
+		for (i = 0; i < s->bm_cache_size; i++) {
 			bm = s->bitmap[i];
 			if (bm) {
 				bm->seqno >>= 1;
@@ -1107,10 +1191,15 @@ static inline void
 install_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	int i;
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	struct vhd_bitmap **chain;
+
+	for (i = 0; i < s->bm_cache_size; i++) {
 		if (!s->bitmap[i]) {
 			touch_bitmap(s, bm);
 			s->bitmap[i] = bm;
+			chain        = bitmap_hash_chain(s, bm->blk);
+			bm->hnext    = *chain;
+			*chain       = bm;
 			return;
 		}
 	}
@@ -1123,15 +1212,16 @@ free_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	int i;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++)
+	for (i = 0; i < s->bm_cache_size; i++)
 		if (s->bitmap[i] == bm)
 			break;
 
 	ASSERT(!bitmap_locked(bm));
 	ASSERT(!bitmap_in_use(bm));
-	ASSERT(i < VHD_CACHE_SIZE);
+	ASSERT(i < s->bm_cache_size);
 
 	s->bitmap[i] = NULL;
+	unhash_bitmap(s, bm);
 	s->bitmap_free[s->bm_free_count++] = bm;
 }
 
@@ -1670,6 +1760,44 @@ __vhd_queue_request(struct vhd_state *s, uint8_t op, td_request_t treq)
 	return 0;
 }
 
+/*
+ * when reads move on sequentially to the next block, read the bitmaps
+ * of the blocks ahead too, rather than one at a time in front of each
+ * data read.
+ */
+static void
+vhd_readahead_bitmaps(struct vhd_state *s, uint64_t sector)
+{
+	int i;
+	u32 blk, ra;
+
+	if (!s->bm_readahead || !vhd_type_dynamic(&s->vhd) || !s->bitmap)
+		return;
+
+	blk = sector / s->spb;
+	if (blk == s->bm_ra_blk)
+		return;
+
+	ra = s->bm_ra_blk;
+	s->bm_ra_blk = blk;
+	if (blk != ra + 1)
+		return;
+
+	for (i = 1; i <= s->bm_readahead; i++) {
+		ra = blk + i;
+
+		if (ra >= s->bat.bat.entries)
+			break;
+
+		if (bat_entry(s, ra) == DD_BLK_UNUSED || test_batmap(s, ra) ||
+		    get_bitmap(s, ra))
+			continue;
+
+		if (schedule_bitmap_read(s, ra))
+			break;
+	}
+}
+
 static void
 vhd_queue_read(td_driver_t *driver, td_request_t treq)
 {
@@ -1678,6 +1806,8 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x (seg: %d)\n",
 	    s->vhd.file, treq.sec, treq.secs, treq.sidx);
 
+	vhd_readahead_bitmaps(s, treq.sec);
+
 	while (treq.secs) {
 		int err;
 		td_request_t clone;
@@ -2261,8 +2391,9 @@ vhd_debug(td_driver_t *driver)
 			    t->sec, r->flags, r, r->next, r->tx);
 	}
 
-	DBG(TLOG_WARN, "BITMAP CACHE:\n");
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	DBG(TLOG_WARN, "BITMAP CACHE: (%d entries, readahead %d)\n",
+	    s->bm_cache_size, s->bm_readahead);
+	for (i = 0; i < s->bm_cache_size; i++) {
 		int qnum = 0, wnum = 0, rnum = 0;
 		struct vhd_bitmap *bm = s->bitmap[i];
 		struct vhd_transaction *tx;
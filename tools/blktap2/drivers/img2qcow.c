@@ -291,12 +291,12 @@ int main(int argc, const char *argv[])
 			if (i == info.size) 
 			  complete = 1;
 
-                        tapdisk_submit_all_tiocbs(&server.aio_queue);
+                        tapdisk_submit_all_tiocbs(&server.loop[0].aio_queue);
 			debug_output(i,info.size);
                 }
 		
 		while(returned_events != submit_events) {
-		    ret = scheduler_wait_for_events(&server.scheduler);
+		    ret = scheduler_wait_for_events(&server.loop[0].scheduler);
 		    if (ret < 0) {
 		      DFPRINTF("server wait returned %d\n", ret);
 		      sleep(2);
@@ -188,4 +188,98 @@ __tp_log(struct profile_info *prof, u64 id, const char *func, int direction)
 #define tp_log(prof, sec, direction)       ((void)0)
 #endif
 
+/*
+ * Latency histograms, for tracing how long requests spend in each stage
+ * of the request path. Unlike the profiling above they are always built
+ * in: callers pass a start time of 0, and skip the clock, when tracing
+ * is off. Buckets are in nanoseconds, 4 to each power of 2, so that a
+ * percentile read back is no more than 25% above the real one.
+ */
+#define TAPPROF_LAT_SHIFT    2
+#define TAPPROF_LAT_BUCKETS  (38 << TAPPROF_LAT_SHIFT)
+
+struct profile_latency {
+	uint64_t              cnt;
+	uint64_t              sum;
+	uint64_t              max;
+	uint64_t              hist[TAPPROF_LAT_BUCKETS];
+};
+
+static inline uint64_t
+tp_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline int
+tp_lat_bucket(uint64_t ns)
+{
+	int msb, b;
+
+	if (ns < (1 << TAPPROF_LAT_SHIFT))
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	b   = ((msb - TAPPROF_LAT_SHIFT + 1) << TAPPROF_LAT_SHIFT) +
+		((ns >> (msb - TAPPROF_LAT_SHIFT)) &
+		 ((1 << TAPPROF_LAT_SHIFT) - 1));
+
+	return (b < TAPPROF_LAT_BUCKETS ? b : TAPPROF_LAT_BUCKETS - 1);
+}
+
+/* the first value past bucket b */
+static inline uint64_t
+tp_lat_bucket_limit(int b)
+{
+	int octave = b >> TAPPROF_LAT_SHIFT;
+	uint64_t sub = b & ((1 << TAPPROF_LAT_SHIFT) - 1);
+
+	if (!octave)
+		return b + 1;
+
+	return ((1ULL << TAPPROF_LAT_SHIFT) + sub + 1) << (octave - 1);
+}
+
+static inline void
+tp_lat_add(struct profile_latency *lat, uint64_t start, uint64_t end)
+{
+	uint64_t ns;
+
+	if (!start || end < start)
+		return;
+
+	ns = end - start;
+	lat->cnt++;
+	lat->sum += ns;
+	if (ns > lat->max)
+		lat->max = ns;
+	lat->hist[tp_lat_bucket(ns)]++;
+}
+
+/* an upper bound on the pct'th percentile, in nanoseconds */
+static inline uint64_t
+tp_lat_percentile(const struct profile_latency *lat, int pct)
+{
+	uint64_t want, seen;
+	int b;
+
+	if (!lat->cnt)
+		return 0;
+
+	want = (lat->cnt * pct + 99) / 100;
+	for (b = 0, seen = 0; b < TAPPROF_LAT_BUCKETS; b++) {
+		seen += lat->hist[b];
+		if (seen >= want)
+			break;
+	}
+
+	if (b == TAPPROF_LAT_BUCKETS - 1 || tp_lat_bucket_limit(b) > lat->max)
+		return lat->max;
+
+	return tp_lat_bucket_limit(b);
+}
+
 #endif
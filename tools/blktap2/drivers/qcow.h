@@ -79,7 +79,9 @@ uint32_t gen_cksum(char *ptr, int len);
 int get_filesize(char *filename, uint64_t *size, struct stat *st);
 int qtruncate(int fd, off_t length, int sparse);
 
-#define L2_CACHE_SIZE 16  /*Fixed allocation in Qemu*/
+#define L2_CACHE_SIZE 16  /*Fixed allocation in Qemu, now the minimum*/
+#define L2_CACHE_BUDGET (1 << 20) /*Default bytes, $TAPDISK_QCOW_L2_CACHE*/
+#define QCOW_PREALLOC_MAX (4 << 20) /*Largest run extended at once*/
 
 struct tdqcow_state {
         int fd;                        /*Main Qcow file descriptor */
@@ -104,10 +106,17 @@ struct tdqcow_state {
 	uint64_t l1_table_offset;      /*L1 table offset from beginning of 
 					*file*/
 	uint64_t *l1_table;            /*L1 table entries*/
-	uint64_t *l2_cache;            /*We maintain a cache of size 
-					*L2_CACHE_SIZE of most read entries*/
-	uint64_t l2_cache_offsets[L2_CACHE_SIZE];     /*L2 cache entries*/
-	uint32_t l2_cache_counts[L2_CACHE_SIZE];      /*Cache access record*/
+	uint64_t *l2_cache;            /*We maintain a cache of 
+					*l2_cache_size recently used tables*/
+	int l2_cache_size;             /*Tables, sized by memory budget*/
+	uint64_t *l2_cache_offsets;    /*L2 cache entries*/
+	uint64_t *l2_cache_lru;        /*Last use of each entry*/
+	uint64_t *l2_cache_dirty;      /*4k sectors not yet written back*/
+	uint64_t l2_cache_seq;         /*LRU clock*/
+	int l2_defer;                  /*Batch L2 writes of one request*/
+	uint64_t prealloc_end;         /*File is zero filled up to here*/
+	uint64_t last_alloc;           /*Guest cluster last allocated*/
+	int prealloc_run;              /*Clusters to extend the file by*/
 	uint8_t *cluster_cache;          
 	uint8_t *cluster_data;
 	uint64_t cluster_cache_offset; /**/
@@ -191,7 +191,7 @@ static void send_read_responses(td_request_t treq, int err)
         ddaio->ops->td_queue_write(ddaio,treq);
         --vreq->submitting;
 
-        tapdisk_submit_all_tiocbs(&server.aio_queue);
+        tapdisk_submit_all_tiocbs(&server.loop[0].aio_queue);
 
 	return;
 }
@@ -417,12 +417,12 @@ int main(int argc, const char *argv[])
 			  complete = 1;
 
 			
-			tapdisk_submit_all_tiocbs(&server.aio_queue);
+			tapdisk_submit_all_tiocbs(&server.loop[0].aio_queue);
 		}
 		
 
 		while(returned_write_events != submit_events) {
-		  ret = scheduler_wait_for_events(&server.scheduler);
+		  ret = scheduler_wait_for_events(&server.loop[0].scheduler);
 		  if (ret < 0) {
 		    DFPRINTF("server wait returned %d\n", ret);
 		    sleep(2);
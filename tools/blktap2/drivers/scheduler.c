@@ -221,6 +221,14 @@ scheduler_set_max_timeout(scheduler_t *s, int timeout)
 		s->max_timeout = MIN(s->max_timeout, timeout);
 }
 
+void
+scheduler_set_max_timeout_us(scheduler_t *s, int usecs)
+{
+	if (usecs >= 0 &&
+	    (s->max_timeout_us < 0 || usecs < s->max_timeout_us))
+		s->max_timeout_us = usecs;
+}
+
 int
 scheduler_wait_for_events(scheduler_t *s)
 {
@@ -232,15 +240,22 @@ scheduler_wait_for_events(scheduler_t *s)
 	tv.tv_sec  = s->timeout;
 	tv.tv_usec = 0;
 
+	if (s->max_timeout_us >= 0 &&
+	    s->max_timeout_us < (long long)s->timeout * 1000000) {
+		tv.tv_sec  = s->max_timeout_us / 1000000;
+		tv.tv_usec = s->max_timeout_us % 1000000;
+	}
+
 	DBG("timeout: %d, max_timeout: %d\n",
 	    s->timeout, s->max_timeout);
 
 	ret = select(s->max_fd + 1, &s->read_fds,
 		     &s->write_fds, &s->except_fds, &tv);
 
-	s->restart     = 0;
-	s->timeout     = SCHEDULER_MAX_TIMEOUT;
-	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
+	s->restart        = 0;
+	s->timeout        = SCHEDULER_MAX_TIMEOUT;
+	s->max_timeout    = SCHEDULER_MAX_TIMEOUT;
+	s->max_timeout_us = -1;
 
 	if (ret < 0)
 		return ret;
@@ -255,7 +270,8 @@ scheduler_initialize(scheduler_t *s)
 {
 	memset(s, 0, sizeof(scheduler_t));
 
-	s->uuid = 1;
+	s->uuid           = 1;
+	s->max_timeout_us = -1;
 
 	FD_ZERO(&s->read_fds);
 	FD_ZERO(&s->write_fds);
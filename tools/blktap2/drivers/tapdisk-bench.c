@@ -0,0 +1,720 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * tapdisk-bench: drive an image through tapdisk's request path, as a
+ * guest would through the ring, with a synthetic workload, and report
+ * throughput and latency. With -T, the time requests spend in each
+ * stage of the path is traced as well.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include "list.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-queue.h"
+#include "tapdisk-server.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-utils.h"
+
+#define POLL_READ                        0
+#define POLL_WRITE                       1
+
+#define MIN(a, b)                        ((a) < (b) ? (a) : (b))
+
+struct tapdisk_bench_poll {
+	int                              pipe[2];
+	int                              set;
+};
+
+struct tapdisk_bench_request {
+	uint64_t                         start;
+	blkif_request_t                  blkif_req;
+	struct list_head                 next;
+};
+
+struct tapdisk_bench_pattern {
+	const char                      *name;
+	int                              random;
+	int                              reads;  /* percent, -1 for -M */
+};
+
+static const struct tapdisk_bench_pattern tapdisk_bench_patterns[] = {
+	{ "read",      0, 100 },
+	{ "write",     0,   0 },
+	{ "rw",        0,  -1 },
+	{ "randread",  1, 100 },
+	{ "randwrite", 1,   0 },
+	{ "randrw",    1,  -1 },
+	{ NULL,        0,   0 },
+};
+
+struct tapdisk_bench {
+	td_vbd_t                        *vbd;
+	unsigned int                     id;
+	int                              err;
+
+	/* the workload */
+	const struct tapdisk_bench_pattern *pattern;
+	int                              reads;
+	uint32_t                         secs;
+	int                              depth;
+	uint64_t                         start_sec;
+	uint64_t                         blocks;
+	uint64_t                         limit;
+	uint64_t                         duration;
+	uint64_t                         seed;
+
+	uint64_t                         cur;
+	int                              pending;
+	int                              stopping;
+
+	/* the results */
+	uint64_t                         begin;
+	uint64_t                         end;
+	uint64_t                         started;
+	uint64_t                         completed;
+	uint64_t                         errors;
+	uint64_t                         read;
+	uint64_t                         written;
+	struct profile_latency           latency;
+
+	struct tapdisk_bench_poll        poll;
+	event_id_t                       enqueue_event_id;
+
+	struct list_head                 free_list;
+	struct tapdisk_bench_request     requests[MAX_REQUESTS];
+};
+
+static void tapdisk_bench_close_image(struct tapdisk_bench *);
+
+static void
+usage(const char *app, int err)
+{
+	printf("usage: %s <-n type:/path/to/image> [-p pattern] [-b block size] "
+	       "[-q depth]\n"
+	       "\t[-t seconds] [-c count] [-M read percent] [-o offset] "
+	       "[-s size]\n"
+	       "\t[-S seed] [-a lio|rwio|uring|uring-poll] [-T] [-C]\n", app);
+	printf("  -p read, write, rw, randread, randwrite or randrw "
+	       "(default read)\n"
+	       "  -b bytes per request, a multiple of 512 (default 4096)\n"
+	       "  -q requests in flight, up to %d (default 32)\n"
+	       "  -t stop after that long (default 10, 0 for no limit), "
+	       "-c after that many\n     requests\n"
+	       "  -M reads in a rw or randrw mix, in percent (default 50)\n"
+	       "  -o, -s the sectors to use (default the whole image)\n"
+	       "  -T trace the latency of each stage of the request path\n"
+	       "  -C print a line of comma separated values\n"
+	       "the write patterns overwrite the image.\n", (int)MAX_REQUESTS);
+	exit(err);
+}
+
+static inline void
+tapdisk_bench_poll_initialize(struct tapdisk_bench_poll *p)
+{
+	p->set = 0;
+	p->pipe[POLL_READ] = p->pipe[POLL_WRITE] = -1;
+}
+
+static int
+tapdisk_bench_poll_open(struct tapdisk_bench_poll *p)
+{
+	int err;
+
+	tapdisk_bench_poll_initialize(p);
+
+	err = pipe(p->pipe);
+	if (err)
+		return -errno;
+
+	err = fcntl(p->pipe[POLL_READ], F_SETFL, O_NONBLOCK);
+	if (err)
+		goto out;
+
+	err = fcntl(p->pipe[POLL_WRITE], F_SETFL, O_NONBLOCK);
+	if (err)
+		goto out;
+
+	return 0;
+
+out:
+	close(p->pipe[POLL_READ]);
+	close(p->pipe[POLL_WRITE]);
+	tapdisk_bench_poll_initialize(p);
+	return -errno;
+}
+
+static void
+tapdisk_bench_poll_close(struct tapdisk_bench_poll *p)
+{
+	if (p->pipe[POLL_READ] != -1)
+		close(p->pipe[POLL_READ]);
+	if (p->pipe[POLL_WRITE] != -1)
+		close(p->pipe[POLL_WRITE]);
+	tapdisk_bench_poll_initialize(p);
+}
+
+static inline void
+tapdisk_bench_poll_clear(struct tapdisk_bench_poll *p)
+{
+	int dummy;
+
+	read_exact(p->pipe[POLL_READ], &dummy, sizeof(dummy));
+	p->set = 0;
+}
+
+static inline void
+tapdisk_bench_poll_set(struct tapdisk_bench_poll *p)
+{
+	int dummy = 0;
+
+	if (!p->set) {
+		write_exact(p->pipe[POLL_WRITE], &dummy, sizeof(dummy));
+		p->set = 1;
+	}
+}
+
+/* xorshift64*: cheap, and the same run for the same -S */
+static inline uint64_t
+tapdisk_bench_random(struct tapdisk_bench *b)
+{
+	b->seed ^= b->seed >> 12;
+	b->seed ^= b->seed << 25;
+	b->seed ^= b->seed >> 27;
+	return b->seed * 2685821657736338717ULL;
+}
+
+static inline int
+tapdisk_bench_done(struct tapdisk_bench *b, uint64_t now)
+{
+	if (b->err || b->stopping)
+		return 1;
+	if (b->limit && b->started >= b->limit)
+		return 1;
+	return (now - b->begin >= b->duration);
+}
+
+static uint64_t
+tapdisk_bench_next_sector(struct tapdisk_bench *b)
+{
+	uint64_t block;
+
+	if (b->pattern->random)
+		block = tapdisk_bench_random(b) % b->blocks;
+	else {
+		block = b->cur++;
+		if (b->cur == b->blocks)
+			b->cur = 0;
+	}
+
+	return b->start_sec + block * b->secs;
+}
+
+static void
+tapdisk_bench_dequeue(void *arg, blkif_response_t *rsp)
+{
+	struct tapdisk_bench *b = (struct tapdisk_bench *)arg;
+	struct tapdisk_bench_request *breq = b->requests + rsp->id;
+	uint64_t bytes = (uint64_t)b->secs << SECTOR_SHIFT;
+
+	tp_lat_add(&b->latency, breq->start, tp_now_ns());
+
+	b->completed++;
+	b->pending--;
+
+	if (rsp->status != BLKIF_RSP_OKAY)
+		b->errors++;
+	else if (rsp->operation == BLKIF_OP_READ)
+		b->read += bytes;
+	else
+		b->written += bytes;
+
+	list_add_tail(&breq->next, &b->free_list);
+	tapdisk_bench_poll_set(&b->poll);
+}
+
+static void
+tapdisk_bench_enqueue(event_id_t id, char mode, void *arg)
+{
+	td_vbd_t *vbd;
+	uint64_t now;
+	int i, idx, psize;
+	struct tapdisk_bench *b = (struct tapdisk_bench *)arg;
+
+	vbd = b->vbd;
+	tapdisk_bench_poll_clear(&b->poll);
+
+	now   = tp_now_ns();
+	psize = getpagesize();
+
+	if (tapdisk_bench_done(b, now)) {
+		if (!b->end)
+			b->end = now;
+		if (!b->pending)
+			tapdisk_bench_close_image(b);
+		return;
+	}
+
+	while (b->pending < b->depth && !tapdisk_bench_done(b, now)) {
+		blkif_request_t *req;
+		td_vbd_request_t *vreq;
+		struct tapdisk_bench_request *breq;
+		uint32_t left;
+
+		breq = list_entry(b->free_list.next,
+				  struct tapdisk_bench_request, next);
+		list_del_init(&breq->next);
+
+		idx                = breq - b->requests;
+		breq->start        = now;
+
+		req                = &breq->blkif_req;
+		req->id            = idx;
+		req->nr_segments   = 0;
+		req->sector_number = tapdisk_bench_next_sector(b);
+		req->operation     = ((int)(tapdisk_bench_random(b) % 100) <
+				      b->reads ? BLKIF_OP_READ :
+				      BLKIF_OP_WRITE);
+
+		for (i = 0, left = b->secs; left; i++) {
+			uint32_t secs = MIN(left, psize >> SECTOR_SHIFT);
+			struct blkif_request_segment *seg = req->seg + i;
+
+			seg->first_sect = 0;
+			seg->last_sect  = secs - 1;
+			req->nr_segments++;
+			left -= secs;
+		}
+
+		vreq = vbd->request_list + idx;
+
+		assert(list_empty(&vreq->next));
+		assert(vreq->secs_pending == 0);
+
+		memcpy(&vreq->req, req, sizeof(*req));
+		vbd->received++;
+		vreq->vbd = vbd;
+		tapdisk_vbd_trace_receive(vbd, vreq);
+
+		tapdisk_vbd_move_request(vreq, &vbd->new_requests);
+		b->started++;
+		b->pending++;
+	}
+
+	tapdisk_vbd_issue_requests(vbd);
+}
+
+static int
+tapdisk_bench_open_image(struct tapdisk_bench *b, const char *path,
+			 int type, const char *queue, int trace)
+{
+	int err, drv;
+	td_flag_t flags;
+
+	err = tapdisk_server_init();
+	if (err)
+		goto out;
+
+	if (queue) {
+		drv = tapdisk_queue_driver(queue);
+		if (drv < 0) {
+			fprintf(stderr, "unknown I/O queue '%s'\n", queue);
+			err = -EINVAL;
+			goto out;
+		}
+		tapdisk_server_set_queue_driver(drv);
+	}
+	tapdisk_server_set_trace(trace);
+
+	err = tapdisk_server_complete();
+	if (err)
+		goto out;
+
+	err = tapdisk_vbd_initialize(b->id);
+	if (err)
+		goto out;
+
+	b->vbd = tapdisk_server_get_vbd(b->id);
+	if (!b->vbd) {
+		err = ENODEV;
+		goto out;
+	}
+
+	tapdisk_vbd_set_callback(b->vbd, tapdisk_bench_dequeue, b);
+
+	flags = (b->reads == 100 ? TD_OPEN_RDONLY : 0);
+	err = tapdisk_vbd_open_vdi(b->vbd, path, type,
+				   TAPDISK_STORAGE_TYPE_DEFAULT, flags);
+	if (err)
+		goto out;
+
+	b->vbd->reopened = 1;
+	err = 0;
+
+out:
+	if (err)
+		fprintf(stderr, "failed to open %s: %d\n", path, err);
+	return err;
+}
+
+/* the vbd only goes at the end, for its latencies to be reported */
+static void
+tapdisk_bench_close_image(struct tapdisk_bench *b)
+{
+	b->stopping = 1;
+	tapdisk_vbd_close_vdi(b->vbd);
+	tapdisk_server_remove_vbd(b->vbd);
+}
+
+static void
+tapdisk_bench_free_image(struct tapdisk_bench *b)
+{
+	td_vbd_t *vbd = b->vbd;
+
+	if (vbd) {
+		if (!b->stopping) {
+			tapdisk_vbd_close_vdi(vbd);
+			tapdisk_server_remove_vbd(vbd);
+		}
+		free((void *)vbd->ring.vstart);
+		free(vbd->name);
+		free(vbd);
+		b->vbd = NULL;
+	}
+}
+
+static int
+tapdisk_bench_set_range(struct tapdisk_bench *b,
+			uint64_t offset, uint64_t size)
+{
+	int err;
+	image_t image;
+
+	err = tapdisk_vbd_get_image_info(b->vbd, &image);
+	if (err) {
+		fprintf(stderr, "failed getting image size: %d\n", err);
+		return err;
+	}
+
+	if (size == (uint64_t)-1)
+		size = (offset < image.size ? image.size - offset : 0);
+
+	if (offset + size > image.size) {
+		fprintf(stderr, "0x%"PRIx64" past end of image 0x%"PRIx64"\n",
+			(uint64_t) (offset + size), (uint64_t) image.size);
+		return -EINVAL;
+	}
+
+	b->start_sec = offset;
+	b->blocks    = size / b->secs;
+	if (!b->blocks) {
+		fprintf(stderr, "no room for a block of %u sectors\n",
+			b->secs);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int
+tapdisk_bench_initialize_requests(struct tapdisk_bench *b)
+{
+	size_t size;
+	td_ring_t *ring;
+	int err, i, psize;
+
+	ring  = &b->vbd->ring;
+	psize = getpagesize();
+	size  = psize * BLKTAP_MMAP_REGION_SIZE;
+
+	/* as tapdisk-stream does, have tapdisk_vbd use our buffers */
+	err = posix_memalign((void **)&ring->vstart, psize, size);
+	if (err) {
+		fprintf(stderr, "failed to allocate buffers: %d\n", err);
+		ring->vstart = 0;
+		return err;
+	}
+
+	/* what gets written, should the workload write */
+	memset((void *)ring->vstart, 0x5a, size);
+
+	for (i = 0; i < MAX_REQUESTS; i++) {
+		struct tapdisk_bench_request *req = b->requests + i;
+		memset(req, 0, sizeof(*req));
+		list_add_tail(&req->next, &b->free_list);
+	}
+
+	return 0;
+}
+
+static int
+tapdisk_bench_register_enqueue_event(struct tapdisk_bench *b)
+{
+	int err;
+	struct tapdisk_bench_poll *p = &b->poll;
+
+	err = tapdisk_bench_poll_open(p);
+	if (err)
+		goto out;
+
+	err = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					    p->pipe[POLL_READ], 0,
+					    tapdisk_bench_enqueue, b);
+	if (err < 0)
+		goto out;
+
+	b->enqueue_event_id = err;
+	err = 0;
+
+out:
+	if (err)
+		fprintf(stderr, "failed to register event: %d\n", err);
+	return err;
+}
+
+static void
+tapdisk_bench_unregister_enqueue_event(struct tapdisk_bench *b)
+{
+	if (b->enqueue_event_id) {
+		tapdisk_server_unregister_event(b->enqueue_event_id);
+		b->enqueue_event_id = 0;
+	}
+	tapdisk_bench_poll_close(&b->poll);
+}
+
+static void
+tapdisk_bench_print_latency(const char *stage,
+			    const struct profile_latency *lat)
+{
+	if (!lat->cnt)
+		return;
+
+	printf("  %-9s avg %9.1fus  p50 %9.1fus  p99 %9.1fus  "
+	       "max %9.1fus\n", stage, lat->sum / 1e3 / lat->cnt,
+	       tp_lat_percentile(lat, 50) / 1e3,
+	       tp_lat_percentile(lat, 99) / 1e3, lat->max / 1e3);
+}
+
+static void
+tapdisk_bench_report(struct tapdisk_bench *b, int csv)
+{
+	double secs, iops, mibs;
+	struct tqueue *queue;
+
+	/* interrupted, rather than done */
+	if (!b->end)
+		b->end = tp_now_ns();
+
+	secs = (b->end - b->begin) / 1e9;
+	iops = (secs ? b->completed / secs : 0);
+	mibs = (secs ? (b->read + b->written) / secs / (1 << 20) : 0);
+
+	if (csv) {
+		printf("%s,%u,%d,%"PRIu64",%"PRIu64",%.3f,%.0f,%.1f,"
+		       "%.1f,%.1f,%.1f,%.1f\n", b->pattern->name,
+		       b->secs << SECTOR_SHIFT, b->depth, b->completed,
+		       b->errors, secs, iops, mibs,
+		       (b->latency.cnt ?
+			b->latency.sum / 1e3 / b->latency.cnt : 0),
+		       tp_lat_percentile(&b->latency, 50) / 1e3,
+		       tp_lat_percentile(&b->latency, 99) / 1e3,
+		       b->latency.max / 1e3);
+		return;
+	}
+
+	printf("%s, %u bytes, depth %d: %"PRIu64" requests, %"PRIu64
+	       " errors in %.2fs\n", b->pattern->name,
+	       b->secs << SECTOR_SHIFT, b->depth, b->completed, b->errors,
+	       secs);
+	printf("  %.0f iops, %.1f MiB/s (read %.1f, written %.1f MiB)\n",
+	       iops, mibs, b->read / (double)(1 << 20),
+	       b->written / (double)(1 << 20));
+	tapdisk_bench_print_latency("latency", &b->latency);
+
+	if (!b->vbd->trace)
+		return;
+
+	queue = &server.loop[0].aio_queue;
+	printf("stages:\n");
+	tapdisk_bench_print_latency("ring",
+				    &b->vbd->latency[TD_VBD_TRACE_RING]);
+	tapdisk_bench_print_latency("queue", &queue->lat_queue);
+	tapdisk_bench_print_latency("aio", &queue->lat_aio);
+	tapdisk_bench_print_latency("driver",
+				    &b->vbd->latency[TD_VBD_TRACE_DRIVER]);
+	tapdisk_bench_print_latency("response",
+				    &b->vbd->latency[TD_VBD_TRACE_RESPONSE]);
+	tapdisk_bench_print_latency("total",
+				    &b->vbd->latency[TD_VBD_TRACE_TOTAL]);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int c, err, type, trace, csv, i;
+	const char *params, *path, *pattern, *queue;
+	uint64_t offset, size, bytes;
+	struct tapdisk_bench bench;
+	struct tapdisk_bench *b = &bench;
+
+	memset(b, 0, sizeof(*b));
+	INIT_LIST_HEAD(&b->free_list);
+
+	err      = 0;
+	trace    = 0;
+	csv      = 0;
+	params   = NULL;
+	pattern  = "read";
+	queue    = NULL;
+	offset   = 0;
+	size     = (uint64_t)-1;
+	bytes    = 4096;
+	b->depth = 32;
+	b->reads = 50;
+	b->seed  = 1;
+	b->duration = 10;
+
+	while ((c = getopt(argc, argv, "n:p:b:q:t:c:M:o:s:S:a:TCh")) != -1) {
+		switch (c) {
+		case 'n':
+			params = optarg;
+			break;
+		case 'p':
+			pattern = optarg;
+			break;
+		case 'b':
+			bytes = strtoull(optarg, NULL, 0);
+			break;
+		case 'q':
+			b->depth = atoi(optarg);
+			break;
+		case 't':
+			b->duration = strtoull(optarg, NULL, 0);
+			break;
+		case 'c':
+			b->limit = strtoull(optarg, NULL, 0);
+			break;
+		case 'M':
+			b->reads = atoi(optarg);
+			break;
+		case 'o':
+			offset = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			size = strtoull(optarg, NULL, 0);
+			break;
+		case 'S':
+			b->seed = strtoull(optarg, NULL, 0) ? : 1;
+			break;
+		case 'a':
+			queue = optarg;
+			break;
+		case 'T':
+			trace = 1;
+			break;
+		case 'C':
+			csv = 1;
+			break;
+		default:
+			err = EINVAL;
+		case 'h':
+			usage(argv[0], err);
+		}
+	}
+
+	if (!params || optind != argc)
+		usage(argv[0], EINVAL);
+
+	for (i = 0; tapdisk_bench_patterns[i].name; i++)
+		if (!strcmp(tapdisk_bench_patterns[i].name, pattern))
+			b->pattern = &tapdisk_bench_patterns[i];
+	if (!b->pattern) {
+		fprintf(stderr, "unknown pattern '%s'\n", pattern);
+		usage(argv[0], EINVAL);
+	}
+	if (b->pattern->reads >= 0)
+		b->reads = b->pattern->reads;
+
+	if (!bytes || bytes & ((1 << SECTOR_SHIFT) - 1) ||
+	    bytes > BLKIF_MAX_SEGMENTS_PER_REQUEST * getpagesize() ||
+	    b->depth < 1 || b->depth > MAX_REQUESTS ||
+	    b->reads < 0 || b->reads > 100)
+		usage(argv[0], EINVAL);
+	b->secs     = bytes >> SECTOR_SHIFT;
+	b->duration = (b->duration ? b->duration * 1000000000ULL :
+		       (uint64_t)-1);
+
+	type = tapdisk_disktype_parse_params(params, &path);
+	if (type < 0) {
+		err = type;
+		fprintf(stderr, "invalid argument %s: %d\n", params, err);
+		return err;
+	}
+
+	tapdisk_start_logging("tapdisk-bench");
+
+	err = tapdisk_bench_open_image(b, path, type, queue, trace);
+	if (err)
+		goto out;
+
+	err = tapdisk_bench_set_range(b, offset, size);
+	if (err)
+		goto out;
+
+	err = tapdisk_bench_initialize_requests(b);
+	if (err)
+		goto out;
+
+	err = tapdisk_bench_register_enqueue_event(b);
+	if (err)
+		goto out;
+
+	b->begin = tp_now_ns();
+	tapdisk_bench_enqueue(b->enqueue_event_id, SCHEDULER_POLL_READ_FD, b);
+	err = tapdisk_server_run();
+	if (err)
+		goto out;
+
+	tapdisk_bench_report(b, csv);
+	err = (b->errors ? EIO : 0);
+
+out:
+	tapdisk_bench_unregister_enqueue_event(b);
+	tapdisk_bench_free_image(b);
+	tapdisk_stop_logging();
+	return err;
+}
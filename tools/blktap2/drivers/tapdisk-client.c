@@ -330,20 +330,20 @@ static int writelog_enqueue_requests(struct writelog* wl)
 
 static int writelog_dequeue_responses(struct writelog* wl)
 {
-  RING_IDX rstart, rend;
-  log_response_t rsp;
+  log_response_t rsps[32];
+  RING_IDX i, n;
 
-  rstart = wl->fring.rsp_cons;
-  rend = wl->sring->rsp_prod;
+  BDPRINTF("ring kicked (start = %u, end = %u)", wl->fring.rsp_cons,
+	   wl->sring->rsp_prod);
 
-  BDPRINTF("ring kicked (start = %u, end = %u)", rstart, rend);
+  do {
+    RING_COPY_RESPONSES(&wl->fring, rsps, 32, n);
 
-  while (rstart != rend) {
-    memcpy(&rsp, RING_GET_RESPONSE(&wl->fring, rstart), sizeof(rsp));
-    BDPRINTF("ctl: read response %"PRIu64":%u", rsp.sector, rsp.count);
-    wl->fring.rsp_cons = ++rstart;
-    wl->inflight--;
-  }
+    for (i = 0; i < n; i++)
+      BDPRINTF("ctl: read response %"PRIu64":%u", rsps[i].sector,
+	       rsps[i].count);
+    wl->inflight -= n;
+  } while (n);
 
   return 0;
 }
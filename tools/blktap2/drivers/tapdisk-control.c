@@ -231,6 +231,7 @@ tapdisk_control_list_minors(struct tapdisk_control_connection *connection,
 
 	head = tapdisk_server_get_all_vbds();
 
+	tapdisk_server_lock_vbds();
 	list_for_each_entry(vbd, head, next) {
 		response.u.minors.list[i++] = vbd->minor;
 		if (i >= TAPDISK_MESSAGE_MAX_MINORS) {
@@ -239,6 +240,7 @@ tapdisk_control_list_minors(struct tapdisk_control_connection *connection,
 			break;
 		}
 	}
+	tapdisk_server_unlock_vbds();
 
 	response.u.minors.count = i;
 	tapdisk_control_write_message(connection->socket, &response, 2);
@@ -260,6 +262,8 @@ tapdisk_control_list(struct tapdisk_control_connection *connection,
 
 	head = tapdisk_server_get_all_vbds();
 
+	tapdisk_server_lock_vbds();
+
 	count = 0;
 	list_for_each_entry(vbd, head, next)
 		count++;
@@ -283,6 +287,8 @@ tapdisk_control_list(struct tapdisk_control_connection *connection,
 		tapdisk_control_write_message(connection->socket, &response, 2);
 	}
 
+	tapdisk_server_unlock_vbds();
+
 	response.u.list.count   = count;
 	response.u.list.minor   = -1;
 	response.u.list.path[0] = 0;
@@ -307,10 +313,9 @@ tapdisk_control_get_pid(struct tapdisk_control_connection *connection,
 }
 
 static void
-tapdisk_control_attach_vbd(struct tapdisk_control_connection *connection,
-			   tapdisk_message_t *request)
+__tapdisk_control_attach_vbd(tapdisk_message_t *request,
+			      tapdisk_message_t *response)
 {
-	tapdisk_message_t response;
 	char *devname;
 	td_vbd_t *vbd;
 	struct blktap2_params params;
@@ -353,13 +358,10 @@ tapdisk_control_attach_vbd(struct tapdisk_control_connection *connection,
 	tapdisk_server_add_vbd(vbd);
 
 out:
-	memset(&response, 0, sizeof(response));
-	response.type = TAPDISK_MESSAGE_ATTACH_RSP;
-	response.cookie = request->cookie;
-	response.u.response.error = -err;
-
-	tapdisk_control_write_message(connection->socket, &response, 2);
-	tapdisk_control_close_connection(connection);
+	memset(response, 0, sizeof(*response));
+	response->type = TAPDISK_MESSAGE_ATTACH_RSP;
+	response->cookie = request->cookie;
+	response->u.response.error = -err;
 
 	return;
 
@@ -371,10 +373,9 @@ fail_vbd:
 
 
 static void
-tapdisk_control_detach_vbd(struct tapdisk_control_connection *connection,
-			   tapdisk_message_t *request)
+__tapdisk_control_detach_vbd(tapdisk_message_t *request,
+			      tapdisk_message_t *response)
 {
-	tapdisk_message_t response;
 	td_vbd_t *vbd;
 	int err;
 
@@ -393,24 +394,20 @@ tapdisk_control_detach_vbd(struct tapdisk_control_connection *connection,
 
 	err = 0;
 out:
-	memset(&response, 0, sizeof(response));
-	response.type = TAPDISK_MESSAGE_DETACH_RSP;
-	response.cookie = request->cookie;
-	response.u.response.error = -err;
-
-	tapdisk_control_write_message(connection->socket, &response, 2);
-	tapdisk_control_close_connection(connection);
+	memset(response, 0, sizeof(*response));
+	response->type = TAPDISK_MESSAGE_DETACH_RSP;
+	response->cookie = request->cookie;
+	response->u.response.error = -err;
 }
 
 static void
-tapdisk_control_open_image(struct tapdisk_control_connection *connection,
-			   tapdisk_message_t *request)
+__tapdisk_control_open_image(tapdisk_message_t *request,
+			      tapdisk_message_t *response)
 {
 	int err;
 	image_t image;
 	td_vbd_t *vbd;
 	td_flag_t flags;
-	tapdisk_message_t response;
 	struct blktap2_params params;
 
 	vbd = tapdisk_server_get_vbd(request->cookie);
@@ -474,22 +471,19 @@ tapdisk_control_open_image(struct tapdisk_control_connection *connection,
 	err = 0;
 
 out:
-	memset(&response, 0, sizeof(response));
-	response.cookie = request->cookie;
+	memset(response, 0, sizeof(*response));
+	response->cookie = request->cookie;
 
 	if (err) {
-		response.type                = TAPDISK_MESSAGE_ERROR;
-		response.u.response.error    = -err;
+		response->type                = TAPDISK_MESSAGE_ERROR;
+		response->u.response.error    = -err;
 	} else {
-		response.u.image.sectors     = image.size;
-		response.u.image.sector_size = image.secsize;
-		response.u.image.info        = image.info;
-		response.type                = TAPDISK_MESSAGE_OPEN_RSP;
+		response->u.image.sectors     = image.size;
+		response->u.image.sector_size = image.secsize;
+		response->u.image.info        = image.info;
+		response->type                = TAPDISK_MESSAGE_OPEN_RSP;
 	}
 
-	tapdisk_control_write_message(connection->socket, &response, 2);
-	tapdisk_control_close_connection(connection);
-
 	return;
 
 fail_close:
@@ -500,10 +494,9 @@ fail_close:
 }
 
 static void
-tapdisk_control_close_image(struct tapdisk_control_connection *connection,
-			    tapdisk_message_t *request)
+__tapdisk_control_close_image(tapdisk_message_t *request,
+			       tapdisk_message_t *response)
 {
-	tapdisk_message_t response;
 	td_vbd_t *vbd;
 	int err;
 
@@ -533,26 +526,22 @@ tapdisk_control_close_image(struct tapdisk_control_connection *connection,
 
 	err = 0;
 out:
-	memset(&response, 0, sizeof(response));
-	response.type = TAPDISK_MESSAGE_CLOSE_RSP;
-	response.cookie = request->cookie;
-	response.u.response.error = -err;
-
-	tapdisk_control_write_message(connection->socket, &response, 2);
-	tapdisk_control_close_connection(connection);
+	memset(response, 0, sizeof(*response));
+	response->type = TAPDISK_MESSAGE_CLOSE_RSP;
+	response->cookie = request->cookie;
+	response->u.response.error = -err;
 }
 
 static void
-tapdisk_control_pause_vbd(struct tapdisk_control_connection *connection,
-			  tapdisk_message_t *request)
+__tapdisk_control_pause_vbd(tapdisk_message_t *request,
+			     tapdisk_message_t *response)
 {
 	int err;
 	td_vbd_t *vbd;
-	tapdisk_message_t response;
 
-	memset(&response, 0, sizeof(response));
+	memset(response, 0, sizeof(*response));
 
-	response.type = TAPDISK_MESSAGE_PAUSE_RSP;
+	response->type = TAPDISK_MESSAGE_PAUSE_RSP;
 
 	vbd = tapdisk_server_get_vbd(request->cookie);
 	if (!vbd) {
@@ -570,23 +559,20 @@ tapdisk_control_pause_vbd(struct tapdisk_control_connection *connection,
 	} while (1);
 
 out:
-	response.cookie = request->cookie;
-	response.u.response.error = -err;
-	tapdisk_control_write_message(connection->socket, &response, 2);
-	tapdisk_control_close_connection(connection);
+	response->cookie = request->cookie;
+	response->u.response.error = -err;
 }
 
 static void
-tapdisk_control_resume_vbd(struct tapdisk_control_connection *connection,
-			   tapdisk_message_t *request)
+__tapdisk_control_resume_vbd(tapdisk_message_t *request,
+			      tapdisk_message_t *response)
 {
 	int err;
 	td_vbd_t *vbd;
-	tapdisk_message_t response;
 
-	memset(&response, 0, sizeof(response));
+	memset(response, 0, sizeof(*response));
 
-	response.type = TAPDISK_MESSAGE_RESUME_RSP;
+	response->type = TAPDISK_MESSAGE_RESUME_RSP;
 
 	vbd = tapdisk_server_get_vbd(request->cookie);
 	if (!vbd) {
@@ -621,8 +607,88 @@ tapdisk_control_resume_vbd(struct tapdisk_control_connection *connection,
 		goto out;
 
 out:
+	response->cookie = request->cookie;
+	response->u.response.error = -err;
+}
+
+struct tapdisk_control_call {
+	void             (*fn)(tapdisk_message_t *, tapdisk_message_t *);
+	tapdisk_message_t *request;
+	tapdisk_message_t *response;
+};
+
+static int
+tapdisk_control_call(void *private)
+{
+	struct tapdisk_control_call *call = private;
+
+	call->fn(call->request, call->response);
+
+	return 0;
+}
+
+/*
+ * VBD requests run on the loop owning the VBD. New VBDs are attached
+ * on the least loaded loop, and stay there.
+ */
+static void
+tapdisk_control_vbd_request(struct tapdisk_control_connection *connection,
+			    tapdisk_message_t *request,
+			    void (*fn)(tapdisk_message_t *,
+				       tapdisk_message_t *))
+{
+	td_vbd_t *vbd;
+	struct tapdisk_loop *loop;
+	tapdisk_message_t response;
+	struct tapdisk_control_call call;
+
+	if (request->type == TAPDISK_MESSAGE_ATTACH)
+		loop = tapdisk_server_pick_loop();
+	else {
+		vbd  = tapdisk_server_get_vbd(request->cookie);
+		loop = vbd ? vbd->loop : NULL;
+	}
+
+	call.fn       = fn;
+	call.request  = request;
+	call.response = &response;
+
+	tapdisk_server_call(loop, tapdisk_control_call, &call);
+
+	tapdisk_control_write_message(connection->socket, &response, 2);
+	tapdisk_control_close_connection(connection);
+}
+
+static void
+tapdisk_control_loops(struct tapdisk_control_connection *connection,
+		      tapdisk_message_t *request)
+{
+	int count;
+	struct tapdisk_loop *loop;
+	tapdisk_message_t response;
+
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_LOOPS_RSP;
 	response.cookie = request->cookie;
-	response.u.response.error = -err;
+
+	count = server.nr_loops;
+
+	tapdisk_server_for_each_loop(loop) {
+		response.u.loop.count      = count--;
+		response.u.loop.id         = loop->id;
+		response.u.loop.vbds       = loop->nr_vbds;
+		response.u.loop.busy_us    = loop->busy_us;
+		response.u.loop.idle_us    = loop->idle_us;
+		response.u.loop.iterations = loop->iterations;
+		response.u.loop.tiocbs     = loop->aio_queue.stats.tiocbs;
+		response.u.loop.iocbs      = loop->aio_queue.stats.iocbs;
+
+		tapdisk_control_write_message(connection->socket, &response, 2);
+	}
+
+	memset(&response.u.loop, 0, sizeof(response.u.loop));
+	response.u.loop.id = -1;
+
 	tapdisk_control_write_message(connection->socket, &response, 2);
 	tapdisk_control_close_connection(connection);
 }
@@ -652,18 +718,26 @@ tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 		return tapdisk_control_list_minors(connection, &message);
 	case TAPDISK_MESSAGE_LIST:
 		return tapdisk_control_list(connection, &message);
+	case TAPDISK_MESSAGE_LOOPS:
+		return tapdisk_control_loops(connection, &message);
 	case TAPDISK_MESSAGE_ATTACH:
-		return tapdisk_control_attach_vbd(connection, &message);
+		return tapdisk_control_vbd_request(connection, &message,
+					__tapdisk_control_attach_vbd);
 	case TAPDISK_MESSAGE_DETACH:
-		return tapdisk_control_detach_vbd(connection, &message);
+		return tapdisk_control_vbd_request(connection, &message,
+					__tapdisk_control_detach_vbd);
 	case TAPDISK_MESSAGE_OPEN:
-		return tapdisk_control_open_image(connection, &message);
+		return tapdisk_control_vbd_request(connection, &message,
+					__tapdisk_control_open_image);
 	case TAPDISK_MESSAGE_PAUSE:
-		return tapdisk_control_pause_vbd(connection, &message);
+		return tapdisk_control_vbd_request(connection, &message,
+					__tapdisk_control_pause_vbd);
 	case TAPDISK_MESSAGE_RESUME:
-		return tapdisk_control_resume_vbd(connection, &message);
+		return tapdisk_control_vbd_request(connection, &message,
+					__tapdisk_control_resume_vbd);
 	case TAPDISK_MESSAGE_CLOSE:
-		return tapdisk_control_close_image(connection, &message);
+		return tapdisk_control_vbd_request(connection, &message,
+					__tapdisk_control_close_image);
 	default: {
 		tapdisk_message_t response;
 	fail:
@@ -231,6 +231,18 @@ td_queue_tiocb(td_driver_t *driver, struct tiocb *tiocb)
 	tapdisk_driver_queue_tiocb(driver, tiocb);
 }
 
+void
+td_register_fd(int fd)
+{
+	tapdisk_server_register_fd(fd);
+}
+
+void
+td_unregister_fd(int fd)
+{
+	tapdisk_server_unregister_fd(fd);
+}
+
 void
 td_prep_read(struct tiocb *tiocb, int fd, char *buf, size_t bytes,
 	     long long offset, td_queue_callback_t cb, void *arg)
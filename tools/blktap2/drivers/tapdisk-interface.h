@@ -50,5 +50,7 @@ void td_prep_read(struct tiocb *, int, char *, size_t,
 		  long long, td_queue_callback_t, void *);
 void td_prep_write(struct tiocb *, int, char *, size_t,
 		   long long, td_queue_callback_t, void *);
+void td_register_fd(int);
+void td_unregister_fd(int);
 
 #endif
@@ -34,8 +34,10 @@
 #include <stdarg.h>
 #include <syslog.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <sys/time.h>
 
+#include "profile.h"
 #include "tapdisk-log.h"
 #include "tapdisk-utils.h"
 
@@ -68,6 +70,9 @@ struct tlog {
 static struct ehandle tapdisk_err;
 static struct tlog tapdisk_log;
 
+/* tapdisk2 may run its event loops on several threads */
+static pthread_mutex_t tapdisk_log_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void
 open_tlog(char *file, size_t bytes, int level, int append)
 {
@@ -118,6 +123,8 @@ __tlog_write(int level, const char *func, const char *fmt, ...)
 	if (level > tapdisk_log.level)
 		return;
 
+	pthread_mutex_lock(&tapdisk_log_lock);
+
 	avail = tapdisk_log.size - (tapdisk_log.p - tapdisk_log.buf);
 	if (avail < MAX_ENTRY_LEN) {
 		if (tapdisk_log.append)
@@ -141,6 +148,8 @@ __tlog_write(int level, const char *func, const char *fmt, ...)
 
 	tapdisk_log.cnt++;
 	tapdisk_log.p += len;
+
+	pthread_mutex_unlock(&tapdisk_log_lock);
 }
 
 void
@@ -153,17 +162,19 @@ __tlog_error(int err, const char *func, const char *fmt, ...)
 
 	err = (err > 0 ? err : -err);
 
+	pthread_mutex_lock(&tapdisk_log_lock);
+
 	for (i = 0; i < tapdisk_err.cnt; i++) {
 		e = &tapdisk_err.errors[i];
 		if (e->err == err && e->func == func) {
 			e->cnt++;
-			return;
+			goto out;
 		}
 	}
 
 	if (tapdisk_err.cnt >= MAX_ERROR_MESSAGES) {
 		tapdisk_err.dropped++;
-		return;
+		goto out;
 	}
 
 	gettimeofday(&t, NULL);
@@ -184,6 +195,24 @@ __tlog_error(int err, const char *func, const char *fmt, ...)
 	e->err  = err;
 	e->func = (char *)func;
 	tapdisk_err.cnt++;
+
+out:
+	pthread_mutex_unlock(&tapdisk_log_lock);
+}
+
+/* one line for a stage traced by tapdisk-vbd.c or tapdisk-queue.c */
+void
+__tlog_latency(const char *func, const char *name, const char *stage,
+	       const struct profile_latency *lat)
+{
+	if (!lat->cnt)
+		return;
+
+	__tlog_write(TLOG_WARN, func, "%s: %s: cnt: %"PRIu64", avg: %"PRIu64
+		     "ns, p50: %"PRIu64"ns, p99: %"PRIu64"ns, max: %"PRIu64
+		     "ns\n", name, stage, lat->cnt, lat->sum / lat->cnt,
+		     tp_lat_percentile(lat, 50), tp_lat_percentile(lat, 99),
+		     lat->max);
 }
 
 void
@@ -32,6 +32,8 @@
 #define TLOG_INFO       1
 #define TLOG_DBG        2
 
+struct profile_latency;
+
 void open_tlog(char *file, size_t bytes, int level, int append);
 void close_tlog(void);
 void tlog_flush(void);
@@ -41,6 +43,8 @@ void __tlog_write(int level, const char *func, const char *fmt, ...)
   __attribute__((format(printf, 3, 4)));
 void __tlog_error(int err, const char *func, const char *fmt, ...)
   __attribute__((format(printf, 3, 4)));
+void __tlog_latency(const char *func, const char *name, const char *stage,
+		    const struct profile_latency *lat);
 
 #define tlog_write(_level, _f, _a...)			\
 	__tlog_write(_level, __func__, _f, ##_a)
@@ -48,4 +52,7 @@ void __tlog_error(int err, const char *func, const char *fmt, ...)
 #define tlog_error(_err, _f, _a...)			\
 	__tlog_error(_err, __func__, _f, ##_a)
 
+#define tlog_latency(_name, _stage, _lat)		\
+	__tlog_latency(__func__, _name, _stage, _lat)
+
 #endif
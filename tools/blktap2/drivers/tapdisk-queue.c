@@ -28,11 +28,19 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <libaio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #ifdef __linux__
 #include <linux/version.h>
 #endif
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#define TAPDISK_HAVE_URING
+#endif
 
 #include "tapdisk.h"
 #include "tapdisk-log.h"
@@ -60,6 +68,9 @@ queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 {
 	struct iocb *iocb = &tiocb->iocb;
 
+	if (!queue->queued && queue->plug_us)
+		gettimeofday(&queue->plug_start, NULL);
+
 	if (queue->queued) {
 		struct tiocb *prev = (struct tiocb *)
 			queue->iocbs[queue->queued - 1]->data;
@@ -129,6 +140,9 @@ complete_tiocb(struct tqueue *queue, struct tiocb *tiocb, unsigned long res)
 	else
 		err = -EIO;
 
+	if (queue->trace)
+		tp_lat_add(&queue->lat_aio, tiocb->ts_submitted, tp_now_ns());
+
 	tiocb->cb(tiocb->arg, tiocb, err);
 }
 
@@ -171,6 +185,116 @@ fail_tiocbs(struct tqueue *queue, int succeeded, int total, int err)
 	return cancel_tiocbs(queue, err);
 }
 
+static inline long long
+iocb_key_cmp(struct iocb *l, struct iocb *r)
+{
+	if (l->aio_fildes != r->aio_fildes)
+		return l->aio_fildes - r->aio_fildes;
+
+	return l->u.c.offset - r->u.c.offset;
+}
+
+/*
+ * Requests of one batch are in flight together and may complete in any
+ * order, so nothing relies on their order within it: sort them by file
+ * and offset so io_merge finds neighbours queued from different rings,
+ * VBDs and iterations. The insertion sort is stable and cheap on the
+ * mostly ordered input this sees. The tiocb chain used for cancelling
+ * follows the new order.
+ */
+static void
+sort_tiocbs(struct tqueue *queue)
+{
+	int i, j;
+	struct iocb *io;
+	struct tiocb *tiocb;
+
+	for (i = 1; i < queue->queued; i++) {
+		io = queue->iocbs[i];
+		for (j = i; j > 0 && iocb_key_cmp(queue->iocbs[j - 1], io) > 0; j--)
+			queue->iocbs[j] = queue->iocbs[j - 1];
+		queue->iocbs[j] = io;
+	}
+
+	for (i = 0; i < queue->queued; i++) {
+		tiocb = queue->iocbs[i]->data;
+		tiocb->next = (i + 1 < queue->queued ?
+			       queue->iocbs[i + 1]->data : NULL);
+	}
+}
+
+static struct tqueue_stats *
+queue_fd_stats(struct tqueue *queue, int fd)
+{
+	int n;
+	struct tqueue_stats *stats;
+
+	if (fd < 0 || fd >= 65536)
+		return NULL;
+
+	if (fd >= queue->nr_fd_stats) {
+		n = queue->nr_fd_stats * 2;
+		if (n <= fd)
+			n = fd + 1;
+		stats = realloc(queue->fd_stats, n * sizeof(*stats));
+		if (!stats)
+			return NULL;
+
+		memset(stats + queue->nr_fd_stats, 0,
+		       (n - queue->nr_fd_stats) * sizeof(*stats));
+		queue->fd_stats    = stats;
+		queue->nr_fd_stats = n;
+	}
+
+	return queue->fd_stats + fd;
+}
+
+/*
+ * filter, order and merge the queued iocbs, ahead of submission
+ */
+static int
+merge_tiocbs(struct tqueue *queue)
+{
+	int i, merged;
+	uint64_t now;
+	struct tiocb *tiocb;
+	struct tqueue_stats *stats;
+
+	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+
+	if (queue->trace) {
+		now = tp_now_ns();
+		for (i = 0; i < queue->queued; i++) {
+			tiocb = queue->iocbs[i]->data;
+			tp_lat_add(&queue->lat_queue, tiocb->ts_queued, now);
+			tiocb->ts_submitted = now;
+		}
+	}
+
+	if (queue->plug_us)
+		sort_tiocbs(queue);
+
+	for (i = 0; i < queue->queued; i++) {
+		stats = queue_fd_stats(queue, queue->iocbs[i]->aio_fildes);
+		if (stats)
+			stats->tiocbs++;
+	}
+
+	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+
+	for (i = 0; i < merged; i++) {
+		stats = queue_fd_stats(queue, queue->iocbs[i]->aio_fildes);
+		if (stats)
+			stats->iocbs++;
+	}
+
+	queue->stats.tiocbs += queue->queued;
+	queue->stats.iocbs  += merged;
+	queue->plugged       = 0;
+
+	return merged;
+}
+
 /*
  * rwio
  */
@@ -234,8 +358,7 @@ tapdisk_rwio_submit(struct tqueue *queue)
 	if (!queue->queued)
 		return 0;
 
-	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
-	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+	merged = merge_tiocbs(queue);
 
 	queue->queued = 0;
 
@@ -514,8 +637,7 @@ tapdisk_lio_submit(struct tqueue *queue)
 	if (!queue->queued)
 		return 0;
 
-	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
-	merged    = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+	merged    = merge_tiocbs(queue);
 	tapdisk_lio_set_eventfd(queue, merged, queue->iocbs);
 	submitted = io_submit(lio->aio_ctx, merged, queue->iocbs);
 
@@ -547,6 +669,567 @@ static const struct tio td_tio_lio = {
 	.tio_submit  = tapdisk_lio_submit,
 };
 
+#ifdef TAPDISK_HAVE_URING
+/*
+ * io_uring
+ *
+ * Requests go through the mmapped submission ring and are handed to the
+ * kernel with a single io_uring_enter per batch; completions are read
+ * straight off the completion ring. Image files and the blktap data area
+ * can be registered with the ring to spare the kernel the per-request
+ * fget and page pinning. "uring-poll" additionally spins on the
+ * completion ring while requests are in flight instead of sleeping on
+ * the eventfd.
+ */
+
+#define URING_MAX_FILES         64
+#define URING_MAX_BUFS          64
+
+#define URING_FLAG_FILES        (1<<0)
+
+struct uring {
+	int                  ring_fd;
+	int                  event_fd;
+	int                  event_id;
+	int                  flags;
+
+	unsigned            *sq_head;
+	unsigned            *sq_tail;
+	unsigned             sq_mask;
+	unsigned            *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned             sq_entries;
+
+	unsigned            *cq_head;
+	unsigned            *cq_tail;
+	unsigned             cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void                *sq_ring;
+	size_t               sq_ring_sz;
+	void                *cq_ring;
+	size_t               cq_ring_sz;
+
+	struct io_event     *aio_events;
+
+	/* fixed file table, -1 for a free slot */
+	int                  files[URING_MAX_FILES];
+
+	struct iovec         bufs[URING_MAX_BUFS];
+	int                  nr_bufs;
+};
+
+static inline int
+__uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+__uring_enter(int fd, unsigned int to_submit,
+	      unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static inline int
+__uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+static void
+tapdisk_uring_destroy(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+
+	if (!uring)
+		return;
+
+	if (uring->event_id >= 0) {
+		tapdisk_server_unregister_event(uring->event_id);
+		uring->event_id = -1;
+	}
+
+	if (uring->event_fd >= 0) {
+		close(uring->event_fd);
+		uring->event_fd = -1;
+	}
+
+	if (uring->sqes) {
+		munmap(uring->sqes,
+		       uring->sq_entries * sizeof(struct io_uring_sqe));
+		uring->sqes = NULL;
+	}
+
+	if (uring->cq_ring && uring->cq_ring != uring->sq_ring)
+		munmap(uring->cq_ring, uring->cq_ring_sz);
+	uring->cq_ring = NULL;
+
+	if (uring->sq_ring) {
+		munmap(uring->sq_ring, uring->sq_ring_sz);
+		uring->sq_ring = NULL;
+	}
+
+	if (uring->ring_fd >= 0) {
+		close(uring->ring_fd);
+		uring->ring_fd = -1;
+	}
+
+	free(uring->aio_events);
+	uring->aio_events = NULL;
+}
+
+static int
+tapdisk_uring_map(struct uring *uring, struct io_uring_params *p)
+{
+	void *ptr;
+
+	uring->sq_ring_sz = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	uring->cq_ring_sz = p->cq_off.cqes +
+		p->cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring->cq_ring_sz > uring->sq_ring_sz)
+			uring->sq_ring_sz = uring->cq_ring_sz;
+		uring->cq_ring_sz = uring->sq_ring_sz;
+	}
+
+	ptr = mmap(NULL, uring->sq_ring_sz, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		return -errno;
+	uring->sq_ring = ptr;
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		uring->cq_ring = uring->sq_ring;
+	else {
+		ptr = mmap(NULL, uring->cq_ring_sz, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+			   IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED)
+			return -errno;
+		uring->cq_ring = ptr;
+	}
+
+	ptr = mmap(NULL, p->sq_entries * sizeof(struct io_uring_sqe),
+		   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		   uring->ring_fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		return -errno;
+	uring->sqes = ptr;
+
+	uring->sq_entries = p->sq_entries;
+	uring->sq_head    = uring->sq_ring + p->sq_off.head;
+	uring->sq_tail    = uring->sq_ring + p->sq_off.tail;
+	uring->sq_mask    = *(unsigned *)(uring->sq_ring + p->sq_off.ring_mask);
+	uring->sq_array   = uring->sq_ring + p->sq_off.array;
+
+	uring->cq_head    = uring->cq_ring + p->cq_off.head;
+	uring->cq_tail    = uring->cq_ring + p->cq_off.tail;
+	uring->cq_mask    = *(unsigned *)(uring->cq_ring + p->cq_off.ring_mask);
+	uring->cqes       = uring->cq_ring + p->cq_off.cqes;
+
+	return 0;
+}
+
+static int
+tapdisk_uring_reap(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	unsigned int head, tail;
+	int i, n, split;
+	struct iocb *iocb;
+	struct tiocb *tiocb;
+	struct io_event *ep;
+
+	head = *uring->cq_head;
+	tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (n = 0; head != tail && n < queue->size; n++, head++) {
+		struct io_uring_cqe *cqe = &uring->cqes[head & uring->cq_mask];
+
+		ep       = uring->aio_events + n;
+		ep->obj  = (struct iocb *)(uintptr_t)cqe->user_data;
+		ep->res  = (long)cqe->res;
+		ep->res2 = 0;
+	}
+
+	__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+	if (!n)
+		return 0;
+
+	split = io_split(&queue->opioctx, uring->aio_events, n);
+	tapdisk_filter_events(queue->filter, uring->aio_events, split);
+
+	DBG("events: %d, tiocbs: %d\n", n, split);
+
+	queue->iocbs_pending  -= n;
+	queue->tiocbs_pending -= split;
+
+	for (i = split, ep = uring->aio_events; i-- > 0; ep++) {
+		iocb  = ep->obj;
+		tiocb = iocb->data;
+		complete_tiocb(queue, tiocb, ep->res);
+	}
+
+	queue_deferred_tiocbs(queue);
+
+	return n;
+}
+
+static void
+tapdisk_uring_event(event_id_t id, char mode, void *private)
+{
+	struct tqueue *queue = private;
+	struct uring *uring = queue->tio_data;
+	uint64_t val;
+
+	read_exact(uring->event_fd, &val, sizeof(val));
+
+	tapdisk_uring_reap(queue);
+}
+
+static int
+tapdisk_uring_register_files(struct uring *uring)
+{
+	int i;
+
+	for (i = 0; i < URING_MAX_FILES; i++)
+		uring->files[i] = -1;
+
+	/* sparse tables need 5.5; we simply do without on older kernels */
+	if (__uring_register(uring->ring_fd, IORING_REGISTER_FILES,
+			     uring->files, URING_MAX_FILES) < 0) {
+		DPRINTF("io_uring: no fixed files: %d\n", -errno);
+		return -errno;
+	}
+
+	uring->flags |= URING_FLAG_FILES;
+	return 0;
+}
+
+static int
+tapdisk_uring_setup(struct tqueue *queue, int qlen)
+{
+	struct uring *uring = queue->tio_data;
+	struct io_uring_params p;
+	int err;
+
+	uring->ring_fd  = -1;
+	uring->event_fd = -1;
+	uring->event_id = -1;
+
+	memset(&p, 0, sizeof(p));
+	uring->ring_fd = __uring_setup(qlen, &p);
+	if (uring->ring_fd < 0) {
+		err = -errno;
+		DPRINTF("io_uring_setup(%d) failed: %d\n", qlen, err);
+		goto fail;
+	}
+
+	err = tapdisk_uring_map(uring, &p);
+	if (err)
+		goto fail;
+
+	uring->event_fd = tapdisk_sys_eventfd(0);
+	if (uring->event_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	if (__uring_register(uring->ring_fd, IORING_REGISTER_EVENTFD,
+			     &uring->event_fd, 1) < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	uring->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      uring->event_fd, 0,
+					      tapdisk_uring_event,
+					      queue);
+	err = uring->event_id;
+	if (err < 0)
+		goto fail;
+
+	uring->aio_events = calloc(qlen, sizeof(struct io_event));
+	if (!uring->aio_events) {
+		err = -errno;
+		goto fail;
+	}
+
+	tapdisk_uring_register_files(uring);
+
+	return 0;
+
+fail:
+	tapdisk_uring_destroy(queue);
+	return err;
+}
+
+static int
+tapdisk_uring_file(struct uring *uring, int fd)
+{
+	int i;
+
+	if (uring->flags & URING_FLAG_FILES)
+		for (i = 0; i < URING_MAX_FILES; i++)
+			if (uring->files[i] == fd)
+				return i;
+
+	return -1;
+}
+
+static int
+tapdisk_uring_buf(struct uring *uring, const char *buf, size_t len)
+{
+	int i;
+
+	for (i = 0; i < uring->nr_bufs; i++) {
+		const char *base = uring->bufs[i].iov_base;
+
+		if (buf >= base && buf + len <= base + uring->bufs[i].iov_len)
+			return i;
+	}
+
+	return -1;
+}
+
+static void
+tapdisk_uring_prep(struct uring *uring, struct iocb *iocb)
+{
+	unsigned int tail = *uring->sq_tail;
+	unsigned int idx  = tail & uring->sq_mask;
+	struct io_uring_sqe *sqe = &uring->sqes[idx];
+	int write = iocb->aio_lio_opcode == IO_CMD_PWRITE;
+	int file, buf;
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	buf = tapdisk_uring_buf(uring, iocb->u.c.buf, iocb->u.c.nbytes);
+	if (buf >= 0) {
+		sqe->opcode    = write ? IORING_OP_WRITE_FIXED :
+					 IORING_OP_READ_FIXED;
+		sqe->buf_index = buf;
+	} else
+		sqe->opcode    = write ? IORING_OP_WRITE : IORING_OP_READ;
+
+	file = tapdisk_uring_file(uring, iocb->aio_fildes);
+	if (file >= 0) {
+		sqe->fd     = file;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	} else
+		sqe->fd     = iocb->aio_fildes;
+
+	sqe->off       = iocb->u.c.offset;
+	sqe->addr      = (uintptr_t)iocb->u.c.buf;
+	sqe->len       = iocb->u.c.nbytes;
+	sqe->user_data = (uintptr_t)iocb;
+
+	uring->sq_array[idx] = idx;
+	*uring->sq_tail = tail + 1;
+}
+
+static int
+tapdisk_uring_submit(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	int i, merged, submitted, err = 0;
+
+	if (!queue->queued)
+		return 0;
+
+	merged = merge_tiocbs(queue);
+
+	for (i = 0; i < merged; i++)
+		tapdisk_uring_prep(uring, queue->iocbs[i]);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	submitted = __uring_enter(uring->ring_fd, merged, 0, 0);
+
+	DBG("queued: %d, merged: %d, submitted: %d\n",
+	    queue->queued, merged, submitted);
+
+	if (submitted < 0) {
+		err = -errno;
+		submitted = 0;
+	} else if (submitted < merged)
+		err = -EIO;
+
+	/*
+	 * Entries the kernel did not consume would go out with the next
+	 * batch; take them back, they are about to be failed.
+	 */
+	if (err)
+		*uring->sq_tail = *uring->sq_head;
+
+	queue->iocbs_pending  += submitted;
+	queue->tiocbs_pending += queue->queued;
+	queue->queued          = 0;
+
+	if (err)
+		queue->tiocbs_pending -=
+			fail_tiocbs(queue, submitted, merged, err);
+
+	return submitted;
+}
+
+static int
+tapdisk_uring_register_fd(struct tqueue *queue, int fd)
+{
+	struct uring *uring = queue->tio_data;
+	struct io_uring_files_update up;
+	int slot;
+
+	if (!(uring->flags & URING_FLAG_FILES))
+		return -EOPNOTSUPP;
+
+	slot = tapdisk_uring_file(uring, -1);
+	if (slot < 0)
+		return -ENOSPC;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = slot;
+	up.fds    = (uintptr_t)&fd;
+	if (__uring_register(uring->ring_fd, IORING_REGISTER_FILES_UPDATE,
+			     &up, 1) < 0)
+		return -errno;
+
+	uring->files[slot] = fd;
+	return 0;
+}
+
+static void
+tapdisk_uring_unregister_fd(struct tqueue *queue, int fd)
+{
+	struct uring *uring = queue->tio_data;
+	struct io_uring_files_update up;
+	int slot, none = -1;
+
+	slot = tapdisk_uring_file(uring, fd);
+	if (slot < 0)
+		return;
+
+	/* requests already submitted hold their own file reference */
+	memset(&up, 0, sizeof(up));
+	up.offset = slot;
+	up.fds    = (uintptr_t)&none;
+	__uring_register(uring->ring_fd, IORING_REGISTER_FILES_UPDATE,
+			 &up, 1);
+
+	uring->files[slot] = -1;
+}
+
+static int
+tapdisk_uring_update_bufs(struct uring *uring)
+{
+	__uring_register(uring->ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+
+	if (!uring->nr_bufs)
+		return 0;
+
+	if (__uring_register(uring->ring_fd, IORING_REGISTER_BUFFERS,
+			     uring->bufs, uring->nr_bufs) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int
+tapdisk_uring_register_buffer(struct tqueue *queue, void *buf, size_t len)
+{
+	struct uring *uring = queue->tio_data;
+	int err;
+
+	if (uring->nr_bufs >= URING_MAX_BUFS)
+		return -ENOSPC;
+
+	uring->bufs[uring->nr_bufs].iov_base = buf;
+	uring->bufs[uring->nr_bufs].iov_len  = len;
+	uring->nr_bufs++;
+
+	/*
+	 * The table is replaced as a whole. Some mappings (e.g. foreign
+	 * pages) cannot be pinned; those are kept out and used unfixed.
+	 */
+	err = tapdisk_uring_update_bufs(uring);
+	if (err) {
+		uring->nr_bufs--;
+		tapdisk_uring_update_bufs(uring);
+	}
+
+	return err;
+}
+
+static void
+tapdisk_uring_unregister_buffer(struct tqueue *queue, void *buf)
+{
+	struct uring *uring = queue->tio_data;
+	int i;
+
+	for (i = 0; i < uring->nr_bufs; i++)
+		if (uring->bufs[i].iov_base == buf)
+			break;
+
+	if (i == uring->nr_bufs)
+		return;
+
+	uring->bufs[i] = uring->bufs[--uring->nr_bufs];
+	tapdisk_uring_update_bufs(uring);
+}
+
+static const struct tio td_tio_uring = {
+	.name                   = "uring",
+	.data_size              = sizeof(struct uring),
+	.tio_setup              = tapdisk_uring_setup,
+	.tio_destroy            = tapdisk_uring_destroy,
+	.tio_submit             = tapdisk_uring_submit,
+	.tio_register_fd        = tapdisk_uring_register_fd,
+	.tio_unregister_fd      = tapdisk_uring_unregister_fd,
+	.tio_register_buffer    = tapdisk_uring_register_buffer,
+	.tio_unregister_buffer  = tapdisk_uring_unregister_buffer,
+};
+
+static const struct tio td_tio_uring_poll = {
+	.name                   = "uring-poll",
+	.data_size              = sizeof(struct uring),
+	.tio_setup              = tapdisk_uring_setup,
+	.tio_destroy            = tapdisk_uring_destroy,
+	.tio_submit             = tapdisk_uring_submit,
+	.tio_register_fd        = tapdisk_uring_register_fd,
+	.tio_unregister_fd      = tapdisk_uring_unregister_fd,
+	.tio_register_buffer    = tapdisk_uring_register_buffer,
+	.tio_unregister_buffer  = tapdisk_uring_unregister_buffer,
+	.tio_poll               = tapdisk_uring_reap,
+};
+#endif /* TAPDISK_HAVE_URING */
+
+static const struct {
+	const char *name;
+	int         drv;
+} tapdisk_queue_drivers[] = {
+	{ "lio",        TIO_DRV_LIO },
+	{ "rwio",       TIO_DRV_RWIO },
+	{ "uring",      TIO_DRV_URING },
+	{ "uring-poll", TIO_DRV_URING_POLL },
+};
+
+int
+tapdisk_queue_driver(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(tapdisk_queue_drivers) /
+		     sizeof(tapdisk_queue_drivers[0]); i++)
+		if (!strcmp(name, tapdisk_queue_drivers[i].name))
+			return tapdisk_queue_drivers[i].drv;
+
+	return -EINVAL;
+}
+
 static void
 tapdisk_queue_free_io(struct tqueue *queue)
 {
@@ -575,6 +1258,14 @@ tapdisk_queue_init_io(struct tqueue *queue, int drv)
 	case TIO_DRV_RWIO:
 		tio = &td_tio_rwio;
 		break;
+#ifdef TAPDISK_HAVE_URING
+	case TIO_DRV_URING:
+		tio = &td_tio_uring;
+		break;
+	case TIO_DRV_URING_POLL:
+		tio = &td_tio_uring_poll;
+		break;
+#endif
 	default:
 		err = -EINVAL;
 		goto fail;
@@ -647,12 +1338,17 @@ tapdisk_free_queue(struct tqueue *queue)
 	free(queue->iocbs);
 	queue->iocbs = NULL;
 
+	free(queue->fd_stats);
+	queue->fd_stats    = NULL;
+	queue->nr_fd_stats = 0;
+
 	opio_free(&queue->opioctx);
 }
 
 void 
 tapdisk_debug_queue(struct tqueue *queue)
 {
+	int i;
 	struct tiocb *tiocb = queue->deferred.head;
 
 	WARN("TAPDISK QUEUE:\n");
@@ -661,6 +1357,26 @@ tapdisk_debug_queue(struct tqueue *queue)
 	     queue->size, queue->tio->name, queue->queued, queue->iocbs_pending,
 	     queue->tiocbs_pending, queue->tiocbs_deferred, queue->deferrals);
 
+	if (queue->plug_us)
+		WARN("elevator: plug %dus, batch %d, plugs: %"PRIu64"\n",
+		     queue->plug_us, queue->plug_batch, queue->plugs);
+
+	WARN("tiocbs: %"PRIu64", iocbs: %"PRIu64"\n",
+	     queue->stats.tiocbs, queue->stats.iocbs);
+
+	if (queue->trace) {
+		tlog_latency(queue->tio->name, "queue", &queue->lat_queue);
+		tlog_latency(queue->tio->name, "aio", &queue->lat_aio);
+	}
+
+	for (i = 0; i < queue->nr_fd_stats; i++) {
+		struct tqueue_stats *stats = &queue->fd_stats[i];
+
+		if (stats->tiocbs)
+			WARN("fd %d: tiocbs: %"PRIu64", iocbs: %"PRIu64"\n",
+			     i, stats->tiocbs, stats->iocbs);
+	}
+
 	if (tiocb) {
 		WARN("deferred:\n");
 		for (; tiocb != NULL; tiocb = tiocb->next) {
@@ -688,11 +1404,17 @@ tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
 	tiocb->cb   = cb;
 	tiocb->arg  = arg;
 	tiocb->next = NULL;
+
+	tiocb->ts_queued    = 0;
+	tiocb->ts_submitted = 0;
 }
 
 void
 tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 {
+	if (queue->trace)
+		tiocb->ts_queued = tp_now_ns();
+
 	if (!tapdisk_queue_full(queue))
 		queue_tiocb(queue, tiocb);
 	else
@@ -706,6 +1428,9 @@ tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 int
 tapdisk_submit_tiocbs(struct tqueue *queue)
 {
+	if (tapdisk_queue_plugged(queue))
+		return 0;
+
 	return queue->tio->tio_submit(queue);
 }
 
@@ -716,11 +1441,56 @@ tapdisk_submit_all_tiocbs(struct tqueue *queue)
 
 	do {
 		submitted += tapdisk_submit_tiocbs(queue);
-	} while (!tapdisk_queue_empty(queue));
+	} while (!tapdisk_queue_empty(queue) && !tapdisk_queue_plugged(queue));
 
 	return submitted;
 }
 
+void
+tapdisk_queue_set_plug(struct tqueue *queue, int usecs, int batch)
+{
+	queue->plug_us    = (usecs > 0 ? usecs : 0);
+	queue->plug_batch = (batch > 0 ? batch : queue->size);
+}
+
+void
+tapdisk_queue_set_trace(struct tqueue *queue, int trace)
+{
+	queue->trace = trace;
+	memset(&queue->lat_queue, 0, sizeof(queue->lat_queue));
+	memset(&queue->lat_aio, 0, sizeof(queue->lat_aio));
+}
+
+/*
+ * returns the microseconds left before queued iocbs must be submitted,
+ * or 0 if they should go now. an idle device is never kept waiting.
+ */
+int
+tapdisk_queue_plugged(struct tqueue *queue)
+{
+	long long elapsed;
+	struct timeval now;
+
+	if (!queue->plug_us || !queue->queued || !queue->iocbs_pending)
+		return 0;
+
+	if (queue->queued >= queue->plug_batch || tapdisk_queue_full(queue))
+		return 0;
+
+	gettimeofday(&now, NULL);
+	elapsed = (now.tv_sec - queue->plug_start.tv_sec) * 1000000LL +
+		(now.tv_usec - queue->plug_start.tv_usec);
+	if (elapsed >= queue->plug_us)
+		return 0;
+
+	if (!queue->plugged) {
+		queue->plugged = 1;
+		queue->plugs++;
+	}
+
+	return queue->plug_us - elapsed;
+}
+
 /*
  * cancel_tiocbs may queue more tiocbs
  */
@@ -730,6 +1500,47 @@ tapdisk_cancel_tiocbs(struct tqueue *queue)
 	return cancel_tiocbs(queue, -EIO);
 }
 
+int
+tapdisk_queue_register_fd(struct tqueue *queue, int fd)
+{
+	if (!queue->tio || !queue->tio->tio_register_fd)
+		return -EOPNOTSUPP;
+
+	return queue->tio->tio_register_fd(queue, fd);
+}
+
+void
+tapdisk_queue_unregister_fd(struct tqueue *queue, int fd)
+{
+	if (queue->tio && queue->tio->tio_unregister_fd)
+		queue->tio->tio_unregister_fd(queue, fd);
+}
+
+int
+tapdisk_queue_register_buffer(struct tqueue *queue, void *buf, size_t len)
+{
+	if (!queue->tio || !queue->tio->tio_register_buffer)
+		return -EOPNOTSUPP;
+
+	return queue->tio->tio_register_buffer(queue, buf, len);
+}
+
+void
+tapdisk_queue_unregister_buffer(struct tqueue *queue, void *buf)
+{
+	if (queue->tio && queue->tio->tio_unregister_buffer)
+		queue->tio->tio_unregister_buffer(queue, buf);
+}
+
+int
+tapdisk_queue_poll(struct tqueue *queue)
+{
+	if (!tapdisk_queue_polling(queue))
+		return 0;
+
+	return queue->tio->tio_poll(queue);
+}
+
 int
 tapdisk_cancel_all_tiocbs(struct tqueue *queue)
 {
@@ -29,10 +29,13 @@
 #ifndef TAPDISK_QUEUE_H
 #define TAPDISK_QUEUE_H
 
+#include <stdint.h>
 #include <libaio.h>
+#include <sys/time.h>
 
 #include "io-optimize.h"
 #include "scheduler.h"
+#include "profile.h"
 
 struct tiocb;
 struct tfilter;
@@ -46,6 +49,10 @@ struct tiocb {
 
 	struct iocb           iocb;
 	struct tiocb         *next;
+
+	/* when queued and submitted, if the queue is tracing */
+	uint64_t              ts_queued;
+	uint64_t              ts_submitted;
 };
 
 struct tlist {
@@ -53,6 +60,11 @@ struct tlist {
 	struct tiocb         *tail;
 };
 
+struct tqueue_stats {
+	uint64_t              tiocbs;      /* requests submitted */
+	uint64_t              iocbs;       /* ... after merging */
+};
+
 struct tqueue {
 	int                   size;
 
@@ -82,6 +94,26 @@ struct tqueue {
 	struct tfilter       *filter;
 
 	uint64_t              deferrals;
+
+	/* elevator: while iocbs are in flight, hold new ones for up to
+	 * plug_us, or until plug_batch are queued, and submit them
+	 * ordered by file and offset. off if plug_us is 0. */
+	int                   plug_us;
+	int                   plug_batch;
+	int                   plugged;
+	struct timeval        plug_start;
+	uint64_t              plugs;
+
+	/* merge statistics, overall and per image fd */
+	struct tqueue_stats   stats;
+	struct tqueue_stats  *fd_stats;
+	int                   nr_fd_stats;
+
+	/* latency tracing: queued until submitted, including any
+	 * deferral and plugging, and submitted until completed */
+	int                   trace;
+	struct profile_latency lat_queue;
+	struct profile_latency lat_aio;
 };
 
 struct tio {
@@ -91,11 +123,23 @@ struct tio {
 	int  (*tio_setup)    (struct tqueue *queue, int qlen);
 	void (*tio_destroy)  (struct tqueue *queue);
 	int  (*tio_submit)   (struct tqueue *queue);
+
+	/* optional: fds and buffers the driver can prepare for */
+	int  (*tio_register_fd)       (struct tqueue *queue, int fd);
+	void (*tio_unregister_fd)     (struct tqueue *queue, int fd);
+	int  (*tio_register_buffer)   (struct tqueue *queue,
+				       void *buf, size_t len);
+	void (*tio_unregister_buffer) (struct tqueue *queue, void *buf);
+
+	/* optional: reap completions without waiting for an event */
+	int  (*tio_poll)     (struct tqueue *queue);
 };
 
 enum {
-	TIO_DRV_LIO     = 1,
-	TIO_DRV_RWIO    = 2,
+	TIO_DRV_LIO        = 1,
+	TIO_DRV_RWIO       = 2,
+	TIO_DRV_URING      = 3,
+	TIO_DRV_URING_POLL = 4,
 };
 
 /*
@@ -111,6 +155,9 @@ enum {
 #define tapdisk_queue_empty(q) ((q)->queued == 0)
 #define tapdisk_queue_full(q)  \
 	(((q)->tiocbs_pending + (q)->queued) >= (q)->size)
+#define tapdisk_queue_polling(q) \
+	((q)->tio && (q)->tio->tio_poll && (q)->iocbs_pending)
+int tapdisk_queue_driver(const char *name);
 int tapdisk_init_queue(struct tqueue *, int size, int drv, struct tfilter *);
 void tapdisk_free_queue(struct tqueue *);
 void tapdisk_debug_queue(struct tqueue *);
@@ -121,5 +168,13 @@ int tapdisk_cancel_tiocbs(struct tqueue *);
 int tapdisk_cancel_all_tiocbs(struct tqueue *);
 void tapdisk_prep_tiocb(struct tiocb *, int, int, char *, size_t,
 			long long, td_queue_callback_t, void *);
+int tapdisk_queue_register_fd(struct tqueue *, int fd);
+void tapdisk_queue_unregister_fd(struct tqueue *, int fd);
+int tapdisk_queue_register_buffer(struct tqueue *, void *, size_t);
+void tapdisk_queue_unregister_buffer(struct tqueue *, void *);
+int tapdisk_queue_poll(struct tqueue *);
+void tapdisk_queue_set_plug(struct tqueue *, int usecs, int batch);
+void tapdisk_queue_set_trace(struct tqueue *, int);
+int tapdisk_queue_plugged(struct tqueue *);
 
 #endif
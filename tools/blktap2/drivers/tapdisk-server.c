@@ -27,8 +27,12 @@
  */
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <signal.h>
 
@@ -42,9 +46,33 @@
 
  tapdisk_server_t server;
 
+/* the loop run by the calling thread */
+static __thread tapdisk_loop_t *loop_self;
+
+struct tapdisk_loop_call {
+	tapdisk_loop_fn_t            fn;
+	void                        *arg;
+	int                          ret;
+	int                          done;
+};
+
 #define tapdisk_server_for_each_vbd(vbd, tmp)			        \
 	list_for_each_entry_safe(vbd, tmp, &server.vbds, next)
 
+#define tapdisk_loop_for_each_vbd(loop, vbd, tmp)			\
+	list_for_each_entry_safe(vbd, tmp, &(loop)->vbds, loop_next)
+
+static inline uint64_t
+tapdisk_server_usecs(struct timeval *a, struct timeval *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000000ULL +
+		b->tv_usec - a->tv_usec;
+}
+
+/*
+ * Images are only shared between VBDs of the same loop, as every
+ * request against an image is issued through its loop's queue.
+ */
 td_image_t *
 tapdisk_server_get_shared_image(td_image_t *image)
 {
@@ -54,7 +82,7 @@ tapdisk_server_get_shared_image(td_image_t *image)
 	if (!td_flag_test(image->flags, TD_OPEN_SHAREABLE))
 		return NULL;
 
-	tapdisk_server_for_each_vbd(vbd, tmpv)
+	tapdisk_loop_for_each_vbd(loop_self, vbd, tmpv)
 		tapdisk_vbd_for_each_image(vbd, img, tmpi)
 			if (img->type == image->type &&
 			    !strcmp(img->name, image->name))
@@ -69,76 +97,136 @@ tapdisk_server_get_all_vbds(void)
 	return &server.vbds;
 }
 
+void
+tapdisk_server_lock_vbds(void)
+{
+	pthread_mutex_lock(&server.vbd_lock);
+}
+
+void
+tapdisk_server_unlock_vbds(void)
+{
+	pthread_mutex_unlock(&server.vbd_lock);
+}
+
 td_vbd_t *
 tapdisk_server_get_vbd(uint16_t uuid)
 {
 	td_vbd_t *vbd, *tmp;
 
+	tapdisk_server_lock_vbds();
+
 	tapdisk_server_for_each_vbd(vbd, tmp)
 		if (vbd->uuid == uuid)
-			return vbd;
+			goto out;
 
-	return NULL;
+	vbd = NULL;
+out:
+	tapdisk_server_unlock_vbds();
+	return vbd;
 }
 
 void
 tapdisk_server_add_vbd(td_vbd_t *vbd)
 {
+	tapdisk_loop_t *loop = loop_self;
+
+	tapdisk_server_lock_vbds();
 	list_add_tail(&vbd->next, &server.vbds);
+	list_add_tail(&vbd->loop_next, &loop->vbds);
+	vbd->loop  = loop;
+	vbd->trace = server.trace;
+	loop->nr_vbds++;
+	tapdisk_server_unlock_vbds();
 }
 
 void
 tapdisk_server_remove_vbd(td_vbd_t *vbd)
 {
+	tapdisk_server_lock_vbds();
 	list_del(&vbd->next);
 	INIT_LIST_HEAD(&vbd->next);
+	if (vbd->loop) {
+		list_del(&vbd->loop_next);
+		INIT_LIST_HEAD(&vbd->loop_next);
+		vbd->loop->nr_vbds--;
+		vbd->loop = NULL;
+	}
+	tapdisk_server_unlock_vbds();
+
 	tapdisk_server_check_state();
 }
 
 void
 tapdisk_server_queue_tiocb(struct tiocb *tiocb)
 {
-	tapdisk_queue_tiocb(&server.aio_queue, tiocb);
+	tapdisk_queue_tiocb(&loop_self->aio_queue, tiocb);
 }
 
-void
-tapdisk_server_debug(void)
+static void
+tapdisk_loop_wake(tapdisk_loop_t *loop)
+{
+	char c = 0;
+
+	if (loop->wake[1] != -1 && write(loop->wake[1], &c, 1) < 0 &&
+	    errno != EAGAIN)
+		DBG(TLOG_WARN, "failed to wake loop %d: %d\n",
+		    loop->id, errno);
+}
+
+static void
+tapdisk_loop_debug(tapdisk_loop_t *loop)
 {
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_debug_queue(&server.aio_queue);
+	DBG(TLOG_WARN, "loop %d: %d vbds, %"PRIu64" iterations, "
+	    "busy %"PRIu64"us, idle %"PRIu64"us\n", loop->id,
+	    loop->nr_vbds, loop->iterations, loop->busy_us, loop->idle_us);
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
+	tapdisk_debug_queue(&loop->aio_queue);
+
+	tapdisk_loop_for_each_vbd(loop, vbd, tmp)
 		tapdisk_vbd_debug(vbd);
+}
 
+void
+tapdisk_server_debug(void)
+{
+	tapdisk_loop_debug(loop_self);
 	tlog_flush();
 }
 
 void
 tapdisk_server_check_state(void)
 {
-	if (list_empty(&server.vbds))
+	tapdisk_loop_t *loop;
+
+	if (list_empty(&server.vbds)) {
 		server.run = 0;
+		tapdisk_server_for_each_loop(loop)
+			if (loop != loop_self)
+				tapdisk_loop_wake(loop);
+	}
 }
 
 event_id_t
 tapdisk_server_register_event(char mode, int fd,
 			      int timeout, event_cb_t cb, void *data)
 {
-	return scheduler_register_event(&server.scheduler,
+	return scheduler_register_event(&loop_self->scheduler,
 					mode, fd, timeout, cb, data);
 }
 
 void
 tapdisk_server_unregister_event(event_id_t event)
 {
-	return scheduler_unregister_event(&server.scheduler, event);
+	return scheduler_unregister_event(&loop_self->scheduler, event);
 }
 
 void
 tapdisk_server_set_max_timeout(int seconds)
 {
-	scheduler_set_max_timeout(&server.scheduler, seconds);
+	scheduler_set_max_timeout(&loop_self->scheduler, seconds);
 }
 
 static void
@@ -148,11 +236,11 @@ tapdisk_server_assert_locks(void)
 }
 
 static void
-tapdisk_server_set_retry_timeout(void)
+tapdisk_server_set_retry_timeout(tapdisk_loop_t *loop)
 {
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
+	tapdisk_loop_for_each_vbd(loop, vbd, tmp)
 		if (tapdisk_vbd_retry_needed(vbd)) {
 			tapdisk_server_set_max_timeout(TD_VBD_RETRY_INTERVAL);
 			return;
@@ -160,97 +248,137 @@ tapdisk_server_set_retry_timeout(void)
 }
 
 static void
-tapdisk_server_check_progress(void)
+tapdisk_server_check_progress(tapdisk_loop_t *loop)
 {
 	struct timeval now;
 	td_vbd_t *vbd, *tmp;
 
 	gettimeofday(&now, NULL);
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
+	tapdisk_loop_for_each_vbd(loop, vbd, tmp)
 		tapdisk_vbd_check_progress(vbd);
 }
 
 static void
-tapdisk_server_submit_tiocbs(void)
+tapdisk_server_submit_tiocbs(tapdisk_loop_t *loop)
 {
-	tapdisk_submit_all_tiocbs(&server.aio_queue);
+	int usecs;
+
+	tapdisk_submit_all_tiocbs(&loop->aio_queue);
+
+	/* come back for plugged iocbs, should nothing else wake us */
+	usecs = tapdisk_queue_plugged(&loop->aio_queue);
+	if (usecs)
+		scheduler_set_max_timeout_us(&loop->scheduler, usecs);
 }
 
 static void
-tapdisk_server_kick_responses(void)
+tapdisk_server_kick_responses(tapdisk_loop_t *loop)
 {
 	int n;
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
+	tapdisk_loop_for_each_vbd(loop, vbd, tmp)
 		tapdisk_vbd_kick(vbd);
 }
 
 static void
-tapdisk_server_check_vbds(void)
+tapdisk_server_check_vbds(tapdisk_loop_t *loop)
 {
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
+	tapdisk_loop_for_each_vbd(loop, vbd, tmp)
 		tapdisk_vbd_check_state(vbd);
 }
 
 static void
-tapdisk_server_stop_vbds(void)
+tapdisk_server_stop_vbds(tapdisk_loop_t *loop)
 {
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
+	tapdisk_loop_for_each_vbd(loop, vbd, tmp)
 		tapdisk_vbd_kill_queue(vbd);
 }
 
 static int
-tapdisk_server_init_aio(void)
+tapdisk_server_init_aio(tapdisk_loop_t *loop)
 {
-	return tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
-				  TIO_DRV_LIO, NULL);
+	int err;
+
+	err = tapdisk_init_queue(&loop->aio_queue, TAPDISK_TIOCBS,
+				 server.aio_drv, NULL);
+	if (err && server.aio_drv != TIO_DRV_LIO) {
+		DBG(TLOG_WARN, "I/O queue driver %d unavailable (%d), "
+		    "falling back to libaio\n", server.aio_drv, err);
+		err = tapdisk_init_queue(&loop->aio_queue, TAPDISK_TIOCBS,
+					 TIO_DRV_LIO, NULL);
+	}
+
+	if (!err) {
+		tapdisk_queue_set_plug(&loop->aio_queue,
+				       server.plug_us, server.plug_batch);
+		tapdisk_queue_set_trace(&loop->aio_queue, server.trace);
+	}
+
+	return err;
 }
 
-static void
-tapdisk_server_close_aio(void)
+void
+tapdisk_server_set_queue_driver(int drv)
 {
-	tapdisk_free_queue(&server.aio_queue);
+	server.aio_drv = drv;
 }
 
-static void
-tapdisk_server_close(void)
+void
+tapdisk_server_set_plug(int usecs, int batch)
 {
-	tapdisk_server_close_aio();
+	server.plug_us    = usecs;
+	server.plug_batch = batch;
 }
 
+/* per-stage latencies, for vbds added and loops opened from now on */
 void
-tapdisk_server_iterate(void)
+tapdisk_server_set_trace(int trace)
 {
-	int ret;
+	server.trace = trace;
+}
 
-	tapdisk_server_assert_locks();
-	tapdisk_server_set_retry_timeout();
-	tapdisk_server_check_progress();
+void
+tapdisk_server_register_fd(int fd)
+{
+	tapdisk_queue_register_fd(&loop_self->aio_queue, fd);
+}
 
-	ret = scheduler_wait_for_events(&server.scheduler);
-	if (ret < 0)
-		DBG(TLOG_WARN, "server wait returned %d\n", ret);
+void
+tapdisk_server_unregister_fd(int fd)
+{
+	tapdisk_queue_unregister_fd(&loop_self->aio_queue, fd);
+}
 
-	tapdisk_server_check_vbds();
-	tapdisk_server_submit_tiocbs();
-	tapdisk_server_kick_responses();
+void
+tapdisk_server_register_buffer(void *buf, size_t len)
+{
+	int err;
+
+	err = tapdisk_queue_register_buffer(&loop_self->aio_queue, buf, len);
+	if (err && err != -EOPNOTSUPP)
+		DBG(TLOG_INFO, "buffer %p not registered: %d\n", buf, err);
+}
+
+void
+tapdisk_server_unregister_buffer(void *buf)
+{
+	tapdisk_queue_unregister_buffer(&loop_self->aio_queue, buf);
 }
 
 static void
-__tapdisk_server_run(void)
+tapdisk_server_close_aio(tapdisk_loop_t *loop)
 {
-	while (server.run)
-		tapdisk_server_iterate();
+	tapdisk_free_queue(&loop->aio_queue);
 }
 
 static void
-tapdisk_server_signal_handler(int signal)
+tapdisk_server_handle_signal(tapdisk_loop_t *loop, int signal)
 {
 	td_vbd_t *vbd, *tmp;
 	static int xfsz_error_sent = 0;
@@ -258,13 +386,13 @@ tapdisk_server_signal_handler(int signal)
 	switch (signal) {
 	case SIGBUS:
 	case SIGINT:
-		tapdisk_server_for_each_vbd(vbd, tmp)
+		tapdisk_loop_for_each_vbd(loop, vbd, tmp)
 			tapdisk_vbd_close(vbd);
 		break;
 
 	case SIGXFSZ:
 		ERR(EFBIG, "received SIGXFSZ");
-		tapdisk_server_stop_vbds();
+		tapdisk_server_stop_vbds(loop);
 		if (xfsz_error_sent)
 			break;
 
@@ -272,37 +400,376 @@ tapdisk_server_signal_handler(int signal)
 		break;
 
 	case SIGUSR1:
-		tapdisk_server_debug();
+		tapdisk_loop_debug(loop);
+		tlog_flush();
 		break;
 	}
 }
 
+/*
+ * Runs on the loop's own thread, for calls and signals posted to it by
+ * other threads.
+ */
+static void
+tapdisk_loop_wake_event(event_id_t id, char mode, void *private)
+{
+	int signal;
+	char buf[64];
+	tapdisk_loop_call_t *call;
+	tapdisk_loop_t *loop = private;
+
+	while (read(loop->wake[0], buf, sizeof(buf)) > 0)
+		;
+
+	signal = loop->signal;
+	if (signal) {
+		loop->signal = 0;
+		tapdisk_server_handle_signal(loop, signal);
+	}
+
+	pthread_mutex_lock(&loop->lock);
+	call = loop->call;
+	loop->call = NULL;
+	pthread_mutex_unlock(&loop->lock);
+
+	if (!call)
+		return;
+
+	call->ret = call->fn(call->arg);
+
+	pthread_mutex_lock(&loop->lock);
+	call->done = 1;
+	pthread_cond_broadcast(&loop->cond);
+	pthread_mutex_unlock(&loop->lock);
+}
+
+/*
+ * Run @fn on @loop's thread and wait for it to return. Only the
+ * control socket, served by loop 0, calls across loops; a NULL @loop
+ * runs @fn on the calling thread.
+ */
+int
+tapdisk_server_call(tapdisk_loop_t *loop, tapdisk_loop_fn_t fn, void *arg)
+{
+	tapdisk_loop_call_t call;
+
+	if (!loop || loop == loop_self)
+		return fn(arg);
+
+	call.fn   = fn;
+	call.arg  = arg;
+	call.ret  = 0;
+	call.done = 0;
+
+	pthread_mutex_lock(&loop->lock);
+	while (loop->call)
+		pthread_cond_wait(&loop->cond, &loop->lock);
+	loop->call = &call;
+	tapdisk_loop_wake(loop);
+	while (!call.done)
+		pthread_cond_wait(&loop->cond, &loop->lock);
+	pthread_mutex_unlock(&loop->lock);
+
+	return call.ret;
+}
+
+/*
+ * New VBDs go to the loop with the fewest. Ties go to the workers, as
+ * loop 0 also serves the control socket.
+ */
+tapdisk_loop_t *
+tapdisk_server_pick_loop(void)
+{
+	tapdisk_loop_t *loop, *best;
+
+	best = &server.loop[0];
+
+	tapdisk_server_lock_vbds();
+	tapdisk_server_for_each_loop(loop)
+		if (loop->nr_vbds <= best->nr_vbds)
+			best = loop;
+	tapdisk_server_unlock_vbds();
+
+	return best;
+}
+
+int
+tapdisk_server_set_loops(int loops)
+{
+	if (loops == 0)
+		loops = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (loops < 1)
+		loops = 1;
+	if (loops > TAPDISK_MAX_LOOPS)
+		loops = TAPDISK_MAX_LOOPS;
+
+	server.nr_loops = loops;
+
+	return loops;
+}
+
+static void
+tapdisk_loop_init(tapdisk_loop_t *loop, int id)
+{
+	memset(loop, 0, sizeof(*loop));
+
+	loop->id         = id;
+	loop->wake[0]    = -1;
+	loop->wake[1]    = -1;
+	loop->wake_event = -1;
+	INIT_LIST_HEAD(&loop->vbds);
+	pthread_mutex_init(&loop->lock, NULL);
+	pthread_cond_init(&loop->cond, NULL);
+
+	scheduler_initialize(&loop->scheduler);
+}
+
+static void
+tapdisk_loop_close(tapdisk_loop_t *loop)
+{
+	tapdisk_loop_t *self = loop_self;
+
+	loop_self = loop;
+
+	if (loop->wake_event >= 0) {
+		tapdisk_server_unregister_event(loop->wake_event);
+		loop->wake_event = -1;
+	}
+
+	if (loop->wake[0] != -1) {
+		close(loop->wake[0]);
+		close(loop->wake[1]);
+		loop->wake[0] = loop->wake[1] = -1;
+	}
+
+	tapdisk_server_close_aio(loop);
+
+	loop_self = self;
+}
+
+/*
+ * Sets up the loop's queue and wakeup pipe. Both register events, so
+ * they do so on behalf of @loop before its thread exists.
+ */
+static int
+tapdisk_loop_open(tapdisk_loop_t *loop)
+{
+	int err;
+	tapdisk_loop_t *self = loop_self;
+
+	loop_self = loop;
+
+	err = tapdisk_server_init_aio(loop);
+	if (err)
+		goto fail;
+
+	if (pipe(loop->wake)) {
+		err = -errno;
+		loop->wake[0] = loop->wake[1] = -1;
+		goto fail;
+	}
+
+	fcntl(loop->wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(loop->wake[1], F_SETFL, O_NONBLOCK);
+
+	err = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					    loop->wake[0], 0,
+					    tapdisk_loop_wake_event, loop);
+	if (err < 0)
+		goto fail;
+
+	loop->wake_event = err;
+	loop_self = self;
+	return 0;
+
+fail:
+	loop_self = self;
+	tapdisk_loop_close(loop);
+	return err;
+}
+
+static void
+tapdisk_server_close(void)
+{
+	tapdisk_loop_t *loop;
+
+	server.run = 0;
+
+	tapdisk_server_for_each_loop(loop)
+		if (loop->id && loop->thread) {
+			tapdisk_loop_wake(loop);
+			pthread_join(loop->thread, NULL);
+			loop->thread = 0;
+		}
+
+	tapdisk_server_for_each_loop(loop)
+		tapdisk_loop_close(loop);
+}
+
+void
+tapdisk_server_iterate(void)
+{
+	int ret;
+	struct timeval start, wait, wake, end;
+	tapdisk_loop_t *loop = loop_self;
+
+	gettimeofday(&start, NULL);
+
+	tapdisk_server_assert_locks();
+	tapdisk_server_set_retry_timeout(loop);
+	tapdisk_server_check_progress(loop);
+
+	/* don't sleep while a polled queue has requests in flight */
+	if (tapdisk_queue_polling(&loop->aio_queue))
+		scheduler_set_max_timeout(&loop->scheduler, 0);
+
+	gettimeofday(&wait, NULL);
+	ret = scheduler_wait_for_events(&loop->scheduler);
+	if (ret < 0)
+		DBG(TLOG_WARN, "server wait returned %d\n", ret);
+	gettimeofday(&wake, NULL);
+
+	tapdisk_queue_poll(&loop->aio_queue);
+
+	tapdisk_server_check_vbds(loop);
+	tapdisk_server_submit_tiocbs(loop);
+	tapdisk_server_kick_responses(loop);
+
+	gettimeofday(&end, NULL);
+
+	loop->idle_us += tapdisk_server_usecs(&wait, &wake);
+	loop->busy_us += tapdisk_server_usecs(&start, &wait) +
+		tapdisk_server_usecs(&wake, &end);
+	loop->iterations++;
+}
+
+static void
+__tapdisk_server_run(void)
+{
+	while (server.run)
+		tapdisk_server_iterate();
+}
+
+static void *
+tapdisk_loop_thread(void *private)
+{
+	cpu_set_t cpus;
+	long ncpus;
+	tapdisk_loop_t *loop = private;
+
+	loop_self = loop;
+
+	/* thread per core: worker N stays on cpu N */
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus > 1) {
+		CPU_ZERO(&cpus);
+		CPU_SET(loop->id % ncpus, &cpus);
+		if (pthread_setaffinity_np(pthread_self(),
+					   sizeof(cpus), &cpus))
+			DBG(TLOG_INFO, "loop %d not pinned\n", loop->id);
+	}
+
+	DBG(TLOG_INFO, "loop %d running\n", loop->id);
+
+	__tapdisk_server_run();
+
+	return NULL;
+}
+
+static void
+tapdisk_server_signal_handler(int signal)
+{
+	tapdisk_loop_t *loop;
+
+	/*
+	 * Signals are blocked in the workers. Loop 0 is ours, the others
+	 * act on the signal against their own VBDs once woken.
+	 */
+	tapdisk_server_for_each_loop(loop) {
+		if (loop == loop_self)
+			continue;
+		loop->signal = signal;
+		tapdisk_loop_wake(loop);
+	}
+
+	tapdisk_server_handle_signal(loop_self, signal);
+}
+
 int
 tapdisk_server_init(void)
 {
+	int i;
+
 	memset(&server, 0, sizeof(server));
 	INIT_LIST_HEAD(&server.vbds);
+	pthread_mutex_init(&server.vbd_lock, NULL);
+	server.aio_drv  = TIO_DRV_LIO;
+	server.nr_loops = 1;
+
+	for (i = 0; i < TAPDISK_MAX_LOOPS; i++)
+		tapdisk_loop_init(&server.loop[i], i);
 
-	scheduler_initialize(&server.scheduler);
+	loop_self = &server.loop[0];
 
 	return 0;
 }
 
+static int
+tapdisk_server_start_loops(void)
+{
+	int err;
+	sigset_t all, old;
+	tapdisk_loop_t *loop;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	err = 0;
+	tapdisk_server_for_each_loop(loop) {
+		if (!loop->id)
+			continue;
+
+		err = -pthread_create(&loop->thread, NULL,
+				      tapdisk_loop_thread, loop);
+		if (err) {
+			ERR(err, "failed to start loop %d\n", loop->id);
+			loop->thread = 0;
+			break;
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return err;
+}
+
 int
 tapdisk_server_complete(void)
 {
 	int err;
+	tapdisk_loop_t *loop;
 
-	err = tapdisk_server_init_aio();
+	tapdisk_server_for_each_loop(loop) {
+		err = tapdisk_loop_open(loop);
+		if (err)
+			goto fail;
+	}
+
+	server.run = 1;
+
+	err = tapdisk_server_start_loops();
 	if (err)
 		goto fail;
 
-	server.run = 1;
+	if (server.nr_loops > 1)
+		DBG(TLOG_INFO, "serving vbds from %d loops\n",
+		    server.nr_loops);
 
 	return 0;
 
 fail:
-	tapdisk_server_close_aio();
+	tapdisk_server_close();
 	return err;
 }
 
@@ -28,6 +28,8 @@
 #ifndef _TAPDISK_SERVER_H_
 #define _TAPDISK_SERVER_H_
 
+#include <pthread.h>
+
 #include "list.h"
 #include "tapdisk-vbd.h"
 #include "tapdisk-queue.h"
@@ -37,6 +39,8 @@ struct tap_disk *tapdisk_server_find_driver_interface(int);
 td_image_t *tapdisk_server_get_shared_image(td_image_t *);
 
 struct list_head *tapdisk_server_get_all_vbds(void);
+void tapdisk_server_lock_vbds(void);
+void tapdisk_server_unlock_vbds(void);
 td_vbd_t *tapdisk_server_get_vbd(td_uuid_t);
 void tapdisk_server_add_vbd(td_vbd_t *);
 void tapdisk_server_remove_vbd(td_vbd_t *);
@@ -49,6 +53,21 @@ event_id_t tapdisk_server_register_event(char, int, int, event_cb_t, void *);
 void tapdisk_server_unregister_event(event_id_t);
 void tapdisk_server_set_max_timeout(int);
 
+void tapdisk_server_set_queue_driver(int);
+void tapdisk_server_set_plug(int usecs, int batch);
+void tapdisk_server_set_trace(int);
+void tapdisk_server_register_fd(int);
+void tapdisk_server_unregister_fd(int);
+void tapdisk_server_register_buffer(void *, size_t);
+void tapdisk_server_unregister_buffer(void *);
+
+struct tapdisk_loop;
+typedef int (*tapdisk_loop_fn_t)(void *);
+
+int tapdisk_server_set_loops(int);
+struct tapdisk_loop *tapdisk_server_pick_loop(void);
+int tapdisk_server_call(struct tapdisk_loop *, tapdisk_loop_fn_t, void *);
+
 int tapdisk_server_init(void);
 int tapdisk_server_initialize(void);
 int tapdisk_server_complete(void);
@@ -56,12 +75,54 @@ int tapdisk_server_run(void);
 void tapdisk_server_iterate(void);
 
 #define TAPDISK_TIOCBS              (TAPDISK_DATA_REQUESTS + 50)
+#define TAPDISK_MAX_LOOPS           64
 
-typedef struct tapdisk_server {
-	int                          run;
+typedef struct tapdisk_loop_call tapdisk_loop_call_t;
+
+/*
+ * Every loop owns a scheduler and an I/O queue, and runs the VBDs it
+ * owns. Loop 0 is the main thread, which also serves the control
+ * socket. Other loops are worker threads, only started in the thread
+ * per core mode. A VBD never changes loops; control operations on it
+ * are handed to its owner with tapdisk_server_call().
+ */
+typedef struct tapdisk_loop {
+	int                          id;
 	struct list_head             vbds;
+	int                          nr_vbds;
 	scheduler_t                  scheduler;
 	struct tqueue                aio_queue;
+
+	pthread_t                    thread;
+	int                          wake[2];
+	event_id_t                   wake_event;
+	volatile int                 signal;
+
+	pthread_mutex_t              lock;
+	pthread_cond_t               cond;
+	tapdisk_loop_call_t         *call;
+
+	uint64_t                     busy_us;
+	uint64_t                     idle_us;
+	uint64_t                     iterations;
+} tapdisk_loop_t;
+
+typedef struct tapdisk_server {
+	volatile int                 run;
+	struct list_head             vbds;
+	pthread_mutex_t              vbd_lock;
+	int                          aio_drv;
+	int                          plug_us;
+	int                          plug_batch;
+	int                          trace;
+	int                          nr_loops;
+	tapdisk_loop_t               loop[TAPDISK_MAX_LOOPS];
 } tapdisk_server_t;
 
+#define tapdisk_server_for_each_loop(_loop)				\
+	for ((_loop) = server.loop;					\
+	     (_loop) < &server.loop[server.nr_loops]; (_loop)++)
+
+extern tapdisk_server_t server;
+
 #endif
@@ -107,6 +107,10 @@ tapdisk_vbd_create(uint16_t uuid)
 	vbd->uuid     = uuid;
 	vbd->minor    = -1;
 	vbd->ring.fd  = -1;
+	vbd->ring.event_id = -1;
+	vbd->ring.vbd = vbd;
+	vbd->rings[0] = &vbd->ring;
+	vbd->nr_rings = 1;
 
 	/* default blktap ring completion */
 	vbd->callback = tapdisk_vbd_callback;
@@ -123,9 +127,10 @@ tapdisk_vbd_create(uint16_t uuid)
 	INIT_LIST_HEAD(&vbd->failed_requests);
 	INIT_LIST_HEAD(&vbd->completed_requests);
 	INIT_LIST_HEAD(&vbd->next);
+	INIT_LIST_HEAD(&vbd->loop_next);
 	gettimeofday(&vbd->ts, NULL);
 
-	for (i = 0; i < MAX_REQUESTS; i++)
+	for (i = 0; i < MAX_REQUESTS * TD_VBD_MAX_RINGS; i++)
 		tapdisk_vbd_initialize_vreq(vbd->request_list + i);
 
 	return vbd;
@@ -578,15 +583,22 @@ fail:
 static int
 tapdisk_vbd_register_event_watches(td_vbd_t *vbd)
 {
+	int i;
 	event_id_t id;
+	td_ring_t *ring;
+
+	for (i = 0; i < vbd->nr_rings; i++) {
+		ring = vbd->rings[i];
 
-	id = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
-					   vbd->ring.fd, 0,
-					   tapdisk_vbd_ring_event, vbd);
-	if (id < 0)
-		return id;
+		id = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+						   ring->fd, 0,
+						   tapdisk_vbd_ring_event,
+						   ring);
+		if (id < 0)
+			return id;
 
-	vbd->ring_event_id = id;
+		ring->event_id = id;
+	}
 
 	return 0;
 }
@@ -594,18 +606,179 @@ tapdisk_vbd_register_event_watches(td_vbd_t *vbd)
 static void
 tapdisk_vbd_unregister_events(td_vbd_t *vbd)
 {
-	if (vbd->ring_event_id)
-		tapdisk_server_unregister_event(vbd->ring_event_id);
+	int i;
+	td_ring_t *ring;
+
+	for (i = 0; i < vbd->nr_rings; i++) {
+		ring = vbd->rings[i];
+
+		if (ring->event_id >= 0) {
+			tapdisk_server_unregister_event(ring->event_id);
+			ring->event_id = -1;
+		}
+	}
 }
 
+/*
+ * Persistent grants: kernels which negotiated feature-persistent with
+ * blkfront hand requests over with the grant references only, and
+ * the ioctl returns the frontend domain. Data is then staged in
+ * private buffers at the usual MMAP_VADDR offsets, so nothing past
+ * the ring notices, and copied from and to the grant pages here.
+ * Kernels without support fail the ioctl and keep mapping grants in
+ * the ring area themselves.
+ */
 static int
-tapdisk_vbd_map_device(td_vbd_t *vbd, const char *devname)
+tapdisk_vbd_open_grants(td_vbd_t *vbd, uint32_t domid)
+{
+	char *env;
+	td_grant_pool_t *pool;
+
+	pool = &vbd->grants;
+
+	if (!pool->xgt) {
+		pool->xgt = xengnttab_open(NULL, 0);
+		if (!pool->xgt)
+			return -errno;
+	}
+
+	pool->domid = domid;
+
+	env = getenv("TAPDISK2_PERSISTENT_GRANTS");
+	if (env)
+		pool->max = atoi(env);
+	else
+		pool->max += MAX_REQUESTS * BLKIF_MAX_SEGMENTS_PER_REQUEST;
+
+	return 0;
+}
+
+static void
+tapdisk_vbd_flush_grants(td_vbd_t *vbd)
+{
+	int i;
+	td_grant_t *g, *next;
+	td_grant_pool_t *pool;
+
+	pool = &vbd->grants;
+	if (!pool->xgt)
+		return;
+
+	for (i = 0; i < TD_VBD_GRANT_BUCKETS; i++) {
+		for (g = pool->hash[i]; g; g = next) {
+			next = g->next;
+			xengnttab_unmap(pool->xgt, g->addr, 1);
+			free(g);
+		}
+		pool->hash[i] = NULL;
+	}
+
+	pool->nr = 0;
+}
+
+static void
+tapdisk_vbd_close_grants(td_vbd_t *vbd)
+{
+	tapdisk_vbd_flush_grants(vbd);
+
+	if (vbd->grants.xgt) {
+		xengnttab_close(vbd->grants.xgt);
+		vbd->grants.xgt = NULL;
+	}
+
+	vbd->grants.max = 0;
+}
+
+static char *
+tapdisk_vbd_get_grant(td_grant_pool_t *pool, uint32_t gref, int *transient)
+{
+	void *addr;
+	td_grant_t *g, **head;
+
+	head = &pool->hash[gref % TD_VBD_GRANT_BUCKETS];
+
+	for (g = *head; g; g = g->next)
+		if (g->gref == gref) {
+			pool->hits++;
+			*transient = 0;
+			return g->addr;
+		}
+
+	addr = xengnttab_map_grant_ref(pool->xgt, pool->domid, gref,
+				       PROT_READ | PROT_WRITE);
+	if (!addr)
+		return NULL;
+
+	if (pool->nr < pool->max) {
+		g = malloc(sizeof(*g));
+		if (g) {
+			g->gref = gref;
+			g->addr = addr;
+			g->next = *head;
+			*head   = g;
+			pool->nr++;
+			pool->maps++;
+			*transient = 0;
+			return addr;
+		}
+	}
+
+	pool->transient++;
+	*transient = 1;
+	return addr;
+}
+
+static int
+tapdisk_vbd_copy_grants(td_vbd_t *vbd, td_vbd_request_t *vreq, int in)
 {
-	
-	int err, psize;
 	td_ring_t *ring;
+	blkif_request_t *req;
+	char *page, *gpage;
+	int i, psize, off, len, transient;
+
+	req   = &vreq->req;
+	ring  = vreq->ring ? : &vbd->ring;
+	psize = getpagesize();
+
+	if (req->nr_segments > BLKIF_MAX_SEGMENTS_PER_REQUEST)
+		return -EINVAL;
+
+	for (i = 0; i < req->nr_segments; i++) {
+		if (req->seg[i].first_sect > req->seg[i].last_sect ||
+		    req->seg[i].last_sect >= (psize >> SECTOR_SHIFT))
+			return -EINVAL;
+
+		off  = req->seg[i].first_sect << SECTOR_SHIFT;
+		len  = (req->seg[i].last_sect + 1) << SECTOR_SHIFT;
+		len -= off;
+		page = (char *)MMAP_VADDR(ring->vstart,
+					  (unsigned long)req->id, i) + off;
+
+		gpage = tapdisk_vbd_get_grant(&vbd->grants,
+					      req->seg[i].gref, &transient);
+		if (!gpage)
+			return -errno;
+
+		if (in)
+			memcpy(page, gpage + off, len);
+		else
+			memcpy(gpage + off, page, len);
+
+		if (transient)
+			xengnttab_unmap(vbd->grants.xgt, gpage, 1);
+
+		vbd->grants.copied += len;
+	}
+
+	return 0;
+}
+
+static int
+tapdisk_vbd_map_ring(td_ring_t *ring, const char *devname)
+{
+	int err, psize, domid;
+	size_t size;
 
-	ring  = &vbd->ring;
 	psize = getpagesize();
 
 	ring->fd = open(devname, O_RDWR);
@@ -628,6 +801,27 @@ tapdisk_vbd_map_device(td_vbd_t *vbd, const char *devname)
 
 	ring->vstart =
 		(unsigned long)ring->mem + (BLKTAP_RING_PAGES * psize);
+	size = psize * (BLKTAP_MMAP_REGION_SIZE - BLKTAP_RING_PAGES);
+
+	domid = ioctl(ring->fd, BLKTAP2_IOCTL_PERSISTENT, 0);
+	if (domid >= 0) {
+		err = tapdisk_vbd_open_grants(ring->vbd, domid);
+		if (err) {
+			EPRINTF("failed to open grant table: %d\n", err);
+			goto fail;
+		}
+
+		err = posix_memalign((void **)&ring->bounce, psize, size);
+		if (err) {
+			err = -err;
+			ring->bounce = NULL;
+			goto fail;
+		}
+
+		ring->vstart = (unsigned long)ring->bounce;
+	}
+
+	tapdisk_server_register_buffer((void *)ring->vstart, size);
 
 	ioctl(ring->fd, BLKTAP_IOCTL_SETMODE, BLKTAP_MODE_INTERPOSE);
 
@@ -640,24 +834,93 @@ fail:
 		close(ring->fd);
 	ring->fd  = -1;
 	ring->mem = NULL;
+	ring->vstart = 0;
 	return err;
 }
 
-static int
-tapdisk_vbd_unmap_device(td_vbd_t *vbd)
+static void
+tapdisk_vbd_unmap_ring(td_ring_t *ring)
 {
 	int psize;
 
 	psize = getpagesize();
 
-	if (vbd->ring.fd != -1)
-		close(vbd->ring.fd);
-	if (vbd->ring.mem > 0)
-		munmap(vbd->ring.mem, psize * BLKTAP_MMAP_REGION_SIZE);
+	if (ring->vstart)
+		tapdisk_server_unregister_buffer((void *)ring->vstart);
+	if (ring->fd != -1)
+		close(ring->fd);
+	if (ring->mem > 0)
+		munmap(ring->mem, psize * BLKTAP_MMAP_REGION_SIZE);
+	free(ring->bounce);
+
+	ring->fd     = -1;
+	ring->mem    = NULL;
+	ring->sring  = NULL;
+	ring->vstart = 0;
+	ring->bounce = NULL;
+}
+
+/*
+ * Multi-queue frontends: the kernel advertises multi-queue-max-queues
+ * to blkfront for as many rings as it could set up for us, each with a
+ * device node and event channel of its own. Rings beyond the
+ * frontend's multi-queue-num-queues just stay idle. Kernels without
+ * multi-queue support fail the ioctl, and the VBD keeps one ring.
+ */
+static int
+tapdisk_vbd_map_rings(td_vbd_t *vbd, int minor)
+{
+	int i, n, err;
+	char *devname;
+	td_ring_t *ring;
+
+	n = ioctl(vbd->ring.fd, BLKTAP2_IOCTL_MAX_QUEUES, TD_VBD_MAX_RINGS);
+	if (n <= 1)
+		return 0;
+	if (n > TD_VBD_MAX_RINGS)
+		n = TD_VBD_MAX_RINGS;
+
+	for (i = 1; i < n; i++) {
+		ring = calloc(1, sizeof(*ring));
+		if (!ring)
+			return -ENOMEM;
+
+		ring->fd       = -1;
+		ring->event_id = -1;
+		ring->queue    = i;
+		ring->vbd      = vbd;
+		vbd->rings[vbd->nr_rings++] = ring;
+
+		if (asprintf(&devname, BLKTAP2_RING_DEVICE"%d.%d",
+			     minor, i) == -1)
+			return -ENOMEM;
+
+		err = tapdisk_vbd_map_ring(ring, devname);
+		free(devname);
+		if (err)
+			return err;
+	}
+
+	DPRINTF("minor %d: %d rings\n", minor, vbd->nr_rings);
 
 	return 0;
 }
 
+static void
+tapdisk_vbd_unmap_device(td_vbd_t *vbd)
+{
+	while (vbd->nr_rings > 1) {
+		td_ring_t *ring = vbd->rings[--vbd->nr_rings];
+
+		tapdisk_vbd_unmap_ring(ring);
+		vbd->rings[vbd->nr_rings] = NULL;
+		free(ring);
+	}
+
+	tapdisk_vbd_unmap_ring(&vbd->ring);
+	tapdisk_vbd_close_grants(vbd);
+}
+
 void
 tapdisk_vbd_detach(td_vbd_t *vbd)
 {
@@ -673,7 +936,11 @@ tapdisk_vbd_attach(td_vbd_t *vbd, const char *devname, int minor)
 {
 	int err;
 
-	err = tapdisk_vbd_map_device(vbd, devname);
+	err = tapdisk_vbd_map_ring(&vbd->ring, devname);
+	if (err)
+		goto fail;
+
+	err = tapdisk_vbd_map_rings(vbd, minor);
 	if (err)
 		goto fail;
 
@@ -824,6 +1091,23 @@ tapdisk_vbd_debug(td_vbd_t *vbd)
 	    vbd->errors, vbd->retries,
 	    vbd->received, vbd->returned, vbd->kicked);
 
+	if (vbd->grants.xgt)
+		DBG(TLOG_WARN, "%s: grants: %d/%d, hits: 0x%08"PRIx64", "
+		    "maps: 0x%08"PRIx64", transient: 0x%08"PRIx64", "
+		    "copied: 0x%08"PRIx64"\n", vbd->name, vbd->grants.nr,
+		    vbd->grants.max, vbd->grants.hits, vbd->grants.maps,
+		    vbd->grants.transient, vbd->grants.copied);
+
+	if (vbd->trace) {
+		tlog_latency(vbd->name, "ring", &vbd->latency[TD_VBD_TRACE_RING]);
+		tlog_latency(vbd->name, "driver",
+			     &vbd->latency[TD_VBD_TRACE_DRIVER]);
+		tlog_latency(vbd->name, "response",
+			     &vbd->latency[TD_VBD_TRACE_RESPONSE]);
+		tlog_latency(vbd->name, "total",
+			     &vbd->latency[TD_VBD_TRACE_TOTAL]);
+	}
+
 	tapdisk_vbd_for_each_image(vbd, image, tmp)
 		td_debug(image);
 }
@@ -1007,15 +1291,11 @@ tapdisk_vbd_resume(td_vbd_t *vbd, const char *path, uint16_t drivertype)
 	return 0;
 }
 
-int
-tapdisk_vbd_kick(td_vbd_t *vbd)
+static int
+tapdisk_vbd_kick_ring(td_vbd_t *vbd, td_ring_t *ring)
 {
 	int n;
-	td_ring_t *ring;
-
-	tapdisk_vbd_check_state(vbd);
 
-	ring = &vbd->ring;
 	if (!ring->sring)
 		return 0;
 
@@ -1027,19 +1307,32 @@ tapdisk_vbd_kick(td_vbd_t *vbd)
 	RING_PUSH_RESPONSES(&ring->fe_ring);
 	ioctl(ring->fd, BLKTAP_IOCTL_KICK_FE, 0);
 
-	DBG(TLOG_INFO, "kicking %d: rec: 0x%08"PRIx64", ret: 0x%08"PRIx64", kicked: "
-	    "0x%08"PRIx64"\n", n, vbd->received, vbd->returned, vbd->kicked);
+	DBG(TLOG_INFO, "kicking %d on ring %d: rec: 0x%08"PRIx64", "
+	    "ret: 0x%08"PRIx64", kicked: 0x%08"PRIx64"\n", n, ring->queue,
+	    vbd->received, vbd->returned, vbd->kicked);
+
+	return n;
+}
+
+int
+tapdisk_vbd_kick(td_vbd_t *vbd)
+{
+	int i, n;
+
+	tapdisk_vbd_check_state(vbd);
+
+	n = 0;
+	for (i = 0; i < vbd->nr_rings; i++)
+		n += tapdisk_vbd_kick_ring(vbd, vbd->rings[i]);
 
 	return n;
 }
 
 static inline void
-tapdisk_vbd_write_response_to_ring(td_vbd_t *vbd, blkif_response_t *rsp)
+tapdisk_vbd_write_response_to_ring(td_ring_t *ring, blkif_response_t *rsp)
 {
-	td_ring_t *ring;
 	blkif_response_t *rspp;
 
-	ring = &vbd->ring;
 	rspp = RING_GET_RESPONSE(&ring->fe_ring, ring->fe_ring.rsp_prod_pvt);
 	memcpy(rspp, rsp, sizeof(blkif_response_t));
 	ring->fe_ring.rsp_prod_pvt++;
@@ -1049,7 +1342,7 @@ static void
 tapdisk_vbd_callback(void *arg, blkif_response_t *rsp)
 {
 	td_vbd_t *vbd = (td_vbd_t *)arg;
-	tapdisk_vbd_write_response_to_ring(vbd, rsp);
+	tapdisk_vbd_write_response_to_ring(&vbd->ring, rsp);
 }
 
 static void
@@ -1061,6 +1354,11 @@ tapdisk_vbd_make_response(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	tmp = vreq->req;
 	rsp = (blkif_response_t *)&vreq->req;
 
+	if (vbd->grants.xgt && vreq->ring &&
+	    tmp.operation == BLKIF_OP_READ && vreq->status == BLKIF_RSP_OKAY &&
+	    tapdisk_vbd_copy_grants(vbd, vreq, 0))
+		vreq->status = BLKIF_RSP_ERROR;
+
 	rsp->id = tmp.id;
 	rsp->operation = tmp.operation;
 	rsp->status = vreq->status;
@@ -1072,7 +1370,23 @@ tapdisk_vbd_make_response(td_vbd_t *vbd, td_vbd_request_t *vreq)
 		ERR(EIO, "returning BLKIF_RSP %d", rsp->status);
 
 	vbd->returned++;
-	vbd->callback(vbd->argument, rsp);
+
+	/* ring requests are answered on the ring they came from */
+	if (vbd->callback == tapdisk_vbd_callback && vreq->ring)
+		tapdisk_vbd_write_response_to_ring(vreq->ring, rsp);
+	else
+		vbd->callback(vbd->argument, rsp);
+
+	if (vbd->trace) {
+		uint64_t now = tp_now_ns();
+
+		tp_lat_add(&vbd->latency[TD_VBD_TRACE_DRIVER],
+			   vreq->ts_issued, vreq->ts_completed);
+		tp_lat_add(&vbd->latency[TD_VBD_TRACE_RESPONSE],
+			   vreq->ts_completed, now);
+		tp_lat_add(&vbd->latency[TD_VBD_TRACE_TOTAL],
+			   vreq->ts_received, now);
+	}
 }
 
 void
@@ -1172,8 +1486,11 @@ tapdisk_vbd_complete_vbd_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 		    !td_flag_test(vbd->state, TD_VBD_DEAD) &&
 		    !td_flag_test(vbd->state, TD_VBD_SHUTDOWN_REQUESTED))
 			tapdisk_vbd_move_request(vreq, &vbd->failed_requests);
-		else
+		else {
+			if (vbd->trace)
+				vreq->ts_completed = tp_now_ns();
 			tapdisk_vbd_move_request(vreq, &vbd->completed_requests);
+		}
 	}
 }
 
@@ -1365,7 +1682,7 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 
 	req       = &vreq->req;
 	id        = req->id;
-	ring      = &vbd->ring;
+	ring      = vreq->ring ? : &vbd->ring;
 	sector_nr = req->sector_number;
 	image     = tapdisk_vbd_first_image(vbd);
 
@@ -1374,6 +1691,13 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	gettimeofday(&vreq->last_try, NULL);
 	tapdisk_vbd_move_request(vreq, &vbd->pending_requests);
 
+	/* retries count towards the driver, from the first issue */
+	if (vbd->trace && !vreq->ts_issued) {
+		vreq->ts_issued = tp_now_ns();
+		tp_lat_add(&vbd->latency[TD_VBD_TRACE_RING],
+			   vreq->ts_received, vreq->ts_issued);
+	}
+
 #if 0
 	err = tapdisk_vbd_check_queue(vbd);
 	if (err)
@@ -1550,15 +1874,15 @@ tapdisk_vbd_issue_requests(td_vbd_t *vbd)
 }
 
 static void
-tapdisk_vbd_pull_ring_requests(td_vbd_t *vbd)
+tapdisk_vbd_pull_ring_requests(td_ring_t *ring)
 {
 	int idx;
+	td_vbd_t *vbd;
 	RING_IDX rp, rc;
-	td_ring_t *ring;
 	blkif_request_t *req;
 	td_vbd_request_t *vreq;
 
-	ring = &vbd->ring;
+	vbd = ring->vbd;
 	if (!ring->sring)
 		return;
 
@@ -1569,7 +1893,8 @@ tapdisk_vbd_pull_ring_requests(td_vbd_t *vbd)
 		req = RING_GET_REQUEST(&ring->fe_ring, rc);
 		++ring->fe_ring.req_cons;
 
-		idx  = req->id;
+		/* request ids are slots in the ring they came from */
+		idx  = ring->queue * MAX_REQUESTS + req->id;
 		vreq = &vbd->request_list[idx];
 
 		ASSERT(list_empty(&vreq->next));
@@ -1577,7 +1902,16 @@ tapdisk_vbd_pull_ring_requests(td_vbd_t *vbd)
 
 		memcpy(&vreq->req, req, sizeof(blkif_request_t));
 		vbd->received++;
-		vreq->vbd = vbd;
+		vreq->vbd  = vbd;
+		vreq->ring = ring;
+		tapdisk_vbd_trace_receive(vbd, vreq);
+
+		if (vbd->grants.xgt && req->operation == BLKIF_OP_WRITE &&
+		    tapdisk_vbd_copy_grants(vbd, vreq, 1)) {
+			vreq->status = BLKIF_RSP_ERROR;
+			tapdisk_vbd_move_request(vreq, &vbd->completed_requests);
+			continue;
+		}
 
 		tapdisk_vbd_move_request(vreq, &vbd->new_requests);
 
@@ -1603,6 +1937,9 @@ tapdisk_vbd_pause_ring(td_vbd_t *vbd)
 
 	tapdisk_vbd_close_vdi(vbd);
 
+	/* a frontend reconnecting after the pause brings new grants */
+	tapdisk_vbd_flush_grants(vbd);
+
 	err = ioctl(vbd->ring.fd, BLKTAP2_IOCTL_PAUSE, 0);
 	if (err)
 		EPRINTF("%s: pause ioctl failed: %d\n", vbd->name, errno);
@@ -1634,6 +1971,12 @@ tapdisk_vbd_resume_ring(td_vbd_t *vbd)
 		return err;
 	}
 
+	if (vbd->grants.xgt) {
+		int domid = ioctl(vbd->ring.fd, BLKTAP2_IOCTL_PERSISTENT, 0);
+		if (domid >= 0)
+			vbd->grants.domid = domid;
+	}
+
 	err = tapdisk_parse_disk_type(message, &path, &type);
 	if (err) {
 		EPRINTF("%s: invalid resume string %s\n", vbd->name, message);
@@ -1705,13 +2048,19 @@ tapdisk_vbd_check_ring_message(td_vbd_t *vbd)
 static void
 tapdisk_vbd_ring_event(event_id_t id, char mode, void *private)
 {
+	td_ring_t *ring;
 	td_vbd_t *vbd;
 
-	vbd = (td_vbd_t *)private;
+	ring = (td_ring_t *)private;
+	vbd  = ring->vbd;
 
-	tapdisk_vbd_pull_ring_requests(vbd);
+	tapdisk_vbd_pull_ring_requests(ring);
 	tapdisk_vbd_issue_requests(vbd);
 
+	/* control messages only come in on the first ring */
+	if (ring->queue)
+		return;
+
 	/* vbd may be destroyed after this call */
 	tapdisk_vbd_check_ring_message(vbd);
 }
@@ -30,14 +30,18 @@
 
 #include <sys/time.h>
 #include <xenctrl.h>
+#include <xengnttab.h>
 #include <xen/io/blkif.h>
 
 #include "tapdisk.h"
+#include "profile.h"
 #include "scheduler.h"
 #include "tapdisk-image.h"
 
 #define TD_VBD_MAX_RETRIES          100
 #define TD_VBD_RETRY_INTERVAL       1
+#define TD_VBD_MAX_RINGS            8
+#define TD_VBD_GRANT_BUCKETS        1024
 
 #define TD_VBD_DEAD                 0x0001
 #define TD_VBD_CLOSED               0x0002
@@ -50,7 +54,16 @@
 #define TD_VBD_RETRY_NEEDED         0x0100
 #define TD_VBD_LOG_DROPPED          0x0200
 
+/* latency stages of a request, traced when vbd->trace is set */
+#define TD_VBD_TRACE_RING           0 /* received until issued */
+#define TD_VBD_TRACE_DRIVER         1 /* issued until the images are done */
+#define TD_VBD_TRACE_RESPONSE       2 /* done until the response is pushed */
+#define TD_VBD_TRACE_TOTAL          3
+#define TD_VBD_TRACE_STAGES         4
+
 typedef struct td_ring              td_ring_t;
+typedef struct td_grant             td_grant_t;
+typedef struct td_grant_pool        td_grant_pool_t;
 typedef struct td_vbd_request       td_vbd_request_t;
 typedef struct td_vbd_driver_info   td_vbd_driver_info_t;
 typedef struct td_vbd_handle        td_vbd_t;
@@ -62,6 +75,35 @@ struct td_ring {
 	blkif_sring_t              *sring;
 	blkif_back_ring_t           fe_ring;
 	unsigned long               vstart;
+	char                       *bounce; /* persistent grant mode */
+
+	int                         queue;
+	event_id_t                  event_id;
+	td_vbd_t                   *vbd;
+};
+
+/*
+ * Grants a persistent frontend keeps reusing, mapped once and kept
+ * until the ring disconnects. Past max, grants are mapped only for
+ * the duration of the copy.
+ */
+struct td_grant {
+	uint32_t                    gref;
+	void                       *addr;
+	td_grant_t                 *next;
+};
+
+struct td_grant_pool {
+	xengnttab_handle           *xgt;
+	uint32_t                    domid;
+	int                         nr;
+	int                         max;
+	td_grant_t                 *hash[TD_VBD_GRANT_BUCKETS];
+
+	uint64_t                    hits;
+	uint64_t                    maps;
+	uint64_t                    transient;
+	uint64_t                    copied;
 };
 
 struct td_vbd_request {
@@ -75,7 +117,12 @@ struct td_vbd_request {
 	int                         num_retries;
 	struct timeval              last_try;
 
+	uint64_t                    ts_received;
+	uint64_t                    ts_issued;
+	uint64_t                    ts_completed;
+
 	td_vbd_t                   *vbd;
+	td_ring_t                  *ring;
 	struct list_head            next;
 };
 
@@ -107,16 +154,27 @@ struct td_vbd_handle {
 	struct list_head            failed_requests;
 	struct list_head            completed_requests;
 
-	td_vbd_request_t            request_list[MAX_REQUESTS];
+	td_vbd_request_t            request_list[MAX_REQUESTS *
+						 TD_VBD_MAX_RINGS];
 
+	/*
+	 * rings[0] is &ring, which also carries the control messages.
+	 * The others are the extra queues of a multi-queue frontend.
+	 */
 	td_ring_t                   ring;
-	event_id_t                  ring_event_id;
+	td_ring_t                  *rings[TD_VBD_MAX_RINGS];
+	int                         nr_rings;
+	td_grant_pool_t             grants;
 
 	td_vbd_cb_t                 callback;
 	void                       *argument;
 
 	struct list_head            next;
 
+	/* owning event loop, see tapdisk-server.c */
+	struct tapdisk_loop        *loop;
+	struct list_head            loop_next;
+
 	struct timeval              ts;
 
 	uint64_t                    received;
@@ -125,6 +183,9 @@ struct td_vbd_handle {
 	uint64_t                    secs_pending;
 	uint64_t                    retries;
 	uint64_t                    errors;
+
+	int                         trace;
+	struct profile_latency      latency[TD_VBD_TRACE_STAGES];
 };
 
 #define tapdisk_vbd_for_each_request(vreq, tmp, list)	                \
@@ -141,6 +202,15 @@ tapdisk_vbd_move_request(td_vbd_request_t *vreq, struct list_head *dest)
 	list_add_tail(&vreq->next, dest);
 }
 
+/* for whoever puts requests on new_requests, ring or not */
+static inline void
+tapdisk_vbd_trace_receive(td_vbd_t *vbd, td_vbd_request_t *vreq)
+{
+	vreq->ts_received  = (vbd->trace ? tp_now_ns() : 0);
+	vreq->ts_issued    = 0;
+	vreq->ts_completed = 0;
+}
+
 static inline void
 tapdisk_vbd_add_image(td_vbd_t *vbd, td_image_t *image)
 {
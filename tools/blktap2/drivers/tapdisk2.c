@@ -42,7 +42,15 @@
 static void
 usage(const char *app, int err)
 {
-	fprintf(stderr, "usage: %s [-D] <-u uuid> <-c control socket>\n", app);
+	fprintf(stderr, "usage: %s [-D] [-q lio|rwio|uring|uring-poll] "
+		"[-t threads] <-u uuid> <-c control socket>\n", app);
+	fprintf(stderr, "  -q selects the I/O queue, defaulting to "
+		"$TAPDISK2_QUEUE or lio\n");
+	fprintf(stderr, "  -t runs vbds on that many event loops, one thread "
+		"each, 0 for one per\n     cpu, defaulting to "
+		"$TAPDISK2_THREADS or 1\n");
+	fprintf(stderr, "  $TAPDISK2_TRACE=1 traces per-stage latencies, "
+		"logged on SIGUSR1\n");
 	exit(err);
 }
 
@@ -50,16 +58,27 @@ int
 main(int argc, char *argv[])
 {
 	char *control;
-	int c, err, nodaemon;
+	const char *queue, *threads, *plug, *trace;
+	int c, err, nodaemon, drv, loops, plug_us, plug_batch;
 
 	control  = NULL;
 	nodaemon = 0;
+	queue    = getenv("TAPDISK2_QUEUE");
+	threads  = getenv("TAPDISK2_THREADS");
+	plug     = getenv("TAPDISK2_PLUG");
+	trace    = getenv("TAPDISK2_TRACE");
 
-	while ((c = getopt(argc, argv, "s:Dh")) != -1) {
+	while ((c = getopt(argc, argv, "s:q:t:Dh")) != -1) {
 		switch (c) {
 		case 'D':
 			nodaemon = 1;
 			break;
+		case 'q':
+			queue = optarg;
+			break;
+		case 't':
+			threads = optarg;
+			break;
 		case 'h':
 			usage(argv[0], 0);
 			break;
@@ -79,6 +98,33 @@ main(int argc, char *argv[])
 	if (optind != argc)
 		usage(argv[0], EINVAL);
 
+	drv = TIO_DRV_LIO;
+	if (queue) {
+		drv = tapdisk_queue_driver(queue);
+		if (drv < 0) {
+			fprintf(stderr, "unknown I/O queue '%s'\n", queue);
+			usage(argv[0], EINVAL);
+		}
+	}
+
+	loops = 1;
+	if (threads) {
+		char *end;
+
+		loops = strtol(threads, &end, 0);
+		if (*threads == '\0' || *end != '\0' || loops < 0) {
+			fprintf(stderr, "bad thread count '%s'\n", threads);
+			usage(argv[0], EINVAL);
+		}
+	}
+
+	/* elevator window, as "usecs[,batch]" */
+	plug_us = plug_batch = 0;
+	if (plug && sscanf(plug, "%d,%d", &plug_us, &plug_batch) < 1) {
+		fprintf(stderr, "bad elevator setting '%s'\n", plug);
+		usage(argv[0], EINVAL);
+	}
+
 	if (chdir("/")) {
 		DPRINTF("failed to chdir(/): %d\n", errno);
 		err = 1;
@@ -93,6 +139,11 @@ main(int argc, char *argv[])
 		goto out;
 	}
 
+	tapdisk_server_set_queue_driver(drv);
+	tapdisk_server_set_loops(loops);
+	tapdisk_server_set_plug(plug_us, plug_batch);
+	tapdisk_server_set_trace(trace && atoi(trace));
+
 	if (!nodaemon) {
 		err = daemon(0, 1);
 		if (err) {
@@ -42,6 +42,8 @@
 #define BLKTAP2_IOCTL_PAUSE            204
 #define BLKTAP2_IOCTL_REOPEN           205
 #define BLKTAP2_IOCTL_RESUME           206
+#define BLKTAP2_IOCTL_MAX_QUEUES       207
+#define BLKTAP2_IOCTL_PERSISTENT       208
 
 #define BLKTAP2_SYSFS_DIR              "/sys/class/blktap2"
 #define BLKTAP2_CONTROL_NAME           "blktap-control"
@@ -0,0 +1,104 @@
+/* Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef _TAPDISK_CACHE_H_
+#define _TAPDISK_CACHE_H_
+
+#include <inttypes.h>
+
+/*
+ * Host-wide read cache for shared parent images, kept in a POSIX shared
+ * memory segment that every tapdisk process maps.
+ *
+ * The segment is a set-associative table of 4K pages. A page is keyed
+ * by the identity of its image and by its page index. Keys hash to a
+ * set of TAPDISK_CACHE_WAYS slots. When the set is full, a CLOCK sweep
+ * evicts the least recently used slot. The total size of the segment
+ * is the host-wide memory budget.
+ *
+ * Lookups take no locks. Each slot has a sequence count, which is odd
+ * while a writer owns the slot. A reader copies the key and data out,
+ * and keeps the copy only if the count was even and unchanged through
+ * the copy. Writers claim a slot with a compare-and-swap on the count.
+ */
+
+#define TAPDISK_CACHE_SHM_NAME       "/tapdisk-cache"
+#define TAPDISK_CACHE_MAGIC          0x74646321 /* "tdc!" */
+#define TAPDISK_CACHE_VERSION        1
+
+#define TAPDISK_CACHE_PAGE_SHIFT     12
+#define TAPDISK_CACHE_PAGE_SIZE      (1 << TAPDISK_CACHE_PAGE_SHIFT)
+#define TAPDISK_CACHE_WAYS           8
+
+/* default budget, TAPDISK_CACHE_SIZE (MB) overrides it at creation */
+#define TAPDISK_CACHE_DEFAULT_MB     256
+
+typedef struct tapdisk_cache_stats   tapdisk_cache_stats_t;
+typedef struct tapdisk_cache_slot    tapdisk_cache_slot_t;
+typedef struct tapdisk_cache_header  tapdisk_cache_header_t;
+
+struct tapdisk_cache_stats {
+	uint64_t                     lookups;   /* pages looked up */
+	uint64_t                     hits;
+	uint64_t                     inserts;
+	uint64_t                     evictions;
+	uint64_t                     races;     /* lost to a writer */
+};
+
+struct tapdisk_cache_slot {
+	uint32_t                     seq;
+	uint32_t                     ref;       /* CLOCK reference bit */
+	uint64_t                     disk;      /* 0 if the slot is free */
+	uint64_t                     page;
+};
+
+struct tapdisk_cache_header {
+	uint32_t                     magic;     /* written last */
+	uint32_t                     version;
+	uint32_t                     sets;      /* power of two */
+	uint32_t                     ways;
+	uint64_t                     size;      /* of the whole segment */
+	uint64_t                     data;      /* offset of page data */
+	tapdisk_cache_stats_t        stats;
+	uint32_t                     hands[];   /* CLOCK hand of each set */
+};
+
+/* the slots of all sets follow the hands, page data follows the slots */
+static inline size_t
+tapdisk_cache_slots_offset(uint32_t sets)
+{
+	return sizeof(tapdisk_cache_header_t) +
+		((sets * sizeof(uint32_t) + 63) & ~63UL);
+}
+
+static inline tapdisk_cache_slot_t *
+tapdisk_cache_slots(tapdisk_cache_header_t *h)
+{
+	return (tapdisk_cache_slot_t *)((char *)h +
+					tapdisk_cache_slots_offset(h->sets));
+}
+
+#endif
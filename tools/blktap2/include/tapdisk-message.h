@@ -50,6 +50,7 @@ typedef struct tapdisk_message_string    tapdisk_message_string_t;
 typedef struct tapdisk_message_response  tapdisk_message_response_t;
 typedef struct tapdisk_message_minors    tapdisk_message_minors_t;
 typedef struct tapdisk_message_list      tapdisk_message_list_t;
+typedef struct tapdisk_message_loop      tapdisk_message_loop_t;
 
 struct tapdisk_message_params {
 	tapdisk_message_flag_t           flags;
@@ -88,6 +89,17 @@ struct tapdisk_message_list {
 	char                             path[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
 };
 
+struct tapdisk_message_loop {
+	int                              count;
+	int                              id;
+	uint32_t                         vbds;
+	uint64_t                         busy_us;
+	uint64_t                         idle_us;
+	uint64_t                         iterations;
+	uint64_t                         tiocbs; /* requests, before merging */
+	uint64_t                         iocbs;  /* and after */
+};
+
 struct tapdisk_message {
 	uint16_t                         type;
 	uint16_t                         cookie;
@@ -100,6 +112,7 @@ struct tapdisk_message {
 		tapdisk_message_minors_t minors;
 		tapdisk_message_response_t response;
 		tapdisk_message_list_t   list;
+		tapdisk_message_loop_t   loop;
 	} u;
 };
 
@@ -126,6 +139,8 @@ enum tapdisk_message_id {
 	TAPDISK_MESSAGE_LIST_RSP,
 	TAPDISK_MESSAGE_FORCE_SHUTDOWN,
 	TAPDISK_MESSAGE_EXIT,
+	TAPDISK_MESSAGE_LOOPS,
+	TAPDISK_MESSAGE_LOOPS_RSP,
 };
 
 static inline char *
@@ -195,6 +210,12 @@ tapdisk_message_name(enum tapdisk_message_id id)
 	case TAPDISK_MESSAGE_EXIT:
 		return "exit";
 
+	case TAPDISK_MESSAGE_LOOPS:
+		return "loops";
+
+	case TAPDISK_MESSAGE_LOOPS_RSP:
+		return "loops response";
+
 	default:
 		return "unknown";
 	}
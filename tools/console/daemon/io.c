@@ -28,6 +28,7 @@
 #include <xen/grant_table.h>
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <string.h>
 #include <poll.h>
@@ -43,6 +44,7 @@
 #include <util.h>
 #elif defined(__linux__)
 #include <pty.h>
+#include <sys/epoll.h>
 #elif defined(__sun__)
 #include <stropts.h>
 #elif defined(__FreeBSD__)
@@ -61,6 +63,12 @@
 /* Duration of each time period in ms */
 #define RATE_LIMIT_PERIOD 200
 
+/* How many ready fds and pending ports are handled at once */
+#define IO_BATCH 64
+
+/* Buffered guest log data is written out once there is that much */
+#define LOG_FLUSH_SIZE (16 * 1024)
+
 extern int log_reload;
 extern int log_guest;
 extern int log_hv;
@@ -68,6 +76,7 @@ extern int log_time_hv;
 extern int log_time_guest;
 extern char *log_dir;
 extern int discard_overflowed_data;
+extern int log_flush_interval;
 
 static int log_time_hv_needts = 1;
 static int log_time_guest_needts = 1;
@@ -75,9 +84,49 @@ static int log_hv_fd = -1;
 
 static xengnttab_handle *xgt_handle = NULL;
 
-static struct pollfd  *fds;
+/*
+ * One event channel handle is shared by all consoles and the hypervisor
+ * log, so that a single fd tells about all of them.  Pending ports are
+ * looked up in port_consoles.
+ */
+static xenevtchn_handle *xce_handle = NULL;
+static xenevtchn_port_or_error_t log_hv_evtchn = -1;
+static struct console **port_consoles;
+static unsigned int nr_port_consoles;
+/* Pending ports read at once: only 1 if the fd can't be non-blocking. */
+static int evtchn_batch = 1;
+
+/*
+ * The fds to wait on are registered as io_watches, to epoll where it is
+ * available, so that an iteration of the main loop costs in proportion
+ * to the number of ready fds rather than to the number of consoles.
+ * Elsewhere, an array for poll() is kept up to date in place.
+ *
+ * Handlers may change any watch, but the structures of watches must stay
+ * around until io_wait() returns.
+ */
+struct io_watch {
+	int fd;
+	short events;
+	void (*handler)(struct io_watch *w, short revents);
+#ifndef __linux__
+	int idx;	/* Slot in fds, or -1 */
+	short revents;
+#endif
+};
+
+#ifdef __linux__
+static int epoll_fd = -1;
+#else
+static struct pollfd *fds;
+static struct io_watch **fd_watches;
+static struct io_watch **ready_watches;
 static unsigned int current_array_size;
 static unsigned int nr_fds;
+#endif
+
+/* Set by handlers to terminate the main loop. */
+static bool io_failed;
 
 #define ROUNDUP(_x,_w) (((unsigned long)(_x)+(1UL<<(_w))-1) & ~((1UL<<(_w))-1))
 
@@ -92,17 +141,24 @@ struct buffer {
 struct console {
 	char *ttyname;
 	int master_fd;
-	int master_pollfd_idx;
+	struct io_watch tty_watch;
 	int slave_fd;
 	int log_fd;
 	struct buffer buffer;
+	/* Log data not written yet, if log_flush_interval is set */
+	struct buffer log_buffer;
+	bool log_pending;
+	struct console *next_log_pending;
 	char *xspath;
 	char *log_suffix;
 	int ring_ref;
-	xenevtchn_handle *xce_handle;
-	int xce_pollfd_idx;
 	int event_count;
 	long long next_period;
+	/* Over RATE_LIMIT_ALLOWANCE, until next_period */
+	bool throttled;
+	struct console *next_throttled;
+	/* local_port got an event and was not unmasked yet */
+	bool evtchn_masked;
 	xenevtchn_port_or_error_t local_port;
 	xenevtchn_port_or_error_t remote_port;
 	struct xencons_interface *interface;
@@ -149,6 +205,13 @@ struct domain {
 };
 
 static struct domain *dom_head;
+/* Some domain in dom_head is dead and must be cleaned up. */
+static bool domains_dead;
+
+static struct console *throttled_head;
+static struct console *log_pending_head;
+/* When to write out the log data of log_pending_head, or 0 */
+static long long next_log_flush;
 
 typedef void (*VOID_ITER_FUNC_ARG1)(struct console *);
 typedef int (*INT_ITER_FUNC_ARG1)(struct console *);
@@ -227,6 +290,205 @@ static inline int console_iter_int_arg3(struct domain *d,
 	return ret;
 }
 
+static void io_watch_init(struct io_watch *w,
+			  void (*handler)(struct io_watch *w, short revents))
+{
+	w->fd = -1;
+	w->events = 0;
+	w->handler = handler;
+#ifndef __linux__
+	w->idx = -1;
+#endif
+}
+
+#ifdef __linux__
+static int io_init(void)
+{
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1) {
+		dolog(LOG_ERR, "Failed to create epoll fd: %d (%s)",
+		      errno, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void io_fini(void)
+{
+	if (epoll_fd != -1)
+		close(epoll_fd);
+	epoll_fd = -1;
+}
+
+/* Watch fd for events (POLL* flags), or nothing if it is -1 or 0. */
+static void io_watch_set(struct io_watch *w, int fd, short events)
+{
+	struct epoll_event ev = { .data.ptr = w };
+
+	if (fd == -1)
+		events = 0;
+	if (w->fd == fd && w->events == events)
+		return;
+
+	if (w->fd != -1 && (w->fd != fd || !events)) {
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, w->fd, NULL) == -1)
+			dolog(LOG_ERR, "Failed to unwatch fd %d: %d (%s)",
+			      w->fd, errno, strerror(errno));
+		w->fd = -1;
+		w->events = 0;
+	}
+
+	if (!events)
+		return;
+
+	ev.events = ((events & POLLIN) ? EPOLLIN : 0) |
+		    ((events & POLLPRI) ? EPOLLPRI : 0) |
+		    ((events & POLLOUT) ? EPOLLOUT : 0);
+	if (epoll_ctl(epoll_fd, w->fd == -1 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+		      fd, &ev) == -1) {
+		dolog(LOG_ERR, "Failed to watch fd %d: %d (%s)",
+		      fd, errno, strerror(errno));
+		return;
+	}
+
+	w->fd = fd;
+	w->events = events;
+}
+
+/* Wait for up to timeout ms, or forever if -1, and run the handlers. */
+static int io_wait(int timeout)
+{
+	struct epoll_event ev[IO_BATCH];
+	int i, ret;
+
+	ret = epoll_wait(epoll_fd, ev, IO_BATCH, timeout);
+
+	for (i = 0; i < ret; i++) {
+		struct io_watch *w = ev[i].data.ptr;
+		short revents =
+			((ev[i].events & EPOLLIN) ? POLLIN : 0) |
+			((ev[i].events & EPOLLPRI) ? POLLPRI : 0) |
+			((ev[i].events & EPOLLOUT) ? POLLOUT : 0) |
+			((ev[i].events & EPOLLERR) ? POLLERR : 0) |
+			((ev[i].events & EPOLLHUP) ? POLLHUP : 0);
+
+		/* Unwatched by an earlier handler */
+		if (w->fd != -1)
+			w->handler(w, revents);
+	}
+
+	return ret;
+}
+#else
+static int io_init(void)
+{
+	return 0;
+}
+
+static void io_fini(void)
+{
+	free(fds);
+	free(fd_watches);
+	free(ready_watches);
+	fds = NULL;
+	fd_watches = NULL;
+	ready_watches = NULL;
+	current_array_size = 0;
+	nr_fds = 0;
+}
+
+/* Watch fd for events (POLL* flags), or nothing if it is -1 or 0. */
+static void io_watch_set(struct io_watch *w, int fd, short events)
+{
+	if (fd == -1)
+		events = 0;
+
+	if (!events) {
+		if (w->idx != -1 && w->idx != --nr_fds) {
+			/* Move the last slot into the freed one */
+			fds[w->idx] = fds[nr_fds];
+			fd_watches[w->idx] = fd_watches[nr_fds];
+			fd_watches[w->idx]->idx = w->idx;
+		}
+		w->idx = -1;
+		w->fd = -1;
+		w->events = 0;
+		return;
+	}
+
+	if (w->idx == -1) {
+		if (current_array_size < nr_fds + 1) {
+			struct pollfd *new_fds;
+			struct io_watch **new_watches;
+			unsigned long newsize;
+
+			/* Round up to 2^8 boundary, in practice this just
+			 * make newsize larger than current_array_size.
+			 */
+			newsize = ROUNDUP(nr_fds + 1, 8);
+
+			new_fds = realloc(fds, sizeof(*fds) * newsize);
+			if (!new_fds)
+				goto fail;
+			fds = new_fds;
+			new_watches = realloc(fd_watches,
+					      sizeof(*fd_watches) * newsize);
+			if (!new_watches)
+				goto fail;
+			fd_watches = new_watches;
+			new_watches = realloc(ready_watches,
+					      sizeof(*ready_watches) * newsize);
+			if (!new_watches)
+				goto fail;
+			ready_watches = new_watches;
+
+			current_array_size = newsize;
+		}
+		w->idx = nr_fds++;
+		fd_watches[w->idx] = w;
+	}
+
+	fds[w->idx].fd = fd;
+	fds[w->idx].events = events;
+	w->fd = fd;
+	w->events = events;
+
+	return;
+fail:
+	dolog(LOG_ERR, "realloc failed, ignoring fd %d\n", fd);
+}
+
+/* Wait for up to timeout ms, or forever if -1, and run the handlers. */
+static int io_wait(int timeout)
+{
+	unsigned int i, nr_ready = 0;
+	int ret;
+
+	ret = poll(fds, nr_fds, timeout);
+	if (ret <= 0)
+		return ret;
+
+	/* Handlers may move the slots around: note the ready ones first */
+	for (i = 0; i < nr_fds; i++) {
+		if (!fds[i].revents)
+			continue;
+		fd_watches[i]->revents = fds[i].revents;
+		ready_watches[nr_ready++] = fd_watches[i];
+	}
+
+	for (i = 0; i < nr_ready; i++) {
+		struct io_watch *w = ready_watches[i];
+
+		/* Unwatched by an earlier handler */
+		if (w->fd != -1)
+			w->handler(w, w->revents);
+	}
+
+	return ret;
+}
+#endif
+
 static int write_all(int fd, const char* buf, size_t len)
 {
 	while (len) {
@@ -242,8 +504,39 @@ static int write_all(int fd, const char* buf, size_t len)
 	return 0;
 }
 
-static int write_with_timestamp(int fd, const char *data, size_t sz,
-				int *needts)
+static long long monotonic_ms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return -1;
+
+	return ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+/* Write to fd, or append to buf if it is not NULL. */
+static int log_write(int fd, struct buffer *buf, const char *data, size_t len)
+{
+	if (buf == NULL)
+		return write_all(fd, data, len);
+
+	if ((buf->capacity - buf->size) < len) {
+		buf->capacity = buf->size + len + LOG_FLUSH_SIZE;
+		buf->data = realloc(buf->data, buf->capacity);
+		if (buf->data == NULL) {
+			dolog(LOG_ERR, "Memory allocation failed");
+			exit(ENOMEM);
+		}
+	}
+
+	memcpy(buf->data + buf->size, data, len);
+	buf->size += len;
+
+	return 0;
+}
+
+static int write_with_timestamp(int fd, struct buffer *buf,
+				const char *data, size_t sz, int *needts)
 {
 	char ts[32];
 	time_t now = time(NULL);
@@ -257,8 +550,8 @@ static int write_with_timestamp(int fd, const char *data, size_t sz,
 		if (!found_nl)
 			nl = last_byte;
 
-		if ((*needts && write_all(fd, ts, tslen))
-		    || write_all(fd, data, nl + 1 - data))
+		if ((*needts && log_write(fd, buf, ts, tslen))
+		    || log_write(fd, buf, data, nl + 1 - data))
 			return -1;
 
 		*needts = found_nl;
@@ -273,6 +566,55 @@ static int write_with_timestamp(int fd, const char *data, size_t sz,
 	return 0;
 }
 
+static void console_flush_log(struct console *con)
+{
+	struct buffer *buffer = &con->log_buffer;
+
+	if (buffer->size && con->log_fd != -1 &&
+	    write_all(con->log_fd, buffer->data, buffer->size) < 0)
+		dolog(LOG_ERR, "Write to log failed "
+		      "on domain %d: %d (%s)\n",
+		      con->d->domid, errno, strerror(errno));
+	buffer->size = 0;
+
+	if (con->log_pending) {
+		struct console **pp;
+
+		for (pp = &log_pending_head; *pp != con;
+		     pp = &(*pp)->next_log_pending)
+			;
+		*pp = con->next_log_pending;
+		con->log_pending = false;
+	}
+}
+
+/* Write out the log data of con later, or now if there is a lot. */
+static void console_queue_log(struct console *con)
+{
+	if (con->log_buffer.size >= LOG_FLUSH_SIZE) {
+		console_flush_log(con);
+		return;
+	}
+
+	if (con->log_pending || !con->log_buffer.size)
+		return;
+
+	con->log_pending = true;
+	con->next_log_pending = log_pending_head;
+	log_pending_head = con;
+
+	if (!next_log_flush)
+		next_log_flush = monotonic_ms() + log_flush_interval;
+}
+
+static void flush_logs(void)
+{
+	while (log_pending_head)
+		console_flush_log(log_pending_head);
+
+	next_log_flush = 0;
+}
+
 static inline bool buffer_available(struct console *con)
 {
 	if (discard_overflowed_data ||
@@ -307,13 +649,20 @@ static void buffer_append(struct console *con)
 		}
 	}
 
-	while (cons != prod)
-		buffer->data[buffer->size++] = intf->out[
-			MASK_XENCONS_IDX(cons++, intf->out)];
+	/* At most two chunks, the ring wrapping around in between */
+	while (cons != prod) {
+		XENCONS_RING_IDX idx = MASK_XENCONS_IDX(cons, intf->out);
+		XENCONS_RING_IDX chunk = MIN(prod - cons,
+					     sizeof(intf->out) - idx);
+
+		memcpy(buffer->data + buffer->size, intf->out + idx, chunk);
+		buffer->size += chunk;
+		cons += chunk;
+	}
 
 	xen_mb();
 	intf->out_cons = cons;
-	xenevtchn_notify(con->xce_handle, con->local_port);
+	xenevtchn_notify(xce_handle, con->local_port);
 
 	/* Get the data to the logfile as early as possible because if
 	 * no one is listening on the console pty then it will fill up
@@ -321,14 +670,17 @@ static void buffer_append(struct console *con)
 	 */
 	if (con->log_fd != -1) {
 		int logret;
+		struct buffer *logbuf = log_flush_interval ?
+					&con->log_buffer : NULL;
+
 		if (log_time_guest) {
 			logret = write_with_timestamp(
-				con->log_fd,
+				con->log_fd, logbuf,
 				buffer->data + buffer->size - size,
 				size, &log_time_guest_needts);
 		} else {
-			logret = write_all(
-				con->log_fd,
+			logret = log_write(
+				con->log_fd, logbuf,
 				buffer->data + buffer->size - size,
 				size);
 		}
@@ -336,6 +688,8 @@ static void buffer_append(struct console *con)
 			dolog(LOG_ERR, "Write to log failed "
 			      "on domain %d: %d (%s)\n",
 			      dom->domid, errno, strerror(errno));
+		if (logbuf)
+			console_queue_log(con);
 	}
 
 	if (discard_overflowed_data && buffer->max_capacity &&
@@ -403,7 +757,7 @@ static int create_hv_log(void)
 		dolog(LOG_ERR, "Failed to open log %s: %d (%s)",
 		      logfile, errno, strerror(errno));
 	if (fd != -1 && log_time_hv) {
-		if (write_with_timestamp(fd, "Logfile Opened\n",
+		if (write_with_timestamp(fd, NULL, "Logfile Opened\n",
 					 strlen("Logfile Opened\n"),
 					 &log_time_hv_needts) < 0) {
 			dolog(LOG_ERR, "Failed to log opening timestamp "
@@ -452,7 +806,7 @@ static int create_console_log(struct console *con)
 		dolog(LOG_ERR, "Failed to open log %s: %d (%s)",
 		      logfile, errno, strerror(errno));
 	if (fd != -1 && log_time_guest) {
-		if (write_with_timestamp(fd, "Logfile Opened\n",
+		if (write_with_timestamp(fd, NULL, "Logfile Opened\n",
 					 strlen("Logfile Opened\n"),
 					 &log_time_guest_needts) < 0) {
 			dolog(LOG_ERR, "Failed to log opening timestamp "
@@ -465,9 +819,13 @@ static int create_console_log(struct console *con)
 	return fd;
 }
 
+static void console_update_tty(struct console *con);
+static void handle_console_tty(struct io_watch *w, short revents);
+
 static void console_close_tty(struct console *con)
 {
 	if (con->master_fd != -1) {
+		io_watch_set(&con->tty_watch, -1, 0);
 		close(con->master_fd);
 		con->master_fd = -1;
 	}
@@ -606,6 +964,8 @@ static int console_create_tty(struct console *con)
 	if (fcntl(con->master_fd, F_SETFL, O_NONBLOCK) == -1)
 		goto out;
 
+	console_update_tty(con);
+
 	return 1;
 out:
 	console_close_tty(con);
@@ -658,6 +1018,49 @@ static void console_unmap_interface(struct console *con)
 	con->interface = NULL;
 	con->ring_ref = -1;
 }
+
+static void console_close_evtchn(struct console *con)
+{
+	if (con->local_port != -1) {
+		(void)xenevtchn_unbind(xce_handle, con->local_port);
+		port_consoles[con->local_port] = NULL;
+	}
+
+	con->local_port = -1;
+	con->remote_port = -1;
+	con->evtchn_masked = false;
+
+	if (con->throttled) {
+		struct console **pp;
+
+		for (pp = &throttled_head; *pp != con;
+		     pp = &(*pp)->next_throttled)
+			;
+		*pp = con->next_throttled;
+		con->throttled = false;
+	}
+}
+
+static void console_set_port(struct console *con,
+			     xenevtchn_port_or_error_t port)
+{
+	if (port >= nr_port_consoles) {
+		unsigned int nr = ROUNDUP(port + 1, 8);
+		struct console **p = realloc(port_consoles, nr * sizeof(*p));
+
+		if (p == NULL) {
+			dolog(LOG_ERR, "Memory allocation failed");
+			exit(ENOMEM);
+		}
+		memset(p + nr_port_consoles, 0,
+		       (nr - nr_port_consoles) * sizeof(*p));
+		port_consoles = p;
+		nr_port_consoles = nr;
+	}
+
+	port_consoles[port] = con;
+	con->local_port = port;
+}
  
 static int console_create_ring(struct console *con)
 {
@@ -723,38 +1126,20 @@ static int console_create_ring(struct console *con)
 			goto out;
 	}
 
-	con->local_port = -1;
-	con->remote_port = -1;
-	if (con->xce_handle != NULL)
-		xenevtchn_close(con->xce_handle);
-
-	/* Opening evtchn independently for each console is a bit
-	 * wasteful, but that's how the code is structured... */
-	con->xce_handle = xenevtchn_open(NULL, 0);
-	if (con->xce_handle == NULL) {
-		err = errno;
-		goto out;
-	}
- 
-	rc = xenevtchn_bind_interdomain(con->xce_handle,
-		dom->domid, remote_port);
+	console_close_evtchn(con);
 
+	rc = xenevtchn_bind_interdomain(xce_handle, dom->domid, remote_port);
 	if (rc == -1) {
 		err = errno;
-		xenevtchn_close(con->xce_handle);
-		con->xce_handle = NULL;
 		goto out;
 	}
-	con->local_port = rc;
+	console_set_port(con, rc);
 	con->remote_port = remote_port;
 
 	if (con->master_fd == -1) {
 		if (!console_create_tty(con)) {
 			err = errno;
-			xenevtchn_close(con->xce_handle);
-			con->xce_handle = NULL;
-			con->local_port = -1;
-			con->remote_port = -1;
+			console_close_evtchn(con);
 			goto out;
 		}
 	}
@@ -801,13 +1186,12 @@ static int console_init(struct console *con, struct domain *dom, void **data)
 	}
 
 	con->master_fd = -1;
-	con->master_pollfd_idx = -1;
+	io_watch_init(&con->tty_watch, handle_console_tty);
 	con->slave_fd = -1;
 	con->log_fd = -1;
 	con->ring_ref = -1;
 	con->local_port = -1;
 	con->remote_port = -1;
-	con->xce_pollfd_idx = -1;
 	con->next_period = ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000) + RATE_LIMIT_PERIOD;
 	con->d = dom;
 	con->ttyname = (*con_type)->ttyname;
@@ -895,6 +1279,10 @@ static void remove_domain(struct domain *dom)
 
 static void console_cleanup(struct console *con)
 {
+	console_flush_log(con);
+	free(con->log_buffer.data);
+	con->log_buffer.data = NULL;
+
 	if (con->log_fd != -1) {
 		close(con->log_fd);
 		con->log_fd = -1;
@@ -916,17 +1304,10 @@ static void cleanup_domain(struct domain *d)
 	remove_domain(d);
 }
 
-static void console_close_evtchn(struct console *con)
-{
-	if (con->xce_handle != NULL)
-		xenevtchn_close(con->xce_handle);
-
-	con->xce_handle = NULL;
-}
-
 static void shutdown_domain(struct domain *d)
 {
 	d->is_dead = true;
+	domains_dead = true;
 	watch_domain(d, false);
 	console_iter_void_arg1(d, console_unmap_interface);
 	console_iter_void_arg1(d, console_close_evtchn);
@@ -955,6 +1336,10 @@ static void enum_domains(void)
 			dom->last_seen = enum_pass;
 		domid = dominfo.domid + 1;
 	}
+
+	for (dom = dom_head; dom; dom = dom->next)
+		if (dom->last_seen != enum_pass && !dom->is_dead)
+			shutdown_domain(dom);
 }
 
 static int ring_free_bytes(struct console *con)
@@ -973,6 +1358,30 @@ static int ring_free_bytes(struct console *con)
 	return (sizeof(intf->in) - space);
 }
 
+/*
+ * Watch the tty for what can be done: reading when there is room in the
+ * ring, writing when there is data in the buffer.  To be called whenever
+ * either may have changed.
+ */
+static void console_update_tty(struct console *con)
+{
+	short events = 0;
+
+	if (con->master_fd != -1) {
+		if (!con->d->is_dead && con->interface &&
+		    ring_free_bytes(con))
+			events |= POLLIN;
+
+		if (!buffer_empty(&con->buffer))
+			events |= POLLOUT;
+
+		if (events)
+			events |= POLLPRI;
+	}
+
+	io_watch_set(&con->tty_watch, con->master_fd, events);
+}
+
 static void console_handle_broken_tty(struct console *con, int recreate)
 {
 	console_close_tty(con);
@@ -987,9 +1396,9 @@ static void console_handle_broken_tty(struct console *con, int recreate)
 static void handle_tty_read(struct console *con)
 {
 	ssize_t len = 0;
-	char msg[80];
-	int i;
 	struct xencons_interface *intf = con->interface;
+	char msg[sizeof(intf->in)];
+	int i;
 	struct domain *dom = con->d;
 	XENCONS_RING_IDX prod;
 
@@ -1000,9 +1409,6 @@ static void handle_tty_read(struct console *con)
 	if (len == 0)
 		return;
 
-	if (len > sizeof(msg))
-		len = sizeof(msg);
-
 	len = read(con->master_fd, msg, len);
 	/*
 	 * Note: on Solaris, len == 0 means the slave closed, and this
@@ -1019,13 +1425,24 @@ static void handle_tty_read(struct console *con)
 		}
 		xen_wmb();
 		intf->in_prod = prod;
-		xenevtchn_notify(con->xce_handle, con->local_port);
+		xenevtchn_notify(xce_handle, con->local_port);
 	} else {
 		console_close_tty(con);
 		shutdown_domain(dom);
 	}
 }
 
+/* Unmask the port of con unless it must wait for the tty or a period. */
+static void console_evtchn_unmask(struct console *con)
+{
+	if (!con->evtchn_masked || con->throttled ||
+	    !buffer_available(con) || !console_enabled(con))
+		return;
+
+	(void)xenevtchn_unmask(xce_handle, con->local_port);
+	con->evtchn_masked = false;
+}
+
 static void handle_tty_write(struct console *con)
 {
 	ssize_t len;
@@ -1042,68 +1459,85 @@ static void handle_tty_write(struct console *con)
 		console_handle_broken_tty(con, domain_is_valid(dom->domid));
 	} else {
 		buffer_advance(&con->buffer, len);
+		console_evtchn_unmask(con);
 	}
 }
 
-static void console_evtchn_unmask(struct console *con, void *data)
+static void handle_console_tty(struct io_watch *w, short revents)
 {
-	long long now = *(long long *)data;
+	struct console *con = (struct console *)
+		((char *)w - offsetof(struct console, tty_watch));
+
+	if (revents & ~(POLLIN|POLLOUT|POLLPRI))
+		console_handle_broken_tty(con, domain_is_valid(con->d->domid));
+	else {
+		if (revents & POLLIN)
+			handle_tty_read(con);
+		if ((revents & POLLOUT) && con->master_fd != -1)
+			handle_tty_write(con);
+	}
 
-	if (!console_enabled(con))
-		return;
+	console_update_tty(con);
+}
 
-	/* CS 16257:955ee4fa1345 introduces a 5ms fuzz
-	 * for select(), it is not clear poll() has
-	 * similar behavior (returning a couple of ms
-	 * sooner than requested) as well. Just leave
-	 * the fuzz here. Remove it with a separate
-	 * patch if necessary */
-	if ((now+5) > con->next_period) {
-		con->next_period = now + RATE_LIMIT_PERIOD;
-		if (con->event_count >= RATE_LIMIT_ALLOWANCE)
-			(void)xenevtchn_unmask(con->xce_handle, con->local_port);
-		con->event_count = 0;
+/*
+ * Give the consoles whose period is over their new allowance.  Returns
+ * when the next period of the remaining throttled consoles ends, or 0.
+ */
+static long long handle_throttled(long long now)
+{
+	struct console **pp = &throttled_head, *con;
+	long long next_timeout = 0;
+
+	while ((con = *pp) != NULL) {
+		/* CS 16257:955ee4fa1345 introduces a 5ms fuzz
+		 * for select(), it is not clear poll() has
+		 * similar behavior (returning a couple of ms
+		 * sooner than requested) as well. Just leave
+		 * the fuzz here. Remove it with a separate
+		 * patch if necessary */
+		if ((now+5) > con->next_period) {
+			*pp = con->next_throttled;
+			con->throttled = false;
+			con->event_count = 0;
+			con->next_period = now + RATE_LIMIT_PERIOD;
+			console_evtchn_unmask(con);
+			continue;
+		}
+
+		if (!next_timeout || con->next_period < next_timeout)
+			next_timeout = con->next_period;
+		pp = &con->next_throttled;
 	}
+
+	return next_timeout;
 }
 
-static void handle_ring_read(struct console *con)
+static void handle_ring_read(struct console *con, long long now)
 {
-	xenevtchn_port_or_error_t port;
-
 	if (con->d->is_dead)
 		return;
 
-	if ((port = xenevtchn_pending(con->xce_handle)) == -1)
-		return;
+	/* The port is masked until we have dealt with the event. */
+	con->evtchn_masked = true;
 
-	if (port != con->local_port) {
-		dolog(LOG_ERR,
-		      "Event received for invalid port %d, Expected port is %d\n",
-		      port, con->local_port);
-		return;
+	if ((now+5) > con->next_period) {
+		con->next_period = now + RATE_LIMIT_PERIOD;
+		con->event_count = 0;
 	}
-
 	con->event_count++;
 
 	buffer_append(con);
 
-	if (con->event_count < RATE_LIMIT_ALLOWANCE)
-		(void)xenevtchn_unmask(con->xce_handle, port);
-}
-
-static void handle_console_ring(struct console *con)
-{
-	if (con->event_count < RATE_LIMIT_ALLOWANCE) {
-		if (con->xce_handle != NULL &&
-		    con->xce_pollfd_idx != -1 &&
-		    !(fds[con->xce_pollfd_idx].revents &
-		      ~(POLLIN|POLLOUT|POLLPRI)) &&
-		    (fds[con->xce_pollfd_idx].revents &
-		     POLLIN))
-			handle_ring_read(con);
+	if (con->event_count >= RATE_LIMIT_ALLOWANCE) {
+		con->throttled = true;
+		con->next_throttled = throttled_head;
+		throttled_head = con;
 	}
 
-	con->xce_pollfd_idx = -1;
+	console_evtchn_unmask(con);
+	/* The guest may also have consumed input. */
+	console_update_tty(con);
 }
 
 static void handle_xs(void)
@@ -1130,16 +1564,12 @@ static void handle_xs(void)
 	free(vec);
 }
 
-static void handle_hv_logs(xenevtchn_handle *xce_handle, bool force)
+static void handle_hv_logs(void)
 {
 	static char buffer[1024*16];
 	char *bufptr = buffer;
 	unsigned int size;
 	static uint32_t index = 0;
-	xenevtchn_port_or_error_t port = -1;
-
-	if (!force && ((port = xenevtchn_pending(xce_handle)) == -1))
-		return;
 
 	do
 	{
@@ -1151,7 +1581,7 @@ static void handle_hv_logs(xenevtchn_handle *xce_handle, bool force)
 			break;
 
 		if (log_time_hv)
-			logret = write_with_timestamp(log_hv_fd, buffer, size,
+			logret = write_with_timestamp(log_hv_fd, NULL, buffer, size,
 						      &log_time_hv_needts);
 		else
 			logret = write_all(log_hv_fd, buffer, size);
@@ -1160,14 +1590,60 @@ static void handle_hv_logs(xenevtchn_handle *xce_handle, bool force)
 			dolog(LOG_ERR, "Failed to write hypervisor log: "
 				       "%d (%s)", errno, strerror(errno));
 	} while (size == sizeof(buffer));
+}
 
-	if (port != -1)
-		(void)xenevtchn_unmask(xce_handle, port);
+static void handle_xs_watch(struct io_watch *w, short revents)
+{
+	if (revents & ~(POLLIN|POLLOUT|POLLPRI)) {
+		dolog(LOG_ERR,
+		      "Failure in poll xs_handle: %d (%s)",
+		      errno, strerror(errno));
+		io_failed = true;
+	} else if (revents & POLLIN)
+		handle_xs();
+}
+
+/* Deal with a batch of the pending ports of all consoles. */
+static void handle_evtchn(struct io_watch *w, short revents)
+{
+	xenevtchn_port_or_error_t port;
+	struct console *con;
+	long long now = monotonic_ms();
+	int i;
+
+	if (revents & ~(POLLIN|POLLOUT|POLLPRI)) {
+		dolog(LOG_ERR,
+		      "Failure in poll xce_handle: %d (%s)",
+		      errno, strerror(errno));
+		io_failed = true;
+		return;
+	}
+
+	for (i = 0; i < evtchn_batch; i++) {
+		if ((port = xenevtchn_pending(xce_handle)) == -1)
+			break;
+
+		if (log_hv && port == log_hv_evtchn) {
+			handle_hv_logs();
+			(void)xenevtchn_unmask(xce_handle, port);
+			continue;
+		}
+
+		con = port < nr_port_consoles ? port_consoles[port] : NULL;
+		if (con == NULL) {
+			dolog(LOG_ERR,
+			      "Event received for invalid port %d\n", port);
+			continue;
+		}
+
+		handle_ring_read(con, now);
+	}
 }
 
 static void console_open_log(struct console *con)
 {
 	if (console_enabled(con)) {
+		console_flush_log(con);
 		if (con->log_fd != -1)
 			close(con->log_fd);
 		con->log_fd = create_console_log(con);
@@ -1190,116 +1666,31 @@ static void handle_log_reload(void)
 	}
 }
 
-/* Returns index inside fds array if succees, -1 if fail */
-static int set_fds(int fd, short events)
-{
-	int ret;
-	if (current_array_size < nr_fds + 1) {
-		struct pollfd  *new_fds = NULL;
-		unsigned long newsize;
-
-		/* Round up to 2^8 boundary, in practice this just
-		 * make newsize larger than current_array_size.
-		 */
-		newsize = ROUNDUP(nr_fds + 1, 8);
-
-		new_fds = realloc(fds, sizeof(struct pollfd)*newsize);
-		if (!new_fds)
-			goto fail;
-		fds = new_fds;
-
-		memset(&fds[0] + current_array_size, 0,
-		       sizeof(struct pollfd) * (newsize-current_array_size));
-		current_array_size = newsize;
-	}
-
-	fds[nr_fds].fd = fd;
-	fds[nr_fds].events = events;
-	ret = nr_fds;
-	nr_fds++;
-
-	return ret;
-fail:
-	dolog(LOG_ERR, "realloc failed, ignoring fd %d\n", fd);
-	return -1;
-}
-
-static void reset_fds(void)
-{
-	nr_fds = 0;
-	if (fds)
-		memset(fds, 0, sizeof(struct pollfd) * current_array_size);
-}
-
-static void maybe_add_console_evtchn_fd(struct console *con, void *data)
-{
-	long long next_timeout = *((long long *)data);
-
-	if (con->event_count >= RATE_LIMIT_ALLOWANCE) {
-		/* Determine if we're going to be the next time slice to expire */
-		if (!next_timeout ||
-		    con->next_period < next_timeout)
-			next_timeout = con->next_period;
-	} else if (con->xce_handle != NULL) {
-		if (buffer_available(con)) {
-			int evtchn_fd = xenevtchn_fd(con->xce_handle);
-			con->xce_pollfd_idx = set_fds(evtchn_fd,
-						      POLLIN|POLLPRI);
-		}
-	}
-
-	*((long long *)data) = next_timeout;
-}
-
-static void maybe_add_console_tty_fd(struct console *con)
+void handle_io(void)
 {
-	if (con->master_fd != -1) {
-		short events = 0;
-		if (!con->d->is_dead && ring_free_bytes(con))
-			events |= POLLIN;
+	int ret, flags;
+	struct io_watch xs_watch, xce_watch;
 
-		if (!buffer_empty(&con->buffer))
-			events |= POLLOUT;
+	io_watch_init(&xs_watch, handle_xs_watch);
+	io_watch_init(&xce_watch, handle_evtchn);
 
-		if (events)
-			con->master_pollfd_idx =
-				set_fds(con->master_fd, events|POLLPRI);
-	}
-}
+	if (io_init())
+		goto out;
 
-static void handle_console_tty(struct console *con)
-{
-	if (con->master_fd != -1 && con->master_pollfd_idx != -1) {
-		if (fds[con->master_pollfd_idx].revents &
-		    ~(POLLIN|POLLOUT|POLLPRI))
-			console_handle_broken_tty(con, domain_is_valid(con->d->domid));
-		else {
-			if (fds[con->master_pollfd_idx].revents &
-			    POLLIN)
-				handle_tty_read(con);
-			if (fds[con->master_pollfd_idx].revents &
-			    POLLOUT)
-				handle_tty_write(con);
-		}
+	xce_handle = xenevtchn_open(NULL, 0);
+	if (xce_handle == NULL) {
+		dolog(LOG_ERR, "Failed to open xce handle: %d (%s)",
+		      errno, strerror(errno));
+		goto out;
 	}
-	con->master_pollfd_idx = -1;
-}
 
-void handle_io(void)
-{
-	int ret;
-	xenevtchn_port_or_error_t log_hv_evtchn = -1;
-	int xce_pollfd_idx = -1;
-	int xs_pollfd_idx = -1;
-	xenevtchn_handle *xce_handle = NULL;
+	/* Drain the pending ports in batches if we can. */
+	flags = fcntl(xenevtchn_fd(xce_handle), F_GETFL);
+	if (flags != -1 &&
+	    fcntl(xenevtchn_fd(xce_handle), F_SETFL, flags | O_NONBLOCK) != -1)
+		evtchn_batch = IO_BATCH;
 
 	if (log_hv) {
-		xce_handle = xenevtchn_open(NULL, 0);
-		if (xce_handle == NULL) {
-			dolog(LOG_ERR, "Failed to open xce handle: %d (%s)",
-			      errno, strerror(errno));
-			goto out;
-		}
 		log_hv_fd = create_hv_log();
 		if (log_hv_fd == -1)
 			goto out;
@@ -1310,7 +1701,7 @@ void handle_io(void)
 			goto out;
 		}
 		/* Log the boot dmesg even if VIRQ_CON_RING isn't pending. */
-		handle_hv_logs(xce_handle, true);
+		handle_hv_logs();
 	}
 
 	xgt_handle = xengnttab_open(NULL, 0);
@@ -1319,40 +1710,33 @@ void handle_io(void)
 		      errno, strerror(errno));
 	}
 
+	io_watch_set(&xs_watch, xs_fileno(xs), POLLIN|POLLPRI);
+	io_watch_set(&xce_watch, xenevtchn_fd(xce_handle), POLLIN|POLLPRI);
+
 	enum_domains();
 
 	for (;;) {
 		struct domain *d, *n;
 		int poll_timeout; /* timeout in milliseconds */
-		struct timespec ts;
-		long long now, next_timeout = 0;
+		long long now, next_timeout;
 
-		reset_fds();
-
-		xs_pollfd_idx = set_fds(xs_fileno(xs), POLLIN|POLLPRI);
-
-		if (log_hv)
-			xce_pollfd_idx = set_fds(xenevtchn_fd(xce_handle),
-						 POLLIN|POLLPRI);
-
-		if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		now = monotonic_ms();
+		if (now < 0)
 			break;
-		now = ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
 
 		/* Re-calculate any event counter allowances & unblock
 		   domains with new allowance */
-		for (d = dom_head; d; d = d->next) {
+		next_timeout = handle_throttled(now);
 
-			console_iter_void_arg2(d, console_evtchn_unmask, (void *)&now);
+		if (next_log_flush && now >= next_log_flush)
+			flush_logs();
+		if (next_log_flush &&
+		    (!next_timeout || next_log_flush < next_timeout))
+			next_timeout = next_log_flush;
 
-			console_iter_void_arg2(d, maybe_add_console_evtchn_fd, 
-					       (void *)&next_timeout);
-
-			console_iter_void_arg1(d, maybe_add_console_tty_fd);
-		}
-
-		/* If any domain has been rate limited, we need to work
-		   out what timeout to supply to poll */
+		/* If any domain has been rate limited, or has log data to
+		   write out, we need to work out what timeout to supply to
+		   poll */
 		if (next_timeout) {
 			long long duration = (next_timeout - now);
 			if (duration <= 0) /* sanity check */
@@ -1360,7 +1744,7 @@ void handle_io(void)
 			poll_timeout = (int)duration;
 		}
 
-		ret = poll(fds, nr_fds, next_timeout ? poll_timeout : -1);
+		ret = io_wait(next_timeout ? poll_timeout : -1);
 
 		if (log_reload) {
 			int saved_errno = errno;
@@ -1381,53 +1765,25 @@ void handle_io(void)
 			break;
 		}
 
-		if (log_hv && xce_pollfd_idx != -1) {
-			if (fds[xce_pollfd_idx].revents & ~(POLLIN|POLLOUT|POLLPRI)) {
-				dolog(LOG_ERR,
-				      "Failure in poll xce_handle: %d (%s)",
-				      errno, strerror(errno));
-				break;
-			} else if (fds[xce_pollfd_idx].revents & POLLIN)
-				handle_hv_logs(xce_handle, false);
-
-			xce_pollfd_idx = -1;
-		}
-
-		if (ret <= 0)
-			continue;
-
-		if (xs_pollfd_idx != -1) {
-			if (fds[xs_pollfd_idx].revents & ~(POLLIN|POLLOUT|POLLPRI)) {
-				dolog(LOG_ERR,
-				      "Failure in poll xs_handle: %d (%s)",
-				      errno, strerror(errno));
-				break;
-			} else if (fds[xs_pollfd_idx].revents & POLLIN)
-				handle_xs();
-
-			xs_pollfd_idx = -1;
-		}
-
-		for (d = dom_head; d; d = n) {
-
-			n = d->next;
-
-			console_iter_void_arg1(d, handle_console_ring);
-
-			console_iter_void_arg1(d, handle_console_tty);
-
-			if (d->last_seen != enum_pass)
-				shutdown_domain(d);
+		if (io_failed)
+			break;
 
-			if (d->is_dead)
-				cleanup_domain(d);
+		if (domains_dead) {
+			domains_dead = false;
+			for (d = dom_head; d; d = n) {
+				n = d->next;
+				if (d->is_dead)
+					cleanup_domain(d);
+			}
 		}
 	}
 
-	free(fds);
-	current_array_size = 0;
+	flush_logs();
 
  out:
+	io_watch_set(&xs_watch, -1, 0);
+	io_watch_set(&xce_watch, -1, 0);
+	io_fini();
 	if (log_hv_fd != -1) {
 		close(log_hv_fd);
 		log_hv_fd = -1;
@@ -40,6 +40,7 @@ int log_time_hv = 0;
 int log_time_guest = 0;
 char *log_dir = NULL;
 int discard_overflowed_data = 1;
+int log_flush_interval = 0;
 
 static void handle_hup(int sig)
 {
@@ -48,7 +49,7 @@ static void handle_hup(int sig)
 
 static void usage(char *name)
 {
-	printf("Usage: %s [-h] [-V] [-v] [-i] [--log=none|guest|hv|all] [--log-dir=DIR] [--pid-file=PATH] [-t, --timestamp=none|guest|hv|all] [-o, --overflow-data=discard|keep]\n", name);
+	printf("Usage: %s [-h] [-V] [-v] [-i] [--log=none|guest|hv|all] [--log-dir=DIR] [--pid-file=PATH] [-t, --timestamp=none|guest|hv|all] [-o, --overflow-data=discard|keep] [--log-flush-interval=MS]\n", name);
 }
 
 static void version(char *name)
@@ -60,13 +61,13 @@ static void increase_fd_limit(void)
 {
 	/*
 	 * We require many file descriptors:
-	 * - per domain: pty master, pty slave, logfile and evtchn
-	 * - misc extra: hypervisor log, privcmd, gntdev, std...
+	 * - per domain: pty master, pty slave and logfile
+	 * - misc extra: hypervisor log, evtchn, epoll, privcmd, gntdev, std...
 	 *
 	 * Allow a generous 1000 for misc, and calculate the maximum possible
 	 * number of fds which could be used.
 	 */
-	unsigned min_fds = (DOMID_FIRST_RESERVED * 4) + 1000;
+	unsigned min_fds = (DOMID_FIRST_RESERVED * 3) + 1000;
 	struct rlimit lim, new = { min_fds, min_fds };
 
 	if (getrlimit(RLIMIT_NOFILE, &lim) < 0) {
@@ -104,6 +105,7 @@ int main(int argc, char **argv)
 		{ "pid-file", 1, 0, 'p' },
 		{ "timestamp", 1, 0, 't' },
 		{ "overflow-data", 1, 0, 'o'},
+		{ "log-flush-interval", 1, 0, 'f' },
 		{ 0 },
 	};
 	bool is_interactive = false;
@@ -168,6 +170,12 @@ int main(int argc, char **argv)
 				discard_overflowed_data = 1;
 			}
 			break;
+		case 'f':
+			/* Milliseconds guest logs may be buffered for */
+			log_flush_interval = atoi(optarg);
+			if (log_flush_interval < 0)
+				log_flush_interval = 0;
+			break;
 		case '?':
 			fprintf(stderr,
 				"Try `%s --help' for more information\n",
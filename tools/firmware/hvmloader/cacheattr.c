@@ -54,7 +54,7 @@ unsigned int cpu_phys_addr(void)
     return phys_bits;
 }
 
-void cacheattr_init(void)
+void cacheattr_init(bool verbose)
 {
     uint32_t eax, ebx, ecx, edx;
     uint64_t mtrr_cap, mtrr_def, content, addr_mask;
@@ -67,7 +67,8 @@ void cacheattr_init(void)
 
     phys_bits = cpu_phys_addr();
 
-    printf("%u-bit phys ... ", phys_bits);
+    if ( verbose )
+        printf("%u-bit phys ... ", phys_bits);
 
     addr_mask = ((1ull << phys_bits) - 1) & ~((1ull << 12) - 1);
     mtrr_cap = rdmsr(MSR_MTRRcap);
@@ -89,7 +90,8 @@ void cacheattr_init(void)
         for ( i = 0; i < 8; i++ )
             wrmsr(MSR_MTRRfix4K_C0000 + i, content);
         mtrr_def |= 1u << 10; /* FE */
-        printf("fixed MTRRs ... ");
+        if ( verbose )
+            printf("fixed MTRRs ... ");
     }
 
     /* Variable-range MTRRs supported? */
@@ -127,7 +129,8 @@ void cacheattr_init(void)
             base += size;
         }
 
-        printf("var MTRRs [%d/%d] ... ", i, nr_var_ranges);
+        if ( verbose )
+            printf("var MTRRs [%d/%d] ... ", i, nr_var_ranges);
     }
 
     wrmsr(MSR_MTRRdefType, mtrr_def);
@@ -37,6 +37,14 @@ uint64_t pci_hi_mem_start = 0, pci_hi_mem_end = 0;
 enum virtual_vga virtual_vga = VGA_none;
 unsigned long igd_opregion_pgbase = 0;
 
+/* The functions found by pci_setup(), so that later scans needn't probe. */
+static uint32_t pci_devfn_found[256 / 32];
+
+bool pci_devfn_present(unsigned int devfn)
+{
+    return pci_devfn_found[devfn / 32] & (1u << (devfn % 32));
+}
+
 /* Check if the specified range conflicts with any reserved device memory. */
 static bool check_overlap_all(uint64_t start, uint64_t size)
 {
@@ -147,11 +155,17 @@ void pci_setup(void)
     /* Scan the PCI bus and map resources. */
     for ( devfn = 0; devfn < 256; devfn++ )
     {
-        class     = pci_readw(devfn, PCI_CLASS_DEVICE);
         vendor_id = pci_readw(devfn, PCI_VENDOR_ID);
         device_id = pci_readw(devfn, PCI_DEVICE_ID);
         if ( (vendor_id == 0xffff) && (device_id == 0xffff) )
+        {
+            /* Without function 0 there's no device in the slot at all. */
+            if ( !(devfn & 7) )
+                devfn |= 7;
             continue;
+        }
+        pci_devfn_found[devfn / 32] |= 1u << (devfn % 32);
+        class = pci_readw(devfn, PCI_CLASS_DEVICE);
 
         ASSERT((devfn != PCI_ISA_DEVFN) ||
                ((vendor_id == 0x8086) && (device_id == 0x7000)));
@@ -293,6 +307,10 @@ void pci_setup(void)
         cmd = pci_readw(devfn, PCI_COMMAND);
         cmd |= PCI_COMMAND_MASTER;
         pci_writew(devfn, PCI_COMMAND, cmd);
+
+        /* Nor are functions 1-7 of a single function device worth probing. */
+        if ( !(devfn & 7) && !(pci_readb(devfn, PCI_HEADER_TYPE) & 0x80) )
+            devfn |= 7;
     }
 
     if ( mmio_hole_size )
@@ -26,7 +26,13 @@
 #define AP_BOOT_EIP 0x1000
 extern char ap_boot_start[], ap_boot_end[];
 
-static int ap_callin, ap_cpuid;
+/*
+ * The APs all come up at once, each taking a ticket on its way in to pick
+ * a stack of its own.
+ */
+#define AP_STACK_SIZE 0x800
+
+static volatile unsigned int ap_callin;
 
 asm (
     "    .text                       \n"
@@ -47,7 +53,12 @@ asm (
     "    mov   %eax,%ds              \n"
     "    mov   %eax,%es              \n"
     "    mov   %eax,%ss              \n"
-    "    movl  $stack_top,%esp       \n"
+    "    mov   $1,%eax               \n"
+    "    lock xadd %eax,ap_ticket    \n"
+    "    inc   %eax                  \n"
+    "    imul  $"STR(AP_STACK_SIZE)",%eax \n"
+    "    add   $ap_stacks,%eax       \n"
+    "    movl  %eax,%esp             \n"
     "    movl  %esp,%ebp             \n"
     "    call  ap_start              \n"
     "1:  hlt                         \n"
@@ -62,20 +73,21 @@ asm (
     "                                \n"
     "    .bss                        \n"
     "    .align    8                 \n"
-    "stack:                          \n"
-    "    .skip    0x4000             \n"
-    "stack_top:                      \n"
+    "ap_ticket:                      \n"
+    "    .long    0                  \n"
+    "    .align    16                \n"
+    "ap_stacks:                      \n"
+    "    .skip    "STR(AP_STACK_SIZE * (HVM_MAX_VCPUS - 1))" \n"
     "    .text                       \n"
     );
 
 void ap_start(void); /* non-static avoids unused-function compiler warning */
 /*static*/ void ap_start(void)
 {
-    printf(" - CPU%d ... ", ap_cpuid);
-    cacheattr_init();
-    printf("done.\n");
+    /* Quietly: the other APs are at the same thing. */
+    cacheattr_init(false);
     wmb();
-    ap_callin = 1;
+    asm volatile ( "lock ; incl %0" : "+m" (ap_callin) :: "memory" );
 }
 
 static void lapic_wait_ready(void)
@@ -88,11 +100,6 @@ static void boot_cpu(unsigned int cpu)
 {
     unsigned int icr2 = SET_APIC_DEST_FIELD(LAPIC_ID(cpu));
 
-    /* Initialise shared variables. */
-    ap_cpuid = cpu;
-    ap_callin = 0;
-    wmb();
-
     /* Wake up the secondary processor: INIT-SIPI-SIPI... */
     lapic_wait_ready();
     lapic_write(APIC_ICR2, icr2);
@@ -104,18 +111,14 @@ static void boot_cpu(unsigned int cpu)
     lapic_write(APIC_ICR2, icr2);
     lapic_write(APIC_ICR, APIC_DM_STARTUP | (AP_BOOT_EIP >> 12));
     lapic_wait_ready();
+}
 
-    /*
-     * Wait for the secondary processor to complete initialisation.
-     * Do not touch shared resources meanwhile.
-     */
-    while ( !ap_callin )
-        cpu_relax();
-
+static void park_cpu(unsigned int cpu)
+{
     /* Take the secondary processor offline. */
-    lapic_write(APIC_ICR2, icr2);
+    lapic_write(APIC_ICR2, SET_APIC_DEST_FIELD(LAPIC_ID(cpu)));
     lapic_write(APIC_ICR, APIC_DM_INIT);
-    lapic_wait_ready();    
+    lapic_wait_ready();
 }
 
 void smp_initialise(void)
@@ -125,9 +128,26 @@ void smp_initialise(void)
     memcpy((void *)AP_BOOT_EIP, ap_boot_start, ap_boot_end - ap_boot_start);
 
     printf("Multiprocessor initialisation:\n");
-    ap_start();
+    printf(" - CPU0 ... ");
+    cacheattr_init(true);
+    printf("done.\n");
+
+    if ( nr_cpus <= 1 )
+        return;
+
+    /*
+     * Start all the APs before waiting for any.  They only touch their own
+     * MSRs and stacks, and the BSP keeps off shared resources meanwhile.
+     */
+    printf(" - CPU1-%u ... ", nr_cpus - 1);
     for ( i = 1; i < nr_cpus; i++ )
         boot_cpu(i);
+    while ( ap_callin != nr_cpus - 1 )
+        cpu_relax();
+
+    for ( i = 1; i < nr_cpus; i++ )
+        park_cpu(i);
+    printf("done.\n");
 }
 
 /*
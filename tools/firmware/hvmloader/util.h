@@ -238,6 +238,7 @@ int hvm_param_set(uint32_t index, uint64_t value);
 
 /* Setup PCI bus */
 void pci_setup(void);
+bool pci_devfn_present(unsigned int devfn);
 
 /* Setup memory map  */
 void memory_map_setup(void);
@@ -250,7 +251,7 @@ uint32_t rombios_highbios_setup(void);
 
 /* Miscellaneous. */
 unsigned int cpu_phys_addr(void);
-void cacheattr_init(void);
+void cacheattr_init(bool verbose);
 unsigned long create_mp_tables(void *table);
 void hvm_write_smbios_tables(
     unsigned long ep, unsigned long smbios_start, unsigned long smbios_end);
@@ -20,6 +20,29 @@ package xenlight
 #cgo LDFLAGS: -lxenlight -lyajl -lxentoollog
 #include <stdlib.h>
 #include <libxl.h>
+
+// The vcpu lists of several domains, for the price of one cgo call.
+static void xenlight_list_vcpus(libxl_ctx *ctx, const uint32_t *domids,
+                                int nr_domids, libxl_vcpuinfo **lists,
+                                int *nb_vcpus)
+{
+    int i, nr_cpus;
+
+    for (i = 0; i < nr_domids; i++) {
+        lists[i] = libxl_list_vcpu(ctx, domids[i], &nb_vcpus[i], &nr_cpus);
+        if (!lists[i])
+            nb_vcpus[i] = 0;
+    }
+}
+
+static void xenlight_vcpuinfo_lists_free(libxl_vcpuinfo **lists,
+                                         int *nb_vcpus, int nr_domids)
+{
+    int i;
+
+    for (i = 0; i < nr_domids; i++)
+        libxl_vcpuinfo_list_free(lists[i], nb_vcpus[i]);
+}
 */
 import "C"
 
@@ -298,10 +321,20 @@ type Dominfo struct {
 func (cdi *C.libxl_dominfo) toGo() (di *Dominfo) {
 
 	di = &Dominfo{}
+	cdi.toGoInto(di)
+
+	return
+}
+
+// Fill in an existing Dominfo, keeping its strings where they are
+// unchanged rather than copying them again.
+func (cdi *C.libxl_dominfo) toGoInto(di *Dominfo) {
 	di.Uuid = Uuid(cdi.uuid)
 	di.Domid = Domid(cdi.domid)
 	di.Ssidref = uint32(cdi.ssidref)
-	di.SsidLabel = C.GoString(cdi.ssid_label)
+	if !cStringEqual(cdi.ssid_label, di.SsidLabel) {
+		di.SsidLabel = C.GoString(cdi.ssid_label)
+	}
 	di.Running = bool(cdi.running)
 	di.Blocked = bool(cdi.blocked)
 	di.Paused = bool(cdi.paused)
@@ -319,8 +352,23 @@ func (cdi *C.libxl_dominfo) toGo() (di *Dominfo) {
 	di.VcpuOnline = uint32(cdi.vcpu_online)
 	di.Cpupool = uint32(cdi.cpupool)
 	di.DomainType = int32(cdi.domain_type)
+}
 
-	return
+// Whether a C string (NULL being "") reads the same as a Go one, without
+// making a Go copy of it.
+func cStringEqual(cs *C.char, gs string) bool {
+	if cs == nil {
+		return gs == ""
+	}
+
+	cbytes := (*[1 << 30]byte)(unsafe.Pointer(cs))
+	for i := 0; i < len(gs); i++ {
+		if cbytes[i] == 0 || cbytes[i] != gs[i] {
+			return false
+		}
+	}
+
+	return cbytes[len(gs)] == 0
 }
 
 // # Consistent with values defined in domctl.h
@@ -686,17 +734,27 @@ func (Ctx *Context) CpupoolMakeFree(Cpumap Bitmap) (err error) {
 
 // Return a Go bitmap which is a copy of the referred C bitmap.
 func (cbm C.libxl_bitmap) toGo() (gbm Bitmap) {
-	// Alloc a Go slice for the bytes
+	cbm.toGoInto(&gbm)
+
+	return
+}
+
+// Copy the referred C bitmap into a Go one, reusing its storage if it is
+// big enough.
+func (cbm C.libxl_bitmap) toGoInto(gbm *Bitmap) {
+	// Alloc a Go slice for the bytes, unless there is one already
 	size := int(cbm.size)
-	gbm.bitmap = make([]C.uint8_t, size)
+	if cap(gbm.bitmap) >= size {
+		gbm.bitmap = gbm.bitmap[:size]
+	} else {
+		gbm.bitmap = make([]C.uint8_t, size)
+	}
 
 	// Make a slice pointing to the C array
 	mapslice := (*[1 << 30]C.uint8_t)(unsafe.Pointer(cbm._map))[:size:size]
 
 	// And copy the C array into the Go array
 	copy(gbm.bitmap, mapslice)
-
-	return
 }
 
 // Must be C.libxl_bitmap_dispose'd of afterwards
@@ -1067,6 +1125,13 @@ func (Ctx *Context) DomainReboot(id Domid) (err error) {
 //libxl_dominfo * libxl_list_domain(libxl_ctx*, int *nb_domain_out);
 //void libxl_dominfo_list_free(libxl_dominfo *list, int nb_domain);
 func (Ctx *Context) ListDomain() (glist []Dominfo) {
+	return Ctx.ListDomainInto(nil)
+}
+
+// ListDomainInto is ListDomain for callers polling the list: the result
+// is built in the storage of buf, whose entries (as returned by a
+// previous call) keep their strings where the domain's are unchanged.
+func (Ctx *Context) ListDomainInto(buf []Dominfo) (glist []Dominfo) {
 	err := Ctx.CheckOpen()
 	if err != nil {
 		return
@@ -1080,10 +1145,15 @@ func (Ctx *Context) ListDomain() (glist []Dominfo) {
 		return
 	}
 
+	glist = buf[:0]
 	gslice := (*[1 << 30]C.libxl_dominfo)(unsafe.Pointer(clist))[:nbDomain:nbDomain]
 	for i := range gslice {
-		info := gslice[i].toGo()
-		glist = append(glist, *info)
+		if i < cap(glist) {
+			glist = glist[:i+1]
+		} else {
+			glist = append(glist, Dominfo{})
+		}
+		gslice[i].toGoInto(&glist[i])
 	}
 
 	return
@@ -1101,16 +1171,21 @@ type Vcpuinfo struct {
 }
 
 func (cvci C.libxl_vcpuinfo) toGo() (gvci Vcpuinfo) {
+	cvci.toGoInto(&gvci)
+
+	return
+}
+
+// Fill in an existing Vcpuinfo, reusing the storage of its bitmaps.
+func (cvci C.libxl_vcpuinfo) toGoInto(gvci *Vcpuinfo) {
 	gvci.Vcpuid = uint32(cvci.vcpuid)
 	gvci.Cpu = uint32(cvci.cpu)
 	gvci.Online = bool(cvci.online)
 	gvci.Blocked = bool(cvci.blocked)
 	gvci.Running = bool(cvci.running)
 	gvci.VCpuTime = time.Duration(cvci.vcpu_time)
-	gvci.Cpumap = cvci.cpumap.toGo()
-	gvci.CpumapSoft = cvci.cpumap_soft.toGo()
-
-	return
+	cvci.cpumap.toGoInto(&gvci.Cpumap)
+	cvci.cpumap_soft.toGoInto(&gvci.CpumapSoft)
 }
 
 //libxl_vcpuinfo *libxl_list_vcpu(libxl_ctx *ctx, uint32_t domid,
@@ -1141,6 +1216,57 @@ func (Ctx *Context) ListVcpu(id Domid) (glist []Vcpuinfo) {
 	return
 }
 
+// ListVcpus returns the vcpus of each of the domains ids, as ListVcpu
+// would, but getting them all with a single cgo call.  The lists are built
+// in the storage of buf, as returned by a previous call, when there is
+// one.  A domain which has gone away gets an empty list.
+func (Ctx *Context) ListVcpus(ids []Domid, buf [][]Vcpuinfo) (glists [][]Vcpuinfo) {
+	err := Ctx.CheckOpen()
+	if err != nil || len(ids) == 0 {
+		return
+	}
+
+	nr := len(ids)
+	cids := make([]C.uint32_t, nr)
+	for i, id := range ids {
+		cids[i] = C.uint32_t(id)
+	}
+	clists := make([]*C.libxl_vcpuinfo, nr)
+	cnbVcpus := make([]C.int, nr)
+
+	C.xenlight_list_vcpus(Ctx.ctx, &cids[0], C.int(nr), &clists[0], &cnbVcpus[0])
+	defer C.xenlight_vcpuinfo_lists_free(&clists[0], &cnbVcpus[0], C.int(nr))
+
+	glists = buf[:0]
+	for i := 0; i < nr; i++ {
+		if i < cap(glists) {
+			glists = glists[:i+1]
+		} else {
+			glists = append(glists, nil)
+		}
+
+		nbVcpu := int(cnbVcpus[i])
+		glist := glists[i][:0]
+		if nbVcpu == 0 {
+			glists[i] = glist
+			continue
+		}
+
+		gslice := (*[1 << 30]C.libxl_vcpuinfo)(unsafe.Pointer(clists[i]))[:nbVcpu:nbVcpu]
+		for j := range gslice {
+			if j < cap(glist) {
+				glist = glist[:j+1]
+			} else {
+				glist = append(glist, Vcpuinfo{})
+			}
+			gslice[j].toGoInto(&glist[j])
+		}
+		glists[i] = glist
+	}
+
+	return
+}
+
 type ConsoleType int
 
 const (
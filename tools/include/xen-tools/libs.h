@@ -1,6 +1,8 @@
 #ifndef __XEN_TOOLS_LIBS__
 #define __XEN_TOOLS_LIBS__
 
+#include <stdint.h>
+
 #ifndef BUILD_BUG_ON
 #if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 6)
 #define BUILD_BUG_ON(p) ({ _Static_assert(!(p), "!(" #p ")"); })
@@ -9,4 +11,27 @@
 #endif
 #endif
 
+/*
+ * Index of the bucket of the @nr bucket histogram @hist which the fraction
+ * @f of its samples are in or below.  The last bucket is open ended, so
+ * that index means at least the lower bound of it.
+ */
+static inline unsigned int hist_percentile(const uint32_t *hist,
+                                           unsigned int nr, double f)
+{
+    uint64_t total = 0, seen = 0;
+    unsigned int i;
+
+    for ( i = 0; i < nr; i++ )
+        total += hist[i];
+    for ( i = 0; i < nr - 1; i++ )
+    {
+        seen += hist[i];
+        if ( seen >= f * total )
+            break;
+    }
+
+    return i;
+}
+
 #endif	/* __XEN_TOOLS_LIBS__ */
@@ -52,6 +52,7 @@ fsi_t *fsi_open_fsimage(const char *path, uint64_t off, const char *options)
 	fsi->f_off = off;
 	fsi->f_data = NULL;
 	fsi->f_bootstring = NULL;
+	fsi->f_cache = NULL;
 
 	pthread_mutex_lock(&fsi_lock);
 	err = find_plugin(fsi, path, options);
@@ -65,6 +66,8 @@ fail:
 	err = errno;
 	if (fd != -1)
 		(void) close(fd);
+	if (fsi != NULL)
+		fsi_cache_free(fsi);
 	free(fsi);
 	errno = err;
 	return (NULL);
@@ -75,6 +78,7 @@ void fsi_close_fsimage(fsi_t *fsi)
 	pthread_mutex_lock(&fsi_lock);
         fsi->f_plugin->fp_ops->fpo_umount(fsi);
         (void) close(fsi->f_fd);
+	fsi_cache_free(fsi);
 	free(fsi);
 	pthread_mutex_unlock(&fsi_lock);
 }
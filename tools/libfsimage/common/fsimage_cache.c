@@ -0,0 +1,151 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * A block cache in front of the image, for the filesystem code's many
+ * small reads.  It is direct mapped, so that blocks following each other
+ * on disk sit next to each other in the cache too, and a run of them can
+ * be read in with one pread(): this is how readahead is done when the
+ * reads are found to be sequential, doubling the run each time up to
+ * FSI_READAHEAD_MAX blocks.
+ *
+ * All reads are of whole, aligned blocks, which also keeps raw disks on
+ * NetBSD happy.  Callers hold fsi_lock.
+ */
+
+#ifndef __sun__
+#define	_XOPEN_SOURCE 500
+#endif
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "fsimage_priv.h"
+
+#define	FSI_CACHE_BLOCK		(64 * 1024)
+#define	FSI_CACHE_BLOCKS	64
+#define	FSI_READAHEAD_MAX	16
+
+struct fsi_cache {
+	char *fc_data;
+	/* Block held by each slot, plus one: 0 is an empty slot. */
+	uint64_t fc_tag[FSI_CACHE_BLOCKS];
+	/* How much of the block is there, less than all of it at the end. */
+	size_t fc_len[FSI_CACHE_BLOCKS];
+	/* The block after the last run read in, and the run's length. */
+	uint64_t fc_next;
+	unsigned int fc_ra;
+};
+
+static int
+fsi_cache_fill(fsi_t *fsi, struct fsi_cache *fc, uint64_t block)
+{
+	unsigned int slot = block % FSI_CACHE_BLOCKS;
+	unsigned int i, n;
+	ssize_t ret;
+
+	if (block == fc->fc_next && fc->fc_ra < FSI_READAHEAD_MAX)
+		fc->fc_ra *= 2;
+	else if (block != fc->fc_next)
+		fc->fc_ra = 1;
+
+	n = fc->fc_ra;
+	if (n > FSI_CACHE_BLOCKS - slot)
+		n = FSI_CACHE_BLOCKS - slot;
+
+	do {
+		ret = pread(fsi->f_fd, fc->fc_data + slot * FSI_CACHE_BLOCK,
+		    n * FSI_CACHE_BLOCK, block * FSI_CACHE_BLOCK);
+	} while (ret == -1 && errno == EINTR);
+	if (ret == -1)
+		return (-1);
+
+	for (i = 0; i < n; i++) {
+		size_t len = ret > FSI_CACHE_BLOCK ? FSI_CACHE_BLOCK : ret;
+
+		fc->fc_tag[slot + i] = len ? block + i + 1 : 0;
+		fc->fc_len[slot + i] = len;
+		ret -= len;
+	}
+	fc->fc_next = block + n;
+
+	return (0);
+}
+
+/*
+ * Read from the image at @off, which is from the start of the image rather
+ * than of the filesystem.  Returns the number of bytes read, which is short
+ * only at the end of the image, or -1 on error.
+ */
+ssize_t
+fsi_cache_pread(fsi_t *fsi, void *buf, size_t nbytes, uint64_t off)
+{
+	struct fsi_cache *fc = fsi->f_cache;
+	char *p = buf;
+	uint64_t block;
+	unsigned int slot;
+	size_t boff, n;
+
+	if (fc == NULL) {
+		if ((fc = calloc(1, sizeof (*fc))) == NULL)
+			return (-1);
+		fc->fc_data = malloc(FSI_CACHE_BLOCKS * FSI_CACHE_BLOCK);
+		if (fc->fc_data == NULL) {
+			free(fc);
+			return (-1);
+		}
+		fc->fc_next = ~0ULL;
+		fsi->f_cache = fc;
+	}
+
+	while (nbytes > 0) {
+		block = off / FSI_CACHE_BLOCK;
+		slot = block % FSI_CACHE_BLOCKS;
+		boff = off % FSI_CACHE_BLOCK;
+
+		if (fc->fc_tag[slot] != block + 1 &&
+		    fsi_cache_fill(fsi, fc, block) == -1)
+			return (-1);
+		if (fc->fc_tag[slot] != block + 1 || boff >= fc->fc_len[slot])
+			break;
+
+		n = fc->fc_len[slot] - boff;
+		if (n > nbytes)
+			n = nbytes;
+		memcpy(p, fc->fc_data + slot * FSI_CACHE_BLOCK + boff, n);
+		p += n;
+		off += n;
+		nbytes -= n;
+	}
+
+	return (p - (char *)buf);
+}
+
+void
+fsi_cache_free(fsi_t *fsi)
+{
+	if (fsi->f_cache != NULL) {
+		free(fsi->f_cache->fc_data);
+		free(fsi->f_cache);
+		fsi->f_cache = NULL;
+	}
+}
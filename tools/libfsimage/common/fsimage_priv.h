@@ -47,6 +47,7 @@ struct fsi {
 	void *f_data;
 	fsi_plugin_t *f_plugin;
 	char *f_bootstring;
+	struct fsi_cache *f_cache;
 };
 
 struct fsi_file {
@@ -56,6 +57,9 @@ struct fsi_file {
 
 int find_plugin(fsi_t *, const char *, const char *);
 
+ssize_t fsi_cache_pread(fsi_t *, void *, size_t, uint64_t);
+void fsi_cache_free(fsi_t *);
+
 #ifdef __cplusplus
 };
 #endif
@@ -46,8 +46,29 @@ static void cache_unlock(xencall_handle *xcall)
     errno = saved_errno;
 }
 
+/* Returns the size class of an nr_pages allocation, or -1 if too big. */
+static int cache_class(size_t nr_pages)
+{
+    int c = 0;
+
+    while ( (1UL << c) < nr_pages )
+        if ( ++c == BUFFER_CACHE_CLASSES )
+            return -1;
+
+    return c;
+}
+
+/* Rounds nr_pages up to what actually gets allocated for it. */
+static size_t cache_pages(size_t nr_pages)
+{
+    int c = cache_class(nr_pages);
+
+    return c < 0 ? nr_pages : 1UL << c;
+}
+
 static void *cache_alloc(xencall_handle *xcall, size_t nr_pages)
 {
+    int c = cache_class(nr_pages);
     void *p = NULL;
 
     cache_lock(xcall);
@@ -57,14 +78,16 @@ static void *cache_alloc(xencall_handle *xcall, size_t nr_pages)
     if ( xcall->buffer_current_allocations > xcall->buffer_maximum_allocations )
         xcall->buffer_maximum_allocations = xcall->buffer_current_allocations;
 
-    if ( nr_pages > 1 )
+    if ( c < 0 )
     {
         xcall->buffer_cache_toobig++;
     }
-    else if ( xcall->buffer_cache_nr > 0 )
+    else if ( xcall->buffer_cache_nr[c] > 0 )
     {
-        p = xcall->buffer_cache[--xcall->buffer_cache_nr];
+        p = xcall->buffer_cache[c][--xcall->buffer_cache_nr[c]];
+        xcall->buffer_cache_pages -= 1 << c;
         xcall->buffer_cache_hits++;
+        xcall->buffer_class_hits[c]++;
     }
     else
     {
@@ -78,6 +101,7 @@ static void *cache_alloc(xencall_handle *xcall, size_t nr_pages)
 
 static int cache_free(xencall_handle *xcall, void *p, size_t nr_pages)
 {
+    int c = cache_class(nr_pages);
     int rc = 0;
 
     cache_lock(xcall);
@@ -85,12 +109,18 @@ static int cache_free(xencall_handle *xcall, void *p, size_t nr_pages)
     xcall->buffer_total_releases++;
     xcall->buffer_current_allocations--;
 
-    if ( nr_pages == 1 &&
-         xcall->buffer_cache_nr < BUFFER_CACHE_SIZE )
+    if ( c >= 0 &&
+         xcall->buffer_cache_nr[c] < BUFFER_CACHE_SIZE &&
+         xcall->buffer_cache_pages + (1 << c) <= BUFFER_CACHE_MAX_PAGES )
     {
-        xcall->buffer_cache[xcall->buffer_cache_nr++] = p;
+        xcall->buffer_cache[c][xcall->buffer_cache_nr[c]++] = p;
+        xcall->buffer_cache_pages += 1 << c;
         rc = 1;
     }
+    else if ( c >= 0 )
+    {
+        xcall->buffer_cache_full++;
+    }
 
     cache_unlock(xcall);
 
@@ -100,6 +130,7 @@ static int cache_free(xencall_handle *xcall, void *p, size_t nr_pages)
 void buffer_release_cache(xencall_handle *xcall)
 {
     void *p;
+    int c;
 
     cache_lock(xcall);
 
@@ -109,18 +140,27 @@ void buffer_release_cache(xencall_handle *xcall)
     DBGPRINTF("current allocations:%d maximum allocations:%d",
               xcall->buffer_current_allocations,
               xcall->buffer_maximum_allocations);
-    DBGPRINTF("cache current size:%d",
-              xcall->buffer_cache_nr);
-    DBGPRINTF("cache hits:%d misses:%d toobig:%d",
+    DBGPRINTF("cache current size:%d pages",
+              xcall->buffer_cache_pages);
+    DBGPRINTF("cache hits:%d misses:%d toobig:%d full:%d",
               xcall->buffer_cache_hits,
               xcall->buffer_cache_misses,
-              xcall->buffer_cache_toobig);
+              xcall->buffer_cache_toobig,
+              xcall->buffer_cache_full);
 
-    while ( xcall->buffer_cache_nr > 0 )
+    for ( c = 0; c < BUFFER_CACHE_CLASSES; c++ )
     {
-        p = xcall->buffer_cache[--xcall->buffer_cache_nr];
-        osdep_free_pages(xcall, p, 1);
+        DBGPRINTF("cache %d page class: hits:%d cached:%d",
+                  1 << c, xcall->buffer_class_hits[c],
+                  xcall->buffer_cache_nr[c]);
+
+        while ( xcall->buffer_cache_nr[c] > 0 )
+        {
+            p = xcall->buffer_cache[c][--xcall->buffer_cache_nr[c]];
+            osdep_free_pages(xcall, p, 1 << c);
+        }
     }
+    xcall->buffer_cache_pages = 0;
 
     cache_unlock(xcall);
 }
@@ -130,7 +170,7 @@ void *xencall_alloc_buffer_pages(xencall_handle *xcall, size_t nr_pages)
     void *p = cache_alloc(xcall, nr_pages);
 
     if ( !p )
-        p = osdep_alloc_pages(xcall, nr_pages);
+        p = osdep_alloc_pages(xcall, cache_pages(nr_pages));
 
     if (!p)
         return NULL;
@@ -146,7 +186,7 @@ void xencall_free_buffer_pages(xencall_handle *xcall, void *p, size_t nr_pages)
         return;
 
     if ( !cache_free(xcall, p, nr_pages) )
-        osdep_free_pages(xcall, p, nr_pages);
+        osdep_free_pages(xcall, p, cache_pages(nr_pages));
 }
 
 struct allocation_header {
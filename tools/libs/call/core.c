@@ -14,6 +14,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "private.h"
 
@@ -34,7 +35,8 @@ xencall_handle *xencall_open(xentoollog_logger *logger, unsigned open_flags)
     xentoolcore__register_active_handle(&xcall->tc_ah);
 
     xcall->flags = open_flags;
-    xcall->buffer_cache_nr = 0;
+    memset(xcall->buffer_cache_nr, 0, sizeof(xcall->buffer_cache_nr));
+    xcall->buffer_cache_pages = 0;
 
     xcall->buffer_total_allocations = 0;
     xcall->buffer_total_releases = 0;
@@ -43,6 +45,8 @@ xencall_handle *xencall_open(xentoollog_logger *logger, unsigned open_flags)
     xcall->buffer_cache_hits = 0;
     xcall->buffer_cache_misses = 0;
     xcall->buffer_cache_toobig = 0;
+    xcall->buffer_cache_full = 0;
+    memset(xcall->buffer_class_hits, 0, sizeof(xcall->buffer_class_hits));
     xcall->logger = logger;
     xcall->logger_tofree = NULL;
 
@@ -24,13 +24,19 @@ struct xencall_handle {
     Xentoolcore__Active_Handle tc_ah;
 
     /*
-     * A simple cache of unused, single page, hypercall buffers
+     * A cache of unused hypercall buffers, in power of two size classes
+     * from 1 to 1 << (BUFFER_CACHE_CLASSES - 1) pages, holding at most
+     * BUFFER_CACHE_SIZE buffers per class and BUFFER_CACHE_MAX_PAGES
+     * pages overall. Smaller allocations are rounded up to their class.
      *
      * Protected by a global lock.
      */
+#define BUFFER_CACHE_CLASSES 5
 #define BUFFER_CACHE_SIZE 4
-    int buffer_cache_nr;
-    void *buffer_cache[BUFFER_CACHE_SIZE];
+#define BUFFER_CACHE_MAX_PAGES 64
+    int buffer_cache_nr[BUFFER_CACHE_CLASSES];
+    void *buffer_cache[BUFFER_CACHE_CLASSES][BUFFER_CACHE_SIZE];
+    int buffer_cache_pages;
 
     /*
      * Hypercall buffer statistics. All protected by the global
@@ -43,6 +49,8 @@ struct xencall_handle {
     int buffer_cache_hits;
     int buffer_cache_misses;
     int buffer_cache_toobig;
+    int buffer_cache_full;
+    int buffer_class_hits[BUFFER_CACHE_CLASSES];
 };
 
 int osdep_xencall_open(xencall_handle *xcall);
@@ -475,6 +475,39 @@ int xendevicemodel_track_dirty_vram(
                              dirty_bitmap, (size_t)(nr + 7) / 8);
 }
 
+int xendevicemodel_track_dirty_vram_ranges(
+    xendevicemodel_handle *dmod, domid_t domid, uint64_t first_pfn,
+    uint32_t nr, uint64_t *generation,
+    struct xen_dm_op_dirty_vram_range *ranges, uint32_t *nr_ranges,
+    uint32_t *flags)
+{
+    struct xen_dm_op op;
+    struct xen_dm_op_track_dirty_vram_ranges *data;
+    int rc;
+
+    memset(&op, 0, sizeof(op));
+
+    op.op = XEN_DMOP_track_dirty_vram_ranges;
+    data = &op.u.track_dirty_vram_ranges;
+
+    data->first_pfn = first_pfn;
+    data->nr = nr;
+    data->nr_ranges = *nr_ranges;
+    data->generation = *generation;
+
+    rc = xendevicemodel_op(dmod, domid, 2, &op, sizeof(op),
+                           ranges, (size_t)*nr_ranges * sizeof(*ranges));
+    if (rc)
+        return rc;
+
+    *generation = data->generation;
+    *nr_ranges = data->nr_ranges;
+    if (flags)
+        *flags = data->flags;
+
+    return 0;
+}
+
 int xendevicemodel_modified_memory_bulk(
     xendevicemodel_handle *dmod, domid_t domid,
     struct xen_dm_op_modified_memory_extent *extents, uint32_t nr)
@@ -253,6 +253,30 @@ int xendevicemodel_track_dirty_vram(
     xendevicemodel_handle *dmod, domid_t domid, uint64_t first_pfn,
     uint32_t nr, unsigned long *dirty_bitmap);
 
+/**
+ * As xendevicemodel_track_dirty_vram(), but returning the pages changed
+ * as a list of ranges. Should there be more than fit, the last range
+ * covers all the remaining ones, and XEN_DMOP_DIRTY_VRAM_MERGED is set.
+ *
+ * @parm dmod a handle to an open devicemodel interface.
+ * @parm domid the domain id to be serviced
+ * @parm first_pfn the start of the area to track
+ * @parm nr the number of pages to track
+ * @parm generation IN: the value the last call returned (0 initially),
+ *                  OUT: the one to pass to the next call. When the one
+ *                  passed is stale, the whole area is reported changed,
+ *                  with XEN_DMOP_DIRTY_VRAM_ALL.
+ * @parm ranges the array to fill in
+ * @parm nr_ranges IN: the size of ranges, OUT: the number filled in
+ * @parm flags OUT: XEN_DMOP_DIRTY_VRAM_* (may be NULL)
+ * @return 0 on success, -1 on failure.
+ */
+int xendevicemodel_track_dirty_vram_ranges(
+    xendevicemodel_handle *dmod, domid_t domid, uint64_t first_pfn,
+    uint32_t nr, uint64_t *generation,
+    struct xen_dm_op_dirty_vram_range *ranges, uint32_t *nr_ranges,
+    uint32_t *flags);
+
 /**
  * This function notifies the hypervisor that a set of contiguous
  * domain pages have been modified.
@@ -0,0 +1,405 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Foreign mapping cache.
+ *
+ * Guest memory is mapped in buckets of 1 << XENFOREIGNMEMORY_CACHE_BUCKET_SHIFT
+ * frames, aligned on the same boundary in both the guest and our address
+ * space, and kept until evicted. An access spanning buckets gets a
+ * mapping of its own covering all of them, filed with its first bucket.
+ * Idle mappings are evicted oldest first, several at once, when the
+ * cache fills up.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "private.h"
+
+#define BUCKET_SHIFT     XENFOREIGNMEMORY_CACHE_BUCKET_SHIFT
+#define BUCKET_PAGES     (1UL << BUCKET_SHIFT)
+#define CACHE_PAGE_SHIFT 12
+#define BUCKET_BYTES     (BUCKET_PAGES << CACHE_PAGE_SHIFT)
+
+struct cache_entry {
+    xen_pfn_t bucket;                   /* first bucket covered */
+    size_t nr_buckets;
+    void *addr;
+    int *err;                           /* per page, if any page failed */
+    unsigned int users;
+    struct cache_entry *hnext;          /* hash chain */
+    struct cache_entry *prev, *next;    /* idle list, oldest first */
+};
+
+struct xenforeignmemory_cache {
+    xenforeignmemory_handle *fmem;
+    uint32_t dom;
+    int prot;
+    size_t max, nr;                     /* buckets mapped */
+    size_t mask;
+    struct cache_entry **hash;
+    struct cache_entry idle;
+    xenforeignmemory_cache_stats_t stats;
+};
+
+static struct cache_entry **cache_chain(xenforeignmemory_cache *cache,
+                                        xen_pfn_t bucket)
+{
+    return &cache->hash[bucket & cache->mask];
+}
+
+static void idle_del(struct cache_entry *e)
+{
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    e->prev = e->next = e;
+}
+
+static void idle_add_tail(xenforeignmemory_cache *cache,
+                          struct cache_entry *e)
+{
+    e->prev = cache->idle.prev;
+    e->next = &cache->idle;
+    cache->idle.prev->next = e;
+    cache->idle.prev = e;
+}
+
+static void cache_evict(xenforeignmemory_cache *cache, struct cache_entry *e)
+{
+    struct cache_entry **pe = cache_chain(cache, e->bucket);
+
+    while ( *pe != e )
+        pe = &(*pe)->hnext;
+    *pe = e->hnext;
+
+    idle_del(e);
+    xenforeignmemory_unmap(cache->fmem, e->addr,
+                           e->nr_buckets * BUCKET_PAGES);
+    cache->nr -= e->nr_buckets;
+    cache->stats.evictions++;
+    free(e->err);
+    free(e);
+}
+
+/*
+ * Make room for @need more buckets. Going down to 7/8 of the limit
+ * rather than just below it batches the unmaps of a filling cache.
+ */
+static int cache_reclaim(xenforeignmemory_cache *cache, size_t need)
+{
+    size_t target = cache->max - cache->max / 8;
+
+    if ( cache->nr + need <= cache->max )
+        return 0;
+
+    if ( target > cache->max - need )
+        target = need > cache->max ? 0 : cache->max - need;
+
+    while ( cache->nr > target && cache->idle.next != &cache->idle )
+        cache_evict(cache, cache->idle.next);
+
+    if ( cache->nr + need > cache->max )
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Map @nr_buckets buckets from @bucket at an address aligned like them,
+ * by mapping over an aligned part of a larger reservation.
+ */
+static void *map_buckets(xenforeignmemory_cache *cache, xen_pfn_t bucket,
+                         size_t nr_buckets, int *err)
+{
+    size_t pages = nr_buckets * BUCKET_PAGES, len = nr_buckets * BUCKET_BYTES;
+    xen_pfn_t *pfns;
+    char *resv, *addr;
+    void *ret;
+    size_t i;
+
+    pfns = malloc(pages * sizeof(*pfns));
+    if ( !pfns )
+        return NULL;
+    for ( i = 0; i < pages; i++ )
+        pfns[i] = (bucket << BUCKET_SHIFT) + i;
+
+    resv = mmap(NULL, len + BUCKET_BYTES, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( resv == MAP_FAILED )
+        ret = xenforeignmemory_map2(cache->fmem, cache->dom, NULL,
+                                    cache->prot, 0, pages, pfns, err);
+    else
+    {
+        addr = (char *)(((unsigned long)resv + BUCKET_BYTES - 1) &
+                        ~(BUCKET_BYTES - 1));
+        if ( addr > resv )
+            munmap(resv, addr - resv);
+        if ( addr + len < resv + len + BUCKET_BYTES )
+            munmap(addr + len, resv + len + BUCKET_BYTES - (addr + len));
+
+        ret = xenforeignmemory_map2(cache->fmem, cache->dom, addr,
+                                    cache->prot, MAP_FIXED, pages, pfns, err);
+        /* not every platform honours the placement */
+        if ( ret != addr )
+            munmap(addr, len);
+    }
+
+    free(pfns);
+    return ret;
+}
+
+static struct cache_entry *cache_add(xenforeignmemory_cache *cache,
+                                     xen_pfn_t bucket, size_t nr_buckets)
+{
+    size_t pages = nr_buckets * BUCKET_PAGES, i;
+    struct cache_entry *e, **chain;
+    int *err;
+
+    if ( cache_reclaim(cache, nr_buckets) )
+        return NULL;
+
+    e = calloc(1, sizeof(*e));
+    err = malloc(pages * sizeof(*err));
+    if ( !e || !err )
+        goto fail;
+
+    e->addr = map_buckets(cache, bucket, nr_buckets, err);
+    if ( !e->addr )
+        goto fail;
+
+    for ( i = 0; i < pages; i++ )
+        if ( err[i] )
+            break;
+    if ( i == pages )
+    {
+        free(err);
+        err = NULL;
+    }
+
+    e->bucket = bucket;
+    e->nr_buckets = nr_buckets;
+    e->err = err;
+    e->prev = e->next = e;
+    chain = cache_chain(cache, bucket);
+    e->hnext = *chain;
+    *chain = e;
+    idle_add_tail(cache, e);
+    cache->nr += nr_buckets;
+    cache->stats.maps++;
+
+    return e;
+
+ fail:
+    free(err);
+    free(e);
+    return NULL;
+}
+
+/* Returns the first error among @num pages of @e from @gfn, or 0. */
+static int entry_error(struct cache_entry *e, xen_pfn_t gfn, size_t num)
+{
+    size_t i, first = gfn - (e->bucket << BUCKET_SHIFT);
+
+    if ( !e->err )
+        return 0;
+
+    for ( i = 0; i < num; i++ )
+        if ( e->err[first + i] )
+            return e->err[first + i];
+
+    return 0;
+}
+
+xenforeignmemory_cache *xenforeignmemory_cache_create(
+    xenforeignmemory_handle *fmem, uint32_t dom, int prot, size_t max_pages)
+{
+    xenforeignmemory_cache *cache;
+    size_t buckets = 1;
+
+    if ( max_pages < BUCKET_PAGES )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    cache = calloc(1, sizeof(*cache));
+    if ( !cache )
+        return NULL;
+
+    cache->max = max_pages / BUCKET_PAGES;
+    while ( buckets < cache->max && buckets < (1UL << 20) )
+        buckets <<= 1;
+
+    cache->hash = calloc(buckets, sizeof(*cache->hash));
+    if ( !cache->hash )
+    {
+        free(cache);
+        return NULL;
+    }
+
+    cache->fmem = fmem;
+    cache->dom = dom;
+    cache->prot = prot;
+    cache->mask = buckets - 1;
+    cache->idle.prev = cache->idle.next = &cache->idle;
+
+    return cache;
+}
+
+void xenforeignmemory_cache_destroy(xenforeignmemory_cache *cache)
+{
+    size_t i;
+
+    if ( !cache )
+        return;
+
+    for ( i = 0; i <= cache->mask; i++ )
+        while ( cache->hash[i] )
+            cache_evict(cache, cache->hash[i]);
+
+    free(cache->hash);
+    free(cache);
+}
+
+void *xenforeignmemory_cache_map(xenforeignmemory_cache *cache,
+                                 xen_pfn_t gfn, size_t num)
+{
+    xen_pfn_t bucket = gfn >> BUCKET_SHIFT;
+    size_t nr_buckets;
+    struct cache_entry *e;
+    int rc, retried = 0;
+
+    if ( !num )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    nr_buckets = ((gfn + num - 1) >> BUCKET_SHIFT) - bucket + 1;
+
+ again:
+    for ( e = *cache_chain(cache, bucket); e; e = e->hnext )
+        if ( e->bucket == bucket && e->nr_buckets >= nr_buckets )
+            break;
+
+    if ( e )
+        cache->stats.hits++;
+    else
+    {
+        cache->stats.misses++;
+        e = cache_add(cache, bucket, nr_buckets);
+        if ( !e )
+            return NULL;
+        retried = 1;
+    }
+
+    rc = entry_error(e, gfn, num);
+    if ( rc )
+    {
+        /* frames may have been paged out or not populated yet: retry once */
+        if ( !retried && !e->users )
+        {
+            cache_evict(cache, e);
+            retried = 1;
+            goto again;
+        }
+        errno = -rc;
+        return NULL;
+    }
+
+    if ( !e->users++ )
+        idle_del(e);
+
+    return (char *)e->addr +
+        ((gfn - (bucket << BUCKET_SHIFT)) << CACHE_PAGE_SHIFT);
+}
+
+int xenforeignmemory_cache_put(xenforeignmemory_cache *cache,
+                               xen_pfn_t gfn, void *addr)
+{
+    xen_pfn_t bucket = gfn >> BUCKET_SHIFT;
+    struct cache_entry *e;
+
+    for ( e = *cache_chain(cache, bucket); e; e = e->hnext )
+        if ( e->bucket == bucket && e->users &&
+             (char *)addr >= (char *)e->addr &&
+             (char *)addr < (char *)e->addr + e->nr_buckets * BUCKET_BYTES )
+            break;
+
+    if ( !e )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ( !--e->users )
+        idle_add_tail(cache, e);
+
+    return 0;
+}
+
+size_t xenforeignmemory_cache_invalidate(xenforeignmemory_cache *cache,
+                                         xen_pfn_t gfn, size_t num)
+{
+    xen_pfn_t first = gfn >> BUCKET_SHIFT;
+    xen_pfn_t last = (gfn + num - 1) >> BUCKET_SHIFT;
+    struct cache_entry *e, *next;
+    size_t i, busy = 0;
+
+    if ( !num )
+        return 0;
+
+    for ( i = 0; i <= cache->mask; i++ )
+        for ( e = cache->hash[i]; e; e = next )
+        {
+            next = e->hnext;
+            if ( e->bucket > last || e->bucket + e->nr_buckets <= first )
+                continue;
+            if ( e->users )
+                busy++;
+            else
+                cache_evict(cache, e);
+        }
+
+    return busy;
+}
+
+size_t xenforeignmemory_cache_flush(xenforeignmemory_cache *cache)
+{
+    while ( cache->idle.next != &cache->idle )
+        cache_evict(cache, cache->idle.next);
+
+    return cache->nr;
+}
+
+void xenforeignmemory_cache_get_stats(xenforeignmemory_cache *cache,
+                                      xenforeignmemory_cache_stats_t *stats)
+{
+    *stats = cache->stats;
+    stats->pages = cache->nr * BUCKET_PAGES;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
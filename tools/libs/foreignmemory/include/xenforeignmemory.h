@@ -138,6 +138,85 @@ int xenforeignmemory_unmap(xenforeignmemory_handle *fmem,
 int xenforeignmemory_restrict(xenforeignmemory_handle *fmem,
                               domid_t domid);
 
+/*
+ * Mapping cache.
+ *
+ * Keeps foreign mappings of one domain across uses, for callers which
+ * keep touching the same guest memory and would otherwise map and unmap
+ * it every time. Guest frames are mapped in aligned buckets of
+ * 1 << XENFOREIGNMEMORY_CACHE_BUCKET_SHIFT (2M worth, with 4k pages),
+ * placed at equally aligned addresses so that the kernel can use large
+ * mappings where it is able to. A range spanning buckets gets a mapping
+ * of its own.
+ *
+ * A cache is not thread safe and belongs to the handle it was created
+ * with, which must outlive it.
+ */
+#define XENFOREIGNMEMORY_CACHE_BUCKET_SHIFT 9
+
+typedef struct xenforeignmemory_cache xenforeignmemory_cache;
+
+typedef struct xenforeignmemory_cache_stats {
+    uint64_t hits, misses;
+    uint64_t maps, evictions;
+    uint64_t pages;                     /* currently mapped */
+} xenforeignmemory_cache_stats_t;
+
+/*
+ * Creates a cache of mappings of @dom with protection @prot, holding at
+ * most @max_pages guest frames (rounded down to whole buckets, at least
+ * one). Returns NULL and sets errno on failure.
+ */
+xenforeignmemory_cache *xenforeignmemory_cache_create(
+    xenforeignmemory_handle *fmem, uint32_t dom, int prot, size_t max_pages);
+
+/*
+ * Unmaps everything, whether or not it is still in use, and frees the
+ * cache. NULL is accepted.
+ */
+void xenforeignmemory_cache_destroy(xenforeignmemory_cache *cache);
+
+/*
+ * Returns the address at which the @num frames from @gfn are mapped,
+ * mapping them if needed, and takes a reference on that mapping which
+ * must be dropped with xenforeignmemory_cache_put().
+ *
+ * A frame which failed to map is retried once, if nothing else is using
+ * its mapping; if it still fails, NULL is returned with errno set as for
+ * @err in xenforeignmemory_map(). When the cache is full of mappings in
+ * use, NULL is returned with errno set to ENOSPC. Idle mappings are
+ * evicted oldest first, enough of them to leave an eighth of the cache
+ * free, so that unmaps come in batches.
+ */
+void *xenforeignmemory_cache_map(xenforeignmemory_cache *cache,
+                                 xen_pfn_t gfn, size_t num);
+
+/*
+ * Drops the reference taken by xenforeignmemory_cache_map() for @gfn,
+ * which returned @addr. Returns 0, or -1 with errno set to EINVAL if
+ * there is no such reference.
+ */
+int xenforeignmemory_cache_put(xenforeignmemory_cache *cache,
+                               xen_pfn_t gfn, void *addr);
+
+/*
+ * Unmaps the idle mappings which cover any of the @num frames from @gfn,
+ * e.g. after the guest gave them up. Returns how many such mappings are
+ * still in use; those stay valid until put and must be invalidated
+ * again after that.
+ */
+size_t xenforeignmemory_cache_invalidate(xenforeignmemory_cache *cache,
+                                         xen_pfn_t gfn, size_t num);
+
+/*
+ * Unmaps every idle mapping. Returns the number of frames still mapped
+ * by mappings in use.
+ */
+size_t xenforeignmemory_cache_flush(xenforeignmemory_cache *cache);
+
+void xenforeignmemory_cache_get_stats(xenforeignmemory_cache *cache,
+                                      xenforeignmemory_cache_stats_t *stats);
+
 #endif
 
 /*
@@ -0,0 +1,361 @@
+/******************************************************************************
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Grant mapping cache.
+ *
+ * Mappings are kept across uses, keyed by (domid, ref), so that a backend
+ * whose frontend keeps reusing the same grants maps each of them once.
+ * The misses of one xengnttab_cache_map_refs() call are mapped together,
+ * with one ioctl and one mmap, and such a batch is only unmapped once all
+ * of its entries have left the cache, again in one go.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "private.h"
+
+#define CACHE_PAGE_SIZE 4096
+
+struct cache_batch {
+    void *addr;
+    uint32_t count;
+    uint32_t live;                      /* entries still in the cache */
+};
+
+struct cache_entry {
+    uint32_t domid, ref;
+    void *addr;
+    uint32_t users;
+    struct cache_batch *batch;
+    struct cache_entry *hnext;          /* hash chain */
+    struct cache_entry *prev, *next;    /* idle list, oldest first */
+};
+
+struct xengnttab_cache {
+    xengnttab_handle *xgt;
+    int prot;
+    uint32_t max, nr;
+    uint32_t mask;
+    struct cache_entry **hash;
+    struct cache_entry idle;
+    xengnttab_cache_stats_t stats;
+};
+
+static struct cache_entry **cache_bucket(xengnttab_cache *cache,
+                                         uint32_t domid, uint32_t ref)
+{
+    return &cache->hash[(ref ^ (domid * 0x9e3779b1U)) & cache->mask];
+}
+
+static struct cache_entry *cache_lookup(xengnttab_cache *cache,
+                                        uint32_t domid, uint32_t ref)
+{
+    struct cache_entry *e;
+
+    for ( e = *cache_bucket(cache, domid, ref); e; e = e->hnext )
+        if ( e->ref == ref && e->domid == domid )
+            return e;
+
+    return NULL;
+}
+
+static void idle_del(struct cache_entry *e)
+{
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    e->prev = e->next = e;
+}
+
+static void idle_add_tail(xengnttab_cache *cache, struct cache_entry *e)
+{
+    e->prev = cache->idle.prev;
+    e->next = &cache->idle;
+    cache->idle.prev->next = e;
+    cache->idle.prev = e;
+}
+
+static void cache_get(xengnttab_cache *cache, struct cache_entry *e)
+{
+    if ( !e->users++ )
+        idle_del(e);
+}
+
+static void cache_put(xengnttab_cache *cache, struct cache_entry *e)
+{
+    if ( !--e->users )
+        idle_add_tail(cache, e);
+}
+
+/* Drop an idle entry, unmapping its batch if it was the last one. */
+static void cache_evict(xengnttab_cache *cache, struct cache_entry *e)
+{
+    struct cache_entry **pe = cache_bucket(cache, e->domid, e->ref);
+    struct cache_batch *b = e->batch;
+
+    while ( *pe != e )
+        pe = &(*pe)->hnext;
+    *pe = e->hnext;
+
+    idle_del(e);
+    cache->nr--;
+    cache->stats.evictions++;
+
+    if ( !--b->live )
+    {
+        xengnttab_unmap(cache->xgt, b->addr, b->count);
+        cache->stats.unmaps++;
+        free(b);
+    }
+
+    free(e);
+}
+
+xengnttab_cache *xengnttab_cache_create(xengnttab_handle *xgt,
+                                        uint32_t max_entries, int prot)
+{
+    xengnttab_cache *cache;
+    uint32_t buckets = 1;
+
+    if ( !max_entries )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    while ( buckets < max_entries && buckets < (1U << 20) )
+        buckets <<= 1;
+
+    cache = calloc(1, sizeof(*cache));
+    if ( !cache )
+        return NULL;
+
+    cache->hash = calloc(buckets, sizeof(*cache->hash));
+    if ( !cache->hash )
+    {
+        free(cache);
+        return NULL;
+    }
+
+    cache->xgt = xgt;
+    cache->prot = prot;
+    cache->max = max_entries;
+    cache->mask = buckets - 1;
+    cache->idle.prev = cache->idle.next = &cache->idle;
+
+    return cache;
+}
+
+void xengnttab_cache_destroy(xengnttab_cache *cache)
+{
+    struct cache_entry *e;
+    uint32_t i;
+
+    if ( !cache )
+        return;
+
+    for ( i = 0; i <= cache->mask; i++ )
+    {
+        while ( (e = cache->hash[i]) )
+            cache_evict(cache, e);
+    }
+
+    free(cache->hash);
+    free(cache);
+}
+
+int xengnttab_cache_map_refs(xengnttab_cache *cache, uint32_t domid,
+                             uint32_t count, uint32_t *refs, void **addrs)
+{
+    struct cache_entry *e, **entries = NULL, **fresh = NULL;
+    struct cache_batch *b = NULL;
+    uint32_t *miss_refs = NULL;
+    uint32_t i, j, nr_miss = 0;
+    int saved_errno;
+
+    if ( !count )
+        return 0;
+
+    miss_refs = malloc(count * sizeof(*miss_refs));
+    entries = calloc(count, sizeof(*entries));
+    fresh = calloc(count, sizeof(*fresh));
+    if ( !miss_refs || !entries || !fresh )
+        goto fail;
+
+    for ( i = 0; i < count; i++ )
+    {
+        e = cache_lookup(cache, domid, refs[i]);
+        if ( e )
+        {
+            cache_get(cache, e);
+            entries[i] = e;
+            cache->stats.hits++;
+            continue;
+        }
+
+        /* a ref can appear twice in one call; map it once */
+        for ( j = 0; j < nr_miss; j++ )
+            if ( miss_refs[j] == refs[i] )
+                break;
+        if ( j == nr_miss )
+            miss_refs[nr_miss++] = refs[i];
+        cache->stats.misses++;
+    }
+
+    if ( nr_miss )
+    {
+        void *addr;
+
+        while ( cache->nr + nr_miss > cache->max &&
+                cache->idle.next != &cache->idle )
+            cache_evict(cache, cache->idle.next);
+
+        if ( cache->nr + nr_miss > cache->max )
+        {
+            errno = ENOSPC;
+            goto fail;
+        }
+
+        b = malloc(sizeof(*b));
+        if ( !b )
+            goto fail;
+        for ( j = 0; j < nr_miss; j++ )
+            if ( !(fresh[j] = malloc(sizeof(*fresh[j]))) )
+                goto fail;
+
+        addr = xengnttab_map_domain_grant_refs(cache->xgt, nr_miss, domid,
+                                               miss_refs, cache->prot);
+        if ( !addr )
+            goto fail;
+
+        b->addr = addr;
+        b->count = b->live = nr_miss;
+        cache->stats.maps++;
+
+        for ( j = 0; j < nr_miss; j++ )
+        {
+            struct cache_entry **head;
+
+            e = fresh[j];
+            e->domid = domid;
+            e->ref = miss_refs[j];
+            e->addr = (char *)addr + (size_t)j * CACHE_PAGE_SIZE;
+            e->users = 0;
+            e->batch = b;
+            e->prev = e->next = e;
+            head = cache_bucket(cache, domid, e->ref);
+            e->hnext = *head;
+            *head = e;
+            idle_add_tail(cache, e);
+            cache->nr++;
+        }
+
+        for ( i = 0; i < count; i++ )
+        {
+            if ( entries[i] )
+                continue;
+            entries[i] = cache_lookup(cache, domid, refs[i]);
+            cache_get(cache, entries[i]);
+        }
+    }
+
+    for ( i = 0; i < count; i++ )
+        addrs[i] = entries[i]->addr;
+
+    free(fresh);
+    free(entries);
+    free(miss_refs);
+    return 0;
+
+ fail:
+    saved_errno = errno;
+    for ( i = 0; entries && i < count; i++ )
+        if ( entries[i] )
+            cache_put(cache, entries[i]);
+    for ( j = 0; fresh && j < nr_miss; j++ )
+        free(fresh[j]);
+    free(b);
+    free(fresh);
+    free(entries);
+    free(miss_refs);
+    errno = saved_errno;
+    return -1;
+}
+
+int xengnttab_cache_put_refs(xengnttab_cache *cache, uint32_t domid,
+                             uint32_t count, uint32_t *refs)
+{
+    struct cache_entry *e;
+    uint32_t i;
+    int rc = 0;
+
+    for ( i = 0; i < count; i++ )
+    {
+        e = cache_lookup(cache, domid, refs[i]);
+        if ( !e || !e->users )
+        {
+            errno = EINVAL;
+            rc = -1;
+            continue;
+        }
+        cache_put(cache, e);
+    }
+
+    return rc;
+}
+
+int xengnttab_cache_invalidate(xengnttab_cache *cache, uint32_t domid,
+                               uint32_t ref)
+{
+    struct cache_entry *e = cache_lookup(cache, domid, ref);
+
+    if ( !e )
+        return 0;
+
+    if ( e->users )
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    cache_evict(cache, e);
+    return 0;
+}
+
+uint32_t xengnttab_cache_flush(xengnttab_cache *cache)
+{
+    while ( cache->idle.next != &cache->idle )
+        cache_evict(cache, cache->idle.next);
+
+    return cache->nr;
+}
+
+void xengnttab_cache_get_stats(xengnttab_cache *cache,
+                               xengnttab_cache_stats_t *stats)
+{
+    *stats = cache->stats;
+    stats->entries = cache->nr;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
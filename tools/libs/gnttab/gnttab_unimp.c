@@ -84,6 +84,46 @@ int xengnttab_grant_copy(xengnttab_handle *xgt,
 {
     abort();
 }
+
+xengnttab_cache *xengnttab_cache_create(xengnttab_handle *xgt,
+                                        uint32_t max_entries, int prot)
+{
+    abort();
+}
+
+void xengnttab_cache_destroy(xengnttab_cache *cache)
+{
+    abort();
+}
+
+int xengnttab_cache_map_refs(xengnttab_cache *cache, uint32_t domid,
+                             uint32_t count, uint32_t *refs, void **addrs)
+{
+    abort();
+}
+
+int xengnttab_cache_put_refs(xengnttab_cache *cache, uint32_t domid,
+                             uint32_t count, uint32_t *refs)
+{
+    abort();
+}
+
+int xengnttab_cache_invalidate(xengnttab_cache *cache, uint32_t domid,
+                               uint32_t ref)
+{
+    abort();
+}
+
+uint32_t xengnttab_cache_flush(xengnttab_cache *cache)
+{
+    abort();
+}
+
+void xengnttab_cache_get_stats(xengnttab_cache *cache,
+                               xengnttab_cache_stats_t *stats)
+{
+    abort();
+}
 /*
  * Local variables:
  * mode: C
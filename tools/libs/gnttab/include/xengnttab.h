@@ -286,6 +286,80 @@ int xengnttab_grant_copy(xengnttab_handle *xgt,
                          uint32_t count,
                          xengnttab_grant_copy_segment_t *segs);
 
+/*
+ * Grant mapping cache
+ *
+ * Keeps grant mappings alive between uses, keyed by (domid, ref), for
+ * backends whose frontends keep reusing the same grants (e.g. blkif
+ * feature-persistent). Mappings missing from the cache are established
+ * together, one batch per xengnttab_cache_map_refs() call, and a batch
+ * is unmapped in one go once all of its entries have been evicted, so
+ * that the unmap and its TLB flush are paid once per batch rather than
+ * once per page.
+ */
+
+typedef struct xengnttab_cache xengnttab_cache;
+
+typedef struct xengnttab_cache_stats {
+    uint64_t hits, misses;
+    uint64_t maps, unmaps;      /* batches mapped and unmapped */
+    uint64_t evictions;
+    uint32_t entries;
+} xengnttab_cache_stats_t;
+
+/**
+ * Creates a mapping cache of up to @max_entries grants on top of @xgt,
+ * which must remain open until the cache is destroyed. Never logs.
+ *
+ * Since batches are unmapped whole, pages of evicted entries can stay
+ * mapped for a while, and more than @max_entries pages may be mapped.
+ *
+ * @parm prot same flag as in mmap(), used for every mapping made
+ */
+xengnttab_cache *xengnttab_cache_create(xengnttab_handle *xgt,
+                                        uint32_t max_entries, int prot);
+
+/**
+ * Unmaps every grant in the cache and frees it. Addresses handed out by
+ * the cache must no longer be used.
+ */
+void xengnttab_cache_destroy(xengnttab_cache *cache);
+
+/**
+ * Looks up @count grant references of @domid, mapping those not cached
+ * with a single call, and stores the address of each page in @addrs.
+ * Each address stays valid until the matching xengnttab_cache_put_refs().
+ * Idle entries are evicted, oldest first, to make room.  Logs errors.
+ *
+ * On failure sets errno (ENOSPC if every entry is in use) and returns -1,
+ * holding none of @refs.
+ */
+int xengnttab_cache_map_refs(xengnttab_cache *cache, uint32_t domid,
+                             uint32_t count, uint32_t *refs, void **addrs);
+
+/**
+ * Releases @count grant references taken with xengnttab_cache_map_refs().
+ * They stay mapped, and are found again by the next lookup, until evicted.
+ */
+int xengnttab_cache_put_refs(xengnttab_cache *cache, uint32_t domid,
+                             uint32_t count, uint32_t *refs);
+
+/**
+ * Drops one idle grant from the cache, e.g. because its frontend is
+ * about to revoke it. Fails with EBUSY if it is still in use.
+ */
+int xengnttab_cache_invalidate(xengnttab_cache *cache, uint32_t domid,
+                               uint32_t ref);
+
+/**
+ * Drops every idle grant, unmapping each batch which has no entries
+ * left. Returns the number of entries still in use.
+ */
+uint32_t xengnttab_cache_flush(xengnttab_cache *cache);
+
+void xengnttab_cache_get_stats(xengnttab_cache *cache,
+                               xengnttab_cache_stats_t *stats);
+
 /*
  * Grant Sharing Interface (allocating and granting pages to others)
  */
@@ -312,6 +312,7 @@ struct libxenvchan *libxenvchan_server_init(struct xentoollog_logger *logger,
 	ctrl->event = NULL;
 	ctrl->is_server = 1;
 	ctrl->server_persist = 0;
+	ctrl->spin_usec = 0;
 
 	ctrl->read.order = min_order(left_min);
 	ctrl->write.order = min_order(right_min);
@@ -396,6 +397,7 @@ struct libxenvchan *libxenvchan_client_init(struct xentoollog_logger *logger,
 	ctrl->gnttab = NULL;
 	ctrl->write.order = ctrl->read.order = 0;
 	ctrl->is_server = 0;
+	ctrl->spin_usec = 0;
 
 	xs = xs_daemon_open();
 	if (!xs)
@@ -35,6 +35,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <xenctrl.h>
@@ -194,33 +195,129 @@ int libxenvchan_buffer_space(struct libxenvchan *ctrl)
 	return raw_get_buffer_space(ctrl);
 }
 
+/*
+ * Watch the indexes and flags the other end moves for up to spin_usec.
+ * Returns 1 as soon as one of them changes, 0 if none did.
+ */
+static int spin_for_peer(struct libxenvchan *ctrl)
+{
+	struct timespec start, now;
+	uint32_t prod = rd_prod(ctrl), cons = wr_cons(ctrl);
+	int live = libxenvchan_is_open(ctrl);
+	unsigned int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; ; i++) {
+		xen_rmb(); /* re-read the shared page on every pass */
+		if (rd_prod(ctrl) != prod || wr_cons(ctrl) != cons ||
+		    libxenvchan_is_open(ctrl) != live)
+			return 1;
+		if (i % 64)
+			continue;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((now.tv_sec - start.tv_sec) * 1000000 +
+		    (now.tv_nsec - start.tv_nsec) / 1000 >= ctrl->spin_usec)
+			return 0;
+	}
+}
+
+void libxenvchan_set_spin(struct libxenvchan *ctrl, unsigned int usec)
+{
+	ctrl->spin_usec = usec;
+}
+
 int libxenvchan_wait(struct libxenvchan *ctrl)
 {
-	int ret = xenevtchn_pending(ctrl->event);
+	int ret;
+	/*
+	 * A change seen while spinning may still leave its event pending,
+	 * which at worst makes a later wait return early; callers recheck.
+	 */
+	if (ctrl->spin_usec && spin_for_peer(ctrl))
+		return 0;
+	ret = xenevtchn_pending(ctrl->event);
 	if (ret < 0)
 		return -1;
 	xenevtchn_unmask(ctrl->event, ret);
 	return 0;
 }
 
+/*
+ * Describe len bytes of a ring from index idx as two iovecs, split where
+ * the ring wraps; the second is empty if it does not.
+ */
+static void ring_iov(void *ring, uint32_t ring_size, uint32_t idx,
+                     size_t len, struct iovec iov[2])
+{
+	uint32_t real_idx = idx & (ring_size - 1);
+	size_t avail_contig = ring_size - real_idx;
+	if (avail_contig > len)
+		avail_contig = len;
+	iov[0].iov_base = ring + real_idx;
+	iov[0].iov_len = avail_contig;
+	iov[1].iov_base = ring;
+	iov[1].iov_len = len - avail_contig;
+}
+
+static size_t iov_total(const struct iovec *iov, int iovcnt)
+{
+	size_t total = 0;
+	int i;
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	return total;
+}
+
+/*
+ * Copy size bytes between the ring space in ring[2] and the caller's
+ * buffers, skipping the first skip bytes of the latter. to_ring gives the
+ * direction.
+ */
+static void copy_iov(struct iovec ring[2], const struct iovec *iov,
+                     int iovcnt, size_t skip, size_t size, int to_ring)
+{
+	int i, r = 0;
+	for (i = 0; i < iovcnt && size; i++) {
+		char *buf = iov[i].iov_base;
+		size_t len = iov[i].iov_len;
+		if (skip >= len) {
+			skip -= len;
+			continue;
+		}
+		buf += skip;
+		len -= skip;
+		skip = 0;
+		if (len > size)
+			len = size;
+		size -= len;
+		while (len) {
+			size_t n = ring[r].iov_len < len ? ring[r].iov_len : len;
+			if (to_ring)
+				memcpy(ring[r].iov_base, buf, n);
+			else
+				memcpy(buf, ring[r].iov_base, n);
+			ring[r].iov_base += n;
+			ring[r].iov_len -= n;
+			buf += n;
+			len -= n;
+			if (!ring[r].iov_len)
+				r++;
+		}
+	}
+}
+
 /**
  * returns -1 on error, or size on success
  *
  * caller must have checked that enough space is available
  */
-static int do_send(struct libxenvchan *ctrl, const void *data, size_t size)
+static int do_sendv(struct libxenvchan *ctrl, const struct iovec *iov,
+                    int iovcnt, size_t skip, size_t size)
 {
-	int real_idx = wr_prod(ctrl) & (wr_ring_size(ctrl) - 1);
-	int avail_contig = wr_ring_size(ctrl) - real_idx;
-	if (avail_contig > size)
-		avail_contig = size;
+	struct iovec ring[2];
+	ring_iov(wr_ring(ctrl), wr_ring_size(ctrl), wr_prod(ctrl), size, ring);
 	xen_mb(); /* read indexes /then/ write data */
-	memcpy(wr_ring(ctrl) + real_idx, data, avail_contig);
-	if (avail_contig < size)
-	{
-		// we rolled across the end of the ring
-		memcpy(wr_ring(ctrl), data + avail_contig, size - avail_contig);
-	}
+	copy_iov(ring, iov, iovcnt, skip, size, 1);
 	xen_wmb(); /* write data /then/ notify */
 	wr_prod(ctrl) += size;
 	if (send_notify(ctrl, VCHAN_NOTIFY_WRITE))
@@ -228,6 +325,12 @@ static int do_send(struct libxenvchan *ctrl, const void *data, size_t size)
 	return size;
 }
 
+static int do_send(struct libxenvchan *ctrl, const void *data, size_t size)
+{
+	struct iovec iov = { .iov_base = (void *)data, .iov_len = size };
+	return do_sendv(ctrl, &iov, 1, 0, size);
+}
+
 /**
  * returns 0 if no buffer space is available, -1 on error, or size on success
  */
@@ -279,24 +382,80 @@ int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size)
 	}
 }
 
+int libxenvchan_writev(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt)
+{
+	size_t size = iov_total(iov, iovcnt);
+	int avail;
+	if (!libxenvchan_is_open(ctrl))
+		return -1;
+	if (ctrl->blocking) {
+		size_t pos = 0;
+		while (1) {
+			avail = fast_get_buffer_space(ctrl, size - pos);
+			if (pos + avail > size)
+				avail = size - pos;
+			if (avail)
+				pos += do_sendv(ctrl, iov, iovcnt, pos, avail);
+			if (pos == size)
+				return pos;
+			if (libxenvchan_wait(ctrl))
+				return -1;
+			if (!libxenvchan_is_open(ctrl))
+				return -1;
+		}
+	} else {
+		avail = fast_get_buffer_space(ctrl, size);
+		if (size > avail)
+			size = avail;
+		if (size == 0)
+			return 0;
+		return do_sendv(ctrl, iov, iovcnt, 0, size);
+	}
+}
+
+int libxenvchan_write_reserve(struct libxenvchan *ctrl, size_t size, struct iovec iov[2])
+{
+	int avail;
+	while (1) {
+		if (!libxenvchan_is_open(ctrl))
+			return -1;
+		avail = fast_get_buffer_space(ctrl, size);
+		if (avail || !ctrl->blocking || !size)
+			break;
+		if (libxenvchan_wait(ctrl))
+			return -1;
+	}
+	if (size > avail)
+		size = avail;
+	ring_iov(wr_ring(ctrl), wr_ring_size(ctrl), wr_prod(ctrl), size, iov);
+	xen_mb(); /* read indexes /then/ caller writes data */
+	return size;
+}
+
+int libxenvchan_write_commit(struct libxenvchan *ctrl, size_t size)
+{
+	if (size > raw_get_buffer_space(ctrl))
+		return -1;
+	xen_wmb(); /* write data /then/ notify */
+	wr_prod(ctrl) += size;
+	if (send_notify(ctrl, VCHAN_NOTIFY_WRITE))
+		return -1;
+	return size;
+}
+
 /**
  * returns -1 on error, or size on success
  *
  * caller must have checked that enough data is available
  */
-static int do_recv(struct libxenvchan *ctrl, void *data, size_t size)
+static int do_recvv(struct libxenvchan *ctrl, const struct iovec *iov,
+                    int iovcnt, size_t size)
 {
-	int real_idx = rd_cons(ctrl) & (rd_ring_size(ctrl) - 1);
-	int avail_contig = rd_ring_size(ctrl) - real_idx;
-	if (avail_contig > size)
-		avail_contig = size;
+	struct iovec ring[2];
+	ring_iov((void *)rd_ring(ctrl), rd_ring_size(ctrl), rd_cons(ctrl),
+	         size, ring);
 	xen_rmb(); /* data read must happen /after/ rd_cons read */
-	memcpy(data, rd_ring(ctrl) + real_idx, avail_contig);
-	if (avail_contig < size)
-	{
-		// we rolled across the end of the ring
-		memcpy(data + avail_contig, rd_ring(ctrl), size - avail_contig);
-	}
+	copy_iov(ring, iov, iovcnt, 0, size, 0);
 	xen_mb(); /* consume /then/ notify */
 	rd_cons(ctrl) += size;
 	if (send_notify(ctrl, VCHAN_NOTIFY_READ))
@@ -304,6 +463,12 @@ static int do_recv(struct libxenvchan *ctrl, void *data, size_t size)
 	return size;
 }
 
+static int do_recv(struct libxenvchan *ctrl, void *data, size_t size)
+{
+	struct iovec iov = { .iov_base = data, .iov_len = size };
+	return do_recvv(ctrl, &iov, 1, size);
+}
+
 /**
  * reads exactly size bytes from the vchan.
  * returns 0 if insufficient data is available, -1 on error, or size on success
@@ -342,6 +507,57 @@ int libxenvchan_read(struct libxenvchan *ctrl, void *data, size_t size)
 	}
 }
 
+int libxenvchan_readv(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt)
+{
+	size_t size = iov_total(iov, iovcnt);
+	while (1) {
+		int avail = fast_get_data_ready(ctrl, size);
+		if (avail && size > avail)
+			size = avail;
+		if (avail)
+			return do_recvv(ctrl, iov, iovcnt, size);
+		if (!libxenvchan_is_open(ctrl))
+			return -1;
+		if (!ctrl->blocking)
+			return 0;
+		if (libxenvchan_wait(ctrl))
+			return -1;
+	}
+}
+
+int libxenvchan_read_peek(struct libxenvchan *ctrl, size_t size, struct iovec iov[2])
+{
+	int avail;
+	while (1) {
+		avail = fast_get_data_ready(ctrl, size);
+		if (avail || !size)
+			break;
+		if (!libxenvchan_is_open(ctrl))
+			return -1;
+		if (!ctrl->blocking)
+			break;
+		if (libxenvchan_wait(ctrl))
+			return -1;
+	}
+	if (size > avail)
+		size = avail;
+	ring_iov((void *)rd_ring(ctrl), rd_ring_size(ctrl), rd_cons(ctrl),
+	         size, iov);
+	xen_rmb(); /* caller reads data /after/ rd_prod read */
+	return size;
+}
+
+int libxenvchan_read_consume(struct libxenvchan *ctrl, size_t size)
+{
+	if (size > raw_get_data_ready(ctrl))
+		return -1;
+	xen_mb(); /* consume /then/ notify */
+	rd_cons(ctrl) += size;
+	if (send_notify(ctrl, VCHAN_NOTIFY_READ))
+		return -1;
+	return size;
+}
+
 int libxenvchan_is_open(struct libxenvchan* ctrl)
 {
 	if (ctrl->is_server)
@@ -42,6 +42,7 @@
  *  compile time, so the macros in ring.h cannot be used to access the rings.
  */
 
+#include <sys/uio.h>
 #include <xen/io/libxenvchan.h>
 #include <xen/xen.h>
 #include <xen/sys/evtchn.h>
@@ -86,6 +87,8 @@ struct libxenvchan {
 	int blocking:1;
 	/* communication rings */
 	struct libxenvchan_ring read, write;
+	/* microseconds libxenvchan_wait() polls the rings before blocking */
+	unsigned int spin_usec;
 };
 
 /**
@@ -153,10 +156,75 @@ int libxenvchan_send(struct libxenvchan *ctrl, const void *data, size_t size);
  *         the vchan is nonblocking)
  */
 int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size);
+/**
+ * Stream-based scatter receive: reads as much data as possible into the
+ * buffers in order, consuming it and notifying the writer once.
+ * @param ctrl The vchan control structure
+ * @param iov Buffers for data that was read
+ * @param iovcnt Number of buffers
+ * @return -1 on error, otherwise the amount of data read (which may be zero if
+ *         the vchan is nonblocking)
+ */
+int libxenvchan_readv(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt);
+/**
+ * Stream-based gather send: sends as much of the buffers as possible, in
+ * order, publishing it and notifying the reader once per ring-full.
+ * @param ctrl The vchan control structure
+ * @param iov Buffers of data to send
+ * @param iovcnt Number of buffers
+ * @return -1 on error, otherwise the amount of data sent (which may be zero if
+ *         the vchan is nonblocking)
+ */
+int libxenvchan_writev(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt);
+/**
+ * Zero-copy send: reserves up to $size bytes of free space in the write ring
+ * and describes it in at most two iovecs (two when it wraps; the second has
+ * iov_len 0 otherwise). Fill them in and publish them with
+ * libxenvchan_write_commit(). Blocks like libxenvchan_write() until some
+ * space is free.
+ * @param ctrl The vchan control structure
+ * @param size Amount of space wanted
+ * @param iov Filled in with pointers into the ring
+ * @return -1 on error, otherwise the amount of space reserved (which may be
+ *         zero if the vchan is nonblocking)
+ */
+int libxenvchan_write_reserve(struct libxenvchan *ctrl, size_t size, struct iovec iov[2]);
+/**
+ * Publishes the first $size bytes of the space from the last
+ * libxenvchan_write_reserve() and notifies the reader.
+ * @return -1 on error, or $size
+ */
+int libxenvchan_write_commit(struct libxenvchan *ctrl, size_t size);
+/**
+ * Zero-copy receive: describes up to $size bytes of data ready in the read
+ * ring in at most two iovecs, without consuming it. Blocks like
+ * libxenvchan_read() until some data is ready. The buffers are shared with
+ * the peer, which can still change them, so validate data after reading it
+ * out of them, not in place. Release the data with libxenvchan_read_consume().
+ * @param ctrl The vchan control structure
+ * @param size Amount of data wanted
+ * @param iov Filled in with pointers into the ring
+ * @return -1 on error, otherwise the amount of data described (which may be
+ *         zero if the vchan is nonblocking)
+ */
+int libxenvchan_read_peek(struct libxenvchan *ctrl, size_t size, struct iovec iov[2]);
+/**
+ * Consumes the first $size bytes described by the last libxenvchan_read_peek()
+ * and notifies the writer.
+ * @return -1 on error, or $size
+ */
+int libxenvchan_read_consume(struct libxenvchan *ctrl, size_t size);
 /**
  * Waits for reads or writes to unblock, or for a close
  */
 int libxenvchan_wait(struct libxenvchan *ctrl);
+/**
+ * Makes libxenvchan_wait() (and so the blocking calls) watch the rings for
+ * up to $usec microseconds before sleeping on the event channel. At high
+ * message rates the peer usually makes progress within that time, and the
+ * sleep and wakeup are saved. 0, the default, always blocks at once.
+ */
+void libxenvchan_set_spin(struct libxenvchan *ctrl, unsigned int usec);
 /**
  * Returns the event file descriptor for this vchan. When this FD is readable,
  * libxenvchan_wait() will not block, and the state of the vchan has changed since
@@ -85,6 +85,9 @@ struct xc_dom_image {
     size_t max_module_size;
     size_t max_devicetree_size;
 
+    /* Where to cache decompressed images, if it exists; NULL for nowhere. */
+    const char *decompress_cache_dir;
+
     /* arguments and parameters */
     char *cmdline;
     size_t cmdline_size;
@@ -308,6 +311,19 @@ int xc_dom_do_gunzip(xc_interface *xch,
                      void *src, size_t srclen, void *dst, size_t dstlen);
 int xc_dom_try_gunzip(struct xc_dom_image *dom, void **blob, size_t * size);
 
+/*
+ * Decompressed image cache, see xc_dom_core.c.  Nothing is cached unless
+ * the administrator creates the directory.
+ */
+#ifndef XC_DOM_DECOMPRESS_CACHE_DIR
+#define XC_DOM_DECOMPRESS_CACHE_DIR XEN_RUN_DIR "/dom-image-cache"
+#endif
+/* Returns 1, and the cached copy in *blob and *size, or 0 on a miss. */
+int xc_dom_cache_lookup(struct xc_dom_image *dom, void **blob, size_t *size);
+void xc_dom_cache_store(struct xc_dom_image *dom,
+                        const void *zblob, size_t zsize,
+                        const void *blob, size_t size);
+
 int xc_dom_kernel_file(struct xc_dom_image *dom, const char *filename);
 int xc_dom_module_file(struct xc_dom_image *dom, const char *filename,
                        const char *cmdline);
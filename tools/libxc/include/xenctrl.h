@@ -501,7 +501,8 @@ int xc_domain_create(xc_interface *xch, uint32_t ssidref,
 
 
 /* Functions to produce a dump of a given domain
- *  xc_domain_dumpcore - produces a dump to a specified file
+ *  xc_domain_dumpcore - produces a dump to a specified file, leaving holes
+ *                       for zero pages if it is a regular file
  *  xc_domain_dumpcore_via_callback - produces a dump, using a specified
  *                                    callback function
  */
@@ -716,6 +717,63 @@ int xc_vcpu_setaffinity(xc_interface *xch,
                         xc_cpumap_t cpumap_soft_inout,
                         uint32_t flags);
 
+/**
+ * This function sets the hard and/or soft CPU affinity of nr_vcpus vcpus,
+ * starting from first_vcpu, with a single hypercall.
+ *
+ * cpumaps_hard_inout and cpumaps_soft_inout hold nr_vcpus maps of
+ * xc_get_cpumap_size() bytes each, one per vcpu, and get the effective
+ * affinities back, as for xc_vcpu_setaffinity().  If flags contains
+ * XEN_VCPUAFFINITYLIST_SAME they instead hold a single map, applied to all
+ * the vcpus, and are left untouched.  Only the maps whose flag is set need
+ * to be provided.
+ *
+ * @param xch a handle to an open hypervisor interface.
+ * @param domid the id of the domain to which the vcpus belong
+ * @param first_vcpu the id of the first vcpu
+ * @param nr_vcpus the number of vcpus
+ * @param cpumaps_hard_inout specifies(/returns) the (effective) hard affinities
+ * @param cpumaps_soft_inout specifies(/returns) the (effective) soft affinities
+ * @param flags what we want to set
+ */
+int xc_vcpu_setaffinity_list(xc_interface *xch,
+                             uint32_t domid,
+                             uint32_t first_vcpu,
+                             uint32_t nr_vcpus,
+                             xc_cpumap_t cpumaps_hard_inout,
+                             xc_cpumap_t cpumaps_soft_inout,
+                             uint32_t flags);
+
+typedef xen_domctl_exit_stat_t xc_exit_stat_t;
+
+/**
+ * This function enables, disables or resets the VM exit histograms of an
+ * HVM domain.
+ *
+ * @param xch a handle to an open hypervisor interface.
+ * @param domid the id of the domain
+ * @param cmd XEN_DOMCTL_EXIT_STATS_{enable,disable,reset}
+ */
+int xc_hvm_exit_stats_op(xc_interface *xch, uint32_t domid, uint32_t cmd);
+
+/**
+ * This function returns the VM exit histograms of an HVM domain, summed
+ * over its vcpus, one per exit reason which occurred.
+ *
+ * @param xch a handle to an open hypervisor interface.
+ * @param domid the id of the domain
+ * @param nr_reasons IN: the size of @stats; OUT: the number of reasons with
+ *        exits, which may be larger
+ * @param stats the histograms
+ * @param vendor returns XEN_DOMCTL_EXIT_STATS_{VMX,SVM}
+ * @param tsc_khz returns the TSC frequency, the histograms being in cycles
+ * @param enabled returns whether exits are being accounted
+ */
+int xc_hvm_exit_stats_query(xc_interface *xch, uint32_t domid,
+                            uint32_t *nr_reasons, xc_exit_stat_t *stats,
+                            uint32_t *vendor, uint32_t *tsc_khz,
+                            uint32_t *enabled);
+
 /**
  * This function retrieves hard and soft CPU affinity of a vcpu,
  * depending on what flags are set.
@@ -802,6 +860,27 @@ int xc_domain_getinfolist(xc_interface *xch,
                           unsigned int max_domains,
                           xc_domaininfo_t *info);
 
+/**
+ * As xc_domain_getinfolist(), but only returning the domains whose
+ * information changed after generation since (all of them if zero).
+ *
+ * @parm since a generation returned by an earlier call, or 0
+ * @parm next_domain if not NULL, set to the first_domain to continue the
+ *                   enumeration with (DOMID_INVALID once it is complete)
+ * @parm generation if not NULL, set to the generation at the start of the
+ *                  call.  Passing the one from the first call of an
+ *                  enumeration as since to the next enumeration reports all
+ *                  changes in between.
+ * @return the number of domains returned or -1 on error
+ */
+int xc_domain_getinfolist_changed(xc_interface *xch,
+                                  uint32_t first_domain,
+                                  unsigned int max_domains,
+                                  uint64_t since,
+                                  xc_domaininfo_t *info,
+                                  uint32_t *next_domain,
+                                  uint64_t *generation);
+
 /**
  * This function set p2m for broken page
  * &parm xch a handle to an open hypervisor interface
@@ -860,6 +939,38 @@ int xc_domain_hvm_setcontext(xc_interface *xch,
                              uint8_t *hvm_ctxt,
                              uint32_t size);
 
+/**
+ * These get and set the context of a hvm domain in pieces: with
+ * XEN_DOMCTL_HVMCONTEXT_DOMAIN in flags, the header, per-domain records
+ * and end marker, which must be got first; otherwise the per-vcpu records
+ * of vcpus [first_vcpu, first_vcpu + nr_vcpus), each vcpu being paused
+ * only while its own are gathered. Setting the pieces is by
+ * xc_domain_hvm_setcontext() for the domain one, then
+ * xc_domain_hvm_setcontext_vcpus() for the others.
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm domid the domain to get or set the context of
+ * @parm first_vcpu the first vcpu of the piece
+ * @parm nr_vcpus the number of vcpus of the piece
+ * @parm flags XEN_DOMCTL_HVMCONTEXT_*
+ * @parm ctxt_buf the piece, NULL to query its size
+ * @parm size the size of ctxt_buf in bytes
+ * @return the size of the piece (get), 0 (set) on success, -1 on failure
+ */
+int xc_domain_hvm_getcontext_vcpus(xc_interface *xch,
+                                   uint32_t domid,
+                                   uint32_t first_vcpu,
+                                   uint32_t nr_vcpus,
+                                   uint32_t flags,
+                                   uint8_t *ctxt_buf,
+                                   uint32_t size);
+int xc_domain_hvm_setcontext_vcpus(xc_interface *xch,
+                                   uint32_t domid,
+                                   uint32_t first_vcpu,
+                                   uint32_t nr_vcpus,
+                                   uint8_t *ctxt_buf,
+                                   uint32_t size);
+
 /**
  * This function will return guest IO ABI protocol
  *
@@ -930,6 +1041,32 @@ int xc_vcpu_getinfo(xc_interface *xch,
                     uint32_t vcpu,
                     xc_vcpuinfo_t *info);
 
+/**
+ * This function returns information about the vcpus of many domains (or
+ * of one, if single_domain is set) in one hypercall, starting with vcpu
+ * *vcpu of the first domain from *domid on, in the order of
+ * xc_domain_getinfolist().
+ *
+ * @parm domid IN: domain to start from; OUT: where to continue, or
+ *             DOMID_INVALID once all vcpus have been returned
+ * @parm vcpu IN: vcpu to start from; OUT: where to continue
+ * @parm max_vcpus the number of elements in info
+ * @parm info an array of max_vcpus elements
+ * @parm cpumap_hard, cpumap_soft if not NULL, max_vcpus maps of
+ *       nr_cpumap_bytes each, for the affinities of the vcpus in info
+ * @return the number of vcpus returned or -1 on error
+ */
+typedef struct xen_sysctl_vcpuinfo xc_vcpuinfolist_t;
+int xc_vcpu_getinfolist(xc_interface *xch,
+                        uint32_t *domid,
+                        uint32_t *vcpu,
+                        bool single_domain,
+                        unsigned int max_vcpus,
+                        xc_vcpuinfolist_t *info,
+                        uint8_t *cpumap_hard,
+                        uint8_t *cpumap_soft,
+                        unsigned int nr_cpumap_bytes);
+
 long long xc_domain_get_cpu_usage(xc_interface *xch,
                                   uint32_t domid,
                                   int vcpu);
@@ -947,6 +1084,54 @@ int xc_shadow_control(xc_interface *xch,
                       uint32_t mode,
                       xc_shadow_op_stats_t *stats);
 
+/*
+ * Get or set how many pagetables each vcpu of a shadowed domain may have
+ * out of sync at once.
+ */
+int xc_shadow_get_oos_pages(xc_interface *xch, uint32_t domid,
+                            unsigned int *nr);
+int xc_shadow_set_oos_pages(xc_interface *xch, uint32_t domid,
+                            unsigned int nr);
+
+/*
+ * Have Xen queue GFNs on a ring as they get marked dirty (HAP guests in
+ * log-dirty mode only).  @entries must be a power of two; 0 tears the ring
+ * down again.
+ */
+int xc_logdirty_ring_setup(xc_interface *xch,
+                           uint32_t domid,
+                           unsigned long entries);
+
+/*
+ * Drain up to @nr GFNs off the dirty ring into @gfns, clearing them in the
+ * log-dirty bitmap.  The number of GFNs drained is stored in @drained, on
+ * failure too, as those have been cleared in the bitmap already.  Returns 0,
+ * or -1 with errno set to EOVERFLOW if entries had to be dropped, in which
+ * case the bitmap needs to be fetched with XEN_DOMCTL_SHADOW_OP_CLEAN
+ * instead.
+ */
+int xc_logdirty_ring_drain(xc_interface *xch,
+                           uint32_t domid,
+                           uint64_t *gfns,
+                           unsigned long nr,
+                           unsigned long *drained);
+
+/*
+ * Fetch the non-empty 64-GFN chunks of the log-dirty bitmap in
+ * [*@first_gfn, *@first_gfn + @nr_gfns), clearing them as well if @clean is
+ * set.  Returns the number of chunks written to @chunks, and updates
+ * *@first_gfn to where to carry on; the range has been covered once it gets
+ * to the end of it.  These calls don't take the domctl lock, so several
+ * threads may work on disjoint ranges concurrently.
+ */
+long xc_logdirty_range(xc_interface *xch,
+                       uint32_t domid,
+                       bool clean,
+                       uint64_t *first_gfn,
+                       uint64_t nr_gfns,
+                       xen_domctl_shadow_dirty_chunk_t *chunks,
+                       unsigned long nr_chunks);
+
 int xc_sched_credit_domain_set(xc_interface *xch,
                                uint32_t domid,
                                struct xen_domctl_sched_credit *sdom);
@@ -1098,6 +1283,22 @@ int xc_domain_set_gnttab_limits(xc_interface *xch, uint32_t domid,
                                 uint32_t grant_frames,
                                 uint32_t maptrack_frames);
 
+/**
+ * Set / get the speculative mitigation profile of a domain (x86 only).
+ * vCPUs of domains in the same non-zero trust group aren't isolated from
+ * one another on context switch.  XEN_DOMCTL_SPEC_CTRL_no_xpti in @flags
+ * lets a PV domain run without Xen page table isolation.
+ *
+ * @param xch a handle to an open hypervisor interface
+ * @param domid the domain id
+ * @param trust_group trust group, 0 for the cpupool's
+ * @param flags XEN_DOMCTL_SPEC_CTRL_* flags
+ */
+int xc_domain_set_spec_ctrl(xc_interface *xch, uint32_t domid,
+                            uint32_t trust_group, uint32_t flags);
+int xc_domain_get_spec_ctrl(xc_interface *xch, uint32_t domid,
+                            uint32_t *trust_group, uint32_t *flags);
+
 /*
  * CPUPOOL MANAGEMENT FUNCTIONS
  */
@@ -1106,6 +1307,7 @@ typedef struct xc_cpupoolinfo {
     uint32_t cpupool_id;
     uint32_t sched_id;
     uint32_t n_dom;
+    uint32_t trust_group;
     xc_cpumap_t cpumap;
 } xc_cpupoolinfo_t;
 
@@ -1187,6 +1389,24 @@ int xc_cpupool_movedomain(xc_interface *xch,
                           uint32_t poolid,
                           uint32_t domid);
 
+/**
+ * Move several domains to another cpupool in one go.  Domains already in
+ * the pool are left where they are.
+ *
+ * @parm xc_handle a handle to an open hypervisor interface
+ * @parm poolid id of the destination cpupool
+ * @parm domids ids of the domains to move
+ * @parm nr_domids number of entries in domids
+ * @parm done if not NULL, set to the number of domains dealt with, i.e. on
+ *            failure the index of the domain which couldn't be moved
+ * return 0 on success, -1 on failure
+ */
+int xc_cpupool_movedomains(xc_interface *xch,
+                           uint32_t poolid,
+                           const uint32_t *domids,
+                           unsigned int nr_domids,
+                           unsigned int *done);
+
 /**
  * Return map of cpus not in any cpupool.
  *
@@ -1195,6 +1415,19 @@ int xc_cpupool_movedomain(xc_interface *xch,
  */
 xc_cpumap_t xc_cpupool_freeinfo(xc_interface *xch);
 
+/**
+ * Set the speculative mitigation trust group of a cpupool's domains which
+ * don't have one of their own (see xc_domain_set_spec_ctrl()).
+ *
+ * @parm xc_handle a handle to an open hypervisor interface
+ * @parm poolid id of the cpupool
+ * @parm trust_group trust group, 0 for none
+ * return 0 on success, -1 on failure
+ */
+int xc_cpupool_set_trust_group(xc_interface *xch,
+                               uint32_t poolid,
+                               uint32_t trust_group);
+
 /*
  * EVENT CHANNEL FUNCTIONS
  *
@@ -1229,6 +1462,23 @@ int xc_evtchn_reset(xc_interface *xch,
 typedef struct evtchn_status xc_evtchn_status_t;
 int xc_evtchn_status(xc_interface *xch, xc_evtchn_status_t *status);
 
+typedef xen_sysctl_evtchn_steer_t xc_evtchn_steer_t;
+/**
+ * Report the event channels of a domain that Xen may steer between its
+ * vCPUs, with the vCPU each currently notifies.
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm domid the domain to query
+ * @parm nr_ports IN: number of entries in @ports, OUT: number of
+ *       steerable ports (which may exceed the number reported)
+ * @parm period_ms OUT: steering period, 0 if steering is disabled
+ * @parm ports the steerable ports (may be NULL if *nr_ports is 0)
+ * @return 0 on success, -1 on failure
+ */
+int xc_evtchn_steering(xc_interface *xch, uint32_t domid,
+                       uint32_t *nr_ports, uint32_t *period_ms,
+                       xc_evtchn_steer_t *ports);
+
 
 
 int xc_physdev_pci_access_modify(xc_interface *xch,
@@ -1244,6 +1494,12 @@ int xc_readconsolering(xc_interface *xch,
                        int clear, int incremental, uint32_t *pindex);
 
 int xc_send_debug_keys(xc_interface *xch, char *keys);
+/*
+ * Collect the output of debug key @key's handler in @buffer.  On entry
+ * *@size is the size of @buffer, on success it is the size of the output,
+ * which was truncated if that is larger.
+ */
+int xc_debug_dump(xc_interface *xch, char key, char *buffer, uint32_t *size);
 int xc_set_parameters(xc_interface *xch, char *params);
 
 typedef struct xen_sysctl_physinfo xc_physinfo_t;
@@ -1489,6 +1745,13 @@ int xc_perfc_query_number(xc_interface *xch,
 int xc_perfc_query(xc_interface *xch,
                    xc_hypercall_buffer_t *desc,
                    xc_hypercall_buffer_t *val);
+/*
+ * Locate the layout info (struct xen_sysctl_perfc_shared) of the counter
+ * pages Xen shares when booted with "perfc_shared".
+ */
+int xc_perfc_shared_info(xc_interface *xch,
+                         uint64_t *info_mfn,
+                         uint32_t *info_frames);
 
 typedef xen_sysctl_lockprof_data_t xc_lockprof_data_t;
 int xc_lockprof_reset(xc_interface *xch);
@@ -1499,6 +1762,60 @@ int xc_lockprof_query(xc_interface *xch,
                       uint64_t *time,
                       xc_hypercall_buffer_t *data);
 
+typedef xen_sysctl_lockhist_data_t xc_lockhist_data_t;
+int xc_lockhist_reset(xc_interface *xch);
+int xc_lockhist_set_rate(xc_interface *xch, uint32_t rate);
+int xc_lockhist_query_number(xc_interface *xch,
+                             uint32_t *n_elems,
+                             uint32_t *rate,
+                             uint32_t *dropped);
+int xc_lockhist_query(xc_interface *xch,
+                      uint32_t *n_elems,
+                      uint32_t *rate,
+                      uint32_t *dropped,
+                      xc_hypercall_buffer_t *data);
+
+typedef xen_sysctl_hcstats_data_t xc_hcstats_data_t;
+/* XEN_SYSCTL_HCSTATS_{enable,disable,reset} */
+int xc_hcstats_op(xc_interface *xch, uint32_t cmd);
+int xc_hcstats_query_number(xc_interface *xch,
+                            uint32_t *n_elems,
+                            uint32_t *enabled,
+                            uint32_t *dropped);
+int xc_hcstats_query(xc_interface *xch,
+                     uint32_t *n_elems,
+                     uint32_t *enabled,
+                     uint32_t *dropped,
+                     xc_hypercall_buffer_t *data);
+
+typedef xen_sysctl_schedstats_vcpu_t xc_schedstats_vcpu_t;
+typedef xen_sysctl_schedstats_cpu_t xc_schedstats_cpu_t;
+/* XEN_SYSCTL_SCHEDSTATS_{enable,disable,reset} */
+int xc_sched_stats_op(xc_interface *xch, uint32_t cmd);
+/*
+ * Scheduling latencies of a domain's vcpus, indexed by vcpu id, and the
+ * runqueue depth samples of the online pcpus. On input *nr is the size
+ * of the array, on output the number of elements available.
+ */
+int xc_sched_stats_query_vcpus(xc_interface *xch, uint32_t domid,
+                               uint32_t *nr, xc_schedstats_vcpu_t *stats,
+                               uint32_t *enabled);
+int xc_sched_stats_query_cpus(xc_interface *xch,
+                              uint32_t *nr, xc_schedstats_cpu_t *stats,
+                              uint32_t *enabled);
+
+typedef xen_sysctl_pmuprof_sample_t xc_pmuprof_sample_t;
+/* nr_samples is the size of the per-pcpu buffers, and a power of 2. */
+int xc_pmuprof_start(xc_interface *xch, uint32_t period, uint32_t nr_samples);
+int xc_pmuprof_stop(xc_interface *xch);
+/*
+ * Take the buffered samples of a pcpu. On input *nr is the size of the
+ * array, on output the number of samples returned. *lost is the number of
+ * samples that cpu dropped on a full buffer since the start.
+ */
+int xc_pmuprof_read(xc_interface *xch, uint32_t cpu, uint32_t *nr,
+                    xc_pmuprof_sample_t *samples, uint64_t *lost);
+
 void *xc_memalign(xc_interface *xch, size_t alignment, size_t size);
 
 /**
@@ -1864,6 +2181,9 @@ struct xc_cx_stat {
     uint32_t nr_cc;        /* entry nr in cc[] */
     uint64_t *pc;          /* 1-biased indexing (i.e. excl C0) */
     uint64_t *cc;          /* 1-biased indexing (i.e. excl C0) */
+    uint64_t pred_total;       /* idle governor selections */
+    uint64_t pred_too_deep;    /* woke before target residency */
+    uint64_t pred_too_shallow; /* slept past next Cx's target residency */
 };
 typedef struct xc_cx_stat xc_cx_stat_t;
 
@@ -1928,6 +2248,16 @@ int xc_set_cpuidle_max_cstate(xc_interface *xch, uint32_t value);
 
 int xc_enable_turbo(xc_interface *xch, int cpuid);
 int xc_disable_turbo(xc_interface *xch, int cpuid);
+
+int xc_get_cpufreq_domain_boost(xc_interface *xch, uint32_t domid,
+                                bool *boost);
+int xc_set_cpufreq_domain_boost(xc_interface *xch, uint32_t domid,
+                                bool boost);
+
+int xc_get_cpupool_idle_latency(xc_interface *xch, uint32_t poolid,
+                                uint32_t *latency);
+int xc_set_cpupool_idle_latency(xc_interface *xch, uint32_t poolid,
+                                uint32_t latency);
 /**
  * tmem operations
  */
@@ -2023,6 +2353,17 @@ int xc_get_mem_access(xc_interface *xch, uint32_t domain_id,
  * Caller has to unmap this page when done.
  */
 void *xc_monitor_enable(xc_interface *xch, uint32_t domain_id, uint32_t *port);
+/*
+ * With the monitor ring enabled, give the vCPUs [first_vcpu, first_vcpu +
+ * nr_vcpus) a ring (and event channel) of their own, so that introspecting
+ * many vCPUs doesn't serialise on one ring.  Responses go on the ring the
+ * request was taken from.  Returns the mapped ring page like
+ * xc_monitor_enable(); all rings go away with xc_monitor_disable(), and
+ * xc_monitor_resume() pulls responses off all of them.
+ */
+void *xc_monitor_add_ring(xc_interface *xch, uint32_t domain_id,
+                          unsigned int first_vcpu, unsigned int nr_vcpus,
+                          uint32_t *port);
 int xc_monitor_disable(xc_interface *xch, uint32_t domain_id);
 int xc_monitor_resume(xc_interface *xch, uint32_t domain_id);
 /*
@@ -2236,6 +2577,20 @@ int xc_memshr_range_share(xc_interface *xch,
                           uint64_t first_gfn,
                           uint64_t last_gfn);
 
+/* Turns the empty, paused HVM domain domid into a copy-on-write fork of
+ * parent_domain. Both domains must have memory sharing enabled and the
+ * same number of vCPUs, and the parent must stay paused while the fork
+ * exists. vCPU state, HVM params, shared_info and vcpu_info are copied;
+ * memory is populated from the parent on the child's first access.
+ *
+ * May fail with EBUSY if either domain is not paused, EINVAL if the child
+ * is not empty or does not match the parent, or EXDEV if the child has
+ * passthrough devices.
+ */
+int xc_memshr_fork(xc_interface *xch,
+                   uint32_t parent_domain,
+                   uint32_t domid);
+
 /* Debug calls: return the number of pages referencing the shared frame backing
  * the input argument. Should be one or greater. 
  *
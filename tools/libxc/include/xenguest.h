@@ -29,6 +29,25 @@
 #define XCFLAGS_HVM       (1 << 2)
 #define XCFLAGS_STDVGA    (1 << 3)
 #define XCFLAGS_CHECKPOINT_COMPRESS    (1 << 4)
+/* Send zero pages as ZERO_PAGE_DATA records: the receiver must know them. */
+#define XCFLAGS_ZERO_PAGES             (1 << 5)
+/*
+ * Live migrate HVM guests post-copy: resume the guest on the receiver after
+ * the pre-copy rounds, and send the pages still dirty on demand.  Needs a
+ * back channel, and a receiver which can page the guest.
+ */
+#define XCFLAGS_POSTCOPY               (1 << 6)
+/*
+ * Let the built-in precopy policy throttle the guest's vcpus, with a
+ * scheduler cap, when the pre-copy rounds stop getting anywhere.
+ */
+#define XCFLAGS_AUTO_CONVERGE          (1 << 7)
+/*
+ * Record where each page's data is in the image, for it to be restored
+ * lazily (see restore_callbacks.lazy).  Only for non-live saves of HVM
+ * guests to a seekable file.
+ */
+#define XCFLAGS_PAGE_INDEX             (1 << 8)
 
 #define X86_64_B_SIZE   64 
 #define X86_32_B_SIZE   32
@@ -74,6 +93,14 @@ struct save_callbacks {
                                         * remaining dirty pages. */
     precopy_policy_t precopy_policy;
 
+    /*
+     * Without a precopy_policy, the longest the guest should stay paused
+     * for, in milliseconds.  The built-in policy then measures the dirty
+     * rate and throughput of each round to judge when to stop and copy.
+     * 0 for a fixed number of rounds instead.
+     */
+    unsigned int max_downtime_ms;
+
     /*
      * Called after the guest's dirty pages have been
      *  copied into an output buffer.
@@ -111,6 +138,18 @@ struct save_callbacks {
     /* Enable qemu-dm logging dirty pages to xen */
     int (*switch_qemu_logdirty)(uint32_t domid, unsigned enable, void *data); /* HVM only */
 
+    /*
+     * Post-copy migration only (optional).  Called once the guest state
+     * is in the stream and only memory is left to send, before the guest
+     * gets resumed on the receiver.  It may write the device model state
+     * into the stream, for the restore side's callback to read.
+     *
+     * returns:
+     * 1: carry on with the migration
+     * 0 or less: abandon it
+     */
+    int (*postcopy_transition)(void *data);
+
     /* to be provided as the last argument to each callback function */
     void* data;
 };
@@ -136,6 +175,19 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
                    struct save_callbacks* callbacks, int hvm,
                    xc_migration_stream_t stream_type, int recv_fd);
 
+/**
+ * As xc_domain_save(), spreading the page data over nr_data_fds data
+ * streams (e.g. one TCP connection each) besides io_fd, which carries
+ * everything else.  The restore side must be given the same number of data
+ * streams, in the same order.  Not available with checkpointing or
+ * post-copy.
+ */
+int xc_domain_save_streams(xc_interface *xch, int io_fd,
+                           const int *data_fds, unsigned int nr_data_fds,
+                           uint32_t dom, uint32_t flags /* XCFLAGS_xxx */,
+                           struct save_callbacks* callbacks, int hvm,
+                           xc_migration_stream_t stream_type, int recv_fd);
+
 /* callbacks provided by xc_domain_restore */
 struct restore_callbacks {
     /* Called after a new checkpoint to suspend the guest.
@@ -172,6 +224,28 @@ struct restore_callbacks {
     void (*restore_results)(xen_pfn_t store_gfn, xen_pfn_t console_gfn,
                             void *data);
 
+    /*
+     * Post-copy migration only (optional).  Called, after restore_results,
+     * once the guest state is loaded and only memory is outstanding, which
+     * the guest then faults in on demand.  It may read the device model
+     * state off the stream, and should unpause the guest.  Without it, the
+     * guest stays paused until all of its memory has arrived.
+     *
+     * returns:
+     * 1: carry on with the migration
+     * 0 or less: abandon it
+     */
+    int (*postcopy_transition)(void *data);
+
+    /*
+     * Restore memory lazily, if the image has a page index and io_fd can be
+     * seeked: the page data is skipped, and read from the image as the
+     * guest faults it in, or in the background.  The guest gets resumed as
+     * in a post-copy migration, and xc_domain_restore() only returns once
+     * all of its memory is in.  HVM guests only.
+     */
+    unsigned int lazy;
+
     /* to be provided as the last argument to each callback function */
     void* data;
 };
@@ -201,6 +275,22 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       xc_migration_stream_t stream_type,
                       struct restore_callbacks *callbacks, int send_back_fd);
 
+/**
+ * As xc_domain_restore(), for a stream from xc_domain_save_streams().  The
+ * data_fds must be sockets, in the order the save side has them in.
+ */
+int xc_domain_restore_streams(xc_interface *xch, int io_fd,
+                              const int *data_fds, unsigned int nr_data_fds,
+                              uint32_t dom, unsigned int store_evtchn,
+                              unsigned long *store_mfn, uint32_t store_domid,
+                              unsigned int console_evtchn,
+                              unsigned long *console_mfn,
+                              uint32_t console_domid,
+                              unsigned int hvm, unsigned int pae,
+                              xc_migration_stream_t stream_type,
+                              struct restore_callbacks *callbacks,
+                              int send_back_fd);
+
 /**
  * This function will create a domain for a paravirtualized Linux
  * using file names pointing to kernel and ramdisk
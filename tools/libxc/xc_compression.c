@@ -8,6 +8,8 @@
  * to the receiver. The cache is then updated with the newer copy of guest page.
  * - The receiver will XOR the non-zero sections against its copy of the guest
  * page, thereby bringing the guest page up-to-date with the sender side.
+ * - Pages are compressed in chunks, each spread over a few threads when
+ * there are CPUs to spare.
  *
  * Copyright (c) 2011 Shriram Rajagopalan (rshriram@cs.ubc.ca).
  *
@@ -28,6 +30,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <inttypes.h>
@@ -45,12 +49,40 @@
  */
 #define PAGE_BUFFER_SIZE (XC_PAGE_SIZE * 8192)
 
+/*
+ * Pages are compressed CHUNK_PAGES at a time, by up to MAX_THREADS threads
+ * (including the caller's), into per page slots, which are then copied out
+ * to the caller's buffer in order.
+ */
+#define CHUNK_PAGES 256
+#define MAX_THREADS 4
+/* Chunks smaller than this are not worth waking the workers up for. */
+#define MIN_PARALLEL_PAGES 16
+
 struct cache_page
 {
     char *page;
     xen_pfn_t pfn;
     struct cache_page *next;
     struct cache_page *prev;
+    /* On the protected list, rather than the probationary one. */
+    bool protected;
+    /* Chunk which last used the page. */
+    unsigned long chunk;
+};
+
+struct cache_list
+{
+    struct cache_page *head;
+    struct cache_page *tail;
+    unsigned long nr;
+};
+
+struct compression_worker
+{
+    comp_ctx *ctx;
+    pthread_t thread;
+    unsigned int share;
 };
 
 struct compression_ctx
@@ -67,13 +99,39 @@ struct compression_ctx
     unsigned int pfns_len;
     unsigned int pfns_index;
 
-    /* Compression Cache (LRU) */
+    /*
+     * Compression Cache (segmented LRU).  Pages come in at the head of the
+     * probationary list, and only move to the protected one when they get
+     * dirtied again while still cached.  Checkpoints dirtying more pages
+     * than fit in the cache then only churn through the probationary list,
+     * rather than flushing out the pages dirtied at every checkpoint.
+     */
     char *cache_base;
     struct cache_page **pfn2cache;
     struct cache_page *cache;
-    struct cache_page *page_list_head;
-    struct cache_page *page_list_tail;
+    struct cache_list probation;
+    struct cache_list protected;
+    unsigned long max_protected;
     unsigned long dom_pfnlist_size;
+
+    /* Current chunk: input pages, cache pages, and compressed data. */
+    unsigned long chunk;
+    char *chunk_src[CHUNK_PAGES];
+    char *chunk_cache[CHUNK_PAGES];
+    bool chunk_raw[CHUNK_PAGES];
+    unsigned int chunk_len[CHUNK_PAGES];
+    char *chunkbuf;
+    /* Pages compressed, and already copied out to the caller. */
+    unsigned int chunk_nr, chunk_next;
+
+    /* Workers, woken up by bumping gen, and counted back in by nr_busy. */
+    struct compression_worker workers[MAX_THREADS - 1];
+    unsigned int nr_workers;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned long gen;
+    unsigned int nr_busy;
+    bool exit;
 };
 
 #define RUNFLAG 0
@@ -114,35 +172,55 @@ struct compression_ctx
  *  cache_page points to a free page slot in the cache where
  *  this new page can be copied to.
  */
-static int add_full_page(comp_ctx *ctx, char *srcpage, char *cache_page)
+static int add_full_page(char *dest, char *srcpage, char *cache_page)
 {
-    char *dest = (ctx->compbuf + ctx->compbuf_pos);
-
-    if ( (ctx->compbuf_pos + FULL_PAGE_SIZE) > ctx->compbuf_size)
-        return -1;
-
     if (cache_page)
         memcpy(cache_page, srcpage, XC_PAGE_SIZE);
     dest[0] = FULL_PAGE;
     memcpy(&dest[1], srcpage, XC_PAGE_SIZE);
-    ctx->compbuf_pos += FULL_PAGE_SIZE;
 
     return FULL_PAGE_SIZE;
 }
 
-static int compress_page(comp_ctx *ctx, char *srcpage, char *cache_page)
+/*
+ * Index of the first delta, from off on, where the pages differ.  Pages
+ * mostly differ in few places, so most of the search is for the end of
+ * runs of identical deltas, which gets done 32 bytes at a time, in a way
+ * the compiler can turn into vector instructions.
+ */
+static unsigned int find_delta(const uint32_t *old, const uint32_t *new,
+                               unsigned int off)
 {
-    char *dest = (ctx->compbuf + ctx->compbuf_pos);
-    uint32_t *new, *old;
+    const uint64_t *old64, *new64;
 
-    int off, runptr = 0;
-    int wascopying = 0, copying = 0, bytes_skipped = 0;
-    int complen = 0, pageoff = 0, runbytes = 0;
+    for (; off < MAX_DELTAS && (off & 7); off++)
+        if (old[off] != new[off])
+            return off;
 
-    char runlen = 0;
+    /* 32 byte aligned now, as the pages are page aligned. */
+    for (; off + 8 <= MAX_DELTAS; off += 8)
+    {
+        old64 = (const uint64_t *)&old[off];
+        new64 = (const uint64_t *)&new[off];
 
-    if ( (ctx->compbuf_pos + WORST_COMP_PAGE_SIZE) > ctx->compbuf_size)
-        return -1;
+        if ((old64[0] ^ new64[0]) | (old64[1] ^ new64[1]) |
+            (old64[2] ^ new64[2]) | (old64[3] ^ new64[3]))
+            break;
+    }
+
+    for (; off < MAX_DELTAS; off++)
+        if (old[off] != new[off])
+            break;
+
+    return off;
+}
+
+static int compress_page(char *dest, char *srcpage, char *cache_page)
+{
+    uint32_t *new, *old;
+    unsigned int off = 0, end, len;
+    int complen = 0, pageoff, runbytes;
+    int copying;
 
     /*
      * There are no alignment issues here since srcpage is
@@ -152,57 +230,96 @@ static int compress_page(comp_ctx *ctx, char *srcpage, char *cache_page)
     new = (uint32_t*)srcpage;
     old = (uint32_t*)cache_page;
 
-    for (off = 0; off <= MAX_DELTAS; off++)
+    /* Unchanged page. */
+    if (find_delta(old, new, 0) == MAX_DELTAS)
+    {
+        dest[0] = EMPTY_PAGE;
+        return 1;
+    }
+
+    while (off < MAX_DELTAS)
     {
-        /*
-         * At (off == MAX_DELTAS), we are processing the last run
-         * in the page. Since there is no XORing, make wascopying != copying
-         * to satisfy the if-block below.
-         */
-        copying = ((off < MAX_DELTAS) ? (old[off] != new[off]) : !wascopying);
-
-        if (runlen)
+        copying = (old[off] != new[off]);
+        if (copying)
         {
-            /* switching between run types or current run is full */
-            if ( (wascopying != copying) || (runlen == LENMASK) )
-            {
-                runbytes = runlen * sizeof(uint32_t);
-                runlen |= (wascopying ? RUNFLAG : SKIPFLAG);
-                dest[complen++] = runlen;
+            for (end = off + 1; end < MAX_DELTAS && old[end] != new[end];
+                 end++)
+                ;
+        }
+        else
+            end = find_delta(old, new, off);
 
-                if (wascopying) /* RUNFLAG */
-                {
-                    pageoff = runptr * sizeof(uint32_t);
-                    memcpy(dest + complen, srcpage + pageoff, runbytes);
-                    memcpy(cache_page + pageoff, srcpage + pageoff, runbytes);
-                    complen += runbytes;
-                }
-                else /* SKIPFLAG */
-                {
-                    bytes_skipped += runbytes;
-                }
+        /* Runs are LENMASK deltas long at most. */
+        for (; off < end; off += len)
+        {
+            len = end - off;
+            if (len > LENMASK)
+                len = LENMASK;
+            dest[complen++] = len | (copying ? RUNFLAG : SKIPFLAG);
 
-                runlen = 0;
-                runptr = off;
+            if (copying) /* RUNFLAG */
+            {
+                pageoff = off * sizeof(uint32_t);
+                runbytes = len * sizeof(uint32_t);
+                memcpy(dest + complen, srcpage + pageoff, runbytes);
+                memcpy(cache_page + pageoff, srcpage + pageoff, runbytes);
+                complen += runbytes;
             }
         }
-        runlen++;
-        wascopying = copying;
     }
 
-    /*
-     * Check for empty page.
-     */
-    if (bytes_skipped == XC_PAGE_SIZE)
-    {
-        complen = 1;
-        dest[0] = EMPTY_PAGE;
-    }
-    ctx->compbuf_pos += complen;
-
     return complen;
 }
 
+static void cache_list_del(struct cache_list *list, struct cache_page *item)
+{
+    if (item->prev)
+        item->prev->next = item->next;
+    else
+        list->head = item->next;
+
+    if (item->next)
+        item->next->prev = item->prev;
+    else
+        list->tail = item->prev;
+
+    item->next = item->prev = NULL;
+    list->nr--;
+}
+
+static void cache_list_add_head(struct cache_list *list,
+                                struct cache_page *item)
+{
+    item->prev = NULL;
+    item->next = list->head;
+    if (list->head)
+        list->head->prev = item;
+    else
+        list->tail = item;
+    list->head = item;
+    list->nr++;
+}
+
+static void cache_list_add_tail(struct cache_list *list,
+                                struct cache_page *item)
+{
+    item->next = NULL;
+    item->prev = list->tail;
+    if (list->tail)
+        list->tail->next = item;
+    else
+        list->head = item;
+    list->tail = item;
+    list->nr++;
+}
+
+/* The cache entry get_cache_page() would return for pfn. */
+static struct cache_page *peek_cache_page(comp_ctx *ctx, xen_pfn_t pfn)
+{
+    return ctx->pfn2cache[pfn] ?:
+        (ctx->probation.tail ?: ctx->protected.tail);
+}
+
 static
 char *get_cache_page(comp_ctx *ctx, xen_pfn_t pfn,
                      int *israw)
@@ -215,38 +332,35 @@ char *get_cache_page(comp_ctx *ctx, xen_pfn_t pfn,
     {
         *israw = 1;
 
-        /* If the list is full, evict a page from the tail end. */
-        item = ctx->page_list_tail;
+        /* Evict the least recently used page on probation. */
+        item = peek_cache_page(ctx, pfn);
+        cache_list_del(item->protected ? &ctx->protected : &ctx->probation,
+                       item);
         if (item->pfn != INVALID_PFN)
             ctx->pfn2cache[item->pfn] = NULL;
 
         item->pfn = pfn;
+        item->protected = false;
         ctx->pfn2cache[pfn] = item;
+        cache_list_add_head(&ctx->probation, item);
+
+        return item->page;
     }
-        
-    /* 	if requested item is in cache move to head of list */
-    if (item != ctx->page_list_head)
+
+    /* Dirtied again while cached: protect it, making room if need be. */
+    cache_list_del(item->protected ? &ctx->protected : &ctx->probation, item);
+    if (ctx->protected.nr >= ctx->max_protected)
     {
-        if (item == ctx->page_list_tail)
-        {
-            /* item at tail of list. */
-            ctx->page_list_tail = item->prev;
-            (ctx->page_list_tail)->next = NULL;
-        }
-        else
-        {
-            /* item in middle of list */
-            item->prev->next = item->next;
-            item->next->prev = item->prev;
-        }
+        struct cache_page *demoted = ctx->protected.tail;
 
-        item->prev = NULL;
-        item->next = ctx->page_list_head;
-        (ctx->page_list_head)->prev = item;
-        ctx->page_list_head = item;
+        cache_list_del(&ctx->protected, demoted);
+        demoted->protected = false;
+        cache_list_add_head(&ctx->probation, demoted);
     }
+    item->protected = true;
+    cache_list_add_head(&ctx->protected, item);
 
-    return (ctx->page_list_head)->page;
+    return item->page;
 }
 
 /* Remove pagetable pages from cache and move to tail, as free pages */
@@ -258,27 +372,12 @@ void invalidate_cache_page(comp_ctx *ctx, xen_pfn_t pfn)
     item = ctx->pfn2cache[pfn];
     if (item)
     {
-        if (item != ctx->page_list_tail)
-        {
-            /* item at head of list */
-            if (item == ctx->page_list_head)
-            {
-                ctx->page_list_head = (ctx->page_list_head)->next;
-                (ctx->page_list_head)->prev = NULL;
-            }
-            else /* item in middle of list */
-            {            
-                item->prev->next = item->next;
-                item->next->prev = item->prev;
-            }
-
-            item->next = NULL;
-            item->prev = ctx->page_list_tail;
-            (ctx->page_list_tail)->next = item;
-            ctx->page_list_tail = item;
-        }
+        cache_list_del(item->protected ? &ctx->protected : &ctx->probation,
+                       item);
+        item->protected = false;
+        cache_list_add_tail(&ctx->probation, item);
         ctx->pfn2cache[pfn] = NULL;
-        (ctx->page_list_tail)->pfn = INVALID_PFN;
+        item->pfn = INVALID_PFN;
     }
 }
 
@@ -307,15 +406,127 @@ int xc_compression_add_page(xc_interface *xch, comp_ctx *ctx,
     return 0;
 }
 
+static void compress_share(comp_ctx *ctx, unsigned int share,
+                           unsigned int nr_shares)
+{
+    unsigned int i;
+    char *dest;
+
+    for (i = share; i < ctx->chunk_nr; i += nr_shares)
+    {
+        dest = ctx->chunkbuf + i * WORST_COMP_PAGE_SIZE;
+
+        if (ctx->chunk_raw[i])
+            ctx->chunk_len[i] = add_full_page(dest, ctx->chunk_src[i],
+                                              ctx->chunk_cache[i]);
+        else
+            ctx->chunk_len[i] = compress_page(dest, ctx->chunk_src[i],
+                                              ctx->chunk_cache[i]);
+    }
+}
+
+static void *compression_worker(void *arg)
+{
+    struct compression_worker *worker = arg;
+    comp_ctx *ctx = worker->ctx;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&ctx->lock);
+    for (;;)
+    {
+        while (!ctx->exit && ctx->gen == seen)
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        if (ctx->exit)
+            break;
+        seen = ctx->gen;
+        pthread_mutex_unlock(&ctx->lock);
+
+        compress_share(ctx, worker->share, ctx->nr_workers + 1);
+
+        pthread_mutex_lock(&ctx->lock);
+        if (!--ctx->nr_busy)
+            pthread_cond_broadcast(&ctx->cond);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    return NULL;
+}
+
+/*
+ * Set the next chunk up from the page buffer.  Cache lookups update the
+ * LRU, so they are done here, in order.  A chunk ends early rather than
+ * use a cache page twice (the same pfn added twice, or a cache smaller
+ * than a chunk), as the pages of a chunk are compressed all at once.
+ */
+static void prepare_chunk(comp_ctx *ctx)
+{
+    unsigned int nr = 0;
+    xen_pfn_t pfn;
+    int israw;
+
+    ctx->chunk++;
+
+    for (; ctx->pfns_index < ctx->pfns_len && nr < CHUNK_PAGES;
+         ctx->pfns_index++, nr++)
+    {
+        pfn = ctx->sendbuf_pfns[ctx->pfns_index];
+        israw = 0;
+        ctx->chunk_cache[nr] = NULL;
+
+        if (pfn != INVALID_PFN)
+        {
+            struct cache_page *item = peek_cache_page(ctx, pfn);
+
+            if (nr && item->chunk == ctx->chunk)
+                break;
+            item->chunk = ctx->chunk;
+
+            ctx->chunk_cache[nr] = get_cache_page(ctx, pfn, &israw);
+        }
+        else
+            israw = 1;
+
+        ctx->chunk_src[nr] = ctx->inputbuf + ctx->pfns_index * XC_PAGE_SIZE;
+        ctx->chunk_raw[nr] = israw;
+    }
+
+    ctx->chunk_nr = nr;
+    ctx->chunk_next = 0;
+}
+
+static void compress_chunk(comp_ctx *ctx)
+{
+    if (!ctx->nr_workers || ctx->chunk_nr < MIN_PARALLEL_PAGES)
+    {
+        compress_share(ctx, 0, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->gen++;
+    ctx->nr_busy = ctx->nr_workers;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+
+    compress_share(ctx, 0, ctx->nr_workers + 1);
+
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->nr_busy)
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
 int xc_compression_compress_pages(xc_interface *xch, comp_ctx *ctx,
                                   char *compbuf, unsigned long compbuf_size,
                                   unsigned long *compbuf_len)
 {
-    char *cache_copy = NULL, *current_page = NULL;
-    int israw, rc = 1;
+    unsigned int len;
+    int rc = 1;
 
-    if (!ctx->pfns_len || (ctx->pfns_index == ctx->pfns_len)) {
+    if ((!ctx->pfns_len || (ctx->pfns_index == ctx->pfns_len)) &&
+        ctx->chunk_next == ctx->chunk_nr) {
         ctx->pfns_len = ctx->pfns_index = 0;
+        ctx->chunk_nr = ctx->chunk_next = 0;
         return 0;
     }
 
@@ -323,31 +534,33 @@ int xc_compression_compress_pages(xc_interface *xch, comp_ctx *ctx,
     ctx->compbuf = compbuf;
     ctx->compbuf_size = compbuf_size;
 
-    for (; ctx->pfns_index < ctx->pfns_len; ctx->pfns_index++)
+    for (;;)
     {
-        israw = 0;
-        cache_copy = NULL;
-        current_page = ctx->inputbuf + ctx->pfns_index * XC_PAGE_SIZE;
-
-        if (ctx->sendbuf_pfns[ctx->pfns_index] == INVALID_PFN)
-            israw = 1;
-        else
-            cache_copy = get_cache_page(ctx,
-                                        ctx->sendbuf_pfns[ctx->pfns_index],
-                                        &israw);
+        /* Copy out what has been compressed already. */
+        for (; ctx->chunk_next < ctx->chunk_nr; ctx->chunk_next++)
+        {
+            len = ctx->chunk_len[ctx->chunk_next];
+            if ((ctx->compbuf_pos + len) > ctx->compbuf_size)
+            {
+                /* Out of space in outbuf! flush and come back */
+                rc = -1;
+                goto out;
+            }
 
-        if (israw)
-            rc = (add_full_page(ctx, current_page, cache_copy) >= 0);
-        else
-            rc = (compress_page(ctx, current_page, cache_copy) >= 0);
+            memcpy(ctx->compbuf + ctx->compbuf_pos,
+                   ctx->chunkbuf + ctx->chunk_next * WORST_COMP_PAGE_SIZE,
+                   len);
+            ctx->compbuf_pos += len;
+        }
 
-        if ( !rc )
-        {
-            /* Out of space in outbuf! flush and come back */
-            rc = -1;
+        if (ctx->pfns_index == ctx->pfns_len)
             break;
-        }
+
+        prepare_chunk(ctx);
+        compress_chunk(ctx);
     }
+
+ out:
     if (compbuf_len)
         *compbuf_len = ctx->compbuf_pos;
 
@@ -358,6 +571,7 @@ inline
 void xc_compression_reset_pagebuf(xc_interface *xch, comp_ctx *ctx)
 {
     ctx->pfns_index = ctx->pfns_len = 0;
+    ctx->chunk_nr = ctx->chunk_next = 0;
 }
 
 int xc_compression_uncompress_page(xc_interface *xch, char *compbuf,
@@ -453,8 +667,24 @@ int xc_compression_uncompress_page(xc_interface *xch, char *compbuf,
 
 void xc_compression_free_context(xc_interface *xch, comp_ctx *ctx)
 {
+    unsigned int i;
+
     if (!ctx) return;
 
+    if (ctx->nr_workers)
+    {
+        pthread_mutex_lock(&ctx->lock);
+        ctx->exit = true;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+
+        for (i = 0; i < ctx->nr_workers; i++)
+            pthread_join(ctx->workers[i].thread, NULL);
+    }
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->lock);
+
+    free(ctx->chunkbuf);
     free(ctx->inputbuf);
     free(ctx->sendbuf_pfns);
     free(ctx->cache_base);
@@ -469,6 +699,11 @@ comp_ctx *xc_compression_create_context(xc_interface *xch,
     unsigned long i;
     comp_ctx *ctx = NULL;
     unsigned long num_cache_pages = DELTA_CACHE_SIZE/XC_PAGE_SIZE;
+    long nr_cpus;
+
+    /* There is no point caching more pages than the domain has. */
+    if (p2m_size && num_cache_pages > p2m_size)
+        num_cache_pages = p2m_size;
 
     ctx = (comp_ctx *)malloc(sizeof(comp_ctx));
     if (!ctx)
@@ -477,6 +712,8 @@ comp_ctx *xc_compression_create_context(xc_interface *xch,
         goto error;
     }
     memset(ctx, 0, sizeof(comp_ctx));
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
 
     ctx->inputbuf = xc_memalign(xch, XC_PAGE_SIZE, PAGE_BUFFER_SIZE);
     if (!ctx->inputbuf)
@@ -485,7 +722,8 @@ comp_ctx *xc_compression_create_context(xc_interface *xch,
         goto error;
     }
 
-    ctx->cache_base = xc_memalign(xch, XC_PAGE_SIZE, DELTA_CACHE_SIZE);
+    ctx->cache_base = xc_memalign(xch, XC_PAGE_SIZE,
+                                  num_cache_pages * XC_PAGE_SIZE);
     if (!ctx->cache_base)
     {
         ERROR("Failed to allocate delta cache\n");
@@ -516,18 +754,39 @@ comp_ctx *xc_compression_create_context(xc_interface *xch,
         goto error;
     }
 
+    /* Everything starts out free, on probation. */
     for (i = 0; i < num_cache_pages; i++)
     {
         ctx->cache[i].pfn = INVALID_PFN;
         ctx->cache[i].page = ctx->cache_base + i * XC_PAGE_SIZE;
-        ctx->cache[i].prev = (i == 0) ? NULL : &(ctx->cache[i - 1]);
-        ctx->cache[i].next = ((i+1) == num_cache_pages)? NULL :
-            &(ctx->cache[i + 1]);
+        ctx->cache[i].protected = false;
+        ctx->cache[i].chunk = 0;
+        ctx->cache[i].prev = ctx->cache[i].next = NULL;
+        cache_list_add_tail(&ctx->probation, &ctx->cache[i]);
     }
-    ctx->page_list_head = &(ctx->cache[0]);
-    ctx->page_list_tail = &(ctx->cache[num_cache_pages -1]);
+    ctx->max_protected = num_cache_pages - num_cache_pages / 4;
     ctx->dom_pfnlist_size = p2m_size;
 
+    ctx->chunkbuf = malloc(CHUNK_PAGES * WORST_COMP_PAGE_SIZE);
+    if (!ctx->chunkbuf)
+    {
+        ERROR("Could not alloc compression chunk buffer\n");
+        goto error;
+    }
+
+    /* Workers are an optimisation only: carry on without them if need be. */
+    nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    while (nr_cpus > 1 + ctx->nr_workers && ctx->nr_workers < MAX_THREADS - 1)
+    {
+        struct compression_worker *worker = &ctx->workers[ctx->nr_workers];
+
+        worker->ctx = ctx;
+        worker->share = ctx->nr_workers + 1;
+        if (pthread_create(&worker->thread, NULL, compression_worker, worker))
+            break;
+        ctx->nr_workers++;
+    }
+
     return ctx;
 error:
     xc_compression_free_context(xch, ctx);
@@ -63,12 +63,24 @@
 #include "xg_private.h"
 #include "xc_core.h"
 #include "xc_dom.h"
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 /* number of pages to write at a time */
 #define DUMP_INCREMENT (4 * 1024)
 
+/* threads mapping and copying guest pages */
+#define DUMP_MAX_WORKERS 4
+
+/*
+ * Called instead of dumpcore_rtn_t for a run of zero pages, for a file to
+ * leave a hole in their place.
+ */
+typedef int (dump_skip_rtn_t)(xc_interface *xch,
+                              void *arg, unsigned int length);
+
 /* string table */
 struct xc_core_strtab {
     char       *strings;
@@ -326,6 +338,353 @@ elfnote_init(struct elfnote *elfnote)
     strncpy(elfnote->name, XEN_DUMPCORE_ELFNOTE_NAME, sizeof(elfnote->name));
 }
 
+/* A batch of up to DUMP_INCREMENT pages, mapped and copied all at once. */
+struct dump_batch {
+    char       *buf;
+    uint64_t   *pfns;
+    xen_pfn_t  *gmfns;
+    int        *err;
+    bool       *zero;
+    unsigned int nr;
+};
+
+struct dump_pages;
+
+struct dump_worker {
+    struct dump_pages  *dp;
+    pthread_t           thread;
+    unsigned int        share;
+};
+
+/*
+ * Dumping .xen_pages: the workers map and copy one batch while the caller
+ * writes out the one before.
+ */
+struct dump_pages {
+    xc_interface       *xch;
+    uint32_t            domid;
+    void               *args;
+    dumpcore_rtn_t     *dump_rtn;
+    dump_skip_rtn_t    *skip_rtn;
+
+    int                 auto_translated_physmap;
+    struct xen_dumpcore_p2m *p2m_array;
+    uint64_t           *pfn_array;
+    unsigned long       j;
+    unsigned long       nr_pages;
+    bool                full;
+
+    struct dump_batch   batch[2];
+    unsigned int        cur;
+
+    /* Workers, woken up by bumping gen, and counted back in by nr_busy. */
+    struct dump_worker  workers[DUMP_MAX_WORKERS];
+    unsigned int        nr_workers;
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    struct dump_batch  *mapping;
+    unsigned long       gen;
+    unsigned int        nr_busy;
+    bool                exit;
+};
+
+static bool
+dump_page_is_zero(const char *page)
+{
+    const unsigned long *p = (const unsigned long *)page;
+    unsigned int i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i++ )
+        if ( p[i] )
+            return false;
+
+    return true;
+}
+
+/*
+ * Map and copy this share of the batch.  Pages which can't be mapped are
+ * left out of the dump, as they always have been.
+ */
+static void
+dump_map_share(struct dump_pages *dp, struct dump_batch *b,
+               unsigned int share, unsigned int nr_shares)
+{
+    xc_interface *xch = dp->xch;
+    unsigned int start = (uint64_t)b->nr * share / nr_shares;
+    unsigned int end = (uint64_t)b->nr * (share + 1) / nr_shares;
+    unsigned int i;
+    char *vaddr;
+
+    if ( start == end )
+        return;
+
+    vaddr = xenforeignmemory_map(xch->fmem, dp->domid, PROT_READ, end - start,
+                                 &b->gmfns[start], &b->err[start]);
+    if ( vaddr == NULL )
+    {
+        for ( i = start; i < end; i++ )
+            b->err[i] = -ENOMEM;
+        return;
+    }
+
+    for ( i = start; i < end; i++ )
+    {
+        char *page = b->buf + (size_t)i * PAGE_SIZE;
+
+        if ( b->err[i] )
+            continue;
+        memcpy(page, vaddr + (size_t)(i - start) * PAGE_SIZE, PAGE_SIZE);
+        b->zero[i] = dump_page_is_zero(page);
+    }
+
+    xenforeignmemory_unmap(xch->fmem, vaddr, end - start);
+}
+
+static void *
+dump_worker(void *arg)
+{
+    struct dump_worker *worker = arg;
+    struct dump_pages *dp = worker->dp;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&dp->lock);
+    for ( ; ; )
+    {
+        while ( !dp->exit && dp->gen == seen )
+            pthread_cond_wait(&dp->cond, &dp->lock);
+        if ( dp->exit )
+            break;
+        seen = dp->gen;
+        pthread_mutex_unlock(&dp->lock);
+
+        dump_map_share(dp, dp->mapping, worker->share, dp->nr_workers);
+
+        pthread_mutex_lock(&dp->lock);
+        if ( !--dp->nr_busy )
+            pthread_cond_broadcast(&dp->cond);
+    }
+    pthread_mutex_unlock(&dp->lock);
+
+    return NULL;
+}
+
+/* Start mapping @b, in the background if there are workers to do it. */
+static void
+dump_map_start(struct dump_pages *dp, struct dump_batch *b)
+{
+    if ( !dp->nr_workers )
+    {
+        dump_map_share(dp, b, 0, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&dp->lock);
+    dp->mapping = b;
+    dp->gen++;
+    dp->nr_busy = dp->nr_workers;
+    pthread_cond_broadcast(&dp->cond);
+    pthread_mutex_unlock(&dp->lock);
+}
+
+static void
+dump_map_wait(struct dump_pages *dp)
+{
+    pthread_mutex_lock(&dp->lock);
+    while ( dp->nr_busy )
+        pthread_cond_wait(&dp->cond, &dp->lock);
+    pthread_mutex_unlock(&dp->lock);
+}
+
+/*
+ * Write out the pages of a batch, recording each in the p2m or pfn table,
+ * in runs of pages next to each other in the buffer.  Zero pages go to
+ * skip_rtn instead, if there is one.
+ */
+static int
+dump_write_batch(struct dump_pages *dp, const struct dump_batch *b)
+{
+    xc_interface *xch = dp->xch;
+    unsigned int i, start = 0, len = 0;
+    bool zero = false, z;
+    int sts;
+
+    for ( i = 0; i <= b->nr; i++ )
+    {
+        z = i < b->nr && dp->skip_rtn && b->zero[i];
+
+        if ( len && (i == b->nr || b->err[i] || z != zero ||
+                     dp->j == dp->nr_pages) )
+        {
+            if ( zero )
+                sts = dp->skip_rtn(xch, dp->args, len * PAGE_SIZE);
+            else
+                sts = dp->dump_rtn(xch, dp->args,
+                                   b->buf + (size_t)start * PAGE_SIZE,
+                                   len * PAGE_SIZE);
+            if ( sts != 0 )
+                return sts;
+            len = 0;
+        }
+
+        if ( i == b->nr || b->err[i] )
+            continue;
+
+        if ( dp->j == dp->nr_pages )
+        {
+            /*
+             * When live dump-mode (-L option) is specified,
+             * guest domain may increase memory.
+             */
+            IPRINTF("exceeded nr_pages (%ld) losing pages", dp->nr_pages);
+            dp->full = true;
+            return 0;
+        }
+
+        if ( !len )
+        {
+            start = i;
+            zero = z;
+        }
+        len++;
+
+        if ( !dp->auto_translated_physmap )
+        {
+            dp->p2m_array[dp->j].pfn = b->pfns[i];
+            dp->p2m_array[dp->j].gmfn = b->gmfns[i];
+        }
+        else
+            dp->pfn_array[dp->j] = b->pfns[i];
+        dp->j++;
+    }
+
+    return 0;
+}
+
+/* Start mapping the current batch, and write out the previous one. */
+static int
+dump_pages_step(struct dump_pages *dp)
+{
+    struct dump_batch *cur = &dp->batch[dp->cur];
+    struct dump_batch *prev = &dp->batch[!dp->cur];
+    int sts = 0;
+
+    if ( cur->nr )
+        dump_map_start(dp, cur);
+
+    if ( prev->nr )
+    {
+        sts = dump_write_batch(dp, prev);
+        prev->nr = 0;
+    }
+
+    if ( cur->nr )
+        dump_map_wait(dp);
+
+    dp->cur = !dp->cur;
+    if ( sts == 0 )
+        xc_report_progress_step(dp->xch, dp->j, dp->nr_pages);
+
+    return sts;
+}
+
+static int
+dump_pages_add(struct dump_pages *dp, uint64_t pfn, xen_pfn_t gmfn)
+{
+    struct dump_batch *b = &dp->batch[dp->cur];
+
+    b->pfns[b->nr] = pfn;
+    b->gmfns[b->nr] = gmfn;
+    b->err[b->nr] = 0;
+    b->zero[b->nr] = false;
+
+    if ( ++b->nr < DUMP_INCREMENT )
+        return 0;
+
+    return dump_pages_step(dp);
+}
+
+/* Map and write whatever is left in the two batches. */
+static int
+dump_pages_flush(struct dump_pages *dp)
+{
+    int sts = dump_pages_step(dp);
+
+    if ( sts == 0 && !dp->full )
+        sts = dump_pages_step(dp);
+
+    return sts;
+}
+
+static void
+dump_pages_free(struct dump_pages *dp)
+{
+    unsigned int i;
+
+    if ( dp->nr_workers )
+    {
+        pthread_mutex_lock(&dp->lock);
+        dp->exit = true;
+        pthread_cond_broadcast(&dp->cond);
+        pthread_mutex_unlock(&dp->lock);
+
+        for ( i = 0; i < dp->nr_workers; i++ )
+            pthread_join(dp->workers[i].thread, NULL);
+    }
+    pthread_cond_destroy(&dp->cond);
+    pthread_mutex_destroy(&dp->lock);
+
+    for ( i = 0; i < ARRAY_SIZE(dp->batch); i++ )
+    {
+        free(dp->batch[i].buf);
+        free(dp->batch[i].pfns);
+        free(dp->batch[i].gmfns);
+        free(dp->batch[i].err);
+        free(dp->batch[i].zero);
+    }
+}
+
+static int
+dump_pages_init(struct dump_pages *dp)
+{
+    xc_interface *xch = dp->xch;
+    struct dump_batch *b;
+    unsigned int i;
+    long nr_cpus;
+
+    pthread_mutex_init(&dp->lock, NULL);
+    pthread_cond_init(&dp->cond, NULL);
+
+    for ( i = 0; i < ARRAY_SIZE(dp->batch); i++ )
+    {
+        b = &dp->batch[i];
+        b->buf = malloc(DUMP_INCREMENT * PAGE_SIZE);
+        b->pfns = malloc(DUMP_INCREMENT * sizeof(*b->pfns));
+        b->gmfns = malloc(DUMP_INCREMENT * sizeof(*b->gmfns));
+        b->err = malloc(DUMP_INCREMENT * sizeof(*b->err));
+        b->zero = malloc(DUMP_INCREMENT * sizeof(*b->zero));
+        if ( !b->buf || !b->pfns || !b->gmfns || !b->err || !b->zero )
+        {
+            PERROR("Could not allocate dump_mem");
+            return -1;
+        }
+    }
+
+    /* Workers are an optimisation only: carry on without them if need be. */
+    nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    while ( nr_cpus > dp->nr_workers + 1 && dp->nr_workers < DUMP_MAX_WORKERS )
+    {
+        struct dump_worker *worker = &dp->workers[dp->nr_workers];
+
+        worker->dp = dp;
+        worker->share = dp->nr_workers;
+        if ( pthread_create(&worker->thread, NULL, dump_worker, worker) )
+            break;
+        dp->nr_workers++;
+    }
+
+    return 0;
+}
+
 static int
 elfnote_dump_none(xc_interface *xch, void *args, dumpcore_rtn_t dump_rtn)
 {
@@ -416,11 +775,9 @@ elfnote_dump_format_version(xc_interface *xch,
     return dump_rtn(xch, args, (char*)&format_version, sizeof(format_version));
 }
 
-int
-xc_domain_dumpcore_via_callback(xc_interface *xch,
-                                uint32_t domid,
-                                void *args,
-                                dumpcore_rtn_t dump_rtn)
+static int
+dumpcore(xc_interface *xch, uint32_t domid, void *args,
+         dumpcore_rtn_t dump_rtn, dump_skip_rtn_t skip_rtn)
 {
     xc_dominfo_t info;
     shared_info_any_t *live_shinfo = NULL;
@@ -428,7 +785,9 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
     struct domain_info_context *dinfo = &_dinfo;
 
     int nr_vcpus = 0;
-    char *dump_mem, *dump_mem_start = NULL;
+    struct dump_pages dp = { .xch = xch, .domid = domid, .args = args,
+                             .dump_rtn = dump_rtn, .skip_rtn = skip_rtn };
+    const char *progress;
     vcpu_guest_context_any_t *ctxt = NULL;
     struct xc_core_arch_context arch_ctxt;
     char dummy[PAGE_SIZE];
@@ -465,12 +824,10 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
         return sts;
     }
 
+    progress = xc_set_progress_prefix(xch, "Dumping core");
     xc_core_arch_context_init(&arch_ctxt);
-    if ( (dump_mem_start = malloc(DUMP_INCREMENT*PAGE_SIZE)) == NULL )
-    {
-        PERROR("Could not allocate dump_mem");
+    if ( dump_pages_init(&dp) )
         goto out;
-    }
 
     if ( xc_domain_getinfo(xch, domid, 1, &info) != 1 )
     {
@@ -776,8 +1133,10 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
         goto out;
 
     /* dump pages: .xen_pages */
-    j = 0;
-    dump_mem = dump_mem_start;
+    dp.auto_translated_physmap = auto_translated_physmap;
+    dp.p2m_array = p2m_array;
+    dp.pfn_array = pfn_array;
+    dp.nr_pages = nr_pages;
     for ( map_idx = 0; map_idx < nr_memory_map; map_idx++ )
     {
         uint64_t pfn_start;
@@ -788,17 +1147,6 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
         for ( i = pfn_start; i < pfn_end; i++ )
         {
             uint64_t gmfn;
-            void *vaddr;
-            
-            if ( j >= nr_pages )
-            {
-                /*
-                 * When live dump-mode (-L option) is specified,
-                 * guest domain may increase memory.
-                 */
-                IPRINTF("exceeded nr_pages (%ld) losing pages", nr_pages);
-                goto copy_done;
-            }
 
             if ( !auto_translated_physmap )
             {
@@ -817,9 +1165,6 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
                     if ( gmfn == (uint32_t)INVALID_PFN )
                        continue;
                 }
-
-                p2m_array[j].pfn = i;
-                p2m_array[j].gmfn = gmfn;
             }
             else
             {
@@ -827,42 +1172,33 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
                     continue;
 
                 gmfn = i;
-                pfn_array[j] = i;
-            }
-
-            vaddr = xc_map_foreign_range(
-                xch, domid, PAGE_SIZE, PROT_READ, gmfn);
-            if ( vaddr == NULL )
-                continue;
-            memcpy(dump_mem, vaddr, PAGE_SIZE);
-            munmap(vaddr, PAGE_SIZE);
-            dump_mem += PAGE_SIZE;
-            if ( (j + 1) % DUMP_INCREMENT == 0 )
-            {
-                sts = dump_rtn(
-                    xch, args, dump_mem_start, dump_mem - dump_mem_start);
-                if ( sts != 0 )
-                    goto out;
-                dump_mem = dump_mem_start;
             }
 
-            j++;
+            sts = dump_pages_add(&dp, i, gmfn);
+            if ( sts != 0 )
+                goto out;
+            if ( dp.full )
+                goto copy_done;
         }
     }
 
-copy_done:
-    sts = dump_rtn(xch, args, dump_mem_start, dump_mem - dump_mem_start);
+    sts = dump_pages_flush(&dp);
     if ( sts != 0 )
         goto out;
+
+copy_done:
+    j = dp.j;
     if ( j < nr_pages )
     {
         /* When live dump-mode (-L option) is specified,
          * guest domain may reduce memory. pad with zero pages.
          */
         DPRINTF("j (%ld) != nr_pages (%ld)", j, nr_pages);
-        memset(dump_mem_start, 0, PAGE_SIZE);
         for (; j < nr_pages; j++) {
-            sts = dump_rtn(xch, args, dump_mem_start, PAGE_SIZE);
+            if ( skip_rtn )
+                sts = skip_rtn(xch, args, PAGE_SIZE);
+            else
+                sts = dump_rtn(xch, args, dummy, PAGE_SIZE);
             if ( sts != 0 )
                 goto out;
             if ( !auto_translated_physmap )
@@ -907,18 +1243,29 @@ out:
         xc_core_strtab_free(strtab);
     if ( ctxt != NULL )
         free(ctxt);
-    if ( dump_mem_start != NULL )
-        free(dump_mem_start);
     if ( live_shinfo != NULL )
         munmap(live_shinfo, PAGE_SIZE);
+    dump_pages_free(&dp);
     xc_core_arch_context_free(&arch_ctxt);
+    xc_set_progress_prefix(xch, progress);
 
     return sts;
 }
 
+int
+xc_domain_dumpcore_via_callback(xc_interface *xch,
+                                uint32_t domid,
+                                void *args,
+                                dumpcore_rtn_t dump_rtn)
+{
+    return dumpcore(xch, domid, args, dump_rtn, NULL);
+}
+
 /* Callback args for writing to a local dump file. */
 struct dump_args {
     int     fd;
+    /* bytes written since the file cache was last discarded */
+    unsigned long written;
 };
 
 /* Callback routine for writing to a local dump file. */
@@ -933,11 +1280,28 @@ static int local_file_dump(xc_interface *xch,
         return -errno;
     }
 
-    if ( length >= (DUMP_INCREMENT * PAGE_SIZE) )
+    da->written += length;
+    if ( da->written >= (DUMP_INCREMENT * PAGE_SIZE) )
     {
         // Now dumping pages -- make sure we discard clean pages from
-        // the cache after each write
+        // the cache after each batch
         discard_file_cache(xch, da->fd, 0 /* no flush */);
+        da->written = 0;
+    }
+
+    return 0;
+}
+
+/* Leave a hole in a local dump file, in place of zero pages. */
+static int local_file_skip(xc_interface *xch,
+                           void *args, unsigned int length)
+{
+    struct dump_args *da = args;
+
+    if ( lseek(da->fd, length, SEEK_CUR) == (off_t)-1 )
+    {
+        PERROR("Failed to seek past zero pages");
+        return -errno;
     }
 
     return 0;
@@ -948,7 +1312,8 @@ xc_domain_dumpcore(xc_interface *xch,
                    uint32_t domid,
                    const char *corename)
 {
-    struct dump_args da;
+    struct dump_args da = { 0 };
+    struct stat st;
     int sts;
 
     if ( (da.fd = open(corename, O_CREAT|O_RDWR|O_TRUNC, S_IWUSR|S_IRUSR)) < 0 )
@@ -957,8 +1322,11 @@ xc_domain_dumpcore(xc_interface *xch,
         return -errno;
     }
 
-    sts = xc_domain_dumpcore_via_callback(
-        xch, domid, &da, &local_file_dump);
+    /* Only a regular file can be sparse, and seeked in. */
+    if ( fstat(da.fd, &st) == 0 && S_ISREG(st.st_mode) )
+        sts = dumpcore(xch, domid, &da, &local_file_dump, &local_file_skip);
+    else
+        sts = dumpcore(xch, domid, &da, &local_file_dump, NULL);
 
     /* flush and discard any remaining portion of the file from cache */
     discard_file_cache(xch, da.fd, 1/* flush first*/);
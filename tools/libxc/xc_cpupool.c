@@ -110,6 +110,7 @@ xc_cpupoolinfo_t *xc_cpupool_getinfo(xc_interface *xch,
     info->cpupool_id = sysctl.u.cpupool_op.cpupool_id;
     info->sched_id = sysctl.u.cpupool_op.sched_id;
     info->n_dom = sysctl.u.cpupool_op.n_dom;
+    info->trust_group = sysctl.u.cpupool_op.trust_group;
     memcpy(info->cpumap, local, local_size);
 
 out:
@@ -179,6 +180,50 @@ int xc_cpupool_movedomain(xc_interface *xch,
     return do_sysctl_save(xch, &sysctl);
 }
 
+int xc_cpupool_movedomains(xc_interface *xch,
+                           uint32_t poolid,
+                           const uint32_t *domids,
+                           unsigned int nr_domids,
+                           unsigned int *done)
+{
+    int err;
+    DECLARE_SYSCTL;
+    DECLARE_NAMED_HYPERCALL_BOUNCE(domids, (void *)domids,
+                                   nr_domids * sizeof(*domids),
+                                   XC_HYPERCALL_BUFFER_BOUNCE_IN);
+
+    if ( xc_hypercall_bounce_pre(xch, domids) )
+        return -1;
+
+    sysctl.cmd = XEN_SYSCTL_cpupool_op;
+    sysctl.u.cpupool_op.op = XEN_SYSCTL_CPUPOOL_OP_MOVEDOMAINS;
+    sysctl.u.cpupool_op.cpupool_id = poolid;
+    sysctl.u.cpupool_op.n_dom = 0;
+    sysctl.u.cpupool_op.nr_domids = nr_domids;
+    set_xen_guest_handle(sysctl.u.cpupool_op.domids, domids);
+    err = do_sysctl_save(xch, &sysctl);
+
+    xc_hypercall_bounce_post(xch, domids);
+
+    if ( done )
+        *done = sysctl.u.cpupool_op.n_dom;
+
+    return err;
+}
+
+int xc_cpupool_set_trust_group(xc_interface *xch,
+                               uint32_t poolid,
+                               uint32_t trust_group)
+{
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_cpupool_op;
+    sysctl.u.cpupool_op.op = XEN_SYSCTL_CPUPOOL_OP_SET_TRUST_GROUP;
+    sysctl.u.cpupool_op.cpupool_id = poolid;
+    sysctl.u.cpupool_op.trust_group = trust_group;
+    return do_sysctl_save(xch, &sysctl);
+}
+
 xc_cpumap_t xc_cpupool_freeinfo(xc_interface *xch)
 {
     int err = -1;
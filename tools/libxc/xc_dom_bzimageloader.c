@@ -651,6 +651,9 @@ static int xc_dom_probe_bzimage_kernel(struct xc_dom_image *dom)
 {
     struct setup_header *hdr;
     uint64_t payload_offset, payload_length;
+    void *zblob;
+    size_t zsize;
+    int cacheable;
     int ret;
 
     if ( dom->kernel_blob == NULL )
@@ -704,6 +707,18 @@ static int xc_dom_probe_bzimage_kernel(struct xc_dom_image *dom)
     dom->kernel_blob = dom->kernel_blob + payload_offset;
     dom->kernel_size = payload_length;
 
+    /* xc_dom_try_gunzip() has its own lookup in the cache. */
+    zblob = dom->kernel_blob;
+    zsize = dom->kernel_size;
+    cacheable = !check_magic(dom, "\037\213", 2);
+    if ( cacheable && xc_dom_cache_lookup(dom, &dom->kernel_blob,
+                                          &dom->kernel_size) )
+    {
+        if ( xc_dom_kernel_check_size(dom, dom->kernel_size) )
+            return -EINVAL;
+        return elf_loader.probe(dom);
+    }
+
     if ( check_magic(dom, "\037\213", 2) )
     {
         ret = xc_dom_try_gunzip(dom, &dom->kernel_blob, &dom->kernel_size);
@@ -776,6 +791,10 @@ static int xc_dom_probe_bzimage_kernel(struct xc_dom_image *dom)
         return -EINVAL;
     }
 
+    if ( cacheable )
+        xc_dom_cache_store(dom, zblob, zsize, dom->kernel_blob,
+                           dom->kernel_size);
+
     return elf_loader.probe(dom);
 }
 
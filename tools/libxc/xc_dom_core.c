@@ -395,6 +395,14 @@ int xc_dom_try_gunzip(struct xc_dom_image *dom, void **blob, size_t * size)
     if ( xc_dom_kernel_check_size(dom, unziplen) )
         return 0;
 
+    unzip = *blob;
+    if ( xc_dom_cache_lookup(dom, &unzip, &unziplen) )
+    {
+        *blob = unzip;
+        *size = unziplen;
+        return 0;
+    }
+
     unzip = xc_dom_malloc(dom, unziplen);
     if ( unzip == NULL )
         return -1;
@@ -402,11 +410,221 @@ int xc_dom_try_gunzip(struct xc_dom_image *dom, void **blob, size_t * size)
     if ( xc_dom_do_gunzip(dom->xch, *blob, *size, unzip, unziplen) == -1 )
         return -1;
 
+    xc_dom_cache_store(dom, *blob, *size, unzip, unziplen);
     *blob = unzip;
     *size = unziplen;
     return 0;
 }
 
+/* ------------------------------------------------------------------------ */
+/* decompressed image cache                                                 */
+
+/*
+ * Booting many guests from the same compressed kernel means decompressing
+ * it again for every one of them.  If dom->decompress_cache_dir names a
+ * directory only we can write to, decompressed images are kept there, in
+ * files named after a hash of the compressed image, and later builds map
+ * them instead, sharing the page cache.
+ *
+ * A cache file holds a header, then the compressed image, then (page
+ * aligned) the decompressed one.  Lookups compare the compressed image in
+ * full, so a hash collision is only ever a cache miss.
+ */
+#define DOM_CACHE_MAGIC "XENDOMC1"
+
+struct dom_cache_header {
+    char magic[8];
+    uint64_t zsize;
+    uint64_t size;
+};
+
+#ifndef __MINIOS__
+
+static uint64_t dom_cache_hash(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t h = 0xcbf29ce484222325ULL, w;
+
+    for ( ; len >= sizeof(w); p += sizeof(w), len -= sizeof(w) )
+    {
+        memcpy(&w, p, sizeof(w));
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 32;
+    }
+    for ( ; len; p++, len-- )
+        h = (h ^ *p) * 0x100000001b3ULL;
+
+    return h;
+}
+
+/* Open the cache directory, if there is one we can trust. */
+static int dom_cache_open_dir(struct xc_dom_image *dom)
+{
+    struct stat st;
+    int dirfd;
+
+    if ( !dom->decompress_cache_dir )
+        return -1;
+
+    dirfd = open(dom->decompress_cache_dir, O_RDONLY | O_DIRECTORY);
+    if ( dirfd < 0 )
+        return -1;
+
+    if ( fstat(dirfd, &st) || st.st_uid != geteuid() ||
+         (st.st_mode & (S_IWGRP | S_IWOTH)) )
+    {
+        DOMPRINTF("%s: ignoring %s, writable by others", __FUNCTION__,
+                  dom->decompress_cache_dir);
+        close(dirfd);
+        return -1;
+    }
+
+    return dirfd;
+}
+
+static void dom_cache_name(char *name, size_t len,
+                           const void *zblob, size_t zsize)
+{
+    snprintf(name, len, "%016"PRIx64"-%zx",
+             dom_cache_hash(zblob, zsize), zsize);
+}
+
+static size_t dom_cache_data_offset(size_t zsize)
+{
+    return (sizeof(struct dom_cache_header) + zsize + XC_PAGE_SIZE - 1) &
+        ~(size_t)(XC_PAGE_SIZE - 1);
+}
+
+int xc_dom_cache_lookup(struct xc_dom_image *dom, void **blob, size_t *size)
+{
+    const struct dom_cache_header *hdr;
+    struct xc_dom_mem *block = NULL;
+    char name[64];
+    struct stat st;
+    int dirfd, fd = -1;
+    void *map = MAP_FAILED;
+    size_t offset;
+
+    dirfd = dom_cache_open_dir(dom);
+    if ( dirfd < 0 )
+        return 0;
+
+    dom_cache_name(name, sizeof(name), *blob, *size);
+    offset = dom_cache_data_offset(*size);
+
+    fd = openat(dirfd, name, O_RDONLY);
+    if ( fd < 0 || fstat(fd, &st) || st.st_size < offset )
+        goto miss;
+
+    /* Private and writeable, as the loaders expect a buffer of their own. */
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if ( map == MAP_FAILED )
+        goto miss;
+
+    hdr = map;
+    if ( memcmp(hdr->magic, DOM_CACHE_MAGIC, sizeof(hdr->magic)) ||
+         hdr->zsize != *size || hdr->size != st.st_size - offset ||
+         memcmp(hdr + 1, *blob, *size) )
+        goto miss;
+
+    block = malloc(sizeof(*block));
+    if ( block == NULL )
+        goto miss;
+
+    memset(block, 0, sizeof(*block));
+    block->ptr = map;
+    block->len = st.st_size;
+    block->type = XC_DOM_MEM_TYPE_MMAP;
+    block->next = dom->memblocks;
+    dom->memblocks = block;
+    dom->alloc_malloc += sizeof(*block);
+    dom->alloc_file_map += block->len;
+
+    DOMPRINTF("%s: found %s, 0x%zx -> 0x%"PRIx64, __FUNCTION__,
+              name, *size, hdr->size);
+    *blob = map + offset;
+    *size = hdr->size;
+    close(fd);
+    close(dirfd);
+    return 1;
+
+ miss:
+    if ( map != MAP_FAILED )
+        munmap(map, st.st_size);
+    if ( fd >= 0 )
+        close(fd);
+    close(dirfd);
+    return 0;
+}
+
+void xc_dom_cache_store(struct xc_dom_image *dom,
+                        const void *zblob, size_t zsize,
+                        const void *blob, size_t size)
+{
+    struct dom_cache_header hdr;
+    char name[64], *tmp = NULL;
+    int dirfd, fd = -1;
+
+    dirfd = dom_cache_open_dir(dom);
+    if ( dirfd < 0 )
+        return;
+
+    dom_cache_name(name, sizeof(name), zblob, zsize);
+
+    if ( asprintf(&tmp, "%s/.%s.XXXXXX", dom->decompress_cache_dir,
+                  name) == -1 )
+    {
+        tmp = NULL;
+        goto err;
+    }
+
+    fd = mkstemp(tmp);
+    if ( fd < 0 )
+        goto err;
+
+    memcpy(hdr.magic, DOM_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.zsize = zsize;
+    hdr.size = size;
+
+    /* Written to a temporary file first, so lookups only see whole ones. */
+    if ( write_exact(fd, &hdr, sizeof(hdr)) ||
+         write_exact(fd, zblob, zsize) ||
+         lseek(fd, dom_cache_data_offset(zsize), SEEK_SET) == -1 ||
+         write_exact(fd, blob, size) ||
+         fchmod(fd, 0644) ||
+         renameat(AT_FDCWD, tmp, dirfd, name) )
+        goto err;
+
+    DOMPRINTF("%s: added %s", __FUNCTION__, name);
+    goto out;
+
+ err:
+    DOMPRINTF("%s: failed to add %s: %s", __FUNCTION__, name,
+              strerror(errno));
+    if ( fd >= 0 )
+        unlink(tmp);
+ out:
+    if ( fd >= 0 )
+        close(fd);
+    free(tmp);
+    close(dirfd);
+}
+
+#else /* __MINIOS__ */
+
+int xc_dom_cache_lookup(struct xc_dom_image *dom, void **blob, size_t *size)
+{
+    return 0;
+}
+
+void xc_dom_cache_store(struct xc_dom_image *dom,
+                        const void *zblob, size_t zsize,
+                        const void *blob, size_t size)
+{
+}
+
+#endif /* __MINIOS__ */
+
 /* ------------------------------------------------------------------------ */
 /* domain memory                                                            */
 
@@ -756,6 +974,7 @@ struct xc_dom_image *xc_dom_allocate(xc_interface *xch,
     dom->max_kernel_size = XC_DOM_DECOMPRESS_MAX;
     dom->max_module_size = XC_DOM_DECOMPRESS_MAX;
     dom->max_devicetree_size = XC_DOM_DECOMPRESS_MAX;
+    dom->decompress_cache_dir = XC_DOM_DECOMPRESS_CACHE_DIR;
 
     if ( cmdline )
         dom->cmdline = xc_dom_strdup(dom, cmdline);
@@ -1051,9 +1270,26 @@ static int xc_dom_build_module(struct xc_dom_image *dom, unsigned int mod)
     }
     if ( unziplen )
     {
+        void *cached = dom->modules[mod].blob;
+        size_t cachedlen = dom->modules[mod].size;
+
+        /* The rest of the segment is left zeroed, as by gunzip. */
+        if ( xc_dom_cache_lookup(dom, &cached, &cachedlen) &&
+             cachedlen <= unziplen )
+        {
+            memcpy(modulemap, cached, cachedlen);
+            return 0;
+        }
+
         if ( xc_dom_do_gunzip(dom->xch, dom->modules[mod].blob, dom->modules[mod].size,
                               modulemap, unziplen) != -1 )
+        {
+            /* Exactly 16 less than unziplen, as zlib checks the length. */
+            xc_dom_cache_store(dom, dom->modules[mod].blob,
+                               dom->modules[mod].size, modulemap,
+                               unziplen - 16);
             return 0;
+        }
         if ( dom->modules[mod].size > modulelen )
             goto err;
     }
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "xg_private.h"
 #include "xc_dom_decompress.h"
@@ -35,6 +37,125 @@ static inline uint_fast32_t le32_to_cpup(const unsigned char *buf)
 
 #define ARCHIVE_MAGICNUMBER 0x184C2102
 
+/*
+ * Every chunk of the legacy format but the last decompresses to exactly
+ * LEGACY_CHUNK_SIZE bytes, so the chunks of a big image can be spread
+ * over a few threads, each writing its own part of the output.
+ */
+#define LEGACY_CHUNK_SIZE (8 << 20)
+#define MAX_CHUNKS 64
+#define MAX_THREADS 4
+
+struct lz4_chunk {
+	const unsigned char *inp;
+	size_t len;
+	size_t dest_len;
+	int ret;
+};
+
+struct lz4_job {
+	struct lz4_chunk *chunks;
+	unsigned int nr_chunks, first, stride;
+	unsigned char *output;
+	size_t out_len;
+};
+
+static void *lz4_decode_chunks(void *arg)
+{
+	struct lz4_job *job = arg;
+	struct lz4_chunk *c;
+	size_t offset;
+	unsigned int i;
+
+	for (i = job->first; i < job->nr_chunks; i += job->stride) {
+		c = &job->chunks[i];
+		offset = (size_t)i * LEGACY_CHUNK_SIZE;
+		c->ret = -1;
+		if (offset >= job->out_len)
+			continue;
+		c->dest_len = job->out_len - offset;
+		if (c->dest_len > LEGACY_CHUNK_SIZE)
+			c->dest_len = LEGACY_CHUNK_SIZE;
+		c->ret = lz4_decompress_unknownoutputsize(c->inp, c->len,
+				job->output + offset, &c->dest_len);
+	}
+
+	return NULL;
+}
+
+/*
+ * Decode a single archive of several chunks in parallel.  Returns 0 if
+ * that worked, or -1 if the image should be decoded serially instead.
+ */
+static int lz4_decode_parallel(const unsigned char *inp, ssize_t size,
+			       unsigned char *output, size_t out_len)
+{
+	struct lz4_chunk chunks[MAX_CHUNKS];
+	struct lz4_job jobs[MAX_THREADS];
+	pthread_t threads[MAX_THREADS];
+	unsigned int nr_chunks = 0, nr_threads, started, i;
+	size_t chunksize, total = 0;
+	long nr_cpus;
+
+	while (size > 0) {
+		if (size < 4 || nr_chunks == MAX_CHUNKS)
+			return -1;
+		chunksize = get_unaligned_le32(inp);
+		/* Several archives one after the other: not worth it. */
+		if (chunksize == ARCHIVE_MAGICNUMBER)
+			return -1;
+		inp += 4;
+		size -= 4;
+		if (chunksize > size)
+			return -1;
+		chunks[nr_chunks].inp = inp;
+		chunks[nr_chunks].len = chunksize;
+		nr_chunks++;
+		inp += chunksize;
+		size -= chunksize;
+	}
+
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nr_threads = nr_chunks < MAX_THREADS ? nr_chunks : MAX_THREADS;
+	if (nr_cpus > 0 && nr_threads > nr_cpus)
+		nr_threads = nr_cpus;
+	if (nr_threads < 2)
+		return -1;
+
+	for (i = 0; i < nr_threads; i++) {
+		jobs[i].chunks = chunks;
+		jobs[i].nr_chunks = nr_chunks;
+		jobs[i].first = i;
+		jobs[i].stride = nr_threads;
+		jobs[i].output = output;
+		jobs[i].out_len = out_len;
+	}
+
+	/* The caller's thread does the first share. */
+	for (started = 1; started < nr_threads; started++)
+		if (pthread_create(&threads[started], NULL, lz4_decode_chunks,
+				   &jobs[started]))
+			break;
+	lz4_decode_chunks(&jobs[0]);
+	for (i = 1; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	/* Threads which failed to start left their chunks undone. */
+	for (i = started; i < nr_threads; i++)
+		lz4_decode_chunks(&jobs[i]);
+
+	for (i = 0; i < nr_chunks; i++) {
+		if (chunks[i].ret < 0)
+			return -1;
+		if (i < nr_chunks - 1 &&
+		    chunks[i].dest_len != LEGACY_CHUNK_SIZE)
+			return -1;
+		total += chunks[i].dest_len;
+	}
+
+	return total == out_len ? 0 : -1;
+}
+
 int xc_try_lz4_decode(
 	struct xc_dom_image *dom, void **blob, size_t *psize)
 {
@@ -71,6 +192,10 @@ int xc_try_lz4_decode(
 		goto exit_2;
 	}
 
+	if (out_len > LEGACY_CHUNK_SIZE &&
+	    !lz4_decode_parallel(inp, size, output, out_len))
+		goto done;
+
 	for (;;) {
 		if (size < 4) {
 			msg = "missing data";
@@ -102,16 +227,7 @@ int xc_try_lz4_decode(
 		size -= chunksize;
 
 		if (size == 0)
-		{
-			if ( xc_dom_register_external(dom, output, out_len) )
-			{
-				msg = "Error registering stream output";
-				goto exit_2;
-			}
-			*blob = output;
-			*psize = out_len;
-			return 0;
-		}
+			goto done;
 
 		if (size < 0) {
 			msg = "data corrupted";
@@ -121,6 +237,16 @@ int xc_try_lz4_decode(
 		inp += chunksize;
 	}
 
+done:
+	if ( xc_dom_register_external(dom, output, out_len) )
+	{
+		msg = "Error registering stream output";
+		goto exit_2;
+	}
+	*blob = output;
+	*psize = out_len;
+	return 0;
+
 exit_2:
 	free(output);
 exit_0:
@@ -27,6 +27,8 @@
 #include <string.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <xen/xen.h>
 #include <xen/foreign/x86_32.h>
@@ -1223,15 +1225,203 @@ static int check_mmio_hole(uint64_t start, uint64_t memsize,
         return 1;
 }
 
+/*
+ * Populating the physmap of a large HVM guest is dominated by the time Xen
+ * spends allocating, scrubbing and mapping the pages, which happens on the
+ * pCPU issuing the hypercall. Carve the guest memory into slices of at most
+ * HVM_POPULATE_SLICE_PFNS, cut on 1GB boundaries so superpage allocation is
+ * unaffected, and populate them from several threads. Each slice inherits
+ * the memflags (and hence the NUMA node) of the vmemrange it belongs to.
+ */
+#define HVM_POPULATE_SLICE_PFNS  (16UL << SUPERPAGE_1GB_SHIFT)
+#define HVM_POPULATE_MAX_THREADS 8
+
+struct hvm_populate_stats {
+    unsigned long normal, sp_2mb, sp_1gb;
+};
+
+struct hvm_populate_slice {
+    xen_pfn_t start, end;
+    unsigned int memflags;
+};
+
+struct hvm_populate_ctx {
+    struct xc_dom_image *dom;
+    struct hvm_populate_slice *slices;
+    unsigned int nr_slices, next_slice;
+    pthread_mutex_t lock;
+    int rc;
+    struct hvm_populate_stats stats;
+};
+
+/*
+ * Populate the guest pages of a slice, trying 1GB extents first, then 2MB and
+ * finally 4kB ones.
+ */
+static int populate_hvm_slice(struct xc_dom_image *dom,
+                              const struct hvm_populate_slice *slice,
+                              struct hvm_populate_stats *stats)
+{
+    xc_interface *xch = dom->xch;
+    uint32_t domid = dom->guest_domid;
+    unsigned int memflags = slice->memflags;
+    xen_pfn_t cur = slice->start, end = slice->end, cur_pfn;
+    unsigned long i;
+    int rc = 0;
+
+    while ( (rc == 0) && (end > cur) )
+    {
+        /* Clip count to maximum 1GB extent. */
+        unsigned long count = end - cur;
+        unsigned long max_pages = SUPERPAGE_1GB_NR_PFNS;
+
+        if ( count > max_pages )
+            count = max_pages;
+
+        cur_pfn = dom->p2m_host[cur];
+
+        /* Take care the corner cases of super page tails */
+        if ( ((cur_pfn & (SUPERPAGE_1GB_NR_PFNS-1)) != 0) &&
+             (count > (-cur_pfn & (SUPERPAGE_1GB_NR_PFNS-1))) )
+            count = -cur_pfn & (SUPERPAGE_1GB_NR_PFNS-1);
+        else if ( ((count & (SUPERPAGE_1GB_NR_PFNS-1)) != 0) &&
+                  (count > SUPERPAGE_1GB_NR_PFNS) )
+            count &= ~(SUPERPAGE_1GB_NR_PFNS - 1);
+
+        /* Attemp to allocate 1GB super page. Because in each pass
+         * we only allocate at most 1GB, we don't have to clip
+         * super page boundaries.
+         */
+        if ( ((count | cur_pfn) & (SUPERPAGE_1GB_NR_PFNS - 1)) == 0 &&
+             /* Check if there exists MMIO hole in the 1GB memory
+              * range */
+             !check_mmio_hole(cur_pfn << PAGE_SHIFT,
+                              SUPERPAGE_1GB_NR_PFNS << PAGE_SHIFT,
+                              dom->mmio_start, dom->mmio_size) )
+        {
+            long done;
+            unsigned long nr_extents = count >> SUPERPAGE_1GB_SHIFT;
+            xen_pfn_t sp_extents[nr_extents];
+
+            for ( i = 0; i < nr_extents; i++ )
+                sp_extents[i] =
+                    dom->p2m_host[cur+(i<<SUPERPAGE_1GB_SHIFT)];
+
+            done = xc_domain_populate_physmap(xch, domid, nr_extents,
+                                              SUPERPAGE_1GB_SHIFT,
+                                              memflags, sp_extents);
+
+            if ( done > 0 )
+            {
+                stats->sp_1gb += done;
+                done <<= SUPERPAGE_1GB_SHIFT;
+                cur += done;
+                count -= done;
+            }
+        }
+
+        if ( count != 0 )
+        {
+            /* Clip count to maximum 8MB extent. */
+            max_pages = SUPERPAGE_2MB_NR_PFNS * 4;
+            if ( count > max_pages )
+                count = max_pages;
+
+            /* Clip partial superpage extents to superpage
+             * boundaries. */
+            if ( ((cur_pfn & (SUPERPAGE_2MB_NR_PFNS-1)) != 0) &&
+                 (count > (-cur_pfn & (SUPERPAGE_2MB_NR_PFNS-1))) )
+                count = -cur_pfn & (SUPERPAGE_2MB_NR_PFNS-1);
+            else if ( ((count & (SUPERPAGE_2MB_NR_PFNS-1)) != 0) &&
+                      (count > SUPERPAGE_2MB_NR_PFNS) )
+                count &= ~(SUPERPAGE_2MB_NR_PFNS - 1); /* clip non-s.p. tail */
+
+            /* Attempt to allocate superpage extents. */
+            if ( ((count | cur_pfn) & (SUPERPAGE_2MB_NR_PFNS - 1)) == 0 )
+            {
+                long done;
+                unsigned long nr_extents = count >> SUPERPAGE_2MB_SHIFT;
+                xen_pfn_t sp_extents[nr_extents];
+
+                for ( i = 0; i < nr_extents; i++ )
+                    sp_extents[i] =
+                        dom->p2m_host[cur+(i<<SUPERPAGE_2MB_SHIFT)];
+
+                done = xc_domain_populate_physmap(xch, domid, nr_extents,
+                                                  SUPERPAGE_2MB_SHIFT,
+                                                  memflags, sp_extents);
+
+                if ( done > 0 )
+                {
+                    stats->sp_2mb += done;
+                    done <<= SUPERPAGE_2MB_SHIFT;
+                    cur += done;
+                    count -= done;
+                }
+            }
+        }
+
+        /* Fall back to 4kB extents. */
+        if ( count != 0 )
+        {
+            rc = xc_domain_populate_physmap_exact(
+                xch, domid, count, 0, memflags, &dom->p2m_host[cur]);
+            cur += count;
+            stats->normal += count;
+        }
+    }
+
+    return rc;
+}
+
+static void *populate_hvm_worker(void *arg)
+{
+    struct hvm_populate_ctx *ctx = arg;
+
+    for ( ; ; )
+    {
+        struct hvm_populate_stats stats = { 0 };
+        const struct hvm_populate_slice *slice;
+        int rc;
+
+        pthread_mutex_lock(&ctx->lock);
+        if ( ctx->rc || ctx->next_slice == ctx->nr_slices )
+        {
+            pthread_mutex_unlock(&ctx->lock);
+            break;
+        }
+        slice = &ctx->slices[ctx->next_slice++];
+        pthread_mutex_unlock(&ctx->lock);
+
+        rc = populate_hvm_slice(ctx->dom, slice, &stats);
+
+        pthread_mutex_lock(&ctx->lock);
+        ctx->stats.normal += stats.normal;
+        ctx->stats.sp_2mb += stats.sp_2mb;
+        ctx->stats.sp_1gb += stats.sp_1gb;
+        if ( rc && !ctx->rc )
+            ctx->rc = rc;
+        pthread_mutex_unlock(&ctx->lock);
+    }
+
+    return NULL;
+}
+
 static int meminit_hvm(struct xc_dom_image *dom)
 {
     unsigned long i, vmemid, nr_pages = dom->total_pages;
     unsigned long p2m_size;
     unsigned long target_pages = dom->target_pages;
-    unsigned long cur_pages, cur_pfn;
+    unsigned long cur_pages;
     int rc;
     unsigned long stat_normal_pages = 0, stat_2mb_pages = 0,
         stat_1gb_pages = 0;
+    struct hvm_populate_ctx ctx = {
+        .dom = dom,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+    };
+    pthread_t threads[HVM_POPULATE_MAX_THREADS];
+    unsigned long nr_threads;
     unsigned int memflags = 0;
     int claim_enabled = dom->claim_enabled;
     uint64_t total_pages;
@@ -1387,6 +1577,15 @@ static int meminit_hvm(struct xc_dom_image *dom)
         }
     }
 
+    ctx.slices = xc_dom_malloc(dom, sizeof(*ctx.slices) *
+                               (2 * nr_vmemranges +
+                                nr_pages / HVM_POPULATE_SLICE_PFNS));
+    if ( ctx.slices == NULL )
+    {
+        DOMPRINTF("Could not allocate populate slices");
+        goto error_out;
+    }
+
     stat_normal_pages = 0;
     for ( vmemid = 0; vmemid < nr_vmemranges; vmemid++ )
     {
@@ -1412,114 +1611,50 @@ static int meminit_hvm(struct xc_dom_image *dom)
         else
             cur_pages = vmemranges[vmemid].start >> PAGE_SHIFT;
 
-        rc = 0;
-        while ( (rc == 0) && (end_pages > cur_pages) )
+        while ( end_pages > cur_pages )
         {
-            /* Clip count to maximum 1GB extent. */
-            unsigned long count = end_pages - cur_pages;
-            unsigned long max_pages = SUPERPAGE_1GB_NR_PFNS;
-
-            if ( count > max_pages )
-                count = max_pages;
+            struct hvm_populate_slice *slice = &ctx.slices[ctx.nr_slices++];
+
+            slice->start = cur_pages;
+            slice->end = (cur_pages & ~(HVM_POPULATE_SLICE_PFNS - 1)) +
+                         HVM_POPULATE_SLICE_PFNS;
+            if ( slice->end > end_pages )
+                slice->end = end_pages;
+            slice->memflags = new_memflags;
+            cur_pages = slice->end;
+        }
+    }
 
-            cur_pfn = dom->p2m_host[cur_pages];
-
-            /* Take care the corner cases of super page tails */
-            if ( ((cur_pfn & (SUPERPAGE_1GB_NR_PFNS-1)) != 0) &&
-                 (count > (-cur_pfn & (SUPERPAGE_1GB_NR_PFNS-1))) )
-                count = -cur_pfn & (SUPERPAGE_1GB_NR_PFNS-1);
-            else if ( ((count & (SUPERPAGE_1GB_NR_PFNS-1)) != 0) &&
-                      (count > SUPERPAGE_1GB_NR_PFNS) )
-                count &= ~(SUPERPAGE_1GB_NR_PFNS - 1);
-
-            /* Attemp to allocate 1GB super page. Because in each pass
-             * we only allocate at most 1GB, we don't have to clip
-             * super page boundaries.
-             */
-            if ( ((count | cur_pfn) & (SUPERPAGE_1GB_NR_PFNS - 1)) == 0 &&
-                 /* Check if there exists MMIO hole in the 1GB memory
-                  * range */
-                 !check_mmio_hole(cur_pfn << PAGE_SHIFT,
-                                  SUPERPAGE_1GB_NR_PFNS << PAGE_SHIFT,
-                                  dom->mmio_start, dom->mmio_size) )
-            {
-                long done;
-                unsigned long nr_extents = count >> SUPERPAGE_1GB_SHIFT;
-                xen_pfn_t sp_extents[nr_extents];
+    nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if ( nr_threads > HVM_POPULATE_MAX_THREADS )
+        nr_threads = HVM_POPULATE_MAX_THREADS;
+    if ( nr_threads > ctx.nr_slices )
+        nr_threads = ctx.nr_slices;
 
-                for ( i = 0; i < nr_extents; i++ )
-                    sp_extents[i] =
-                        dom->p2m_host[cur_pages+(i<<SUPERPAGE_1GB_SHIFT)];
+    /*
+     * The calling thread is a worker too. If we fail to spawn some of the
+     * others, the ones we have will just populate more slices each.
+     */
+    for ( i = 1; i < nr_threads; i++ )
+        if ( pthread_create(&threads[i], NULL, populate_hvm_worker, &ctx) )
+            break;
+    nr_threads = i;
 
-                done = xc_domain_populate_physmap(xch, domid, nr_extents,
-                                                  SUPERPAGE_1GB_SHIFT,
-                                                  new_memflags, sp_extents);
+    populate_hvm_worker(&ctx);
 
-                if ( done > 0 )
-                {
-                    stat_1gb_pages += done;
-                    done <<= SUPERPAGE_1GB_SHIFT;
-                    cur_pages += done;
-                    count -= done;
-                }
-            }
+    for ( i = 1; i < nr_threads; i++ )
+        pthread_join(threads[i], NULL);
 
-            if ( count != 0 )
-            {
-                /* Clip count to maximum 8MB extent. */
-                max_pages = SUPERPAGE_2MB_NR_PFNS * 4;
-                if ( count > max_pages )
-                    count = max_pages;
-
-                /* Clip partial superpage extents to superpage
-                 * boundaries. */
-                if ( ((cur_pfn & (SUPERPAGE_2MB_NR_PFNS-1)) != 0) &&
-                     (count > (-cur_pfn & (SUPERPAGE_2MB_NR_PFNS-1))) )
-                    count = -cur_pfn & (SUPERPAGE_2MB_NR_PFNS-1);
-                else if ( ((count & (SUPERPAGE_2MB_NR_PFNS-1)) != 0) &&
-                          (count > SUPERPAGE_2MB_NR_PFNS) )
-                    count &= ~(SUPERPAGE_2MB_NR_PFNS - 1); /* clip non-s.p. tail */
-
-                /* Attempt to allocate superpage extents. */
-                if ( ((count | cur_pfn) & (SUPERPAGE_2MB_NR_PFNS - 1)) == 0 )
-                {
-                    long done;
-                    unsigned long nr_extents = count >> SUPERPAGE_2MB_SHIFT;
-                    xen_pfn_t sp_extents[nr_extents];
-
-                    for ( i = 0; i < nr_extents; i++ )
-                        sp_extents[i] =
-                            dom->p2m_host[cur_pages+(i<<SUPERPAGE_2MB_SHIFT)];
-
-                    done = xc_domain_populate_physmap(xch, domid, nr_extents,
-                                                      SUPERPAGE_2MB_SHIFT,
-                                                      new_memflags, sp_extents);
-
-                    if ( done > 0 )
-                    {
-                        stat_2mb_pages += done;
-                        done <<= SUPERPAGE_2MB_SHIFT;
-                        cur_pages += done;
-                        count -= done;
-                    }
-                }
-            }
+    pthread_mutex_destroy(&ctx.lock);
 
-            /* Fall back to 4kB extents. */
-            if ( count != 0 )
-            {
-                rc = xc_domain_populate_physmap_exact(
-                    xch, domid, count, 0, new_memflags, &dom->p2m_host[cur_pages]);
-                cur_pages += count;
-                stat_normal_pages += count;
-            }
-        }
+    stat_normal_pages += ctx.stats.normal;
+    stat_2mb_pages = ctx.stats.sp_2mb;
+    stat_1gb_pages = ctx.stats.sp_1gb;
 
-        if ( rc != 0 )
-        {
-            DOMPRINTF("Could not allocate memory for HVM guest.");
-            goto error_out;
-        }
+    if ( ctx.rc != 0 )
+    {
+        DOMPRINTF("Could not allocate memory for HVM guest.");
+        goto error_out;
     }
 
     DPRINTF("PHYSICAL MEMORY ALLOCATION:\n");
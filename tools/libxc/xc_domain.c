@@ -274,6 +274,112 @@ int xc_vcpu_setaffinity(xc_interface *xch,
     return ret;
 }
 
+int xc_vcpu_setaffinity_list(xc_interface *xch,
+                             uint32_t domid,
+                             uint32_t first_vcpu,
+                             uint32_t nr_vcpus,
+                             xc_cpumap_t cpumaps_hard_inout,
+                             xc_cpumap_t cpumaps_soft_inout,
+                             uint32_t flags)
+{
+    DECLARE_DOMCTL;
+    DECLARE_HYPERCALL_BOUNCE(cpumaps_hard_inout, 0,
+                             XC_HYPERCALL_BUFFER_BOUNCE_BOTH);
+    DECLARE_HYPERCALL_BOUNCE(cpumaps_soft_inout, 0,
+                             XC_HYPERCALL_BUFFER_BOUNCE_BOTH);
+    int ret = -1;
+    int cpusize;
+    size_t size;
+
+    cpusize = xc_get_cpumap_size(xch);
+    if (cpusize <= 0)
+    {
+        PERROR("Could not get number of cpus");
+        return -1;
+    }
+
+    size = (size_t)cpusize *
+           ((flags & XEN_VCPUAFFINITYLIST_SAME) ? 1 : nr_vcpus);
+    HYPERCALL_BOUNCE_SET_SIZE(cpumaps_hard_inout, size);
+    HYPERCALL_BOUNCE_SET_SIZE(cpumaps_soft_inout, size);
+
+    if ( xc_hypercall_bounce_pre(xch, cpumaps_hard_inout) ||
+         xc_hypercall_bounce_pre(xch, cpumaps_soft_inout) )
+    {
+        PERROR("Could not allocate hcall buffers for DOMCTL_setvcpuaffinitylist");
+        goto out;
+    }
+
+    domctl.cmd = XEN_DOMCTL_setvcpuaffinitylist;
+    domctl.domain = domid;
+    domctl.u.vcpuaffinitylist.vcpu = first_vcpu;
+    domctl.u.vcpuaffinitylist.nr_vcpus = nr_vcpus;
+    domctl.u.vcpuaffinitylist.flags = flags;
+    domctl.u.vcpuaffinitylist.nr_cpumap_bytes = cpusize;
+    set_xen_guest_handle(domctl.u.vcpuaffinitylist.cpumap_hard,
+                         cpumaps_hard_inout);
+    set_xen_guest_handle(domctl.u.vcpuaffinitylist.cpumap_soft,
+                         cpumaps_soft_inout);
+
+    ret = do_domctl(xch, &domctl);
+
+ out:
+    xc_hypercall_bounce_post(xch, cpumaps_hard_inout);
+    xc_hypercall_bounce_post(xch, cpumaps_soft_inout);
+
+    return ret;
+}
+
+int xc_hvm_exit_stats_op(xc_interface *xch, uint32_t domid, uint32_t cmd)
+{
+    DECLARE_DOMCTL;
+
+    domctl.cmd = XEN_DOMCTL_hvm_exit_stats;
+    domctl.domain = domid;
+    domctl.u.hvm_exit_stats.cmd = cmd;
+    domctl.u.hvm_exit_stats.nr_reasons = 0;
+    set_xen_guest_handle(domctl.u.hvm_exit_stats.stats, HYPERCALL_BUFFER_NULL);
+
+    return do_domctl(xch, &domctl);
+}
+
+int xc_hvm_exit_stats_query(xc_interface *xch, uint32_t domid,
+                            uint32_t *nr_reasons, xc_exit_stat_t *stats,
+                            uint32_t *vendor, uint32_t *tsc_khz,
+                            uint32_t *enabled)
+{
+    DECLARE_DOMCTL;
+    DECLARE_HYPERCALL_BOUNCE(stats, *nr_reasons * sizeof(*stats),
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+    int ret;
+
+    if ( xc_hypercall_bounce_pre(xch, stats) )
+    {
+        PERROR("Could not allocate hcall buffer for DOMCTL_hvm_exit_stats");
+        return -1;
+    }
+
+    domctl.cmd = XEN_DOMCTL_hvm_exit_stats;
+    domctl.domain = domid;
+    domctl.u.hvm_exit_stats.cmd = XEN_DOMCTL_EXIT_STATS_query;
+    domctl.u.hvm_exit_stats.nr_reasons = *nr_reasons;
+    set_xen_guest_handle(domctl.u.hvm_exit_stats.stats, stats);
+
+    ret = do_domctl(xch, &domctl);
+
+    xc_hypercall_bounce_post(xch, stats);
+
+    if ( !ret )
+    {
+        *nr_reasons = domctl.u.hvm_exit_stats.nr_reasons;
+        *vendor = domctl.u.hvm_exit_stats.vendor;
+        *tsc_khz = domctl.u.hvm_exit_stats.tsc_khz;
+        *enabled = domctl.u.hvm_exit_stats.enabled;
+    }
+
+    return ret;
+}
+
 
 int xc_vcpu_getaffinity(xc_interface *xch,
                         uint32_t domid,
@@ -436,10 +542,13 @@ int xc_domain_getinfo(xc_interface *xch,
     return nr_doms;
 }
 
-int xc_domain_getinfolist(xc_interface *xch,
-                          uint32_t first_domain,
-                          unsigned int max_domains,
-                          xc_domaininfo_t *info)
+int xc_domain_getinfolist_changed(xc_interface *xch,
+                                  uint32_t first_domain,
+                                  unsigned int max_domains,
+                                  uint64_t since,
+                                  xc_domaininfo_t *info,
+                                  uint32_t *next_domain,
+                                  uint64_t *generation)
 {
     int ret = 0;
     DECLARE_SYSCTL;
@@ -451,18 +560,34 @@ int xc_domain_getinfolist(xc_interface *xch,
     sysctl.cmd = XEN_SYSCTL_getdomaininfolist;
     sysctl.u.getdomaininfolist.first_domain = first_domain;
     sysctl.u.getdomaininfolist.max_domains  = max_domains;
+    sysctl.u.getdomaininfolist.since        = since;
     set_xen_guest_handle(sysctl.u.getdomaininfolist.buffer, info);
 
     if ( xc_sysctl(xch, &sysctl) < 0 )
         ret = -1;
     else
+    {
         ret = sysctl.u.getdomaininfolist.num_domains;
+        if ( next_domain )
+            *next_domain = sysctl.u.getdomaininfolist.next_domain;
+        if ( generation )
+            *generation = sysctl.u.getdomaininfolist.generation;
+    }
 
     xc_hypercall_bounce_post(xch, info);
 
     return ret;
 }
 
+int xc_domain_getinfolist(xc_interface *xch,
+                          uint32_t first_domain,
+                          unsigned int max_domains,
+                          xc_domaininfo_t *info)
+{
+    return xc_domain_getinfolist_changed(xch, first_domain, max_domains, 0,
+                                         info, NULL, NULL);
+}
+
 /* set broken page p2m */
 int xc_set_broken_page_p2m(xc_interface *xch,
                            uint32_t domid,
@@ -534,6 +659,36 @@ int xc_domain_hvm_getcontext_partial(xc_interface *xch,
     return ret ? -1 : 0;
 }
 
+int xc_domain_hvm_getcontext_vcpus(xc_interface *xch,
+                                   uint32_t domid,
+                                   uint32_t first_vcpu,
+                                   uint32_t nr_vcpus,
+                                   uint32_t flags,
+                                   uint8_t *ctxt_buf,
+                                   uint32_t size)
+{
+    int ret;
+    DECLARE_DOMCTL;
+    DECLARE_HYPERCALL_BOUNCE(ctxt_buf, size, XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, ctxt_buf) )
+        return -1;
+
+    domctl.cmd = XEN_DOMCTL_gethvmcontext_vcpus;
+    domctl.domain = domid;
+    domctl.u.hvmcontext_vcpus.first_vcpu = first_vcpu;
+    domctl.u.hvmcontext_vcpus.nr_vcpus = nr_vcpus;
+    domctl.u.hvmcontext_vcpus.flags = flags;
+    domctl.u.hvmcontext_vcpus.size = size;
+    set_xen_guest_handle(domctl.u.hvmcontext_vcpus.buffer, ctxt_buf);
+
+    ret = do_domctl(xch, &domctl);
+
+    xc_hypercall_bounce_post(xch, ctxt_buf);
+
+    return (ret < 0 ? -1 : domctl.u.hvmcontext_vcpus.size);
+}
+
 /* set info to hvm guest for restore */
 int xc_domain_hvm_setcontext(xc_interface *xch,
                              uint32_t domid,
@@ -559,6 +714,35 @@ int xc_domain_hvm_setcontext(xc_interface *xch,
     return ret;
 }
 
+int xc_domain_hvm_setcontext_vcpus(xc_interface *xch,
+                                   uint32_t domid,
+                                   uint32_t first_vcpu,
+                                   uint32_t nr_vcpus,
+                                   uint8_t *ctxt_buf,
+                                   uint32_t size)
+{
+    int ret;
+    DECLARE_DOMCTL;
+    DECLARE_HYPERCALL_BOUNCE(ctxt_buf, size, XC_HYPERCALL_BUFFER_BOUNCE_IN);
+
+    if ( xc_hypercall_bounce_pre(xch, ctxt_buf) )
+        return -1;
+
+    domctl.cmd = XEN_DOMCTL_sethvmcontext_vcpus;
+    domctl.domain = domid;
+    domctl.u.hvmcontext_vcpus.first_vcpu = first_vcpu;
+    domctl.u.hvmcontext_vcpus.nr_vcpus = nr_vcpus;
+    domctl.u.hvmcontext_vcpus.flags = 0;
+    domctl.u.hvmcontext_vcpus.size = size;
+    set_xen_guest_handle(domctl.u.hvmcontext_vcpus.buffer, ctxt_buf);
+
+    ret = do_domctl(xch, &domctl);
+
+    xc_hypercall_bounce_post(xch, ctxt_buf);
+
+    return ret;
+}
+
 int xc_vcpu_getcontext(xc_interface *xch,
                        uint32_t domid,
                        uint32_t vcpu,
@@ -709,6 +893,136 @@ int xc_shadow_control(xc_interface *xch,
     return (rc == 0) ? domctl.u.shadow_op.pages : rc;
 }
 
+int xc_shadow_get_oos_pages(xc_interface *xch, uint32_t domid,
+                            unsigned int *nr)
+{
+    int rc;
+    DECLARE_DOMCTL;
+
+    memset(&domctl, 0, sizeof(domctl));
+
+    domctl.cmd = XEN_DOMCTL_shadow_op;
+    domctl.domain = domid;
+    domctl.u.shadow_op.op = XEN_DOMCTL_SHADOW_OP_GET_OOS_PAGES;
+
+    rc = do_domctl(xch, &domctl);
+    if ( !rc )
+        *nr = domctl.u.shadow_op.oos_pages;
+
+    return rc;
+}
+
+int xc_shadow_set_oos_pages(xc_interface *xch, uint32_t domid,
+                            unsigned int nr)
+{
+    DECLARE_DOMCTL;
+
+    memset(&domctl, 0, sizeof(domctl));
+
+    domctl.cmd = XEN_DOMCTL_shadow_op;
+    domctl.domain = domid;
+    domctl.u.shadow_op.op = XEN_DOMCTL_SHADOW_OP_SET_OOS_PAGES;
+    domctl.u.shadow_op.oos_pages = nr;
+
+    return do_domctl(xch, &domctl);
+}
+
+int xc_logdirty_ring_setup(xc_interface *xch,
+                           uint32_t domid,
+                           unsigned long entries)
+{
+    DECLARE_DOMCTL;
+
+    memset(&domctl, 0, sizeof(domctl));
+
+    domctl.cmd = XEN_DOMCTL_shadow_op;
+    domctl.domain = domid;
+    domctl.u.shadow_op.op    = XEN_DOMCTL_SHADOW_OP_DIRTY_RING_SETUP;
+    domctl.u.shadow_op.pages = entries;
+
+    return do_domctl(xch, &domctl);
+}
+
+int xc_logdirty_ring_drain(xc_interface *xch,
+                           uint32_t domid,
+                           uint64_t *gfns,
+                           unsigned long nr,
+                           unsigned long *drained)
+{
+    int rc;
+    unsigned long done = 0;
+    DECLARE_DOMCTL;
+    DECLARE_HYPERCALL_BOUNCE(gfns, nr * sizeof(*gfns),
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, gfns) )
+        return -1;
+
+    /* Xen hands out a limited number at a time; keep going until empty. */
+    do {
+        memset(&domctl, 0, sizeof(domctl));
+
+        domctl.cmd = XEN_DOMCTL_shadow_op;
+        domctl.domain = domid;
+        domctl.u.shadow_op.op    = XEN_DOMCTL_SHADOW_OP_DIRTY_RING_DRAIN;
+        domctl.u.shadow_op.pages = nr - done;
+        set_xen_guest_handle_offset(domctl.u.shadow_op.dirty_gfns, gfns,
+                                    done);
+
+        rc = do_domctl(xch, &domctl);
+        if ( rc )
+            break;
+
+        done += domctl.u.shadow_op.pages;
+    } while ( domctl.u.shadow_op.stats.dirty_count && done < nr );
+
+    xc_hypercall_bounce_post(xch, gfns);
+
+    /* Whatever got drained is no longer in the bitmap, so report it. */
+    *drained = done;
+
+    return rc;
+}
+
+long xc_logdirty_range(xc_interface *xch,
+                       uint32_t domid,
+                       bool clean,
+                       uint64_t *first_gfn,
+                       uint64_t nr_gfns,
+                       xen_domctl_shadow_dirty_chunk_t *chunks,
+                       unsigned long nr_chunks)
+{
+    int rc;
+    DECLARE_DOMCTL;
+    DECLARE_HYPERCALL_BOUNCE(chunks, nr_chunks * sizeof(*chunks),
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, chunks) )
+        return -1;
+
+    memset(&domctl, 0, sizeof(domctl));
+
+    domctl.cmd = XEN_DOMCTL_shadow_op;
+    domctl.domain = domid;
+    domctl.u.shadow_op.op        = clean ? XEN_DOMCTL_SHADOW_OP_CLEAN_RANGE
+                                         : XEN_DOMCTL_SHADOW_OP_PEEK_RANGE;
+    domctl.u.shadow_op.pages     = nr_chunks;
+    domctl.u.shadow_op.first_gfn = *first_gfn;
+    domctl.u.shadow_op.nr_gfns   = nr_gfns;
+    set_xen_guest_handle(domctl.u.shadow_op.dirty_chunks, chunks);
+
+    rc = do_domctl(xch, &domctl);
+
+    xc_hypercall_bounce_post(xch, chunks);
+
+    if ( rc )
+        return rc;
+
+    *first_gfn = domctl.u.shadow_op.first_gfn;
+
+    return domctl.u.shadow_op.pages;
+}
+
 int xc_domain_setmaxmem(xc_interface *xch,
                         uint32_t domid,
                         uint64_t max_memkb)
@@ -1354,6 +1668,60 @@ int xc_vcpu_getinfo(xc_interface *xch,
     return rc;
 }
 
+int xc_vcpu_getinfolist(xc_interface *xch,
+                        uint32_t *domid,
+                        uint32_t *vcpu,
+                        bool single_domain,
+                        unsigned int max_vcpus,
+                        xc_vcpuinfolist_t *info,
+                        uint8_t *cpumap_hard,
+                        uint8_t *cpumap_soft,
+                        unsigned int nr_cpumap_bytes)
+{
+    int ret = -1;
+    size_t maps_size = (size_t)max_vcpus * nr_cpumap_bytes;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BOUNCE(info, max_vcpus * sizeof(*info),
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+    DECLARE_HYPERCALL_BOUNCE(cpumap_hard, maps_size,
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+    DECLARE_HYPERCALL_BOUNCE(cpumap_soft, maps_size,
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( !cpumap_hard && !cpumap_soft )
+        nr_cpumap_bytes = 0;
+
+    if ( xc_hypercall_bounce_pre(xch, info) ||
+         xc_hypercall_bounce_pre(xch, cpumap_hard) ||
+         xc_hypercall_bounce_pre(xch, cpumap_soft) )
+        goto out;
+
+    sysctl.cmd = XEN_SYSCTL_getvcpuinfolist;
+    sysctl.u.getvcpuinfolist.domain = *domid;
+    sysctl.u.getvcpuinfolist.flags =
+        single_domain ? XEN_SYSCTL_VCPUINFO_single_domain : 0;
+    sysctl.u.getvcpuinfolist.vcpu = *vcpu;
+    sysctl.u.getvcpuinfolist.nr_vcpus = max_vcpus;
+    sysctl.u.getvcpuinfolist.nr_cpumap_bytes = nr_cpumap_bytes;
+    set_xen_guest_handle(sysctl.u.getvcpuinfolist.info, info);
+    set_xen_guest_handle(sysctl.u.getvcpuinfolist.cpumap_hard, cpumap_hard);
+    set_xen_guest_handle(sysctl.u.getvcpuinfolist.cpumap_soft, cpumap_soft);
+
+    if ( xc_sysctl(xch, &sysctl) < 0 )
+        goto out;
+
+    *domid = sysctl.u.getvcpuinfolist.domain;
+    *vcpu = sysctl.u.getvcpuinfolist.vcpu;
+    ret = sysctl.u.getvcpuinfolist.nr_vcpus;
+
+ out:
+    xc_hypercall_bounce_post(xch, info);
+    xc_hypercall_bounce_post(xch, cpumap_hard);
+    xc_hypercall_bounce_post(xch, cpumap_soft);
+
+    return ret;
+}
+
 int xc_domain_ioport_permission(xc_interface *xch,
                                 uint32_t domid,
                                 uint32_t first_port,
@@ -2303,6 +2671,35 @@ int xc_domain_set_gnttab_limits(xc_interface *xch, uint32_t domid,
     return do_domctl(xch, &domctl);
 }
 
+int xc_domain_set_spec_ctrl(xc_interface *xch, uint32_t domid,
+                            uint32_t trust_group, uint32_t flags)
+{
+    DECLARE_DOMCTL;
+
+    domctl.cmd = XEN_DOMCTL_set_spec_ctrl;
+    domctl.domain = domid;
+    domctl.u.spec_ctrl.trust_group = trust_group;
+    domctl.u.spec_ctrl.flags = flags;
+    return do_domctl(xch, &domctl);
+}
+
+int xc_domain_get_spec_ctrl(xc_interface *xch, uint32_t domid,
+                            uint32_t *trust_group, uint32_t *flags)
+{
+    int rc;
+    DECLARE_DOMCTL;
+
+    domctl.cmd = XEN_DOMCTL_get_spec_ctrl;
+    domctl.domain = domid;
+    rc = do_domctl(xch, &domctl);
+    if ( rc )
+        return rc;
+
+    *trust_group = domctl.u.spec_ctrl.trust_group;
+    *flags = domctl.u.spec_ctrl.flags;
+    return 0;
+}
+
 /* Plumbing Xen with vNUMA topology */
 int xc_domain_setvnuma(xc_interface *xch,
                        uint32_t domid,
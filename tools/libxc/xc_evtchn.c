@@ -74,6 +74,36 @@ int xc_evtchn_status(xc_interface *xch, xc_evtchn_status_t *status)
                         sizeof(*status), 1);
 }
 
+int xc_evtchn_steering(xc_interface *xch, uint32_t domid,
+                       uint32_t *nr_ports, uint32_t *period_ms,
+                       xc_evtchn_steer_t *ports)
+{
+    int rc;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BOUNCE(ports, *nr_ports * sizeof(*ports),
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, ports) )
+        return -1;
+
+    sysctl.cmd = XEN_SYSCTL_evtchn_steering;
+    sysctl.u.evtchn_steering.domid = domid;
+    sysctl.u.evtchn_steering.max_ports = *nr_ports;
+    set_xen_guest_handle(sysctl.u.evtchn_steering.ports, ports);
+
+    rc = do_sysctl(xch, &sysctl);
+
+    xc_hypercall_bounce_post(xch, ports);
+
+    if ( !rc )
+    {
+        *nr_ports = sysctl.u.evtchn_steering.nr_ports;
+        *period_ms = sysctl.u.evtchn_steering.period_ms;
+    }
+
+    return rc;
+}
+
 /*
  * Local variables:
  * mode: C
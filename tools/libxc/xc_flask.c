@@ -379,7 +379,8 @@ int xc_flask_avc_cachestats(xc_interface *xch, char *buf, int size)
     int i = 0;
     DECLARE_FLASK_OP;
 
-    n = snprintf(buf, size, "lookups hits misses allocations reclaims frees\n");
+    n = snprintf(buf, size, "lookups hits misses allocations reclaims frees "
+                            "pcpu_hits pcpu_misses\n");
     buf += n;
     size -= n;
   
@@ -392,10 +393,12 @@ int xc_flask_avc_cachestats(xc_interface *xch, char *buf, int size)
             return 0;
         if ( err )
             return err;
-        n = snprintf(buf, size, "%u %u %u %u %u %u\n",
+        n = snprintf(buf, size, "%u %u %u %u %u %u %u %u\n",
                      op.u.cache_stats.lookups, op.u.cache_stats.hits,
                      op.u.cache_stats.misses, op.u.cache_stats.allocations,
-                     op.u.cache_stats.reclaims, op.u.cache_stats.frees);
+                     op.u.cache_stats.reclaims, op.u.cache_stats.frees,
+                     op.u.cache_stats.pcpu_hits,
+                     op.u.cache_stats.pcpu_misses);
         buf += n;
         size -= n;
         i++;
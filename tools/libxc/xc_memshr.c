@@ -200,6 +200,20 @@ int xc_memshr_range_share(xc_interface *xch,
     return xc_memshr_memop(xch, source_domain, &mso);
 }
 
+int xc_memshr_fork(xc_interface *xch,
+                   uint32_t parent_domain,
+                   uint32_t domid)
+{
+    xen_mem_sharing_op_t mso;
+
+    memset(&mso, 0, sizeof(mso));
+
+    mso.op = XENMEM_sharing_op_fork;
+    mso.u.fork.parent_domain = parent_domain;
+
+    return xc_memshr_memop(xch, domid, &mso);
+}
+
 int xc_memshr_domain_resume(xc_interface *xch,
                             uint32_t domid)
 {
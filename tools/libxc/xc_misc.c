@@ -187,6 +187,29 @@ int xc_send_debug_keys(xc_interface *xch, char *keys)
     return ret;
 }
 
+int xc_debug_dump(xc_interface *xch, char key, char *buffer, uint32_t *size)
+{
+    int ret;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BOUNCE(buffer, *size, XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, buffer) )
+        return -1;
+
+    sysctl.cmd = XEN_SYSCTL_debug_dump;
+    sysctl.u.debug_dump.key = key;
+    sysctl.u.debug_dump.size = *size;
+    set_xen_guest_handle(sysctl.u.debug_dump.buffer, buffer);
+
+    ret = do_sysctl(xch, &sysctl);
+    if ( !ret )
+        *size = sysctl.u.debug_dump.size;
+
+    xc_hypercall_bounce_post(xch, buffer);
+
+    return ret;
+}
+
 int xc_set_parameters(xc_interface *xch, char *params)
 {
     int ret, len = strlen(params);
@@ -464,6 +487,29 @@ int xc_perfc_query(xc_interface *xch,
     return do_sysctl(xch, &sysctl);
 }
 
+int xc_perfc_shared_info(xc_interface *xch,
+                         uint64_t *info_mfn,
+                         uint32_t *info_frames)
+{
+    int rc;
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_perfc_op;
+    sysctl.u.perfc_op.cmd = XEN_SYSCTL_PERFCOP_shared;
+    set_xen_guest_handle(sysctl.u.perfc_op.desc, HYPERCALL_BUFFER_NULL);
+    set_xen_guest_handle(sysctl.u.perfc_op.val, HYPERCALL_BUFFER_NULL);
+
+    rc = do_sysctl(xch, &sysctl);
+
+    if ( !rc )
+    {
+        *info_mfn = sysctl.u.perfc_op.info_mfn;
+        *info_frames = sysctl.u.perfc_op.info_frames;
+    }
+
+    return rc;
+}
+
 int xc_lockprof_reset(xc_interface *xch)
 {
     DECLARE_SYSCTL;
@@ -514,6 +560,261 @@ int xc_lockprof_query(xc_interface *xch,
     return rc;
 }
 
+int xc_lockhist_reset(xc_interface *xch)
+{
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_lockhist_op;
+    sysctl.u.lockhist_op.cmd = XEN_SYSCTL_LOCKHIST_reset;
+    set_xen_guest_handle(sysctl.u.lockhist_op.data, HYPERCALL_BUFFER_NULL);
+
+    return do_sysctl(xch, &sysctl);
+}
+
+int xc_lockhist_set_rate(xc_interface *xch, uint32_t rate)
+{
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_lockhist_op;
+    sysctl.u.lockhist_op.cmd = XEN_SYSCTL_LOCKHIST_set_rate;
+    sysctl.u.lockhist_op.rate = rate;
+    set_xen_guest_handle(sysctl.u.lockhist_op.data, HYPERCALL_BUFFER_NULL);
+
+    return do_sysctl(xch, &sysctl);
+}
+
+int xc_lockhist_query_number(xc_interface *xch,
+                             uint32_t *n_elems,
+                             uint32_t *rate,
+                             uint32_t *dropped)
+{
+    int rc;
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_lockhist_op;
+    sysctl.u.lockhist_op.max_elem = 0;
+    sysctl.u.lockhist_op.cmd = XEN_SYSCTL_LOCKHIST_query;
+    set_xen_guest_handle(sysctl.u.lockhist_op.data, HYPERCALL_BUFFER_NULL);
+
+    rc = do_sysctl(xch, &sysctl);
+
+    *n_elems = sysctl.u.lockhist_op.nr_elem;
+    *rate = sysctl.u.lockhist_op.rate;
+    *dropped = sysctl.u.lockhist_op.dropped;
+
+    return rc;
+}
+
+int xc_lockhist_query(xc_interface *xch,
+                      uint32_t *n_elems,
+                      uint32_t *rate,
+                      uint32_t *dropped,
+                      struct xc_hypercall_buffer *data)
+{
+    int rc;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BUFFER_ARGUMENT(data);
+
+    sysctl.cmd = XEN_SYSCTL_lockhist_op;
+    sysctl.u.lockhist_op.cmd = XEN_SYSCTL_LOCKHIST_query;
+    sysctl.u.lockhist_op.max_elem = *n_elems;
+    set_xen_guest_handle(sysctl.u.lockhist_op.data, data);
+
+    rc = do_sysctl(xch, &sysctl);
+
+    *n_elems = sysctl.u.lockhist_op.nr_elem;
+    *rate = sysctl.u.lockhist_op.rate;
+    *dropped = sysctl.u.lockhist_op.dropped;
+
+    return rc;
+}
+
+int xc_hcstats_op(xc_interface *xch, uint32_t cmd)
+{
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_hypercall_stats;
+    sysctl.u.hcstats_op.cmd = cmd;
+    set_xen_guest_handle(sysctl.u.hcstats_op.data, HYPERCALL_BUFFER_NULL);
+
+    return do_sysctl(xch, &sysctl);
+}
+
+int xc_hcstats_query_number(xc_interface *xch,
+                            uint32_t *n_elems,
+                            uint32_t *enabled,
+                            uint32_t *dropped)
+{
+    int rc;
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_hypercall_stats;
+    sysctl.u.hcstats_op.max_elem = 0;
+    sysctl.u.hcstats_op.cmd = XEN_SYSCTL_HCSTATS_query;
+    set_xen_guest_handle(sysctl.u.hcstats_op.data, HYPERCALL_BUFFER_NULL);
+
+    rc = do_sysctl(xch, &sysctl);
+
+    *n_elems = sysctl.u.hcstats_op.nr_elem;
+    *enabled = sysctl.u.hcstats_op.enabled;
+    *dropped = sysctl.u.hcstats_op.dropped;
+
+    return rc;
+}
+
+int xc_hcstats_query(xc_interface *xch,
+                     uint32_t *n_elems,
+                     uint32_t *enabled,
+                     uint32_t *dropped,
+                     struct xc_hypercall_buffer *data)
+{
+    int rc;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BUFFER_ARGUMENT(data);
+
+    sysctl.cmd = XEN_SYSCTL_hypercall_stats;
+    sysctl.u.hcstats_op.cmd = XEN_SYSCTL_HCSTATS_query;
+    sysctl.u.hcstats_op.max_elem = *n_elems;
+    set_xen_guest_handle(sysctl.u.hcstats_op.data, data);
+
+    rc = do_sysctl(xch, &sysctl);
+
+    *n_elems = sysctl.u.hcstats_op.nr_elem;
+    *enabled = sysctl.u.hcstats_op.enabled;
+    *dropped = sysctl.u.hcstats_op.dropped;
+
+    return rc;
+}
+
+int xc_sched_stats_op(xc_interface *xch, uint32_t cmd)
+{
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_sched_stats;
+    sysctl.u.sched_stats.cmd = cmd;
+    set_xen_guest_handle(sysctl.u.sched_stats.vcpus, HYPERCALL_BUFFER_NULL);
+    set_xen_guest_handle(sysctl.u.sched_stats.cpus, HYPERCALL_BUFFER_NULL);
+
+    return do_sysctl(xch, &sysctl);
+}
+
+int xc_sched_stats_query_vcpus(xc_interface *xch, uint32_t domid,
+                               uint32_t *nr, xc_schedstats_vcpu_t *stats,
+                               uint32_t *enabled)
+{
+    int rc;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BOUNCE(stats, *nr * sizeof(*stats),
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, stats) )
+        return -1;
+
+    sysctl.cmd = XEN_SYSCTL_sched_stats;
+    sysctl.u.sched_stats.cmd = XEN_SYSCTL_SCHEDSTATS_query_vcpus;
+    sysctl.u.sched_stats.domid = domid;
+    sysctl.u.sched_stats.max_elem = *nr;
+    set_xen_guest_handle(sysctl.u.sched_stats.vcpus, stats);
+    set_xen_guest_handle(sysctl.u.sched_stats.cpus, HYPERCALL_BUFFER_NULL);
+
+    rc = do_sysctl(xch, &sysctl);
+
+    xc_hypercall_bounce_post(xch, stats);
+
+    if ( !rc )
+    {
+        *nr = sysctl.u.sched_stats.nr_elem;
+        *enabled = sysctl.u.sched_stats.enabled;
+    }
+
+    return rc;
+}
+
+int xc_sched_stats_query_cpus(xc_interface *xch,
+                              uint32_t *nr, xc_schedstats_cpu_t *stats,
+                              uint32_t *enabled)
+{
+    int rc;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BOUNCE(stats, *nr * sizeof(*stats),
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, stats) )
+        return -1;
+
+    sysctl.cmd = XEN_SYSCTL_sched_stats;
+    sysctl.u.sched_stats.cmd = XEN_SYSCTL_SCHEDSTATS_query_cpus;
+    sysctl.u.sched_stats.max_elem = *nr;
+    set_xen_guest_handle(sysctl.u.sched_stats.vcpus, HYPERCALL_BUFFER_NULL);
+    set_xen_guest_handle(sysctl.u.sched_stats.cpus, stats);
+
+    rc = do_sysctl(xch, &sysctl);
+
+    xc_hypercall_bounce_post(xch, stats);
+
+    if ( !rc )
+    {
+        *nr = sysctl.u.sched_stats.nr_elem;
+        *enabled = sysctl.u.sched_stats.enabled;
+    }
+
+    return rc;
+}
+
+int xc_pmuprof_start(xc_interface *xch, uint32_t period, uint32_t nr_samples)
+{
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_pmuprof_op;
+    sysctl.u.pmuprof_op.cmd = XEN_SYSCTL_PMUPROF_start;
+    sysctl.u.pmuprof_op.period = period;
+    sysctl.u.pmuprof_op.nr_samples = nr_samples;
+    set_xen_guest_handle(sysctl.u.pmuprof_op.samples, HYPERCALL_BUFFER_NULL);
+
+    return do_sysctl(xch, &sysctl);
+}
+
+int xc_pmuprof_stop(xc_interface *xch)
+{
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_pmuprof_op;
+    sysctl.u.pmuprof_op.cmd = XEN_SYSCTL_PMUPROF_stop;
+    set_xen_guest_handle(sysctl.u.pmuprof_op.samples, HYPERCALL_BUFFER_NULL);
+
+    return do_sysctl(xch, &sysctl);
+}
+
+int xc_pmuprof_read(xc_interface *xch, uint32_t cpu, uint32_t *nr,
+                    xc_pmuprof_sample_t *samples, uint64_t *lost)
+{
+    int rc;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BOUNCE(samples, *nr * sizeof(*samples),
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, samples) )
+        return -1;
+
+    sysctl.cmd = XEN_SYSCTL_pmuprof_op;
+    sysctl.u.pmuprof_op.cmd = XEN_SYSCTL_PMUPROF_read;
+    sysctl.u.pmuprof_op.cpu = cpu;
+    sysctl.u.pmuprof_op.nr_samples = *nr;
+    set_xen_guest_handle(sysctl.u.pmuprof_op.samples, samples);
+
+    rc = do_sysctl(xch, &sysctl);
+
+    xc_hypercall_bounce_post(xch, samples);
+
+    if ( !rc )
+    {
+        *nr = sysctl.u.pmuprof_op.nr_samples;
+        *lost = sysctl.u.pmuprof_op.lost;
+    }
+
+    return rc;
+}
+
 int xc_getcpuinfo(xc_interface *xch, int max_cpus,
                   xc_cpuinfo_t *info, int *nr_cpus)
 {
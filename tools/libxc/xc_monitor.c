@@ -28,6 +28,14 @@ void *xc_monitor_enable(xc_interface *xch, uint32_t domain_id, uint32_t *port)
                               port);
 }
 
+void *xc_monitor_add_ring(xc_interface *xch, uint32_t domain_id,
+                          unsigned int first_vcpu, unsigned int nr_vcpus,
+                          uint32_t *port)
+{
+    return xc_vm_event_add_ring(xch, domain_id, XEN_DOMCTL_VM_EVENT_OP_MONITOR,
+                                first_vcpu, nr_vcpus, port);
+}
+
 int xc_monitor_disable(xc_interface *xch, uint32_t domain_id)
 {
     return xc_vm_event_control(xch, domain_id,
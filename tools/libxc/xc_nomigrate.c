@@ -28,6 +28,16 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t flags,
     return -1;
 }
 
+int xc_domain_save_streams(xc_interface *xch, int io_fd,
+                           const int *data_fds, unsigned int nr_data_fds,
+                           uint32_t dom, uint32_t flags,
+                           struct save_callbacks* callbacks, int hvm,
+                           xc_migration_stream_t stream_type, int recv_fd)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
 int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       unsigned int store_evtchn, unsigned long *store_mfn,
                       uint32_t store_domid, unsigned int console_evtchn,
@@ -40,6 +50,22 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     return -1;
 }
 
+int xc_domain_restore_streams(xc_interface *xch, int io_fd,
+                              const int *data_fds, unsigned int nr_data_fds,
+                              uint32_t dom, unsigned int store_evtchn,
+                              unsigned long *store_mfn, uint32_t store_domid,
+                              unsigned int console_evtchn,
+                              unsigned long *console_mfn,
+                              uint32_t console_domid,
+                              unsigned int hvm, unsigned int pae,
+                              xc_migration_stream_t stream_type,
+                              struct restore_callbacks *callbacks,
+                              int send_back_fd)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
 /*
  * Local variables:
  * mode: C
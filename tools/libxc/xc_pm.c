@@ -168,6 +168,9 @@ int xc_pm_get_cxstat(xc_interface *xch, int cpuid, struct xc_cx_stat *cxpt)
     cxpt->idle_time = sysctl.u.get_pmstat.u.getcx.idle_time;
     cxpt->nr_pc = sysctl.u.get_pmstat.u.getcx.nr_pc;
     cxpt->nr_cc = sysctl.u.get_pmstat.u.getcx.nr_cc;
+    cxpt->pred_total = sysctl.u.get_pmstat.u.getcx.pred_total;
+    cxpt->pred_too_deep = sysctl.u.get_pmstat.u.getcx.pred_too_deep;
+    cxpt->pred_too_shallow = sysctl.u.get_pmstat.u.getcx.pred_too_shallow;
 
 unlock_4:
     xc_hypercall_bounce_post(xch, cc);
@@ -463,3 +466,85 @@ int xc_disable_turbo(xc_interface *xch, int cpuid)
     sysctl.u.pm_op.cpuid = cpuid;
     return do_sysctl(xch, &sysctl);
 }
+
+int xc_get_cpufreq_domain_boost(xc_interface *xch, uint32_t domid,
+                                bool *boost)
+{
+    int rc;
+    DECLARE_SYSCTL;
+
+    if ( !xch || !boost )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    sysctl.cmd = XEN_SYSCTL_pm_op;
+    sysctl.u.pm_op.cmd = XEN_SYSCTL_pm_op_get_domain_boost;
+    sysctl.u.pm_op.cpuid = 0;
+    sysctl.u.pm_op.u.domain_boost.domid = domid;
+    rc = do_sysctl(xch, &sysctl);
+    if ( !rc )
+        *boost = sysctl.u.pm_op.u.domain_boost.boost;
+
+    return rc;
+}
+
+int xc_set_cpufreq_domain_boost(xc_interface *xch, uint32_t domid,
+                                bool boost)
+{
+    DECLARE_SYSCTL;
+
+    if ( !xch )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    sysctl.cmd = XEN_SYSCTL_pm_op;
+    sysctl.u.pm_op.cmd = XEN_SYSCTL_pm_op_set_domain_boost;
+    sysctl.u.pm_op.cpuid = 0;
+    sysctl.u.pm_op.u.domain_boost.domid = domid;
+    sysctl.u.pm_op.u.domain_boost.boost = boost;
+
+    return do_sysctl(xch, &sysctl);
+}
+
+int xc_get_cpupool_idle_latency(xc_interface *xch, uint32_t poolid,
+                                uint32_t *latency)
+{
+    int rc;
+    DECLARE_SYSCTL;
+
+    if ( !xch || !latency )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    sysctl.cmd = XEN_SYSCTL_pm_op;
+    sysctl.u.pm_op.cmd = XEN_SYSCTL_pm_op_get_cpupool_latency;
+    sysctl.u.pm_op.cpuid = 0;
+    sysctl.u.pm_op.u.cpupool_latency.cpupool_id = poolid;
+    rc = do_sysctl(xch, &sysctl);
+    if ( !rc )
+        *latency = sysctl.u.pm_op.u.cpupool_latency.latency;
+
+    return rc;
+}
+
+int xc_set_cpupool_idle_latency(xc_interface *xch, uint32_t poolid,
+                                uint32_t latency)
+{
+    DECLARE_SYSCTL;
+
+    if ( !xch )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    sysctl.cmd = XEN_SYSCTL_pm_op;
+    sysctl.u.pm_op.cmd = XEN_SYSCTL_pm_op_set_cpupool_latency;
+    sysctl.u.pm_op.cpuid = 0;
+    sysctl.u.pm_op.u.cpupool_latency.cpupool_id = poolid;
+    sysctl.u.pm_op.u.cpupool_latency.latency = latency;
+
+    return do_sysctl(xch, &sysctl);
+}
@@ -422,6 +422,13 @@ int xc_vm_event_control(xc_interface *xch, uint32_t domain_id, unsigned int op,
  */
 void *xc_vm_event_enable(xc_interface *xch, uint32_t domain_id, int param,
                          uint32_t *port);
+/*
+ * Sets up a further ring for the vCPUs [first_vcpu, first_vcpu + nr_vcpus)
+ * and returns it mapped.  Only XEN_DOMCTL_VM_EVENT_OP_MONITOR supports this.
+ */
+void *xc_vm_event_add_ring(xc_interface *xch, uint32_t domain_id,
+                           unsigned int mode, unsigned int first_vcpu,
+                           unsigned int nr_vcpus, uint32_t *port);
 
 int do_dm_op(xc_interface *xch, uint32_t domid, unsigned int nr_bufs, ...);
 
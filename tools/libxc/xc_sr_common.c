@@ -38,6 +38,19 @@ static const char *mandatory_rec_types[] =
     [REC_TYPE_VERIFY]                       = "Verify",
     [REC_TYPE_CHECKPOINT]                   = "Checkpoint",
     [REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST]    = "Checkpoint dirty pfn list",
+    [REC_TYPE_ZERO_PAGE_DATA]               = "Zero page data",
+    [REC_TYPE_POSTCOPY_PFNS]                = "Postcopy pfns",
+    [REC_TYPE_POSTCOPY_TRANSITION]          = "Postcopy transition",
+    [REC_TYPE_POSTCOPY_PAGE_DATA]           = "Postcopy page data",
+    [REC_TYPE_POSTCOPY_FAULT]               = "Postcopy fault",
+    [REC_TYPE_DATA_STREAMS]                 = "Data streams",
+    [REC_TYPE_DATA_SYNC]                    = "Data sync",
+};
+
+static const char *optional_rec_types[] =
+{
+    [REC_TYPE_PAGE_INDEX_OFFSET & ~REC_TYPE_OPTIONAL] = "Page index offset",
+    [REC_TYPE_PAGE_INDEX & ~REC_TYPE_OPTIONAL]        = "Page index",
 };
 
 const char *rec_type_to_str(uint32_t type)
@@ -48,12 +61,19 @@ const char *rec_type_to_str(uint32_t type)
              (mandatory_rec_types[type]) )
             return mandatory_rec_types[type];
     }
+    else
+    {
+        type &= ~REC_TYPE_OPTIONAL;
+        if ( (type < ARRAY_SIZE(optional_rec_types)) &&
+             (optional_rec_types[type]) )
+            return optional_rec_types[type];
+    }
 
     return "Reserved";
 }
 
-int write_split_record(struct xc_sr_context *ctx, struct xc_sr_record *rec,
-                       void *buf, size_t sz)
+int write_split_record_fd(struct xc_sr_context *ctx, int fd,
+                          struct xc_sr_record *rec, void *buf, size_t sz)
 {
     static const char zeroes[(1u << REC_ALIGN_ORDER) - 1] = { 0 };
 
@@ -81,7 +101,7 @@ int write_split_record(struct xc_sr_context *ctx, struct xc_sr_record *rec,
     if ( sz )
         assert(buf);
 
-    if ( writev_exact(ctx->fd, parts, ARRAY_SIZE(parts)) )
+    if ( writev_exact(fd, parts, ARRAY_SIZE(parts)) )
         goto err;
 
     return 0;
@@ -153,6 +173,9 @@ static void __attribute__((unused)) build_assertions(void)
     BUILD_BUG_ON(sizeof(struct xc_sr_rec_tsc_info)          != 24);
     BUILD_BUG_ON(sizeof(struct xc_sr_rec_hvm_params_entry)  != 16);
     BUILD_BUG_ON(sizeof(struct xc_sr_rec_hvm_params)        != 8);
+    BUILD_BUG_ON(sizeof(struct xc_sr_rec_data_streams)      != 8);
+    BUILD_BUG_ON(sizeof(struct xc_sr_rec_page_index_offset) != 8);
+    BUILD_BUG_ON(sizeof(struct xc_sr_rec_page_index_entry)  != 24);
 }
 
 /*
@@ -10,6 +10,9 @@
 
 #include "xc_sr_stream_format.h"
 
+#include <xenevtchn.h>
+#include <xen/vm_event.h>
+
 /* String representation of Domain Header types. */
 const char *dhdr_type_to_str(uint32_t type);
 
@@ -18,6 +21,10 @@ const char *rec_type_to_str(uint32_t type);
 
 struct xc_sr_context;
 struct xc_sr_record;
+struct xc_sr_save_pipeline;
+struct xc_sr_save_zerocopy;
+struct xc_sr_restore_pipeline;
+struct xc_sr_restore_streams;
 
 /**
  * Save operations.  To be implemented for each type of guest, for use by the
@@ -27,7 +34,11 @@ struct xc_sr_record;
  */
 struct xc_sr_save_ops
 {
-    /* Convert a PFN to GFN.  May return ~0UL for an invalid mapping. */
+    /*
+     * Convert a PFN to GFN.  May return ~0UL for an invalid mapping.
+     *
+     * May be called from several threads at once, as may normalise_page().
+     */
     xen_pfn_t (*pfn_to_gfn)(const struct xc_sr_context *ctx, xen_pfn_t pfn);
 
     /**
@@ -186,6 +197,28 @@ struct xc_sr_context
         {
             int recv_fd;
 
+            /* Extra streams spreading the page data, if any. */
+            const int *data_fds;
+            unsigned nr_data_fds, next_data_fd;
+            /* Page data sent since the last DATA_SYNC. */
+            bool data_unsynced;
+
+            /* State of the built-in adaptive precopy policy. */
+            struct
+            {
+                bool auto_converge;
+                /* Start of the current pass over the dirty pages. */
+                struct timespec pass_start;
+                unsigned long pass_pages;
+                /* Pages sent, and dirtied, per second. */
+                unsigned long send_rate, dirty_rate;
+                unsigned long last_dirty;
+                unsigned stalled;
+                /* Percentage of vcpu time taken away, and the cap before. */
+                unsigned throttle;
+                uint16_t orig_cap;
+            } policy;
+
             struct xc_sr_save_ops ops;
             struct save_callbacks *callbacks;
 
@@ -198,6 +231,16 @@ struct xc_sr_context
             /* Further debugging information in the stream. */
             bool debug;
 
+            /* Elide zero pages, using ZERO_PAGE_DATA records. */
+            bool zero_pages;
+
+            /*
+             * Send the pages still dirty after the pre-copy rounds
+             * post-copy, and whether we are doing so (batches then go out
+             * as POSTCOPY_PAGE_DATA records).
+             */
+            bool postcopy, in_postcopy;
+
             unsigned long p2m_size;
 
             struct precopy_stats stats;
@@ -207,6 +250,24 @@ struct xc_sr_context
             unsigned long *deferred_pages;
             unsigned long nr_deferred_pages;
             xc_hypercall_buffer_t dirty_bitmap_hbuf;
+
+            /* Batches sent with MSG_ZEROCOPY, when in use. */
+            struct xc_sr_save_zerocopy *zerocopy;
+
+            /* Worker threads preparing batches, if any. */
+            struct xc_sr_save_pipeline *pipeline;
+
+            /* GFNs drained off Xen's dirty ring, if it could set one up. */
+            uint64_t *dirty_gfns;
+
+            /*
+             * With XCFLAGS_PAGE_INDEX, where the page data went in the
+             * image, and where the PAGE_INDEX_OFFSET record's offset is.
+             */
+            bool page_index;
+            off_t index_offset_pos;
+            struct xc_sr_rec_page_index_entry *index;
+            unsigned long nr_index, max_index;
         } save;
 
         struct /* Restore data. */
@@ -215,6 +276,12 @@ struct xc_sr_context
             struct restore_callbacks *callbacks;
 
             int send_back_fd;
+
+            /* Extra streams carrying page data, and their readers. */
+            const int *data_fds;
+            unsigned nr_data_fds;
+            struct xc_sr_restore_streams *streams;
+
             unsigned long p2m_size;
             xc_hypercall_buffer_t dirty_bitmap_hbuf;
 
@@ -258,6 +325,59 @@ struct xc_sr_context
 
             /* Sender has invoked verify mode on the stream. */
             bool verify;
+
+            /* Post-copy state, once the sender listed outstanding pfns. */
+            struct
+            {
+                /* Pfns whose data is yet to come, bounded by p2m_size. */
+                unsigned long *outstanding;
+                unsigned long nr_outstanding;
+                /* Outstanding pfns evicted, to be paged in on demand. */
+                unsigned long *paged_out;
+                /* Outstanding pfns asked for with a POSTCOPY_FAULT. */
+                unsigned long *requested;
+                /* Outstanding pfns which could not be evicted. */
+                unsigned long nr_pinned;
+
+                /* Transition record seen, and guest state loaded. */
+                bool transition, resumed;
+
+                /* Paging ring. */
+                xenevtchn_handle *xce;
+                evtchn_port_t port;
+                void *ring_page;
+                vm_event_back_ring_t back_ring;
+
+                /* Requests waiting for their page to arrive. */
+                vm_event_request_t *pending;
+                unsigned nr_pending, max_pending;
+
+                /* Page aligned buffer for xc_mem_paging_load(). */
+                void *buffer;
+            } postcopy;
+
+            /*
+             * Lazy restore, from when the page index has been found.  The
+             * pages it has data for are outstanding, as for post-copy.
+             */
+            struct
+            {
+                bool active;
+
+                /* Page index entries with data, sorted by pfn at the end. */
+                struct xc_sr_rec_page_index_entry *runs;
+                unsigned long nr_runs, max_runs;
+
+                /* Where the background prefetch has got to. */
+                unsigned long next_run;
+                uint32_t next_page;
+
+                /* Page aligned buffer for reads from the image. */
+                void *buffer;
+            } lazy;
+
+            /* Worker threads writing page data, HVM only (may be NULL). */
+            struct xc_sr_restore_pipeline *pipeline;
         } restore;
     };
 
@@ -359,8 +479,28 @@ struct xc_sr_record
  *
  * Returns 0 on success and non0 on failure.
  */
-int write_split_record(struct xc_sr_context *ctx, struct xc_sr_record *rec,
-                       void *buf, size_t sz);
+int write_split_record_fd(struct xc_sr_context *ctx, int fd,
+                          struct xc_sr_record *rec, void *buf, size_t sz);
+
+static inline int write_split_record(struct xc_sr_context *ctx,
+                                     struct xc_sr_record *rec,
+                                     void *buf, size_t sz)
+{
+    return write_split_record_fd(ctx, ctx->fd, rec, buf, sz);
+}
+
+/* Whether a page of data is all zeroes. */
+static inline bool page_is_zero(const void *page)
+{
+    const uint64_t *p = page;
+    unsigned i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); ++i )
+        if ( p[i] )
+            return false;
+
+    return true;
+}
 
 /*
  * Writes a record to the stream, applying correct padding where appropriate.
@@ -1,6 +1,10 @@
 #include <arpa/inet.h>
 
 #include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
 
 #include "xc_sr_common.h"
 
@@ -194,151 +198,1907 @@ int populate_pfns(struct xc_sr_context *ctx, unsigned count,
     return rc;
 }
 
+/*
+ * Given a list of populated pfns, their types, and pointers to their data
+ * (NULL for pages to be zeroed), record their types, map the relevant subset
+ * and copy the data into the guest, or compare it with the guest's if verify.
+ *
+ * For HVM guests, it may be called from several threads at once, for
+ * disjoint sets of pfns.
+ */
+static int write_page_data(struct xc_sr_context *ctx, unsigned count,
+                           const xen_pfn_t *pfns, const uint32_t *types,
+                           void *const *pages, bool verify)
+{
+    xc_interface *xch = ctx->xch;
+    xen_pfn_t *mfns = malloc(count * sizeof(*mfns));
+    int *map_errs = malloc(count * sizeof(*map_errs));
+    int rc;
+    void *mapping = NULL, *guest_page = NULL;
+    unsigned i,    /* i indexes the pfns from the record. */
+        j,         /* j indexes the subset of pfns we decide to map. */
+        nr_pages = 0;
+
+    if ( !mfns || !map_errs )
+    {
+        rc = -1;
+        ERROR("Failed to allocate %zu bytes to process page data",
+              count * (sizeof(*mfns) + sizeof(*map_errs)));
+        goto err;
+    }
+
+    for ( i = 0; i < count; ++i )
+    {
+        ctx->restore.ops.set_page_type(ctx, pfns[i], types[i]);
+
+        switch ( types[i] )
+        {
+        case XEN_DOMCTL_PFINFO_NOTAB:
+
+        case XEN_DOMCTL_PFINFO_L1TAB:
+        case XEN_DOMCTL_PFINFO_L1TAB | XEN_DOMCTL_PFINFO_LPINTAB:
+
+        case XEN_DOMCTL_PFINFO_L2TAB:
+        case XEN_DOMCTL_PFINFO_L2TAB | XEN_DOMCTL_PFINFO_LPINTAB:
+
+        case XEN_DOMCTL_PFINFO_L3TAB:
+        case XEN_DOMCTL_PFINFO_L3TAB | XEN_DOMCTL_PFINFO_LPINTAB:
+
+        case XEN_DOMCTL_PFINFO_L4TAB:
+        case XEN_DOMCTL_PFINFO_L4TAB | XEN_DOMCTL_PFINFO_LPINTAB:
+
+            mfns[nr_pages++] = ctx->restore.ops.pfn_to_gfn(ctx, pfns[i]);
+            break;
+        }
+    }
+
+    /* Nothing to do? */
+    if ( nr_pages == 0 )
+        goto done;
+
+    mapping = guest_page = xenforeignmemory_map(xch->fmem,
+        ctx->domid, PROT_READ | PROT_WRITE,
+        nr_pages, mfns, map_errs);
+    if ( !mapping )
+    {
+        rc = -1;
+        PERROR("Unable to map %u mfns for %u pages of data",
+               nr_pages, count);
+        goto err;
+    }
+
+    for ( i = 0, j = 0; i < count; ++i )
+    {
+        switch ( types[i] )
+        {
+        case XEN_DOMCTL_PFINFO_XTAB:
+        case XEN_DOMCTL_PFINFO_BROKEN:
+        case XEN_DOMCTL_PFINFO_XALLOC:
+            /* No page data to deal with. */
+            continue;
+        }
+
+        if ( map_errs[j] )
+        {
+            rc = -1;
+            ERROR("Mapping pfn %#"PRIpfn" (mfn %#"PRIpfn", type %#"PRIx32") failed with %d",
+                  pfns[i], mfns[j], types[i], map_errs[j]);
+            goto err;
+        }
+
+        if ( !pages[i] )
+        {
+            /* Zero pages need no localising, even if pagetables. */
+            if ( verify )
+            {
+                if ( !page_is_zero(guest_page) )
+                    ERROR("verify pfn %#"PRIpfn" failed (type %#"PRIx32")",
+                          pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
+            }
+            else
+                memset(guest_page, 0, PAGE_SIZE);
+
+            ++j;
+            guest_page += PAGE_SIZE;
+            continue;
+        }
+
+        /* Undo page normalisation done by the saver. */
+        rc = ctx->restore.ops.localise_page(ctx, types[i], pages[i]);
+        if ( rc )
+        {
+            ERROR("Failed to localise pfn %#"PRIpfn" (type %#"PRIx32")",
+                  pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
+            goto err;
+        }
+
+        if ( verify )
+        {
+            /* Verify mode - compare incoming data to what we already have. */
+            if ( memcmp(guest_page, pages[i], PAGE_SIZE) )
+                ERROR("verify pfn %#"PRIpfn" failed (type %#"PRIx32")",
+                      pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
+        }
+        else
+        {
+            /* Regular mode - copy incoming data into place. */
+            memcpy(guest_page, pages[i], PAGE_SIZE);
+        }
+
+        ++j;
+        guest_page += PAGE_SIZE;
+    }
+
+ done:
+    rc = 0;
+
+ err:
+    if ( mapping )
+        xenforeignmemory_unmap(xch->fmem, mapping, nr_pages);
+
+    free(map_errs);
+    free(mfns);
+
+    return rc;
+}
+
+/* Whether a page of this type has a page worth of data in the stream. */
+static bool page_type_has_data(uint32_t type)
+{
+    switch ( type )
+    {
+    case XEN_DOMCTL_PFINFO_XTAB:
+    case XEN_DOMCTL_PFINFO_BROKEN:
+    case XEN_DOMCTL_PFINFO_XALLOC:
+        return false;
+    }
+
+    return true;
+}
+
 /*
  * Given a list of pfns, their types, and a block of page data from the
  * stream, populate and record their types, map the relevant subset and copy
- * the data into the guest.
+ * the data into the guest.  Without page data, the pages are zeroed instead.
+ */
+static int process_page_data(struct xc_sr_context *ctx, unsigned count,
+                             xen_pfn_t *pfns, uint32_t *types, void *page_data)
+{
+    xc_interface *xch = ctx->xch;
+    void **pages = malloc(count * sizeof(*pages));
+    unsigned i;
+    int rc = -1;
+
+    if ( !pages )
+    {
+        ERROR("Failed to allocate %zu bytes to process page data",
+              count * sizeof(*pages));
+        goto err;
+    }
+
+    rc = populate_pfns(ctx, count, pfns, types);
+    if ( rc )
+    {
+        ERROR("Failed to populate pfns for batch of %u pages", count);
+        goto err;
+    }
+
+    for ( i = 0; i < count; ++i )
+    {
+        pages[i] = page_data && page_type_has_data(types[i]) ? page_data
+                                                              : NULL;
+        if ( pages[i] )
+            page_data += PAGE_SIZE;
+    }
+
+    rc = write_page_data(ctx, count, pfns, types, pages, ctx->restore.verify);
+
+ err:
+    free(pages);
+
+    return rc;
+}
+
+/*
+ * When restoring an HVM guest with CPUs to spare, page data gets mapped and
+ * copied into the guest by worker threads, while the main thread reads the
+ * stream and populates the physmap.  Each worker owns every nr_threads'th
+ * 2MB range of pfns, and handles its share of the records in stream order,
+ * so pages sent several times still end up with their latest contents.
+ *
+ * A PV guest's localise_page() looks up (and populates) other pfns, so its
+ * page data is always processed by the main thread.
+ */
+#define RESTORE_MAX_WORKERS 4
+#define RESTORE_SHARD_SHIFT 9
+/* Records in the hands of the workers before the main thread waits. */
+#define RESTORE_MAX_RECORDS (4 * RESTORE_MAX_WORKERS)
+
+/* A page data record, shared between the workers which have a part of it. */
+struct xc_sr_restore_data
+{
+    void *data;
+    unsigned refs;
+};
+
+/* A worker's part of a page data record. */
+struct xc_sr_restore_batch
+{
+    struct xc_sr_restore_batch *next;
+    struct xc_sr_restore_data *rec;
+    unsigned count;
+    bool verify;
+    void **pages;
+    xen_pfn_t *pfns;
+    uint32_t *types;
+};
+
+struct xc_sr_restore_worker
+{
+    struct xc_sr_restore_pipeline *pipe;
+    pthread_t thread;
+    struct xc_sr_restore_batch *head, **tail;
+};
+
+struct xc_sr_restore_pipeline
+{
+    struct xc_sr_context *ctx;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool exit;
+    /* First failure of a worker, after which the others just drop batches. */
+    int rc;
+    unsigned nr_records;
+
+    struct xc_sr_restore_worker workers[RESTORE_MAX_WORKERS];
+    unsigned nr_threads;
+};
+
+static unsigned pfn_to_worker(const struct xc_sr_restore_pipeline *pipe,
+                              xen_pfn_t pfn)
+{
+    return (pfn >> RESTORE_SHARD_SHIFT) % pipe->nr_threads;
+}
+
+/* Called with the lock held. */
+static void put_batch(struct xc_sr_restore_pipeline *pipe,
+                      struct xc_sr_restore_batch *batch)
+{
+    if ( !--batch->rec->refs )
+    {
+        free(batch->rec->data);
+        free(batch->rec);
+        pipe->nr_records--;
+        pthread_cond_broadcast(&pipe->cond);
+    }
+    free(batch);
+}
+
+static void *restore_worker(void *arg)
+{
+    struct xc_sr_restore_worker *worker = arg;
+    struct xc_sr_restore_pipeline *pipe = worker->pipe;
+    struct xc_sr_restore_batch *batch;
+    int rc;
+
+    pthread_mutex_lock(&pipe->lock);
+    for ( ;; )
+    {
+        batch = worker->head;
+        if ( !batch )
+        {
+            if ( pipe->exit )
+                break;
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+            continue;
+        }
+
+        worker->head = batch->next;
+        if ( !worker->head )
+            worker->tail = &worker->head;
+        rc = pipe->rc;
+        pthread_mutex_unlock(&pipe->lock);
+
+        if ( !rc )
+            rc = write_page_data(pipe->ctx, batch->count, batch->pfns,
+                                 batch->types, batch->pages, batch->verify);
+
+        pthread_mutex_lock(&pipe->lock);
+        if ( rc && !pipe->rc )
+            pipe->rc = rc;
+        put_batch(pipe, batch);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+
+    return NULL;
+}
+
+/*
+ * Populate the pfns of a validated PAGE_DATA or ZERO_PAGE_DATA record, and
+ * hand its pages over to the workers.  Takes ownership of rec->data.
+ */
+static int queue_page_data(struct xc_sr_context *ctx,
+                           struct xc_sr_record *rec, unsigned count,
+                           xen_pfn_t *pfns, uint32_t *types, void *page_data)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_pipeline *pipe = ctx->restore.pipeline;
+    struct xc_sr_restore_batch *batches[RESTORE_MAX_WORKERS] = { NULL };
+    struct xc_sr_restore_batch *batch;
+    struct xc_sr_restore_data *data;
+    unsigned nr[RESTORE_MAX_WORKERS] = { 0 };
+    unsigned i, w;
+    int rc;
+
+    rc = populate_pfns(ctx, count, pfns, types);
+    if ( rc )
+    {
+        ERROR("Failed to populate pfns for batch of %u pages", count);
+        return rc;
+    }
+
+    rc = -1;
+    for ( i = 0; i < count; ++i )
+        nr[pfn_to_worker(pipe, pfns[i])]++;
+
+    data = malloc(sizeof(*data));
+    if ( !data )
+        goto nomem;
+    data->data = rec->data;
+    data->refs = 0;
+
+    for ( w = 0; w < pipe->nr_threads; ++w )
+    {
+        if ( !nr[w] )
+            continue;
+
+        batch = batches[w] = malloc(sizeof(*batch) +
+                                    nr[w] * (sizeof(*batch->pages) +
+                                             sizeof(*batch->pfns) +
+                                             sizeof(*batch->types)));
+        if ( !batch )
+            goto nomem;
+
+        batch->next = NULL;
+        batch->rec = data;
+        batch->count = 0;
+        batch->verify = ctx->restore.verify;
+        batch->pages = (void **)(batch + 1);
+        batch->pfns = (xen_pfn_t *)(batch->pages + nr[w]);
+        batch->types = (uint32_t *)(batch->pfns + nr[w]);
+        data->refs++;
+    }
+
+    for ( i = 0; i < count; ++i )
+    {
+        batch = batches[pfn_to_worker(pipe, pfns[i])];
+
+        batch->pages[batch->count] =
+            page_data && page_type_has_data(types[i]) ? page_data : NULL;
+        if ( batch->pages[batch->count] )
+            page_data += PAGE_SIZE;
+        batch->pfns[batch->count] = pfns[i];
+        batch->types[batch->count++] = types[i];
+    }
+
+    pthread_mutex_lock(&pipe->lock);
+    while ( !pipe->rc && pipe->nr_records == RESTORE_MAX_RECORDS )
+        pthread_cond_wait(&pipe->cond, &pipe->lock);
+
+    rc = pipe->rc;
+    if ( !rc )
+    {
+        for ( w = 0; w < pipe->nr_threads; ++w )
+        {
+            if ( !batches[w] )
+                continue;
+
+            *pipe->workers[w].tail = batches[w];
+            pipe->workers[w].tail = &batches[w]->next;
+        }
+        pipe->nr_records++;
+        pthread_cond_broadcast(&pipe->cond);
+        rec->data = NULL;
+    }
+    pthread_mutex_unlock(&pipe->lock);
+
+    if ( !rc )
+        return 0;
+
+    ERROR("Failed to write page data into the guest");
+    goto err;
+
+ nomem:
+    ERROR("Unable to allocate memory to queue a batch of %u pages", count);
+ err:
+    for ( w = 0; w < RESTORE_MAX_WORKERS; ++w )
+        free(batches[w]);
+    free(data);
+
+    return rc;
+}
+
+/*
+ * Wait for the workers to have written all the page data queued so far.
+ */
+static int drain_page_data(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_pipeline *pipe = ctx->restore.pipeline;
+    int rc;
+
+    if ( !pipe )
+        return 0;
+
+    pthread_mutex_lock(&pipe->lock);
+    while ( pipe->nr_records )
+        pthread_cond_wait(&pipe->cond, &pipe->lock);
+    rc = pipe->rc;
+    pthread_mutex_unlock(&pipe->lock);
+
+    if ( rc )
+        ERROR("Failed to write page data into the guest");
+
+    return rc;
+}
+
+/*
+ * Start worker threads, if it makes sense.  Failing to is not fatal: page
+ * data then gets processed by the main thread.
+ */
+static void setup_pipeline(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_pipeline *pipe;
+    long nr_threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    unsigned i;
+
+    /* Data streams have a thread each already. */
+    if ( !ctx->dominfo.hvm || ctx->restore.nr_data_fds || nr_threads <= 0 )
+        return;
+    if ( nr_threads > RESTORE_MAX_WORKERS )
+        nr_threads = RESTORE_MAX_WORKERS;
+
+    pipe = calloc(1, sizeof(*pipe));
+    if ( !pipe )
+        return;
+
+    pipe->ctx = ctx;
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->cond, NULL);
+
+    for ( i = 0; i < nr_threads; i++ )
+    {
+        pipe->workers[i].pipe = pipe;
+        pipe->workers[i].tail = &pipe->workers[i].head;
+        if ( pthread_create(&pipe->workers[i].thread, NULL,
+                            restore_worker, &pipe->workers[i]) )
+            break;
+    }
+    pipe->nr_threads = i;
+
+    if ( !pipe->nr_threads )
+    {
+        pthread_cond_destroy(&pipe->cond);
+        pthread_mutex_destroy(&pipe->lock);
+        free(pipe);
+        return;
+    }
+
+    DPRINTF("Writing page data with %u threads", pipe->nr_threads);
+    ctx->restore.pipeline = pipe;
+}
+
+static void teardown_pipeline(struct xc_sr_context *ctx)
+{
+    struct xc_sr_restore_pipeline *pipe = ctx->restore.pipeline;
+    unsigned i;
+
+    if ( !pipe )
+        return;
+
+    /* Whatever is left over after an error just gets dropped. */
+    pthread_mutex_lock(&pipe->lock);
+    if ( !pipe->rc )
+        pipe->rc = -1;
+    pipe->exit = true;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+
+    for ( i = 0; i < pipe->nr_threads; i++ )
+        pthread_join(pipe->workers[i].thread, NULL);
+
+    pthread_cond_destroy(&pipe->cond);
+    pthread_mutex_destroy(&pipe->lock);
+    free(pipe);
+    ctx->restore.pipeline = NULL;
+}
+
+/*
+ * Post-copy migration.  The sender lists the pages still dirty once it has
+ * suspended the guest in POSTCOPY_PFNS records, and only sends them after
+ * the POSTCOPY_TRANSITION record.  At the transition, the outstanding pages
+ * are evicted using the paging ring, and the guest gets resumed.  Whenever it
+ * touches one of them, Xen pauses the vcpu and puts a request on the ring,
+ * which we forward to the sender in a POSTCOPY_FAULT record; the page then
+ * gets loaded as soon as it arrives in a POSTCOPY_PAGE_DATA record, ahead of
+ * the ones the sender pushes meanwhile.
+ */
+static int send_postcopy_fault(struct xc_sr_context *ctx, uint64_t *pfns,
+                               unsigned count)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec =
+    {
+        .type = REC_TYPE_POSTCOPY_FAULT,
+        .length = count * sizeof(*pfns),
+    };
+    struct iovec iov[] =
+    {
+        { &rec.type, sizeof(rec.type) },
+        { &rec.length, sizeof(rec.length) },
+        { pfns, count * sizeof(*pfns) },
+    };
+
+    if ( writev_exact(ctx->restore.send_back_fd, iov, ARRAY_SIZE(iov)) )
+    {
+        PERROR("Failed to write postcopy fault to the back channel");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int alloc_outstanding(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+
+    if ( ctx->restore.postcopy.outstanding )
+        return 0;
+
+    ctx->restore.postcopy.outstanding = bitmap_alloc(ctx->restore.p2m_size);
+    ctx->restore.postcopy.paged_out = bitmap_alloc(ctx->restore.p2m_size);
+    ctx->restore.postcopy.requested = bitmap_alloc(ctx->restore.p2m_size);
+    if ( !ctx->restore.postcopy.outstanding ||
+         !ctx->restore.postcopy.paged_out ||
+         !ctx->restore.postcopy.requested )
+    {
+        ERROR("Unable to allocate memory for post-copy bitmaps");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Mark pfns as outstanding, as listed by a POSTCOPY_PFNS record.  They get
+ * populated straight away, to be evicted at the transition.
+ */
+static int handle_postcopy_pfns(struct xc_sr_context *ctx,
+                                struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    const uint64_t *pfns = rec->data;
+    unsigned i, nr_pfns = 0, count = rec->length / sizeof(*pfns);
+    xen_pfn_t *new_pfns = NULL;
+    int rc = -1;
+
+    if ( ctx->restore.checkpointed != XC_MIG_STREAM_NONE ||
+         ctx->restore.postcopy.transition )
+    {
+        ERROR("Unexpected POSTCOPY_PFNS record");
+        goto err;
+    }
+
+    if ( rec->length % sizeof(*pfns) )
+    {
+        ERROR("Invalid POSTCOPY_PFNS record length %u", rec->length);
+        goto err;
+    }
+
+    if ( alloc_outstanding(ctx) )
+        goto err;
+
+    new_pfns = malloc(count * sizeof(*new_pfns));
+    if ( count && !new_pfns )
+    {
+        ERROR("Unable to allocate memory for %u post-copy pfns", count);
+        goto err;
+    }
+
+    for ( i = 0; i < count; ++i )
+    {
+        if ( pfns[i] >= ctx->restore.p2m_size ||
+             !ctx->restore.ops.pfn_is_valid(ctx, pfns[i]) )
+        {
+            ERROR("Post-copy pfn %#"PRIx64" outside domain maximum", pfns[i]);
+            goto err;
+        }
+
+        if ( test_and_set_bit(pfns[i], ctx->restore.postcopy.outstanding) )
+            continue;
+
+        ctx->restore.postcopy.nr_outstanding++;
+        new_pfns[nr_pfns++] = pfns[i];
+    }
+
+    rc = populate_pfns(ctx, nr_pfns, new_pfns, NULL);
+
+ err:
+    free(new_pfns);
+    return rc;
+}
+
+static void postcopy_put_response(struct xc_sr_context *ctx,
+                                  const vm_event_request_t *req)
+{
+    vm_event_back_ring_t *back_ring = &ctx->restore.postcopy.back_ring;
+    vm_event_response_t rsp =
+    {
+        .version = VM_EVENT_INTERFACE_VERSION,
+        .vcpu_id = req->vcpu_id,
+        .flags = req->flags,
+        .reason = req->reason,
+        .u.mem_paging.gfn = req->u.mem_paging.gfn,
+    };
+
+    memcpy(RING_GET_RESPONSE(back_ring, back_ring->rsp_prod_pvt),
+           &rsp, sizeof(rsp));
+    back_ring->rsp_prod_pvt++;
+    RING_PUSH_RESPONSES(back_ring);
+}
+
+/*
+ * Sets up the paging ring, the way xenpaging does.
+ */
+static int setup_paging_ring(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    uint64_t ring_pfn;
+    xen_pfn_t pfn;
+    int rc;
+
+    if ( xc_hvm_param_get(xch, ctx->domid, HVM_PARAM_PAGING_RING_PFN,
+                          &ring_pfn) )
+    {
+        PERROR("Failed to get HVM_PARAM_PAGING_RING_PFN");
+        return -1;
+    }
+
+    /* The ring's contents are ours, whatever the sender thinks. */
+    if ( ring_pfn < ctx->restore.p2m_size &&
+         test_and_clear_bit(ring_pfn, ctx->restore.postcopy.outstanding) )
+        ctx->restore.postcopy.nr_outstanding--;
+
+    pfn = ring_pfn;
+    ctx->restore.postcopy.ring_page = xenforeignmemory_map(
+        xch->fmem, ctx->domid, PROT_READ | PROT_WRITE, 1, &pfn, NULL);
+    if ( !ctx->restore.postcopy.ring_page )
+    {
+        if ( xc_domain_populate_physmap_exact(xch, ctx->domid, 1, 0, 0,
+                                              &pfn) )
+        {
+            PERROR("Failed to populate ring gfn %#"PRIx64, ring_pfn);
+            return -1;
+        }
+
+        pfn = ring_pfn;
+        ctx->restore.postcopy.ring_page = xenforeignmemory_map(
+            xch->fmem, ctx->domid, PROT_READ | PROT_WRITE, 1, &pfn, NULL);
+        if ( !ctx->restore.postcopy.ring_page )
+        {
+            PERROR("Failed to map the paging ring");
+            return -1;
+        }
+    }
+
+    if ( xc_mem_paging_enable(xch, ctx->domid, &ctx->restore.postcopy.port) )
+    {
+        PERROR("Failed to enable paging%s", errno == ENODEV ?
+               " (Hardware Assisted Paging is required)" : "");
+        xenforeignmemory_unmap(xch->fmem, ctx->restore.postcopy.ring_page, 1);
+        ctx->restore.postcopy.ring_page = NULL;
+        return -1;
+    }
+
+    ctx->restore.postcopy.xce = xenevtchn_open(NULL, 0);
+    if ( !ctx->restore.postcopy.xce )
+    {
+        PERROR("Failed to open event channel");
+        return -1;
+    }
+
+    rc = xenevtchn_bind_interdomain(ctx->restore.postcopy.xce, ctx->domid,
+                                    ctx->restore.postcopy.port);
+    if ( rc < 0 )
+    {
+        PERROR("Failed to bind paging event channel");
+        xenevtchn_close(ctx->restore.postcopy.xce);
+        ctx->restore.postcopy.xce = NULL;
+        return -1;
+    }
+    ctx->restore.postcopy.port = rc;
+
+    SHARED_RING_INIT((vm_event_sring_t *)ctx->restore.postcopy.ring_page);
+    BACK_RING_INIT(&ctx->restore.postcopy.back_ring,
+                   (vm_event_sring_t *)ctx->restore.postcopy.ring_page,
+                   PAGE_SIZE);
+
+    /* Now that the ring is set, remove it from the guest's physmap. */
+    pfn = ring_pfn;
+    if ( xc_domain_decrease_reservation_exact(xch, ctx->domid, 1, 0, &pfn) )
+        PERROR("Failed to remove ring from guest physmap");
+
+    return 0;
+}
+
+static void teardown_paging_ring(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+
+    if ( !ctx->restore.postcopy.ring_page )
+        return;
+
+    if ( xc_mem_paging_disable(xch, ctx->domid) )
+        PERROR("Failed to disable paging");
+
+    if ( ctx->restore.postcopy.xce )
+    {
+        xenevtchn_unbind(ctx->restore.postcopy.xce,
+                         ctx->restore.postcopy.port);
+        xenevtchn_close(ctx->restore.postcopy.xce);
+        ctx->restore.postcopy.xce = NULL;
+    }
+
+    xenforeignmemory_unmap(xch->fmem, ctx->restore.postcopy.ring_page, 1);
+    ctx->restore.postcopy.ring_page = NULL;
+}
+
+/*
+ * All the pages which could not be evicted have arrived: load the guest
+ * state, and hand the guest over to the toolstack to be resumed.
+ */
+static int postcopy_resume_guest(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct restore_callbacks *callbacks = ctx->restore.callbacks;
+    int rc;
+
+    rc = ctx->restore.ops.stream_complete(ctx);
+    if ( rc )
+        return rc;
+    ctx->restore.postcopy.resumed = true;
+
+    DPRINTF("Resuming guest with %lu pages outstanding",
+            ctx->restore.postcopy.nr_outstanding);
+
+    if ( callbacks && callbacks->restore_results )
+        callbacks->restore_results(ctx->restore.xenstore_gfn,
+                                   ctx->restore.console_gfn,
+                                   callbacks->data);
+
+    if ( callbacks && callbacks->postcopy_transition )
+    {
+        rc = callbacks->postcopy_transition(callbacks->data);
+        if ( rc <= 0 )
+        {
+            ERROR("restore callback postcopy_transition() failed: %d", rc);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Evict the outstanding pages for the guest to fault them in on demand,
+ * counting the ones which cannot be (e.g. as something else holds a
+ * reference to them) as pinned.
+ */
+static int evict_outstanding(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned long *outstanding = ctx->restore.postcopy.outstanding;
+    xen_pfn_t pfn;
+
+    if ( posix_memalign(&ctx->restore.postcopy.buffer, PAGE_SIZE,
+                        PAGE_SIZE) )
+    {
+        ctx->restore.postcopy.buffer = NULL;
+        ERROR("Unable to allocate a post-copy buffer");
+        return -1;
+    }
+
+    if ( setup_paging_ring(ctx) )
+        return -1;
+
+    for ( pfn = 0; pfn < ctx->restore.p2m_size; ++pfn )
+    {
+        if ( !test_bit(pfn, outstanding) )
+            continue;
+
+        if ( !xc_mem_paging_nominate(xch, ctx->domid, pfn) &&
+             !xc_mem_paging_evict(xch, ctx->domid, pfn) )
+        {
+            set_bit(pfn, ctx->restore.postcopy.paged_out);
+            continue;
+        }
+
+        if ( errno != EBUSY )
+        {
+            PERROR("Failed to evict pfn %#"PRIpfn, pfn);
+            return -1;
+        }
+
+        ctx->restore.postcopy.nr_pinned++;
+    }
+
+    DPRINTF("%lu pages outstanding, %lu not evictable",
+            ctx->restore.postcopy.nr_outstanding,
+            ctx->restore.postcopy.nr_pinned);
+
+    return 0;
+}
+
+/*
+ * Evict the outstanding pages for the guest to fault them in on demand.  The
+ * pinned ones are asked for straight away, and the guest is only resumed
+ * once they have arrived.
+ */
+static int handle_postcopy_transition(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned long *outstanding = ctx->restore.postcopy.outstanding;
+    uint64_t *pinned = NULL;
+    unsigned nr_pinned = 0;
+    xen_pfn_t pfn;
+    int rc = -1;
+
+    if ( ctx->restore.postcopy.transition )
+    {
+        ERROR("Unexpected POSTCOPY_TRANSITION record");
+        goto err;
+    }
+    ctx->restore.postcopy.transition = true;
+
+    if ( !ctx->restore.postcopy.nr_outstanding )
+        return postcopy_resume_guest(ctx);
+
+    if ( ctx->restore.send_back_fd < 0 )
+    {
+        ERROR("Post-copy needs a back channel");
+        goto err;
+    }
+
+    if ( evict_outstanding(ctx) )
+        goto err;
+
+    if ( !ctx->restore.postcopy.nr_pinned )
+        return postcopy_resume_guest(ctx);
+
+    pinned = malloc(ctx->restore.postcopy.nr_pinned * sizeof(*pinned));
+    if ( !pinned )
+    {
+        ERROR("Unable to allocate memory for %lu pfns",
+              ctx->restore.postcopy.nr_pinned);
+        goto err;
+    }
+
+    for ( pfn = 0; pfn < ctx->restore.p2m_size; ++pfn )
+    {
+        if ( test_bit(pfn, outstanding) &&
+             !test_bit(pfn, ctx->restore.postcopy.paged_out) )
+        {
+            set_bit(pfn, ctx->restore.postcopy.requested);
+            pinned[nr_pinned++] = pfn;
+        }
+    }
+
+    rc = send_postcopy_fault(ctx, pinned, nr_pinned);
+
+ err:
+    free(pinned);
+    return rc;
+}
+
+static int lazy_load_pfn(struct xc_sr_context *ctx, xen_pfn_t pfn,
+                         bool *notify);
+
+/*
+ * Pull the requests off the paging ring.  Those for outstanding pages are
+ * kept until their page arrives (or, restoring lazily, have it read from the
+ * image), the others are answered straight away.
+ */
+static int handle_paging_requests(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    vm_event_back_ring_t *back_ring = &ctx->restore.postcopy.back_ring;
+    vm_event_request_t req, *pending;
+    xenevtchn_port_or_error_t port;
+    uint64_t faults[64], gfn;
+    unsigned nr_faults = 0;
+    bool notify = false;
+
+    port = xenevtchn_pending(ctx->restore.postcopy.xce);
+    if ( port < 0 )
+    {
+        PERROR("Failed to get pending paging event");
+        return -1;
+    }
+
+    if ( xenevtchn_unmask(ctx->restore.postcopy.xce, port) )
+    {
+        PERROR("Failed to unmask paging event channel");
+        return -1;
+    }
+
+    while ( RING_HAS_UNCONSUMED_REQUESTS(back_ring) )
+    {
+        memcpy(&req, RING_GET_REQUEST(back_ring, back_ring->req_cons),
+               sizeof(req));
+        back_ring->req_cons++;
+        back_ring->sring->req_event = back_ring->req_cons + 1;
+
+        gfn = req.u.mem_paging.gfn;
+        if ( gfn >= ctx->restore.p2m_size )
+        {
+            ERROR("Paging request for gfn %#"PRIx64" outside domain maximum",
+                  gfn);
+            return -1;
+        }
+
+        if ( req.u.mem_paging.flags & MEM_PAGING_DROP_PAGE )
+        {
+            /* Ballooned out: its contents are no use any more. */
+            if ( test_and_clear_bit(gfn, ctx->restore.postcopy.outstanding) )
+            {
+                clear_bit(gfn, ctx->restore.postcopy.paged_out);
+                clear_bit(gfn, ctx->restore.postcopy.requested);
+                ctx->restore.postcopy.nr_outstanding--;
+            }
+        }
+        else if ( ctx->restore.lazy.active &&
+                  test_bit(gfn, ctx->restore.postcopy.outstanding) )
+        {
+            if ( lazy_load_pfn(ctx, gfn, &notify) )
+                return -1;
+        }
+        else if ( test_bit(gfn, ctx->restore.postcopy.outstanding) )
+        {
+            if ( ctx->restore.postcopy.nr_pending ==
+                 ctx->restore.postcopy.max_pending )
+            {
+                unsigned max = ctx->restore.postcopy.max_pending * 2 ?: 64;
+
+                pending = realloc(ctx->restore.postcopy.pending,
+                                  max * sizeof(*pending));
+                if ( !pending )
+                {
+                    ERROR("Unable to allocate memory for paging requests");
+                    return -1;
+                }
+                ctx->restore.postcopy.pending = pending;
+                ctx->restore.postcopy.max_pending = max;
+            }
+            ctx->restore.postcopy.pending[
+                ctx->restore.postcopy.nr_pending++] = req;
+
+            if ( !test_and_set_bit(gfn, ctx->restore.postcopy.requested) )
+            {
+                faults[nr_faults++] = gfn;
+                if ( nr_faults == ARRAY_SIZE(faults) )
+                {
+                    if ( send_postcopy_fault(ctx, faults, nr_faults) )
+                        return -1;
+                    nr_faults = 0;
+                }
+            }
+            continue;
+        }
+
+        /* Already arrived. */
+        postcopy_put_response(ctx, &req);
+        notify = true;
+    }
+
+    if ( nr_faults && send_postcopy_fault(ctx, faults, nr_faults) )
+        return -1;
+
+    if ( notify &&
+         xenevtchn_notify(ctx->restore.postcopy.xce,
+                          ctx->restore.postcopy.port) )
+    {
+        PERROR("Failed to notify paging event channel");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Wait for the next record, serving the paging ring meanwhile.
+ */
+static int postcopy_wait_for_stream(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct pollfd pfds[] =
+    {
+        { .fd = ctx->fd, .events = POLLIN },
+        { .fd = xenevtchn_fd(ctx->restore.postcopy.xce), .events = POLLIN },
+    };
+
+    for ( ;; )
+    {
+        if ( poll(pfds, ARRAY_SIZE(pfds), -1) < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            PERROR("Failed to poll the stream and paging event channel");
+            return -1;
+        }
+
+        if ( (pfds[1].revents & POLLIN) && handle_paging_requests(ctx) )
+            return -1;
+
+        /* Errors and hangups are for read_record() to report. */
+        if ( pfds[0].revents )
+            return 0;
+    }
+}
+
+/*
+ * Load the data of an outstanding page, and answer the paging requests
+ * waiting for it, setting notify if there were any.
+ */
+static int load_outstanding_page(struct xc_sr_context *ctx, xen_pfn_t pfn,
+                                 uint32_t type, void *page_data,
+                                 bool *notify)
+{
+    xc_interface *xch = ctx->xch;
+    void *buffer = ctx->restore.postcopy.buffer;
+    unsigned i;
+    int rc;
+
+    /* Dropped by the guest since, or sent twice. */
+    if ( !test_bit(pfn, ctx->restore.postcopy.outstanding) )
+        return 0;
+
+    if ( test_bit(pfn, ctx->restore.postcopy.paged_out) )
+    {
+        memcpy(buffer, page_data, PAGE_SIZE);
+
+        rc = ctx->restore.ops.localise_page(ctx, type, buffer);
+        if ( rc )
+        {
+            ERROR("Failed to localise pfn %#"PRIpfn" (type %#"PRIx32")",
+                  pfn, type >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
+            return rc;
+        }
+
+        /* ENOENT: dropped by the guest, with its request still queued. */
+        if ( xc_mem_paging_load(xch, ctx->domid, pfn, buffer) &&
+             errno != ENOENT )
+        {
+            PERROR("Failed to load pfn %#"PRIpfn, pfn);
+            return -1;
+        }
+        clear_bit(pfn, ctx->restore.postcopy.paged_out);
+    }
+    else
+    {
+        /* Not evicted: the guest is still paused. */
+        rc = process_page_data(ctx, 1, &pfn, &type, page_data);
+        if ( rc )
+            return rc;
+        ctx->restore.postcopy.nr_pinned--;
+    }
+
+    clear_bit(pfn, ctx->restore.postcopy.outstanding);
+    clear_bit(pfn, ctx->restore.postcopy.requested);
+    ctx->restore.postcopy.nr_outstanding--;
+
+    for ( i = 0; i < ctx->restore.postcopy.nr_pending; )
+    {
+        vm_event_request_t *req = &ctx->restore.postcopy.pending[i];
+
+        if ( req->u.mem_paging.gfn != pfn )
+        {
+            ++i;
+            continue;
+        }
+
+        postcopy_put_response(ctx, req);
+        *notify = true;
+        *req = ctx->restore.postcopy.pending[
+            --ctx->restore.postcopy.nr_pending];
+    }
+
+    return 0;
+}
+
+/*
+ * Load the pages of a POSTCOPY_PAGE_DATA record, and answer the paging
+ * requests waiting for them.
+ */
+static int process_postcopy_page_data(struct xc_sr_context *ctx,
+                                      unsigned count, xen_pfn_t *pfns,
+                                      uint32_t *types, void *page_data)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned i;
+    bool notify = false;
+    int rc;
+
+    for ( i = 0; i < count; ++i )
+    {
+        /* No page data for those. */
+        if ( types[i] >= XEN_DOMCTL_PFINFO_BROKEN )
+            continue;
+
+        rc = load_outstanding_page(ctx, pfns[i], types[i], page_data,
+                                   &notify);
+        if ( rc )
+            return rc;
+
+        page_data += PAGE_SIZE;
+    }
+
+    if ( notify &&
+         xenevtchn_notify(ctx->restore.postcopy.xce,
+                          ctx->restore.postcopy.port) )
+    {
+        PERROR("Failed to notify paging event channel");
+        return -1;
+    }
+
+    if ( !ctx->restore.postcopy.resumed && !ctx->restore.postcopy.nr_pinned )
+        return postcopy_resume_guest(ctx);
+
+    return 0;
+}
+
+/*
+ * Lazy restore.  When asked to (restore_callbacks.lazy), and the image has
+ * a page index, the PAGE_INDEX_OFFSET record has us seek straight to the
+ * PAGE_INDEX records.  The pages they list with data are populated and
+ * marked outstanding, and the rest of the stream gets read as usual.  At
+ * the END record, the outstanding pages get evicted, and the guest resumed
+ * as at a post-copy transition.  Paging requests are then answered by
+ * reading the page from the image, and the other outstanding pages get
+ * read meanwhile, in order, LAZY_PREFETCH_PAGES at a time.
+ */
+#define LAZY_PREFETCH_PAGES 256
+
+static int read_image(struct xc_sr_context *ctx, void *buf, size_t size,
+                      uint64_t offset)
+{
+    xc_interface *xch = ctx->xch;
+    ssize_t len;
+
+    while ( size )
+    {
+        len = pread(ctx->fd, buf, size, offset);
+        if ( len < 0 && errno == EINTR )
+            continue;
+        if ( len <= 0 )
+        {
+            if ( !len )
+                errno = 0;
+            PERROR("Failed to read %zu bytes at offset %#"PRIx64
+                   " of the image", size, offset);
+            return -1;
+        }
+
+        buf += len;
+        size -= len;
+        offset += len;
+    }
+
+    return 0;
+}
+
+static int compare_runs(const void *l, const void *r)
+{
+    const struct xc_sr_rec_page_index_entry *lhs = l, *rhs = r;
+
+    return lhs->pfn < rhs->pfn ? -1 : lhs->pfn > rhs->pfn;
+}
+
+static struct xc_sr_rec_page_index_entry *find_run(struct xc_sr_context *ctx,
+                                                   xen_pfn_t pfn)
+{
+    struct xc_sr_rec_page_index_entry *runs = ctx->restore.lazy.runs;
+    unsigned long lo = 0, hi = ctx->restore.lazy.nr_runs, mid;
+
+    while ( lo < hi )
+    {
+        mid = lo + (hi - lo) / 2;
+
+        if ( pfn < runs[mid].pfn )
+            hi = mid;
+        else if ( pfn >= runs[mid].pfn + runs[mid].count )
+            lo = mid + 1;
+        else
+            return &runs[mid];
+    }
+
+    return NULL;
+}
+
+static int lazy_load_pfn(struct xc_sr_context *ctx, xen_pfn_t pfn,
+                         bool *notify)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_page_index_entry *run = find_run(ctx, pfn);
+
+    if ( !run )
+    {
+        ERROR("Outstanding pfn %#"PRIpfn" not in the page index", pfn);
+        return -1;
+    }
+
+    if ( read_image(ctx, ctx->restore.lazy.buffer, PAGE_SIZE,
+                    run->offset + (pfn - run->pfn) * PAGE_SIZE) )
+        return -1;
+
+    return load_outstanding_page(ctx, pfn, run->type,
+                                 ctx->restore.lazy.buffer, notify);
+}
+
+/*
+ * Read the next outstanding pages of the image in the background.
+ */
+static int lazy_prefetch(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_page_index_entry *run;
+    void *buffer = ctx->restore.lazy.buffer;
+    xen_pfn_t first;
+    unsigned i, nr;
+    bool notify = false;
+
+    while ( ctx->restore.lazy.next_run < ctx->restore.lazy.nr_runs )
+    {
+        run = &ctx->restore.lazy.runs[ctx->restore.lazy.next_run];
+        first = run->pfn + ctx->restore.lazy.next_page;
+        nr = min(run->count - ctx->restore.lazy.next_page,
+                 (uint32_t)LAZY_PREFETCH_PAGES);
+
+        ctx->restore.lazy.next_page += nr;
+        if ( ctx->restore.lazy.next_page == run->count )
+        {
+            ctx->restore.lazy.next_run++;
+            ctx->restore.lazy.next_page = 0;
+        }
+
+        for ( i = 0; i < nr; ++i )
+            if ( test_bit(first + i, ctx->restore.postcopy.outstanding) )
+                break;
+        if ( i == nr )
+            continue;
+
+        if ( read_image(ctx, buffer, nr * PAGE_SIZE,
+                        run->offset + (first - run->pfn) * PAGE_SIZE) )
+            return -1;
+
+        for ( i = 0; i < nr; ++i )
+            if ( load_outstanding_page(ctx, first + i, run->type,
+                                       buffer + i * PAGE_SIZE, &notify) )
+                return -1;
+
+        if ( notify &&
+             xenevtchn_notify(ctx->restore.postcopy.xce,
+                              ctx->restore.postcopy.port) )
+        {
+            PERROR("Failed to notify paging event channel");
+            return -1;
+        }
+
+        return 0;
+    }
+
+    ERROR("%lu pages outstanding, with none left to read",
+          ctx->restore.postcopy.nr_outstanding);
+    return -1;
+}
+
+/*
+ * A PAGE_INDEX_OFFSET record.  Skip the page data, if restoring lazily.
+ * Anything which stops us from doing so just means an ordinary restore.
+ */
+static int handle_page_index_offset(struct xc_sr_context *ctx,
+                                    struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_page_index_offset *index_offset = rec->data;
+    off_t pos;
+
+    if ( !ctx->restore.callbacks || !ctx->restore.callbacks->lazy ||
+         ctx->restore.lazy.active )
+        return 0;
+
+    if ( rec->length != sizeof(*index_offset) )
+    {
+        ERROR("PAGE_INDEX_OFFSET record wrong size: length %u, expected %zu",
+              rec->length, sizeof(*index_offset));
+        return -1;
+    }
+
+    if ( !ctx->dominfo.hvm || ctx->restore.checkpointed != XC_MIG_STREAM_NONE ||
+         ctx->restore.nr_data_fds || !index_offset->offset )
+    {
+        DPRINTF("Not restoring lazily");
+        return 0;
+    }
+
+    pos = lseek(ctx->fd, 0, SEEK_CUR);
+    if ( pos < 0 )
+    {
+        DPRINTF("Stream not seekable, not restoring lazily");
+        return 0;
+    }
+
+    if ( index_offset->offset < pos )
+    {
+        ERROR("Page index at offset %#"PRIx64", before offset %#"PRIx64,
+              index_offset->offset, (uint64_t)pos);
+        return -1;
+    }
+
+    if ( alloc_outstanding(ctx) )
+        return -1;
+
+    if ( posix_memalign(&ctx->restore.lazy.buffer, PAGE_SIZE,
+                        LAZY_PREFETCH_PAGES * PAGE_SIZE) )
+    {
+        ctx->restore.lazy.buffer = NULL;
+        ERROR("Unable to allocate a lazy restore buffer");
+        return -1;
+    }
+
+    if ( lseek(ctx->fd, index_offset->offset, SEEK_SET) < 0 )
+    {
+        PERROR("Failed to seek to the page index");
+        return -1;
+    }
+
+    DPRINTF("Restoring lazily, page index at offset %#"PRIx64,
+            index_offset->offset);
+    ctx->restore.lazy.active = true;
+
+    return 0;
+}
+
+/*
+ * A PAGE_INDEX record.  Pages without data are dealt with straight away,
+ * the others marked outstanding.  Ignored unless restoring lazily, as the
+ * page data has been read already.
+ */
+static int handle_page_index(struct xc_sr_context *ctx,
+                             struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_page_index_entry *entry = rec->data, *runs;
+    unsigned i, j, k, nr, count = rec->length / sizeof(*entry);
+    xen_pfn_t pfns[MAX_BATCH_SIZE];
+    uint32_t types[MAX_BATCH_SIZE];
+    int rc;
+
+    if ( !ctx->restore.lazy.active )
+        return 0;
+
+    if ( rec->length % sizeof(*entry) )
+    {
+        ERROR("Invalid PAGE_INDEX record length %u", rec->length);
+        return -1;
+    }
+
+    for ( i = 0; i < count; ++i, ++entry )
+    {
+        bool has_data = page_type_has_data(entry->type) && entry->offset;
+
+        if ( !entry->count || entry->pfn >= ctx->restore.p2m_size ||
+             entry->count > ctx->restore.p2m_size - entry->pfn )
+        {
+            ERROR("Page index entry %#"PRIx64"+%u outside domain maximum",
+                  entry->pfn, entry->count);
+            return -1;
+        }
+
+        if ( ((entry->type >> XEN_DOMCTL_PFINFO_LTAB_SHIFT) >= 5) &&
+             ((entry->type >> XEN_DOMCTL_PFINFO_LTAB_SHIFT) <= 8) )
+        {
+            ERROR("Invalid type %#"PRIx32" for pfn %#"PRIx64" in page index",
+                  entry->type, entry->pfn);
+            return -1;
+        }
+
+        for ( j = 0; j < entry->count; j += nr )
+        {
+            nr = min(entry->count - j, (uint32_t)MAX_BATCH_SIZE);
+
+            for ( k = 0; k < nr; ++k )
+            {
+                pfns[k] = entry->pfn + j + k;
+                types[k] = entry->type;
+
+                if ( !ctx->restore.ops.pfn_is_valid(ctx, pfns[k]) )
+                {
+                    ERROR("pfn %#"PRIpfn" in page index outside domain "
+                          "maximum", pfns[k]);
+                    return -1;
+                }
+
+                if ( has_data &&
+                     test_and_set_bit(pfns[k],
+                                      ctx->restore.postcopy.outstanding) )
+                {
+                    ERROR("pfn %#"PRIpfn" twice in page index", pfns[k]);
+                    return -1;
+                }
+            }
+
+            /* Zero pages, or pages without data, are done with here. */
+            rc = has_data ? populate_pfns(ctx, nr, pfns, types)
+                          : process_page_data(ctx, nr, pfns, types, NULL);
+            if ( rc )
+                return rc;
+        }
+
+        if ( !has_data )
+            continue;
+
+        ctx->restore.postcopy.nr_outstanding += entry->count;
+
+        if ( ctx->restore.lazy.nr_runs == ctx->restore.lazy.max_runs )
+        {
+            unsigned long max = ctx->restore.lazy.max_runs * 2 ?: 1024;
+
+            runs = realloc(ctx->restore.lazy.runs, max * sizeof(*runs));
+            if ( !runs )
+            {
+                ERROR("Unable to allocate memory for the page index");
+                return -1;
+            }
+            ctx->restore.lazy.runs = runs;
+            ctx->restore.lazy.max_runs = max;
+        }
+        ctx->restore.lazy.runs[ctx->restore.lazy.nr_runs++] = *entry;
+    }
+
+    return 0;
+}
+
+/*
+ * At the END record: evict the outstanding pages and resume the guest, then
+ * read the pages in from the image until there are none left.
+ */
+static int restore_lazily(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct pollfd pfd;
+    xen_pfn_t pfn;
+    bool notify = false;
+    int rc;
+
+    if ( !ctx->restore.postcopy.nr_outstanding )
+        return 0;
+
+    qsort(ctx->restore.lazy.runs, ctx->restore.lazy.nr_runs,
+          sizeof(*ctx->restore.lazy.runs), compare_runs);
+
+    if ( evict_outstanding(ctx) )
+        return -1;
+
+    /* The guest is still paused, so these are read right away. */
+    for ( pfn = 0; ctx->restore.postcopy.nr_pinned &&
+                   pfn < ctx->restore.p2m_size; ++pfn )
+        if ( test_bit(pfn, ctx->restore.postcopy.outstanding) &&
+             !test_bit(pfn, ctx->restore.postcopy.paged_out) &&
+             lazy_load_pfn(ctx, pfn, &notify) )
+            return -1;
+
+    rc = postcopy_resume_guest(ctx);
+    if ( rc )
+        return rc;
+
+    pfd.fd = xenevtchn_fd(ctx->restore.postcopy.xce);
+    pfd.events = POLLIN;
+
+    while ( ctx->restore.postcopy.nr_outstanding )
+    {
+        rc = poll(&pfd, 1, 0);
+        if ( rc < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            PERROR("Failed to poll the paging event channel");
+            return -1;
+        }
+
+        rc = rc && (pfd.revents & POLLIN) ? handle_paging_requests(ctx)
+                                          : lazy_prefetch(ctx);
+        if ( rc )
+            return rc;
+    }
+
+    DPRINTF("All memory restored from the image");
+
+    return 0;
+}
+
+/*
+ * Data streams.  The save side may spread page data over several streams
+ * (connections) besides the main one.  Each of them gets a thread, reading
+ * and processing its page data while the main thread gets on with the other
+ * records.
+ *
+ * DATA_SYNC records keep the streams in step: on the n'th one in the main
+ * stream, the main thread waits for each data stream to have been processed
+ * up to its n'th one, and lets the data streams go on to their next one.
+ * The save side arranges for page data between two syncs not to depend on
+ * the other records in between.
  */
-static int process_page_data(struct xc_sr_context *ctx, unsigned count,
-                             xen_pfn_t *pfns, uint32_t *types, void *page_data)
+struct xc_sr_restore_stream
+{
+    struct xc_sr_restore_streams *set;
+    pthread_t thread;
+    unsigned index;
+    int fd;
+
+    /* DATA_SYNC records reached, and whether END has been. */
+    unsigned synced;
+    bool done;
+};
+
+struct xc_sr_restore_streams
+{
+    struct xc_sr_context *ctx;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* DATA_SYNC records reached by the main thread. */
+    unsigned released;
+    bool exit;
+    /* First failure of a data stream. */
+    int rc;
+
+    unsigned nr_streams, nr_threads;
+    struct xc_sr_restore_stream streams[];
+};
+
+/*
+ * Process page data from a data stream.  Populating updates state shared
+ * by all streams, as does all of PV page processing (localising pagetables
+ * looks at and populates other pfns), so they get serialised.
+ */
+static int process_stream_page_data(struct xc_sr_context *ctx,
+                                    unsigned count, xen_pfn_t *pfns,
+                                    uint32_t *types, void *page_data)
 {
     xc_interface *xch = ctx->xch;
-    xen_pfn_t *mfns = malloc(count * sizeof(*mfns));
-    int *map_errs = malloc(count * sizeof(*map_errs));
+    struct xc_sr_restore_streams *set = ctx->restore.streams;
+    void **pages;
+    unsigned i;
     int rc;
-    void *mapping = NULL, *guest_page = NULL;
-    unsigned i,    /* i indexes the pfns from the record. */
-        j,         /* j indexes the subset of pfns we decide to map. */
-        nr_pages = 0;
 
-    if ( !mfns || !map_errs )
+    pthread_mutex_lock(&set->lock);
+    if ( !ctx->dominfo.hvm )
     {
-        rc = -1;
-        ERROR("Failed to allocate %zu bytes to process page data",
-              count * (sizeof(*mfns) + sizeof(*map_errs)));
-        goto err;
+        rc = process_page_data(ctx, count, pfns, types, page_data);
+        pthread_mutex_unlock(&set->lock);
+        return rc;
     }
 
     rc = populate_pfns(ctx, count, pfns, types);
+    pthread_mutex_unlock(&set->lock);
     if ( rc )
     {
         ERROR("Failed to populate pfns for batch of %u pages", count);
-        goto err;
+        return rc;
+    }
+
+    pages = malloc(count * sizeof(*pages));
+    if ( !pages )
+    {
+        ERROR("Unable to allocate memory for %u pages", count);
+        return -1;
     }
 
     for ( i = 0; i < count; ++i )
     {
-        ctx->restore.ops.set_page_type(ctx, pfns[i], types[i]);
+        pages[i] = page_data && page_type_has_data(types[i]) ? page_data
+                                                             : NULL;
+        if ( pages[i] )
+            page_data += PAGE_SIZE;
+    }
 
-        switch ( types[i] )
-        {
-        case XEN_DOMCTL_PFINFO_NOTAB:
+    rc = write_page_data(ctx, count, pfns, types, pages,
+                         ctx->restore.verify);
+    free(pages);
 
-        case XEN_DOMCTL_PFINFO_L1TAB:
-        case XEN_DOMCTL_PFINFO_L1TAB | XEN_DOMCTL_PFINFO_LPINTAB:
+    return rc;
+}
 
-        case XEN_DOMCTL_PFINFO_L2TAB:
-        case XEN_DOMCTL_PFINFO_L2TAB | XEN_DOMCTL_PFINFO_LPINTAB:
+static int handle_page_data(struct xc_sr_context *ctx,
+                            struct xc_sr_record *rec);
 
-        case XEN_DOMCTL_PFINFO_L3TAB:
-        case XEN_DOMCTL_PFINFO_L3TAB | XEN_DOMCTL_PFINFO_LPINTAB:
+static int check_data_streams_record(struct xc_sr_context *ctx,
+                                     struct xc_sr_record *rec,
+                                     unsigned index)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_data_streams *streams = rec->data;
 
-        case XEN_DOMCTL_PFINFO_L4TAB:
-        case XEN_DOMCTL_PFINFO_L4TAB | XEN_DOMCTL_PFINFO_LPINTAB:
+    if ( rec->type != REC_TYPE_DATA_STREAMS )
+    {
+        ERROR("Expected DATA_STREAMS record, got %#x (%s)",
+              rec->type, rec_type_to_str(rec->type));
+        return -1;
+    }
 
-            mfns[nr_pages++] = ctx->restore.ops.pfn_to_gfn(ctx, pfns[i]);
+    if ( rec->length != sizeof(*streams) )
+    {
+        ERROR("DATA_STREAMS record wrong size: length %u, expected %zu",
+              rec->length, sizeof(*streams));
+        return -1;
+    }
+
+    if ( streams->count != ctx->restore.nr_data_fds ||
+         streams->index != index )
+    {
+        ERROR("Stream %u of %u found where stream %u of %u expected",
+              streams->index, streams->count,
+              index, ctx->restore.nr_data_fds);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *restore_stream(void *arg)
+{
+    struct xc_sr_restore_stream *stream = arg;
+    struct xc_sr_restore_streams *set = stream->set;
+    struct xc_sr_context *ctx = set->ctx;
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec = { 0 };
+    int rc;
+
+    rc = read_record(ctx, stream->fd, &rec);
+    if ( !rc )
+        rc = check_data_streams_record(ctx, &rec, stream->index);
+    free(rec.data);
+
+    while ( !rc )
+    {
+        rc = read_record(ctx, stream->fd, &rec);
+        if ( rc )
+            break;
+
+        switch ( rec.type )
+        {
+        case REC_TYPE_PAGE_DATA:
+        case REC_TYPE_ZERO_PAGE_DATA:
+            if ( !stream->synced )
+            {
+                ERROR("Page data ahead of the first DATA_SYNC in stream %u",
+                      stream->index);
+                rc = -1;
+                break;
+            }
+            rc = handle_page_data(ctx, &rec);
+            break;
+
+        case REC_TYPE_DATA_SYNC:
+            pthread_mutex_lock(&set->lock);
+            stream->synced++;
+            pthread_cond_broadcast(&set->cond);
+            while ( set->released < stream->synced && !set->exit &&
+                    !set->rc )
+                pthread_cond_wait(&set->cond, &set->lock);
+            if ( set->exit || set->rc )
+                rc = -1;
+            pthread_mutex_unlock(&set->lock);
+            break;
+
+        case REC_TYPE_END:
+            break;
+
+        default:
+            ERROR("Record %#x (%s) found in data stream %u", rec.type,
+                  rec_type_to_str(rec.type), stream->index);
+            rc = -1;
             break;
         }
+
+        free(rec.data);
+        rec.data = NULL;
+
+        if ( rec.type == REC_TYPE_END )
+            break;
     }
 
-    /* Nothing to do? */
-    if ( nr_pages == 0 )
-        goto done;
+    pthread_mutex_lock(&set->lock);
+    if ( rc && !set->rc )
+        set->rc = rc;
+    stream->done = true;
+    pthread_cond_broadcast(&set->cond);
+    pthread_mutex_unlock(&set->lock);
 
-    mapping = guest_page = xenforeignmemory_map(xch->fmem,
-        ctx->domid, PROT_READ | PROT_WRITE,
-        nr_pages, mfns, map_errs);
-    if ( !mapping )
+    return NULL;
+}
+
+/*
+ * A DATA_STREAMS record in the main stream: check it matches the data
+ * streams we got, and start reading them.
+ */
+static int handle_data_streams(struct xc_sr_context *ctx,
+                               struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_streams *set;
+    unsigned i;
+
+    if ( ctx->restore.streams )
     {
-        rc = -1;
-        PERROR("Unable to map %u mfns for %u pages of data",
-               nr_pages, count);
-        goto err;
+        ERROR("Duplicate DATA_STREAMS record");
+        return -1;
     }
 
-    for ( i = 0, j = 0; i < count; ++i )
+    if ( check_data_streams_record(ctx, rec, 0) )
+        return -1;
+
+    set = calloc(1, sizeof(*set) +
+                 ctx->restore.nr_data_fds * sizeof(*set->streams));
+    if ( !set )
     {
-        switch ( types[i] )
+        ERROR("Unable to allocate memory for %u data streams",
+              ctx->restore.nr_data_fds);
+        return -1;
+    }
+
+    set->ctx = ctx;
+    set->nr_streams = ctx->restore.nr_data_fds;
+    pthread_mutex_init(&set->lock, NULL);
+    pthread_cond_init(&set->cond, NULL);
+    ctx->restore.streams = set;
+
+    for ( i = 0; i < set->nr_streams; ++i )
+    {
+        set->streams[i].set = set;
+        set->streams[i].index = i + 1;
+        set->streams[i].fd = ctx->restore.data_fds[i];
+        if ( pthread_create(&set->streams[i].thread, NULL, restore_stream,
+                            &set->streams[i]) )
         {
-        case XEN_DOMCTL_PFINFO_XTAB:
-        case XEN_DOMCTL_PFINFO_BROKEN:
-        case XEN_DOMCTL_PFINFO_XALLOC:
-            /* No page data to deal with. */
-            continue;
+            PERROR("Unable to start reading data stream %u", i + 1);
+            return -1;
         }
+        set->nr_threads++;
+    }
 
-        if ( map_errs[j] )
+    DPRINTF("Reading page data from %u data streams", set->nr_streams);
+
+    return 0;
+}
+
+/*
+ * A DATA_SYNC record in the main stream: wait for each data stream to be
+ * processed up to its matching one, and let them carry on.  At the END,
+ * wait for them to be processed completely instead.
+ */
+static int sync_data_streams(struct xc_sr_context *ctx, bool end)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_streams *set = ctx->restore.streams;
+    struct xc_sr_restore_stream *stream;
+    unsigned i, n;
+    int rc = 0;
+
+    if ( !set )
+    {
+        ERROR("%s without data streams", end ? "END" : "DATA_SYNC");
+        return -1;
+    }
+
+    n = end ? 0 : set->released + 1;
+
+    pthread_mutex_lock(&set->lock);
+    for ( i = 0; !set->rc && i < set->nr_streams; )
+    {
+        stream = &set->streams[i];
+
+        if ( stream->done && n && stream->synced < n )
         {
+            ERROR("Data stream %u ended at DATA_SYNC %u of %u",
+                  stream->index, stream->synced, n);
             rc = -1;
-            ERROR("Mapping pfn %#"PRIpfn" (mfn %#"PRIpfn", type %#"PRIx32") failed with %d",
-                  pfns[i], mfns[j], types[i], map_errs[j]);
-            goto err;
+            break;
         }
 
-        /* Undo page normalisation done by the saver. */
-        rc = ctx->restore.ops.localise_page(ctx, types[i], page_data);
-        if ( rc )
+        if ( n ? stream->synced >= n : stream->done )
         {
-            ERROR("Failed to localise pfn %#"PRIpfn" (type %#"PRIx32")",
-                  pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
-            goto err;
+            ++i;
+            continue;
         }
 
-        if ( ctx->restore.verify )
-        {
-            /* Verify mode - compare incoming data to what we already have. */
-            if ( memcmp(guest_page, page_data, PAGE_SIZE) )
-                ERROR("verify pfn %#"PRIpfn" failed (type %#"PRIx32")",
-                      pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
-        }
-        else
-        {
-            /* Regular mode - copy incoming data into place. */
-            memcpy(guest_page, page_data, PAGE_SIZE);
-        }
+        pthread_cond_wait(&set->cond, &set->lock);
+    }
 
-        ++j;
-        guest_page += PAGE_SIZE;
-        page_data += PAGE_SIZE;
+    if ( !rc )
+        rc = set->rc;
+    if ( !rc && n )
+    {
+        set->released = n;
+        pthread_cond_broadcast(&set->cond);
     }
+    pthread_mutex_unlock(&set->lock);
 
- done:
-    rc = 0;
+    if ( rc )
+        ERROR("Failed to process the data streams");
 
- err:
-    if ( mapping )
-        xenforeignmemory_unmap(xch->fmem, mapping, nr_pages);
+    return rc;
+}
 
-    free(map_errs);
-    free(mfns);
+static void teardown_data_streams(struct xc_sr_context *ctx)
+{
+    struct xc_sr_restore_streams *set = ctx->restore.streams;
+    unsigned i;
 
-    return rc;
+    if ( !set )
+        return;
+
+    pthread_mutex_lock(&set->lock);
+    set->exit = true;
+    pthread_cond_broadcast(&set->cond);
+    pthread_mutex_unlock(&set->lock);
+
+    /* Get any thread still waiting for a record out of read(). */
+    for ( i = 0; i < set->nr_threads; ++i )
+        if ( !set->streams[i].done )
+            shutdown(set->streams[i].fd, SHUT_RD);
+
+    for ( i = 0; i < set->nr_threads; ++i )
+        pthread_join(set->streams[i].thread, NULL);
+
+    pthread_cond_destroy(&set->cond);
+    pthread_mutex_destroy(&set->lock);
+    free(set);
+    ctx->restore.streams = NULL;
 }
 
 /*
- * Validate a PAGE_DATA record from the stream, and pass the results to
- * process_page_data() to actually perform the legwork.
+ * Validate a PAGE_DATA, ZERO_PAGE_DATA or POSTCOPY_PAGE_DATA record from the
+ * stream, and pass the results to process_page_data() (or
+ * process_postcopy_page_data()) to actually perform the legwork.
  */
 static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
 {
     xc_interface *xch = ctx->xch;
     struct xc_sr_rec_page_data_header *pages = rec->data;
+    bool zero = rec->type == REC_TYPE_ZERO_PAGE_DATA;
+    bool postcopy = rec->type == REC_TYPE_POSTCOPY_PAGE_DATA;
     unsigned i, pages_of_data = 0;
     int rc = -1;
 
     xen_pfn_t *pfns = NULL, pfn;
     uint32_t *types = NULL, type;
 
+    if ( postcopy != ctx->restore.postcopy.transition )
+    {
+        ERROR("%s record %s the post-copy transition",
+              rec_type_to_str(rec->type), postcopy ? "before" : "after");
+        goto err;
+    }
+
+    if ( ctx->restore.lazy.active )
+    {
+        ERROR("%s record after the page index", rec_type_to_str(rec->type));
+        goto err;
+    }
+
     if ( rec->length < sizeof(*pages) )
     {
         ERROR("PAGE_DATA record truncated: length %u, min %zu",
@@ -387,11 +2147,21 @@ static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
             /* NOTAB and all L1 through L4 tables (including pinned) should
              * have a page worth of data in the record. */
             pages_of_data++;
+        else if ( zero )
+        {
+            ERROR("Type %#"PRIx32" without data for zero pfn %#"PRIpfn
+                  " (index %u)", type, pfn, i);
+            goto err;
+        }
 
         pfns[i] = pfn;
         types[i] = type;
     }
 
+    /* Zero pages are all that ZERO_PAGE_DATA records describe. */
+    if ( zero )
+        pages_of_data = 0;
+
     if ( rec->length != (sizeof(*pages) +
                          (sizeof(uint64_t) * pages->count) +
                          (PAGE_SIZE * pages_of_data)) )
@@ -402,8 +2172,18 @@ static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         goto err;
     }
 
-    rc = process_page_data(ctx, pages->count, pfns, types,
-                           &pages->pfn[pages->count]);
+    if ( postcopy )
+        rc = process_postcopy_page_data(ctx, pages->count, pfns, types,
+                                        &pages->pfn[pages->count]);
+    else if ( ctx->restore.streams )
+        rc = process_stream_page_data(ctx, pages->count, pfns, types,
+                                      zero ? NULL : &pages->pfn[pages->count]);
+    else if ( ctx->restore.pipeline )
+        rc = queue_page_data(ctx, rec, pages->count, pfns, types,
+                             zero ? NULL : &pages->pfn[pages->count]);
+    else
+        rc = process_page_data(ctx, pages->count, pfns, types,
+                               zero ? NULL : &pages->pfn[pages->count]);
  err:
     free(types);
     free(pfns);
@@ -543,6 +2323,10 @@ static int handle_checkpoint(struct xc_sr_context *ctx)
                 goto err;
         }
         ctx->restore.buffered_rec_num = 0;
+
+        rc = drain_page_data(ctx);
+        if ( rc )
+            goto err;
         IPRINTF("All records processed");
     }
     else
@@ -631,15 +2415,64 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
     xc_interface *xch = ctx->xch;
     int rc = 0;
 
+    /*
+     * Anything but more page data may depend on the guest's memory being
+     * up to date, so wait for the workers to catch up.
+     */
+    if ( rec->type != REC_TYPE_PAGE_DATA &&
+         rec->type != REC_TYPE_ZERO_PAGE_DATA )
+    {
+        rc = drain_page_data(ctx);
+        if ( rc )
+            goto out;
+    }
+
     switch ( rec->type )
     {
     case REC_TYPE_END:
+        if ( ctx->restore.lazy.active )
+            rc = restore_lazily(ctx);
+        else if ( ctx->restore.postcopy.transition &&
+             ctx->restore.postcopy.nr_outstanding )
+        {
+            ERROR("%lu post-copy pages missing at the end of the stream",
+                  ctx->restore.postcopy.nr_outstanding);
+            rc = -1;
+        }
+        else if ( ctx->restore.nr_data_fds )
+            rc = sync_data_streams(ctx, true);
         break;
 
     case REC_TYPE_PAGE_DATA:
+    case REC_TYPE_ZERO_PAGE_DATA:
+    case REC_TYPE_POSTCOPY_PAGE_DATA:
         rc = handle_page_data(ctx, rec);
         break;
 
+    case REC_TYPE_POSTCOPY_PFNS:
+        rc = handle_postcopy_pfns(ctx, rec);
+        break;
+
+    case REC_TYPE_POSTCOPY_TRANSITION:
+        rc = handle_postcopy_transition(ctx);
+        break;
+
+    case REC_TYPE_DATA_STREAMS:
+        rc = handle_data_streams(ctx, rec);
+        break;
+
+    case REC_TYPE_DATA_SYNC:
+        rc = sync_data_streams(ctx, false);
+        break;
+
+    case REC_TYPE_PAGE_INDEX_OFFSET:
+        rc = handle_page_index_offset(ctx, rec);
+        break;
+
+    case REC_TYPE_PAGE_INDEX:
+        rc = handle_page_index(ctx, rec);
+        break;
+
     case REC_TYPE_VERIFY:
         DPRINTF("Verify mode enabled");
         ctx->restore.verify = true;
@@ -654,6 +2487,7 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         break;
     }
 
+ out:
     free(rec->data);
     rec->data = NULL;
 
@@ -704,6 +2538,8 @@ static int setup(struct xc_sr_context *ctx)
     }
     ctx->restore.allocated_rec_num = DEFAULT_BUF_RECORDS;
 
+    setup_pipeline(ctx);
+
  err:
     return rc;
 }
@@ -715,6 +2551,9 @@ static void cleanup(struct xc_sr_context *ctx)
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->restore.dirty_bitmap_hbuf);
 
+    teardown_pipeline(ctx);
+    teardown_data_streams(ctx);
+
     for ( i = 0; i < ctx->restore.buffered_rec_num; i++ )
         free(ctx->restore.buffered_records[i].data);
 
@@ -723,6 +2562,15 @@ static void cleanup(struct xc_sr_context *ctx)
                                    NRPAGES(bitmap_size(ctx->restore.p2m_size)));
     free(ctx->restore.buffered_records);
     free(ctx->restore.populated_pfns);
+
+    teardown_paging_ring(ctx);
+    free(ctx->restore.postcopy.buffer);
+    free(ctx->restore.postcopy.pending);
+    free(ctx->restore.postcopy.requested);
+    free(ctx->restore.postcopy.paged_out);
+    free(ctx->restore.postcopy.outstanding);
+    free(ctx->restore.lazy.buffer);
+    free(ctx->restore.lazy.runs);
     if ( ctx->restore.ops.cleanup(ctx) )
         PERROR("Failed to clean up");
 }
@@ -744,6 +2592,13 @@ static int restore(struct xc_sr_context *ctx)
 
     do
     {
+        if ( ctx->restore.postcopy.xce )
+        {
+            rc = postcopy_wait_for_stream(ctx);
+            if ( rc )
+                goto err;
+        }
+
         rc = read_record(ctx, ctx->fd, &rec);
         if ( rc )
         {
@@ -786,6 +2641,10 @@ static int restore(struct xc_sr_context *ctx)
     } while ( rec.type != REC_TYPE_END );
 
  remus_failover:
+    /* Page data from the last checkpoint (or the whole stream). */
+    rc = drain_page_data(ctx);
+    if ( rc )
+        goto err;
 
     if ( ctx->restore.checkpointed == XC_MIG_STREAM_COLO )
     {
@@ -795,6 +2654,13 @@ static int restore(struct xc_sr_context *ctx)
         goto done;
     }
 
+    /* Post-copy resumed the guest before its memory arrived. */
+    if ( ctx->restore.postcopy.resumed )
+    {
+        IPRINTF("Restore successful");
+        goto done;
+    }
+
     /*
      * With Remus, if we reach here, there must be some error on primary,
      * failover from the last checkpoint state.
@@ -830,6 +2696,24 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       unsigned int hvm, unsigned int pae,
                       xc_migration_stream_t stream_type,
                       struct restore_callbacks *callbacks, int send_back_fd)
+{
+    return xc_domain_restore_streams(xch, io_fd, NULL, 0, dom, store_evtchn,
+                                     store_mfn, store_domid, console_evtchn,
+                                     console_gfn, console_domid, hvm, pae,
+                                     stream_type, callbacks, send_back_fd);
+}
+
+int xc_domain_restore_streams(xc_interface *xch, int io_fd,
+                              const int *data_fds, unsigned int nr_data_fds,
+                              uint32_t dom, unsigned int store_evtchn,
+                              unsigned long *store_mfn, uint32_t store_domid,
+                              unsigned int console_evtchn,
+                              unsigned long *console_gfn,
+                              uint32_t console_domid,
+                              unsigned int hvm, unsigned int pae,
+                              xc_migration_stream_t stream_type,
+                              struct restore_callbacks *callbacks,
+                              int send_back_fd)
 {
     xen_pfn_t nr_pfns;
     struct xc_sr_context ctx =
@@ -837,6 +2721,9 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
             .xch = xch,
             .fd = io_fd,
         };
+    unsigned int i;
+    int type;
+    socklen_t len = sizeof(type);
 
     /* GCC 4.4 (of CentOS 6.x vintage) can' t initialise anonymous unions. */
     ctx.restore.console_evtchn = console_evtchn;
@@ -846,6 +2733,8 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.restore.checkpointed = stream_type;
     ctx.restore.callbacks = callbacks;
     ctx.restore.send_back_fd = send_back_fd;
+    ctx.restore.data_fds = data_fds;
+    ctx.restore.nr_data_fds = nr_data_fds;
 
     /* Sanity checks for callbacks. */
     if ( stream_type )
@@ -863,6 +2752,22 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     DPRINTF("fd %d, dom %u, hvm %u, pae %u, stream_type %d",
             io_fd, dom, hvm, pae, stream_type);
 
+    if ( nr_data_fds && stream_type != XC_MIG_STREAM_NONE )
+    {
+        ERROR("Data streams can't be used with checkpoints");
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Only sockets can be shut down, should the restore fail. */
+    for ( i = 0; i < nr_data_fds; ++i )
+        if ( getsockopt(data_fds[i], SOL_SOCKET, SO_TYPE, &type, &len) )
+        {
+            PERROR("Data stream %u (fd %d) is not a socket", i + 1,
+                   data_fds[i]);
+            return -1;
+        }
+
     if ( xc_domain_getinfo(xch, dom, 1, &ctx.dominfo) != 1 )
     {
         PERROR("Failed to get domain info");
@@ -1,5 +1,13 @@
 #include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
 
 #include "xc_sr_common.h"
 
@@ -47,11 +55,62 @@ static int write_headers(struct xc_sr_context *ctx, uint16_t guest_type)
 }
 
 /*
- * Writes an END record into the stream.
+ * Writes a DATA_STREAMS record into the stream and each data stream.
+ */
+static int write_data_streams_records(struct xc_sr_context *ctx)
+{
+    struct xc_sr_rec_data_streams streams =
+        {
+            .count = ctx->save.nr_data_fds,
+        };
+    struct xc_sr_record rec =
+        {
+            .type = REC_TYPE_DATA_STREAMS,
+            .length = sizeof(streams),
+            .data = &streams,
+        };
+    unsigned i;
+    int rc = write_record(ctx, &rec);
+
+    for ( i = 0; !rc && i < ctx->save.nr_data_fds; ++i )
+    {
+        streams.index = i + 1;
+        rc = write_split_record_fd(ctx, ctx->save.data_fds[i], &rec, NULL, 0);
+    }
+
+    return rc;
+}
+
+/*
+ * Writes a DATA_SYNC record into each data stream and then the stream,
+ * allowing the restore side to process the page data between this and the
+ * next one while reading the stream on.
+ */
+static int write_data_sync_records(struct xc_sr_context *ctx)
+{
+    struct xc_sr_record sync = { REC_TYPE_DATA_SYNC, 0, NULL };
+    unsigned i;
+
+    for ( i = 0; i < ctx->save.nr_data_fds; ++i )
+        if ( write_split_record_fd(ctx, ctx->save.data_fds[i], &sync,
+                                   NULL, 0) )
+            return -1;
+
+    return write_record(ctx, &sync);
+}
+
+/*
+ * Writes an END record into the stream, and each data stream.
  */
 static int write_end_record(struct xc_sr_context *ctx)
 {
     struct xc_sr_record end = { REC_TYPE_END, 0, NULL };
+    unsigned i;
+
+    for ( i = 0; i < ctx->save.nr_data_fds; ++i )
+        if ( write_split_record_fd(ctx, ctx->save.data_fds[i], &end,
+                                   NULL, 0) )
+            return -1;
 
     return write_record(ctx, &end);
 }
@@ -67,50 +126,110 @@ static int write_checkpoint_record(struct xc_sr_context *ctx)
 }
 
 /*
- * Writes a batch of memory as a PAGE_DATA record into the stream.  The batch
- * is constructed in ctx->save.batch_pfns.
+ * A batch of pfns on its way into the stream as a PAGE_DATA record.
+ */
+struct xc_sr_save_batch
+{
+    xen_pfn_t *pfns;
+    unsigned nr_pfns;
+
+    /* Set up by prepare_batch(), freed by release_batch(). */
+    xen_pfn_t *mfns, *types;
+    int *errors;
+    void *guest_mapping;
+    unsigned nr_pages_mapped;
+    void **guest_data;
+    void **local_pages;
+    uint64_t *rec_pfns;
+    struct iovec *iov;
+    int iovcnt;
+    struct xc_sr_rec_page_data_header hdr, zero_hdr;
+    struct xc_sr_record rec, zero_rec;
+
+    /* Pfns to retry later, added to deferred_pages by send_batch(). */
+    xen_pfn_t *deferred;
+    unsigned nr_deferred;
+
+    /* MSG_ZEROCOPY sends of the batch, numbered from zc_first. */
+    uint32_t zc_first;
+    unsigned zc_sent, zc_pending;
+
+    int rc;
+    bool ready;
+};
+
+/*
+ * When the toolstack domain has CPUs to spare, batches are mapped and
+ * normalised by worker threads, while the saving thread writes the ones
+ * already prepared into the stream.  Batches go round a ring, so they get
+ * written in the order they were submitted in, whatever the order they got
+ * prepared in.
+ */
+#define SAVE_MAX_WORKERS 4
+#define SAVE_NR_BATCHES  (2 * SAVE_MAX_WORKERS)
+
+struct xc_sr_save_pipeline
+{
+    struct xc_sr_context *ctx;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t threads[SAVE_MAX_WORKERS];
+    unsigned nr_threads;
+    bool exit;
+
+    struct xc_sr_save_batch batches[SAVE_NR_BATCHES];
+    /* Free running indices of the next batch to submit, prepare and write. */
+    unsigned head, next, tail;
+};
+
+/*
+ * Prepares a batch of memory to be written into the stream.
  *
  * This function:
  * - gets the types for each pfn in the batch.
  * - for each pfn with real data:
  *   - maps and attempts to localise the pages.
- * - construct and writes a PAGE_DATA record into the stream.
+ * - constructs the PAGE_DATA record (and the ZERO_PAGE_DATA one, for the
+ *   pages found to be all zeroes, if the receiver knows them) and the
+ *   iovec[] to write them with.  Post-copy, it is a POSTCOPY_PAGE_DATA
+ *   record instead, and zero pages are sent as they are.
+ *
+ * It may be called from several threads at once, for different batches.
  */
-static int write_batch(struct xc_sr_context *ctx)
+static int prepare_batch(struct xc_sr_context *ctx,
+                         struct xc_sr_save_batch *batch)
 {
     xc_interface *xch = ctx->xch;
-    xen_pfn_t *mfns = NULL, *types = NULL;
-    void *guest_mapping = NULL;
-    void **guest_data = NULL;
-    void **local_pages = NULL;
-    int *errors = NULL, rc = -1;
-    unsigned i, p, nr_pages = 0, nr_pages_mapped = 0;
-    unsigned nr_pfns = ctx->save.nr_batch_pfns;
+    xen_pfn_t *mfns, *types;
+    int *errors, rc = -1;
+    unsigned i, p, nr_pages = 0, nr_recs = 0, nr_zero = 0;
+    unsigned nr_pfns = batch->nr_pfns;
     void *page, *orig_page;
-    uint64_t *rec_pfns = NULL;
-    struct iovec *iov = NULL; int iovcnt = 0;
-    struct xc_sr_rec_page_data_header hdr = { 0 };
-    struct xc_sr_record rec =
-    {
-        .type = REC_TYPE_PAGE_DATA,
-    };
+    struct iovec *iov;
+    int iovcnt = 0;
 
     assert(nr_pfns != 0);
 
     /* Mfns of the batch pfns. */
-    mfns = malloc(nr_pfns * sizeof(*mfns));
+    mfns = batch->mfns = malloc(nr_pfns * sizeof(*mfns));
     /* Types of the batch pfns. */
-    types = malloc(nr_pfns * sizeof(*types));
+    types = batch->types = malloc(nr_pfns * sizeof(*types));
     /* Errors from attempting to map the gfns. */
-    errors = malloc(nr_pfns * sizeof(*errors));
+    errors = batch->errors = malloc(nr_pfns * sizeof(*errors));
     /* Pointers to page data to send.  Mapped gfns or local allocations. */
-    guest_data = calloc(nr_pfns, sizeof(*guest_data));
+    batch->guest_data = calloc(nr_pfns, sizeof(*batch->guest_data));
     /* Pointers to locally allocated pages.  Need freeing. */
-    local_pages = calloc(nr_pfns, sizeof(*local_pages));
+    batch->local_pages = calloc(nr_pfns, sizeof(*batch->local_pages));
+    /* Pfns and types for the record. */
+    batch->rec_pfns = malloc(nr_pfns * sizeof(*batch->rec_pfns));
     /* iovec[] for writev(). */
-    iov = malloc((nr_pfns + 4) * sizeof(*iov));
+    iov = batch->iov = malloc((nr_pfns + 8) * sizeof(*iov));
+    /* Pfns to retry later. */
+    batch->deferred = malloc(nr_pfns * sizeof(*batch->deferred));
 
-    if ( !mfns || !types || !errors || !guest_data || !local_pages || !iov )
+    if ( !mfns || !types || !errors || !batch->guest_data ||
+         !batch->local_pages || !batch->rec_pfns || !iov || !batch->deferred )
     {
         ERROR("Unable to allocate arrays for a batch of %u pages",
               nr_pfns);
@@ -119,15 +238,11 @@ static int write_batch(struct xc_sr_context *ctx)
 
     for ( i = 0; i < nr_pfns; ++i )
     {
-        types[i] = mfns[i] = ctx->save.ops.pfn_to_gfn(ctx,
-                                                      ctx->save.batch_pfns[i]);
+        types[i] = mfns[i] = ctx->save.ops.pfn_to_gfn(ctx, batch->pfns[i]);
 
         /* Likely a ballooned page. */
         if ( mfns[i] == INVALID_MFN )
-        {
-            set_bit(ctx->save.batch_pfns[i], ctx->save.deferred_pages);
-            ++ctx->save.nr_deferred_pages;
-        }
+            batch->deferred[batch->nr_deferred++] = batch->pfns[i];
     }
 
     rc = xc_get_pfn_type_batch(xch, ctx->domid, nr_pfns, types);
@@ -153,14 +268,14 @@ static int write_batch(struct xc_sr_context *ctx)
 
     if ( nr_pages > 0 )
     {
-        guest_mapping = xenforeignmemory_map(xch->fmem,
+        batch->guest_mapping = xenforeignmemory_map(xch->fmem,
             ctx->domid, PROT_READ, nr_pages, mfns, errors);
-        if ( !guest_mapping )
+        if ( !batch->guest_mapping )
         {
             PERROR("Failed to map guest pages");
             goto err;
         }
-        nr_pages_mapped = nr_pages;
+        batch->nr_pages_mapped = nr_pages;
 
         for ( i = 0, p = 0; i < nr_pfns; ++i )
         {
@@ -175,22 +290,21 @@ static int write_batch(struct xc_sr_context *ctx)
             if ( errors[p] )
             {
                 ERROR("Mapping of pfn %#"PRIpfn" (mfn %#"PRIpfn") failed %d",
-                      ctx->save.batch_pfns[i], mfns[p], errors[p]);
+                      batch->pfns[i], mfns[p], errors[p]);
                 goto err;
             }
 
-            orig_page = page = guest_mapping + (p * PAGE_SIZE);
+            orig_page = page = batch->guest_mapping + (p * PAGE_SIZE);
             rc = ctx->save.ops.normalise_page(ctx, types[i], &page);
 
             if ( orig_page != page )
-                local_pages[i] = page;
+                batch->local_pages[i] = page;
 
             if ( rc )
             {
                 if ( rc == -1 && errno == EAGAIN )
                 {
-                    set_bit(ctx->save.batch_pfns[i], ctx->save.deferred_pages);
-                    ++ctx->save.nr_deferred_pages;
+                    batch->deferred[batch->nr_deferred++] = batch->pfns[i];
                     types[i] = XEN_DOMCTL_PFINFO_XTAB;
                     --nr_pages;
                 }
@@ -198,51 +312,82 @@ static int write_batch(struct xc_sr_context *ctx)
                     goto err;
             }
             else
-                guest_data[i] = page;
+                batch->guest_data[i] = page;
 
             rc = -1;
             ++p;
         }
     }
 
-    rec_pfns = malloc(nr_pfns * sizeof(*rec_pfns));
-    if ( !rec_pfns )
+    for ( i = 0; i < nr_pfns; ++i )
     {
-        ERROR("Unable to allocate %zu bytes of memory for page data pfn list",
-              nr_pfns * sizeof(*rec_pfns));
-        goto err;
+        uint64_t rec_pfn = ((uint64_t)(types[i]) << 32) | batch->pfns[i];
+
+        if ( ctx->save.zero_pages && !ctx->save.in_postcopy &&
+             batch->guest_data[i] &&
+             page_is_zero(batch->guest_data[i]) )
+        {
+            /* Zero pages fill rec_pfns[] from the end. */
+            batch->rec_pfns[nr_pfns - ++nr_zero] = rec_pfn;
+            batch->guest_data[i] = NULL;
+            --nr_pages;
+        }
+        else
+            batch->rec_pfns[nr_recs++] = rec_pfn;
     }
 
-    hdr.count = nr_pfns;
+    if ( nr_zero )
+    {
+        batch->zero_hdr.count = nr_zero;
+
+        batch->zero_rec.type = REC_TYPE_ZERO_PAGE_DATA;
+        batch->zero_rec.length = sizeof(batch->zero_hdr);
+        batch->zero_rec.length += nr_zero * sizeof(*batch->rec_pfns);
 
-    rec.length = sizeof(hdr);
-    rec.length += nr_pfns * sizeof(*rec_pfns);
-    rec.length += nr_pages * PAGE_SIZE;
+        iov[iovcnt].iov_base = &batch->zero_rec.type;
+        iov[iovcnt++].iov_len = sizeof(batch->zero_rec.type);
 
-    for ( i = 0; i < nr_pfns; ++i )
-        rec_pfns[i] = ((uint64_t)(types[i]) << 32) | ctx->save.batch_pfns[i];
+        iov[iovcnt].iov_base = &batch->zero_rec.length;
+        iov[iovcnt++].iov_len = sizeof(batch->zero_rec.length);
+
+        iov[iovcnt].iov_base = &batch->zero_hdr;
+        iov[iovcnt++].iov_len = sizeof(batch->zero_hdr);
+
+        iov[iovcnt].iov_base = &batch->rec_pfns[nr_pfns - nr_zero];
+        iov[iovcnt++].iov_len = nr_zero * sizeof(*batch->rec_pfns);
+    }
+
+    /* PAGE_DATA records must describe at least one pfn. */
+    if ( !nr_recs )
+        goto done;
 
-    iov[0].iov_base = &rec.type;
-    iov[0].iov_len = sizeof(rec.type);
+    batch->hdr.count = nr_recs;
 
-    iov[1].iov_base = &rec.length;
-    iov[1].iov_len = sizeof(rec.length);
+    batch->rec.type = ctx->save.in_postcopy ? REC_TYPE_POSTCOPY_PAGE_DATA
+                                            : REC_TYPE_PAGE_DATA;
+    batch->rec.length = sizeof(batch->hdr);
+    batch->rec.length += nr_recs * sizeof(*batch->rec_pfns);
+    batch->rec.length += nr_pages * PAGE_SIZE;
 
-    iov[2].iov_base = &hdr;
-    iov[2].iov_len = sizeof(hdr);
+    iov[iovcnt].iov_base = &batch->rec.type;
+    iov[iovcnt++].iov_len = sizeof(batch->rec.type);
 
-    iov[3].iov_base = rec_pfns;
-    iov[3].iov_len = nr_pfns * sizeof(*rec_pfns);
+    iov[iovcnt].iov_base = &batch->rec.length;
+    iov[iovcnt++].iov_len = sizeof(batch->rec.length);
 
-    iovcnt = 4;
+    iov[iovcnt].iov_base = &batch->hdr;
+    iov[iovcnt++].iov_len = sizeof(batch->hdr);
+
+    iov[iovcnt].iov_base = batch->rec_pfns;
+    iov[iovcnt++].iov_len = nr_recs * sizeof(*batch->rec_pfns);
 
     if ( nr_pages )
     {
         for ( i = 0; i < nr_pfns; ++i )
         {
-            if ( guest_data[i] )
+            if ( batch->guest_data[i] )
             {
-                iov[iovcnt].iov_base = guest_data[i];
+                iov[iovcnt].iov_base = batch->guest_data[i];
                 iov[iovcnt].iov_len = PAGE_SIZE;
                 iovcnt++;
                 --nr_pages;
@@ -250,175 +395,1002 @@ static int write_batch(struct xc_sr_context *ctx)
         }
     }
 
-    if ( writev_exact(ctx->fd, iov, iovcnt) )
-    {
-        PERROR("Failed to write page data to stream");
-        goto err;
-    }
-
-    /* Sanity check we have sent all the pages we expected to. */
+    /* Sanity check we are sending all the pages we expected to. */
     assert(nr_pages == 0);
-    rc = ctx->save.nr_batch_pfns = 0;
+ done:
+    batch->iovcnt = iovcnt;
+    rc = 0;
 
  err:
-    free(rec_pfns);
-    if ( guest_mapping )
-        xenforeignmemory_unmap(xch->fmem, guest_mapping, nr_pages_mapped);
-    for ( i = 0; local_pages && i < nr_pfns; ++i )
-        free(local_pages[i]);
-    free(iov);
-    free(local_pages);
-    free(guest_data);
-    free(errors);
-    free(types);
-    free(mfns);
-
     return rc;
 }
 
 /*
- * Flush a batch of pfns into the stream.
+ * Frees whatever prepare_batch() set up, leaving the batch ready for reuse.
  */
-static int flush_batch(struct xc_sr_context *ctx)
+static void free_batch(struct xc_sr_context *ctx,
+                       struct xc_sr_save_batch *batch)
 {
-    int rc = 0;
+    xc_interface *xch = ctx->xch;
+    xen_pfn_t *pfns = batch->pfns;
+    unsigned i;
+
+    if ( batch->guest_mapping )
+        xenforeignmemory_unmap(xch->fmem, batch->guest_mapping,
+                               batch->nr_pages_mapped);
+    for ( i = 0; batch->local_pages && i < batch->nr_pfns; ++i )
+        free(batch->local_pages[i]);
+    free(batch->deferred);
+    free(batch->iov);
+    free(batch->rec_pfns);
+    free(batch->local_pages);
+    free(batch->guest_data);
+    free(batch->errors);
+    free(batch->types);
+    free(batch->mfns);
+
+    memset(batch, 0, sizeof(*batch));
+    batch->pfns = pfns;
+}
 
-    if ( ctx->save.nr_batch_pfns == 0 )
-        return rc;
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && \
+    defined(SO_EE_ORIGIN_ZEROCOPY)
+/*
+ * Zero-copy sending.  When the stream is a Linux socket, batches are sent
+ * with MSG_ZEROCOPY, so the kernel transmits straight out of the guest
+ * mappings (and the normalised pages) rather than copying them into the
+ * socket buffer.  The kernel tells us through the socket's error queue when
+ * it has finished with the data of each send, until which the batch is
+ * parked rather than unmapped and freed.
+ *
+ * The guest keeps running while its pages are queued, which is fine for
+ * pre-copy, but not for checkpoints after which it runs on, so checkpointed
+ * streams never use this.
+ *
+ * The kernel may refuse to pin the pages (EFAULT, e.g. for mappings it
+ * can't pin), or tell us it copied them anyway; either way we just go back
+ * to writev() for the rest of the stream.
+ */
+#define SAVE_ZC_MAX_PARKED 16
 
-    rc = write_batch(ctx);
+struct xc_sr_save_zerocopy
+{
+    uint32_t next_seq;
+    bool disabled;
 
-    if ( !rc )
+    struct xc_sr_save_batch *parked[SAVE_ZC_MAX_PARKED];
+    unsigned nr_parked;
+
+    /* Batch which couldn't be parked, being waited for. */
+    struct xc_sr_save_batch *waiting;
+};
+
+static void setup_zerocopy(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    int one = 1;
+
+    /* Page data going out on data streams isn't tracked (yet). */
+    if ( ctx->save.checkpointed != XC_MIG_STREAM_NONE ||
+         ctx->save.nr_data_fds )
+        return;
+
+    /* Fails for anything but a (TCP or Unix) socket. */
+    if ( setsockopt(ctx->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) )
+        return;
+
+    ctx->save.zerocopy = calloc(1, sizeof(*ctx->save.zerocopy));
+    if ( ctx->save.zerocopy )
+        DPRINTF("Sending page data with MSG_ZEROCOPY");
+}
+
+/* Account for the kernel being done with sends lo to hi (inclusive). */
+static void complete_zerocopy(struct xc_sr_context *ctx,
+                              uint32_t lo, uint32_t hi)
+{
+    struct xc_sr_save_zerocopy *zc = ctx->save.zerocopy;
+    struct xc_sr_save_batch *batch;
+    uint32_t seq = lo;
+    unsigned i;
+
+    do {
+        batch = zc->waiting;
+        for ( i = 0; i < zc->nr_parked; ++i )
+            if ( (uint32_t)(seq - zc->parked[i]->zc_first) <
+                 zc->parked[i]->zc_sent )
+            {
+                batch = zc->parked[i];
+                break;
+            }
+
+        if ( batch && (uint32_t)(seq - batch->zc_first) < batch->zc_sent )
+            batch->zc_pending--;
+    } while ( seq++ != hi );
+
+    for ( i = 0; i < zc->nr_parked; )
     {
-        VALGRIND_MAKE_MEM_UNDEFINED(ctx->save.batch_pfns,
-                                    MAX_BATCH_SIZE *
-                                    sizeof(*ctx->save.batch_pfns));
+        batch = zc->parked[i];
+        if ( batch->zc_pending )
+        {
+            ++i;
+            continue;
+        }
+
+        free_batch(ctx, batch);
+        free(batch);
+        zc->parked[i] = zc->parked[--zc->nr_parked];
     }
+}
 
-    return rc;
+/*
+ * Reads completions off the error queue until at most max_parked batches
+ * (and not the one being waited for) are still in the hands of the kernel.
+ */
+static int reap_zerocopy(struct xc_sr_context *ctx, unsigned max_parked)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_save_zerocopy *zc = ctx->save.zerocopy;
+    struct pollfd pfd = { .fd = ctx->fd };
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct sock_extended_err *serr;
+    int err;
+    socklen_t len = sizeof(err);
+
+    while ( zc->nr_parked > max_parked ||
+            (zc->waiting && zc->waiting->zc_pending) )
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if ( recvmsg(ctx->fd, &msg, MSG_ERRQUEUE) < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            if ( errno != EAGAIN && errno != EWOULDBLOCK )
+            {
+                PERROR("Failed to read MSG_ZEROCOPY completions");
+                return -1;
+            }
+
+            /* Nothing queued: a pending socket error can't be waited out. */
+            if ( getsockopt(ctx->fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 &&
+                 err )
+            {
+                errno = err;
+                PERROR("Stream failed with page data in flight");
+                return -1;
+            }
+
+            if ( poll(&pfd, 1, -1) < 0 && errno != EINTR )
+            {
+                PERROR("Failed to wait for MSG_ZEROCOPY completions");
+                return -1;
+            }
+            continue;
+        }
+
+        for ( cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+              cmsg = CMSG_NXTHDR(&msg, cmsg) )
+        {
+            if ( !((cmsg->cmsg_level == SOL_IP &&
+                    cmsg->cmsg_type == IP_RECVERR) ||
+                   (cmsg->cmsg_level == SOL_IPV6 &&
+                    cmsg->cmsg_type == IPV6_RECVERR)) )
+                continue;
+
+            serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if ( serr->ee_errno != 0 ||
+                 serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY )
+                continue;
+
+            if ( (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) &&
+                 !zc->disabled )
+            {
+                DPRINTF("Kernel copies MSG_ZEROCOPY data, using writev()");
+                zc->disabled = true;
+            }
+
+            complete_zerocopy(ctx, serr->ee_info, serr->ee_data);
+        }
+    }
+
+    return 0;
 }
 
 /*
- * Add a single pfn to the batch, flushing the batch if full.
+ * Sends a prepared batch with MSG_ZEROCOPY, falling back to writev_exact()
+ * once the kernel won't.
  */
-static int add_to_batch(struct xc_sr_context *ctx, xen_pfn_t pfn)
+static int send_zerocopy(struct xc_sr_context *ctx,
+                         struct xc_sr_save_batch *batch)
 {
-    int rc = 0;
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_save_zerocopy *zc = ctx->save.zerocopy;
+    struct iovec *iov = batch->iov;
+    int iovcnt = batch->iovcnt;
+    struct msghdr msg = { 0 };
+    ssize_t len;
 
-    if ( ctx->save.nr_batch_pfns == MAX_BATCH_SIZE )
-        rc = flush_batch(ctx);
+    batch->zc_first = zc->next_seq;
 
-    if ( rc == 0 )
-        ctx->save.batch_pfns[ctx->save.nr_batch_pfns++] = pfn;
+    while ( iovcnt && !zc->disabled )
+    {
+        if ( iov->iov_len == 0 )
+        {
+            iov++;
+            iovcnt--;
+            continue;
+        }
 
-    return rc;
+        msg.msg_iov = iov;
+        msg.msg_iovlen = min(iovcnt, IOV_MAX);
+        len = sendmsg(ctx->fd, &msg, MSG_ZEROCOPY);
+        if ( len < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            if ( errno == ENOBUFS )
+                /* Out of memory to track the send: copy this batch. */
+                break;
+            if ( errno != EFAULT )
+                return -1;
+
+            DPRINTF("Kernel can't send guest pages with MSG_ZEROCOPY");
+            zc->disabled = true;
+            break;
+        }
+
+        /* Only sends which queued something get a completion. */
+        zc->next_seq++;
+        batch->zc_sent++;
+        batch->zc_pending++;
+
+        for ( ; iovcnt && len >= iov->iov_len; iov++, iovcnt-- )
+            len -= iov->iov_len;
+        if ( len )
+        {
+            iov->iov_base = (char *)iov->iov_base + len;
+            iov->iov_len -= len;
+        }
+    }
+
+    return iovcnt ? writev_exact(ctx->fd, iov, iovcnt) : 0;
 }
 
 /*
- * Pause/suspend the domain, and refresh ctx->dominfo if required.
+ * Keeps a batch the kernel may still be sending from until it is done with
+ * it.  Returns false if it had to wait for that instead.
  */
-static int suspend_domain(struct xc_sr_context *ctx)
+static bool park_batch(struct xc_sr_context *ctx,
+                       struct xc_sr_save_batch *batch)
 {
     xc_interface *xch = ctx->xch;
+    struct xc_sr_save_zerocopy *zc = ctx->save.zerocopy;
+    struct xc_sr_save_batch *parked;
+    xen_pfn_t *pfns = batch->pfns;
+
+    if ( reap_zerocopy(ctx, SAVE_ZC_MAX_PARKED - 1) ||
+         !(parked = malloc(sizeof(*parked))) )
+        goto wait;
+
+    /* The batch's resources now belong to parked, its pfns stay put. */
+    *parked = *batch;
+    parked->pfns = NULL;
+    zc->parked[zc->nr_parked++] = parked;
+
+    memset(batch, 0, sizeof(*batch));
+    batch->pfns = pfns;
+    return true;
+
+ wait:
+    /* On error the stream is dead anyway, and the kernel keeps its pages. */
+    zc->waiting = batch;
+    if ( reap_zerocopy(ctx, SAVE_ZC_MAX_PARKED) )
+        ERROR("Releasing page data the kernel may still be sending");
+    zc->waiting = NULL;
+    return false;
+}
 
-    /* TODO: Properly specify the return value from this callback.  All
-     * implementations currently appear to return 1 for success, whereas
-     * the legacy code checks for != 0. */
-    int cb_rc = ctx->save.callbacks->suspend(ctx->save.callbacks->data);
+static void teardown_zerocopy(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_save_zerocopy *zc = ctx->save.zerocopy;
+    unsigned i;
 
-    if ( cb_rc == 0 )
+    if ( !zc )
+        return;
+
+    if ( reap_zerocopy(ctx, 0) )
+        ERROR("Releasing page data the kernel may still be sending");
+
+    for ( i = 0; i < zc->nr_parked; ++i )
     {
-        ERROR("save callback suspend() failed: %d", cb_rc);
-        return -1;
+        free_batch(ctx, zc->parked[i]);
+        free(zc->parked[i]);
     }
+    free(zc);
+    ctx->save.zerocopy = NULL;
+}
+#else
+static void setup_zerocopy(struct xc_sr_context *ctx) {}
+static int send_zerocopy(struct xc_sr_context *ctx,
+                         struct xc_sr_save_batch *batch)
+{
+    return writev_exact(ctx->fd, batch->iov, batch->iovcnt);
+}
+static bool park_batch(struct xc_sr_context *ctx,
+                       struct xc_sr_save_batch *batch)
+{
+    return false;
+}
+static void teardown_zerocopy(struct xc_sr_context *ctx) {}
+#endif
 
-    /* Refresh domain information. */
-    if ( (xc_domain_getinfo(xch, ctx->domid, 1, &ctx->dominfo) != 1) ||
-         (ctx->dominfo.domid != ctx->domid) )
+/*
+ * Page index.  For non-live saves to a file, the file offset of each page's
+ * data gets recorded in PAGE_INDEX records after the page data, so that the
+ * restore side can skip over the latter, and read pages as it needs them.
+ * A PAGE_INDEX_OFFSET record before the page data says where the index is.
+ * Consecutive pfns with consecutive data make up a single entry, which for
+ * a non-live save means one per batch, or per run of (non-)zero pages.
+ */
+static int add_to_index(struct xc_sr_context *ctx, xen_pfn_t pfn,
+                        uint32_t type, uint64_t offset)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_page_index_entry *entry, *index;
+
+    if ( ctx->save.nr_index )
     {
-        PERROR("Unable to refresh domain information");
-        return -1;
+        entry = &ctx->save.index[ctx->save.nr_index - 1];
+
+        if ( entry->pfn + entry->count == pfn && entry->type == type &&
+             entry->count < UINT32_MAX &&
+             (offset ? entry->offset &&
+                       entry->offset + entry->count * PAGE_SIZE == offset
+                     : !entry->offset) )
+        {
+            entry->count++;
+            return 0;
+        }
     }
 
-    /* Confirm the domain has actually been paused. */
-    if ( !ctx->dominfo.shutdown ||
-         (ctx->dominfo.shutdown_reason != SHUTDOWN_suspend) )
+    if ( ctx->save.nr_index == ctx->save.max_index )
     {
-        ERROR("Domain has not been suspended: shutdown %d, reason %d",
-              ctx->dominfo.shutdown, ctx->dominfo.shutdown_reason);
-        return -1;
+        unsigned long max = ctx->save.max_index * 2 ?: 1024;
+
+        index = realloc(ctx->save.index, max * sizeof(*index));
+        if ( !index )
+        {
+            ERROR("Unable to allocate memory for the page index");
+            return -1;
+        }
+        ctx->save.index = index;
+        ctx->save.max_index = max;
     }
 
-    xc_report_progress_single(xch, "Domain now suspended");
+    entry = &ctx->save.index[ctx->save.nr_index++];
+    entry->pfn = pfn;
+    entry->count = 1;
+    entry->type = type;
+    entry->offset = offset;
 
     return 0;
 }
 
 /*
- * Send a subset of pages in the guests p2m, according to the dirty bitmap.
- * Used for each subsequent iteration of the live migration loop.
- *
- * Bitmap is bounded by p2m_size.
+ * Index a batch written at offset pos: first its ZERO_PAGE_DATA record, if
+ * any, then its PAGE_DATA one.
  */
-static int send_dirty_pages(struct xc_sr_context *ctx,
-                            unsigned long entries)
+static int index_batch(struct xc_sr_context *ctx,
+                       struct xc_sr_save_batch *batch, off_t pos)
 {
-    xc_interface *xch = ctx->xch;
-    xen_pfn_t p;
-    unsigned long written;
-    int rc;
-    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
-                                    &ctx->save.dirty_bitmap_hbuf);
+    unsigned i, nr_zero = batch->zero_hdr.count, nr_recs = batch->hdr.count;
+    uint64_t rec_pfn, offset;
+    uint32_t type;
 
-    for ( p = 0, written = 0; p < ctx->save.p2m_size; ++p )
+    for ( i = 0; i < nr_zero; ++i )
     {
-        if ( !test_bit(p, dirty_bitmap) )
-            continue;
-
-        rc = add_to_batch(ctx, p);
-        if ( rc )
-            return rc;
+        /* Filled from the end of rec_pfns[]. */
+        rec_pfn = batch->rec_pfns[batch->nr_pfns - 1 - i];
+        if ( add_to_index(ctx, rec_pfn & PAGE_DATA_PFN_MASK, rec_pfn >> 32,
+                          0) )
+            return -1;
+    }
 
-        /* Update progress every 4MB worth of memory sent. */
-        if ( (written & ((1U << (22 - 12)) - 1)) == 0 )
-            xc_report_progress_step(xch, written, entries);
+    if ( nr_zero )
+        pos += sizeof(struct xc_sr_rhdr) + batch->zero_rec.length;
 
-        ++written;
-    }
+    offset = pos + sizeof(struct xc_sr_rhdr) + sizeof(batch->hdr) +
+        nr_recs * sizeof(*batch->rec_pfns);
 
-    rc = flush_batch(ctx);
-    if ( rc )
-        return rc;
+    for ( i = 0; i < nr_recs; ++i )
+    {
+        rec_pfn = batch->rec_pfns[i];
+        type = rec_pfn >> 32;
 
-    if ( written > entries )
-        DPRINTF("Bitmap contained more entries than expected...");
+        if ( add_to_index(ctx, rec_pfn & PAGE_DATA_PFN_MASK, type,
+                          type < XEN_DOMCTL_PFINFO_BROKEN ? offset : 0) )
+            return -1;
 
-    xc_report_progress_step(xch, entries, entries);
+        if ( type < XEN_DOMCTL_PFINFO_BROKEN )
+            offset += PAGE_SIZE;
+    }
 
-    return ctx->save.ops.check_vm_state(ctx);
+    return 0;
 }
 
 /*
- * Send all pages in the guests p2m.  Used as the first iteration of the live
- * migration loop, and for a non-live save.
+ * Writes the PAGE_INDEX_OFFSET record, to be filled in by
+ * write_page_index().
  */
-static int send_all_pages(struct xc_sr_context *ctx)
+static int write_page_index_offset_record(struct xc_sr_context *ctx)
 {
-    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
-                                    &ctx->save.dirty_bitmap_hbuf);
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_page_index_offset index_offset = { 0 };
+    struct xc_sr_record rec =
+    {
+        .type = REC_TYPE_PAGE_INDEX_OFFSET,
+        .length = sizeof(index_offset),
+        .data = &index_offset,
+    };
+    off_t pos = lseek(ctx->fd, 0, SEEK_CUR);
 
-    bitmap_set(dirty_bitmap, ctx->save.p2m_size);
+    if ( pos < 0 )
+    {
+        PERROR("Failed to get the stream position");
+        return -1;
+    }
+    ctx->save.index_offset_pos = pos + sizeof(struct xc_sr_rhdr);
 
-    return send_dirty_pages(ctx, ctx->save.p2m_size);
+    return write_record(ctx, &rec);
 }
 
-static int enable_logdirty(struct xc_sr_context *ctx)
+/*
+ * Writes the PAGE_INDEX records, as many as their maximum length needs, and
+ * tells the PAGE_INDEX_OFFSET record where they are.
+ */
+static int write_page_index(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
-    int on1 = 0, off = 0, on2 = 0;
-    int rc;
+    struct xc_sr_rec_page_index_offset index_offset;
+    struct xc_sr_record rec = { .type = REC_TYPE_PAGE_INDEX };
+    unsigned long i, nr, max = REC_LENGTH_MAX / sizeof(*ctx->save.index);
+    off_t pos = lseek(ctx->fd, 0, SEEK_CUR);
 
-    /* This juggling is required if logdirty is enabled for VRAM tracking. */
+    if ( pos < 0 )
+    {
+        PERROR("Failed to get the stream position");
+        return -1;
+    }
+
+    for ( i = 0; i < ctx->save.nr_index; i += nr )
+    {
+        nr = min(ctx->save.nr_index - i, max);
+        if ( write_split_record(ctx, &rec, &ctx->save.index[i],
+                                nr * sizeof(*ctx->save.index)) )
+            return -1;
+    }
+
+    index_offset.offset = pos;
+    if ( pwrite(ctx->fd, &index_offset, sizeof(index_offset),
+                ctx->save.index_offset_pos) != sizeof(index_offset) )
+    {
+        PERROR("Failed to write the page index offset");
+        return -1;
+    }
+
+    DPRINTF("Page index of %lu entries at offset %#"PRIx64,
+            ctx->save.nr_index, index_offset.offset);
+
+    return 0;
+}
+
+/*
+ * Writes a prepared batch into the stream.  Only ever called by the saving
+ * thread, in the order the batches were submitted in.
+ */
+static int send_batch(struct xc_sr_context *ctx,
+                      struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned i;
+    int rc, fd = ctx->fd;
+    off_t pos = 0;
+
+    for ( i = 0; i < batch->nr_deferred; ++i )
+        set_bit(batch->deferred[i], ctx->save.deferred_pages);
+    ctx->save.nr_deferred_pages += batch->nr_deferred;
+
+    /*
+     * With data streams, batches go round them.  A sync first ends whatever
+     * the restore side got to process alongside the records written since
+     * the last one, which this page data may depend on.
+     */
+    if ( ctx->save.nr_data_fds )
+    {
+        if ( !ctx->save.data_unsynced )
+        {
+            if ( write_data_sync_records(ctx) )
+            {
+                PERROR("Failed to sync data streams");
+                return -1;
+            }
+            ctx->save.data_unsynced = true;
+        }
+
+        fd = ctx->save.data_fds[ctx->save.next_data_fd++ %
+                                ctx->save.nr_data_fds];
+    }
+
+    if ( ctx->save.page_index )
+    {
+        pos = lseek(fd, 0, SEEK_CUR);
+        if ( pos < 0 )
+        {
+            PERROR("Failed to get the stream position");
+            return -1;
+        }
+    }
+
+    if ( ctx->save.zerocopy )
+        rc = send_zerocopy(ctx, batch);
+    else
+        rc = writev_exact(fd, batch->iov, batch->iovcnt);
+
+    if ( rc )
+    {
+        PERROR("Failed to write page data to stream");
+        return -1;
+    }
+
+    if ( ctx->save.page_index )
+        return index_batch(ctx, batch, pos);
+
+    return 0;
+}
+
+/*
+ * Done with a batch: free it, unless the kernel still sends from it.
+ */
+static void release_batch(struct xc_sr_context *ctx,
+                          struct xc_sr_save_batch *batch)
+{
+    if ( batch->zc_pending && park_batch(ctx, batch) )
+        return;
+
+    free_batch(ctx, batch);
+}
+
+/*
+ * Writes the batch of memory constructed in ctx->save.batch_pfns as a
+ * PAGE_DATA record into the stream, without the help of other threads.
+ */
+static int write_batch(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_batch batch =
+    {
+        .pfns = ctx->save.batch_pfns,
+        .nr_pfns = ctx->save.nr_batch_pfns,
+    };
+    int rc;
+
+    rc = prepare_batch(ctx, &batch);
+    if ( !rc )
+        rc = send_batch(ctx, &batch);
+    release_batch(ctx, &batch);
+
+    if ( !rc )
+        ctx->save.nr_batch_pfns = 0;
+
+    return rc;
+}
+
+static void *save_worker(void *arg)
+{
+    struct xc_sr_save_pipeline *pipe = arg;
+    struct xc_sr_save_batch *batch;
+    int rc;
+
+    pthread_mutex_lock(&pipe->lock);
+    for ( ;; )
+    {
+        if ( pipe->next == pipe->head )
+        {
+            if ( pipe->exit )
+                break;
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+            continue;
+        }
+
+        batch = &pipe->batches[pipe->next++ % SAVE_NR_BATCHES];
+        pthread_mutex_unlock(&pipe->lock);
+
+        rc = prepare_batch(pipe->ctx, batch);
+
+        pthread_mutex_lock(&pipe->lock);
+        batch->rc = rc;
+        batch->ready = true;
+        pthread_cond_broadcast(&pipe->cond);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+
+    return NULL;
+}
+
+/*
+ * Writes the oldest batch in the pipeline into the stream, or just drops it
+ * if discard, waiting for it to be prepared if need be.
+ */
+static int write_oldest_batch(struct xc_sr_context *ctx, bool discard)
+{
+    struct xc_sr_save_pipeline *pipe = ctx->save.pipeline;
+    struct xc_sr_save_batch *batch =
+        &pipe->batches[pipe->tail % SAVE_NR_BATCHES];
+    int rc;
+
+    pthread_mutex_lock(&pipe->lock);
+    while ( !batch->ready )
+        pthread_cond_wait(&pipe->cond, &pipe->lock);
+    pthread_mutex_unlock(&pipe->lock);
+
+    rc = discard ? 0 : batch->rc;
+    if ( !rc && !discard )
+        rc = send_batch(ctx, batch);
+    release_batch(ctx, batch);
+    pipe->tail++;
+
+    return rc;
+}
+
+static bool oldest_batch_ready(struct xc_sr_save_pipeline *pipe)
+{
+    bool ready;
+
+    pthread_mutex_lock(&pipe->lock);
+    ready = pipe->tail != pipe->head &&
+            pipe->batches[pipe->tail % SAVE_NR_BATCHES].ready;
+    pthread_mutex_unlock(&pipe->lock);
+
+    return ready;
+}
+
+/*
+ * Hands the batch constructed in ctx->save.batch_pfns over to the workers,
+ * writing whatever they have finished preparing into the stream meanwhile.
+ */
+static int submit_batch(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_pipeline *pipe = ctx->save.pipeline;
+    struct xc_sr_save_batch *batch;
+    xen_pfn_t *pfns;
+    int rc;
+
+    while ( oldest_batch_ready(pipe) ||
+            pipe->head - pipe->tail == SAVE_NR_BATCHES )
+    {
+        rc = write_oldest_batch(ctx, false);
+        if ( rc )
+            return rc;
+    }
+
+    /* The batch takes the pfns, and we take its (spare) array. */
+    batch = &pipe->batches[pipe->head % SAVE_NR_BATCHES];
+    pfns = batch->pfns;
+    batch->pfns = ctx->save.batch_pfns;
+    batch->nr_pfns = ctx->save.nr_batch_pfns;
+    ctx->save.batch_pfns = pfns;
+    ctx->save.nr_batch_pfns = 0;
+
+    pthread_mutex_lock(&pipe->lock);
+    pipe->head++;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+
+    return 0;
+}
+
+/*
+ * Writes all the batches still in the pipeline into the stream.
+ */
+static int drain_batches(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_pipeline *pipe = ctx->save.pipeline;
+    int rc = 0;
+
+    while ( pipe && pipe->tail != pipe->head )
+        if ( write_oldest_batch(ctx, rc != 0) )
+            rc = -1;
+
+    return rc;
+}
+
+/*
+ * Start worker threads to prepare batches, if the toolstack domain has CPUs
+ * to spare (the saving thread is busy writing the stream).  Failing to is
+ * not fatal: batches are then prepared by the saving thread.
+ */
+static void setup_pipeline(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_save_pipeline *pipe;
+    long nr_threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    unsigned i;
+
+    if ( nr_threads <= 0 )
+        return;
+    if ( nr_threads > SAVE_MAX_WORKERS )
+        nr_threads = SAVE_MAX_WORKERS;
+
+    pipe = calloc(1, sizeof(*pipe));
+    if ( !pipe )
+        return;
+
+    for ( i = 0; i < SAVE_NR_BATCHES; i++ )
+    {
+        pipe->batches[i].pfns = malloc(MAX_BATCH_SIZE *
+                                       sizeof(*pipe->batches[i].pfns));
+        if ( !pipe->batches[i].pfns )
+            goto err;
+    }
+
+    pipe->ctx = ctx;
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->cond, NULL);
+
+    for ( i = 0; i < nr_threads; i++ )
+        if ( pthread_create(&pipe->threads[i], NULL, save_worker, pipe) )
+            break;
+    pipe->nr_threads = i;
+
+    if ( !pipe->nr_threads )
+    {
+        pthread_cond_destroy(&pipe->cond);
+        pthread_mutex_destroy(&pipe->lock);
+        goto err;
+    }
+
+    DPRINTF("Preparing page batches with %u threads", pipe->nr_threads);
+    ctx->save.pipeline = pipe;
+    return;
+
+ err:
+    for ( i = 0; i < SAVE_NR_BATCHES; i++ )
+        free(pipe->batches[i].pfns);
+    free(pipe);
+}
+
+static void teardown_pipeline(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_pipeline *pipe = ctx->save.pipeline;
+    unsigned i;
+
+    if ( !pipe )
+        return;
+
+    /* Drop the batches left over after an error. */
+    while ( pipe->tail != pipe->head )
+        write_oldest_batch(ctx, true);
+
+    pthread_mutex_lock(&pipe->lock);
+    pipe->exit = true;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+
+    for ( i = 0; i < pipe->nr_threads; i++ )
+        pthread_join(pipe->threads[i], NULL);
+
+    pthread_cond_destroy(&pipe->cond);
+    pthread_mutex_destroy(&pipe->lock);
+
+    for ( i = 0; i < SAVE_NR_BATCHES; i++ )
+        free(pipe->batches[i].pfns);
+    free(pipe);
+    ctx->save.pipeline = NULL;
+}
+
+/*
+ * Queue the batch of pfns in ctx->save.batch_pfns for the stream.
+ */
+static int queue_batch(struct xc_sr_context *ctx)
+{
+    int rc;
+
+    if ( ctx->save.nr_batch_pfns == 0 )
+        return 0;
+
+    rc = ctx->save.pipeline ? submit_batch(ctx) : write_batch(ctx);
+
+    if ( !rc )
+    {
+        VALGRIND_MAKE_MEM_UNDEFINED(ctx->save.batch_pfns,
+                                    MAX_BATCH_SIZE *
+                                    sizeof(*ctx->save.batch_pfns));
+    }
+
+    return rc;
+}
+
+/*
+ * Flush a batch of pfns, and all the ones queued before, into the stream.
+ */
+static int flush_batch(struct xc_sr_context *ctx)
+{
+    int rc = queue_batch(ctx);
+
+    if ( !rc )
+        rc = drain_batches(ctx);
+
+    /* Whatever comes next may depend on the page data being in place. */
+    if ( !rc && ctx->save.data_unsynced )
+    {
+        rc = write_data_sync_records(ctx);
+        ctx->save.data_unsynced = false;
+    }
+
+    return rc;
+}
+
+/*
+ * Add a single pfn to the batch, queueing the batch if full.
+ */
+static int add_to_batch(struct xc_sr_context *ctx, xen_pfn_t pfn)
+{
+    int rc = 0;
+
+    if ( ctx->save.nr_batch_pfns == MAX_BATCH_SIZE )
+        rc = queue_batch(ctx);
+
+    if ( rc == 0 )
+        ctx->save.batch_pfns[ctx->save.nr_batch_pfns++] = pfn;
+
+    return rc;
+}
+
+/*
+ * Pause/suspend the domain, and refresh ctx->dominfo if required.
+ */
+static int suspend_domain(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+
+    /* TODO: Properly specify the return value from this callback.  All
+     * implementations currently appear to return 1 for success, whereas
+     * the legacy code checks for != 0. */
+    int cb_rc = ctx->save.callbacks->suspend(ctx->save.callbacks->data);
+
+    if ( cb_rc == 0 )
+    {
+        ERROR("save callback suspend() failed: %d", cb_rc);
+        return -1;
+    }
+
+    /* Refresh domain information. */
+    if ( (xc_domain_getinfo(xch, ctx->domid, 1, &ctx->dominfo) != 1) ||
+         (ctx->dominfo.domid != ctx->domid) )
+    {
+        PERROR("Unable to refresh domain information");
+        return -1;
+    }
+
+    /* Confirm the domain has actually been paused. */
+    if ( !ctx->dominfo.shutdown ||
+         (ctx->dominfo.shutdown_reason != SHUTDOWN_suspend) )
+    {
+        ERROR("Domain has not been suspended: shutdown %d, reason %d",
+              ctx->dominfo.shutdown, ctx->dominfo.shutdown_reason);
+        return -1;
+    }
+
+    xc_report_progress_single(xch, "Domain now suspended");
+
+    return 0;
+}
+
+/*
+ * Send a subset of pages in the guests p2m, according to the dirty bitmap.
+ * Used for each subsequent iteration of the live migration loop.
+ *
+ * Bitmap is bounded by p2m_size.
+ */
+static int send_dirty_pages(struct xc_sr_context *ctx,
+                            unsigned long entries)
+{
+    xc_interface *xch = ctx->xch;
+    xen_pfn_t p;
+    unsigned long written;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    for ( p = 0, written = 0; p < ctx->save.p2m_size; ++p )
+    {
+        if ( !test_bit(p, dirty_bitmap) )
+            continue;
+
+        rc = add_to_batch(ctx, p);
+        if ( rc )
+            return rc;
+
+        /* Update progress every 4MB worth of memory sent. */
+        if ( (written & ((1U << (22 - 12)) - 1)) == 0 )
+            xc_report_progress_step(xch, written, entries);
+
+        ++written;
+    }
+
+    rc = flush_batch(ctx);
+    if ( rc )
+        return rc;
+
+    if ( written > entries )
+        DPRINTF("Bitmap contained more entries than expected...");
+
+    xc_report_progress_step(xch, entries, entries);
+
+    return ctx->save.ops.check_vm_state(ctx);
+}
+
+/*
+ * Send the pages drained off the dirty ring.  Used for the iterations of the
+ * live migration loop when Xen provides one.
+ */
+static int send_dirty_ring_pages(struct xc_sr_context *ctx,
+                                 unsigned long entries)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned long i;
+    int rc;
+
+    for ( i = 0; i < entries; ++i )
+    {
+        xen_pfn_t p = ctx->save.dirty_gfns[i];
+
+        if ( p >= ctx->save.p2m_size )
+            continue;
+
+        rc = add_to_batch(ctx, p);
+        if ( rc )
+            return rc;
+
+        /* Update progress every 4MB worth of memory sent. */
+        if ( (i & ((1U << (22 - 12)) - 1)) == 0 )
+            xc_report_progress_step(xch, i, entries);
+    }
+
+    rc = flush_batch(ctx);
+    if ( rc )
+        return rc;
+
+    xc_report_progress_step(xch, entries, entries);
+
+    return ctx->save.ops.check_vm_state(ctx);
+}
+
+/*
+ * Send all pages in the guests p2m.  Used as the first iteration of the live
+ * migration loop, and for a non-live save.
+ */
+static int send_all_pages(struct xc_sr_context *ctx)
+{
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    bitmap_set(dirty_bitmap, ctx->save.p2m_size);
+
+    return send_dirty_pages(ctx, ctx->save.p2m_size);
+}
+
+static int enable_logdirty(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    int on1 = 0, off = 0, on2 = 0;
+    int rc;
+
+    /* This juggling is required if logdirty is enabled for VRAM tracking. */
     rc = xc_shadow_control(xch, ctx->domid,
                            XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY,
                            NULL, 0, NULL, 0, NULL);
@@ -446,45 +1418,280 @@ static int enable_logdirty(struct xc_sr_context *ctx)
     return 0;
 }
 
-static int update_progress_string(struct xc_sr_context *ctx, char **str)
+/*
+ * Enough ring entries for 1GB worth of pages to get dirtied between two
+ * iterations before Xen has to drop some.
+ */
+#define DIRTY_RING_ENTRIES (1U << 18)
+
+static void teardown_dirty_ring(struct xc_sr_context *ctx)
+{
+    if ( !ctx->save.dirty_gfns )
+        return;
+
+    xc_logdirty_ring_setup(ctx->xch, ctx->domid, 0);
+    free(ctx->save.dirty_gfns);
+    ctx->save.dirty_gfns = NULL;
+}
+
+/*
+ * Try to have Xen queue up dirtied GFNs for us, so that the cost of an
+ * iteration scales with the number of pages dirtied rather than with the
+ * size of the guest.  Not being able to is fine: the bitmap still works.
+ */
+static void setup_dirty_ring(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+
+    ctx->save.dirty_gfns = malloc(DIRTY_RING_ENTRIES *
+                                  sizeof(*ctx->save.dirty_gfns));
+    if ( !ctx->save.dirty_gfns )
+        return;
+
+    /*
+     * Pages dirtied before the ring got set up are only recorded in the
+     * bitmap.  Clear it, as the first iteration sends everything anyway.
+     */
+    if ( xc_logdirty_ring_setup(xch, ctx->domid, DIRTY_RING_ENTRIES) ||
+         xc_shadow_control(xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
+                           NULL, ctx->save.p2m_size, NULL, 0, NULL) < 0 )
+    {
+        DPRINTF("No dirty ring, using the logdirty bitmap only");
+        teardown_dirty_ring(ctx);
+    }
+}
+
+static int update_progress_string(struct xc_sr_context *ctx, char **str)
+{
+    xc_interface *xch = ctx->xch;
+    char *new_str = NULL;
+    unsigned int iter = ctx->save.stats.iteration;
+
+    if ( asprintf(&new_str, "Frames iteration %u", iter) == -1 )
+    {
+        PERROR("Unable to allocate new progress string");
+        return -1;
+    }
+
+    free(*str);
+    *str = new_str;
+
+    xc_set_progress_prefix(xch, *str);
+    return 0;
+}
+
+/*
+ * This is the live migration precopy policy - it's called periodically during
+ * the precopy phase of live migrations, and is responsible for deciding when
+ * the precopy phase should terminate and what should be done next.
+ *
+ * The policy implemented here behaves identically to the policy previously
+ * hard-coded into xc_domain_save() - it proceeds to the stop-and-copy phase of
+ * the live migration when there are either fewer than 50 dirty pages, or more
+ * than 5 precopy rounds have completed.
+ */
+#define SPP_MAX_ITERATIONS      5
+#define SPP_TARGET_DIRTY_COUNT 50
+
+static int simple_precopy_policy(struct precopy_stats stats, void *user)
+{
+    return ((stats.dirty_count >= 0 &&
+            stats.dirty_count < SPP_TARGET_DIRTY_COUNT) ||
+            stats.iteration >= SPP_MAX_ITERATIONS)
+        ? XGS_POLICY_STOP_AND_COPY
+        : XGS_POLICY_CONTINUE_PRECOPY;
+}
+
+/*
+ * Adaptive precopy policy, used when asked for a maximum downtime.  Each
+ * pass over the dirty pages measures how fast the stream takes pages, and
+ * how fast the guest dirties them meanwhile.  The guest gets suspended once
+ * the pages it will dirty while the next pass is sent are expected to take
+ * no longer than the downtime to send.
+ *
+ * Passes which don't shrink the dirty set by at least a tenth count as
+ * stalled.  After a few of them, the vcpus get throttled further with a
+ * scheduler cap if auto-converge is on, or the guest just gets suspended.
+ */
+#define APP_MAX_ITERATIONS   30
+#define APP_STALLED_PASSES    3
+#define APP_THROTTLE_INITIAL 20
+#define APP_THROTTLE_STEP    10
+#define APP_THROTTLE_MAX     99
+
+static uint64_t elapsed_us(const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - since->tv_sec) * 1000000ULL +
+        (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+/*
+ * Cap the domain to what is left of its vcpus' time after taking percent
+ * of it away, or lift our cap if percent is 0.  Only credit and credit2
+ * have caps.
+ */
+static int throttle_vcpus(struct xc_sr_context *ctx, unsigned percent)
+{
+    xc_interface *xch = ctx->xch;
+    xc_cpupoolinfo_t *pool;
+    uint32_t sched_id;
+    unsigned long cap;
+    uint16_t cur;
+    int rc;
+    union {
+        struct xen_domctl_sched_credit credit;
+        struct xen_domctl_sched_credit2 credit2;
+    } sdom;
+
+    pool = xc_cpupool_getinfo(xch, ctx->dominfo.cpupool);
+    if ( !pool )
+    {
+        PERROR("Failed to get the scheduler of cpupool %u",
+               ctx->dominfo.cpupool);
+        return -1;
+    }
+    sched_id = pool->sched_id;
+    xc_cpupool_infofree(xch, pool);
+
+    switch ( sched_id )
+    {
+    case XEN_SCHEDULER_CREDIT:
+        rc = xc_sched_credit_domain_get(xch, ctx->domid, &sdom.credit);
+        cur = sdom.credit.cap;
+        break;
+
+    case XEN_SCHEDULER_CREDIT2:
+        rc = xc_sched_credit2_domain_get(xch, ctx->domid, &sdom.credit2);
+        cur = sdom.credit2.cap;
+        break;
+
+    default:
+        ERROR("Can't throttle vcpus with scheduler %u", sched_id);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    if ( rc )
+    {
+        PERROR("Failed to get the scheduler parameters of the domain");
+        return rc;
+    }
+
+    if ( !ctx->save.policy.throttle )
+        ctx->save.policy.orig_cap = cur;
+
+    /* Caps are in percent of a pcpu, for the whole domain. */
+    cap = ctx->save.policy.orig_cap;
+    if ( percent )
+    {
+        cap = (ctx->dominfo.max_vcpu_id + 1UL) * (100 - percent);
+        cap = min(cap, (unsigned long)UINT16_MAX);
+        if ( ctx->save.policy.orig_cap )
+            cap = min(cap, (unsigned long)ctx->save.policy.orig_cap);
+    }
+
+    if ( sched_id == XEN_SCHEDULER_CREDIT )
+    {
+        sdom.credit.cap = cap;
+        rc = xc_sched_credit_domain_set(xch, ctx->domid, &sdom.credit);
+    }
+    else
+    {
+        sdom.credit2.cap = cap;
+        rc = xc_sched_credit2_domain_set(xch, ctx->domid, &sdom.credit2);
+    }
+
+    if ( rc )
+    {
+        PERROR("Failed to set the scheduler cap of the domain to %lu", cap);
+        return rc;
+    }
+
+    ctx->save.policy.throttle = percent;
+
+    return 0;
+}
+
+static int adaptive_precopy_policy(struct precopy_stats stats, void *user)
 {
+    struct xc_sr_context *ctx = user;
     xc_interface *xch = ctx->xch;
-    char *new_str = NULL;
-    unsigned int iter = ctx->save.stats.iteration;
+    typeof(ctx->save.policy) *p = &ctx->save.policy;
+    unsigned long max_downtime_ms = ctx->save.callbacks->max_downtime_ms;
+    uint64_t us = elapsed_us(&p->pass_start) ?: 1;
+    unsigned long left, downtime_ms;
 
-    if ( asprintf(&new_str, "Frames iteration %u", iter) == -1 )
+    /* A pass has just been sent. */
+    if ( stats.dirty_count < 0 )
     {
-        PERROR("Unable to allocate new progress string");
-        return -1;
+        p->send_rate = p->pass_pages * 1000000ULL / us;
+        return XGS_POLICY_CONTINUE_PRECOPY;
     }
 
-    free(*str);
-    *str = new_str;
+    if ( stats.iteration )
+    {
+        p->dirty_rate = stats.dirty_count * 1000000ULL / us;
 
-    xc_set_progress_prefix(xch, *str);
-    return 0;
-}
+        /* What the next pass leaves behind, to be sent while paused. */
+        left = p->send_rate
+            ? min((unsigned long)stats.dirty_count,
+                  (unsigned long)((uint64_t)stats.dirty_count *
+                                  p->dirty_rate / p->send_rate))
+            : stats.dirty_count;
+        downtime_ms = p->send_rate ? left * 1000ULL / p->send_rate : ~0UL;
 
-/*
- * This is the live migration precopy policy - it's called periodically during
- * the precopy phase of live migrations, and is responsible for deciding when
- * the precopy phase should terminate and what should be done next.
- *
- * The policy implemented here behaves identically to the policy previously
- * hard-coded into xc_domain_save() - it proceeds to the stop-and-copy phase of
- * the live migration when there are either fewer than 50 dirty pages, or more
- * than 5 precopy rounds have completed.
- */
-#define SPP_MAX_ITERATIONS      5
-#define SPP_TARGET_DIRTY_COUNT 50
+        DPRINTF("Pass %u: %ld pages dirty, sending %lu pages/s, "
+                "dirtying %lu pages/s, expected downtime %lums",
+                stats.iteration, stats.dirty_count, p->send_rate,
+                p->dirty_rate, downtime_ms);
 
-static int simple_precopy_policy(struct precopy_stats stats, void *user)
-{
-    return ((stats.dirty_count >= 0 &&
-            stats.dirty_count < SPP_TARGET_DIRTY_COUNT) ||
-            stats.iteration >= SPP_MAX_ITERATIONS)
-        ? XGS_POLICY_STOP_AND_COPY
-        : XGS_POLICY_CONTINUE_PRECOPY;
+        if ( downtime_ms <= max_downtime_ms )
+            return XGS_POLICY_STOP_AND_COPY;
+
+        if ( stats.iteration >= APP_MAX_ITERATIONS )
+        {
+            DPRINTF("No convergence after %u passes", stats.iteration);
+            return XGS_POLICY_STOP_AND_COPY;
+        }
+
+        if ( stats.dirty_count * 10UL > p->last_dirty * 9UL )
+            p->stalled++;
+        else
+            p->stalled = 0;
+
+        if ( p->stalled >= APP_STALLED_PASSES )
+        {
+            unsigned throttle = p->throttle ? p->throttle + APP_THROTTLE_STEP
+                                            : APP_THROTTLE_INITIAL;
+
+            if ( !p->auto_converge || p->throttle == APP_THROTTLE_MAX )
+            {
+                DPRINTF("Pre-copy stalled, stopping");
+                return XGS_POLICY_STOP_AND_COPY;
+            }
+
+            throttle = min(throttle, (unsigned)APP_THROTTLE_MAX);
+            if ( throttle_vcpus(ctx, throttle) )
+            {
+                /* Can't throttle: just stop trying to. */
+                p->auto_converge = false;
+                return XGS_POLICY_STOP_AND_COPY;
+            }
+
+            DPRINTF("Pre-copy stalled, throttling vcpus by %u%%", throttle);
+            p->stalled = 0;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &p->pass_start);
+    p->pass_pages = stats.dirty_count;
+    p->last_dirty = stats.dirty_count;
+
+    return XGS_POLICY_CONTINUE_PRECOPY;
 }
 
 /*
@@ -496,6 +1703,8 @@ static int send_memory_live(struct xc_sr_context *ctx)
     xc_shadow_op_stats_t stats = { 0, ctx->save.p2m_size };
     char *progress_str = NULL;
     unsigned int x = 0;
+    long ring_entries = -1;
+    unsigned long drained = 0, i;
     int rc;
     int policy_decision;
 
@@ -516,7 +1725,17 @@ static int send_memory_live(struct xc_sr_context *ctx)
     policy_stats = &ctx->save.stats;
 
     if ( precopy_policy == NULL )
-         precopy_policy = simple_precopy_policy;
+    {
+        if ( ctx->save.callbacks->max_downtime_ms )
+        {
+            precopy_policy = adaptive_precopy_policy;
+            data = ctx;
+        }
+        else
+            precopy_policy = simple_precopy_policy;
+    }
+
+    setup_dirty_ring(ctx);
 
     bitmap_set(dirty_bitmap, ctx->save.p2m_size);
 
@@ -531,7 +1750,9 @@ static int send_memory_live(struct xc_sr_context *ctx)
             if ( rc )
                 goto out;
 
-            rc = send_dirty_pages(ctx, stats.dirty_count);
+            rc = ring_entries >= 0
+                ? send_dirty_ring_pages(ctx, ring_entries)
+                : send_dirty_pages(ctx, stats.dirty_count);
             if ( rc )
                 goto out;
         }
@@ -548,6 +1769,30 @@ static int send_memory_live(struct xc_sr_context *ctx)
         if ( policy_decision != XGS_POLICY_CONTINUE_PRECOPY )
            break;
 
+        if ( ctx->save.dirty_gfns )
+        {
+            if ( !xc_logdirty_ring_drain(xch, ctx->domid,
+                                         ctx->save.dirty_gfns,
+                                         DIRTY_RING_ENTRIES, &drained) )
+            {
+                ring_entries = drained;
+                stats.dirty_count = ring_entries;
+                policy_stats->dirty_count = stats.dirty_count;
+                continue;
+            }
+
+            ring_entries = -1;
+
+            if ( errno != EOVERFLOW )
+            {
+                PERROR("Failed to drain dirty ring");
+                rc = -1;
+                goto out;
+            }
+
+            DPRINTF("Dirty ring overflowed, falling back to the bitmap");
+        }
+
         if ( xc_shadow_control(
                  xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
                  &ctx->save.dirty_bitmap_hbuf, ctx->save.p2m_size,
@@ -558,11 +1803,26 @@ static int send_memory_live(struct xc_sr_context *ctx)
             goto out;
         }
 
+        /*
+         * GFNs drained before the ring overflowed are no longer in Xen's
+         * bitmap, so fold them back into ours.
+         */
+        for ( i = 0; i < drained; ++i )
+        {
+            xen_pfn_t p = ctx->save.dirty_gfns[i];
+
+            if ( p < ctx->save.p2m_size &&
+                 !test_and_set_bit(p, dirty_bitmap) )
+                stats.dirty_count++;
+        }
+        drained = 0;
+
         policy_stats->dirty_count = stats.dirty_count;
 
     }
 
  out:
+    teardown_dirty_ring(ctx);
     xc_set_progress_prefix(xch, NULL);
     free(progress_str);
     return rc;
@@ -683,6 +1943,264 @@ static int suspend_and_send_dirty(struct xc_sr_context *ctx)
     return rc;
 }
 
+/* 8MB worth of pfns, well within REC_LENGTH_MAX. */
+#define POSTCOPY_PFNS_PER_RECORD (1U << 20)
+
+static int write_postcopy_pfns(struct xc_sr_context *ctx, uint64_t *pfns,
+                               unsigned count)
+{
+    struct xc_sr_record rec =
+    {
+        .type = REC_TYPE_POSTCOPY_PFNS,
+        .length = count * sizeof(*pfns),
+        .data = pfns,
+    };
+
+    return count ? write_record(ctx, &rec) : 0;
+}
+
+/*
+ * Suspend the domain, and list the pages dirtied since the last pre-copy
+ * round in POSTCOPY_PFNS records, rather than sending them.  Pfns without
+ * data go out in PAGE_DATA records straight away.  The pfns left outstanding
+ * stay set in the dirty bitmap.
+ */
+static int suspend_and_list_postcopy_pfns(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    xc_shadow_op_stats_t stats = { 0, ctx->save.p2m_size };
+    xen_pfn_t p, *batch = NULL, *types = NULL;
+    uint64_t *pfns = NULL;
+    unsigned i, nr_batch = 0, nr_pfns = 0;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    rc = suspend_domain(ctx);
+    if ( rc )
+        goto out;
+
+    rc = -1;
+    if ( xc_shadow_control(
+             xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
+             HYPERCALL_BUFFER(dirty_bitmap), ctx->save.p2m_size,
+             NULL, XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL, &stats) !=
+         ctx->save.p2m_size )
+    {
+        PERROR("Failed to retrieve logdirty bitmap");
+        goto out;
+    }
+
+    bitmap_or(dirty_bitmap, ctx->save.deferred_pages, ctx->save.p2m_size);
+    bitmap_clear(ctx->save.deferred_pages, ctx->save.p2m_size);
+    ctx->save.nr_deferred_pages = 0;
+
+    batch = malloc(MAX_BATCH_SIZE * sizeof(*batch));
+    types = malloc(MAX_BATCH_SIZE * sizeof(*types));
+    pfns = malloc(POSTCOPY_PFNS_PER_RECORD * sizeof(*pfns));
+    if ( !batch || !types || !pfns )
+    {
+        ERROR("Unable to allocate memory for listing post-copy pfns");
+        goto out;
+    }
+
+    xc_set_progress_prefix(xch, "Post-copy pfns");
+
+    for ( p = 0; p <= ctx->save.p2m_size; ++p )
+    {
+        if ( p < ctx->save.p2m_size )
+        {
+            if ( !test_bit(p, dirty_bitmap) )
+                continue;
+
+            batch[nr_batch] = p;
+            types[nr_batch++] = ctx->save.ops.pfn_to_gfn(ctx, p);
+            if ( nr_batch < MAX_BATCH_SIZE )
+                continue;
+        }
+
+        if ( !nr_batch )
+            continue;
+
+        if ( xc_get_pfn_type_batch(xch, ctx->domid, nr_batch, types) )
+        {
+            PERROR("Failed to get types for pfn batch");
+            goto out;
+        }
+
+        for ( i = 0; i < nr_batch; ++i )
+        {
+            switch ( types[i] )
+            {
+            case XEN_DOMCTL_PFINFO_BROKEN:
+            case XEN_DOMCTL_PFINFO_XALLOC:
+            case XEN_DOMCTL_PFINFO_XTAB:
+                /* Nothing to fetch on demand. */
+                clear_bit(batch[i], dirty_bitmap);
+                if ( add_to_batch(ctx, batch[i]) )
+                    goto out;
+                continue;
+            }
+
+            pfns[nr_pfns++] = batch[i];
+            if ( nr_pfns == POSTCOPY_PFNS_PER_RECORD )
+            {
+                if ( write_postcopy_pfns(ctx, pfns, nr_pfns) )
+                    goto out;
+                nr_pfns = 0;
+            }
+        }
+        nr_batch = 0;
+    }
+
+    if ( flush_batch(ctx) || write_postcopy_pfns(ctx, pfns, nr_pfns) )
+        goto out;
+
+    rc = 0;
+
+ out:
+    xc_set_progress_prefix(xch, NULL);
+    free(pfns);
+    free(types);
+    free(batch);
+    return rc;
+}
+
+/*
+ * Post-copy phase, once the guest state is in the stream.  Hands the guest
+ * over to the receiver, then sends the outstanding pages: first the ones the
+ * receiver asks for in POSTCOPY_FAULT records on the back channel, as the
+ * resumed guest is waiting for them, and the rest in order meanwhile.
+ */
+static int send_memory_postcopy(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record transition = { REC_TYPE_POSTCOPY_TRANSITION, 0, NULL };
+    struct xc_sr_record rec = { 0, 0, NULL };
+    struct pollfd pfd = { .fd = ctx->save.recv_fd, .events = POLLIN };
+    unsigned long nr_outstanding = 0, total;
+    xen_pfn_t p, cursor = 0;
+    uint64_t *pfns;
+    unsigned i, n, count;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    for ( p = 0; p < ctx->save.p2m_size; ++p )
+        if ( test_bit(p, dirty_bitmap) )
+            ++nr_outstanding;
+    total = nr_outstanding;
+
+    DPRINTF("Transition to post-copy, %lu pages outstanding", total);
+
+    rc = write_record(ctx, &transition);
+    if ( rc )
+        goto out;
+
+    if ( ctx->save.callbacks->postcopy_transition )
+    {
+        rc = ctx->save.callbacks->postcopy_transition(
+            ctx->save.callbacks->data);
+        if ( rc <= 0 )
+        {
+            ERROR("save callback postcopy_transition() failed: %d", rc);
+            rc = -1;
+            goto out;
+        }
+    }
+
+    xc_set_progress_prefix(xch, "Post-copy");
+    ctx->save.in_postcopy = true;
+
+    while ( nr_outstanding )
+    {
+        rc = poll(&pfd, 1, 0);
+        if ( rc < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            PERROR("Failed to poll the back channel");
+            goto out;
+        }
+
+        if ( rc > 0 )
+        {
+            rc = read_record(ctx, ctx->save.recv_fd, &rec);
+            if ( rc )
+                goto out;
+
+            rc = -1;
+            if ( rec.type != REC_TYPE_POSTCOPY_FAULT ||
+                 rec.length % sizeof(*pfns) )
+            {
+                ERROR("Unexpected %s record (length %u) on the back channel",
+                      rec_type_to_str(rec.type), rec.length);
+                goto out;
+            }
+
+            pfns = rec.data;
+            count = rec.length / sizeof(*pfns);
+            for ( i = 0; i < count; ++i )
+            {
+                if ( pfns[i] >= ctx->save.p2m_size )
+                {
+                    ERROR("Invalid pfn %#"PRIx64" asked for", pfns[i]);
+                    goto out;
+                }
+
+                /* It may be on its way already. */
+                if ( !test_and_clear_bit(pfns[i], dirty_bitmap) )
+                    continue;
+
+                --nr_outstanding;
+                if ( add_to_batch(ctx, pfns[i]) )
+                    goto out;
+            }
+
+            free(rec.data);
+            rec.data = NULL;
+        }
+        else
+        {
+            /* Nothing asked for: push the next batch. */
+            for ( n = 0; cursor < ctx->save.p2m_size && n < MAX_BATCH_SIZE;
+                  ++cursor )
+            {
+                if ( !test_and_clear_bit(cursor, dirty_bitmap) )
+                    continue;
+
+                --nr_outstanding;
+                ++n;
+                rc = add_to_batch(ctx, cursor);
+                if ( rc )
+                    goto out;
+            }
+        }
+
+        rc = flush_batch(ctx);
+        if ( rc )
+            goto out;
+
+        xc_report_progress_step(xch, total - nr_outstanding, total);
+    }
+
+    if ( ctx->save.nr_deferred_pages )
+    {
+        ERROR("%lu pages could not be sent post-copy",
+              ctx->save.nr_deferred_pages);
+        rc = -1;
+        goto out;
+    }
+
+    rc = 0;
+
+ out:
+    ctx->save.in_postcopy = false;
+    xc_set_progress_prefix(xch, NULL);
+    free(rec.data);
+    return rc;
+}
+
 static int verify_frames(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
@@ -737,7 +2255,8 @@ static int send_domain_memory_live(struct xc_sr_context *ctx)
     if ( rc )
         goto out;
 
-    rc = suspend_and_send_dirty(ctx);
+    rc = ctx->save.postcopy ? suspend_and_list_postcopy_pfns(ctx)
+                            : suspend_and_send_dirty(ctx);
     if ( rc )
         goto out;
 
@@ -775,10 +2294,20 @@ static int send_domain_memory_nonlive(struct xc_sr_context *ctx)
 
     xc_set_progress_prefix(xch, "Frames");
 
+    if ( ctx->save.page_index )
+    {
+        rc = write_page_index_offset_record(ctx);
+        if ( rc )
+            goto err;
+    }
+
     rc = send_all_pages(ctx);
     if ( rc )
         goto err;
 
+    if ( ctx->save.page_index )
+        rc = write_page_index(ctx);
+
  err:
     return rc;
 }
@@ -809,6 +2338,9 @@ static int setup(struct xc_sr_context *ctx)
         goto err;
     }
 
+    setup_pipeline(ctx);
+    setup_zerocopy(ctx);
+
     rc = 0;
 
  err:
@@ -821,6 +2353,12 @@ static void cleanup(struct xc_sr_context *ctx)
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->save.dirty_bitmap_hbuf);
 
+    teardown_pipeline(ctx);
+    teardown_zerocopy(ctx);
+
+    /* Give a guest left running (e.g. after a failure) its vcpus back. */
+    if ( ctx->save.policy.throttle )
+        throttle_vcpus(ctx, 0);
 
     xc_shadow_control(xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_OFF,
                       NULL, 0, NULL, 0, NULL);
@@ -830,6 +2368,7 @@ static void cleanup(struct xc_sr_context *ctx)
 
     xc_hypercall_buffer_free_pages(xch, dirty_bitmap,
                                    NRPAGES(bitmap_size(ctx->save.p2m_size)));
+    free(ctx->save.index);
     free(ctx->save.deferred_pages);
     free(ctx->save.batch_pfns);
 }
@@ -855,6 +2394,13 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
     if ( rc )
         goto err;
 
+    if ( ctx->save.nr_data_fds )
+    {
+        rc = write_data_streams_records(ctx);
+        if ( rc )
+            goto err;
+    }
+
     rc = ctx->save.ops.start_of_stream(ctx);
     if ( rc )
         goto err;
@@ -890,6 +2436,13 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
         if ( rc )
             goto err;
 
+        if ( ctx->save.postcopy )
+        {
+            rc = send_memory_postcopy(ctx);
+            if ( rc )
+                goto err;
+        }
+
         if ( ctx->save.checkpointed != XC_MIG_STREAM_NONE )
         {
             /*
@@ -968,6 +2521,16 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
                    uint32_t flags, struct save_callbacks* callbacks,
                    int hvm, xc_migration_stream_t stream_type, int recv_fd)
+{
+    return xc_domain_save_streams(xch, io_fd, NULL, 0, dom, flags, callbacks,
+                                  hvm, stream_type, recv_fd);
+}
+
+int xc_domain_save_streams(xc_interface *xch, int io_fd,
+                           const int *data_fds, unsigned int nr_data_fds,
+                           uint32_t dom, uint32_t flags,
+                           struct save_callbacks* callbacks, int hvm,
+                           xc_migration_stream_t stream_type, int recv_fd)
 {
     struct xc_sr_context ctx =
         {
@@ -979,8 +2542,14 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.save.callbacks = callbacks;
     ctx.save.live  = !!(flags & XCFLAGS_LIVE);
     ctx.save.debug = !!(flags & XCFLAGS_DEBUG);
+    ctx.save.zero_pages = !!(flags & XCFLAGS_ZERO_PAGES);
+    ctx.save.postcopy = !!(flags & XCFLAGS_POSTCOPY);
+    ctx.save.policy.auto_converge = !!(flags & XCFLAGS_AUTO_CONVERGE);
+    ctx.save.page_index = !!(flags & XCFLAGS_PAGE_INDEX);
     ctx.save.checkpointed = stream_type;
     ctx.save.recv_fd = recv_fd;
+    ctx.save.data_fds = data_fds;
+    ctx.save.nr_data_fds = nr_data_fds;
 
     /* If altering migration_stream update this assert too. */
     assert(stream_type == XC_MIG_STREAM_NONE ||
@@ -1011,6 +2580,41 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
 
     ctx.domid = dom;
 
+    /* Only HAP guests can be paged, to fetch their memory on demand. */
+    if ( ctx.save.postcopy &&
+         (!ctx.dominfo.hvm || !ctx.save.live ||
+          ctx.save.checkpointed != XC_MIG_STREAM_NONE || recv_fd < 0) )
+    {
+        ERROR("Post-copy needs a live migration of an HVM domain, "
+              "with a back channel");
+        errno = EINVAL;
+        return -1;
+    }
+
+    /*
+     * Checkpoints and post-copy interleave page data with other records,
+     * which data streams don't keep in order.
+     */
+    if ( nr_data_fds &&
+         (ctx.save.postcopy || ctx.save.checkpointed != XC_MIG_STREAM_NONE) )
+    {
+        ERROR("Data streams can't be used with checkpoints or post-copy");
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Pages are sent once only, in order, into a single file. */
+    if ( ctx.save.page_index &&
+         (!ctx.dominfo.hvm || ctx.save.live ||
+          ctx.save.checkpointed != XC_MIG_STREAM_NONE || nr_data_fds ||
+          lseek(io_fd, 0, SEEK_CUR) < 0) )
+    {
+        ERROR("A page index needs a non-live save of an HVM domain to a "
+              "seekable file");
+        errno = EINVAL;
+        return -1;
+    }
+
     if ( ctx.dominfo.hvm )
     {
         ctx.save.ops = save_ops_x86_hvm;
@@ -7,41 +7,81 @@
 /*
  * Query for the HVM context and write an HVM_CONTEXT record into the stream.
  */
+/* vCPUs whose HVM context is got from Xen at a time. */
+#define HVM_CONTEXT_VCPU_CHUNK 32U
+
 static int write_hvm_context(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
-    int rc, hvm_buf_size;
+    unsigned int first, nr, nr_vcpus = ctx->dominfo.max_vcpu_id + 1;
+    int rc = -1, size, total, cur;
+    struct hvm_save_descriptor end;
     struct xc_sr_record hvm_rec =
     {
         .type = REC_TYPE_HVM_CONTEXT,
     };
 
-    hvm_buf_size = xc_domain_hvm_getcontext(xch, ctx->domid, 0, 0);
-    if ( hvm_buf_size < 0 )
+    /*
+     * The per-domain records, then those of the vCPUs a chunk at a time,
+     * so that Xen never needs to make up the whole context in one go.  The
+     * end marker the per-domain piece comes with goes last.
+     */
+    total = xc_domain_hvm_getcontext_vcpus(xch, ctx->domid, 0, 0,
+                                           XEN_DOMCTL_HVMCONTEXT_DOMAIN,
+                                           NULL, 0);
+    for ( first = 0; total >= 0 && first < nr_vcpus; first += nr )
+    {
+        nr = min(nr_vcpus - first, HVM_CONTEXT_VCPU_CHUNK);
+        size = xc_domain_hvm_getcontext_vcpus(xch, ctx->domid, first, nr,
+                                              0, NULL, 0);
+        total = size < 0 ? size : total + size;
+    }
+    if ( total < 0 )
     {
         PERROR("Couldn't get HVM context size from Xen");
-        rc = -1;
         goto out;
     }
 
-    hvm_rec.data = malloc(hvm_buf_size);
+    hvm_rec.data = malloc(total);
     if ( !hvm_rec.data )
     {
         PERROR("Couldn't allocate memory");
-        rc = -1;
         goto out;
     }
 
-    hvm_buf_size = xc_domain_hvm_getcontext(xch, ctx->domid,
-                                            hvm_rec.data, hvm_buf_size);
-    if ( hvm_buf_size < 0 )
+    size = xc_domain_hvm_getcontext_vcpus(xch, ctx->domid, 0, 0,
+                                          XEN_DOMCTL_HVMCONTEXT_DOMAIN,
+                                          hvm_rec.data, total);
+    if ( size < (int)sizeof(end) )
     {
         PERROR("Couldn't get HVM context from Xen");
-        rc = -1;
         goto out;
     }
+    cur = size - sizeof(end);
+    memcpy(&end, hvm_rec.data + cur, sizeof(end));
+    if ( end.typecode != 0 )
+    {
+        ERROR("HVM context doesn't finish with an end marker");
+        goto out;
+    }
+
+    for ( first = 0; first < nr_vcpus; first += nr )
+    {
+        nr = min(nr_vcpus - first, HVM_CONTEXT_VCPU_CHUNK);
+        size = xc_domain_hvm_getcontext_vcpus(xch, ctx->domid, first, nr, 0,
+                                              hvm_rec.data + cur,
+                                              total - cur - sizeof(end));
+        if ( size < 0 )
+        {
+            PERROR("Couldn't get HVM context of vcpus %u-%u from Xen",
+                   first, first + nr - 1);
+            goto out;
+        }
+        cur += size;
+    }
 
-    hvm_rec.length = hvm_buf_size;
+    memcpy(hvm_rec.data + cur, &end, sizeof(end));
+    hvm_rec.length = cur + sizeof(end);
     rc = write_record(ctx, &hvm_rec);
     if ( rc < 0 )
     {
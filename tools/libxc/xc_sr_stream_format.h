@@ -76,9 +76,19 @@ struct xc_sr_rhdr
 #define REC_TYPE_VERIFY                     0x0000000dU
 #define REC_TYPE_CHECKPOINT                 0x0000000eU
 #define REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST  0x0000000fU
+#define REC_TYPE_ZERO_PAGE_DATA             0x00000010U
+#define REC_TYPE_POSTCOPY_PFNS              0x00000011U
+#define REC_TYPE_POSTCOPY_TRANSITION        0x00000012U
+#define REC_TYPE_POSTCOPY_PAGE_DATA         0x00000013U
+#define REC_TYPE_POSTCOPY_FAULT             0x00000014U
+#define REC_TYPE_DATA_STREAMS               0x00000015U
+#define REC_TYPE_DATA_SYNC                  0x00000016U
 
 #define REC_TYPE_OPTIONAL             0x80000000U
 
+#define REC_TYPE_PAGE_INDEX_OFFSET          0x80000000U
+#define REC_TYPE_PAGE_INDEX                 0x80000001U
+
 /* PAGE_DATA */
 struct xc_sr_rec_page_data_header
 {
@@ -90,6 +100,12 @@ struct xc_sr_rec_page_data_header
 #define PAGE_DATA_PFN_MASK  0x000fffffffffffffULL
 #define PAGE_DATA_TYPE_MASK 0xf000000000000000ULL
 
+/* ZERO_PAGE_DATA: as PAGE_DATA, without any page data. */
+
+/* POSTCOPY_PAGE_DATA: as PAGE_DATA. */
+
+/* POSTCOPY_PFNS and POSTCOPY_FAULT: an array of uint64_t pfns. */
+
 /* X86_PV_INFO */
 struct xc_sr_rec_x86_pv_info
 {
@@ -138,6 +154,30 @@ struct xc_sr_rec_hvm_params
     struct xc_sr_rec_hvm_params_entry param[0];
 };
 
+/* DATA_STREAMS: index is 0 on the control stream, 1 to count otherwise. */
+struct xc_sr_rec_data_streams
+{
+    uint32_t count;
+    uint32_t index;
+};
+
+/* DATA_SYNC: no fields. */
+
+/* PAGE_INDEX_OFFSET */
+struct xc_sr_rec_page_index_offset
+{
+    uint64_t offset;
+};
+
+/* PAGE_INDEX: an array of entries. */
+struct xc_sr_rec_page_index_entry
+{
+    uint64_t pfn;
+    uint32_t count;
+    uint32_t type;
+    uint64_t offset;
+};
+
 #endif
 /*
  * Local variables:
@@ -39,49 +39,29 @@ int xc_vm_event_control(xc_interface *xch, uint32_t domain_id, unsigned int op,
     return rc;
 }
 
-void *xc_vm_event_enable(xc_interface *xch, uint32_t domain_id, int param,
-                         uint32_t *port)
+/*
+ * Map the ring page at pfn (populating it first if need be), issue the
+ * domctl enabling a ring on it, and remove the page from the guest's physmap
+ * again.  The caller has to have paused the domain.
+ */
+static void *vm_event_setup_ring(xc_interface *xch, uint32_t domain_id,
+                                 xen_pfn_t pfn, struct xen_domctl *domctl,
+                                 uint32_t *port)
 {
-    void *ring_page = NULL;
-    uint64_t pfn;
-    xen_pfn_t ring_pfn, mmap_pfn;
-    unsigned int op, mode;
-    int rc1, rc2, saved_errno;
-
-    if ( !port )
-    {
-        errno = EINVAL;
-        return NULL;
-    }
-
-    /* Pause the domain for ring page setup */
-    rc1 = xc_domain_pause(xch, domain_id);
-    if ( rc1 != 0 )
-    {
-        PERROR("Unable to pause domain\n");
-        return NULL;
-    }
-
-    /* Get the pfn of the ring page */
-    rc1 = xc_hvm_param_get(xch, domain_id, param, &pfn);
-    if ( rc1 != 0 )
-    {
-        PERROR("Failed to get pfn of ring page\n");
-        goto out;
-    }
+    void *ring_page;
+    xen_pfn_t ring_pfn = pfn, mmap_pfn = pfn;
+    int rc, saved_errno;
 
-    ring_pfn = pfn;
-    mmap_pfn = pfn;
-    rc1 = xc_get_pfn_type_batch(xch, domain_id, 1, &mmap_pfn);
-    if ( rc1 || mmap_pfn & XEN_DOMCTL_PFINFO_XTAB )
+    rc = xc_get_pfn_type_batch(xch, domain_id, 1, &mmap_pfn);
+    if ( rc || mmap_pfn & XEN_DOMCTL_PFINFO_XTAB )
     {
         /* Page not in the physmap, try to populate it */
-        rc1 = xc_domain_populate_physmap_exact(xch, domain_id, 1, 0, 0,
+        rc = xc_domain_populate_physmap_exact(xch, domain_id, 1, 0, 0,
                                               &ring_pfn);
-        if ( rc1 != 0 )
+        if ( rc != 0 )
         {
             PERROR("Failed to populate ring pfn\n");
-            goto out;
+            return NULL;
         }
     }
 
@@ -91,24 +71,80 @@ void *xc_vm_event_enable(xc_interface *xch, uint32_t domain_id, int param,
     if ( !ring_page )
     {
         PERROR("Could not map the ring page\n");
-        goto out;
+        return NULL;
+    }
+
+    domctl->cmd = XEN_DOMCTL_vm_event_op;
+    domctl->domain = domain_id;
+    rc = do_domctl(xch, domctl);
+    if ( rc != 0 )
+        PERROR("Failed to enable vm_event\n");
+    else
+    {
+        *port = domctl->u.vm_event_op.port;
+
+        /* Remove the ring_pfn from the guest's physmap */
+        rc = xc_domain_decrease_reservation_exact(xch, domain_id, 1, 0,
+                                                  &ring_pfn);
+        if ( rc != 0 )
+            PERROR("Failed to remove ring page from guest physmap");
+    }
+
+    if ( rc != 0 )
+    {
+        saved_errno = errno;
+        xenforeignmemory_unmap(xch->fmem, ring_page, 1);
+        errno = saved_errno;
+        ring_page = NULL;
+    }
+
+    return ring_page;
+}
+
+/* Unpause the domain after ring setup, dropping the ring if that fails. */
+static void vm_event_unpause(xc_interface *xch, uint32_t domain_id,
+                             void **ring_page)
+{
+    int saved_errno = errno;
+
+    if ( xc_domain_unpause(xch, domain_id) != 0 )
+    {
+        saved_errno = errno;
+        PERROR("Unable to unpause domain");
+        if ( *ring_page )
+            xenforeignmemory_unmap(xch->fmem, *ring_page, 1);
+        *ring_page = NULL;
+    }
+
+    errno = saved_errno;
+}
+
+void *xc_vm_event_enable(xc_interface *xch, uint32_t domain_id, int param,
+                         uint32_t *port)
+{
+    DECLARE_DOMCTL;
+    void *ring_page = NULL;
+    uint64_t pfn;
+    int rc;
+
+    if ( !port )
+    {
+        errno = EINVAL;
+        return NULL;
     }
 
     switch ( param )
     {
     case HVM_PARAM_PAGING_RING_PFN:
-        op = XEN_VM_EVENT_ENABLE;
-        mode = XEN_DOMCTL_VM_EVENT_OP_PAGING;
+        domctl.u.vm_event_op.mode = XEN_DOMCTL_VM_EVENT_OP_PAGING;
         break;
 
     case HVM_PARAM_MONITOR_RING_PFN:
-        op = XEN_VM_EVENT_ENABLE;
-        mode = XEN_DOMCTL_VM_EVENT_OP_MONITOR;
+        domctl.u.vm_event_op.mode = XEN_DOMCTL_VM_EVENT_OP_MONITOR;
         break;
 
     case HVM_PARAM_SHARING_RING_PFN:
-        op = XEN_VM_EVENT_ENABLE;
-        mode = XEN_DOMCTL_VM_EVENT_OP_SHARING;
+        domctl.u.vm_event_op.mode = XEN_DOMCTL_VM_EVENT_OP_SHARING;
         break;
 
     /*
@@ -117,42 +153,74 @@ void *xc_vm_event_enable(xc_interface *xch, uint32_t domain_id, int param,
      */
     default:
         errno = EINVAL;
-        rc1 = -1;
-        goto out;
+        return NULL;
     }
+    domctl.u.vm_event_op.op = XEN_VM_EVENT_ENABLE;
 
-    rc1 = xc_vm_event_control(xch, domain_id, op, mode, port);
-    if ( rc1 != 0 )
+    /* Pause the domain for ring page setup */
+    rc = xc_domain_pause(xch, domain_id);
+    if ( rc != 0 )
     {
-        PERROR("Failed to enable vm_event\n");
-        goto out;
+        PERROR("Unable to pause domain\n");
+        return NULL;
     }
 
-    /* Remove the ring_pfn from the guest's physmap */
-    rc1 = xc_domain_decrease_reservation_exact(xch, domain_id, 1, 0, &ring_pfn);
-    if ( rc1 != 0 )
-        PERROR("Failed to remove ring page from guest physmap");
+    /* Get the pfn of the ring page */
+    rc = xc_hvm_param_get(xch, domain_id, param, &pfn);
+    if ( rc != 0 )
+        PERROR("Failed to get pfn of ring page\n");
+    else
+        ring_page = vm_event_setup_ring(xch, domain_id, pfn, &domctl, port);
+
+    vm_event_unpause(xch, domain_id, &ring_page);
+
+    return ring_page;
+}
 
- out:
-    saved_errno = errno;
+void *xc_vm_event_add_ring(xc_interface *xch, uint32_t domain_id,
+                           unsigned int mode, unsigned int first_vcpu,
+                           unsigned int nr_vcpus, uint32_t *port)
+{
+    DECLARE_DOMCTL;
+    void *ring_page = NULL;
+    xen_pfn_t max_gpfn;
+    int rc;
 
-    rc2 = xc_domain_unpause(xch, domain_id);
-    if ( rc1 != 0 || rc2 != 0 )
+    if ( !port )
     {
-        if ( rc2 != 0 )
-        {
-            if ( rc1 == 0 )
-                saved_errno = errno;
-            PERROR("Unable to unpause domain");
-        }
+        errno = EINVAL;
+        return NULL;
+    }
 
-        if ( ring_page )
-            xenforeignmemory_unmap(xch->fmem, ring_page, 1);
-        ring_page = NULL;
+    domctl.u.vm_event_op.op = XEN_VM_EVENT_ADD_RING;
+    domctl.u.vm_event_op.mode = mode;
+    domctl.u.vm_event_op.first_vcpu = first_vcpu;
+    domctl.u.vm_event_op.nr_vcpus = nr_vcpus;
 
-        errno = saved_errno;
+    /* Pause the domain for ring page setup */
+    rc = xc_domain_pause(xch, domain_id);
+    if ( rc != 0 )
+    {
+        PERROR("Unable to pause domain\n");
+        return NULL;
     }
 
+    /*
+     * Use a pfn above anything the guest has in its physmap: it is only
+     * there until Xen has taken hold of the page.
+     */
+    rc = xc_domain_maximum_gpfn(xch, domain_id, &max_gpfn);
+    if ( rc < 0 )
+        PERROR("Failed to get the maximum gpfn\n");
+    else
+    {
+        domctl.u.vm_event_op.ring_gfn = max_gpfn + 1;
+        ring_page = vm_event_setup_ring(xch, domain_id, max_gpfn + 1,
+                                        &domctl, port);
+    }
+
+    vm_event_unpause(xch, domain_id, &ring_page);
+
     return ring_page;
 }
 
@@ -428,9 +428,14 @@ def libxl_C_type_to_json(ty, v, indent = "    "):
         s = indent + s
     return s.replace("\n", "\n%s" % indent).rstrip(indent)
 
+# Number of map position variables declared in the current parse function.
+json_map_pos = 0
+
 def libxl_C_type_parse_json(ty, w, v, indent = "    ", parent = None, discriminator = None):
+    global json_map_pos
     s = ""
     if parent is None:
+        json_map_pos = 0
         s += "int rc = 0;\n"
         s += "const libxl__json_object *x __attribute__((__unused__)) = o;\n"
 
@@ -490,14 +495,20 @@ def libxl_C_type_parse_json(ty, w, v, indent = "    ", parent = None, discrimina
     elif isinstance(ty, idl.Struct) and (parent is None or ty.json_parse_fn is None):
         if discriminator is not None:
             raise Exception("Only KeyedUnion can have discriminator")
+        # Fields are looked up in the order they are generated in, so
+        # look for each one after the previous one found.
+        pos = "map_pos%d" % json_map_pos
+        json_map_pos += 1
+        s += "{\n"
+        s += "int %s = 0;\n" % pos
         for f in [f for f in ty.fields if not f.const and not f.type.private]:
             saved_var_name = "saved_%s" % f.name
             s += "{\n"
             s += "    const libxl__json_object *%s = x;\n" % saved_var_name
             if isinstance(f.type, idl.KeyedUnion):
                 for x in f.type.fields:
-                    s += "    x = libxl__json_map_get(\"%s\", %s, JSON_MAP);\n" % \
-                         (f.type.keyvar.name + "." + x.name, w)
+                    s += "    x = libxl__json_map_get_from(\"%s\", %s, JSON_MAP, &%s);\n" % \
+                         (f.type.keyvar.name + "." + x.name, w, pos)
                     s += "    if (x) {\n"
                     (nparent, fexpr) = ty.member(v, f.type.keyvar, parent is None)
                     s += "        %s_init_%s(%s, %s);\n" % (ty.typename, f.type.keyvar.name, v, x.enumname)
@@ -505,13 +516,14 @@ def libxl_C_type_parse_json(ty, w, v, indent = "    ", parent = None, discrimina
                     s += libxl_C_type_parse_json(f.type, "x", fexpr, "  ", nparent, x.enumname)
                     s += "    }\n"
             else:
-                s += "    x = libxl__json_map_get(\"%s\", %s, %s);\n" % (f.name, w, f.type.json_parse_type)
+                s += "    x = libxl__json_map_get_from(\"%s\", %s, %s, &%s);\n" % (f.name, w, f.type.json_parse_type, pos)
                 s += "    if (x) {\n"
                 (nparent,fexpr) = ty.member(v, f, parent is None)
                 s += libxl_C_type_parse_json(f.type, "x", fexpr, "        ", nparent)
                 s += "    }\n"
             s += "    x = %s;\n" % saved_var_name
             s += "}\n"
+        s += "}\n"
     else:
         if discriminator is not None:
             raise Exception("Only KeyedUnion can have discriminator")
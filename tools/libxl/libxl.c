@@ -62,6 +62,7 @@ int libxl_ctx_alloc(libxl_ctx **pctx, int version,
     libxl__ev_fd_init(&ctx->evtchn_efd);
 
     LIBXL_LIST_INIT(&ctx->aos_inprogress);
+    LIBXL_LIST_INIT(&ctx->qmp_held);
 
     LIBXL_TAILQ_INIT(&ctx->death_list);
     libxl__ev_xswatch_init(&ctx->death_watch);
@@ -155,6 +156,10 @@ int libxl_ctx_free(libxl_ctx *ctx)
     while ((eject = LIBXL_LIST_FIRST(&CTX->disk_eject_evgens)))
         libxl__evdisable_disk_eject(gc, eject);
 
+    libxl_evgen_domain_create_stages *stages;
+    while ((stages = LIBXL_LIST_FIRST(&CTX->create_stage_evgens)))
+        libxl__evdisable_domain_create_stages(gc, stages);
+
     libxl_childproc_setmode(CTX,0,0);
     for (i = 0; i < ctx->watch_nslots; i++)
         assert(!libxl__watch_slot_contents(gc, i));
@@ -168,9 +173,12 @@ int libxl_ctx_free(libxl_ctx *ctx)
     assert(LIBXL_TAILQ_EMPTY(&ctx->etimes));
     assert(LIBXL_LIST_EMPTY(&ctx->evtchns_waiting));
     assert(LIBXL_LIST_EMPTY(&ctx->aos_inprogress));
+    assert(LIBXL_LIST_EMPTY(&ctx->qmp_held));
 
     if (ctx->xch) xc_interface_close(ctx->xch);
     libxl_version_info_dispose(&ctx->version_info);
+    free(ctx->numa_load.vcpus_on_node);
+    libxl_bitmap_dispose(&ctx->numa_load.cpumap);
     if (ctx->xsh) xs_daemon_close(ctx->xsh);
     if (ctx->xce) xenevtchn_close(ctx->xce);
 
@@ -374,6 +382,9 @@ int libxl_get_physinfo(libxl_ctx *ctx, libxl_physinfo *physinfo)
     physinfo->scrub_pages = xcphysinfo.scrub_pages;
     physinfo->outstanding_pages = xcphysinfo.outstanding_pages;
     physinfo->max_possible_mfn = xcphysinfo.max_mfn;
+    physinfo->superpage_pool_pages = xcphysinfo.superpage_pool_pages;
+    physinfo->superpage_pool_target_pages =
+        xcphysinfo.superpage_pool_target_pages;
     l = xc_sharing_freed_pages(ctx->xch);
     if (l < 0 && errno == ENOSYS) {
         l = 0;
@@ -653,6 +664,35 @@ int libxl_send_debug_keys(libxl_ctx *ctx, char *keys)
     return 0;
 }
 
+int libxl_debug_dump(libxl_ctx *ctx, char key, char **output)
+{
+    /* The hypervisor won't return more than 1MiB. */
+    uint32_t size = 64 << 10, len;
+    char *buf = NULL;
+    int ret;
+    GC_INIT(ctx);
+
+    for (;;) {
+        buf = libxl__realloc(NOGC, buf, size + 1);
+        len = size;
+        ret = xc_debug_dump(ctx->xch, key, buf, &len);
+        if (ret < 0) {
+            LOGE(ERROR, "collecting output of debug key '%c'", key);
+            free(buf);
+            GC_FREE;
+            return ERROR_FAIL;
+        }
+        if (len <= size || size >= (1u << 20))
+            break;
+        size = len < (1u << 20) ? len : (1u << 20);
+    }
+
+    buf[len < size ? len : size] = '\0';
+    *output = buf;
+    GC_FREE;
+    return 0;
+}
+
 int libxl_set_parameters(libxl_ctx *ctx, char *params)
 {
     int ret;
@@ -121,6 +121,14 @@
  */
 #define LIBXL_HAVE_CPUPOOL_ADD_REM_CPUMAP 1
 
+/* LIBXL_HAVE_CPUPOOL_MOVEDOMAINS
+ *
+ * If this is defined, libxl has a library function called
+ * libxl_cpupool_movedomains, which moves several domains into a cpupool
+ * with a single hypercall.
+ */
+#define LIBXL_HAVE_CPUPOOL_MOVEDOMAINS 1
+
 /*
  *
  * LIBXL_HAVE_BITMAP_AND_OR
@@ -181,6 +189,27 @@
  */
 #define LIBXL_HAVE_SET_VCPUAFFINITY_FORCE 1
 
+/*
+ * LIBXL_HAVE_SET_VCPUAFFINITY_RANGE indicates that the
+ * libxl_set_vcpuaffinity_range() library call is available, and that
+ * it and libxl_set_vcpuaffinity_all() set the affinity of all the vcpus
+ * with a single hypercall.
+ */
+#define LIBXL_HAVE_SET_VCPUAFFINITY_RANGE 1
+
+/*
+ * LIBXL_HAVE_SUSPEND_ZERO_PAGES indicates that the LIBXL_SUSPEND_ZERO_PAGES
+ * flag of libxl_domain_suspend() is available.
+ */
+#define LIBXL_HAVE_SUSPEND_ZERO_PAGES 1
+
+/*
+ * LIBXL_HAVE_DOMAIN_SUSPEND_PROPS indicates that libxl_domain_suspend_ext()
+ * and libxl_domain_suspend_props are available, the latter with a
+ * max_downtime_ms field, as is the LIBXL_SUSPEND_AUTO_CONVERGE flag.
+ */
+#define LIBXL_HAVE_DOMAIN_SUSPEND_PROPS 1
+
 /*
  * LIBXL_HAVE_DEVICE_DISK_DIRECT_IO_SAFE indicates that a
  * 'direct_io_safe' field (of boolean type) is present in
@@ -305,6 +334,22 @@
  */
 #define LIBXL_HAVE_VIRIDIAN_CRASH_CTL 1
 
+/*
+ * LIBXL_HAVE_VIRIDIAN_HCALL_IPI and LIBXL_HAVE_VIRIDIAN_EX_PROCESSOR_MASKS
+ * indicate that the 'hcall_ipi' and 'ex_processor_masks' values are present
+ * in the viridian enlightenment enumeration.
+ */
+#define LIBXL_HAVE_VIRIDIAN_HCALL_IPI 1
+#define LIBXL_HAVE_VIRIDIAN_EX_PROCESSOR_MASKS 1
+
+/*
+ * LIBXL_HAVE_VIRIDIAN_SYNIC and LIBXL_HAVE_VIRIDIAN_STIMER indicate that
+ * the 'synic' and 'stimer' values are present in the viridian enlightenment
+ * enumeration.
+ */
+#define LIBXL_HAVE_VIRIDIAN_SYNIC 1
+#define LIBXL_HAVE_VIRIDIAN_STIMER 1
+
 /*
  * LIBXL_HAVE_BUILDINFO_HVM_ACPI_LAPTOP_SLATE indicates that
  * libxl_domain_build_info has the u.hvm.acpi_laptop_slate field.
@@ -689,6 +734,16 @@ typedef struct libxl__ctx libxl_ctx;
  */
 #define LIBXL_HAVE_PHYSINFO_MAX_POSSIBLE_MFN 1
 
+/*
+ * LIBXL_HAVE_PHYSINFO_SUPERPAGE_POOL
+ *
+ * If this is defined, libxl_physinfo structure will contain the uint64
+ * fields superpage_pool_pages and superpage_pool_target_pages, containing
+ * the number of pages currently held in the hypervisor's 1G superpage pool,
+ * and the number of pages it is meant to hold.
+ */
+#define LIBXL_HAVE_PHYSINFO_SUPERPAGE_POOL 1
+
 /*
  * LIBXL_HAVE_DOMINFO_OUTSTANDING_MEMKB 1
  *
@@ -1112,6 +1167,30 @@ void libxl_mac_copy(libxl_ctx *ctx, libxl_mac *dst, const libxl_mac *src);
  */
 #define LIBXL_HAVE_SET_PARAMETERS 1
 
+/*
+ * LIBXL_HAVE_DEBUG_DUMP
+ *
+ * If this is defined libxl_debug_dump is available, returning the output
+ * of a debug key's handler instead of sending it to the hypervisor console.
+ */
+#define LIBXL_HAVE_DEBUG_DUMP 1
+
+/*
+ * LIBXL_HAVE_DOMAIN_VCPU_ITER
+ *
+ * If this is defined libxl_domain_iter and libxl_vcpu_iter, and the
+ * functions to use them, are available.
+ */
+#define LIBXL_HAVE_DOMAIN_VCPU_ITER 1
+
+/*
+ * LIBXL_HAVE_DOMAIN_CREATE_STAGE_EVENTS
+ *
+ * If this is defined libxl_evenable_domain_create_stages is available,
+ * as are the DOMAIN_CREATE_STAGE event type and libxl_domain_create_stage.
+ */
+#define LIBXL_HAVE_DOMAIN_CREATE_STAGE_EVENTS 1
+
 /*
  * LIBXL_HAVE_PV_SHIM
  *
@@ -1120,6 +1199,29 @@ void libxl_mac_copy(libxl_ctx *ctx, libxl_mac *dst, const libxl_mac *src);
  */
 #define LIBXL_HAVE_PV_SHIM 1
 
+/*
+ * LIBXL_HAVE_DOMAIN_FORK
+ *
+ * If this is defined libxl_domain_fork is available.
+ */
+#define LIBXL_HAVE_DOMAIN_FORK 1
+
+/*
+ * LIBXL_HAVE_DOMAIN_EXIT_STATS
+ *
+ * If this is defined libxl_domain_exit_stats_{set,reset,get} are
+ * available, with the libxl_exit_stats types.
+ */
+#define LIBXL_HAVE_DOMAIN_EXIT_STATS 1
+
+/*
+ * LIBXL_HAVE_SCHED_STATS
+ *
+ * If this is defined libxl_sched_stats_{set,reset,get} are available,
+ * with the libxl_sched_stats types.
+ */
+#define LIBXL_HAVE_SCHED_STATS 1
+
 typedef char **libxl_string_list;
 void libxl_string_list_dispose(libxl_string_list *sl);
 int libxl_string_list_length(const libxl_string_list *sl);
@@ -1467,8 +1569,19 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd,
                          int flags, /* LIBXL_SUSPEND_* */
                          const libxl_asyncop_how *ao_how)
                          LIBXL_EXTERNAL_CALLERS_ONLY;
+int libxl_domain_suspend_ext(libxl_ctx *ctx, uint32_t domid, int fd,
+                             const libxl_domain_suspend_props *props,
+                             const libxl_asyncop_how *ao_how)
+                             LIBXL_EXTERNAL_CALLERS_ONLY;
 #define LIBXL_SUSPEND_DEBUG 1
 #define LIBXL_SUSPEND_LIVE 2
+/* Elide zero pages from the stream, which older restorers can't handle. */
+#define LIBXL_SUSPEND_ZERO_PAGES 4
+/*
+ * Throttle the guest's vcpus with a scheduler cap if the pre-copy rounds
+ * can't get the downtime under max_downtime_ms.
+ */
+#define LIBXL_SUSPEND_AUTO_CONVERGE 8
 
 /* @param suspend_cancel [from xenctrl.h:xc_domain_resume( @param fast )]
  *   If this parameter is true, use co-operative resume. The guest
@@ -1519,6 +1632,28 @@ int libxl_domain_rename(libxl_ctx *ctx, uint32_t domid,
 int libxl_domain_pause(libxl_ctx *ctx, uint32_t domid);
 int libxl_domain_unpause(libxl_ctx *ctx, uint32_t domid);
 
+/*
+ * Create a new HVM domain called name as a copy-on-write fork of parent.
+ * The child starts from the parent's vCPU state and shares its memory
+ * until written; devices, event channels and grants are not inherited.
+ * The parent is paused and must stay paused while any fork exists.
+ * The child is left paused if paused is true.
+ */
+int libxl_domain_fork(libxl_ctx *ctx, uint32_t parent, const char *name,
+                      bool paused, uint32_t *domid_r);
+
+/*
+ * VM exit accounting of HVM domains: per exit reason counts, and the
+ * TSC cycles spent handling them.  Bucket 0 of the histograms counts
+ * exits handled in less than 256 cycles, bucket i > 0 those handled in
+ * [2^(i+7), 2^(i+8)) cycles, and the last bucket also longer ones.
+ * Disabling keeps what was recorded until reset.
+ */
+int libxl_domain_exit_stats_set(libxl_ctx *ctx, uint32_t domid, bool enable);
+int libxl_domain_exit_stats_reset(libxl_ctx *ctx, uint32_t domid);
+int libxl_domain_exit_stats_get(libxl_ctx *ctx, uint32_t domid,
+                                libxl_exit_stats *stats);
+
 int libxl_domain_core_dump(libxl_ctx *ctx, uint32_t domid,
                            const char *filename,
                            const libxl_asyncop_how *ao_how)
@@ -1663,6 +1798,31 @@ libxl_vcpuinfo *libxl_list_vcpu(libxl_ctx *ctx, uint32_t domid,
                                 int *nb_vcpu, int *nr_cpus_out);
 void libxl_vcpuinfo_list_free(libxl_vcpuinfo *, int nr_vcpus);
 
+/*
+ * These iterate over the domains, or over the vcpus of a domain (of all
+ * domains if domid is INVALID_DOMID), fetching their information in
+ * batches, so that callers polling it don't need all of it in memory at
+ * once.
+ *
+ * libxl_THING_iter_next returns 1 after filling in *info_r, 0 once there
+ * is nothing more to return, or an ERROR_* code.  info_r must have been
+ * initialised with libxl_THINGinfo_init.  It can be passed to the
+ * following calls as it is, reusing the memory it points to, and must
+ * be disposed of with libxl_THINGinfo_dispose after the last one.
+ */
+typedef struct libxl__domain_iter libxl_domain_iter;
+int libxl_domain_iter_init(libxl_ctx *ctx, libxl_domain_iter **iter_r);
+int libxl_domain_iter_next(libxl_domain_iter *iter, libxl_dominfo *info_r);
+void libxl_domain_iter_free(libxl_domain_iter *iter);
+
+typedef struct libxl__vcpu_iter libxl_vcpu_iter;
+int libxl_vcpu_iter_init(libxl_ctx *ctx, uint32_t domid,
+                         libxl_vcpu_iter **iter_r);
+/* domid_r, if not NULL, is set to the domain of the vcpu. */
+int libxl_vcpu_iter_next(libxl_vcpu_iter *iter, uint32_t *domid_r,
+                         libxl_vcpuinfo *info_r);
+void libxl_vcpu_iter_free(libxl_vcpu_iter *iter);
+
 /*
  * Devices
  * =======
@@ -2130,6 +2290,11 @@ int libxl_set_vcpuaffinity_all(libxl_ctx *ctx, uint32_t domid,
                                unsigned int max_vcpus,
                                const libxl_bitmap *cpumap_hard,
                                const libxl_bitmap *cpumap_soft);
+/* Set the affinity of vcpus first_vcpu to first_vcpu + nr_vcpus - 1. */
+int libxl_set_vcpuaffinity_range(libxl_ctx *ctx, uint32_t domid,
+                                 uint32_t first_vcpu, uint32_t nr_vcpus,
+                                 const libxl_bitmap *cpumap_hard,
+                                 const libxl_bitmap *cpumap_soft);
 
 #if defined (LIBXL_API_VERSION) && LIBXL_API_VERSION < 0x040500
 
@@ -2161,6 +2326,17 @@ int libxl_sched_credit2_params_get(libxl_ctx *ctx, uint32_t poolid,
 int libxl_sched_credit2_params_set(libxl_ctx *ctx, uint32_t poolid,
                                    libxl_sched_credit2_params *scinfo);
 
+/*
+ * Scheduling latency statistics, for all schedulers: how long vcpus wait
+ * to run once runnable, and how many wait on each pcpu. They are only
+ * gathered while enabled. libxl_sched_stats_get returns those of the
+ * pcpus, and of the vcpus of domid unless it is INVALID_DOMID.
+ */
+int libxl_sched_stats_set(libxl_ctx *ctx, bool enable);
+int libxl_sched_stats_reset(libxl_ctx *ctx);
+int libxl_sched_stats_get(libxl_ctx *ctx, uint32_t domid,
+                          libxl_sched_stats *stats);
+
 /* Scheduler Per-domain parameters */
 
 #define LIBXL_DOMAIN_SCHED_PARAM_WEIGHT_DEFAULT    -1
@@ -2210,6 +2386,8 @@ int libxl_send_trigger(libxl_ctx *ctx, uint32_t domid,
                        libxl_trigger trigger, uint32_t vcpuid);
 int libxl_send_sysrq(libxl_ctx *ctx, uint32_t domid, char sysrq);
 int libxl_send_debug_keys(libxl_ctx *ctx, char *keys);
+/* On success, *output is a NUL terminated string the caller must free. */
+int libxl_debug_dump(libxl_ctx *ctx, char key, char **output);
 int libxl_set_parameters(libxl_ctx *ctx, char *params);
 
 typedef struct libxl__xen_console_reader libxl_xen_console_reader;
@@ -2255,6 +2433,8 @@ int libxl_cpupool_cpuremove_node(libxl_ctx *ctx, uint32_t poolid, int node, int
 int libxl_cpupool_cpuremove_cpumap(libxl_ctx *ctx, uint32_t poolid,
                                    const libxl_bitmap *cpumap);
 int libxl_cpupool_movedomain(libxl_ctx *ctx, uint32_t poolid, uint32_t domid);
+int libxl_cpupool_movedomains(libxl_ctx *ctx, uint32_t poolid,
+                              const uint32_t *domids, int nr_domids);
 int libxl_cpupool_info(libxl_ctx *ctx, libxl_cpupoolinfo *info, uint32_t poolid);
 
 int libxl_domid_valid_guest(uint32_t domid);
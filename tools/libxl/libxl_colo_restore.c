@@ -192,6 +192,7 @@ static int init_dsps(libxl__domain_suspend_state *dsps)
 
     dsps->guest_evtchn.port = -1;
     dsps->guest_evtchn_lockfd = -1;
+    dsps->guest_evtchn_notify_only = 0;
     dsps->guest_responded = 0;
     dsps->dm_savefile = libxl__device_model_savefile(gc, dsps->domid);
 
@@ -443,6 +443,27 @@ int libxl_cpupool_movedomain(libxl_ctx *ctx, uint32_t poolid, uint32_t domid)
     return 0;
 }
 
+int libxl_cpupool_movedomains(libxl_ctx *ctx, uint32_t poolid,
+                              const uint32_t *domids, int nr_domids)
+{
+    GC_INIT(ctx);
+    unsigned int done;
+    int rc;
+
+    rc = xc_cpupool_movedomains(ctx->xch, poolid, domids, nr_domids, &done);
+    if (rc) {
+        if (done < nr_domids)
+            LOGEVD(ERROR, rc, domids[done], "Error moving domain to cpupool");
+        else
+            LOGEV(ERROR, rc, "Error moving domains to cpupool");
+        GC_FREE;
+        return ERROR_FAIL;
+    }
+
+    GC_FREE;
+    return 0;
+}
+
 /*
  * Local variables:
  * mode: C
@@ -811,6 +811,130 @@ static void domcreate_destruction_cb(libxl__egc *egc,
                                      libxl__domain_destroy_state *dds,
                                      int rc);
 
+/*----- creation stage timing -----*/
+
+int libxl_evenable_domain_create_stages(libxl_ctx *ctx, libxl_ev_user user,
+                            libxl_evgen_domain_create_stages **evgen_out)
+{
+    GC_INIT(ctx);
+    libxl_evgen_domain_create_stages *evg;
+    int rc;
+
+    CTX_LOCK;
+
+    evg = malloc(sizeof(*evg));
+    if (!evg) { rc = ERROR_NOMEM; goto out; }
+    memset(evg, 0, sizeof(*evg));
+    evg->user = user;
+    LIBXL_LIST_INSERT_HEAD(&CTX->create_stage_evgens, evg, entry);
+
+    *evgen_out = evg;
+    rc = 0;
+
+ out:
+    CTX_UNLOCK;
+    GC_FREE;
+    return rc;
+}
+
+void libxl__evdisable_domain_create_stages(libxl__gc *gc,
+                                    libxl_evgen_domain_create_stages *evg)
+{
+    CTX_LOCK;
+    LIBXL_LIST_REMOVE(evg, entry);
+    free(evg);
+    CTX_UNLOCK;
+}
+
+void libxl_evdisable_domain_create_stages(libxl_ctx *ctx,
+                                    libxl_evgen_domain_create_stages *evg)
+{
+    GC_INIT(ctx);
+    libxl__evdisable_domain_create_stages(gc, evg);
+    GC_FREE;
+}
+
+/* Log a stage of the creation, and tell the callers who asked for it */
+static void domcreate_report_stage(libxl__egc *egc,
+                                   libxl__domain_create_state *dcs,
+                                   libxl_domain_create_stage stage,
+                                   const char *device,
+                                   uint64_t start_us, uint64_t end_us)
+{
+    EGC_GC;
+    libxl_evgen_domain_create_stages *evg;
+    libxl_event *ev;
+    uint64_t duration_us = end_us - start_us;
+
+    dcs->stage_total_us[stage] += duration_us;
+
+    LOGD(DEBUG, dcs->guest_domid, "%s%s%s took %"PRIu64".%03"PRIu64"s",
+         libxl_domain_create_stage_to_string(stage),
+         device ? " " : "", device ? device : "",
+         duration_us / 1000000, duration_us / 1000 % 1000);
+
+    LIBXL_LIST_FOREACH(evg, &CTX->create_stage_evgens, entry) {
+        ev = NEW_EVENT(egc, DOMAIN_CREATE_STAGE, dcs->guest_domid, evg->user);
+        ev->u.domain_create_stage.stage = stage;
+        ev->u.domain_create_stage.device =
+            device ? libxl__strdup(NOGC, device) : NULL;
+        ev->u.domain_create_stage.start_us = start_us - dcs->start_us;
+        ev->u.domain_create_stage.duration_us = duration_us;
+        libxl__event_occurred(egc, ev);
+    }
+}
+
+/* Report a stage of the creation as done now, and start the next one */
+static void domcreate_stage_done(libxl__egc *egc,
+                                 libxl__domain_create_state *dcs,
+                                 libxl_domain_create_stage stage)
+{
+    uint64_t now = libxl__monotonic_us();
+
+    domcreate_report_stage(egc, dcs, stage, NULL, dcs->stage_start_us, now);
+    dcs->stage_start_us = now;
+}
+
+/* multidev->device_done of the devices attached during creation */
+static void domcreate_device_done(libxl__egc *egc, libxl__ao_device *aodev)
+{
+    libxl__domain_create_state *dcs =
+        CONTAINER_OF(aodev->multidev, *dcs, multidev);
+    STATE_AO_GC(aodev->ao);
+    const char *device = NULL;
+
+    if (aodev->rc)
+        return;
+
+    if (aodev->dev)
+        device = GCSPRINTF("%s/%d",
+                           libxl__device_kind_to_string(aodev->dev->kind),
+                           aodev->dev->devid);
+
+    domcreate_report_stage(egc, dcs, LIBXL_DOMAIN_CREATE_STAGE_DEVICE, device,
+                           aodev->start_us, libxl__monotonic_us());
+}
+
+static void domcreate_log_summary(libxl__gc *gc,
+                                  libxl__domain_create_state *dcs)
+{
+#define STAGE_TIME(s)                                                   \
+    dcs->stage_total_us[LIBXL_DOMAIN_CREATE_STAGE_##s] / 1000000,       \
+    dcs->stage_total_us[LIBXL_DOMAIN_CREATE_STAGE_##s] / 1000 % 1000
+#define STAGE_FMT "%"PRIu64".%03"PRIu64"s"
+
+    LOGD(DETAIL, dcs->guest_domid, "domain created in "STAGE_FMT": "
+         "make "STAGE_FMT", bootloader "STAGE_FMT", "
+         "build "STAGE_FMT" (memory "STAGE_FMT"), disks "STAGE_FMT", "
+         "device model "STAGE_FMT", devices "STAGE_FMT,
+         STAGE_TIME(TOTAL), STAGE_TIME(MAKE), STAGE_TIME(BOOTLOADER),
+         STAGE_TIME(BUILD), STAGE_TIME(MEMORY), STAGE_TIME(DISKS),
+         STAGE_TIME(DEVICE_MODEL), STAGE_TIME(DEVICES));
+
+#undef STAGE_FMT
+#undef STAGE_TIME
+}
+
 static void initiate_domain_create(libxl__egc *egc,
                                    libxl__domain_create_state *dcs)
 {
@@ -827,6 +951,8 @@ static void initiate_domain_create(libxl__egc *egc,
 
     domid = dcs->domid_soft_reset;
 
+    dcs->start_us = dcs->stage_start_us = libxl__monotonic_us();
+
     if (d_config->c_info.ssid_label) {
         char *s = d_config->c_info.ssid_label;
         ret = libxl_flask_context_to_sid(ctx, s, strlen(s),
@@ -998,6 +1124,8 @@ static void initiate_domain_create(libxl__egc *egc,
     if (ret)
         goto error_out;
 
+    domcreate_stage_done(egc, dcs, LIBXL_DOMAIN_CREATE_STAGE_MAKE);
+
     if (restore_fd >= 0 || dcs->domid_soft_reset != INVALID_DOMID) {
         LOGD(DEBUG, domid, "restoring, not running bootloader");
         domcreate_bootloader_done(egc, &dcs->bl, 0);
@@ -1077,6 +1205,9 @@ static void domcreate_bootloader_done(libxl__egc *egc,
         return;
     }
 
+    if (restore_fd < 0 && dcs->domid_soft_reset == INVALID_DOMID)
+        domcreate_stage_done(egc, dcs, LIBXL_DOMAIN_CREATE_STAGE_BOOTLOADER);
+
     /* consume bootloader outputs. state->pv_{kernel,ramdisk} have
      * been initialised by the bootloader already.
      */
@@ -1266,10 +1397,17 @@ static void domcreate_rebuild_done(libxl__egc *egc,
         goto error_out;
     }
 
+    if (dcs->build_state.populate_end_us)
+        domcreate_report_stage(egc, dcs, LIBXL_DOMAIN_CREATE_STAGE_MEMORY,
+                               NULL, dcs->build_state.populate_start_us,
+                               dcs->build_state.populate_end_us);
+    domcreate_stage_done(egc, dcs, LIBXL_DOMAIN_CREATE_STAGE_BUILD);
+
     store_libxl_entry(gc, domid, &d_config->b_info);
 
     libxl__multidev_begin(ao, &dcs->multidev);
     dcs->multidev.callback = domcreate_launch_dm;
+    dcs->multidev.device_done = domcreate_device_done;
     libxl__add_disks(egc, ao, domid, d_config, &dcs->multidev);
     libxl__multidev_prepared(egc, &dcs->multidev, 0);
 
@@ -1297,6 +1435,8 @@ static void domcreate_launch_dm(libxl__egc *egc, libxl__multidev *multidev,
         goto error_out;
     }
 
+    domcreate_stage_done(egc, dcs, LIBXL_DOMAIN_CREATE_STAGE_DISKS);
+
     for (i = 0; i < d_config->b_info.num_ioports; i++) {
         libxl_ioport_range *io = &d_config->b_info.ioports[i];
 
@@ -1509,27 +1649,32 @@ static void domcreate_attach_devices(libxl__egc *egc,
     const struct libxl_device_type *dt;
 
     if (ret) {
-        LOGD(ERROR, domid, "unable to add %s devices",
-             libxl__device_kind_to_string(device_type_tbl[dcs->device_type_idx]->type));
+        LOGD(ERROR, domid, "unable to add devices");
         goto error_out;
     }
 
-    dcs->device_type_idx++;
-    dt = device_type_tbl[dcs->device_type_idx];
-    if (dt) {
-        if (*libxl__device_type_get_num(dt, d_config) > 0 && !dt->skip_attach) {
-            /* Attach devices */
-            libxl__multidev_begin(ao, &dcs->multidev);
-            dcs->multidev.callback = domcreate_attach_devices;
-            dt->add(egc, ao, domid, d_config, &dcs->multidev);
-            libxl__multidev_prepared(egc, &dcs->multidev, 0);
-            return;
-        }
-
-        domcreate_attach_devices(egc, &dcs->multidev, 0);
+    if (device_type_tbl[dcs->device_type_idx]) {
+        /*
+         * Attach the devices of all types up to the next one depending
+         * on the previous ones at once, so that their backends and
+         * hotplug scripts run concurrently.
+         */
+        libxl__multidev_begin(ao, &dcs->multidev);
+        dcs->multidev.callback = domcreate_attach_devices;
+        dcs->multidev.device_done = domcreate_device_done;
+        do {
+            dt = device_type_tbl[dcs->device_type_idx++];
+            if (*libxl__device_type_get_num(dt, d_config) > 0 &&
+                !dt->skip_attach)
+                dt->add(egc, ao, domid, d_config, &dcs->multidev);
+        } while (device_type_tbl[dcs->device_type_idx] &&
+                 !device_type_tbl[dcs->device_type_idx]->attach_after);
+        libxl__multidev_prepared(egc, &dcs->multidev, 0);
         return;
     }
 
+    domcreate_stage_done(egc, dcs, LIBXL_DOMAIN_CREATE_STAGE_DEVICES);
+
     domcreate_console_available(egc, dcs);
 
     domcreate_complete(egc, dcs, 0);
@@ -1564,7 +1709,9 @@ static void domcreate_devmodel_started(libxl__egc *egc,
         }
     }
 
-    dcs->device_type_idx = -1;
+    domcreate_stage_done(egc, dcs, LIBXL_DOMAIN_CREATE_STAGE_DEVICE_MODEL);
+
+    dcs->device_type_idx = 0;
     domcreate_attach_devices(egc, &dcs->multidev, 0);
     return;
 
@@ -1581,6 +1728,12 @@ static void domcreate_complete(libxl__egc *egc,
     libxl_domain_config *const d_config = dcs->guest_config;
     libxl_domain_config *d_config_saved = &dcs->guest_config_saved;
 
+    if (!rc) {
+        domcreate_report_stage(egc, dcs, LIBXL_DOMAIN_CREATE_STAGE_TOTAL,
+                               NULL, dcs->start_us, libxl__monotonic_us());
+        domcreate_log_summary(gc, dcs);
+    }
+
     libxl__file_reference_unmap(&dcs->build_state.pv_kernel);
     libxl__file_reference_unmap(&dcs->build_state.pv_ramdisk);
 
@@ -17,6 +17,9 @@
 #include "libxl_osdeps.h" /* must come before any other headers */
 
 #include "libxl_internal.h"
+#include "libxl_hotplug_plugin.h"
+
+#include <dlfcn.h>
 
 static char *libxl__device_frontend_path(libxl__gc *gc, libxl__device *device)
 {
@@ -657,6 +660,7 @@ void libxl__multidev_begin(libxl__ao *ao, libxl__multidev *multidev)
     AO_GC;
 
     multidev->ao = ao;
+    multidev->device_done = NULL;
     multidev->array = 0;
     multidev->used = multidev->allocd = 0;
 
@@ -680,6 +684,7 @@ void libxl__multidev_prepare_with_aodev(libxl__multidev *multidev,
 
     aodev->multidev = multidev;
     aodev->callback = libxl__multidev_one_callback;
+    aodev->start_us = libxl__monotonic_us();
     libxl__prepare_ao_device(ao, aodev);
 
     if (multidev->used >= multidev->allocd) {
@@ -707,6 +712,9 @@ void libxl__multidev_one_callback(libxl__egc *egc, libxl__ao_device *aodev)
 
     aodev->active = 0;
 
+    if (multidev->device_done && aodev != multidev->preparation)
+        multidev->device_done(egc, aodev);
+
     for (i = 0; i < multidev->used; i++) {
         if (multidev->array[i]->active)
             return;
@@ -1128,6 +1136,105 @@ static void device_backend_cleanup(libxl__gc *gc, libxl__ao_device *aodev)
     libxl__ev_devstate_cancel(gc, &aodev->backend_ds);
 }
 
+/* Hotplug plugins, see libxl_hotplug_plugin.h */
+
+typedef struct {
+    libxl__gc *gc;
+    uint32_t domid;
+} hotplug_plugin_state;
+
+static const char *hotplug_plugin_xs_read(void *opaque, const char *path)
+{
+    hotplug_plugin_state *hps = opaque;
+
+    return libxl__xs_read(hps->gc, XBT_NULL, path);
+}
+
+static int hotplug_plugin_xs_write(void *opaque, const char *path,
+                                   const char *value)
+{
+    hotplug_plugin_state *hps = opaque;
+
+    return libxl__xs_write_checked(hps->gc, XBT_NULL, path, value) ? -1 : 0;
+}
+
+static void hotplug_plugin_log(void *opaque, int error, const char *msg)
+{
+    hotplug_plugin_state *hps = opaque;
+    libxl__gc *gc = hps->gc;
+
+    if (error)
+        LOGD(ERROR, hps->domid, "hotplug plugin: %s", msg);
+    else
+        LOGD(DEBUG, hps->domid, "hotplug plugin: %s", msg);
+}
+
+/*
+ * Returns true if a plugin took care of the hotplug script invocation
+ * described by args and env, in which case *status is set like the exit
+ * status of the script.
+ */
+static bool device_hotplug_plugin(libxl__gc *gc, libxl__ao_device *aodev,
+                                  char **args, char **env, int *status)
+{
+    const uint32_t domid = aodev->dev->domid;
+    const char *script = strrchr(args[0], '/');
+    char *path;
+    void *handle;
+    libxl_hotplug_plugin_fn *fn;
+    libxl_hotplug_plugin_call call;
+    hotplug_plugin_state hps = { .gc = gc, .domid = domid };
+    int r;
+
+    path = GCSPRINTF("%s/%s.so", libxl__hotplug_plugin_dir_path(),
+                     script ? script + 1 : args[0]);
+    if (access(path, R_OK))
+        return false;
+
+    /* Keep it loaded, so that the next devices don't have to map it. */
+    handle = dlopen(path, RTLD_NOW | RTLD_LOCAL | RTLD_NODELETE);
+    if (!handle) {
+        LOGD(WARN, domid, "unable to load hotplug plugin %s: %s", path,
+             dlerror());
+        return false;
+    }
+
+    fn = (libxl_hotplug_plugin_fn *)dlsym(handle,
+                                          LIBXL_HOTPLUG_PLUGIN_ENTRY);
+    if (!fn) {
+        LOGD(WARN, domid, "hotplug plugin %s has no %s", path,
+             LIBXL_HOTPLUG_PLUGIN_ENTRY);
+        dlclose(handle);
+        return false;
+    }
+
+    call.version = LIBXL_HOTPLUG_PLUGIN_VERSION;
+    call.args = (const char *const *)args;
+    call.env = (const char *const *)env;
+    call.xs_read = hotplug_plugin_xs_read;
+    call.xs_write = hotplug_plugin_xs_write;
+    call.log = hotplug_plugin_log;
+    call.opaque = &hps;
+
+    r = fn(&call);
+    dlclose(handle);
+
+    if (r == LIBXL_HOTPLUG_PLUGIN_FALLBACK) {
+        LOGD(DEBUG, domid, "hotplug plugin %s deferred to the script", path);
+        return false;
+    }
+
+    if (r) {
+        LOGD(ERROR, domid, "hotplug plugin %s failed to handle %s", path,
+             args[1]);
+        *status = 1;
+    } else {
+        LOGD(DEBUG, domid, "hotplug plugin %s handled %s", path, args[1]);
+        *status = 0;
+    }
+    return true;
+}
+
 static void device_hotplug(libxl__egc *egc, libxl__ao_device *aodev)
 {
     STATE_AO_GC(aodev->ao);
@@ -1135,7 +1242,7 @@ static void device_hotplug(libxl__egc *egc, libxl__ao_device *aodev)
     char *be_path = libxl__device_backend_path(gc, aodev->dev);
     char **args = NULL, **env = NULL;
     int rc = 0;
-    int hotplug, nullfd = -1;
+    int hotplug, nullfd = -1, status;
     uint32_t domid;
 
     /*
@@ -1215,6 +1322,12 @@ static void device_hotplug(libxl__egc *egc, libxl__ao_device *aodev)
         }
     }
 
+    if (device_hotplug_plugin(gc, aodev, args, env, &status)) {
+        /* Carry on just like after the script exited. */
+        device_hotplug_child_death_cb(egc, aes, 0, status);
+        return;
+    }
+
     nullfd = open("/dev/null", O_RDONLY);
     if (nullfd < 0) {
         LOGD(ERROR, aodev->dev->domid, "unable to open /dev/null for hotplug script");
@@ -675,6 +675,7 @@ int libxl_cdrom_insert(libxl_ctx *ctx, uint32_t domid, libxl_device_disk *disk,
     libxl__domain_userdata_lock *lock = NULL;
     xs_transaction_t t = XBT_NULL;
     flexarray_t *insert = NULL, *empty = NULL;
+    bool qmp_held = false;
 
     libxl_domain_config_init(&d_config);
     libxl_device_disk_init(&disk_empty);
@@ -770,6 +771,9 @@ int libxl_cdrom_insert(libxl_ctx *ctx, uint32_t domid, libxl_device_disk *disk,
      * by inserting empty media. JSON is not updated.
      */
     if (dm_ver == LIBXL_DEVICE_MODEL_VERSION_QEMU_XEN) {
+        /* Both media changes go through the same QMP connection. */
+        libxl__qmp_hold(gc, domid);
+        qmp_held = true;
         rc = libxl__qmp_insert_cdrom(gc, domid, &disk_empty);
         if (rc) goto out;
     }
@@ -848,6 +852,7 @@ int libxl_cdrom_insert(libxl_ctx *ctx, uint32_t domid, libxl_device_disk *disk,
     rc = 0;
 
 out:
+    if (qmp_held) libxl__qmp_release(gc, domid);
     libxl__xs_transaction_abort(gc, &t);
     libxl__device_list_free(&libxl__disk_devtype, disks, num);
     libxl_device_disk_dispose(&disk_empty);
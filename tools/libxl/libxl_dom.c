@@ -199,6 +199,8 @@ static int numa_place_domain(libxl__gc *gc, uint32_t domid,
             libxl_bitmap_reset(&info->nodemap, i);
     }
 
+    libxl__numa_account_placement(gc, &info->nodemap, info->max_vcpus);
+
     LOG(DETAIL, "NUMA placement candidate with %d nodes, %d cpus and "
                 "%"PRIu64" KB free selected", candidate.nr_nodes,
                 candidate.nr_cpus, candidate.free_memkb / 1024);
@@ -285,6 +287,18 @@ static int hvm_set_viridian_features(libxl__gc *gc, uint32_t domid,
     if (libxl_bitmap_test(&enlightenments, LIBXL_VIRIDIAN_ENLIGHTENMENT_CRASH_CTL))
         mask |= HVMPV_crash_ctl;
 
+    if (libxl_bitmap_test(&enlightenments, LIBXL_VIRIDIAN_ENLIGHTENMENT_HCALL_IPI))
+        mask |= HVMPV_hcall_ipi;
+
+    if (libxl_bitmap_test(&enlightenments, LIBXL_VIRIDIAN_ENLIGHTENMENT_EX_PROCESSOR_MASKS))
+        mask |= HVMPV_ex_processor_masks;
+
+    if (libxl_bitmap_test(&enlightenments, LIBXL_VIRIDIAN_ENLIGHTENMENT_SYNIC))
+        mask |= HVMPV_synic;
+
+    if (libxl_bitmap_test(&enlightenments, LIBXL_VIRIDIAN_ENLIGHTENMENT_STIMER))
+        mask |= HVMPV_stimer;
+
     if (mask != 0 &&
         xc_hvm_param_set(CTX->xch,
                          domid,
@@ -434,33 +448,29 @@ int libxl__build_pre(libxl__gc *gc, uint32_t domid,
         libxl_domain_set_nodeaffinity(ctx, domid, &info->nodemap);
 
     if (info->num_vcpu_hard_affinity || info->num_vcpu_soft_affinity) {
-        libxl_bitmap *hard_affinity, *soft_affinity;
-        int i, n_vcpus;
-
-        n_vcpus = info->num_vcpu_hard_affinity > info->num_vcpu_soft_affinity ?
-            info->num_vcpu_hard_affinity : info->num_vcpu_soft_affinity;
+        int n_hard = info->num_vcpu_hard_affinity;
+        int n_soft = info->num_vcpu_soft_affinity;
+        int n_both = n_hard < n_soft ? n_hard : n_soft;
 
-        for (i = 0; i < n_vcpus; i++) {
-            /*
-             * Prepare hard and soft affinity pointers in a way that allows
-             * us to issue only one call to libxl_set_vcpuaffinity(), setting,
-             * for each vcpu, both hard and soft affinity "atomically".
-             */
-            hard_affinity = NULL;
-            if (info->num_vcpu_hard_affinity &&
-                i < info->num_vcpu_hard_affinity)
-                hard_affinity = &info->vcpu_hard_affinity[i];
-
-            soft_affinity = NULL;
-            if (info->num_vcpu_soft_affinity &&
-                i < info->num_vcpu_soft_affinity)
-                soft_affinity = &info->vcpu_soft_affinity[i];
-
-            if (libxl_set_vcpuaffinity(ctx, domid, i,
-                                       hard_affinity, soft_affinity)) {
-                LOG(ERROR, "setting affinity failed on vcpu `%d'", i);
-                return ERROR_FAIL;
-            }
+        /*
+         * Set both hard and soft affinity "atomically" for the vcpus which
+         * have both, and then whichever of the two the remaining ones have,
+         * each with a single hypercall for all the vcpus concerned.
+         */
+        if (libxl__set_vcpuaffinity_list(gc, domid, 0, n_both,
+                                         info->vcpu_hard_affinity,
+                                         info->vcpu_soft_affinity, false) ||
+            (n_hard > n_both &&
+             libxl__set_vcpuaffinity_list(gc, domid, n_both, n_hard - n_both,
+                                          &info->vcpu_hard_affinity[n_both],
+                                          NULL, false)) ||
+            (n_soft > n_both &&
+             libxl__set_vcpuaffinity_list(gc, domid, n_both, n_soft - n_both,
+                                          NULL,
+                                          &info->vcpu_soft_affinity[n_both],
+                                          false))) {
+            LOG(ERROR, "setting vcpu affinity failed");
+            return ERROR_FAIL;
         }
     }
 
@@ -531,7 +541,7 @@ static int set_vnuma_affinity(libxl__gc *gc, uint32_t domid,
 {
     libxl_bitmap cpumap;
     libxl_vnode_info *v;
-    unsigned int i, j;
+    unsigned int i, j, k;
     int rc = 0;
 
     libxl_bitmap_init(&cpumap);
@@ -544,7 +554,8 @@ static int set_vnuma_affinity(libxl__gc *gc, uint32_t domid,
 
     /*
      * For each vcpu in each vnode, set its soft affinity to
-     * the pcpus belonging to the pnode the vnode is on
+     * the pcpus belonging to the pnode the vnode is on, with one
+     * hypercall per run of contiguous vcpus.
      */
     for (i = 0; i < info->num_vnuma_nodes; i++) {
         v = &info->vnuma_nodes[i];
@@ -556,11 +567,17 @@ static int set_vnuma_affinity(libxl__gc *gc, uint32_t domid,
         }
 
         libxl_for_each_set_bit(j, v->vcpus) {
-            rc = libxl_set_vcpuaffinity(CTX, domid, j, NULL, &cpumap);
+            for (k = j + 1; k < v->vcpus.size * 8; k++)
+                if (!libxl_bitmap_test(&v->vcpus, k))
+                    break;
+
+            rc = libxl__set_vcpuaffinity_list(gc, domid, j, k - j,
+                                              NULL, &cpumap, true);
             if (rc) {
-                LOG(ERROR, "Can't set cpu affinity for %d", j);
+                LOG(ERROR, "Can't set cpu affinity for %u-%u", j, k - 1);
                 goto out;
             }
+            j = k;
         }
     }
 
@@ -729,10 +746,12 @@ static int libxl__build_dom(libxl__gc *gc, uint32_t domid,
         LOGE(ERROR, "xc_dom_mem_init failed");
         goto out;
     }
+    state->populate_start_us = libxl__monotonic_us();
     if ( (ret = xc_dom_boot_mem_init(dom)) != 0 ) {
         LOGE(ERROR, "xc_dom_boot_mem_init failed");
         goto out;
     }
+    state->populate_end_us = libxl__monotonic_us();
     if ( (ret = libxl__arch_domain_finalise_hw_description(gc, info, dom)) != 0 ) {
         LOGE(ERROR, "libxl__arch_domain_finalise_hw_description failed");
         goto out;
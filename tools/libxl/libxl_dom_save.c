@@ -379,6 +379,8 @@ void libxl__domain_save(libxl__egc *egc, libxl__domain_save_state *dss)
 
     dss->xcflags = (live ? XCFLAGS_LIVE : 0)
           | (debug ? XCFLAGS_DEBUG : 0)
+          | (dss->zero_pages ? XCFLAGS_ZERO_PAGES : 0)
+          | (dss->auto_converge ? XCFLAGS_AUTO_CONVERGE : 0)
           | (dss->hvm ? XCFLAGS_HVM : 0);
 
     /* Disallow saving a guest with vNUMA configured because migration
@@ -436,9 +438,26 @@ static void domain_save_done(libxl__egc *egc,
 
     libxl__ev_evtchn_cancel(gc, &dsps->guest_evtchn);
 
-    if (dsps->guest_evtchn.port > 0)
+    if (!rc && dsps->dm_saved_us &&
+        dss->checkpointed_stream == LIBXL_CHECKPOINTED_STREAM_NONE) {
+        uint64_t now_us = libxl__monotonic_us();
+
+        LOGD(INFO, domid, "Downtime before the end of the stream: %"PRIu64"ms"
+             " (guest suspend %"PRIu64"ms, device model %"PRIu64"ms,"
+             " final copy %"PRIu64"ms)",
+             (now_us - dsps->suspend_start_us) / 1000,
+             (dsps->suspended_us - dsps->suspend_start_us) / 1000,
+             (dsps->dm_saved_us - dsps->suspended_us) / 1000,
+             (now_us - dsps->dm_saved_us) / 1000);
+    }
+
+    if (dsps->guest_evtchn.port > 0) {
+        /* Let @releaseDomain tell others about the guest again. */
+        if (dsps->guest_evtchn_notify_only)
+            xc_domain_subscribe_for_suspend(CTX->xch, domid, 0);
         xc_suspend_evtchn_release(CTX->xch, CTX->xce, domid,
                         dsps->guest_evtchn.port, &dsps->guest_evtchn_lockfd);
+    }
 
     if (dss->remus) {
         /*
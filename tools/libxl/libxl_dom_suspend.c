@@ -19,6 +19,49 @@
 
 /*====================== Domain suspend =======================*/
 
+/*
+ * For guests without a suspend event channel of their own, we make one in
+ * the guest, for Xen to tell us through once the guest has suspended
+ * (see XEN_DOMCTL_subscribe), rather than waiting for @releaseDomain.
+ * The guest can't close it for us, so it is remembered in xenstore for
+ * the next time round.  Returns the port, or -1 on failure.
+ */
+static int suspend_notify_port(libxl__gc *gc, uint32_t domid)
+{
+    const char *path, *val;
+    xc_evtchn_status_t status;
+    uint32_t self;
+    int port, rc;
+
+    rc = libxl__get_domid(gc, &self);
+    if (rc) return -1;
+
+    path = GCSPRINTF("%s/suspend-notify-port", libxl__xs_libxl_path(gc, domid));
+    rc = libxl__xs_read_checked(gc, XBT_NULL, path, &val);
+    if (rc) return -1;
+
+    if (val) {
+        memset(&status, 0, sizeof(status));
+        status.dom = domid;
+        status.port = atoi(val);
+        if (!xc_evtchn_status(CTX->xch, &status) &&
+            status.status == EVTCHNSTAT_unbound &&
+            status.u.unbound.dom == self)
+            return status.port;
+    }
+
+    port = xc_evtchn_alloc_unbound(CTX->xch, domid, self);
+    if (port < 0) {
+        LOGED(WARN, domid, "Unable to allocate suspend notification port");
+        return -1;
+    }
+
+    rc = libxl__xs_printf(gc, XBT_NULL, path, "%d", port);
+    if (rc) return -1;
+
+    return port;
+}
+
 int libxl__domain_suspend_init(libxl__egc *egc,
                                libxl__domain_suspend_state *dsps,
                                libxl_domain_type type)
@@ -40,11 +83,18 @@ int libxl__domain_suspend_init(libxl__egc *egc,
 
     dsps->guest_evtchn.port = -1;
     dsps->guest_evtchn_lockfd = -1;
+    dsps->guest_evtchn_notify_only = 0;
     dsps->guest_responded = 0;
+    dsps->suspend_start_us = dsps->suspended_us = dsps->dm_saved_us = 0;
     dsps->dm_savefile = libxl__device_model_savefile(gc, domid);
 
     port = xs_suspend_evtchn_port(domid);
 
+    if (port < 0) {
+        port = suspend_notify_port(gc, domid);
+        dsps->guest_evtchn_notify_only = 1;
+    }
+
     if (port >= 0) {
         rc = libxl__ctx_evtchn_init(gc);
         if (rc) goto out;
@@ -53,11 +103,17 @@ int libxl__domain_suspend_init(libxl__egc *egc,
             xc_suspend_evtchn_init_exclusive(CTX->xch, CTX->xce,
                                     domid, port, &dsps->guest_evtchn_lockfd);
 
-        if (dsps->guest_evtchn.port < 0) {
+        if (dsps->guest_evtchn.port < 0 && dsps->guest_evtchn_notify_only) {
+            /* Only an optimisation: watch for @releaseDomain instead. */
+            LOGD(WARN, domid, "Suspend notification initialization failed");
+            dsps->guest_evtchn_notify_only = 0;
+        } else if (dsps->guest_evtchn.port < 0) {
             LOGD(WARN, domid, "Suspend event channel initialization failed");
             rc = ERROR_FAIL;
             goto out;
         }
+    } else {
+        dsps->guest_evtchn_notify_only = 0;
     }
 
     rc = 0;
@@ -83,10 +139,14 @@ int libxl__domain_suspend_device_model(libxl__gc *gc,
         break;
     }
     case LIBXL_DEVICE_MODEL_VERSION_QEMU_XEN:
-        if (libxl__qmp_stop(gc, domid))
+        libxl__qmp_hold(gc, domid);
+        if (libxl__qmp_stop(gc, domid)) {
+            libxl__qmp_release(gc, domid);
             return ERROR_FAIL;
+        }
         /* Save DM state into filename */
         ret = libxl__qmp_save(gc, domid, filename);
+        libxl__qmp_release(gc, domid);
         if (ret)
             unlink(filename);
         break;
@@ -146,12 +206,16 @@ static void domain_suspend_callback_common(libxl__egc *egc,
     /* Convenience aliases */
     const uint32_t domid = dsps->domid;
 
+    dsps->suspend_start_us = libxl__monotonic_us();
+    dsps->suspended_us = dsps->dm_saved_us = 0;
+
     if (dsps->type != LIBXL_DOMAIN_TYPE_PV) {
         xc_hvm_param_get(CTX->xch, domid, HVM_PARAM_CALLBACK_IRQ, &hvm_pvdrv);
         xc_hvm_param_get(CTX->xch, domid, HVM_PARAM_ACPI_S_STATE, &hvm_s_state);
     }
 
-    if ((hvm_s_state == 0) && (dsps->guest_evtchn.port >= 0)) {
+    if ((hvm_s_state == 0) && (dsps->guest_evtchn.port >= 0) &&
+        !dsps->guest_evtchn_notify_only) {
         LOGD(DEBUG, domid, "issuing %s suspend request via event channel",
             dsps->type != LIBXL_DOMAIN_TYPE_PV ? "PVH/HVM" : "PV");
         ret = xenevtchn_notify(CTX->xce, dsps->guest_evtchn.port);
@@ -173,6 +237,14 @@ static void domain_suspend_callback_common(libxl__egc *egc,
         return;
     }
 
+    if (dsps->guest_evtchn.port >= 0) {
+        /* Xen notifies the port as soon as the guest has suspended, which
+         * may be before we get to see any acknowledgement: listen now. */
+        dsps->guest_evtchn.callback = domain_suspend_common_wait_guest_evtchn;
+        rc = libxl__ev_evtchn_wait(gc, &dsps->guest_evtchn);
+        if (rc) goto err;
+    }
+
     if (dsps->type == LIBXL_DOMAIN_TYPE_HVM && (!hvm_pvdrv || hvm_s_state)) {
         LOGD(DEBUG, domid, "Calling xc_domain_shutdown on HVM domain");
         ret = xc_domain_shutdown(CTX->xch, domid, SHUTDOWN_suspend);
@@ -291,9 +363,14 @@ static void domain_suspend_common_wait_guest(libxl__egc *egc,
 
     LOGD(DEBUG, dsps->domid, "wait for the guest to suspend");
 
-    rc = libxl__ev_xswatch_register(gc, &dsps->guest_watch,
-                                    suspend_common_wait_guest_watch,
-                                    "@releaseDomain");
+    if (dsps->guest_evtchn.port >= 0) {
+        /* Already listening, see domain_suspend_callback_common */
+        rc = libxl__ev_evtchn_wait(gc, &dsps->guest_evtchn);
+    } else {
+        rc = libxl__ev_xswatch_register(gc, &dsps->guest_watch,
+                                        suspend_common_wait_guest_watch,
+                                        "@releaseDomain");
+    }
     if (rc) goto err;
 
     rc = libxl__ev_time_register_rel(ao, &dsps->guest_timeout,
@@ -373,6 +450,10 @@ static void domain_suspend_common_guest_suspended(libxl__egc *egc,
     STATE_AO_GC(dsps->ao);
     int rc;
 
+    dsps->suspended_us = libxl__monotonic_us();
+
+    /* We may have heard from Xen before the guest's acknowledgement. */
+    libxl__xswait_stop(gc, &dsps->pvcontrol);
     libxl__ev_evtchn_cancel(gc, &dsps->guest_evtchn);
     libxl__ev_xswatch_deregister(gc, &dsps->guest_watch);
     libxl__ev_time_deregister(gc, &dsps->guest_timeout);
@@ -386,6 +467,7 @@ static void domain_suspend_common_guest_suspended(libxl__egc *egc,
             return;
         }
     }
+    dsps->dm_saved_us = libxl__monotonic_us();
     domain_suspend_common_done(egc, dsps, 0);
 }
 
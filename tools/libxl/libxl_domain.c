@@ -302,13 +302,15 @@ libxl_dominfo * libxl_list_domain(libxl_ctx *ctx, int *nb_domain_out)
     uint32_t domid = 0;
     GC_INIT(ctx);
 
-    while ((ret = xc_domain_getinfolist(ctx->xch, domid, 1024, info)) > 0) {
+    while ((ret = xc_domain_getinfolist_changed(ctx->xch, domid, 1024, 0,
+                                                info, &domid, NULL)) > 0) {
         ptr = libxl__realloc(NOGC, ptr, (size + ret) * sizeof(libxl_dominfo));
         for (i = 0; i < ret; i++) {
             libxl__xcinfo2xlinfo(ctx, &info[i], &ptr[size + i]);
         }
-        domid = info[ret - 1].domain + 1;
         size += ret;
+        if (domid == DOMID_INVALID)
+            break;
     }
 
     if (ret < 0) {
@@ -488,8 +490,24 @@ static void domain_suspend_cb(libxl__egc *egc,
 
 int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
                          const libxl_asyncop_how *ao_how)
+{
+    libxl_domain_suspend_props props;
+    int rc;
+
+    libxl_domain_suspend_props_init(&props);
+    props.flags = flags;
+    rc = libxl_domain_suspend_ext(ctx, domid, fd, &props, ao_how);
+    libxl_domain_suspend_props_dispose(&props);
+
+    return rc;
+}
+
+int libxl_domain_suspend_ext(libxl_ctx *ctx, uint32_t domid, int fd,
+                             const libxl_domain_suspend_props *props,
+                             const libxl_asyncop_how *ao_how)
 {
     AO_CREATE(ctx, domid, ao_how);
+    int flags = props->flags;
     int rc;
 
     libxl_domain_type type = libxl__domain_type(gc, domid);
@@ -509,6 +527,9 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
     dss->type = type;
     dss->live = flags & LIBXL_SUSPEND_LIVE;
     dss->debug = flags & LIBXL_SUSPEND_DEBUG;
+    dss->zero_pages = flags & LIBXL_SUSPEND_ZERO_PAGES;
+    dss->auto_converge = flags & LIBXL_SUSPEND_AUTO_CONVERGE;
+    dss->max_downtime_ms = props->max_downtime_ms;
     dss->checkpointed_stream = LIBXL_CHECKPOINTED_STREAM_NONE;
 
     rc = libxl__fd_flags_modify_save(gc, dss->fd,
@@ -537,6 +558,88 @@ int libxl_domain_pause(libxl_ctx *ctx, uint32_t domid)
     return 0;
 }
 
+static int exit_stats_op(libxl_ctx *ctx, uint32_t domid, uint32_t cmd)
+{
+    int rc = 0;
+    GC_INIT(ctx);
+
+    if (xc_hvm_exit_stats_op(ctx->xch, domid, cmd)) {
+        LOGED(ERROR, domid, "Controlling VM exit stats");
+        rc = ERROR_FAIL;
+    }
+
+    GC_FREE;
+    return rc;
+}
+
+int libxl_domain_exit_stats_set(libxl_ctx *ctx, uint32_t domid, bool enable)
+{
+    return exit_stats_op(ctx, domid, enable ? XEN_DOMCTL_EXIT_STATS_enable
+                                            : XEN_DOMCTL_EXIT_STATS_disable);
+}
+
+int libxl_domain_exit_stats_reset(libxl_ctx *ctx, uint32_t domid)
+{
+    return exit_stats_op(ctx, domid, XEN_DOMCTL_EXIT_STATS_reset);
+}
+
+int libxl_domain_exit_stats_get(libxl_ctx *ctx, uint32_t domid,
+                                libxl_exit_stats *stats)
+{
+    GC_INIT(ctx);
+    xc_exit_stat_t *xstats = NULL;
+    uint32_t nr = 0, max, vendor, tsc_khz, enabled;
+    int i, rc;
+
+    /* Reasons may show up between the calls: allow for some more. */
+    if (xc_hvm_exit_stats_query(ctx->xch, domid, &nr, NULL,
+                                &vendor, &tsc_khz, &enabled))
+        goto err;
+    do {
+        max = nr + 8;
+        xstats = libxl__realloc(gc, xstats, max * sizeof(*xstats));
+        nr = max;
+        if (xc_hvm_exit_stats_query(ctx->xch, domid, &nr, xstats,
+                                    &vendor, &tsc_khz, &enabled))
+            goto err;
+    } while (nr > max);
+
+    libxl_exit_stats_init(stats);
+    switch (vendor) {
+    case XEN_DOMCTL_EXIT_STATS_VMX:
+        stats->vendor = LIBXL_EXIT_STATS_VENDOR_VMX;
+        break;
+    case XEN_DOMCTL_EXIT_STATS_SVM:
+        stats->vendor = LIBXL_EXIT_STATS_VENDOR_SVM;
+        break;
+    }
+    stats->tsc_khz = tsc_khz;
+    stats->enabled = enabled;
+    stats->num_reasons = nr;
+    stats->reasons = libxl__calloc(NOGC, nr, sizeof(*stats->reasons));
+    for (i = 0; i < nr; i++) {
+        libxl_exit_stat *s = &stats->reasons[i];
+
+        libxl_exit_stat_init(s);
+        s->reason = xstats[i].reason;
+        s->count = xstats[i].count;
+        s->cycles = xstats[i].cycles;
+        s->num_hist = XEN_DOMCTL_EXIT_STATS_BUCKETS;
+        s->hist = libxl__calloc(NOGC, s->num_hist, sizeof(*s->hist));
+        memcpy(s->hist, xstats[i].hist, sizeof(xstats[i].hist));
+    }
+
+    rc = 0;
+    goto out;
+
+ err:
+    LOGED(ERROR, domid, "Getting VM exit stats");
+    rc = ERROR_FAIL;
+ out:
+    GC_FREE;
+    return rc;
+}
+
 int libxl_domain_core_dump(libxl_ctx *ctx, uint32_t domid,
                            const char *filename,
                            const libxl_asyncop_how *ao_how)
@@ -588,6 +691,125 @@ int libxl_domain_unpause(libxl_ctx *ctx, uint32_t domid)
     return rc;
 }
 
+int libxl_domain_fork(libxl_ctx *ctx, uint32_t parent, const char *name,
+                      bool paused, uint32_t *domid_r)
+{
+    GC_INIT(ctx);
+    libxl_domain_config parent_config, d_config;
+    xc_domain_configuration_t xc_config;
+    libxl__domain_userdata_lock *lock = NULL;
+    xc_dominfo_t info;
+    uint32_t domid = INVALID_DOMID;
+    unsigned long shadow_mb = 0;
+    const char *dom_path, *vm_path;
+    int r, rc;
+
+    libxl_domain_config_init(&parent_config);
+    libxl_domain_config_init(&d_config);
+
+    r = xc_domain_getinfo(ctx->xch, parent, 1, &info);
+    if (r != 1 || info.domid != parent) {
+        LOGED(ERROR, parent, "Getting domain info");
+        rc = ERROR_FAIL;
+        goto out;
+    }
+    if (!info.hvm) {
+        LOGD(ERROR, parent, "Only HVM domains can be forked");
+        rc = ERROR_INVAL;
+        goto out;
+    }
+
+    rc = libxl__get_domain_configuration(gc, parent, &parent_config);
+    if (rc) {
+        LOGD(ERROR, parent, "Failed to retrieve domain configuration");
+        goto out;
+    }
+
+    /*
+     * Only memory and vCPU state is inherited, so the child gets the
+     * parent's create and build info but none of its devices.
+     */
+    libxl_domain_create_info_copy(ctx, &d_config.c_info,
+                                  &parent_config.c_info);
+    libxl_domain_build_info_copy(ctx, &d_config.b_info,
+                                 &parent_config.b_info);
+    free(d_config.c_info.name);
+    d_config.c_info.name = libxl__strdup(NOGC, name);
+    libxl_uuid_generate(&d_config.c_info.uuid);
+
+    memset(&xc_config, 0, sizeof(xc_config));
+    rc = libxl__domain_make(gc, &d_config, &domid, &xc_config);
+    if (rc)
+        goto out;
+
+    if (xc_domain_max_vcpus(ctx->xch, domid, d_config.b_info.max_vcpus) ||
+        xc_domain_setmaxmem(ctx->xch, domid, info.max_memkb) ||
+        xc_shadow_control(ctx->xch, parent,
+                          XEN_DOMCTL_SHADOW_OP_GET_ALLOCATION,
+                          NULL, 0, &shadow_mb, 0, NULL) ||
+        xc_shadow_control(ctx->xch, domid,
+                          XEN_DOMCTL_SHADOW_OP_SET_ALLOCATION,
+                          NULL, 0, &shadow_mb, 0, NULL)) {
+        LOGED(ERROR, domid, "Setting up fork of domain %u", parent);
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    if (xc_memshr_control(ctx->xch, parent, 1) ||
+        xc_memshr_control(ctx->xch, domid, 1)) {
+        LOGED(ERROR, domid, "Enabling memory sharing");
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    /* The parent's memory is the child's: it must not run again. */
+    if (!info.paused && xc_domain_pause(ctx->xch, parent)) {
+        LOGED(ERROR, parent, "Pausing domain");
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    if (xc_memshr_fork(ctx->xch, parent, domid)) {
+        LOGED(ERROR, domid, "Forking domain %u", parent);
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    lock = libxl__lock_domain_userdata(gc, domid);
+    if (!lock) {
+        rc = ERROR_LOCK_FAIL;
+        goto out;
+    }
+    rc = libxl__set_domain_configuration(gc, domid, &d_config);
+    libxl__unlock_domain_userdata(lock);
+    if (rc)
+        goto out;
+
+    if (!paused && xc_domain_unpause(ctx->xch, domid)) {
+        LOGED(ERROR, domid, "Unpausing domain");
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    LOGD(DEBUG, domid, "Forked from domain %u", parent);
+    *domid_r = domid;
+
+ out:
+    if (rc && libxl_domid_valid_guest(domid)) {
+        dom_path = libxl__xs_get_dompath(gc, domid);
+        vm_path = libxl__xs_read(gc, XBT_NULL, GCSPRINTF("%s/vm", dom_path));
+        xc_domain_destroy(ctx->xch, domid);
+        if (vm_path)
+            xs_rm(ctx->xsh, XBT_NULL, vm_path);
+        xs_rm(ctx->xsh, XBT_NULL, dom_path);
+        xs_rm(ctx->xsh, XBT_NULL, libxl__xs_libxl_path(gc, domid));
+    }
+    libxl_domain_config_dispose(&d_config);
+    libxl_domain_config_dispose(&parent_config);
+    GC_FREE;
+    return rc;
+}
+
 int libxl__domain_pvcontrol_available(libxl__gc *gc, uint32_t domid)
 {
     libxl_ctx *ctx = libxl__gc_owner(gc);
@@ -1195,13 +1417,187 @@ int libxl__resolve_domid(libxl__gc *gc, const char *name, uint32_t *domid)
     return libxl_domain_qualifier_to_domid(CTX, name, domid);
 }
 
+/* Number of domains or vcpus fetched at once by the iterators. */
+#define ITER_BATCH 256
+
+struct libxl__domain_iter {
+    libxl_ctx *ctx;
+    uint32_t next_domid;        /* to fetch from, DOMID_INVALID at the end */
+    int nr, idx;                /* info[idx..nr-1] are still to return */
+    xc_domaininfo_t info[ITER_BATCH];
+};
+
+int libxl_domain_iter_init(libxl_ctx *ctx, libxl_domain_iter **iter_r)
+{
+    GC_INIT(ctx);
+    libxl_domain_iter *iter = libxl__zalloc(NOGC, sizeof(*iter));
+
+    iter->ctx = ctx;
+    *iter_r = iter;
+    GC_FREE;
+    return 0;
+}
+
+int libxl_domain_iter_next(libxl_domain_iter *iter, libxl_dominfo *info_r)
+{
+    libxl_ctx *ctx = iter->ctx;
+    int ret;
+    GC_INIT(ctx);
+
+    while (iter->idx == iter->nr) {
+        if (iter->next_domid == DOMID_INVALID) {
+            GC_FREE;
+            return 0;
+        }
+
+        ret = xc_domain_getinfolist_changed(ctx->xch, iter->next_domid,
+                                            ITER_BATCH, 0, iter->info,
+                                            &iter->next_domid, NULL);
+        if (ret < 0) {
+            LOGE(ERROR, "getting domain info list");
+            GC_FREE;
+            return ERROR_FAIL;
+        }
+        iter->nr = ret;
+        iter->idx = 0;
+    }
+
+    libxl_dominfo_dispose(info_r);
+    libxl_dominfo_init(info_r);
+    libxl__xcinfo2xlinfo(ctx, &iter->info[iter->idx++], info_r);
+
+    GC_FREE;
+    return 1;
+}
+
+void libxl_domain_iter_free(libxl_domain_iter *iter)
+{
+    free(iter);
+}
+
+struct libxl__vcpu_iter {
+    libxl_ctx *ctx;
+    bool single_domain;
+    uint32_t next_domid;        /* to fetch from, DOMID_INVALID at the end */
+    uint32_t next_vcpu;
+    int nr, idx;                /* info[idx..nr-1] are still to return */
+    int nr_cpus;
+    unsigned int map_bytes;
+    uint8_t *cpumap_hard, *cpumap_soft; /* ITER_BATCH maps of map_bytes */
+    xc_vcpuinfolist_t info[ITER_BATCH];
+};
+
+int libxl_vcpu_iter_init(libxl_ctx *ctx, uint32_t domid,
+                         libxl_vcpu_iter **iter_r)
+{
+    GC_INIT(ctx);
+    libxl_vcpu_iter *iter;
+    int nr_cpus = libxl_get_max_cpus(ctx);
+
+    if (nr_cpus <= 0) {
+        LOG(ERROR, "unable to get the number of cpus");
+        GC_FREE;
+        return ERROR_FAIL;
+    }
+
+    iter = libxl__zalloc(NOGC, sizeof(*iter));
+    iter->ctx = ctx;
+    iter->single_domain = domid != INVALID_DOMID;
+    iter->next_domid = iter->single_domain ? domid : 0;
+    iter->nr_cpus = nr_cpus;
+    iter->map_bytes = (nr_cpus + 7) / 8;
+    iter->cpumap_hard = libxl__calloc(NOGC, ITER_BATCH, iter->map_bytes);
+    iter->cpumap_soft = libxl__calloc(NOGC, ITER_BATCH, iter->map_bytes);
+
+    *iter_r = iter;
+    GC_FREE;
+    return 0;
+}
+
+static int vcpu_iter_get_map(libxl_vcpu_iter *iter, libxl_bitmap *map,
+                             const uint8_t *maps)
+{
+    int rc;
+
+    if (map->size != iter->map_bytes) {
+        libxl_bitmap_dispose(map);
+        rc = libxl_cpu_bitmap_alloc(iter->ctx, map, iter->nr_cpus);
+        if (rc)
+            return rc;
+    }
+
+    memcpy(map->map, maps + (size_t)iter->idx * iter->map_bytes,
+           iter->map_bytes);
+    return 0;
+}
+
+int libxl_vcpu_iter_next(libxl_vcpu_iter *iter, uint32_t *domid_r,
+                         libxl_vcpuinfo *info_r)
+{
+    libxl_ctx *ctx = iter->ctx;
+    const xc_vcpuinfolist_t *info;
+    int ret, rc;
+    GC_INIT(ctx);
+
+    while (iter->idx == iter->nr) {
+        if (iter->next_domid == DOMID_INVALID) {
+            rc = 0;
+            goto out;
+        }
+
+        ret = xc_vcpu_getinfolist(ctx->xch, &iter->next_domid,
+                                  &iter->next_vcpu, iter->single_domain,
+                                  ITER_BATCH, iter->info, iter->cpumap_hard,
+                                  iter->cpumap_soft, iter->map_bytes);
+        if (ret < 0) {
+            LOGE(ERROR, "getting vcpu info list");
+            rc = ERROR_FAIL;
+            goto out;
+        }
+        iter->nr = ret;
+        iter->idx = 0;
+    }
+
+    rc = vcpu_iter_get_map(iter, &info_r->cpumap, iter->cpumap_hard);
+    if (!rc)
+        rc = vcpu_iter_get_map(iter, &info_r->cpumap_soft, iter->cpumap_soft);
+    if (rc)
+        goto out;
+
+    info = &iter->info[iter->idx++];
+    if (domid_r)
+        *domid_r = info->domain;
+    info_r->vcpuid = info->vcpu;
+    info_r->cpu = info->cpu;
+    info_r->online = !!info->online;
+    info_r->blocked = !!info->blocked;
+    info_r->running = !!info->running;
+    info_r->vcpu_time = info->cpu_time;
+    rc = 1;
+
+ out:
+    GC_FREE;
+    return rc;
+}
+
+void libxl_vcpu_iter_free(libxl_vcpu_iter *iter)
+{
+    if (!iter)
+        return;
+
+    free(iter->cpumap_hard);
+    free(iter->cpumap_soft);
+    free(iter);
+}
+
 libxl_vcpuinfo *libxl_list_vcpu(libxl_ctx *ctx, uint32_t domid,
                                        int *nr_vcpus_out, int *nr_cpus_out)
 {
     GC_INIT(ctx);
-    libxl_vcpuinfo *ptr, *ret;
+    libxl_vcpuinfo *ret;
+    libxl_vcpu_iter *iter;
     xc_domaininfo_t domaininfo;
-    xc_vcpuinfo_t vcpuinfo;
+    int nr_vcpus, rc;
 
     if (xc_domain_getinfolist(ctx->xch, domid, 1, &domaininfo) != 1) {
         LOGED(ERROR, domid, "Getting infolist");
@@ -1214,44 +1610,37 @@ libxl_vcpuinfo *libxl_list_vcpu(libxl_ctx *ctx, uint32_t domid,
         return NULL;
     }
 
-    *nr_cpus_out = libxl_get_max_cpus(ctx);
-    ret = ptr = libxl__calloc(NOGC, domaininfo.max_vcpu_id + 1,
-                              sizeof(libxl_vcpuinfo));
+    if (libxl_vcpu_iter_init(ctx, domid, &iter)) {
+        GC_FREE;
+        return NULL;
+    }
 
-    for (*nr_vcpus_out = 0;
-         *nr_vcpus_out <= domaininfo.max_vcpu_id;
-         ++*nr_vcpus_out, ++ptr) {
-        libxl_bitmap_init(&ptr->cpumap);
-        if (libxl_cpu_bitmap_alloc(ctx, &ptr->cpumap, 0))
-            goto err;
-        libxl_bitmap_init(&ptr->cpumap_soft);
-        if (libxl_cpu_bitmap_alloc(ctx, &ptr->cpumap_soft, 0))
-            goto err;
-        if (xc_vcpu_getinfo(ctx->xch, domid, *nr_vcpus_out, &vcpuinfo) == -1) {
-            LOGED(ERROR, domid, "Getting vcpu info");
-            goto err;
-        }
+    *nr_cpus_out = iter->nr_cpus;
+    ret = libxl__calloc(NOGC, domaininfo.max_vcpu_id + 1,
+                        sizeof(libxl_vcpuinfo));
 
-        if (xc_vcpu_getaffinity(ctx->xch, domid, *nr_vcpus_out,
-                                ptr->cpumap.map, ptr->cpumap_soft.map,
-                                XEN_VCPUAFFINITY_SOFT|XEN_VCPUAFFINITY_HARD) == -1) {
-            LOGED(ERROR, domid, "Getting vcpu affinity");
+    /* All the vcpus of the domain, in one batch unless it is huge. */
+    for (nr_vcpus = 0; nr_vcpus <= domaininfo.max_vcpu_id; nr_vcpus++) {
+        libxl_vcpuinfo_init(&ret[nr_vcpus]);
+        rc = libxl_vcpu_iter_next(iter, NULL, &ret[nr_vcpus]);
+        if (rc < 0)
             goto err;
-        }
-        ptr->vcpuid = *nr_vcpus_out;
-        ptr->cpu = vcpuinfo.cpu;
-        ptr->online = !!vcpuinfo.online;
-        ptr->blocked = !!vcpuinfo.blocked;
-        ptr->running = !!vcpuinfo.running;
-        ptr->vcpu_time = vcpuinfo.cpu_time;
+        if (rc == 0)
+            break;
+    }
+    if (!nr_vcpus) {
+        LOGD(ERROR, domid, "Getting vcpu info");
+        goto err;
     }
+
+    libxl_vcpu_iter_free(iter);
+    *nr_vcpus_out = nr_vcpus;
     GC_FREE;
     return ret;
 
 err:
-    libxl_bitmap_dispose(&ptr->cpumap);
-    libxl_bitmap_dispose(&ptr->cpumap_soft);
-    free(ret);
+    libxl_vcpu_iter_free(iter);
+    libxl_vcpuinfo_list_free(ret, domaininfo.max_vcpu_id + 1);
     GC_FREE;
     return NULL;
 }
@@ -1292,6 +1681,8 @@ static int libxl__set_vcpuonline_qmp(libxl__gc *gc, uint32_t domid,
     libxl_bitmap_init(&current_map);
     libxl_bitmap_init(&final_map);
 
+    libxl__qmp_hold(gc, domid);
+
     libxl_bitmap_alloc(CTX, &current_map, info->vcpu_max_id + 1);
     libxl_bitmap_set_none(&current_map);
     rc = libxl__qmp_query_cpus(gc, domid, &current_map);
@@ -1315,6 +1706,7 @@ static int libxl__set_vcpuonline_qmp(libxl__gc *gc, uint32_t domid,
 
     rc = 0;
 out:
+    libxl__qmp_release(gc, domid);
     libxl_bitmap_dispose(&current_map);
     libxl_bitmap_dispose(&final_map);
     return rc;
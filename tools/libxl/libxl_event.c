@@ -283,6 +283,15 @@ int libxl__gettimeofday(libxl__gc *gc, struct timeval *now_r)
     return 0;
 }
 
+uint64_t libxl__monotonic_us(void)
+{
+    struct timespec now;
+
+    /* Cannot fail with a valid clock id and pointer. */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
 static int time_rel_to_abs(libxl__gc *gc, int ms, struct timeval *abs_out)
 {
     int rc;
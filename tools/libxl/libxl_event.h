@@ -194,6 +194,21 @@ void libxl_evdisable_disk_eject(libxl_ctx *ctx, libxl_evgen_disk_eject*);
    * member of event.u.
    */
 
+typedef struct libxl__evgen_domain_create_stages
+    libxl_evgen_domain_create_stages;
+int libxl_evenable_domain_create_stages(libxl_ctx *ctx, libxl_ev_user,
+                        libxl_evgen_domain_create_stages **evgen_out);
+void libxl_evdisable_domain_create_stages(libxl_ctx *ctx,
+                                    libxl_evgen_domain_create_stages*);
+  /* Arranges for the generation of a DOMAIN_CREATE_STAGE event for
+   * each stage of each domain creation done with ctx, as the stage
+   * ends.  start_us is the start of the stage in microseconds since
+   * the start of the creation, measured by a monotonic clock.  device
+   * names the device attached for a stage of type DEVICE, e.g.
+   * "vif/0", and is NULL otherwise.  A failed creation generates the
+   * events of the stages which it completed.
+   */
+
 
 /*======================================================================*/
 
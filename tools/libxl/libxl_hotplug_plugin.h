@@ -0,0 +1,90 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#ifndef LIBXL_HOTPLUG_PLUGIN_H
+#define LIBXL_HOTPLUG_PLUGIN_H
+
+/*
+ * Hotplug plugins
+ * ===============
+ *
+ * Before running a hotplug script, libxl looks for a shared object
+ * named after it in (by default) /usr/lib/xen/lib/hotplug, e.g.
+ * vif-bridge.so for /etc/xen/scripts/vif-bridge.  If there is one, libxl
+ * calls its LIBXL_HOTPLUG_PLUGIN_ENTRY function in process, instead of
+ * forking the script.
+ *
+ * The plugin is called with the arguments and environment the script
+ * would have got, and must then do everything the script does, including
+ * writing hotplug-status (or hotplug-error) to the backend directory.
+ * Anything it does not know how to handle (e.g. an unknown action, or a
+ * configuration needing the script's iptables handling) should be left
+ * to the script by returning LIBXL_HOTPLUG_PLUGIN_FALLBACK.
+ *
+ * Plugins run synchronously in the libxl event loop of the toolstack
+ * process, so they must not block for long, must not fork without
+ * libxl's help, and must not change signal dispositions or other
+ * process-wide state.  They may be called concurrently from several
+ * threads.
+ */
+
+/*
+ * Version of libxl_hotplug_plugin_call.  Later versions only add
+ * members at its end.
+ */
+#define LIBXL_HOTPLUG_PLUGIN_VERSION 1
+
+/* Name of the libxl_hotplug_plugin_fn the plugin must export. */
+#define LIBXL_HOTPLUG_PLUGIN_ENTRY "libxl_hotplug_plugin_run"
+
+typedef struct libxl_hotplug_plugin_call {
+    unsigned int version;
+
+    /* NULL terminated argument vector of the script, args[0] being it. */
+    const char *const *args;
+    /* Environment of the script: name, value, name, value, ..., NULL. */
+    const char *const *env;
+
+    /*
+     * Access to xenstore through libxl's connection, outside of any
+     * transaction.  xs_read returns a string valid until the plugin
+     * returns, or NULL with errno set (ENOENT if the node doesn't exist).
+     * xs_write returns 0 or -1.
+     */
+    const char *(*xs_read)(void *opaque, const char *path);
+    int (*xs_write)(void *opaque, const char *path, const char *value);
+
+    /* Log msg to libxl's logger, as an error if error is non-zero. */
+    void (*log)(void *opaque, int error, const char *msg);
+
+    void *opaque;
+} libxl_hotplug_plugin_call;
+
+/* Returned by a plugin to have libxl run the hotplug script instead. */
+#define LIBXL_HOTPLUG_PLUGIN_FALLBACK 1
+
+/*
+ * Returns 0 on success, LIBXL_HOTPLUG_PLUGIN_FALLBACK, or -1 if the
+ * hotplug action failed, just like a script exiting with a non-zero
+ * status.
+ */
+typedef int libxl_hotplug_plugin_fn(const libxl_hotplug_plugin_call *call);
+
+#endif /* LIBXL_HOTPLUG_PLUGIN_H */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
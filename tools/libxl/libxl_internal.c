@@ -51,12 +51,15 @@ void libxl__ptr_add(libxl__gc *gc, void *ptr)
     if (!ptr)
         return;
 
-    /* fast case: we have space in the array for storing the pointer */
-    for (i = 0; i < gc->alloc_maxsize; i++) {
-        if (!gc->alloc_ptrs[i]) {
-            gc->alloc_ptrs[i] = ptr;
-            return;
-        }
+    /*
+     * fast case: we have space in the array for storing the pointer.
+     * Pointers are never removed, so the free slots are all at the end:
+     * don't look through the used ones, there can be thousands of them
+     * (e.g. when parsing JSON).
+     */
+    if (gc->alloc_used < gc->alloc_maxsize) {
+        gc->alloc_ptrs[gc->alloc_used++] = ptr;
+        return;
     }
     int new_maxsize = gc->alloc_maxsize * 2 + 25;
     assert(new_maxsize < INT_MAX / sizeof(void*) / 2);
@@ -65,9 +68,11 @@ void libxl__ptr_add(libxl__gc *gc, void *ptr)
         libxl__alloc_failed(CTX, __func__, new_maxsize, sizeof(void*));
 
     gc->alloc_ptrs[gc->alloc_maxsize++] = ptr;
+    gc->alloc_used = gc->alloc_maxsize;
 
-    while (gc->alloc_maxsize < new_maxsize)
-        gc->alloc_ptrs[gc->alloc_maxsize++] = 0;
+    for (i = gc->alloc_maxsize; i < new_maxsize; i++)
+        gc->alloc_ptrs[i] = 0;
+    gc->alloc_maxsize = new_maxsize;
 
     return;
 }
@@ -87,6 +92,7 @@ void libxl__free_all(libxl__gc *gc)
     free(gc->alloc_ptrs);
     gc->alloc_ptrs = 0;
     gc->alloc_maxsize = 0;
+    gc->alloc_used = 0;
 }
 
 void *libxl__malloc(libxl__gc *gc, size_t size)
@@ -127,8 +133,9 @@ void *libxl__realloc(libxl__gc *gc, void *ptr, size_t new_size)
     if (ptr == NULL) {
         libxl__ptr_add(gc, new_ptr);
     } else if (new_ptr != ptr && libxl__gc_is_real(gc)) {
-        for (i = 0; ; i++) {
-            assert(i < gc->alloc_maxsize);
+        /* Memory being grown was most likely allocated recently. */
+        for (i = gc->alloc_used - 1; ; i--) {
+            assert(i >= 0);
             if (gc->alloc_ptrs[i] == ptr) {
                 gc->alloc_ptrs[i] = new_ptr;
                 break;
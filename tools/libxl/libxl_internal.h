@@ -385,6 +385,14 @@ struct libxl__evgen_disk_eject {
 _hidden void
 libxl__evdisable_disk_eject(libxl__gc*, libxl_evgen_disk_eject*);
 
+struct libxl__evgen_domain_create_stages {
+    LIBXL_LIST_ENTRY(libxl_evgen_domain_create_stages) entry;
+    libxl_ev_user user;
+};
+_hidden void
+libxl__evdisable_domain_create_stages(libxl__gc*,
+                                      libxl_evgen_domain_create_stages*);
+
 typedef struct libxl__poller libxl__poller;
 struct libxl__poller {
     /*
@@ -432,6 +440,7 @@ struct libxl__poller {
 struct libxl__gc {
     /* mini-GC */
     int alloc_maxsize; /* -1 means this is the dummy non-gc gc */
+    int alloc_used; /* alloc_ptrs[alloc_used..alloc_maxsize-1] are free */
     void **alloc_ptrs;
     libxl_ctx *owner;
 };
@@ -493,6 +502,7 @@ struct libxl__ctx {
     libxl__ev_xswatch death_watch;
     
     LIBXL_LIST_HEAD(, libxl_evgen_disk_eject) disk_eject_evgens;
+    LIBXL_LIST_HEAD(, libxl_evgen_domain_create_stages) create_stage_evgens;
 
     const libxl_childproc_hooks *childproc_hooks;
     void *childproc_user;
@@ -503,6 +513,16 @@ struct libxl__ctx {
     LIBXL_LIST_ENTRY(libxl_ctx) sigchld_users_entry;
 
     libxl_version_info version_info;
+
+    LIBXL_LIST_HEAD(, struct libxl__qmp_handler) qmp_held; /* see libxl_qmp.c */
+
+    /* Number of vcpus runnable on each node, see libxl_numa.c */
+    struct {
+        int *vcpus_on_node;
+        int nr_nodes;
+        libxl_bitmap cpumap; /* the vcpus were counted on */
+        struct timeval stamp;
+    } numa_load;
 };
 
 /*
@@ -596,6 +616,7 @@ struct libxl__ao {
 
 #define LIBXL_INIT_GC(gc,ctx) do{               \
         (gc).alloc_maxsize = 0;                 \
+        (gc).alloc_used = 0;                    \
         (gc).alloc_ptrs = 0;                    \
         (gc).owner = (ctx);                     \
     } while(0)
@@ -1118,6 +1139,17 @@ _hidden int libxl__file_reference_unmap(libxl__file_reference *f);
 /* from xl_dom */
 _hidden libxl_domain_type libxl__domain_type(libxl__gc *gc, uint32_t domid);
 _hidden int libxl__domain_cpupool(libxl__gc *gc, uint32_t domid);
+/*
+ * Set the affinity of nr_vcpus vcpus from first_vcpu with one hypercall,
+ * each from its own entry of cpumaps_hard and cpumaps_soft (either of which
+ * may be NULL), or all from the first one if same.
+ */
+_hidden int libxl__set_vcpuaffinity_list(libxl__gc *gc, uint32_t domid,
+                                         uint32_t first_vcpu,
+                                         uint32_t nr_vcpus,
+                                         const libxl_bitmap *cpumaps_hard,
+                                         const libxl_bitmap *cpumaps_soft,
+                                         bool same);
 _hidden libxl_scheduler libxl__domain_scheduler(libxl__gc *gc, uint32_t domid);
 _hidden int libxl__sched_set_params(libxl__gc *gc, uint32_t domid,
                                     libxl_domain_sched_params *scparams);
@@ -1149,6 +1181,9 @@ typedef struct {
 
     xen_pfn_t vuart_gfn;
     evtchn_port_t vuart_port;
+
+    /* When libxl__build_dom populated the memory, see libxl__monotonic_us */
+    uint64_t populate_start_us, populate_end_us;
 } libxl__domain_build_state;
 
 _hidden int libxl__build_pre(libxl__gc *gc, uint32_t domid,
@@ -1795,6 +1830,8 @@ _hidden int libxl__mac_is_default(libxl_mac *mac);
 _hidden int libxl__init_recursive_mutex(libxl_ctx *ctx, pthread_mutex_t *lock);
 
 _hidden int libxl__gettimeofday(libxl__gc *gc, struct timeval *now_r);
+/* Microseconds since some point in the past, never going backwards */
+_hidden uint64_t libxl__monotonic_us(void);
 
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
@@ -1860,6 +1897,15 @@ _hidden int libxl__qmp_hmp(libxl__gc *gc, int domid, const char *command_line,
                            char **out);
 /* close and free the QMP handler */
 _hidden void libxl__qmp_close(libxl__qmp_handler *qmp);
+/*
+ * Keep the connection to the QMP server of domid open for the commands
+ * run until the matching libxl__qmp_release() to reuse, instead of each
+ * connecting anew. Holds nest. QEMU only serves one client at a time on
+ * the socket, so a connection should only be held for the duration of a
+ * sequence of commands.
+ */
+_hidden void libxl__qmp_hold(libxl__gc *gc, uint32_t domid);
+_hidden void libxl__qmp_release(libxl__gc *gc, uint32_t domid);
 /* remove the socket file, if the file has already been removed,
  * nothing happen */
 _hidden void libxl__qmp_cleanup(libxl__gc *gc, uint32_t domid);
@@ -2025,6 +2071,15 @@ libxl__json_map_node *libxl__json_map_node_get(const libxl__json_object *o,
 _hidden const libxl__json_object *libxl__json_map_get(const char *key,
                                           const libxl__json_object *o,
                                           libxl__json_node_type expected_type);
+/*
+ * Like libxl__json_map_get, but starts looking at index *pos of the map,
+ * and sets *pos to the index following the key found.  So looking up keys
+ * in the order they appear in the map is linear in its size.
+ */
+_hidden const libxl__json_object *libxl__json_map_get_from(const char *key,
+                                          const libxl__json_object *o,
+                                          libxl__json_node_type expected_type,
+                                          int *pos);
 _hidden yajl_status libxl__json_object_to_yajl_gen(libxl__gc *gc_opt,
                                                    yajl_gen hand,
                                                    libxl__json_object *param);
@@ -2355,6 +2410,7 @@ _hidden const char *libxl__private_bindir_path(void);
 _hidden const char *libxl__xenfirmwaredir_path(void);
 _hidden const char *libxl__xen_config_dir_path(void);
 _hidden const char *libxl__xen_script_dir_path(void);
+_hidden const char *libxl__hotplug_plugin_dir_path(void);
 _hidden const char *libxl__lock_dir_path(void);
 _hidden const char *libxl__run_dir_path(void);
 _hidden const char *libxl__seabios_path(void);
@@ -2436,6 +2492,7 @@ struct libxl__ao_device {
     /* private for multidev */
     int active;
     libxl__multidev *multidev; /* reference to the containing multidev */
+    uint64_t start_us; /* when prepared, see libxl__monotonic_us */
     /* private for add/remove implementation */
     libxl__ev_devstate backend_ds;
     /* Bodge for Qemu devices */
@@ -2507,6 +2564,8 @@ typedef void libxl__devices_callback(libxl__egc*, libxl__multidev*, int rc);
 struct libxl__multidev {
     /* set by user: */
     libxl__devices_callback *callback;
+    /* optional, called as each device is done, before callback: */
+    libxl__device_callback *device_done;
     /* for private use by libxl__...ao_devices... machinery: */
     libxl__ao *ao;
     libxl__ao_device **array;
@@ -3270,7 +3329,12 @@ struct libxl__domain_suspend_state {
 
     libxl__ev_evtchn guest_evtchn;
     int guest_evtchn_lockfd;
+    /* guest_evtchn is ours, only used by Xen to say the guest suspended */
+    bool guest_evtchn_notify_only;
     int guest_responded;
+    /* When suspending started, the guest suspended, and qemu was saved,
+     * see libxl__monotonic_us; 0 if not (yet) */
+    uint64_t suspend_start_us, suspended_us, dm_saved_us;
 
     libxl__xswait_state pvcontrol;
     libxl__ev_xswatch guest_watch;
@@ -3296,6 +3360,9 @@ struct libxl__domain_save_state {
     libxl_domain_type type;
     int live;
     int debug;
+    int zero_pages;
+    int auto_converge;
+    uint32_t max_downtime_ms;
     int checkpointed_stream;
     const libxl_domain_remus_info *remus;
     /* private */
@@ -3577,6 +3644,8 @@ typedef int (*device_set_xenstore_config_fn_t)(libxl__gc *, uint32_t, void *,
 struct libxl_device_type {
     libxl__device_kind type;
     int skip_attach;   /* Skip entry in domcreate_attach_devices() if 1 */
+    int attach_after;  /* Wait in domcreate_attach_devices() for the
+                          previous entries to be attached if 1 */
     int ptr_offset;    /* Offset of device array ptr in libxl_domain_config */
     int num_offset;    /* Offset of # of devices in libxl_domain_config */
     int dev_elem_size; /* Size of one device element in array */
@@ -3816,6 +3885,9 @@ struct libxl__domain_create_state {
     /* private to domain_create */
     int guest_domid;
     int device_type_idx;
+    /* See domcreate_stage_done */
+    uint64_t start_us, stage_start_us;
+    uint64_t stage_total_us[LIBXL_DOMAIN_CREATE_STAGE_TOTAL + 1];
     const char *colo_proxy_script;
     libxl__domain_build_state build_state;
     libxl__colo_restore_state crs;
@@ -4119,6 +4191,15 @@ _hidden int libxl__get_numa_candidate(libxl__gc *gc,
                                       libxl__numa_candidate *cndt_out,
                                       int *cndt_found);
 
+/*
+ * Account for nr_vcpus more vcpus being runnable on the nodes in nodemap,
+ * e.g. because a domain just got placed there, in the vcpu counts
+ * libxl__get_numa_candidate() may reuse in its next invocations.
+ */
+_hidden void libxl__numa_account_placement(libxl__gc *gc,
+                                           const libxl_bitmap *nodemap,
+                                           int nr_vcpus);
+
 /* Initialization, allocation and deallocation for placement candidates */
 static inline void libxl__numa_candidate_init(libxl__numa_candidate *cndt)
 {
@@ -586,18 +586,30 @@ libxl__json_map_node *libxl__json_map_node_get(const libxl__json_object *o,
 const libxl__json_object *libxl__json_map_get(const char *key,
                                           const libxl__json_object *o,
                                           libxl__json_node_type expected_type)
+{
+    int pos = 0;
+
+    return libxl__json_map_get_from(key, o, expected_type, &pos);
+}
+
+const libxl__json_object *libxl__json_map_get_from(const char *key,
+                                          const libxl__json_object *o,
+                                          libxl__json_node_type expected_type,
+                                          int *pos)
 {
     flexarray_t *maps = NULL;
-    int idx = 0;
+    int i, idx;
 
     if (libxl__json_object_is_map(o)) {
         libxl__json_map_node *node = NULL;
 
         maps = o->u.map;
-        for (idx = 0; idx < maps->count; idx++) {
+        for (i = 0; i < maps->count; i++) {
+            idx = (*pos + i) % maps->count;
             if (flexarray_get(maps, idx, (void**)&node) != 0)
                 return NULL;
             if (strcmp(key, node->map_key) == 0) {
+                *pos = idx + 1;
                 if (expected_type == JSON_ANY
                     || (node->obj && (node->obj->type & expected_type))) {
                     return node->obj;
@@ -1019,23 +1031,12 @@ out:
 
 yajl_gen_status libxl__uint64_gen_json(yajl_gen hand, uint64_t val)
 {
-    char *num;
+    char num[24];
     int len;
-    yajl_gen_status s;
 
+    len = snprintf(num, sizeof(num), "%"PRIu64, val);
 
-    len = asprintf(&num, "%"PRIu64, val);
-    if (len == -1) {
-        s = yajl_gen_in_error_state;
-        goto out;
-    }
-
-    s = yajl_gen_number(hand, num, len);
-
-    free(num);
-
-out:
-    return s;
+    return yajl_gen_number(hand, num, len);
 }
 
 int libxl__object_from_json(libxl_ctx *ctx, const char *type,
@@ -136,47 +136,6 @@ static void comb_get_nodemap(comb_iter_t it, libxl_bitmap *suitable_nodemap,
     }
 }
 
-/* Retrieve the number of cpus that the nodes that are part of the nodemap
- * span and are also set in suitable_cpumap. */
-static int nodemap_to_nr_cpus(libxl_cputopology *tinfo, int nr_cpus,
-                              const libxl_bitmap *suitable_cpumap,
-                              const libxl_bitmap *nodemap)
-{
-    int i, nodes_cpus = 0;
-
-    for (i = 0; i < nr_cpus; i++) {
-        if (libxl_bitmap_test(suitable_cpumap, i) &&
-            libxl_bitmap_test(nodemap, tinfo[i].node))
-            nodes_cpus++;
-    }
-    return nodes_cpus;
-}
-
-/* Retrieve the amount of free memory within the nodemap */
-static uint32_t nodemap_to_free_memkb(libxl_numainfo *ninfo,
-                                      libxl_bitmap *nodemap)
-{
-    uint32_t free_memkb = 0;
-    int i;
-
-    libxl_for_each_set_bit(i, *nodemap)
-        free_memkb += ninfo[i].free / 1024;
-
-    return free_memkb;
-}
-
-/* Retrieve the number of vcpus able to run on the nodes in nodemap */
-static int nodemap_to_nr_vcpus(libxl__gc *gc, int vcpus_on_node[],
-                               const libxl_bitmap *nodemap)
-{
-    int i, nr_vcpus = 0;
-
-    libxl_for_each_set_bit(i, *nodemap)
-        nr_vcpus += vcpus_on_node[i];
-
-    return nr_vcpus;
-}
-
 /* Number of vcpus able to run on the cpus of the various nodes
  * (reported by filling the array vcpus_on_node[]). */
 static int nr_vcpus_on_nodes(libxl__gc *gc, libxl_cputopology *tinfo,
@@ -264,6 +223,77 @@ static int nr_vcpus_on_nodes(libxl__gc *gc, libxl_cputopology *tinfo,
     return 0;
 }
 
+/*
+ * Counting the vcpus runnable on each node means fetching the affinity of
+ * all the vcpus of all the domains, which takes a while on hosts running
+ * many of them. The counts are therefore kept in the ctx for a few
+ * seconds, during which the placements done through it are accounted for
+ * by libxl__numa_account_placement(). They only drive the choice among
+ * otherwise equivalent candidates, so they need not be exact.
+ */
+#define NUMA_LOAD_CACHE_SECS 5
+
+static int nr_vcpus_on_nodes_cached(libxl__gc *gc, libxl_cputopology *tinfo,
+                                    size_t tinfo_elements, int nr_nodes,
+                                    const libxl_bitmap *suitable_cpumap,
+                                    int vcpus_on_node[])
+{
+    struct timeval now, expiry;
+    const struct timeval validity = { .tv_sec = NUMA_LOAD_CACHE_SECS };
+    int rc;
+
+    rc = libxl__gettimeofday(gc, &now);
+    if (rc)
+        return rc;
+
+    CTX_LOCK;
+
+    timeradd(&CTX->numa_load.stamp, &validity, &expiry);
+    if (CTX->numa_load.vcpus_on_node &&
+        CTX->numa_load.nr_nodes == nr_nodes &&
+        timercmp(&now, &expiry, <) &&
+        libxl_bitmap_equal(&CTX->numa_load.cpumap, suitable_cpumap, 0)) {
+        memcpy(vcpus_on_node, CTX->numa_load.vcpus_on_node,
+               nr_nodes * sizeof(*vcpus_on_node));
+        goto out;
+    }
+
+    rc = nr_vcpus_on_nodes(gc, tinfo, tinfo_elements, suitable_cpumap,
+                           vcpus_on_node);
+    if (rc)
+        goto out;
+
+    free(CTX->numa_load.vcpus_on_node);
+    CTX->numa_load.vcpus_on_node = libxl__calloc(NOGC, nr_nodes,
+                                                 sizeof(*vcpus_on_node));
+    memcpy(CTX->numa_load.vcpus_on_node, vcpus_on_node,
+           nr_nodes * sizeof(*vcpus_on_node));
+    CTX->numa_load.nr_nodes = nr_nodes;
+    libxl_bitmap_dispose(&CTX->numa_load.cpumap);
+    libxl_bitmap_copy_alloc(CTX, &CTX->numa_load.cpumap, suitable_cpumap);
+    CTX->numa_load.stamp = now;
+
+ out:
+    CTX_UNLOCK;
+    return rc;
+}
+
+void libxl__numa_account_placement(libxl__gc *gc, const libxl_bitmap *nodemap,
+                                   int nr_vcpus)
+{
+    int i;
+
+    CTX_LOCK;
+    if (CTX->numa_load.vcpus_on_node) {
+        libxl_for_each_set_bit(i, *nodemap) {
+            if (i >= CTX->numa_load.nr_nodes)
+                break;
+            CTX->numa_load.vcpus_on_node[i] += nr_vcpus;
+        }
+    }
+    CTX_UNLOCK;
+}
+
 /*
  * This function tries to figure out if the host has a consistent number
  * of cpus along all its NUMA nodes. In fact, if that is the case, we can
@@ -298,6 +328,160 @@ static int count_cpus_per_node(libxl_cputopology *tinfo, int nr_cpus,
     return cpus_per_node;
 }
 
+/* What placement candidates are evaluated against */
+typedef struct {
+    int nr_nodes;
+    int *cpus;              /* suitable cpus of each node */
+    int *vcpus;             /* vcpus runnable on each node */
+    uint64_t *free_memkb;   /* free memory of each node */
+    libxl_numainfo *ninfo;
+    uint64_t min_free_memkb;
+    int min_cpus;
+    libxl__numa_candidate_cmpf numa_cmpf;
+} numa_search;
+
+/*
+ * Check whether the nodes in nodemap satisfy the constraints and, if they
+ * do and make for a better candidate than the best one found so far (if
+ * any), make them the best one. Candidates with fewer nodes always win,
+ * the comparison function decides among the ones with as many nodes.
+ * Returns true if the search is over, as, without a comparison function,
+ * the first suitable candidate is the answer.
+ */
+static bool consider_candidate(libxl__gc *gc, const numa_search *s,
+                               const libxl_bitmap *nodemap,
+                               libxl__numa_candidate *new_cndt,
+                               libxl__numa_candidate *cndt_out,
+                               int *cndt_found)
+{
+    int i;
+
+    new_cndt->nr_nodes = new_cndt->nr_cpus = new_cndt->nr_vcpus = 0;
+    new_cndt->free_memkb = 0;
+    libxl_for_each_set_bit(i, *nodemap) {
+        new_cndt->nr_nodes++;
+        new_cndt->nr_cpus += s->cpus[i];
+        new_cndt->nr_vcpus += s->vcpus[i];
+        new_cndt->free_memkb += s->free_memkb[i];
+    }
+
+    if (s->min_free_memkb && new_cndt->free_memkb < s->min_free_memkb)
+        return false;
+    if (s->min_cpus && new_cndt->nr_cpus < s->min_cpus)
+        return false;
+
+    if (*cndt_found) {
+        if (new_cndt->nr_nodes > cndt_out->nr_nodes)
+            return false;
+        if (new_cndt->nr_nodes == cndt_out->nr_nodes &&
+            (!s->numa_cmpf || s->numa_cmpf(new_cndt, cndt_out) >= 0))
+            return false;
+    }
+
+    *cndt_found = 1;
+
+    LOG(DEBUG, "New best NUMA placement candidate found: "
+               "nr_nodes=%d, nr_cpus=%d, nr_vcpus=%d, "
+               "free_memkb=%"PRIu64"", new_cndt->nr_nodes,
+               new_cndt->nr_cpus, new_cndt->nr_vcpus,
+               new_cndt->free_memkb / 1024);
+
+    libxl__numa_candidate_put_nodemap(gc, cndt_out, nodemap);
+    cndt_out->nr_vcpus = new_cndt->nr_vcpus;
+    cndt_out->free_memkb = new_cndt->free_memkb;
+    cndt_out->nr_nodes = new_cndt->nr_nodes;
+    cndt_out->nr_cpus = new_cndt->nr_cpus;
+
+    return s->numa_cmpf == NULL;
+}
+
+/*
+ * Up to this many combinations of a given number of nodes are all
+ * evaluated. Past that, candidates are built greedily instead.
+ */
+#define NUMA_MAX_COMBINATIONS 4096
+
+/* C(n k), or anything bigger than NUMA_MAX_COMBINATIONS if it is. */
+static unsigned long nr_combinations(int n, int k)
+{
+    unsigned long c = 1;
+    int i;
+
+    if (k > n - k)
+        k = n - k;
+    /* Exact at each step, as c then is C(n - k + i, i). */
+    for (i = 1; i <= k && c <= NUMA_MAX_COMBINATIONS; i++)
+        c = c * (n - k + i) / i;
+
+    return c;
+}
+
+static uint32_t node_distance(const numa_search *s, int from, int to)
+{
+    const libxl_numainfo *ninfo = &s->ninfo[from];
+
+    if (to >= ninfo->num_dists ||
+        ninfo->dists[to] == LIBXL_NUMAINFO_INVALID_ENTRY)
+        return 0;
+
+    return ninfo->dists[to];
+}
+
+/*
+ * Build a candidate around node seed, by adding, one at a time, the
+ * suitable node closest to the ones already in (with the most free
+ * memory breaking ties), until the candidate has at least min_nodes nodes
+ * and satisfies the constraints. Returns false if that takes more than
+ * max_nodes nodes.
+ */
+static bool grow_candidate(const numa_search *s,
+                           const libxl_bitmap *suitable_nodemap,
+                           int min_nodes, int max_nodes, int seed,
+                           libxl_bitmap *nodemap)
+{
+    uint64_t free_memkb = 0;
+    int nr_cpus = 0, nr = 0, node = seed;
+
+    libxl_bitmap_set_none(nodemap);
+    for (;;) {
+        uint64_t dist, best_dist = 0;
+        int i, j, best = -1;
+
+        libxl_bitmap_set(nodemap, node);
+        free_memkb += s->free_memkb[node];
+        nr_cpus += s->cpus[node];
+        nr++;
+
+        if (nr >= min_nodes &&
+            (!s->min_free_memkb || free_memkb >= s->min_free_memkb) &&
+            (!s->min_cpus || nr_cpus >= s->min_cpus))
+            return true;
+        if (nr >= max_nodes)
+            return false;
+
+        libxl_for_each_set_bit(i, *suitable_nodemap) {
+            if (i >= s->nr_nodes)
+                break;
+            if (libxl_bitmap_test(nodemap, i))
+                continue;
+
+            dist = 0;
+            libxl_for_each_set_bit(j, *nodemap)
+                dist += node_distance(s, j, i);
+
+            if (best < 0 || dist < best_dist ||
+                (dist == best_dist &&
+                 s->free_memkb[i] > s->free_memkb[best])) {
+                best = i;
+                best_dist = dist;
+            }
+        }
+        if (best < 0)
+            return false;
+        node = best;
+    }
+}
+
 /*
  * Looks for the placement candidates that satisfyies some specific
  * conditions and return the best one according to the provided
@@ -316,7 +500,8 @@ int libxl__get_numa_candidate(libxl__gc *gc,
     libxl_numainfo *ninfo = NULL;
     int nr_nodes = 0, nr_suit_nodes, nr_cpus = 0;
     libxl_bitmap suitable_nodemap, nodemap;
-    int *vcpus_on_node, rc = 0;
+    numa_search s;
+    int i, rc = 0;
 
     libxl_bitmap_init(&nodemap);
     libxl_bitmap_init(&suitable_nodemap);
@@ -332,34 +517,6 @@ int libxl__get_numa_candidate(libxl__gc *gc,
         goto out;
     }
 
-    GCNEW_ARRAY(vcpus_on_node, nr_nodes);
-
-    /*
-     * The good thing about this solution is that it is based on heuristics
-     * (implemented in numa_cmpf() ), but we at least can evaluate it on
-     * all the possible placement candidates. That can happen because the
-     * number of nodes present in current NUMA systems is quite small.
-     * In fact, even if a sum of binomials is involved, if the system has
-     * up to 16 nodes it "only" takes 65535 steps. This is fine, as the
-     * number of nodes the biggest NUMA systems provide at the time of this
-     * writing is 8 (and it will probably continue to be so for a while).
-     * However, computanional complexity would explode on systems bigger
-     * than that, and it's really important we avoid trying to run this
-     * on monsters with 32, 64 or more nodes (if they ever pop into being).
-     * Therefore, here it comes a safety catch that disables the algorithm
-     * for the cases when it wouldn't work well.
-     */
-    if (nr_nodes > 16) {
-        /* Log we did nothing and return 0, as no real error occurred */
-        LOG(WARN, "System has %d NUMA nodes, which is too big for the "
-                  "placement algorithm to work effectively: skipping it. "
-                  "Consider manually pinning the vCPUs and/or looking at "
-                  "cpupools for manually partitioning the system.",
-                  nr_nodes);
-        *cndt_found = 0;
-        goto out;
-    }
-
     tinfo = libxl_get_cpu_topology(CTX, &nr_cpus);
     if (tinfo == NULL) {
         rc = ERROR_FAIL;
@@ -383,15 +540,32 @@ int libxl__get_numa_candidate(libxl__gc *gc,
         goto out;
 
     /*
-     * Later on, we will try to figure out how many vcpus are runnable on
-     * each candidate (as a part of choosing the best one of them). That
-     * requires going through all the vcpus of all the domains and check
-     * their affinities. So, instead of doing that for each candidate,
-     * let's count here the number of vcpus runnable on each node, so that
-     * all we have to do later is summing up the right elements of the
-     * vcpus_on_node array.
+     * Candidates are evaluated over and over, so gather once the per node
+     * figures they are evaluated on: the number of suitable cpus and the
+     * amount of free memory of each node, and the number of vcpus runnable
+     * on each node. The latter requires going through all the vcpus of all
+     * the domains and check their affinities, see
+     * nr_vcpus_on_nodes_cached().
      */
-    rc = nr_vcpus_on_nodes(gc, tinfo, nr_cpus, suitable_cpumap, vcpus_on_node);
+    s.nr_nodes = nr_nodes;
+    s.ninfo = ninfo;
+    s.min_free_memkb = min_free_memkb;
+    s.min_cpus = min_cpus;
+    s.numa_cmpf = numa_cmpf;
+    GCNEW_ARRAY(s.cpus, nr_nodes);
+    GCNEW_ARRAY(s.vcpus, nr_nodes);
+    GCNEW_ARRAY(s.free_memkb, nr_nodes);
+
+    for (i = 0; i < nr_cpus; i++) {
+        if (libxl_bitmap_test(suitable_cpumap, i) &&
+            tinfo[i].node < nr_nodes)
+            s.cpus[tinfo[i].node]++;
+    }
+    for (i = 0; i < nr_nodes; i++)
+        s.free_memkb[i] = ninfo[i].free / 1024;
+
+    rc = nr_vcpus_on_nodes_cached(gc, tinfo, nr_cpus, nr_nodes,
+                                  suitable_cpumap, s.vcpus);
     if (rc)
         goto out;
 
@@ -439,12 +613,37 @@ int libxl__get_numa_candidate(libxl__gc *gc,
      * could find during the (i+1)-eth and all the subsequent steps (they
      * all will have more nodes). It's thus pointless to keep going if
      * we already found something.
+     *
+     * The number of combinations explodes with the number of nodes though
+     * (a sum of binomials is involved: all the subsets of 16 nodes already
+     * are 65535). So, as soon as there are too many combinations of a given
+     * size to try them all, resort to growing one candidate around each
+     * node instead, adding the closest nodes first (see grow_candidate()),
+     * which keeps placement quick on hosts of any size.
      */
     *cndt_found = 0;
     while (min_nodes <= max_nodes && *cndt_found == 0) {
         comb_iter_t comb_iter;
         int comb_ok;
 
+        if (nr_combinations(nr_suit_nodes, min_nodes) >
+            NUMA_MAX_COMBINATIONS) {
+            LOG(DEBUG, "Too many combinations of %d out of %d NUMA nodes, "
+                       "building placement candidates greedily",
+                       min_nodes, nr_suit_nodes);
+
+            libxl_for_each_set_bit(i, suitable_nodemap) {
+                if (i >= nr_nodes)
+                    break;
+                if (grow_candidate(&s, &suitable_nodemap, min_nodes,
+                                   max_nodes, i, &nodemap) &&
+                    consider_candidate(gc, &s, &nodemap, &new_cndt,
+                                       cndt_out, cndt_found))
+                    break;
+            }
+            break;
+        }
+
         /*
          * And here it is. Each step of this cycle generates a combination of
          * nodes as big as min_nodes mandates.  Each of these combinations is
@@ -455,61 +654,14 @@ int libxl__get_numa_candidate(libxl__gc *gc,
         for (comb_ok = comb_init(gc, &comb_iter, nr_suit_nodes, min_nodes);
              comb_ok;
              comb_ok = comb_next(comb_iter, nr_suit_nodes, min_nodes)) {
-            uint64_t nodes_free_memkb;
-            int nodes_cpus;
-
             /* Get the nodemap for the combination, only considering
              * suitable nodes. */
             comb_get_nodemap(comb_iter, &suitable_nodemap,
                              &nodemap, min_nodes);
 
-            /* If there is not enough memory in this combination, skip it
-             * and go generating the next one... */
-            nodes_free_memkb = nodemap_to_free_memkb(ninfo, &nodemap);
-            if (min_free_memkb && nodes_free_memkb < min_free_memkb)
-                continue;
-
-            /* And the same applies if this combination is short in cpus */
-            nodes_cpus = nodemap_to_nr_cpus(tinfo, nr_cpus, suitable_cpumap,
-                                            &nodemap);
-            if (min_cpus && nodes_cpus < min_cpus)
-                continue;
-
-            /*
-             * Conditions are met, we can compare this candidate with the
-             * current best one (if any).
-             */
-            libxl__numa_candidate_put_nodemap(gc, &new_cndt, &nodemap);
-            new_cndt.nr_vcpus = nodemap_to_nr_vcpus(gc, vcpus_on_node,
-                                                    &nodemap);
-            new_cndt.free_memkb = nodes_free_memkb;
-            new_cndt.nr_nodes = libxl_bitmap_count_set(&nodemap);
-            new_cndt.nr_cpus = nodes_cpus;
-
-            /*
-             * Check if the new candidate we is better the what we found up
-             * to now by means of the comparison function. If no comparison
-             * function is provided, just return as soon as we find our first
-             * candidate.
-             */
-            if (*cndt_found == 0 || numa_cmpf(&new_cndt, cndt_out) < 0) {
-                *cndt_found = 1;
-
-                LOG(DEBUG, "New best NUMA placement candidate found: "
-                           "nr_nodes=%d, nr_cpus=%d, nr_vcpus=%d, "
-                           "free_memkb=%"PRIu64"", new_cndt.nr_nodes,
-                           new_cndt.nr_cpus, new_cndt.nr_vcpus,
-                           new_cndt.free_memkb / 1024);
-
-                libxl__numa_candidate_put_nodemap(gc, cndt_out, &nodemap);
-                cndt_out->nr_vcpus = new_cndt.nr_vcpus;
-                cndt_out->free_memkb = new_cndt.free_memkb;
-                cndt_out->nr_nodes = new_cndt.nr_nodes;
-                cndt_out->nr_cpus = new_cndt.nr_cpus;
-
-                if (numa_cmpf == NULL)
-                    break;
-            }
+            if (consider_candidate(gc, &s, &nodemap, &new_cndt,
+                                   cndt_out, cndt_found))
+                break;
         }
         min_nodes++;
     }
@@ -30,6 +30,11 @@ const char *libxl__xen_script_dir_path(void)
     return XEN_SCRIPT_DIR;
 }
 
+const char *libxl__hotplug_plugin_dir_path(void)
+{
+    return LIBEXEC_LIB "/hotplug";
+}
+
 const char *libxl__run_dir_path(void)
 {
     return XEN_RUN_DIR;
@@ -1294,13 +1294,16 @@ static void libxl__add_pcidevs(libxl__egc *egc, libxl__ao *ao, uint32_t domid,
     libxl__ao_device *aodev = libxl__multidev_prepare(multidev);
     int i, rc = 0;
 
+    libxl__qmp_hold(gc, domid);
     for (i = 0; i < d_config->num_pcidevs; i++) {
         rc = libxl__device_pci_add(gc, domid, &d_config->pcidevs[i], 1);
         if (rc < 0) {
             LOGD(ERROR, domid, "libxl_device_pci_add failed: %d", rc);
+            libxl__qmp_release(gc, domid);
             goto out;
         }
     }
+    libxl__qmp_release(gc, domid);
 
     if (d_config->num_pcidevs > 0) {
         rc = libxl__create_pci_backend(gc, domid, d_config->pcidevs,
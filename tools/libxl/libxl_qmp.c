@@ -75,6 +75,10 @@ struct libxl__qmp_handler {
 
     int last_id_used;
     LIBXL_STAILQ_HEAD(callback_list, callback_id_pair) callback_list;
+
+    /* Number of libxl__qmp_hold() of the connection, see qmp_get() */
+    int holds;
+    LIBXL_LIST_ENTRY(libxl__qmp_handler) held_entry;
 };
 
 static int qmp_send(libxl__qmp_handler *qmp,
@@ -348,6 +352,7 @@ static libxl__qmp_handler *qmp_init_handler(libxl__gc *gc, uint32_t domid)
     qmp->ctx = CTX;
     qmp->domid = domid;
     qmp->timeout = 5;
+    qmp->qmp_fd = -1;
 
     LIBXL_STAILQ_INIT(&qmp->callback_list);
 
@@ -399,22 +404,39 @@ static int qmp_open(libxl__qmp_handler *qmp, const char *qmp_socket_path,
     } while ((++i / 5 <= timeout) && (usleep(200 * 1000) <= 0));
 
 out:
-    if (ret == -1 && qmp->qmp_fd > -1) close(qmp->qmp_fd);
+    if (ret == -1 && qmp->qmp_fd > -1) {
+        close(qmp->qmp_fd);
+        qmp->qmp_fd = -1;
+    }
 
     return ret;
 }
 
+/* Disconnect, leaving the handler ready for another qmp_connect() */
 static void qmp_close(libxl__qmp_handler *qmp)
 {
     callback_id_pair *pp = NULL;
     callback_id_pair *tmp = NULL;
 
-    close(qmp->qmp_fd);
+    if (qmp->qmp_fd > -1)
+        close(qmp->qmp_fd);
+    qmp->qmp_fd = -1;
+    qmp->connected = false;
+    qmp->wait_for_id = 0;
     LIBXL_STAILQ_FOREACH(pp, &qmp->callback_list, next) {
         free(tmp);
         tmp = pp;
     }
     free(tmp);
+    LIBXL_STAILQ_INIT(&qmp->callback_list);
+}
+
+/* Whether QEMU closed the connection, e.g. because it exited */
+static bool qmp_hung_up(libxl__qmp_handler *qmp)
+{
+    struct pollfd pfd = { .fd = qmp->qmp_fd, .events = POLLIN };
+
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR));
 }
 
 static int qmp_next(libxl__gc *gc, libxl__qmp_handler *qmp)
@@ -688,20 +710,16 @@ static void qmp_parameters_add_integer(libxl__gc *gc,
  * API
  */
 
-libxl__qmp_handler *libxl__qmp_initialize(libxl__gc *gc, uint32_t domid)
+static int qmp_connect(libxl__gc *gc, libxl__qmp_handler *qmp)
 {
+    const uint32_t domid = qmp->domid;
     int ret = 0;
-    libxl__qmp_handler *qmp = NULL;
     char *qmp_socket;
 
-    qmp = qmp_init_handler(gc, domid);
-    if (!qmp) return NULL;
-
     qmp_socket = GCSPRINTF("%s/qmp-libxl-%d", libxl__run_dir_path(), domid);
     if ((ret = qmp_open(qmp, qmp_socket, QMP_SOCKET_CONNECT_TIMEOUT)) < 0) {
         LOGED(ERROR, domid, "Connection error");
-        qmp_free_handler(qmp);
-        return NULL;
+        return -1;
     }
 
     LOGD(DEBUG, domid, "connected to %s", qmp_socket);
@@ -715,7 +733,21 @@ libxl__qmp_handler *libxl__qmp_initialize(libxl__gc *gc, uint32_t domid)
 
     if (!qmp->connected) {
         LOGD(ERROR, domid, "Failed to connect to QMP");
-        libxl__qmp_close(qmp);
+        qmp_close(qmp);
+        return -1;
+    }
+    return 0;
+}
+
+libxl__qmp_handler *libxl__qmp_initialize(libxl__gc *gc, uint32_t domid)
+{
+    libxl__qmp_handler *qmp = NULL;
+
+    qmp = qmp_init_handler(gc, domid);
+    if (!qmp) return NULL;
+
+    if (qmp_connect(gc, qmp)) {
+        qmp_free_handler(qmp);
         return NULL;
     }
     return qmp;
@@ -729,6 +761,96 @@ void libxl__qmp_close(libxl__qmp_handler *qmp)
     qmp_free_handler(qmp);
 }
 
+/*
+ * Held connections
+ */
+
+static libxl__qmp_handler *qmp_find_held(libxl__gc *gc, uint32_t domid)
+{
+    libxl__qmp_handler *qmp;
+
+    LIBXL_LIST_FOREACH(qmp, &CTX->qmp_held, held_entry) {
+        if (qmp->domid == domid)
+            return qmp;
+    }
+    return NULL;
+}
+
+void libxl__qmp_hold(libxl__gc *gc, uint32_t domid)
+{
+    libxl__qmp_handler *qmp;
+
+    CTX_LOCK;
+    qmp = qmp_find_held(gc, domid);
+    if (!qmp) {
+        /* Connect lazily, on the first command. */
+        qmp = qmp_init_handler(gc, domid);
+        if (!qmp)
+            goto out; /* The commands will just connect each time. */
+        LIBXL_LIST_INSERT_HEAD(&CTX->qmp_held, qmp, held_entry);
+    }
+    qmp->holds++;
+ out:
+    CTX_UNLOCK;
+}
+
+void libxl__qmp_release(libxl__gc *gc, uint32_t domid)
+{
+    libxl__qmp_handler *qmp;
+
+    CTX_LOCK;
+    qmp = qmp_find_held(gc, domid);
+    if (qmp && !--qmp->holds) {
+        LIBXL_LIST_REMOVE(qmp, held_entry);
+        libxl__qmp_close(qmp);
+    }
+    CTX_UNLOCK;
+}
+
+/*
+ * Returns a connection to the QMP server of domid, to be given back to
+ * qmp_put(): either the held one, if any, with the CTX lock taken until
+ * qmp_put() so that only one thread at a time uses it, or a new one.
+ */
+static libxl__qmp_handler *qmp_get(libxl__gc *gc, uint32_t domid)
+{
+    libxl__qmp_handler *qmp;
+
+    CTX_LOCK;
+    qmp = qmp_find_held(gc, domid);
+    if (!qmp) {
+        CTX_UNLOCK;
+        return libxl__qmp_initialize(gc, domid);
+    }
+
+    if (qmp->connected && qmp_hung_up(qmp)) {
+        LOGD(DEBUG, domid, "QMP server went away, reconnecting");
+        qmp_close(qmp);
+    }
+    if (!qmp->connected && qmp_connect(gc, qmp)) {
+        CTX_UNLOCK;
+        return NULL;
+    }
+    return qmp;
+}
+
+/* rc is the outcome of the commands run on the connection. */
+static void qmp_put(libxl__gc *gc, libxl__qmp_handler *qmp, int rc)
+{
+    if (!qmp->holds) {
+        libxl__qmp_close(qmp);
+        return;
+    }
+
+    /*
+     * After a failure (e.g. a timeout), replies to what was sent might
+     * still be on their way: reconnect next time instead.
+     */
+    if (rc)
+        qmp_close(qmp);
+    CTX_UNLOCK;
+}
+
 void libxl__qmp_cleanup(libxl__gc *gc, uint32_t domid)
 {
     char *qmp_socket;
@@ -817,13 +939,13 @@ static int qmp_run_command(libxl__gc *gc, int domid,
     libxl__qmp_handler *qmp = NULL;
     int rc = 0;
 
-    qmp = libxl__qmp_initialize(gc, domid);
+    qmp = qmp_get(gc, domid);
     if (!qmp)
         return ERROR_FAIL;
 
     rc = qmp_synchronous_send(qmp, cmd, args, callback, opaque, qmp->timeout);
 
-    libxl__qmp_close(qmp);
+    qmp_put(gc, qmp, rc);
     return rc;
 }
 
@@ -850,10 +972,6 @@ int libxl__qmp_pci_add(libxl__gc *gc, int domid, libxl_device_pci *pcidev)
     char *hostaddr = NULL;
     int rc = 0;
 
-    qmp = libxl__qmp_initialize(gc, domid);
-    if (!qmp)
-        return -1;
-
     hostaddr = GCSPRINTF("%04x:%02x:%02x.%01x", pcidev->domain,
                          pcidev->bus, pcidev->dev, pcidev->func);
     if (!hostaddr)
@@ -880,6 +998,10 @@ int libxl__qmp_pci_add(libxl__gc *gc, int domid, libxl_device_pci *pcidev)
     if (pcidev->permissive)
         qmp_parameters_add_bool(gc, &args, "permissive", true);
 
+    qmp = qmp_get(gc, domid);
+    if (!qmp)
+        return -1;
+
     rc = qmp_synchronous_send(qmp, "device_add", args,
                               NULL, NULL, qmp->timeout);
     if (rc == 0) {
@@ -887,7 +1009,7 @@ int libxl__qmp_pci_add(libxl__gc *gc, int domid, libxl_device_pci *pcidev)
                                   pci_add_callback, pcidev, qmp->timeout);
     }
 
-    libxl__qmp_close(qmp);
+    qmp_put(gc, qmp, rc);
     return rc;
 }
 
@@ -1177,7 +1299,7 @@ int libxl__qmp_initializations(libxl__gc *gc, uint32_t domid,
     libxl__qmp_handler *qmp = NULL;
     int ret = 0;
 
-    qmp = libxl__qmp_initialize(gc, domid);
+    qmp = qmp_get(gc, domid);
     if (!qmp)
         return -1;
     ret = libxl__qmp_query_serial(qmp);
@@ -1188,7 +1310,7 @@ int libxl__qmp_initializations(libxl__gc *gc, uint32_t domid,
     if (!ret) {
         ret = qmp_query_vnc(qmp);
     }
-    libxl__qmp_close(qmp);
+    qmp_put(gc, qmp, ret);
     return ret;
 }
 
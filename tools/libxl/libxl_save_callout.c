@@ -90,7 +90,7 @@ void libxl__xc_domain_save(libxl__egc *egc, libxl__domain_save_state *dss,
 
     const unsigned long argnums[] = {
         dss->domid, dss->xcflags, dss->hvm, cbflags,
-        dss->checkpointed_stream,
+        dss->checkpointed_stream, dss->max_downtime_ms,
     };
 
     shs->ao = ao;
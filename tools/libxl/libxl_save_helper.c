@@ -255,9 +255,11 @@ int main(int argc, char **argv)
         int hvm =                           atoi(NEXTARG);
         unsigned cbflags =                  strtoul(NEXTARG,0,10);
         xc_migration_stream_t stream_type = strtoul(NEXTARG,0,10);
+        unsigned max_downtime_ms =          strtoul(NEXTARG,0,10);
         assert(!*++argv);
 
         helper_setcallbacks_save(&helper_save_callbacks, cbflags);
+        helper_save_callbacks.max_downtime_ms = max_downtime_ms;
 
         startup("save");
         setup_signals(save_signal_handler);
@@ -111,25 +111,106 @@ int libxl_set_vcpuaffinity_force(libxl_ctx *ctx, uint32_t domid,
                                    cpumap_soft, XEN_VCPUAFFINITY_FORCE);
 }
 
-int libxl_set_vcpuaffinity_all(libxl_ctx *ctx, uint32_t domid,
-                               unsigned int max_vcpus,
-                               const libxl_bitmap *cpumap_hard,
-                               const libxl_bitmap *cpumap_soft)
+int libxl__set_vcpuaffinity_list(libxl__gc *gc, uint32_t domid,
+                                 uint32_t first_vcpu, uint32_t nr_vcpus,
+                                 const libxl_bitmap *cpumaps_hard,
+                                 const libxl_bitmap *cpumaps_soft,
+                                 bool same)
 {
-    GC_INIT(ctx);
-    int i, rc = 0;
+    unsigned int nr_maps = same ? 1 : nr_vcpus, flags = 0, i;
+    uint8_t *hard = NULL, *soft = NULL;
+    libxl_bitmap map;
+    int cpusize;
+
+    if (!nr_vcpus)
+        return 0;
+    if (!cpumaps_hard && !cpumaps_soft)
+        return ERROR_INVAL;
+
+    cpusize = xc_get_cpumap_size(CTX->xch);
+    if (cpusize <= 0) {
+        LOGED(ERROR, domid, "Getting cpumap size");
+        return ERROR_FAIL;
+    }
+
+    /*
+     * Lay all the maps out one after the other, as Xen wants them, and
+     * let it put the effective affinities back in them (unless same).
+     */
+    map.size = cpusize;
+    if (cpumaps_hard) {
+        hard = libxl__zalloc(gc, nr_maps * cpusize);
+        for (i = 0; i < nr_maps; i++) {
+            map.map = hard + i * cpusize;
+            libxl__bitmap_copy_best_effort(gc, &map, &cpumaps_hard[i]);
+        }
+        flags |= XEN_VCPUAFFINITY_HARD;
+    }
+    if (cpumaps_soft) {
+        soft = libxl__zalloc(gc, nr_maps * cpusize);
+        for (i = 0; i < nr_maps; i++) {
+            map.map = soft + i * cpusize;
+            libxl__bitmap_copy_best_effort(gc, &map, &cpumaps_soft[i]);
+        }
+        flags |= XEN_VCPUAFFINITY_SOFT;
+    }
+    if (same)
+        flags |= XEN_VCPUAFFINITYLIST_SAME;
+
+    if (xc_vcpu_setaffinity_list(CTX->xch, domid, first_vcpu, nr_vcpus,
+                                 hard, soft, flags)) {
+        LOGED(ERROR, domid, "Setting affinity of vcpus %u-%u",
+              first_vcpu, first_vcpu + nr_vcpus - 1);
+        return ERROR_FAIL;
+    }
 
-    for (i = 0; i < max_vcpus; i++) {
-        if (libxl_set_vcpuaffinity(ctx, domid, i, cpumap_hard, cpumap_soft)) {
-            LOGD(WARN, domid, "Failed to set affinity for %d", i);
-            rc = ERROR_FAIL;
+    /* Same checks as libxl__set_vcpuaffinity(). */
+    for (i = 0; !same && i < nr_vcpus; i++) {
+        if (hard) {
+            map.map = hard + i * cpusize;
+            if (!libxl_bitmap_equal(&cpumaps_hard[i], &map, 0))
+                LOGD(DEBUG, domid, "New hard affinity for vcpu %u has unreachable cpus",
+                     first_vcpu + i);
+        }
+        if (soft) {
+            map.map = soft + i * cpusize;
+            if (!libxl_bitmap_equal(&cpumaps_soft[i], &map, 0))
+                LOGD(DEBUG, domid, "New soft affinity for vcpu %u has unreachable cpus",
+                     first_vcpu + i);
+            if (libxl_bitmap_is_empty(&map))
+                LOGD(WARN, domid, "All cpus in soft affinity of vcpu %u are unreachable."
+                     " Only hard affinity will be considered for scheduling",
+                     first_vcpu + i);
         }
     }
 
+    return 0;
+}
+
+int libxl_set_vcpuaffinity_range(libxl_ctx *ctx, uint32_t domid,
+                                 uint32_t first_vcpu, uint32_t nr_vcpus,
+                                 const libxl_bitmap *cpumap_hard,
+                                 const libxl_bitmap *cpumap_soft)
+{
+    GC_INIT(ctx);
+    int rc;
+
+    rc = libxl__set_vcpuaffinity_list(gc, domid, first_vcpu, nr_vcpus,
+                                      cpumap_hard, cpumap_soft, true);
+
     GC_FREE;
     return rc;
 }
 
+int libxl_set_vcpuaffinity_all(libxl_ctx *ctx, uint32_t domid,
+                               unsigned int max_vcpus,
+                               const libxl_bitmap *cpumap_hard,
+                               const libxl_bitmap *cpumap_soft)
+{
+    return libxl_set_vcpuaffinity_range(ctx, domid, 0, max_vcpus,
+                                        cpumap_hard, cpumap_soft);
+}
+
 int libxl_domain_set_nodeaffinity(libxl_ctx *ctx, uint32_t domid,
                                   libxl_bitmap *nodemap)
 {
@@ -968,6 +1049,125 @@ int libxl_vcpu_sched_params_get_all(libxl_ctx *ctx, uint32_t domid,
     return rc;
 }
 
+static int sched_stats_op(libxl_ctx *ctx, uint32_t cmd)
+{
+    int rc = 0;
+    GC_INIT(ctx);
+
+    if (xc_sched_stats_op(ctx->xch, cmd)) {
+        LOGE(ERROR, "Controlling scheduling stats");
+        rc = ERROR_FAIL;
+    }
+
+    GC_FREE;
+    return rc;
+}
+
+int libxl_sched_stats_set(libxl_ctx *ctx, bool enable)
+{
+    return sched_stats_op(ctx, enable ? XEN_SYSCTL_SCHEDSTATS_enable
+                                      : XEN_SYSCTL_SCHEDSTATS_disable);
+}
+
+int libxl_sched_stats_reset(libxl_ctx *ctx)
+{
+    return sched_stats_op(ctx, XEN_SYSCTL_SCHEDSTATS_reset);
+}
+
+static int sched_stats_get_cpus(libxl__gc *gc, libxl_sched_stats *stats)
+{
+    xc_schedstats_cpu_t *xstats = NULL;
+    uint32_t nr = 0, max, enabled;
+    int i;
+
+    /* pcpus may come online between the calls */
+    do {
+        max = nr;
+        xstats = libxl__realloc(gc, xstats, (max ?: 1) * sizeof(*xstats));
+        if (xc_sched_stats_query_cpus(CTX->xch, &nr, max ? xstats : NULL,
+                                      &enabled)) {
+            LOGE(ERROR, "Getting pcpu scheduling stats");
+            return ERROR_FAIL;
+        }
+    } while (nr > max);
+
+    stats->enabled = enabled;
+    stats->num_cpus = nr;
+    stats->cpus = libxl__calloc(NOGC, nr, sizeof(*stats->cpus));
+    for (i = 0; i < nr; i++) {
+        libxl_sched_cpu_stats *s = &stats->cpus[i];
+
+        libxl_sched_cpu_stats_init(s);
+        s->cpu = xstats[i].cpu;
+        s->num_depth_hist = XEN_SYSCTL_SCHEDSTATS_DEPTHS;
+        s->depth_hist = libxl__calloc(NOGC, s->num_depth_hist,
+                                      sizeof(*s->depth_hist));
+        memcpy(s->depth_hist, xstats[i].hist, sizeof(xstats[i].hist));
+    }
+
+    return 0;
+}
+
+static int sched_stats_get_vcpus(libxl__gc *gc, uint32_t domid,
+                                 libxl_sched_stats *stats)
+{
+    xc_schedstats_vcpu_t *xstats;
+    uint32_t nr = 0, max, enabled;
+    int i;
+
+    if (xc_sched_stats_query_vcpus(CTX->xch, domid, &nr, NULL, &enabled))
+        goto err;
+
+    max = nr;
+    xstats = libxl__calloc(gc, max ?: 1, sizeof(*xstats));
+    if (xc_sched_stats_query_vcpus(CTX->xch, domid, &nr, xstats, &enabled))
+        goto err;
+
+    stats->num_vcpus = max;
+    stats->vcpus = libxl__calloc(NOGC, max, sizeof(*stats->vcpus));
+    for (i = 0; i < max; i++) {
+        libxl_sched_vcpu_stats *s = &stats->vcpus[i];
+
+        libxl_sched_vcpu_stats_init(s);
+        s->vcpuid = i;
+        s->wait_count = xstats[i].wait_count;
+        s->wait_ns = xstats[i].wait_ns;
+        s->wake_count = xstats[i].wake_count;
+        s->wake_ns = xstats[i].wake_ns;
+        s->num_wait_hist = s->num_wake_hist = XEN_SYSCTL_SCHEDSTATS_BUCKETS;
+        s->wait_hist = libxl__calloc(NOGC, s->num_wait_hist,
+                                     sizeof(*s->wait_hist));
+        s->wake_hist = libxl__calloc(NOGC, s->num_wake_hist,
+                                     sizeof(*s->wake_hist));
+        memcpy(s->wait_hist, xstats[i].wait_hist, sizeof(xstats[i].wait_hist));
+        memcpy(s->wake_hist, xstats[i].wake_hist, sizeof(xstats[i].wake_hist));
+    }
+
+    return 0;
+
+ err:
+    LOGED(ERROR, domid, "Getting vcpu scheduling stats");
+    return ERROR_FAIL;
+}
+
+int libxl_sched_stats_get(libxl_ctx *ctx, uint32_t domid,
+                          libxl_sched_stats *stats)
+{
+    GC_INIT(ctx);
+    int rc;
+
+    libxl_sched_stats_init(stats);
+
+    rc = sched_stats_get_cpus(gc, stats);
+    if (!rc && domid != INVALID_DOMID)
+        rc = sched_stats_get_vcpus(gc, domid, stats);
+    if (rc)
+        libxl_sched_stats_dispose(stats);
+
+    GC_FREE;
+    return rc;
+}
+
 /*
  * Local variables:
  * mode: C
@@ -1972,7 +1972,10 @@ DEFINE_DEVICE_TYPE_STRUCT(usbctrl, VUSB,
 #define libxl__device_from_usbdev NULL
 #define libxl__device_usbdev_update_devid NULL
 
-DEFINE_DEVICE_TYPE_STRUCT(usbdev, VUSB);
+DEFINE_DEVICE_TYPE_STRUCT(usbdev, VUSB,
+    /* May need the controllers to be there. */
+    .attach_after = 1,
+);
 
 /*
  * Local variables:
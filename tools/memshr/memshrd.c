@@ -0,0 +1,615 @@
+/******************************************************************************
+ * memshrd.c
+ *
+ * Content based page sharing daemon.  Periodically hashes the memory of
+ * HVM guests, and shares pages whose contents have been stable for a few
+ * scans ("cold" pages) with identical pages found elsewhere.  Candidates
+ * are verified byte for byte after nomination, when the guest can no
+ * longer modify them, so a hash collision never results in sharing.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xenctrl.h>
+#include <xenforeignmemory.h>
+
+#define PAGE_SIZE_4K        4096
+#define PAGE_WORDS          (PAGE_SIZE_4K / sizeof(uint64_t))
+#define MAX_DOMAINS         1024
+
+/* Per gfn state: how many scans the hash has been stable, and whether
+ * we shared the page ourselves. */
+#define ST_STABLE_MASK      0x0f
+#define ST_SHARED           0x80
+#define ST_UNMAPPABLE       0x40
+
+struct dom_state {
+    uint32_t domid;
+    bool present;               /* Seen during the current pass. */
+    unsigned long nr_gfns;
+    uint64_t *hash;
+    uint8_t *state;
+    unsigned long scanned;
+    unsigned long shared;       /* Pages we shared, in total. */
+};
+
+struct index_entry {
+    uint64_t hash;              /* 0 means empty. */
+    uint32_t domid;
+    unsigned long gfn;
+};
+
+static xc_interface *xch;
+static xenforeignmemory_handle *fmem;
+
+static struct dom_state doms[MAX_DOMAINS];
+static unsigned int nr_doms;
+
+static struct index_entry *idx;
+static unsigned long idx_size, idx_used;
+
+static unsigned int opt_interval = 30;         /* Seconds between passes. */
+static unsigned long opt_scan_rate = 65536;    /* Pages hashed per second. */
+static unsigned long opt_share_rate = 8192;    /* Pages shared per second. */
+static unsigned int opt_batch = 256;
+static unsigned int opt_cold = 2;
+static bool opt_verbose;
+static uint32_t opt_domids[MAX_DOMAINS];
+static unsigned int opt_nr_domids;
+
+static volatile sig_atomic_t done;
+
+static void sigterm(int sig)
+{
+    done = 1;
+}
+
+/*
+ * 64 bit hash over four independent lanes.  The lanes carry no dependency
+ * between each other, which keeps the multiplier pipelines busy and lets
+ * the compiler vectorise the inner loop where the target allows it.
+ */
+static uint64_t page_hash(const void *page)
+{
+    const uint64_t *p = page;
+    uint64_t h[4] = {
+        0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+        0x165667b19e3779f9ULL, 0x27d4eb2f165667c5ULL,
+    };
+    uint64_t r;
+    unsigned int i, l;
+
+    for ( i = 0; i < PAGE_WORDS; i += 4 )
+        for ( l = 0; l < 4; l++ )
+        {
+            h[l] ^= p[i + l];
+            h[l] *= 0xff51afd7ed558ccdULL;
+            h[l] ^= h[l] >> 31;
+        }
+
+    r = h[0] ^ (h[1] << 1 | h[1] >> 63) ^
+        (h[2] << 7 | h[2] >> 57) ^ (h[3] << 13 | h[3] >> 51);
+    r ^= r >> 33;
+    r *= 0xc4ceb9fe1a85ec53ULL;
+    r ^= r >> 33;
+
+    /* 0 marks an empty index slot. */
+    return r ? r : 1;
+}
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Sleep long enough for 'done' units of work not to exceed 'rate' per
+ * second since 'start'. */
+static void rate_limit(uint64_t start, unsigned long done_units,
+                       unsigned long rate)
+{
+    uint64_t due, now = now_us();
+
+    if ( !rate )
+        return;
+
+    due = start + (uint64_t)done_units * 1000000 / rate;
+    if ( due > now )
+        usleep(due - now);
+}
+
+/** Cross-domain index of cold page hashes **/
+
+static int index_resize(unsigned long size)
+{
+    struct index_entry *old = idx;
+    unsigned long i, old_size = idx_size;
+
+    idx = calloc(size, sizeof(*idx));
+    if ( !idx )
+    {
+        idx = old;
+        return -ENOMEM;
+    }
+    idx_size = size;
+    idx_used = 0;
+
+    for ( i = 0; i < old_size; i++ )
+    {
+        struct index_entry *e = &old[i];
+        unsigned long j;
+
+        if ( !e->hash )
+            continue;
+        for ( j = e->hash & (idx_size - 1); idx[j].hash;
+              j = (j + 1) & (idx_size - 1) )
+            ;
+        idx[j] = *e;
+        idx_used++;
+    }
+
+    free(old);
+    return 0;
+}
+
+static void index_clear(void)
+{
+    if ( idx )
+        memset(idx, 0, idx_size * sizeof(*idx));
+    idx_used = 0;
+}
+
+/* Returns the entry for hash, creating an empty one (hash set, domid
+ * DOMID_INVALID) if there is none.  NULL if out of memory. */
+static struct index_entry *index_get(uint64_t hash)
+{
+    unsigned long j;
+
+    if ( (idx_used + 1) * 10 > idx_size * 7 &&
+         index_resize(idx_size ? idx_size * 2 : 65536) )
+        return NULL;
+
+    for ( j = hash & (idx_size - 1); idx[j].hash;
+          j = (j + 1) & (idx_size - 1) )
+        if ( idx[j].hash == hash )
+            return &idx[j];
+
+    idx[j].hash = hash;
+    idx[j].domid = DOMID_INVALID;
+    idx_used++;
+    return &idx[j];
+}
+
+/** Sharing **/
+
+static int compare_frames(uint32_t sdom, unsigned long sgfn,
+                          uint32_t cdom, unsigned long cgfn)
+{
+    xen_pfn_t spfn = sgfn, cpfn = cgfn;
+    void *s, *c;
+    int rc = -1;
+
+    s = xenforeignmemory_map(fmem, sdom, PROT_READ, 1, &spfn, NULL);
+    if ( !s )
+        return -1;
+    c = xenforeignmemory_map(fmem, cdom, PROT_READ, 1, &cpfn, NULL);
+    if ( c )
+    {
+        rc = memcmp(s, c, PAGE_SIZE_4K) ? 1 : 0;
+        xenforeignmemory_unmap(fmem, c, 1);
+    }
+    xenforeignmemory_unmap(fmem, s, 1);
+
+    return rc;
+}
+
+/*
+ * Share client page (cdom, cgfn) with the page recorded in e.  Returns 1
+ * if the pages were shared, 0 if they turned out not to be identical (or
+ * the recorded page has gone), and -1 on error.
+ */
+static int try_share(struct index_entry *e, struct dom_state *cd,
+                     unsigned long cgfn)
+{
+    uint64_t sh, ch;
+    int rc;
+
+    if ( xc_memshr_nominate_gfn(xch, e->domid, e->gfn, &sh) )
+        return 0;
+    if ( xc_memshr_nominate_gfn(xch, cd->domid, cgfn, &ch) )
+        return -1;
+
+    /* Already backed by the same frame. */
+    if ( sh == ch )
+        return 1;
+
+    /* Nominated pages are read-only to the guest: the contents we
+     * compare now are the contents that will be shared. */
+    rc = compare_frames(e->domid, e->gfn, cd->domid, cgfn);
+    if ( rc )
+        return rc < 0 ? -1 : 0;
+
+    if ( xc_memshr_share_gfns(xch, e->domid, e->gfn, sh,
+                              cd->domid, cgfn, ch) )
+        return 0;
+
+    return 1;
+}
+
+/** Scanning **/
+
+static struct dom_state *find_dom(uint32_t domid, bool create)
+{
+    unsigned int i;
+
+    for ( i = 0; i < nr_doms; i++ )
+        if ( doms[i].domid == domid )
+            return &doms[i];
+
+    if ( !create || nr_doms == MAX_DOMAINS )
+        return NULL;
+
+    memset(&doms[nr_doms], 0, sizeof(doms[nr_doms]));
+    doms[nr_doms].domid = domid;
+    return &doms[nr_doms++];
+}
+
+static int resize_dom(struct dom_state *ds, unsigned long nr_gfns)
+{
+    uint64_t *hash;
+    uint8_t *state;
+
+    if ( nr_gfns <= ds->nr_gfns )
+        return 0;
+
+    hash = realloc(ds->hash, nr_gfns * sizeof(*hash));
+    if ( !hash )
+        return -ENOMEM;
+    ds->hash = hash;
+    state = realloc(ds->state, nr_gfns);
+    if ( !state )
+        return -ENOMEM;
+    ds->state = state;
+
+    memset(ds->hash + ds->nr_gfns, 0,
+           (nr_gfns - ds->nr_gfns) * sizeof(*hash));
+    memset(ds->state + ds->nr_gfns, 0, nr_gfns - ds->nr_gfns);
+    ds->nr_gfns = nr_gfns;
+
+    return 0;
+}
+
+static void free_dom(struct dom_state *ds)
+{
+    free(ds->hash);
+    free(ds->state);
+    *ds = doms[--nr_doms];
+}
+
+static unsigned long shared_this_pass, hashed_this_pass;
+static uint64_t pass_start;
+
+static void scan_batch(struct dom_state *ds, unsigned long first,
+                       unsigned int nr)
+{
+    xen_pfn_t pfns[nr];
+    int err[nr];
+    uint64_t hashes[nr];
+    unsigned int i;
+    char *map;
+
+    for ( i = 0; i < nr; i++ )
+        pfns[i] = first + i;
+
+    map = xenforeignmemory_map(fmem, ds->domid, PROT_READ, nr, pfns, err);
+    if ( !map )
+        return;
+
+    for ( i = 0; i < nr; i++ )
+        hashes[i] = err[i] ? 0 : page_hash(map + i * PAGE_SIZE_4K);
+
+    /* Nomination fails on pages we still have mapped. */
+    xenforeignmemory_unmap(fmem, map, nr);
+
+    hashed_this_pass += nr;
+    ds->scanned += nr;
+
+    for ( i = 0; i < nr; i++ )
+    {
+        unsigned long gfn = first + i;
+        uint8_t *st = &ds->state[gfn];
+        struct index_entry *e;
+        int rc;
+
+        if ( !hashes[i] )
+        {
+            *st = ST_UNMAPPABLE;
+            continue;
+        }
+
+        if ( hashes[i] != ds->hash[gfn] || (*st & ST_UNMAPPABLE) )
+        {
+            /* Changed (possibly unshared by a write): start over. */
+            ds->hash[gfn] = hashes[i];
+            *st = 0;
+            continue;
+        }
+
+        if ( (*st & ST_STABLE_MASK) < opt_cold )
+        {
+            (*st)++;
+            if ( (*st & ST_STABLE_MASK) < opt_cold )
+                continue;
+        }
+
+        if ( (e = index_get(hashes[i])) == NULL )
+            continue;
+
+        if ( e->domid == DOMID_INVALID )
+        {
+            e->domid = ds->domid;
+            e->gfn = gfn;
+            continue;
+        }
+
+        if ( (e->domid == ds->domid && e->gfn == gfn) ||
+             (*st & ST_SHARED) )
+            continue;
+
+        rc = try_share(e, ds, gfn);
+        if ( rc > 0 )
+        {
+            *st |= ST_SHARED;
+            ds->shared++;
+            shared_this_pass++;
+            rate_limit(pass_start, shared_this_pass, opt_share_rate);
+        }
+        else if ( rc == 0 )
+        {
+            /* Stale or colliding entry: this page replaces it. */
+            e->domid = ds->domid;
+            e->gfn = gfn;
+        }
+    }
+
+    rate_limit(pass_start, hashed_this_pass, opt_scan_rate);
+}
+
+static void scan_domain(struct dom_state *ds)
+{
+    xen_pfn_t max_gpfn;
+    unsigned long gfn;
+
+    if ( xc_domain_maximum_gpfn(xch, ds->domid, &max_gpfn) < 0 ||
+         resize_dom(ds, max_gpfn + 1) )
+        return;
+
+    for ( gfn = 0; gfn <= max_gpfn && !done; gfn += opt_batch )
+        scan_batch(ds, gfn, gfn + opt_batch > max_gpfn + 1 ?
+                            max_gpfn + 1 - gfn : opt_batch);
+}
+
+static bool wanted(uint32_t domid)
+{
+    unsigned int i;
+
+    if ( !opt_nr_domids )
+        return true;
+
+    for ( i = 0; i < opt_nr_domids; i++ )
+        if ( opt_domids[i] == domid )
+            return true;
+
+    return false;
+}
+
+static void report(void)
+{
+    xc_dominfo_t info;
+    unsigned int i;
+
+    printf("pass: hashed %lu pages, shared %lu, in %"PRIu64" ms; "
+           "host: %ld pages freed by sharing, %ld shared frames\n",
+           hashed_this_pass, shared_this_pass,
+           (now_us() - pass_start) / 1000,
+           xc_sharing_freed_pages(xch), xc_sharing_used_frames(xch));
+
+    for ( i = 0; i < nr_doms; i++ )
+    {
+        struct dom_state *ds = &doms[i];
+
+        if ( xc_domain_getinfo(xch, ds->domid, 1, &info) != 1 ||
+             info.domid != ds->domid )
+            continue;
+
+        printf("  dom%u: %lu of %lu pages shared (%lu KiB), "
+               "%lu shared by us\n",
+               ds->domid, info.nr_shared_pages, info.nr_pages,
+               info.nr_shared_pages * (PAGE_SIZE_4K / 1024), ds->shared);
+    }
+    fflush(stdout);
+}
+
+static void scan_pass(void)
+{
+    xc_dominfo_t info[64];
+    uint32_t next = 1;
+    unsigned int i;
+    int n;
+
+    pass_start = now_us();
+    hashed_this_pass = shared_this_pass = 0;
+
+    for ( i = 0; i < nr_doms; i++ )
+        doms[i].present = false;
+
+    /* Entries from the previous pass may refer to changed or gone pages,
+     * and every domain is about to be rescanned anyway. */
+    index_clear();
+
+    while ( !done && (n = xc_domain_getinfo(xch, next, 64, info)) > 0 )
+    {
+        for ( i = 0; i < n && !done; i++ )
+        {
+            struct dom_state *ds;
+
+            next = info[i].domid + 1;
+            if ( !info[i].hvm || info[i].dying || info[i].shutdown ||
+                 !wanted(info[i].domid) )
+                continue;
+
+            ds = find_dom(info[i].domid, true);
+            if ( !ds )
+                continue;
+
+            if ( !ds->nr_gfns &&
+                 xc_memshr_control(xch, ds->domid, 1) )
+            {
+                if ( opt_verbose )
+                    fprintf(stderr, "dom%u: cannot enable sharing: %s\n",
+                            ds->domid, strerror(errno));
+                continue;
+            }
+
+            ds->present = true;
+            scan_domain(ds);
+        }
+    }
+
+    for ( i = 0; i < nr_doms; )
+        if ( !doms[i].present )
+            free_dom(&doms[i]);
+        else
+            i++;
+
+    if ( opt_verbose )
+        report();
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [domid ...]\n"
+            "Share identical cold pages of HVM domains (all, or those given).\n"
+            "  -i SECS   seconds between scan passes (default %u)\n"
+            "  -s RATE   pages hashed per second, 0 = unlimited (default %lu)\n"
+            "  -r RATE   pages shared per second, 0 = unlimited (default %lu)\n"
+            "  -b PAGES  pages mapped per batch (default %u)\n"
+            "  -c SCANS  scans a page must stay unchanged to be cold "
+            "(default %u)\n"
+            "  -1        run a single pass and exit\n"
+            "  -v        report per domain savings after every pass\n",
+            prog, opt_interval, opt_scan_rate, opt_share_rate, opt_batch,
+            opt_cold);
+}
+
+int main(int argc, char **argv)
+{
+    struct sigaction sa = { .sa_handler = sigterm };
+    bool once = false;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "i:s:r:b:c:1vh")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'i':
+            opt_interval = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            opt_scan_rate = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            opt_share_rate = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            opt_batch = strtoul(optarg, NULL, 0);
+            if ( !opt_batch || opt_batch > 4096 )
+                opt_batch = 256;
+            break;
+        case 'c':
+            opt_cold = strtoul(optarg, NULL, 0);
+            if ( opt_cold > ST_STABLE_MASK )
+                opt_cold = ST_STABLE_MASK;
+            break;
+        case '1':
+            once = true;
+            break;
+        case 'v':
+            opt_verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+
+    for ( ; optind < argc && opt_nr_domids < MAX_DOMAINS; optind++ )
+        opt_domids[opt_nr_domids++] = strtoul(argv[optind], NULL, 0);
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    if ( !xch )
+    {
+        perror("xc_interface_open");
+        return 1;
+    }
+    fmem = xenforeignmemory_open(NULL, 0);
+    if ( !fmem )
+    {
+        perror("xenforeignmemory_open");
+        xc_interface_close(xch);
+        return 1;
+    }
+
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    while ( !done )
+    {
+        scan_pass();
+        if ( once )
+            break;
+        sleep(opt_interval);
+    }
+
+    while ( nr_doms )
+        free_dom(&doms[0]);
+    free(idx);
+    xenforeignmemory_close(fmem);
+    xc_interface_close(xch);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -1,6 +1,25 @@
 /*
- * xen-lowmemd: demo VIRQ_ENOMEM
+ * xen-lowmemd: memory pressure controller
  * Andres Lagar-Cavilla (GridCentric Inc.)
+ *
+ * Watches host free memory (woken by VIRQ_ENOMEM, and polling) and keeps
+ * it between a low and a high watermark by moving the balloon targets of
+ * the running domains:
+ *
+ *  - below the low watermark, memory/target of each domain is lowered
+ *    in proportion to what it can spare divided by its weight, never
+ *    below its floor and, when the guest reports its free memory, never
+ *    by more than that;
+ *  - if ballooning cannot cover the shortfall, domains served by
+ *    xenpaging get their memory/target-tot_pages lowered as well;
+ *  - once free memory is back above twice the high watermark, memory
+ *    taken away is handed back, favouring heavier domains.
+ *
+ * Per domain knobs, all optional, in /local/domain/<domid>/:
+ *   memory/lowmemd-weight  relative share to keep (default 256)
+ *   memory/lowmemd-min     floor for memory/target, KiB
+ *                          (default a quarter of memory/static-max)
+ *   data/meminfo_free      free memory reported by the guest agent, KiB
  */
 
 #include <stdio.h>
@@ -9,6 +28,10 @@
 #include <xenstore.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <poll.h>
 
 static evtchn_port_t virq_port      = ~0;
 static xenevtchn_handle *xce_handle = NULL;
@@ -29,19 +52,289 @@ void cleanup(void)
 
 /* Never shrink dom0 below 1 GiB */
 #define DOM0_FLOOR  (1 << 30)
-#define DOM0_FLOOR_PG   ((DOM0_FLOOR) >> 12)
+#define DOM0_FLOOR_KB   ((DOM0_FLOOR) >> 10)
 
-/* Act if free memory is less than 92 MiB */
+/* Act if free memory is less than 92 MiB, by default */
 #define THRESHOLD   (92 << 20)
 #define THRESHOLD_PG    ((THRESHOLD) >> 12)
 
+#define DEFAULT_WEIGHT  256
+#define MAX_DOMS        1024
+
 #define BUFSZ 512
+
+static unsigned long low_pg = THRESHOLD_PG, high_pg = 2 * THRESHOLD_PG;
+static int interval = 5;
+static bool dry_run, verbose;
+
+struct dom {
+    uint32_t domid;
+    unsigned long nr_pages;
+    uint64_t target_kb;
+    uint64_t floor_kb;
+    uint64_t max_kb;
+    uint64_t free_kb;           /* guest reported, ~0 if unknown */
+    unsigned int weight;
+    bool pod;
+    bool paging;
+    uint64_t spare_kb;          /* scratch space for the policy */
+};
+
+/* What we took from each domain, to hand it back later. */
+static uint64_t lowered_kb[DOMID_FIRST_RESERVED];
+static bool paging_lowered[DOMID_FIRST_RESERVED];
+
+static struct dom doms[MAX_DOMS];
+static unsigned int nr_doms;
+
+static bool xs_read_u64(uint32_t domid, const char *node, uint64_t *val)
+{
+    char path[BUFSZ], *data, *end;
+    unsigned int len;
+    bool ok;
+
+    snprintf(path, BUFSZ, "/local/domain/%u/%s", domid, node);
+    data = xs_read(xs_handle, XBT_NULL, path, &len);
+    if (!data)
+        return false;
+
+    *val = strtoull(data, &end, 10);
+    ok = end != data && *end == '\0';
+    free(data);
+
+    return ok;
+}
+
+static void xs_write_u64(uint32_t domid, const char *node, uint64_t val)
+{
+    char path[BUFSZ], data[BUFSZ], error[BUFSZ];
+
+    if (verbose || dry_run)
+        printf("dom%u: %s %s -> %"PRIu64"\n", domid,
+               dry_run ? "would set" : "setting", node, val);
+    if (dry_run)
+        return;
+
+    snprintf(path, BUFSZ, "/local/domain/%u/%s", domid, node);
+    snprintf(data, BUFSZ, "%"PRIu64, val);
+    if (!xs_write(xs_handle, XBT_NULL, path, data, strlen(data)))
+    {
+        snprintf(error, BUFSZ, "Failed to write %s to %s", data, path);
+        perror(error);
+    }
+}
+
+static void set_target(struct dom *d, uint64_t target_kb)
+{
+    uint64_t videoram_kb = 0;
+
+    xs_write_u64(d->domid, "memory/target", target_kb);
+    d->target_kb = target_kb;
+
+    /* Like libxl_set_memory_target(): a PoD guest may otherwise touch
+     * memory it has no backing for before its balloon catches up. */
+    if (d->pod && !dry_run)
+    {
+        xs_read_u64(d->domid, "memory/videoram", &videoram_kb);
+        if (xc_domain_set_pod_target(xch, d->domid,
+                                     (target_kb - videoram_kb + 1024) / 4,
+                                     NULL, NULL, NULL))
+            perror("Failed to set PoD target");
+    }
+}
+
+static void collect_domains(void)
+{
+    xc_dominfo_t info[64];
+    uint32_t next = 0;
+    int n, i;
+
+    nr_doms = 0;
+    while ((n = xc_domain_getinfo(xch, next, 64, info)) > 0)
+    {
+        for (i = 0; i < n && nr_doms < MAX_DOMS; i++)
+        {
+            struct dom *d = &doms[nr_doms];
+            uint64_t tot, cache, entries, weight, paging;
+
+            next = info[i].domid + 1;
+            if (info[i].dying || info[i].shutdown ||
+                info[i].domid >= DOMID_FIRST_RESERVED)
+                continue;
+
+            memset(d, 0, sizeof(*d));
+            d->domid = info[i].domid;
+            d->nr_pages = info[i].nr_pages;
+
+            if (!xs_read_u64(d->domid, "memory/target", &d->target_kb))
+            {
+                /* Dom0 without autoballoon has no target yet */
+                if (d->domid)
+                    continue;
+                d->target_kb = (uint64_t)d->nr_pages << 2;
+            }
+            if (!xs_read_u64(d->domid, "memory/static-max", &d->max_kb))
+                d->max_kb = info[i].max_memkb;
+            if (!xs_read_u64(d->domid, "memory/lowmemd-min", &d->floor_kb))
+                d->floor_kb = d->domid ? d->max_kb / 4 : DOM0_FLOOR_KB;
+            if (!d->domid && d->floor_kb < DOM0_FLOOR_KB)
+                d->floor_kb = DOM0_FLOOR_KB;
+            if (!xs_read_u64(d->domid, "data/meminfo_free", &d->free_kb))
+                d->free_kb = ~0ULL;
+            d->weight = xs_read_u64(d->domid, "memory/lowmemd-weight",
+                                    &weight) && weight ? weight
+                                                       : DEFAULT_WEIGHT;
+            d->paging = xs_read_u64(d->domid, "memory/target-tot_pages",
+                                    &paging);
+            d->pod = info[i].hvm &&
+                !xc_domain_get_pod_target(xch, d->domid, &tot, &cache,
+                                          &entries) && entries;
+
+            nr_doms++;
+        }
+    }
+}
+
+/* How much each domain can give up, in KiB */
+static uint64_t compute_spare(void)
+{
+    uint64_t total = 0;
+    unsigned int i;
+
+    for (i = 0; i < nr_doms; i++)
+    {
+        struct dom *d = &doms[i];
+        uint64_t spare = d->target_kb > d->floor_kb ?
+                         d->target_kb - d->floor_kb : 0;
+
+        /* Leave the guest a sixteenth of its target as slack */
+        if (d->free_kb != ~0ULL)
+        {
+            uint64_t slack = d->target_kb / 16;
+            uint64_t free_kb = d->free_kb > slack ? d->free_kb - slack : 0;
+
+            if (spare > free_kb)
+                spare = free_kb;
+        }
+
+        d->spare_kb = spare;
+        total += spare / d->weight;
+    }
+
+    return total;
+}
+
+/* Take need_kb away from the domains' balloon targets. Returns what
+ * could not be covered. */
+static uint64_t reclaim(uint64_t need_kb)
+{
+    unsigned int i, round;
+
+    for (round = 0; round < 2 && need_kb; round++)
+    {
+        uint64_t total = compute_spare(), want = need_kb;
+
+        if (!total)
+            break;
+
+        for (i = 0; i < nr_doms && need_kb; i++)
+        {
+            struct dom *d = &doms[i];
+            uint64_t share = want * (d->spare_kb / d->weight) / total;
+
+            if (share > d->spare_kb)
+                share = d->spare_kb;
+            if (share > need_kb)
+                share = need_kb;
+            /* Don't bother the guest for less than a MiB */
+            if (share < 1024)
+                continue;
+
+            set_target(d, d->target_kb - share);
+            lowered_kb[d->domid] += share;
+            need_kb -= share;
+        }
+    }
+
+    return need_kb;
+}
+
+/* Ballooning fell short: page out from domains xenpaging serves */
+static void reclaim_paging(uint64_t need_kb)
+{
+    uint64_t total_weight = 0;
+    unsigned int i;
+
+    for (i = 0; i < nr_doms; i++)
+        if (doms[i].paging)
+            total_weight += doms[i].weight;
+
+    for (i = 0; i < nr_doms && total_weight; i++)
+    {
+        struct dom *d = &doms[i];
+        uint64_t share_pg, floor_pg = d->floor_kb >> 2;
+
+        if (!d->paging || d->nr_pages <= floor_pg)
+            continue;
+
+        /* Invert the weights: heavier domains give up less */
+        share_pg = (need_kb >> 2) * (total_weight - d->weight + 1) /
+                   (total_weight * (nr_doms > 1 ? nr_doms - 1 : 1));
+        if (share_pg > d->nr_pages - floor_pg)
+            share_pg = d->nr_pages - floor_pg;
+        if (!share_pg)
+            continue;
+
+        xs_write_u64(d->domid, "memory/target-tot_pages",
+                     d->nr_pages - share_pg);
+        paging_lowered[d->domid] = true;
+    }
+}
+
+/* Hand back up to surplus_kb of what was taken, by weight */
+static void restore(uint64_t surplus_kb)
+{
+    uint64_t total = 0;
+    unsigned int i;
+
+    for (i = 0; i < nr_doms; i++)
+    {
+        struct dom *d = &doms[i];
+
+        /* Paging first: it costs the guest the most */
+        if (paging_lowered[d->domid])
+        {
+            xs_write_u64(d->domid, "memory/target-tot_pages", 0);
+            paging_lowered[d->domid] = false;
+        }
+        total += d->weight * (lowered_kb[d->domid] >> 10);
+    }
+
+    for (i = 0; i < nr_doms && total && surplus_kb; i++)
+    {
+        struct dom *d = &doms[i];
+        uint64_t give = surplus_kb * d->weight *
+                        (lowered_kb[d->domid] >> 10) / total;
+
+        if (give > lowered_kb[d->domid])
+            give = lowered_kb[d->domid];
+        if (d->target_kb + give > d->max_kb)
+            give = d->max_kb > d->target_kb ? d->max_kb - d->target_kb : 0;
+        if (give < 1024)
+            continue;
+
+        set_target(d, d->target_kb + give);
+        lowered_kb[d->domid] -= give;
+        surplus_kb -= give;
+    }
+}
+
 void handle_low_mem(void)
 {
-    xc_dominfo_t  dom0_info;
     xc_physinfo_t info;
-    unsigned long long free_pages, dom0_pages, diff, dom0_target;
-    char data[BUFSZ], error[BUFSZ];
+    unsigned long long free_pages;
+    uint64_t left;
+    unsigned int i;
 
     if (xc_physinfo(xch, &info) < 0)
     {
@@ -49,42 +342,82 @@ void handle_low_mem(void)
         return;
     }
 
+    /* Memory claimed by domains being built is as good as gone */
     free_pages = (unsigned long long) info.free_pages;
-    printf("Available free pages: 0x%llx:%llux\n",
-            free_pages, free_pages);
+    free_pages = free_pages > info.outstanding_pages ?
+                 free_pages - info.outstanding_pages : 0;
+    if (verbose)
+        printf("Available free pages: 0x%llx:%llu\n",
+               free_pages, free_pages);
 
-    /* Don't do anything if we have more than the threshold free */
-    if ( free_pages >= THRESHOLD_PG )
+    if (free_pages >= low_pg && free_pages < 2 * high_pg)
         return;
-    diff = THRESHOLD_PG - free_pages; 
 
-    if (xc_domain_getinfo(xch, 0, 1, &dom0_info) < 1)
+    collect_domains();
+
+    if (free_pages < low_pg)
     {
-        perror("Failed to get dom0 info");
+        left = reclaim((high_pg - free_pages) << 2);
+        if (left)
+        {
+            printf("Ballooning is short by %"PRIu64" KiB\n", left);
+            reclaim_paging(left);
+        }
         return;
     }
 
-    dom0_pages = (unsigned long long) dom0_info.nr_pages;
-    printf("Dom0 pages: 0x%llx:%llu\n", dom0_pages, dom0_pages);
-    dom0_target = dom0_pages - diff;
-    if (dom0_target <= DOM0_FLOOR_PG)
-        return;
-
-    printf("Shooting for dom0 target 0x%llx:%llu\n", 
-            dom0_target, dom0_target);
+    for (i = 0; i < nr_doms; i++)
+        if (lowered_kb[doms[i].domid] || paging_lowered[doms[i].domid])
+            break;
+    if (i < nr_doms)
+        restore((free_pages - high_pg) << 2);
+}
 
-    snprintf(data, BUFSZ, "%llu", dom0_target);
-    if (!xs_write(xs_handle, XBT_NULL, 
-            "/local/domain/0/memory/target", data, strlen(data)))
-    {
-        snprintf(error, BUFSZ,"Failed to write target %s to xenstore", data);
-        perror(error);
-    }
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-l low-MiB] [-H high-MiB] [-i seconds] [-n] [-v]\n"
+            "  -l  act when free host memory drops below this (default %d)\n"
+            "  -H  refill free host memory to this (default twice -l)\n"
+            "  -i  poll interval, on top of VIRQ_ENOMEM (default %d)\n"
+            "  -n  only report what would be done\n"
+            "  -v  verbose\n",
+            prog, THRESHOLD >> 20, interval);
 }
 
 int main(int argc, char *argv[])
 {
-    int rc;
+    int rc, opt;
+    bool high_set = false;
+    struct pollfd pfd;
+
+    while ((opt = getopt(argc, argv, "l:H:i:nvh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'l':
+            low_pg = strtoul(optarg, NULL, 0) << (20 - 12);
+            break;
+        case 'H':
+            high_pg = strtoul(optarg, NULL, 0) << (20 - 12);
+            high_set = true;
+            break;
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        case 'n':
+            dry_run = true;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (!high_set || high_pg < low_pg)
+        high_pg = 2 * low_pg;
 
     atexit(cleanup);
 
@@ -116,33 +449,49 @@ int main(int argc, char *argv[])
     }
 
     virq_port = rc;
-    
+
+    pfd.fd = xenevtchn_fd(xce_handle);
+    pfd.events = POLLIN;
+
     while(1)
     {
         evtchn_port_t port;
 
-        if ((port = xenevtchn_pending(xce_handle)) == -1)
+        rc = poll(&pfd, 1, interval > 0 ? interval * 1000 : -1);
+        if (rc < 0)
         {
-            perror("Failed to listen for pending event channel");
+            perror("Failed to poll the event channel");
             return 5;
         }
 
-        if (port != virq_port)
+        if (rc > 0)
         {
-            char data[BUFSZ];
-            snprintf(data, BUFSZ, "Wrong port, got %d expected %d", port, virq_port);
-            perror(data);
-            return 6;
-        }
+            if ((port = xenevtchn_pending(xce_handle)) == -1)
+            {
+                perror("Failed to listen for pending event channel");
+                return 5;
+            }
 
-        if (xenevtchn_unmask(xce_handle, port) == -1)
-        {
-            perror("Failed to unmask port");
-            return 7;
+            if (port != virq_port)
+            {
+                char data[BUFSZ];
+                snprintf(data, BUFSZ, "Wrong port, got %d expected %d", port, virq_port);
+                perror(data);
+                return 6;
+            }
+
+            if (xenevtchn_unmask(xce_handle, port) == -1)
+            {
+                perror("Failed to unmask port");
+                return 7;
+            }
+
+            if (verbose)
+                printf("Got a virq kick, time to get work\n");
         }
 
-        printf("Got a virq kick, time to get work\n");
         handle_low_mem();
+        fflush(stdout);
     }
 
     return 0;
@@ -0,0 +1,348 @@
+/*
+ * xen-pmuprof: sample where the hypervisor spends its time
+ *
+ * Drives XEN_SYSCTL_pmuprof_op: every pcpu takes a sample each period
+ * unhalted cycles, which we drain from its buffer and write out in the
+ * text format of "perf script", so that the usual perf tooling (e.g.
+ * stackcollapse-perf.pl and flamegraph.pl) can be used on it.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xenctrl.h>
+
+struct symbol {
+    uint64_t addr;
+    char *name;
+};
+
+static struct symbol *symbols;
+static unsigned int nr_symbols;
+
+static volatile sig_atomic_t interrupted;
+
+static void usage(FILE *f)
+{
+    fprintf(f,
+            "Usage: xen-pmuprof [options]\n"
+            "Sample the hypervisor until interrupted, writing \"perf script\" output.\n"
+            "  -p, --period=CYCLES    cycles between samples (default 1000000)\n"
+            "  -b, --buffer=SAMPLES   samples buffered per cpu, a power of 2\n"
+            "                         (default 4096)\n"
+            "  -i, --interval=MS      how often to drain the buffers (default 100)\n"
+            "  -t, --time=SECONDS     stop after that long\n"
+            "  -m, --map=FILE         symbols, as \"nm -n xen-syms\" prints them\n"
+            "  -o, --output=FILE      write to FILE rather than stdout\n"
+            "  -s, --stop             stop a run left behind by a killed instance\n");
+}
+
+static int cmp_symbol(const void *a, const void *b)
+{
+    const struct symbol *x = a, *y = b;
+
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+static int load_symbols(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    unsigned int max = 0;
+    char line[512], type, name[256];
+    uint64_t addr;
+
+    if ( !f )
+    {
+        perror(path);
+        return -1;
+    }
+
+    while ( fgets(line, sizeof(line), f) )
+    {
+        if ( sscanf(line, "%"SCNx64" %c %255s", &addr, &type, name) != 3 )
+            continue;
+        if ( type != 't' && type != 'T' && type != 'w' && type != 'W' )
+            continue;
+
+        if ( nr_symbols == max )
+        {
+            max = max ? max * 2 : 4096;
+            symbols = realloc(symbols, max * sizeof(*symbols));
+            if ( !symbols )
+            {
+                fclose(f);
+                return -1;
+            }
+        }
+        symbols[nr_symbols].addr = addr;
+        symbols[nr_symbols].name = strdup(name);
+        nr_symbols++;
+    }
+
+    fclose(f);
+    qsort(symbols, nr_symbols, sizeof(*symbols), cmp_symbol);
+
+    return 0;
+}
+
+static void print_frame(FILE *out, uint64_t ip, bool guest)
+{
+    unsigned int lo = 0, hi = nr_symbols;
+
+    if ( guest )
+    {
+        fprintf(out, "\t%16"PRIx64" [unknown] ([guest])\n", ip);
+        return;
+    }
+
+    /* the last symbol at or below ip */
+    while ( lo < hi )
+    {
+        unsigned int mid = (lo + hi) / 2;
+
+        if ( symbols[mid].addr <= ip )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if ( lo )
+        fprintf(out, "\t%16"PRIx64" %s+0x%"PRIx64" ([xen])\n", ip,
+                symbols[lo - 1].name, ip - symbols[lo - 1].addr);
+    else
+        fprintf(out, "\t%16"PRIx64" [unknown] ([xen])\n", ip);
+}
+
+static void print_sample(FILE *out, unsigned int cpu, uint32_t period,
+                         const xc_pmuprof_sample_t *s)
+{
+    bool guest = s->flags & XEN_SYSCTL_PMUPROF_GUEST;
+    unsigned int i;
+    char comm[16];
+
+    if ( s->domid == DOMID_IDLE )
+        snprintf(comm, sizeof(comm), "idle");
+    else
+        snprintf(comm, sizeof(comm), "d%u", s->domid);
+
+    fprintf(out, "%s %5u/%-5u [%03u] %"PRIu64".%06"PRIu64": %u cycles:\n",
+            comm, s->domid, s->vcpu, cpu, s->time / 1000000000,
+            (s->time / 1000) % 1000000, period);
+    print_frame(out, s->ip, guest);
+    for ( i = 0; i < s->nr_frames && i < XEN_SYSCTL_PMUPROF_DEPTH; i++ )
+        print_frame(out, s->frames[i], false);
+    fputc('\n', out);
+}
+
+/* Drain every cpu's buffer, returning the number of samples. */
+static uint64_t drain(xc_interface *xch, FILE *out, unsigned int nr_cpus,
+                      uint32_t period, xc_pmuprof_sample_t *buf,
+                      uint32_t bufsize, uint64_t *lost)
+{
+    uint64_t total = 0, cpu_lost;
+    unsigned int cpu, i;
+    uint32_t nr;
+
+    *lost = 0;
+
+    for ( cpu = 0; cpu < nr_cpus; cpu++ )
+    {
+        cpu_lost = 0;
+        do {
+            nr = bufsize;
+            if ( xc_pmuprof_read(xch, cpu, &nr, buf, &cpu_lost) )
+            {
+                nr = 0;
+                break;
+            }
+            for ( i = 0; i < nr; i++ )
+                print_sample(out, cpu, period, &buf[i]);
+            total += nr;
+        } while ( nr == bufsize );
+        *lost += cpu_lost;
+    }
+
+    return total;
+}
+
+static void handle_signal(int sig)
+{
+    interrupted = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option opts[] = {
+        { "period", required_argument, NULL, 'p' },
+        { "buffer", required_argument, NULL, 'b' },
+        { "interval", required_argument, NULL, 'i' },
+        { "time", required_argument, NULL, 't' },
+        { "map", required_argument, NULL, 'm' },
+        { "output", required_argument, NULL, 'o' },
+        { "stop", no_argument, NULL, 's' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    uint32_t period = 1000000, bufsize = 4096;
+    unsigned int interval_ms = 100, seconds = 0;
+    const char *map = NULL, *output = NULL;
+    xc_pmuprof_sample_t *buf;
+    xc_physinfo_t info = { 0 };
+    uint64_t samples = 0, lost = 0;
+    struct sigaction sa;
+    time_t end = 0;
+    xc_interface *xch;
+    FILE *out = stdout;
+    int opt, stop = 0;
+
+    while ( (opt = getopt_long(argc, argv, "p:b:i:t:m:o:sh", opts,
+                               NULL)) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'p':
+            period = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            bufsize = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            interval_ms = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            seconds = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            map = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 's':
+            stop = 1;
+            break;
+        case 'h':
+            usage(stdout);
+            return 0;
+        default:
+            usage(stderr);
+            return 2;
+        }
+    }
+
+    if ( !period || !bufsize || (bufsize & (bufsize - 1)) || !interval_ms )
+    {
+        usage(stderr);
+        return 2;
+    }
+
+    xch = xc_interface_open(0, 0, 0);
+    if ( !xch )
+    {
+        fprintf(stderr, "failed to open control interface\n");
+        return 1;
+    }
+
+    if ( stop )
+    {
+        if ( xc_pmuprof_stop(xch) )
+        {
+            perror("xc_pmuprof_stop");
+            return 1;
+        }
+        return 0;
+    }
+
+    if ( map && load_symbols(map) )
+        return 1;
+
+    if ( output && !(out = fopen(output, "w")) )
+    {
+        perror(output);
+        return 1;
+    }
+
+    if ( xc_physinfo(xch, &info) )
+    {
+        perror("xc_physinfo");
+        return 1;
+    }
+
+    buf = calloc(bufsize, sizeof(*buf));
+    if ( !buf )
+    {
+        perror("calloc");
+        return 1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if ( xc_pmuprof_start(xch, period, bufsize) )
+    {
+        if ( errno == EBUSY )
+            fprintf(stderr, "The PMU is in use (by xenoprof, vPMU, or a "
+                    "previous run: see --stop)\n");
+        else if ( errno == EOPNOTSUPP )
+            fprintf(stderr, "No usable performance counters\n");
+        else
+            perror("xc_pmuprof_start");
+        return 1;
+    }
+
+    if ( seconds )
+        end = time(NULL) + seconds;
+
+    while ( !interrupted && (!end || time(NULL) < end) )
+    {
+        usleep(interval_ms * 1000);
+        samples += drain(xch, out, info.max_cpu_id + 1, period,
+                         buf, bufsize, &lost);
+    }
+
+    samples += drain(xch, out, info.max_cpu_id + 1, period,
+                     buf, bufsize, &lost);
+    if ( xc_pmuprof_stop(xch) )
+        perror("xc_pmuprof_stop");
+
+    fprintf(stderr, "%"PRIu64" samples, %"PRIu64" lost\n", samples, lost);
+
+    if ( out != stdout )
+        fclose(out);
+    free(buf);
+    xc_interface_close(xch);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -17,6 +17,150 @@
 #include <errno.h>
 #include <string.h>
 #include <inttypes.h>
+#include <stdbool.h>
+
+static void usage(const char *prog)
+{
+    printf("%s: [-r]\n", prog);
+    printf("%s: --histogram [-r | -s <rate>]\n", prog);
+    printf("no args: print lock profile data\n");
+    printf("    -r : reset profile data\n");
+    printf("    --histogram: print lock contention histograms\n");
+    printf("    --histogram -r: reset lock contention histograms\n");
+    printf("    --histogram -s <rate>: sample one contended locking every\n"
+           "                           <rate> (per CPU), 0 disables\n");
+}
+
+/* Upper bound of bucket i, in ns. See XEN_SYSCTL_LOCKHIST_BUCKETS. */
+static void print_bucket(unsigned int i)
+{
+    uint64_t ns = 1ULL << (i + 8);
+
+    if ( i == XEN_SYSCTL_LOCKHIST_BUCKETS - 1 )
+        printf("  %10s", "longer");
+    else if ( ns < 1000 )
+        printf("  <%7"PRIu64"ns", ns);
+    else if ( ns < 1000000 )
+        printf("  <%7"PRIu64"us", ns / 1000);
+    else
+        printf("  <%7"PRIu64"ms", ns / 1000000);
+}
+
+static int cmp_site(const void *a, const void *b)
+{
+    uint32_t ca = *(const uint32_t *)a, cb = *(const uint32_t *)b;
+
+    return (ca < cb) - (ca > cb);
+}
+
+static int histograms(xc_interface *xc_handle, int argc, char *argv[])
+{
+    uint32_t           i, j, n, rate, dropped;
+    uint64_t           samples;
+    struct { uint32_t cnt, idx; } sites[XEN_SYSCTL_LOCKHIST_SITES];
+    DECLARE_HYPERCALL_BUFFER(xc_lockhist_data_t, data);
+
+    if ( argc == 3 && !strcmp(argv[2], "-r") )
+    {
+        if ( xc_lockhist_reset(xc_handle) != 0 )
+        {
+            fprintf(stderr, "Error reseting histograms: %d (%s)\n",
+                    errno, strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+
+    if ( argc == 4 && !strcmp(argv[2], "-s") )
+    {
+        if ( xc_lockhist_set_rate(xc_handle, strtoul(argv[3], NULL, 0)) != 0 )
+        {
+            fprintf(stderr, "Error setting sampling rate: %d (%s)\n",
+                    errno, strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+
+    if ( argc != 2 )
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    n = 0;
+    if ( xc_lockhist_query_number(xc_handle, &n, &rate, &dropped) != 0 )
+    {
+        fprintf(stderr, "Error getting number of histograms: %d (%s)\n",
+                errno, strerror(errno));
+        return 1;
+    }
+
+    if ( rate == 0 )
+        printf("lock contention sampling is off (enable with -s <rate>)\n");
+    else
+        printf("sampling one every %u contended lockings\n", rate);
+    if ( dropped )
+        printf("%u samples dropped (too many locks)\n", dropped);
+
+    if ( n == 0 )
+        return 0;
+
+    n += 32;    /* just to be sure */
+    data = xc_hypercall_buffer_alloc(xc_handle, data, sizeof(*data) * n);
+    if ( data == NULL )
+    {
+        fprintf(stderr, "Could not allocate buffers: %d (%s)\n",
+                errno, strerror(errno));
+        return 1;
+    }
+
+    i = n;
+    if ( xc_lockhist_query(xc_handle, &i, &rate, &dropped,
+                           HYPERCALL_BUFFER(data)) != 0 )
+    {
+        fprintf(stderr, "Error getting histograms: %d (%s)\n",
+                errno, strerror(errno));
+        return 1;
+    }
+
+    if ( i > n )
+    {
+        printf("data incomplete, %d records are missing!\n\n", i - n);
+        i = n;
+    }
+
+    for ( j = 0; j < i; j++ )
+    {
+        unsigned int k;
+
+        for ( samples = 0, k = 0; k < XEN_SYSCTL_LOCKHIST_BUCKETS; k++ )
+            samples += data[j].hist[k];
+
+        printf("\nlock %s (0x%"PRIx64"): %"PRIu64" samples\n",
+               data[j].name, data[j].lock, samples);
+        for ( k = 0; k < XEN_SYSCTL_LOCKHIST_BUCKETS; k++ )
+            print_bucket(k);
+        printf("\n");
+        for ( k = 0; k < XEN_SYSCTL_LOCKHIST_BUCKETS; k++ )
+            printf("  %10u", data[j].hist[k]);
+        printf("\n");
+
+        for ( k = 0; k < XEN_SYSCTL_LOCKHIST_SITES; k++ )
+        {
+            sites[k].cnt = data[j].site[k].addr ? data[j].site[k].cnt : 0;
+            sites[k].idx = k;
+        }
+        qsort(sites, XEN_SYSCTL_LOCKHIST_SITES, sizeof(sites[0]), cmp_site);
+        for ( k = 0; k < XEN_SYSCTL_LOCKHIST_SITES && sites[k].cnt; k++ )
+            printf("  waiter %-40s: %10u\n",
+                   data[j].site[sites[k].idx].name, sites[k].cnt);
+    }
+
+    xc_hypercall_buffer_free(xc_handle, data);
+
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
@@ -25,13 +169,13 @@ int main(int argc, char *argv[])
     uint64_t           time;
     double             l, b, sl, sb;
     char               name[100];
+    bool               hist = (argc >= 2) && !strcmp(argv[1], "--histogram");
     DECLARE_HYPERCALL_BUFFER(xc_lockprof_data_t, data);
 
-    if ( (argc > 2) || ((argc == 2) && (strcmp(argv[1], "-r") != 0)) )
+    if ( !hist &&
+         ((argc > 2) || ((argc == 2) && (strcmp(argv[1], "-r") != 0))) )
     {
-        printf("%s: [-r]\n", argv[0]);
-        printf("no args: print lock profile data\n");
-        printf("    -r : reset profile data\n");
+        usage(argv[0]);
         return 1;
     }
 
@@ -42,6 +186,9 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if ( hist )
+        return histograms(xc_handle, argc, argv);
+
     if ( argc > 1 )
     {
         if ( xc_lockprof_reset(xc_handle) != 0 )
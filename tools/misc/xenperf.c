@@ -10,12 +10,16 @@
  * Description: 
  */
 
+#define XC_WANT_COMPAT_MAP_FOREIGN_API
 #include <xenctrl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <xen-tools/libs.h>
 
 #define X(name) [__HYPERVISOR_##name] = #name
 const char *hypercall_name_table[64] =
@@ -68,6 +72,243 @@ const char *hypercall_name_table[64] =
 };
 #undef X
 
+/*
+ * Sample the counters Xen shares read-only when booted with "perfc_shared",
+ * printing per-second rates of those that changed, without a hypercall per
+ * sample.
+ */
+static int watch_counters(xc_interface *xc_handle, const xc_perfc_desc_t *pcd,
+                          int num_desc, unsigned int interval)
+{
+    uint64_t info_mfn;
+    uint32_t info_frames;
+    const xen_sysctl_perfc_shared_t *info;
+    const uint32_t *nr_slots;
+    const uint64_t *mfn;
+    const uint32_t **counters;
+    uint32_t *prev;
+    unsigned int cpu, i, j, slot, first = 1;
+
+    if ( xc_perfc_shared_info(xc_handle, &info_mfn, &info_frames) != 0 )
+    {
+        fprintf(stderr, "Error locating shared perf counters "
+                "(is Xen booted with perfc_shared?): %d (%s)\n",
+                errno, strerror(errno));
+        return 1;
+    }
+
+    info = xc_map_foreign_range(xc_handle, DOMID_XEN,
+                                info_frames * XC_PAGE_SIZE, PROT_READ,
+                                info_mfn);
+    if ( info == NULL )
+    {
+        fprintf(stderr, "Error mapping perf counter info: %d (%s)\n",
+                errno, strerror(errno));
+        return 1;
+    }
+
+    if ( info->nr_counters != num_desc )
+    {
+        fprintf(stderr, "Mismatching number of perf counters: %u vs %d\n",
+                info->nr_counters, num_desc);
+        return 1;
+    }
+
+    nr_slots = (const uint32_t *)(info + 1);
+    mfn = (const void *)info + info->mfn_offset;
+
+    counters = calloc(info->nr_cpus, sizeof(*counters));
+    prev = calloc(num_desc, sizeof(*prev));
+    if ( counters == NULL || prev == NULL )
+    {
+        fprintf(stderr, "Could not allocate buffers: %d (%s)\n",
+                errno, strerror(errno));
+        return 1;
+    }
+
+    for ( cpu = 0; cpu < info->nr_cpus; cpu++ )
+    {
+        counters[cpu] = xc_map_foreign_range(xc_handle, DOMID_XEN,
+                                             info->cpu_frames * XC_PAGE_SIZE,
+                                             PROT_READ, mfn[cpu]);
+        if ( counters[cpu] == NULL )
+        {
+            fprintf(stderr, "Error mapping perf counters of CPU%u: %d (%s)\n",
+                    cpu, errno, strerror(errno));
+            return 1;
+        }
+    }
+
+    for ( ; ; first = 0 )
+    {
+        if ( !first )
+            printf("--- %u second(s) ---\n", interval);
+
+        for ( i = slot = 0; i < num_desc; slot += nr_slots[i++] )
+        {
+            uint32_t sum = 0;
+
+            for ( cpu = 0; cpu < info->nr_cpus; cpu++ )
+                for ( j = 0; j < nr_slots[i]; j++ )
+                    sum += counters[cpu][slot + j];
+
+            if ( !first && sum != prev[i] )
+                printf("%-35s T=%10u %+14.1f/s\n", pcd[i].name, sum,
+                       (int32_t)(sum - prev[i]) / (double)interval);
+            prev[i] = sum;
+        }
+
+        fflush(stdout);
+        sleep(interval);
+    }
+}
+
+struct hcstats_sum {
+    uint32_t op, subop;
+    uint64_t calls, continuations, total_ns;
+    uint32_t hist[XEN_SYSCTL_HCSTATS_BUCKETS];
+};
+
+static int cmp_hcstats_sum(const void *a, const void *b)
+{
+    const struct hcstats_sum *x = a, *y = b;
+
+    return x->total_ns < y->total_ns ? 1 : x->total_ns > y->total_ns ? -1 : 0;
+}
+
+/* Upper bound of the histogram bucket the fraction @f of calls is under. */
+static void hcstats_percentile(const struct hcstats_sum *s, double f,
+                               char *buf, size_t len)
+{
+    unsigned int i = hist_percentile(s->hist, XEN_SYSCTL_HCSTATS_BUCKETS, f);
+
+    if ( i == XEN_SYSCTL_HCSTATS_BUCKETS - 1 )
+        snprintf(buf, len, ">%.0fus", (double)(1ULL << (i + 7)) / 1000);
+    else
+        snprintf(buf, len, "<%.1fus", (double)(1ULL << (i + 8)) / 1000);
+}
+
+/*
+ * Print the hypercall latency histograms, summed over all CPUs, the
+ * hypercalls and sub-ops which took the most time first.
+ */
+static int hypercall_stats(xc_interface *xc_handle, const char *cmd)
+{
+    DECLARE_HYPERCALL_BUFFER(xc_hcstats_data_t, data);
+    struct hcstats_sum *sums;
+    uint32_t i, j, k, n, nr_elem, nr_sums = 0, enabled, dropped;
+    char name[36], p50[16], p99[16];
+
+    if ( cmd )
+    {
+        uint32_t op;
+
+        if ( !strcmp(cmd, "enable") )
+            op = XEN_SYSCTL_HCSTATS_enable;
+        else if ( !strcmp(cmd, "disable") )
+            op = XEN_SYSCTL_HCSTATS_disable;
+        else if ( !strcmp(cmd, "reset") )
+            op = XEN_SYSCTL_HCSTATS_reset;
+        else
+        {
+            fprintf(stderr, "Unknown --hypercalls command '%s'\n", cmd);
+            return 1;
+        }
+
+        if ( xc_hcstats_op(xc_handle, op) != 0 )
+        {
+            fprintf(stderr, "Error controlling hypercall stats: %d (%s)\n",
+                    errno, strerror(errno));
+            return 1;
+        }
+
+        return 0;
+    }
+
+    if ( xc_hcstats_query_number(xc_handle, &nr_elem, &enabled,
+                                 &dropped) != 0 )
+    {
+        fprintf(stderr, "Error getting number of hypercall stats: %d (%s)\n",
+                errno, strerror(errno));
+        return 1;
+    }
+
+    /* Leave room for entries created while we were allocating. */
+    nr_elem += 64;
+    data = xc_hypercall_buffer_alloc(xc_handle, data,
+                                     sizeof(*data) * nr_elem);
+    sums = calloc(nr_elem, sizeof(*sums));
+    if ( data == NULL || sums == NULL )
+    {
+        fprintf(stderr, "Could not allocate buffers: %d (%s)\n",
+                errno, strerror(errno));
+        return 1;
+    }
+
+    n = nr_elem;
+    if ( xc_hcstats_query(xc_handle, &n, &enabled, &dropped,
+                          HYPERCALL_BUFFER(data)) != 0 )
+    {
+        fprintf(stderr, "Error getting hypercall stats: %d (%s)\n",
+                errno, strerror(errno));
+        return 1;
+    }
+    if ( n > nr_elem )
+        n = nr_elem;
+
+    for ( i = 0; i < n; i++ )
+    {
+        for ( j = 0; j < nr_sums; j++ )
+            if ( sums[j].op == data[i].op && sums[j].subop == data[i].subop )
+                break;
+        if ( j == nr_sums )
+        {
+            sums[j].op = data[i].op;
+            sums[j].subop = data[i].subop;
+            nr_sums++;
+        }
+
+        sums[j].continuations += data[i].continuations;
+        sums[j].total_ns += data[i].total_ns;
+        for ( k = 0; k < XEN_SYSCTL_HCSTATS_BUCKETS; k++ )
+        {
+            sums[j].hist[k] += data[i].hist[k];
+            sums[j].calls += data[i].hist[k];
+        }
+    }
+
+    qsort(sums, nr_sums, sizeof(*sums), cmp_hcstats_sum);
+
+    printf("Hypercall stats %s, %u sample(s) dropped\n",
+           enabled ? "enabled" : "disabled", dropped);
+    printf("%-32s %10s %12s %10s %10s %10s %10s\n", "hypercall", "subop",
+           "calls", "cont", "avg", "p50", "p99");
+    for ( j = 0; j < nr_sums; j++ )
+    {
+        const struct hcstats_sum *s = &sums[j];
+
+        if ( (s->op < 64) && hypercall_name_table[s->op] )
+            snprintf(name, sizeof(name), "%s", hypercall_name_table[s->op]);
+        else
+            snprintf(name, sizeof(name), "[%u]", s->op);
+        hcstats_percentile(s, 0.5, p50, sizeof(p50));
+        hcstats_percentile(s, 0.99, p99, sizeof(p99));
+
+        printf("%-32s ", name);
+        if ( s->subop == XEN_SYSCTL_HCSTATS_NO_SUBOP )
+            printf("%10s ", "-");
+        else
+            printf("%10u ", s->subop);
+        printf("%12"PRIu64" %10"PRIu64" %8.1fus %10s %10s\n",
+               s->calls, s->continuations,
+               s->calls ? s->total_ns / 1000.0 / s->calls : 0, p50, p99);
+    }
+
+    free(sums);
+    xc_hypercall_buffer_free(xc_handle, data);
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     int              i, j;
@@ -77,12 +318,15 @@ int main(int argc, char *argv[])
     xc_perfc_val_t  *val;
     int num_desc, num_val;
     unsigned int    sum, reset = 0, full = 0, pretty = 0;
+    unsigned int    watch = 0, interval = 1, hypercalls = 0;
     char hypercall_name[36];
 
     if ( argc > 1 )
     {
         char *p = argv[1];
-        if ( p[0] == '-' )
+        if ( !strcmp(p, "--hypercalls") )
+            hypercalls = 1;
+        else if ( p[0] == '-' )
         {
             switch ( p[1] )
             {
@@ -96,6 +340,11 @@ int main(int argc, char *argv[])
             case 'r':
                 reset = 1;
                 break;
+            case 'w':
+                watch = 1;
+                if ( argc > 2 && (interval = atoi(argv[2])) == 0 )
+                    goto error;
+                break;
             default:
                 goto error;
             }
@@ -103,11 +352,17 @@ int main(int argc, char *argv[])
         else
         {
         error:
-            printf("%s: [-r]\n", argv[0]);
+            printf("%s: [-f | -p | -r | -w [<seconds>] |\n"
+                   "    --hypercalls [enable | disable | reset]]\n", argv[0]);
             printf("no args: print digested counters\n");
             printf("    -f : print full arrays/histograms\n");
             printf("    -p : print full arrays/histograms in pretty format\n");
             printf("    -r : reset counters\n");
+            printf("    -w : print rates of changing counters every <seconds>\n"
+                   "         (default 1), sampling the pages Xen shares when\n"
+                   "         booted with perfc_shared\n");
+            printf("    --hypercalls : print hypercall latencies by sub-op,\n"
+                   "         or control their recording\n");
             return 0;
         }
     }   
@@ -118,6 +373,13 @@ int main(int argc, char *argv[])
                 errno, strerror(errno));
         return 1;
     }
+
+    if ( hypercalls )
+    {
+        i = hypercall_stats(xc_handle, argc > 2 ? argv[2] : NULL);
+        xc_interface_close(xc_handle);
+        return i;
+    }
     
     if ( reset )
     {
@@ -155,6 +417,14 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if ( watch )
+    {
+        i = watch_counters(xc_handle, pcd, num_desc, interval);
+        xc_hypercall_buffer_free(xc_handle, pcd);
+        xc_hypercall_buffer_free(xc_handle, pcv);
+        return i;
+    }
+
     val = pcv;
     for ( i = 0; i < num_desc; i++ )
     {
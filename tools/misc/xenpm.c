@@ -55,7 +55,8 @@ void show_help(void)
             " set-scaling-speed     [cpuid] <num> set scaling speed on CPU <cpuid> or all\n"
             "                                     it is used in userspace governor.\n"
             " set-scaling-governor  [cpuid] <gov> set scaling governor on CPU <cpuid> or all\n"
-            "                                     as userspace/performance/powersave/ondemand\n"
+            "                                     as userspace/performance/powersave/ondemand/\n"
+            "                                     schedutil\n"
             " set-sampling-rate     [cpuid] <num> set sampling rate on CPU <cpuid> or all\n"
             "                                     it is used in ondemand governor.\n"
             " set-up-threshold      [cpuid] <num> set up threshold on CPU <cpuid> or all\n"
@@ -69,6 +70,13 @@ void show_help(void)
             "                                     output after CTRL-C or SIGINT or several seconds.\n"
             " enable-turbo-mode     [cpuid]       enable Turbo Mode for processors that support it.\n"
             " disable-turbo-mode    [cpuid]       disable Turbo Mode for processors that support it.\n"
+            " get-domain-boost      <domid>       get the performance boost hint of a domain\n"
+            " set-domain-boost      <domid> <0|1> set the performance boost hint of a domain,\n"
+            "                                     it is used in schedutil governor.\n"
+            " get-cpupool-max-latency <poolid>    get the C-state exit latency limit of a cpupool\n"
+            " set-cpupool-max-latency <poolid> <us>\n"
+            "                                     limit C-state exit latency of a cpupool's CPUs\n"
+            "                                     to <us> microseconds (0 for no limit)\n"
             );
 }
 /* wrapper function */
@@ -132,6 +140,11 @@ static void print_cxstat(int cpuid, struct xc_cx_stat *cxstat)
         if ( cxstat->cc[i] )
            printf("cc%d                  : [%20"PRIu64" ms]\n", i + 1,
                   cxstat->cc[i] / 1000000UL);
+    if ( cxstat->pred_total )
+        printf("idle predictions     : [%20"PRIu64"] too deep %"PRIu64
+               "%%, too shallow %"PRIu64"%%\n", cxstat->pred_total,
+               cxstat->pred_too_deep * 100 / cxstat->pred_total,
+               cxstat->pred_too_shallow * 100 / cxstat->pred_total);
     printf("\n");
 }
 
@@ -1163,6 +1176,78 @@ void disable_turbo_mode(int argc, char *argv[])
                 errno, strerror(errno));
 }
 
+void get_domain_boost_func(int argc, char *argv[])
+{
+    int domid;
+    bool boost;
+
+    if ( argc != 1 || sscanf(argv[0], "%d", &domid) != 1 || domid < 0 )
+    {
+        fprintf(stderr, "Missing or invalid argument(s)\n");
+        exit(EINVAL);
+    }
+
+    if ( !xc_get_cpufreq_domain_boost(xc_handle, domid, &boost) )
+        printf("Domain %d performance boost is %s\n", domid,
+               boost ? "on" : "off");
+    else
+        fprintf(stderr, "failed to get domain %d boost (%d - %s)\n",
+                domid, errno, strerror(errno));
+}
+
+void set_domain_boost_func(int argc, char *argv[])
+{
+    int domid, boost;
+
+    if ( argc != 2 || sscanf(argv[0], "%d", &domid) != 1 || domid < 0 ||
+         sscanf(argv[1], "%d", &boost) != 1 || boost < 0 || boost > 1 )
+    {
+        fprintf(stderr, "Missing or invalid argument(s)\n");
+        exit(EINVAL);
+    }
+
+    if ( xc_set_cpufreq_domain_boost(xc_handle, domid, boost) )
+        fprintf(stderr, "failed to set domain %d boost (%d - %s)\n",
+                domid, errno, strerror(errno));
+}
+
+void get_cpupool_latency_func(int argc, char *argv[])
+{
+    int poolid;
+    uint32_t latency;
+
+    if ( argc != 1 || sscanf(argv[0], "%d", &poolid) != 1 || poolid < 0 )
+    {
+        fprintf(stderr, "Missing or invalid argument(s)\n");
+        exit(EINVAL);
+    }
+
+    if ( xc_get_cpupool_idle_latency(xc_handle, poolid, &latency) )
+        fprintf(stderr, "failed to get cpupool %d latency (%d - %s)\n",
+                poolid, errno, strerror(errno));
+    else if ( latency )
+        printf("Cpupool %d max C-state exit latency is %u us\n",
+               poolid, latency);
+    else
+        printf("Cpupool %d max C-state exit latency is unlimited\n", poolid);
+}
+
+void set_cpupool_latency_func(int argc, char *argv[])
+{
+    int poolid, latency;
+
+    if ( argc != 2 || sscanf(argv[0], "%d", &poolid) != 1 || poolid < 0 ||
+         sscanf(argv[1], "%d", &latency) != 1 || latency < 0 )
+    {
+        fprintf(stderr, "Missing or invalid argument(s)\n");
+        exit(EINVAL);
+    }
+
+    if ( xc_set_cpupool_idle_latency(xc_handle, poolid, latency) )
+        fprintf(stderr, "failed to set cpupool %d latency (%d - %s)\n",
+                poolid, errno, strerror(errno));
+}
+
 struct {
     const char *name;
     void (*function)(int argc, char *argv[]);
@@ -1186,6 +1271,10 @@ struct {
     { "set-max-cstate", set_max_cstate_func},
     { "enable-turbo-mode", enable_turbo_mode },
     { "disable-turbo-mode", disable_turbo_mode },
+    { "get-domain-boost", get_domain_boost_func },
+    { "set-domain-boost", set_domain_boost_func },
+    { "get-cpupool-max-latency", get_cpupool_latency_func },
+    { "set-cpupool-max-latency", set_cpupool_latency_func },
 };
 
 int main(int argc, char *argv[])
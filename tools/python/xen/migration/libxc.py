@@ -65,6 +65,15 @@ REC_TYPE_x86_pv_vcpu_msrs           = 0x0000000c
 REC_TYPE_verify                     = 0x0000000d
 REC_TYPE_checkpoint                 = 0x0000000e
 REC_TYPE_checkpoint_dirty_pfn_list  = 0x0000000f
+REC_TYPE_zero_page_data             = 0x00000010
+REC_TYPE_postcopy_pfns              = 0x00000011
+REC_TYPE_postcopy_transition        = 0x00000012
+REC_TYPE_postcopy_page_data         = 0x00000013
+REC_TYPE_postcopy_fault             = 0x00000014
+REC_TYPE_data_streams               = 0x00000015
+REC_TYPE_data_sync                  = 0x00000016
+REC_TYPE_page_index_offset          = 0x80000000
+REC_TYPE_page_index                 = 0x80000001
 
 rec_type_to_str = {
     REC_TYPE_end                        : "End",
@@ -82,7 +91,16 @@ rec_type_to_str = {
     REC_TYPE_x86_pv_vcpu_msrs           : "x86 PV vcpu msrs",
     REC_TYPE_verify                     : "Verify",
     REC_TYPE_checkpoint                 : "Checkpoint",
-    REC_TYPE_checkpoint_dirty_pfn_list  : "Checkpoint dirty pfn list"
+    REC_TYPE_checkpoint_dirty_pfn_list  : "Checkpoint dirty pfn list",
+    REC_TYPE_zero_page_data             : "Zero page data",
+    REC_TYPE_postcopy_pfns              : "Postcopy pfns",
+    REC_TYPE_postcopy_transition        : "Postcopy transition",
+    REC_TYPE_postcopy_page_data         : "Postcopy page data",
+    REC_TYPE_postcopy_fault             : "Postcopy fault",
+    REC_TYPE_data_streams               : "Data streams",
+    REC_TYPE_data_sync                  : "Data sync",
+    REC_TYPE_page_index_offset          : "Page index offset",
+    REC_TYPE_page_index                 : "Page index"
 }
 
 # page_data
@@ -120,6 +138,15 @@ TSC_INFO_FORMAT           = "IIQII"
 HVM_PARAMS_ENTRY_FORMAT   = "QQ"
 HVM_PARAMS_FORMAT         = "II"
 
+# data_streams
+DATA_STREAMS_FORMAT       = "II"
+
+# page_index_offset
+PAGE_INDEX_OFFSET_FORMAT  = "Q"
+
+# page_index
+PAGE_INDEX_ENTRY_FORMAT   = "QIIQ"
+
 class VerifyLibxc(VerifyBase):
     """ Verify a Libxc v2 stream """
 
@@ -209,7 +236,8 @@ class VerifyLibxc(VerifyBase):
         contentsz = (length + 7) & ~7
         content = self.rdexact(contentsz)
 
-        if rtype != REC_TYPE_page_data:
+        if rtype not in (REC_TYPE_page_data, REC_TYPE_zero_page_data,
+                         REC_TYPE_postcopy_page_data):
 
             if self.squashed_pagedata_records > 0:
                 self.info("Squashed %d Page Data records together"
@@ -242,24 +270,25 @@ class VerifyLibxc(VerifyBase):
             raise RecordError("End record with non-zero length")
 
 
-    def verify_record_page_data(self, content):
+    def verify_record_page_data(self, content, name = "PAGE_DATA",
+                                with_data = True):
         """ Page Data record """
         minsz = calcsize(PAGE_DATA_FORMAT)
 
         if len(content) <= minsz:
-            raise RecordError("PAGE_DATA record must be at least %d bytes long"
-                              % (minsz, ))
+            raise RecordError("%s record must be at least %d bytes long"
+                              % (name, minsz))
 
         count, res1 = unpack(PAGE_DATA_FORMAT, content[:minsz])
 
         if res1 != 0:
-            raise StreamError("Reserved bits set in PAGE_DATA record 0x%04x"
-                              % (res1, ))
+            raise StreamError("Reserved bits set in %s record 0x%04x"
+                              % (name, res1))
 
         pfnsz = count * 8
         if (len(content) - minsz) < pfnsz:
-            raise RecordError("PAGE_DATA record must contain a pfn record for "
-                              "each count")
+            raise RecordError("%s record must contain a pfn record for "
+                              "each count" % (name, ))
 
         pfns = list(unpack("=%dQ" % (count,), content[minsz:minsz + pfnsz]))
 
@@ -278,8 +307,11 @@ class VerifyLibxc(VerifyBase):
             if PAGE_DATA_TYPE_NOTAB <= (pfn & PAGE_DATA_TYPE_LTABTYPE_MASK) \
                     <= PAGE_DATA_TYPE_L4TAB:
                 nr_pages += 1
+            elif not with_data:
+                raise RecordError("Type without data in pfn[%d]: 0x%016x",
+                                  idx, pfn & PAGE_DATA_TYPE_LTAB_MASK)
 
-        pagesz = nr_pages * 4096
+        pagesz = nr_pages * 4096 if with_data else 0
         if len(content) != minsz + pfnsz + pagesz:
             raise RecordError("Expected %u + %u + %u, got %u"
                               % (minsz, pfnsz, pagesz, len(content)))
@@ -425,6 +457,92 @@ class VerifyLibxc(VerifyBase):
         raise RecordError("Found checkpoint dirty pfn list record in stream")
 
 
+    def verify_record_zero_page_data(self, content):
+        """ Zero Page Data record """
+        self.verify_record_page_data(content, "ZERO_PAGE_DATA", False)
+
+
+    def verify_record_postcopy_pfns(self, content):
+        """ Postcopy pfns record """
+
+        if len(content) % 8 != 0:
+            raise RecordError("Postcopy pfns record length %d not a "
+                              "multiple of 8" % (len(content), ))
+
+
+    def verify_record_postcopy_transition(self, content):
+        """ Postcopy transition record """
+
+        if len(content) != 0:
+            raise RecordError("Postcopy transition record with non-zero "
+                              "length")
+
+
+    def verify_record_postcopy_page_data(self, content):
+        """ Postcopy Page Data record """
+        self.verify_record_page_data(content, "POSTCOPY_PAGE_DATA")
+
+
+    def verify_record_postcopy_fault(self, content):
+        """ postcopy fault """
+        raise RecordError("Found postcopy fault record in stream")
+
+
+    def verify_record_data_streams(self, content):
+        """ Data streams record """
+
+        minsz = calcsize(DATA_STREAMS_FORMAT)
+
+        if len(content) != minsz:
+            raise RecordError("Data streams record length %d, expected %d" %
+                              (len(content), minsz))
+
+        count, index = unpack(DATA_STREAMS_FORMAT, content)
+
+        if count == 0 or index > count:
+            raise RecordError("Stream %d of %d" % (index, count))
+
+        self.info("  Stream %d of %d" % (index, count))
+
+
+    def verify_record_data_sync(self, content):
+        """ Data sync record """
+
+        if len(content) != 0:
+            raise RecordError("Data sync record with non-zero length")
+
+
+    def verify_record_page_index_offset(self, content):
+        """ Page index offset record """
+
+        sz = calcsize(PAGE_INDEX_OFFSET_FORMAT)
+
+        if len(content) != sz:
+            raise RecordError("Page index offset record length %d, expected %d"
+                              % (len(content), sz))
+
+        offset, = unpack(PAGE_INDEX_OFFSET_FORMAT, content)
+        self.info("  Page index at offset 0x%x" % (offset, ))
+
+
+    def verify_record_page_index(self, content):
+        """ Page index record """
+
+        sz = calcsize(PAGE_INDEX_ENTRY_FORMAT)
+
+        if len(content) % sz != 0:
+            raise RecordError("Length expected to be a multiple of %d, got %d"
+                              % (sz, len(content)))
+
+        for i in range(len(content) / sz):
+            pfn, count, _, _ = unpack(PAGE_INDEX_ENTRY_FORMAT,
+                                      content[i * sz:(i + 1) * sz])
+
+            if count == 0:
+                raise RecordError("Page index entry for pfn 0x%x with no pages"
+                                  % (pfn, ))
+
+
 record_verifiers = {
     REC_TYPE_end:
         VerifyLibxc.verify_record_end,
@@ -466,4 +584,25 @@ record_verifiers = {
         VerifyLibxc.verify_record_checkpoint,
     REC_TYPE_checkpoint_dirty_pfn_list:
         VerifyLibxc.verify_record_checkpoint_dirty_pfn_list,
+
+    REC_TYPE_zero_page_data:
+        VerifyLibxc.verify_record_zero_page_data,
+
+    REC_TYPE_postcopy_pfns:
+        VerifyLibxc.verify_record_postcopy_pfns,
+    REC_TYPE_postcopy_transition:
+        VerifyLibxc.verify_record_postcopy_transition,
+    REC_TYPE_postcopy_page_data:
+        VerifyLibxc.verify_record_postcopy_page_data,
+    REC_TYPE_postcopy_fault:
+        VerifyLibxc.verify_record_postcopy_fault,
+
+    REC_TYPE_data_streams:
+        VerifyLibxc.verify_record_data_streams,
+    REC_TYPE_data_sync:
+        VerifyLibxc.verify_record_data_sync,
+    REC_TYPE_page_index_offset:
+        VerifyLibxc.verify_record_page_index_offset,
+    REC_TYPE_page_index:
+        VerifyLibxc.verify_record_page_index,
     }
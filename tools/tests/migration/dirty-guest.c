@@ -0,0 +1,504 @@
+/*
+ * dirty-guest.c
+ *
+ * A minimal PVH guest for migration testing: it dirties its memory at a
+ * configurable rate and in a configurable pattern, and answers just
+ * enough of the control/shutdown protocol over xenstore to be suspended
+ * (and so migrated) and shut down by the toolstack. There are no
+ * interrupts and no paging; everything is polled.
+ *
+ * Parameters come from the kernel command line ("cmdline=" in the guest
+ * config), as space separated key=value pairs:
+ *   wss=<MiB>        working set to dirty (default 64)
+ *   rate=<pages/s>   pages dirtied per second, 0 for flat out (default 0)
+ *   pattern=<name>   seq, random or hot (default seq)
+ *   hot=<percent>    share of the working set "hot" dirties (default 10)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <xen/xen.h>
+#include <xen/arch-x86/cpuid.h>
+#include <xen/arch-x86/hvm/start_info.h>
+#include <xen/event_channel.h>
+#include <xen/hvm/hvm_op.h>
+#include <xen/hvm/params.h>
+#include <xen/io/xs_wire.h>
+#include <xen/sched.h>
+
+#define PAGE_SHIFT      12
+#define PAGE_SIZE       (1U << PAGE_SHIFT)
+#define MAX_WSS_MB      2048
+#define CONTROL_POLL_MS 100
+
+#define barrier()       asm volatile ( "" ::: "memory" )
+
+enum pattern {
+    PATTERN_SEQ,
+    PATTERN_RANDOM,
+    PATTERN_HOT,
+};
+
+extern char _end[];
+
+uint8_t hypercall_page[PAGE_SIZE]
+    __attribute__((aligned(PAGE_SIZE), section(".bss.page_aligned")));
+
+static struct xenstore_domain_interface *xs_ring;
+static evtchn_port_t xs_port;
+static uint32_t xs_req_id;
+
+static uint32_t tsc_khz;
+
+static unsigned int wss_mb = 64, rate, hot = 10;
+static enum pattern pattern = PATTERN_SEQ;
+
+#define hypercall2(nr, a1, a2) ({                                       \
+    long res_, ign1_, ign2_;                                            \
+    asm volatile ( "call hypercall_page + %c[offset]"                   \
+                   : "=a" (res_), "=b" (ign1_), "=c" (ign2_)            \
+                   : [offset] "i" ((nr) * 32),                          \
+                     "1" ((long)(a1)), "2" ((long)(a2))                 \
+                   : "memory" );                                        \
+    res_;                                                               \
+})
+
+/* The compiler may emit calls to these even when freestanding. */
+void *memset(void *s, int c, size_t n)
+{
+    uint8_t *p = s;
+
+    while ( n-- )
+        *p++ = c;
+
+    return s;
+}
+
+void *memcpy(void *dst, const void *src, size_t n)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+
+    while ( n-- )
+        *d++ = *s++;
+
+    return dst;
+}
+
+static size_t strlen(const char *s)
+{
+    size_t n = 0;
+
+    while ( s[n] )
+        n++;
+
+    return n;
+}
+
+static bool streq(const char *a, const char *b)
+{
+    while ( *a && *a == *b )
+        a++, b++;
+
+    return *a == *b;
+}
+
+static bool strprefix(const char *s, const char *prefix, const char **rest)
+{
+    while ( *prefix )
+        if ( *s++ != *prefix++ )
+            return false;
+
+    *rest = s;
+    return true;
+}
+
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax,
+                  uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+    asm volatile ( "cpuid"
+                   : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+                   : "0" (leaf), "2" (subleaf) );
+}
+
+static uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+
+    asm volatile ( "rdtsc" : "=a" (lo), "=d" (hi) );
+
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* 64 by 32 bit division, without libgcc: the quotient must fit 32 bits. */
+static uint32_t div64_32(uint64_t n, uint32_t d)
+{
+    uint32_t q, r;
+
+    if ( (n >> 32) >= d )
+        return ~0U;
+
+    asm ( "divl %4"
+          : "=a" (q), "=d" (r)
+          : "0" ((uint32_t)n), "1" ((uint32_t)(n >> 32)), "rm" (d) );
+
+    return q;
+}
+
+/* Output goes to the hypervisor's debug port, and so to "xl dmesg". */
+static void puts(const char *s)
+{
+    while ( *s )
+        asm volatile ( "outb %b0, %w1" :: "a" (*s++), "Nd" (0xe9) );
+}
+
+static void putu(unsigned int v)
+{
+    char buf[11], *p = buf + sizeof(buf);
+
+    *--p = '\0';
+    do {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while ( v );
+
+    puts(p);
+}
+
+static uint32_t xen_cpuid_base(void)
+{
+    uint32_t base, eax, ebx, ecx, edx;
+
+    for ( base = 0x40000000; base < 0x40010000; base += 0x100 )
+    {
+        cpuid(base, 0, &eax, &ebx, &ecx, &edx);
+        if ( ebx == XEN_CPUID_SIGNATURE_EBX &&
+             ecx == XEN_CPUID_SIGNATURE_ECX &&
+             edx == XEN_CPUID_SIGNATURE_EDX &&
+             eax - base >= 3 )
+            return base;
+    }
+
+    return 0;
+}
+
+static uint64_t hvm_get_param(uint32_t index)
+{
+    struct xen_hvm_param p = {
+        .domid = DOMID_SELF,
+        .index = index,
+    };
+
+    if ( hypercall2(__HYPERVISOR_hvm_op, HVMOP_get_param, &p) )
+        return 0;
+
+    return p.value;
+}
+
+/*
+ * Xenstore, spinning for everything. The ring indexes are never cached:
+ * the ring may have been reset under our feet by a migration.
+ */
+static void xs_notify(void)
+{
+    struct evtchn_send send = { .port = xs_port };
+
+    hypercall2(__HYPERVISOR_event_channel_op, EVTCHNOP_send, &send);
+}
+
+static void xs_put(const void *data, unsigned int len)
+{
+    const char *p = data;
+    XENSTORE_RING_IDX prod;
+
+    while ( len )
+    {
+        prod = xs_ring->req_prod;
+        barrier();
+        if ( prod - xs_ring->req_cons >= XENSTORE_RING_SIZE )
+        {
+            xs_notify();
+            continue;
+        }
+        xs_ring->req[MASK_XENSTORE_IDX(prod)] = *p++;
+        barrier();
+        xs_ring->req_prod = prod + 1;
+        len--;
+    }
+}
+
+/* Read @len bytes of reply, keeping the first @size of them. */
+static void xs_get(void *data, unsigned int len, unsigned int size)
+{
+    char *p = data;
+    XENSTORE_RING_IDX cons;
+    unsigned int i;
+
+    for ( i = 0; i < len; )
+    {
+        cons = xs_ring->rsp_cons;
+        barrier();
+        if ( cons == xs_ring->rsp_prod )
+        {
+            asm volatile ( "pause" );
+            continue;
+        }
+        if ( i < size )
+            p[i] = xs_ring->rsp[MASK_XENSTORE_IDX(cons)];
+        barrier();
+        xs_ring->rsp_cons = cons + 1;
+        i++;
+    }
+
+    xs_notify();
+}
+
+/*
+ * One request on @path, with @value appended for writes. Returns the
+ * reply's length (truncated to @size), or -1 if it was an error.
+ */
+static int xs_request(enum xsd_sockmsg_type type, const char *path,
+                      const char *value, char *reply, unsigned int size)
+{
+    struct xsd_sockmsg msg = {
+        .type = type,
+        .req_id = ++xs_req_id,
+        .len = strlen(path) + 1 + (value ? strlen(value) : 0),
+    };
+
+    xs_put(&msg, sizeof(msg));
+    xs_put(path, strlen(path) + 1);
+    if ( value )
+        xs_put(value, strlen(value));
+    xs_notify();
+
+    xs_get(&msg, sizeof(msg), sizeof(msg));
+    xs_get(reply, msg.len, size);
+
+    if ( msg.type == XS_ERROR )
+        return -1;
+
+    return msg.len < size ? msg.len : size;
+}
+
+static void xs_setup(void)
+{
+    xs_ring = (void *)(unsigned long)(hvm_get_param(HVM_PARAM_STORE_PFN) <<
+                                      PAGE_SHIFT);
+    xs_port = hvm_get_param(HVM_PARAM_STORE_EVTCHN);
+}
+
+static void shutdown(unsigned int reason)
+{
+    struct sched_shutdown s = { .reason = reason };
+
+    hypercall2(__HYPERVISOR_sched_op, SCHEDOP_shutdown, &s);
+}
+
+/*
+ * Act on a request in control/shutdown. Returns true if we were
+ * suspended, and resumed since, possibly on another host.
+ */
+static bool check_control(void)
+{
+    char buf[16];
+    int len;
+
+    len = xs_request(XS_READ, "control/shutdown", NULL, buf,
+                     sizeof(buf) - 1);
+    if ( len <= 0 )
+        return false;
+    buf[len] = '\0';
+
+    xs_request(XS_WRITE, "control/shutdown", "", buf, 0);
+
+    if ( streq(buf, "suspend") )
+    {
+        shutdown(SHUTDOWN_suspend);
+        xs_setup();
+        puts("dirty-guest: resumed\n");
+        return true;
+    }
+    if ( streq(buf, "poweroff") || streq(buf, "halt") )
+        shutdown(SHUTDOWN_poweroff);
+    if ( streq(buf, "reboot") )
+        shutdown(SHUTDOWN_reboot);
+
+    return false;
+}
+
+static unsigned int parse_uint(const char **s)
+{
+    unsigned int v = 0;
+
+    while ( **s >= '0' && **s <= '9' )
+        v = v * 10 + *(*s)++ - '0';
+
+    return v;
+}
+
+static void parse_cmdline(const char *s)
+{
+    const char *v;
+
+    while ( *s )
+    {
+        if ( strprefix(s, "wss=", &v) )
+            wss_mb = parse_uint(&v);
+        else if ( strprefix(s, "rate=", &v) )
+            rate = parse_uint(&v);
+        else if ( strprefix(s, "hot=", &v) )
+            hot = parse_uint(&v);
+        else if ( strprefix(s, "pattern=seq", &v) )
+            pattern = PATTERN_SEQ;
+        else if ( strprefix(s, "pattern=random", &v) )
+            pattern = PATTERN_RANDOM;
+        else if ( strprefix(s, "pattern=hot", &v) )
+            pattern = PATTERN_HOT;
+        else
+            v = s;
+
+        while ( *v && *v != ' ' )
+            v++;
+        while ( *v == ' ' )
+            v++;
+        s = v;
+    }
+
+    if ( !wss_mb )
+        wss_mb = 1;
+    if ( wss_mb > MAX_WSS_MB )
+        wss_mb = MAX_WSS_MB;
+    if ( !hot || hot > 100 )
+        hot = 10;
+}
+
+void guest_main(const struct hvm_start_info *si)
+{
+    static const char *const pattern_names[] = {
+        [PATTERN_SEQ] = "seq",
+        [PATTERN_RANDOM] = "random",
+        [PATTERN_HOT] = "hot",
+    };
+    uint8_t *region = (uint8_t *)(((unsigned long)_end + PAGE_SIZE - 1) &
+                                  ~(PAGE_SIZE - 1));
+    uint32_t eax, ebx, ecx, edx, base, nr_pages, hot_pages, page = 0;
+    uint32_t seed = 2463534242U, stamp = 0, due, done = 0, n, ms;
+    uint64_t now, window, last_check;
+
+    if ( si->magic == XEN_HVM_START_MAGIC_VALUE && si->cmdline_paddr )
+        parse_cmdline((const char *)(unsigned long)si->cmdline_paddr);
+
+    base = xen_cpuid_base();
+    if ( !base )
+    {
+        puts("dirty-guest: not running on Xen\n");
+        return;
+    }
+
+    cpuid(base + 2, 0, &eax, &ebx, &ecx, &edx);
+    asm volatile ( "wrmsr" :: "c" (ebx), "a" ((unsigned long)hypercall_page),
+                   "d" (0) : "memory" );
+
+    cpuid(base + 3, 0, &eax, &ebx, &ecx, &edx);
+    tsc_khz = ecx ?: 1000000;
+
+    xs_setup();
+
+    nr_pages = wss_mb << (20 - PAGE_SHIFT);
+    hot_pages = nr_pages * hot / 100 ?: 1;
+
+    puts("dirty-guest: wss ");
+    putu(wss_mb);
+    puts(" MiB, rate ");
+    putu(rate);
+    puts(" pages/s, pattern ");
+    puts(pattern_names[pattern]);
+    puts("\n");
+
+    window = last_check = rdtsc();
+
+    for ( ; ; )
+    {
+        now = rdtsc();
+
+        /*
+         * Pace over one second windows, so that the arithmetic stays in
+         * 32 bits, and a stall (or a migration) isn't made up for later.
+         */
+        ms = div64_32(now - window, tsc_khz);
+        if ( ms >= 1000 )
+        {
+            window = now;
+            done = 0;
+            ms = 0;
+        }
+        if ( rate )
+        {
+            due = div64_32((uint64_t)ms * rate, 1000);
+            n = due > done ? due - done : 0;
+            if ( n > 4096 )
+                n = 4096;
+        }
+        else
+            n = 256;
+        done += n;
+
+        while ( n-- )
+        {
+            switch ( pattern )
+            {
+            case PATTERN_SEQ:
+                if ( ++page >= nr_pages )
+                    page = 0;
+                break;
+
+            case PATTERN_RANDOM:
+            case PATTERN_HOT:
+                /* xorshift32 */
+                seed ^= seed << 13;
+                seed ^= seed >> 17;
+                seed ^= seed << 5;
+                page = seed % (pattern == PATTERN_HOT ? hot_pages : nr_pages);
+                break;
+            }
+
+            *(volatile uint32_t *)(region + (page << PAGE_SHIFT)) = ++stamp;
+        }
+
+        if ( div64_32(now - last_check, tsc_khz) >= CONTROL_POLL_MS )
+        {
+            if ( check_control() )
+            {
+                window = rdtsc();
+                done = 0;
+            }
+            last_check = rdtsc();
+        }
+        else if ( rate )
+            asm volatile ( "pause" );
+    }
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,389 @@
+/*
+ * migrate-bench.c
+ *
+ * Live migrate a domain to the local host through libxl, as "xl migrate
+ * <dom> localhost" would, and report how it went: total time, downtime,
+ * bytes in the stream and the number of pre-copy iterations.
+ *
+ * The save and restore sides run in two processes joined by a relay
+ * thread, which counts the bytes and watches for the source getting
+ * suspended. Downtime is from then until the destination is unpaused.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libxl.h>
+#include <libxl_utils.h>
+#include <xentoollog.h>
+
+#define RELAY_CHUNK (64 * 1024)
+
+struct relay {
+    libxl_ctx *ctx;
+    uint32_t domid;
+    int in, out;
+    uint64_t bytes;
+    uint64_t suspended_ns;
+};
+
+/* Passes messages on, and keeps the last "Frames iteration N" seen. */
+typedef struct {
+    xentoollog_logger vtable;
+    xentoollog_logger *inner;
+    unsigned int iterations;
+} xentoollog_logger_bench;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_vmessage(xentoollog_logger *logger, xentoollog_level level,
+                           int errnoval, const char *context,
+                           const char *format, va_list al)
+{
+    xentoollog_logger_bench *lg = (void *)logger;
+
+    lg->inner->vmessage(lg->inner, level, errnoval, context, format, al);
+}
+
+static void bench_progress(xentoollog_logger *logger, const char *context,
+                           const char *doing_what, int percent,
+                           unsigned long done, unsigned long total)
+{
+    xentoollog_logger_bench *lg = (void *)logger;
+    unsigned int iter;
+
+    /* counted from 0, and the final stop-and-copy pass is one too */
+    if ( sscanf(doing_what, "Frames iteration %u", &iter) == 1 &&
+         iter + 1 > lg->iterations )
+        lg->iterations = iter + 1;
+}
+
+static void bench_destroy(xentoollog_logger *logger)
+{
+}
+
+static void *relay_thread(void *arg)
+{
+    struct relay *r = arg;
+    struct pollfd pfd = { .fd = r->in, .events = POLLIN };
+    libxl_dominfo info;
+    uint64_t last = 0, now;
+    char *buf = malloc(RELAY_CHUNK);
+    ssize_t len, done, n;
+
+    if ( !buf )
+        return NULL;
+
+    libxl_dominfo_init(&info);
+
+    for ( ; ; )
+    {
+        now = now_ns();
+        if ( !r->suspended_ns && now - last >= 1000000 )
+        {
+            last = now;
+            if ( !libxl_domain_info(r->ctx, &info, r->domid) &&
+                 info.shutdown &&
+                 info.shutdown_reason == LIBXL_SHUTDOWN_REASON_SUSPEND )
+                r->suspended_ns = now;
+            libxl_dominfo_dispose(&info);
+            libxl_dominfo_init(&info);
+        }
+
+        if ( poll(&pfd, 1, r->suspended_ns ? -1 : 1) <= 0 )
+            continue;
+
+        len = read(r->in, buf, RELAY_CHUNK);
+        if ( len < 0 && errno == EINTR )
+            continue;
+        if ( len <= 0 )
+            break;
+
+        for ( done = 0; done < len; done += n )
+        {
+            n = write(r->out, buf + done, len - done);
+            if ( n < 0 && errno == EINTR )
+                n = 0;
+            else if ( n < 0 )
+                goto out;
+        }
+        r->bytes += len;
+    }
+
+ out:
+    close(r->out);
+    free(buf);
+
+    return NULL;
+}
+
+/*
+ * The receiving side: restore from @fd as "<name>--incoming", unpause,
+ * and report the new domid and the time of the unpause over @result.
+ */
+static int receive(const char *domname, int fd, int result)
+{
+    libxl_domain_restore_params params;
+    libxl_domain_config d_config;
+    xentoollog_logger *lg;
+    libxl_ctx *ctx = NULL;
+    uint32_t src, domid;
+    bool created = false;
+    uint64_t msg[2];
+    char *name;
+    int rc = 1;
+
+    lg = (xentoollog_logger *)xtl_createlogger_stdiostream(stderr,
+                                                           XTL_ERROR, 0);
+    libxl_domain_config_init(&d_config);
+    libxl_domain_restore_params_init(&params);
+
+    if ( !lg || libxl_ctx_alloc(&ctx, LIBXL_VERSION, 0, lg) )
+        goto out;
+    if ( libxl_domain_qualifier_to_domid(ctx, domname, &src) ||
+         libxl_retrieve_domain_configuration(ctx, src, &d_config) )
+        goto out;
+
+    if ( asprintf(&name, "%s--incoming", d_config.c_info.name) < 0 )
+        goto out;
+    free(d_config.c_info.name);
+    d_config.c_info.name = name;
+
+    params.checkpointed_stream = LIBXL_CHECKPOINTED_STREAM_NONE;
+    params.stream_version = 2;
+
+    if ( libxl_domain_create_restore(ctx, &d_config, &domid, fd, -1,
+                                     &params, NULL, NULL) )
+        goto out;
+    created = true;
+    if ( libxl_domain_unpause(ctx, domid) )
+        goto out;
+
+    msg[0] = domid;
+    msg[1] = now_ns();
+    if ( write(result, msg, sizeof(msg)) == sizeof(msg) )
+        rc = 0;
+
+ out:
+    if ( rc && created )
+        libxl_domain_destroy(ctx, domid, NULL);
+    libxl_domain_restore_params_dispose(&params);
+    libxl_domain_config_dispose(&d_config);
+    if ( ctx )
+        libxl_ctx_free(ctx);
+    if ( lg )
+        xtl_logger_destroy(lg);
+
+    return rc;
+}
+
+static void usage(int ret)
+{
+    FILE *out;
+
+    out = ret ? stderr : stdout;
+
+    fprintf(out, "usage: migrate-bench [<options>] <domain>\n");
+    fprintf(out, "  <options> are:\n");
+    fprintf(out, "  -a|--auto-converge      throttle the guest if it won't converge\n");
+    fprintf(out, "  -c|--csv-header         print the csv header line first\n");
+    fprintf(out, "  -m|--max-downtime <ms>  adaptive pre-copy, aiming for <ms>\n");
+    fprintf(out, "  -t|--tag <name>         label the result, e.g. by rate or release\n");
+    fprintf(out, "  -z|--zero-pages         elide zero pages from the stream\n");
+    fprintf(out, "  -h|--help               print this usage information\n");
+    exit(ret);
+}
+
+static const struct option options[] = {
+    { "auto-converge", no_argument, NULL, 'a' },
+    { "csv-header", no_argument, NULL, 'c' },
+    { "max-downtime", required_argument, NULL, 'm' },
+    { "tag", required_argument, NULL, 't' },
+    { "zero-pages", no_argument, NULL, 'z' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+int main(int argc, char *argv[])
+{
+    libxl_domain_suspend_props props;
+    xentoollog_logger_bench lg_buf = { 0 }, *lg;
+    struct relay relay = { 0 };
+    int save_pipe[2], restore_pipe[2], result_pipe[2];
+    const char *tag = "", *domname;
+    uint64_t start, msg[2];
+    libxl_ctx *ctx = NULL;
+    uint32_t domid;
+    pthread_t thread;
+    bool header = false;
+    pid_t child;
+    int opt, status, rc;
+
+    libxl_domain_suspend_props_init(&props);
+    props.flags = LIBXL_SUSPEND_LIVE;
+
+    while ( (opt = getopt_long(argc, argv, "acm:t:zh", options,
+                               NULL)) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'a':
+            props.flags |= LIBXL_SUSPEND_AUTO_CONVERGE;
+            break;
+        case 'c':
+            header = true;
+            break;
+        case 'm':
+            props.max_downtime_ms = atoi(optarg);
+            break;
+        case 't':
+            tag = optarg;
+            break;
+        case 'z':
+            props.flags |= LIBXL_SUSPEND_ZERO_PAGES;
+            break;
+        case 'h':
+            usage(0);
+            break;
+        default:
+            usage(1);
+        }
+    }
+    if ( optind + 1 != argc )
+        usage(1);
+    if ( (props.flags & LIBXL_SUSPEND_AUTO_CONVERGE) &&
+         !props.max_downtime_ms )
+        usage(1);
+    domname = argv[optind];
+
+    if ( pipe(save_pipe) || pipe(restore_pipe) || pipe(result_pipe) )
+    {
+        perror("pipe");
+        return 2;
+    }
+    /* a receiver giving up must not take us down with it */
+    signal(SIGPIPE, SIG_IGN);
+
+    /*
+     * Fork before anything else touches libxl: the receiving side gets a
+     * context of its own, as it would in "xl migrate-receive".
+     */
+    child = fork();
+    if ( child < 0 )
+    {
+        perror("fork");
+        return 2;
+    }
+    if ( !child )
+    {
+        close(save_pipe[0]);
+        close(save_pipe[1]);
+        close(restore_pipe[1]);
+        close(result_pipe[0]);
+        _exit(receive(domname, restore_pipe[0], result_pipe[1]));
+    }
+    close(restore_pipe[0]);
+    close(result_pipe[1]);
+
+    lg_buf.inner = (xentoollog_logger *)
+        xtl_createlogger_stdiostream(stderr, XTL_ERROR, 0);
+    if ( !lg_buf.inner )
+        return 2;
+    lg = XTL_NEW_LOGGER(bench, lg_buf);
+    if ( !lg || libxl_ctx_alloc(&ctx, LIBXL_VERSION, 0, &lg->vtable) )
+    {
+        fprintf(stderr, "could not initialise libxl\n");
+        return 2;
+    }
+
+    if ( libxl_domain_qualifier_to_domid(ctx, domname, &domid) )
+    {
+        fprintf(stderr, "%s: no such domain\n", domname);
+        return 2;
+    }
+
+    relay.ctx = ctx;
+    relay.domid = domid;
+    relay.in = save_pipe[0];
+    relay.out = restore_pipe[1];
+    if ( pthread_create(&thread, NULL, relay_thread, &relay) )
+    {
+        perror("pthread_create");
+        return 2;
+    }
+
+    start = now_ns();
+    rc = libxl_domain_suspend_ext(ctx, domid, save_pipe[1], &props, NULL);
+    close(save_pipe[1]);
+    pthread_join(thread, NULL);
+    close(save_pipe[0]);
+
+    if ( read(result_pipe[0], msg, sizeof(msg)) != sizeof(msg) )
+        rc = rc ?: ERROR_FAIL;
+    waitpid(child, &status, 0);
+
+    if ( rc )
+    {
+        fprintf(stderr, "migration of %s failed (%d)\n", domname, rc);
+        libxl_domain_resume(ctx, domid, 1, NULL);
+        return 1;
+    }
+
+    /* The domain lives on in the copy, under its old name. */
+    if ( libxl_domain_destroy(ctx, domid, NULL) ||
+         libxl_domain_rename(ctx, msg[0], NULL, domname) )
+        fprintf(stderr, "could not replace %s by d%"PRIu64"\n", domname, msg[0]);
+
+    if ( header )
+        printf("tag,total_ms,downtime_ms,bytes,iterations\n");
+    printf("%s,%.1f,%.1f,%"PRIu64",%u\n", tag, (msg[1] - start) / 1e6,
+           relay.suspended_ns ? (msg[1] - relay.suspended_ns) / 1e6 : 0,
+           relay.bytes, lg->iterations);
+
+    libxl_ctx_free(ctx);
+    xtl_logger_destroy(lg_buf.inner);
+    free(lg);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
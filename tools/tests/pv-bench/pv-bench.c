@@ -0,0 +1,691 @@
+/*
+ * pv-bench.c
+ *
+ * Microbenchmarks for the paravirtual primitives guests lean on: null
+ * hypercalls, event channel round-trips, grant map/unmap/copy, memory_op
+ * populate/decrease and mmu_update batches. Run from dom0; the memory
+ * and mmu_update benchmarks operate on a (disposable) test guest given
+ * with --domain, the others on dom0 itself.
+ *
+ * Event channels are bound in loopback through dom0, so they use
+ * whichever ABI dom0's kernel picked: compare 2-level to FIFO by booting
+ * it once with xen.fifo_events=0, and telling the runs apart with --tag.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xenctrl.h>
+#include <xencall.h>
+#include <xen/sched.h>
+#include <xenevtchn.h>
+#include <xengnttab.h>
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+#define MAX_BATCHES 16
+#define MAX_POLL_PORTS 128          /* as do_poll() allows */
+
+struct samples {
+    unsigned int nr;
+    uint64_t *ns;
+};
+
+struct bench {
+    const char *name;
+    int (*func)(unsigned int batch);
+    bool batched;               /* run once per --batch size */
+    bool needs_domain;          /* needs a test guest */
+    const char *descr;
+};
+
+static xc_interface *xch;
+static xencall_handle *xcall;
+static int domid = -1;
+static unsigned int iterations = 1000;
+static bool csv;
+static const char *tag = "";
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int samples_init(struct samples *s)
+{
+    s->nr = 0;
+    s->ns = malloc(iterations * sizeof(*s->ns));
+
+    return s->ns ? 0 : -ENOMEM;
+}
+
+static void record(struct samples *s, uint64_t start, uint64_t end)
+{
+    if ( s->nr < iterations )
+        s->ns[s->nr++] = end - start;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    const uint64_t *x = a, *y = b;
+
+    return *x < *y ? -1 : *x > *y;
+}
+
+/* One line per (benchmark, batch size); rates are in batch items. */
+static void report(const char *name, unsigned int batch, struct samples *s)
+{
+    uint64_t sum = 0;
+    double rate;
+    unsigned int i;
+
+    if ( !s->nr )
+        return;
+
+    qsort(s->ns, s->nr, sizeof(*s->ns), cmp_u64);
+    for ( i = 0; i < s->nr; i++ )
+        sum += s->ns[i];
+    rate = sum ? (double)batch * s->nr * 1e9 / sum : 0;
+
+    if ( csv )
+        printf("%s,%s,%u,%u,%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%.0f\n",
+               tag, name, batch, s->nr, s->ns[0], s->ns[s->nr / 2],
+               s->ns[(s->nr * 99ULL) / 100], s->ns[s->nr - 1], rate);
+    else
+        printf("  %-14s %6u %8u %10.2f %10.2f %10.2f %12.0f\n", name, batch,
+               s->nr, s->ns[s->nr / 2] / 1e3,
+               s->ns[(s->nr * 99ULL) / 100] / 1e3, s->ns[s->nr - 1] / 1e3,
+               rate);
+}
+
+static int bench_null(unsigned int batch)
+{
+    struct samples s;
+    uint64_t t;
+    unsigned int i;
+
+    if ( samples_init(&s) )
+        return -ENOMEM;
+
+    for ( i = 0; i < iterations; i++ )
+    {
+        t = now_ns();
+        if ( xencall2(xcall, __HYPERVISOR_xen_version, XENVER_version, 0) < 0 )
+            break;
+        record(&s, t, now_ns());
+    }
+
+    report("null", 1, &s);
+    free(s.ns);
+
+    return i == iterations ? 0 : -errno;
+}
+
+static int bench_evtchn(unsigned int batch)
+{
+    xenevtchn_handle *xa = NULL, *xb = NULL;
+    xenevtchn_port_or_error_t la = -1, lb = -1, p;
+    struct samples s;
+    uint64_t t;
+    unsigned int i;
+    int rc = -1;
+
+    if ( samples_init(&s) )
+        return -ENOMEM;
+
+    xa = xenevtchn_open(NULL, 0);
+    xb = xenevtchn_open(NULL, 0);
+    if ( !xa || !xb )
+        goto out;
+
+    la = xenevtchn_bind_unbound_port(xa, 0);
+    if ( la < 0 )
+        goto out;
+    lb = xenevtchn_bind_interdomain(xb, 0, la);
+    if ( lb < 0 )
+        goto out;
+
+    /* a ping and its pong, each delivered through the kernel's upcall */
+    for ( i = 0; i < iterations; i++ )
+    {
+        t = now_ns();
+        if ( xenevtchn_notify(xa, la) ||
+             (p = xenevtchn_pending(xb)) < 0 || xenevtchn_unmask(xb, p) ||
+             xenevtchn_notify(xb, lb) ||
+             (p = xenevtchn_pending(xa)) < 0 || xenevtchn_unmask(xa, p) )
+            goto out;
+        record(&s, t, now_ns());
+    }
+
+    report("evtchn-rtt", 1, &s);
+    rc = 0;
+
+ out:
+    if ( rc )
+        rc = -errno;
+    if ( lb >= 0 )
+        xenevtchn_unbind(xb, lb);
+    if ( la >= 0 )
+        xenevtchn_unbind(xa, la);
+    if ( xb )
+        xenevtchn_close(xb);
+    if ( xa )
+        xenevtchn_close(xa);
+    free(s.ns);
+
+    return rc;
+}
+
+/*
+ * SCHEDOP_poll on @batch unbound, and so never pending, ports with a
+ * timeout already in the past: every port is checked, then the vCPU
+ * blocks and is woken straight away by the timer.
+ */
+static int bench_poll(unsigned int batch)
+{
+    xenevtchn_handle *xe = NULL;
+    xenevtchn_port_or_error_t *ports = NULL;
+    evtchn_port_t *buf = NULL;
+    struct sched_poll *poll = NULL;
+    struct samples s;
+    unsigned int i, nr = 0;
+    uint64_t t;
+    int rc = -1;
+
+    if ( batch > MAX_POLL_PORTS )
+        return 0;
+
+    if ( samples_init(&s) )
+        return -ENOMEM;
+
+    ports = calloc(batch, sizeof(*ports));
+    poll = xencall_alloc_buffer(xcall, sizeof(*poll));
+    buf = xencall_alloc_buffer(xcall, batch * sizeof(*buf));
+    xe = xenevtchn_open(NULL, 0);
+    if ( !ports || !poll || !buf || !xe )
+        goto out;
+
+    for ( nr = 0; nr < batch; nr++ )
+    {
+        ports[nr] = xenevtchn_bind_unbound_port(xe, 0);
+        if ( ports[nr] < 0 )
+            goto out;
+        buf[nr] = ports[nr];
+    }
+
+    set_xen_guest_handle_raw(poll->ports, buf);
+    poll->nr_ports = batch;
+    poll->timeout = 1;
+
+    for ( i = 0; i < iterations; i++ )
+    {
+        t = now_ns();
+        if ( xencall2(xcall, __HYPERVISOR_sched_op, SCHEDOP_poll,
+                      (unsigned long)poll) < 0 )
+            goto out;
+        record(&s, t, now_ns());
+    }
+
+    report("poll-ports", batch, &s);
+    rc = 0;
+
+ out:
+    if ( rc )
+        rc = -errno;
+    while ( nr-- )
+        xenevtchn_unbind(xe, ports[nr]);
+    if ( xe )
+        xenevtchn_close(xe);
+    if ( buf )
+        xencall_free_buffer(xcall, buf);
+    if ( poll )
+        xencall_free_buffer(xcall, poll);
+    free(ports);
+    free(s.ns);
+
+    return rc;
+}
+
+static int bench_grant(unsigned int batch)
+{
+    xengntshr_handle *xgs = NULL;
+    xengnttab_handle *xgt = NULL;
+    xengnttab_grant_copy_segment_t *segs = NULL;
+    struct samples map = { 0 }, unmap = { 0 }, copy = { 0 };
+    uint32_t *refs = NULL;
+    void *shared = NULL, *addr;
+    char *buf = NULL;
+    uint64_t t0, t1;
+    unsigned int i, j;
+    int rc = -ENOMEM;
+
+    if ( samples_init(&map) || samples_init(&unmap) || samples_init(&copy) )
+        goto out;
+
+    refs = calloc(batch, sizeof(*refs));
+    segs = calloc(batch, sizeof(*segs));
+    buf = malloc((size_t)batch * XC_PAGE_SIZE);
+    if ( !refs || !segs || !buf )
+        goto out;
+
+    xgs = xengntshr_open(NULL, 0);
+    xgt = xengnttab_open(NULL, 0);
+    if ( !xgs || !xgt )
+        goto fail;
+    xengnttab_set_max_grants(xgt, batch);
+
+    /* dom0 grants pages to itself, and maps or copies those */
+    shared = xengntshr_share_pages(xgs, 0, batch, refs, 1);
+    if ( !shared )
+        goto fail;
+
+    for ( i = 0; i < batch; i++ )
+    {
+        segs[i].source.foreign.ref = refs[i];
+        segs[i].source.foreign.domid = 0;
+        segs[i].dest.virt = buf + (size_t)i * XC_PAGE_SIZE;
+        segs[i].len = XC_PAGE_SIZE;
+        segs[i].flags = GNTCOPY_source_gref;
+    }
+
+    for ( i = 0; i < iterations; i++ )
+    {
+        t0 = now_ns();
+        addr = xengnttab_map_domain_grant_refs(xgt, batch, 0, refs,
+                                               PROT_READ | PROT_WRITE);
+        if ( !addr )
+            goto fail;
+        t1 = now_ns();
+        record(&map, t0, t1);
+
+        if ( xengnttab_unmap(xgt, addr, batch) )
+            goto fail;
+        record(&unmap, t1, now_ns());
+
+        t0 = now_ns();
+        if ( xengnttab_grant_copy(xgt, batch, segs) )
+            goto fail;
+        t1 = now_ns();
+        for ( j = 0; j < batch; j++ )
+            if ( segs[j].status != GNTST_okay )
+            {
+                errno = EIO;
+                goto fail;
+            }
+        record(&copy, t0, t1);
+    }
+
+    report("grant-map", batch, &map);
+    report("grant-unmap", batch, &unmap);
+    report("grant-copy", batch, &copy);
+    rc = 0;
+    goto out;
+
+ fail:
+    rc = -errno;
+ out:
+    if ( shared )
+        xengntshr_unshare(xgs, shared, batch);
+    if ( xgt )
+        xengnttab_close(xgt);
+    if ( xgs )
+        xengntshr_close(xgs);
+    free(buf);
+    free(segs);
+    free(refs);
+    free(copy.ns);
+    free(unmap.ns);
+    free(map.ns);
+
+    return rc;
+}
+
+/*
+ * Room for @batch more pages in the test guest, above anything it has
+ * populated, with its old limit in @maxmem_kb to be restored afterwards.
+ */
+static int guest_reserve(unsigned int batch, xen_pfn_t *base,
+                         uint64_t *maxmem_kb, bool *hvm)
+{
+    xc_dominfo_t info;
+    xen_pfn_t max_gpfn;
+
+    if ( xc_domain_getinfo(xch, domid, 1, &info) != 1 ||
+         info.domid != domid )
+        return -ESRCH;
+    if ( xc_domain_maximum_gpfn(xch, domid, &max_gpfn) < 0 )
+        return -errno;
+    if ( xc_domain_setmaxmem(xch, domid, info.max_memkb +
+                             batch * (XC_PAGE_SIZE / 1024)) )
+        return -errno;
+
+    *base = max_gpfn + 1;
+    *maxmem_kb = info.max_memkb;
+    *hvm = info.hvm;
+
+    return 0;
+}
+
+static int bench_memory(unsigned int batch)
+{
+    struct samples pop = { 0 }, dec = { 0 };
+    xen_pfn_t *pfns = NULL, base;
+    uint64_t maxmem_kb, t0, t1;
+    unsigned int i, j;
+    bool hvm;
+    int rc;
+
+    rc = guest_reserve(batch, &base, &maxmem_kb, &hvm);
+    if ( rc )
+        return rc;
+
+    rc = -ENOMEM;
+    pfns = malloc(batch * sizeof(*pfns));
+    if ( !pfns || samples_init(&pop) || samples_init(&dec) )
+        goto out;
+
+    for ( i = 0; i < iterations; i++ )
+    {
+        /* for a PV guest, populate hands back the mfns to release */
+        for ( j = 0; j < batch; j++ )
+            pfns[j] = base + j;
+
+        t0 = now_ns();
+        if ( xc_domain_populate_physmap_exact(xch, domid, batch, 0, 0,
+                                              pfns) )
+            goto fail;
+        t1 = now_ns();
+        record(&pop, t0, t1);
+
+        if ( xc_domain_decrease_reservation_exact(xch, domid, batch, 0,
+                                                  pfns) )
+            goto fail;
+        record(&dec, t1, now_ns());
+    }
+
+    report("populate", batch, &pop);
+    report("decrease", batch, &dec);
+    rc = 0;
+    goto out;
+
+ fail:
+    rc = -errno;
+ out:
+    xc_domain_setmaxmem(xch, domid, maxmem_kb);
+    free(pfns);
+    free(dec.ns);
+    free(pop.ns);
+
+    return rc;
+}
+
+/*
+ * mmu_update on behalf of a PV test guest: machine-to-phys updates of a
+ * batch of pages populated for the purpose, which nothing else uses.
+ */
+static int bench_mmu(unsigned int batch)
+{
+    struct samples s = { 0 };
+    xen_pfn_t *pfns = NULL, base;
+    mmu_update_t *req = NULL;
+    uint64_t maxmem_kb, t;
+    unsigned int i;
+    bool hvm, populated = false;
+    int rc;
+
+    rc = guest_reserve(batch, &base, &maxmem_kb, &hvm);
+    if ( rc )
+        return rc;
+
+    rc = -EOPNOTSUPP;
+    if ( hvm )
+        goto out;
+
+    rc = -ENOMEM;
+    pfns = malloc(batch * sizeof(*pfns));
+    req = xencall_alloc_buffer(xcall, batch * sizeof(*req));
+    if ( !pfns || !req || samples_init(&s) )
+        goto out;
+
+    if ( xc_domain_populate_physmap_exact(xch, domid, batch, 0, 0, pfns) )
+        goto fail;
+    populated = true;
+
+    for ( i = 0; i < batch; i++ )
+    {
+        req[i].ptr = ((uint64_t)pfns[i] << XC_PAGE_SHIFT) |
+                     MMU_MACHPHYS_UPDATE;
+        req[i].val = base + i;
+    }
+
+    for ( i = 0; i < iterations; i++ )
+    {
+        t = now_ns();
+        if ( xencall4(xcall, __HYPERVISOR_mmu_update, (unsigned long)req,
+                      batch, 0, domid) < 0 )
+            goto fail;
+        record(&s, t, now_ns());
+    }
+
+    report("mmu-update", batch, &s);
+    rc = 0;
+    goto out;
+
+ fail:
+    rc = -errno;
+ out:
+    if ( populated )
+        xc_domain_decrease_reservation_exact(xch, domid, batch, 0, pfns);
+    xc_domain_setmaxmem(xch, domid, maxmem_kb);
+    if ( req )
+        xencall_free_buffer(xcall, req);
+    free(pfns);
+    free(s.ns);
+
+    return rc;
+}
+
+static struct bench benches[] = {
+    { "null", bench_null, false, false,
+      "xen_version(XENVER_version) hypercalls" },
+    { "evtchn", bench_evtchn, false, false,
+      "Event channel notify/receive round-trips in dom0" },
+    { "poll", bench_poll, true, false,
+      "SCHEDOP_poll across as many non-pending ports as the batch" },
+    { "grant", bench_grant, true, false,
+      "Grant map, unmap and copy of dom0's own grants" },
+    { "memory", bench_memory, true, true,
+      "populate_physmap and decrease_reservation in the test guest" },
+    { "mmu", bench_mmu, true, true,
+      "mmu_update machphys batches for a PV test guest" },
+};
+
+static void usage(int ret)
+{
+    FILE *out;
+
+    out = ret ? stderr : stdout;
+
+    fprintf(out, "usage: pv-bench [<options>]\n");
+    fprintf(out, "  <options> are:\n");
+    fprintf(out, "  -b|--batch <n>[,<n>...] batch sizes (default 1,8,64,256)\n");
+    fprintf(out, "  -c|--csv                machine-readable output\n");
+    fprintf(out, "  -d|--domain <domid>     test guest for the memory benchmarks\n");
+    fprintf(out, "  -i|--iterations <n>     samples per benchmark (default 1000)\n");
+    fprintf(out, "  -l|--list               list available benchmarks\n");
+    fprintf(out, "  -t|--tag <name>         label the csv lines, e.g. by release\n");
+    fprintf(out, "  -w|--bench <name>       run <name> (default is all benchmarks)\n");
+    fprintf(out, "  -h|--help               print this usage information\n");
+    exit(ret);
+}
+
+static const struct option options[] = {
+    { "batch", required_argument, NULL, 'b' },
+    { "csv", no_argument, NULL, 'c' },
+    { "domain", required_argument, NULL, 'd' },
+    { "iterations", required_argument, NULL, 'i' },
+    { "list", no_argument, NULL, 'l' },
+    { "tag", required_argument, NULL, 't' },
+    { "bench", required_argument, NULL, 'w' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+static unsigned int parse_batches(char *arg, unsigned int *batches)
+{
+    unsigned int nr = 0;
+    char *tok, *end;
+
+    for ( tok = strtok(arg, ","); tok; tok = strtok(NULL, ",") )
+    {
+        if ( nr == MAX_BATCHES )
+            usage(1);
+        batches[nr] = strtoul(tok, &end, 0);
+        if ( *end || !batches[nr] )
+            usage(1);
+        nr++;
+    }
+
+    return nr;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int batches[MAX_BATCHES] = { 1, 8, 64, 256 };
+    unsigned int nr_batches = 4, b, w;
+    const char *bench = NULL;
+    bool list = false;
+    int opt, rc, ret = 0;
+
+    while ( (opt = getopt_long(argc, argv, "b:cd:i:lt:w:h", options,
+                               NULL)) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'b':
+            nr_batches = parse_batches(optarg, batches);
+            break;
+        case 'c':
+            csv = true;
+            break;
+        case 'd':
+            domid = atoi(optarg);
+            break;
+        case 'i':
+            iterations = atoi(optarg);
+            break;
+        case 'l':
+            list = true;
+            break;
+        case 't':
+            tag = optarg;
+            break;
+        case 'w':
+            bench = optarg;
+            break;
+        case 'h':
+            usage(0);
+            break;
+        default:
+            usage(1);
+        }
+    }
+    if ( optind != argc || !iterations || !nr_batches )
+        usage(1);
+
+    if ( list )
+    {
+        for ( w = 0; w < ARRAY_SIZE(benches); w++ )
+            printf("%-8s: %s%s\n", benches[w].name, benches[w].descr,
+                   benches[w].needs_domain ? " (needs --domain)" : "");
+        return 0;
+    }
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    xcall = xencall_open(NULL, 0);
+    if ( !xch || !xcall )
+    {
+        fprintf(stderr, "could not open the hypervisor interfaces\n");
+        exit(2);
+    }
+
+    if ( csv )
+        printf("tag,bench,batch,samples,min_ns,p50_ns,p99_ns,max_ns,"
+               "items_per_s\n");
+    else
+        printf("  %-14s %6s %8s %10s %10s %10s %12s\n", "bench", "batch",
+               "count", "p50 us", "p99 us", "max us", "items/s");
+
+    for ( w = 0; w < ARRAY_SIZE(benches); w++ )
+    {
+        if ( bench && strcmp(bench, benches[w].name) )
+            continue;
+
+        if ( benches[w].needs_domain && domid < 0 )
+        {
+            if ( bench )
+                ret = 1;
+            fprintf(stderr, "%s: skipped, no --domain given\n",
+                    benches[w].name);
+            continue;
+        }
+
+        for ( b = 0; b < (benches[w].batched ? nr_batches : 1); b++ )
+        {
+            rc = benches[w].func(benches[w].batched ? batches[b] : 1);
+            if ( rc == -EOPNOTSUPP )
+            {
+                fprintf(stderr, "%s: not supported for d%d\n",
+                        benches[w].name, domid);
+                break;
+            }
+            if ( rc )
+            {
+                fprintf(stderr, "%s: failed (batch %u): %s\n",
+                        benches[w].name, benches[w].batched ? batches[b] : 1,
+                        strerror(-rc));
+                ret = 1;
+                break;
+            }
+        }
+        fflush(stdout);
+    }
+
+    xencall_close(xcall);
+    xc_interface_close(xch);
+
+    return ret;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
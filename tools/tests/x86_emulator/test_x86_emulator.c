@@ -1,7 +1,9 @@
 #include <errno.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdio.h>
 #include <sys/mman.h>
+#include <time.h>
 
 #include "x86-emulate.h"
 #include "blowfish.h"
@@ -320,6 +322,139 @@ static struct x86_emulate_ops emulops = {
     .put_fpu    = emul_test_put_fpu,
 };
 
+/*
+ * Benchmark mode: instruction mixes as the emulator sees them on its hot
+ * paths, i.e. MMIO accesses, string instructions and SIMD loads/stores,
+ * with memory operands at %eax (%esi/%edi for the string ones).
+ */
+static const struct {
+    const char *mix;
+    const char *name;
+    uint8_t insn[8];
+    unsigned int len;
+    unsigned int reps;
+    bool (*check_cpu)(void);
+} bench_insns[] = {
+    { "mmio", "movl (%eax),%ecx",      { 0x8b, 0x08 }, 2 },
+    { "mmio", "movl %ecx,(%eax)",      { 0x89, 0x08 }, 2 },
+    { "mmio", "movzwl (%eax),%ecx",    { 0x0f, 0xb7, 0x08 }, 3 },
+    { "mmio", "movb %cl,(%eax)",       { 0x88, 0x08 }, 2 },
+    { "mmio", "movl $imm32,(%eax)",    { 0xc7, 0x00, 0x78, 0x56, 0x34, 0x12 }, 6 },
+    { "mmio", "orl %ecx,(%eax)",       { 0x09, 0x08 }, 2 },
+    { "string", "rep movsb (x64)",     { 0xf3, 0xa4 }, 2, 64 },
+    { "string", "rep movsl (x64)",     { 0xf3, 0xa5 }, 2, 64 },
+    { "string", "rep stosl (x64)",     { 0xf3, 0xab }, 2, 64 },
+    { "simd", "movups (%eax),%xmm0",   { 0x0f, 0x10, 0x00 }, 3, 0,
+      simd_check_sse },
+    { "simd", "movaps %xmm0,(%eax)",   { 0x0f, 0x29, 0x00 }, 3, 0,
+      simd_check_sse },
+    { "simd", "movdqu (%eax),%xmm0",   { 0xf3, 0x0f, 0x6f, 0x00 }, 4, 0,
+      simd_check_sse2 },
+    { "simd", "vmovups (%eax),%ymm0",  { 0xc5, 0xfc, 0x10, 0x00 }, 4, 0,
+      simd_check_avx },
+    { "simd", "vmovdqu %ymm0,(%eax)",  { 0xc5, 0xfe, 0x7f, 0x00 }, 4, 0,
+      simd_check_avx },
+};
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Emulate bench_insns[i] @iters times, returning the time taken. */
+static int bench_one(struct x86_emulate_ctxt *ctxt, char *instr,
+                     unsigned int *res, unsigned int i, unsigned int iters,
+                     uint64_t *ns, unsigned long *calls)
+{
+    struct cpu_user_regs *regs = ctxt->regs;
+    uint64_t start;
+    unsigned int n;
+    int rc;
+
+    memcpy(instr, bench_insns[i].insn, bench_insns[i].len);
+    *calls = 0;
+    start = bench_now();
+
+    for ( n = 0; n < iters; n++ )
+    {
+        regs->eflags = 0x200;
+        regs->eip    = (unsigned long)instr;
+        regs->eax    = (unsigned long)res;
+        regs->ecx    = bench_insns[i].reps ?: 0x12345678;
+        regs->esi    = (unsigned long)res + MMAP_SZ / 4;
+        regs->edi    = (unsigned long)res + MMAP_SZ / 2;
+
+        /* rep-prefixed ones may take one call per iteration */
+        do {
+            rc = x86_emulate(ctxt, &emulops);
+            if ( rc != X86EMUL_OKAY )
+                return rc;
+            ++*calls;
+        } while ( regs->eip != (unsigned long)instr + bench_insns[i].len );
+    }
+
+    *ns = bench_now() - start;
+
+    return X86EMUL_OKAY;
+}
+
+/*
+ * This file gets built without SSE (see x86-emulate.h), so keep clear of
+ * floating point: times are printed in tenths of nanoseconds.
+ */
+static int bench(struct x86_emulate_ctxt *ctxt, char *instr,
+                 unsigned int *res, unsigned int iters)
+{
+    unsigned int i, mix_nr = 0;
+    unsigned long calls;
+    uint64_t ns, tenths, mix_tenths = 0;
+    int rc;
+
+    printf("%-8s %-24s %12s %12s\n", "mix", "instruction", "ns/insn",
+           "calls/insn");
+
+    for ( i = 0; i < ARRAY_SIZE(bench_insns); i++ )
+    {
+        if ( bench_insns[i].check_cpu && !bench_insns[i].check_cpu() )
+            printf("%-8s %-24s %12s\n", bench_insns[i].mix,
+                   bench_insns[i].name, "skipped");
+        else
+        {
+            rc = bench_one(ctxt, instr, res, i, iters, &ns, &calls);
+            if ( rc != X86EMUL_OKAY )
+            {
+                printf("%s: failed (rc %d)\n", bench_insns[i].name, rc);
+                return 1;
+            }
+
+            tenths = ns * 10 / iters;
+            printf("%-8s %-24s %10"PRIu64".%"PRIu64" %10lu.%lu\n",
+                   bench_insns[i].mix, bench_insns[i].name,
+                   tenths / 10, tenths % 10, calls / iters,
+                   calls * 10 / iters % 10);
+            mix_tenths += tenths;
+            mix_nr++;
+        }
+
+        if ( i + 1 == ARRAY_SIZE(bench_insns) ||
+             strcmp(bench_insns[i + 1].mix, bench_insns[i].mix) )
+        {
+            if ( mix_nr )
+                printf("%-8s %-24s %10"PRIu64".%"PRIu64"\n",
+                       bench_insns[i].mix, "(mean)",
+                       mix_tenths / mix_nr / 10, mix_tenths / mix_nr % 10);
+            mix_tenths = 0;
+            mix_nr = 0;
+        }
+    }
+
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     struct x86_emulate_ctxt ctxt;
@@ -356,6 +491,10 @@ int main(int argc, char **argv)
     if ( !stack_exec )
         printf("Warning: Stack could not be made executable (%d).\n", errno);
 
+    if ( argc > 1 && !strcmp(argv[1], "--bench") )
+        return bench(&ctxt, instr, res,
+                     argc > 2 ? strtoul(argv[2], NULL, 0) : 100000);
+
     printf("%-40s", "Testing addl %ecx,(%eax)...");
     instr[0] = 0x01; instr[1] = 0x08;
     regs.eflags = 0x200;
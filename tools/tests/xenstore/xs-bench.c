@@ -0,0 +1,665 @@
+/*
+ * xs-bench.c
+ *
+ * Xenstore load generator: replay the access patterns of domain creation
+ * and destruction, of backends handling device state changes, and of
+ * large transactions for a number of simulated domains, and report the
+ * latencies per request type.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <xenstore.h>
+
+#define BENCH_PATH "xenstore-bench"
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+#define MAX_TA_LOOPS 100
+
+/* Number of devices of each type per simulated domain. */
+#define DEVICES 4
+
+enum op {
+    OP_READ,
+    OP_WRITE,
+    OP_MKDIR,
+    OP_RM,
+    OP_DIRECTORY,
+    OP_SET_PERMS,
+    OP_TA_START,
+    OP_TA_END,
+    OP_WATCH,
+    OP_WATCH_EVENT,
+    OP_NR
+};
+
+static const char *op_names[OP_NR] = {
+    [OP_READ]        = "read",
+    [OP_WRITE]       = "write",
+    [OP_MKDIR]       = "mkdir",
+    [OP_RM]          = "rm",
+    [OP_DIRECTORY]   = "directory",
+    [OP_SET_PERMS]   = "set_perms",
+    [OP_TA_START]    = "ta_start",
+    [OP_TA_END]      = "ta_end",
+    [OP_WATCH]       = "watch",
+    [OP_WATCH_EVENT] = "watch_event",
+};
+
+struct samples {
+    uint64_t *ns;
+    unsigned int nr, max;
+};
+
+struct workload {
+    char *name;
+    int (*func)(unsigned int round);
+    char *descr;
+};
+
+static struct samples samples[OP_NR];
+static struct xs_handle *xsh;
+static char *path;
+static unsigned int domains = 16;
+static unsigned int ta_conflicts, ta_loops;
+
+static struct option options[] = {
+    { "domains", 1, NULL, 'd' },
+    { "list-workloads", 0, NULL, 'l' },
+    { "rounds", 1, NULL, 'r' },
+    { "workload", 1, NULL, 'w' },
+    { "help", 0, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+
+    return tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+static void record(enum op op, uint64_t start)
+{
+    struct samples *s = samples + op;
+    uint64_t *ns;
+
+    if ( s->nr == s->max )
+    {
+        ns = realloc(s->ns, (s->max * 2 + 1024) * sizeof(*ns));
+        if ( !ns )
+            return;
+        s->ns = ns;
+        s->max = s->max * 2 + 1024;
+    }
+
+    s->ns[s->nr++] = now_ns() - start;
+}
+
+/* Path below our base directory, valid until the next call. */
+static char *node(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static char *node(const char *fmt, ...)
+{
+    static char buf[XENSTORE_ABS_PATH_MAX];
+    va_list ap;
+    int len;
+
+    len = snprintf(buf, sizeof(buf), "%s/", path);
+    va_start(ap, fmt);
+    vsnprintf(buf + len, sizeof(buf) - len, fmt, ap);
+    va_end(ap);
+
+    return buf;
+}
+
+/* Timed wrappers of the libxenstore calls. */
+static bool b_write(xs_transaction_t t, const char *p, const char *val)
+{
+    uint64_t start = now_ns();
+    bool ret = xs_write(xsh, t, p, val, strlen(val));
+
+    record(OP_WRITE, start);
+    return ret;
+}
+
+static char *b_read(xs_transaction_t t, const char *p)
+{
+    uint64_t start = now_ns();
+    unsigned int len;
+    char *ret = xs_read(xsh, t, p, &len);
+
+    record(OP_READ, start);
+    return ret;
+}
+
+static bool b_mkdir(xs_transaction_t t, const char *p)
+{
+    uint64_t start = now_ns();
+    bool ret = xs_mkdir(xsh, t, p);
+
+    record(OP_MKDIR, start);
+    return ret;
+}
+
+static bool b_rm(xs_transaction_t t, const char *p)
+{
+    uint64_t start = now_ns();
+    bool ret = xs_rm(xsh, t, p);
+
+    record(OP_RM, start);
+    return ret;
+}
+
+static char **b_directory(xs_transaction_t t, const char *p,
+                          unsigned int *num)
+{
+    uint64_t start = now_ns();
+    char **ret = xs_directory(xsh, t, p, num);
+
+    record(OP_DIRECTORY, start);
+    return ret;
+}
+
+static bool b_set_perms(xs_transaction_t t, const char *p, unsigned int domid)
+{
+    struct xs_permissions perms[2] = {
+        { .id = 0, .perms = XS_PERM_NONE },
+        { .id = domid, .perms = XS_PERM_READ },
+    };
+    uint64_t start = now_ns();
+    bool ret = xs_set_permissions(xsh, t, p, perms, 2);
+
+    record(OP_SET_PERMS, start);
+    return ret;
+}
+
+static xs_transaction_t b_ta_start(void)
+{
+    uint64_t start = now_ns();
+    xs_transaction_t t = xs_transaction_start(xsh);
+
+    record(OP_TA_START, start);
+    return t;
+}
+
+static bool b_ta_end(xs_transaction_t t, bool abort)
+{
+    uint64_t start = now_ns();
+    bool ret = xs_transaction_end(xsh, t, abort);
+
+    record(OP_TA_END, start);
+    if ( !ret && errno == EAGAIN )
+        ta_conflicts++;
+    return ret;
+}
+
+/* Do fn in a transaction, retrying on conflicts like the toolstack. */
+static int in_transaction(int (*fn)(xs_transaction_t t, unsigned int domid),
+                          unsigned int domid)
+{
+    xs_transaction_t t;
+    int loops, ret;
+
+    for ( loops = 0; loops < MAX_TA_LOOPS; loops++ )
+    {
+        t = b_ta_start();
+        if ( t == XBT_NULL )
+            return errno;
+        ret = fn(t, domid);
+        if ( ret )
+        {
+            b_ta_end(t, true);
+            return ret;
+        }
+        if ( b_ta_end(t, false) )
+            return 0;
+        if ( errno != EAGAIN )
+            return errno;
+    }
+
+    ta_loops++;
+    return EAGAIN;
+}
+
+/* What the toolstack writes when creating a domain with its devices. */
+static int create_domain(xs_transaction_t t, unsigned int domid)
+{
+    static const char *vbd_keys[] = {
+        "frontend-id", "online", "removable", "bootable", "state",
+        "dev", "type", "mode", "device-type", "discard-enable", "params",
+    };
+    static const char *vif_keys[] = {
+        "frontend-id", "online", "state", "script", "mac", "bridge",
+        "handle", "type",
+    };
+    const char *fe, *be;
+    unsigned int i, k;
+
+    if ( !b_mkdir(t, node("local/domain/%u", domid)) ||
+         !b_set_perms(t, node("local/domain/%u", domid), domid) ||
+         !b_write(t, node("local/domain/%u/name", domid), "guest") ||
+         !b_write(t, node("local/domain/%u/vm", domid), "/vm/uuid") ||
+         !b_write(t, node("local/domain/%u/memory/target", domid),
+                  "1048576") ||
+         !b_write(t, node("local/domain/%u/memory/static-max", domid),
+                  "1048576") ||
+         !b_mkdir(t, node("local/domain/%u/control/shutdown", domid)) ||
+         !b_set_perms(t, node("local/domain/%u/control/shutdown", domid),
+                      domid) ||
+         !b_write(t, node("local/domain/%u/control/platform-feature-multiprocessor-suspend",
+                          domid), "1") )
+        return errno;
+
+    for ( i = 0; i < DEVICES; i++ )
+    {
+        for ( k = 0; k < ARRAY_SIZE(vbd_keys); k++ )
+        {
+            be = node("backend/vbd/%u/%u/%s", domid, 51712 + i * 16,
+                      vbd_keys[k]);
+            if ( !b_write(t, be, "1") )
+                return errno;
+        }
+        fe = node("local/domain/%u/device/vbd/%u/state", domid,
+                  51712 + i * 16);
+        if ( !b_write(t, fe, "1") )
+            return errno;
+
+        for ( k = 0; k < ARRAY_SIZE(vif_keys); k++ )
+        {
+            be = node("backend/vif/%u/%u/%s", domid, i, vif_keys[k]);
+            if ( !b_write(t, be, "1") )
+                return errno;
+        }
+        fe = node("local/domain/%u/device/vif/%u/state", domid, i);
+        if ( !b_write(t, fe, "1") )
+            return errno;
+    }
+
+    return 0;
+}
+
+static int destroy_domain(xs_transaction_t t, unsigned int domid)
+{
+    if ( !b_rm(t, node("backend/vbd/%u", domid)) ||
+         !b_rm(t, node("backend/vif/%u", domid)) ||
+         !b_rm(t, node("local/domain/%u", domid)) )
+        return errno;
+
+    return 0;
+}
+
+static int work_domains(unsigned int round)
+{
+    unsigned int domid;
+    int ret;
+
+    for ( domid = 1; domid <= domains; domid++ )
+    {
+        ret = in_transaction(create_domain, domid);
+        if ( ret )
+            return ret;
+    }
+
+    for ( domid = 1; domid <= domains; domid++ )
+    {
+        ret = in_transaction(destroy_domain, domid);
+        if ( ret )
+            return ret;
+    }
+
+    return 0;
+}
+
+/*
+ * A backend watching all its devices: each frontend state change causes
+ * an event, upon which the backend reads the state and the device
+ * directory and writes its own state.
+ */
+static int work_backend(unsigned int round)
+{
+    struct xs_handle *wh;
+    char **vec, **dir;
+    unsigned int domid, i, num, state;
+    uint64_t start;
+    int ret = 0;
+
+    for ( domid = 1; domid <= domains && !ret; domid++ )
+        ret = in_transaction(create_domain, domid);
+    if ( ret )
+        return ret;
+
+    wh = xs_open(0);
+    if ( !wh )
+        return errno;
+
+    start = now_ns();
+    if ( !xs_watch(wh, node("local/domain"), "bench") )
+    {
+        ret = errno;
+        goto out;
+    }
+    record(OP_WATCH, start);
+
+    /* Initial event of the new watch. */
+    vec = xs_read_watch(wh, &num);
+    free(vec);
+
+    for ( state = 2; state <= 4; state++ )
+        for ( domid = 1; domid <= domains; domid++ )
+            for ( i = 0; i < DEVICES; i++ )
+            {
+                char val[4];
+                char *p, *fe = strdup(node("local/domain/%u/device/vbd/%u/state",
+                                           domid, 51712 + i * 16));
+
+                snprintf(val, sizeof(val), "%u", state);
+                start = now_ns();
+                if ( !fe || !b_write(XBT_NULL, fe, val) )
+                {
+                    ret = errno;
+                    free(fe);
+                    goto out;
+                }
+                vec = xs_read_watch(wh, &num);
+                record(OP_WATCH_EVENT, start);
+                free(vec);
+                free(fe);
+
+                p = b_read(XBT_NULL, node("local/domain/%u/device/vbd/%u/state",
+                                          domid, 51712 + i * 16));
+                free(p);
+                dir = b_directory(XBT_NULL,
+                                  node("backend/vbd/%u/%u", domid,
+                                       51712 + i * 16), &num);
+                free(dir);
+                if ( !b_write(XBT_NULL, node("backend/vbd/%u/%u/state",
+                                             domid, 51712 + i * 16), val) )
+                {
+                    ret = errno;
+                    goto out;
+                }
+            }
+
+ out:
+    xs_unwatch(wh, node("local/domain"), "bench");
+    xs_close(wh);
+
+    for ( domid = 1; domid <= domains; domid++ )
+        in_transaction(destroy_domain, domid);
+
+    return ret;
+}
+
+/*
+ * Large transactions, as done for device hotplug: each one reads and
+ * rewrites all devices of a domain.  Transactions for several domains are
+ * kept open at the same time, in order to measure conflict handling.
+ */
+static int work_transactions(unsigned int round)
+{
+    struct xs_handle *main_xsh = xsh, **hs;
+    xs_transaction_t *ts;
+    unsigned int domid, i, k;
+    char *p, val[16];
+    int ret = 0;
+
+    for ( domid = 1; domid <= domains && !ret; domid++ )
+        ret = in_transaction(create_domain, domid);
+    if ( ret )
+        return ret;
+
+    hs = calloc(domains, sizeof(*hs));
+    ts = calloc(domains, sizeof(*ts));
+    if ( !hs || !ts )
+    {
+        ret = ENOMEM;
+        goto out;
+    }
+
+    for ( domid = 1; domid <= domains; domid++ )
+    {
+        hs[domid - 1] = xs_open(0);
+        if ( !hs[domid - 1] )
+        {
+            ret = errno;
+            goto out;
+        }
+        xsh = hs[domid - 1];
+        ts[domid - 1] = b_ta_start();
+        if ( ts[domid - 1] == XBT_NULL )
+        {
+            ret = errno;
+            goto out;
+        }
+    }
+
+    /* Interleave the transactions' accesses. */
+    snprintf(val, sizeof(val), "%u", round);
+    for ( i = 0; i < DEVICES; i++ )
+        for ( domid = 1; domid <= domains; domid++ )
+        {
+            xsh = hs[domid - 1];
+            for ( k = 0; k < 8; k++ )
+            {
+                p = b_read(ts[domid - 1],
+                           node("backend/vbd/%u/%u/state", domid,
+                                51712 + i * 16));
+                free(p);
+                if ( !b_write(ts[domid - 1],
+                              node("backend/vbd/%u/%u/key-%u", domid,
+                                   51712 + i * 16, k), val) )
+                {
+                    ret = errno;
+                    goto out;
+                }
+            }
+            /* Hotplug of a new device below the shared backend dir. */
+            if ( !b_write(ts[domid - 1],
+                          node("backend/vbd/%u/%u/state", domid,
+                               51712 + (DEVICES + round) * 16), "1") )
+            {
+                ret = errno;
+                goto out;
+            }
+        }
+
+    for ( domid = 1; domid <= domains; domid++ )
+    {
+        xsh = hs[domid - 1];
+        b_ta_end(ts[domid - 1], false);
+        ts[domid - 1] = XBT_NULL;
+    }
+
+ out:
+    for ( domid = 1; hs && domid <= domains; domid++ )
+    {
+        xsh = hs[domid - 1];
+        if ( ts && ts[domid - 1] != XBT_NULL )
+            xs_transaction_end(xsh, ts[domid - 1], true);
+        if ( xsh )
+            xs_close(xsh);
+    }
+    free(hs);
+    free(ts);
+    xsh = main_xsh;
+
+    for ( domid = 1; domid <= domains; domid++ )
+        in_transaction(destroy_domain, domid);
+
+    return ret;
+}
+
+static struct workload workloads[] = {
+    { "domains", work_domains,
+      "Create and destroy domains with devices in transactions" },
+    { "backend", work_backend,
+      "Device state changes handled by a backend watching them" },
+    { "transactions", work_transactions,
+      "Concurrent large transactions on the domains' devices" },
+};
+
+static int cmp_u64(const void *a, const void *b)
+{
+    const uint64_t *x = a, *y = b;
+
+    return *x < *y ? -1 : *x > *y;
+}
+
+static void report(const char *name, uint64_t ns)
+{
+    unsigned int op, i, nr = 0;
+    uint64_t sum;
+    struct samples *s;
+
+    printf("%s: %.3f s\n", name, ns / 1e9);
+    printf("  %-12s %10s %10s %10s %12s\n", "type", "count", "p50 us",
+           "p99 us", "ops/s");
+
+    for ( op = 0; op < OP_NR; op++ )
+    {
+        s = samples + op;
+        if ( !s->nr )
+            continue;
+        nr += s->nr;
+
+        qsort(s->ns, s->nr, sizeof(*s->ns), cmp_u64);
+        for ( sum = 0, i = 0; i < s->nr; i++ )
+            sum += s->ns[i];
+
+        printf("  %-12s %10u %10.1f %10.1f %12.0f\n", op_names[op], s->nr,
+               s->ns[s->nr / 2] / 1e3, s->ns[(s->nr * 99ULL) / 100] / 1e3,
+               sum ? s->nr * 1e9 / sum : 0);
+        s->nr = 0;
+    }
+
+    printf("  %-12s %10u %32.0f\n", "total", nr, ns ? nr * 1e9 / ns : 0);
+    if ( ta_conflicts )
+        printf("  transaction conflicts: %u\n", ta_conflicts);
+    ta_conflicts = 0;
+}
+
+static void usage(int ret)
+{
+    FILE *out;
+
+    out = ret ? stderr : stdout;
+
+    fprintf(out, "usage: xs-bench [<options>]\n");
+    fprintf(out, "  <options> are:\n");
+    fprintf(out, "  -d|--domains <n>       simulate <n> domains (default 16)\n");
+    fprintf(out, "  -l|--list-workloads    list available workloads\n");
+    fprintf(out, "  -r|--rounds <n>        run each workload <n> times (default 10)\n");
+    fprintf(out, "  -w|--workload <name>   run <name> (default is all workloads)\n");
+    fprintf(out, "  -h|--help              print this usage information\n");
+    exit(ret);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, w, ret = 0;
+    unsigned int r, rounds = 10;
+    char *workload = NULL;
+    bool list = false;
+    uint64_t start;
+
+    while ( (opt = getopt_long(argc, argv, "d:lr:w:h", options,
+                               NULL)) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'd':
+            domains = atoi(optarg);
+            break;
+        case 'l':
+            list = true;
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 'w':
+            workload = optarg;
+            break;
+        case 'h':
+            usage(0);
+            break;
+        default:
+            usage(1);
+        }
+    }
+    if ( optind != argc || !domains )
+        usage(1);
+
+    if ( list )
+    {
+        for ( w = 0; w < ARRAY_SIZE(workloads); w++ )
+            printf("%-12s: %s\n", workloads[w].name, workloads[w].descr);
+        return 0;
+    }
+
+    if ( asprintf(&path, "%s/%u", BENCH_PATH, getpid()) < 0 )
+        return 2;
+
+    xsh = xs_open(0);
+    if ( !xsh )
+    {
+        fprintf(stderr, "could not connect to xenstore\n");
+        exit(2);
+    }
+
+    for ( w = 0; w < ARRAY_SIZE(workloads); w++ )
+    {
+        if ( workload && strcmp(workload, workloads[w].name) )
+            continue;
+
+        start = now_ns();
+        for ( r = 0; r < rounds && !ret; r++ )
+            ret = workloads[w].func(r);
+        if ( ret )
+        {
+            printf("%s: failed (ret = %d, round %u)\n", workloads[w].name,
+                   ret, r - 1);
+            break;
+        }
+        report(workloads[w].name, now_ns() - start);
+    }
+
+    xs_rm(xsh, XBT_NULL, path);
+    xs_close(xsh);
+
+    if ( ta_loops )
+        printf("Exhaustive transaction retries (%d) occurrred %u times.\n",
+               MAX_TA_LOOPS, ta_loops);
+
+    return ret ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -22,20 +22,18 @@
 #include <unistd.h>
 #include <xc_private.h>
 
-static int file_op(int fd, void *page, int i,
-                   ssize_t (*fn)(int, void *, size_t))
+/* Transfer nr pages between page and slots i .. i + nr - 1 of the file,
+ * with one positioned syscall for the common case. */
+static int file_op(int fd, void *page, int i, int nr,
+                   ssize_t (*fn)(int, void *, size_t, off_t))
 {
-    off_t offset = i;
-    int total = 0;
-    int bytes;
+    off_t offset = (off_t)i << PAGE_SHIFT;
+    size_t total = 0, size = (size_t)nr << PAGE_SHIFT;
+    ssize_t bytes;
 
-    offset = lseek(fd, offset << PAGE_SHIFT, SEEK_SET);
-    if ( offset == (off_t)-1 )
-        return -1;
-
-    while ( total < PAGE_SIZE )
+    while ( total < size )
     {
-        bytes = fn(fd, page + total, PAGE_SIZE - total);
+        bytes = fn(fd, page + total, size - total, offset + total);
         if ( bytes <= 0 )
             return -1;
 
@@ -45,19 +43,29 @@ static int file_op(int fd, void *page, int i,
     return 0;
 }
 
-static ssize_t my_write(int fd, void *buf, size_t count)
+static ssize_t my_pwrite(int fd, void *buf, size_t count, off_t offset)
 {
-    return write(fd, buf, count);
+    return pwrite(fd, buf, count, offset);
 }
 
 int read_page(int fd, void *page, int i)
 {
-    return file_op(fd, page, i, &read);
+    return file_op(fd, page, i, 1, &pread);
 }
 
 int write_page(int fd, void *page, int i)
 {
-    return file_op(fd, page, i, &my_write);
+    return file_op(fd, page, i, 1, &my_pwrite);
+}
+
+int read_pages(int fd, void *pages, int i, int nr)
+{
+    return file_op(fd, pages, i, nr, &pread);
+}
+
+int write_pages(int fd, void *pages, int i, int nr)
+{
+    return file_op(fd, pages, i, nr, &my_pwrite);
 }
 
 
@@ -26,6 +26,9 @@
 
 int read_page(int fd, void *page, int i);
 int write_page(int fd, void *page, int i);
+/* nr contiguous pages to or from nr consecutive slots starting at i */
+int read_pages(int fd, void *pages, int i, int nr);
+int write_pages(int fd, void *pages, int i, int nr);
 
 
 #endif
@@ -33,6 +33,8 @@ void policy_notify_paged_out(unsigned long gfn);
 void policy_notify_paged_in(unsigned long gfn);
 void policy_notify_paged_in_nomru(unsigned long gfn);
 void policy_notify_dropped(unsigned long gfn);
+void policy_notify_prefetched(unsigned long gfn);
+void policy_notify_referenced(unsigned long gfn);
 
 #endif // __XEN_PAGING_POLICY_H__
 
@@ -31,6 +31,9 @@ static unsigned int i_mru;
 static unsigned int mru_size;
 static unsigned long *bitmap;
 static unsigned long *unconsumed;
+/* CLOCK reference bits: set when a gfn is seen to be in use, cleared
+ * (instead of evicting) when the hand passes over it. */
+static unsigned long *referenced;
 static unsigned int unconsumed_cleared;
 static unsigned long current_gfn;
 static unsigned long max_pages;
@@ -51,6 +54,9 @@ int policy_init(struct xenpaging *paging)
     unconsumed = bitmap_alloc(max_pages);
     if ( !unconsumed )
         goto out;
+    referenced = bitmap_alloc(max_pages);
+    if ( !referenced )
+        goto out;
 
     /* Initialise MRU list of paged in pages */
     if ( paging->policy_mru_size > 0 )
@@ -110,6 +116,10 @@ unsigned long policy_choose_victim(struct xenpaging *paging)
         if ( test_bit(current_gfn, unconsumed) )
             continue;
 
+        /* gfn used recently: second chance */
+        if ( test_and_clear_bit(current_gfn, referenced) )
+            continue;
+
         /* gfn found */
         break;
     }
@@ -146,6 +156,9 @@ static void policy_handle_paged_in(unsigned long gfn, int do_mru)
 {
     unsigned long old_gfn = mru[i_mru & (mru_size - 1)];
 
+    /* The guest faulted on it, so it is part of the working set. */
+    set_bit(gfn, referenced);
+
     if ( old_gfn != INVALID_MFN )
         clear_bit(old_gfn, bitmap);
     
@@ -169,6 +182,17 @@ void policy_notify_paged_in_nomru(unsigned long gfn)
     policy_handle_paged_in(gfn, 0);
 }
 
+void policy_notify_prefetched(unsigned long gfn)
+{
+    /* Paged in ahead of use: evictable again, without a second chance. */
+    clear_bit(gfn, bitmap);
+}
+
+void policy_notify_referenced(unsigned long gfn)
+{
+    set_bit(gfn, referenced);
+}
+
 void policy_notify_dropped(unsigned long gfn)
 {
     clear_bit(gfn, bitmap);
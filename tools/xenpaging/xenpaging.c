@@ -178,17 +178,17 @@ static int xenpaging_get_tot_pages(struct xenpaging *paging)
     return domain_info.tot_pages;
 }
 
-static void *init_page(void)
+static void *init_pages(unsigned int nr)
 {
     void *buffer;
 
     /* Allocated page memory */
-    errno = posix_memalign(&buffer, PAGE_SIZE, PAGE_SIZE);
+    errno = posix_memalign(&buffer, PAGE_SIZE, (size_t)nr << PAGE_SHIFT);
     if ( errno != 0 )
         return NULL;
 
     /* Lock buffer in memory so it can't be paged out */
-    if ( mlock(buffer, PAGE_SIZE) < 0 )
+    if ( mlock(buffer, (size_t)nr << PAGE_SHIFT) < 0 )
     {
         free(buffer);
         buffer = NULL;
@@ -466,13 +466,20 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
         goto err;
     }
 
-    paging->paging_buffer = init_page();
+    paging->paging_buffer = init_pages(1);
     if ( !paging->paging_buffer )
     {
         PERROR("Creating page aligned load buffer");
         goto err;
     }
 
+    paging->prefetch_buffer = init_pages(XENPAGING_PREFETCH_MAX);
+    if ( !paging->prefetch_buffer )
+    {
+        PERROR("Creating page aligned prefetch buffer");
+        goto err;
+    }
+
     /* Open file */
     paging->fd = open(filename, O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR);
     if ( paging->fd < 0 )
@@ -495,6 +502,12 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
             munlock(paging->paging_buffer, PAGE_SIZE);
             free(paging->paging_buffer);
         }
+        if ( paging->prefetch_buffer )
+        {
+            munlock(paging->prefetch_buffer,
+                    XENPAGING_PREFETCH_MAX << PAGE_SHIFT);
+            free(paging->prefetch_buffer);
+        }
 
         if ( paging->vm_event.ring_page )
         {
@@ -587,83 +600,150 @@ static void put_response(struct vm_event *vm_event, vm_event_response_t *rsp)
     RING_PUSH_RESPONSES(back_ring);
 }
 
-/* Evict a given gfn
+/* Evict up to nr victims into the given slots, the first from_stack of
+ * which were taken from the free slot stack.  Victims are nominated
+ * first, then mapped with one call and written out with one write per run
+ * of consecutive slots, and only then evicted.
  * Returns < 0 on fatal error
- * Returns 0 on successful evict
- * Returns > 0 if gfn can not be evicted
+ * Returns the number of pages evicted otherwise, which is less than nr
+ * if no more gfns can be evicted
  */
-static int xenpaging_evict_page(struct xenpaging *paging, unsigned long gfn, int slot)
+static int evict_victims(struct xenpaging *paging, int *slots, int nr,
+                         int from_stack)
 {
     xc_interface *xch = paging->xc_handle;
-    void *page;
-    xen_pfn_t victim = gfn;
-    int ret;
-
-    DECLARE_DOMCTL;
+    static int num_paged_out;
+    xen_pfn_t gfns[XENPAGING_EVICT_BATCH];
+    int err[XENPAGING_EVICT_BATCH];
+    bool used[XENPAGING_EVICT_BATCH] = { false };
+    unsigned long gfn;
+    char *pages = NULL;
+    int i, j, nr_gfns = 0, num = 0, ret;
 
-    /* Nominate page */
-    ret = xc_mem_paging_nominate(xch, paging->vm_event.domain_id, gfn);
-    if ( ret < 0 )
+    /* Choose and nominate victims */
+    while ( nr_gfns < nr )
     {
-        /* unpageable gfn is indicated by EBUSY */
-        if ( errno == EBUSY )
-            ret = 1;
-        else
+        gfn = policy_choose_victim(paging);
+        if ( gfn == INVALID_MFN )
+        {
+            /* If the number did not change after last flush command then
+             * the command did not reach qemu yet, or qemu still processes
+             * the command, or qemu has nothing to release.
+             * Right now there is no need to issue the command again.
+             */
+            if ( num_paged_out != paging->num_paged_out )
+            {
+                DPRINTF("Flushing qemu cache\n");
+                xenpaging_mem_paging_flush_ioemu_cache(paging);
+                num_paged_out = paging->num_paged_out;
+            }
+            break;
+        }
+
+        if ( interrupted )
+            break;
+
+        ret = xc_mem_paging_nominate(xch, paging->vm_event.domain_id, gfn);
+        if ( ret < 0 )
+        {
+            /* unpageable gfn is indicated by EBUSY */
+            if ( errno == EBUSY )
+                continue;
             PERROR("Error nominating page %lx", gfn);
-        goto out;
+            num = -1;
+            goto out;
+        }
+
+        gfns[nr_gfns++] = gfn;
     }
 
-    /* Map page */
-    page = xc_map_foreign_pages(xch, paging->vm_event.domain_id, PROT_READ, &victim, 1);
-    if ( page == NULL )
+    if ( !nr_gfns )
+        goto out;
+
+    /* Map pages */
+    pages = xc_map_foreign_bulk(xch, paging->vm_event.domain_id, PROT_READ,
+                                gfns, err, nr_gfns);
+    if ( pages == NULL )
     {
-        PERROR("Error mapping page %lx", gfn);
-        ret = -1;
+        PERROR("Error mapping %d pages", nr_gfns);
+        num = -1;
         goto out;
     }
 
-    /* Copy page */
-    ret = write_page(paging->fd, page, slot);
-    if ( ret < 0 )
+    /* Copy pages */
+    for ( i = 0; i < nr_gfns; i = j )
     {
-        PERROR("Error copying page %lx", gfn);
-        munmap(page, PAGE_SIZE);
-        ret = -1;
-        goto out;
+        for ( j = i + 1; j < nr_gfns && slots[j] == slots[j - 1] + 1 &&
+                         !err[j] == !err[i]; j++ )
+            ;
+
+        if ( err[i] )
+            continue;
+
+        if ( write_pages(paging->fd, pages + ((size_t)i << PAGE_SHIFT),
+                         slots[i], j - i) < 0 )
+        {
+            PERROR("Error copying pages %lx-%lx", (unsigned long)gfns[i],
+                   (unsigned long)gfns[j - 1]);
+            num = -1;
+            goto out;
+        }
     }
 
-    /* Release page */
-    munmap(page, PAGE_SIZE);
+    /* Release pages */
+    munmap(pages, (size_t)nr_gfns << PAGE_SHIFT);
+    pages = NULL;
 
-    /* Tell Xen to evict page */
-    ret = xc_mem_paging_evict(xch, paging->vm_event.domain_id, gfn);
-    if ( ret < 0 )
+    /* Tell Xen to evict pages */
+    for ( i = 0; i < nr_gfns; i++ )
     {
-        /* A gfn in use is indicated by EBUSY */
-        if ( errno == EBUSY )
+        if ( err[i] )
+            continue;
+
+        ret = xc_mem_paging_evict(xch, paging->vm_event.domain_id, gfns[i]);
+        if ( ret < 0 )
         {
-                ret = 1;
-                DPRINTF("Nominated page %lx busy", gfn);
-        } else
-            PERROR("Error evicting page %lx", gfn);
-        goto out;
-    }
+            /* A gfn in use is indicated by EBUSY */
+            if ( errno == EBUSY )
+            {
+                DPRINTF("Nominated page %lx busy", (unsigned long)gfns[i]);
+                policy_notify_referenced(gfns[i]);
+                continue;
+            }
+            PERROR("Error evicting page %lx", (unsigned long)gfns[i]);
+            num = -1;
+            goto out;
+        }
+
+        DPRINTF("evict_page > gfn %lx pageslot %d\n",
+                (unsigned long)gfns[i], slots[i]);
+        /* Notify policy of page being paged out */
+        policy_notify_paged_out(gfns[i]);
 
-    DPRINTF("evict_page > gfn %lx pageslot %d\n", gfn, slot);
-    /* Notify policy of page being paged out */
-    policy_notify_paged_out(gfn);
+        /* Update index */
+        paging->slot_to_gfn[slots[i]] = gfns[i];
+        paging->gfn_to_slot[gfns[i]] = slots[i];
 
-    /* Update index */
-    paging->slot_to_gfn[slot] = gfn;
-    paging->gfn_to_slot[gfn] = slot;
+        /* Record number of evicted pages */
+        paging->num_paged_out++;
 
-    /* Record number of evicted pages */
-    paging->num_paged_out++;
+        if ( test_and_set_bit(gfns[i], paging->bitmap) )
+            ERROR("Page %lx has been evicted before", (unsigned long)gfns[i]);
 
-    ret = 0;
+        used[i] = true;
+        num++;
+    }
 
  out:
-    return ret;
+    if ( pages )
+        munmap(pages, (size_t)nr_gfns << PAGE_SHIFT);
+
+    /* Give back the free slots we did not need */
+    for ( i = 0; i < from_stack; i++ )
+        if ( !used[i] )
+            paging->free_slot_stack[paging->stack_count++] = slots[i];
+
+    return num;
 }
 
 static int xenpaging_resume_page(struct xenpaging *paging, vm_event_response_t *rsp, int notify_policy)
@@ -732,6 +812,75 @@ static int xenpaging_populate_page(struct xenpaging *paging, unsigned long gfn,
     return ret;
 }
 
+/* Sequential readahead: if the guest faults on the gfn following the last
+ * one paged in, it is probably walking through memory, so page in the
+ * paged out gfns after it as well, with a window that doubles on every
+ * such fault.  Any other fault resets the window. */
+static void prefetch_pages(struct xenpaging *paging, unsigned long gfn)
+{
+    xc_interface *xch = paging->xc_handle;
+    static unsigned long next_gfn;
+    static int window;
+    unsigned long gfns[XENPAGING_PREFETCH_MAX];
+    int slots[XENPAGING_PREFETCH_MAX];
+    int i, j, nr;
+
+    if ( gfn != next_gfn )
+    {
+        window = 0;
+        next_gfn = gfn + 1;
+        return;
+    }
+
+    window = window ? window * 2 : 2;
+    if ( window > XENPAGING_PREFETCH_MAX )
+        window = XENPAGING_PREFETCH_MAX;
+
+    for ( nr = 0; nr < window && gfn + 1 + nr < paging->max_pages; nr++ )
+    {
+        gfns[nr] = gfn + 1 + nr;
+        if ( !test_bit(gfns[nr], paging->bitmap) )
+            break;
+        slots[nr] = paging->gfn_to_slot[gfns[nr]];
+    }
+    next_gfn = gfn + 1 + nr;
+
+    for ( i = 0; i < nr; i = j )
+    {
+        int k;
+
+        /* Read runs of consecutive slots with one call */
+        for ( j = i + 1; j < nr && slots[j] == slots[j - 1] + 1; j++ )
+            ;
+        if ( read_pages(paging->fd, paging->prefetch_buffer, slots[i],
+                        j - i) < 0 )
+        {
+            PERROR("Error reading pages for prefetch");
+            return;
+        }
+
+        for ( k = i; k < j; k++ )
+        {
+            /* Not fatal: the gfn stays paged out, and faults normally */
+            if ( xc_mem_paging_load(xch, paging->vm_event.domain_id, gfns[k],
+                                    paging->prefetch_buffer +
+                                    ((size_t)(k - i) << PAGE_SHIFT)) < 0 )
+            {
+                next_gfn = gfns[k];
+                return;
+            }
+
+            DPRINTF("prefetch_page < gfn %lx pageslot %d\n",
+                    gfns[k], slots[k]);
+            clear_bit(gfns[k], paging->bitmap);
+            policy_notify_prefetched(gfns[k]);
+            paging->num_paged_out--;
+            paging->slot_to_gfn[slots[k]] = 0;
+            paging->free_slot_stack[paging->stack_count++] = slots[k];
+        }
+    }
+}
+
 /* Trigger a page-in for a batch of pages */
 static void resume_pages(struct xenpaging *paging, int num_pages)
 {
@@ -753,98 +902,44 @@ static void resume_pages(struct xenpaging *paging, int num_pages)
         page_in_trigger();
 }
 
-/* Evict one gfn and write it to the given slot
- * Returns < 0 on fatal error
- * Returns 0 on successful evict
- * Returns > 0 if no gfn can be evicted
- */
-static int evict_victim(struct xenpaging *paging, int slot)
-{
-    xc_interface *xch = paging->xc_handle;
-    unsigned long gfn;
-    static int num_paged_out;
-    int ret;
-
-    do
-    {
-        gfn = policy_choose_victim(paging);
-        if ( gfn == INVALID_MFN )
-        {
-            /* If the number did not change after last flush command then
-             * the command did not reach qemu yet, or qemu still processes
-             * the command, or qemu has nothing to release.
-             * Right now there is no need to issue the command again.
-             */
-            if ( num_paged_out != paging->num_paged_out )
-            {
-                DPRINTF("Flushing qemu cache\n");
-                xenpaging_mem_paging_flush_ioemu_cache(paging);
-                num_paged_out = paging->num_paged_out;
-            }
-            ret = ENOSPC;
-            goto out;
-        }
-
-        if ( interrupted )
-        {
-            ret = EINTR;
-            goto out;
-        }
-
-        ret = xenpaging_evict_page(paging, gfn, slot);
-        if ( ret < 0 )
-            goto out;
-    }
-    while ( ret );
-
-    if ( test_and_set_bit(gfn, paging->bitmap) )
-        ERROR("Page %lx has been evicted before", gfn);
-
-    ret = 0;
-
- out:
-    return ret;
-}
-
-/* Evict a batch of pages and write them to a free slot in the paging file
+/* Evict a batch of pages and write them to free slots in the paging file
  * Returns < 0 on fatal error
  * Returns 0 if no gfn can be evicted
  * Returns > 0 on successful evict
  */
 static int evict_pages(struct xenpaging *paging, int num_pages)
 {
-    xc_interface *xch = paging->xc_handle;
-    int rc, slot, num = 0;
+    int slots[XENPAGING_EVICT_BATCH];
+    int rc, nr, from_stack, slot = 0, num = 0;
 
-    /* Reuse known free slots */
-    while ( paging->stack_count > 0 && num < num_pages )
+    while ( num < num_pages )
     {
-        slot = paging->free_slot_stack[--paging->stack_count];
-        rc = evict_victim(paging, slot);
-        if ( rc )
-        {
-            num = rc < 0 ? -1 : num;
-            return num;
-        }
-        num++;
-    }
+        /* Reuse known free slots, then scan all slots for remainders.
+         * Slots on the stack are free too, so the scan only starts once
+         * the stack is empty. */
+        nr = from_stack = 0;
+        while ( nr < XENPAGING_EVICT_BATCH && nr < num_pages - num &&
+                paging->stack_count > 0 )
+            slots[nr++] = paging->free_slot_stack[--paging->stack_count];
+        from_stack = nr;
+        for ( ; nr < XENPAGING_EVICT_BATCH && nr < num_pages - num &&
+                !paging->stack_count && slot < paging->max_pages; slot++ )
+            /* Slot is not allocated */
+            if ( !paging->slot_to_gfn[slot] )
+                slots[nr++] = slot;
+
+        if ( !nr )
+            break;
 
-    /* Scan all slots slots for remainders */
-    for ( slot = 0; slot < paging->max_pages && num < num_pages; slot++ )
-    {
-        /* Slot is allocated */
-        if ( paging->slot_to_gfn[slot] )
-            continue;
+        rc = evict_victims(paging, slots, nr, from_stack);
+        if ( rc < 0 )
+            return -1;
 
-        rc = evict_victim(paging, slot);
-        if ( rc )
-        {
-            num = rc < 0 ? -1 : num;
+        num += rc;
+        if ( rc < nr )
             break;
-        }
-
-        num++;
     }
+
     return num;
 }
 
@@ -960,6 +1055,9 @@ int main(int argc, char *argv[])
 
                 /* Record this free slot */
                 paging->free_slot_stack[paging->stack_count++] = slot;
+
+                if ( !(req.u.mem_paging.flags & MEM_PAGING_DROP_PAGE) )
+                    prefetch_pages(paging, req.u.mem_paging.gfn);
             }
             else
             {
@@ -32,6 +32,10 @@
 #include <xen/vm_event.h>
 
 #define XENPAGING_PAGEIN_QUEUE_SIZE 64
+/* Pages nominated, mapped and written out together */
+#define XENPAGING_EVICT_BATCH 64
+/* Largest sequential readahead on page-in */
+#define XENPAGING_PREFETCH_MAX 32
 
 struct vm_event {
     domid_t domain_id;
@@ -52,6 +56,7 @@ struct xenpaging {
     int *gfn_to_slot;
 
     void *paging_buffer;
+    void *prefetch_buffer;
 
     struct vm_event vm_event;
     int fd;
@@ -20,6 +20,7 @@
  * Use is subject to license terms.
  */
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -60,8 +61,9 @@ static void xenstat_free_xen_version(xenstat_node * node);
 static void xenstat_free_vbds(xenstat_node * node);
 static void xenstat_uninit_vcpus(xenstat_handle * handle);
 static void xenstat_uninit_xen_version(xenstat_handle * handle);
-static char *xenstat_get_domain_name(xenstat_handle * handle, unsigned int domain_id);
-static void xenstat_prune_domain(xenstat_node *node, unsigned int entry);
+static char *xenstat_get_domain_name(xenstat_handle * handle,
+				     xenstat_domain_cache * cached);
+static void xenstat_forget_domains(xenstat_handle * handle);
 
 static xenstat_collector collectors[] = {
 	{ XENSTAT_VCPU, xenstat_collect_vcpus,
@@ -124,6 +126,7 @@ void xenstat_uninit(xenstat_handle * handle)
 	if (handle) {
 		for (i = 0; i < NUM_COLLECTORS; i++)
 			collectors[i].uninit(handle);
+		xenstat_forget_domains(handle);
 		xc_interface_close(handle->xc_handle);
 		xs_daemon_close(handle->xshandle);
 		free(handle->priv);
@@ -158,13 +161,97 @@ void domain_get_tmem_stats(xenstat_handle * handle, xenstat_domain * domain)
 	domain->tmem_stats.succ_pers_gets = parse(buffer,"Gp");
 }
 
+/* Token of the watch telling about backend devices being added or removed */
+#define DEVICES_WATCH_TOKEN "devices"
+
+static xenstat_domain_cache *xenstat_find_cached(xenstat_handle * handle,
+						 unsigned int domain_id)
+{
+	unsigned int lo = 0, hi = handle->num_domains, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (handle->domains[mid].id == domain_id)
+			return &handle->domains[mid];
+		if (handle->domains[mid].id < domain_id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+/* Drop what was cached because of the watches which fired */
+static void xenstat_read_watches(xenstat_handle * handle)
+{
+	xenstat_domain_cache *cached;
+	unsigned int domain_id, i;
+	char **event;
+
+	while ((event = xs_check_watch(handle->xshandle)) != NULL) {
+		if (strcmp(event[XS_WATCH_TOKEN], DEVICES_WATCH_TOKEN) == 0)
+			handle->devices_generation++;
+		else if (sscanf(event[XS_WATCH_TOKEN], "%u", &domain_id) == 1
+			 && (cached = xenstat_find_cached(handle,
+							  domain_id)) != NULL) {
+			/* The one fired when setting the watch is no news */
+			if (cached->name_watch == 2)
+				cached->name_watch = 1;
+			else {
+				free(cached->name);
+				cached->name = NULL;
+			}
+		}
+		free(event);
+	}
+
+	if (errno == EAGAIN)
+		return;
+
+	/* Events may have been lost: don't trust anything cached */
+	for (i = 0; i < handle->num_domains; i++) {
+		free(handle->domains[i].name);
+		handle->domains[i].name = NULL;
+		handle->domains[i].name_watch = 0;
+	}
+	handle->devices_watched = 0;
+}
+
+static void xenstat_forget_domain(xenstat_handle * handle,
+				  xenstat_domain_cache * cached)
+{
+	char path[80], token[16];
+
+	if (cached->name_watch) {
+		snprintf(path, sizeof(path), "/local/domain/%u/name",
+			 cached->id);
+		snprintf(token, sizeof(token), "%u", cached->id);
+		xs_unwatch(handle->xshandle, path, token);
+	}
+	free(cached->name);
+}
+
+static void xenstat_forget_domains(xenstat_handle * handle)
+{
+	unsigned int i;
+
+	for (i = 0; i < handle->num_domains; i++)
+		xenstat_forget_domain(handle, &handle->domains[i]);
+	free(handle->domains);
+	handle->domains = NULL;
+	handle->num_domains = 0;
+}
+
 xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 {
 #define DOMAIN_CHUNK_SIZE 256
 	xenstat_node *node;
 	xc_physinfo_t physinfo = { 0 };
 	xc_domaininfo_t domaininfo[DOMAIN_CHUNK_SIZE];
-	int new_domains;
+	xenstat_domain_cache *cache = NULL, *cached, *old = handle->domains;
+	unsigned int num_cached = 0, num_old = handle->num_domains, j = 0;
+	uint32_t next_domain = 0;
+	int new_domains, tmem, changed;
 	unsigned int i;
 	int rc;
 
@@ -193,6 +280,8 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 	rc = xc_tmem_control(handle->xc_handle, -1,
                          XEN_SYSCTL_TMEM_OP_QUERY_FREEABLE_MB, -1, 0, 0, NULL);
 	node->freeable_mb = (rc < 0) ? 0 : rc;
+	/* Without tmem, don't ask for the statistics of every domain */
+	tmem = rc >= 0;
 	/* malloc(0) is not portable, so allocate a single domain.  This will
 	 * be resized below. */
 	node->domains = malloc(sizeof(xenstat_domain));
@@ -200,15 +289,32 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 		free(node);
 		return NULL;
 	}
+	if (num_old) {
+		node->removed = malloc(num_old * sizeof(*node->removed));
+		if (node->removed == NULL)
+			goto err;
+	}
+
+	/* Names and device lists are cached until watches fire */
+	xenstat_read_watches(handle);
+	if (!handle->devices_watched) {
+		handle->devices_watched =
+		    xs_watch(handle->xshandle, "backend", DEVICES_WATCH_TOKEN)
+		    || errno == EEXIST;
+		handle->devices_generation++;
+	}
 
 	node->num_domains = 0;
 	do {
 		xenstat_domain *domain, *tmp;
-
-		new_domains = xc_domain_getinfolist(handle->xc_handle,
-						    node->num_domains, 
-						    DOMAIN_CHUNK_SIZE, 
-						    domaininfo);
+		xenstat_domain_cache *tmp_cache;
+
+		new_domains = xc_domain_getinfolist_changed(handle->xc_handle,
+							    next_domain,
+							    DOMAIN_CHUNK_SIZE,
+							    0, domaininfo,
+							    &next_domain,
+							    NULL);
 		if (new_domains < 0)
 			goto err;
 
@@ -220,21 +326,47 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 
 		node->domains = tmp;
 
+		tmp_cache = realloc(cache, (num_cached + new_domains + 1)
+					   * sizeof(xenstat_domain_cache));
+		if (tmp_cache == NULL)
+			goto err;
+
+		cache = tmp_cache;
+
 		domain = node->domains + node->num_domains;
 
 		/* zero out newly allocated memory in case error occurs below */
 		memset(domain, 0, new_domains * sizeof(xenstat_domain));
 
 		for (i = 0; i < new_domains; i++) {
+			/* Carry over what is cached about the domain (both
+			 * lists are sorted by id), forgetting the ones gone */
+			while (j < num_old && old[j].id < domaininfo[i].domain) {
+				node->removed[node->num_removed++] = old[j].id;
+				xenstat_forget_domain(handle, &old[j++]);
+			}
+			cached = &cache[num_cached++];
+			if (j < num_old && old[j].id == domaininfo[i].domain) {
+				*cached = old[j++];
+				changed = memcmp(&cached->info, &domaininfo[i],
+						 sizeof(cached->info)) != 0;
+			} else {
+				memset(cached, 0, sizeof(*cached));
+				cached->id = domaininfo[i].domain;
+				changed = 1;
+			}
+			cached->info = domaininfo[i];
+
+			if ((flags & XENSTAT_CHANGED_ONLY) && !changed)
+				continue;
+
 			/* Fill in domain using domaininfo[i] */
 			domain->id = domaininfo[i].domain;
-			domain->name = xenstat_get_domain_name(handle, 
-							       domain->id);
+			domain->name = xenstat_get_domain_name(handle, cached);
 			if (domain->name == NULL) {
 				if (errno == ENOMEM) {
 					/* fatal error */
-					xenstat_free_node(node);
-					return NULL;
+					goto err;
 				}
 				else {
 					/* failed to get name -- this means the
@@ -243,6 +375,7 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 					continue;
 				}
 			}
+			domain->changed = changed;
 			domain->state = domaininfo[i].flags;
 			domain->cpu_ns = domaininfo[i].cpu_time;
 			domain->num_vcpus = (domaininfo[i].max_vcpu_id+1);
@@ -260,16 +393,24 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 			domain->networks = NULL;
 			domain->num_vbds = 0;
 			domain->vbds = NULL;
-			domain_get_tmem_stats(handle,domain);
+			if (tmem)
+				domain_get_tmem_stats(handle,domain);
 
 			domain++;
 			node->num_domains++;
 		}
-	} while (new_domains == DOMAIN_CHUNK_SIZE);
+	} while (next_domain != DOMID_INVALID);
 
+	while (j < num_old) {
+		node->removed[node->num_removed++] = old[j].id;
+		xenstat_forget_domain(handle, &old[j++]);
+	}
+	free(old);
+	handle->domains = cache;
+	handle->num_domains = num_cached;
 
 	/* Run all the extra data collectors requested */
-	node->flags = 0;
+	node->flags = flags & XENSTAT_CHANGED_ONLY;
 	for (i = 0; i < NUM_COLLECTORS; i++) {
 		if ((flags & collectors[i].flag) == collectors[i].flag) {
 			node->flags |= collectors[i].flag;
@@ -282,7 +423,17 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 
 	return node;
 err:
+	/* Entries may have moved to the new cache already: drop both */
+	handle->domains = cache;
+	handle->num_domains = num_cached;
+	xenstat_forget_domains(handle);
+	for (; j < num_old; j++)
+		xenstat_forget_domain(handle, &old[j]);
+	free(old);
+	for (i = 0; i < node->num_domains; i++)
+		free(node->domains[i].name);
 	free(node->domains);
+	free(node->removed);
 	free(node);
 	return NULL;
 }
@@ -302,19 +453,25 @@ void xenstat_free_node(xenstat_node * node)
 					collectors[i].free(node);
 			free(node->domains);
 		}
+		free(node->removed);
 		free(node);
 	}
 }
 
 xenstat_domain *xenstat_node_domain(xenstat_node * node, unsigned int domid)
 {
-	unsigned int i;
-
-	/* FIXME: binary search */
-	/* Find the appropriate domain entry in the node struct. */
-	for (i = 0; i < node->num_domains; i++) {
-		if (node->domains[i].id == domid)
-			return &(node->domains[i]);
+	unsigned int lo = 0, hi = node->num_domains, mid;
+
+	/* Find the appropriate domain entry in the node struct, which has
+	 * them in the order they were enumerated in, i.e. sorted by id. */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (node->domains[mid].id == domid)
+			return &(node->domains[mid]);
+		if (node->domains[mid].id < domid)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 	return NULL;
 }
@@ -363,6 +520,16 @@ unsigned long long xenstat_node_cpu_hz(xenstat_node * node)
 	return node->cpu_hz;
 }
 
+unsigned int xenstat_node_num_removed(xenstat_node * node)
+{
+	return node->num_removed;
+}
+
+unsigned int xenstat_node_removed(xenstat_node * node, unsigned int index)
+{
+	return node->removed[index];
+}
+
 /* Get the domain ID for this domain */
 unsigned xenstat_domain_id(xenstat_domain * domain)
 {
@@ -412,6 +579,11 @@ unsigned int xenstat_domain_ssid(xenstat_domain * domain)
 	return domain->ssid;
 }
 
+unsigned int xenstat_domain_changed(xenstat_domain * domain)
+{
+	return domain->changed;
+}
+
 /* Get domain states */
 unsigned int xenstat_domain_dying(xenstat_domain * domain)
 {
@@ -483,42 +655,52 @@ xenstat_vbd *xenstat_domain_vbd(xenstat_domain * domain,
 /* Collect information about VCPUs */
 static int xenstat_collect_vcpus(xenstat_node * node)
 {
-	unsigned int i, vcpu, inc_index;
+#define VCPU_CHUNK_SIZE 256
+	xc_vcpuinfolist_t info[VCPU_CHUNK_SIZE];
+	xenstat_domain *domain;
+	uint32_t domid, vcpu = 0;
+	unsigned int i, j;
+	int nr;
 
-	/* Fill in VCPU information */
-	for (i = 0; i < node->num_domains; i+=inc_index) {
-		inc_index = 1; /* default is to increment to next domain */
-
-		node->domains[i].vcpus = malloc(node->domains[i].num_vcpus
-						* sizeof(xenstat_vcpu));
+	for (i = 0; i < node->num_domains; i++) {
+		/* calloc(0) may return NULL */
+		node->domains[i].vcpus = calloc(node->domains[i].num_vcpus + 1,
+						sizeof(xenstat_vcpu));
 		if (node->domains[i].vcpus == NULL)
 			return 0;
-	
-		for (vcpu = 0; vcpu < node->domains[i].num_vcpus; vcpu++) {
-			/* FIXME: need to be using a more efficient mechanism*/
-			xc_vcpuinfo_t info;
+	}
 
-			if (xc_vcpu_getinfo(node->handle->xc_handle,
-					    node->domains[i].id, vcpu, &info) != 0) {
-				if (errno == ENOMEM) {
-					/* fatal error */ 
-					return 0;
-				}
-				else {
-					/* domain is in transition - remove
-					   from list */
-					xenstat_prune_domain(node, i);
+	/* Get the vcpus of all the domains at once, in the order of the
+	 * domains, skipping over the ones not in the node. */
+	for (i = 0; i < node->num_domains; ) {
+		domid = node->domains[i].id;
+		nr = xc_vcpu_getinfolist(node->handle->xc_handle, &domid, &vcpu,
+					 false, VCPU_CHUNK_SIZE, info,
+					 NULL, NULL, 0);
+		if (nr < 0)
+			return 0;
 
-					/* remember not to increment index! */
-					inc_index = 0;
-					break;
-				}
-			}
-			else {
-				node->domains[i].vcpus[vcpu].online = info.online;
-				node->domains[i].vcpus[vcpu].ns = info.cpu_time;
-			}
+		for (j = 0; j < nr; j++) {
+			while (i < node->num_domains &&
+			       node->domains[i].id < info[j].domain)
+				i++;
+			if (i == node->num_domains)
+				break;
+			domain = &node->domains[i];
+			if (domain->id != info[j].domain ||
+			    info[j].vcpu >= domain->num_vcpus)
+				continue;
+			domain->vcpus[info[j].vcpu].online = info[j].online;
+			domain->vcpus[info[j].vcpu].ns = info[j].cpu_time;
 		}
+
+		/* Continue with the next domain needed */
+		while (i < node->num_domains && node->domains[i].id < domid)
+			i++;
+		if (domid == DOMID_INVALID)
+			break;
+		if (i < node->num_domains && node->domains[i].id != domid)
+			vcpu = 0;
 	}
 	return 1;
 }
@@ -763,32 +945,36 @@ unsigned long long xenstat_tmem_succ_pers_gets(xenstat_tmem *tmem)
 }
 
 
-static char *xenstat_get_domain_name(xenstat_handle *handle, unsigned int domain_id)
+static char *xenstat_get_domain_name(xenstat_handle *handle,
+				     xenstat_domain_cache *cached)
 {
-	char path[80];
+	char path[80], token[16];
+	char *name;
 
-	snprintf(path, sizeof(path),"/local/domain/%i/name", domain_id);
-
-	return xs_read(handle->xshandle, XBT_NULL, path, NULL);
-}
+	if (cached->name == NULL) {
+		snprintf(path, sizeof(path), "/local/domain/%u/name",
+			 cached->id);
 
-/* Remove specified entry from list of domains */
-static void xenstat_prune_domain(xenstat_node *node, unsigned int entry)
-{
-	/* nothing to do if array is empty or entry is beyond end */
-	if (node->num_domains == 0 || entry >= node->num_domains)
-		return;
+		/* Watch the name before reading it, not to miss changes */
+		if (cached->name_watch == 0) {
+			snprintf(token, sizeof(token), "%u", cached->id);
+			if (xs_watch(handle->xshandle, path, token))
+				cached->name_watch = 2;
+			else if (errno == EEXIST)
+				cached->name_watch = 1;
+		}
 
-	/* decrement count of domains */
-	node->num_domains--;
+		cached->name = xs_read(handle->xshandle, XBT_NULL, path, NULL);
+		if (cached->name == NULL)
+			return NULL;
+	}
 
-	/* shift entries following specified entry up by one */
-	if (entry < node->num_domains) {
-		xenstat_domain *domain = &node->domains[entry];
-		memmove(domain,domain+1,(node->num_domains - entry) * sizeof(xenstat_domain) );
+	/* Without a watch, the name can't be kept */
+	if (cached->name_watch == 0) {
+		name = cached->name;
+		cached->name = NULL;
+		return name;
 	}
 
-	/* zero out original last entry from node -- not
-	   strictly necessary but safer! */
-	memset(&node->domains[node->num_domains], 0, sizeof(xenstat_domain)); 
+	return strdup(cached->name);
 }
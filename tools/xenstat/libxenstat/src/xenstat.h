@@ -42,6 +42,10 @@ void xenstat_uninit(xenstat_handle * handle);
 #define XENSTAT_XEN_VERSION 0x4
 #define XENSTAT_VBD 0x8
 #define XENSTAT_ALL (XENSTAT_VCPU|XENSTAT_NETWORK|XENSTAT_XEN_VERSION|XENSTAT_VBD)
+/* Only get the domains whose information changed since the previous call
+ * of xenstat_get_node on the handle (see xenstat_domain_changed), and
+ * collect the other information requested for them only. */
+#define XENSTAT_CHANGED_ONLY 0x10
 
 /* Get all available information about a node */
 xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags);
@@ -79,6 +83,14 @@ unsigned int xenstat_node_num_domains(xenstat_node * node);
 /* Find the number of CPUs existing on a node */
 unsigned int xenstat_node_num_cpus(xenstat_node * node);
 
+/* Find the number of domains which disappeared since the previous call
+ * of xenstat_get_node on the handle */
+unsigned int xenstat_node_num_removed(xenstat_node * node);
+
+/* Get the ID of the removed domain with the given index, which must be
+ * less than xenstat_node_num_removed */
+unsigned int xenstat_node_removed(xenstat_node * node, unsigned int index);
+
 /* Get information about the CPU speed */
 unsigned long long xenstat_node_cpu_hz(xenstat_node * node);
 
@@ -111,6 +123,10 @@ unsigned long long xenstat_domain_max_mem(xenstat_domain * domain);
 /* Find the domain's SSID */
 unsigned int xenstat_domain_ssid(xenstat_domain * domain);
 
+/* Whether the domain is new, or its state, CPU time or memory changed,
+ * since the previous call of xenstat_get_node on the handle */
+unsigned int xenstat_domain_changed(xenstat_domain * domain);
+
 /* Get domain states */
 unsigned int xenstat_domain_dying(xenstat_domain * domain);
 unsigned int xenstat_domain_crashed(xenstat_domain * domain);
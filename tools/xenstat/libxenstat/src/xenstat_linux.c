@@ -28,15 +28,35 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <regex.h>
 
 #include "xenstat_priv.h"
 
 #define SYSFS_VBD_PATH "/sys/bus/xen-backend/devices"
 
+/* What is known about a network interface */
+struct iface_info {
+	char name[16];
+	int is_vif;
+	unsigned int domid, netid;
+};
+
+/* A VBD found in SYSFS_VBD_PATH */
+struct vbd_info {
+	char name[32];
+	unsigned int domid, dev, back_type;
+};
+
 struct priv_data {
 	FILE *procnetdev;
 	DIR *sysfsvbd;
+	/* Cached for as long as handle->devices_generation doesn't change */
+	unsigned int ifaces_generation, vbds_generation;
+	int ifaces_valid, vbds_valid;
+	char bridge[16];
+	struct iface_info *ifaces;
+	unsigned int num_ifaces, ifaces_cursor;
+	struct vbd_info *vbds;
+	unsigned int num_vbds;
 };
 
 static struct priv_data *
@@ -45,13 +65,10 @@ get_priv_data(xenstat_handle *handle)
 	if (handle->priv != NULL)
 		return handle->priv;
 
-	handle->priv = malloc(sizeof(struct priv_data));
+	handle->priv = calloc(1, sizeof(struct priv_data));
 	if (handle->priv == NULL)
 		return (NULL);
 
-	((struct priv_data *)handle->priv)->procnetdev = NULL;
-	((struct priv_data *)handle->priv)->sysfsvbd = NULL;
-
 	return handle->priv;
 }
 
@@ -87,8 +104,8 @@ void getBridge(char *excludeName, char *result, size_t resultLen)
 	closedir(d);
 }
 
-/* parseNetLine provides regular expression based parsing for lines from /proc/net/dev, all the */
-/* information are parsed but not all are used in our case, ie. for xenstat */
+/* parseNetLine parses lines from /proc/net/dev, all the information are */
+/* parsed but not all are used in our case, ie. for xenstat */
 int parseNetDevLine(char *line, char *iface, unsigned long long *rxBytes, unsigned long long *rxPackets,
 		unsigned long long *rxErrs, unsigned long long *rxDrops, unsigned long long *rxFifo,
 		unsigned long long *rxFrames, unsigned long long *rxComp, unsigned long long *rxMcast,
@@ -96,142 +113,45 @@ int parseNetDevLine(char *line, char *iface, unsigned long long *rxBytes, unsign
 		unsigned long long *txDrops, unsigned long long *txFifo, unsigned long long *txColls,
 		unsigned long long *txCarrier, unsigned long long *txComp)
 {
-	/* Temporary/helper variables */
-	int ret;
-	char *tmp;
-	int i = 0, x = 0, col = 0;
-	regex_t r;
-	regmatch_t matches[19];
-	int num = 19;
-
-	/* Regular exception to parse all the information from /proc/net/dev line */
-	char *regex = "([^:]*):([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)"
-			"[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*"
-			"([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)";
+	/* The columns following the interface name, in order */
+	unsigned long long *cols[] = {
+		rxBytes, rxPackets, rxErrs, rxDrops, rxFifo, rxFrames, rxComp,
+		rxMcast, txBytes, txPackets, txErrs, txDrops, txFifo, txColls,
+		txCarrier, txComp
+	};
+	unsigned long long val;
+	char *p, *end;
+	int i;
 
 	/* Initialize all variables called has passed as non-NULL to zeros */
 	if (iface != NULL)
-		memset(iface, 0, sizeof(*iface));
-	if (rxBytes != NULL)
-		*rxBytes = 0;
-	if (rxPackets != NULL)
-		*rxPackets = 0;
-	if (rxErrs != NULL)
-		*rxErrs = 0;
-	if (rxDrops != NULL)
-		*rxDrops = 0;
-	if (rxFifo != NULL)
-		*rxFifo = 0;
-	if (rxFrames != NULL)
-		*rxFrames = 0;
-	if (rxPackets != NULL)
-		*rxPackets = 0;
-	if (rxComp != NULL)
-		*rxComp = 0;
-	if (txBytes != NULL)
-		*txBytes = 0;
-	if (txPackets != NULL)
-		*txPackets = 0;
-	if (txErrs != NULL)
-		*txErrs = 0;
-	if (txDrops != NULL)
-		*txDrops = 0;
-	if (txFifo != NULL)
-		*txFifo = 0;
-	if (txColls != NULL)
-		*txColls = 0;
-	if (txCarrier != NULL)
-		*txCarrier = 0;
-	if (txComp != NULL)
-		*txComp = 0;
-
-	if ((ret = regcomp(&r, regex, REG_EXTENDED))) {
-		regfree(&r);
-		return ret;
-	}
-
-	tmp = (char *)malloc( sizeof(char) );
-	if (regexec (&r, line, num, matches, REG_EXTENDED) == 0){
-		for (i = 1; i < num; i++) {
-			/* The expression matches are empty sometimes so we need to check it first */
-			if (matches[i].rm_eo - matches[i].rm_so > 0) {
-				/* Col variable contains current id of non-empty match */
-				col++;
-				tmp = (char *)realloc(tmp, (matches[i].rm_eo - 
-							matches[i].rm_so + 1) * sizeof(char));
-				for (x = matches[i].rm_so; x < matches[i].rm_eo; x++)
-					tmp[x - matches[i].rm_so] = line[x];
-
-				/* We populate all the fields from /proc/net/dev line */
-				if (i > 1) {
-					unsigned long long ullTmp = strtoull(tmp, NULL, 10);
-
-					switch (col) {
-						case 2: if (rxBytes != NULL)
-								*rxBytes = ullTmp;
-							break;
-						case 3: if (rxPackets != NULL)
-								*rxPackets = ullTmp;
-							break;
-						case 4: if (rxErrs != NULL)
-								*rxErrs = ullTmp;
-							break;
-						case 5: if (rxDrops != NULL)
-								*rxDrops = ullTmp;
-							break;
-						case 6: if (rxFifo != NULL)
-								*rxFifo = ullTmp;
-							break;
-						case 7: if (rxFrames != NULL)
-								*rxFrames = ullTmp;
-							break;
-						case 8: if (rxComp != NULL)
-								*rxComp = ullTmp;
-							break;
-						case 9: if (rxMcast != NULL)
-								*rxMcast = ullTmp;
-							break;
-						case 10: if (txBytes != NULL)
-								*txBytes = ullTmp;
-							break;
-						case 11: if (txPackets != NULL)
-								*txPackets = ullTmp;
-							break;
-						case 12: if (txErrs != NULL)
-								*txErrs = ullTmp;
-							break;
-						case 13: if (txDrops != NULL)
-								*txDrops = ullTmp;
-							break;
-						case 14: if (txFifo != NULL)
-								*txFifo = ullTmp;
-							break;
-						case 15: if (txColls != NULL)
-								*txColls = ullTmp;
-							break;
-						case 16: if (txCarrier != NULL)
-								*txCarrier = ullTmp;
-							break;
-						case 17: if (txComp != NULL)
-								*txComp = ullTmp;
-							break;
-					}
-				}
-				else
-				/* There were errors when parsing this directly in RE. strpbrk() helps */
-				if (iface != NULL) {
-					char *tmp2 = strpbrk(tmp, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789");
-					if (tmp2 != NULL)
-						strcpy(iface, tmp2);
-				}
-
-				memset(tmp, 0, matches[i].rm_eo - matches[i].rm_so);
-			}
+		*iface = '\0';
+	for (i = 0; i < sizeof(cols) / sizeof(cols[0]); i++)
+		if (cols[i] != NULL)
+			*cols[i] = 0;
+
+	/* "<spaces><iface>:<col> <col> ...", iface at most 15 characters */
+	p = strchr(line, ':');
+	if (p == NULL)
+		return 0;
+	if (iface != NULL) {
+		for (end = line; *end == ' '; end++)
+			;
+		if (p - end < 16) {
+			memcpy(iface, end, p - end);
+			iface[p - end] = '\0';
 		}
 	}
 
-	free(tmp);
-	regfree(&r);
+	p++;
+	for (i = 0; i < sizeof(cols) / sizeof(cols[0]); i++) {
+		val = strtoull(p, &end, 10);
+		if (end == p)
+			break;
+		if (cols[i] != NULL)
+			*cols[i] = val;
+		p = end;
+	}
 
 	return 0;
 }
@@ -259,12 +179,41 @@ static int get_iface_domid_network(const char *iface, unsigned int *domid_p, uns
 	return 0;
 }
 
+/* Look up, or find out and remember, what an interface is */
+static struct iface_info *get_iface_info(struct priv_data *priv, const char *iface)
+{
+	struct iface_info *info;
+	unsigned int i, idx;
+
+	/* /proc/net/dev lists the interfaces in the same order every time */
+	for (i = 0; i < priv->num_ifaces; i++) {
+		idx = (priv->ifaces_cursor + i) % priv->num_ifaces;
+		if (strcmp(priv->ifaces[idx].name, iface) == 0) {
+			priv->ifaces_cursor = idx + 1;
+			return &priv->ifaces[idx];
+		}
+	}
+
+	info = realloc(priv->ifaces, (priv->num_ifaces + 1) * sizeof(*info));
+	if (info == NULL)
+		return NULL;
+	priv->ifaces = info;
+
+	info = &priv->ifaces[priv->num_ifaces++];
+	priv->ifaces_cursor = priv->num_ifaces;
+	snprintf(info->name, sizeof(info->name), "%s", iface);
+	info->is_vif = get_iface_domid_network(iface, &info->domid, &info->netid);
+
+	return info;
+}
+
 /* Collect information about networks */
 int xenstat_collect_networks(xenstat_node * node)
 {
 	/* Helper variables for parseNetDevLine() function defined above */
 	int i;
-	char line[512] = { 0 }, iface[16] = { 0 }, devBridge[16] = { 0 }, devNoBridge[16] = { 0 };
+	char line[512] = { 0 }, iface[16] = { 0 }, devNoBridge[16] = { 0 };
+	struct iface_info *info;
 	unsigned long long rxBytes, rxPackets, rxErrs, rxDrops, txBytes, txPackets, txErrs, txDrops;
 
 	struct priv_data *priv = get_priv_data(node->handle);
@@ -302,9 +251,21 @@ int xenstat_collect_networks(xenstat_node * node)
 	fseek(priv->procnetdev, sizeof(PROCNETDEV_HEADER) - 1,
 	      SEEK_SET);
 
-	/* We get the bridge devices for use with bonding interface to get bonding interface stats */
-	getBridge("vir", devBridge, sizeof(devBridge));
-	snprintf(devNoBridge, 16, "p%s", devBridge);
+	/* Interfaces are only looked at again once devices were added or
+	 * removed */
+	if (!priv->ifaces_valid ||
+	    priv->ifaces_generation != node->handle->devices_generation) {
+		priv->num_ifaces = 0;
+		priv->ifaces_cursor = 0;
+
+		/* We get the bridge devices for use with bonding interface to get bonding interface stats */
+		memset(priv->bridge, 0, sizeof(priv->bridge));
+		getBridge("vir", priv->bridge, sizeof(priv->bridge));
+
+		priv->ifaces_generation = node->handle->devices_generation;
+		priv->ifaces_valid = 1;
+	}
+	snprintf(devNoBridge, 16, "p%s", priv->bridge);
 
 	while (fgets(line, 512, priv->procnetdev)) {
 		xenstat_domain *domain;
@@ -316,7 +277,7 @@ int xenstat_collect_networks(xenstat_node * node)
 
 		/* If the device parsed is network bridge and both tx & rx packets are zero, we are most */
 		/* likely using bonding so we alter the configuration for dom0 to have bridge stats */
-		if ((strstr(iface, devBridge) != NULL) &&
+		if ((strstr(iface, priv->bridge) != NULL) &&
 		    (strstr(iface, devNoBridge) == NULL) &&
 		    ((domain = xenstat_node_domain(node, 0)) != NULL)) {
 			for (i = 0; i < domain->num_networks; i++) {
@@ -335,7 +296,9 @@ int xenstat_collect_networks(xenstat_node * node)
 			}
 		}
 		else /* Otherwise we need to preserve old behaviour */
-		if (get_iface_domid_network(iface, &domid, &net.id)) {
+		if ((info = get_iface_info(priv, iface)) != NULL && info->is_vif) {
+			domid = info->domid;
+			net.id = info->netid;
 
 			net.tbytes = txBytes;
 			net.tpackets = txPackets;
@@ -349,10 +312,12 @@ int xenstat_collect_networks(xenstat_node * node)
 		/* FIXME: this does a search for the domid */
 		  domain = xenstat_node_domain(node, domid);
 		  if (domain == NULL) {
-			fprintf(stderr,
-				"Found interface vif%u.%u but domain %u"
-				" does not exist.\n", domid, net.id,
-				domid);
+			/* Unchanged domains are left out of the node */
+			if (!(node->flags & XENSTAT_CHANGED_ONLY))
+				fprintf(stderr,
+					"Found interface vif%u.%u but domain %u"
+					" does not exist.\n", domid, net.id,
+					domid);
 			continue;
 		  }
 		  if (domain->networks == NULL) {
@@ -383,6 +348,8 @@ void xenstat_uninit_networks(xenstat_handle * handle)
 	struct priv_data *priv = get_priv_data(handle);
 	if (priv != NULL && priv->procnetdev != NULL)
 		fclose(priv->procnetdev);
+	if (priv != NULL)
+		free(priv->ifaces);
 }
 
 static int read_attributes_vbd(const char *vbd_directory, const char *what, char *ret, int cap)
@@ -401,16 +368,12 @@ static int read_attributes_vbd(const char *vbd_directory, const char *what, char
 	return num_read;
 }
 
-/* Collect information about VBDs */
-int xenstat_collect_vbds(xenstat_node * node)
+/* Find the VBDs there are, in SYSFS_VBD_PATH */
+static int scan_vbds(struct priv_data *priv)
 {
 	struct dirent *dp;
-	struct priv_data *priv = get_priv_data(node->handle);
-
-	if (priv == NULL) {
-		perror("Allocation error");
-		return 0;
-	}
+	struct vbd_info vbd, *tmp;
+	char type[4];
 
 	if (priv->sysfsvbd == NULL) {
 		priv->sysfsvbd = opendir(SYSFS_VBD_PATH);
@@ -420,64 +383,109 @@ int xenstat_collect_vbds(xenstat_node * node)
 		}
 	}
 
-	/* Get qdisk statistics */
-	read_attributes_qdisk(node);
-
+	priv->num_vbds = 0;
 	rewinddir(priv->sysfsvbd);
 
 	for(dp = readdir(priv->sysfsvbd); dp != NULL ;
 	    dp = readdir(priv->sysfsvbd)) {
-		xenstat_domain *domain;
-		xenstat_vbd vbd;
-		unsigned int domid;
-		int ret;
-		char buf[256];
-
-		ret = sscanf(dp->d_name, "%3s-%u-%u", buf, &domid, &vbd.dev);
-		if (ret != 3)
+		if (sscanf(dp->d_name, "%3s-%u-%u", type, &vbd.domid,
+			   &vbd.dev) != 3)
 			continue;
 
-		if (strcmp(buf,"vbd") == 0)
+		if (strcmp(type,"vbd") == 0)
 			vbd.back_type = 1;
-		else if (strcmp(buf,"tap") == 0)
+		else if (strcmp(type,"tap") == 0)
 			vbd.back_type = 2;
 		else
 			continue;
 
-		domain = xenstat_node_domain(node, domid);
+		if (strlen(dp->d_name) >= sizeof(vbd.name))
+			continue;
+		strcpy(vbd.name, dp->d_name);
+
+		tmp = realloc(priv->vbds, (priv->num_vbds + 1) * sizeof(*tmp));
+		if (tmp == NULL) {
+			perror("Allocation error");
+			return 0;
+		}
+		priv->vbds = tmp;
+		priv->vbds[priv->num_vbds++] = vbd;
+	}
+
+	return 1;
+}
+
+/* Collect information about VBDs */
+int xenstat_collect_vbds(xenstat_node * node)
+{
+	struct priv_data *priv = get_priv_data(node->handle);
+	unsigned int i;
+
+	if (priv == NULL) {
+		perror("Allocation error");
+		return 0;
+	}
+
+	/* The directory is only read again once devices were added or
+	 * removed */
+	if (!priv->vbds_valid ||
+	    priv->vbds_generation != node->handle->devices_generation) {
+		priv->vbds_valid = 0;
+		if (!scan_vbds(priv))
+			return 0;
+		priv->vbds_generation = node->handle->devices_generation;
+		priv->vbds_valid = 1;
+	}
+
+	/* Get qdisk statistics */
+	read_attributes_qdisk(node);
+
+	for (i = 0; i < priv->num_vbds; i++) {
+		const struct vbd_info *info = &priv->vbds[i];
+		xenstat_domain *domain;
+		xenstat_vbd vbd;
+		int ret;
+		char buf[256];
+
+		vbd.back_type = info->back_type;
+		vbd.dev = info->dev;
+
+		domain = xenstat_node_domain(node, info->domid);
 		if (domain == NULL) {
-			fprintf(stderr,
-				"Found interface %s-%u-%u but domain %u"
-				" does not exist.\n",
-				buf, domid, vbd.dev, domid);
+			/* Unchanged domains are left out of the node */
+			if (!(node->flags & XENSTAT_CHANGED_ONLY))
+				fprintf(stderr,
+					"Found interface %s but domain %u"
+					" does not exist.\n",
+					info->name, info->domid);
 			continue;
 		}
 
-		if((read_attributes_vbd(dp->d_name, "statistics/oo_req", buf, 256)<=0)
+		if((read_attributes_vbd(info->name, "statistics/oo_req", buf, 256)<=0)
 		   || ((ret = sscanf(buf, "%llu", &vbd.oo_reqs)) != 1))
 		{
 			continue;
 		}
 
-		if((read_attributes_vbd(dp->d_name, "statistics/rd_req", buf, 256)<=0)
+		if((read_attributes_vbd(info->name, "statistics/rd_req", buf, 256)<=0)
 		   || ((ret = sscanf(buf, "%llu", &vbd.rd_reqs)) != 1))
 		{
 			continue;
 		}
 
-		if((read_attributes_vbd(dp->d_name, "statistics/wr_req", buf, 256)<=0)
+		if((read_attributes_vbd(info->name, "statistics/wr_req", buf, 256)<=0)
 		   || ((ret = sscanf(buf, "%llu", &vbd.wr_reqs)) != 1))
 		{
 			continue;
 		}
 
-		if((read_attributes_vbd(dp->d_name, "statistics/rd_sect", buf, 256)<=0)
+		if((read_attributes_vbd(info->name, "statistics/rd_sect", buf, 256)<=0)
 		   || ((ret = sscanf(buf, "%llu", &vbd.rd_sects)) != 1))
 		{
 			continue;
 		}
 
-		if((read_attributes_vbd(dp->d_name, "statistics/wr_sect", buf, 256)<=0)
+		if((read_attributes_vbd(info->name, "statistics/wr_sect", buf, 256)<=0)
 		   || ((ret = sscanf(buf, "%llu", &vbd.wr_sects)) != 1))
 		{
 			continue;
@@ -498,4 +506,6 @@ void xenstat_uninit_vbds(xenstat_handle * handle)
 	struct priv_data *priv = get_priv_data(handle);
 	if (priv != NULL && priv->sysfsvbd != NULL)
 		closedir(priv->sysfsvbd);
+	if (priv != NULL)
+		free(priv->vbds);
 }
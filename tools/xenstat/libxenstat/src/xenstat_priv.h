@@ -32,12 +32,26 @@
 #define SHORT_ASC_LEN 5                 /* length of 65535 */
 #define VERSION_SIZE (2 * SHORT_ASC_LEN + 1 + sizeof(xen_extraversion_t) + 1)
 
+/* What is kept about a domain from one xenstat_get_node() to the next */
+typedef struct xenstat_domain_cache {
+	unsigned int id;
+	char *name;		/* NULL if it needs to be read (again) */
+	int name_watch;		/* 0: none, 1: set, 2: initial event pending */
+	xc_domaininfo_t info;	/* as of the last xenstat_get_node() */
+} xenstat_domain_cache;
+
 struct xenstat_handle {
 	xc_interface *xc_handle;
 	struct xs_handle *xshandle; /* xenstore handle */
 	int page_size;
 	void *priv;
 	char xen_version[VERSION_SIZE]; /* xen version running on this node */
+	xenstat_domain_cache *domains;	/* Sorted by id */
+	unsigned int num_domains;
+	int devices_watched;
+	/* Changes whenever backend devices might have been added or removed,
+	 * so that lists of them can be cached in the meantime. */
+	unsigned int devices_generation;
 };
 
 struct xenstat_node {
@@ -50,6 +64,8 @@ struct xenstat_node {
 	unsigned int num_domains;
 	xenstat_domain *domains;	/* Array of length num_domains */
 	long freeable_mb;
+	unsigned int num_removed;
+	unsigned int *removed;		/* Array of length num_removed */
 };
 
 struct xenstat_tmem {
@@ -74,6 +90,7 @@ struct xenstat_domain {
 	unsigned int num_vbds;
 	xenstat_vbd *vbds;
 	xenstat_tmem tmem_stats;
+	unsigned int changed;
 };
 
 struct xenstat_vcpu {
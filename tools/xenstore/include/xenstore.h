@@ -49,6 +49,7 @@
 
 struct xs_handle;
 typedef uint32_t xs_transaction_t;
+typedef uint32_t xs_request_t;
 
 /* IMPORTANT: For details on xenstore protocol limits, see
  * docs/misc/xenstore.txt in the Xen public source repository, and use the
@@ -107,9 +108,27 @@ void xs_daemon_destroy_postfork(struct xs_handle *);
 char **xs_directory(struct xs_handle *h, xs_transaction_t t,
 		    const char *path, unsigned int *num);
 
+/* Get names and values of the immediate children of a directory, in as
+ * few requests as possible.
+ * Returns a malloced array: call free() on it after use.
+ * Num indicates size.  Values are nul terminated, with len indicating
+ * their length in bytes, not including terminator.  value is NULL for
+ * children which couldn't be read.
+ */
+struct xs_dir_value {
+	const char *name;
+	const void *value;
+	unsigned int len;
+};
+struct xs_dir_value *xs_directory_values(struct xs_handle *h,
+					 xs_transaction_t t,
+					 const char *path, unsigned int *num);
+
 /* Get the value of a single file, nul terminated.
  * Returns a malloced value: call free() on it after use.
  * len indicates length in bytes, not including terminator.
+ * Outside of transactions, nodes mirrored by xenstored (see its --mirror
+ * option) are read without talking to it over socket connections.
  */
 void *xs_read(struct xs_handle *h, xs_transaction_t t,
 	      const char *path, unsigned int *len);
@@ -132,6 +151,32 @@ bool xs_mkdir(struct xs_handle *h, xs_transaction_t t,
 bool xs_rm(struct xs_handle *h, xs_transaction_t t,
 	   const char *path);
 
+/* Pipelined requests.
+ *
+ * These send the same request as their synchronous counterparts, but
+ * return without waiting for the reply.  Any number of requests may be
+ * outstanding, and they are handled by the daemon in the order sent.
+ * Returns an id to pass to xs_async_wait(), or 0 on failure.
+ */
+xs_request_t xs_read_async(struct xs_handle *h, xs_transaction_t t,
+			   const char *path);
+xs_request_t xs_write_async(struct xs_handle *h, xs_transaction_t t,
+			    const char *path, const void *data,
+			    unsigned int len);
+xs_request_t xs_mkdir_async(struct xs_handle *h, xs_transaction_t t,
+			    const char *path);
+xs_request_t xs_rm_async(struct xs_handle *h, xs_transaction_t t,
+			 const char *path);
+
+/* Wait for the reply to a pipelined request.  Every request sent must be
+ * waited for, in any order, as replies are kept until then.
+ * Returns a malloced reply, nul terminated: call free() on it after use,
+ * or NULL on failure.  For xs_read_async() it is the value read, and len
+ * (if not NULL) indicates its length as for xs_read().
+ */
+void *xs_async_wait(struct xs_handle *h, xs_request_t req,
+		    unsigned int *len);
+
 /* Get permissions of node (first element is owner, first perms is "other").
  * Returns malloced array, or NULL: call free() after use.
  */
@@ -61,6 +61,7 @@
 #define TALLOC_MAGIC 0xe814ec70
 #define TALLOC_FLAG_FREE 0x01
 #define TALLOC_FLAG_LOOP 0x02
+#define TALLOC_FLAG_POOLED 0x04	/* children are allocated from tc->pool */
 #define TALLOC_MAGIC_REFERENCE ((const char *)1)
 
 /* by default we abort when given a bad pointer (such as when talloc_free() is called 
@@ -92,21 +93,116 @@ struct talloc_reference_handle {
 
 typedef int (*talloc_destructor_t)(void *);
 
+struct talloc_pool;
+
 struct talloc_chunk {
 	struct talloc_chunk *next, *prev;
 	struct talloc_chunk *parent, *child;
 	struct talloc_reference_handle *refs;
 	unsigned int null_refs; /* references from null_context */
+	unsigned flags;
 	talloc_destructor_t destructor;
 	const char *name;
 	size_t size;
-	unsigned flags;
+	struct talloc_pool *pool; /* pool the chunk lives in, if any */
 };
 
 /* 16 byte alignment seems to keep everyone happy */
-#define TC_HDR_SIZE ((sizeof(struct talloc_chunk)+15)&~15)
+#define TC_ALIGN(size) (((size)+15)&~15)
+#define TC_HDR_SIZE TC_ALIGN(sizeof(struct talloc_chunk))
 #define TC_PTR_FROM_CHUNK(tc) ((void *)(TC_HDR_SIZE + (char*)tc))
 
+/*
+  A pool is a chunk with extra space behind it, which its descendants
+  get carved out of by bumping a pointer instead of calling malloc().
+  Freeing a chunk in the pool only returns its space if it was the most
+  recent allocation, but once only the pool itself is left the whole
+  space becomes available again.  The memory is released when the pool
+  and all chunks in it (including any stolen away) have been freed.
+*/
+struct talloc_pool {
+	struct talloc_chunk *tc;
+	char *start, *next, *end;
+	unsigned int objects; /* chunks in the pool, plus the pool itself */
+};
+
+#define TP_HDR_SIZE TC_ALIGN(sizeof(struct talloc_pool))
+
+static char *talloc_chunk_end(struct talloc_chunk *tc)
+{
+	return (char *)TC_PTR_FROM_CHUNK(tc) + TC_ALIGN(tc->size);
+}
+
+static struct talloc_chunk *talloc_pool_alloc(struct talloc_pool *pool,
+					      size_t size)
+{
+	struct talloc_chunk *tc = (struct talloc_chunk *)pool->next;
+
+	if (TC_HDR_SIZE + TC_ALIGN(size) > (size_t)(pool->end - pool->next)) {
+		return NULL;
+	}
+
+	pool->next += TC_HDR_SIZE + TC_ALIGN(size);
+	pool->objects++;
+	tc->pool = pool;
+
+	return tc;
+}
+
+static void talloc_pool_release(struct talloc_chunk *tc)
+{
+	struct talloc_pool *pool = tc->pool;
+
+	if (--pool->objects == 0) {
+		free(pool->tc);
+		return;
+	}
+
+	if (pool->objects == 1 && !(pool->tc->flags & TALLOC_FLAG_FREE)) {
+		pool->next = pool->start;
+	} else if (tc != pool->tc && talloc_chunk_end(tc) == pool->next) {
+		pool->next = (char *)tc;
+	}
+}
+
+/*
+  resize a chunk living in a pool: in place if it is the last one, by
+  moving it out of the pool otherwise. Pools themselves can't be resized.
+*/
+static struct talloc_chunk *talloc_pool_realloc(struct talloc_chunk *tc,
+						size_t size)
+{
+	struct talloc_pool *pool = tc->pool;
+	struct talloc_chunk *new_tc;
+
+	if (tc == pool->tc) {
+		return NULL;
+	}
+
+	if (talloc_chunk_end(tc) == pool->next &&
+	    TC_ALIGN(size) <= TC_ALIGN(tc->size) +
+			      (size_t)(pool->end - pool->next)) {
+		pool->next = (char *)TC_PTR_FROM_CHUNK(tc) + TC_ALIGN(size);
+		return tc;
+	}
+
+	if (size <= tc->size) {
+		return tc;
+	}
+
+	new_tc = malloc(size + TC_HDR_SIZE);
+	if (new_tc == NULL) {
+		return NULL;
+	}
+
+	memcpy(new_tc, tc, tc->size + TC_HDR_SIZE);
+	talloc_pool_release(tc);
+	new_tc->pool = NULL;
+	new_tc->flags &= ~TALLOC_FLAG_POOLED;
+
+	return new_tc;
+}
+
 /* panic if we get a bad magic value */
 static struct talloc_chunk *talloc_chunk_from_ptr(const void *ptr)
 {
@@ -166,11 +262,12 @@ void *talloc_parent(const void *ptr)
 }
 
 /* 
-   Allocate a bit of memory as a child of an existing pointer
+   Allocate a bit of memory as a child of an existing pointer, from the
+   pool of the parent if it has one and use_pool is set
 */
-void *_talloc(const void *context, size_t size)
+static void *__talloc(const void *context, size_t size, int use_pool)
 {
-	struct talloc_chunk *tc;
+	struct talloc_chunk *tc = NULL, *parent = NULL;
 
 	if (context == NULL) {
 		context = null_context;
@@ -180,20 +277,30 @@ void *_talloc(const void *context, size_t size)
 		return NULL;
 	}
 
-	tc = malloc(TC_HDR_SIZE+size);
-	if (tc == NULL) return NULL;
+	if (context) {
+		parent = talloc_chunk_from_ptr(context);
+		if (use_pool && (parent->flags & TALLOC_FLAG_POOLED)) {
+			tc = talloc_pool_alloc(parent->pool, size);
+		}
+	}
+
+	if (tc) {
+		tc->flags = TALLOC_MAGIC | TALLOC_FLAG_POOLED;
+	} else {
+		tc = malloc(TC_HDR_SIZE+size);
+		if (tc == NULL) return NULL;
+		tc->flags = TALLOC_MAGIC;
+		tc->pool = NULL;
+	}
 
 	tc->size = size;
-	tc->flags = TALLOC_MAGIC;
 	tc->destructor = NULL;
 	tc->child = NULL;
 	tc->name = NULL;
 	tc->refs = NULL;
 	tc->null_refs = 0;
 
-	if (context) {
-		struct talloc_chunk *parent = talloc_chunk_from_ptr(context);
-
+	if (parent) {
 		tc->parent = parent;
 
 		if (parent->child) {
@@ -208,6 +315,50 @@ void *_talloc(const void *context, size_t size)
 	return TC_PTR_FROM_CHUNK(tc);
 }
 
+void *_talloc(const void *context, size_t size)
+{
+	return __talloc(context, size, 1);
+}
+
+/*
+  Allocate an object of the given size with a pool of pool_size bytes
+  behind it, which its descendants get allocated from as long as it
+  lasts. Each chunk in the pool takes its size rounded up to 16 bytes,
+  plus the talloc header.
+*/
+void *_talloc_pooled_object(const void *context, size_t size,
+			    size_t pool_size, const char *name)
+{
+	struct talloc_chunk *tc;
+	struct talloc_pool *pool;
+	void *ptr;
+
+	if (size >= MAX_TALLOC_SIZE || pool_size >= MAX_TALLOC_SIZE) {
+		return NULL;
+	}
+
+	/* Pools don't nest. */
+	ptr = __talloc(context, TC_ALIGN(size) + TP_HDR_SIZE + pool_size, 0);
+	if (ptr == NULL) {
+		return NULL;
+	}
+
+	tc = talloc_chunk_from_ptr(ptr);
+	tc->size = size;
+
+	pool = (struct talloc_pool *)talloc_chunk_end(tc);
+	pool->tc = tc;
+	pool->start = pool->next = (char *)pool + TP_HDR_SIZE;
+	pool->end = pool->start + pool_size;
+	pool->objects = 1;
+
+	tc->pool = pool;
+	tc->flags |= TALLOC_FLAG_POOLED;
+	talloc_set_name_const(ptr, name);
+
+	return ptr;
+}
+
 
 /*
   setup a destructor to be called on free of a pointer
@@ -593,7 +744,11 @@ int talloc_free(void *ptr)
 
 	tc->flags |= TALLOC_FLAG_FREE;
 
-	free(tc);
+	if (tc->pool) {
+		talloc_pool_release(tc);
+	} else {
+		free(tc);
+	}
 	return 0;
 }
 
@@ -630,21 +785,28 @@ void *_talloc_realloc(const void *context, void *ptr, size_t size, const char *n
 		return NULL;
 	}
 
-	/* by resetting magic we catch users of the old memory */
-	tc->flags |= TALLOC_FLAG_FREE;
+	if (tc->pool) {
+		new_ptr = talloc_pool_realloc(tc, size);
+		if (!new_ptr) {
+			return NULL;
+		}
+	} else {
+		/* by resetting magic we catch users of the old memory */
+		tc->flags |= TALLOC_FLAG_FREE;
 
 #if ALWAYS_REALLOC
-	new_ptr = malloc(size + TC_HDR_SIZE);
-	if (new_ptr) {
-		memcpy(new_ptr, tc, tc->size + TC_HDR_SIZE);
-		free(tc);
-	}
+		new_ptr = malloc(size + TC_HDR_SIZE);
+		if (new_ptr) {
+			memcpy(new_ptr, tc, tc->size + TC_HDR_SIZE);
+			free(tc);
+		}
 #else
-	new_ptr = realloc(tc, size + TC_HDR_SIZE);
+		new_ptr = realloc(tc, size + TC_HDR_SIZE);
 #endif
-	if (!new_ptr) {	
-		tc->flags &= ~TALLOC_FLAG_FREE; 
-		return NULL; 
+		if (!new_ptr) {	
+			tc->flags &= ~TALLOC_FLAG_FREE; 
+			return NULL; 
+		}
 	}
 
 	tc = new_ptr;
@@ -700,6 +862,7 @@ void *talloc_steal(const void *new_ctx, const void *ptr)
 		}
 		
 		tc->parent = tc->next = tc->prev = NULL;
+		tc->flags &= ~TALLOC_FLAG_POOLED;
 		return discard_const_p(void, ptr);
 	}
 
@@ -723,6 +886,11 @@ void *talloc_steal(const void *new_ctx, const void *ptr)
 	if (new_tc->child) new_tc->child->parent = NULL;
 	_TLIST_ADD(new_tc->child, tc);
 
+	/* Don't have the pool grow into the new context. */
+	if (!(new_tc->flags & TALLOC_FLAG_POOLED) || new_tc->pool != tc->pool) {
+		tc->flags &= ~TALLOC_FLAG_POOLED;
+	}
+
 	return discard_const_p(void, ptr);
 }
 
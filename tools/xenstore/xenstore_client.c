@@ -128,8 +128,9 @@ static int show_whole_path = 0;
 
 static void do_ls(struct xs_handle *h, char *path, int cur_depth, int show_perms)
 {
-    char **e;
-    char *newpath, *val;
+    struct xs_dir_value *e;
+    char *newpath;
+    const char *val;
     int newpath_len;
     int i;
     unsigned int num, len;
@@ -138,9 +139,9 @@ static void do_ls(struct xs_handle *h, char *path, int cur_depth, int show_perms
     if (!newpath)
       err(1, "malloc in do_ls");
 
-    e = xs_directory(h, XBT_NULL, path, &num);
+    e = xs_directory_values(h, XBT_NULL, path, &num);
     if (e == NULL)
-        err(1, "xs_directory (%s)", path);
+        err(1, "xs_directory_values (%s)", path);
 
     for (i = 0; i<num; i++) {
         char buf[MAX_STRLEN(unsigned int)+1];
@@ -151,7 +152,7 @@ static void do_ls(struct xs_handle *h, char *path, int cur_depth, int show_perms
         /* Compose fullpath */
         newpath_len = snprintf(newpath, STRING_MAX, "%s%s%s", path,
                 path[strlen(path)-1] == '/' ? "" : "/", 
-                e[i]);
+                e[i].name);
 
         /* Print indent and path basename */
         linewid = 0;
@@ -162,12 +163,13 @@ static void do_ls(struct xs_handle *h, char *path, int cur_depth, int show_perms
                 putchar(' ');
             }
             linewid += printf("%.*s",
-                              (int) (max_width - TAG_LEN - linewid), e[i]);
+                              (int) (max_width - TAG_LEN - linewid), e[i].name);
         }
 
-	/* Fetch value */
+	/* Value came along with the directory */
         if ( newpath_len < STRING_MAX ) {
-            val = xs_read(h, XBT_NULL, newpath, &len);
+            val = e[i].value;
+            len = e[i].len;
         }
         else {
             /* Path was truncated and thus invalid */
@@ -197,12 +199,11 @@ static void do_ls(struct xs_handle *h, char *path, int cur_depth, int show_perms
                 }
             }
         }
-        free(val);
 
         if (show_perms) {
             perms = xs_get_permissions(h, XBT_NULL, newpath, &nperms);
             if (perms == NULL) {
-                warn("\ncould not access permissions for %s", e[i]);
+                warn("\ncould not access permissions for %s", e[i].name);
             }
             else {
                 int i;
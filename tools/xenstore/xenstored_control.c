@@ -25,6 +25,8 @@
 #include "talloc.h"
 #include "xenstored_core.h"
 #include "xenstored_control.h"
+#include "xenstored_mirror.h"
+#include "xenstored_transaction.h"
 
 struct cmd_s {
 	char *cmd;
@@ -127,14 +129,93 @@ static int do_control_print(void *ctx, struct connection *conn,
 	return 0;
 }
 
+static int do_control_connections(void *ctx, struct connection *conn,
+				   char **vec, int num)
+{
+	struct connection *c;
+	char *resp;
+
+	if (num)
+		return EINVAL;
+
+	resp = talloc_strdup(ctx, "");
+	list_for_each_entry(c, &connections, list) {
+		if (!resp)
+			break;
+		if (c->domain)
+			resp = talloc_asprintf_append(resp, "domain %u", c->id);
+		else
+			resp = talloc_asprintf_append(resp, "socket %d", c->fd);
+		if (!resp)
+			break;
+		resp = talloc_asprintf_append(resp,
+			": queued %u max %u, sent %lu in %lu writes\n",
+			c->out_queued, c->out_queued_max, c->out_msgs,
+			c->out_writes);
+	}
+	if (!resp)
+		return ENOMEM;
+
+	send_reply(conn, XS_CONTROL, resp, strlen(resp));
+	return 0;
+}
+
+static int do_control_transactions(void *ctx, struct connection *conn,
+				    char **vec, int num)
+{
+	char *resp;
+
+	if (num)
+		return EINVAL;
+
+	resp = transaction_stats(ctx);
+	if (!resp)
+		return ENOMEM;
+
+	send_reply(conn, XS_CONTROL, resp, strlen(resp));
+	return 0;
+}
+
+static int do_control_mirror(void *ctx, struct connection *conn,
+			     char **vec, int num)
+{
+	char *resp;
+	int ret;
+
+	if (num == 0) {
+		resp = mirror_list(ctx);
+		if (!resp)
+			return ENOMEM;
+		send_reply(conn, XS_CONTROL, resp, strlen(resp));
+		return 0;
+	}
+
+	if (num != 2)
+		return EINVAL;
+	if (!strcmp(vec[0], "add"))
+		ret = mirror_add(vec[1]);
+	else if (!strcmp(vec[0], "del"))
+		ret = mirror_del(vec[1]);
+	else
+		return EINVAL;
+	if (ret)
+		return ret;
+
+	send_ack(conn, XS_CONTROL);
+	return 0;
+}
+
 static int do_control_help(void *, struct connection *, char **, int);
 
 static struct cmd_s cmds[] = {
 	{ "check", do_control_check, "" },
+	{ "connections", do_control_connections, "" },
 	{ "log", do_control_log, "on|off" },
 	{ "logfile", do_control_logfile, "<file>" },
 	{ "memreport", do_control_memreport, "[<file>]" },
+	{ "mirror", do_control_mirror, "[add|del <path>]" },
 	{ "print", do_control_print, "<string>" },
+	{ "transactions", do_control_transactions, "" },
 	{ "help", do_control_help, "" },
 };
 
@@ -20,11 +20,15 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 #ifndef NO_SOCKETS
 #include <sys/socket.h>
 #include <sys/un.h>
 #endif
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -52,6 +56,7 @@
 #include "xenstored_transaction.h"
 #include "xenstored_domain.h"
 #include "xenstored_control.h"
+#include "xenstored_mirror.h"
 #include "tdb.h"
 
 #ifndef NO_SOCKETS
@@ -65,21 +70,13 @@
 #endif
 
 extern xenevtchn_handle *xce_handle; /* in xenstored_domain.c */
-static int xce_pollfd_idx = -1;
-static struct pollfd *fds;
-static unsigned int current_array_size;
-static unsigned int nr_fds;
-
-#define ROUNDUP(_x, _w) (((unsigned long)(_x)+(1UL<<(_w))-1) & ~((1UL<<(_w))-1))
 
 static bool verbose = false;
 LIST_HEAD(connections);
 int tracefd = -1;
 static bool recovery = true;
 static int reopen_log_pipe[2];
-static int reopen_log_pipe0_pollfd_idx = -1;
 char *tracefile = NULL;
-TDB_CONTEXT *tdb_ctx = NULL;
 
 static const char *sockmsg_string(enum xsd_sockmsg_type type);
 
@@ -204,162 +201,309 @@ void reopen_log(void)
 	}
 }
 
+/* Upper bound of iovecs (two per message) passed to conn->write(). */
+#define WRITE_IOV_MAX	64
+
+/*
+ * Write out as many queued messages as the connection takes in one go:
+ * for domains this fills the ring with a single notification, for sockets
+ * it's a single writev().
+ */
 static bool write_messages(struct connection *conn)
 {
-	int ret;
+	struct iovec iov[WRITE_IOV_MAX];
 	struct buffered_data *out;
+	unsigned int niov = 0, len;
+	int ret;
 
-	out = list_top(&conn->out_list, struct buffered_data, list);
-	if (out == NULL)
-		return true;
+	list_for_each_entry(out, &conn->out_list, list) {
+		if (niov + 2 > ARRAY_SIZE(iov))
+			break;
 
-	if (out->inhdr) {
-		if (verbose)
-			xprintf("Writing msg %s (%.*s) out to %p\n",
-				sockmsg_string(out->hdr.msg.type),
-				out->hdr.msg.len,
-				out->buffer, conn);
-		ret = conn->write(conn, out->hdr.raw + out->used,
-				  sizeof(out->hdr) - out->used);
-		if (ret < 0)
-			return false;
-
-		out->used += ret;
-		if (out->used < sizeof(out->hdr))
-			return true;
-
-		out->inhdr = false;
-		out->used = 0;
-
-		/* Second write might block if non-zero. */
-		if (out->hdr.msg.len && !conn->domain)
-			return true;
+		if (out->inhdr) {
+			if (verbose && !out->used)
+				xprintf("Writing msg %s (%.*s) out to %p\n",
+					sockmsg_string(out->hdr.msg.type),
+					out->hdr.msg.len,
+					out->buffer, conn);
+			iov[niov].iov_base = out->hdr.raw + out->used;
+			iov[niov].iov_len = sizeof(out->hdr) - out->used;
+			niov++;
+			if (!out->hdr.msg.len)
+				continue;
+			iov[niov].iov_base = out->buffer;
+			iov[niov].iov_len = out->hdr.msg.len;
+		} else {
+			iov[niov].iov_base = out->buffer + out->used;
+			iov[niov].iov_len = out->hdr.msg.len - out->used;
+		}
+		niov++;
 	}
 
-	ret = conn->write(conn, out->buffer + out->used,
-			  out->hdr.msg.len - out->used);
+	if (!niov)
+		return true;
+
+	ret = conn->write(conn, iov, niov);
 	if (ret < 0)
 		return false;
+	if (ret)
+		conn->out_writes++;
+
+	/* Consume what has been written. */
+	while ((out = list_top(&conn->out_list, struct buffered_data, list))) {
+		if (out->inhdr) {
+			len = MIN((unsigned int)ret, sizeof(out->hdr) - out->used);
+			out->used += len;
+			ret -= len;
+			if (out->used < sizeof(out->hdr))
+				break;
 
-	out->used += ret;
-	if (out->used != out->hdr.msg.len)
-		return true;
+			out->inhdr = false;
+			out->used = 0;
+		}
 
-	trace_io(conn, out, 1);
+		len = MIN((unsigned int)ret, out->hdr.msg.len - out->used);
+		out->used += len;
+		ret -= len;
+		if (out->used != out->hdr.msg.len)
+			break;
 
-	list_del(&out->list);
-	talloc_free(out);
+		trace_io(conn, out, 1);
+
+		list_del(&out->list);
+		talloc_free(out);
+		conn->out_queued--;
+		conn->out_msgs++;
+	}
 
 	return true;
 }
 
-static int destroy_conn(void *_conn)
+/*
+ * The file descriptors we wait for events on, indexed by fd.  Each is
+ * either a socket connection or one of xenstored's own fds, which have a
+ * handler called directly on events.
+ */
+struct poll_fd {
+	struct connection *conn;
+	void (*handler)(int fd, short revents);
+	short events;
+};
+static struct poll_fd *poll_fds;
+static unsigned int nr_poll_fds;
+
+/*
+ * Connections which may have work to do.  Domain connections get added
+ * when their event channel fires or output gets queued for them, socket
+ * connections when their fd got events or their output queue changed.
+ */
+static LIST_HEAD(ready_connections);
+
+static void poll_fd_event(int fd, short revents);
+
+#ifdef __linux__
+static int epoll_fd = -1;
+
+static void poll_init(void)
 {
-	struct connection *conn = _conn;
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+		barf_perror("Failed to create epoll instance");
+}
 
-	/* Flush outgoing if possible, but don't block. */
-	if (!conn->domain) {
-		struct pollfd pfd;
-		pfd.fd = conn->fd;
-		pfd.events = POLLOUT;
+static int poll_backend_set(int fd, short old, short events)
+{
+	struct epoll_event ev = { .events = 0, .data.fd = fd };
+	int op;
 
-		while (!list_empty(&conn->out_list)
-		       && poll(&pfd, 1, 0) == 1)
-			if (!write_messages(conn))
-				break;
-		close(conn->fd);
+	if (!old && !events)
+		return 0;
+	op = !old ? EPOLL_CTL_ADD : !events ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+
+	if (events & POLLIN)
+		ev.events |= EPOLLIN;
+	if (events & POLLPRI)
+		ev.events |= EPOLLPRI;
+	if (events & POLLOUT)
+		ev.events |= EPOLLOUT;
+
+	return epoll_ctl(epoll_fd, op, fd, &ev);
+}
+
+static int poll_wait(int timeout)
+{
+	struct epoll_event evs[64];
+	int i, n;
+	short revents;
+
+	n = epoll_wait(epoll_fd, evs, ARRAY_SIZE(evs), timeout);
+	if (n < 0)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		revents = 0;
+		if (evs[i].events & EPOLLIN)
+			revents |= POLLIN;
+		if (evs[i].events & EPOLLPRI)
+			revents |= POLLPRI;
+		if (evs[i].events & EPOLLOUT)
+			revents |= POLLOUT;
+		if (evs[i].events & EPOLLERR)
+			revents |= POLLERR;
+		if (evs[i].events & EPOLLHUP)
+			revents |= POLLHUP;
+		poll_fd_event(evs[i].data.fd, revents);
 	}
-        if (conn->target)
-                talloc_unlink(conn, conn->target);
-	list_del(&conn->list);
-	trace_destroy(conn, "connection");
+
 	return 0;
 }
+#else
+static void poll_init(void)
+{
+}
 
-/* This function returns index inside the array if succeed, -1 if fail */
-static int set_fd(int fd, short events)
+static int poll_backend_set(int fd, short old, short events)
 {
-	int ret;
-	if (current_array_size < nr_fds + 1) {
-		struct pollfd *new_fds = NULL;
-		unsigned long newsize;
+	return 0;
+}
 
-		/* Round up to 2^8 boundary, in practice this just
-		 * make newsize larger than current_array_size.
-		 */
-		newsize = ROUNDUP(nr_fds + 1, 8);
+/* Without epoll, the pollfd array is rebuilt on each call. */
+static int poll_wait(int timeout)
+{
+	static struct pollfd *fds;
+	static unsigned int fds_size;
+	unsigned int fd, nr = 0, i;
 
-		new_fds = realloc(fds, sizeof(struct pollfd)*newsize);
-		if (!new_fds)
-			goto fail;
+	if (fds_size < nr_poll_fds) {
+		struct pollfd *new_fds;
+
+		new_fds = realloc(fds, sizeof(*fds) * nr_poll_fds);
+		if (!new_fds) {
+			errno = ENOMEM;
+			return -1;
+		}
 		fds = new_fds;
+		fds_size = nr_poll_fds;
+	}
 
-		memset(&fds[0] + current_array_size, 0,
-		       sizeof(struct pollfd ) * (newsize-current_array_size));
-		current_array_size = newsize;
+	for (fd = 0; fd < nr_poll_fds; fd++) {
+		if (!poll_fds[fd].events)
+			continue;
+		fds[nr].fd = fd;
+		fds[nr].events = poll_fds[fd].events;
+		fds[nr].revents = 0;
+		nr++;
 	}
 
-	fds[nr_fds].fd = fd;
-	fds[nr_fds].events = events;
-	ret = nr_fds;
-	nr_fds++;
+	if (poll(fds, nr, timeout) < 0)
+		return -1;
 
-	return ret;
-fail:
-	syslog(LOG_ERR, "realloc failed, ignoring fd %d\n", fd);
-	return -1;
+	for (i = 0; i < nr; i++)
+		if (fds[i].revents)
+			poll_fd_event(fds[i].fd, fds[i].revents);
+
+	return 0;
+}
+#endif
+
+/*
+ * Start, change or (with events == 0) stop waiting for events on fd.
+ * Returns 0, or -1 with errno set.
+ */
+static int poll_fd_set(int fd, struct connection *conn,
+		       void (*handler)(int fd, short revents), short events)
+{
+	if (fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if (fd >= nr_poll_fds) {
+		struct poll_fd *new_fds;
+		unsigned int nr = (fd + 64) & ~63;
+
+		if (!events)
+			return 0;
+
+		new_fds = realloc(poll_fds, sizeof(*poll_fds) * nr);
+		if (!new_fds) {
+			errno = ENOMEM;
+			return -1;
+		}
+		memset(new_fds + nr_poll_fds, 0,
+		       sizeof(*poll_fds) * (nr - nr_poll_fds));
+		poll_fds = new_fds;
+		nr_poll_fds = nr;
+	}
+
+	if (poll_backend_set(fd, poll_fds[fd].events, events))
+		return -1;
+
+	poll_fds[fd].conn = events ? conn : NULL;
+	poll_fds[fd].handler = events ? handler : NULL;
+	poll_fds[fd].events = events;
+
+	return 0;
 }
 
-static void initialize_fds(int sock, int *p_sock_pollfd_idx,
-			   int ro_sock, int *p_ro_sock_pollfd_idx,
-			   int *ptimeout)
+static short poll_fd_events(int fd)
 {
-	struct connection *conn;
-	struct wrl_timestampt now;
+	return (fd >= 0 && fd < nr_poll_fds) ? poll_fds[fd].events : 0;
+}
 
-	if (fds)
-		memset(fds, 0, sizeof(struct pollfd) * current_array_size);
-	nr_fds = 0;
+void conn_set_ready(struct connection *conn)
+{
+	if (list_empty(&conn->ready_list))
+		list_add_tail(&conn->ready_list, &ready_connections);
+}
 
-	*ptimeout = -1;
+static void poll_fd_event(int fd, short revents)
+{
+	struct poll_fd *pfd;
 
-	if (sock != -1)
-		*p_sock_pollfd_idx = set_fd(sock, POLLIN|POLLPRI);
-	if (ro_sock != -1)
-		*p_ro_sock_pollfd_idx = set_fd(ro_sock, POLLIN|POLLPRI);
-	if (reopen_log_pipe[0] != -1)
-		reopen_log_pipe0_pollfd_idx =
-			set_fd(reopen_log_pipe[0], POLLIN|POLLPRI);
+	if (fd >= nr_poll_fds)
+		return;
 
-	if (xce_handle != NULL)
-		xce_pollfd_idx = set_fd(xenevtchn_fd(xce_handle),
-					POLLIN|POLLPRI);
+	pfd = &poll_fds[fd];
+	if (pfd->conn) {
+		pfd->conn->revents |= revents;
+		conn_set_ready(pfd->conn);
+	} else if (pfd->handler)
+		pfd->handler(fd, revents);
+}
 
-	wrl_gettime_now(&now);
-	wrl_log_periodic(now);
+static int destroy_conn(void *_conn)
+{
+	struct connection *conn = _conn;
 
-	list_for_each_entry(conn, &connections, list) {
-		if (conn->domain) {
-			wrl_check_timeout(conn->domain, now, ptimeout);
-			if (domain_can_read(conn) ||
-			    (domain_can_write(conn) &&
-			     !list_empty(&conn->out_list)))
-				*ptimeout = 0;
-		} else {
-			short events = POLLIN|POLLPRI;
-			if (!list_empty(&conn->out_list))
-				events |= POLLOUT;
-			conn->pollfd_idx = set_fd(conn->fd, events);
-		}
+	/* Flush outgoing if possible, but don't block. */
+	if (!conn->domain) {
+		struct pollfd pfd;
+		pfd.fd = conn->fd;
+		pfd.events = POLLOUT;
+
+		while (!list_empty(&conn->out_list)
+		       && poll(&pfd, 1, 0) == 1)
+			if (!write_messages(conn))
+				break;
+		poll_fd_set(conn->fd, NULL, NULL, 0);
+		close(conn->fd);
 	}
+	list_del(&conn->ready_list);
+        if (conn->target)
+                talloc_unlink(conn, conn->target);
+	list_del(&conn->list);
+	trace_destroy(conn, "connection");
+	return 0;
 }
 
 /*
  * If it fails, returns NULL and sets errno.
  * Temporary memory allocations will be done with ctx.
  */
-static struct node *read_node(struct connection *conn, const void *ctx,
-			      const char *name)
+static struct node *read_node_access(struct connection *conn,
+				     const void *ctx, const char *name,
+				     enum node_access_type type)
 {
 	TDB_DATA key, data;
 	struct xs_tdb_record_hdr *hdr;
@@ -380,17 +524,15 @@ static struct node *read_node(struct connection *conn, const void *ctx,
 	if (transaction_prepend(conn, name, &key))
 		return NULL;
 
-	data = tdb_fetch(tdb_ctx, key);
+	data = db_fetch(key);
 
 	if (data.dptr == NULL) {
-		if (tdb_error(tdb_ctx) == TDB_ERR_NOEXIST) {
+		if (errno == ENOENT) {
 			node->generation = NO_GENERATION;
-			access_node(conn, node, NODE_ACCESS_READ, NULL);
+			access_node(conn, node, type, NULL);
 			errno = ENOENT;
-		} else {
-			log("TDB error on read: %s", tdb_errorstr(tdb_ctx));
-			errno = EIO;
-		}
+		} else
+			log("DB error on read: %s", strerror(errno));
 		talloc_free(node);
 		return NULL;
 	}
@@ -412,16 +554,23 @@ static struct node *read_node(struct connection *conn, const void *ctx,
 	/* Children is strings, nul separated. */
 	node->children = node->data + node->datalen;
 
-	access_node(conn, node, NODE_ACCESS_READ, NULL);
+	access_node(conn, node, type, NULL);
 
 	return node;
 }
 
+static struct node *read_node(struct connection *conn, const void *ctx,
+			      const char *name)
+{
+	return read_node_access(conn, ctx, name, NODE_ACCESS_READ);
+}
+
 int write_node_raw(struct connection *conn, TDB_DATA *key, struct node *node)
 {
 	TDB_DATA data;
 	void *p;
 	struct xs_tdb_record_hdr *hdr;
+	int ret;
 
 	data.dsize = sizeof(*hdr)
 		+ node->num_perms*sizeof(node->perms[0])
@@ -446,8 +595,11 @@ int write_node_raw(struct connection *conn, TDB_DATA *key, struct node *node)
 	p += node->datalen;
 	memcpy(p, node->children, node->childlen);
 
-	/* TDB should set errno, but doesn't even set ecode AFAICT. */
-	if (tdb_store(tdb_ctx, *key, data, TDB_REPLACE) != 0) {
+	ret = db_store(*key, data);
+	talloc_free(data.dptr);
+	if (ret) {
+		if (errno == ENOMEM)
+			return errno;
 		corrupt(conn, "Write of %s failed", key->dptr);
 		errno = EIO;
 		return errno;
@@ -455,16 +607,22 @@ int write_node_raw(struct connection *conn, TDB_DATA *key, struct node *node)
 	return 0;
 }
 
-static int write_node(struct connection *conn, struct node *node)
+static int write_node_access(struct connection *conn, struct node *node,
+			     enum node_access_type type)
 {
 	TDB_DATA key;
 
-	if (access_node(conn, node, NODE_ACCESS_WRITE, &key))
+	if (access_node(conn, node, type, &key))
 		return errno;
 
 	return write_node_raw(conn, &key, node);
 }
 
+static int write_node(struct connection *conn, struct node *node)
+{
+	return write_node_access(conn, node, NODE_ACCESS_WRITE);
+}
+
 static enum xs_perm_type perm_for_conn(struct connection *conn,
 				       struct xs_permissions *perms,
 				       unsigned int num)
@@ -602,6 +760,20 @@ static struct buffered_data *new_buffer(void *ctx)
 	return data;
 }
 
+static struct buffered_data *new_request(struct connection *conn)
+{
+	struct buffered_data *data;
+
+	data = talloc_pooled_object(conn, struct buffered_data,
+				    REQUEST_ARENA_SIZE);
+	if (data == NULL)
+		return NULL;
+
+	memset(data, 0, sizeof(*data));
+	data->inhdr = true;
+	return data;
+}
+
 /* Return length of string (including nul) at this offset.
  * If there is no nul, returns 0 for failure.
  */
@@ -706,6 +878,9 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 
 	/* Queue for later transmission. */
 	list_add_tail(&bdata->list, &conn->out_list);
+	if (++conn->out_queued > conn->out_queued_max)
+		conn->out_queued_max = conn->out_queued;
+	conn_set_ready(conn);
 
 	return;
 }
@@ -871,6 +1046,87 @@ static int send_directory_part(struct connection *conn,
 	return 0;
 }
 
+/*
+ * Like send_directory_part(), but with each child name followed by the
+ * length of its value and the value itself.  The length is left empty for
+ * children which can't be read, or whose value doesn't fit into a reply.
+ */
+static int send_directory_values(struct connection *conn,
+				 struct buffered_data *in)
+{
+	unsigned int off, len, genlen, namelen, lenlen, entlen;
+	char *child, *data, *path;
+	struct node *node, *cnode;
+	char gen[24], lenstr[12];
+
+	if (xs_count_strings(in->buffer, in->used) != 2)
+		return EINVAL;
+
+	/* First arg is node name. */
+	node = get_node_canonicalized(conn, in, in->buffer, NULL, XS_PERM_READ);
+	if (!node)
+		return errno;
+
+	/* Second arg is childlist offset. */
+	off = atoi(in->buffer + strlen(in->buffer) + 1);
+
+	genlen = snprintf(gen, sizeof(gen), "%"PRIu64, node->generation) + 1;
+
+	data = talloc_array(in, char, XENSTORE_PAYLOAD_MAX);
+	if (!data)
+		return ENOMEM;
+	memcpy(data, gen, genlen);
+	len = genlen;
+
+	for (child = node->children + off;
+	     child < node->children + node->childlen;
+	     child += namelen) {
+		namelen = strlen(child) + 1;
+
+		path = talloc_asprintf(in, "%s/%s",
+				       strcmp(node->name, "/") ? node->name : "",
+				       child);
+		cnode = path ? get_node(conn, in, path, XS_PERM_READ) : NULL;
+		lenlen = cnode ? snprintf(lenstr, sizeof(lenstr), "%u",
+					  cnode->datalen) + 1 : 1;
+		entlen = namelen + lenlen + (cnode ? cnode->datalen : 0);
+
+		/* Leave room for the terminating empty name. */
+		if (len + entlen >= XENSTORE_PAYLOAD_MAX) {
+			if (len > genlen) {
+				talloc_free(cnode);
+				talloc_free(path);
+				break;
+			}
+			/* Don't let a large value stall the listing. */
+			talloc_free(cnode);
+			cnode = NULL;
+			lenlen = 1;
+			entlen = namelen + lenlen;
+		}
+
+		memcpy(data + len, child, namelen);
+		len += namelen;
+		if (cnode) {
+			memcpy(data + len, lenstr, lenlen);
+			memcpy(data + len + lenlen, cnode->data, cnode->datalen);
+		} else
+			data[len] = 0;
+		len += entlen - namelen;
+
+		talloc_free(cnode);
+		talloc_free(path);
+	}
+
+	/* End of list: add an empty name. */
+	if (child >= node->children + node->childlen)
+		data[len++] = 0;
+
+	send_reply(conn, XS_DIRECTORY_VALUES, data, len);
+
+	return 0;
+}
+
 static int do_read(struct connection *conn, struct buffered_data *in)
 {
 	struct node *node;
@@ -891,7 +1147,7 @@ static void delete_node_single(struct connection *conn, struct node *node)
 	if (access_node(conn, node, NODE_ACCESS_DELETE, &key))
 		return;
 
-	if (tdb_delete(tdb_ctx, key) != 0) {
+	if (db_delete(key) != 0) {
 		corrupt(conn, "Could not delete '%s'", node->name);
 		return;
 	}
@@ -917,7 +1173,8 @@ static struct node *construct_node(struct connection *conn, const void *ctx,
 		return NULL;
 
 	/* If parent doesn't exist, create it. */
-	parent = read_node(conn, parentname, parentname);
+	parent = read_node_access(conn, parentname, parentname,
+				  NODE_ACCESS_READ_CHILDREN);
 	if (!parent)
 		parent = construct_node(conn, ctx, parentname);
 	if (!parent)
@@ -979,7 +1236,7 @@ static int destroy_node(void *_node)
 	key.dptr = (void *)node->name;
 	key.dsize = strlen(node->name);
 
-	tdb_delete(tdb_ctx, key);
+	db_delete(key);
 	return 0;
 }
 
@@ -999,7 +1256,8 @@ static struct node *create_node(struct connection *conn, const void *ctx,
 	/* We write out the nodes down, setting destructor in case
 	 * something goes wrong. */
 	for (i = node; i; i = i->parent) {
-		if (write_node(conn, i)) {
+		if (write_node_access(conn, i, i == node ? NODE_ACCESS_WRITE :
+					       NODE_ACCESS_WRITE_CHILDREN)) {
 			domain_entry_dec(conn, i);
 			return NULL;
 		}
@@ -1115,7 +1373,7 @@ static int remove_child_entry(struct connection *conn, struct node *node,
 	size_t childlen = strlen(node->children + offset);
 	memdel(node->children, offset, childlen + 1, node->childlen);
 	node->childlen -= childlen + 1;
-	return write_node(conn, node);
+	return write_node_access(conn, node, NODE_ACCESS_WRITE_CHILDREN);
 }
 
 
@@ -1146,7 +1404,8 @@ static int _rm(struct connection *conn, const void *ctx, struct node *node,
 	if (!parentname)
 		return errno;
 
-	parent = read_node(conn, ctx, parentname);
+	parent = read_node_access(conn, ctx, parentname,
+				  NODE_ACCESS_READ_CHILDREN);
 	if (!parent)
 		return (errno == ENOMEM) ? ENOMEM : EINVAL;
 
@@ -1290,6 +1549,7 @@ static struct {
 	[XS_SET_TARGET]        = { "SET_TARGET",        do_set_target },
 	[XS_RESET_WATCHES]     = { "RESET_WATCHES",     do_reset_watches },
 	[XS_DIRECTORY_PART]    = { "DIRECTORY_PART",    send_directory_part },
+	[XS_DIRECTORY_VALUES]  = { "DIRECTORY_VALUES",  send_directory_values },
 };
 
 static const char *sockmsg_string(enum xsd_sockmsg_type type)
@@ -1350,7 +1610,7 @@ static void handle_input(struct connection *conn)
 	struct buffered_data *in;
 
 	if (!conn->in) {
-		conn->in = new_buffer(conn);
+		conn->in = new_request(conn);
 		/* In case of no memory just try it again next time. */
 		if (!conn->in)
 			return;
@@ -1410,6 +1670,101 @@ static void handle_output(struct connection *conn)
 		talloc_free(conn);
 }
 
+/*
+ * How long to wait for events: not at all if a ready connection can make
+ * progress, otherwise until the first rate limited domain may continue.
+ */
+static int ready_timeout(void)
+{
+	struct connection *conn;
+	struct wrl_timestampt now;
+	int timeout = -1;
+
+	wrl_gettime_now(&now);
+	wrl_log_periodic(now);
+
+	list_for_each_entry(conn, &ready_connections, ready_list) {
+		if (!conn->domain)
+			return 0;
+		wrl_check_timeout(conn->domain, now, &timeout);
+		if (domain_can_read(conn) ||
+		    (domain_can_write(conn) && !list_empty(&conn->out_list)))
+			return 0;
+	}
+
+	return timeout;
+}
+
+static void handle_ready_connection(struct connection *conn)
+{
+	short revents = conn->revents, events;
+
+	conn->revents = 0;
+
+	if (conn->domain) {
+		if (domain_can_read(conn))
+			handle_input(conn);
+		if (talloc_free(conn) == 0)
+			return;
+
+		talloc_increase_ref_count(conn);
+		if (domain_can_write(conn) &&
+		    !list_empty(&conn->out_list))
+			handle_output(conn);
+		if (talloc_free(conn) == 0)
+			return;
+
+		/* Come back while there is input or output left. */
+		if (domain_pending(conn))
+			conn_set_ready(conn);
+		return;
+	}
+
+	if (revents & ~(POLLIN|POLLOUT))
+		talloc_free(conn);
+	else if (revents & POLLIN)
+		handle_input(conn);
+	if (talloc_free(conn) == 0)
+		return;
+
+	talloc_increase_ref_count(conn);
+	if (revents & ~(POLLIN|POLLOUT))
+		talloc_free(conn);
+	else if (revents & POLLOUT)
+		handle_output(conn);
+	if (talloc_free(conn) == 0)
+		return;
+
+	events = POLLIN|POLLPRI;
+	if (!list_empty(&conn->out_list))
+		events |= POLLOUT;
+	if (events != poll_fd_events(conn->fd) &&
+	    poll_fd_set(conn->fd, conn, NULL, events)) {
+		syslog(LOG_ERR, "Failed to poll fd %d: %s\n", conn->fd,
+		       strerror(errno));
+		talloc_free(conn);
+	}
+}
+
+static void handle_ready_connections(void)
+{
+	LIST_HEAD(todo);
+	struct connection *conn;
+
+	/*
+	 * Connections freed meanwhile drop off the list.  Ones becoming
+	 * ready again are looked at on the next round.
+	 */
+	list_splice_init(&ready_connections, &todo);
+	while (!list_empty(&todo)) {
+		conn = list_entry(todo.next, struct connection, ready_list);
+		list_del_init(&conn->ready_list);
+
+		talloc_increase_ref_count(conn);
+		handle_ready_connection(conn);
+	}
+}
+
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read)
 {
 	struct connection *new;
@@ -1419,7 +1774,6 @@ struct connection *new_connection(connwritefn_t *write, connreadfn_t *read)
 		return NULL;
 
 	new->fd = -1;
-	new->pollfd_idx = -1;
 	new->write = write;
 	new->read = read;
 	new->can_write = true;
@@ -1427,8 +1781,11 @@ struct connection *new_connection(connwritefn_t *write, connreadfn_t *read)
 	INIT_LIST_HEAD(&new->out_list);
 	INIT_LIST_HEAD(&new->watches);
 	INIT_LIST_HEAD(&new->transaction_list);
+	INIT_LIST_HEAD(&new->ready_list);
 
 	list_add_tail(&new->list, &connections);
+	/* Socket connections get their fd registered once picked up. */
+	conn_set_ready(new);
 	talloc_set_destructor(new, destroy_conn);
 	trace_create(new, "connection");
 	return new;
@@ -1439,11 +1796,12 @@ static void accept_connection(int sock, bool canwrite)
 {
 }
 #else
-static int writefd(struct connection *conn, const void *data, unsigned int len)
+static int writefd(struct connection *conn, const struct iovec *iov,
+		   int iovcnt)
 {
 	int rc;
 
-	while ((rc = write(conn->fd, data, len)) < 0) {
+	while ((rc = writev(conn->fd, iov, iovcnt)) < 0) {
 		if (errno == EAGAIN) {
 			rc = 0;
 			break;
@@ -1460,10 +1818,8 @@ static int readfd(struct connection *conn, void *data, unsigned int len)
 	int rc;
 
 	while ((rc = read(conn->fd, data, len)) < 0) {
-		if (errno == EAGAIN) {
-			rc = 0;
-			break;
-		}
+		if (errno == EAGAIN)
+			return 0;
 		if (errno != EINTR)
 			break;
 	}
@@ -1486,6 +1842,12 @@ static void accept_connection(int sock, bool canwrite)
 	if (fd < 0)
 		return;
 
+	/* Never let a slow client block us. */
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+		close(fd);
+		return;
+	}
+
 	conn = new_connection(writefd, readfd);
 	if (conn) {
 		conn->fd = fd;
@@ -1495,7 +1857,8 @@ static void accept_connection(int sock, bool canwrite)
 }
 #endif
 
-static int tdb_flags;
+/* Keep a copy of the store in a TDB file? */
+static bool tdb_copy;
 
 /* We create initial nodes manually. */
 static void manual_node(const char *name, const char *child)
@@ -1543,17 +1906,16 @@ static void tdb_logger(TDB_CONTEXT *tdb, int level, const char * fmt, ...)
 static void setup_structure(void)
 {
 	char *tdbname;
-	tdbname = talloc_strdup(talloc_autofree_context(), xs_daemon_tdb());
-	if (!tdbname)
-		barf_perror("Could not create tdbname");
 
-	if (!(tdb_flags & TDB_INTERNAL))
-		unlink(tdbname);
+	if (tdb_copy) {
+		tdbname = talloc_strdup(talloc_autofree_context(),
+					xs_daemon_tdb());
+		if (!tdbname)
+			barf_perror("Could not create tdbname");
 
-	tdb_ctx = tdb_open_ex(tdbname, 7919, tdb_flags, O_RDWR|O_CREAT|O_EXCL,
-			      0640, &tdb_logger, NULL);
-	if (!tdb_ctx)
-		barf_perror("Could not create tdb file %s", tdbname);
+		if (!db_open_tdb(tdbname, 0, &tdb_logger))
+			barf_perror("Could not create tdb file %s", tdbname);
+	}
 
 	manual_node("/", "tool");
 	manual_node("/tool", "xenstored");
@@ -1709,8 +2071,7 @@ static int check_store_(const char *name, struct hashtable *reachable)
 /**
  * Helper to clean_store below.
  */
-static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
-			void *private)
+static int clean_store_(TDB_DATA key, TDB_DATA val, void *private)
 {
 	struct hashtable *reachable = private;
 	char *slash;
@@ -1729,7 +2090,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
 	if (!hashtable_search(reachable, name)) {
 		log("clean_store: '%s' is orphaned!", name);
 		if (recovery) {
-			tdb_delete(tdb, key);
+			db_delete(key);
 		}
 	}
 
@@ -1745,7 +2106,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
  */
 static void clean_store(struct hashtable *reachable)
 {
-	tdb_traverse(tdb_ctx, &clean_store_, reachable);
+	db_traverse(&clean_store_, reachable);
 }
 
 
@@ -1878,7 +2239,12 @@ static void usage(void)
 "  -t, --transaction <nb>  limit the number of transaction allowed per domain,\n"
 "  -R, --no-recovery       to request that no recovery should be attempted when\n"
 "                          the store is corrupted (debug only),\n"
-"  -I, --internal-db       store database in memory, not on disk\n"
+"  -I, --internal-db       store database in memory only (default),\n"
+"  -C, --tdb-copy          also keep a copy of the database on disk, e.g. for\n"
+"                          xs_tdb_dump,\n"
+"  -M, --mirror            mirror nodes added via \"xenstore-control mirror\"\n"
+"                          for clients on the local sockets to read them\n"
+"                          without asking xenstored,\n"
 "  -V, --verbose           to request verbose execution.\n");
 }
 
@@ -1889,6 +2255,7 @@ static struct option options[] = {
 	{ "pid-file", 1, NULL, 'F' },
 	{ "event", 1, NULL, 'e' },
 	{ "master-domid", 1, NULL, 'm' },
+	{ "mirror", 0, NULL, 'M' },
 	{ "help", 0, NULL, 'H' },
 	{ "no-fork", 0, NULL, 'N' },
 	{ "priv-domid", 1, NULL, 'p' },
@@ -1898,10 +2265,59 @@ static struct option options[] = {
 	{ "transaction", 1, NULL, 't' },
 	{ "no-recovery", 0, NULL, 'R' },
 	{ "internal-db", 0, NULL, 'I' },
+	{ "tdb-copy", 0, NULL, 'C' },
 	{ "verbose", 0, NULL, 'V' },
 	{ "watch-nb", 1, NULL, 'W' },
 	{ NULL, 0, NULL, 0 } };
 
+static void handle_sock(int fd, short revents)
+{
+	if (revents & ~POLLIN)
+		barf_perror("sock poll failed");
+	accept_connection(fd, true);
+}
+
+static void handle_ro_sock(int fd, short revents)
+{
+	if (revents & ~POLLIN)
+		barf_perror("ro sock poll failed");
+	accept_connection(fd, false);
+}
+
+static void handle_reopen_log_pipe(int fd, short revents);
+
+static void watch_reopen_log_pipe(void)
+{
+	if (reopen_log_pipe[0] != -1 &&
+	    poll_fd_set(reopen_log_pipe[0], NULL, handle_reopen_log_pipe,
+			POLLIN|POLLPRI))
+		barf_perror("Failed to poll log pipe");
+}
+
+static void handle_reopen_log_pipe(int fd, short revents)
+{
+	char c;
+
+	if (revents & ~POLLIN) {
+		poll_fd_set(fd, NULL, NULL, 0);
+		close(reopen_log_pipe[0]);
+		close(reopen_log_pipe[1]);
+		init_pipe(reopen_log_pipe);
+		watch_reopen_log_pipe();
+	} else {
+		if (read(reopen_log_pipe[0], &c, 1) != 1)
+			barf_perror("read failed");
+		reopen_log();
+	}
+}
+
+static void handle_xce(int fd, short revents)
+{
+	if (revents & ~POLLIN)
+		barf_perror("xce_handle poll failed");
+	handle_event();
+}
+
 extern void dump_conn(struct connection *conn); 
 int dom0_domid = 0;
 int dom0_event = 0;
@@ -1910,15 +2326,13 @@ int priv_domid = 0;
 int main(int argc, char *argv[])
 {
 	int opt, *sock = NULL, *ro_sock = NULL;
-	int sock_pollfd_idx = -1, ro_sock_pollfd_idx = -1;
 	bool dofork = true;
 	bool outputpid = false;
 	bool no_domain_init = false;
+	bool use_mirror = false;
 	const char *pidfile = NULL;
-	int timeout;
 
-
-	while ((opt = getopt_long(argc, argv, "DE:F:HNPS:t:T:RVW:", options,
+	while ((opt = getopt_long(argc, argv, "CDE:F:HMNPS:t:T:RVW:", options,
 				  NULL)) != -1) {
 		switch (opt) {
 		case 'D':
@@ -1933,6 +2347,9 @@ int main(int argc, char *argv[])
 		case 'H':
 			usage();
 			return 0;
+		case 'M':
+			use_mirror = true;
+			break;
 		case 'N':
 			dofork = false;
 			break;
@@ -1951,8 +2368,11 @@ int main(int argc, char *argv[])
 		case 'T':
 			tracefile = optarg;
 			break;
+		case 'C':
+			tdb_copy = true;
+			break;
 		case 'I':
-			tdb_flags = TDB_INTERNAL|TDB_NOLOCK;
+			tdb_copy = false;
 			break;
 		case 'V':
 			verbose = true;
@@ -2004,6 +2424,8 @@ int main(int argc, char *argv[])
 	/* Setup the database */
 	setup_structure();
 
+	mirror_init(use_mirror);
+
 	/* Listen to hypervisor. */
 	if (!no_domain_init)
 		domain_init();
@@ -2025,8 +2447,18 @@ int main(int argc, char *argv[])
 		tracefile = talloc_strdup(NULL, tracefile);
 
 	/* Get ready to listen to the tools. */
-	initialize_fds(*sock, &sock_pollfd_idx, *ro_sock, &ro_sock_pollfd_idx,
-		       &timeout);
+	poll_init();
+	if (*sock != -1 &&
+	    poll_fd_set(*sock, NULL, handle_sock, POLLIN|POLLPRI))
+		barf_perror("Failed to poll socket");
+	if (*ro_sock != -1 &&
+	    poll_fd_set(*ro_sock, NULL, handle_ro_sock, POLLIN|POLLPRI))
+		barf_perror("Failed to poll ro socket");
+	watch_reopen_log_pipe();
+	if (xce_handle != NULL &&
+	    poll_fd_set(xenevtchn_fd(xce_handle), NULL, handle_xce,
+			POLLIN|POLLPRI))
+		barf_perror("Failed to poll event channels");
 
 	/* Tell the kernel we're up and running. */
 	xenbus_notify_running();
@@ -2038,114 +2470,14 @@ int main(int argc, char *argv[])
 
 	/* Main loop. */
 	for (;;) {
-		struct connection *conn, *next;
-
-		if (poll(fds, nr_fds, timeout) < 0) {
+		if (poll_wait(ready_timeout()) < 0) {
 			if (errno == EINTR)
 				continue;
 			barf_perror("Poll failed");
 		}
 
-		if (reopen_log_pipe0_pollfd_idx != -1) {
-			if (fds[reopen_log_pipe0_pollfd_idx].revents
-			    & ~POLLIN) {
-				close(reopen_log_pipe[0]);
-				close(reopen_log_pipe[1]);
-				init_pipe(reopen_log_pipe);
-			} else if (fds[reopen_log_pipe0_pollfd_idx].revents
-				   & POLLIN) {
-				char c;
-				if (read(reopen_log_pipe[0], &c, 1) != 1)
-					barf_perror("read failed");
-				reopen_log();
-			}
-			reopen_log_pipe0_pollfd_idx = -1;
-		}
-
-		if (sock_pollfd_idx != -1) {
-			if (fds[sock_pollfd_idx].revents & ~POLLIN) {
-				barf_perror("sock poll failed");
-				break;
-			} else if (fds[sock_pollfd_idx].revents & POLLIN) {
-				accept_connection(*sock, true);
-				sock_pollfd_idx = -1;
-			}
-		}
-
-		if (ro_sock_pollfd_idx != -1) {
-			if (fds[ro_sock_pollfd_idx].revents & ~POLLIN) {
-				barf_perror("ro sock poll failed");
-				break;
-			} else if (fds[ro_sock_pollfd_idx].revents & POLLIN) {
-				accept_connection(*ro_sock, false);
-				ro_sock_pollfd_idx = -1;
-			}
-		}
-
-		if (xce_pollfd_idx != -1) {
-			if (fds[xce_pollfd_idx].revents & ~POLLIN) {
-				barf_perror("xce_handle poll failed");
-				break;
-			} else if (fds[xce_pollfd_idx].revents & POLLIN) {
-				handle_event();
-				xce_pollfd_idx = -1;
-			}
-		}
-
-		next = list_entry(connections.next, typeof(*conn), list);
-		if (&next->list != &connections)
-			talloc_increase_ref_count(next);
-		while (&next->list != &connections) {
-			conn = next;
-
-			next = list_entry(conn->list.next,
-					  typeof(*conn), list);
-			if (&next->list != &connections)
-				talloc_increase_ref_count(next);
-
-			if (conn->domain) {
-				if (domain_can_read(conn))
-					handle_input(conn);
-				if (talloc_free(conn) == 0)
-					continue;
-
-				talloc_increase_ref_count(conn);
-				if (domain_can_write(conn) &&
-				    !list_empty(&conn->out_list))
-					handle_output(conn);
-				if (talloc_free(conn) == 0)
-					continue;
-			} else {
-				if (conn->pollfd_idx != -1) {
-					if (fds[conn->pollfd_idx].revents
-					    & ~(POLLIN|POLLOUT))
-						talloc_free(conn);
-					else if (fds[conn->pollfd_idx].revents
-						 & POLLIN)
-						handle_input(conn);
-				}
-				if (talloc_free(conn) == 0)
-					continue;
-
-				talloc_increase_ref_count(conn);
-
-				if (conn->pollfd_idx != -1) {
-					if (fds[conn->pollfd_idx].revents
-					    & ~(POLLIN|POLLOUT))
-						talloc_free(conn);
-					else if (fds[conn->pollfd_idx].revents
-						 & POLLOUT)
-						handle_output(conn);
-				}
-				if (talloc_free(conn) == 0)
-					continue;
-
-				conn->pollfd_idx = -1;
-			}
-		}
-
-		initialize_fds(*sock, &sock_pollfd_idx, *ro_sock,
-			       &ro_sock_pollfd_idx, &timeout);
+		handle_ready_connections();
+		domain_notify_flush();
 	}
 }
 
@@ -24,6 +24,7 @@
 #include <xengnttab.h>
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <dirent.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -32,11 +33,20 @@
 #include "xenstore_lib.h"
 #include "list.h"
 #include "tdb.h"
+#include "xenstored_db.h"
 #include "hashtable.h"
 
 /* DEFAULT_BUFFER_SIZE should be large enough for each errno string. */
 #define DEFAULT_BUFFER_SIZE 16
 
+/*
+ * Size of the arena requests come with: everything allocated off a request
+ * while handling it is carved out of it, and it's released in one go after
+ * the reply has been written.  Long lived objects must not be allocated off
+ * the request, as they would keep the arena around.
+ */
+#define REQUEST_ARENA_SIZE 8192
+
 #define MIN(a, b) (((a) < (b))? (a) : (b))
 
 typedef int32_t wrl_creditt;
@@ -64,7 +74,8 @@ struct buffered_data
 };
 
 struct connection;
-typedef int connwritefn_t(struct connection *, const void *, unsigned int);
+/* Returns the number of bytes written, possibly 0, or -1 with errno set. */
+typedef int connwritefn_t(struct connection *, const struct iovec *, int);
 typedef int connreadfn_t(struct connection *, void *, unsigned int);
 
 struct connection
@@ -73,8 +84,11 @@ struct connection
 
 	/* The file descriptor we came in on. */
 	int fd;
-	/* The index of pollfd in global pollfd array */
-	int pollfd_idx;
+	/* Poll events seen on fd since last handled. */
+	short revents;
+
+	/* Entry in the list of connections to look at, if any. */
+	struct list_head ready_list;
 
 	/* Who am I? 0 for socket connections. */
 	unsigned int id;
@@ -88,6 +102,12 @@ struct connection
 	/* Buffered output data */
 	struct list_head out_list;
 
+	/* Output statistics. */
+	unsigned int out_queued;	/* Messages in out_list. */
+	unsigned int out_queued_max;
+	unsigned long out_msgs;		/* Messages written. */
+	unsigned long out_writes;	/* Successful write calls. */
+
 	/* Transaction context for current request (NULL if none). */
 	struct transaction *transaction;
 
@@ -150,7 +170,7 @@ void send_ack(struct connection *conn, enum xsd_sockmsg_type type);
 /* Canonicalize this path if possible. */
 char *canonicalize(struct connection *conn, const void *ctx, const char *node);
 
-/* Write a node to the tdb data base. */
+/* Write a node to the data base. */
 int write_node_raw(struct connection *conn, TDB_DATA *key, struct node *node);
 
 /* Get this node, checking we have permissions. */
@@ -160,6 +180,8 @@ struct node *get_node(struct connection *conn,
 		      enum xs_perm_type perm);
 
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read);
+/* Have the main loop look at a connection on its next round. */
+void conn_set_ready(struct connection *conn);
 void check_store(void);
 void corrupt(struct connection *conn, const char *fmt, ...);
 
@@ -177,7 +199,6 @@ void close_log(void);
 extern char *tracefile;
 extern int tracefd;
 
-extern TDB_CONTEXT *tdb_ctx;
 extern int dom0_domid;
 extern int dom0_event;
 extern int priv_domid;
@@ -195,6 +216,9 @@ evtchn_port_t xenbus_evtchn(void);
 /* Tell the kernel xenstored is running. */
 void xenbus_notify_running(void);
 
+/* Does xenevtchn_pending() return -1, rather than block, once none are? */
+bool xenbus_pending_nonblocking(void);
+
 /* Write out the pidfile */
 void write_pidfile(const char *pidfile);
 
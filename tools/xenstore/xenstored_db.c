@@ -0,0 +1,303 @@
+/*
+    Node record store for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "talloc.h"
+#include "xenstored_db.h"
+
+/*
+ * Records are kept in a chained hash table, which doubles in size whenever
+ * it holds twice as many records as it has buckets.  A record is a single
+ * allocation holding its key and data, the latter suitably aligned for
+ * struct xs_tdb_record_hdr.
+ */
+struct db_rec {
+	struct db_rec *next;
+	unsigned int hash;
+	unsigned int keylen;
+	unsigned int datalen;
+	uint64_t buf[];
+};
+
+#define DB_MIN_BUCKETS	8192
+#define DB_KEY_SPACE(l)	(((l) + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1))
+
+static void *db_ctx;
+static struct db_rec **db_buckets;
+static unsigned int db_nr_buckets;	/* Always a power of 2. */
+static unsigned int db_nr_recs;
+
+/* Optional copy of the store on disk. */
+static TDB_CONTEXT *db_tdb;
+
+static unsigned int db_hash(TDB_DATA key)
+{
+	unsigned int hash = 5381, i;
+
+	for (i = 0; i < key.dsize; i++)
+		hash = ((hash << 5) + hash) + (unsigned char)key.dptr[i];
+
+	return hash;
+}
+
+static char *rec_key(struct db_rec *rec)
+{
+	return (char *)rec->buf;
+}
+
+static void *rec_data(struct db_rec *rec)
+{
+	return (char *)rec->buf + DB_KEY_SPACE(rec->keylen);
+}
+
+static int db_init(void)
+{
+	if (db_buckets)
+		return 0;
+
+	db_ctx = talloc_named_const(NULL, 0, "db");
+	db_buckets = talloc_zero_array(db_ctx, struct db_rec *,
+				       DB_MIN_BUCKETS);
+	if (!db_ctx || !db_buckets) {
+		talloc_free(db_ctx);
+		db_ctx = NULL;
+		db_buckets = NULL;
+		errno = ENOMEM;
+		return -1;
+	}
+	db_nr_buckets = DB_MIN_BUCKETS;
+
+	return 0;
+}
+
+/* Returns the link pointing to the record of key (or the end of a chain). */
+static struct db_rec **db_find(TDB_DATA key, unsigned int hash)
+{
+	struct db_rec **link = &db_buckets[hash & (db_nr_buckets - 1)];
+
+	for (; *link; link = &(*link)->next)
+		if ((*link)->hash == hash && (*link)->keylen == key.dsize &&
+		    !memcmp(rec_key(*link), key.dptr, key.dsize))
+			break;
+
+	return link;
+}
+
+static void db_grow(void)
+{
+	unsigned int i, nr = db_nr_buckets * 2;
+	struct db_rec **buckets, *rec, *next;
+
+	/* Failing to grow only makes chains longer. */
+	buckets = talloc_zero_array(db_ctx, struct db_rec *, nr);
+	if (!buckets)
+		return;
+
+	for (i = 0; i < db_nr_buckets; i++)
+		for (rec = db_buckets[i]; rec; rec = next) {
+			next = rec->next;
+			rec->next = buckets[rec->hash & (nr - 1)];
+			buckets[rec->hash & (nr - 1)] = rec;
+		}
+
+	talloc_free(db_buckets);
+	db_buckets = buckets;
+	db_nr_buckets = nr;
+}
+
+TDB_CONTEXT *db_open_tdb(const char *name, int tdb_flags, tdb_log_func log)
+{
+	unlink(name);
+
+	db_tdb = tdb_open_ex(name, 7919, tdb_flags, O_RDWR|O_CREAT|O_EXCL,
+			     0640, log, NULL);
+
+	return db_tdb;
+}
+
+TDB_DATA db_peek(TDB_DATA key)
+{
+	TDB_DATA data = { .dptr = NULL, .dsize = 0 };
+	struct db_rec *rec;
+
+	if (!db_buckets) {
+		errno = ENOENT;
+		return data;
+	}
+
+	rec = *db_find(key, db_hash(key));
+	if (!rec) {
+		errno = ENOENT;
+		return data;
+	}
+
+	data.dptr = rec_data(rec);
+	data.dsize = rec->datalen;
+
+	return data;
+}
+
+TDB_DATA db_fetch(TDB_DATA key)
+{
+	TDB_DATA data = db_peek(key);
+
+	if (data.dptr) {
+		data.dptr = talloc_memdup(NULL, data.dptr, data.dsize);
+		if (!data.dptr)
+			errno = ENOMEM;
+	}
+
+	return data;
+}
+
+int db_store(TDB_DATA key, TDB_DATA data)
+{
+	unsigned int hash = db_hash(key);
+	struct db_rec **link, *rec;
+
+	if (db_init())
+		return -1;
+
+	rec = talloc_size(db_ctx, sizeof(*rec) + DB_KEY_SPACE(key.dsize) +
+				  data.dsize);
+	if (!rec) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (db_tdb && tdb_store(db_tdb, key, data, TDB_REPLACE)) {
+		talloc_free(rec);
+		errno = EIO;
+		return -1;
+	}
+
+	rec->hash = hash;
+	rec->keylen = key.dsize;
+	rec->datalen = data.dsize;
+	memcpy(rec_key(rec), key.dptr, key.dsize);
+	memcpy(rec_data(rec), data.dptr, data.dsize);
+
+	link = db_find(key, hash);
+	if (*link) {
+		rec->next = (*link)->next;
+		talloc_free(*link);
+		*link = rec;
+		return 0;
+	}
+
+	rec->next = NULL;
+	*link = rec;
+	if (++db_nr_recs > 2 * db_nr_buckets)
+		db_grow();
+
+	return 0;
+}
+
+int db_delete(TDB_DATA key)
+{
+	struct db_rec **link, *rec;
+
+	if (!db_buckets || !*(link = db_find(key, db_hash(key)))) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (db_tdb && tdb_delete(db_tdb, key) &&
+	    tdb_error(db_tdb) != TDB_ERR_NOEXIST) {
+		errno = EIO;
+		return -1;
+	}
+
+	rec = *link;
+	*link = rec->next;
+	talloc_free(rec);
+	db_nr_recs--;
+
+	return 0;
+}
+
+int db_move(TDB_DATA from, TDB_DATA to)
+{
+	struct db_rec **link, *rec;
+	TDB_DATA data = db_peek(from);
+
+	if (!data.dptr)
+		return -1;
+
+	/* Only the key changes: reuse the record if the new one fits. */
+	link = db_find(from, db_hash(from));
+	if (DB_KEY_SPACE(to.dsize) != DB_KEY_SPACE(from.dsize))
+		return db_store(to, data) ?: db_delete(from);
+
+	if (db_tdb && (tdb_store(db_tdb, to, data, TDB_REPLACE) ||
+		       (tdb_delete(db_tdb, from) &&
+			tdb_error(db_tdb) != TDB_ERR_NOEXIST))) {
+		errno = EIO;
+		return -1;
+	}
+
+	rec = *link;
+	*link = rec->next;
+	db_nr_recs--;
+
+	rec->hash = db_hash(to);
+	rec->keylen = to.dsize;
+	memcpy(rec_key(rec), to.dptr, to.dsize);
+
+	link = db_find(to, rec->hash);
+	if (*link) {
+		rec->next = (*link)->next;
+		talloc_free(*link);
+		*link = rec;
+		return 0;
+	}
+
+	rec->next = NULL;
+	*link = rec;
+	db_nr_recs++;
+
+	return 0;
+}
+
+int db_traverse(int (*fn)(TDB_DATA key, TDB_DATA data, void *priv),
+		void *priv)
+{
+	unsigned int i;
+	struct db_rec *rec, *next;
+	TDB_DATA key, data;
+	int ret;
+
+	for (i = 0; i < db_nr_buckets; i++)
+		for (rec = db_buckets[i]; rec; rec = next) {
+			next = rec->next;
+			key.dptr = rec_key(rec);
+			key.dsize = rec->keylen;
+			data.dptr = rec_data(rec);
+			data.dsize = rec->datalen;
+			ret = fn(key, data, priv);
+			if (ret)
+				return ret;
+		}
+
+	return 0;
+}
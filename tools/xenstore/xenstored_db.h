@@ -0,0 +1,61 @@
+/*
+    Node record store for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _XENSTORED_DB_H
+#define _XENSTORED_DB_H
+
+#include "tdb.h"
+
+/*
+ * All node records (keyed by node name, or by transaction specific name
+ * for nodes modified in a transaction) live in a hash table in memory.
+ * If a TDB file was opened via db_open_tdb(), every modification is also
+ * written through to it, e.g. for inspection with xs_tdb_dump.
+ */
+
+/* Open the TDB file to write modifications through to. */
+TDB_CONTEXT *db_open_tdb(const char *name, int tdb_flags, tdb_log_func log);
+
+/*
+ * Returns a copy of the record allocated off the NULL talloc context, or
+ * data.dptr == NULL, with errno set to ENOENT or ENOMEM.
+ */
+TDB_DATA db_fetch(TDB_DATA key);
+
+/*
+ * Returns the record itself, valid until the next modification of the
+ * store, or data.dptr == NULL with errno set to ENOENT.
+ */
+TDB_DATA db_peek(TDB_DATA key);
+
+/* Returns 0, or -1 with errno set. */
+int db_store(TDB_DATA key, TDB_DATA data);
+int db_delete(TDB_DATA key);
+
+/*
+ * Replace the record of @to by the one of @from, which gets deleted,
+ * without copying it.  Returns 0, or -1 with errno set.
+ */
+int db_move(TDB_DATA from, TDB_DATA to);
+
+/*
+ * Call fn for each record, stopping when it returns non-zero.  fn may
+ * delete the record it got passed.
+ */
+int db_traverse(int (*fn)(TDB_DATA key, TDB_DATA data, void *priv),
+		void *priv);
+
+#endif /* _XENSTORED_DB_H */
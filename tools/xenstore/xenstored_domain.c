@@ -30,6 +30,7 @@
 #include "xenstored_domain.h"
 #include "xenstored_transaction.h"
 #include "xenstored_watch.h"
+#include "hashtable.h"
 
 #include <xenevtchn.h>
 #include <xenctrl.h>
@@ -51,6 +52,9 @@ struct domain
 	/* Event channel port */
 	evtchn_port_t port;
 
+	/* On notify_domains while an event is owed for ring progress. */
+	struct list_head notify_list;
+
 	/* The remote end of the event channel, used only to validate
 	   repeated domain introductions. */
 	evtchn_port_t remote_port;
@@ -84,6 +88,32 @@ struct domain
 };
 
 static LIST_HEAD(domains);
+static LIST_HEAD(notify_domains);
+
+/*
+ * Ring progress is signalled once per pass of the main loop rather than
+ * on every read or write: a request is read as header then payload, and
+ * its reply may go out in the same pass.
+ */
+static void domain_notify(struct domain *domain)
+{
+	if (list_empty(&domain->notify_list))
+		list_add_tail(&domain->notify_list, &notify_domains);
+}
+
+void domain_notify_flush(void)
+{
+	struct domain *domain, *tmp;
+
+	list_for_each_entry_safe(domain, tmp, &notify_domains, notify_list) {
+		list_del_init(&domain->notify_list);
+		if (domain->port)
+			xenevtchn_notify(xce_handle, domain->port);
+	}
+}
+
+/* Domains by local event channel port. */
+static struct hashtable *port_domains;
 
 static bool check_indexes(XENSTORE_RING_IDX cons, XENSTORE_RING_IDX prod)
 {
@@ -110,13 +140,17 @@ static const void *get_input_chunk(XENSTORE_RING_IDX cons,
 	return buf + MASK_XENSTORE_IDX(cons);
 }
 
+/* Copy as much as fits into the ring, notifying the domain once. */
 static int writechn(struct connection *conn,
-		    const void *data, unsigned int len)
+		    const struct iovec *iov, int iovcnt)
 {
 	uint32_t avail;
 	void *dest;
 	struct xenstore_domain_interface *intf = conn->domain->interface;
 	XENSTORE_RING_IDX cons, prod;
+	const char *src;
+	unsigned int len, done = 0;
+	int i;
 
 	/* Must read indexes once, and before anything else, and verified. */
 	cons = intf->rsp_cons;
@@ -128,17 +162,31 @@ static int writechn(struct connection *conn,
 		return -1;
 	}
 
-	dest = get_output_chunk(cons, prod, intf->rsp, &avail);
-	if (avail < len)
-		len = avail;
-
-	memcpy(dest, data, len);
-	xen_mb();
-	intf->rsp_prod += len;
+	for (i = 0; i < iovcnt; i++) {
+		src = iov[i].iov_base;
+		len = iov[i].iov_len;
+		while (len) {
+			dest = get_output_chunk(cons, prod, intf->rsp, &avail);
+			if (!avail)
+				goto out;
+			if (avail > len)
+				avail = len;
+			memcpy(dest, src, avail);
+			prod += avail;
+			src += avail;
+			len -= avail;
+			done += avail;
+		}
+	}
 
-	xenevtchn_notify(xce_handle, conn->domain->port);
+ out:
+	if (done) {
+		xen_mb();
+		intf->rsp_prod = prod;
+		domain_notify(conn->domain);
+	}
 
-	return len;
+	return done;
 }
 
 static int readchn(struct connection *conn, void *data, unsigned int len)
@@ -166,7 +214,7 @@ static int readchn(struct connection *conn, void *data, unsigned int len)
 	xen_mb();
 	intf->req_cons += len;
 
-	xenevtchn_notify(xce_handle, conn->domain->port);
+	domain_notify(conn->domain);
 
 	return len;
 }
@@ -191,16 +239,59 @@ static void unmap_interface(void *interface)
 		munmap(interface, XC_PAGE_SIZE);
 }
 
+static unsigned int hash_port(void *k)
+{
+	return *(evtchn_port_t *)k;
+}
+
+static int ports_equal(void *k1, void *k2)
+{
+	return *(evtchn_port_t *)k1 == *(evtchn_port_t *)k2;
+}
+
+/* Bind to the remote port, returning the local one or -1. */
+static int domain_bind_port(struct domain *domain, evtchn_port_t remote)
+{
+	evtchn_port_t *key;
+	int rc;
+
+	rc = xenevtchn_bind_interdomain(xce_handle, domain->domid, remote);
+	if (rc == -1)
+		return -1;
+
+	key = malloc(sizeof(*key));
+	if (key)
+		*key = rc;
+	if (!key || !hashtable_insert(port_domains, key, domain)) {
+		free(key);
+		xenevtchn_unbind(xce_handle, rc);
+		errno = ENOMEM;
+		return -1;
+	}
+	domain->port = rc;
+
+	return rc;
+}
+
+static void domain_unbind_port(struct domain *domain)
+{
+	if (!domain->port)
+		return;
+
+	hashtable_remove(port_domains, &domain->port);
+	if (xenevtchn_unbind(xce_handle, domain->port) == -1)
+		eprintf("> Unbinding port %i failed!\n", domain->port);
+	domain->port = 0;
+}
+
 static int destroy_domain(void *_domain)
 {
 	struct domain *domain = _domain;
 
 	list_del(&domain->list);
+	list_del(&domain->notify_list);
 
-	if (domain->port) {
-		if (xenevtchn_unbind(xce_handle, domain->port) == -1)
-			eprintf("> Unbinding port %i failed!\n", domain->port);
-	}
+	domain_unbind_port(domain);
 
 	if (domain->interface) {
 		/* Domain 0 was mapped by dom0_init, so it must be unmapped
@@ -249,19 +340,29 @@ static void domain_cleanup(void)
 		fire_watches(NULL, NULL, "@releaseDomain", false);
 }
 
-/* We scan all domains rather than use the information given here. */
 void handle_event(void)
 {
 	evtchn_port_t port;
+	struct domain *domain;
 
 	if ((port = xenevtchn_pending(xce_handle)) == -1)
 		barf_perror("Failed to read from event fd");
 
-	if (port == virq_port)
-		domain_cleanup();
-
-	if (xenevtchn_unmask(xce_handle, port) == -1)
-		barf_perror("Failed to write to event fd");
+	/*
+	 * Rather than go round the poll loop once per notified ring, take
+	 * all the pending ports now where that cannot block (mini-os).
+	 */
+	do {
+		if (port == virq_port)
+			domain_cleanup();
+		else if ((domain = hashtable_search(port_domains, &port)) &&
+			 domain->conn)
+			conn_set_ready(domain->conn);
+
+		if (xenevtchn_unmask(xce_handle, port) == -1)
+			barf_perror("Failed to write to event fd");
+	} while (xenbus_pending_nonblocking() &&
+		 (port = xenevtchn_pending(xce_handle)) != -1);
 }
 
 bool domain_can_read(struct connection *conn)
@@ -290,6 +391,14 @@ bool domain_can_write(struct connection *conn)
 	return ((intf->rsp_prod - intf->rsp_cons) != XENSTORE_RING_SIZE);
 }
 
+bool domain_pending(struct connection *conn)
+{
+	struct xenstore_domain_interface *intf = conn->domain->interface;
+
+	return intf->req_cons != intf->req_prod ||
+	       (domain_can_write(conn) && !list_empty(&conn->out_list));
+}
+
 static char *talloc_domain_path(void *context, unsigned int domid)
 {
 	return talloc_asprintf(context, "/local/domain/%u", domid);
@@ -306,6 +415,7 @@ static struct domain *new_domain(void *context, unsigned int domid,
 		return NULL;
 
 	domain->port = 0;
+	INIT_LIST_HEAD(&domain->notify_list);
 	domain->shutdown = 0;
 	domain->domid = domid;
 	domain->path = talloc_domain_path(domain, domid);
@@ -318,10 +428,9 @@ static struct domain *new_domain(void *context, unsigned int domid,
 	talloc_set_destructor(domain, destroy_domain);
 
 	/* Tell kernel we're interested in this event. */
-	rc = xenevtchn_bind_interdomain(xce_handle, domid, port);
+	rc = domain_bind_port(domain, port);
 	if (rc == -1)
 	    return NULL;
-	domain->port = rc;
 
 	domain->conn = new_connection(writechn, readchn);
 	if (!domain->conn)
@@ -361,6 +470,7 @@ static void domain_conn_reset(struct domain *domain)
 		list_del(&out->list);
 		talloc_free(out);
 	}
+	conn->out_queued = 0;
 
 	talloc_free(conn->in);
 
@@ -377,6 +487,7 @@ int do_introduce(struct connection *conn, struct buffered_data *in)
 	unsigned long mfn;
 	evtchn_port_t port;
 	int rc;
+	void *ctx;
 	struct xenstore_domain_interface *interface;
 
 	if (get_strings(in, vec, ARRAY_SIZE(vec)) < ARRAY_SIZE(vec))
@@ -399,11 +510,16 @@ int do_introduce(struct connection *conn, struct buffered_data *in)
 		interface = map_interface(domid, mfn);
 		if (!interface)
 			return errno;
-		/* Hang domain off "in" until we're finished. */
-		domain = new_domain(in, domid, port);
+		/*
+		 * Hang domain off a context of its own until we're finished:
+		 * "in" would keep its arena around for the domain's lifetime.
+		 */
+		ctx = talloc_new(NULL);
+		domain = ctx ? new_domain(ctx, domid, port) : NULL;
 		if (!domain) {
-			rc = errno;
+			rc = ctx ? errno : ENOMEM;
 			unmap_interface(interface);
+			talloc_free(ctx);
 			return rc;
 		}
 		domain->interface = interface;
@@ -411,14 +527,13 @@ int do_introduce(struct connection *conn, struct buffered_data *in)
 
 		/* Now domain belongs to its connection. */
 		talloc_steal(domain->conn, domain);
+		talloc_free(ctx);
 
 		fire_watches(NULL, in, "@introduceDomain", false);
 	} else if ((domain->mfn == mfn) && (domain->conn != conn)) {
 		/* Use XS_INTRODUCE for recreating the xenbus event-channel. */
-		if (domain->port)
-			xenevtchn_unbind(xce_handle, domain->port);
-		rc = xenevtchn_bind_interdomain(xce_handle, domid, port);
-		domain->port = (rc == -1) ? 0 : rc;
+		domain_unbind_port(domain);
+		domain_bind_port(domain, port);
 		domain->remote_port = port;
 	} else
 		return EINVAL;
@@ -650,6 +765,10 @@ void domain_init(void)
 	if (xce_handle == NULL)
 		barf_perror("Failed to open evtchn device");
 
+	port_domains = create_hashtable(64, hash_port, ports_equal);
+	if (!port_domains)
+		barf_perror("Failed to allocate domain port table");
+
 	if (dom0_init() != 0) 
 		barf_perror("Failed to initialize dom0 state"); 
 
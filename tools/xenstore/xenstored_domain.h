@@ -53,6 +53,11 @@ void restore_existing_connections(void);
 /* Can connection attached to domain read/write. */
 bool domain_can_read(struct connection *conn);
 bool domain_can_write(struct connection *conn);
+/* Is there input or writable output, even if rate limited? */
+bool domain_pending(struct connection *conn);
+
+/* Send the events owed to domains for reading from or writing to rings. */
+void domain_notify_flush(void);
 
 bool domain_is_unprivileged(struct connection *conn);
 
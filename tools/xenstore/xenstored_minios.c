@@ -42,6 +42,11 @@ void xenbus_notify_running(void)
 {
 }
 
+bool xenbus_pending_nonblocking(void)
+{
+	return true;
+}
+
 evtchn_port_t xenbus_evtchn(void)
 {
 	return dom0_event;
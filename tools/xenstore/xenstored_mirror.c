@@ -0,0 +1,215 @@
+/*
+    Mirror of frequently read nodes for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#ifndef NO_SOCKETS
+#include <sys/mman.h>
+#endif
+#include <unistd.h>
+#include "talloc.h"
+#include "utils.h"
+#include "xenstore_lib.h"
+#include "xenstored_core.h"
+#include "xenstored_mirror.h"
+#include "xs_mirror.h"
+
+static struct xs_mirror *mirror;
+
+#ifdef NO_SOCKETS
+void mirror_init(bool enable)
+{
+	/* Nobody to share the mirror with. */
+}
+#else
+static const char *mirror_path(void)
+{
+	static char buf[PATH_MAX];
+
+	snprintf(buf, sizeof(buf), "%s/" XS_MIRROR_FILE, xs_daemon_rundir());
+	return buf;
+}
+
+void mirror_init(bool enable)
+{
+	char tmp[PATH_MAX];
+	void *p;
+	int fd;
+
+	unlink(mirror_path());
+	if (!enable)
+		return;
+
+	/* Clients must never see a partially set up file. */
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", mirror_path()) >= sizeof(tmp))
+		barf("Mirror path too long");
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+	if (fd == -1)
+		barf_perror("Could not create %s", tmp);
+	if (ftruncate(fd, sizeof(*mirror)))
+		barf_perror("Could not size %s", tmp);
+	p = mmap(NULL, sizeof(*mirror), PROT_READ | PROT_WRITE, MAP_SHARED,
+		 fd, 0);
+	if (p == MAP_FAILED)
+		barf_perror("Could not map %s", tmp);
+	close(fd);
+
+	mirror = p;
+	mirror->nr_entries = XS_MIRROR_ENTRIES;
+	mirror->magic = XS_MIRROR_MAGIC;
+
+	if (rename(tmp, mirror_path()))
+		barf_perror("Could not rename %s", tmp);
+}
+#endif
+
+static struct xs_mirror_entry *mirror_find(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < XS_MIRROR_ENTRIES; i++)
+		if (streq(mirror->entries[i].path, name))
+			return &mirror->entries[i];
+
+	return NULL;
+}
+
+/* Refresh an entry from the global node, dropping it if that's gone. */
+static void mirror_refresh(struct xs_mirror_entry *e, const char *name)
+{
+	TDB_DATA key, data;
+	struct xs_tdb_record_hdr *hdr;
+
+	key.dptr = (char *)name;
+	key.dsize = strlen(name);
+	data = db_peek(key);
+	hdr = (void *)data.dptr;
+
+	e->seq++;
+	xs_mirror_barrier();
+
+	if (!hdr) {
+		e->len = XS_MIRROR_ABSENT;
+		e->path[0] = 0;
+	} else if (hdr->datalen > XS_MIRROR_VALUE_MAX) {
+		e->len = XS_MIRROR_TOO_BIG;
+	} else {
+		e->len = hdr->datalen;
+		memcpy(e->value, hdr->perms + hdr->num_perms, hdr->datalen);
+	}
+	if (e->path != name && hdr)
+		strcpy(e->path, name);
+
+	xs_mirror_barrier();
+	e->seq++;
+}
+
+int mirror_add(const char *name)
+{
+	TDB_DATA key;
+	struct xs_mirror_entry *e;
+
+	if (!mirror)
+		return ENODEV;
+	if (!is_valid_nodename(name) || strlen(name) >= XS_MIRROR_PATH_MAX)
+		return EINVAL;
+	if (mirror_find(name))
+		return EEXIST;
+
+	key.dptr = (char *)name;
+	key.dsize = strlen(name);
+	if (!db_peek(key).dptr)
+		return ENOENT;
+
+	e = mirror_find("");
+	if (!e)
+		return ENOSPC;
+
+	mirror_refresh(e, name);
+
+	return 0;
+}
+
+int mirror_del(const char *name)
+{
+	struct xs_mirror_entry *e;
+
+	if (!mirror)
+		return ENODEV;
+
+	e = *name ? mirror_find(name) : NULL;
+	if (!e)
+		return ENOENT;
+
+	e->seq++;
+	xs_mirror_barrier();
+	e->len = XS_MIRROR_ABSENT;
+	e->path[0] = 0;
+	xs_mirror_barrier();
+	e->seq++;
+
+	return 0;
+}
+
+char *mirror_list(const void *ctx)
+{
+	char *list = talloc_strdup(ctx, "");
+	unsigned int i;
+
+	if (!mirror)
+		return list;
+
+	for (i = 0; list && i < XS_MIRROR_ENTRIES; i++)
+		if (mirror->entries[i].path[0])
+			list = talloc_asprintf_append(list, "%s\n",
+						      mirror->entries[i].path);
+
+	return list;
+}
+
+void mirror_changed(const char *name, bool recurse)
+{
+	struct xs_mirror_entry *e;
+	size_t len;
+	unsigned int i;
+
+	if (!mirror || *name != '/')
+		return;
+
+	len = strlen(name);
+	for (i = 0; i < XS_MIRROR_ENTRIES; i++) {
+		e = &mirror->entries[i];
+		if (!e->path[0] || strncmp(e->path, name, len))
+			continue;
+		if (e->path[len] == 0 ||
+		    (recurse && (e->path[len] == '/' || len == 1)))
+			mirror_refresh(e, e->path);
+	}
+}
+
+/*
+ * Local variables:
+ *  c-file-style: "linux"
+ *  indent-tabs-mode: t
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
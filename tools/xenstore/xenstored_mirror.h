@@ -0,0 +1,38 @@
+/*
+    Mirror of frequently read nodes for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _XENSTORED_MIRROR_H
+#define _XENSTORED_MIRROR_H
+
+#include <stdbool.h>
+
+/* Create the mirror file if enabled, remove any stale one otherwise. */
+void mirror_init(bool enable);
+
+/*
+ * Add or remove a node to or from the mirror.  Nodes are removed
+ * automatically when deleted.  Return 0 or an errno value.
+ */
+int mirror_add(const char *name);
+int mirror_del(const char *name);
+
+/* List of the mirrored nodes, one per line, allocated off ctx. */
+char *mirror_list(const void *ctx);
+
+/* The global node name (or all nodes below it with recurse) changed. */
+void mirror_changed(const char *name, bool recurse);
+
+#endif /* _XENSTORED_MIRROR_H */
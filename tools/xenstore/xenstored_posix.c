@@ -152,3 +152,8 @@ void xenbus_notify_running(void)
 {
 }
 #endif /* !__sun__ */
+
+bool xenbus_pending_nonblocking(void)
+{
+	return false;
+}
@@ -101,6 +101,24 @@
  *    TA2: write node A:   g(2:A) = 6, G = 7
  *    End TA1: g(1:A) == g(A) => okay, B = 1:B, g(B) = 7, G = 8
  *    End TA2: g(2:B) != g(B) => EAGAIN
+ *
+ * Creating or deleting a node reads and writes its parent just for updating
+ * the parent's list of children, which would make concurrent transactions
+ * creating different nodes below the same parent (e.g. devices of the same
+ * type) conflict with each other.  As long as a transaction accessed an
+ * existing parent only this way, a changed generation count doesn't count
+ * as a conflict: the children the transaction added or removed are applied
+ * to the global version of the parent instead.  Conflicts on any child
+ * itself are still detected via that child's generation count.
+ *
+ * 5. Two transactions creating different children
+ *    I: g(A) = 1, children(A) = X, G = 2
+ *    Start transaction 1: G(1) = 2, G = 3
+ *    Start transaction 2: G(2) = 3, G = 4
+ *    TA1: create node A/Y: g(1:A) = 1, children(1:A) = X,Y, G = 6
+ *    TA2: create node A/Z: g(2:A) = 1, children(2:A) = X,Z, G = 8
+ *    End TA1: A = 1:A, g(A) = 8, G = 9
+ *    End TA2: g(2:A) != g(A), but only children changed => add Z to A
  */
 
 struct accessed_node
@@ -122,6 +140,16 @@ struct accessed_node
 
 	/* Transaction node in data base? */
 	bool ta_node;
+
+	/* Only accessed for updating the children of an existing node? */
+	bool children_only;
+
+	/* Merge the child changes into the global node on commit? */
+	bool merge;
+
+	/* Children of the node when first accessed, if children_only. */
+	char *base_children;
+	unsigned int base_childlen;
 };
 
 struct changed_domain
@@ -160,6 +188,14 @@ struct transaction
 extern int quota_max_transaction;
 static uint64_t generation;
 
+static struct {
+	unsigned long started;
+	unsigned long committed;
+	unsigned long aborted;
+	unsigned long conflicts;	/* Failed with EAGAIN, to be retried. */
+	unsigned long merged;		/* Nodes with children merged. */
+} trans_stats;
+
 static void set_tdb_key(const char *name, TDB_DATA *key)
 {
 	key->dptr = (char *)name;
@@ -232,8 +268,10 @@ int access_node(struct connection *conn, struct node *node,
 	const char *trans_name = NULL;
 	int ret;
 	bool introduce = false;
+	bool read = type == NODE_ACCESS_READ ||
+		    type == NODE_ACCESS_READ_CHILDREN;
 
-	if (type != NODE_ACCESS_READ) {
+	if (!read) {
 		node->generation = generation++;
 		if (conn && !conn->transaction)
 			wrl_apply_debit_direct(conn);
@@ -264,6 +302,16 @@ int access_node(struct connection *conn, struct node *node,
 		introduce = true;
 		i->ta_node = false;
 
+		if (type == NODE_ACCESS_READ_CHILDREN &&
+		    node->generation != NO_GENERATION) {
+			i->base_children = talloc_memdup(i, node->children,
+							 node->childlen);
+			if (!i->base_children && node->childlen)
+				goto nomem;
+			i->base_childlen = node->childlen;
+			i->children_only = true;
+		}
+
 		/*
 		 * Additional transaction-specific node for read type. We only
 		 * have to verify read nodes if we didn't write them.
@@ -271,7 +319,7 @@ int access_node(struct connection *conn, struct node *node,
 		 * The node is created and written to DB here to distinguish
 		 * from the write types.
 		 */
-		if (type == NODE_ACCESS_READ) {
+		if (read) {
 			i->generation = node->generation;
 			i->check_gen = true;
 			if (node->generation != NO_GENERATION) {
@@ -285,7 +333,11 @@ int access_node(struct connection *conn, struct node *node,
 		list_add_tail(&i->list, &trans->accessed);
 	}
 
-	if (type != NODE_ACCESS_READ)
+	if (type != NODE_ACCESS_READ_CHILDREN &&
+	    type != NODE_ACCESS_WRITE_CHILDREN)
+		i->children_only = false;
+
+	if (!read)
 		i->modified = true;
 
 	if (introduce && type == NODE_ACCESS_DELETE)
@@ -294,7 +346,8 @@ int access_node(struct connection *conn, struct node *node,
 
 	if (key) {
 		set_tdb_key(trans_name, key);
-		if (type == NODE_ACCESS_WRITE)
+		if (type == NODE_ACCESS_WRITE ||
+		    type == NODE_ACCESS_WRITE_CHILDREN)
 			i->ta_node = true;
 		if (type == NODE_ACCESS_DELETE)
 			i->ta_node = false;
@@ -312,6 +365,87 @@ err:
 	return ret;
 }
 
+static bool in_children(const char *children, unsigned int childlen,
+			const char *name)
+{
+	unsigned int off;
+
+	for (off = 0; off < childlen; off += strlen(children + off) + 1)
+		if (streq(children + off, name))
+			return true;
+
+	return false;
+}
+
+static char *record_children(struct xs_tdb_record_hdr *hdr)
+{
+	return (char *)(hdr->perms + hdr->num_perms) + hdr->datalen;
+}
+
+/*
+ * Replace the global node by its global version with the children added and
+ * removed in the transaction (relative to when it was first accessed).
+ */
+static int merge_children(struct accessed_node *i, TDB_DATA key,
+			  TDB_DATA ta_key)
+{
+	TDB_DATA cur = db_peek(key), ta = db_peek(ta_key), data;
+	struct xs_tdb_record_hdr *cur_hdr, *ta_hdr, *hdr;
+	char *cur_children, *ta_children, *child, *children;
+	unsigned int off, len;
+
+	if (!cur.dptr || !ta.dptr)
+		return -1;
+
+	cur_hdr = (void *)cur.dptr;
+	ta_hdr = (void *)ta.dptr;
+	cur_children = record_children(cur_hdr);
+	ta_children = record_children(ta_hdr);
+
+	data.dsize = cur.dsize - cur_hdr->childlen;
+	data.dptr = talloc_size(i, data.dsize + cur_hdr->childlen +
+				   ta_hdr->childlen);
+	if (!data.dptr)
+		return -1;
+	memcpy(data.dptr, cur.dptr, data.dsize);
+	hdr = (void *)data.dptr;
+	children = record_children(hdr);
+
+	/* Keep the children not removed by the transaction ... */
+	for (off = 0; off < cur_hdr->childlen; off += len) {
+		child = cur_children + off;
+		len = strlen(child) + 1;
+		if (in_children(i->base_children, i->base_childlen, child) &&
+		    !in_children(ta_children, ta_hdr->childlen, child))
+			continue;
+		memcpy(children, child, len);
+		children += len;
+	}
+
+	/* ... and add those it created. */
+	for (off = 0; off < ta_hdr->childlen; off += len) {
+		child = ta_children + off;
+		len = strlen(child) + 1;
+		if (in_children(i->base_children, i->base_childlen, child) ||
+		    in_children(cur_children, cur_hdr->childlen, child))
+			continue;
+		memcpy(children, child, len);
+		children += len;
+	}
+
+	hdr->childlen = children - record_children(hdr);
+	hdr->generation = generation++;
+	data.dsize += hdr->childlen;
+
+	if (db_store(key, data) || db_delete(ta_key))
+		return -1;
+
+	talloc_free(data.dptr);
+	trans_stats.merged++;
+
+	return 0;
+}
+
 /*
  * Finalize transaction:
  * Walk through accessed nodes and check generation against global data.
@@ -334,17 +468,14 @@ static int finalize_transaction(struct connection *conn,
 			continue;
 
 		set_tdb_key(i->node, &key);
-		data = tdb_fetch(tdb_ctx, key);
+		data = db_peek(key);
 		hdr = (void *)data.dptr;
-		if (!data.dptr) {
-			if (tdb_error(tdb_ctx) != TDB_ERR_NOEXIST)
-				return EIO;
-			gen = NO_GENERATION;
-		} else
-			gen = hdr->generation;
-		talloc_free(data.dptr);
-		if (i->generation != gen)
+		gen = data.dptr ? hdr->generation : NO_GENERATION;
+		if (i->generation == gen)
+			continue;
+		if (!i->children_only || gen == NO_GENERATION)
 			return EAGAIN;
+		i->merge = i->modified;
 	}
 
 	while ((i = list_top(&trans->accessed, struct accessed_node, list))) {
@@ -357,23 +488,23 @@ static int finalize_transaction(struct connection *conn,
 
 		if (i->modified) {
 			set_tdb_key(i->node, &key);
-			if (i->ta_node) {
-				data = tdb_fetch(tdb_ctx, ta_key);
+			if (i->merge) {
+				if (merge_children(i, key, ta_key))
+					goto err;
+			} else if (i->ta_node) {
+				/* Make the transaction's copy the node. */
+				data = db_peek(ta_key);
 				if (!data.dptr)
 					goto err;
 				hdr = (void *)data.dptr;
 				hdr->generation = generation++;
-				ret = tdb_store(tdb_ctx, key, data,
-						TDB_REPLACE);
-				talloc_free(data.dptr);
+				ret = db_move(ta_key, key);
 				if (ret)
 					goto err;
-			} else if (tdb_delete(tdb_ctx, key))
+			} else if (db_delete(key))
 					goto err;
 			fire_watches(conn, trans, i->node, false);
-		}
-
-		if (i->ta_node && tdb_delete(tdb_ctx, ta_key))
+		} else if (i->ta_node && db_delete(ta_key))
 			goto err;
 		list_del(&i->list);
 		talloc_free(i);
@@ -401,7 +532,7 @@ static int destroy_transaction(void *_transaction)
 							       i->node);
 			if (trans_name) {
 				set_tdb_key(trans_name, &key);
-				tdb_delete(tdb_ctx, key);
+				db_delete(key);
 			}
 		}
 		list_del(&i->list);
@@ -437,8 +568,7 @@ int do_transaction_start(struct connection *conn, struct buffered_data *in)
 	if (conn->id && conn->transaction_started > quota_max_transaction)
 		return ENOSPC;
 
-	/* Attach transaction to input for autofree until it's complete */
-	trans = talloc_zero(in, struct transaction);
+	trans = talloc_zero(conn, struct transaction);
 	if (!trans)
 		return ENOMEM;
 
@@ -455,7 +585,7 @@ int do_transaction_start(struct connection *conn, struct buffered_data *in)
 
 	/* Now we own it. */
 	list_add_tail(&trans->list, &conn->transaction_list);
-	talloc_steal(conn, trans);
+	trans_stats.started++;
 	talloc_set_destructor(trans, destroy_transaction);
 	conn->transaction_started++;
 	wrl_ntransactions++;
@@ -505,14 +635,19 @@ int do_transaction_end(struct connection *conn, struct buffered_data *in)
 		ret = transaction_fix_domains(trans, false);
 		if (ret)
 			return ret;
-		if (finalize_transaction(conn, trans))
+		ret = finalize_transaction(conn, trans);
+		if (ret == EAGAIN)
+			trans_stats.conflicts++;
+		if (ret)
 			return EAGAIN;
+		trans_stats.committed++;
 
 		wrl_apply_debit_trans_commit(conn);
 
 		/* fix domain entry for each changed domain */
 		transaction_fix_domains(trans, true);
-	}
+	} else
+		trans_stats.aborted++;
 	send_ack(conn, XS_TRANSACTION_END);
 
 	return 0;
@@ -610,6 +745,16 @@ nomem:
 	return ENOMEM;
 }
 
+char *transaction_stats(const void *ctx)
+{
+	return talloc_asprintf(ctx,
+		"active %ld, started %lu, committed %lu, aborted %lu\n"
+		"conflicts %lu, merged nodes %lu\n",
+		wrl_ntransactions, trans_stats.started, trans_stats.committed,
+		trans_stats.aborted, trans_stats.conflicts,
+		trans_stats.merged);
+}
+
 /*
  * Local variables:
  *  c-file-style: "linux"
@@ -22,7 +22,10 @@
 enum node_access_type {
     NODE_ACCESS_READ,
     NODE_ACCESS_WRITE,
-    NODE_ACCESS_DELETE
+    NODE_ACCESS_DELETE,
+    /* Read or write of the parent only for adding or removing a child. */
+    NODE_ACCESS_READ_CHILDREN,
+    NODE_ACCESS_WRITE_CHILDREN
 };
 
 struct transaction;
@@ -45,6 +48,9 @@ int transaction_prepend(struct connection *conn, const char *name,
                         TDB_DATA *key);
 
 void conn_delete_all_transactions(struct connection *conn);
+
+/* Transaction statistics, as text allocated off ctx. */
+char *transaction_stats(const void *ctx);
 int check_transactions(struct hashtable *hash);
 
 #endif /* _XENSTORED_TRANSACTION_H */
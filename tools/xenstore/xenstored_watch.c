@@ -25,18 +25,51 @@
 #include <assert.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "xenstored_watch.h"
 #include "xenstore_lib.h"
 #include "utils.h"
 #include "xenstored_domain.h"
+#include "xenstored_mirror.h"
 
 extern int quota_nb_watch_per_domain;
 
+/*
+ * Watches are indexed by a trie of the components of their paths, so that
+ * firing watches for a node only needs to look at the node's ancestors
+ * (and its descendants, for removals), rather than at all watches.  The
+ * root stands for "/", whose watches see all events.  Special watches
+ * ("@releaseDomain" etc.) live in a separate trie.
+ */
+struct watch_node
+{
+	struct watch_node *parent;
+
+	/* Siblings, and children.  Children are also hashed by name. */
+	struct list_head list;
+	struct list_head children;
+	struct hashtable *child_hash;
+
+	/* Watches on this path. */
+	struct list_head watches;
+
+	/* Path component, owned by parent's child_hash. */
+	char *name;
+};
+
+static struct watch_node *watch_root, *event_root;
+
 struct watch
 {
 	/* Watches on this connection */
 	struct list_head list;
 
+	/* Watches on the same path. */
+	struct list_head node_list;
+	struct watch_node *wnode;
+
+	struct connection *conn;
+
 	/* Current outstanding events applying to this watch. */
 	struct list_head events;
 
@@ -56,22 +89,123 @@ static bool check_event_node(const char *node)
 	return true;
 }
 
-/* Is child a subnode of parent, or equal? */
-static bool is_child(const char *child, const char *parent)
+static unsigned int hash_name(void *k)
 {
-	unsigned int len = strlen(parent);
+	const char *str = k;
+	unsigned int hash = 5381;
+	char c;
 
-	/*
-	 * / should really be "" for this algorithm to work, but that's a
-	 * usability nightmare.
-	 */
-	if (streq(parent, "/"))
-		return true;
+	while ((c = *str++))
+		hash = ((hash << 5) + hash) + (unsigned int)c;
 
-	if (strncmp(child, parent, len) != 0)
-		return false;
+	return hash;
+}
 
-	return child[len] == '/' || child[len] == '\0';
+static int names_equal(void *key1, void *key2)
+{
+	return streq(key1, key2);
+}
+
+static struct watch_node *new_watch_node(struct watch_node *parent)
+{
+	struct watch_node *wn = talloc_zero(parent, struct watch_node);
+
+	if (!wn)
+		return NULL;
+
+	wn->parent = parent;
+	INIT_LIST_HEAD(&wn->list);
+	INIT_LIST_HEAD(&wn->children);
+	INIT_LIST_HEAD(&wn->watches);
+
+	return wn;
+}
+
+static struct watch_node *find_child(struct watch_node *wn, const char *name,
+				     bool create)
+{
+	struct watch_node *child;
+	char *key;
+
+	child = wn->child_hash ? hashtable_search(wn->child_hash, (void *)name)
+			       : NULL;
+	if (child || !create)
+		return child;
+
+	if (!wn->child_hash) {
+		wn->child_hash = create_hashtable(8, hash_name, names_equal);
+		if (!wn->child_hash)
+			return NULL;
+	}
+
+	child = new_watch_node(wn);
+	key = strdup(name);
+	if (!child || !key || !hashtable_insert(wn->child_hash, key, child)) {
+		talloc_free(child);
+		free(key);
+		return NULL;
+	}
+	child->name = key;
+	list_add_tail(&child->list, &wn->children);
+
+	return child;
+}
+
+/* Drop trie nodes no longer leading to any watch. */
+static void prune_watch_node(struct watch_node *wn)
+{
+	struct watch_node *parent;
+
+	while ((parent = wn->parent) && list_empty(&wn->watches) &&
+	       list_empty(&wn->children)) {
+		list_del(&wn->list);
+		/* Frees wn->name. */
+		hashtable_remove(parent->child_hash, wn->name);
+		if (wn->child_hash)
+			hashtable_destroy(wn->child_hash, 0);
+		talloc_free(wn);
+		wn = parent;
+	}
+}
+
+/*
+ * Look up the trie node of a path, splitting the (temporary) copy of it in
+ * tmp into components, and calling fn (if any) for each node on the way
+ * below the root.  Missing nodes are created if create is set.
+ */
+static struct watch_node *walk_watch_nodes(char *tmp, bool create,
+					   void (*fn)(struct watch_node *,
+						      void *),
+					   void *arg)
+{
+	struct watch_node **root = *tmp == '/' ? &watch_root : &event_root;
+	struct watch_node *wn, *child;
+	char *comp, *next;
+
+	if (!*root && !(*root = new_watch_node(NULL)))
+		return NULL;
+	wn = *root;
+
+	for (comp = tmp; comp; comp = next) {
+		while (*comp == '/')
+			comp++;
+		if (!*comp)
+			break;
+		next = strchr(comp, '/');
+		if (next)
+			*next++ = '\0';
+		child = find_child(wn, comp, create);
+		if (!child) {
+			if (create)
+				prune_watch_node(wn);
+			return NULL;
+		}
+		wn = child;
+		if (fn)
+			fn(wn, arg);
+	}
+
+	return wn;
 }
 
 /*
@@ -119,6 +253,34 @@ static void add_event(struct connection *conn,
 	talloc_free(data);
 }
 
+struct fire_args {
+	void *ctx;
+	const char *name;
+};
+
+/* Fire the watches on a path name is on, or below of. */
+static void fire_node_watches(struct watch_node *wn, void *arg)
+{
+	struct fire_args *args = arg;
+	struct watch *watch;
+
+	list_for_each_entry(watch, &wn->watches, node_list)
+		add_event(watch->conn, args->ctx, watch, args->name);
+}
+
+/* Fire the watches below a removed node, with their own path. */
+static void fire_subtree_watches(struct watch_node *wn, void *ctx)
+{
+	struct watch_node *child;
+	struct watch *watch;
+
+	list_for_each_entry(child, &wn->children, list) {
+		list_for_each_entry(watch, &child->watches, node_list)
+			add_event(watch->conn, ctx, watch, watch->node);
+		fire_subtree_watches(child, ctx);
+	}
+}
+
 /*
  * Check whether any watch events are to be sent.
  * Temporary memory allocations are done with ctx.
@@ -126,26 +288,45 @@ static void add_event(struct connection *conn,
 void fire_watches(struct connection *conn, void *ctx, const char *name,
 		  bool recurse)
 {
-	struct connection *i;
-	struct watch *watch;
+	struct fire_args args = { .ctx = ctx, .name = name };
+	struct watch_node *wn;
+	char *tmp;
 
 	/* During transactions, don't fire watches. */
 	if (conn && conn->transaction)
 		return;
 
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		list_for_each_entry(watch, &i->watches, list) {
-			if (is_child(name, watch->node))
-				add_event(i, ctx, watch, name);
-			else if (recurse && is_child(watch->node, name))
-				add_event(i, ctx, watch, watch->node);
-		}
-	}
+	/* Update the mirror before anyone learns about the change. */
+	mirror_changed(name, recurse);
+
+	/* Watches on / see everything. */
+	if (watch_root)
+		fire_node_watches(watch_root, &args);
+
+	if (*name == '/' ? !watch_root : !event_root)
+		return;
+
+	tmp = talloc_strdup(ctx, name);
+	if (!tmp)
+		return;
+
+	/* Watches on each of name's parents (or name itself). */
+	wn = walk_watch_nodes(tmp, false, fire_node_watches, &args);
+	if (wn && recurse)
+		fire_subtree_watches(wn, ctx);
+
+	talloc_free(tmp);
 }
 
 static int destroy_watch(void *_watch)
 {
+	struct watch *watch = _watch;
+
+	if (watch->wnode) {
+		list_del(&watch->node_list);
+		prune_watch_node(watch->wnode);
+	}
+
 	trace_destroy(_watch, "watch");
 	return 0;
 }
@@ -153,7 +334,8 @@ static int destroy_watch(void *_watch)
 int do_watch(struct connection *conn, struct buffered_data *in)
 {
 	struct watch *watch;
-	char *vec[2];
+	struct watch_node *wn;
+	char *vec[2], *tmp;
 	bool relative;
 
 	if (get_strings(in, vec, ARRAY_SIZE(vec)) != ARRAY_SIZE(vec))
@@ -183,12 +365,19 @@ int do_watch(struct connection *conn, struct buffered_data *in)
 	if (domain_watch(conn) > quota_nb_watch_per_domain)
 		return E2BIG;
 
-	watch = talloc(conn, struct watch);
+	watch = talloc_zero(conn, struct watch);
 	if (!watch)
 		return ENOMEM;
+	watch->conn = conn;
 	watch->node = talloc_strdup(watch, vec[0]);
 	watch->token = talloc_strdup(watch, vec[1]);
-	if (!watch->node || !watch->token) {
+	tmp = talloc_strdup(in, vec[0]);
+	if (!watch->node || !watch->token || !tmp) {
+		talloc_free(watch);
+		return ENOMEM;
+	}
+	wn = walk_watch_nodes(tmp, true, NULL, NULL);
+	if (!wn) {
 		talloc_free(watch);
 		return ENOMEM;
 	}
@@ -201,6 +390,8 @@ int do_watch(struct connection *conn, struct buffered_data *in)
 
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
+	list_add_tail(&watch->node_list, &wn->watches);
+	watch->wnode = wn;
 	trace_create(watch, "watch");
 	talloc_set_destructor(watch, destroy_watch);
 	send_ack(conn, XS_WATCH);
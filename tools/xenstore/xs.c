@@ -22,6 +22,8 @@
 #include <sys/uio.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
@@ -34,6 +36,7 @@
 #include "xenstore.h"
 #include "list.h"
 #include "utils.h"
+#include "xs_mirror.h"
 
 #include <xentoolcore_internal.h>
 
@@ -73,19 +76,24 @@ struct xs_handle {
 	bool unwatch_filter;
 
 	/*
-         * A list of replies. Currently only one will ever be outstanding
-         * because we serialise requests. The requester can wait on the
-         * conditional variable for its response.
+         * A list of replies, matched to their requests by req_id.  Any
+         * number of requests may be outstanding.  Requesters can wait on
+         * the conditional variable for their response.
          */
 	struct list_head reply_list;
 	pthread_mutex_t reply_mutex;
 	pthread_cond_t reply_condvar;
 
-	/* One request at a time. */
+	/* One request written at a time. */
 	pthread_mutex_t request_mutex;
+	xs_request_t next_req_id;
+
+	/* Mirror of frequently read nodes, if xenstored provides one. */
+	const struct xs_mirror *mirror;
 
 	/* Lock discipline:
 	 *  Only holder of the request lock may write to h->fd.
+	 *  Only holder of the request lock may access next_req_id.
 	 *  Only holder of the request lock may access read_thr_exists.
 	 *  If read_thr_exists==0, only holder of request lock may read h->fd;
 	 *  If read_thr_exists==1, only the read thread may read h->fd.
@@ -102,6 +110,7 @@ struct xs_handle {
 #define mutex_lock(m)		pthread_mutex_lock(m)
 #define mutex_unlock(m)		pthread_mutex_unlock(m)
 #define condvar_signal(c)	pthread_cond_signal(c)
+#define condvar_broadcast(c)	pthread_cond_broadcast(c)
 #define condvar_wait(c,m)	pthread_cond_wait(c,m)
 #define cleanup_push(f, a)	\
     pthread_cleanup_push((void (*)(void *))(f), (void *)(a))
@@ -132,11 +141,14 @@ struct xs_handle {
 	int watch_pipe[2];
 	/* Filtering watch event in unwatch function? */
 	bool unwatch_filter;
+	xs_request_t next_req_id;
+	const struct xs_mirror *mirror;
 };
 
 #define mutex_lock(m)		((void)0)
 #define mutex_unlock(m)		((void)0)
 #define condvar_signal(c)	((void)0)
+#define condvar_broadcast(c)	((void)0)
 #define condvar_wait(c,m)	((void)0)
 #define cleanup_push(f, a)	((void)0)
 #define cleanup_pop(run)	((void)0)
@@ -223,8 +235,102 @@ static int get_dev(const char *connect_to)
 	return open(connect_to, O_RDWR);
 }
 
+static void unmap_mirror(struct xs_handle *h)
+{
+	if (h->mirror)
+		munmap((void *)h->mirror, sizeof(*h->mirror));
+	h->mirror = NULL;
+}
+
+static void map_mirror(struct xs_handle *h)
+{
+	char path[PATH_MAX];
+	struct stat buf;
+	void *p;
+	int fd;
+
+	if (snprintf(path, sizeof(path), "%s/" XS_MIRROR_FILE,
+		     xs_daemon_rundir()) >= sizeof(path))
+		return;
+
+	/* It's fine for there to be no mirror. */
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return;
+
+	if (fstat(fd, &buf) == 0 && buf.st_size >= sizeof(*h->mirror)) {
+		p = mmap(NULL, sizeof(*h->mirror), PROT_READ, MAP_SHARED,
+			 fd, 0);
+		if (p != MAP_FAILED)
+			h->mirror = p;
+	}
+
+	close(fd);
+}
+
+/*
+ * Look up a node in the mirror.  Returns false if it isn't mirrored, and
+ * true otherwise, with *value set to its value (or NULL, with errno set).
+ */
+static bool read_mirror(struct xs_handle *h, const char *path,
+			void **value, unsigned int *len)
+{
+	const struct xs_mirror *m = h->mirror;
+	const volatile struct xs_mirror_entry *e;
+	char buf[XS_MIRROR_VALUE_MAX];
+	uint32_t seq, vlen = XS_MIRROR_TOO_BIG;
+	unsigned int i, tries;
+	bool found = false;
+
+	if (!m || m->magic != XS_MIRROR_MAGIC || *path != '/' ||
+	    strlen(path) >= XS_MIRROR_PATH_MAX)
+		return false;
+
+	for (i = 0; i < m->nr_entries && i < XS_MIRROR_ENTRIES; i++) {
+		e = &m->entries[i];
+		if (strncmp((const char *)e->path, path, XS_MIRROR_PATH_MAX))
+			continue;
+
+		/* Don't wait forever for a writer having gone away. */
+		for (tries = 0; tries < 1000; tries++) {
+			seq = e->seq;
+			xs_mirror_barrier();
+			found = !strncmp((const char *)e->path, path,
+					  XS_MIRROR_PATH_MAX);
+			vlen = e->len;
+			if (found && vlen <= XS_MIRROR_VALUE_MAX)
+				memcpy(buf, (const char *)e->value, vlen);
+			xs_mirror_barrier();
+			if (!(seq & 1) && e->seq == seq)
+				break;
+		}
+		break;
+	}
+
+	if (!found || tries == 1000 || vlen == XS_MIRROR_TOO_BIG)
+		return false;
+
+	if (vlen == XS_MIRROR_ABSENT) {
+		*value = NULL;
+		errno = ENOENT;
+		return true;
+	}
+
+	*value = malloc(vlen + 1);
+	if (*value) {
+		memcpy(*value, buf, vlen);
+		((char *)*value)[vlen] = 0;
+		if (len)
+			*len = vlen;
+	}
+
+	return true;
+}
+
 static int all_restrict_cb(Xentoolcore__Active_Handle *ah, domid_t domid) {
     struct xs_handle *h = CONTAINER_OF(ah, *h, tc_ah);
+    /* The mirror is only for privileged clients. */
+    unmap_mirror(h);
     return xentoolcore__restrict_by_dup2_null(h->fd);
 }
 
@@ -255,6 +361,9 @@ static struct xs_handle *get_handle(const char *connect_to)
 	if (h->fd == -1)
 		goto err;
 
+	if (S_ISSOCK(buf.st_mode))
+		map_mirror(h);
+
 	INIT_LIST_HEAD(&h->reply_list);
 	INIT_LIST_HEAD(&h->watch_list);
 
@@ -344,6 +453,7 @@ static void close_fds_free(struct xs_handle *h) {
 
 	xentoolcore__deregister_active_handle(&h->tc_ah);
         close(h->fd);
+	unmap_mirror(h);
         
 	free(h);
 }
@@ -439,35 +549,64 @@ static int get_error(const char *errorstring)
 	return xsd_errors[i].errnum;
 }
 
-/* Adds extra nul terminator, because we generally (always?) hold strings. */
-static void *read_reply(
-	struct xs_handle *h, enum xsd_sockmsg_type *type, unsigned int *len)
+/* Returns the reply to request req_id, if it arrived.  Needs reply lock. */
+static struct xs_stored_msg *find_reply(struct xs_handle *h, uint32_t req_id)
+{
+	struct xs_stored_msg *msg;
+
+	list_for_each_entry(msg, &h->reply_list, list)
+		if (msg->hdr.req_id == req_id)
+			return msg;
+
+	return NULL;
+}
+
+/* Wait for the reply to request req_id.
+ * Adds extra nul terminator, because we generally (always?) hold strings. */
+static void *read_reply(struct xs_handle *h, uint32_t req_id,
+			enum xsd_sockmsg_type *type, unsigned int *len)
 {
 	struct xs_stored_msg *msg;
 	char *body;
 	int read_from_thread;
+	int saved_errno = EINVAL;
 
+	mutex_lock(&h->request_mutex);
 	read_from_thread = read_thread_exists(h);
-
-	/* Read from comms channel ourselves if there is no reader thread. */
-	if (!read_from_thread && (read_message(h, 0) == -1))
-		return NULL;
+	/* Without reader thread, holding the request lock we read ourselves. */
+	if (read_from_thread)
+		mutex_unlock(&h->request_mutex);
 
 	mutex_lock(&h->reply_mutex);
+	while (!(msg = find_reply(h, req_id))) {
+		if (!read_from_thread) {
+			mutex_unlock(&h->reply_mutex);
+			if (read_message(h, 0) == -1) {
+				saved_errno = errno;
+				mutex_lock(&h->reply_mutex);
+				break;
+			}
+			mutex_lock(&h->reply_mutex);
+			continue;
+		}
 #ifdef USE_PTHREAD
-	while (list_empty(&h->reply_list) && read_from_thread && h->fd != -1)
+		if (h->fd == -1)
+			break;
 		condvar_wait(&h->reply_condvar, &h->reply_mutex);
 #endif
-	if (list_empty(&h->reply_list)) {
-		mutex_unlock(&h->reply_mutex);
-		errno = EINVAL;
-		return NULL;
 	}
-	msg = list_top(&h->reply_list, struct xs_stored_msg, list);
-	list_del(&msg->list);
-	assert(list_empty(&h->reply_list));
+	if (msg)
+		list_del(&msg->list);
 	mutex_unlock(&h->reply_mutex);
 
+	if (!read_from_thread)
+		mutex_unlock(&h->request_mutex);
+
+	if (!msg) {
+		errno = saved_errno;
+		return NULL;
+	}
+
 	*type = msg->hdr.type;
 	if (len)
 		*len = msg->hdr.len;
@@ -478,21 +617,18 @@ static void *read_reply(
 	return body;
 }
 
-/* Send message to xs, get malloc'ed reply.  NULL and set errno on error. */
-static void *xs_talkv(struct xs_handle *h, xs_transaction_t t,
-		      enum xsd_sockmsg_type type,
-		      const struct iovec *iovec,
-		      unsigned int num_vecs,
-		      unsigned int *len)
+/* Send message to xs.  Returns the request id, or 0 and set errno on error. */
+static xs_request_t xs_send(struct xs_handle *h, xs_transaction_t t,
+			    enum xsd_sockmsg_type type,
+			    const struct iovec *iovec,
+			    unsigned int num_vecs)
 {
 	struct xsd_sockmsg msg;
-	void *ret = NULL;
 	int saved_errno;
 	unsigned int i;
 	struct sigaction ignorepipe, oldact;
 
 	msg.tx_id = t;
-	msg.req_id = 0;
 	msg.type = type;
 	msg.len = 0;
 	for (i = 0; i < num_vecs; i++)
@@ -510,6 +646,11 @@ static void *xs_talkv(struct xs_handle *h, xs_transaction_t t,
 
 	mutex_lock(&h->request_mutex);
 
+	/* Request ids are never 0, telling failure apart. */
+	msg.req_id = h->next_req_id++;
+	if (!msg.req_id)
+		msg.req_id = h->next_req_id++;
+
 	if (!xs_write_all(h->fd, &msg, sizeof(msg)))
 		goto fail;
 
@@ -517,39 +658,74 @@ static void *xs_talkv(struct xs_handle *h, xs_transaction_t t,
 		if (!xs_write_all(h->fd, iovec[i].iov_base, iovec[i].iov_len))
 			goto fail;
 
-	ret = read_reply(h, &msg.type, len);
-	if (!ret)
-		goto fail;
-
 	mutex_unlock(&h->request_mutex);
 
 	sigaction(SIGPIPE, &oldact, NULL);
-	if (msg.type == XS_ERROR) {
+	return msg.req_id;
+
+fail:
+	/* We're in a bad state, so close fd. */
+	saved_errno = errno;
+	mutex_unlock(&h->request_mutex);
+	sigaction(SIGPIPE, &oldact, NULL);
+	close(h->fd);
+	h->fd = -1;
+	errno = saved_errno;
+	return 0;
+}
+
+/* Get malloc'ed reply to request req_id, which must be of the given type
+ * (or any, for XS_INVALID).  NULL and set errno on error. */
+static void *xs_wait(struct xs_handle *h, xs_request_t req_id,
+		     enum xsd_sockmsg_type type, unsigned int *len)
+{
+	enum xsd_sockmsg_type reply_type;
+	void *ret;
+	int saved_errno;
+
+	ret = read_reply(h, req_id, &reply_type, len);
+	if (!ret) {
+		saved_errno = errno;
+		goto close_fd;
+	}
+
+	if (reply_type == XS_ERROR) {
 		saved_errno = get_error(ret);
 		free(ret);
 		errno = saved_errno;
 		return NULL;
 	}
 
-	if (msg.type != type) {
+	if (type != XS_INVALID && reply_type != type) {
 		free(ret);
 		saved_errno = EBADF;
 		goto close_fd;
 	}
 	return ret;
 
-fail:
-	/* We're in a bad state, so close fd. */
-	saved_errno = errno;
-	mutex_unlock(&h->request_mutex);
-	sigaction(SIGPIPE, &oldact, NULL);
 close_fd:
+	/* We're in a bad state, so close fd. */
 	close(h->fd);
 	h->fd = -1;
 	errno = saved_errno;
 	return NULL;
 }
 
+/* Send message to xs, get malloc'ed reply.  NULL and set errno on error. */
+static void *xs_talkv(struct xs_handle *h, xs_transaction_t t,
+		      enum xsd_sockmsg_type type,
+		      const struct iovec *iovec,
+		      unsigned int num_vecs,
+		      unsigned int *len)
+{
+	xs_request_t req_id = xs_send(h, t, type, iovec, num_vecs);
+
+	if (!req_id)
+		return NULL;
+
+	return xs_wait(h, req_id, type, len);
+}
+
 /* free(), but don't change errno. */
 static void free_no_errno(void *p)
 {
@@ -671,6 +847,230 @@ char **xs_directory(struct xs_handle *h, xs_transaction_t t,
 	return xs_directory_common(strings, len, num);
 }
 
+/* Parse one XS_DIRECTORY_VALUES entry from [p, end), returning its size,
+ * or 0 if malformed.  An empty name ends the list. */
+static unsigned int parse_dir_value(const char *p, const char *end,
+				    const char **name, const char **value,
+				    unsigned int *len)
+{
+	const char *q, *lenstr;
+	unsigned long l;
+
+	*name = p;
+	*value = NULL;
+	*len = 0;
+
+	q = memchr(p, 0, end - p);
+	if (!q++)
+		return 0;
+	if (!**name)
+		return q - p;
+
+	lenstr = q;
+	q = memchr(q, 0, end - q);
+	if (!q++)
+		return 0;
+	if (*lenstr) {
+		l = strtoul(lenstr, NULL, 10);
+		if (l > end - q)
+			return 0;
+		*value = q;
+		*len = l;
+		q += l;
+	}
+
+	return q - p;
+}
+
+/* Pack names and (malloced) values into one allocation, freeing values. */
+static struct xs_dir_value *pack_dir_values(struct xs_dir_value *tmp,
+					    unsigned int num)
+{
+	struct xs_dir_value *ret;
+	unsigned int i;
+	size_t size = num * sizeof(*ret);
+	char *p;
+
+	for (i = 0; i < num; i++)
+		size += strlen(tmp[i].name) + 1 +
+			(tmp[i].value ? tmp[i].len + 1 : 0);
+
+	ret = malloc(size ?: 1);
+	if (ret) {
+		p = (char *)&ret[num];
+		for (i = 0; i < num; i++) {
+			ret[i].name = strcpy(p, tmp[i].name);
+			p += strlen(p) + 1;
+			ret[i].value = NULL;
+			ret[i].len = tmp[i].len;
+			if (tmp[i].value) {
+				ret[i].value = memcpy(p, tmp[i].value,
+						      tmp[i].len + 1);
+				p += tmp[i].len + 1;
+			}
+		}
+	}
+
+	for (i = 0; i < num; i++)
+		free_no_errno((void *)tmp[i].value);
+
+	return ret;
+}
+
+static void *xs_read_child(struct xs_handle *h, xs_transaction_t t,
+			   const char *path, const char *name,
+			   unsigned int *len)
+{
+	char *child;
+	void *val;
+
+	child = malloc(strlen(path) + strlen(name) + 2);
+	if (!child)
+		return NULL;
+	sprintf(child, "%s/%s", strcmp(path, "/") ? path : "", name);
+	val = xs_read(h, t, child, len);
+	free_no_errno(child);
+
+	return val;
+}
+
+/* Fallback for daemons not knowing XS_DIRECTORY_VALUES. */
+static struct xs_dir_value *xs_directory_values_slow(struct xs_handle *h,
+						     xs_transaction_t t,
+						     const char *path,
+						     unsigned int *num)
+{
+	struct xs_dir_value *tmp, *ret = NULL;
+	char **names;
+	unsigned int i;
+
+	names = xs_directory(h, t, path, num);
+	if (!names)
+		return NULL;
+
+	tmp = calloc(*num ?: 1, sizeof(*tmp));
+	if (tmp) {
+		for (i = 0; i < *num; i++) {
+			tmp[i].name = names[i];
+			tmp[i].value = xs_read_child(h, t, path, names[i],
+						     &tmp[i].len);
+			if (!tmp[i].value)
+				tmp[i].len = 0;
+		}
+		ret = pack_dir_values(tmp, *num);
+		free_no_errno(tmp);
+	}
+	free_no_errno(names);
+
+	return ret;
+}
+
+struct xs_dir_value *xs_directory_values(struct xs_handle *h,
+					 xs_transaction_t t,
+					 const char *path, unsigned int *num)
+{
+	unsigned int off, result_len, raw_len, entlen, len, n, i;
+	char gen[24], offstr[12];
+	struct iovec iovec[2];
+	char *result, *raw = NULL, *p, *end, *start;
+	const char *name, *value;
+	struct xs_dir_value *tmp, *ret = NULL;
+	bool done;
+
+	iovec[0].iov_base = (void *)path;
+	iovec[0].iov_len = strlen(path) + 1;
+
+ again:
+	/* Collect the entries of all parts first. */
+	memset(gen, 0, sizeof(gen));
+	raw_len = 0;
+	n = 0;
+
+	for (off = 0, done = false; !done;) {
+		snprintf(offstr, sizeof(offstr), "%u", off);
+		iovec[1].iov_base = (void *)offstr;
+		iovec[1].iov_len = strlen(offstr) + 1;
+		result = xs_talkv(h, t, XS_DIRECTORY_VALUES, iovec, 2,
+				  &result_len);
+		if (!result) {
+			free_no_errno(raw);
+			if (errno == EINVAL || errno == ENOSYS)
+				return xs_directory_values_slow(h, t, path,
+								num);
+			return NULL;
+		}
+
+		/* Start over if the directory changed meanwhile. */
+		if (off && strcmp(gen, result)) {
+			free(result);
+			goto again;
+		}
+		strncpy(gen, result, sizeof(gen) - 1);
+
+		start = p = result + strlen(result) + 1;
+		end = result + result_len;
+		if (p > end)
+			goto bad;
+		p = realloc(raw, raw_len + (end - start) + 1);
+		if (!p) {
+			free(result);
+			goto out;
+		}
+		raw = p;
+
+		for (p = start; p < end; p += entlen) {
+			entlen = parse_dir_value(p, end, &name, &value, &len);
+			if (!entlen)
+				goto bad;
+			if (!*name) {
+				done = true;
+				break;
+			}
+			memcpy(raw + raw_len, p, entlen);
+			raw_len += entlen;
+			off += strlen(name) + 1;
+			n++;
+		}
+
+		/* A part without progress would make us loop forever. */
+		if (!done && p == start)
+			goto bad;
+		free(result);
+	}
+
+	tmp = calloc(n ?: 1, sizeof(*tmp));
+	if (!tmp)
+		goto out;
+
+	for (p = raw, i = 0; i < n; i++, p += entlen) {
+		entlen = parse_dir_value(p, raw + raw_len, &name, &value, &len);
+		tmp[i].name = name;
+		/* Values left out need reading on their own. */
+		if (!value)
+			tmp[i].value = xs_read_child(h, t, path, name, &len);
+		else if ((tmp[i].value = malloc(len + 1))) {
+			memcpy((void *)tmp[i].value, value, len);
+			((char *)tmp[i].value)[len] = 0;
+		}
+		tmp[i].len = tmp[i].value ? len : 0;
+	}
+
+	ret = pack_dir_values(tmp, n);
+	free_no_errno(tmp);
+	if (ret)
+		*num = n;
+
+ out:
+	free_no_errno(raw);
+	return ret;
+
+ bad:
+	free(result);
+	free(raw);
+	errno = EBADF;
+	return NULL;
+}
+
 /* Get the value of a single file, nul terminated.
  * Returns a malloced value: call free() on it after use.
  * len indicates length in bytes, not including the nul.
@@ -678,6 +1078,11 @@ char **xs_directory(struct xs_handle *h, xs_transaction_t t,
 void *xs_read(struct xs_handle *h, xs_transaction_t t,
 	      const char *path, unsigned int *len)
 {
+	void *value;
+
+	if (t == XBT_NULL && read_mirror(h, path, &value, len))
+		return value;
+
 	return xs_single(h, t, XS_READ, path, len);
 }
 
@@ -716,6 +1121,55 @@ bool xs_rm(struct xs_handle *h, xs_transaction_t t,
 	return xs_bool(xs_single(h, t, XS_RM, path, NULL));
 }
 
+static xs_request_t xs_send_single(struct xs_handle *h, xs_transaction_t t,
+				   enum xsd_sockmsg_type type,
+				   const char *string)
+{
+	struct iovec iovec;
+
+	iovec.iov_base = (void *)string;
+	iovec.iov_len = strlen(string) + 1;
+	return xs_send(h, t, type, &iovec, 1);
+}
+
+xs_request_t xs_read_async(struct xs_handle *h, xs_transaction_t t,
+			   const char *path)
+{
+	return xs_send_single(h, t, XS_READ, path);
+}
+
+xs_request_t xs_write_async(struct xs_handle *h, xs_transaction_t t,
+			    const char *path, const void *data,
+			    unsigned int len)
+{
+	struct iovec iovec[2];
+
+	iovec[0].iov_base = (void *)path;
+	iovec[0].iov_len = strlen(path) + 1;
+	iovec[1].iov_base = (void *)data;
+	iovec[1].iov_len = len;
+
+	return xs_send(h, t, XS_WRITE, iovec, ARRAY_SIZE(iovec));
+}
+
+xs_request_t xs_mkdir_async(struct xs_handle *h, xs_transaction_t t,
+			    const char *path)
+{
+	return xs_send_single(h, t, XS_MKDIR, path);
+}
+
+xs_request_t xs_rm_async(struct xs_handle *h, xs_transaction_t t,
+			 const char *path)
+{
+	return xs_send_single(h, t, XS_RM, path);
+}
+
+void *xs_async_wait(struct xs_handle *h, xs_request_t req,
+		    unsigned int *len)
+{
+	return xs_wait(h, req, XS_INVALID, len);
+}
+
 /* Get permissions of node (first element is owner).
  * Returns malloced array, or NULL: call free() after use.
  */
@@ -1269,15 +1723,8 @@ static int read_message(struct xs_handle *h, int nonblocking)
 	} else {
 		mutex_lock(&h->reply_mutex);
 
-		/* There should only ever be one response pending! */
-		if (!list_empty(&h->reply_list)) {
-			mutex_unlock(&h->reply_mutex);
-			saved_errno = EEXIST;
-			goto error_freebody;
-		}
-
 		list_add_tail(&msg->list, &h->reply_list);
-		condvar_signal(&h->reply_condvar);
+		condvar_broadcast(&h->reply_condvar);
 
 		mutex_unlock(&h->reply_mutex);
 	}
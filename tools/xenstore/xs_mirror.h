@@ -0,0 +1,57 @@
+/*
+    Layout of the mirror of frequently read nodes, shared between the Xen
+    Store Daemon and libxenstore.
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef XS_MIRROR_H
+#define XS_MIRROR_H
+
+#include <stdint.h>
+
+/*
+ * With the mirror enabled, xenstored keeps the values of a configurable set
+ * of nodes in a file in its run directory, which clients connected via the
+ * (privileged) sockets map to read these nodes without a round trip to the
+ * daemon.  Each entry is protected by a sequence count, which is odd while
+ * the entry is being updated.  Nodes not in the mirror, or with values too
+ * large for it, are read through the socket as usual.
+ */
+#define XS_MIRROR_FILE		"mirror"
+#define XS_MIRROR_MAGIC		0x78736d31	/* "xsm1" */
+#define XS_MIRROR_ENTRIES	64
+#define XS_MIRROR_PATH_MAX	128
+#define XS_MIRROR_VALUE_MAX	248
+
+/* Values of len other than the value's length. */
+#define XS_MIRROR_ABSENT	(~(uint32_t)0)	/* The node doesn't exist. */
+#define XS_MIRROR_TOO_BIG	(~(uint32_t)1)	/* Read it from xenstored. */
+
+struct xs_mirror_entry {
+	uint32_t seq;
+	uint32_t len;
+	char path[XS_MIRROR_PATH_MAX];		/* Empty if unused. */
+	char value[XS_MIRROR_VALUE_MAX];
+};
+
+struct xs_mirror {
+	uint32_t magic;
+	uint32_t nr_entries;
+	struct xs_mirror_entry entries[XS_MIRROR_ENTRIES];
+};
+
+#define xs_mirror_barrier()	__sync_synchronize()
+
+#endif /* XS_MIRROR_H */
@@ -27,9 +27,24 @@ mread_handle_t mread_init(int fd)
     fstat(fd, &s);
     h->file_size = s.st_size;
 
+    /* One mapping makes every read a copy, and is safe to share between
+     * threads; the windows below are for when the address space won't
+     * take the file. */
+    if ( h->file_size > 0 && (size_t)h->file_size == h->file_size )
+    {
+        h->whole = mmap(NULL, h->file_size, PROT_READ, MAP_SHARED, fd, 0);
+        if ( h->whole == MAP_FAILED )
+            h->whole = NULL;
+    }
+
     return h;
 }
 
+const char *mread_whole(mread_handle_t h)
+{
+    return h->whole;
+}
+
 ssize_t mread64(mread_handle_t h, void *rec, ssize_t len, off_t offset)
 {
     /* Idea: have a "cache" of N mmaped regions.  If the offset is
@@ -66,6 +81,12 @@ ssize_t mread64(mread_handle_t h, void *rec, ssize_t len, off_t offset)
         len = h->file_size - offset;
     }
 
+    if ( h->whole )
+    {
+        bcopy(h->whole + offset, rec, len);
+        return len;
+    }
+
     /* Try to find the offset in our range */
     dprintf(warn, " Trying last, %d\n", last);
     if ( h->map[h->last].buffer
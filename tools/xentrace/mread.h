@@ -6,6 +6,7 @@
 typedef struct mread_ctrl {
     int fd;
     off_t file_size;
+    char * whole; /* the whole file, if it could be mapped in one go */
     struct mread_buffer {
         char * buffer;
         off_t start_offset;
@@ -16,3 +17,5 @@ typedef struct mread_ctrl {
 
 mread_handle_t mread_init(int fd);
 ssize_t mread64(mread_handle_t h, void *dst, ssize_t len, off_t offset);
+/* Returns the whole file mapped, or NULL if only mread64() can get at it */
+const char *mread_whole(mread_handle_t h);
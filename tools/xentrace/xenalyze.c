@@ -29,6 +29,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <xen/trace.h>
 #include "analyze.h"
 #include "mread.h"
@@ -64,6 +65,13 @@ struct array_struct {
     } while(0)                                    \
 
 /* -- Global variables -- */
+/* One cpu_change window of the trace file; see build_window_index() */
+struct window_index_entry {
+    off_t offset;
+    int cpu;
+    tsc_t first_tsc, last_tsc; /* 0 if the window has no tsc */
+};
+
 struct {
     int fd;
     struct mread_ctrl *mh;
@@ -78,6 +86,10 @@ struct {
         FILE* out;
         int pid;
     } progress;
+    struct {
+        struct window_index_entry *e;
+        int count;
+    } index;
 } G = {
     .fd=-1,
     .symbols = NULL,
@@ -180,6 +192,7 @@ struct {
         summary:1,
         report_pcpu:1,
         tsc_loop_fatal:1,
+        time_window:1,
         summary_info;
     long long cpu_qhz, cpu_hz;
     int scatterplot_interrupt_vector;
@@ -222,6 +235,11 @@ struct {
         };
         int count;
     } interval;
+    struct {
+        /* seconds into the trace; end 0 for the end of the file */
+        double start, end;
+        tsc_t start_tsc, end_tsc;
+    } window;
 } opt = {
     .scatterplot_interrupt_eip=0,
     .scatterplot_unpin_promote=0,
@@ -7907,6 +7925,24 @@ void sched_process(struct pcpu_info *p)
                        ri->dump_header, r->domid, r->vcpuid);
             }
             break;
+        case TRC_SCHED_CLASS_EVT(CSCHED2, 24): /* LOAD_LEVEL       */
+            if(opt.dump_all) {
+                struct {
+                    unsigned lrqi:16, orqi:16;
+                    unsigned level:16, ok:16;
+                    unsigned load_delta;
+                } *r = (typeof(r))ri->d;
+                static const char *levels[] = {
+                    "core", "socket", "node", "system"
+                };
+
+                printf(" %s csched2:load_balance_level lrq# %u, orq# %u, "
+                       "level = %s, delta = %u, %s\n",
+                       ri->dump_header, r->lrqi, r->orqi,
+                       r->level < ARRAY_SIZE(levels) ? levels[r->level] : "?",
+                       r->load_delta, r->ok ? "balancing" : "skipping");
+            }
+            break;
         /* RTDS (TRC_RTDS_xxx) */
         case TRC_SCHED_CLASS_EVT(RTDS, 1): /* TICKLE           */
             if(opt.dump_all) {
@@ -7972,6 +8008,18 @@ void sched_process(struct pcpu_info *p)
                        r->tickled ? ", tickled" : ", not tickled");
             }
             break;
+        case TRC_SCHED_CLASS_EVT(RTDS, 7): /* REPL_HANDLER     */
+            if (opt.dump_all) {
+                struct {
+                    uint64_t hold_time;
+                    unsigned int nr_repl;
+                } __attribute__((packed)) *r = (typeof(r))ri->d;
+
+                printf(" %s rtds:repl_handler %u vcpus replenished, "
+                       "lock held for %"PRIu64" ns\n",
+                       ri->dump_header, r->nr_repl, r->hold_time);
+            }
+            break;
         case TRC_SCHED_CLASS_EVT(SNULL, 1): /* PICKED_CPU */
             if (opt.dump_all) {
                 struct {
@@ -9833,6 +9881,13 @@ struct pcpu_info * choose_next_record(void)
     /* If there are active pcpus, make sure we chose one */
     assert(min_p || (P.max_active_pcpu==-1));
 
+    /* Past the end of the time window: wind up as at the end of the file */
+    if ( min_p && opt.window.end_tsc && min_p->order_tsc > opt.window.end_tsc ) {
+        while ( record_order[0] )
+            deactivate_pcpu(record_order[0]);
+        return NULL;
+    }
+
     return min_p;
 }
 
@@ -9966,9 +10021,194 @@ void report_pcpu(void) {
 
 }
 
-void init_pcpus(void) {
-    int i=0;
+/*
+ * Time window seeking.  The windows are found by hopping from one
+ * cpu_change record to the next, which only reads their headers; then
+ * the records of every window are walked for its first and last tsc, by
+ * a few threads when the whole file is mapped, since windows can be
+ * decoded independently of each other.
+ */
+#define INDEX_MAX_THREADS 16
+
+struct index_job {
+    const char *file;
+    int first, stride;
+};
+
+static void index_window(const char *file, struct window_index_entry *e)
+{
+    struct trace_record rec;
+    struct cpu_change_data *cd;
+    off_t o, end;
+    ssize_t size;
+
+    memcpy(&rec, file + e->offset, sizeof(uint32_t) + sizeof(*cd));
+    cd = (typeof(cd))rec.u.notsc.data;
+    o = e->offset + sizeof(uint32_t) + sizeof(*cd);
+    end = o + cd->window_size;
+    if ( end > G.file_size )
+        end = G.file_size;
+
+    while ( o + (off_t)sizeof(uint32_t) <= end ) {
+        memcpy(&rec, file + o, sizeof(uint32_t));
+        size = get_rec_size(&rec);
+        if ( o + size > end )
+            break;
+        if ( rec.cycle_flag ) {
+            tsc_t tsc;
+
+            memcpy(&rec, file + o, size);
+            tsc = (((tsc_t)rec.u.tsc.tsc_hi) << 32) | rec.u.tsc.tsc_lo;
+            if ( !e->first_tsc )
+                e->first_tsc = tsc;
+            e->last_tsc = tsc;
+        }
+        o += size;
+    }
+}
+
+static void *index_thread(void *arg)
+{
+    struct index_job *job = arg;
+    int i;
+
+    for ( i = job->first; i < G.index.count; i += job->stride )
+        index_window(job->file, G.index.e + i);
+
+    return NULL;
+}
+
+void build_window_index(void) {
+    const char *file = mread_whole(G.mh);
+    struct index_job jobs[INDEX_MAX_THREADS];
+    pthread_t threads[INDEX_MAX_THREADS];
+    struct trace_record rec;
+    struct cpu_change_data *cd;
     off_t offset = 0;
+    ssize_t r;
+    int i, max = 0, nr_threads;
+
+    while ( (r = __read_record(&rec, offset)) ) {
+        if ( rec.event != TRC_TRACE_CPU_CHANGE || rec.cycle_flag ) {
+            fprintf(warn, "%s: no cpu_change at offset %llx, index stops there\n",
+                    __func__, (unsigned long long)offset);
+            break;
+        }
+        cd = (typeof(cd))rec.u.notsc.data;
+
+        if ( G.index.count == max ) {
+            max = max ? max * 2 : 1024;
+            G.index.e = realloc(G.index.e, max * sizeof(*G.index.e));
+            if ( !G.index.e ) {
+                perror("realloc");
+                error(ERR_SYSTEM, NULL);
+            }
+        }
+        G.index.e[G.index.count].offset = offset;
+        G.index.e[G.index.count].cpu = cd->cpu;
+        G.index.e[G.index.count].first_tsc = 0;
+        G.index.e[G.index.count].last_tsc = 0;
+        G.index.count++;
+
+        offset += r + cd->window_size;
+    }
+
+    if ( !file ) {
+        /* mread64() isn't thread safe; read the windows one by one */
+        char *copy = NULL;
+
+        for ( i = 0; i < G.index.count; i++ ) {
+            struct window_index_entry e = G.index.e[i];
+            off_t len = (i + 1 < G.index.count ? G.index.e[i + 1].offset
+                         : G.file_size) - e.offset;
+
+            copy = realloc(copy, len);
+            if ( !copy ) {
+                perror("realloc");
+                error(ERR_SYSTEM, NULL);
+            }
+            mread64(G.mh, copy, len, e.offset);
+            e.offset = 0;
+            index_window(copy, &e);
+            G.index.e[i].first_tsc = e.first_tsc;
+            G.index.e[i].last_tsc = e.last_tsc;
+        }
+        free(copy);
+        return;
+    }
+
+    nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if ( nr_threads < 1 )
+        nr_threads = 1;
+    if ( nr_threads > INDEX_MAX_THREADS )
+        nr_threads = INDEX_MAX_THREADS;
+
+    for ( i = 0; i < nr_threads; i++ ) {
+        jobs[i].file = file;
+        jobs[i].first = i;
+        jobs[i].stride = nr_threads;
+        if ( pthread_create(threads + i, NULL, index_thread, jobs + i) ) {
+            /* do the rest here */
+            jobs[i].stride = 1;
+            index_thread(jobs + i);
+            nr_threads = i;
+            break;
+        }
+    }
+    for ( i = 0; i < nr_threads; i++ )
+        pthread_join(threads[i], NULL);
+}
+
+/*
+ * Returns the offset to start processing from for --time-start: that of
+ * the earliest window, over all cpus, of the first window of each cpu
+ * still holding records at or after the start.  Windows of one cpu come
+ * in tsc order.  Also works out the tsc bounds of the window.
+ */
+off_t time_window_seek(void) {
+    static off_t first_window[MAX_CPUS];
+    tsc_t first_tsc = 0;
+    off_t offset = -1;
+    int i;
+
+    build_window_index();
+
+    for ( i = 0; i < G.index.count; i++ )
+        if ( G.index.e[i].first_tsc
+             && (!first_tsc || G.index.e[i].first_tsc < first_tsc) )
+            first_tsc = G.index.e[i].first_tsc;
+
+    opt.window.start_tsc = first_tsc + (tsc_t)(opt.window.start * opt.cpu_hz);
+    if ( opt.window.end > 0 )
+        opt.window.end_tsc = first_tsc + (tsc_t)(opt.window.end * opt.cpu_hz);
+
+    for ( i = 0; i < MAX_CPUS; i++ )
+        first_window[i] = -1;
+
+    for ( i = 0; i < G.index.count; i++ ) {
+        struct window_index_entry *e = G.index.e + i;
+
+        if ( e->cpu < 0 || e->cpu >= MAX_CPUS || first_window[e->cpu] >= 0 )
+            continue;
+        if ( e->last_tsc >= opt.window.start_tsc ) {
+            first_window[e->cpu] = e->offset;
+            if ( offset < 0 || e->offset < offset )
+                offset = e->offset;
+        }
+    }
+
+    fprintf(warn, "%s: %d windows indexed, starting at offset %llx\n",
+            __func__, G.index.count,
+            (unsigned long long)(offset < 0 ? G.file_size : offset));
+
+    free(G.index.e);
+    G.index.e = NULL;
+
+    return offset < 0 ? G.file_size : offset;
+}
+
+void init_pcpus(off_t offset) {
+    int i=0;
 
     for(i=0; i<MAX_CPUS; i++)
     {
@@ -10046,6 +10286,8 @@ enum {
     OPT_PROGRESS,
     OPT_TOLERANCE,
     OPT_TSC_LOOP_FATAL,
+    OPT_TIME_START,
+    OPT_TIME_END,
     /* Specific letters */
     OPT_DUMP_ALL='a',
     OPT_INTERVAL_LENGTH='i',
@@ -10526,6 +10768,23 @@ error_t cmd_parser(int key, char *arg, struct argp_state *state)
         opt.tsc_loop_fatal = 1;
         break;
 
+    case OPT_TIME_START:
+    case OPT_TIME_END:
+    {
+        char * inval;
+        double t = strtod(arg, &inval);
+
+        if ( inval == arg || t < 0 )
+            argp_usage(state);
+
+        if ( key == OPT_TIME_START )
+            opt.window.start = t;
+        else
+            opt.window.end = t;
+        opt.time_window = 1;
+        break;
+    }
+
     case ARGP_KEY_ARG:
     {
         /* FIXME - strcpy */
@@ -10815,6 +11074,16 @@ const struct argp_option cmd_opts[] =  {
       .key = OPT_TSC_LOOP_FATAL,
       .doc = "Stop processing and exit if tsc skew tracking detects a dependency loop.", },
 
+    { .name = "time-start",
+      .key = OPT_TIME_START,
+      .arg = "seconds",
+      .doc = "Only analyze from this many seconds into the trace.  The file is indexed first, and processing starts at the windows holding that time, without reading the ones before.", },
+
+    { .name = "time-end",
+      .key = OPT_TIME_END,
+      .arg = "seconds",
+      .doc = "Stop analyzing this many seconds into the trace.", },
+
     { .name = "tolerance",
       .key = OPT_TOLERANCE,
       .arg = "errlevel",
@@ -10861,7 +11130,7 @@ int main(int argc, char *argv[]) {
     if(opt.dump_all)
         warn = stdout;
 
-    init_pcpus();
+    init_pcpus(opt.time_window ? time_window_seek() : 0);
 
     if(opt.progress)
         progress_init();
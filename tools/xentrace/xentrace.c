@@ -9,6 +9,8 @@
  * Date:   February 2004
  */
 
+#define _GNU_SOURCE
+
 #include <time.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -25,6 +27,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <poll.h>
+#include <pthread.h>
 #include <sys/statvfs.h>
 
 #include <xen/xen.h>
@@ -49,6 +52,108 @@ do {                                                            \
 #define POLL_SLEEP_MILLIS 100
 
 #define DEFAULT_TBUF_SIZE 32
+
+/* smallest staging buffer of a reader thread */
+#define STAGE_SIZE (1UL << 20)
+
+/* size and alignment of the writes made with --direct-io */
+#define DIRECT_BUF_SIZE (4UL << 20)
+#define DIRECT_ALIGN 4096
+
+/***** LZ4 frame output ******************************************************/
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define INIT
+#define likely(a) a
+#define unlikely(a) a
+
+static inline uint_fast16_t le16_to_cpup(const unsigned char *buf)
+{
+    return buf[0] | (buf[1] << 8);
+}
+
+static inline uint_fast32_t le32_to_cpup(const unsigned char *buf)
+{
+    return le16_to_cpup(buf) | ((uint32_t)le16_to_cpup(buf + 2) << 16);
+}
+
+#define get_unaligned(_p) (*(_p))
+#define put_unaligned(_val,_p) (*(_p)=_val)
+
+/* The C library defines both byte orders, defs.h goes by which is there. */
+#if defined(__BYTE_ORDER) && __BYTE_ORDER == __LITTLE_ENDIAN
+#undef __BIG_ENDIAN
+#endif
+
+#include "../../xen/include/xen/lz4.h"
+#include "../../xen/common/lz4/defs.h"
+#include "../../xen/common/lz4/compress.c"
+
+/*
+ * The output of --compress is a standard LZ4 frame, which lz4 -d or
+ * lz4cat turn back into what xentrace_format and xenalyze expect: version
+ * 1, independent blocks of up to 64KiB (all the compressor handles), no
+ * checksums, no content size. The last header byte is the second byte of
+ * the xxHash32 of the two descriptor bytes.
+ */
+#define LZ4F_BLOCK_SIZE (64UL << 10)
+#define LZ4F_UNCOMPRESSED 0x80000000U
+
+static const unsigned char lz4f_header[] = {
+    0x04, 0x22, 0x4d, 0x18,     /* magic */
+    0x60,                       /* FLG: version 1, block independence */
+    0x40,                       /* BD: 64KiB blocks */
+    0x82,                       /* HC */
+};
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static unsigned long lz4f_bound(unsigned long len)
+{
+    unsigned long blocks = (len + LZ4F_BLOCK_SIZE - 1) / LZ4F_BLOCK_SIZE;
+
+    return blocks * (4 + lz4_compressbound(LZ4F_BLOCK_SIZE));
+}
+
+/* Turns len bytes from src into LZ4 frame blocks at dst, returns their size */
+static unsigned long lz4f_blocks(const unsigned char *src, unsigned long len,
+                                 unsigned char *dst, void *wrkmem)
+{
+    unsigned char *p = dst;
+
+    while ( len )
+    {
+        unsigned long n = len < LZ4F_BLOCK_SIZE ? len : LZ4F_BLOCK_SIZE;
+        size_t zlen;
+
+        if ( lz4_compress(src, n, p + 4, &zlen, wrkmem) == 0 && zlen < n )
+            put_le32(p, zlen);
+        else
+        {
+            /* incompressible, store it as it is */
+            zlen = n;
+            memcpy(p + 4, src, n);
+            put_le32(p, n | LZ4F_UNCOMPRESSED);
+        }
+
+        p += 4 + zlen;
+        src += n;
+        len -= n;
+    }
+
+    return p - dst;
+}
+
 /***** The code **************************************************************/
 
 typedef struct settings_st {
@@ -60,9 +165,12 @@ typedef struct settings_st {
     unsigned long disk_rsvd;
     unsigned long timeout;
     unsigned long memory_buffer;
+    unsigned long readers;
     uint8_t discard:1,
         disable_tracing:1,
-        start_disabled:1;
+        start_disabled:1,
+        direct_io:1,
+        compress:1;
 } settings_t;
 
 struct t_struct {
@@ -85,6 +193,186 @@ static void close_handler(int signal)
     interrupted = 1;
 }
 
+/*
+ * Reader threads. Each serves every nr_readers'th cpu from its first: it
+ * copies the new windows of their trace buffers, each behind a cpu_change
+ * record, into its staging buffer, hands the trace buffers back to Xen
+ * straight away, and only then writes the lot out in one go. Xen keeps
+ * filling its buffers while we wait for the disk.
+ */
+struct reader {
+    pthread_t thread;
+    unsigned int first;
+    unsigned char *stage;
+    unsigned long stage_len, stage_size;
+    unsigned char *zstage;      /* compressed stage, with --compress */
+    void *wrkmem;
+};
+
+static struct t_struct *tbufs_map;  /* hypervisor maps */
+static unsigned int nr_cpus, nr_readers;
+static unsigned long data_size;
+static struct reader *readers;
+
+static pthread_mutex_t kick_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kick_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long kick_gen;
+static int kick_stop;
+
+/*
+ * Output. Everything goes through out_write(), under out_lock once the
+ * readers run, which writes straight to outfd or, with --direct-io,
+ * gathers the data into large aligned writes.
+ */
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+    unsigned char *buf;         /* --direct-io staging */
+    unsigned long len;
+    unsigned long long total;   /* bytes of output so far */
+} out;
+
+static void check_disk_space(unsigned long size)
+{
+    struct statvfs stat;
+    unsigned long long freespace;
+
+    if ( opts.memory_buffer != 0 || opts.disk_rsvd == 0 )
+        return;
+
+    /* Check that filesystem has enough space. */
+    if ( fstatvfs (outfd, &stat) )
+    {
+        fprintf(stderr, "Statfs failed!\n");
+        PERROR("Failed to write trace data");
+        exit(EXIT_FAILURE);
+    }
+
+    freespace = stat.f_frsize * (unsigned long long)stat.f_bfree;
+    freespace -= size;
+    freespace >>= 20; /* Convert to MB */
+
+    if ( freespace <= opts.disk_rsvd )
+    {
+        fprintf(stderr, "Disk space limit reached (free space: %lluMB, limit: %luMB).\n", freespace, opts.disk_rsvd);
+        exit (EXIT_FAILURE);
+    }
+}
+
+static void write_all(const unsigned char *p, unsigned long size)
+{
+    ssize_t written;
+
+    while ( size )
+    {
+        written = write(outfd, p, size);
+        if ( written < 0 && errno == EINTR )
+            continue;
+        if ( written <= 0 )
+        {
+            fprintf(stderr, "Write failed! (size %lu, returned %zd)\n",
+                    size, written);
+            PERROR("Failed to write trace data");
+            exit(EXIT_FAILURE);
+        }
+        p += written;
+        size -= written;
+    }
+}
+
+static void out_write(const void *data, unsigned long size)
+{
+    const unsigned char *p = data;
+
+    out.total += size;
+
+    if ( !opts.direct_io )
+    {
+        check_disk_space(size);
+        write_all(p, size);
+        return;
+    }
+
+    while ( size )
+    {
+        unsigned long n = DIRECT_BUF_SIZE - out.len;
+
+        if ( n > size )
+            n = size;
+        memcpy(out.buf + out.len, p, n);
+        out.len += n;
+        p += n;
+        size -= n;
+
+        if ( out.len == DIRECT_BUF_SIZE )
+        {
+            check_disk_space(DIRECT_BUF_SIZE);
+            write_all(out.buf, DIRECT_BUF_SIZE);
+            out.len = 0;
+        }
+    }
+}
+
+/* Writes size bytes of trace data, compressing them with --compress. */
+static void out_data(const void *data, unsigned long size)
+{
+    const unsigned char *p = data;
+    struct reader *r = &readers[0];
+
+    if ( !opts.compress )
+    {
+        out_write(p, size);
+        return;
+    }
+
+    while ( size )
+    {
+        unsigned long n = size < r->stage_size ? size : r->stage_size;
+
+        out_write(r->zstage, lz4f_blocks(p, n, r->zstage, r->wrkmem));
+        p += n;
+        size -= n;
+    }
+}
+
+static void out_open(void)
+{
+    if ( opts.direct_io &&
+         posix_memalign((void **)&out.buf, DIRECT_ALIGN, DIRECT_BUF_SIZE) )
+    {
+        fprintf(stderr, "%s: Couldn't allocate the output buffer!\n",
+                __func__);
+        exit(EXIT_FAILURE);
+    }
+
+    if ( opts.compress )
+        out_write(lz4f_header, sizeof(lz4f_header));
+}
+
+static void out_close(void)
+{
+    if ( opts.compress )
+    {
+        static const unsigned char endmark[4];
+
+        out_write(endmark, sizeof(endmark));
+    }
+
+    /* Pad the last write to the alignment, then cut the padding off. */
+    if ( opts.direct_io && out.len )
+    {
+        unsigned long len = (out.len + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1);
+
+        memset(out.buf + out.len, 0, len - out.len);
+        check_disk_space(len);
+        write_all(out.buf, len);
+        if ( ftruncate(outfd, out.total) )
+            PERROR("Failed to truncate the output file");
+    }
+
+    close(outfd);
+}
+
 static struct {
     char * buf;
     unsigned long prod, cons, size;
@@ -280,8 +568,7 @@ void membuf_write(void *start, unsigned long size) {
 
 void membuf_dump(void) {
     /* Dump circular memory buffer */
-    int cons, prod, wsize, written;
-    char * wstart;
+    unsigned long cons, prod;
 
     fprintf(stderr, "Dumping memory buffer.\n");
 
@@ -291,138 +578,216 @@ void membuf_dump(void) {
     if(prod > cons)
     {
         /* Write in one go */
-        wstart = membuf.buf + cons;
-        wsize = prod - cons;
-
-        written = write(outfd, wstart, wsize);
-        if ( written != wsize )
-            goto fail;
+        out_data(membuf.buf + cons, prod - cons);
     }
     else
     {
         /* Write in two pieces: cons->end, beginning->prod. */
-        wstart = membuf.buf + cons;
-        wsize = membuf.size - cons;
+        out_data(membuf.buf + cons, membuf.size - cons);
+        out_data(membuf.buf, prod);
+    }
 
-        written = write(outfd, wstart, wsize);
-        if ( written != wsize )
-        {
-            fprintf(stderr, "Write failed! (size %d, returned %d)\n",
-                    wsize, written);
-            goto fail;
-        }
+    membuf.cons = membuf.prod = 0;
+}
 
-        wstart = membuf.buf;
-        wsize = prod;
+/* Writes out what the reader staged, in one go. */
+static void reader_flush(struct reader *r)
+{
+    struct cpu_change_record *rec;
+    unsigned long off, zlen;
 
-        written = write(outfd, wstart, wsize);
-        if ( written != wsize )
+    if ( !r->stage_len )
+        return;
+
+    if ( opts.memory_buffer )
+    {
+        pthread_mutex_lock(&out_lock);
+        for ( off = 0; off < r->stage_len;
+              off += sizeof(*rec) + rec->data.window_size )
         {
-            fprintf(stderr, "Write failed! (size %d, returned %d)\n",
-                    wsize, written);
-            goto fail;
+            rec = (struct cpu_change_record *)(r->stage + off);
+            membuf_reserve_window(rec->data.cpu, rec->data.window_size);
+            membuf_write(rec + 1, rec->data.window_size);
         }
+        pthread_mutex_unlock(&out_lock);
+    }
+    else if ( opts.compress )
+    {
+        /* compress outside the lock, so that readers do it in parallel */
+        zlen = lz4f_blocks(r->stage, r->stage_len, r->zstage, r->wrkmem);
+        pthread_mutex_lock(&out_lock);
+        out_write(r->zstage, zlen);
+        pthread_mutex_unlock(&out_lock);
+    }
+    else
+    {
+        pthread_mutex_lock(&out_lock);
+        out_write(r->stage, r->stage_len);
+        pthread_mutex_unlock(&out_lock);
     }
 
-    membuf.cons = membuf.prod = 0;
-    
-    return;
-fail:
-    exit(1);
-    return;
+    r->stage_len = 0;
 }
 
 /**
- * write_buffer - write a section of the trace buffer
- * @cpu      - source buffer CPU ID
- * @start
- * @size     - size of write (may be less than total window size)
- * @total_size - total size of the window (0 on 2nd write of wrapped windows)
- * @out      - output stream
+ * reader_copy - stage the new window of a cpu's trace buffer
+ * @r   - the reader serving the cpu
+ * @cpu - source buffer CPU ID
  *
- * Outputs the trace buffer to a filestream, prepending the CPU and size
- * of the buffer write.
+ * Copies the window, behind a CPU_BUF record, into the staging buffer
+ * and hands it back to Xen. Wrapped windows are copied in two pieces.
  */
-static void write_buffer(unsigned int cpu, unsigned char *start, int size,
-                         int total_size)
+static void reader_copy(struct reader *r, unsigned int cpu)
 {
-    struct statvfs stat;
-    size_t written = 0;
-    
-    if ( opts.memory_buffer == 0 && opts.disk_rsvd != 0 )
+    struct t_buf *meta = tbufs_map->meta[cpu];
+    unsigned char *data = tbufs_map->data[cpu];
+    unsigned long start_offset, end_offset, window_size, cons, prod;
+    struct cpu_change_record rec;
+    unsigned char *p;
+
+    /* Read window information only once. */
+    cons = meta->cons;
+    prod = meta->prod;
+    xen_rmb(); /* read prod, then read item. */
+
+    if ( cons == prod )
+        return;
+
+    assert(cons < 2*data_size);
+    assert(prod < 2*data_size);
+
+    // NB: if (prod<cons), then (prod-cons)%data_size will not yield
+    // the correct answer because data_size is not a power of 2.
+    if ( prod < cons )
+        window_size = (prod + 2*data_size) - cons;
+    else
+        window_size = prod - cons;
+    assert(window_size > 0);
+    assert(window_size <= data_size);
+
+    start_offset = cons % data_size;
+    end_offset = prod % data_size;
+
+    if ( r->stage_len + sizeof(rec) + window_size > r->stage_size )
+        reader_flush(r);
+
+    rec.header = CPU_CHANGE_HEADER;
+    rec.data.cpu = cpu;
+    rec.data.window_size = window_size;
+
+    p = r->stage + r->stage_len;
+    memcpy(p, &rec, sizeof(rec));
+    p += sizeof(rec);
+
+    if ( end_offset > start_offset )
+        memcpy(p, data + start_offset, window_size);
+    else
     {
-        unsigned long long freespace;
+        memcpy(p, data + start_offset, data_size - start_offset);
+        memcpy(p + data_size - start_offset, data, end_offset);
+    }
 
-        /* Check that filesystem has enough space. */
-        if ( fstatvfs (outfd, &stat) )
-        {
-            fprintf(stderr, "Statfs failed!\n");
-            goto fail;
-        }
+    r->stage_len += sizeof(rec) + window_size;
 
-        freespace = stat.f_frsize * (unsigned long long)stat.f_bfree;
+    xen_mb(); /* read buffer, then update cons. */
+    meta->cons = prod;
+}
 
-        if ( total_size )
-            freespace -= total_size;
-        else
-            freespace -= size;
+static void *reader_thread(void *arg)
+{
+    struct reader *r = arg;
+    unsigned long gen = 0;
+    unsigned int cpu;
+    int stop;
 
-        freespace >>= 20; /* Convert to MB */
+    do {
+        pthread_mutex_lock(&kick_lock);
+        while ( kick_gen == gen && !kick_stop )
+            pthread_cond_wait(&kick_cond, &kick_lock);
+        gen = kick_gen;
+        stop = kick_stop;
+        pthread_mutex_unlock(&kick_lock);
+
+        for ( cpu = r->first; cpu < nr_cpus; cpu += nr_readers )
+            reader_copy(r, cpu);
+        reader_flush(r);
+    } while ( !stop );
+
+    return NULL;
+}
 
-        if ( freespace <= opts.disk_rsvd )
-        {
-            fprintf(stderr, "Disk space limit reached (free space: %lluMB, limit: %luMB).\n", freespace, opts.disk_rsvd);
-            exit (EXIT_FAILURE);
-        }
+/* Makes the readers scan their buffers, one last time if @stop. */
+static void kick_readers(int stop)
+{
+    pthread_mutex_lock(&kick_lock);
+    kick_gen++;
+    kick_stop = stop;
+    pthread_cond_broadcast(&kick_cond);
+    pthread_mutex_unlock(&kick_lock);
+}
+
+static void start_readers(void)
+{
+    unsigned long stage_size = sizeof(struct cpu_change_record) + data_size;
+    sigset_t set, old;
+    unsigned int i;
+
+    if ( stage_size < STAGE_SIZE )
+        stage_size = STAGE_SIZE;
+
+    nr_readers = opts.readers;
+    if ( nr_readers == 0 || nr_readers > nr_cpus )
+        nr_readers = nr_cpus;
+
+    readers = calloc(nr_readers, sizeof(*readers));
+    if ( readers == NULL )
+    {
+        PERROR("Failed to allocate reader threads");
+        exit(EXIT_FAILURE);
     }
 
-    /* Write a CPU_BUF record on each buffer "window" written.  Wrapped
-     * windows may involve two writes, so only write the record on the
-     * first write. */
-    if ( total_size != 0 )
+    /* Leave the signals to the main thread, whose poll() they interrupt. */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+
+    for ( i = 0; i < nr_readers; i++ )
     {
-        if ( opts.memory_buffer )
+        struct reader *r = &readers[i];
+
+        r->first = i;
+        r->stage_size = stage_size;
+        r->stage = malloc(stage_size);
+        if ( opts.compress )
         {
-            membuf_reserve_window(cpu, total_size);
+            r->zstage = malloc(lz4f_bound(stage_size));
+            r->wrkmem = malloc(LZ4_MEM_COMPRESS);
         }
-        else
+        if ( r->stage == NULL ||
+             (opts.compress && (r->zstage == NULL || r->wrkmem == NULL)) )
         {
-            struct cpu_change_record rec;
-
-            rec.header = CPU_CHANGE_HEADER;
-            rec.data.cpu = cpu;
-            rec.data.window_size = total_size;
-
-            written = write(outfd, &rec, sizeof(rec));
-            if ( written != sizeof(rec) )
-            {
-                fprintf(stderr, "Cannot write cpu change (write returned %zd)\n",
-                        written);
-                goto fail;
-            }
+            PERROR("Failed to allocate reader buffers");
+            exit(EXIT_FAILURE);
         }
-    }
 
-    if ( opts.memory_buffer )
-    {
-        membuf_write(start, size);
-    }
-    else
-    {
-        written = write(outfd, start, size);
-        if ( written != size )
+        errno = pthread_create(&r->thread, NULL, reader_thread, r);
+        if ( errno )
         {
-            fprintf(stderr, "Write failed! (size %d, returned %zd)\n",
-                    size, written);
-            goto fail;
+            PERROR("Failed to start reader thread");
+            exit(EXIT_FAILURE);
         }
     }
 
-    return;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
 
-fail:
-    PERROR("Failed to write trace data");
-    exit(EXIT_FAILURE);
+static void stop_readers(void)
+{
+    unsigned int i;
+
+    kick_readers(1);
+
+    for ( i = 0; i < nr_readers; i++ )
+        pthread_join(readers[i].thread, NULL);
 }
 
 static void disable_tbufs(void)
@@ -664,26 +1029,16 @@ static void wait_for_event_or_timeout(unsigned long milliseconds)
  */
 static int monitor_tbufs(void)
 {
-    int i;
-
-    struct t_struct *tbufs;      /* Pointer to hypervisor maps */
-    struct t_buf **meta;         /* pointers to the trace buffer metadata    */
-    unsigned char **data;        /* pointers to the trace buffer data areas
-                                  * where they are mapped into user space.   */
     unsigned long tbufs_mfn;     /* mfn of the tbufs                         */
-    unsigned int  num;           /* number of trace buffers / logical CPUS   */
     unsigned long tinfo_size;    /* size of t_info metadata map */
     unsigned long size;          /* size of a single trace buffer            */
-
-    unsigned long data_size;
-
-    int last_read = 1;
+    unsigned int i;
 
     /* prepare to listen for VIRQ_TBUF */
     event_init();
 
     /* get number of logical CPUs (and therefore number of trace buffers) */
-    num = get_num_cpus();
+    nr_cpus = get_num_cpus();
 
     /* setup access to trace buffers */
     get_tbufs(&tbufs_mfn, &tinfo_size);
@@ -691,100 +1046,46 @@ static int monitor_tbufs(void)
     if ( opts.start_disabled )
         disable_tbufs();
     
-    tbufs = map_tbufs(tbufs_mfn, num, tinfo_size);
+    tbufs_map = map_tbufs(tbufs_mfn, nr_cpus, tinfo_size);
 
-    size = tbufs->t_info->tbuf_size * XC_PAGE_SIZE;
+    size = tbufs_map->t_info->tbuf_size * XC_PAGE_SIZE;
 
     data_size = size - sizeof(struct t_buf);
 
-    meta = tbufs->meta;
-    data = tbufs->data;
-
     if ( opts.discard )
-        for ( i = 0; i < num; i++ )
-            meta[i]->cons = meta[i]->prod;
+        for ( i = 0; i < nr_cpus; i++ )
+            tbufs_map->meta[i]->cons = tbufs_map->meta[i]->prod;
 
     /* now, scan buffers for events */
-    while ( 1 )
-    {
-        for ( i = 0; i < num; i++ )
-        {
-            unsigned long start_offset, end_offset, window_size, cons, prod;
-                
-            /* Read window information only once. */
-            cons = meta[i]->cons;
-            prod = meta[i]->prod;
-            xen_rmb(); /* read prod, then read item. */
-
-            if ( cons == prod )
-                continue;
-           
-            assert(cons < 2*data_size);
-            assert(prod < 2*data_size);
-
-            // NB: if (prod<cons), then (prod-cons)%data_size will not yield
-            // the correct answer because data_size is not a power of 2.
-            if ( prod < cons )
-                window_size = (prod + 2*data_size) - cons;
-            else
-                window_size = prod - cons;
-            assert(window_size > 0);
-            assert(window_size <= data_size);
-
-            start_offset = cons % data_size;
-            end_offset = prod % data_size;
-
-            if ( end_offset > start_offset )
-            {
-                /* If window does not wrap, write in one big chunk */
-                write_buffer(i, data[i]+start_offset,
-                             window_size,
-                             window_size);
-            }
-            else
-            {
-                /* If wrapped, write in two chunks:
-                 * - first, start to the end of the buffer
-                 * - second, start of buffer to end of window
-                 */
-                write_buffer(i, data[i] + start_offset,
-                             data_size - start_offset,
-                             window_size);
-                write_buffer(i, data[i],
-                             end_offset,
-                             0);
-            }
-
-            xen_mb(); /* read buffer, then update cons. */
-            meta[i]->cons = prod;
-
-        }
-
-        if ( interrupted )
-        {
-            if ( last_read )
-            {
-                /* Disable tracing, then read through all the buffers one last time */
-                if ( opts.disable_tracing )
-                    disable_tbufs();
-                last_read = 0;
-                continue;
-            }
-            else
-                break;
-        }
+    start_readers();
 
+    while ( !interrupted )
+    {
+        kick_readers(0);
         wait_for_event_or_timeout(opts.poll_sleep);
     }
 
+    /* Disable tracing, then read through all the buffers one last time */
+    if ( opts.disable_tracing )
+        disable_tbufs();
+    stop_readers();
+
     if ( opts.memory_buffer )
         membuf_dump();
 
+    out_close();
+
     /* cleanup */
-    free(meta);
-    free(data);
+    for ( i = 0; i < nr_readers; i++ )
+    {
+        free(readers[i].stage);
+        free(readers[i].zstage);
+        free(readers[i].wrkmem);
+    }
+    free(readers);
+    free(tbufs_map->meta);
+    free(tbufs_map->data);
     /* don't need to munmap - cleanup is automatic */
-    close(outfd);
 
     return 0;
 }
@@ -835,6 +1136,13 @@ static void usage(void)
 "  -r  --reserve-disk-space=n Before writing trace records to disk, check to see\n" \
 "                          that after the write there will be at least n space\n" \
 "                          left on the disk.\n" \
+"  -R  --reader-threads=n  Read the trace buffers with n threads, each\n" \
+"                          serving every nth CPU, 0 for one per CPU\n" \
+"                          (default 1).\n" \
+"  -d  --direct-io         Write the output file with O_DIRECT, in large\n" \
+"                          aligned writes.\n" \
+"  -z  --compress          Compress the output into an LZ4 frame, which\n" \
+"                          lz4 -d turns back into the usual format.\n" \
 "\n" \
 "This tool is used to capture trace buffer data from Xen. The\n" \
 "data is output in a binary format, in the following order:\n" \
@@ -1083,12 +1391,15 @@ static void parse_args(int argc, char **argv)
         { "discard-buffers", no_argument,      0, 'D' },
         { "dont-disable-tracing", no_argument, 0, 'x' },
         { "start-disabled", no_argument,       0, 'X' },
+        { "reader-threads", required_argument, 0, 'R' },
+        { "direct-io",      no_argument,       0, 'd' },
+        { "compress",       no_argument,       0, 'z' },
         { "help",           no_argument,       0, '?' },
         { "version",        no_argument,       0, 'V' },
         { 0, 0, 0, 0 }
     };
 
-    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:DxX?V",
+    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:R:dzDxX?V",
                     long_options, NULL)) != -1) 
     {
         switch ( option )
@@ -1137,6 +1448,18 @@ static void parse_args(int argc, char **argv)
             opts.memory_buffer = sargtol(optarg, 0);
             break;
 
+        case 'R':
+            opts.readers = argtol(optarg, 0);
+            break;
+
+        case 'd':
+            opts.direct_io = 1;
+            break;
+
+        case 'z':
+            opts.compress = 1;
+            break;
+
         default:
             usage();
         }
@@ -1153,6 +1476,9 @@ static void parse_args(int argc, char **argv)
 #ifndef O_LARGEFILE
 #define O_LARGEFILE	0
 #endif
+#ifndef O_DIRECT
+#define O_DIRECT	0
+#endif
 
 int main(int argc, char **argv)
 {
@@ -1167,6 +1493,7 @@ int main(int argc, char **argv)
     opts.disable_tracing = 1;
     opts.start_disabled = 0;
     opts.timeout = 0;
+    opts.readers = 1;
 
     parse_args(argc, argv);
 
@@ -1190,9 +1517,17 @@ int main(int argc, char **argv)
         alarm(opts.timeout);
 
     if ( opts.outfile )
+    {
         outfd = open(opts.outfile,
-                     O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
+                     O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE |
+                     (opts.direct_io ? O_DIRECT : 0),
                      0644);
+        /* not every filesystem does O_DIRECT; still make large writes */
+        if ( outfd < 0 && errno == EINVAL && opts.direct_io )
+            outfd = open(opts.outfile,
+                         O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
+                         0644);
+    }
 
     if ( outfd < 0 )
     {
@@ -1206,6 +1541,19 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
+    if ( opts.direct_io )
+    {
+        struct stat st;
+
+        if ( fstat(outfd, &st) || !S_ISREG(st.st_mode) )
+        {
+            fprintf(stderr, "--direct-io needs a regular output file.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    out_open();
+
     if ( opts.memory_buffer > 0 )
         membuf_alloc(opts.memory_buffer);
 
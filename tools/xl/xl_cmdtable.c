@@ -165,6 +165,13 @@ struct cmd_spec cmd_table[] = {
       "-e              Do not wait in the background (on <host>) for the death\n"
       "                of the domain.\n"
       "--debug         Print huge (!) amount of debug during the migration process.\n"
+      "--zero-pages    Send zero pages without their contents (needs <host> to\n"
+      "                know of this).\n"
+      "--max-downtime <ms>\n"
+      "                Keep copying memory while the domain runs until it is\n"
+      "                expected to stay paused for less than <ms> milliseconds.\n"
+      "--auto-converge Slow the domain down if it dirties memory too fast for\n"
+      "                --max-downtime to be met.\n"
       "-p              Do not unpause domain after migrating it."
     },
     { "restore",
@@ -189,6 +196,13 @@ struct cmd_spec cmd_table[] = {
       "Core dump a domain",
       "<Domain> <filename>"
     },
+    { "fork",
+      &main_fork, 0, 1,
+      "Create a copy-on-write fork of a paused HVM domain",
+      "[options] <Domain>",
+      "-n <name>       name of the new domain\n"
+      "-p              leave the new domain paused"
+    },
     { "cd-insert",
       &main_cd_insert, 1, 1,
       "Insert a cdrom into a guest's cd drive",
@@ -223,7 +237,7 @@ struct cmd_spec cmd_table[] = {
     { "vcpu-pin",
       &main_vcpupin, 1, 1,
       "Set which CPUs a VCPU can use",
-      "[option] <Domain> <VCPU|all> <Hard affinity|-|all> <Soft affinity|-|all>",
+      "[option] <Domain> <VCPU|VCPU-VCPU|all> <Hard affinity|-|all> <Soft affinity|-|all>",
       "-f, --force        undo an override pinning done by the kernel",
     },
     { "vcpu-set",
@@ -281,6 +295,14 @@ struct cmd_spec cmd_table[] = {
       "-b BUDGET, --budget=BUDGET     Budget (us)\n"
       "-e Extratime, --extratime=Extratime Extratime (1=yes, 0=no)\n"
     },
+    { "sched-stats",
+      &main_sched_stats, 0, 0,
+      "Show how long vcpus wait to run, and how many queue on each pcpu",
+      "[options] [Domain]",
+      "-e, --enable    Start gathering scheduling stats\n"
+      "-d, --disable   Stop gathering them, keeping those so far\n"
+      "-r, --reset     Reset the stats",
+    },
     { "domid",
       &main_domid, 0, 0,
       "Convert a domain name to domain id",
@@ -311,6 +333,11 @@ struct cmd_spec cmd_table[] = {
       "Send debug keys to Xen",
       "<Keys>",
     },
+    { "debug-dump",
+      &main_debug_dump, 0, 0,
+      "Print the output of a debug key's handler",
+      "<Key>",
+    },
     { "set-parameters",
       &main_set_parameters, 0, 1,
       "Set hypervisor parameters",
@@ -327,6 +354,15 @@ struct cmd_spec cmd_table[] = {
       "Monitor a host and the domains in real time",
       "",
     },
+    { "top-exits",
+      &main_top_exits, 0, 0,
+      "Show the VM exits of an HVM domain taking the most time",
+      "[options] <Domain>",
+      "-e, --enable    Start accounting VM exits\n"
+      "-d, --disable   Stop accounting VM exits, keeping the counts\n"
+      "-r, --reset     Reset the counts\n"
+      "-n N            Show the top N exit reasons (default 10, 0 for all)",
+    },
     { "network-attach",
       &main_networkattach, 1, 1,
       "Create a new virtual network device",
@@ -488,8 +524,8 @@ struct cmd_spec cmd_table[] = {
     },
     { "cpupool-migrate",
       &main_cpupoolmigrate, 0, 1,
-      "Moves a domain into a CPU pool",
-      "<Domain> <CPU Pool>",
+      "Moves one or more domains into a CPU pool",
+      "<Domain> [<Domain> ...] <CPU Pool>",
     },
     { "cpupool-numa-split",
       &main_cpupoolnumasplit, 0, 1,
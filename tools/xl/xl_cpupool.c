@@ -439,31 +439,44 @@ int main_cpupoolmigrate(int argc, char **argv)
     const char *pool;
     uint32_t poolid;
     const char *dom;
-    uint32_t domid;
+    uint32_t *domids;
+    int i, nr_domids;
+    int rc = EXIT_FAILURE;
 
     SWITCH_FOREACH_OPT(opt, "", NULL, "cpupool-migrate", 2) {
         /* No options */
     }
 
-    dom = argv[optind++];
-    pool = argv[optind];
+    /* Any number of domains, then the pool they all go to. */
+    nr_domids = argc - optind - 1;
+    pool = argv[argc - 1];
 
-    if (libxl_domain_qualifier_to_domid(ctx, dom, &domid) ||
-        !libxl_domid_to_name(ctx, domid)) {
-        fprintf(stderr, "unknown domain '%s'\n", dom);
-        return EXIT_FAILURE;
+    domids = xcalloc(nr_domids, sizeof(*domids));
+    for (i = 0; i < nr_domids; i++) {
+        dom = argv[optind + i];
+        if (libxl_domain_qualifier_to_domid(ctx, dom, &domids[i]) ||
+            !libxl_domid_to_name(ctx, domids[i])) {
+            fprintf(stderr, "unknown domain '%s'\n", dom);
+            goto out;
+        }
     }
 
     if (libxl_cpupool_qualifier_to_cpupoolid(ctx, pool, &poolid, NULL) ||
         !libxl_cpupoolid_is_valid(ctx, poolid)) {
         fprintf(stderr, "unknown cpupool '%s'\n", pool);
-        return EXIT_FAILURE;
+        goto out;
     }
 
-    if (libxl_cpupool_movedomain(ctx, poolid, domid))
-        return EXIT_FAILURE;
+    if (nr_domids == 1 ? libxl_cpupool_movedomain(ctx, poolid, domids[0])
+                       : libxl_cpupool_movedomains(ctx, poolid, domids,
+                                                   nr_domids))
+        goto out;
 
-    return EXIT_SUCCESS;
+    rc = EXIT_SUCCESS;
+
+out:
+    free(domids);
+    return rc;
 }
 
 int main_cpupoolnumasplit(int argc, char **argv)
@@ -27,6 +27,7 @@
 #include <libxl_json.h>
 #include <libxl_utils.h>
 #include <libxlutil.h>
+#include <xen-tools/libs.h>
 
 #include "xl.h"
 #include "xl_utils.h"
@@ -223,6 +224,10 @@ static void output_physinfo(void)
         maybe_printf("sharing_freed_memory   : %"PRIu64"\n", info.sharing_freed_pages / i);
         maybe_printf("sharing_used_memory    : %"PRIu64"\n", info.sharing_used_frames / i);
         maybe_printf("outstanding_claims     : %"PRIu64"\n", info.outstanding_pages / i);
+        if (info.superpage_pool_target_pages)
+            maybe_printf("superpage_pool         : %"PRIu64" of %"PRIu64"\n",
+                         info.superpage_pool_pages / i,
+                         info.superpage_pool_target_pages / i);
     }
     if (!libxl_get_freecpus(ctx, &cpumap)) {
         libxl_for_each_bit(i, cpumap)
@@ -919,6 +924,167 @@ int main_top(int argc, char **argv)
     return system("xentop");
 }
 
+static const char *const vmx_exit_names[] = {
+    [0] = "EXCEPTION_NMI", "EXTERNAL_INTERRUPT", "TRIPLE_FAULT", "INIT",
+    "SIPI", "IO_SMI", "OTHER_SMI", "PENDING_VIRT_INTR", "PENDING_VIRT_NMI",
+    "TASK_SWITCH", "CPUID", "GETSEC", "HLT", "INVD", "INVLPG", "RDPMC",
+    "RDTSC", "RSM", "VMCALL", "VMCLEAR", "VMLAUNCH", "VMPTRLD", "VMPTRST",
+    "VMREAD", "VMRESUME", "VMWRITE", "VMXOFF", "VMXON", "CR_ACCESS",
+    "DR_ACCESS", "IO_INSTRUCTION", "MSR_READ", "MSR_WRITE",
+    "INVALID_GUEST_STATE", "MSR_LOADING",
+    [36] = "MWAIT", "MONITOR_TRAP_FLAG",
+    [39] = "MONITOR", "PAUSE", "MCE_DURING_VMENTRY",
+    [43] = "TPR_BELOW_THRESHOLD", "APIC_ACCESS", "EOI_INDUCED",
+    "ACCESS_GDTR_OR_IDTR", "ACCESS_LDTR_OR_TR", "EPT_VIOLATION",
+    "EPT_MISCONFIG", "INVEPT", "RDTSCP", "PREEMPTION_TIMER", "INVVPID",
+    "WBINVD", "XSETBV", "APIC_WRITE", "RDRAND", "INVPCID", "VMFUNC",
+    "ENCLS", "RDSEED", "PML_FULL", "XSAVES", "XRSTORS",
+};
+
+static const char *const svm_exit_names[] = {
+    [0x60] = "INTR", "NMI", "SMI", "INIT", "VINTR", "CR0_SEL_WRITE",
+    "IDTR_READ", "GDTR_READ", "LDTR_READ", "TR_READ", "IDTR_WRITE",
+    "GDTR_WRITE", "LDTR_WRITE", "TR_WRITE", "RDTSC", "RDPMC", "PUSHF",
+    "POPF", "CPUID", "RSM", "IRET", "SWINT", "INVD", "PAUSE", "HLT",
+    "INVLPG", "INVLPGA", "IOIO", "MSR", "TASK_SWITCH", "FERR_FREEZE",
+    "SHUTDOWN", "VMRUN", "VMMCALL", "VMLOAD", "VMSAVE", "STGI", "CLGI",
+    "SKINIT", "RDTSCP", "ICEBP", "WBINVD", "MONITOR", "MWAIT",
+    "MWAIT_CONDITIONAL", "XSETBV",
+};
+
+static void exit_reason_name(libxl_exit_stats_vendor vendor, uint32_t reason,
+                             char *buf, size_t len)
+{
+    const char *name = NULL;
+
+    if (reason == ~0U) {        /* reasons the hypervisor does not tell apart */
+        snprintf(buf, len, "(other)");
+        return;
+    }
+
+    switch (vendor) {
+    case LIBXL_EXIT_STATS_VENDOR_VMX:
+        if (reason < sizeof(vmx_exit_names) / sizeof(vmx_exit_names[0]))
+            name = vmx_exit_names[reason];
+        break;
+    case LIBXL_EXIT_STATS_VENDOR_SVM:
+        if (reason < 0x40) {
+            /* CR reads, CR writes, DR reads, DR writes, 16 of each */
+            snprintf(buf, len, "%cR%u_%s", reason < 0x20 ? 'C' : 'D',
+                     reason & 0xf, reason & 0x10 ? "WRITE" : "READ");
+            return;
+        }
+        if (reason < 0x60) {
+            snprintf(buf, len, "EXCEPTION_%u", reason - 0x40);
+            return;
+        }
+        if (reason < sizeof(svm_exit_names) / sizeof(svm_exit_names[0]))
+            name = svm_exit_names[reason];
+        else if (reason == 0x400)
+            name = "NPF";
+        else if (reason == 0x401)
+            name = "AVIC_INCOMPLETE_IPI";
+        else if (reason == 0x402)
+            name = "AVIC_NOACCEL";
+        break;
+    default:
+        break;
+    }
+
+    if (name)
+        snprintf(buf, len, "%s", name);
+    else
+        snprintf(buf, len, "%#x", reason);
+}
+
+/* Upper bound, in us, of the bucket under which a fraction f of exits are. */
+static double exit_percentile(const libxl_exit_stat *s, double f,
+                              uint32_t tsc_khz)
+{
+    unsigned int i = hist_percentile(s->hist, s->num_hist, f);
+
+    return (double)(1ULL << (i + 8)) * 1000 / tsc_khz;
+}
+
+static int cmp_exit_stat(const void *a, const void *b)
+{
+    const libxl_exit_stat *x = a, *y = b;
+
+    return x->cycles < y->cycles ? 1 : x->cycles > y->cycles ? -1 : 0;
+}
+
+int main_top_exits(int argc, char **argv)
+{
+    libxl_exit_stats stats;
+    uint64_t count = 0, cycles = 0;
+    uint32_t domid;
+    int opt, i, top = 10, enable = -1, reset = 0;
+    char name[32];
+    static struct option opts[] = {
+        {"enable", 0, 0, 'e'},
+        {"disable", 0, 0, 'd'},
+        {"reset", 0, 0, 'r'},
+        COMMON_LONG_OPTS
+    };
+
+    SWITCH_FOREACH_OPT(opt, "edrn:", opts, "top-exits", 1) {
+    case 'e':
+        enable = 1;
+        break;
+    case 'd':
+        enable = 0;
+        break;
+    case 'r':
+        reset = 1;
+        break;
+    case 'n':
+        top = atoi(optarg);
+        break;
+    }
+
+    domid = find_domain(argv[optind]);
+
+    if (reset && libxl_domain_exit_stats_reset(ctx, domid))
+        return EXIT_FAILURE;
+    if (enable >= 0 && libxl_domain_exit_stats_set(ctx, domid, enable))
+        return EXIT_FAILURE;
+    if (reset || enable >= 0)
+        return EXIT_SUCCESS;
+
+    if (libxl_domain_exit_stats_get(ctx, domid, &stats)) {
+        fprintf(stderr, "cannot get VM exit stats of domain %u\n", domid);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < stats.num_reasons; i++) {
+        count += stats.reasons[i].count;
+        cycles += stats.reasons[i].cycles;
+    }
+    qsort(stats.reasons, stats.num_reasons, sizeof(*stats.reasons),
+          cmp_exit_stat);
+
+    printf("VM exit accounting %s, %"PRIu64" exits, %.3f s handling them\n",
+           stats.enabled ? "enabled" : "disabled", count,
+           stats.tsc_khz ? (double)cycles / stats.tsc_khz / 1000 : 0);
+    printf("%-24s %12s %7s %10s %10s %10s\n", "Reason", "Count", "Time%",
+           "Avg(us)", "p50(us)", "p99(us)");
+    for (i = 0; i < stats.num_reasons && (top <= 0 || i < top); i++) {
+        const libxl_exit_stat *s = &stats.reasons[i];
+
+        if (!stats.tsc_khz || !s->count)
+            continue;
+        exit_reason_name(stats.vendor, s->reason, name, sizeof(name));
+        printf("%-24s %12"PRIu64" %6.1f%% %10.2f %10.2f %10.2f\n", name,
+               s->count, cycles ? 100.0 * s->cycles / cycles : 0,
+               (double)s->cycles * 1000 / stats.tsc_khz / s->count,
+               exit_percentile(s, 0.5, stats.tsc_khz),
+               exit_percentile(s, 0.99, stats.tsc_khz));
+    }
+
+    libxl_exit_stats_dispose(&stats);
+    return EXIT_SUCCESS;
+}
+
 
 /*
  * Local variables:
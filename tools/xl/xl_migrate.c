@@ -177,6 +177,8 @@ static void migrate_do_preamble(int send_fd, int recv_fd, pid_t child,
 }
 
 static void migrate_domain(uint32_t domid, const char *rune, int debug,
+                           int zero_pages, unsigned int max_downtime_ms,
+                           int auto_converge,
                            const char *override_config_file)
 {
     pid_t child = -1;
@@ -186,6 +188,8 @@ static void migrate_domain(uint32_t domid, const char *rune, int debug,
     char rc_buf;
     uint8_t *config_data;
     int config_len, flags = LIBXL_SUSPEND_LIVE;
+    libxl_domain_suspend_props props;
+    struct timespec stream_end, started;
 
     save_domain_core_begin(domid, override_config_file,
                            &config_data, &config_len);
@@ -205,7 +209,16 @@ static void migrate_domain(uint32_t domid, const char *rune, int debug,
 
     if (debug)
         flags |= LIBXL_SUSPEND_DEBUG;
-    rc = libxl_domain_suspend(ctx, domid, send_fd, flags, NULL);
+    if (zero_pages)
+        flags |= LIBXL_SUSPEND_ZERO_PAGES;
+    if (auto_converge)
+        flags |= LIBXL_SUSPEND_AUTO_CONVERGE;
+
+    libxl_domain_suspend_props_init(&props);
+    props.flags = flags;
+    props.max_downtime_ms = max_downtime_ms;
+    rc = libxl_domain_suspend_ext(ctx, domid, send_fd, &props, NULL);
+    libxl_domain_suspend_props_dispose(&props);
     if (rc) {
         fprintf(stderr, "migration sender: libxl_domain_suspend failed"
                 " (rc=%d)\n", rc);
@@ -214,6 +227,8 @@ static void migrate_domain(uint32_t domid, const char *rune, int debug,
         else
             goto failed_resume;
     }
+    /* libxl has logged the downtime up to here, we time the handover. */
+    CHK_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &stream_end));
 
     //fprintf(stderr, "migration sender: Transfer complete.\n");
     // Should only be printed when debugging as it's a bit messy with
@@ -283,7 +298,11 @@ static void migrate_domain(uint32_t domid, const char *rune, int debug,
         exit(EXIT_FAILURE);
     }
 
-    fprintf(stderr, "migration sender: Target reports successful startup.\n");
+    CHK_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &started));
+    fprintf(stderr, "migration sender: Target reports successful startup"
+            " %ldms after the end of the stream.\n",
+            (long)((started.tv_sec - stream_end.tv_sec) * 1000 +
+                   (started.tv_nsec - stream_end.tv_nsec) / 1000000));
     libxl_domain_destroy(ctx, domid, 0); /* bang! */
     fprintf(stderr, "Migration successful.\n");
     exit(EXIT_SUCCESS);
@@ -537,9 +556,15 @@ int main_migrate(int argc, char **argv)
     char *rune = NULL;
     char *host;
     int opt, daemonize = 1, monitor = 1, debug = 0, pause_after_migration = 0;
+    int zero_pages = 0, auto_converge = 0;
+    unsigned int max_downtime_ms = 0;
+    char *endptr;
     static struct option opts[] = {
         {"debug", 0, 0, 0x100},
         {"live", 0, 0, 0x200},
+        {"zero-pages", 0, 0, 0x300},
+        {"max-downtime", 1, 0, 0x301},
+        {"auto-converge", 0, 0, 0x302},
         COMMON_LONG_OPTS
     };
 
@@ -566,6 +591,24 @@ int main_migrate(int argc, char **argv)
     case 0x200: /* --live */
         /* ignored for compatibility with xm */
         break;
+    case 0x300: /* --zero-pages */
+        zero_pages = 1;
+        break;
+    case 0x301: /* --max-downtime */
+        max_downtime_ms = strtoul(optarg, &endptr, 10);
+        if (*endptr != '\0' || !max_downtime_ms) {
+            fprintf(stderr, "Invalid --max-downtime: %s\n", optarg);
+            return EXIT_FAILURE;
+        }
+        break;
+    case 0x302: /* --auto-converge */
+        auto_converge = 1;
+        break;
+    }
+
+    if (auto_converge && !max_downtime_ms) {
+        fprintf(stderr, "--auto-converge needs --max-downtime\n");
+        return EXIT_FAILURE;
     }
 
     domid = find_domain(argv[optind]);
@@ -596,7 +639,8 @@ int main_migrate(int argc, char **argv)
                   pause_after_migration ? " -p" : "");
     }
 
-    migrate_domain(domid, rune, debug, config_filename);
+    migrate_domain(domid, rune, debug, zero_pages, max_downtime_ms,
+                   auto_converge, config_filename);
     return EXIT_SUCCESS;
 }
 
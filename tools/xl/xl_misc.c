@@ -155,6 +155,32 @@ int main_debug_keys(int argc, char **argv)
     return EXIT_SUCCESS;
 }
 
+int main_debug_dump(int argc, char **argv)
+{
+    int opt;
+    char *output;
+
+    SWITCH_FOREACH_OPT(opt, "", NULL, "debug-dump", 1) {
+        /* No options */
+    }
+
+    if (strlen(argv[optind]) != 1) {
+        fprintf(stderr, "expected a single debug key\n");
+        return EXIT_FAILURE;
+    }
+
+    if (libxl_debug_dump(ctx, argv[optind][0], &output)) {
+        fprintf(stderr, "cannot collect output of debug key '%s'\n",
+                argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    fputs(output, stdout);
+    free(output);
+
+    return EXIT_SUCCESS;
+}
+
 int main_set_parameters(int argc, char **argv)
 {
     int opt;
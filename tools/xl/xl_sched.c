@@ -18,6 +18,7 @@
 #include <libxl.h>
 #include <libxl_utils.h>
 #include <libxlutil.h>
+#include <xen-tools/libs.h>
 
 #include "xl.h"
 #include "xl_utils.h"
@@ -914,6 +915,135 @@ out:
     return r;
 }
 
+/* Upper bound, in us, of a latency bucket. */
+static double sched_stats_us(int bucket)
+{
+    return (double)(1ULL << (bucket + 10)) / 1000;
+}
+
+static void sched_stats_cpus_output(const libxl_sched_stats *stats)
+{
+    int i, j;
+
+    printf("%-6s %12s %9s %8s %8s\n", "CPU", "Samples", "AvgDepth",
+           "Queued%", "p99");
+    for (i = 0; i < stats->num_cpus; i++) {
+        const libxl_sched_cpu_stats *s = &stats->cpus[i];
+        uint64_t samples = 0, depth = 0;
+        int p99;
+
+        for (j = 0; j < s->num_depth_hist; j++) {
+            samples += s->depth_hist[j];
+            depth += (uint64_t)j * s->depth_hist[j];
+        }
+        if (!samples)
+            continue;
+        p99 = hist_percentile(s->depth_hist, s->num_depth_hist, 0.99);
+        printf("%-6u %12"PRIu64" %9.2f %7.1f%% %7d%s\n", s->cpu, samples,
+               (double)depth / samples,
+               100.0 * (samples - s->depth_hist[0]) / samples,
+               p99, p99 == s->num_depth_hist - 1 ? "+" : "");
+    }
+}
+
+static int sched_stats_domain_output(uint32_t domid)
+{
+    libxl_sched_stats stats;
+    char *domname;
+    int i;
+
+    if (libxl_sched_stats_get(ctx, domid, &stats)) {
+        fprintf(stderr, "cannot get scheduling stats of domain %u\n", domid);
+        return 1;
+    }
+
+    domname = libxl_domid_to_name(ctx, domid);
+    for (i = 0; i < stats.num_vcpus; i++) {
+        const libxl_sched_vcpu_stats *s = &stats.vcpus[i];
+
+        if (!s->wait_count)
+            continue;
+        printf("%-25s %5u %4u %10"PRIu64" %8.1f %8.1f %9.1f "
+               "%10"PRIu64" %8.1f %8.1f %9.1f\n",
+               domname, domid, s->vcpuid,
+               s->wait_count, (double)s->wait_ns / 1000 / s->wait_count,
+               sched_stats_us(hist_percentile(s->wait_hist,
+                                              s->num_wait_hist, 0.5)),
+               sched_stats_us(hist_percentile(s->wait_hist,
+                                              s->num_wait_hist, 0.99)),
+               s->wake_count,
+               s->wake_count ? (double)s->wake_ns / 1000 / s->wake_count : 0,
+               sched_stats_us(hist_percentile(s->wake_hist,
+                                              s->num_wake_hist, 0.5)),
+               sched_stats_us(hist_percentile(s->wake_hist,
+                                              s->num_wake_hist, 0.99)));
+    }
+    free(domname);
+    libxl_sched_stats_dispose(&stats);
+
+    return 0;
+}
+
+int main_sched_stats(int argc, char **argv)
+{
+    libxl_sched_stats stats;
+    libxl_dominfo *info;
+    int opt, i, nb_domain, rc = EXIT_SUCCESS, enable = -1, reset = 0;
+    static struct option opts[] = {
+        {"enable", 0, 0, 'e'},
+        {"disable", 0, 0, 'd'},
+        {"reset", 0, 0, 'r'},
+        COMMON_LONG_OPTS
+    };
+
+    SWITCH_FOREACH_OPT(opt, "edr", opts, "sched-stats", 0) {
+    case 'e':
+        enable = 1;
+        break;
+    case 'd':
+        enable = 0;
+        break;
+    case 'r':
+        reset = 1;
+        break;
+    }
+
+    if (reset && libxl_sched_stats_reset(ctx))
+        return EXIT_FAILURE;
+    if (enable >= 0 && libxl_sched_stats_set(ctx, enable))
+        return EXIT_FAILURE;
+    if (reset || enable >= 0)
+        return EXIT_SUCCESS;
+
+    if (libxl_sched_stats_get(ctx, INVALID_DOMID, &stats)) {
+        fprintf(stderr, "cannot get scheduling stats\n");
+        return EXIT_FAILURE;
+    }
+    printf("Scheduling stats %s\n\n", stats.enabled ? "enabled" : "disabled");
+    sched_stats_cpus_output(&stats);
+    libxl_sched_stats_dispose(&stats);
+
+    printf("\n%-25s %5s %4s %10s %8s %8s %9s %10s %8s %8s %9s\n",
+           "Name", "ID", "VCPU", "Waits", "Avg(us)", "p50(us)", "p99(us)",
+           "Wakeups", "Avg(us)", "p50(us)", "p99(us)");
+
+    if (optind < argc)
+        return sched_stats_domain_output(find_domain(argv[optind])) ?
+            EXIT_FAILURE : EXIT_SUCCESS;
+
+    info = libxl_list_domain(ctx, &nb_domain);
+    if (!info) {
+        fprintf(stderr, "libxl_list_domain failed.\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < nb_domain; i++)
+        if (sched_stats_domain_output(info[i].domid))
+            rc = EXIT_FAILURE;
+    libxl_dominfo_list_free(info, nb_domain);
+
+    return rc;
+}
+
 /*
  * Local variables:
  * mode: C
@@ -128,7 +128,7 @@ int main_vcpupin(int argc, char **argv)
      * int would be enough for vcpuid, but we don't want to
      * mess aroung range checking the return value of strtol().
      */
-    long vcpuid;
+    long vcpuid, last_vcpuid;
     const char *vcpu, *hard_str, *soft_str;
     char *endptr;
     int opt, nb_cpu, nb_vcpu, rc = EXIT_FAILURE;
@@ -163,6 +163,20 @@ int main_vcpupin(int argc, char **argv)
         }
         vcpuid = -1;
     }
+    last_vcpuid = vcpuid;
+    if (vcpuid != -1 && *endptr == '-') {
+        const char *last = endptr + 1;
+
+        last_vcpuid = strtol(last, &endptr, 10);
+        if (last == endptr || *endptr || last_vcpuid < vcpuid) {
+            fprintf(stderr, "Error: Invalid argument %s as VCPU.\n", vcpu);
+            goto out;
+        }
+        if (force) {
+            fprintf(stderr, "Error: --force and a range of VCPUs not allowed.\n");
+            goto out;
+        }
+    }
 
     if (libxl_cpu_bitmap_alloc(ctx, &cpumap_hard, 0) ||
         libxl_cpu_bitmap_alloc(ctx, &cpumap_soft, 0))
@@ -229,6 +243,14 @@ int main_vcpupin(int argc, char **argv)
             goto out;
         }
     }
+    else if (last_vcpuid != vcpuid) {
+        if (libxl_set_vcpuaffinity_range(ctx, domid, vcpuid,
+                                         last_vcpuid - vcpuid + 1,
+                                         hard, soft)) {
+            fprintf(stderr, "Could not set affinity for vcpus `%s'.\n", vcpu);
+            goto out;
+        }
+    }
     else if (vcpuid != -1) {
         if (libxl_set_vcpuaffinity(ctx, domid, vcpuid, hard, soft)) {
             fprintf(stderr, "Could not set affinity for vcpu `%ld'.\n",
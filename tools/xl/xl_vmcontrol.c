@@ -82,6 +82,43 @@ int main_unpause(int argc, char **argv)
     return EXIT_SUCCESS;
 }
 
+int main_fork(int argc, char **argv)
+{
+    int opt;
+    bool paused = false;
+    const char *name = NULL;
+    char *parent_name, *default_name = NULL;
+    uint32_t parent, domid;
+    int rc;
+
+    SWITCH_FOREACH_OPT(opt, "n:p", NULL, "fork", 1) {
+    case 'n':
+        name = optarg;
+        break;
+    case 'p':
+        paused = true;
+        break;
+    }
+
+    parent = find_domain(argv[optind]);
+    parent_name = libxl_domid_to_name(ctx, parent);
+    if (!name) {
+        xasprintf(&default_name, "%s-fork",
+                  parent_name ? parent_name : "domain");
+        name = default_name;
+    }
+    free(parent_name);
+
+    rc = libxl_domain_fork(ctx, parent, name, paused, &domid);
+    if (rc)
+        fprintf(stderr, "Failed to fork domain %u\n", parent);
+    else
+        printf("Forked domain %u as %s (id %u)\n", parent, name, domid);
+
+    free(default_name);
+    return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 int main_destroy(int argc, char **argv)
 {
     int opt;
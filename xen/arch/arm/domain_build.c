@@ -1948,6 +1948,67 @@ static int prepare_acpi(struct domain *d, struct kernel_info *kinfo)
     return -EINVAL;
 }
 #endif
+
+/* Chunks the copies of boot modules into dom0's memory are split into. */
+#define HWDOM_COPY_CHUNK MB(2)
+
+struct hwdom_copy {
+    paddr_t dst;
+    const void *src;
+    paddr_t len;
+    unsigned int nr_chunks;
+    atomic_t next;
+};
+
+static void __init hwdom_copy_work(void *data)
+{
+    struct hwdom_copy *copy = data;
+    unsigned int chunk;
+
+    while ( (chunk = atomic_inc_return(&copy->next) - 1) < copy->nr_chunks )
+    {
+        paddr_t offs = (paddr_t)chunk * HWDOM_COPY_CHUNK;
+        paddr_t end = min_t(paddr_t, offs + HWDOM_COPY_CHUNK, copy->len);
+
+        while ( offs < end )
+        {
+            paddr_t addr = copy->dst + offs;
+            unsigned int size = min_t(paddr_t, PAGE_SIZE - (addr & ~PAGE_MASK),
+                                      end - offs);
+            void *p = map_domain_page(maddr_to_mfn(addr));
+
+            p += addr & ~PAGE_MASK;
+            memcpy(p, copy->src + offs, size);
+            clean_dcache_va_range(p, size);
+            unmap_domain_page(p);
+
+            offs += size;
+        }
+    }
+}
+
+void __init hwdom_copy_parallel(struct domain *d, paddr_t gpa,
+                                const void *src, paddr_t len)
+{
+    struct hwdom_copy copy = {
+        .dst = gpa,
+        .src = src,
+        .len = len,
+        .nr_chunks = DIV_ROUND_UP(len, HWDOM_COPY_CHUNK),
+        .next = ATOMIC_INIT(0),
+    };
+
+    /*
+     * The domain is direct mapped (allocate_memory() insists on it), and
+     * the bootloader placed the destination in its RAM banks, so the
+     * copy can go straight to the machine frames, without having to walk
+     * the p2m in IPI context on the other CPUs.
+     */
+    BUG_ON(!is_domain_direct_mapped(d));
+
+    on_selected_cpus(&cpu_online_map, hwdom_copy_work, &copy, 1);
+}
+
 static void dtb_load(struct kernel_info *kinfo)
 {
     unsigned long left;
@@ -2007,10 +2068,7 @@ static void initrd_load(struct kernel_info *kinfo)
     if ( !initrd )
         panic("Unable to map the hwdom initrd");
 
-    res = copy_to_guest_phys_flush_dcache(kinfo->d, load_addr,
-                                          initrd, len);
-    if ( res != 0 )
-        panic("Unable to copy the initrd in the hwdom memory");
+    hwdom_copy_parallel(kinfo->d, load_addr, initrd, len);
 }
 
 static void evtchn_fixup(struct domain *d, struct kernel_info *kinfo)
@@ -2094,11 +2152,22 @@ static void __init find_gnttab_region(struct domain *d,
            kinfo->gnttab_start, kinfo->gnttab_start + kinfo->gnttab_size);
 }
 
+static s_time_t __init dom0_phase_done(const char *what, s_time_t start)
+{
+    s_time_t now = NOW();
+
+    printk("Dom0 build: %s took %"PRI_stime"us\n",
+           what, (now - start) / MICROSECS(1));
+
+    return now;
+}
+
 int construct_dom0(struct domain *d)
 {
     struct kernel_info kinfo = {};
     struct vcpu *saved_current;
     int rc, i, cpu;
+    s_time_t start = NOW(), phase = start;
 
     struct vcpu *v = d->vcpu[0];
     struct cpu_user_regs *regs = &v->arch.cpu_info->guest_cpu_user_regs;
@@ -2142,6 +2211,7 @@ int construct_dom0(struct domain *d)
 #endif
 
     allocate_memory(d, &kinfo);
+    phase = dom0_phase_done("memory allocation", phase);
     find_gnttab_region(d, &kinfo);
 
     if ( acpi_disabled )
@@ -2151,6 +2221,8 @@ int construct_dom0(struct domain *d)
 
     if ( rc < 0 )
         return rc;
+    phase = dom0_phase_done(acpi_disabled ? "DTB preparation"
+                                          : "ACPI preparation", phase);
 
     /* Map extra GIC MMIO, irqs and other hw stuffs to dom0. */
     rc = gic_map_hwdom_extra_mappings(d);
@@ -2160,6 +2232,7 @@ int construct_dom0(struct domain *d)
     rc = platform_specific_mapping(d);
     if ( rc < 0 )
         return rc;
+    phase = dom0_phase_done("device mappings", phase);
 
     /*
      * The following loads use the domain's p2m and require current to
@@ -2174,11 +2247,14 @@ int construct_dom0(struct domain *d)
      * as the initrd & fdt in RAM, so call it first.
      */
     kernel_load(&kinfo);
+    phase = dom0_phase_done("kernel load", phase);
     /* initrd_load will fix up the fdt, so call it before dtb_load */
     initrd_load(&kinfo);
+    phase = dom0_phase_done("initrd load", phase);
     /* Allocate the event channel IRQ and fix up the device tree */
     evtchn_fixup(d, &kinfo);
     dtb_load(&kinfo);
+    dom0_phase_done("DTB load", phase);
 
     /* Now that we are done restore the original p2m and current. */
     set_current(saved_current);
@@ -2236,6 +2312,8 @@ int construct_dom0(struct domain *d)
     v->is_initialised = 1;
     clear_bit(_VPF_down, &v->pause_flags);
 
+    dom0_phase_done("construction in total", start);
+
     return 0;
 }
 
@@ -67,7 +67,67 @@ bool gicv3_its_host_has_its(void)
 }
 
 #define BUFPTR_MASK                     GENMASK(19, 5)
-static int its_send_command(struct host_its *hw_its, const void *its_cmd)
+
+/*
+ * A batch of commands is written to the command queue under the command
+ * lock, but only handed to the ITS (by updating GITS_CWRITER) at the end,
+ * or when the queue runs full.  This saves the MMIO accesses per command
+ * when queuing many of them in a row.
+ */
+struct its_cmd_batch {
+    struct host_its *its;
+    uint64_t readp;             /* GITS_CREADR, as last read. */
+    uint64_t start;             /* First command not handed to the ITS yet. */
+    uint64_t writep;            /* Where the next command goes. */
+};
+
+static void its_batch_start(struct its_cmd_batch *batch,
+                            struct host_its *hw_its)
+{
+    /* No ITS commands from an interrupt handler (at the moment). */
+    ASSERT(!in_irq());
+
+    spin_lock(&hw_its->cmd_lock);
+
+    batch->its = hw_its;
+    batch->readp = readq_relaxed(hw_its->its_base + GITS_CREADR) & BUFPTR_MASK;
+    batch->writep = readq_relaxed(hw_its->its_base + GITS_CWRITER) &
+                    BUFPTR_MASK;
+    batch->start = batch->writep;
+}
+
+/* Hand all commands queued so far to the ITS. */
+static void its_batch_publish(struct its_cmd_batch *batch)
+{
+    struct host_its *hw_its = batch->its;
+
+    if ( batch->writep == batch->start )
+        return;
+
+    if ( hw_its->flags & HOST_ITS_FLUSH_CMD_QUEUE )
+    {
+        if ( batch->writep < batch->start )
+        {
+            clean_and_invalidate_dcache_va_range(hw_its->cmd_buf + batch->start,
+                                                 ITS_CMD_QUEUE_SZ -
+                                                 batch->start);
+            if ( batch->writep )
+                clean_and_invalidate_dcache_va_range(hw_its->cmd_buf,
+                                                     batch->writep);
+        }
+        else
+            clean_and_invalidate_dcache_va_range(hw_its->cmd_buf + batch->start,
+                                                 batch->writep - batch->start);
+    }
+    else
+        dsb(ishst);
+
+    writeq_relaxed(batch->writep & BUFPTR_MASK,
+                   hw_its->its_base + GITS_CWRITER);
+    batch->start = batch->writep;
+}
+
+static int its_batch_add(struct its_cmd_batch *batch, const void *its_cmd)
 {
     /*
      * The command queue should actually never become full, if it does anyway
@@ -80,56 +140,69 @@ static int its_send_command(struct host_its *hw_its, const void *its_cmd)
      * But this value is rather arbitrarily chosen based on theoretical
      * considerations.
      */
-    s_time_t deadline = NOW() + MILLISECS(1);
-    uint64_t readp, writep;
-    int ret = -EBUSY;
+    struct host_its *hw_its = batch->its;
+    s_time_t deadline;
 
-    /* No ITS commands from an interrupt handler (at the moment). */
-    ASSERT(!in_irq());
+    if ( unlikely(((batch->writep + ITS_CMD_SIZE) % ITS_CMD_QUEUE_SZ) ==
+                  batch->readp) )
+    {
+        /* The ITS can't make progress on commands it hasn't been given. */
+        its_batch_publish(batch);
 
-    spin_lock(&hw_its->cmd_lock);
+        deadline = NOW() + MILLISECS(1);
+        for ( ; ; )
+        {
+            batch->readp = readq_relaxed(hw_its->its_base + GITS_CREADR) &
+                           BUFPTR_MASK;
+            batch->writep = readq_relaxed(hw_its->its_base + GITS_CWRITER) &
+                            BUFPTR_MASK;
+            batch->start = batch->writep;
 
-    do {
-        readp = readq_relaxed(hw_its->its_base + GITS_CREADR) & BUFPTR_MASK;
-        writep = readq_relaxed(hw_its->its_base + GITS_CWRITER) & BUFPTR_MASK;
+            if ( ((batch->writep + ITS_CMD_SIZE) % ITS_CMD_QUEUE_SZ) !=
+                 batch->readp )
+                break;
 
-        if ( ((writep + ITS_CMD_SIZE) % ITS_CMD_QUEUE_SZ) != readp )
-        {
-            ret = 0;
-            break;
+            if ( NOW() > deadline )
+            {
+                if ( printk_ratelimit() )
+                    printk(XENLOG_WARNING "host ITS: command queue full.\n");
+                return -EBUSY;
+            }
+
+            /*
+             * If the command queue is full, wait for a bit in the hope it
+             * drains before giving up.
+             */
+            spin_unlock(&hw_its->cmd_lock);
+            cpu_relax();
+            udelay(1);
+            spin_lock(&hw_its->cmd_lock);
         }
+    }
 
-        /*
-         * If the command queue is full, wait for a bit in the hope it drains
-         * before giving up.
-         */
-        spin_unlock(&hw_its->cmd_lock);
-        cpu_relax();
-        udelay(1);
-        spin_lock(&hw_its->cmd_lock);
-    } while ( NOW() <= deadline );
+    memcpy(hw_its->cmd_buf + batch->writep, its_cmd, ITS_CMD_SIZE);
+    batch->writep = (batch->writep + ITS_CMD_SIZE) % ITS_CMD_QUEUE_SZ;
 
-    if ( ret )
-    {
-        spin_unlock(&hw_its->cmd_lock);
-        if ( printk_ratelimit() )
-            printk(XENLOG_WARNING "host ITS: command queue full.\n");
-        return ret;
-    }
+    return 0;
+}
 
-    memcpy(hw_its->cmd_buf + writep, its_cmd, ITS_CMD_SIZE);
-    if ( hw_its->flags & HOST_ITS_FLUSH_CMD_QUEUE )
-        clean_and_invalidate_dcache_va_range(hw_its->cmd_buf + writep,
-                                             ITS_CMD_SIZE);
-    else
-        dsb(ishst);
+/* Hand the queued commands to the ITS, and end the batch. */
+static void its_batch_end(struct its_cmd_batch *batch)
+{
+    its_batch_publish(batch);
+    spin_unlock(&batch->its->cmd_lock);
+}
 
-    writep = (writep + ITS_CMD_SIZE) % ITS_CMD_QUEUE_SZ;
-    writeq_relaxed(writep & BUFPTR_MASK, hw_its->its_base + GITS_CWRITER);
+static int its_send_command(struct host_its *hw_its, const void *its_cmd)
+{
+    struct its_cmd_batch batch;
+    int ret;
 
-    spin_unlock(&hw_its->cmd_lock);
+    its_batch_start(&batch, hw_its);
+    ret = its_batch_add(&batch, its_cmd);
+    its_batch_end(&batch);
 
-    return 0;
+    return ret;
 }
 
 /* Wait for an ITS to finish processing all commands. */
@@ -170,21 +243,33 @@ static uint64_t encode_rdbase(struct host_its *hw_its, unsigned int cpu,
     return reg;
 }
 
-static int its_send_cmd_sync(struct host_its *its, unsigned int cpu)
+static int its_queue_cmd_sync(struct its_cmd_batch *batch, unsigned int cpu)
 {
     uint64_t cmd[4];
 
     cmd[0] = GITS_CMD_SYNC;
     cmd[1] = 0x00;
-    cmd[2] = encode_rdbase(its, cpu, 0x0);
+    cmd[2] = encode_rdbase(batch->its, cpu, 0x0);
     cmd[3] = 0x00;
 
-    return its_send_command(its, cmd);
+    return its_batch_add(batch, cmd);
 }
 
-static int its_send_cmd_mapti(struct host_its *its,
-                              uint32_t deviceid, uint32_t eventid,
-                              uint32_t pintid, uint16_t icid)
+static int its_send_cmd_sync(struct host_its *its, unsigned int cpu)
+{
+    struct its_cmd_batch batch;
+    int ret;
+
+    its_batch_start(&batch, its);
+    ret = its_queue_cmd_sync(&batch, cpu);
+    its_batch_end(&batch);
+
+    return ret;
+}
+
+static int its_queue_cmd_mapti(struct its_cmd_batch *batch,
+                               uint32_t deviceid, uint32_t eventid,
+                               uint32_t pintid, uint16_t icid)
 {
     uint64_t cmd[4];
 
@@ -193,7 +278,7 @@ static int its_send_cmd_mapti(struct host_its *its,
     cmd[2] = icid;
     cmd[3] = 0x00;
 
-    return its_send_command(its, cmd);
+    return its_batch_add(batch, cmd);
 }
 
 static int its_send_cmd_mapc(struct host_its *its, uint32_t collection_id,
@@ -234,8 +319,8 @@ static int its_send_cmd_mapd(struct host_its *its, uint32_t deviceid,
     return its_send_command(its, cmd);
 }
 
-static int its_send_cmd_inv(struct host_its *its,
-                            uint32_t deviceid, uint32_t eventid)
+static int its_queue_cmd_inv(struct its_cmd_batch *batch,
+                             uint32_t deviceid, uint32_t eventid)
 {
     uint64_t cmd[4];
 
@@ -244,7 +329,7 @@ static int its_send_cmd_inv(struct host_its *its,
     cmd[2] = 0x00;
     cmd[3] = 0x00;
 
-    return its_send_command(its, cmd);
+    return its_batch_add(batch, cmd);
 }
 
 /* Set up the (1:1) collection mapping for the given host CPU. */
@@ -580,32 +665,42 @@ static int compare_its_guest_devices(struct its_device *dev,
 }
 
 /*
- * On the host ITS @its, map @nr_events consecutive LPIs.
- * The mapping connects a device @devid and event @eventid pair to LPI @lpi,
- * increasing both @eventid and @lpi to cover the number of requested LPIs.
+ * On the host ITS @its, map the first @nr_blocks * LPI_BLOCK events of
+ * device @devid, each block of LPI_BLOCK consecutive events to the block of
+ * consecutive LPIs starting at the respective entry of @lpi_blocks.
+ * All commands get queued in one go, followed by a single SYNC.
  */
-static int gicv3_its_map_host_events(struct host_its *its,
-                                     uint32_t devid, uint32_t eventid,
-                                     uint32_t lpi, uint32_t nr_events)
+static int gicv3_its_map_host_events(struct host_its *its, uint32_t devid,
+                                     const uint32_t *lpi_blocks,
+                                     unsigned int nr_blocks)
 {
-    uint32_t i;
-    int ret;
+    struct its_cmd_batch batch;
+    unsigned int i, j;
+    int ret = 0;
 
-    for ( i = 0; i < nr_events; i++ )
-    {
-        /* For now we map every host LPI to host CPU 0 */
-        ret = its_send_cmd_mapti(its, devid, eventid + i, lpi + i, 0);
-        if ( ret )
-            return ret;
+    its_batch_start(&batch, its);
 
-        ret = its_send_cmd_inv(its, devid, eventid + i);
-        if ( ret )
-            return ret;
-    }
+    for ( i = 0; !ret && i < nr_blocks; i++ )
+        for ( j = 0; j < LPI_BLOCK; j++ )
+        {
+            /* For now we map every host LPI to host CPU 0 */
+            ret = its_queue_cmd_mapti(&batch, devid, i * LPI_BLOCK + j,
+                                      lpi_blocks[i] + j, 0);
+            if ( ret )
+                break;
+
+            ret = its_queue_cmd_inv(&batch, devid, i * LPI_BLOCK + j);
+            if ( ret )
+                break;
+        }
 
     /* TODO: Consider using INVALL here. Didn't work on the model, though. */
 
-    ret = its_send_cmd_sync(its, 0);
+    if ( !ret )
+        ret = its_queue_cmd_sync(&batch, 0);
+
+    its_batch_end(&batch);
+
     if ( ret )
         return ret;
 
@@ -739,19 +834,21 @@ int gicv3_its_map_guest_device(struct domain *d,
     /*
      * Map all host LPIs within this device already. We can't afford to queue
      * any host ITS commands later on during the guest's runtime.
+     * Allocate all LPI blocks first, so that all events can be mapped with
+     * a single batch of commands and a single wait for its completion.
      */
     for ( i = 0; i < nr_events / LPI_BLOCK; i++ )
     {
         ret = gicv3_allocate_host_lpi_block(d, &dev->host_lpi_blocks[i]);
         if ( ret < 0 )
             break;
-
-        ret = gicv3_its_map_host_events(hw_its, host_devid, i * LPI_BLOCK,
-                                        dev->host_lpi_blocks[i], LPI_BLOCK);
-        if ( ret < 0 )
-            break;
     }
 
+    if ( !ret )
+        ret = gicv3_its_map_host_events(hw_its, host_devid,
+                                        dev->host_lpi_blocks,
+                                        nr_events / LPI_BLOCK);
+
     if ( ret )
     {
         /* Clean up all allocated host LPI blocks. */
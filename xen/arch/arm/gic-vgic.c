@@ -48,29 +48,21 @@ static inline void gic_set_lr(int lr, struct pending_irq *p,
 
 static inline void gic_add_to_lr_pending(struct vcpu *v, struct pending_irq *n)
 {
-    struct pending_irq *iter;
-
     ASSERT(spin_is_locked(&v->arch.vgic.lock));
 
     if ( !list_empty(&n->lr_queue) )
         return;
 
-    list_for_each_entry ( iter, &v->arch.vgic.lr_pending, lr_queue )
-    {
-        if ( iter->priority > n->priority )
-        {
-            list_add_tail(&n->lr_queue, &iter->lr_queue);
-            return;
-        }
-    }
-    list_add_tail(&n->lr_queue, &v->arch.vgic.lr_pending);
+    vgic_prio_add(v->arch.vgic.lr_pending_index, &v->arch.vgic.lr_pending,
+                  n, offsetof(struct pending_irq, lr_queue));
 }
 
 void gic_remove_from_lr_pending(struct vcpu *v, struct pending_irq *p)
 {
     ASSERT(spin_is_locked(&v->arch.vgic.lock));
 
-    list_del_init(&p->lr_queue);
+    vgic_prio_del(v->arch.vgic.lr_pending_index, &v->arch.vgic.lr_pending,
+                  p, offsetof(struct pending_irq, lr_queue));
 }
 
 void gic_raise_inflight_irq(struct vcpu *v, unsigned int virtual_irq)
@@ -229,7 +221,9 @@ static void gic_update_one_lr(struct vcpu *v, int i)
              !test_bit(GIC_IRQ_GUEST_MIGRATING, &p->status) )
             gic_raise_guest_irq(v, irq, p->priority);
         else {
-            list_del_init(&p->inflight);
+            vgic_prio_del(v->arch.vgic.inflight_index,
+                          &v->arch.vgic.inflight_irqs,
+                          p, offsetof(struct pending_irq, inflight));
             /*
              * Remove from inflight, then change physical affinity. It
              * makes sure that when a new interrupt is received on the
@@ -315,7 +309,7 @@ found:
         }
 
         gic_set_lr(lr, p, GICH_LR_PENDING);
-        list_del_init(&p->lr_queue);
+        gic_remove_from_lr_pending(v, p);
         set_bit(lr, &this_cpu(lr_mask));
 
         /* We can only evict nr_lrs entries */
@@ -160,7 +160,6 @@ static void kernel_zimage_load(struct kernel_info *info)
     paddr_t paddr = info->zimage.kernel_addr;
     paddr_t len = info->zimage.len;
     void *kernel;
-    int rc;
 
     info->entry = load_addr;
 
@@ -173,10 +172,7 @@ static void kernel_zimage_load(struct kernel_info *info)
     if ( !kernel )
         panic("Unable to map the hwdom kernel");
 
-    rc = copy_to_guest_phys_flush_dcache(info->d, load_addr,
-                                         kernel, len);
-    if ( rc != 0 )
-        panic("Unable to copy the kernel in the hwdom memory");
+    hwdom_copy_parallel(info->d, load_addr, kernel, len);
 
     iounmap(kernel);
 }
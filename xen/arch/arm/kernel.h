@@ -78,6 +78,14 @@ int kernel_probe(struct kernel_info *info);
  */
 void kernel_load(struct kernel_info *info);
 
+/*
+ * Copy @len bytes from @src into the memory of the direct mapped hardware
+ * domain at @gpa, cleaning the data cache as copy_to_guest_phys_flush_dcache
+ * does.  The work is shared among all online CPUs.
+ */
+void hwdom_copy_parallel(struct domain *d, paddr_t gpa, const void *src,
+                         paddr_t len);
+
 #endif /* #ifdef __ARCH_ARM_KERNEL_H__ */
 
 /*
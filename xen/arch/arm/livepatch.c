@@ -60,6 +60,21 @@ void arch_livepatch_revive(void)
     vmap_of_xen_text = NULL;
 }
 
+bool arch_livepatch_live_ok(const struct livepatch_func *func, bool applied)
+{
+    return false;
+}
+
+void arch_livepatch_apply_live(struct livepatch_func *func)
+{
+    ASSERT_UNREACHABLE();
+}
+
+void arch_livepatch_revert_live(const struct livepatch_func *func)
+{
+    ASSERT_UNREACHABLE();
+}
+
 int arch_livepatch_verify_func(const struct livepatch_func *func)
 {
     /* If NOPing only do up to maximum amount we can put in the ->opaque. */
@@ -7,6 +7,7 @@
 #include <xen/monitor.h>
 #include <xen/iocap.h>
 #include <xen/mem_access.h>
+#include <xen/perfc.h>
 #include <xen/xmalloc.h>
 #include <public/vm_event.h>
 #include <asm/flushtlb.h>
@@ -140,6 +141,7 @@ static void p2m_force_tlb_flush_sync(struct p2m_domain *p2m)
 {
     unsigned long flags = 0;
     uint64_t ovttbr;
+    struct page_info *pg;
 
     ASSERT(p2m_is_write_locked(p2m));
 
@@ -164,7 +166,22 @@ static void p2m_force_tlb_flush_sync(struct p2m_domain *p2m)
         local_irq_restore(flags);
     }
 
+    perfc_incr(p2m_tlb_flush);
     p2m->need_flush = false;
+
+    while ( (pg = page_list_remove_head(&p2m->freelist)) )
+        free_domheap_page(pg);
+}
+
+/*
+ * Request a flush at the latest when the p2m write lock gets dropped,
+ * accounting for the ones merged with an already pending one.
+ */
+static void p2m_defer_tlb_flush(struct p2m_domain *p2m)
+{
+    if ( p2m->need_flush )
+        perfc_incr(p2m_tlb_flush_merged);
+    p2m->need_flush = true;
 }
 
 void p2m_tlb_flush_sync(struct p2m_domain *p2m)
@@ -663,21 +680,27 @@ static void p2m_free_entry(struct p2m_domain *p2m,
 
     unmap_domain_page(table);
 
-    /*
-     * Make sure all the references in the TLB have been removed before
-     * freing the intermediate page table.
-     * XXX: Should we defer the free of the page table to avoid the
-     * flush?
-     */
-    p2m_tlb_flush_sync(p2m);
-
     mfn = _mfn(entry.p2m.base);
     ASSERT(mfn_valid(mfn));
 
     pg = mfn_to_page(mfn);
 
     page_list_del(pg, &p2m->pages);
-    free_domheap_page(pg);
+
+    /*
+     * All the references in the TLB need to have been removed before
+     * freeing the intermediate page table.  If the removal of the entry
+     * pointing to it is still to be flushed, rather than flushing for every
+     * table, defer freeing them to the next flush, which happens at the
+     * latest when the p2m write lock gets released.
+     */
+    if ( p2m->need_flush )
+    {
+        page_list_add(pg, &p2m->freelist);
+        perfc_incr(p2m_tlb_flush_merged);
+    }
+    else
+        free_domheap_page(pg);
 }
 
 static bool p2m_split_superpage(struct p2m_domain *p2m, lpae_t *entry,
@@ -914,8 +937,11 @@ static int __p2m_set_entry(struct p2m_domain *p2m,
         p2m_remove_pte(entry, p2m->clean_pte);
 
     if ( mfn_eq(smfn, INVALID_MFN) )
+    {
         /* Flush can be deferred if the entry is removed */
-        p2m->need_flush |= !!lpae_valid(orig_pte);
+        if ( lpae_valid(orig_pte) )
+            p2m_defer_tlb_flush(p2m);
+    }
     else
     {
         lpae_t pte = mfn_to_p2m_entry(smfn, t, a);
@@ -936,7 +962,7 @@ static int __p2m_set_entry(struct p2m_domain *p2m,
                  P2M_CLEAR_PERM(pte) != P2M_CLEAR_PERM(orig_pte) )
                 p2m_force_tlb_flush_sync(p2m);
             else
-                p2m->need_flush = true;
+                p2m_defer_tlb_flush(p2m);
         }
         else /* new mapping */
             p2m->stats.mappings[level]++;
@@ -1221,6 +1247,9 @@ void p2m_teardown(struct domain *d)
     while ( (pg = page_list_remove_head(&p2m->pages)) )
         free_domheap_page(pg);
 
+    while ( (pg = page_list_remove_head(&p2m->freelist)) )
+        free_domheap_page(pg);
+
     if ( p2m->root )
         free_domheap_pages(p2m->root, P2M_ROOT_ORDER);
 
@@ -1241,6 +1270,7 @@ int p2m_init(struct domain *d)
 
     rwlock_init(&p2m->lock);
     INIT_PAGE_LIST_HEAD(&p2m->pages);
+    INIT_PAGE_LIST_HEAD(&p2m->freelist);
 
     p2m->vmid = INVALID_VMID;
 
@@ -1572,6 +1572,10 @@ enum mc_disposition arch_do_multicall_call(struct mc_state *state)
            ? mc_continue : mc_preempt;
 }
 
+void arch_multicall_flush(void)
+{
+}
+
 /*
  * stolen from arch/arm/kernel/opcodes.c
  *
@@ -26,7 +26,8 @@
  *     its->its_lock                     (protects the translation tables)
  *         d->its_devices_lock           (protects the device RB tree)
  *             v->vgic.lock              (protects the struct pending_irq)
- *                 d->pend_lpi_tree_lock (protects the radix tree)
+ *                 d->pend_lpi_tree_lock (serialises radix tree updates,
+ *                                        lookups are lockless)
  */
 
 #include <xen/bitops.h>
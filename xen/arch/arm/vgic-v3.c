@@ -1759,14 +1759,20 @@ static void vgic_v3_domain_free(struct domain *d)
  * enabled and pending bit plus the priority.
  * Returns NULL if an LPI cannot be found (or no LPIs are supported).
  */
+static DEFINE_RCU_READ_LOCK(pend_lpi_rcu_lock);
+
 static struct pending_irq *vgic_v3_lpi_to_pending(struct domain *d,
                                                   unsigned int lpi)
 {
     struct pending_irq *pirq;
 
-    read_lock(&d->arch.vgic.pend_lpi_tree_lock);
+    /*
+     * Lockless, see radix-tree.h.  The pending_irq structures are owned by
+     * their ITS device, and outlive their presence in the tree.
+     */
+    rcu_read_lock(&pend_lpi_rcu_lock);
     pirq = radix_tree_lookup(&d->arch.vgic.pend_lpi_tree, lpi);
-    read_unlock(&d->arch.vgic.pend_lpi_tree_lock);
+    rcu_read_unlock(&pend_lpi_rcu_lock);
 
     return pirq;
 }
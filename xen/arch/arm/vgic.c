@@ -222,15 +222,88 @@ int vcpu_vgic_init(struct vcpu *v)
     INIT_LIST_HEAD(&v->arch.vgic.lr_pending);
     spin_lock_init(&v->arch.vgic.lock);
 
+    v->arch.vgic.inflight_index = xzalloc_array(struct vgic_prio_index, 2);
+    if ( v->arch.vgic.inflight_index == NULL )
+        return -ENOMEM;
+    v->arch.vgic.lr_pending_index = v->arch.vgic.inflight_index + 1;
+
     return 0;
 }
 
 int vcpu_vgic_free(struct vcpu *v)
 {
     xfree(v->arch.vgic.private_irqs);
+    xfree(v->arch.vgic.inflight_index);
     return 0;
 }
 
+static inline struct pending_irq *prio_entry(struct list_head *node,
+                                             size_t link)
+{
+    return (void *)node - link;
+}
+
+/*
+ * Insert @p into the priority ordered list @head, indexed by @idx, through
+ * its list_head at offset @link.  Entries of the same priority are kept in
+ * FIFO order.  Other than walking back over lower priority entries of the
+ * same guest visible level, this is O(1).
+ */
+void vgic_prio_add(struct vgic_prio_index *idx, struct list_head *head,
+                   struct pending_irq *p, size_t link)
+{
+    struct list_head *node = (void *)p + link, *pos;
+    unsigned int level = GIC_PRI_TO_GUEST(p->priority);
+    uint32_t above;
+
+    if ( idx->levels & (1U << level) )
+    {
+        pos = idx->tail[level];
+        while ( pos != head &&
+                GIC_PRI_TO_GUEST(prio_entry(pos, link)->priority) == level &&
+                prio_entry(pos, link)->priority > p->priority )
+            pos = pos->prev;
+        if ( pos == idx->tail[level] )
+            idx->tail[level] = node;
+    }
+    else
+    {
+        above = idx->levels & ((1U << level) - 1);
+        pos = above ? idx->tail[fls(above) - 1] : head;
+        idx->levels |= 1U << level;
+        idx->tail[level] = node;
+    }
+
+    list_add(node, pos);
+}
+
+/* Remove @p (if queued) from the list @head, indexed by @idx. */
+void vgic_prio_del(struct vgic_prio_index *idx, struct list_head *head,
+                   struct pending_irq *p, size_t link)
+{
+    struct list_head *node = (void *)p + link;
+    unsigned int level = GIC_PRI_TO_GUEST(p->priority);
+
+    if ( list_empty(node) )
+        return;
+
+    if ( idx->tail[level] == node )
+    {
+        struct list_head *prev = node->prev;
+
+        if ( prev != head &&
+             GIC_PRI_TO_GUEST(prio_entry(prev, link)->priority) == level )
+            idx->tail[level] = prev;
+        else
+        {
+            idx->tail[level] = NULL;
+            idx->levels &= ~(1U << level);
+        }
+    }
+
+    list_del_init(node);
+}
+
 struct vcpu *vgic_get_target_vcpu(struct vcpu *v, unsigned int virq)
 {
     struct vgic_irq_rank *rank = vgic_rank_irq(v, virq);
@@ -511,6 +584,7 @@ void vgic_clear_pending_irqs(struct vcpu *v)
     spin_lock_irqsave(&v->arch.vgic.lock, flags);
     list_for_each_entry_safe ( p, t, &v->arch.vgic.inflight_irqs, inflight )
         list_del_init(&p->inflight);
+    v->arch.vgic.inflight_index->levels = 0;
     gic_clear_pending_irqs(v);
     spin_unlock_irqrestore(&v->arch.vgic.lock, flags);
 }
@@ -520,14 +594,15 @@ void vgic_remove_irq_from_queues(struct vcpu *v, struct pending_irq *p)
     ASSERT(spin_is_locked(&v->arch.vgic.lock));
 
     clear_bit(GIC_IRQ_GUEST_QUEUED, &p->status);
-    list_del_init(&p->inflight);
+    vgic_prio_del(v->arch.vgic.inflight_index, &v->arch.vgic.inflight_irqs,
+                  p, offsetof(struct pending_irq, inflight));
     gic_remove_from_lr_pending(v, p);
 }
 
 void vgic_vcpu_inject_irq(struct vcpu *v, unsigned int virq)
 {
     uint8_t priority;
-    struct pending_irq *iter, *n;
+    struct pending_irq *n;
     unsigned long flags;
     bool running;
 
@@ -563,15 +638,8 @@ void vgic_vcpu_inject_irq(struct vcpu *v, unsigned int virq)
     if ( test_bit(GIC_IRQ_GUEST_ENABLED, &n->status) )
         gic_raise_guest_irq(v, virq, priority);
 
-    list_for_each_entry ( iter, &v->arch.vgic.inflight_irqs, inflight )
-    {
-        if ( iter->priority > priority )
-        {
-            list_add_tail(&n->inflight, &iter->inflight);
-            goto out;
-        }
-    }
-    list_add_tail(&n->inflight, &v->arch.vgic.inflight_irqs);
+    vgic_prio_add(v->arch.vgic.inflight_index, &v->arch.vgic.inflight_irqs,
+                  n, offsetof(struct pending_irq, inflight));
 out:
     spin_unlock_irqrestore(&v->arch.vgic.lock, flags);
     /* we have a new higher priority irq, inject it into the guest */
@@ -136,29 +136,47 @@ void vcpu_timer_destroy(struct vcpu *v)
     kill_timer(&v->arch.phys_timer.timer);
 }
 
+/*
+ * A vCPU which is merely descheduled gets the hardware timer interrupt as
+ * soon as its state is restored, should the deadline have passed by then,
+ * so the software timer is only needed to wake one which has blocked.
+ * Preemption thus costs neither a set_timer() nor a stop_timer(), and the
+ * timer only moves when the vCPU has.
+ */
 int virt_timer_save(struct vcpu *v)
 {
+    struct vtimer *t = &v->arch.virt_timer;
+
     ASSERT(!is_idle_vcpu(v));
 
-    v->arch.virt_timer.ctl = READ_SYSREG32(CNTV_CTL_EL0);
-    WRITE_SYSREG32(v->arch.virt_timer.ctl & ~CNTx_CTL_ENABLE, CNTV_CTL_EL0);
-    v->arch.virt_timer.cval = READ_SYSREG64(CNTV_CVAL_EL0);
-    if ( (v->arch.virt_timer.ctl & CNTx_CTL_ENABLE) &&
-         !(v->arch.virt_timer.ctl & CNTx_CTL_MASK))
+    t->ctl = READ_SYSREG32(CNTV_CTL_EL0);
+    WRITE_SYSREG32(t->ctl & ~CNTx_CTL_ENABLE, CNTV_CTL_EL0);
+    t->cval = READ_SYSREG64(CNTV_CVAL_EL0);
+    if ( (t->ctl & CNTx_CTL_ENABLE) && !(t->ctl & CNTx_CTL_MASK) &&
+         test_bit(_VPF_blocked, &v->pause_flags) )
     {
-        set_timer(&v->arch.virt_timer.timer, ticks_to_ns(v->arch.virt_timer.cval +
+        if ( t->timer.cpu != v->processor )
+            migrate_timer(&t->timer, v->processor);
+        set_timer(&t->timer, ticks_to_ns(t->cval +
                   v->domain->arch.virt_timer_base.offset - boot_count));
+        t->armed = true;
     }
     return 0;
 }
 
 int virt_timer_restore(struct vcpu *v)
 {
+    struct vtimer *t = &v->arch.virt_timer;
+
     ASSERT(!is_idle_vcpu(v));
 
-    stop_timer(&v->arch.virt_timer.timer);
-    migrate_timer(&v->arch.virt_timer.timer, v->processor);
-    migrate_timer(&v->arch.phys_timer.timer, v->processor);
+    if ( t->armed )
+    {
+        stop_timer(&t->timer);
+        t->armed = false;
+    }
+    if ( v->arch.phys_timer.timer.cpu != v->processor )
+        migrate_timer(&v->arch.phys_timer.timer, v->processor);
 
     WRITE_SYSREG64(v->domain->arch.virt_timer_base.offset, CNTVOFF_EL2);
     WRITE_SYSREG64(v->arch.virt_timer.cval, CNTV_CVAL_EL0);
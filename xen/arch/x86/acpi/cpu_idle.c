@@ -489,7 +489,7 @@ static struct {
 
 void trace_exit_reason(u32 *irq_traced)
 {
-    if ( unlikely(tb_init_done) )
+    if ( tb_tracing() )
     {
         int i, curbit;
         u32 irr_status[8] = { 0 };
@@ -1256,10 +1256,15 @@ int pmstat_get_cx_stat(uint32_t cpuid, struct pm_cx_stat *stat)
         stat->idle_time = 0;
         stat->nr_pc = 0;
         stat->nr_cc = 0;
+        stat->pred_total = 0;
+        stat->pred_too_deep = 0;
+        stat->pred_too_shallow = 0;
         return 0;
     }
 
     stat->idle_time = get_cpu_idle_time(cpuid);
+    menu_get_pred_stats(cpuid, &stat->pred_total, &stat->pred_too_deep,
+                        &stat->pred_too_shallow);
     nr = min(stat->nr, power->count);
 
     /* mimic the stat when detail info hasn't been registered by dom0 */
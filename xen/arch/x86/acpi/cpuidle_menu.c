@@ -28,6 +28,7 @@
 #include <xen/acpi.h>
 #include <xen/timer.h>
 #include <xen/cpuidle.h>
+#include <xen/sched.h>
 #include <asm/irq.h>
 
 #define BUCKETS 6
@@ -35,6 +36,7 @@
 #define DECAY 4
 #define MAX_INTERESTING 50000
 #define LATENCY_MULTIPLIER 10
+#define INTERVALS 8
 
 /*
  * Concepts and ideas behind the menu governor
@@ -90,6 +92,18 @@
  * As an additional rule to reduce the performance impact, menu tries to
  * limit the exit latency duration to be no more than 10% of the decaying
  * measured idle time.
+ *
+ * Repeating wakeup patterns
+ * -------------------------
+ * Wakeups not caused by timers (IPIs from remote vCPU wakeups, device
+ * interrupts) are often periodic.  The last INTERVALS measured idle
+ * durations are kept, and if they are consistent enough their average
+ * caps the prediction derived from the next timer event.
+ *
+ * Latency tolerance
+ * -----------------
+ * A cpupool may limit the exit latency of states its CPUs enter, for pools
+ * running latency sensitive workloads.
  */
 
 struct perf_factor{
@@ -110,6 +124,15 @@ struct menu_device
     unsigned int    bucket;
     u64             correction_factor[BUCKETS];
     struct perf_factor pf;
+    unsigned int    intervals[INTERVALS];
+    unsigned int    interval_ptr;
+    /* Residencies which would have made the choice too deep / shallow. */
+    unsigned int    target_us;
+    unsigned int    next_target_us;
+    /* Prediction accuracy statistics. */
+    u64             nr_decisions;
+    u64             nr_too_deep;
+    u64             nr_too_shallow;
 };
 
 static DEFINE_PER_CPU(struct menu_device, menu_devices);
@@ -185,11 +208,66 @@ static unsigned int get_sleep_length_us(void)
     return (us >> 32) ? (unsigned int)-2000 : (unsigned int)us;
 }
 
+/*
+ * Try to detect a repeating pattern in the recent idle durations: if their
+ * standard deviation is small compared to their average (after dropping
+ * outliers above it, a few times at most), return the average.  Otherwise
+ * return UINT_MAX.
+ */
+static unsigned int get_typical_interval(const struct menu_device *data)
+{
+    unsigned int i, divisor, thresh = UINT_MAX, pass;
+
+    for ( pass = 0; pass < 3; pass++ )
+    {
+        uint64_t avg = 0, variance = 0, largest = 0;
+
+        for ( divisor = i = 0; i < INTERVALS; i++ )
+        {
+            unsigned int value = data->intervals[i];
+
+            if ( value > thresh )
+                continue;
+            avg += value;
+            largest = max(largest, (uint64_t)value);
+            divisor++;
+        }
+
+        /* Too many outliers (or no history yet): give up. */
+        if ( divisor * 4 <= INTERVALS * 3 )
+            break;
+        avg /= divisor;
+
+        for ( i = 0; i < INTERVALS; i++ )
+        {
+            unsigned int value = data->intervals[i];
+
+            if ( value <= thresh )
+                variance += (value - avg) * (value - avg);
+        }
+        variance /= divisor;
+
+        /*
+         * Accept when the standard deviation is below 20us, or below a
+         * sixth of the average.
+         */
+        if ( variance <= 400 || avg * avg > variance * 36 )
+            return avg;
+
+        /* Drop the largest values and retry. */
+        thresh = largest - 1;
+    }
+
+    return UINT_MAX;
+}
+
 static int menu_select(struct acpi_processor_power *power)
 {
     struct menu_device *data = &__get_cpu_var(menu_devices);
     int i;
     s_time_t    io_interval;
+    unsigned int typical_us;
+    unsigned int max_latency = this_cpu(cpupool_idle_latency);
 
     /*  TBD: Change to 0 if C0(polling mode) support is added later*/
     data->last_state_idx = CPUIDLE_DRIVER_STATE_START;
@@ -218,6 +296,10 @@ static int menu_select(struct acpi_processor_power *power)
             data->expected_us * data->correction_factor[data->bucket],
             RESOLUTION * DECAY);
 
+    typical_us = get_typical_interval(data);
+    if ( typical_us < data->predicted_us )
+        data->predicted_us = typical_us;
+
     /* find the deepest idle state that satisfies our constraints */
     for ( i = CPUIDLE_DRIVER_STATE_START + 1; i < power->count; i++ )
     {
@@ -229,11 +311,17 @@ static int menu_select(struct acpi_processor_power *power)
             break;
         if (s->latency * LATENCY_MULTIPLIER > data->latency_factor)
             break;
-        /* TBD: we need to check the QoS requirment in future */
+        if (max_latency && s->latency > max_latency)
+            break;
         data->exit_us = s->latency;
         data->last_state_idx = i;
     }
 
+    data->target_us = power->states[data->last_state_idx].target_residency;
+    data->next_target_us = data->last_state_idx + 1 < power->count
+        ? power->states[data->last_state_idx + 1].target_residency
+        : UINT_MAX;
+
     return data->last_state_idx;
 }
 
@@ -251,6 +339,14 @@ static void menu_reflect(struct acpi_processor_power *power)
     if (data->measured_us > data->exit_us)
         data->measured_us -= data->exit_us;
 
+    data->intervals[data->interval_ptr++ % INTERVALS] = data->measured_us;
+
+    data->nr_decisions++;
+    if (data->measured_us < data->target_us)
+        data->nr_too_deep++;
+    else if (data->measured_us >= data->next_target_us)
+        data->nr_too_shallow++;
+
     /* update our correction ratio */
 
     new_factor = data->correction_factor[data->bucket]
@@ -301,3 +397,13 @@ void menu_get_trace_data(u32 *expected, u32 *pred)
     *expected = data->expected_us;
     *pred = data->predicted_us;
 }
+
+void menu_get_pred_stats(unsigned int cpu, u64 *total, u64 *too_deep,
+                         u64 *too_shallow)
+{
+    const struct menu_device *data = &per_cpu(menu_devices, cpu);
+
+    *total = data->nr_decisions;
+    *too_deep = data->nr_too_deep;
+    *too_shallow = data->nr_too_shallow;
+}
@@ -16,6 +16,8 @@
  */
 
 #include <xen/delay.h>
+#include <xen/static_key.h>
+#include <xen/stop_machine.h>
 #include <xen/types.h>
 #include <asm/apic.h>
 #include <asm/processor.h>
@@ -279,3 +281,72 @@ void __init alternative_instructions(void)
 
     set_nmi_callback(saved_nmi_callback);
 }
+
+#ifdef STATIC_KEY_PATCHING
+extern const struct static_key_entry __start_static_keys[],
+                                     __stop_static_keys[];
+
+static const u8 static_key_nop[STATIC_KEY_INSN_LEN] = { P6_NOP5 };
+
+/* Runs with all other CPUs rendezvoused, with interrupts disabled. */
+static int static_key_patch(void *data)
+{
+    const struct static_key *key = data;
+    const struct static_key_entry *e;
+    unsigned long cr0 = read_cr0();
+
+    /* Disable WP to allow patching read-only pages. */
+    write_cr0(cr0 & ~X86_CR0_WP);
+
+    for ( e = __start_static_keys; e < __stop_static_keys; e++ )
+    {
+        u8 *code = SK_CODE_PTR(e), insn[STATIC_KEY_INSN_LEN];
+
+        if ( SK_KEY_PTR(e) != key )
+            continue;
+
+        /* .init.text is gone once booting completed. */
+        if ( system_state >= SYS_STATE_active && is_kernel_inittext(code) )
+            continue;
+
+        if ( key->enabled )
+        {
+            insn[0] = 0xe9;
+            *(s32 *)&insn[1] = SK_TARGET_PTR(e) - (code + sizeof(insn));
+        }
+        else
+            memcpy(insn, static_key_nop, sizeof(insn));
+
+        memcpy(code, insn, sizeof(insn));
+    }
+
+    write_cr0(cr0);
+
+    return 0;
+}
+
+static int static_key_set(struct static_key *key, bool enable)
+{
+    int rc;
+
+    if ( key->enabled == enable )
+        return 0;
+
+    key->enabled = enable;
+    rc = stop_machine_run(static_key_patch, key, smp_processor_id());
+    if ( rc )
+        key->enabled = !enable;
+
+    return rc;
+}
+
+int static_key_enable(struct static_key *key)
+{
+    return static_key_set(key, true);
+}
+
+int static_key_disable(struct static_key *key)
+{
+    return static_key_set(key, false);
+}
+#endif /* STATIC_KEY_PATCHING */
@@ -3,6 +3,7 @@
 #include <xen/lib.h>
 #include <xen/mm.h>
 #include <xen/string.h>
+#include <xen/time.h>
 #include <xen/types.h>
 #include <xen/gunzip.h>
 #include <xen/decompress.h>
@@ -110,6 +111,7 @@ int __init bzimage_parse(void *image_base, void **image_start,
     struct setup_header *hdr = (struct setup_header *)(*image_start);
     int err = bzimage_check(hdr, *image_len);
     unsigned long output_len;
+    s_time_t start;
 
     if ( err < 0 )
         return err;
@@ -127,11 +129,15 @@ int __init bzimage_parse(void *image_base, void **image_start,
 
     output_len = output_length(*image_start, orig_image_len);
 
+    start = NOW();
     if ( (err = perform_gunzip(image_base, *image_start, orig_image_len)) > 0 )
         err = decompress(*image_start, orig_image_len, image_base);
 
     if ( !err )
     {
+        printk("Kernel decompressed (%lu KiB -> %lu KiB) in %"PRI_stime"ms\n",
+               orig_image_len >> 10, output_len >> 10,
+               (NOW() - start) / MILLISECS(1));
         *image_start = image_base;
         *image_len = output_len;
     }
@@ -1340,9 +1340,12 @@ static void load_segments(struct vcpu *n)
         if ( n->arch.pv_vcpu.fs_base | (dirty_segment_mask & DIRTY_FS_BASE) )
             wrfsbase(n->arch.pv_vcpu.fs_base);
 
-        /* Most kernels have non-zero GS base, so don't bother testing. */
-        /* (This is also a serialising instruction, avoiding AMD erratum #88.) */
-        wrmsrl(MSR_SHADOW_GS_BASE, n->arch.pv_vcpu.gs_base_kernel);
+        /*
+         * Most kernels have non-zero GS base, so don't bother testing.
+         * (Without FSGSBASE this is a serialising MSR write, avoiding AMD
+         * erratum #88, which affects no CPU having FSGSBASE.)
+         */
+        wrgsshadow(n->arch.pv_vcpu.gs_base_kernel);
 
         /* This can only be non-zero if selector is NULL. */
         if ( n->arch.pv_vcpu.gs_base_user |
@@ -1526,6 +1529,10 @@ void paravirt_ctxt_switch_to(struct vcpu *v)
             l4e_from_page(v->domain->arch.perdomain_l3_pg,
                           __PAGE_HYPERVISOR_RW);
 
+    /* A zero pv_cr3 makes the exit path stay on the guest's page tables. */
+    get_cpu_info()->pv_cr3 = root_pgt && !v->domain->arch.spec_no_xpti
+                             ? __pa(root_pgt) : 0;
+
     cr4 = pv_guest_cr4_to_real_cr4(v);
     if ( unlikely(cr4 != read_cr4()) )
         write_cr4(cr4);
@@ -1762,7 +1769,18 @@ void context_switch(struct vcpu *prev, struct vcpu *next)
              */
             unsigned int next_id = (((unsigned int)nextd->domain_id << 16) |
                                     (uint16_t)next->vcpu_id);
+            unsigned int group = nextd->arch.spec_trust_group ?:
+                                 this_cpu(cpupool_trust_group);
+
             BUILD_BUG_ON(MAX_VIRT_CPUS > 0xffff);
+            BUILD_BUG_ON(DOMID_FIRST_RESERVED > 0x8000);
+
+            /*
+             * All vCPUs of a trust group share one security context.  Bit
+             * 31 keeps its ID distinct from the domid/vcpu id ones.
+             */
+            if ( group )
+                next_id = (1u << 31) | group;
 
             /*
              * When scheduling from a vcpu, to idle, and back to the same vcpu
@@ -1773,8 +1791,11 @@ void context_switch(struct vcpu *prev, struct vcpu *next)
             if ( *last_id != next_id )
             {
                 wrmsrl(MSR_PRED_CMD, PRED_CMD_IBPB);
+                perfc_incr(ctxt_switch_ibpb);
                 *last_id = next_id;
             }
+            else
+                perfc_incr(ctxt_switch_ibpb_skip);
         }
     }
 
@@ -2080,6 +2101,16 @@ void cpuid_policy_updated(struct vcpu *v)
 void arch_dump_domain_info(struct domain *d)
 {
     paging_dump_domain_info(d);
+
+    if ( is_hvm_domain(d) && has_vhpet(d) )
+    {
+        const struct vcpu *v;
+        unsigned long reads = 0;
+
+        for_each_vcpu ( d, v )
+            reads += v->arch.hvm_vcpu.hpet_reads;
+        printk("    HPET reads: %lu\n", reads);
+    }
 }
 
 void arch_dump_vcpu_info(struct vcpu *v)
@@ -67,12 +67,14 @@ void __init mapcache_override_current(struct vcpu *v)
 #define MAPCACHE_L1ENT(idx) \
     __linear_l1_table[l1_linear_offset(MAPCACHE_VIRT_START + pfn_to_paddr(idx))]
 
+#define MAPCACHE_VCPU_ALL ((1UL << MAPCACHE_VCPU_ENTRIES) - 1)
+#define mapcache_vcpu_base(v) ((v)->vcpu_id * MAPCACHE_VCPU_ENTRIES)
+
 void *map_domain_page(mfn_t mfn)
 {
     unsigned long flags;
-    unsigned int idx, i;
+    unsigned int idx, base, i;
     struct vcpu *v;
-    struct mapcache_domain *dcache;
     struct mapcache_vcpu *vcache;
     struct vcpu_maphash_entry *hashent;
 
@@ -85,11 +87,12 @@ void *map_domain_page(mfn_t mfn)
     if ( !v || !is_pv_vcpu(v) )
         return mfn_to_virt(mfn_x(mfn));
 
-    dcache = &v->domain->arch.pv_domain.mapcache;
-    vcache = &v->arch.pv_vcpu.mapcache;
-    if ( !dcache->inuse )
+    if ( !v->domain->arch.pv_domain.mapcache.enabled )
         return mfn_to_virt(mfn_x(mfn));
 
+    vcache = &v->arch.pv_vcpu.mapcache;
+    base = mapcache_vcpu_base(v);
+
     perfc_incr(map_domain_page_count);
 
     local_irq_save(flags);
@@ -98,42 +101,37 @@ void *map_domain_page(mfn_t mfn)
     if ( hashent->mfn == mfn_x(mfn) )
     {
         idx = hashent->idx;
-        ASSERT(idx < dcache->entries);
+        ASSERT(idx - base < MAPCACHE_VCPU_ENTRIES);
         hashent->refcnt++;
         ASSERT(hashent->refcnt);
         ASSERT(l1e_get_pfn(MAPCACHE_L1ENT(idx)) == mfn_x(mfn));
+        perfc_incr(map_domain_page_hit);
         goto out;
     }
 
-    spin_lock(&dcache->lock);
+    perfc_incr(map_domain_page_miss);
 
-    /* Has some other CPU caused a wrap? We must flush if so. */
-    if ( unlikely(dcache->epoch != vcache->shadow_epoch) )
+    /*
+     * Have we reaped garbage on another CPU since we last ran here?  This
+     * CPU's TLB may then still hold stale translations for reused entries.
+     */
+    if ( unlikely(vcache->flush_cpu != smp_processor_id()) )
     {
-        vcache->shadow_epoch = dcache->epoch;
-        if ( NEED_FLUSH(this_cpu(tlbflush_time), dcache->tlbflush_timestamp) )
+        if ( NEED_FLUSH(this_cpu(tlbflush_time), vcache->tlbflush_timestamp) )
         {
             perfc_incr(domain_page_tlb_flush);
             flush_tlb_local();
         }
+        vcache->flush_cpu = smp_processor_id();
     }
 
-    idx = find_next_zero_bit(dcache->inuse, dcache->entries, dcache->cursor);
-    if ( unlikely(idx >= dcache->entries) )
+    if ( unlikely(vcache->inuse == MAPCACHE_VCPU_ALL) )
     {
-        unsigned long accum = 0, prev = 0;
-
         /* /First/, clean the garbage map and update the inuse list. */
-        for ( i = 0; i < BITS_TO_LONGS(dcache->entries); i++ )
-        {
-            accum |= prev;
-            dcache->inuse[i] &= ~xchg(&dcache->garbage[i], 0);
-            prev = ~dcache->inuse[i];
-        }
+        vcache->inuse &= ~vcache->garbage;
+        vcache->garbage = 0;
 
-        if ( accum | (prev & BITMAP_LAST_WORD_MASK(dcache->entries)) )
-            idx = find_first_zero_bit(dcache->inuse, dcache->entries);
-        else
+        if ( vcache->inuse == MAPCACHE_VCPU_ALL )
         {
             /* Replace a hash entry instead. */
             i = MAPHASH_HASHFN(mfn_x(mfn));
@@ -146,25 +144,25 @@ void *map_domain_page(mfn_t mfn)
                     l1e_write(&MAPCACHE_L1ENT(idx), l1e_empty());
                     hashent->idx = MAPHASHENT_NOTINUSE;
                     hashent->mfn = ~0UL;
+                    __clear_bit(idx - base, &vcache->inuse);
+                    perfc_incr(map_domain_page_evict);
                     break;
                 }
                 if ( ++i == MAPHASH_ENTRIES )
                     i = 0;
             } while ( i != MAPHASH_HASHFN(mfn_x(mfn)) );
         }
-        BUG_ON(idx >= dcache->entries);
+        BUG_ON(vcache->inuse == MAPCACHE_VCPU_ALL);
 
-        /* /Second/, flush TLBs. */
+        /* /Second/, flush TLBs, once for the whole batch. */
         perfc_incr(domain_page_tlb_flush);
         flush_tlb_local();
-        vcache->shadow_epoch = ++dcache->epoch;
-        dcache->tlbflush_timestamp = tlbflush_current_time();
+        vcache->tlbflush_timestamp = tlbflush_current_time();
     }
 
-    set_bit(idx, dcache->inuse);
-    dcache->cursor = idx + 1;
-
-    spin_unlock(&dcache->lock);
+    i = find_first_zero_bit(&vcache->inuse, MAPCACHE_VCPU_ENTRIES);
+    __set_bit(i, &vcache->inuse);
+    idx = base + i;
 
     l1e_write(&MAPCACHE_L1ENT(idx), l1e_from_mfn(mfn, __PAGE_HYPERVISOR_RW));
 
@@ -175,9 +173,9 @@ void *map_domain_page(mfn_t mfn)
 
 void unmap_domain_page(const void *ptr)
 {
-    unsigned int idx;
+    unsigned int idx, base;
     struct vcpu *v;
-    struct mapcache_domain *dcache;
+    struct mapcache_vcpu *vcache;
     unsigned long va = (unsigned long)ptr, mfn, flags;
     struct vcpu_maphash_entry *hashent;
 
@@ -188,13 +186,16 @@ void unmap_domain_page(const void *ptr)
 
     v = mapcache_current_vcpu();
     ASSERT(v && is_pv_vcpu(v));
+    ASSERT(v->domain->arch.pv_domain.mapcache.enabled);
 
-    dcache = &v->domain->arch.pv_domain.mapcache;
-    ASSERT(dcache->inuse);
+    vcache = &v->arch.pv_vcpu.mapcache;
+    base = mapcache_vcpu_base(v);
 
     idx = PFN_DOWN(va - MAPCACHE_VIRT_START);
+    /* Mappings must be dropped by the vCPU which established them. */
+    ASSERT(idx - base < MAPCACHE_VCPU_ENTRIES);
     mfn = l1e_get_pfn(MAPCACHE_L1ENT(idx));
-    hashent = &v->arch.pv_vcpu.mapcache.hash[MAPHASH_HASHFN(mfn)];
+    hashent = &vcache->hash[MAPHASH_HASHFN(mfn)];
 
     local_irq_save(flags);
 
@@ -213,7 +214,7 @@ void unmap_domain_page(const void *ptr)
                    hashent->mfn);
             l1e_write(&MAPCACHE_L1ENT(hashent->idx), l1e_empty());
             /* /Second/, mark as garbage. */
-            set_bit(hashent->idx, dcache->garbage);
+            __set_bit(hashent->idx - base, &vcache->garbage);
         }
 
         /* Add newly-freed mapping to the maphash. */
@@ -225,7 +226,7 @@ void unmap_domain_page(const void *ptr)
         /* /First/, zap the PTE. */
         l1e_write(&MAPCACHE_L1ENT(idx), l1e_empty());
         /* /Second/, mark as garbage. */
-        set_bit(idx, dcache->garbage);
+        __set_bit(idx - base, &vcache->garbage);
     }
 
     local_irq_restore(flags);
@@ -234,7 +235,6 @@ void unmap_domain_page(const void *ptr)
 int mapcache_domain_init(struct domain *d)
 {
     struct mapcache_domain *dcache = &d->arch.pv_domain.mapcache;
-    unsigned int bitmap_pages;
 
     if ( !is_pv_domain(d) || is_idle_domain(d) )
         return 0;
@@ -244,30 +244,22 @@ int mapcache_domain_init(struct domain *d)
         return 0;
 #endif
 
-    BUILD_BUG_ON(MAPCACHE_VIRT_END + PAGE_SIZE * (3 +
-                 2 * PFN_UP(BITS_TO_LONGS(MAPCACHE_ENTRIES) * sizeof(long))) >
-                 MAPCACHE_VIRT_START + (PERDOMAIN_SLOT_MBYTES << 20));
-    bitmap_pages = PFN_UP(BITS_TO_LONGS(MAPCACHE_ENTRIES) * sizeof(long));
-    dcache->inuse = (void *)MAPCACHE_VIRT_END + PAGE_SIZE;
-    dcache->garbage = dcache->inuse +
-                      (bitmap_pages + 1) * PAGE_SIZE / sizeof(long);
+    BUILD_BUG_ON(MAPCACHE_VCPU_ENTRIES >= BITS_PER_LONG);
 
-    spin_lock_init(&dcache->lock);
+    dcache->enabled = true;
 
-    return create_perdomain_mapping(d, (unsigned long)dcache->inuse,
-                                    2 * bitmap_pages + 1,
-                                    NIL(l1_pgentry_t *), NULL);
+    return 0;
 }
 
 int mapcache_vcpu_init(struct vcpu *v)
 {
     struct domain *d = v->domain;
     struct mapcache_domain *dcache = &d->arch.pv_domain.mapcache;
+    struct mapcache_vcpu *vcache = &v->arch.pv_vcpu.mapcache;
     unsigned long i;
     unsigned int ents = d->max_vcpus * MAPCACHE_VCPU_ENTRIES;
-    unsigned int nr = PFN_UP(BITS_TO_LONGS(ents) * sizeof(long));
 
-    if ( !is_pv_vcpu(v) || !dcache->inuse )
+    if ( !is_pv_vcpu(v) || !dcache->enabled )
         return 0;
 
     if ( ents > dcache->entries )
@@ -276,25 +268,20 @@ int mapcache_vcpu_init(struct vcpu *v)
         int rc = create_perdomain_mapping(d, MAPCACHE_VIRT_START, ents,
                                           NIL(l1_pgentry_t *), NULL);
 
-        /* Populate bit maps. */
-        if ( !rc )
-            rc = create_perdomain_mapping(d, (unsigned long)dcache->inuse,
-                                          nr, NULL, NIL(struct page_info *));
-        if ( !rc )
-            rc = create_perdomain_mapping(d, (unsigned long)dcache->garbage,
-                                          nr, NULL, NIL(struct page_info *));
-
         if ( rc )
             return rc;
 
         dcache->entries = ents;
     }
 
+    vcache->inuse = vcache->garbage = 0;
+    vcache->flush_cpu = nr_cpu_ids;
+
     /* Mark all maphash entries as not in use. */
     BUILD_BUG_ON(MAPHASHENT_NOTINUSE < MAPCACHE_ENTRIES);
     for ( i = 0; i < MAPHASH_ENTRIES; i++ )
     {
-        struct vcpu_maphash_entry *hashent = &v->arch.pv_vcpu.mapcache.hash[i];
+        struct vcpu_maphash_entry *hashent = &vcache->hash[i];
 
         hashent->mfn = ~0UL; /* never valid to map */
         hashent->idx = MAPHASHENT_NOTINUSE;
@@ -21,6 +21,7 @@
 #include <xen/iocap.h>
 #include <xen/paging.h>
 #include <asm/irq.h>
+#include <asm/hvm/exit_stats.h>
 #include <asm/hvm/hvm.h>
 #include <asm/hvm/support.h>
 #include <asm/processor.h>
@@ -591,17 +592,113 @@ long arch_do_domctl(
              !is_hvm_domain(d) )
             break;
 
-        domain_pause(d);
+        /* Pauses as much of the domain as the record needs. */
         ret = hvm_save_one(d, domctl->u.hvmcontext_partial.type,
                            domctl->u.hvmcontext_partial.instance,
                            domctl->u.hvmcontext_partial.buffer,
                            &domctl->u.hvmcontext_partial.bufsz);
-        domain_unpause(d);
 
         if ( !ret )
             copyback = true;
         break;
 
+    case XEN_DOMCTL_gethvmcontext_vcpus:
+    {
+        struct xen_domctl_hvmcontext_vcpus *hv = &domctl->u.hvmcontext_vcpus;
+        struct hvm_domain_context c = { 0 };
+        bool whole = hv->flags & XEN_DOMCTL_HVMCONTEXT_DOMAIN;
+        unsigned int i, end = hv->first_vcpu + hv->nr_vcpus;
+
+        ret = -EINVAL;
+        if ( (d == currd) || /* no domain_pause() */
+             !is_hvm_domain(d) ||
+             (hv->flags & ~XEN_DOMCTL_HVMCONTEXT_DOMAIN) ||
+             (!whole && (end < hv->first_vcpu || end > d->max_vcpus)) )
+            goto gethvmcontext_vcpus_out;
+
+        if ( whole )
+            c.size = hvm_save_size_domain(d);
+        else
+            for ( i = hv->first_vcpu; i < end; i++ )
+                if ( d->vcpu[i] )
+                    c.size += hvm_save_size_vcpu(d->vcpu[i]);
+
+        if ( guest_handle_is_null(hv->buffer) )
+        {
+            hv->size = c.size;
+            ret = 0;
+            goto gethvmcontext_vcpus_out;
+        }
+
+        ret = -ENOSPC;
+        if ( hv->size < c.size )
+            goto gethvmcontext_vcpus_out;
+
+        ret = -ENOMEM;
+        if ( c.size && (c.data = xmalloc_bytes(c.size)) == NULL )
+            goto gethvmcontext_vcpus_out;
+
+        ret = 0;
+        if ( whole )
+        {
+            domain_pause(d);
+            ret = hvm_save_domain(d, &c);
+            domain_unpause(d);
+        }
+        else
+            /* The others keep running while one vcpu gets saved. */
+            for ( i = hv->first_vcpu; !ret && i < end; i++ )
+            {
+                struct vcpu *v = d->vcpu[i];
+
+                if ( !v )
+                    continue;
+
+                vcpu_pause(v);
+                ret = hvm_save_vcpu(v, &c);
+                vcpu_unpause(v);
+            }
+
+        hv->size = c.cur;
+        if ( !ret && copy_to_guest(hv->buffer, c.data, c.cur) )
+            ret = -EFAULT;
+
+    gethvmcontext_vcpus_out:
+        copyback = true;
+        xfree(c.data);
+        break;
+    }
+
+    case XEN_DOMCTL_sethvmcontext_vcpus:
+    {
+        const struct xen_domctl_hvmcontext_vcpus *hv =
+            &domctl->u.hvmcontext_vcpus;
+        struct hvm_domain_context c = { .size = hv->size };
+        unsigned int end = hv->first_vcpu + hv->nr_vcpus;
+
+        ret = -EINVAL;
+        if ( (d == currd) || /* no domain_pause() */
+             !is_hvm_domain(d) || hv->flags ||
+             end < hv->first_vcpu || end > d->max_vcpus )
+            goto sethvmcontext_vcpus_out;
+
+        ret = -ENOMEM;
+        if ( (c.data = xmalloc_bytes(c.size)) == NULL )
+            goto sethvmcontext_vcpus_out;
+
+        ret = -EFAULT;
+        if ( copy_from_guest(c.data, hv->buffer, c.size) != 0 )
+            goto sethvmcontext_vcpus_out;
+
+        domain_pause(d);
+        ret = hvm_load_vcpus(d, hv->first_vcpu, hv->nr_vcpus, &c);
+        domain_unpause(d);
+
+    sethvmcontext_vcpus_out:
+        xfree(c.data);
+        break;
+    }
+
     case XEN_DOMCTL_set_address_size:
         if ( ((domctl->u.address_size.size == 64) && !d->arch.is_32bit_pv) ||
              ((domctl->u.address_size.size == 32) && d->arch.is_32bit_pv) )
@@ -618,6 +715,37 @@ long arch_do_domctl(
         copyback = true;
         break;
 
+    case XEN_DOMCTL_set_spec_ctrl:
+    {
+        const struct xen_domctl_spec_ctrl *sc = &domctl->u.spec_ctrl;
+
+        ret = -EINVAL;
+        if ( (sc->trust_group >> 31) ||
+             (sc->flags & ~XEN_DOMCTL_SPEC_CTRL_no_xpti) ||
+             ((sc->flags & XEN_DOMCTL_SPEC_CTRL_no_xpti) &&
+              !is_pv_domain(d)) )
+            break;
+
+        /* Takes effect as the domain's vCPUs next get scheduled. */
+        d->arch.spec_trust_group = sc->trust_group;
+        d->arch.spec_no_xpti = sc->flags & XEN_DOMCTL_SPEC_CTRL_no_xpti;
+        ret = 0;
+        break;
+    }
+
+    case XEN_DOMCTL_get_spec_ctrl:
+        domctl->u.spec_ctrl.trust_group = d->arch.spec_trust_group;
+        domctl->u.spec_ctrl.flags =
+            d->arch.spec_no_xpti ? XEN_DOMCTL_SPEC_CTRL_no_xpti : 0;
+        copyback = true;
+        break;
+
+    case XEN_DOMCTL_hvm_exit_stats:
+        ret = hvm_exit_stats_domctl(d, &domctl->u.hvm_exit_stats);
+        copyback = !ret &&
+            domctl->u.hvm_exit_stats.cmd == XEN_DOMCTL_EXIT_STATS_query;
+        break;
+
     case XEN_DOMCTL_set_machine_address_size:
         if ( d->tot_pages > 0 )
             ret = -EBUSY;
@@ -1185,12 +1313,16 @@ long arch_do_domctl(
             else
             {
                 vcpu_pause(v);
-                v->arch.xcr0 = _xcr0;
-                v->arch.xcr0_accum = _xcr0_accum;
-                if ( _xcr0_accum & XSTATE_NONLAZY )
-                    v->arch.nonlazy_xstate_used = 1;
-                compress_xsave_states(v, _xsave_area,
-                                      evc->size - PV_XSAVE_HDR_SIZE);
+                ret = xstate_update_save_area(v, _xcr0_accum);
+                if ( !ret )
+                {
+                    v->arch.xcr0 = _xcr0;
+                    v->arch.xcr0_accum = _xcr0_accum;
+                    if ( _xcr0_accum & XSTATE_NONLAZY )
+                        v->arch.nonlazy_xstate_used = 1;
+                    compress_xsave_states(v, _xsave_area,
+                                          evc->size - PV_XSAVE_HDR_SIZE);
+                }
                 vcpu_unpause(v);
             }
 
@@ -7,6 +7,7 @@
  * Copyright (c) 2003-2006, K A Fraser
  */
 
+#include <xen/perfc.h>
 #include <xen/sched.h>
 #include <xen/softirq.h>
 #include <asm/flushtlb.h>
@@ -96,6 +97,9 @@ void write_cr3(unsigned long cr3)
  * bits cleared that have been fully (i.e. system-wide) taken care of, i.e.
  * namely not requiring any further action on remote CPUs.
  */
+/* Widest area flushed page by page rather than globally. */
+#define FLUSH_INVLPG_MAX_ORDER 3
+
 unsigned int flush_area_local(const void *va, unsigned int flags)
 {
     unsigned int order = (flags - 1) & FLUSH_ORDER_MASK;
@@ -106,16 +110,26 @@ unsigned int flush_area_local(const void *va, unsigned int flags)
 
     if ( flags & (FLUSH_TLB|FLUSH_TLB_GLOBAL) )
     {
-        if ( order == 0 )
+        if ( order <= FLUSH_INVLPG_MAX_ORDER )
         {
             /*
-             * We don't INVLPG multi-page regions because the 2M/4M/1G
+             * We don't INVLPG larger multi-page regions because the 2M/4M/1G
              * region may not have been mapped with a superpage. Also there
              * are various errata surrounding INVLPG usage on superpages, and
-             * a full flush is in any case not *that* expensive.
+             * a full flush is in any case not *that* expensive.  A handful
+             * of pages (as e.g. arising from merged remote requests) is
+             * still cheaper to flush one by one though.
              */
-            asm volatile ( "invlpg %0"
-                           : : "m" (*(const char *)(va)) : "memory" );
+            unsigned long addr = (unsigned long)va;
+            unsigned int i;
+
+            if ( order )
+                addr &= ~((PAGE_SIZE << order) - 1);
+            for ( i = 0; i < (1u << order); ++i, addr += PAGE_SIZE )
+                asm volatile ( "invlpg %0"
+                               : : "m" (*(const char *)addr) : "memory" );
+            if ( order )
+                perfc_incr(flush_area_invlpg);
         }
         else
         {
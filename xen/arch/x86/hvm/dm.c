@@ -78,6 +78,110 @@ static int track_dirty_vram(struct domain *d, xen_pfn_t first_pfn,
         hap_track_dirty_vram(d, first_pfn, nr, buf->h);
 }
 
+static int track_dirty_vram_ranges(
+    struct domain *d, struct xen_dm_op_track_dirty_vram_ranges *data,
+    const struct xen_dm_op_buf *buf)
+{
+    uint64_t *genp = &d->arch.hvm_domain.dirty_vram_gen, gen;
+    uint64_t last_gen = data->generation;
+    struct xen_dm_op_dirty_vram_range range = {};
+    unsigned long *bitmap = NULL, i, end;
+    unsigned int n = 0, max = data->nr_ranges;
+    bool all, dirty;
+    int rc;
+
+    if ( data->nr > (GB(1) >> PAGE_SHIFT) )
+        return -EINVAL;
+
+    if ( d->is_dying )
+        return -ESRCH;
+
+    if ( !d->max_vcpus || !d->vcpu[0] )
+        return -EINVAL;
+
+    if ( data->nr && (!max || max > buf->size / sizeof(range)) )
+        return -EINVAL;
+
+    if ( data->nr )
+    {
+        bitmap = vzalloc(BITS_TO_LONGS(data->nr) * sizeof(*bitmap));
+        if ( !bitmap )
+            return -ENOMEM;
+    }
+
+    gen = read_atomic(genp);
+
+    rc = shadow_mode_enabled(d) ?
+        shadow_dirty_vram_bitmap(d, data->first_pfn, data->nr, bitmap) :
+        hap_dirty_vram_bitmap(d, data->first_pfn, data->nr, bitmap);
+
+    data->nr_ranges = 0;
+    data->flags = 0;
+
+    if ( !data->nr || (rc && rc != -ENODATA) )
+    {
+        data->generation = gen;
+        goto out;
+    }
+
+    /*
+     * Anyone else consuming modifications since the caller's last call
+     * has taken some away from it: only the whole range is safe then.
+     */
+    all = rc == -ENODATA || last_gen != gen;
+    dirty = find_first_bit(bitmap, data->nr) < data->nr;
+    if ( !all && dirty )
+        all = cmpxchg(genp, gen, gen + 1) != gen;
+    else if ( !all )
+        all = read_atomic(genp) != gen;
+
+    if ( all )
+    {
+        gen = arch_fetch_and_add(genp, 1) + 1;
+        data->flags |= XEN_DMOP_DIRTY_VRAM_ALL;
+    }
+    else if ( dirty )
+        gen++;
+
+    for ( i = all ? 0 : find_first_bit(bitmap, data->nr); i < data->nr;
+          i = find_next_bit(bitmap, data->nr, end) )
+    {
+        end = all ? data->nr : find_next_zero_bit(bitmap, data->nr, i);
+
+        if ( range.nr && n + 1 == max )
+        {
+            /* Out of room: the last range covers all the others too. */
+            range.nr = data->first_pfn + end - range.first_pfn;
+            data->flags |= XEN_DMOP_DIRTY_VRAM_MERGED;
+            continue;
+        }
+
+        if ( range.nr && copy_to_guest_offset(buf->h, n++, &range, 1) )
+            goto fault;
+
+        range.first_pfn = data->first_pfn + i;
+        range.nr = end - i;
+    }
+
+    if ( range.nr && copy_to_guest_offset(buf->h, n++, &range, 1) )
+        goto fault;
+
+    data->nr_ranges = n;
+    data->generation = gen;
+    rc = 0;
+
+ out:
+    vfree(bitmap);
+
+    return rc;
+
+ fault:
+    /* The modifications are lost: have the next call report everything. */
+    arch_fetch_and_add(genp, 1);
+    rc = -EFAULT;
+    goto out;
+}
+
 static int set_pci_intx_level(struct domain *d, uint16_t domain,
                               uint8_t bus, uint8_t device,
                               uint8_t intx, uint8_t level)
@@ -359,6 +463,7 @@ static int dm_op(const struct dmop_args *op_args)
         [XEN_DMOP_remote_shutdown]                  = sizeof(struct xen_dm_op_remote_shutdown),
         [XEN_DMOP_relocate_memory]                  = sizeof(struct xen_dm_op_relocate_memory),
         [XEN_DMOP_pin_memory_cacheattr]             = sizeof(struct xen_dm_op_pin_memory_cacheattr),
+        [XEN_DMOP_track_dirty_vram_ranges]          = sizeof(struct xen_dm_op_track_dirty_vram_ranges),
     };
 
     rc = rcu_lock_remote_domain_by_id(op_args->domid, &d);
@@ -409,11 +514,14 @@ static int dm_op(const struct dmop_args *op_args)
         const_op = false;
 
         rc = -EINVAL;
-        if ( data->pad[0] || data->pad[1] || data->pad[2] )
+        if ( data->pad[0] || data->pad[1] ||
+             (data->flags & ~(XEN_DMOP_IOREQ_SERVER_POLL |
+                              XEN_DMOP_IOREQ_SERVER_BUFIOREQ_COALESCE)) )
             break;
 
         rc = hvm_create_ioreq_server(d, curr_d->domain_id, false,
-                                     data->handle_bufioreq, &data->id);
+                                     data->handle_bufioreq, data->flags,
+                                     &data->id);
         break;
     }
 
@@ -441,11 +549,12 @@ static int dm_op(const struct dmop_args *op_args)
             &op.u.map_io_range_to_ioreq_server;
 
         rc = -EINVAL;
-        if ( data->pad )
+        if ( data->flags & ~XEN_DMOP_IO_RANGE_BUFFERED )
             break;
 
         rc = hvm_map_io_range_to_ioreq_server(d, data->id, data->type,
-                                              data->start, data->end);
+                                              data->start, data->end,
+                                              data->flags);
         break;
     }
 
@@ -455,7 +564,7 @@ static int dm_op(const struct dmop_args *op_args)
             &op.u.unmap_io_range_from_ioreq_server;
 
         rc = -EINVAL;
-        if ( data->pad )
+        if ( data->flags & ~XEN_DMOP_IO_RANGE_BUFFERED )
             break;
 
         rc = hvm_unmap_io_range_from_ioreq_server(d, data->id, data->type,
@@ -555,6 +664,23 @@ static int dm_op(const struct dmop_args *op_args)
         break;
     }
 
+    case XEN_DMOP_track_dirty_vram_ranges:
+    {
+        struct xen_dm_op_track_dirty_vram_ranges *data =
+            &op.u.track_dirty_vram_ranges;
+
+        rc = -EINVAL;
+        if ( data->pad )
+            break;
+
+        if ( op_args->nr_bufs < 2 )
+            break;
+
+        const_op = false;
+        rc = track_dirty_vram_ranges(d, data, &op_args->buf[1]);
+        break;
+    }
+
     case XEN_DMOP_set_pci_intx_level:
     {
         const struct xen_dm_op_set_pci_intx_level *data =
@@ -724,6 +850,8 @@ CHECK_dm_op_inject_msi;
 CHECK_dm_op_remote_shutdown;
 CHECK_dm_op_relocate_memory;
 CHECK_dm_op_pin_memory_cacheattr;
+CHECK_dm_op_track_dirty_vram_ranges;
+CHECK_dm_op_dirty_vram_range;
 
 int compat_dm_op(domid_t domid,
                  unsigned int nr_bufs,
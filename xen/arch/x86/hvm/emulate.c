@@ -370,6 +370,13 @@ static inline void hvmemul_release_page(struct page_info *page)
     put_page(page);
 }
 
+/*
+ * Maximum number of RAM pages a single REP request to a device model may
+ * cover. Internal handlers access RAM through hvm_copy_*_guest_phys(),
+ * which validates every page itself, so their requests are not limited.
+ */
+#define HVMEMUL_IO_MAX_PAGES 8
+
 static int hvmemul_do_io_addr(
     bool_t is_mmio, paddr_t addr, unsigned long *reps,
     unsigned int size, uint8_t dir, bool_t df, paddr_t ram_gpa)
@@ -377,7 +384,7 @@ static int hvmemul_do_io_addr(
     struct vcpu *v = current;
     unsigned long ram_gmfn = paddr_to_pfn(ram_gpa);
     unsigned int page_off = ram_gpa & (PAGE_SIZE - 1);
-    struct page_info *ram_page[2];
+    struct page_info *ram_page[HVMEMUL_IO_MAX_PAGES];
     unsigned int nr_pages = 0;
     unsigned long count;
     int rc;
@@ -412,6 +419,47 @@ static int hvmemul_do_io_addr(
         nr_pages++;
         count = 1;
     }
+    else if ( count < *reps )
+    {
+        ioreq_t p = {
+            .type = is_mmio ? IOREQ_TYPE_COPY : IOREQ_TYPE_PIO,
+            .addr = addr,
+            .size = size,
+            .count = *reps,
+            .dir = dir,
+            .df = df,
+            .data = ram_gpa,
+            .data_is_ptr = 1,
+        };
+
+        /*
+         * hvmemul_linear_to_phys() has ensured the RAM range is physically
+         * contiguous, so an internal handler can do the whole REP in one
+         * go. Otherwise hand the device model as many (forward) pages as
+         * can be acquired, up to the limit.
+         */
+        if ( hvm_io_internal(&p) )
+            count = *reps;
+        else if ( !df )
+        {
+            while ( count < *reps && nr_pages < ARRAY_SIZE(ram_page) )
+            {
+                p2m_type_t p2mt;
+
+                /* Stop short of anything that isn't plain RAM. */
+                get_gfn_query_unlocked(v->domain, ram_gmfn + nr_pages, &p2mt);
+                if ( !p2m_is_ram(p2mt) || p2m_is_paging(p2mt) ||
+                     p2m_is_shared(p2mt) ||
+                     hvmemul_acquire_page(ram_gmfn + nr_pages,
+                                          &ram_page[nr_pages]) != X86EMUL_OKAY )
+                    break;
+
+                nr_pages++;
+                count = min_t(unsigned long, *reps,
+                              (nr_pages * PAGE_SIZE - page_off) / size);
+            }
+        }
+    }
 
     rc = hvmemul_do_io(is_mmio, addr, &count, size, dir, df, 1,
                        ram_gpa);
@@ -2311,6 +2359,100 @@ void hvm_emulate_init_once(
     hvmemul_ctxt->ctxt.force_writeback = true;
 }
 
+/*
+ * Fetch the instruction at the current rIP into insn_buf[], returning the
+ * number of bytes fetched (or zero on failure).
+ *
+ * Guest drivers tend to hit the same few MMIO instructions over and over, so
+ * the linear-to-guest-physical translations of the most recently fetched
+ * instructions are kept per vCPU, sparing the guest page walk.  The bytes are
+ * still read afresh from guest memory every time, so writes to code pages are
+ * honoured, and an entry whose bytes changed is dropped, which also catches
+ * code frames re-used after a remapping Xen didn't get to see.  Otherwise the
+ * cache behaves like a TLB: it gets flushed on guest INVLPG, and on any
+ * change to CR0, CR3, CR4 or EFER.  CR3 and the access type (user/supervisor)
+ * are part of the key.
+ *
+ * This is only sound under shadow paging, where Xen intercepts all of the
+ * above.  With HAP the guest may rewrite its page tables, flush its TLB and
+ * even reload CR3 unobserved, so the cache isn't used there.
+ */
+static unsigned int hvmemul_fetch_insn(struct hvm_emulate_ctxt *hvmemul_ctxt,
+                                       uint32_t pfec)
+{
+    struct vcpu *curr = current;
+    struct hvm_vcpu_io *vio = &curr->arch.hvm_vcpu.hvm_io;
+    unsigned char *buf = hvmemul_ctxt->insn_buf;
+    const unsigned int bytes = sizeof(hvmemul_ctxt->insn_buf);
+    unsigned long addr, gfn, cr3 = curr->arch.hvm_vcpu.guest_cr[3];
+    struct hvm_insn_cache *ent;
+    uint32_t walk;
+    unsigned int i;
+    bool cache = paging_mode_shadow(curr->domain);
+
+    BUILD_BUG_ON(sizeof(ent->insn) != sizeof(hvmemul_ctxt->insn_buf));
+
+    if ( !hvm_virtual_to_linear_addr(x86_seg_cs,
+                                     &hvmemul_ctxt->seg_reg[x86_seg_cs],
+                                     hvmemul_ctxt->insn_buf_eip, bytes,
+                                     hvm_access_insn_fetch,
+                                     &hvmemul_ctxt->seg_reg[x86_seg_cs],
+                                     &addr) )
+        return 0;
+
+    for ( i = 0; cache && i < vio->insn_cache_count; ++i )
+    {
+        ent = &vio->insn_cache[i];
+        if ( ent->addr != addr || ent->cr3 != cr3 || ent->pfec != pfec )
+            continue;
+
+        if ( hvm_copy_from_guest_phys(buf, gfn_to_gaddr(ent->gfn) +
+                                      (addr & ~PAGE_MASK),
+                                      bytes) == HVMTRANS_okay &&
+             !memcmp(buf, ent->insn, bytes) )
+        {
+            perfc_incr(hvm_insn_cache_hit);
+            return bytes;
+        }
+
+        *ent = vio->insn_cache[--vio->insn_cache_count];
+        break;
+    }
+
+    if ( cache )
+        perfc_incr(hvm_insn_cache_miss);
+
+    if ( hvm_fetch_from_guest_linear(buf, addr, bytes, pfec,
+                                     NULL) != HVMTRANS_okay )
+        return 0;
+
+    /* Instructions crossing a page boundary don't get cached. */
+    if ( !cache || (addr & ~PAGE_MASK) + bytes > PAGE_SIZE )
+        return bytes;
+
+    walk = pfec | PFEC_page_present | PFEC_insn_fetch;
+    gfn = paging_gva_to_gfn(curr, addr, &walk);
+    if ( gfn == gfn_x(INVALID_GFN) )
+        return bytes;
+
+    if ( vio->insn_cache_count < ARRAY_SIZE(vio->insn_cache) )
+        ent = &vio->insn_cache[vio->insn_cache_count++];
+    else
+    {
+        ent = &vio->insn_cache[vio->insn_cache_next];
+        vio->insn_cache_next = (vio->insn_cache_next + 1) %
+                               ARRAY_SIZE(vio->insn_cache);
+    }
+
+    ent->addr = addr;
+    ent->cr3 = cr3;
+    ent->gfn = _gfn(gfn);
+    ent->pfec = pfec;
+    memcpy(ent->insn, buf, bytes);
+
+    return bytes;
+}
+
 void hvm_emulate_init_per_insn(
     struct hvm_emulate_ctxt *hvmemul_ctxt,
     const unsigned char *insn_buf,
@@ -2318,7 +2460,6 @@ void hvm_emulate_init_per_insn(
 {
     struct vcpu *curr = current;
     unsigned int pfec = PFEC_page_present;
-    unsigned long addr;
 
     hvmemul_ctxt->ctxt.lma = hvm_long_mode_active(curr);
 
@@ -2341,17 +2482,7 @@ void hvm_emulate_init_per_insn(
     {
         hvmemul_ctxt->insn_buf_bytes =
             hvm_get_insn_bytes(curr, hvmemul_ctxt->insn_buf) ?:
-            (hvm_virtual_to_linear_addr(x86_seg_cs,
-                                        &hvmemul_ctxt->seg_reg[x86_seg_cs],
-                                        hvmemul_ctxt->insn_buf_eip,
-                                        sizeof(hvmemul_ctxt->insn_buf),
-                                        hvm_access_insn_fetch,
-                                        &hvmemul_ctxt->seg_reg[x86_seg_cs],
-                                        &addr) &&
-             hvm_fetch_from_guest_linear(hvmemul_ctxt->insn_buf, addr,
-                                         sizeof(hvmemul_ctxt->insn_buf),
-                                         pfec, NULL) == HVMTRANS_okay) ?
-            sizeof(hvmemul_ctxt->insn_buf) : 0;
+            hvmemul_fetch_insn(hvmemul_ctxt, pfec);
     }
     else
     {
@@ -0,0 +1,194 @@
+/*
+ * arch/x86/hvm/exit_stats.c
+ *
+ * Per exit reason VM exit counts and handling time histograms.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * When enabled for a domain, the exit handlers note the TSC and the exit
+ * reason as they start, and the time until the next VM entry, or until
+ * the vCPU is descheduled, is accounted to that reason, in the vCPU's own
+ * table.  A vCPU only runs on one pCPU at a time, which hence is the only
+ * one updating its table: neither locks nor atomic ops are needed, and
+ * the tables don't bounce between pCPUs more than the vCPU does.  Queries
+ * sum the tables of all vCPUs, racing with their updates, as for perfc.
+ *
+ * VMX basic exit reasons, and SVM exit codes up to the CR write traps, are
+ * accounted individually, as are the SVM nested page fault and AVIC exits.
+ * The few others share one slot.
+ */
+
+#include <xen/guest_access.h>
+#include <xen/log2hist.h>
+#include <xen/sched.h>
+#include <xen/time.h>
+#include <xen/xmalloc.h>
+#include <asm/hvm/exit_stats.h>
+#include <asm/hvm/hvm.h>
+
+#define EXIT_STATS_DIRECT   0xa0
+#define EXIT_STATS_HIGH     0x400    /* SVM NPF, AVIC, ... */
+#define EXIT_STATS_NR       (EXIT_STATS_DIRECT + 8)
+#define EXIT_STATS_BUCKETS  XEN_DOMCTL_EXIT_STATS_BUCKETS
+
+struct hvm_exit_stat {
+    uint64_t count;
+    uint64_t cycles;
+    uint32_t hist[EXIT_STATS_BUCKETS];
+};
+
+static unsigned int exit_slot(unsigned int reason)
+{
+    if ( reason < EXIT_STATS_DIRECT )
+        return reason;
+    if ( reason - EXIT_STATS_HIGH < EXIT_STATS_NR - EXIT_STATS_DIRECT - 1 )
+        return EXIT_STATS_DIRECT + reason - EXIT_STATS_HIGH;
+
+    return EXIT_STATS_NR - 1;
+}
+
+static unsigned int slot_reason(unsigned int slot)
+{
+    if ( slot < EXIT_STATS_DIRECT )
+        return slot;
+    if ( slot < EXIT_STATS_NR - 1 )
+        return EXIT_STATS_HIGH + slot - EXIT_STATS_DIRECT;
+
+    return XEN_DOMCTL_EXIT_STATS_OTHER;
+}
+
+void hvm_exit_stats_account(struct vcpu *v)
+{
+    struct hvm_exit_stat *s = v->arch.hvm_vcpu.exit_stats;
+    uint64_t cycles = rdtsc() - v->arch.hvm_vcpu.exit_tsc;
+
+    v->arch.hvm_vcpu.exit_tsc = 0;
+
+    /* Enabled before this vCPU got its table? */
+    if ( unlikely(!s) )
+        return;
+
+    s += exit_slot(v->arch.hvm_vcpu.exit_reason);
+    s->count++;
+    s->cycles += cycles;
+
+    /* Bucket 0 is < 256 cycles. */
+    log2_hist_add(s->hist, EXIT_STATS_BUCKETS, cycles, 8);
+}
+
+void hvm_exit_stats_destroy(struct vcpu *v)
+{
+    xfree(v->arch.hvm_vcpu.exit_stats);
+    v->arch.hvm_vcpu.exit_stats = NULL;
+}
+
+static int exit_stats_query(struct domain *d,
+                            struct xen_domctl_hvm_exit_stats *op)
+{
+    struct xen_domctl_exit_stat elem;
+    const struct vcpu *v;
+    unsigned int slot, i, nr = 0;
+
+    op->vendor = cpu_has_vmx ? XEN_DOMCTL_EXIT_STATS_VMX
+                             : XEN_DOMCTL_EXIT_STATS_SVM;
+    op->tsc_khz = cpu_khz;
+    op->enabled = d->arch.hvm_domain.exit_stats;
+
+    for ( slot = 0; slot < EXIT_STATS_NR; slot++ )
+    {
+        memset(&elem, 0, sizeof(elem));
+        elem.reason = slot_reason(slot);
+
+        for_each_vcpu ( d, v )
+        {
+            const struct hvm_exit_stat *s = v->arch.hvm_vcpu.exit_stats;
+
+            if ( !s )
+                continue;
+
+            s += slot;
+            elem.count += s->count;
+            elem.cycles += s->cycles;
+            for ( i = 0; i < EXIT_STATS_BUCKETS; i++ )
+                elem.hist[i] += s->hist[i];
+        }
+
+        if ( !elem.count )
+            continue;
+
+        if ( nr < op->nr_reasons &&
+             copy_to_guest_offset(op->stats, nr, &elem, 1) )
+            return -EFAULT;
+        nr++;
+    }
+
+    op->nr_reasons = nr;
+
+    return 0;
+}
+
+int hvm_exit_stats_domctl(struct domain *d,
+                          struct xen_domctl_hvm_exit_stats *op)
+{
+    struct vcpu *v;
+
+    if ( !is_hvm_domain(d) )
+        return -EOPNOTSUPP;
+
+    switch ( op->cmd )
+    {
+    case XEN_DOMCTL_EXIT_STATS_query:
+        return exit_stats_query(d, op);
+
+    case XEN_DOMCTL_EXIT_STATS_enable:
+        for_each_vcpu ( d, v )
+        {
+            if ( v->arch.hvm_vcpu.exit_stats )
+                continue;
+            v->arch.hvm_vcpu.exit_stats =
+                xzalloc_array(struct hvm_exit_stat, EXIT_STATS_NR);
+            if ( !v->arch.hvm_vcpu.exit_stats )
+                return -ENOMEM;
+        }
+        d->arch.hvm_domain.exit_stats = true;
+        break;
+
+    case XEN_DOMCTL_EXIT_STATS_disable:
+        d->arch.hvm_domain.exit_stats = false;
+        break;
+
+    case XEN_DOMCTL_EXIT_STATS_reset:
+        for_each_vcpu ( d, v )
+            if ( v->arch.hvm_vcpu.exit_stats )
+                memset(v->arch.hvm_vcpu.exit_stats, 0,
+                       EXIT_STATS_NR * sizeof(struct hvm_exit_stat));
+        break;
+
+    default:
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
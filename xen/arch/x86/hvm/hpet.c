@@ -73,49 +73,81 @@
     ((timer_config(h, n) & HPET_TN_INT_ROUTE_CAP_MASK) \
         >> HPET_TN_INT_ROUTE_CAP_SHIFT)
 
-static inline uint64_t hpet_read_maincounter(HPETState *h, uint64_t guest_time)
+/*
+ * Guests using the HPET as clocksource read the main counter all the time,
+ * often from many vCPUs at once, so reads take no lock.  Everything they
+ * look at is only changed between hpet_write_lock() and hpet_write_unlock(),
+ * which bump h->seq around the update, and a read which saw it change (or
+ * odd) tries again.
+ */
+static void hpet_write_lock(HPETState *h)
 {
-    ASSERT(rw_is_locked(&h->lock));
+    write_lock(&h->lock);
+    h->seq++;
+    smp_wmb();
+}
 
+static void hpet_write_unlock(HPETState *h)
+{
+    smp_wmb();
+    h->seq++;
+    write_unlock(&h->lock);
+}
+
+static inline uint64_t hpet_read_maincounter(const HPETState *h,
+                                             uint64_t guest_time)
+{
     if ( hpet_enabled(h) )
         return guest_time + h->mc_offset;
     else
         return h->hpet.mc64;
 }
 
-static uint64_t hpet_get_comparator(HPETState *h, unsigned int tn,
-                                    uint64_t guest_time)
+/* The 64 bit comparator, moved on by the periods elapsed since it was set. */
+static uint64_t hpet_calc_comparator(const HPETState *h, unsigned int tn,
+                                     uint64_t guest_time)
 {
-    uint64_t comparator;
+    uint64_t comparator = h->hpet.comparator64[tn];
     uint64_t elapsed;
 
-    ASSERT(rw_is_write_locked(&h->lock));
-
-    comparator = h->hpet.comparator64[tn];
     if ( hpet_enabled(h) && timer_is_periodic(h, tn) )
     {
-        /* update comparator by number of periods elapsed since last update */
         uint64_t period = h->hpet.period[tn];
-        if (period)
+
+        if ( period )
         {
             elapsed = hpet_read_maincounter(h, guest_time) - comparator;
             if ( (int64_t)elapsed >= 0 )
-            {
                 comparator += ((elapsed + period) / period) * period;
-                h->hpet.comparator64[tn] = comparator;
-            }
         }
     }
 
+    return comparator;
+}
+
+static uint64_t hpet_get_comparator(HPETState *h, unsigned int tn,
+                                    uint64_t guest_time)
+{
+    uint64_t comparator;
+
+    ASSERT(rw_is_write_locked(&h->lock));
+
+    /* update comparator by number of periods elapsed since last update */
+    comparator = hpet_calc_comparator(h, tn, guest_time);
+    h->hpet.comparator64[tn] = comparator;
+
     /* truncate if timer is in 32 bit mode */
     if ( timer_is_32bit(h, tn) )
         comparator = (uint32_t)comparator;
     h->hpet.timers[tn].cmp = comparator;
     return comparator;
 }
-static inline uint64_t hpet_read64(HPETState *h, unsigned long addr,
+
+static inline uint64_t hpet_read64(const HPETState *h, unsigned long addr,
                                    uint64_t guest_time)
 {
+    uint64_t comparator;
+
     addr &= ~7;
 
     switch ( addr )
@@ -135,7 +167,9 @@ static inline uint64_t hpet_read64(HPETState *h, unsigned long addr,
     case HPET_Tn_CMP(0):
     case HPET_Tn_CMP(1):
     case HPET_Tn_CMP(2):
-        return hpet_get_comparator(h, HPET_TN(CMP, addr), guest_time);
+        comparator = hpet_calc_comparator(h, HPET_TN(CMP, addr), guest_time);
+        return timer_is_32bit(h, HPET_TN(CMP, addr)) ? (uint32_t)comparator
+                                                     : comparator;
     case HPET_Tn_ROUTE(0):
     case HPET_Tn_ROUTE(1):
     case HPET_Tn_ROUTE(2):
@@ -169,7 +203,8 @@ static int hpet_read(
 {
     HPETState *h = vcpu_vhpet(v);
     unsigned long result;
-    uint64_t val;
+    uint64_t val, guest_time;
+    unsigned int seq;
 
     if ( !v->domain->arch.hvm_domain.params[HVM_PARAM_HPET_ENABLED] )
     {
@@ -185,19 +220,25 @@ static int hpet_read(
         goto out;
     }
 
-    result = addr < HPET_Tn_CMP(0) ||
-             ((addr - HPET_Tn_CMP(0)) % (HPET_Tn_CMP(1) - HPET_Tn_CMP(0))) > 7;
-    if ( result )
-        read_lock(&h->lock);
-    else
-        write_lock(&h->lock);
+    v->arch.hvm_vcpu.hpet_reads++;
+    guest_time = guest_time_hpet(h);
 
-    val = hpet_read64(h, addr, guest_time_hpet(h));
+    for ( ; ; )
+    {
+        seq = read_atomic(&h->seq);
+        if ( unlikely(seq & 1) )
+        {
+            cpu_relax();
+            continue;
+        }
+        smp_rmb();
 
-    if ( result )
-        read_unlock(&h->lock);
-    else
-        write_unlock(&h->lock);
+        val = hpet_read64(h, addr, guest_time);
+
+        smp_rmb();
+        if ( likely(read_atomic(&h->seq) == seq) )
+            break;
+    }
 
     result = val;
     if ( length != 8 )
@@ -321,7 +362,7 @@ static int hpet_write(
     if ( hpet_check_access_length(addr, length) != 0 )
         goto out;
 
-    write_lock(&h->lock);
+    hpet_write_lock(h);
 
     guest_time = guest_time_hpet(h);
     old_val = hpet_read64(h, addr, guest_time);
@@ -490,7 +531,7 @@ static int hpet_write(
 #undef set_start_timer
 #undef set_restart_timer
 
-    write_unlock(&h->lock);
+    hpet_write_unlock(h);
 
  out:
     return X86EMUL_OKAY;
@@ -519,7 +560,7 @@ static int hpet_save(struct domain *d, hvm_domain_context_t *h)
     if ( !has_vhpet(d) )
         return 0;
 
-    write_lock(&hp->lock);
+    hpet_write_lock(hp);
     guest_time = (v->arch.hvm_vcpu.guest_time ?: hvm_get_guest_time(v)) /
                  STIME_PER_HPET_TICK;
 
@@ -566,7 +607,7 @@ static int hpet_save(struct domain *d, hvm_domain_context_t *h)
         rec->timers[2].cmp = hp->hpet.comparator64[2];
     }
 
-    write_unlock(&hp->lock);
+    hpet_write_unlock(hp);
 
     return rc;
 }
@@ -582,12 +623,12 @@ static int hpet_load(struct domain *d, hvm_domain_context_t *h)
     if ( !has_vhpet(d) )
         return -ENODEV;
 
-    write_lock(&hp->lock);
+    hpet_write_lock(hp);
 
     /* Reload the HPET registers */
     if ( _hvm_check_entry(h, HVM_SAVE_CODE(HPET), HVM_SAVE_LENGTH(HPET), 1) )
     {
-        write_unlock(&hp->lock);
+        hpet_write_unlock(hp);
         return -EINVAL;
     }
 
@@ -628,7 +669,7 @@ static int hpet_load(struct domain *d, hvm_domain_context_t *h)
             if ( timer_enabled(hp, i) )
                 hpet_set_timer(hp, i, guest_time);
 
-    write_unlock(&hp->lock);
+    hpet_write_unlock(hp);
 
     return 0;
 }
@@ -684,7 +725,7 @@ void hpet_deinit(struct domain *d)
     if ( !has_vhpet(d) )
         return;
 
-    write_lock(&h->lock);
+    hpet_write_lock(h);
 
     if ( hpet_enabled(h) )
     {
@@ -695,7 +736,7 @@ void hpet_deinit(struct domain *d)
                 hpet_stop_timer(h, i, guest_time);
     }
 
-    write_unlock(&h->lock);
+    hpet_write_unlock(h);
 }
 
 void hpet_reset(struct domain *d)
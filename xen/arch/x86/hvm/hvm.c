@@ -53,6 +53,7 @@
 #include <asm/mce.h>
 #include <asm/monitor.h>
 #include <asm/hvm/hvm.h>
+#include <asm/hvm/exit_stats.h>
 #include <asm/hvm/vpt.h>
 #include <asm/hvm/support.h>
 #include <asm/hvm/cacheattr.h>
@@ -109,6 +110,17 @@ static const char __initconst warning_hvm_fep[] =
 static bool_t __initdata opt_altp2m_enabled = 0;
 boolean_param("altp2m", opt_altp2m_enabled);
 
+/*
+ * Xen command-line option to have guest bound MSIs follow their target vCPU
+ * lazily: at most once per this many milliseconds, rather than upon every
+ * vCPU migration.
+ */
+static unsigned int __read_mostly opt_hvm_msi_balance;
+integer_param("hvm_msi_balance", opt_hvm_msi_balance);
+
+/* Consecutive remote deliveries towards one pCPU before moving an MSI. */
+#define MSI_BALANCE_HITS 8
+
 static int cpu_callback(
     struct notifier_block *nfb, unsigned long action, void *hcpu)
 {
@@ -459,6 +471,7 @@ void hvm_migrate_timers(struct vcpu *v)
 {
     rtc_migrate_timers(v);
     pt_migrate(v);
+    viridian_migrate_timers(v);
 }
 
 static int hvm_migrate_pirq(struct domain *d, struct hvm_pirq_dpci *pirq_dpci,
@@ -488,6 +501,10 @@ void hvm_migrate_pirqs(struct vcpu *v)
 {
     struct domain *d = v->domain;
 
+    /* Left to hvm_balance_pirq() when interrupts actually arrive. */
+    if ( opt_hvm_msi_balance )
+        return;
+
     if ( !iommu_enabled || !hvm_domain_irq(d)->dpci )
        return;
 
@@ -496,6 +513,59 @@ void hvm_migrate_pirqs(struct vcpu *v)
     spin_unlock(&d->event_lock);
 }
 
+/*
+ * Called with the event lock held for every guest bound MSI received on
+ * the local CPU, ahead of its delivery.  Move the physical interrupt to the
+ * pCPU its (single) target vCPU runs on, once it has repeatedly been found
+ * running there.  Posted interrupts are delivered directly to wherever the
+ * vCPU runs and hence are left alone.
+ */
+void hvm_balance_pirq(struct domain *d, struct hvm_pirq_dpci *pirq_dpci)
+{
+    struct hvm_gmsi_info *gmsi = &pirq_dpci->gmsi;
+    struct irq_desc *desc;
+    unsigned int cpu;
+    s_time_t now;
+
+    ASSERT(spin_is_locked(&d->event_lock));
+
+    if ( !opt_hvm_msi_balance ||
+         !(pirq_dpci->flags & HVM_IRQ_DPCI_MACH_MSI) ||
+         gmsi->posted || gmsi->dest_vcpu_id < 0 )
+        return;
+
+    cpu = read_atomic(&d->vcpu[gmsi->dest_vcpu_id]->processor);
+    if ( cpu == smp_processor_id() )
+    {
+        gmsi->balance_hits = 0;
+        return;
+    }
+
+    if ( cpu != gmsi->balance_cpu )
+    {
+        gmsi->balance_cpu = cpu;
+        gmsi->balance_hits = 0;
+    }
+
+    if ( ++gmsi->balance_hits < MSI_BALANCE_HITS )
+        return;
+
+    now = NOW();
+    if ( now - gmsi->balance_stamp < MILLISECS(opt_hvm_msi_balance) )
+        return;
+
+    desc = pirq_spin_lock_irq_desc(dpci_pirq(pirq_dpci), NULL);
+    if ( !desc )
+        return;
+    ASSERT(MSI_IRQ(desc - irq_desc));
+    irq_set_affinity(desc, cpumask_of(cpu));
+    spin_unlock_irq(&desc->lock);
+
+    perfc_incr(hvm_msi_balanced);
+    gmsi->balance_stamp = now;
+    gmsi->balance_hits = 0;
+}
+
 static bool hvm_get_pending_event(struct vcpu *v, struct x86_event *info)
 {
     info->cr2 = v->arch.hvm_vcpu.guest_cr[2];
@@ -655,6 +725,10 @@ int hvm_domain_initialise(struct domain *d, unsigned long domcr_flags,
     if ( hvm_tsc_scaling_supported )
         d->arch.hvm_domain.tsc_scaling_ratio = hvm_default_tsc_scaling_ratio;
 
+    rc = numa_balance_domain_init(d);
+    if ( rc != 0 )
+        goto fail2;
+
     rc = hvm_funcs.domain_initialise(d);
     if ( rc != 0 )
         goto fail2;
@@ -662,6 +736,7 @@ int hvm_domain_initialise(struct domain *d, unsigned long domcr_flags,
     return 0;
 
  fail2:
+    numa_balance_domain_destroy(d);
     rtc_deinit(d);
     stdvga_deinit(d);
     vioapic_deinit(d);
@@ -691,6 +766,7 @@ void hvm_domain_relinquish_resources(struct domain *d)
     msixtbl_pt_cleanup(d);
 
     /* Stop all asynchronous timer actions. */
+    numa_balance_domain_stop(d);
     rtc_deinit(d);
     if ( d->vcpu != NULL && d->vcpu[0] != NULL )
     {
@@ -712,6 +788,8 @@ void hvm_domain_destroy(struct domain *d)
 
     hvm_destroy_cacheattr_region_list(d);
 
+    numa_balance_domain_destroy(d);
+
     hvm_funcs.domain_destroy(d);
     rtc_deinit(d);
     stdvga_deinit(d);
@@ -732,21 +810,13 @@ void hvm_domain_destroy(struct domain *d)
     }
 }
 
-static int hvm_save_tsc_adjust(struct domain *d, hvm_domain_context_t *h)
+static int hvm_save_tsc_adjust(struct vcpu *v, hvm_domain_context_t *h)
 {
-    struct vcpu *v;
-    struct hvm_tsc_adjust ctxt;
-    int err = 0;
+    struct hvm_tsc_adjust ctxt = {
+        .tsc_adjust = v->arch.hvm_vcpu.msr_tsc_adjust,
+    };
 
-    for_each_vcpu ( d, v )
-    {
-        ctxt.tsc_adjust = v->arch.hvm_vcpu.msr_tsc_adjust;
-        err = hvm_save_entry(TSC_ADJUST, v->vcpu_id, h, &ctxt);
-        if ( err )
-            break;
-    }
-
-    return err;
+    return hvm_save_entry(TSC_ADJUST, v->vcpu_id, h, &ctxt);
 }
 
 static int hvm_load_tsc_adjust(struct domain *d, hvm_domain_context_t *h)
@@ -769,122 +839,116 @@ static int hvm_load_tsc_adjust(struct domain *d, hvm_domain_context_t *h)
     return 0;
 }
 
-HVM_REGISTER_SAVE_RESTORE(TSC_ADJUST, hvm_save_tsc_adjust,
-                          hvm_load_tsc_adjust, 1, HVMSR_PER_VCPU);
+HVM_REGISTER_SAVE_RESTORE_VCPU(TSC_ADJUST, hvm_save_tsc_adjust,
+                               hvm_load_tsc_adjust);
 
-static int hvm_save_cpu_ctxt(struct domain *d, hvm_domain_context_t *h)
+static int hvm_save_cpu_ctxt(struct vcpu *v, hvm_domain_context_t *h)
 {
-    struct vcpu *v;
     struct hvm_hw_cpu ctxt;
     struct segment_register seg;
 
-    for_each_vcpu ( d, v )
-    {
-        /* We don't need to save state for a vcpu that is down; the restore 
-         * code will leave it down if there is nothing saved. */
-        if ( v->pause_flags & VPF_down )
-            continue;
+    /* We don't need to save state for a vcpu that is down; the restore 
+     * code will leave it down if there is nothing saved. */
+    if ( v->pause_flags & VPF_down )
+        return 0;
 
-        memset(&ctxt, 0, sizeof(ctxt));
-
-        /* Architecture-specific vmcs/vmcb bits */
-        hvm_funcs.save_cpu_ctxt(v, &ctxt);
-
-        ctxt.tsc = hvm_get_guest_tsc_fixed(v, d->arch.hvm_domain.sync_tsc);
-
-        ctxt.msr_tsc_aux = hvm_msr_tsc_aux(v);
-
-        hvm_get_segment_register(v, x86_seg_idtr, &seg);
-        ctxt.idtr_limit = seg.limit;
-        ctxt.idtr_base = seg.base;
-
-        hvm_get_segment_register(v, x86_seg_gdtr, &seg);
-        ctxt.gdtr_limit = seg.limit;
-        ctxt.gdtr_base = seg.base;
-
-        hvm_get_segment_register(v, x86_seg_cs, &seg);
-        ctxt.cs_sel = seg.sel;
-        ctxt.cs_limit = seg.limit;
-        ctxt.cs_base = seg.base;
-        ctxt.cs_arbytes = seg.attr;
-
-        hvm_get_segment_register(v, x86_seg_ds, &seg);
-        ctxt.ds_sel = seg.sel;
-        ctxt.ds_limit = seg.limit;
-        ctxt.ds_base = seg.base;
-        ctxt.ds_arbytes = seg.attr;
-
-        hvm_get_segment_register(v, x86_seg_es, &seg);
-        ctxt.es_sel = seg.sel;
-        ctxt.es_limit = seg.limit;
-        ctxt.es_base = seg.base;
-        ctxt.es_arbytes = seg.attr;
-
-        hvm_get_segment_register(v, x86_seg_ss, &seg);
-        ctxt.ss_sel = seg.sel;
-        ctxt.ss_limit = seg.limit;
-        ctxt.ss_base = seg.base;
-        ctxt.ss_arbytes = seg.attr;
-
-        hvm_get_segment_register(v, x86_seg_fs, &seg);
-        ctxt.fs_sel = seg.sel;
-        ctxt.fs_limit = seg.limit;
-        ctxt.fs_base = seg.base;
-        ctxt.fs_arbytes = seg.attr;
-
-        hvm_get_segment_register(v, x86_seg_gs, &seg);
-        ctxt.gs_sel = seg.sel;
-        ctxt.gs_limit = seg.limit;
-        ctxt.gs_base = seg.base;
-        ctxt.gs_arbytes = seg.attr;
-
-        hvm_get_segment_register(v, x86_seg_tr, &seg);
-        ctxt.tr_sel = seg.sel;
-        ctxt.tr_limit = seg.limit;
-        ctxt.tr_base = seg.base;
-        ctxt.tr_arbytes = seg.attr;
-
-        hvm_get_segment_register(v, x86_seg_ldtr, &seg);
-        ctxt.ldtr_sel = seg.sel;
-        ctxt.ldtr_limit = seg.limit;
-        ctxt.ldtr_base = seg.base;
-        ctxt.ldtr_arbytes = seg.attr;
-
-        if ( v->fpu_initialised )
-        {
-            memcpy(ctxt.fpu_regs, v->arch.fpu_ctxt, sizeof(ctxt.fpu_regs));
-            ctxt.flags = XEN_X86_FPU_INITIALISED;
-        }
+    memset(&ctxt, 0, sizeof(ctxt));
 
-        ctxt.rax = v->arch.user_regs.rax;
-        ctxt.rbx = v->arch.user_regs.rbx;
-        ctxt.rcx = v->arch.user_regs.rcx;
-        ctxt.rdx = v->arch.user_regs.rdx;
-        ctxt.rbp = v->arch.user_regs.rbp;
-        ctxt.rsi = v->arch.user_regs.rsi;
-        ctxt.rdi = v->arch.user_regs.rdi;
-        ctxt.rsp = v->arch.user_regs.rsp;
-        ctxt.rip = v->arch.user_regs.rip;
-        ctxt.rflags = v->arch.user_regs.rflags;
-        ctxt.r8  = v->arch.user_regs.r8;
-        ctxt.r9  = v->arch.user_regs.r9;
-        ctxt.r10 = v->arch.user_regs.r10;
-        ctxt.r11 = v->arch.user_regs.r11;
-        ctxt.r12 = v->arch.user_regs.r12;
-        ctxt.r13 = v->arch.user_regs.r13;
-        ctxt.r14 = v->arch.user_regs.r14;
-        ctxt.r15 = v->arch.user_regs.r15;
-        ctxt.dr0 = v->arch.debugreg[0];
-        ctxt.dr1 = v->arch.debugreg[1];
-        ctxt.dr2 = v->arch.debugreg[2];
-        ctxt.dr3 = v->arch.debugreg[3];
-        ctxt.dr6 = v->arch.debugreg[6];
-        ctxt.dr7 = v->arch.debugreg[7];
-
-        if ( hvm_save_entry(CPU, v->vcpu_id, h, &ctxt) != 0 )
-            return 1; 
-    }
-    return 0;
+    /* Architecture-specific vmcs/vmcb bits */
+    hvm_funcs.save_cpu_ctxt(v, &ctxt);
+
+    ctxt.tsc = hvm_get_guest_tsc_fixed(v, v->domain->arch.hvm_domain.sync_tsc);
+
+    ctxt.msr_tsc_aux = hvm_msr_tsc_aux(v);
+
+    hvm_get_segment_register(v, x86_seg_idtr, &seg);
+    ctxt.idtr_limit = seg.limit;
+    ctxt.idtr_base = seg.base;
+
+    hvm_get_segment_register(v, x86_seg_gdtr, &seg);
+    ctxt.gdtr_limit = seg.limit;
+    ctxt.gdtr_base = seg.base;
+
+    hvm_get_segment_register(v, x86_seg_cs, &seg);
+    ctxt.cs_sel = seg.sel;
+    ctxt.cs_limit = seg.limit;
+    ctxt.cs_base = seg.base;
+    ctxt.cs_arbytes = seg.attr;
+
+    hvm_get_segment_register(v, x86_seg_ds, &seg);
+    ctxt.ds_sel = seg.sel;
+    ctxt.ds_limit = seg.limit;
+    ctxt.ds_base = seg.base;
+    ctxt.ds_arbytes = seg.attr;
+
+    hvm_get_segment_register(v, x86_seg_es, &seg);
+    ctxt.es_sel = seg.sel;
+    ctxt.es_limit = seg.limit;
+    ctxt.es_base = seg.base;
+    ctxt.es_arbytes = seg.attr;
+
+    hvm_get_segment_register(v, x86_seg_ss, &seg);
+    ctxt.ss_sel = seg.sel;
+    ctxt.ss_limit = seg.limit;
+    ctxt.ss_base = seg.base;
+    ctxt.ss_arbytes = seg.attr;
+
+    hvm_get_segment_register(v, x86_seg_fs, &seg);
+    ctxt.fs_sel = seg.sel;
+    ctxt.fs_limit = seg.limit;
+    ctxt.fs_base = seg.base;
+    ctxt.fs_arbytes = seg.attr;
+
+    hvm_get_segment_register(v, x86_seg_gs, &seg);
+    ctxt.gs_sel = seg.sel;
+    ctxt.gs_limit = seg.limit;
+    ctxt.gs_base = seg.base;
+    ctxt.gs_arbytes = seg.attr;
+
+    hvm_get_segment_register(v, x86_seg_tr, &seg);
+    ctxt.tr_sel = seg.sel;
+    ctxt.tr_limit = seg.limit;
+    ctxt.tr_base = seg.base;
+    ctxt.tr_arbytes = seg.attr;
+
+    hvm_get_segment_register(v, x86_seg_ldtr, &seg);
+    ctxt.ldtr_sel = seg.sel;
+    ctxt.ldtr_limit = seg.limit;
+    ctxt.ldtr_base = seg.base;
+    ctxt.ldtr_arbytes = seg.attr;
+
+    if ( v->fpu_initialised )
+    {
+        memcpy(ctxt.fpu_regs, v->arch.fpu_ctxt, sizeof(ctxt.fpu_regs));
+        ctxt.flags = XEN_X86_FPU_INITIALISED;
+    }
+
+    ctxt.rax = v->arch.user_regs.rax;
+    ctxt.rbx = v->arch.user_regs.rbx;
+    ctxt.rcx = v->arch.user_regs.rcx;
+    ctxt.rdx = v->arch.user_regs.rdx;
+    ctxt.rbp = v->arch.user_regs.rbp;
+    ctxt.rsi = v->arch.user_regs.rsi;
+    ctxt.rdi = v->arch.user_regs.rdi;
+    ctxt.rsp = v->arch.user_regs.rsp;
+    ctxt.rip = v->arch.user_regs.rip;
+    ctxt.rflags = v->arch.user_regs.rflags;
+    ctxt.r8  = v->arch.user_regs.r8;
+    ctxt.r9  = v->arch.user_regs.r9;
+    ctxt.r10 = v->arch.user_regs.r10;
+    ctxt.r11 = v->arch.user_regs.r11;
+    ctxt.r12 = v->arch.user_regs.r12;
+    ctxt.r13 = v->arch.user_regs.r13;
+    ctxt.r14 = v->arch.user_regs.r14;
+    ctxt.r15 = v->arch.user_regs.r15;
+    ctxt.dr0 = v->arch.debugreg[0];
+    ctxt.dr1 = v->arch.debugreg[1];
+    ctxt.dr2 = v->arch.debugreg[2];
+    ctxt.dr3 = v->arch.debugreg[3];
+    ctxt.dr6 = v->arch.debugreg[6];
+    ctxt.dr7 = v->arch.debugreg[7];
+
+    return hvm_save_entry(CPU, v->vcpu_id, h, &ctxt);
 }
 
 /* Return a string indicating the error, or NULL for valid. */
@@ -1159,38 +1223,30 @@ static int hvm_load_cpu_ctxt(struct domain *d, hvm_domain_context_t *h)
     return 0;
 }
 
-HVM_REGISTER_SAVE_RESTORE(CPU, hvm_save_cpu_ctxt, hvm_load_cpu_ctxt,
-                          1, HVMSR_PER_VCPU);
+HVM_REGISTER_SAVE_RESTORE_VCPU(CPU, hvm_save_cpu_ctxt, hvm_load_cpu_ctxt);
 
 #define HVM_CPU_XSAVE_SIZE(xcr0) (offsetof(struct hvm_hw_cpu_xsave, \
                                            save_area) + \
                                   xstate_ctxt_size(xcr0))
 
-static int hvm_save_cpu_xsave_states(struct domain *d, hvm_domain_context_t *h)
+static int hvm_save_cpu_xsave_states(struct vcpu *v, hvm_domain_context_t *h)
 {
-    struct vcpu *v;
     struct hvm_hw_cpu_xsave *ctxt;
+    unsigned int size = HVM_CPU_XSAVE_SIZE(v->arch.xcr0_accum);
 
-    if ( !cpu_has_xsave )
+    if ( !cpu_has_xsave || !xsave_enabled(v) )
         return 0;   /* do nothing */
 
-    for_each_vcpu ( d, v )
-    {
-        unsigned int size = HVM_CPU_XSAVE_SIZE(v->arch.xcr0_accum);
+    if ( _hvm_init_entry(h, CPU_XSAVE_CODE, v->vcpu_id, size) )
+        return 1;
+    ctxt = (struct hvm_hw_cpu_xsave *)&h->data[h->cur];
+    h->cur += size;
 
-        if ( !xsave_enabled(v) )
-            continue;
-        if ( _hvm_init_entry(h, CPU_XSAVE_CODE, v->vcpu_id, size) )
-            return 1;
-        ctxt = (struct hvm_hw_cpu_xsave *)&h->data[h->cur];
-        h->cur += size;
-
-        ctxt->xfeature_mask = xfeature_mask;
-        ctxt->xcr0 = v->arch.xcr0;
-        ctxt->xcr0_accum = v->arch.xcr0_accum;
-        expand_xsave_states(v, &ctxt->save_area,
-                            size - offsetof(typeof(*ctxt), save_area));
-    }
+    ctxt->xfeature_mask = xfeature_mask;
+    ctxt->xcr0 = v->arch.xcr0;
+    ctxt->xcr0_accum = v->arch.xcr0_accum;
+    expand_xsave_states(v, &ctxt->save_area,
+                        size - offsetof(typeof(*ctxt), save_area));
 
     return 0;
 }
@@ -1315,6 +1371,10 @@ static int hvm_load_cpu_xsave_states(struct domain *d, hvm_domain_context_t *h)
     }
     /* Checking finished */
 
+    err = xstate_update_save_area(v, ctxt->xcr0_accum);
+    if ( err )
+        return err;
+
     v->arch.xcr0 = ctxt->xcr0;
     v->arch.xcr0_accum = ctxt->xcr0_accum;
     if ( ctxt->xcr0_accum & XSTATE_NONLAZY )
@@ -1332,67 +1392,62 @@ static const uint32_t msrs_to_send[] = {
 };
 static unsigned int __read_mostly msr_count_max = ARRAY_SIZE(msrs_to_send);
 
-static int hvm_save_cpu_msrs(struct domain *d, hvm_domain_context_t *h)
+static int hvm_save_cpu_msrs(struct vcpu *v, hvm_domain_context_t *h)
 {
-    struct vcpu *v;
+    struct hvm_save_descriptor *d = _p(&h->data[h->cur]);
+    struct hvm_msr *ctxt;
+    unsigned int i;
 
-    for_each_vcpu ( d, v )
+    if ( _hvm_init_entry(h, CPU_MSR_CODE, v->vcpu_id,
+                         HVM_CPU_MSR_SIZE(msr_count_max)) )
+        return 1;
+    ctxt = (struct hvm_msr *)&h->data[h->cur];
+    ctxt->count = 0;
+
+    for ( i = 0; i < ARRAY_SIZE(msrs_to_send); ++i )
     {
-        struct hvm_save_descriptor *d = _p(&h->data[h->cur]);
-        struct hvm_msr *ctxt;
-        unsigned int i;
+        uint64_t val;
+        int rc = guest_rdmsr(v, msrs_to_send[i], &val);
 
-        if ( _hvm_init_entry(h, CPU_MSR_CODE, v->vcpu_id,
-                             HVM_CPU_MSR_SIZE(msr_count_max)) )
-            return 1;
-        ctxt = (struct hvm_msr *)&h->data[h->cur];
-        ctxt->count = 0;
+        /*
+         * It is the programmers responsibility to ensure that
+         * msrs_to_send[] contain generally-read/write MSRs.
+         * X86EMUL_EXCEPTION here implies a missing feature, and that the
+         * guest doesn't have access to the MSR.
+         */
+        if ( rc == X86EMUL_EXCEPTION )
+            continue;
 
-        for ( i = 0; i < ARRAY_SIZE(msrs_to_send); ++i )
+        if ( rc != X86EMUL_OKAY )
         {
-            uint64_t val;
-            int rc = guest_rdmsr(v, msrs_to_send[i], &val);
-
-            /*
-             * It is the programmers responsibility to ensure that
-             * msrs_to_send[] contain generally-read/write MSRs.
-             * X86EMUL_EXCEPTION here implies a missing feature, and that the
-             * guest doesn't have access to the MSR.
-             */
-            if ( rc == X86EMUL_EXCEPTION )
-                continue;
-
-            if ( rc != X86EMUL_OKAY )
-            {
-                ASSERT_UNREACHABLE();
-                return -ENXIO;
-            }
+            ASSERT_UNREACHABLE();
+            return -ENXIO;
+        }
 
-            if ( !val )
-                continue; /* Skip empty MSRs. */
+        if ( !val )
+            continue; /* Skip empty MSRs. */
 
-            ctxt->msr[ctxt->count].index = msrs_to_send[i];
-            ctxt->msr[ctxt->count++].val = val;
-        }
+        ctxt->msr[ctxt->count].index = msrs_to_send[i];
+        ctxt->msr[ctxt->count++].val = val;
+    }
 
-        if ( hvm_funcs.save_msr )
-            hvm_funcs.save_msr(v, ctxt);
+    if ( hvm_funcs.save_msr )
+        hvm_funcs.save_msr(v, ctxt);
 
-        ASSERT(ctxt->count <= msr_count_max);
+    ASSERT(ctxt->count <= msr_count_max);
 
-        for ( i = 0; i < ctxt->count; ++i )
-            ctxt->msr[i]._rsvd = 0;
+    for ( i = 0; i < ctxt->count; ++i )
+        ctxt->msr[i]._rsvd = 0;
 
-        if ( ctxt->count )
-        {
-            /* Rewrite length to indicate how much space we actually used. */
-            d->length = HVM_CPU_MSR_SIZE(ctxt->count);
-            h->cur += HVM_CPU_MSR_SIZE(ctxt->count);
-        }
-        else
-            /* or rewind and remove the descriptor from the stream. */
-            h->cur -= sizeof(struct hvm_save_descriptor);
+    if ( ctxt->count )
+    {
+        /* Rewrite length to indicate how much space we actually used. */
+        d->length = HVM_CPU_MSR_SIZE(ctxt->count);
+        h->cur += HVM_CPU_MSR_SIZE(ctxt->count);
     }
+    else
+        /* or rewind and remove the descriptor from the stream. */
+        h->cur -= sizeof(struct hvm_save_descriptor);
 
     return 0;
 }
@@ -1486,25 +1541,23 @@ static int hvm_load_cpu_msrs(struct domain *d, hvm_domain_context_t *h)
  */
 static int __init hvm_register_CPU_save_and_restore(void)
 {
-    hvm_register_savevm(CPU_XSAVE_CODE,
-                        "CPU_XSAVE",
-                        hvm_save_cpu_xsave_states,
-                        hvm_load_cpu_xsave_states,
-                        HVM_CPU_XSAVE_SIZE(xfeature_mask) +
-                            sizeof(struct hvm_save_descriptor),
-                        HVMSR_PER_VCPU);
+    hvm_register_savevm_vcpu(CPU_XSAVE_CODE,
+                             "CPU_XSAVE",
+                             hvm_save_cpu_xsave_states,
+                             hvm_load_cpu_xsave_states,
+                             HVM_CPU_XSAVE_SIZE(xfeature_mask) +
+                                 sizeof(struct hvm_save_descriptor));
 
     if ( hvm_funcs.init_msr )
         msr_count_max += hvm_funcs.init_msr();
 
     if ( msr_count_max )
-        hvm_register_savevm(CPU_MSR_CODE,
-                            "CPU_MSR",
-                            hvm_save_cpu_msrs,
-                            hvm_load_cpu_msrs,
-                            HVM_CPU_MSR_SIZE(msr_count_max) +
-                                sizeof(struct hvm_save_descriptor),
-                            HVMSR_PER_VCPU);
+        hvm_register_savevm_vcpu(CPU_MSR_CODE,
+                                 "CPU_MSR",
+                                 hvm_save_cpu_msrs,
+                                 hvm_load_cpu_msrs,
+                                 HVM_CPU_MSR_SIZE(msr_count_max) +
+                                     sizeof(struct hvm_save_descriptor));
 
     return 0;
 }
@@ -1517,8 +1570,7 @@ int hvm_vcpu_initialise(struct vcpu *v)
 
     hvm_asid_flush_vcpu(v);
 
-    spin_lock_init(&v->arch.hvm_vcpu.tm_lock);
-    INIT_LIST_HEAD(&v->arch.hvm_vcpu.tm_list);
+    pt_vcpu_init(v);
 
     rc = hvm_vcpu_cacheattr_init(v); /* teardown: vcpu_cacheattr_destroy */
     if ( rc != 0 )
@@ -1551,6 +1603,10 @@ int hvm_vcpu_initialise(struct vcpu *v)
     if ( rc != 0 )
         goto fail6;
 
+    rc = viridian_vcpu_init(v); /* teardown: viridian_vcpu_deinit */
+    if ( rc != 0 )
+        goto fail7;
+
     if ( v->vcpu_id == 0 )
     {
         /* NB. All these really belong in hvm_domain_initialise(). */
@@ -1563,6 +1619,8 @@ int hvm_vcpu_initialise(struct vcpu *v)
 
     return 0;
 
+ fail7:
+    hvm_all_ioreq_servers_remove_vcpu(v->domain, v);
  fail6:
     nestedhvm_vcpu_destroy(v);
  fail5:
@@ -1595,7 +1653,11 @@ void hvm_vcpu_destroy(struct vcpu *v)
 
     vlapic_destroy(v);
 
+    pt_vcpu_destroy(v);
+
     hvm_vcpu_cacheattr_destroy(v);
+
+    hvm_exit_stats_destroy(v);
 }
 
 void hvm_vcpu_down(struct vcpu *v)
@@ -4168,6 +4230,9 @@ static int hvmop_set_param(
         if ( (a.value & ~HVMPV_feature_mask) ||
              !(a.value & HVMPV_base_freq) )
             rc = -EINVAL;
+        else if ( (a.value & HVMPV_stimer) &&
+                  (~a.value & (HVMPV_synic | HVMPV_time_ref_count)) )
+            rc = -EINVAL;
         break;
     case HVM_PARAM_IDENT_PT:
         /*
@@ -4183,10 +4248,10 @@ static int hvmop_set_param(
         /*
          * Update GUEST_CR3 in each VMCS to point at identity map.
          * All foreign updates to guest state must synchronise on
-         * the domctl_lock.
+         * the domain's domctl_lock.
          */
         rc = -ERESTART;
-        if ( !domctl_lock_acquire() )
+        if ( !domctl_lock_acquire_domain(d) )
             break;
 
         rc = 0;
@@ -4196,7 +4261,7 @@ static int hvmop_set_param(
             paging_update_cr3(v);
         domain_unpause(d);
 
-        domctl_lock_release();
+        domctl_lock_release_domain(d);
         break;
     case HVM_PARAM_DM_DOMAIN:
         if ( a.value == DOMID_SELF )
@@ -4446,7 +4511,8 @@ static int hvmop_get_param(
             domid_t domid = d->arch.hvm_domain.params[HVM_PARAM_DM_DOMAIN];
 
             rc = hvm_create_ioreq_server(d, domid, true,
-                                         HVM_IOREQSRV_BUFIOREQ_LEGACY, NULL);
+                                         HVM_IOREQSRV_BUFIOREQ_LEGACY, 0,
+                                         NULL);
             if ( rc != 0 && rc != -EEXIST )
                 goto out;
         }
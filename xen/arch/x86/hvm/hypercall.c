@@ -147,6 +147,7 @@ int hvm_hypercall(struct cpu_user_regs *regs)
     struct domain *currd = curr->domain;
     int mode = hvm_guest_x86_mode(curr);
     unsigned long eax = regs->eax;
+    s_time_t start;
 
     switch ( mode )
     {
@@ -184,6 +185,7 @@ int hvm_hypercall(struct cpu_user_regs *regs)
     }
 
     curr->hcall_preempted = false;
+    start = hypercall_stats_begin();
 
     if ( mode == 8 )
     {
@@ -212,6 +214,7 @@ int hvm_hypercall(struct cpu_user_regs *regs)
 
         regs->rax = hvm_hypercall_table[eax].native(rdi, rsi, rdx, r10, r8,
                                                     r9);
+        hypercall_stats_end(eax, rdi, start);
 
 #ifndef NDEBUG
         if ( !curr->hcall_preempted )
@@ -258,6 +261,7 @@ int hvm_hypercall(struct cpu_user_regs *regs)
         regs->rax = hvm_hypercall_table[eax].compat(ebx, ecx, edx, esi, edi,
                                                     ebp);
         curr->hcall_compat = false;
+        hypercall_stats_end(eax, ebx, start);
 
 #ifndef NDEBUG
         if ( !curr->hcall_preempted )
@@ -112,11 +112,148 @@ static const struct hvm_io_ops portio_ops = {
     .write = hvm_portio_write
 };
 
+/*
+ * REPs to or from guest RAM access the RAM side in batches of up to this
+ * many bytes, rather than with one hvm_copy_{to,from}_guest_phys() (and
+ * hence one p2m lookup and mapping) per repetition.
+ */
+#define IO_BATCH_BYTES 256
+
+/*
+ * Batches are laid out in ascending guest address order, so for DF=1
+ * repetitions are placed from the end of the buffer backwards.
+ */
+static unsigned int batch_slot(const ioreq_t *p, unsigned int nr_slots,
+                               unsigned int k)
+{
+    return (p->df ? nr_slots - 1 - k : k) * p->size;
+}
+
+/* Start of, and guest address for, a batch of n repetitions from first. */
+static uint8_t *batch_start(const ioreq_t *p, uint8_t *batch,
+                            unsigned int nr_slots, unsigned int n)
+{
+    return batch + (p->df ? (nr_slots - n) * p->size : 0);
+}
+
+static paddr_t batch_gpa(const ioreq_t *p, unsigned int first, unsigned int n)
+{
+    return p->df ? p->data - (paddr_t)(first + n - 1) * p->size
+                 : p->data + (paddr_t)first * p->size;
+}
+
+/* Copy n repetitions starting at first out to guest RAM. */
+static int flush_read_batch(const ioreq_t *p, uint8_t *batch,
+                            unsigned int nr_slots, unsigned int first,
+                            unsigned int n)
+{
+    int step = p->df ? -p->size : p->size;
+    unsigned int k;
+
+    switch ( hvm_copy_to_guest_phys(batch_gpa(p, first, n),
+                                    batch_start(p, batch, nr_slots, n),
+                                    n * p->size, current) )
+    {
+    case HVMTRANS_okay:
+        return X86EMUL_OKAY;
+    case HVMTRANS_bad_gfn_to_mfn:
+        /* Redo per repetition, so only the bad ones are dropped. */
+        break;
+    case HVMTRANS_bad_linear_to_gfn:
+    case HVMTRANS_gfn_paged_out:
+    case HVMTRANS_gfn_shared:
+        ASSERT_UNREACHABLE();
+        /* fall through */
+    default:
+        domain_crash(current->domain);
+        return X86EMUL_UNHANDLEABLE;
+    }
+
+    for ( k = 0; k < n; k++ )
+    {
+        switch ( hvm_copy_to_guest_phys(p->data + step * (first + k),
+                                        batch + batch_slot(p, nr_slots, k),
+                                        p->size, current) )
+        {
+        case HVMTRANS_okay:
+            break;
+        case HVMTRANS_bad_gfn_to_mfn:
+            /* Drop the write as real hardware would. */
+            continue;
+        case HVMTRANS_bad_linear_to_gfn:
+        case HVMTRANS_gfn_paged_out:
+        case HVMTRANS_gfn_shared:
+            ASSERT_UNREACHABLE();
+            /* fall through */
+        default:
+            domain_crash(current->domain);
+            return X86EMUL_UNHANDLEABLE;
+        }
+    }
+
+    return X86EMUL_OKAY;
+}
+
+/* Fetch n repetitions starting at first from guest RAM. */
+static int fill_write_batch(const ioreq_t *p, uint8_t *batch,
+                            unsigned int nr_slots, unsigned int first,
+                            unsigned int n)
+{
+    int step = p->df ? -p->size : p->size;
+    unsigned int k;
+
+    switch ( hvm_copy_from_guest_phys(batch_start(p, batch, nr_slots, n),
+                                      batch_gpa(p, first, n), n * p->size) )
+    {
+    case HVMTRANS_okay:
+        return X86EMUL_OKAY;
+    case HVMTRANS_bad_gfn_to_mfn:
+        /* Redo per repetition, so only the bad ones read as all ones. */
+        break;
+    case HVMTRANS_bad_linear_to_gfn:
+    case HVMTRANS_gfn_paged_out:
+    case HVMTRANS_gfn_shared:
+        ASSERT_UNREACHABLE();
+        /* fall through */
+    default:
+        domain_crash(current->domain);
+        return X86EMUL_UNHANDLEABLE;
+    }
+
+    for ( k = 0; k < n; k++ )
+    {
+        uint8_t *slot = batch + batch_slot(p, nr_slots, k);
+
+        switch ( hvm_copy_from_guest_phys(slot, p->data + step * (first + k),
+                                          p->size) )
+        {
+        case HVMTRANS_okay:
+            break;
+        case HVMTRANS_bad_gfn_to_mfn:
+            memset(slot, 0xff, p->size);
+            break;
+        case HVMTRANS_bad_linear_to_gfn:
+        case HVMTRANS_gfn_paged_out:
+        case HVMTRANS_gfn_shared:
+            ASSERT_UNREACHABLE();
+            /* fall through */
+        default:
+            domain_crash(current->domain);
+            return X86EMUL_UNHANDLEABLE;
+        }
+    }
+
+    return X86EMUL_OKAY;
+}
+
 int hvm_process_io_intercept(const struct hvm_io_handler *handler,
                              ioreq_t *p)
 {
     const struct hvm_io_ops *ops = handler->ops;
     int rc = X86EMUL_OKAY, i, step = p->df ? -p->size : p->size;
+    uint8_t batch[IO_BATCH_BYTES];
+    unsigned int nr_slots = IO_BATCH_BYTES / p->size;
+    unsigned int first = 0, n = 0;
     uint64_t data;
     uint64_t addr;
 
@@ -134,27 +271,24 @@ int hvm_process_io_intercept(const struct hvm_io_handler *handler,
 
             if ( p->data_is_ptr )
             {
-                switch ( hvm_copy_to_guest_phys(p->data + step * i,
-                                                &data, p->size, current) )
+                memcpy(batch + batch_slot(p, nr_slots, n), &data, p->size);
+                if ( ++n == nr_slots )
                 {
-                case HVMTRANS_okay:
-                    break;
-                case HVMTRANS_bad_gfn_to_mfn:
-                    /* Drop the write as real hardware would. */
-                    continue;
-                case HVMTRANS_bad_linear_to_gfn:
-                case HVMTRANS_gfn_paged_out:
-                case HVMTRANS_gfn_shared:
-                    ASSERT_UNREACHABLE();
-                    /* fall through */
-                default:
-                    domain_crash(current->domain);
-                    return X86EMUL_UNHANDLEABLE;
+                    if ( flush_read_batch(p, batch, nr_slots, first,
+                                          n) != X86EMUL_OKAY )
+                        return X86EMUL_UNHANDLEABLE;
+                    first += n;
+                    n = 0;
                 }
             }
             else
                 p->data = data;
         }
+
+        /* Flush whatever was read before completion or failure. */
+        if ( n && flush_read_batch(p, batch, nr_slots, first,
+                                   n) != X86EMUL_OKAY )
+            return X86EMUL_UNHANDLEABLE;
     }
     else /* p->dir == IOREQ_WRITE */
     {
@@ -162,24 +296,18 @@ int hvm_process_io_intercept(const struct hvm_io_handler *handler,
         {
             if ( p->data_is_ptr )
             {
-                data = 0;
-                switch ( hvm_copy_from_guest_phys(&data, p->data + step * i,
-                                                  p->size) )
+                if ( i == first + n )
                 {
-                case HVMTRANS_okay:
-                    break;
-                case HVMTRANS_bad_gfn_to_mfn:
-                    data = ~0;
-                    break;
-                case HVMTRANS_bad_linear_to_gfn:
-                case HVMTRANS_gfn_paged_out:
-                case HVMTRANS_gfn_shared:
-                    ASSERT_UNREACHABLE();
-                    /* fall through */
-                default:
-                    domain_crash(current->domain);
-                    return X86EMUL_UNHANDLEABLE;
+                    first = i;
+                    n = min_t(unsigned int, nr_slots, p->count - i);
+                    if ( fill_write_batch(p, batch, nr_slots, first,
+                                          n) != X86EMUL_OKAY )
+                        return X86EMUL_UNHANDLEABLE;
                 }
+
+                data = 0;
+                memcpy(&data, batch + batch_slot(p, nr_slots, i - first),
+                       p->size);
             }
             else
                 data = p->data;
@@ -320,27 +448,33 @@ void relocate_portio_handler(struct domain *d, unsigned int old_port,
     }
 }
 
-bool_t hvm_mmio_internal(paddr_t gpa)
+bool hvm_io_internal(const ioreq_t *p)
 {
     const struct hvm_io_handler *handler;
     const struct hvm_io_ops *ops;
-    ioreq_t p = {
-        .type = IOREQ_TYPE_COPY,
-        .addr = gpa,
-        .count = 1,
-        .size = 1,
-    };
 
-    handler = hvm_find_io_handler(&p);
+    handler = hvm_find_io_handler(p);
 
     if ( handler == NULL )
-        return 0;
+        return false;
 
     ops = handler->ops;
     if ( ops->complete != NULL )
         ops->complete(handler);
 
-    return 1;
+    return true;
+}
+
+bool_t hvm_mmio_internal(paddr_t gpa)
+{
+    ioreq_t p = {
+        .type = IOREQ_TYPE_COPY,
+        .addr = gpa,
+        .count = 1,
+        .size = 1,
+    };
+
+    return hvm_io_internal(&p);
 }
 
 /*
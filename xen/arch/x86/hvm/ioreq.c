@@ -31,8 +31,13 @@
 #include <asm/hvm/ioreq.h>
 #include <asm/hvm/vmx/vmx.h>
 
+#include <public/hvm/dm_op.h>
 #include <public/hvm/ioreq.h>
 
+/* Time (in us) to wait for a polling emulator to pick up a request. */
+static unsigned int __read_mostly ioreq_poll_us = 20;
+integer_param("ioreq-poll-us", ioreq_poll_us);
+
 static ioreq_t *get_ioreq(struct hvm_ioreq_server *s, struct vcpu *v)
 {
     shared_iopage_t *p = s->ioreq.va;
@@ -498,6 +503,9 @@ static void hvm_ioreq_server_free_rangesets(struct hvm_ioreq_server *s,
 
     for ( i = 0; i < NR_IO_RANGE_TYPES; i++ )
         rangeset_destroy(s->range[i]);
+
+    for ( i = 0; i < ARRAY_SIZE(s->buffered); i++ )
+        rangeset_destroy(s->buffered[i]);
 }
 
 static int hvm_ioreq_server_alloc_rangesets(struct hvm_ioreq_server *s,
@@ -533,6 +541,27 @@ static int hvm_ioreq_server_alloc_rangesets(struct hvm_ioreq_server *s,
         rangeset_limit(s->range[i], MAX_NR_IO_RANGES);
     }
 
+    for ( i = 0; i < ARRAY_SIZE(s->buffered); i++ )
+    {
+        char *name;
+
+        rc = asprintf(&name, "ioreq_server %d buffered %s", s->id,
+                      (i == XEN_DMOP_IO_RANGE_PORT) ? "port" : "memory");
+        if ( rc )
+            goto fail;
+
+        s->buffered[i] = rangeset_new(s->domain, name,
+                                      RANGESETF_prettyprint_hex);
+
+        xfree(name);
+
+        rc = -ENOMEM;
+        if ( !s->buffered[i] )
+            goto fail;
+
+        rangeset_limit(s->buffered[i], MAX_NR_IO_RANGES);
+    }
+
  done:
     return 0;
 
@@ -542,6 +571,14 @@ static int hvm_ioreq_server_alloc_rangesets(struct hvm_ioreq_server *s,
     return rc;
 }
 
+/* Invalidate the results cached by hvm_select_ioreq_server(). */
+static void hvm_ioreq_servers_changed(struct domain *d)
+{
+    smp_wmb();
+    write_atomic(&d->arch.hvm_domain.ioreq_server.gen,
+                 d->arch.hvm_domain.ioreq_server.gen + 1);
+}
+
 static void hvm_ioreq_server_enable(struct hvm_ioreq_server *s,
                                     bool is_default)
 {
@@ -563,6 +600,7 @@ static void hvm_ioreq_server_enable(struct hvm_ioreq_server *s,
     }
 
     s->enabled = true;
+    hvm_ioreq_servers_changed(d);
 
     list_for_each_entry ( sv,
                           &s->ioreq_vcpu_list,
@@ -593,6 +631,7 @@ static void hvm_ioreq_server_disable(struct hvm_ioreq_server *s,
     }
 
     s->enabled = false;
+    hvm_ioreq_servers_changed(d);
 
  done:
     spin_unlock(&s->lock);
@@ -682,7 +721,7 @@ static ioservid_t next_ioservid(struct domain *d)
 
 int hvm_create_ioreq_server(struct domain *d, domid_t domid,
                             bool is_default, int bufioreq_handling,
-                            ioservid_t *id)
+                            unsigned int flags, ioservid_t *id)
 {
     struct hvm_ioreq_server *s;
     int rc;
@@ -707,6 +746,9 @@ int hvm_create_ioreq_server(struct domain *d, domid_t domid,
     if ( rc )
         goto fail3;
 
+    s->polled = flags & XEN_DMOP_IOREQ_SERVER_POLL;
+    s->bufioreq_coalesce = flags & XEN_DMOP_IOREQ_SERVER_BUFIOREQ_COALESCE;
+
     list_add(&s->list_entry,
              &d->arch.hvm_domain.ioreq_server.list);
 
@@ -815,7 +857,7 @@ int hvm_get_ioreq_server_info(struct domain *d, ioservid_t id,
 
 int hvm_map_io_range_to_ioreq_server(struct domain *d, ioservid_t id,
                                      uint32_t type, uint64_t start,
-                                     uint64_t end)
+                                     uint64_t end, unsigned int flags)
 {
     struct hvm_ioreq_server *s;
     int rc;
@@ -854,11 +896,35 @@ int hvm_map_io_range_to_ioreq_server(struct domain *d, ioservid_t id,
             if ( !r )
                 break;
 
+            rc = -EINVAL;
+            if ( (flags & XEN_DMOP_IO_RANGE_BUFFERED) &&
+                 (type == XEN_DMOP_IO_RANGE_PCI || !s->bufioreq.va) )
+                break;
+
             rc = -EEXIST;
             if ( rangeset_overlaps_range(r, start, end) )
                 break;
 
+            /*
+             * Buffered eligibility only matters for accesses routed here
+             * through r, so should the clean-up below fail, the range left
+             * behind is benign.
+             */
+            if ( flags & XEN_DMOP_IO_RANGE_BUFFERED )
+            {
+                rc = rangeset_add_range(s->buffered[type], start, end);
+                if ( rc )
+                    break;
+            }
+
             rc = rangeset_add_range(r, start, end);
+            if ( rc && (flags & XEN_DMOP_IO_RANGE_BUFFERED) &&
+                 rangeset_remove_range(s->buffered[type], start, end) )
+                gprintk(XENLOG_WARNING,
+                        "ioreq server %u: stale buffered range %lx-%lx\n",
+                        id, start, end);
+            if ( !rc )
+                hvm_ioreq_servers_changed(d);
             break;
         }
     }
@@ -913,7 +979,12 @@ int hvm_unmap_io_range_from_ioreq_server(struct domain *d, ioservid_t id,
             if ( !rangeset_contains_range(r, start, end) )
                 break;
 
-            rc = rangeset_remove_range(r, start, end);
+            rc = (type < ARRAY_SIZE(s->buffered))
+                 ? rangeset_remove_range(s->buffered[type], start, end) : 0;
+            if ( !rc )
+                rc = rangeset_remove_range(r, start, end);
+            if ( !rc )
+                hvm_ioreq_servers_changed(d);
             break;
         }
     }
@@ -1167,9 +1238,11 @@ struct hvm_ioreq_server *hvm_select_ioreq_server(struct domain *d,
                                                  ioreq_t *p)
 {
     struct hvm_ioreq_server *s;
+    struct hvm_ioreq_sel *sel = NULL;
+    unsigned int gen = 0;
     uint32_t cf8;
     uint8_t type;
-    uint64_t addr;
+    uint64_t addr, end;
 
     if ( list_empty(&d->arch.hvm_domain.ioreq_server.list) )
         return NULL;
@@ -1213,6 +1286,38 @@ struct hvm_ioreq_server *hvm_select_ioreq_server(struct domain *d,
         addr = p->addr;
     }
 
+    switch ( type )
+    {
+    case XEN_DMOP_IO_RANGE_PORT:
+        end = addr + p->size - 1;
+        break;
+    case XEN_DMOP_IO_RANGE_MEMORY:
+        end = addr + (p->size * p->count) - 1;
+        break;
+    default:
+        end = addr;
+        break;
+    }
+
+    /*
+     * Emulated devices tend to see the same accesses over and over, so the
+     * last match is remembered per vCPU, for as long as no server got
+     * enabled, disabled or had its ranges changed.
+     */
+    if ( current->domain == d )
+    {
+        sel = &current->arch.hvm_vcpu.hvm_io.ioreq_sel;
+        gen = read_atomic(&d->arch.hvm_domain.ioreq_server.gen);
+        smp_rmb();
+
+        if ( sel->server && sel->gen == gen && sel->type == type &&
+             sel->start == addr && sel->end == end )
+        {
+            s = sel->server;
+            goto found;
+        }
+    }
+
     list_for_each_entry ( s,
                           &d->arch.hvm_domain.ioreq_server.list,
                           list_entry )
@@ -1229,33 +1334,40 @@ struct hvm_ioreq_server *hvm_select_ioreq_server(struct domain *d,
 
         switch ( type )
         {
-            unsigned long end;
-
         case XEN_DMOP_IO_RANGE_PORT:
-            end = addr + p->size - 1;
-            if ( rangeset_contains_range(r, addr, end) )
-                return s;
-
-            break;
         case XEN_DMOP_IO_RANGE_MEMORY:
-            end = addr + (p->size * p->count) - 1;
             if ( rangeset_contains_range(r, addr, end) )
-                return s;
+                goto match;
 
             break;
         case XEN_DMOP_IO_RANGE_PCI:
             if ( rangeset_contains_singleton(r, addr >> 32) )
-            {
-                p->type = IOREQ_TYPE_PCI_CONFIG;
-                p->addr = addr;
-                return s;
-            }
+                goto match;
 
             break;
         }
     }
 
     return d->arch.hvm_domain.default_ioreq_server;
+
+ match:
+    if ( sel )
+    {
+        sel->server = s;
+        sel->gen = gen;
+        sel->type = type;
+        sel->start = addr;
+        sel->end = end;
+    }
+
+ found:
+    if ( type == XEN_DMOP_IO_RANGE_PCI )
+    {
+        p->type = IOREQ_TYPE_PCI_CONFIG;
+        p->addr = addr;
+    }
+
+    return s;
 }
 
 static int hvm_send_buffered_ioreq(struct hvm_ioreq_server *s, ioreq_t *p)
@@ -1269,6 +1381,8 @@ static int hvm_send_buffered_ioreq(struct hvm_ioreq_server *s, ioreq_t *p)
                        .dir = p->dir };
     /* Timeoffset sends 64b data, but no address. Use two consecutive slots. */
     int qw = 0;
+    uint32_t wp;
+    bool notify = true;
 
     /* Ensure buffered_iopage fits in a page */
     BUILD_BUG_ON(sizeof(buffered_iopage_t) > PAGE_SIZE);
@@ -1312,8 +1426,8 @@ static int hvm_send_buffered_ioreq(struct hvm_ioreq_server *s, ioreq_t *p)
 
     spin_lock(&s->bufioreq_lock);
 
-    if ( (pg->ptrs.write_pointer - pg->ptrs.read_pointer) >=
-         (IOREQ_BUFFER_SLOT_NUM - qw) )
+    wp = pg->ptrs.write_pointer;
+    if ( (wp - pg->ptrs.read_pointer) >= (IOREQ_BUFFER_SLOT_NUM - qw) )
     {
         /* The queue is full: send the iopacket through the normal path. */
         spin_unlock(&s->bufioreq_lock);
@@ -1332,6 +1446,17 @@ static int hvm_send_buffered_ioreq(struct hvm_ioreq_server *s, ioreq_t *p)
     smp_wmb();
     pg->ptrs.write_pointer += qw ? 2 : 1;
 
+    /*
+     * With coalescing, only a ring found empty needs a notification: an
+     * emulator still busy with earlier entries is bound to find ours, as it
+     * re-checks write_pointer after updating read_pointer.
+     */
+    if ( s->bufioreq_coalesce )
+    {
+        smp_mb();
+        notify = pg->ptrs.read_pointer == wp;
+    }
+
     /* Canonicalize read/write pointers to prevent their overflow. */
     while ( s->bufioreq_atomic && qw++ < IOREQ_BUFFER_SLOT_NUM &&
             pg->ptrs.read_pointer >= IOREQ_BUFFER_SLOT_NUM )
@@ -1344,12 +1469,83 @@ static int hvm_send_buffered_ioreq(struct hvm_ioreq_server *s, ioreq_t *p)
         cmpxchg(&pg->ptrs.full, old.full, new.full);
     }
 
-    notify_via_xen_event_channel(d, s->bufioreq_evtchn);
+    if ( notify )
+        notify_via_xen_event_channel(d, s->bufioreq_evtchn);
     spin_unlock(&s->bufioreq_lock);
 
     return X86EMUL_OKAY;
 }
 
+/*
+ * Whether the request is a write the server asked to receive through its
+ * buffered ring, and which fits the ring's format (see
+ * hvm_send_buffered_ioreq()).
+ */
+static bool hvm_ioreq_postable(const struct hvm_ioreq_server *s,
+                               const ioreq_t *p)
+{
+    unsigned int type;
+
+    if ( !s->bufioreq.va || p->dir != IOREQ_WRITE || p->data_is_ptr ||
+         p->count != 1 || p->addr > 0xffffful )
+        return false;
+
+    switch ( p->size )
+    {
+    case 1: case 2: case 4: case 8:
+        break;
+    default:
+        return false;
+    }
+
+    switch ( p->type )
+    {
+    case IOREQ_TYPE_PIO:
+        type = XEN_DMOP_IO_RANGE_PORT;
+        break;
+    case IOREQ_TYPE_COPY:
+        type = XEN_DMOP_IO_RANGE_MEMORY;
+        break;
+    default:
+        return false;
+    }
+
+    return s->buffered[type] &&
+           rangeset_contains_range(s->buffered[type], p->addr,
+                                   p->addr + p->size - 1);
+}
+
+/*
+ * Spin for a polling emulator to pick up the request just issued, and then
+ * for a little longer for it to complete, in which case the vCPU needn't get
+ * descheduled.  Returns whether the request was picked up, i.e. whether the
+ * event channel notification can be skipped.
+ */
+static bool hvm_ioreq_poll(const ioreq_t *p)
+{
+    s_time_t deadline = NOW() + MICROSECS(ioreq_poll_us);
+    bool seen = false;
+
+    do {
+        unsigned int state = p->state;
+
+        smp_rmb();
+        if ( state == STATE_IORESP_READY || state == STATE_IOREQ_NONE )
+        {
+            /* hvm_wait_for_io() will find the request completed. */
+            clear_bit(_VPF_blocked_in_xen, &current->pause_flags);
+            return true;
+        }
+
+        if ( state != STATE_IOREQ_READY )
+            seen = true;
+
+        cpu_relax();
+    } while ( NOW() < deadline );
+
+    return seen;
+}
+
 int hvm_send_ioreq(struct hvm_ioreq_server *s, ioreq_t *proto_p,
                    bool buffered)
 {
@@ -1362,6 +1558,10 @@ int hvm_send_ioreq(struct hvm_ioreq_server *s, ioreq_t *proto_p,
     if ( buffered )
         return hvm_send_buffered_ioreq(s, proto_p);
 
+    if ( hvm_ioreq_postable(s, proto_p) &&
+         hvm_send_buffered_ioreq(s, proto_p) == X86EMUL_OKAY )
+        return X86EMUL_OKAY;
+
     if ( unlikely(!vcpu_start_shutdown_deferral(curr)) )
         return X86EMUL_RETRY;
 
@@ -1400,7 +1600,8 @@ int hvm_send_ioreq(struct hvm_ioreq_server *s, ioreq_t *proto_p,
              * barrier.
              */
             p->state = STATE_IOREQ_READY;
-            notify_via_xen_event_channel(d, port);
+            if ( !s->polled || !hvm_ioreq_poll(p) )
+                notify_via_xen_event_channel(d, port);
 
             sv->pending = true;
             return X86EMUL_RETRY;
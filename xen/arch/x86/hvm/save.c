@@ -85,11 +85,12 @@ int arch_hvm_load(struct domain *d, struct hvm_save_header *hdr)
 /* List of handlers for various HVM save and restore types */
 static struct {
     hvm_save_handler save;
+    hvm_save_vcpu_handler save_vcpu;
     hvm_load_handler load;
     const char *name;
     size_t size;
     int kind;
-} hvm_sr_handlers[HVM_SAVE_CODE_MAX + 1] = { {NULL, NULL, "<?>"}, };
+} hvm_sr_handlers[HVM_SAVE_CODE_MAX + 1] = { {NULL, NULL, NULL, "<?>"}, };
 
 /* Init-time function to add entries to that list */
 void __init hvm_register_savevm(uint16_t typecode,
@@ -100,7 +101,10 @@ void __init hvm_register_savevm(uint16_t typecode,
 {
     ASSERT(typecode <= HVM_SAVE_CODE_MAX);
     ASSERT(hvm_sr_handlers[typecode].save == NULL);
+    ASSERT(hvm_sr_handlers[typecode].save_vcpu == NULL);
     ASSERT(hvm_sr_handlers[typecode].load == NULL);
+    /* Per-vcpu types are to use hvm_register_savevm_vcpu(). */
+    ASSERT(kind == HVMSR_PER_DOM);
     hvm_sr_handlers[typecode].save = save_state;
     hvm_sr_handlers[typecode].load = load_state;
     hvm_sr_handlers[typecode].name = name;
@@ -108,9 +112,25 @@ void __init hvm_register_savevm(uint16_t typecode,
     hvm_sr_handlers[typecode].kind = kind;
 }
 
-size_t hvm_save_size(struct domain *d)
+void __init hvm_register_savevm_vcpu(uint16_t typecode,
+                                     const char *name,
+                                     hvm_save_vcpu_handler save_state,
+                                     hvm_load_handler load_state,
+                                     size_t size)
+{
+    ASSERT(typecode <= HVM_SAVE_CODE_MAX);
+    ASSERT(hvm_sr_handlers[typecode].save == NULL);
+    ASSERT(hvm_sr_handlers[typecode].save_vcpu == NULL);
+    ASSERT(hvm_sr_handlers[typecode].load == NULL);
+    hvm_sr_handlers[typecode].save_vcpu = save_state;
+    hvm_sr_handlers[typecode].load = load_state;
+    hvm_sr_handlers[typecode].name = name;
+    hvm_sr_handlers[typecode].size = size;
+    hvm_sr_handlers[typecode].kind = HVMSR_PER_VCPU;
+}
+
+size_t hvm_save_size_domain(struct domain *d)
 {
-    struct vcpu *v;
     size_t sz;
     int i;
 
@@ -118,19 +138,41 @@ size_t hvm_save_size(struct domain *d)
     sz = (2 * sizeof (struct hvm_save_descriptor)) + HVM_SAVE_LENGTH(HEADER);
 
     /* Plus space for each thing we will be saving */
+    for ( i = 0; i <= HVM_SAVE_CODE_MAX; i++ )
+        if ( hvm_sr_handlers[i].kind == HVMSR_PER_DOM )
+            sz += hvm_sr_handlers[i].size;
+
+    return sz;
+}
+
+size_t hvm_save_size_vcpu(struct vcpu *v)
+{
+    size_t sz = 0;
+    int i;
+
     for ( i = 0; i <= HVM_SAVE_CODE_MAX; i++ )
         if ( hvm_sr_handlers[i].kind == HVMSR_PER_VCPU )
-            for_each_vcpu(d, v)
-                sz += hvm_sr_handlers[i].size;
-        else
             sz += hvm_sr_handlers[i].size;
 
     return sz;
 }
 
+size_t hvm_save_size(struct domain *d)
+{
+    struct vcpu *v;
+    size_t sz = hvm_save_size_domain(d);
+
+    for_each_vcpu(d, v)
+        sz += hvm_save_size_vcpu(v);
+
+    return sz;
+}
+
 /*
- * Extract a single instance of a save record, by marshalling all records of
- * that type and copying out the one we need.
+ * Extract a single instance of a save record.  Per-vcpu records get saved
+ * for just the vcpu concerned, which is the only one paused meanwhile;
+ * others by marshalling all records of that type and copying out the one
+ * we need.
  */
 int hvm_save_one(struct domain *d, unsigned int typecode, unsigned int instance,
                  XEN_GUEST_HANDLE_64(uint8) handle, uint64_t *bufsz)
@@ -138,21 +180,40 @@ int hvm_save_one(struct domain *d, unsigned int typecode, unsigned int instance,
     int rv;
     hvm_domain_context_t ctxt = { };
     const struct hvm_save_descriptor *desc;
+    struct vcpu *v = NULL;
 
     if ( d->is_dying ||
          typecode > HVM_SAVE_CODE_MAX ||
          hvm_sr_handlers[typecode].size < sizeof(*desc) ||
-         !hvm_sr_handlers[typecode].save )
+         (!hvm_sr_handlers[typecode].save &&
+          !hvm_sr_handlers[typecode].save_vcpu) )
         return -EINVAL;
 
-    ctxt.size = hvm_sr_handlers[typecode].size;
     if ( hvm_sr_handlers[typecode].kind == HVMSR_PER_VCPU )
-        ctxt.size *= d->max_vcpus;
+    {
+        if ( instance >= d->max_vcpus || (v = d->vcpu[instance]) == NULL )
+            return -ENOENT;
+    }
+
+    ctxt.size = hvm_sr_handlers[typecode].size;
     ctxt.data = xmalloc_bytes(ctxt.size);
     if ( !ctxt.data )
         return -ENOMEM;
 
-    if ( (rv = hvm_sr_handlers[typecode].save(d, &ctxt)) != 0 )
+    if ( v )
+    {
+        vcpu_pause(v);
+        rv = hvm_sr_handlers[typecode].save_vcpu(v, &ctxt);
+        vcpu_unpause(v);
+    }
+    else
+    {
+        domain_pause(d);
+        rv = hvm_sr_handlers[typecode].save(d, &ctxt);
+        domain_unpause(d);
+    }
+
+    if ( rv != 0 )
         printk(XENLOG_G_ERR "HVM%d save: failed to save type %"PRIu16" (%d)\n",
                d->domain_id, typecode, rv);
     else if ( rv = -ENOENT, ctxt.cur >= sizeof(*desc) )
@@ -187,16 +248,10 @@ int hvm_save_one(struct domain *d, unsigned int typecode, unsigned int instance,
     return rv;
 }
 
-int hvm_save(struct domain *d, hvm_domain_context_t *h)
+static int hvm_save_header(struct domain *d, hvm_domain_context_t *h)
 {
     char *c;
     struct hvm_save_header hdr;
-    struct hvm_save_end end;
-    hvm_save_handler handler;
-    unsigned int i;
-
-    if ( d->is_dying )
-        return -EINVAL;
 
     hdr.magic = HVM_FILE_MAGIC;
     hdr.version = HVM_FILE_VERSION;
@@ -217,23 +272,12 @@ int hvm_save(struct domain *d, hvm_domain_context_t *h)
         return -EFAULT;
     }
 
-    /* Save all available kinds of state */
-    for ( i = 0; i <= HVM_SAVE_CODE_MAX; i++ )
-    {
-        handler = hvm_sr_handlers[i].save;
-        if ( handler != NULL )
-        {
-            printk(XENLOG_G_INFO "HVM%d save: %s\n",
-                   d->domain_id, hvm_sr_handlers[i].name);
-            if ( handler(d, h) != 0 )
-            {
-                printk(XENLOG_G_ERR
-                       "HVM%d save: failed to save type %"PRIu16"\n",
-                       d->domain_id, i);
-                return -EFAULT;
-            }
-        }
-    }
+    return 0;
+}
+
+static int hvm_save_end(struct domain *d, hvm_domain_context_t *h)
+{
+    struct hvm_save_end end;
 
     /* Save an end-of-file marker */
     if ( hvm_save_entry(END, 0, h, &end) != 0 )
@@ -249,11 +293,126 @@ int hvm_save(struct domain *d, hvm_domain_context_t *h)
     return 0;
 }
 
+static int hvm_save_type(struct domain *d, unsigned int i,
+                         hvm_domain_context_t *h)
+{
+    struct vcpu *v;
+    int rc = 0;
+
+    if ( !hvm_sr_handlers[i].save && !hvm_sr_handlers[i].save_vcpu )
+        return 0;
+
+    printk(XENLOG_G_INFO "HVM%d save: %s\n",
+           d->domain_id, hvm_sr_handlers[i].name);
+
+    if ( hvm_sr_handlers[i].save_vcpu )
+    {
+        for_each_vcpu ( d, v )
+            if ( (rc = hvm_sr_handlers[i].save_vcpu(v, h)) != 0 )
+                break;
+    }
+    else
+        rc = hvm_sr_handlers[i].save(d, h);
+
+    if ( rc != 0 )
+    {
+        printk(XENLOG_G_ERR "HVM%d save: failed to save type %"PRIu16"\n",
+               d->domain_id, i);
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+int hvm_save(struct domain *d, hvm_domain_context_t *h)
+{
+    unsigned int i;
+    int rc;
+
+    if ( d->is_dying )
+        return -EINVAL;
+
+    rc = hvm_save_header(d, h);
+
+    /* Save all available kinds of state */
+    for ( i = 0; !rc && i <= HVM_SAVE_CODE_MAX; i++ )
+        rc = hvm_save_type(d, i, h);
+
+    return rc ?: hvm_save_end(d, h);
+}
+
+int hvm_save_domain(struct domain *d, hvm_domain_context_t *h)
+{
+    unsigned int i;
+    int rc;
+
+    if ( d->is_dying )
+        return -EINVAL;
+
+    rc = hvm_save_header(d, h);
+
+    for ( i = 0; !rc && i <= HVM_SAVE_CODE_MAX; i++ )
+        if ( hvm_sr_handlers[i].kind == HVMSR_PER_DOM )
+            rc = hvm_save_type(d, i, h);
+
+    return rc ?: hvm_save_end(d, h);
+}
+
+/* Relative to the TSC of an hvm_save_domain() done beforehand. */
+int hvm_save_vcpu(struct vcpu *v, hvm_domain_context_t *h)
+{
+    struct domain *d = v->domain;
+    unsigned int i;
+
+    if ( d->is_dying )
+        return -EINVAL;
+
+    for ( i = 0; i <= HVM_SAVE_CODE_MAX; i++ )
+        if ( hvm_sr_handlers[i].save_vcpu &&
+             hvm_sr_handlers[i].save_vcpu(v, h) != 0 )
+        {
+            printk(XENLOG_G_ERR
+                   "HVM%d save: failed to save type %"PRIu16" of vcpu%u\n",
+                   d->domain_id, i, v->vcpu_id);
+            return -EFAULT;
+        }
+
+    ASSERT(h->cur <= h->size);
+    return 0;
+}
+
+/* Load the entry which @desc describes. */
+static int hvm_load_record(struct domain *d, hvm_domain_context_t *h,
+                           const struct hvm_save_descriptor *desc)
+{
+    hvm_load_handler handler;
+
+    /* Find the handler for this entry */
+    if ( (desc->typecode > HVM_SAVE_CODE_MAX) ||
+         ((handler = hvm_sr_handlers[desc->typecode].load) == NULL) )
+    {
+        printk(XENLOG_G_ERR "HVM%d restore: unknown entry typecode %u\n",
+               d->domain_id, desc->typecode);
+        return -1;
+    }
+
+    /* Load the entry */
+    printk(XENLOG_G_INFO "HVM%d restore: %s %"PRIu16"\n", d->domain_id,
+           hvm_sr_handlers[desc->typecode].name, desc->instance);
+    if ( handler(d, h) != 0 )
+    {
+        printk(XENLOG_G_ERR "HVM%d restore: failed to load entry %u/%u\n",
+               d->domain_id, desc->typecode, desc->instance);
+        return -1;
+    }
+
+    return 0;
+}
+
 int hvm_load(struct domain *d, hvm_domain_context_t *h)
 {
     struct hvm_save_header hdr;
     struct hvm_save_descriptor *desc;
-    hvm_load_handler handler;
     struct vcpu *v;
 
     if ( d->is_dying )
@@ -287,27 +446,51 @@ int hvm_load(struct domain *d, hvm_domain_context_t *h)
         if ( desc->typecode == 0 )
             return 0;
 
-        /* Find the handler for this entry */
-        if ( (desc->typecode > HVM_SAVE_CODE_MAX) ||
-             ((handler = hvm_sr_handlers[desc->typecode].load) == NULL) )
+        if ( hvm_load_record(d, h, desc) )
+            return -1;
+    }
+
+    /* Not reached */
+}
+
+/*
+ * Load what hvm_save_vcpu() saved of vcpus [first, first + nr), after the
+ * hvm_load() of what hvm_save_domain() did.
+ */
+int hvm_load_vcpus(struct domain *d, unsigned int first, unsigned int nr,
+                   hvm_domain_context_t *h)
+{
+    const struct hvm_save_descriptor *desc;
+
+    if ( d->is_dying )
+        return -EINVAL;
+
+    while ( h->cur < h->size )
+    {
+        if ( h->size - h->cur < sizeof(*desc) )
         {
-            printk(XENLOG_G_ERR "HVM%d restore: unknown entry typecode %u\n",
-                   d->domain_id, desc->typecode);
+            printk(XENLOG_G_ERR "HVM%d restore: truncated vcpu records\n",
+                   d->domain_id);
             return -1;
         }
 
-        /* Load the entry */
-        printk(XENLOG_G_INFO "HVM%d restore: %s %"PRIu16"\n", d->domain_id,
-               hvm_sr_handlers[desc->typecode].name, desc->instance);
-        if ( handler(d, h) != 0 )
+        desc = (const void *)&h->data[h->cur];
+        if ( desc->typecode > HVM_SAVE_CODE_MAX ||
+             hvm_sr_handlers[desc->typecode].kind != HVMSR_PER_VCPU ||
+             desc->instance < first || desc->instance - first >= nr )
         {
-            printk(XENLOG_G_ERR "HVM%d restore: failed to load entry %u/%u\n",
-                   d->domain_id, desc->typecode, desc->instance);
+            printk(XENLOG_G_ERR
+                   "HVM%d restore: entry %u/%u is not of vcpus %u-%u\n",
+                   d->domain_id, desc->typecode, desc->instance,
+                   first, first + nr - 1);
             return -1;
         }
+
+        if ( hvm_load_record(d, h, desc) )
+            return -1;
     }
 
-    /* Not reached */
+    return 0;
 }
 
 int _hvm_init_entry(struct hvm_domain_context *h, uint16_t tc, uint16_t inst,
@@ -40,6 +40,7 @@
 #include <asm/i387.h>
 #include <asm/iocap.h>
 #include <asm/hvm/emulate.h>
+#include <asm/hvm/exit_stats.h>
 #include <asm/hvm/hvm.h>
 #include <asm/hvm/support.h>
 #include <asm/hvm/io.h>
@@ -548,6 +549,8 @@ void svm_update_guest_cr(struct vcpu *v, unsigned int cr)
     struct vmcb_struct *vmcb = v->arch.hvm_svm.vmcb;
     uint64_t value;
 
+    hvm_vcpu_io_flush_insn_cache(&v->arch.hvm_vcpu.hvm_io);
+
     switch ( cr )
     {
     case 0: {
@@ -627,6 +630,8 @@ static void svm_update_guest_efer(struct vcpu *v)
     bool_t lma = !!(v->arch.hvm_vcpu.guest_efer & EFER_LMA);
     uint64_t new_efer;
 
+    hvm_vcpu_io_flush_insn_cache(&v->arch.hvm_vcpu.hvm_io);
+
     new_efer = (v->arch.hvm_vcpu.guest_efer | EFER_SVME) & ~EFER_LME;
     if ( lma )
         new_efer |= EFER_LME;
@@ -1059,6 +1064,8 @@ static void svm_ctxt_switch_from(struct vcpu *v)
     if ( unlikely((read_efer() & EFER_SVME) == 0) )
         return;
 
+    hvm_exit_stats_end(v);
+
     svm_fpu_leave(v);
 
     svm_save_dr(v);
@@ -2539,6 +2546,7 @@ void svm_vmexit_handler(struct cpu_user_regs *regs)
     }
 
     exit_reason = vmcb->exitcode;
+    hvm_exit_stats_begin(v, exit_reason);
 
     if ( hvm_long_mode_active(v) )
         HVMTRACE_ND(VMEXIT64, vcpu_guestmode ? TRC_HVM_NESTEDFLAG : 0,
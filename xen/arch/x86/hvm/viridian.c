@@ -14,11 +14,13 @@
 #include <xen/perfc.h>
 #include <xen/hypercall.h>
 #include <xen/domain_page.h>
+#include <xen/event.h>
 #include <asm/guest_access.h>
 #include <asm/paging.h>
 #include <asm/p2m.h>
 #include <asm/apic.h>
 #include <asm/hvm/support.h>
+#include <asm/hvm/vlapic.h>
 #include <public/sched.h>
 #include <public/hvm/hvm_op.h>
 
@@ -97,15 +99,32 @@
 #define HV_STATUS_INVALID_PARAMETER             0x0005
 
 /* Viridian Hypercall Codes. */
-#define HvFlushVirtualAddressSpace 0x0002
-#define HvFlushVirtualAddressList  0x0003
-#define HvNotifyLongSpinWait       0x0008
-#define HvGetPartitionId           0x0046
-#define HvExtCallQueryCapabilities 0x8001
+#define HvFlushVirtualAddressSpace   0x0002
+#define HvFlushVirtualAddressList    0x0003
+#define HvNotifyLongSpinWait         0x0008
+#define HvSendSyntheticClusterIpi    0x000b
+#define HvFlushVirtualAddressSpaceEx 0x0013
+#define HvFlushVirtualAddressListEx  0x0014
+#define HvSendSyntheticClusterIpiEx  0x0015
+#define HvGetPartitionId             0x0046
+#define HvExtCallQueryCapabilities   0x8001
 
 /* Viridian Hypercall Flags. */
 #define HV_FLUSH_ALL_PROCESSORS 1
 
+/* Formats of the sparse VP sets taken by the "Ex" hypercalls. */
+#define HV_GENERIC_SET_SPARSE_4K 0
+#define HV_GENERIC_SET_ALL       1
+
+struct hv_vpset {
+    uint64_t format;
+    uint64_t valid_bank_mask;
+    /* uint64_t bank_contents[], one for each bit set in valid_bank_mask. */
+};
+
+/* Bitmap of VP indexes (i.e. vCPU ids), one bank of 64 per element. */
+#define HV_VPMASK_BANKS DIV_ROUND_UP(HVM_MAX_VCPUS, 64)
+
 /*
  * Viridian Partition Privilege Flags.
  *
@@ -165,12 +184,46 @@ typedef union _HV_CRASH_CTL_REG_CONTENTS
 } HV_CRASH_CTL_REG_CONTENTS;
 
 /* Viridian CPUID leaf 3, Hypervisor Feature Indication */
-#define CPUID3D_CRASH_MSRS (1 << 10)
+#define CPUID3D_CRASH_MSRS          (1 << 10)
+#define CPUID3D_STIMER_DIRECT_MODE  (1 << 19)
 
 /* Viridian CPUID leaf 4: Implementation Recommendations. */
 #define CPUID4A_HCALL_REMOTE_TLB_FLUSH (1 << 2)
 #define CPUID4A_MSR_BASED_APIC         (1 << 3)
 #define CPUID4A_RELAX_TIMER_INT        (1 << 5)
+#define CPUID4A_DEPRECATE_AUTOEOI      (1 << 9)
+#define CPUID4A_SYNTHETIC_CLUSTER_IPI  (1 << 10)
+#define CPUID4A_EX_PROCESSOR_MASKS     (1 << 11)
+
+/*
+ * Synthetic interrupt message page layout, as in section 11.9 of the
+ * specification.
+ */
+#define HvMessageTypeNone     0x00000000
+#define HvMessageTimerExpired 0x80000010
+
+#define HV_MESSAGE_FLAG_PENDING 0x01
+
+typedef struct {
+    uint32_t MessageType;
+    uint8_t  PayloadSize;
+    uint8_t  MessageFlags;
+    uint16_t Reserved;
+    uint64_t Sender;
+    union {
+        uint64_t Payload[30];
+        struct {
+            uint32_t TimerIndex;
+            uint32_t Reserved;
+            uint64_t ExpirationTime;
+            uint64_t DeliveryTime;
+        } Timer;
+    } u;
+} HV_MESSAGE;
+
+typedef struct {
+    HV_MESSAGE SintMessage[VIRIDIAN_SINT_COUNT];
+} HV_MESSAGE_PAGE;
 
 /* Viridian CPUID leaf 6: Implementation HW features detected and in use. */
 #define CPUID6A_APIC_OVERLAY    (1 << 0)
@@ -254,6 +307,10 @@ void cpuid_viridian_leaves(const struct vcpu *v, uint32_t leaf,
             mask.AccessPartitionReferenceCounter = 1;
         if ( viridian_feature_mask(d) & HVMPV_reference_tsc )
             mask.AccessPartitionReferenceTsc = 1;
+        if ( viridian_feature_mask(d) & HVMPV_synic )
+            mask.AccessSynicRegs = 1;
+        if ( viridian_feature_mask(d) & HVMPV_stimer )
+            mask.AccessSyntheticTimerRegs = 1;
 
         u.mask = mask;
 
@@ -261,7 +318,9 @@ void cpuid_viridian_leaves(const struct vcpu *v, uint32_t leaf,
         res->b = u.hi;
 
         if ( viridian_feature_mask(d) & HVMPV_crash_ctl )
-            res->d = CPUID3D_CRASH_MSRS;
+            res->d |= CPUID3D_CRASH_MSRS;
+        if ( viridian_feature_mask(d) & HVMPV_stimer )
+            res->d |= CPUID3D_STIMER_DIRECT_MODE;
 
         break;
     }
@@ -276,6 +335,13 @@ void cpuid_viridian_leaves(const struct vcpu *v, uint32_t leaf,
             res->a |= CPUID4A_HCALL_REMOTE_TLB_FLUSH;
         if ( !cpu_has_vmx_apic_reg_virt )
             res->a |= CPUID4A_MSR_BASED_APIC;
+        if ( viridian_feature_mask(d) & HVMPV_hcall_ipi )
+            res->a |= CPUID4A_SYNTHETIC_CLUSTER_IPI;
+        if ( viridian_feature_mask(d) & HVMPV_ex_processor_masks )
+            res->a |= CPUID4A_EX_PROCESSOR_MASKS;
+        /* Auto-EOI SINTs are not implemented. */
+        if ( viridian_feature_mask(d) & HVMPV_synic )
+            res->a |= CPUID4A_DEPRECATE_AUTOEOI;
 
         /*
          * This value is the recommended number of attempts to try to
@@ -285,6 +351,12 @@ void cpuid_viridian_leaves(const struct vcpu *v, uint32_t leaf,
         res->b = viridian_spinlock_retry_count;
         break;
 
+    case 5:
+        /* Implementation limits: maximum number of virtual processors. */
+        if ( viridian_feature_mask(d) & HVMPV_ex_processor_masks )
+            res->a = d->max_vcpus;
+        break;
+
     case 6:
         /* Detected and in use hardware features. */
         if ( cpu_has_vmx_virtualize_apic_accesses )
@@ -554,6 +626,282 @@ static void update_reference_tsc(struct domain *d, bool_t initialize)
     put_page_and_type(page);
 }
 
+static int64_t raw_trc_val(struct domain *d)
+{
+    uint64_t tsc;
+    struct time_scale tsc_to_ns;
+
+    tsc = hvm_get_guest_tsc(pt_global_vcpu_target(d));
+
+    /* convert tsc to count of 100ns periods */
+    set_time_scale(&tsc_to_ns, d->arch.tsc_khz * 1000ul);
+    return scale_delta(tsc, &tsc_to_ns) / 100ul;
+}
+
+static int64_t time_ref_count(struct domain *d)
+{
+    struct viridian_time_ref_count *trc =
+        &d->arch.hvm_domain.viridian.time_ref_count;
+
+    return test_bit(_TRC_running, &trc->flags) ? raw_trc_val(d) + trc->off
+                                               : (int64_t)trc->val;
+}
+
+static void *map_viridian_page(struct domain *d, unsigned long gmfn)
+{
+    struct page_info *page = get_page_from_gfn(d, gmfn, NULL, P2M_ALLOC);
+    void *va;
+
+    if ( !page )
+        goto fail;
+
+    if ( !get_page_type(page, PGT_writable_page) )
+    {
+        put_page(page);
+        goto fail;
+    }
+
+    va = __map_domain_page_global(page);
+    if ( !va )
+    {
+        put_page_and_type(page);
+        goto fail;
+    }
+
+    return va;
+
+ fail:
+    gdprintk(XENLOG_WARNING, "Bad GMFN %#"PRI_gfn" (MFN %#"PRI_mfn")\n", gmfn,
+             page ? page_to_mfn(page) : mfn_x(INVALID_MFN));
+    return NULL;
+}
+
+static void unmap_viridian_page(void *va)
+{
+    struct page_info *page = mfn_to_page(domain_page_map_to_mfn(va));
+
+    unmap_domain_page_global(va);
+    put_page_and_type(page);
+}
+
+static void teardown_simp(struct vcpu *v)
+{
+    void *va = v->arch.hvm_vcpu.viridian.synic->simp_va;
+
+    if ( !va )
+        return;
+
+    v->arch.hvm_vcpu.viridian.synic->simp_va = NULL;
+    unmap_viridian_page(va);
+}
+
+static void initialize_simp(struct vcpu *v, bool clear)
+{
+    void *va;
+
+    BUILD_BUG_ON(sizeof(HV_MESSAGE_PAGE) != PAGE_SIZE);
+    ASSERT(!v->arch.hvm_vcpu.viridian.synic->simp_va);
+
+    va = map_viridian_page(v->domain,
+                           v->arch.hvm_vcpu.viridian.synic->simp.fields.pfn);
+    if ( !va )
+        return;
+
+    if ( clear )
+        clear_page(va);
+
+    v->arch.hvm_vcpu.viridian.synic->simp_va = va;
+}
+
+/*
+ * Post a timer expiry message into the SIMP slot of the given SINT, as
+ * described in section 15.3.3 of the specification. Returns false if the
+ * slot is still occupied by an earlier message, in which case the message
+ * pending flag is set so the guest will write EOM once it has drained
+ * the slot, and delivery is retried from viridian_synic_poll().
+ */
+static bool synic_deliver_timer_msg(struct vcpu *v, unsigned int sintx,
+                                    unsigned int index, uint64_t expiration,
+                                    uint64_t delivery)
+{
+    struct viridian_vcpu *vv = &v->arch.hvm_vcpu.viridian;
+    const union viridian_sint_msr *sint = &vv->synic->sint[sintx];
+    HV_MESSAGE_PAGE *page = vv->synic->simp_va;
+    HV_MESSAGE *msg;
+
+    /* Messages to a disabled SynIC or a masked SINT are dropped. */
+    if ( !(vv->synic->scontrol & 1) || !page || sint->fields.mask )
+        return true;
+
+    msg = &page->SintMessage[sintx];
+    if ( ACCESS_ONCE(msg->MessageType) != HvMessageTypeNone )
+    {
+        msg->MessageFlags |= HV_MESSAGE_FLAG_PENDING;
+        return false;
+    }
+
+    msg->PayloadSize = sizeof(msg->u.Timer);
+    msg->MessageFlags = 0;
+    msg->Sender = 0;
+    msg->u.Timer.TimerIndex = index;
+    msg->u.Timer.Reserved = 0;
+    msg->u.Timer.ExpirationTime = expiration;
+    msg->u.Timer.DeliveryTime = delivery;
+    smp_wmb();
+    ACCESS_ONCE(msg->MessageType) = HvMessageTimerExpired;
+
+    if ( !sint->fields.polling && sint->fields.vector >= 0x10 )
+        vlapic_set_irq(vcpu_vlapic(v), sint->fields.vector, 0);
+
+    return true;
+}
+
+/*
+ * Synthetic timers. Expiry times are held in reference time (100ns units)
+ * and converted to system time when arming the underlying Xen timer,
+ * whose handler merely marks the timer pending and kicks the vCPU. The
+ * resulting interrupt or message is delivered in vCPU context by
+ * viridian_synic_poll().
+ */
+static void stimer_expire(void *data)
+{
+    struct viridian_stimer *vs = data;
+    struct vcpu *v = vs->v;
+
+    set_bit(vs - v->arch.hvm_vcpu.viridian.synic->stimer,
+            &v->arch.hvm_vcpu.viridian.synic->stimer_pending);
+    vcpu_kick(v);
+}
+
+static void stimer_arm(struct viridian_stimer *vs)
+{
+    int64_t now = time_ref_count(vs->v->domain);
+    int64_t delta = (int64_t)vs->expiration - now;
+
+    if ( delta <= 0 )
+    {
+        stimer_expire(vs);
+        return;
+    }
+
+    set_timer(&vs->timer, NOW() + delta * 100);
+}
+
+static void stimer_start(struct viridian_stimer *vs)
+{
+    /*
+     * The count register holds the period of a periodic timer, and the
+     * absolute expiration time of a one-shot timer.
+     */
+    if ( vs->config.fields.periodic )
+        vs->expiration = time_ref_count(vs->v->domain) + vs->count;
+    else
+        vs->expiration = vs->count;
+
+    stimer_arm(vs);
+}
+
+static void stimer_stop(struct viridian_stimer *vs)
+{
+    struct vcpu *v = vs->v;
+
+    stop_timer(&vs->timer);
+    clear_bit(vs - v->arch.hvm_vcpu.viridian.synic->stimer,
+              &v->arch.hvm_vcpu.viridian.synic->stimer_pending);
+}
+
+static bool stimer_deliver(struct vcpu *v, unsigned int index)
+{
+    struct viridian_stimer *vs = &v->arch.hvm_vcpu.viridian.synic->stimer[index];
+    int64_t now = time_ref_count(v->domain);
+
+    if ( !vs->config.fields.enabled )
+        return true;
+
+    if ( vs->config.fields.direct_mode )
+    {
+        perfc_incr(mshv_stimer_direct);
+        if ( vs->config.fields.vector >= 0x10 )
+            vlapic_set_irq(vcpu_vlapic(v), vs->config.fields.vector, 0);
+    }
+    else
+    {
+        if ( !synic_deliver_timer_msg(v, vs->config.fields.sintx, index,
+                                      vs->expiration, now) )
+            return false;
+        perfc_incr(mshv_stimer_message);
+    }
+
+    if ( vs->config.fields.periodic && vs->count )
+    {
+        /*
+         * Skip any periods that were missed rather than bunching them.  The
+         * reference counter may not have caught up with the expiration yet
+         * when delivery is early, in which case nothing was missed.
+         */
+        uint64_t missed = 0;
+
+        if ( now > (int64_t)vs->expiration )
+            missed = (now - (int64_t)vs->expiration) / vs->count;
+
+        vs->expiration += (missed + 1) * vs->count;
+        stimer_arm(vs);
+    }
+    else
+        vs->config.fields.enabled = 0;
+
+    return true;
+}
+
+static void stimer_write_config(struct viridian_stimer *vs, uint64_t val)
+{
+    stimer_stop(vs);
+
+    vs->config.raw = val;
+    vs->config.fields.reserved_zero1 = 0;
+    vs->config.fields.reserved_zero2 = 0;
+
+    /* A message mode timer targeting SINT0 is implicitly disabled. */
+    if ( !vs->config.fields.direct_mode && !vs->config.fields.sintx )
+        vs->config.fields.enabled = 0;
+
+    if ( vs->config.fields.enabled && vs->count )
+        stimer_start(vs);
+}
+
+static void stimer_write_count(struct viridian_stimer *vs, uint64_t val)
+{
+    stimer_stop(vs);
+
+    vs->count = val;
+
+    if ( !vs->count )
+        vs->config.fields.enabled = 0;
+    else if ( vs->config.fields.auto_enable )
+        vs->config.fields.enabled = 1;
+
+    if ( vs->config.fields.enabled )
+        stimer_start(vs);
+}
+
+void viridian_synic_poll(struct vcpu *v)
+{
+    struct viridian_vcpu *vv = &v->arch.hvm_vcpu.viridian;
+    unsigned int i;
+
+    if ( !vv->synic->stimer_pending )
+        return;
+
+    for ( i = 0; i < ARRAY_SIZE(vv->synic->stimer); i++ )
+    {
+        if ( !test_and_clear_bit(i, &vv->synic->stimer_pending) )
+            continue;
+
+        if ( !stimer_deliver(v, i) )
+            set_bit(i, &vv->synic->stimer_pending);
+    }
+}
+
 int wrmsr_viridian_regs(uint32_t idx, uint64_t val)
 {
     struct vcpu *v = current;
@@ -624,6 +972,71 @@ int wrmsr_viridian_regs(uint32_t idx, uint64_t val)
             update_reference_tsc(d, 1);
         break;
 
+    case HV_X64_MSR_SCONTROL:
+        if ( !(viridian_feature_mask(d) & HVMPV_synic) )
+            return 0;
+
+        v->arch.hvm_vcpu.viridian.synic->scontrol = val;
+        break;
+
+    case HV_X64_MSR_SIEFP:
+        if ( !(viridian_feature_mask(d) & HVMPV_synic) )
+            return 0;
+
+        /* No events are ever signalled, so the page is not mapped. */
+        v->arch.hvm_vcpu.viridian.synic->siefp.raw = val;
+        break;
+
+    case HV_X64_MSR_SIMP:
+        if ( !(viridian_feature_mask(d) & HVMPV_synic) )
+            return 0;
+
+        teardown_simp(v); /* release any previous mapping */
+        v->arch.hvm_vcpu.viridian.synic->simp.raw = val;
+        if ( v->arch.hvm_vcpu.viridian.synic->simp.fields.enabled )
+            initialize_simp(v, true);
+        break;
+
+    case HV_X64_MSR_EOM:
+        if ( !(viridian_feature_mask(d) & HVMPV_synic) )
+            return 0;
+
+        /*
+         * Any message held back by an occupied slot is still marked
+         * pending and will be retried by viridian_synic_poll().
+         */
+        break;
+
+    case HV_X64_MSR_SINT0 ... HV_X64_MSR_SINT15:
+        if ( !(viridian_feature_mask(d) & HVMPV_synic) )
+            return 0;
+
+        idx -= HV_X64_MSR_SINT0;
+        v->arch.hvm_vcpu.viridian.synic->sint[idx].raw = val;
+        break;
+
+    case HV_X64_MSR_STIMER0_CONFIG:
+    case HV_X64_MSR_STIMER1_CONFIG:
+    case HV_X64_MSR_STIMER2_CONFIG:
+    case HV_X64_MSR_STIMER3_CONFIG:
+        if ( !(viridian_feature_mask(d) & HVMPV_stimer) )
+            return 0;
+
+        idx = (idx - HV_X64_MSR_STIMER0_CONFIG) / 2;
+        stimer_write_config(&v->arch.hvm_vcpu.viridian.synic->stimer[idx], val);
+        break;
+
+    case HV_X64_MSR_STIMER0_COUNT:
+    case HV_X64_MSR_STIMER1_COUNT:
+    case HV_X64_MSR_STIMER2_COUNT:
+    case HV_X64_MSR_STIMER3_COUNT:
+        if ( !(viridian_feature_mask(d) & HVMPV_stimer) )
+            return 0;
+
+        idx = (idx - HV_X64_MSR_STIMER0_CONFIG) / 2;
+        stimer_write_count(&v->arch.hvm_vcpu.viridian.synic->stimer[idx], val);
+        break;
+
     case HV_X64_MSR_CRASH_P0:
     case HV_X64_MSR_CRASH_P1:
     case HV_X64_MSR_CRASH_P2:
@@ -665,18 +1078,6 @@ int wrmsr_viridian_regs(uint32_t idx, uint64_t val)
     return 1;
 }
 
-static int64_t raw_trc_val(struct domain *d)
-{
-    uint64_t tsc;
-    struct time_scale tsc_to_ns;
-
-    tsc = hvm_get_guest_tsc(pt_global_vcpu_target(d));
-
-    /* convert tsc to count of 100ns periods */
-    set_time_scale(&tsc_to_ns, d->arch.tsc_khz * 1000ul);
-    return scale_delta(tsc, &tsc_to_ns) / 100ul;
-}
-
 void viridian_time_ref_count_freeze(struct domain *d)
 {
     struct viridian_time_ref_count *trc;
@@ -781,6 +1182,72 @@ int rdmsr_viridian_regs(uint32_t idx, uint64_t *val)
         break;
     }
 
+    case HV_X64_MSR_SCONTROL:
+        if ( !(viridian_feature_mask(d) & HVMPV_synic) )
+            return 0;
+
+        *val = v->arch.hvm_vcpu.viridian.synic->scontrol;
+        break;
+
+    case HV_X64_MSR_SVERSION:
+        if ( !(viridian_feature_mask(d) & HVMPV_synic) )
+            return 0;
+
+        /* Section 11.8.5 of the specification mandates a value of 1. */
+        *val = 1;
+        break;
+
+    case HV_X64_MSR_SIEFP:
+        if ( !(viridian_feature_mask(d) & HVMPV_synic) )
+            return 0;
+
+        *val = v->arch.hvm_vcpu.viridian.synic->siefp.raw;
+        break;
+
+    case HV_X64_MSR_SIMP:
+        if ( !(viridian_feature_mask(d) & HVMPV_synic) )
+            return 0;
+
+        *val = v->arch.hvm_vcpu.viridian.synic->simp.raw;
+        break;
+
+    case HV_X64_MSR_EOM:
+        if ( !(viridian_feature_mask(d) & HVMPV_synic) )
+            return 0;
+
+        *val = 0;
+        break;
+
+    case HV_X64_MSR_SINT0 ... HV_X64_MSR_SINT15:
+        if ( !(viridian_feature_mask(d) & HVMPV_synic) )
+            return 0;
+
+        idx -= HV_X64_MSR_SINT0;
+        *val = v->arch.hvm_vcpu.viridian.synic->sint[idx].raw;
+        break;
+
+    case HV_X64_MSR_STIMER0_CONFIG:
+    case HV_X64_MSR_STIMER1_CONFIG:
+    case HV_X64_MSR_STIMER2_CONFIG:
+    case HV_X64_MSR_STIMER3_CONFIG:
+        if ( !(viridian_feature_mask(d) & HVMPV_stimer) )
+            return 0;
+
+        idx = (idx - HV_X64_MSR_STIMER0_CONFIG) / 2;
+        *val = v->arch.hvm_vcpu.viridian.synic->stimer[idx].config.raw;
+        break;
+
+    case HV_X64_MSR_STIMER0_COUNT:
+    case HV_X64_MSR_STIMER1_COUNT:
+    case HV_X64_MSR_STIMER2_COUNT:
+    case HV_X64_MSR_STIMER3_COUNT:
+        if ( !(viridian_feature_mask(d) & HVMPV_stimer) )
+            return 0;
+
+        idx = (idx - HV_X64_MSR_STIMER0_CONFIG) / 2;
+        *val = v->arch.hvm_vcpu.viridian.synic->stimer[idx].count;
+        break;
+
     case HV_X64_MSR_CRASH_P0:
     case HV_X64_MSR_CRASH_P1:
     case HV_X64_MSR_CRASH_P2:
@@ -814,9 +1281,57 @@ int rdmsr_viridian_regs(uint32_t idx, uint64_t *val)
     return 1;
 }
 
+int viridian_vcpu_init(struct vcpu *v)
+{
+    struct viridian_synic *synic;
+    unsigned int i;
+
+    /*
+     * The feature mask is not known yet, so this is needed by every HVM
+     * vCPU.
+     */
+    synic = xzalloc(struct viridian_synic);
+    if ( !synic )
+        return -ENOMEM;
+
+    /* SINTs come out of reset masked. */
+    for ( i = 0; i < ARRAY_SIZE(synic->sint); i++ )
+        synic->sint[i].fields.mask = 1;
+
+    for ( i = 0; i < ARRAY_SIZE(synic->stimer); i++ )
+    {
+        struct viridian_stimer *vs = &synic->stimer[i];
+
+        vs->v = v;
+        init_timer(&vs->timer, stimer_expire, vs, v->processor);
+    }
+
+    v->arch.hvm_vcpu.viridian.synic = synic;
+
+    return 0;
+}
+
+static void teardown_synic(struct vcpu *v)
+{
+    struct viridian_synic *synic = v->arch.hvm_vcpu.viridian.synic;
+    unsigned int i;
+
+    if ( !synic )
+        return;
+
+    for ( i = 0; i < ARRAY_SIZE(synic->stimer); i++ )
+        kill_timer(&synic->stimer[i].timer);
+
+    teardown_simp(v);
+}
+
 void viridian_vcpu_deinit(struct vcpu *v)
 {
+    teardown_synic(v);
     teardown_vp_assist(v);
+
+    xfree(v->arch.hvm_vcpu.viridian.synic);
+    v->arch.hvm_vcpu.viridian.synic = NULL;
 }
 
 void viridian_domain_deinit(struct domain *d)
@@ -824,11 +1339,128 @@ void viridian_domain_deinit(struct domain *d)
     struct vcpu *v;
 
     for_each_vcpu ( d, v )
+    {
+        teardown_synic(v);
         teardown_vp_assist(v);
+    }
+}
+
+void viridian_migrate_timers(struct vcpu *v)
+{
+    struct viridian_synic *synic = v->arch.hvm_vcpu.viridian.synic;
+    unsigned int i;
+
+    if ( !synic )
+        return;
+
+    for ( i = 0; i < ARRAY_SIZE(synic->stimer); i++ )
+        migrate_timer(&synic->stimer[i].timer, v->processor);
 }
 
 static DEFINE_PER_CPU(cpumask_t, ipi_cpumask);
 
+/*
+ * Read the sparse VP set at gpa into vpmask[].  Banks beyond the domain's
+ * vCPUs are skipped rather than rejected, as the set may well describe
+ * all VPs the guest knows of.  Returns false if the set is malformed or
+ * can't be read.
+ */
+static bool hv_vpset_to_vpmask(paddr_t gpa, uint64_t vpmask[HV_VPMASK_BANKS])
+{
+    struct hv_vpset set;
+    unsigned int bank, nr = 0;
+
+    memset(vpmask, 0, HV_VPMASK_BANKS * sizeof(*vpmask));
+
+    if ( hvm_copy_from_guest_phys(&set, gpa, sizeof(set)) != HVMTRANS_okay )
+        return false;
+
+    switch ( set.format )
+    {
+    case HV_GENERIC_SET_ALL:
+        memset(vpmask, 0xff, HV_VPMASK_BANKS * sizeof(*vpmask));
+        return true;
+
+    case HV_GENERIC_SET_SPARSE_4K:
+        break;
+
+    default:
+        return false;
+    }
+
+    for ( bank = 0; bank < 64; bank++ )
+    {
+        if ( !(set.valid_bank_mask & (1ul << bank)) )
+            continue;
+
+        if ( bank < HV_VPMASK_BANKS &&
+             hvm_copy_from_guest_phys(&vpmask[bank],
+                                      gpa + sizeof(set) +
+                                      nr * sizeof(*vpmask),
+                                      sizeof(*vpmask)) != HVMTRANS_okay )
+            return false;
+
+        nr++;
+    }
+
+    return true;
+}
+
+static bool vpmask_test(const uint64_t vpmask[HV_VPMASK_BANKS],
+                        unsigned int vp)
+{
+    return vp < HV_VPMASK_BANKS * 64 &&
+           (vpmask[vp / 64] & (1ul << (vp % 64)));
+}
+
+/*
+ * For each specified virtual CPU flush all ASIDs to invalidate TLB entries
+ * the next time it is scheduled and then, if it is currently running, add
+ * its physical CPU to a mask of those which need to be interrupted to force
+ * a flush.  All those CPUs get interrupted in one go.
+ */
+static void viridian_flush_vcpus(const uint64_t vpmask[HV_VPMASK_BANKS])
+{
+    struct vcpu *curr = current, *v;
+    cpumask_t *pcpu_mask = &this_cpu(ipi_cpumask);
+
+    cpumask_clear(pcpu_mask);
+
+    for_each_vcpu ( curr->domain, v )
+    {
+        if ( !vpmask_test(vpmask, v->vcpu_id) )
+            continue;
+
+        hvm_asid_flush_vcpu(v);
+        if ( v != curr && v->is_running )
+            __cpumask_set_cpu(v->processor, pcpu_mask);
+    }
+
+    /*
+     * Since ASIDs have now been flushed it just remains to force any CPUs
+     * currently running target vCPUs out of non-root mode. It's possible
+     * that re-scheduling has taken place so we may unnecessarily IPI some
+     * CPUs.
+     */
+    if ( !cpumask_empty(pcpu_mask) )
+        smp_send_event_check_mask(pcpu_mask);
+}
+
+static uint16_t viridian_send_ipi(uint32_t vector,
+                                  const uint64_t vpmask[HV_VPMASK_BANKS])
+{
+    struct vcpu *v;
+
+    if ( vector < 0x10 || vector > 0xff )
+        return HV_STATUS_INVALID_PARAMETER;
+
+    for_each_vcpu ( current->domain, v )
+        if ( vpmask_test(vpmask, v->vcpu_id) )
+            vlapic_set_irq(vcpu_vlapic(v), vector, 0);
+
+    return HV_STATUS_SUCCESS;
+}
+
 int viridian_hypercall(struct cpu_user_regs *regs)
 {
     struct vcpu *curr = current;
@@ -892,13 +1524,12 @@ int viridian_hypercall(struct cpu_user_regs *regs)
     case HvFlushVirtualAddressSpace:
     case HvFlushVirtualAddressList:
     {
-        cpumask_t *pcpu_mask;
-        struct vcpu *v;
         struct {
             uint64_t address_space;
             uint64_t flags;
             uint64_t vcpu_mask;
         } input_params;
+        uint64_t vpmask[HV_VPMASK_BANKS] = {};
 
         /*
          * See sections 9.4.2 and 9.4.4 of the specification.
@@ -907,7 +1538,8 @@ int viridian_hypercall(struct cpu_user_regs *regs)
 
         /* These hypercalls should never use the fast-call convention. */
         status = HV_STATUS_INVALID_PARAMETER;
-        if ( input.fast )
+        if ( !(viridian_feature_mask(currd) & HVMPV_hcall_remote_tlb_flush) ||
+             input.fast )
             break;
 
         /* Get input parameters. */
@@ -921,38 +1553,47 @@ int viridian_hypercall(struct cpu_user_regs *regs)
          * so err on the safe side.
          */
         if ( input_params.flags & HV_FLUSH_ALL_PROCESSORS )
-            input_params.vcpu_mask = ~0ul;
+            memset(vpmask, 0xff, sizeof(vpmask));
+        else
+            vpmask[0] = input_params.vcpu_mask;
 
-        pcpu_mask = &this_cpu(ipi_cpumask);
-        cpumask_clear(pcpu_mask);
+        viridian_flush_vcpus(vpmask);
 
-        /*
-         * For each specified virtual CPU flush all ASIDs to invalidate
-         * TLB entries the next time it is scheduled and then, if it
-         * is currently running, add its physical CPU to a mask of
-         * those which need to be interrupted to force a flush.
-         */
-        for_each_vcpu ( currd, v )
-        {
-            if ( v->vcpu_id >= (sizeof(input_params.vcpu_mask) * 8) )
-                break;
+        output.rep_complete = input.rep_count;
 
-            if ( !(input_params.vcpu_mask & (1ul << v->vcpu_id)) )
-                continue;
+        status = HV_STATUS_SUCCESS;
+        break;
+    }
 
-            hvm_asid_flush_vcpu(v);
-            if ( v != curr && v->is_running )
-                __cpumask_set_cpu(v->processor, pcpu_mask);
-        }
+    case HvFlushVirtualAddressSpaceEx:
+    case HvFlushVirtualAddressListEx:
+    {
+        struct {
+            uint64_t address_space;
+            uint64_t flags;
+        } input_params;
+        uint64_t vpmask[HV_VPMASK_BANKS];
 
-        /*
-         * Since ASIDs have now been flushed it just remains to
-         * force any CPUs currently running target vCPUs out of non-
-         * root mode. It's possible that re-scheduling has taken place
-         * so we may unnecessarily IPI some CPUs.
-         */
-        if ( !cpumask_empty(pcpu_mask) )
-            smp_send_event_check_mask(pcpu_mask);
+        /* As the above, but with a sparse VP set following the flags. */
+        perfc_incr(mshv_call_flush_ex);
+
+        status = HV_STATUS_INVALID_PARAMETER;
+        if ( !(viridian_feature_mask(currd) & HVMPV_hcall_remote_tlb_flush) ||
+             !(viridian_feature_mask(currd) & HVMPV_ex_processor_masks) ||
+             input.fast )
+            break;
+
+        if ( hvm_copy_from_guest_phys(&input_params, input_params_gpa,
+                                      sizeof(input_params)) != HVMTRANS_okay )
+            break;
+
+        if ( input_params.flags & HV_FLUSH_ALL_PROCESSORS )
+            memset(vpmask, 0xff, sizeof(vpmask));
+        else if ( !hv_vpset_to_vpmask(input_params_gpa + sizeof(input_params),
+                                      vpmask) )
+            break;
+
+        viridian_flush_vcpus(vpmask);
 
         output.rep_complete = input.rep_count;
 
@@ -960,6 +1601,64 @@ int viridian_hypercall(struct cpu_user_regs *regs)
         break;
     }
 
+    case HvSendSyntheticClusterIpi:
+    {
+        struct {
+            uint32_t vector;
+            uint32_t reserved;
+            uint64_t vcpu_mask;
+        } input_params;
+        uint64_t vpmask[HV_VPMASK_BANKS] = {};
+
+        perfc_incr(mshv_call_ipi);
+
+        status = HV_STATUS_INVALID_PARAMETER;
+        if ( !(viridian_feature_mask(currd) & HVMPV_hcall_ipi) )
+            break;
+
+        /* The fast-call convention passes both words in registers. */
+        if ( input.fast )
+        {
+            input_params.vector = input_params_gpa;
+            input_params.vcpu_mask = output_params_gpa;
+        }
+        else if ( hvm_copy_from_guest_phys(&input_params, input_params_gpa,
+                                           sizeof(input_params)) !=
+                  HVMTRANS_okay )
+            break;
+
+        vpmask[0] = input_params.vcpu_mask;
+        status = viridian_send_ipi(input_params.vector, vpmask);
+        break;
+    }
+
+    case HvSendSyntheticClusterIpiEx:
+    {
+        struct {
+            uint32_t vector;
+            uint32_t reserved;
+        } input_params;
+        uint64_t vpmask[HV_VPMASK_BANKS];
+
+        perfc_incr(mshv_call_ipi_ex);
+
+        /* The fast-call form would need XMM input, which isn't offered. */
+        status = HV_STATUS_INVALID_PARAMETER;
+        if ( !(viridian_feature_mask(currd) & HVMPV_hcall_ipi) ||
+             !(viridian_feature_mask(currd) & HVMPV_ex_processor_masks) ||
+             input.fast )
+            break;
+
+        if ( hvm_copy_from_guest_phys(&input_params, input_params_gpa,
+                                      sizeof(input_params)) != HVMTRANS_okay ||
+             !hv_vpset_to_vpmask(input_params_gpa + sizeof(input_params),
+                                 vpmask) )
+            break;
+
+        status = viridian_send_ipi(input_params.vector, vpmask);
+        break;
+    }
+
     default:
         gprintk(XENLOG_WARNING, "unimplemented hypercall %04x\n",
                 input.call_code);
@@ -1028,30 +1727,42 @@ static int viridian_load_domain_ctxt(struct domain *d, hvm_domain_context_t *h)
 HVM_REGISTER_SAVE_RESTORE(VIRIDIAN_DOMAIN, viridian_save_domain_ctxt,
                           viridian_load_domain_ctxt, 1, HVMSR_PER_DOM);
 
-static int viridian_save_vcpu_ctxt(struct domain *d, hvm_domain_context_t *h)
+static int viridian_save_vcpu_ctxt(struct vcpu *v, hvm_domain_context_t *h)
 {
-    struct vcpu *v;
+    struct viridian_vcpu *vv = &v->arch.hvm_vcpu.viridian;
+    struct hvm_viridian_vcpu_context ctxt;
+    unsigned int i;
 
-    if ( !is_viridian_domain(d) )
+    if ( !is_viridian_domain(v->domain) )
         return 0;
 
-    for_each_vcpu( d, v ) {
-        struct hvm_viridian_vcpu_context ctxt = {
-            .vp_assist_msr = v->arch.hvm_vcpu.viridian.vp_assist.msr.raw,
-            .vp_assist_pending = v->arch.hvm_vcpu.viridian.vp_assist.pending,
-        };
+    ctxt = (struct hvm_viridian_vcpu_context){
+        .vp_assist_msr = vv->vp_assist.msr.raw,
+        .vp_assist_pending = vv->vp_assist.pending,
+        .scontrol_msr = vv->synic->scontrol,
+        .siefp_msr = vv->synic->siefp.raw,
+        .simp_msr = vv->synic->simp.raw,
+        .stimer_pending = vv->synic->stimer_pending,
+    };
+
+    for ( i = 0; i < ARRAY_SIZE(vv->synic->sint); i++ )
+        ctxt.sint_msr[i] = vv->synic->sint[i].raw;
 
-        if ( hvm_save_entry(VIRIDIAN_VCPU, v->vcpu_id, h, &ctxt) != 0 )
-            return 1;
+    for ( i = 0; i < ARRAY_SIZE(vv->synic->stimer); i++ )
+    {
+        ctxt.stimer_config_msr[i] = vv->synic->stimer[i].config.raw;
+        ctxt.stimer_count_msr[i] = vv->synic->stimer[i].count;
     }
 
-    return 0;
+    return hvm_save_entry(VIRIDIAN_VCPU, v->vcpu_id, h, &ctxt);
 }
 
 static int viridian_load_vcpu_ctxt(struct domain *d, hvm_domain_context_t *h)
 {
     int vcpuid;
+    unsigned int i;
     struct vcpu *v;
+    struct viridian_vcpu *vv;
     struct hvm_viridian_vcpu_context ctxt;
 
     vcpuid = hvm_load_instance(h);
@@ -1065,21 +1776,52 @@ static int viridian_load_vcpu_ctxt(struct domain *d, hvm_domain_context_t *h)
     if ( hvm_load_entry_zeroextend(VIRIDIAN_VCPU, h, &ctxt) != 0 )
         return -EINVAL;
 
-    if ( memcmp(&ctxt._pad, zero_page, sizeof(ctxt._pad)) )
+    if ( memcmp(&ctxt._pad, zero_page, sizeof(ctxt._pad)) ||
+         memcmp(&ctxt._pad2, zero_page, sizeof(ctxt._pad2)) )
         return -EINVAL;
 
-    v->arch.hvm_vcpu.viridian.vp_assist.msr.raw = ctxt.vp_assist_msr;
-    if ( v->arch.hvm_vcpu.viridian.vp_assist.msr.fields.enabled &&
-         !v->arch.hvm_vcpu.viridian.vp_assist.va )
+    vv = &v->arch.hvm_vcpu.viridian;
+
+    vv->vp_assist.msr.raw = ctxt.vp_assist_msr;
+    if ( vv->vp_assist.msr.fields.enabled && !vv->vp_assist.va )
         initialize_vp_assist(v);
 
-    v->arch.hvm_vcpu.viridian.vp_assist.pending = !!ctxt.vp_assist_pending;
+    vv->vp_assist.pending = !!ctxt.vp_assist_pending;
+
+    /*
+     * Records from older hypervisors are zero extended, which leaves
+     * the SINTs unmasked, but with SCONTROL clear nothing is delivered.
+     */
+    vv->synic->scontrol = ctxt.scontrol_msr;
+    vv->synic->siefp.raw = ctxt.siefp_msr;
+
+    teardown_simp(v);
+    vv->synic->simp.raw = ctxt.simp_msr;
+    if ( vv->synic->simp.fields.enabled )
+        initialize_simp(v, false);
+
+    for ( i = 0; i < ARRAY_SIZE(vv->synic->sint); i++ )
+        vv->synic->sint[i].raw = ctxt.sint_msr[i];
+
+    for ( i = 0; i < ARRAY_SIZE(vv->synic->stimer); i++ )
+    {
+        struct viridian_stimer *vs = &vv->synic->stimer[i];
+
+        stimer_stop(vs);
+        vs->config.raw = ctxt.stimer_config_msr[i];
+        vs->count = ctxt.stimer_count_msr[i];
+        if ( vs->config.fields.enabled && vs->count )
+            stimer_start(vs);
+    }
+
+    vv->synic->stimer_pending |= ctxt.stimer_pending &
+                          ((1ul << ARRAY_SIZE(vv->synic->stimer)) - 1);
 
     return 0;
 }
 
-HVM_REGISTER_SAVE_RESTORE(VIRIDIAN_VCPU, viridian_save_vcpu_ctxt,
-                          viridian_load_vcpu_ctxt, 1, HVMSR_PER_VCPU);
+HVM_REGISTER_SAVE_RESTORE_VCPU(VIRIDIAN_VCPU, viridian_save_vcpu_ctxt,
+                               viridian_load_vcpu_ctxt);
 
 static int __init parse_viridian_version(const char *arg)
 {
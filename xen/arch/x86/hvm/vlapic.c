@@ -487,6 +487,35 @@ static bool_t is_multicast_dest(struct vlapic *vlapic, unsigned int short_hand,
     return dest == 0xff;
 }
 
+/*
+ * Find the single destination of an IPI without scanning all vCPUs, where
+ * that is possible: self-IPIs, and physical destinations in x2APIC mode,
+ * where APIC IDs are read-only and derived from the vCPU ID.
+ */
+static struct vcpu *vlapic_single_dest(struct vlapic *vlapic,
+                                       unsigned int short_hand, uint32_t dest,
+                                       bool_t dest_mode)
+{
+    const struct domain *d = vlapic_domain(vlapic);
+    struct vcpu *v;
+
+    if ( short_hand == APIC_DEST_SELF )
+        return vlapic_vcpu(vlapic);
+
+    /* Also excludes the broadcast ID, which is odd. */
+    if ( short_hand || dest_mode || !vlapic_x2apic_mode(vlapic) ||
+         (dest & 1) || dest / 2 >= d->max_vcpus )
+        return NULL;
+
+    v = d->vcpu[dest / 2];
+    if ( !v || !vlapic_x2apic_mode(vcpu_vlapic(v)) )
+        return NULL;
+
+    ASSERT(VLAPIC_ID(vcpu_vlapic(v)) == dest);
+
+    return v;
+}
+
 void vlapic_ipi(
     struct vlapic *vlapic, uint32_t icr_low, uint32_t icr_high)
 {
@@ -532,11 +561,22 @@ void vlapic_ipi(
         }
         /* fall through */
     default: {
-        struct vcpu *v;
-        bool_t batch = is_multicast_dest(vlapic, short_hand, dest, dest_mode);
+        struct vcpu *v = vlapic_single_dest(vlapic, short_hand, dest,
+                                            dest_mode);
+        bool_t batch;
+
+        if ( v )
+        {
+            vlapic_accept_irq(v, icr_low);
+            break;
+        }
 
+        batch = is_multicast_dest(vlapic, short_hand, dest, dest_mode);
         if ( batch )
+        {
             cpu_raise_softirq_batch_begin();
+            hvm_posted_intr_batch_begin();
+        }
         for_each_vcpu ( vlapic_domain(vlapic), v )
         {
             if ( vlapic_match_dest(vcpu_vlapic(v), vlapic,
@@ -544,7 +584,10 @@ void vlapic_ipi(
                 vlapic_accept_irq(v, icr_low);
         }
         if ( batch )
+        {
+            hvm_posted_intr_batch_finish();
             cpu_raise_softirq_batch_finish();
+        }
         break;
     }
     }
@@ -1271,6 +1314,13 @@ int vlapic_has_pending_irq(struct vcpu *v)
     if ( !vlapic_enabled(vlapic) )
         return -1;
 
+    /*
+     * Deliver any expired synthetic timers first, since doing so may
+     * assert a vector in the IRR.
+     */
+    if ( has_viridian_synic(v->domain) )
+        viridian_synic_poll(v);
+
     irr = vlapic_find_highest_irr(vlapic);
     if ( irr == -1 )
         return -1;
@@ -1432,45 +1482,23 @@ static void lapic_rearm(struct vlapic *s)
     s->timer_last_update = s->pt.last_plt_gtime;
 }
 
-static int lapic_save_hidden(struct domain *d, hvm_domain_context_t *h)
+static int lapic_save_hidden(struct vcpu *v, hvm_domain_context_t *h)
 {
-    struct vcpu *v;
-    struct vlapic *s;
-    int rc = 0;
-
-    if ( !has_vlapic(d) )
+    if ( !has_vlapic(v->domain) )
         return 0;
 
-    for_each_vcpu ( d, v )
-    {
-        s = vcpu_vlapic(v);
-        if ( (rc = hvm_save_entry(LAPIC, v->vcpu_id, h, &s->hw)) != 0 )
-            break;
-    }
-
-    return rc;
+    return hvm_save_entry(LAPIC, v->vcpu_id, h, &vcpu_vlapic(v)->hw);
 }
 
-static int lapic_save_regs(struct domain *d, hvm_domain_context_t *h)
+static int lapic_save_regs(struct vcpu *v, hvm_domain_context_t *h)
 {
-    struct vcpu *v;
-    struct vlapic *s;
-    int rc = 0;
-
-    if ( !has_vlapic(d) )
+    if ( !has_vlapic(v->domain) )
         return 0;
 
-    for_each_vcpu ( d, v )
-    {
-        if ( hvm_funcs.sync_pir_to_irr )
-            hvm_funcs.sync_pir_to_irr(v);
-
-        s = vcpu_vlapic(v);
-        if ( (rc = hvm_save_entry(LAPIC_REGS, v->vcpu_id, h, s->regs)) != 0 )
-            break;
-    }
+    if ( hvm_funcs.sync_pir_to_irr )
+        hvm_funcs.sync_pir_to_irr(v);
 
-    return rc;
+    return hvm_save_entry(LAPIC_REGS, v->vcpu_id, h, vcpu_vlapic(v)->regs);
 }
 
 /*
@@ -1573,10 +1601,8 @@ static int lapic_load_regs(struct domain *d, hvm_domain_context_t *h)
     return 0;
 }
 
-HVM_REGISTER_SAVE_RESTORE(LAPIC, lapic_save_hidden, lapic_load_hidden,
-                          1, HVMSR_PER_VCPU);
-HVM_REGISTER_SAVE_RESTORE(LAPIC_REGS, lapic_save_regs, lapic_load_regs,
-                          1, HVMSR_PER_VCPU);
+HVM_REGISTER_SAVE_RESTORE_VCPU(LAPIC, lapic_save_hidden, lapic_load_hidden);
+HVM_REGISTER_SAVE_RESTORE_VCPU(LAPIC_REGS, lapic_save_regs, lapic_load_regs);
 
 int vlapic_init(struct vcpu *v)
 {
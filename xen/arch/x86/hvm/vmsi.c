@@ -31,6 +31,7 @@
 #include <xen/errno.h>
 #include <xen/sched.h>
 #include <xen/irq.h>
+#include <xen/perfc.h>
 #include <public/hvm/ioreq.h>
 #include <asm/hvm/io.h>
 #include <asm/hvm/vpic.h>
@@ -149,17 +150,18 @@ struct msixtbl_entry
 
     /* TODO: resolve the potential race by destruction of pdev */
     struct pci_dev *pdev;
+    struct domain *domain;
     unsigned long gtable;       /* gpa of msix table */
     DECLARE_BITMAP(table_flags, MAX_MSIX_TABLE_ENTRIES);
-#define MAX_MSIX_ACC_ENTRIES 3
     unsigned int table_len;
-    struct { 
+    struct rcu_head rcu;
+    /* One per table entry. */
+    struct {
         uint32_t msi_ad[3];	/* Shadow of address low, high and data */
-    } gentries[MAX_MSIX_ACC_ENTRIES];
-    DECLARE_BITMAP(acc_valid, 3 * MAX_MSIX_ACC_ENTRIES);
+        unsigned int acc_valid;	/* Which of the above are known */
+    } gentries[];
 #define acc_bit(what, ent, slot, idx) \
-        what##_bit((slot) * 3 + (idx), (ent)->acc_valid)
-    struct rcu_head rcu;
+        what##_bit(idx, &(ent)->gentries[slot].acc_valid)
 };
 
 static DEFINE_RCU_READ_LOCK(msixtbl_rcu_lock);
@@ -180,10 +182,23 @@ static struct msixtbl_entry *msixtbl_find_entry(
     struct msixtbl_entry *entry;
     struct domain *d = v->domain;
 
+    /*
+     * Accepting, handling, and completing an access each look the table up,
+     * and guests tend to program one device at a time, so try the table
+     * found last before walking the list.
+     */
+    entry = rcu_dereference(d->arch.hvm_domain.msixtbl_last);
+    if ( entry && addr >= entry->gtable &&
+         addr < entry->gtable + entry->table_len )
+        return entry;
+
     list_for_each_entry( entry, &d->arch.hvm_domain.msixtbl_list, list )
         if ( addr >= entry->gtable &&
              addr < entry->gtable + entry->table_len )
+        {
+            write_atomic(&d->arch.hvm_domain.msixtbl_last, entry);
             return entry;
+        }
 
     return NULL;
 }
@@ -229,8 +244,7 @@ static int msixtbl_read(const struct hvm_io_handler *handler,
     {
         nr_entry = (address - entry->gtable) / PCI_MSIX_ENTRY_SIZE;
         index = offset / sizeof(uint32_t);
-        if ( nr_entry >= MAX_MSIX_ACC_ENTRIES ||
-             !acc_bit(test, entry, nr_entry, index) )
+        if ( !acc_bit(test, entry, nr_entry, index) )
             goto out;
         *pval = entry->gentries[nr_entry].msi_ad[index];
         if ( len == 8 )
@@ -260,9 +274,27 @@ static int msixtbl_read(const struct hvm_io_handler *handler,
     r = X86EMUL_OKAY;
 out:
     rcu_read_unlock(&msixtbl_rcu_lock);
+    if ( r != X86EMUL_OKAY )
+        perfc_incr(msixtbl_dm_read);
     return r;
 }
 
+/*
+ * Record a guest write to the address or data fields of a table entry.
+ * Returns whether the value is known to be unchanged.
+ */
+static bool msixtbl_shadow(struct msixtbl_entry *entry, unsigned int nr_entry,
+                           unsigned int index, uint32_t val)
+{
+    bool same = acc_bit(test, entry, nr_entry, index) &&
+                entry->gentries[nr_entry].msi_ad[index] == val;
+
+    entry->gentries[nr_entry].msi_ad[index] = val;
+    acc_bit(set, entry, nr_entry, index);
+
+    return same;
+}
+
 static int msixtbl_write(struct vcpu *v, unsigned long address,
                          unsigned int len, unsigned long val)
 {
@@ -287,18 +319,22 @@ static int msixtbl_write(struct vcpu *v, unsigned long address,
     offset = address & (PCI_MSIX_ENTRY_SIZE - 1);
     if ( offset != PCI_MSIX_ENTRY_VECTOR_CTRL_OFFSET )
     {
+        bool same;
+
         index = offset / sizeof(uint32_t);
-        if ( nr_entry < MAX_MSIX_ACC_ENTRIES ) 
-        {
-            entry->gentries[nr_entry].msi_ad[index] = val;
-            acc_bit(set, entry, nr_entry, index);
-            if ( len == 8 && !index )
-            {
-                entry->gentries[nr_entry].msi_ad[1] = val >> 32;
-                acc_bit(set, entry, nr_entry, 1);
-            }
-        }
-        set_bit(nr_entry, &entry->table_flags);
+        same = msixtbl_shadow(entry, nr_entry, index, val);
+        if ( len == 8 && !index )
+            same &= msixtbl_shadow(entry, nr_entry, 1, val >> 32);
+
+        /*
+         * Rewriting the values already in place (which the device model
+         * ignores as well) needs no re-binding, so it doesn't require the
+         * next unmask to be forwarded.
+         */
+        if ( !same )
+            set_bit(nr_entry, &entry->table_flags);
+        else
+            perfc_incr(msixtbl_same);
         if ( len != 8 || !index )
             goto out;
         val >>= 32;
@@ -310,6 +346,7 @@ static int msixtbl_write(struct vcpu *v, unsigned long address,
          test_and_clear_bit(nr_entry, &entry->table_flags) )
     {
         v->arch.hvm_vcpu.hvm_io.msix_unmask_address = address;
+        perfc_incr(msixtbl_dm_unmask);
         goto out;
     }
 
@@ -329,6 +366,7 @@ static int msixtbl_write(struct vcpu *v, unsigned long address,
     ASSERT(msi_desc == desc->msi_desc);
    
     guest_mask_msi_irq(desc, !!(val & PCI_MSIX_VECTOR_BITMASK));
+    perfc_incr(msixtbl_mask);
 
 unlock:
     spin_unlock_irqrestore(&desc->lock, flags);
@@ -337,6 +375,8 @@ unlock:
 
 out:
     rcu_read_unlock(&msixtbl_rcu_lock);
+    if ( r != X86EMUL_OKAY )
+        perfc_incr(msixtbl_dm_write);
     return r;
 }
 
@@ -351,12 +391,39 @@ static bool_t msixtbl_range(const struct hvm_io_handler *handler,
 {
     struct vcpu *curr = current;
     unsigned long addr = r->addr;
+    struct msixtbl_entry *entry;
     const struct msi_desc *desc;
 
     ASSERT(r->type == IOREQ_TYPE_COPY);
 
     rcu_read_lock(&msixtbl_rcu_lock);
-    desc = msixtbl_addr_to_desc(msixtbl_find_entry(curr, addr), addr);
+    entry = msixtbl_find_entry(curr, addr);
+    desc = msixtbl_addr_to_desc(entry, addr);
+    if ( !desc && entry && r->dir == IOREQ_WRITE )
+    {
+        /*
+         * Writes to entries not currently bound go straight to the device
+         * model, bypassing msixtbl_write(): forget what's known about all
+         * entries the access covers.
+         */
+        unsigned long first = addr, last = addr + r->size - 1;
+        unsigned int i;
+
+        if ( r->count > 1 )
+        {
+            if ( r->df )
+                first -= (r->count - 1) * (unsigned long)r->size;
+            else
+                last += (r->count - 1) * (unsigned long)r->size;
+        }
+        first = max(first, entry->gtable);
+        last = min(last, entry->gtable + entry->table_len - 1);
+        for ( i = (first - entry->gtable) / PCI_MSIX_ENTRY_SIZE;
+              first <= last && i <= (last - entry->gtable) / PCI_MSIX_ENTRY_SIZE;
+              i++ )
+            write_atomic(&entry->gentries[i].acc_valid, 0);
+        perfc_incr(msixtbl_dm_unbound);
+    }
     rcu_read_unlock(&msixtbl_rcu_lock);
 
     if ( desc )
@@ -426,6 +493,7 @@ static void add_msixtbl_entry(struct domain *d,
 
     entry->table_len = pdev->msix->nr_entries * PCI_MSIX_ENTRY_SIZE;
     entry->pdev = pdev;
+    entry->domain = d;
     entry->gtable = (unsigned long) gtable;
 
     list_add_rcu(&entry->list, &d->arch.hvm_domain.msixtbl_list);
@@ -440,10 +508,23 @@ static void free_msixtbl_entry(struct rcu_head *rcu)
     xfree(entry);
 }
 
+static void forget_msixtbl_entry(struct rcu_head *rcu)
+{
+    struct msixtbl_entry *entry = container_of(rcu, struct msixtbl_entry, rcu);
+
+    /*
+     * Lookups can't find the entry on the list anymore, and hence can't
+     * install it as the last one looked up.  Those which picked it up from
+     * there may still be using it though.
+     */
+    (void)cmpxchg(&entry->domain->arch.hvm_domain.msixtbl_last, entry, NULL);
+    call_rcu(&entry->rcu, free_msixtbl_entry);
+}
+
 static void del_msixtbl_entry(struct msixtbl_entry *entry)
 {
     list_del_rcu(&entry->list);
-    call_rcu(&entry->rcu, free_msixtbl_entry);
+    call_rcu(&entry->rcu, forget_msixtbl_entry);
 }
 
 int msixtbl_pt_register(struct domain *d, struct pirq *pirq, uint64_t gtable)
@@ -451,7 +532,8 @@ int msixtbl_pt_register(struct domain *d, struct pirq *pirq, uint64_t gtable)
     struct irq_desc *irq_desc;
     struct msi_desc *msi_desc;
     struct pci_dev *pdev;
-    struct msixtbl_entry *entry, *new_entry;
+    struct msixtbl_entry *entry, *new_entry = NULL;
+    unsigned int nr_entries = 0;
     int r = -EINVAL;
 
     ASSERT(pcidevs_locked());
@@ -460,14 +542,7 @@ int msixtbl_pt_register(struct domain *d, struct pirq *pirq, uint64_t gtable)
     if ( !msixtbl_initialised(d) )
         return -ENODEV;
 
-    /*
-     * xmalloc() with irq_disabled causes the failure of check_lock() 
-     * for xenpool->lock. So we allocate an entry beforehand.
-     */
-    new_entry = xzalloc(struct msixtbl_entry);
-    if ( !new_entry )
-        return -ENOMEM;
-
+ retry:
     irq_desc = pirq_spin_lock_irq_desc(pirq, NULL);
     if ( !irq_desc )
     {
@@ -485,6 +560,23 @@ int msixtbl_pt_register(struct domain *d, struct pirq *pirq, uint64_t gtable)
         if ( pdev == entry->pdev )
             goto found;
 
+    if ( !new_entry || nr_entries < pdev->msix->nr_entries )
+    {
+        /*
+         * xmalloc() with irq_disabled causes the failure of check_lock()
+         * for xenpool->lock. So we allocate an entry (sized by the number
+         * of table entries) with the lock dropped, and look again.
+         */
+        nr_entries = pdev->msix->nr_entries;
+        spin_unlock_irq(&irq_desc->lock);
+        xfree(new_entry);
+        new_entry = xzalloc_bytes(sizeof(*new_entry) +
+                                  nr_entries * sizeof(new_entry->gentries[0]));
+        if ( !new_entry )
+            return -ENOMEM;
+        goto retry;
+    }
+
     entry = new_entry;
     new_entry = NULL;
     add_msixtbl_entry(d, pdev, gtable, entry);
@@ -581,9 +673,15 @@ void msixtbl_pt_cleanup(struct domain *d)
 
     spin_lock(&d->event_lock);
 
+    /* The domain is dead, nothing can be looking up entries anymore. */
+    d->arch.hvm_domain.msixtbl_last = NULL;
+
     list_for_each_entry_safe( entry, temp,
                               &d->arch.hvm_domain.msixtbl_list, list )
-        del_msixtbl_entry(entry);
+    {
+        list_del_rcu(&entry->list);
+        call_rcu(&entry->rcu, free_msixtbl_entry);
+    }
 
     spin_unlock(&d->event_lock);
 }
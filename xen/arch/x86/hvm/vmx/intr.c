@@ -73,7 +73,7 @@ static void vmx_enable_intr_window(struct vcpu *v, struct hvm_intack intack)
 
     ASSERT(intack.source != hvm_intsrc_none);
 
-    if ( unlikely(tb_init_done) )
+    if ( tb_tracing() )
     {
         unsigned long intr;
 
@@ -66,6 +66,7 @@ integer_param("ple_window", ple_window);
 
 static bool_t __read_mostly opt_pml_enabled = 1;
 static s8 __read_mostly opt_ept_ad = -1;
+bool __read_mostly opt_ept_coalesce = true;
 
 /*
  * The 'ept' parameter controls functionalities that depend on, or impact the
@@ -93,6 +94,8 @@ static int __init parse_ept_param(const char *s)
             opt_pml_enabled = val;
         else if ( !strncmp(s, "ad", ss - s) )
             opt_ept_ad = val;
+        else if ( !strncmp(s, "coalesce", ss - s) )
+            opt_ept_coalesce = val;
         else
             rc = -EINVAL;
 
@@ -36,6 +36,7 @@
 #include <asm/p2m.h>
 #include <asm/mem_sharing.h>
 #include <asm/hvm/emulate.h>
+#include <asm/hvm/exit_stats.h>
 #include <asm/hvm/hvm.h>
 #include <asm/hvm/support.h>
 #include <asm/hvm/vmx/vmx.h>
@@ -80,6 +81,7 @@ static int vmx_vmfunc_intercept(struct cpu_user_regs *regs);
 struct vmx_pi_blocking_vcpu {
     struct list_head     list;
     spinlock_t           lock;
+    unsigned int         counter;   /* Entries on the list, under lock. */
 };
 
 /*
@@ -88,6 +90,18 @@ struct vmx_pi_blocking_vcpu {
  */
 static DEFINE_PER_CPU(struct vmx_pi_blocking_vcpu, vmx_pi_blocking);
 
+/*
+ * The wakeup handler walks the whole list of the pCPU it runs on.  To keep
+ * that walk bounded, no list is allowed to grow much beyond its fair share
+ * of all blocked vCPUs: blocking vCPUs (and the ones left behind by an
+ * offlined pCPU) get queued on another pCPU instead, with the notification
+ * destination of their descriptor pointed there.
+ */
+static atomic_t vmx_pi_blocked_vcpus = ATOMIC_INIT(0);
+#define PI_LIST_SLACK 32
+#define PI_LIST_LIMIT (atomic_read(&vmx_pi_blocked_vcpus) / \
+                       num_online_cpus() + PI_LIST_SLACK)
+
 uint8_t __read_mostly posted_intr_vector;
 static uint8_t __read_mostly pi_wakeup_vector;
 
@@ -95,17 +109,55 @@ void vmx_pi_per_cpu_init(unsigned int cpu)
 {
     INIT_LIST_HEAD(&per_cpu(vmx_pi_blocking, cpu).list);
     spin_lock_init(&per_cpu(vmx_pi_blocking, cpu).lock);
+    per_cpu(vmx_pi_blocking, cpu).counter = 0;
+}
+
+/*
+ * Pick the (online) pCPU whose blocking list to put a vCPU on, starting
+ * with @cpu and moving on to the next ones if its list is over the limit.
+ * The counters are sampled without their locks: this is only a heuristic.
+ */
+static unsigned int vmx_pi_pick_cpu(unsigned int cpu)
+{
+    unsigned int limit = PI_LIST_LIMIT, best = cpu, i = cpu, n;
+    unsigned int best_count = UINT_MAX;
+
+    do {
+        n = read_atomic(&per_cpu(vmx_pi_blocking, i).counter);
+        if ( n < limit )
+            return i;
+        if ( n < best_count )
+        {
+            best_count = n;
+            best = i;
+        }
+        i = cpumask_cycle(i, &cpu_online_map);
+    } while ( i != cpu && i < nr_cpu_ids );
+
+    return best;
 }
 
 static void vmx_vcpu_block(struct vcpu *v)
 {
     unsigned long flags;
-    unsigned int dest;
+    unsigned int dest, pi_cpu = v->processor;
     spinlock_t *old_lock;
-    spinlock_t *pi_blocking_list_lock =
-		&per_cpu(vmx_pi_blocking, v->processor).lock;
+    spinlock_t *pi_blocking_list_lock;
     struct pi_desc *pi_desc = &v->arch.hvm_vmx.pi_desc;
 
+    ASSERT(!pi_test_sn(pi_desc));
+
+    dest = cpu_physical_id(v->processor);
+
+    ASSERT(pi_desc->ndst ==
+           (x2apic_enabled ? dest : MASK_INSR(dest, PI_xAPIC_NDST_MASK)));
+
+    if ( unlikely(read_atomic(&per_cpu(vmx_pi_blocking, pi_cpu).counter) >=
+                  PI_LIST_LIMIT) )
+        pi_cpu = vmx_pi_pick_cpu(pi_cpu);
+
+    pi_blocking_list_lock = &per_cpu(vmx_pi_blocking, pi_cpu).lock;
+
     spin_lock_irqsave(pi_blocking_list_lock, flags);
     old_lock = cmpxchg(&v->arch.hvm_vmx.pi_blocking.lock, NULL,
                        pi_blocking_list_lock);
@@ -118,15 +170,23 @@ static void vmx_vcpu_block(struct vcpu *v)
     ASSERT(old_lock == NULL);
 
     list_add_tail(&v->arch.hvm_vmx.pi_blocking.list,
-                  &per_cpu(vmx_pi_blocking, v->processor).list);
-    spin_unlock_irqrestore(pi_blocking_list_lock, flags);
+                  &per_cpu(vmx_pi_blocking, pi_cpu).list);
+    per_cpu(vmx_pi_blocking, pi_cpu).counter++;
+    atomic_inc(&vmx_pi_blocked_vcpus);
 
-    ASSERT(!pi_test_sn(pi_desc));
-
-    dest = cpu_physical_id(v->processor);
+    /*
+     * The wakeup event needs to go to the pCPU owning the list.  NDST gets
+     * set back to v->processor by vmx_pi_switch_to() once the vCPU runs
+     * again.
+     */
+    if ( pi_cpu != v->processor )
+    {
+        dest = cpu_physical_id(pi_cpu);
+        write_atomic(&pi_desc->ndst,
+                     x2apic_enabled ? dest : MASK_INSR(dest, PI_xAPIC_NDST_MASK));
+    }
 
-    ASSERT(pi_desc->ndst ==
-           (x2apic_enabled ? dest : MASK_INSR(dest, PI_xAPIC_NDST_MASK)));
+    spin_unlock_irqrestore(pi_blocking_list_lock, flags);
 
     write_atomic(&pi_desc->nv, pi_wakeup_vector);
 }
@@ -184,6 +244,9 @@ static void vmx_pi_unblock_vcpu(struct vcpu *v)
     {
         ASSERT(v->arch.hvm_vmx.pi_blocking.lock == pi_blocking_list_lock);
         list_del(&v->arch.hvm_vmx.pi_blocking.list);
+        container_of(pi_blocking_list_lock,
+                     struct vmx_pi_blocking_vcpu, lock)->counter--;
+        atomic_dec(&vmx_pi_blocked_vcpus);
         v->arch.hvm_vmx.pi_blocking.lock = NULL;
     }
 
@@ -232,6 +295,8 @@ void vmx_pi_desc_fixup(unsigned int cpu)
         if ( pi_test_on(&vmx->pi_desc) )
         {
             list_del(&vmx->pi_blocking.list);
+            per_cpu(vmx_pi_blocking, cpu).counter--;
+            atomic_dec(&vmx_pi_blocked_vcpus);
             vmx->pi_blocking.lock = NULL;
             vcpu_unblock(container_of(vmx, struct vcpu, arch.hvm_vmx));
         }
@@ -241,9 +306,10 @@ void vmx_pi_desc_fixup(unsigned int cpu)
              * We need to find an online cpu as the NDST of the PI descriptor, it
              * doesn't matter whether it is within the cpupool of the domain or
              * not. As long as it is online, the vCPU will be woken up once the
-             * notification event arrives.
+             * notification event arrives.  Spread the vCPUs rather than
+             * piling all of them onto a single list.
              */
-            new_cpu = cpumask_any(&cpu_online_map);
+            new_cpu = vmx_pi_pick_cpu(cpumask_cycle(cpu, &cpu_online_map));
             new_lock = &per_cpu(vmx_pi_blocking, new_cpu).lock;
 
             spin_lock(new_lock);
@@ -256,6 +322,8 @@ void vmx_pi_desc_fixup(unsigned int cpu)
 
             list_move(&vmx->pi_blocking.list,
                       &per_cpu(vmx_pi_blocking, new_cpu).list);
+            per_cpu(vmx_pi_blocking, cpu).counter--;
+            per_cpu(vmx_pi_blocking, new_cpu).counter++;
             vmx->pi_blocking.lock = new_lock;
 
             spin_unlock(new_lock);
@@ -497,7 +565,7 @@ static int long_mode_do_msr_read(unsigned int msr, uint64_t *msr_content)
         break;
 
     case MSR_SHADOW_GS_BASE:
-        rdmsrl(MSR_SHADOW_GS_BASE, *msr_content);
+        *msr_content = rdgsshadow();
         break;
 
     case MSR_STAR:
@@ -544,7 +612,7 @@ static int long_mode_do_msr_write(unsigned int msr, uint64_t msr_content)
         else if ( msr == MSR_GS_BASE )
             __vmwrite(GUEST_GS_BASE, msr_content);
         else
-            wrmsrl(MSR_SHADOW_GS_BASE, msr_content);
+            wrgsshadow(msr_content);
 
         break;
 
@@ -598,12 +666,12 @@ static void vmx_save_guest_msrs(struct vcpu *v)
      * We cannot cache SHADOW_GS_BASE while the VCPU runs, as it can
      * be updated at any time via SWAPGS, which we cannot trap.
      */
-    rdmsrl(MSR_SHADOW_GS_BASE, v->arch.hvm_vmx.shadow_gs);
+    v->arch.hvm_vmx.shadow_gs = rdgsshadow();
 }
 
 static void vmx_restore_guest_msrs(struct vcpu *v)
 {
-    wrmsrl(MSR_SHADOW_GS_BASE, v->arch.hvm_vmx.shadow_gs);
+    wrgsshadow(v->arch.hvm_vmx.shadow_gs);
     wrmsrl(MSR_STAR,           v->arch.hvm_vmx.star);
     wrmsrl(MSR_LSTAR,          v->arch.hvm_vmx.lstar);
     wrmsrl(MSR_SYSCALL_MASK,   v->arch.hvm_vmx.sfmask);
@@ -1019,6 +1087,8 @@ static void vmx_ctxt_switch_from(struct vcpu *v)
     if ( unlikely(!this_cpu(vmxon)) )
         return;
 
+    hvm_exit_stats_end(v);
+
     if ( !v->is_running )
     {
         /*
@@ -1550,6 +1620,8 @@ void vmx_update_debug_state(struct vcpu *v)
 
 static void vmx_update_guest_cr(struct vcpu *v, unsigned int cr)
 {
+    hvm_vcpu_io_flush_insn_cache(&v->arch.hvm_vcpu.hvm_io);
+
     vmx_vmcs_enter(v);
 
     switch ( cr )
@@ -1714,6 +1786,8 @@ static void vmx_update_guest_efer(struct vcpu *v)
 {
     unsigned long vm_entry_value;
 
+    hvm_vcpu_io_flush_insn_cache(&v->arch.hvm_vcpu.hvm_io);
+
     vmx_vmcs_enter(v);
 
     __vmread(VM_ENTRY_CONTROLS, &vm_entry_value);
@@ -2011,6 +2085,30 @@ static void vmx_process_isr(int isr, struct vcpu *v)
     vmx_vmcs_exit(v);
 }
 
+static DEFINE_PER_CPU(cpumask_t, pi_batch_mask);
+static DEFINE_PER_CPU(unsigned int, pi_batching);
+
+static void vmx_posted_intr_batch_begin(void)
+{
+    ++this_cpu(pi_batching);
+}
+
+static void vmx_posted_intr_batch_finish(void)
+{
+    cpumask_t *mask = &this_cpu(pi_batch_mask);
+
+    ASSERT(this_cpu(pi_batching));
+
+    if ( --this_cpu(pi_batching) )
+        return;
+
+    if ( !cpumask_empty(mask) )
+    {
+        send_IPI_mask(mask, posted_intr_vector);
+        cpumask_clear(mask);
+    }
+}
+
 static void __vmx_deliver_posted_interrupt(struct vcpu *v)
 {
     bool_t running = v->is_running;
@@ -2053,9 +2151,17 @@ static void __vmx_deliver_posted_interrupt(struct vcpu *v)
          * local_events_need_delivery() just after blocking, the vCPU must
          * have synced PIR to vIRR. Similarly, there is a IPI and a softirq
          * sent to a wrong vCPU.
+         *
+         * The same holds if the notification is deferred to the end of a
+         * batch, which merely widens that window.
          */
         if ( cpu != smp_processor_id() )
-            send_IPI_mask(cpumask_of(cpu), posted_intr_vector);
+        {
+            if ( this_cpu(pi_batching) && !in_irq() )
+                __cpumask_set_cpu(cpu, &this_cpu(pi_batch_mask));
+            else
+                send_IPI_mask(cpumask_of(cpu), posted_intr_vector);
+        }
         /*
          * For case 2, raising a softirq ensures PIR will be synced to vIRR.
          * As any softirq will do, as an optimization we only raise one if
@@ -2350,6 +2456,8 @@ static struct hvm_function_table __initdata vmx_function_table = {
     .deliver_posted_intr  = vmx_deliver_posted_intr,
     .sync_pir_to_irr      = vmx_sync_pir_to_irr,
     .test_pir             = vmx_test_pir,
+    .posted_intr_batch_begin = vmx_posted_intr_batch_begin,
+    .posted_intr_batch_finish = vmx_posted_intr_batch_finish,
     .handle_eoi           = vmx_handle_eoi,
     .nhvm_hap_walk_L1_p2m = nvmx_hap_walk_L1_p2m,
     .enable_msr_interception = vmx_enable_msr_interception,
@@ -2368,9 +2476,9 @@ static struct hvm_function_table __initdata vmx_function_table = {
 static void pi_wakeup_interrupt(struct cpu_user_regs *regs)
 {
     struct arch_vmx_struct *vmx, *tmp;
-    spinlock_t *lock = &per_cpu(vmx_pi_blocking, smp_processor_id()).lock;
-    struct list_head *blocked_vcpus =
-		&per_cpu(vmx_pi_blocking, smp_processor_id()).list;
+    struct vmx_pi_blocking_vcpu *pib = &this_cpu(vmx_pi_blocking);
+    spinlock_t *lock = &pib->lock;
+    struct list_head *blocked_vcpus = &pib->list;
 
     ack_APIC_irq();
     this_cpu(irq_count)++;
@@ -2378,15 +2486,17 @@ static void pi_wakeup_interrupt(struct cpu_user_regs *regs)
     spin_lock(lock);
 
     /*
-     * XXX: The length of the list depends on how many vCPU is current
-     * blocked on this specific pCPU. This may hurt the interrupt latency
-     * if the list grows to too many entries.
+     * The length of the list depends on how many vCPUs are currently
+     * blocked on this specific pCPU, which vmx_vcpu_block() keeps close to
+     * an even share of all blocked vCPUs (see PI_LIST_LIMIT).
      */
     list_for_each_entry_safe(vmx, tmp, blocked_vcpus, pi_blocking.list)
     {
         if ( pi_test_on(&vmx->pi_desc) )
         {
             list_del(&vmx->pi_blocking.list);
+            pib->counter--;
+            atomic_dec(&vmx_pi_blocked_vcpus);
             ASSERT(vmx->pi_blocking.lock == lock);
             vmx->pi_blocking.lock = NULL;
             vcpu_unblock(container_of(vmx, struct vcpu, arch.hvm_vmx));
@@ -2497,6 +2607,8 @@ const struct hvm_function_table * __init start_vmx(void)
         vmx_function_table.deliver_posted_intr = NULL;
         vmx_function_table.sync_pir_to_irr = NULL;
         vmx_function_table.test_pir = NULL;
+        vmx_function_table.posted_intr_batch_begin = NULL;
+        vmx_function_table.posted_intr_batch_finish = NULL;
     }
 
     if ( cpu_has_vmx_tsc_scaling )
@@ -3518,6 +3630,7 @@ void vmx_vmexit_handler(struct cpu_user_regs *regs)
     }
 
     __vmread(VM_EXIT_REASON, &exit_reason);
+    hvm_exit_stats_begin(v, (uint16_t)exit_reason);
 
     if ( hvm_long_mode_active(v) )
         HVMTRACE_ND(VMEXIT64, 0, 1/*cycles*/, 3, exit_reason,
@@ -4220,6 +4333,8 @@ bool vmx_vmenter_helper(const struct cpu_user_regs *regs)
      if ( nestedhvm_vcpu_in_guestmode(curr) && vcpu_nestedhvm(curr).stale_np2m )
          return false;
 
+    hvm_exit_stats_end(curr);
+
     if ( curr->domain->arch.hvm_domain.pi_ops.do_resume )
         curr->domain->arch.hvm_domain.pi_ops.do_resume(curr);
 
@@ -4260,15 +4375,44 @@ bool vmx_vmenter_helper(const struct cpu_user_regs *regs)
     {
         struct ept_data *ept = &p2m_get_hostp2m(curr->domain)->ept;
         unsigned int cpu = smp_processor_id();
+        unsigned int inv = 0; /* None => Single => All */
+        struct ept_data *single = NULL; /* Single eptp, iff inv == 1 */
 
         if ( cpumask_test_cpu(cpu, ept->invalidate) )
         {
             cpumask_clear_cpu(cpu, ept->invalidate);
-            if ( nestedhvm_enabled(curr->domain) )
-                __invept(INVEPT_ALL_CONTEXT, 0);
-            else
-                __invept(INVEPT_SINGLE_CONTEXT, ept->eptp);
+
+            /* Automatically invalidate all contexts if nested. */
+            inv += 1 + nestedhvm_enabled(curr->domain);
+            single = ept;
+        }
+
+        /*
+         * Not just the active view: with VMFUNC the guest can switch to
+         * any of them without exiting, so all must be clean on entry.
+         */
+        if ( altp2m_active(curr->domain) )
+        {
+            unsigned int i;
+
+            for ( i = 0; i < MAX_ALTP2M; ++i )
+            {
+                if ( curr->domain->arch.altp2m_eptp[i] == mfn_x(INVALID_MFN) )
+                    continue;
+
+                ept = &curr->domain->arch.altp2m_p2m[i]->ept;
+                if ( cpumask_test_cpu(cpu, ept->invalidate) )
+                {
+                    cpumask_clear_cpu(cpu, ept->invalidate);
+                    inv++;
+                    single = ept;
+                }
+            }
         }
+
+        if ( inv )
+            __invept(inv == 1 ? INVEPT_SINGLE_CONTEXT : INVEPT_ALL_CONTEXT,
+                     inv == 1 ? single->eptp          : 0);
     }
 
  out:
@@ -26,6 +26,13 @@
 #define mode_is(d, name) \
     ((d)->arch.hvm_domain.params[HVM_PARAM_TIMER_MODE] == HVMPTM_##name)
 
+/*
+ * Drive all platform timers of a vCPU from a single host timer, armed
+ * only for timers whose interrupt the guest could currently observe.
+ */
+static bool __read_mostly opt_vpt_coalesce;
+boolean_param("vpt-coalesce", opt_vpt_coalesce);
+
 void hvm_init_guest_time(struct domain *d)
 {
     struct pl_time *pl = d->arch.hvm_domain.pl_time;
@@ -153,6 +160,53 @@ static void pt_unlock(struct periodic_time *pt)
     spin_unlock(&pt->vcpu->arch.hvm_vcpu.tm_lock);
 }
 
+/*
+ * Does the timer need a host timer armed?  Timers with interrupts still
+ * outstanding are re-armed once those are acknowledged, and there is no
+ * point in waking up for a masked one: pt_may_unmask_irq() re-arms once it
+ * is unmasked, and any ticks missed meanwhile are accounted as usual.
+ */
+static bool pt_needs_timer(struct periodic_time *pt)
+{
+    if ( pt->pending_intr_nr )
+        return false;
+
+    /* RTC code takes care of disabling the timer itself. */
+    return (pt->irq == RTC_IRQ && pt->priv) || pt_irq_masked(pt) == 0;
+}
+
+/*
+ * Arm the vCPU's host timer for the earliest timer needing one. If frozen,
+ * only timers which keep running while the vCPU is descheduled count.
+ * Called with tm_lock held.
+ */
+static void pt_vcpu_arm(struct vcpu *v, bool frozen)
+{
+    struct list_head *head = &v->arch.hvm_vcpu.tm_list;
+    struct periodic_time *pt;
+    s_time_t deadline = STIME_MAX;
+
+    ASSERT(spin_is_locked(&v->arch.hvm_vcpu.tm_lock));
+
+    list_for_each_entry ( pt, head, list )
+        if ( (!frozen || pt->do_not_freeze) && pt_needs_timer(pt) &&
+             pt->scheduled < deadline )
+            deadline = pt->scheduled;
+
+    if ( deadline == STIME_MAX )
+        stop_timer(&v->arch.hvm_vcpu.tm_timer);
+    else
+        set_timer(&v->arch.hvm_vcpu.tm_timer, deadline);
+}
+
+static void pt_arm(struct periodic_time *pt)
+{
+    if ( opt_vpt_coalesce )
+        pt_vcpu_arm(pt->vcpu, false);
+    else
+        set_timer(&pt->timer, pt->scheduled);
+}
+
 static void pt_process_missed_ticks(struct periodic_time *pt)
 {
     s_time_t missed_ticks, now = NOW();
@@ -202,9 +256,12 @@ void pt_save_timer(struct vcpu *v)
 
     spin_lock(&v->arch.hvm_vcpu.tm_lock);
 
-    list_for_each_entry ( pt, head, list )
-        if ( !pt->do_not_freeze )
-            stop_timer(&pt->timer);
+    if ( opt_vpt_coalesce )
+        pt_vcpu_arm(v, true);
+    else
+        list_for_each_entry ( pt, head, list )
+            if ( !pt->do_not_freeze )
+                stop_timer(&pt->timer);
 
     pt_freeze_time(v);
 
@@ -223,10 +280,14 @@ void pt_restore_timer(struct vcpu *v)
         if ( pt->pending_intr_nr == 0 )
         {
             pt_process_missed_ticks(pt);
-            set_timer(&pt->timer, pt->scheduled);
+            if ( !opt_vpt_coalesce )
+                set_timer(&pt->timer, pt->scheduled);
         }
     }
 
+    if ( opt_vpt_coalesce )
+        pt_vcpu_arm(v, false);
+
     pt_thaw_time(v);
 
     spin_unlock(&v->arch.hvm_vcpu.tm_lock);
@@ -247,6 +308,49 @@ static void pt_timer_fn(void *data)
     pt_unlock(pt);
 }
 
+static void pt_vcpu_timer_fn(void *data)
+{
+    struct vcpu *v = data;
+    struct list_head *head = &v->arch.hvm_vcpu.tm_list;
+    struct periodic_time *pt;
+    s_time_t now = NOW();
+    bool kick = false;
+
+    spin_lock(&v->arch.hvm_vcpu.tm_lock);
+
+    list_for_each_entry ( pt, head, list )
+    {
+        if ( pt->scheduled > now || !pt_needs_timer(pt) )
+            continue;
+
+        pt->pending_intr_nr++;
+        pt->scheduled += pt->period;
+        pt->do_not_freeze = 0;
+        kick = true;
+    }
+
+    /* Timers still outstanding may only be those kept running frozen. */
+    pt_vcpu_arm(v, !v->is_running && !(v->pause_flags & VPF_blocked));
+
+    spin_unlock(&v->arch.hvm_vcpu.tm_lock);
+
+    if ( kick )
+        vcpu_kick(v);
+}
+
+void pt_vcpu_init(struct vcpu *v)
+{
+    spin_lock_init(&v->arch.hvm_vcpu.tm_lock);
+    INIT_LIST_HEAD(&v->arch.hvm_vcpu.tm_list);
+    init_timer(&v->arch.hvm_vcpu.tm_timer, pt_vcpu_timer_fn, v,
+               v->processor);
+}
+
+void pt_vcpu_destroy(struct vcpu *v)
+{
+    kill_timer(&v->arch.hvm_vcpu.tm_timer);
+}
+
 int pt_update_irq(struct vcpu *v)
 {
     struct list_head *head = &v->arch.hvm_vcpu.tm_list;
@@ -375,7 +479,7 @@ void pt_intr_post(struct vcpu *v, struct hvm_intack intack)
         pt->last_plt_gtime = hvm_get_guest_time(v);
         pt_process_missed_ticks(pt);
         pt->pending_intr_nr = 0; /* 'collapse' all missed ticks */
-        set_timer(&pt->timer, pt->scheduled);
+        pt_arm(pt);
     }
     else
     {
@@ -384,7 +488,7 @@ void pt_intr_post(struct vcpu *v, struct hvm_intack intack)
         {
             pt_process_missed_ticks(pt);
             if ( pt->pending_intr_nr == 0 )
-                set_timer(&pt->timer, pt->scheduled);
+                pt_arm(pt);
         }
     }
 
@@ -411,6 +515,8 @@ void pt_migrate(struct vcpu *v)
     list_for_each_entry ( pt, head, list )
         migrate_timer(&pt->timer, v->processor);
 
+    migrate_timer(&v->arch.hvm_vcpu.tm_timer, v->processor);
+
     spin_unlock(&v->arch.hvm_vcpu.tm_lock);
 }
 
@@ -469,7 +575,7 @@ void create_periodic_time(
     list_add(&pt->list, &v->arch.hvm_vcpu.tm_list);
 
     init_timer(&pt->timer, pt_timer_fn, pt, v->processor);
-    set_timer(&pt->timer, pt->scheduled);
+    pt_arm(pt);
 
     spin_unlock(&v->arch.hvm_vcpu.tm_lock);
 }
@@ -517,7 +623,10 @@ static void pt_adjust_vcpu(struct periodic_time *pt, struct vcpu *v)
         pt->on_list = 1;
         list_add(&pt->list, &v->arch.hvm_vcpu.tm_list);
 
-        migrate_timer(&pt->timer, v->processor);
+        if ( opt_vpt_coalesce )
+            pt_vcpu_arm(v, false);
+        else
+            migrate_timer(&pt->timer, v->processor);
     }
     spin_unlock(&v->arch.hvm_vcpu.tm_lock);
 }
@@ -562,6 +671,9 @@ static void pt_resume(struct periodic_time *pt)
         list_add(&pt->list, &pt->vcpu->arch.hvm_vcpu.tm_list);
         vcpu_kick(pt->vcpu);
     }
+    else if ( opt_vpt_coalesce && pt->on_list &&
+              (pt->vcpu->is_running || (pt->vcpu->pause_flags & VPF_blocked)) )
+        pt_vcpu_arm(pt->vcpu, false); /* may have been skipped as masked */
     pt_unlock(pt);
 }
 
@@ -19,7 +19,14 @@
  * Copyright (c) 2015,2016 Citrix Systems Ltd.
  */
 
+#include <xen/guest_access.h>
+#include <xen/hash.h>
+#include <xen/init.h>
 #include <xen/hypercall.h>
+#include <xen/log2hist.h>
+#include <xen/smp.h>
+#include <xen/xmalloc.h>
+#include <public/sysctl.h>
 
 #define ARGS(x, n)                              \
     [ __HYPERVISOR_ ## x ] = { n, n }
@@ -246,6 +253,217 @@ int hypercall_xlat_continuation(unsigned int *id, unsigned int nr,
     return rc;
 }
 
+/*
+ * Hypercall latency histograms.
+ *
+ * When enabled, every hypercall, and every call in a multicall, has the
+ * time spent dispatching it accounted in a log2 histogram, on the CPU it
+ * ran on, keyed by hypercall and sub-op.  Each CPU only ever updates its
+ * own table, so no locking or atomic ops are needed; the tables are read
+ * (and reset) remotely, which is racy but as fine as it is for perfc.
+ *
+ * The tables are allocated when the histograms are first enabled, for
+ * all CPUs which may come online, and never freed, so that a CPU going
+ * offline does not lose what it recorded.
+ */
+#define HCALL_STATS_BITS    7
+#define HCALL_STATS_SIZE    (1u << HCALL_STATS_BITS)
+#define HCALL_STATS_BUCKETS XEN_SYSCTL_HCSTATS_BUCKETS
+
+struct hcall_stat {
+    uint64_t key;                  /* (op + 1) << 32 | subop, 0 if free */
+    uint64_t total;
+    uint32_t continuations;
+    uint32_t hist[HCALL_STATS_BUCKETS];
+};
+
+static bool __initdata opt_hypercall_stats;
+boolean_param("hypercall-stats", opt_hypercall_stats);
+
+bool __read_mostly hypercall_stats_enabled;
+/* Not per-CPU data, which is freed when a CPU goes offline. */
+static struct hcall_stat *__read_mostly hcall_stats[NR_CPUS];
+static unsigned int hcall_stats_dropped[NR_CPUS];
+
+static unsigned int hcall_subop(unsigned int op, unsigned long arg0)
+{
+    uint32_t cmd;
+
+    switch ( op )
+    {
+    case __HYPERVISOR_memory_op:
+        /* The rest is the continuation's start extent. */
+        return arg0 & MEMOP_CMD_MASK;
+
+    case __HYPERVISOR_sched_op_compat:
+    case __HYPERVISOR_xen_version:
+    case __HYPERVISOR_console_io:
+    case __HYPERVISOR_grant_table_op:
+    case __HYPERVISOR_vm_assist:
+    case __HYPERVISOR_vcpu_op:
+    case __HYPERVISOR_nmi_op:
+    case __HYPERVISOR_sched_op:
+    case __HYPERVISOR_callback_op:
+    case __HYPERVISOR_xenoprof_op:
+    case __HYPERVISOR_event_channel_op:
+    case __HYPERVISOR_physdev_op:
+    case __HYPERVISOR_hvm_op:
+    case __HYPERVISOR_kexec_op:
+    case __HYPERVISOR_xenpmu_op:
+        return arg0;
+
+    case __HYPERVISOR_platform_op:
+    case __HYPERVISOR_sysctl:
+    case __HYPERVISOR_domctl:
+        /* cmd is the first field of all three structures. */
+        if ( !raw_copy_from_guest(&cmd, (void *)arg0, sizeof(cmd)) &&
+             cmd != XEN_SYSCTL_HCSTATS_NO_SUBOP )
+            return cmd;
+        break;
+    }
+
+    return XEN_SYSCTL_HCSTATS_NO_SUBOP;
+}
+
+void hypercall_stats_record(unsigned int op, unsigned long arg0,
+                            s_time_t start)
+{
+    s_time_t time = NOW() - start;
+    struct hcall_stat *table = hcall_stats[smp_processor_id()], *e;
+    uint64_t key;
+    unsigned int i, idx;
+
+    if ( unlikely(!table) || time < 0 )
+        return;
+
+    key = ((uint64_t)(op + 1) << 32) | hcall_subop(op, arg0);
+    idx = hash_long(key, HCALL_STATS_BITS);
+    for ( i = 0; i < HCALL_STATS_SIZE; i++ )
+    {
+        e = &table[(idx + i) % HCALL_STATS_SIZE];
+        if ( e->key == key || !e->key )
+            break;
+    }
+    if ( i == HCALL_STATS_SIZE )
+    {
+        hcall_stats_dropped[smp_processor_id()]++;
+        return;
+    }
+
+    e->key = key;
+    e->total += time;
+    if ( current->hcall_preempted )
+        e->continuations++;
+
+    /* Bucket 0 is < 256ns. */
+    log2_hist_add(e->hist, HCALL_STATS_BUCKETS, time, 8);
+}
+
+static int hypercall_stats_alloc(void)
+{
+    unsigned int cpu;
+
+    for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+    {
+        if ( hcall_stats[cpu] )
+            continue;
+        hcall_stats[cpu] = xzalloc_array(struct hcall_stat, HCALL_STATS_SIZE);
+        if ( !hcall_stats[cpu] )
+            return -ENOMEM;
+    }
+
+    return 0;
+}
+
+static int __init hypercall_stats_init(void)
+{
+    if ( !opt_hypercall_stats )
+        return 0;
+
+    if ( hypercall_stats_alloc() )
+        printk(XENLOG_WARNING "Not enough memory for hypercall-stats\n");
+    else
+        hypercall_stats_enabled = true;
+
+    return 0;
+}
+__initcall(hypercall_stats_init);
+
+/* Dom0 control of the hypercall latency histograms */
+int hypercall_stats_control(struct xen_sysctl_hcstats_op *op)
+{
+    struct xen_sysctl_hcstats_data elem;
+    const struct hcall_stat *table;
+    unsigned int cpu, i;
+    int rc;
+
+    switch ( op->cmd )
+    {
+    case XEN_SYSCTL_HCSTATS_enable:
+        rc = hypercall_stats_alloc();
+        if ( rc )
+            return rc;
+        smp_wmb();
+        hypercall_stats_enabled = true;
+        break;
+
+    case XEN_SYSCTL_HCSTATS_disable:
+        hypercall_stats_enabled = false;
+        break;
+
+    case XEN_SYSCTL_HCSTATS_reset:
+        for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+        {
+            if ( hcall_stats[cpu] )
+                memset(hcall_stats[cpu], 0,
+                       HCALL_STATS_SIZE * sizeof(struct hcall_stat));
+            hcall_stats_dropped[cpu] = 0;
+        }
+        break;
+
+    case XEN_SYSCTL_HCSTATS_query:
+        op->enabled = hypercall_stats_enabled;
+        op->dropped = 0;
+        op->nr_elem = 0;
+        for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+        {
+            op->dropped += hcall_stats_dropped[cpu];
+            table = hcall_stats[cpu];
+            if ( !table )
+                continue;
+
+            for ( i = 0; i < HCALL_STATS_SIZE; i++ )
+            {
+                const struct hcall_stat *e = &table[i];
+                uint64_t key = read_atomic(&e->key);
+
+                if ( !key )
+                    continue;
+
+                if ( op->nr_elem < op->max_elem )
+                {
+                    elem.cpu = cpu;
+                    elem.op = (key >> 32) - 1;
+                    elem.subop = key;
+                    elem.continuations = e->continuations;
+                    elem.total_ns = e->total;
+                    memcpy(elem.hist, e->hist, sizeof(elem.hist));
+                    if ( copy_to_guest_offset(op->data, op->nr_elem,
+                                              &elem, 1) )
+                        return -EFAULT;
+                }
+                op->nr_elem++;
+            }
+        }
+        break;
+
+    default:
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
 /*
  * Local variables:
  * mode: C
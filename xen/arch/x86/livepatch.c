@@ -2,17 +2,20 @@
  * Copyright (C) 2016 Citrix Systems R&D Ltd.
  */
 
+#include <xen/err.h>
 #include <xen/errno.h>
 #include <xen/init.h>
 #include <xen/lib.h>
 #include <xen/mm.h>
 #include <xen/pfn.h>
+#include <xen/smp.h>
 #include <xen/vmap.h>
 #include <xen/livepatch_elf.h>
 #include <xen/livepatch.h>
 
 #include <asm/nmi.h>
 #include <asm/livepatch.h>
+#include <asm/x86_emulate.h>
 
 int arch_livepatch_quiesce(void)
 {
@@ -46,22 +49,15 @@ int arch_livepatch_verify_func(const struct livepatch_func *func)
     return 0;
 }
 
-/*
- * "noinline" to cause control flow change and thus invalidate I$ and
- * cause refetch after modification.
- */
-void noinline arch_livepatch_apply(struct livepatch_func *func)
+/* Save the original code of @func, and construct its replacement. */
+static unsigned int build_insn(struct livepatch_func *func, uint8_t *insn)
 {
-    uint8_t *old_ptr;
-    uint8_t insn[sizeof(func->opaque)];
-    unsigned int len;
+    unsigned int len = livepatch_insn_len(func);
 
-    old_ptr = func->old_addr;
-    len = livepatch_insn_len(func);
     if ( !len )
-        return;
+        return 0;
 
-    memcpy(func->opaque, old_ptr, len);
+    memcpy(func->opaque, func->old_addr, len);
     if ( func->new_addr )
     {
         int32_t val;
@@ -76,7 +72,20 @@ void noinline arch_livepatch_apply(struct livepatch_func *func)
     else
         add_nops(insn, len);
 
-    memcpy(old_ptr, insn, len);
+    return len;
+}
+
+/*
+ * "noinline" to cause control flow change and thus invalidate I$ and
+ * cause refetch after modification.
+ */
+void noinline arch_livepatch_apply(struct livepatch_func *func)
+{
+    uint8_t insn[sizeof(func->opaque)];
+    unsigned int len = build_insn(func, insn);
+
+    if ( len )
+        memcpy(func->old_addr, insn, len);
 }
 
 /*
@@ -96,6 +105,168 @@ void noinline arch_livepatch_post_action(void)
 {
 }
 
+/*
+ * Live patching, with other CPUs running, rewrites a function's entry in
+ * three steps: first an INT3 is placed on its first byte, then the rest of
+ * the new instruction is written, and finally its first byte.  Each step
+ * is followed by serialising all CPUs, such that none of them ever
+ * executes a mix of old and new bytes.  Whoever hits the INT3 in the
+ * meantime is sent to where the patched function would have taken them.
+ *
+ * This is only sound when a single instruction replaces a single one
+ * (arch_livepatch_live_ok()): a CPU interrupted at a boundary inside the
+ * replaced bytes would otherwise resume in the middle of the new code.
+ * Functions used by the INT3 path, or by NMI or #MC handlers (which could
+ * run while the breakpoint is in place), can't be patched this way either;
+ * this can't be checked, which is why live patching has to be asked for
+ * ("livepatch-live").  The NMI callbacks are masked while patching.
+ */
+static struct {
+    const void *addr;      /* The patch site, while INT3 may be found there. */
+    unsigned long target;  /* Where to continue hitting it. */
+} live_poke;
+
+bool arch_livepatch_int3(struct cpu_user_regs *regs)
+{
+    const void *addr = ACCESS_ONCE(live_poke.addr);
+
+    if ( !addr || regs->rip - 1 != (unsigned long)addr )
+        return false;
+
+    smp_rmb();
+    regs->rip = live_poke.target;
+
+    return true;
+}
+
+static void live_sync(void *unused)
+{
+    /* Taking and returning from the IPI serialises the CPU. */
+}
+
+static void live_write(void *dst, const void *src, unsigned int len)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    arch_livepatch_quiesce();
+    memcpy(dst, src, len);
+    arch_livepatch_revive();
+    local_irq_restore(flags);
+
+    on_each_cpu(live_sync, NULL, 1);
+}
+
+static void live_poke_insn(void *addr, const uint8_t *insn, unsigned int len,
+                           unsigned long target)
+{
+    static const uint8_t int3 = 0xcc;
+
+    ASSERT(local_irq_is_enabled());
+
+    live_poke.target = target;
+    smp_wmb();
+    ACCESS_ONCE(live_poke.addr) = addr;
+    smp_mb();
+    arch_livepatch_mask();
+
+    live_write(addr, &int3, 1);
+    if ( len > 1 )
+        live_write(addr + 1, insn + 1, len - 1);
+    live_write(addr, insn, 1);
+
+    arch_livepatch_unmask();
+    ACCESS_ONCE(live_poke.addr) = NULL;
+}
+
+/* CPUs running into either version of @func behave as if it was patched. */
+static unsigned long live_target(const struct livepatch_func *func)
+{
+    return func->new_addr ? (unsigned long)func->new_addr
+                          : (unsigned long)func->old_addr + func->new_size;
+}
+
+struct live_decode {
+    const struct livepatch_func *func;
+    bool applied;
+};
+
+/* Fetch from the function's original code, wherever that is now. */
+static int live_fetch(enum x86_segment seg, unsigned long offset,
+                      void *p_data, unsigned int bytes,
+                      struct x86_emulate_ctxt *ctxt)
+{
+    const struct live_decode *d = ctxt->data;
+    unsigned long start = (unsigned long)d->func->old_addr;
+    unsigned int len = livepatch_insn_len(d->func), i;
+
+    if ( offset < start || offset + bytes > start + d->func->old_size )
+        return X86EMUL_UNHANDLEABLE;
+
+    for ( i = 0; i < bytes; i++ )
+    {
+        unsigned long pos = offset + i - start;
+
+        ((uint8_t *)p_data)[i] = d->applied && pos < len
+                                 ? d->func->opaque[pos]
+                                 : ((const uint8_t *)start)[pos];
+    }
+
+    return X86EMUL_OKAY;
+}
+
+/*
+ * Both the original code and its replacement must have a single instruction
+ * covering all the replaced bytes, such that no CPU can have been stopped at
+ * a boundary within them.  The replacement is a JMP, or a NOP as long as
+ * one is enough.
+ */
+bool arch_livepatch_live_ok(const struct livepatch_func *func, bool applied)
+{
+    struct live_decode d = { .func = func, .applied = applied };
+    struct cpu_user_regs regs = { .rip = (unsigned long)func->old_addr };
+    struct x86_emulate_ctxt ctxt = {
+        .data = &d,
+        .regs = &regs,
+        .addr_size = 64,
+        .sp_size = 64,
+        .lma = true,
+        .vendor = boot_cpu_data.x86_vendor,
+    };
+    struct x86_emulate_state *state;
+    unsigned int len = livepatch_insn_len(func);
+    bool ok;
+
+    if ( !func->new_addr && len > ASM_NOP_MAX )
+        return false;
+
+    state = x86_decode_insn(&ctxt, live_fetch);
+    if ( IS_ERR_OR_NULL(state) )
+        return false;
+
+    ok = x86_insn_length(state, &ctxt) >= len;
+    x86_emulate_free_state(state);
+
+    return ok;
+}
+
+void arch_livepatch_apply_live(struct livepatch_func *func)
+{
+    uint8_t insn[sizeof(func->opaque)];
+    unsigned int len = build_insn(func, insn);
+
+    if ( len )
+        live_poke_insn(func->old_addr, insn, len, live_target(func));
+}
+
+void arch_livepatch_revert_live(const struct livepatch_func *func)
+{
+    unsigned int len = livepatch_insn_len(func);
+
+    if ( len )
+        live_poke_insn(func->old_addr, func->opaque, len, live_target(func));
+}
+
 static nmi_callback_t *saved_nmi_callback;
 /*
  * Note that because of this NOP code the do_nmi is not safely patchable.
@@ -30,6 +30,7 @@
 #include <xen/smp.h>
 #include <xen/softirq.h>
 #include <xen/spinlock.h>
+#include <xen/stop_machine.h>
 #include <xen/tasklet.h>
 #include <xen/guest_access.h>
 #include <xen/earlycpio.h>
@@ -190,6 +191,8 @@ struct microcode_info {
     unsigned int cpu;
     uint32_t buffer_size;
     int error;
+    cpumask_t prepared;   /* CPUs with a newer patch to load */
+    cpumask_t loaded;     /* Cores done loading, by first thread */
     char buffer[1];
 };
 
@@ -262,7 +265,7 @@ int microcode_resume_cpu(unsigned int cpu)
     return err;
 }
 
-static int microcode_update_cpu(const void *buf, size_t size)
+static int microcode_update_cpu(const void *buf, size_t size, bool apply)
 {
     int err;
     unsigned int cpu = smp_processor_id();
@@ -272,7 +275,7 @@ static int microcode_update_cpu(const void *buf, size_t size)
 
     err = microcode_ops->collect_cpu_info(cpu, &uci->cpu_sig);
     if ( likely(!err) )
-        err = microcode_ops->cpu_request_microcode(cpu, buf, size);
+        err = microcode_ops->cpu_request_microcode(cpu, buf, size, apply);
     else
         __microcode_fini_cpu(cpu);
 
@@ -281,6 +284,43 @@ static int microcode_update_cpu(const void *buf, size_t size)
     return err;
 }
 
+/*
+ * Late loading happens in two steps.  Parsing the blob (which needs memory
+ * allocations) is done CPU by CPU with IRQs enabled, each CPU recording the
+ * patch it needs without loading it.  The (slow) loading itself is then done
+ * in parallel in a stop_machine rendezvous, by the first thread of each core
+ * while its siblings, sharing the core's microcode, wait for it to finish.
+ */
+static int do_microcode_load(void *_info)
+{
+    struct microcode_info *info = _info;
+    unsigned int cpu = smp_processor_id();
+    unsigned int first = cpumask_first(per_cpu(cpu_sibling_mask, cpu));
+    int error = 0;
+
+    if ( cpu == first )
+    {
+        if ( cpumask_test_cpu(cpu, &info->prepared) )
+            error = microcode_ops->apply_microcode(cpu);
+        cpumask_set_cpu(cpu, &info->loaded);
+    }
+    else
+    {
+        while ( !cpumask_test_cpu(first, &info->loaded) )
+            cpu_relax();
+
+        /* Pick up the revision loaded through the sibling. */
+        if ( cpumask_test_cpu(cpu, &info->prepared) )
+            error = microcode_ops->collect_cpu_info(
+                cpu, &per_cpu(ucode_cpu_info, cpu).cpu_sig);
+    }
+
+    if ( microcode_ops->end_update_percpu )
+        microcode_ops->end_update_percpu();
+
+    return error;
+}
+
 static long do_microcode_update(void *_info)
 {
     struct microcode_info *info = _info;
@@ -288,15 +328,19 @@ static long do_microcode_update(void *_info)
 
     BUG_ON(info->cpu != smp_processor_id());
 
-    error = microcode_update_cpu(info->buffer, info->buffer_size);
-    if ( error )
+    error = microcode_update_cpu(info->buffer, info->buffer_size, false);
+    if ( error > 0 )
+        cpumask_set_cpu(info->cpu, &info->prepared);
+    else if ( error )
         info->error = error;
 
     info->cpu = cpumask_next(info->cpu, &cpu_online_map);
     if ( info->cpu < nr_cpu_ids )
         return continue_hypercall_on_cpu(info->cpu, do_microcode_update, info);
 
-    error = info->error;
+    error = stop_machine_run(do_microcode_load, info, NR_CPUS);
+    if ( !error )
+        error = info->error;
     xfree(info);
     return error;
 }
@@ -325,6 +369,8 @@ int microcode_update(XEN_GUEST_HANDLE_PARAM(const_void) buf, unsigned long len)
 
     info->buffer_size = len;
     info->error = 0;
+    cpumask_clear(&info->prepared);
+    cpumask_clear(&info->loaded);
     info->cpu = cpumask_first(&cpu_online_map);
 
     if ( microcode_ops->start_update )
@@ -405,7 +451,7 @@ int __init early_microcode_update_cpu(bool start_update)
         if ( rc )
             return rc;
 
-        return microcode_update_cpu(data, len);
+        return microcode_update_cpu(data, len, true);
     }
     else
         return -ENOMEM;
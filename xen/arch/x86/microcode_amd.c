@@ -74,9 +74,6 @@ struct mpbhdr {
     uint8_t data[];
 };
 
-/* serialize access to the physical write */
-static DEFINE_SPINLOCK(microcode_update_lock);
-
 /* See comment in start_update() for cases when this routine fails */
 static int collect_cpu_info(unsigned int cpu, struct cpu_signature *csig)
 {
@@ -209,14 +206,20 @@ static int apply_microcode(unsigned int cpu)
     if ( hdr == NULL )
         return -EINVAL;
 
-    spin_lock_irqsave(&microcode_update_lock, flags);
+    /*
+     * No global serialisation of the patch load: threads of one core never
+     * get here concurrently (boot and resume load on one CPU at a time, late
+     * loading on one thread per core), while distinct cores may load in
+     * parallel.
+     */
+    local_irq_save(flags);
 
     hw_err = wrmsr_safe(MSR_AMD_PATCHLOADER, (unsigned long)hdr);
 
     /* get patch id after patching */
     rdmsrl(MSR_AMD_PATCHLEVEL, rev);
 
-    spin_unlock_irqrestore(&microcode_update_lock, flags);
+    local_irq_restore(flags);
 
     /* check current patch id and patch's id for match */
     if ( hw_err || (rev != hdr->patch_id) )
@@ -389,11 +392,12 @@ static bool_t check_final_patch_levels(unsigned int cpu)
 }
 
 static int cpu_request_microcode(unsigned int cpu, const void *buf,
-                                 size_t bufsize)
+                                 size_t bufsize, bool apply)
 {
     struct microcode_amd *mc_amd, *mc_old;
     size_t offset = 0;
     size_t last_offset, applied_offset = 0;
+    uint32_t found_id = 0;
     int error = 0, save_error = 1;
     struct ucode_cpu_info *uci = &per_cpu(ucode_cpu_info, cpu);
     unsigned int current_cpu_id;
@@ -493,10 +497,21 @@ static int cpu_request_microcode(unsigned int cpu, const void *buf,
     {
         if ( microcode_fits(mc_amd, cpu) )
         {
-            error = apply_microcode(cpu);
-            if ( error )
-                break;
-            applied_offset = last_offset;
+            const struct microcode_header_amd *hdr = mc_amd->mpb;
+
+            if ( apply )
+            {
+                error = apply_microcode(cpu);
+                if ( error )
+                    break;
+                applied_offset = last_offset;
+            }
+            /* Without loading, only the revision can tell the newest. */
+            else if ( hdr->patch_id > found_id )
+            {
+                found_id = hdr->patch_id;
+                applied_offset = last_offset;
+            }
         }
 
         last_offset = offset;
@@ -550,7 +565,11 @@ static int cpu_request_microcode(unsigned int cpu, const void *buf,
         xfree(mc_old);
 
   out:
-    svm_host_osvw_init();
+    /* For a late update, end_update_percpu() does this once loaded. */
+    if ( apply )
+        svm_host_osvw_init();
+    else if ( !error && !save_error )
+        error = 1;
 
     /*
      * In some cases we may return an error even if processor's microcode has
@@ -611,7 +630,8 @@ static int start_update(void)
 {
     /*
      * We assume here that svm_host_osvw_init() will be called on each cpu (from
-     * cpu_request_microcode()).
+     * cpu_request_microcode() at boot, or end_update_percpu() for late
+     * loading).
      *
      * Note that if collect_cpu_info() returns an error then
      * cpu_request_microcode() will not invoked thus leaving OSVW bits not
@@ -623,12 +643,18 @@ static int start_update(void)
     return 0;
 }
 
+static void end_update_percpu(void)
+{
+    svm_host_osvw_init();
+}
+
 static const struct microcode_ops microcode_amd_ops = {
     .microcode_resume_match           = microcode_resume_match,
     .cpu_request_microcode            = cpu_request_microcode,
     .collect_cpu_info                 = collect_cpu_info,
     .apply_microcode                  = apply_microcode,
     .start_update                     = start_update,
+    .end_update_percpu                = end_update_percpu,
 };
 
 int __init microcode_init_amd(void)
@@ -86,9 +86,6 @@ struct extended_sigtable {
 
 #define exttable_size(et) ((et)->count * EXT_SIGNATURE_SIZE + EXT_HEADER_SIZE)
 
-/* serialize access to the physical write to MSR 0x79 */
-static DEFINE_SPINLOCK(microcode_update_lock);
-
 static int collect_cpu_info(unsigned int cpu_num, struct cpu_signature *csig)
 {
     struct cpuinfo_x86 *c = &cpu_data[cpu_num];
@@ -291,8 +288,13 @@ static int apply_microcode(unsigned int cpu)
     if ( uci->mc.mc_intel == NULL )
         return -EINVAL;
 
-    /* serialize access to the physical write to MSR 0x79 */
-    spin_lock_irqsave(&microcode_update_lock, flags);
+    /*
+     * No global serialisation of the write to MSR 0x79: threads of one core
+     * never get here concurrently (boot and resume load on one CPU at a
+     * time, late loading on one thread per core), while distinct cores may
+     * load in parallel.
+     */
+    local_irq_save(flags);
 
     /* write microcode via MSR 0x79 */
     wrmsrl(MSR_IA32_UCODE_WRITE, (unsigned long)uci->mc.mc_intel->bits);
@@ -305,7 +307,7 @@ static int apply_microcode(unsigned int cpu)
     rdmsrl(MSR_IA32_UCODE_REV, msr_content);
     val[1] = (uint32_t)(msr_content >> 32);
 
-    spin_unlock_irqrestore(&microcode_update_lock, flags);
+    local_irq_restore(flags);
     if ( val[1] != uci->mc.mc_intel->hdr.rev )
     {
         printk(KERN_ERR "microcode: CPU%d update from revision "
@@ -353,7 +355,7 @@ static long get_next_ucode_from_buffer(void **mc, const u8 *buf,
 }
 
 static int cpu_request_microcode(unsigned int cpu, const void *buf,
-                                 size_t size)
+                                 size_t size, bool apply)
 {
     long offset = 0;
     int error = 0;
@@ -388,7 +390,7 @@ static int cpu_request_microcode(unsigned int cpu, const void *buf,
         error = offset;
 
     if ( !error && matching_count )
-        error = apply_microcode(cpu);
+        error = apply ? apply_microcode(cpu) : 1;
 
     return error;
 }
@@ -103,6 +103,7 @@
 #include <xen/efi.h>
 #include <xen/grant_table.h>
 #include <xen/hypercall.h>
+#include <xen/multicall.h>
 #include <asm/paging.h>
 #include <asm/shadow.h>
 #include <asm/page.h>
@@ -2995,6 +2996,49 @@ static inline int vcpumask_to_pcpumask(
     }
 }
 
+/*
+ * Full TLB flushes asked for by the sub-calls of a multicall get merged,
+ * and are only carried out once the batch is done, or is about to make a
+ * sub-call other than a page table update.  The vCPU can't be descheduled
+ * in the meantime, so the pending flush is kept per pCPU.
+ */
+static DEFINE_PER_CPU(cpumask_t, mc_flush_mask);
+
+static void flush_tlb_mask_deferred(const cpumask_t *mask)
+{
+    cpumask_t *pending = &this_cpu(mc_flush_mask);
+
+    if ( !(current->mc_state.flags & MCSF_in_multicall) )
+    {
+        flush_tlb_mask(mask);
+        return;
+    }
+
+    if ( !cpumask_empty(pending) )
+        perfc_incr(multicall_flushes_merged);
+    cpumask_or(pending, pending, mask);
+}
+
+void multicall_flush_tlb(void)
+{
+    cpumask_t *pending = &this_cpu(mc_flush_mask);
+
+    if ( cpumask_empty(pending) )
+        return;
+
+    flush_tlb_mask(pending);
+    cpumask_clear(pending);
+}
+
+void arch_multicall_flush(void)
+{
+    multicall_flush_tlb();
+
+    /* Event sends the PV shim has batched up for L0. */
+    if ( pv_shim )
+        pv_shim_flush_sends();
+}
+
 long do_mmuext_op(
     XEN_GUEST_HANDLE_PARAM(mmuext_op_t) uops,
     unsigned int count,
@@ -3293,7 +3337,7 @@ long do_mmuext_op(
 
         case MMUEXT_TLB_FLUSH_LOCAL:
             if ( likely(currd == pg_owner) )
-                flush_tlb_local();
+                flush_tlb_mask_deferred(cpumask_of(smp_processor_id()));
             else
                 rc = -EPERM;
             break;
@@ -3321,7 +3365,7 @@ long do_mmuext_op(
                 break;
 
             if ( op.cmd == MMUEXT_TLB_FLUSH_MULTI )
-                flush_tlb_mask(mask);
+                flush_tlb_mask_deferred(mask);
             else if ( __addr_ok(op.arg1.linear_addr) )
                 flush_tlb_one_mask(mask, op.arg1.linear_addr);
             break;
@@ -3329,7 +3373,7 @@ long do_mmuext_op(
 
         case MMUEXT_TLB_FLUSH_ALL:
             if ( likely(currd == pg_owner) )
-                flush_tlb_mask(currd->dirty_cpumask);
+                flush_tlb_mask_deferred(currd->dirty_cpumask);
             else
                 rc = -EPERM;
             break;
@@ -3534,8 +3578,8 @@ long do_mmu_update(
 {
     struct mmu_update req;
     void *va = NULL;
-    unsigned long gpfn, gmfn, mfn;
-    struct page_info *page;
+    unsigned long gpfn, gmfn, mfn, l1_gmfn = 0;
+    struct page_info *page, *l1_page = NULL;
     unsigned int cmd, i = 0, done = 0, pt_dom;
     struct vcpu *curr = current, *v = curr;
     struct domain *d = v->domain, *pt_owner = d, *pg_owner;
@@ -3613,6 +3657,21 @@ long do_mmu_update(
 
         cmd = req.ptr & (sizeof(l1_pgentry_t)-1);
 
+        /*
+         * Consecutive updates to the same L1 table are done under a single
+         * reference and page lock, taken for the first of them.  Release it
+         * as soon as the run ends.
+         */
+        if ( l1_page &&
+             ((cmd != MMU_NORMAL_PT_UPDATE &&
+               cmd != MMU_PT_UPDATE_PRESERVE_AD) ||
+              (req.ptr >> PAGE_SHIFT) != l1_gmfn) )
+        {
+            page_unlock(l1_page);
+            put_page(l1_page);
+            l1_page = NULL;
+        }
+
         switch ( cmd )
         {
             /*
@@ -3647,6 +3706,21 @@ long do_mmu_update(
 
             req.ptr -= cmd;
             gmfn = req.ptr >> PAGE_SHIFT;
+
+            if ( l1_page )
+            {
+                /* Still mapped, referenced and locked from the last entry. */
+                ASSERT(gmfn == l1_gmfn);
+                perfc_incr(mmu_update_l1_batched);
+                va = _p(((unsigned long)va & PAGE_MASK) +
+                        (req.ptr & ~PAGE_MASK));
+                rc = mod_l1_entry(va, l1e_from_intpte(req.val),
+                                  mfn_x(map_mfn),
+                                  cmd == MMU_PT_UPDATE_PRESERVE_AD, v,
+                                  pg_owner);
+                break;
+            }
+
             page = get_page_from_gfn(pt_owner, gmfn, &p2mt, P2M_ALLOC);
 
             if ( unlikely(!page) || p2mt != p2m_ram_rw )
@@ -3683,6 +3757,12 @@ long do_mmu_update(
                     rc = mod_l1_entry(va, l1e_from_intpte(req.val), mfn,
                                       cmd == MMU_PT_UPDATE_PRESERVE_AD, v,
                                       pg_owner);
+                    /* Keep the page locked for a following entry. */
+                    if ( !rc )
+                    {
+                        l1_page = page;
+                        l1_gmfn = gmfn;
+                    }
                     break;
 
                 case PGT_l2_page_table:
@@ -3724,6 +3804,8 @@ long do_mmu_update(
                         rc = 0;
                     break;
                 }
+                if ( page == l1_page )
+                    break;
                 page_unlock(page);
                 if ( rc == -EINTR )
                     rc = -ERESTART;
@@ -3791,6 +3873,12 @@ long do_mmu_update(
         guest_handle_add_offset(ureqs, 1);
     }
 
+    if ( l1_page )
+    {
+        page_unlock(l1_page);
+        put_page(l1_page);
+    }
+
     if ( rc == -ERESTART )
     {
         ASSERT(i < count);
@@ -4012,7 +4100,7 @@ static int __do_update_va_mapping(
         switch ( (bmap_ptr = flags & ~UVMF_FLUSHTYPE_MASK) )
         {
         case UVMF_LOCAL:
-            flush_tlb_local();
+            flush_tlb_mask_deferred(cpumask_of(smp_processor_id()));
             break;
         case UVMF_ALL:
             mask = d->dirty_cpumask;
@@ -4025,7 +4113,7 @@ static int __do_update_va_mapping(
             break;
         }
         if ( mask )
-            flush_tlb_mask(mask);
+            flush_tlb_mask_deferred(mask);
         break;
 
     case UVMF_INVLPG:
@@ -5607,6 +5695,9 @@ void paging_invlpg(struct vcpu *v, unsigned long va)
     if ( !is_canonical_address(va) )
         return;
 
+    if ( is_hvm_vcpu(v) )
+        hvm_vcpu_io_flush_insn_cache(&v->arch.hvm_vcpu.hvm_io);
+
     if ( paging_mode_enabled(v->domain) &&
          !paging_get_hostmode(v)->invlpg(v, va) )
         return;
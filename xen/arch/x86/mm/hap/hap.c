@@ -53,123 +53,218 @@
 /************************************************/
 
 /*
- * hap_track_dirty_vram()
- * Create the domain's dv_dirty_vram struct on demand.
- * Create a dirty vram range on demand when some [begin_pfn:begin_pfn+nr] is
- * first encountered.
- * Collect the guest_dirty bitmask, a bit mask of the dirty vram pages, by
- * calling paging_log_dirty_range(), which interrogates each vram
- * page's p2m type looking for pages that have been made writable.
+ * hap_dirty_vram_bitmap()
+ * Create the domain's dirty_vram struct on demand, when some
+ * [begin_pfn:begin_pfn+nr] is first encountered, and put the range in log
+ * dirty mode.
+ * The first write to each page then faults, or is logged by PML, and goes
+ * through paging_mark_pfn_dirty(), which sets the page's bit in
+ * dirty_vram->dirty_bitmap.  Collecting the guest_dirty bitmask is thus a
+ * copy, and only the pages which were written need write protecting again,
+ * rather than every page of the range having its p2m type looked up.
+ * @dirty_bitmap has BITS_TO_LONGS(nr) longs, and is left alone, returning
+ * -ENODATA, when tracking has only just been (re)started: all pages are to
+ * be considered dirty then.  nr == 0 stops tracking.
  */
-
-int hap_track_dirty_vram(struct domain *d,
-                         unsigned long begin_pfn,
-                         unsigned long nr,
-                         XEN_GUEST_HANDLE_PARAM(void) guest_dirty_bitmap)
+int hap_dirty_vram_bitmap(struct domain *d,
+                          unsigned long begin_pfn,
+                          unsigned long nr,
+                          unsigned long *dirty_bitmap)
 {
-    long rc = 0;
-    struct sh_dirty_vram *dirty_vram;
-    uint8_t *dirty_bitmap = NULL;
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    unsigned long size = BITS_TO_LONGS(nr) * sizeof(*dirty_bitmap);
+    unsigned long i, nr_dirty = 0;
+    struct sh_dirty_vram *dirty_vram, *old;
+    bool restart = false;
+    struct vcpu *v;
+    int rc;
 
-    if ( nr )
+    if ( !nr )
     {
-        int size = (nr + BITS_PER_BYTE - 1) / BITS_PER_BYTE;
+        paging_lock(d);
+        dirty_vram = d->arch.hvm_domain.dirty_vram;
+        d->arch.hvm_domain.dirty_vram = NULL;
+        paging_unlock(d);
 
-        if ( !paging_mode_log_dirty(d) )
+        if ( dirty_vram )
         {
-            rc = paging_log_dirty_enable(d, 0);
-            if ( rc )
-                goto out;
+            /*
+             * If zero pages specified while tracking dirty vram
+             * then stop tracking
+             */
+            p2m_change_type_range(d, dirty_vram->begin_pfn,
+                                  dirty_vram->end_pfn,
+                                  p2m_ram_logdirty, p2m_ram_rw);
+            xfree(dirty_vram->dirty_bitmap);
+            xfree(dirty_vram);
         }
 
-        rc = -ENOMEM;
-        dirty_bitmap = vzalloc(size);
-        if ( !dirty_bitmap )
-            goto out;
+        return 0;
+    }
 
-        paging_lock(d);
+    /* Nothing got recorded while log dirty mode was off. */
+    if ( !paging_mode_log_dirty(d) )
+    {
+        rc = paging_log_dirty_enable(d, 0);
+        if ( rc )
+            return rc;
+        restart = true;
+    }
 
-        dirty_vram = d->arch.hvm_domain.dirty_vram;
-        if ( !dirty_vram )
-        {
-            rc = -ENOMEM;
-            if ( (dirty_vram = xzalloc(struct sh_dirty_vram)) == NULL )
-            {
-                paging_unlock(d);
-                goto out;
-            }
+    paging_lock(d);
 
-            d->arch.hvm_domain.dirty_vram = dirty_vram;
-        }
+    dirty_vram = d->arch.hvm_domain.dirty_vram;
+    if ( restart || !dirty_vram || begin_pfn != dirty_vram->begin_pfn ||
+         begin_pfn + nr != dirty_vram->end_pfn )
+    {
+        unsigned long *bitmap;
 
-        if ( begin_pfn != dirty_vram->begin_pfn ||
-             begin_pfn + nr != dirty_vram->end_pfn )
+        dirty_vram = xzalloc(struct sh_dirty_vram);
+        bitmap = xzalloc_array(unsigned long, BITS_TO_LONGS(nr));
+        if ( !dirty_vram || !bitmap )
         {
-            unsigned long ostart = dirty_vram->begin_pfn;
-            unsigned long oend = dirty_vram->end_pfn;
-
-            dirty_vram->begin_pfn = begin_pfn;
-            dirty_vram->end_pfn = begin_pfn + nr;
-
             paging_unlock(d);
+            xfree(dirty_vram);
+            xfree(bitmap);
+            return -ENOMEM;
+        }
 
-            if ( oend > ostart )
-                p2m_change_type_range(d, ostart, oend,
-                                      p2m_ram_logdirty, p2m_ram_rw);
+        dirty_vram->begin_pfn = begin_pfn;
+        dirty_vram->end_pfn = begin_pfn + nr;
+        dirty_vram->dirty_bitmap = (uint8_t *)bitmap;
 
-            /*
-             * Switch vram to log dirty mode, either by setting l1e entries of
-             * P2M table to be read-only, or via hardware-assisted log-dirty.
-             */
-            p2m_change_type_range(d, begin_pfn, begin_pfn + nr,
-                                  p2m_ram_rw, p2m_ram_logdirty);
+        old = d->arch.hvm_domain.dirty_vram;
+        d->arch.hvm_domain.dirty_vram = dirty_vram;
 
-            flush_tlb_mask(d->dirty_cpumask);
+        paging_unlock(d);
 
-            memset(dirty_bitmap, 0xff, size); /* consider all pages dirty */
-        }
-        else
+        if ( old )
         {
-            paging_unlock(d);
+            p2m_change_type_range(d, old->begin_pfn, old->end_pfn,
+                                  p2m_ram_logdirty, p2m_ram_rw);
+            xfree(old->dirty_bitmap);
+            xfree(old);
+        }
 
-            domain_pause(d);
+        /*
+         * Switch vram to log dirty mode, either by setting l1e entries of
+         * P2M table to be read-only, or via hardware-assisted log-dirty.
+         */
+        p2m_change_type_range(d, begin_pfn, begin_pfn + nr,
+                              p2m_ram_rw, p2m_ram_logdirty);
 
-            /* Flush dirty GFNs potentially cached by hardware. */
-            p2m_flush_hardware_cached_dirty(d);
+        flush_tlb_mask(d->dirty_cpumask);
+
+        return -ENODATA;
+    }
 
-            /* get the bitmap */
-            paging_log_dirty_range(d, begin_pfn, nr, dirty_bitmap);
+    paging_unlock(d);
 
-            domain_unpause(d);
+    /*
+     * Flush dirty GFNs potentially cached by hardware.  Only vcpus which
+     * ran since we last did so can have any, and just those get paused.
+     */
+    if ( p2m->flush_hardware_cached_dirty_vcpu )
+        for_each_vcpu ( d, v )
+        {
+            if ( !v->is_running &&
+                 v->runstate.time[RUNSTATE_running] ==
+                 v->arch.hvm_vcpu.dirty_vram_ran )
+                continue;
+
+            vcpu_pause(v);
+            p2m_flush_hardware_cached_dirty_vcpu(v);
+            v->arch.hvm_vcpu.dirty_vram_ran =
+                v->runstate.time[RUNSTATE_running];
+            vcpu_unpause(v);
         }
 
-        rc = -EFAULT;
-        if ( copy_to_guest(guest_dirty_bitmap, dirty_bitmap, size) == 0 )
-            rc = 0;
+    /*
+     * The fault path marks the page dirty and makes it writable under the
+     * p2m lock, so holding that across fetching the bits and re-arming the
+     * pages means no write can fall in between.
+     */
+    p2m_lock(p2m);
+    paging_lock(d);
+
+    dirty_vram = d->arch.hvm_domain.dirty_vram;
+    if ( !dirty_vram || begin_pfn != dirty_vram->begin_pfn ||
+         begin_pfn + nr != dirty_vram->end_pfn )
+    {
+        /* Raced with another caller changing the range. */
+        paging_unlock(d);
+        p2m_unlock(p2m);
+        return -ENODATA;
     }
-    else
+
+    if ( dirty_vram->nr_dirty )
     {
-        paging_lock(d);
+        memcpy(dirty_bitmap, dirty_vram->dirty_bitmap, size);
+        memset(dirty_vram->dirty_bitmap, 0, size);
+        nr_dirty = dirty_vram->nr_dirty;
+        dirty_vram->nr_dirty = 0;
+    }
 
-        dirty_vram = d->arch.hvm_domain.dirty_vram;
-        if ( dirty_vram )
-        {
-            /*
-             * If zero pages specified while tracking dirty vram
-             * then stop tracking
-             */
-            begin_pfn = dirty_vram->begin_pfn;
-            nr = dirty_vram->end_pfn - dirty_vram->begin_pfn;
-            xfree(dirty_vram);
-            d->arch.hvm_domain.dirty_vram = NULL;
-        }
+    paging_unlock(d);
 
-        paging_unlock(d);
-        if ( nr )
-            p2m_change_type_range(d, begin_pfn, begin_pfn + nr,
-                                  p2m_ram_logdirty, p2m_ram_rw);
+    /* Pages only written by Xen itself may not need re-arming: -EBUSY. */
+    if ( nr_dirty )
+        for ( i = find_first_bit(dirty_bitmap, nr); i < nr;
+              i = find_next_bit(dirty_bitmap, nr, i + 1) )
+            p2m_change_type_one(d, begin_pfn + i,
+                                p2m_ram_rw, p2m_ram_logdirty);
+
+    p2m_unlock(p2m);
+
+    if ( nr_dirty )
+        flush_tlb_mask(d->dirty_cpumask);
+
+    return 0;
+}
+
+/* Called from paging_mark_pfn_dirty(), with the paging lock held. */
+void hap_mark_dirty_vram(struct domain *d, unsigned long pfn)
+{
+    struct sh_dirty_vram *dirty_vram = d->arch.hvm_domain.dirty_vram;
+
+    ASSERT(paging_locked_by_me(d));
+
+    if ( !dirty_vram || pfn < dirty_vram->begin_pfn ||
+         pfn >= dirty_vram->end_pfn )
+        return;
+
+    if ( !__test_and_set_bit(pfn - dirty_vram->begin_pfn,
+                             (unsigned long *)dirty_vram->dirty_bitmap) )
+        dirty_vram->nr_dirty++;
+}
+
+int hap_track_dirty_vram(struct domain *d,
+                         unsigned long begin_pfn,
+                         unsigned long nr,
+                         XEN_GUEST_HANDLE_PARAM(void) guest_dirty_bitmap)
+{
+    unsigned long size = (nr + BITS_PER_BYTE - 1) / BITS_PER_BYTE;
+    uint8_t *dirty_bitmap = NULL;
+    int rc;
+
+    if ( nr )
+    {
+        dirty_bitmap = vzalloc(BITS_TO_LONGS(nr) * sizeof(unsigned long));
+        if ( !dirty_bitmap )
+            return -ENOMEM;
     }
-out:
+
+    rc = hap_dirty_vram_bitmap(d, begin_pfn, nr,
+                               (unsigned long *)dirty_bitmap);
+    if ( rc == -ENODATA )
+    {
+        memset(dirty_bitmap, 0xff, size); /* consider all pages dirty */
+        rc = 0;
+    }
+
+    if ( !rc && nr && copy_to_guest(guest_dirty_bitmap, dirty_bitmap, size) )
+        rc = -EFAULT;
+
     vfree(dirty_bitmap);
 
     return rc;
@@ -585,6 +680,8 @@ void hap_teardown(struct domain *d, bool *preempted)
 
     d->arch.paging.mode &= ~PG_log_dirty;
 
+    if ( d->arch.hvm_domain.dirty_vram )
+        xfree(d->arch.hvm_domain.dirty_vram->dirty_bitmap);
     xfree(d->arch.hvm_domain.dirty_vram);
     d->arch.hvm_domain.dirty_vram = NULL;
 
@@ -741,7 +838,15 @@ hap_write_p2m_entry(struct domain *d, unsigned long gfn, l1_pgentry_t *p,
 
     safe_write_pte(p, new);
     if ( old_flags & _PAGE_PRESENT )
-        flush_tlb_mask(d->dirty_cpumask);
+    {
+        struct p2m_domain *p2m = p2m_get_hostp2m(d);
+
+        /* Leave the flush to p2m_unlock() if the p2m lock is held. */
+        if ( p2m->defer_flush )
+            p2m->need_flush = 1;
+        else
+            flush_tlb_mask(d->dirty_cpumask);
+    }
 
     paging_unlock(d);
 
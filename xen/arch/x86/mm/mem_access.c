@@ -277,12 +277,20 @@ int p2m_set_altp2m_mem_access(struct domain *d, struct p2m_domain *hp2m,
                            current->domain != d);
 }
 
+/*
+ * Set the access of gfn and, if they are mapped by the same (superpage)
+ * entry of the host p2m, of as many of the nr pages following it as that
+ * entry covers, so as to not shatter it.  *order gets set to the order of
+ * the GFN range dealt with.
+ */
 static int set_mem_access(struct domain *d, struct p2m_domain *p2m,
                           struct p2m_domain *ap2m, p2m_access_t a,
-                          gfn_t gfn)
+                          gfn_t gfn, unsigned long nr, unsigned int *order)
 {
     int rc = 0;
 
+    *order = PAGE_ORDER_4K;
+
     if ( ap2m )
     {
         rc = p2m_set_altp2m_mem_access(d, p2m, ap2m, a, gfn);
@@ -295,9 +303,20 @@ static int set_mem_access(struct domain *d, struct p2m_domain *p2m,
         mfn_t mfn;
         p2m_access_t _a;
         p2m_type_t t;
+        unsigned int page_order;
+
+        mfn = p2m->get_entry(p2m, gfn, &t, &_a, 0, &page_order, NULL);
+
+        /* Use the largest (smaller) order the range covers fully. */
+        while ( page_order > PAGE_ORDER_4K &&
+                (!IS_ALIGNED(gfn_x(gfn), 1UL << page_order) ||
+                 (1UL << page_order) > nr) )
+            page_order -= PAGE_ORDER_2M;
 
-        mfn = p2m->get_entry(p2m, gfn, &t, &_a, 0, NULL, NULL);
-        rc = p2m->set_entry(p2m, gfn, mfn, PAGE_ORDER_4K, t, a, -1);
+        *order = page_order;
+
+        if ( _a != a )
+            rc = p2m->set_entry(p2m, gfn, mfn, page_order, t, a, -1);
     }
 
     return rc;
@@ -348,6 +367,7 @@ long p2m_set_mem_access(struct domain *d, gfn_t gfn, uint32_t nr,
     struct p2m_domain *p2m = p2m_get_hostp2m(d), *ap2m = NULL;
     p2m_access_t a;
     unsigned long gfn_l;
+    unsigned int order;
     long rc = 0;
 
     /* altp2m view 0 is treated as the hostp2m */
@@ -374,15 +394,22 @@ long p2m_set_mem_access(struct domain *d, gfn_t gfn, uint32_t nr,
     if ( ap2m )
         p2m_lock(ap2m);
 
-    for ( gfn_l = gfn_x(gfn) + start; nr > start; ++gfn_l )
+    for ( gfn_l = gfn_x(gfn) + start; nr > start; gfn_l += 1UL << order )
     {
-        rc = set_mem_access(d, p2m, ap2m, a, _gfn(gfn_l));
+        uint32_t prev = start;
+
+        rc = set_mem_access(d, p2m, ap2m, a, _gfn(gfn_l), nr - start, &order);
 
         if ( rc )
             break;
 
-        /* Check for continuation if it's not the last iteration. */
-        if ( nr > ++start && !(start & mask) && hypercall_preempt_check() )
+        /*
+         * Check for continuation if it's not the last iteration, and a
+         * multiple of (mask + 1) was reached or skipped over.
+         */
+        start += 1U << order;
+        if ( nr > start && (start & ~mask) != (prev & ~mask) &&
+             hypercall_preempt_check() )
         {
             rc = start;
             break;
@@ -403,6 +430,7 @@ long p2m_set_mem_access_multi(struct domain *d,
                               unsigned int altp2m_idx)
 {
     struct p2m_domain *p2m = p2m_get_hostp2m(d), *ap2m = NULL;
+    unsigned int order;
     long rc = 0;
 
     /* altp2m view 0 is treated as the hostp2m */
@@ -438,7 +466,7 @@ long p2m_set_mem_access_multi(struct domain *d,
             break;
         }
 
-        rc = set_mem_access(d, p2m, ap2m, a, _gfn(gfn_l));
+        rc = set_mem_access(d, p2m, ap2m, a, _gfn(gfn_l), 1, &order);
 
         if ( rc )
             break;
@@ -36,6 +36,7 @@
 #include <asm/altp2m.h>
 #include <asm/atomic.h>
 #include <asm/event.h>
+#include <asm/hvm/save.h>
 #include <xsm/xsm.h>
 
 #include "mm-locks.h"
@@ -63,12 +64,46 @@ static DEFINE_PER_CPU(pg_lock_data_t, __pld);
  * table constantly. */
 #define RMAP_LIGHT_SHARED_PAGE   (RMAP_HEAVY_SHARED_PAGE >> 2)
 
+/*
+ * Sharing state that every share and unshare touches is kept per NUMA
+ * node, so that unshare faults on different nodes don't bounce the same
+ * cache lines.  Counters are charged to the node of the current CPU and
+ * summed when read; a shared page sits on the audit list of its own node.
+ */
+struct mem_sharing_node {
+    atomic_t nr_saved_mfns;
+    atomic_t nr_shared_mfns;
+#if MEM_SHARING_AUDIT
+    spinlock_t audit_lock;
+    struct list_head audit_list;
+#endif
+} __cacheline_aligned;
+
+static struct mem_sharing_node shr_nodes[MAX_NUMNODES];
+
+static inline struct mem_sharing_node *local_shr_node(void)
+{
+    nodeid_t node = cpu_to_node(smp_processor_id());
+
+    return &shr_nodes[node < MAX_NUMNODES ? node : 0];
+}
+
+#define shr_count_inc(c) atomic_inc(&local_shr_node()->c)
+#define shr_count_dec(c) atomic_dec(&local_shr_node()->c)
+
 #if MEM_SHARING_AUDIT
 
-static struct list_head shr_audit_list;
-static spinlock_t shr_audit_lock;
 static DEFINE_RCU_READ_LOCK(shr_audit_read_lock);
 
+static inline struct mem_sharing_node *page_shr_node(struct page_info *page)
+{
+    return &shr_nodes[phys_to_nid(page_to_maddr(page))];
+}
+
+#define for_each_audit_entry(node, ae)                      \
+    for ( (node) = 0; (node) < MAX_NUMNODES; (node)++ )     \
+        list_for_each_rcu(ae, &shr_nodes[node].audit_list)
+
 /* RCU delayed free of audit list entry */
 static void _free_pg_shared_info(struct rcu_head *head)
 {
@@ -77,23 +112,27 @@ static void _free_pg_shared_info(struct rcu_head *head)
 
 static inline void audit_add_list(struct page_info *page)
 {
+    struct mem_sharing_node *n = page_shr_node(page);
+
     INIT_LIST_HEAD(&page->sharing->entry);
-    spin_lock(&shr_audit_lock);
-    list_add_rcu(&page->sharing->entry, &shr_audit_list);
-    spin_unlock(&shr_audit_lock);
+    spin_lock(&n->audit_lock);
+    list_add_rcu(&page->sharing->entry, &n->audit_list);
+    spin_unlock(&n->audit_lock);
 }
 
 /* Removes from the audit list and cleans up the page sharing metadata. */
 static inline void page_sharing_dispose(struct page_info *page)
 {
+    struct mem_sharing_node *n = page_shr_node(page);
+
     /* Unlikely given our thresholds, but we should be careful. */
     if ( unlikely(RMAP_USES_HASHTAB(page)) )
         free_xenheap_pages(page->sharing->hash_table.bucket, 
                             RMAP_HASHTAB_ORDER);
 
-    spin_lock(&shr_audit_lock);
+    spin_lock(&n->audit_lock);
     list_del_rcu(&page->sharing->entry);
-    spin_unlock(&shr_audit_lock);
+    spin_unlock(&n->audit_lock);
     INIT_RCU_HEAD(&page->sharing->rcu_head);
     call_rcu(&page->sharing->rcu_head, _free_pg_shared_info);
 }
@@ -157,9 +196,6 @@ static inline shr_handle_t get_next_handle(void)
 #undef page_to_mfn
 #define page_to_mfn(_pg) _mfn(__page_to_mfn(_pg))
 
-static atomic_t nr_saved_mfns   = ATOMIC_INIT(0); 
-static atomic_t nr_shared_mfns  = ATOMIC_INIT(0);
-
 /** Reverse map **/
 /* Every shared frame keeps a reverse map (rmap) of <domain, gfn> tuples that
  * this shared frame backs. For pages with a low degree of sharing, a O(n)
@@ -424,12 +460,13 @@ static int audit(void)
     unsigned long count_expected;
     unsigned long count_found = 0;
     struct list_head *ae;
+    unsigned int node;
 
-    count_expected = atomic_read(&nr_shared_mfns);
+    count_expected = mem_sharing_get_nr_shared_mfns();
 
     rcu_read_lock(&shr_audit_read_lock);
 
-    list_for_each_rcu(ae, &shr_audit_list)
+    for_each_audit_entry ( node, ae )
     {
         struct page_sharing_info *pg_shared_info;
         unsigned long nr_gfns = 0;
@@ -579,12 +616,22 @@ int mem_sharing_notify_enomem(struct domain *d, unsigned long gfn,
 
 unsigned int mem_sharing_get_nr_saved_mfns(void)
 {
-    return ((unsigned int)atomic_read(&nr_saved_mfns));
+    unsigned int i, nr = 0;
+
+    for ( i = 0; i < MAX_NUMNODES; i++ )
+        nr += atomic_read(&shr_nodes[i].nr_saved_mfns);
+
+    return nr;
 }
 
 unsigned int mem_sharing_get_nr_shared_mfns(void)
 {
-    return (unsigned int)atomic_read(&nr_shared_mfns);
+    unsigned int i, nr = 0;
+
+    for ( i = 0; i < MAX_NUMNODES; i++ )
+        nr += atomic_read(&shr_nodes[i].nr_shared_mfns);
+
+    return nr;
 }
 
 /* Functions that change a page's type and ownership */
@@ -876,7 +923,7 @@ static int nominate_page(struct domain *d, gfn_t gfn,
     BUG_ON(p2m_change_type_one(d, gfn_x(gfn), p2mt, p2m_ram_shared));
 
     /* Account for this page. */
-    atomic_inc(&nr_shared_mfns);
+    shr_count_inc(nr_shared_mfns);
 
     /* Update m2p entry to SHARED_M2P_ENTRY */
     set_gpfn_from_mfn(mfn_x(mfn), SHARED_M2P_ENTRY);
@@ -967,7 +1014,15 @@ static int share_pages(struct domain *sd, gfn_t sgfn, shr_handle_t sh,
         goto err_out;
     }
 
-    /* Merge the lists together */
+    /* Switch the source rmap to a hash table once, up front, rather than
+     * part way through the merge. */
+    if ( !RMAP_USES_HASHTAB(spage) &&
+         (rmap_count(spage) + rmap_count(cpage) >= RMAP_HEAVY_SHARED_PAGE) )
+        (void)rmap_list_to_hash_table(spage);
+
+    /* Merge the lists together.  The client's gfns mostly belong to one
+     * domain, so hang on to the domain reference across entries. */
+    d = NULL;
     rmap_seed_iterator(cpage, &ri);
     while ( (gfn = rmap_iterate(cpage, &ri)) != NULL)
     {
@@ -979,11 +1034,17 @@ static int share_pages(struct domain *sd, gfn_t sgfn, shr_handle_t sh,
         rmap_del(gfn, cpage, 0);
         rmap_add(gfn, spage);
         put_page_and_type(cpage);
-        d = get_domain_by_id(gfn->domain);
-        BUG_ON(!d);
+        if ( !d || d->domain_id != gfn->domain )
+        {
+            if ( d )
+                put_domain(d);
+            d = get_domain_by_id(gfn->domain);
+            BUG_ON(!d);
+        }
         BUG_ON(set_shared_p2m_entry(d, gfn->gfn, smfn));
-        put_domain(d);
     }
+    if ( d )
+        put_domain(d);
     ASSERT(list_empty(&cpage->sharing->gfns));
 
     /* Clear the rest of the shared state */
@@ -998,8 +1059,8 @@ static int share_pages(struct domain *sd, gfn_t sgfn, shr_handle_t sh,
         put_page(cpage);
 
     /* We managed to free a domain page. */
-    atomic_dec(&nr_shared_mfns);
-    atomic_inc(&nr_saved_mfns);
+    shr_count_dec(nr_shared_mfns);
+    shr_count_inc(nr_saved_mfns);
     ret = 0;
     
 err_out:
@@ -1076,7 +1137,7 @@ int mem_sharing_add_to_physmap(struct domain *sd, unsigned long sgfn, shr_handle
         }
     }
 
-    atomic_inc(&nr_saved_mfns);
+    shr_count_inc(nr_saved_mfns);
 
 err_unlock:
     mem_sharing_page_unlock(spage);
@@ -1143,10 +1204,10 @@ int __mem_sharing_unshare_page(struct domain *d,
         mem_sharing_gfn_destroy(page, d, gfn_info);
         page_sharing_dispose(page);
         page->sharing = NULL;
-        atomic_dec(&nr_shared_mfns);
+        shr_count_dec(nr_shared_mfns);
     }
     else
-        atomic_dec(&nr_saved_mfns);
+        shr_count_dec(nr_saved_mfns);
 
     /* If the GFN is getting destroyed drop the references to MFN 
      * (possibly freeing the page), and exit early */
@@ -1176,7 +1237,7 @@ int __mem_sharing_unshare_page(struct domain *d,
     if ( !page ) 
     {
         /* Undo dec of nr_saved_mfns, as the retry will decrease again. */
-        atomic_inc(&nr_saved_mfns);
+        shr_count_inc(nr_saved_mfns);
         mem_sharing_page_unlock(old_page);
         put_gfn(d, gfn);
         /* Caller is responsible for placing an event
@@ -1261,6 +1322,14 @@ int relinquish_shared_pages(struct domain *d)
     }
 
     p2m_unlock(p2m);
+
+    /* All pages borrowed from the parent are gone: drop our reference. */
+    if ( !rc && d->arch.hvm_domain.fork_parent )
+    {
+        put_domain(d->arch.hvm_domain.fork_parent);
+        d->arch.hvm_domain.fork_parent = NULL;
+    }
+
     return rc;
 }
 
@@ -1315,6 +1384,201 @@ static int range_share(struct domain *d, struct domain *cd,
     return rc;
 }
 
+/*
+ * Find the nearest ancestor of a fork actually backing gfn with RAM.  On
+ * success the ancestor's gfn is returned locked.
+ */
+static struct domain *fork_source(struct domain *cd, gfn_t gfn, mfn_t *mfn)
+{
+    struct domain *d = cd;
+    p2m_type_t p2mt;
+
+    while ( (d = d->arch.hvm_domain.fork_parent) != NULL )
+    {
+        *mfn = get_gfn_query(d, gfn_x(gfn), &p2mt);
+        if ( p2m_is_ram(p2mt) && mfn_valid(*mfn) )
+            return d;
+        put_gfn(d, gfn_x(gfn));
+        if ( !p2m_is_hole(p2mt) )
+            break;
+    }
+
+    return NULL;
+}
+
+int mem_sharing_fork_page(struct domain *cd, gfn_t gfn, bool unsharing)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(cd);
+    struct page_info *page;
+    struct domain *d;
+    shr_handle_t handle;
+    p2m_type_t p2mt;
+    p2m_access_t p2ma;
+    mfn_t mfn;
+    int rc;
+
+    if ( !mem_sharing_is_fork(cd) )
+        return -ENOENT;
+
+    if ( !unsharing )
+    {
+        if ( (d = fork_source(cd, gfn, &mfn)) == NULL )
+            return -ENOENT;
+        put_gfn(d, gfn_x(gfn));
+
+        /*
+         * Pages Xen or a device model hold extra references to cannot be
+         * nominated; those fall through to being copied.
+         */
+        if ( !nominate_page(d, gfn, 0, &handle) &&
+             !mem_sharing_add_to_physmap(d, gfn_x(gfn), handle,
+                                         cd, gfn_x(gfn)) )
+            return 0;
+    }
+
+    if ( (page = alloc_domheap_page(cd, 0)) == NULL )
+        return -ENOMEM;
+
+    if ( (d = fork_source(cd, gfn, &mfn)) == NULL )
+    {
+        rc = -ENOENT;
+        goto free_page;
+    }
+    copy_domain_page(page_to_mfn(page), mfn);
+    put_gfn(d, gfn_x(gfn));
+
+    p2m_lock(p2m);
+    /* Someone else may have filled the hole meanwhile. */
+    p2m->get_entry(p2m, gfn, &p2mt, &p2ma, 0, NULL, NULL);
+    if ( p2m_is_hole(p2mt) )
+        rc = p2m_set_entry(p2m, gfn, page_to_mfn(page), PAGE_ORDER_4K,
+                           p2m_ram_rw, p2m->default_access);
+    else
+        rc = -EEXIST;
+    p2m_unlock(p2m);
+
+    if ( !rc )
+    {
+        set_gpfn_from_mfn(mfn_x(page_to_mfn(page)), gfn_x(gfn));
+        return 0;
+    }
+    if ( rc == -EEXIST )
+        rc = 0;
+
+ free_page:
+    if ( test_and_clear_bit(_PGC_allocated, &page->count_info) )
+        put_page(page);
+    return rc;
+}
+
+static int fork_shared_info(struct domain *cd, struct domain *d)
+{
+    unsigned long gfn = mfn_to_gmfn(d, virt_to_mfn(d->shared_info));
+    union xen_add_to_physmap_batch_extra extra = { .res0 = 0 };
+
+    cd->arch.has_32bit_shinfo = d->arch.has_32bit_shinfo;
+    copy_domain_page(_mfn(virt_to_mfn(cd->shared_info)),
+                     _mfn(virt_to_mfn(d->shared_info)));
+
+    /* Not (yet) mapped into the parent's physmap. */
+    if ( !VALID_M2P(gfn) )
+        return 0;
+
+    return xenmem_add_to_physmap_one(cd, XENMAPSPACE_shared_info, extra, 0,
+                                     _gfn(gfn));
+}
+
+static int fork_vcpu_info(struct domain *cd, struct domain *d)
+{
+    unsigned int i;
+    int rc;
+
+    for ( i = 0; i < d->max_vcpus; i++ )
+    {
+        struct vcpu *v = d->vcpu[i], *cv = cd->vcpu[i];
+        unsigned long gfn;
+
+        if ( !v || mfn_eq(v->vcpu_info_mfn, INVALID_MFN) )
+            continue;
+
+        gfn = mfn_to_gmfn(d, mfn_x(v->vcpu_info_mfn));
+        if ( !VALID_M2P(gfn) )
+            return -EINVAL;
+
+        /* The page must be private to the child for map_vcpu_info(). */
+        rc = mem_sharing_fork_page(cd, _gfn(gfn), true);
+        if ( !rc )
+            rc = map_vcpu_info(cv, gfn, (unsigned long)v->vcpu_info &
+                                        ~PAGE_MASK);
+        if ( rc )
+            return rc;
+
+        memcpy(cv->vcpu_info, v->vcpu_info, sizeof(*cv->vcpu_info));
+    }
+
+    return 0;
+}
+
+/*
+ * Turn an empty, paused HVM domain into a copy-on-write fork of a paused
+ * parent.  Only the state needed to resume the vCPUs is copied up front;
+ * guest memory is filled in lazily by mem_sharing_fork_page() as the
+ * child touches it.
+ */
+static int mem_sharing_fork(struct domain *d, struct domain *cd)
+{
+    struct hvm_domain_context c = { 0 };
+    unsigned int i;
+    int rc;
+
+    if ( d == cd || cd->arch.hvm_domain.fork_parent )
+        return -EINVAL;
+
+    /*
+     * Sanity check only, the client should keep the parent paused for as
+     * long as the fork exists.
+     */
+    if ( !atomic_read(&d->pause_count) || !atomic_read(&cd->pause_count) )
+        return -EBUSY;
+
+    if ( cd->tot_pages || cd->max_vcpus != d->max_vcpus )
+        return -EINVAL;
+
+    for ( i = 0; i < d->max_vcpus; i++ )
+        if ( !d->vcpu[i] != !cd->vcpu[i] )
+            return -EINVAL;
+
+    if ( need_iommu(cd) )
+        return -EXDEV;
+
+    if ( !get_domain(d) )
+        return -EINVAL;
+    cd->arch.hvm_domain.fork_parent = d;
+
+    memcpy(cd->arch.hvm_domain.params, d->arch.hvm_domain.params,
+           HVM_NR_PARAMS * sizeof(*cd->arch.hvm_domain.params));
+    hvm_set_callback_via(cd, d->arch.hvm_domain.params[HVM_PARAM_CALLBACK_IRQ]);
+
+    if ( (rc = fork_shared_info(cd, d)) ||
+         (rc = fork_vcpu_info(cd, d)) )
+        return rc;
+
+    c.size = hvm_save_size(d);
+    if ( (c.data = xmalloc_bytes(c.size)) == NULL )
+        return -ENOMEM;
+
+    rc = hvm_save(d, &c);
+    if ( !rc )
+    {
+        c.size = c.cur;
+        c.cur = 0;
+        rc = hvm_load(cd, &c);
+    }
+
+    xfree(c.data);
+    return rc;
+}
+
 int mem_sharing_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_sharing_op_t) arg)
 {
     int rc;
@@ -1581,6 +1845,30 @@ int mem_sharing_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_sharing_op_t) arg)
         }
         break;
 
+        case XENMEM_sharing_op_fork:
+        {
+            struct domain *pd;
+
+            rc = -EINVAL;
+            if ( mso.u.fork._pad[0] || mso.u.fork._pad[1] ||
+                 mso.u.fork._pad[2] )
+                 goto out;
+
+            rc = rcu_lock_live_remote_domain_by_id(mso.u.fork.parent_domain,
+                                                   &pd);
+            if ( rc )
+                goto out;
+
+            rc = xsm_mem_sharing_op(XSM_DM_PRIV, pd, d, mso.op);
+            if ( !rc && !mem_sharing_enabled(pd) )
+                rc = -EINVAL;
+            if ( !rc )
+                rc = mem_sharing_fork(pd, d);
+
+            rcu_unlock_domain(pd);
+        }
+        break;
+
         case XENMEM_sharing_op_debug_gfn:
             rc = debug_gfn(d, _gfn(mso.u.debug.u.gfn));
             break;
@@ -1631,10 +1919,17 @@ int mem_sharing_domctl(struct domain *d, struct xen_domctl_mem_sharing_op *mec)
 
 void __init mem_sharing_init(void)
 {
+#if MEM_SHARING_AUDIT
+    unsigned int i;
+#endif
+
     printk("Initing memory sharing.\n");
 #if MEM_SHARING_AUDIT
-    spin_lock_init(&shr_audit_lock);
-    INIT_LIST_HEAD(&shr_audit_list);
+    for ( i = 0; i < MAX_NUMNODES; i++ )
+    {
+        spin_lock_init(&shr_nodes[i].audit_lock);
+        INIT_LIST_HEAD(&shr_nodes[i].audit_list);
+    }
 #endif
 }
 
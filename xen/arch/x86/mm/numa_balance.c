@@ -0,0 +1,343 @@
+/******************************************************************************
+ * arch/x86/mm/numa_balance.c
+ *
+ * Background migration of HVM guest memory towards the NUMA node its vCPUs
+ * run on.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <xen/domain_page.h>
+#include <xen/iommu.h>
+#include <xen/numa.h>
+#include <xen/sched.h>
+#include <xen/tasklet.h>
+#include <xen/timer.h>
+#include <asm/altp2m.h>
+#include <asm/numa.h>
+#include <asm/p2m.h>
+#include <asm/paging.h>
+
+#include "mm-locks.h"
+
+/* Override macros from asm/page.h to make them work with mfn_t */
+#undef mfn_to_page
+#define mfn_to_page(mfn) __mfn_to_page(mfn_x(mfn))
+#undef page_to_mfn
+#define page_to_mfn(pg) _mfn(__page_to_mfn(pg))
+
+/*
+ * Maximum amount of guest memory (in MiB) to move per domain and second.
+ * Zero (the default) disables balancing altogether.
+ */
+static unsigned int __read_mostly opt_numa_balance;
+integer_param("numa-balance", opt_numa_balance);
+
+#define NUMA_BALANCE_PERIOD   SECONDS(1)
+/* p2m entries looked at per period, bounding the cost of scanning. */
+#define NUMA_BALANCE_SCAN     1024
+
+struct numa_balance {
+    struct domain *domain;
+    struct timer timer;
+    struct tasklet tasklet;
+    unsigned long cursor;          /* Next gfn to look at. */
+    nodeid_t home;                 /* Target node of the last period. */
+    unsigned long pass_local;      /* Pages seen local / remote ... */
+    unsigned long pass_remote;     /* ... so far in the current pass. */
+    unsigned long local;           /* Same, for the last completed pass. */
+    unsigned long remote;
+    unsigned long migrated;        /* Pages moved in total. */
+    unsigned long failed;          /* Extents found busy or unmovable. */
+};
+
+/*
+ * The node a clear majority of the domain's (up) vCPUs last ran on, provided
+ * it's one the domain's memory may live on.  NUMA_NO_NODE otherwise.
+ */
+static nodeid_t home_node(const struct domain *d)
+{
+    unsigned int count[MAX_NUMNODES] = {}, nr = 0, best = 0;
+    nodeid_t node, home = NUMA_NO_NODE;
+    const struct vcpu *v;
+
+    for_each_vcpu ( d, v )
+    {
+        if ( !v->is_initialised || test_bit(_VPF_down, &v->pause_flags) )
+            continue;
+        node = cpu_to_node(v->processor);
+        if ( node >= MAX_NUMNODES )
+            continue;
+        nr++;
+        if ( ++count[node] > best )
+        {
+            best = count[node];
+            home = node;
+        }
+    }
+
+    if ( home == NUMA_NO_NODE || best * 2 <= nr ||
+         !node_isset(home, d->node_affinity) )
+        return NUMA_NO_NODE;
+
+    return home;
+}
+
+static bool numa_balance_movable(const struct domain *d)
+{
+    return !need_iommu(d) && !paging_mode_log_dirty(d) && !altp2m_active(d);
+}
+
+/*
+ * Move the 4k page or 2M superpage mapped at @gfn (aligned to @order) from
+ * @mfn to freshly allocated memory on @node.  Returns the number of pages
+ * moved, or 0 if the extent changed or is in use in ways which can't be
+ * transparently redirected (foreign or grant mappings, Xen's own mappings,
+ * etc.), which are all reflected in extra page references.
+ */
+static unsigned long migrate_extent(struct domain *d, unsigned long gfn,
+                                    mfn_t mfn, unsigned int order,
+                                    nodeid_t node)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    unsigned long i, nr = 1UL << order;
+    struct page_info *old = mfn_to_page(mfn), *new;
+    p2m_type_t t;
+    p2m_access_t a;
+    unsigned int cur_order;
+    mfn_t new_mfn;
+
+    new = alloc_domheap_pages(d, order, MEMF_node(node) | MEMF_exact_node |
+                                        MEMF_no_refcount);
+    if ( !new )
+        return 0;
+    new_mfn = page_to_mfn(new);
+
+    /*
+     * Account for the new extent right away, as freeing either it or the
+     * old one will drop the domain's page count.  This makes the domain
+     * transiently exceed its allocation by at most one extent.
+     */
+    spin_lock(&d->page_alloc_lock);
+    domain_adjust_tot_pages(d, nr);
+    spin_unlock(&d->page_alloc_lock);
+
+    gfn_lock(p2m, gfn, order);
+
+    /*
+     * Moving memory is only safe when nothing but the p2m (and hence the
+     * CPU) can access it, and nothing else tracks its changes.  Log-dirty
+     * mode in particular gets enabled before retyping the p2m under its
+     * lock, so checking here is sufficient.
+     */
+    if ( !numa_balance_movable(d) )
+        goto busy;
+
+    if ( !mfn_eq(p2m->get_entry(p2m, _gfn(gfn), &t, &a, 0, &cur_order, NULL),
+                 mfn) ||
+         t != p2m_ram_rw || cur_order != order )
+        goto busy;
+
+    for ( i = 0; i < nr; i++ )
+        if ( page_get_owner(&old[i]) != d ||
+             (old[i].count_info & (PGC_count_mask | PGC_allocated |
+                                   PGC_xen_heap | PGC_page_table |
+                                   PGC_broken)) != (PGC_allocated | 1) ||
+             (old[i].u.inuse.type_info & PGT_count_mask) )
+            goto busy;
+
+    /*
+     * Write-protect the extent while copying it.  Guest writes fault, and
+     * the fault handler will wait for the p2m lock we hold.  As will anyone
+     * trying to obtain a new reference to the pages through the p2m.
+     */
+    if ( p2m_set_entry(p2m, _gfn(gfn), mfn, order, p2m_ram_logdirty, a) )
+        goto busy;
+
+    for ( i = 0; i < nr; i++ )
+        copy_domain_page(mfn_add(new_mfn, i), mfn_add(mfn, i));
+
+    if ( p2m_set_entry(p2m, _gfn(gfn), new_mfn, order, p2m_ram_rw, a) )
+    {
+        if ( p2m_set_entry(p2m, _gfn(gfn), mfn, order, p2m_ram_rw, a) )
+            domain_crash(d);
+        goto busy;
+    }
+
+    for ( i = 0; i < nr; i++ )
+    {
+        set_gpfn_from_mfn(mfn_x(new_mfn) + i, gfn + i);
+        set_gpfn_from_mfn(mfn_x(mfn) + i, INVALID_M2P_ENTRY);
+    }
+
+    gfn_unlock(p2m, gfn, order);
+
+    for ( i = 0; i < nr; i++ )
+        if ( test_and_clear_bit(_PGC_allocated, &old[i].count_info) )
+            put_page(&old[i]);
+
+    return nr;
+
+ busy:
+    gfn_unlock(p2m, gfn, order);
+    for ( i = 0; i < nr; i++ )
+        if ( test_and_clear_bit(_PGC_allocated, &new[i].count_info) )
+            put_page(&new[i]);
+
+    return 0;
+}
+
+static void numa_balance_work(unsigned long data)
+{
+    struct numa_balance *nb = (void *)data;
+    struct domain *d = nb->domain;
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    unsigned long budget = (unsigned long)opt_numa_balance <<
+                           (20 - PAGE_SHIFT);
+    unsigned int i;
+    bool movable = numa_balance_movable(d);
+
+    if ( d->is_dying )
+        return;
+
+    nb->home = home_node(d);
+
+    for ( i = 0; i < NUMA_BALANCE_SCAN; i++ )
+    {
+        unsigned long gfn = nb->cursor, nr;
+        unsigned int order;
+        p2m_type_t t;
+        p2m_access_t a;
+        mfn_t mfn;
+
+        if ( gfn > p2m->max_mapped_pfn )
+        {
+            nb->local = nb->pass_local;
+            nb->remote = nb->pass_remote;
+            nb->pass_local = nb->pass_remote = 0;
+            nb->cursor = 0;
+            break;
+        }
+
+        gfn_lock(p2m, gfn, 0);
+        mfn = p2m->get_entry(p2m, _gfn(gfn), &t, &a, 0, &order, NULL);
+        gfn_unlock(p2m, gfn, 0);
+
+        /* Holes may be reported at any level: skip them as a whole. */
+        gfn &= ~((1UL << order) - 1);
+        nr = 1UL << order;
+        nb->cursor = gfn + nr;
+
+        if ( !p2m_is_ram(t) || !mfn_valid(mfn) )
+            continue;
+        mfn = _mfn(mfn_x(mfn) & ~(nr - 1));
+
+        if ( nb->home == NUMA_NO_NODE ||
+             phys_to_nid(mfn_to_maddr(mfn)) == nb->home )
+        {
+            nb->pass_local += nr;
+            continue;
+        }
+
+        if ( movable && t == p2m_ram_rw && order <= PAGE_ORDER_2M &&
+             nr <= budget )
+        {
+            if ( migrate_extent(d, gfn, mfn, order, nb->home) )
+            {
+                budget -= nr;
+                nb->migrated += nr;
+                nb->pass_local += nr;
+                continue;
+            }
+            nb->failed++;
+        }
+
+        nb->pass_remote += nr;
+    }
+
+    set_timer(&nb->timer, NOW() + NUMA_BALANCE_PERIOD);
+}
+
+static void numa_balance_timer_fn(void *data)
+{
+    struct numa_balance *nb = data;
+
+    /* Copying memory is too long for timer context. */
+    tasklet_schedule(&nb->tasklet);
+}
+
+int numa_balance_domain_init(struct domain *d)
+{
+    struct numa_balance *nb;
+
+    if ( !opt_numa_balance || num_online_nodes() < 2 || !hap_enabled(d) )
+        return 0;
+
+    nb = xzalloc(struct numa_balance);
+    if ( !nb )
+        return -ENOMEM;
+
+    nb->domain = d;
+    nb->home = NUMA_NO_NODE;
+    tasklet_init(&nb->tasklet, numa_balance_work, (unsigned long)nb);
+    init_timer(&nb->timer, numa_balance_timer_fn, nb,
+               cpumask_cycle(d->domain_id % nr_cpu_ids, &cpu_online_map));
+    set_timer(&nb->timer, NOW() + NUMA_BALANCE_PERIOD);
+
+    d->arch.hvm_domain.numa_balance = nb;
+
+    return 0;
+}
+
+void numa_balance_domain_stop(struct domain *d)
+{
+    struct numa_balance *nb = d->arch.hvm_domain.numa_balance;
+
+    if ( !nb )
+        return;
+
+    kill_timer(&nb->timer);
+    tasklet_kill(&nb->tasklet);
+}
+
+void numa_balance_domain_destroy(struct domain *d)
+{
+    numa_balance_domain_stop(d);
+    xfree(d->arch.hvm_domain.numa_balance);
+    d->arch.hvm_domain.numa_balance = NULL;
+}
+
+void numa_balance_dump(const struct domain *d)
+{
+    const struct numa_balance *nb;
+
+    if ( !is_hvm_domain(d) || !(nb = d->arch.hvm_domain.numa_balance) )
+        return;
+
+    if ( nb->home == NUMA_NO_NODE )
+        printk("    Balancing: no home node,");
+    else
+        printk("    Balancing: home node %u,", nb->home);
+    printk(" last pass local %lu remote %lu, migrated %lu, busy %lu\n",
+           nb->local, nb->remote, nb->migrated, nb->failed);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -649,6 +649,28 @@ static int resolve_misconfig(struct p2m_domain *p2m, unsigned long gfn)
     return rc;
 }
 
+/*
+ * Superpages split for transient reasons (log-dirty tracking, mem_access
+ * settings, MMIO mappings, PoD) would otherwise stay split for the rest of
+ * the guest's life.  Some time after a split, the host p2m gets scanned in
+ * the background, folding tables whose entries uniformly map contiguous
+ * frames back into superpages.
+ */
+#define EPT_COALESCE_DELAY  SECONDS(10)
+/* GFNs to scan per tasklet run, i.e. with the p2m lock held: 4G worth. */
+#define EPT_COALESCE_BATCH  (1UL << (2 * EPT_TABLE_ORDER + 2))
+
+static void ept_coalesce_schedule(struct p2m_domain *p2m)
+{
+    struct timer *t = &p2m->ept.coalesce_timer;
+    s_time_t expires = NOW() + EPT_COALESCE_DELAY;
+
+    /* Leave an already pending timer alone, not to defer the scan. */
+    if ( opt_ept_coalesce && p2m_is_hostp2m(p2m) &&
+         !timer_expires_before(t, expires + 1) )
+        set_timer(t, expires);
+}
+
 bool_t ept_handle_misconfig(uint64_t gpa)
 {
     struct vcpu *curr = current;
@@ -784,6 +806,8 @@ ept_set_entry(struct p2m_domain *p2m, gfn_t gfn_, mfn_t mfn,
         rc = atomic_write_ept_entry(ept_entry, split_ept_entry, i);
         ASSERT(rc == 0);
 
+        ept_coalesce_schedule(p2m);
+
         /* then move to the level we want to make real changes */
         for ( ; i > target; i-- )
             if ( !ept_next_level(p2m, 0, &table, &gfn_remainder, i) )
@@ -868,30 +892,10 @@ out:
     {
         if ( iommu_hap_pt_share )
             rc = iommu_pte_flush(d, gfn, &ept_entry->epte, order, vtd_pte_present);
+        else if ( iommu_flags )
+            rc = iommu_map_pages(d, gfn, mfn_x(mfn), order, iommu_flags);
         else
-        {
-            if ( iommu_flags )
-                for ( i = 0; i < (1 << order); i++ )
-                {
-                    rc = iommu_map_page(d, gfn + i, mfn_x(mfn) + i, iommu_flags);
-                    if ( unlikely(rc) )
-                    {
-                        while ( i-- )
-                            /* If statement to satisfy __must_check. */
-                            if ( iommu_unmap_page(p2m->domain, gfn + i) )
-                                continue;
-
-                        break;
-                    }
-                }
-            else
-                for ( i = 0; i < (1 << order); i++ )
-                {
-                    ret = iommu_unmap_page(d, gfn + i);
-                    if ( !rc )
-                        rc = ret;
-                }
-        }
+            rc = iommu_unmap_pages(d, gfn, order);
     }
 
     unmap_domain_page(table);
@@ -1087,6 +1091,10 @@ static void ept_change_entry_type_global(struct p2m_domain *p2m,
 
     if ( ept_invalidate_emt(_mfn(mfn), 1, p2m->ept.wl) )
         ept_sync_domain(p2m);
+
+    /* E.g. log-dirty mode ending, with all the superpages it split. */
+    if ( nt == p2m_ram_rw )
+        ept_coalesce_schedule(p2m);
 }
 
 static int ept_change_entry_type_range(struct p2m_domain *p2m,
@@ -1180,6 +1188,16 @@ static void ept_sync_domain_prepare(struct p2m_domain *p2m)
 
 static void ept_sync_domain_mask(struct p2m_domain *p2m, const cpumask_t *mask)
 {
+    /*
+     * No pCPU has the EPT tables of this domain loaded (e.g. while the
+     * domain is being built, or when all its vCPUs are descheduled): the
+     * invalidate mask set by ept_sync_domain_prepare() is enough to get
+     * stale translations flushed on next VM entry, so don't serialise
+     * on call_lock for nothing.
+     */
+    if ( cpumask_empty(mask) )
+        return;
+
     on_selected_cpus(mask, __ept_sync_domain, p2m, 1);
 }
 
@@ -1245,6 +1263,160 @@ static void ept_flush_pml_buffers(struct p2m_domain *p2m)
     vmx_domain_flush_pml_buffers(p2m->domain);
 }
 
+static void ept_flush_pml_buffer_vcpu(struct p2m_domain *p2m, struct vcpu *v)
+{
+    /* The vcpu must have been paused */
+    ASSERT(atomic_read(&v->pause_count));
+
+    if ( vmx_domain_pml_enabled(p2m->domain) )
+        vmx_vcpu_flush_pml_buffer(v);
+}
+
+/* Read the entry at the given level mapping gfn, if there is one. */
+static bool ept_read_entry(struct p2m_domain *p2m, unsigned long gfn,
+                           unsigned int level, ept_entry_t *e)
+{
+    ept_entry_t *table;
+    unsigned long gfn_remainder = gfn;
+    unsigned int i;
+    bool found = true;
+
+    table = map_domain_page(pagetable_get_mfn(p2m_get_pagetable(p2m)));
+
+    for ( i = p2m->ept.wl; i > level; i-- )
+        if ( ept_next_level(p2m, 1, &table, &gfn_remainder, i) !=
+             GUEST_TABLE_NORMAL_PAGE )
+        {
+            found = false;
+            break;
+        }
+
+    if ( found )
+    {
+        *e = atomic_read_ept_entry(table +
+                                   (gfn_remainder >> (level * EPT_TABLE_ORDER)));
+        found = is_epte_present(e);
+    }
+
+    unmap_domain_page(table);
+
+    return found;
+}
+
+/*
+ * Replace the (present, non-leaf) entry e at the given level by a superpage,
+ * if the entries of the table it points to are all leaves of the same type
+ * and attributes, mapping contiguous and suitably aligned frames.
+ */
+static bool ept_coalesce_entry(struct p2m_domain *p2m, ept_entry_t e,
+                               unsigned int level, unsigned long gfn)
+{
+    const ept_entry_t *table = map_domain_page(_mfn(e.mfn));
+    unsigned long stride = 1UL << ((level - 1) * EPT_TABLE_ORDER);
+    ept_entry_t first = table[0];
+    unsigned int i;
+    uint8_t ipat;
+    bool ok;
+
+    ok = is_epte_present(&first) && is_epte_valid(&first) &&
+         (level == 1 || is_epte_superpage(&first)) &&
+         first.sa_p2mt == p2m_ram_rw && !first.recalc &&
+         first.emt != MTRR_NUM_TYPES &&
+         !(first.mfn & ((1UL << (level * EPT_TABLE_ORDER)) - 1));
+
+    for ( i = 1; ok && i < EPT_PAGETABLE_ENTRIES; i++ )
+    {
+        const ept_entry_t *c = &table[i];
+
+        ok = is_epte_present(c) && c->sp == first.sp && !c->recalc &&
+             c->sa_p2mt == first.sa_p2mt && c->access == first.access &&
+             c->emt == first.emt && c->ipat == first.ipat &&
+             c->suppress_ve == first.suppress_ve &&
+             c->mfn == first.mfn + i * stride;
+    }
+
+    unmap_domain_page(table);
+
+    /* The memory type has to be uniform across the superpage, too. */
+    if ( !ok ||
+         epte_get_entry_emt(p2m->domain, gfn, _mfn(first.mfn),
+                            level * EPT_TABLE_ORDER, &ipat, 0) < 0 )
+        return false;
+
+    return !p2m->set_entry(p2m, _gfn(gfn), _mfn(first.mfn),
+                           level * EPT_TABLE_ORDER, first.sa_p2mt,
+                           first.access, first.suppress_ve);
+}
+
+/* Try to restore superpages in the 1G region starting at gfn. */
+static void ept_coalesce_region(struct p2m_domain *p2m, unsigned long gfn)
+{
+    struct ept_data *ept = &p2m->ept;
+    ept_entry_t e;
+    unsigned long end = gfn + (1UL << (2 * EPT_TABLE_ORDER)), gfn_2m;
+
+    if ( !ept_read_entry(p2m, gfn, 2, &e) || is_epte_superpage(&e) )
+        return;
+
+    if ( hap_has_2mb )
+        for ( gfn_2m = gfn; gfn_2m < end; gfn_2m += 1UL << EPT_TABLE_ORDER )
+        {
+            /* Carry out pending type / memory type changes first. */
+            if ( resolve_misconfig(p2m, gfn_2m) < 0 )
+                return;
+
+            if ( ept_read_entry(p2m, gfn_2m, 1, &e) &&
+                 !is_epte_superpage(&e) &&
+                 ept_coalesce_entry(p2m, e, 1, gfn_2m) )
+            {
+                ept->coalesced_2m++;
+                perfc_incr(ept_coalesced_2m);
+            }
+        }
+
+    if ( hap_has_1gb && ept_read_entry(p2m, gfn, 2, &e) &&
+         !is_epte_superpage(&e) && ept_coalesce_entry(p2m, e, 2, gfn) )
+    {
+        ept->coalesced_1g++;
+        perfc_incr(ept_coalesced_1g);
+    }
+}
+
+static void ept_coalesce_work(unsigned long data)
+{
+    struct p2m_domain *p2m = (struct p2m_domain *)data;
+    struct ept_data *ept = &p2m->ept;
+    unsigned long gfn, end;
+
+    p2m_lock(p2m);
+
+    /* Log-dirty mode would split things up again right away. */
+    if ( p2m->domain->is_dying || paging_mode_log_dirty(p2m->domain) )
+    {
+        p2m_unlock(p2m);
+        return;
+    }
+
+    gfn = ept->coalesce_gfn;
+    end = min(gfn + EPT_COALESCE_BATCH, p2m->max_mapped_pfn + 1);
+    for ( ; gfn < end; gfn += 1UL << (2 * EPT_TABLE_ORDER) )
+        ept_coalesce_region(p2m, gfn);
+    ept->coalesce_gfn = gfn > p2m->max_mapped_pfn ? 0 : gfn;
+
+    /* One INVEPT for the whole batch, as flushes are deferred until here. */
+    p2m_unlock(p2m);
+
+    if ( ept->coalesce_gfn )
+        tasklet_schedule(&ept->coalesce_tasklet);
+}
+
+static void ept_coalesce_timer_fn(void *data)
+{
+    struct p2m_domain *p2m = data;
+
+    tasklet_schedule(&p2m->ept.coalesce_tasklet);
+}
+
 int ept_p2m_init(struct p2m_domain *p2m)
 {
     struct ept_data *ept = &p2m->ept;
@@ -1264,11 +1436,18 @@ int ept_p2m_init(struct p2m_domain *p2m)
     /* set EPT page-walk length, now it's actual walk length - 1, i.e. 3 */
     ept->wl = 3;
 
+    init_timer(&ept->coalesce_timer, ept_coalesce_timer_fn, p2m,
+               smp_processor_id());
+    tasklet_init(&ept->coalesce_tasklet, ept_coalesce_work,
+                 (unsigned long)p2m);
+    ept->coalesce_gfn = 0;
+
     if ( cpu_has_vmx_pml )
     {
         p2m->enable_hardware_log_dirty = ept_enable_pml;
         p2m->disable_hardware_log_dirty = ept_disable_pml;
         p2m->flush_hardware_cached_dirty = ept_flush_pml_buffers;
+        p2m->flush_hardware_cached_dirty_vcpu = ept_flush_pml_buffer_vcpu;
     }
 
     if ( !zalloc_cpumask_var(&ept->invalidate) )
@@ -1286,6 +1465,9 @@ int ept_p2m_init(struct p2m_domain *p2m)
 void ept_p2m_uninit(struct p2m_domain *p2m)
 {
     struct ept_data *ept = &p2m->ept;
+
+    kill_timer(&ept->coalesce_timer);
+    tasklet_kill(&ept->coalesce_tasklet);
     free_cpumask_var(ept->invalidate);
 }
 
@@ -1323,7 +1505,8 @@ static void ept_dump_p2m_table(unsigned char key)
 
         p2m = p2m_get_hostp2m(d);
         ept = &p2m->ept;
-        printk("\ndomain%d EPT p2m table:\n", d->domain_id);
+        printk("\ndomain%d EPT p2m table (superpages restored: %lu 2M, %lu 1G):\n",
+               d->domain_id, ept->coalesced_2m, ept->coalesced_1g);
 
         for ( gfn = 0; gfn <= p2m->max_mapped_pfn; gfn += 1UL << order )
         {
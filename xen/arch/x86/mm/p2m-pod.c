@@ -55,6 +55,28 @@ static inline void unlock_page_alloc(struct p2m_domain *p2m)
  * Populate-on-demand functionality
  */
 
+static void p2m_pod_background_sweep(unsigned long data);
+
+void p2m_pod_init(struct p2m_domain *p2m)
+{
+    unsigned int i;
+
+    mm_lock_init(&p2m->pod.lock);
+    INIT_PAGE_LIST_HEAD(&p2m->pod.super);
+    INIT_PAGE_LIST_HEAD(&p2m->pod.single);
+
+    for ( i = 0; i < ARRAY_SIZE(p2m->pod.mrp.list); ++i )
+        p2m->pod.mrp.list[i] = gfn_x(INVALID_GFN);
+
+    tasklet_init(&p2m->pod.sweeper, p2m_pod_background_sweep,
+                 (unsigned long)p2m);
+}
+
+void p2m_pod_uninit(struct p2m_domain *p2m)
+{
+    tasklet_kill(&p2m->pod.sweeper);
+}
+
 static int
 p2m_pod_cache_add(struct p2m_domain *p2m,
                   struct page_info *page,
@@ -689,6 +711,27 @@ void p2m_pod_dump_data(struct domain *d)
            p2m->pod.entry_count, p2m->pod.count);
 }
 
+/* How much of a page to look at before deciding whether it's worth unmapping */
+#define POD_QUICK_CHECK_BYTES   (16 * sizeof(unsigned long))
+
+/*
+ * Check whether the first @bytes (a multiple of 64) of a mapped page are all
+ * zero.  Vector registers aren't available to Xen itself, so instead OR
+ * together a cache line's worth of words and only test once per line.
+ */
+static bool pod_zero_check_mapped(const unsigned long *map, unsigned int bytes)
+{
+    const unsigned long *end = map + bytes / sizeof(*map);
+
+    ASSERT(!(bytes % (8 * sizeof(*map))));
+
+    for ( ; map < end; map += 8 )
+        if ( map[0] | map[1] | map[2] | map[3] |
+             map[4] | map[5] | map[6] | map[7] )
+            return false;
+
+    return true;
+}
 
 /*
  * Search for all-zero superpages to be reclaimed as superpages for the
@@ -703,7 +746,7 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, gfn_t gfn)
     unsigned long * map = NULL;
     int ret=0, reset = 0;
     unsigned long i, n;
-    unsigned int j;
+    bool zero;
     int max_ref = 1;
     struct domain *d = p2m->domain;
 
@@ -774,14 +817,10 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, gfn_t gfn)
     {
         /* Quick zero-check */
         map = map_domain_page(mfn_add(mfn0, i));
-
-        for ( j = 0; j < 16; j++ )
-            if ( *(map + j) != 0 )
-                break;
-
+        zero = pod_zero_check_mapped(map, POD_QUICK_CHECK_BYTES);
         unmap_domain_page(map);
 
-        if ( j < 16 )
+        if ( !zero )
             goto out;
 
     }
@@ -812,14 +851,8 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, gfn_t gfn)
     for ( i = 0; i < SUPERPAGE_PAGES; i++ )
     {
         map = map_domain_page(mfn_add(mfn0, i));
-
-        for ( j = 0; j < (PAGE_SIZE / sizeof(*map)); j++ )
-            if ( *(map+j) != 0 )
-            {
-                reset = 1;
-                break;
-            }
-
+        if ( !pod_zero_check_mapped(map, PAGE_SIZE) )
+            reset = 1;
         unmap_domain_page(map);
 
         if ( reset )
@@ -876,7 +909,7 @@ p2m_pod_zero_check(struct p2m_domain *p2m, const gfn_t *gfns, int count)
     unsigned long *map[count];
     struct domain *d = p2m->domain;
 
-    int i, j;
+    int i;
     int max_ref = 1;
 
     /* Allow an extra refcount for one shadow pt mapping in shadowed domains */
@@ -915,11 +948,7 @@ p2m_pod_zero_check(struct p2m_domain *p2m, const gfn_t *gfns, int count)
             continue;
 
         /* Quick zero-check */
-        for ( j = 0; j < 16; j++ )
-            if ( *(map[i] + j) != 0 )
-                break;
-
-        if ( j < 16 )
+        if ( !pod_zero_check_mapped(map[i], POD_QUICK_CHECK_BYTES) )
         {
             unmap_domain_page(map[i]);
             map[i] = NULL;
@@ -962,12 +991,12 @@ p2m_pod_zero_check(struct p2m_domain *p2m, const gfn_t *gfns, int count)
     /* Now check each page for real */
     for ( i = 0; i < count; i++ )
     {
+        bool zero;
+
         if ( !map[i] )
             continue;
 
-        for ( j = 0; j < (PAGE_SIZE / sizeof(*map[i])); j++ )
-            if ( *(map[i] + j) != 0 )
-                break;
+        zero = pod_zero_check_mapped(map[i], PAGE_SIZE);
 
         unmap_domain_page(map[i]);
 
@@ -977,7 +1006,7 @@ p2m_pod_zero_check(struct p2m_domain *p2m, const gfn_t *gfns, int count)
          * See comment in p2m_pod_zero_check_superpage() re gnttab
          * check timing.
          */
-        if ( j < (PAGE_SIZE / sizeof(*map[i])) )
+        if ( !zero )
         {
             /*
              * If the previous p2m_set_entry call succeeded, this one shouldn't
@@ -1026,8 +1055,12 @@ out_unmap:
             unmap_domain_page(map[i]);
 }
 
+/*
+ * Pages found by a sweep are checked in batches of POD_SWEEP_STRIDE, each
+ * batch costing a single TLB flush.
+ */
 #define POD_SWEEP_LIMIT 1024
-#define POD_SWEEP_STRIDE  16
+#define POD_SWEEP_STRIDE  64
 static void
 p2m_pod_emergency_sweep(struct p2m_domain *p2m)
 {
@@ -1083,6 +1116,42 @@ p2m_pod_emergency_sweep(struct p2m_domain *p2m)
 
 }
 
+/*
+ * Once the cache runs this low while the guest still has outstanding PoD
+ * entries, sweep for zero pages in the background, so that guest faults
+ * find memory in the cache rather than having to sweep synchronously.
+ */
+#define POD_SWEEP_LOW_WATERMARK (4 * SUPERPAGE_PAGES)
+
+static bool pod_sweep_wanted(const struct p2m_domain *p2m)
+{
+    return p2m->pod.count < POD_SWEEP_LOW_WATERMARK &&
+           p2m->pod.entry_count > p2m->pod.count;
+}
+
+static void p2m_pod_background_sweep(unsigned long data)
+{
+    struct p2m_domain *p2m = (struct p2m_domain *)data;
+    long count;
+
+    /* Same lock order as the demand populate path: p2m, then PoD. */
+    p2m_lock(p2m);
+    pod_lock(p2m);
+
+    count = p2m->pod.count;
+    if ( !p2m->domain->is_dying && pod_sweep_wanted(p2m) )
+    {
+        p2m_pod_emergency_sweep(p2m);
+
+        /* Carry on for as long as we're short and still finding pages. */
+        if ( p2m->pod.count > count && pod_sweep_wanted(p2m) )
+            tasklet_schedule(&p2m->pod.sweeper);
+    }
+
+    pod_unlock(p2m);
+    p2m_unlock(p2m);
+}
+
 static void pod_eager_reclaim(struct p2m_domain *p2m)
 {
     struct pod_mrp_list *mrp = &p2m->pod.mrp;
@@ -1223,6 +1292,9 @@ p2m_pod_demand_populate(struct p2m_domain *p2m, gfn_t gfn,
 
     pod_eager_record(p2m, gfn_aligned, order);
 
+    if ( pod_sweep_wanted(p2m) )
+        tasklet_schedule(&p2m->pod.sweeper);
+
     if ( tb_init_done )
     {
         struct {
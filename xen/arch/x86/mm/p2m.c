@@ -27,6 +27,7 @@
 #include <xen/iommu.h>
 #include <xen/vm_event.h>
 #include <xen/event.h>
+#include <xen/perfc.h>
 #include <public/vm_event.h>
 #include <asm/domain.h>
 #include <asm/page.h>
@@ -58,15 +59,12 @@ DEFINE_PERCPU_RWLOCK_GLOBAL(p2m_percpu_rwlock);
 /* Init the datastructures for later use by the p2m code */
 static int p2m_initialise(struct domain *d, struct p2m_domain *p2m)
 {
-    unsigned int i;
     int ret = 0;
 
     mm_rwlock_init(&p2m->lock);
-    mm_lock_init(&p2m->pod.lock);
     INIT_LIST_HEAD(&p2m->np2m_list);
     INIT_PAGE_LIST_HEAD(&p2m->pages);
-    INIT_PAGE_LIST_HEAD(&p2m->pod.super);
-    INIT_PAGE_LIST_HEAD(&p2m->pod.single);
+    p2m_pod_init(p2m);
 
     p2m->domain = d;
     p2m->default_access = p2m_access_rwx;
@@ -75,9 +73,6 @@ static int p2m_initialise(struct domain *d, struct p2m_domain *p2m)
     p2m->np2m_base = P2M_BASE_EADDR;
     p2m->np2m_generation = 0;
 
-    for ( i = 0; i < ARRAY_SIZE(p2m->pod.mrp.list); ++i )
-        p2m->pod.mrp.list[i] = gfn_x(INVALID_GFN);
-
     if ( hap_enabled(d) && cpu_has_vmx )
         ret = ept_p2m_init(p2m);
     else
@@ -111,6 +106,7 @@ free_p2m:
 
 static void p2m_free_one(struct p2m_domain *p2m)
 {
+    p2m_pod_uninit(p2m);
     if ( hap_enabled(p2m->domain) && cpu_has_vmx )
         ept_p2m_uninit(p2m);
     free_cpumask_var(p2m->dirty_cpumask);
@@ -390,6 +386,18 @@ void p2m_flush_hardware_cached_dirty(struct domain *d)
     }
 }
 
+void p2m_flush_hardware_cached_dirty_vcpu(struct vcpu *v)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(v->domain);
+
+    if ( p2m->flush_hardware_cached_dirty_vcpu )
+    {
+        p2m_lock(p2m);
+        p2m->flush_hardware_cached_dirty_vcpu(p2m, v);
+        p2m_unlock(p2m);
+    }
+}
+
 /*
  * Force a synchronous P2M TLB flush if a deferred flush is pending.
  *
@@ -416,6 +424,21 @@ void p2m_unlock_and_tlb_flush(struct p2m_domain *p2m)
         mm_write_unlock(&p2m->lock);
 }
 
+void p2m_batch_begin(struct domain *d)
+{
+    p2m_lock(p2m_get_hostp2m(d));
+}
+
+void p2m_batch_flush(struct domain *d)
+{
+    p2m_tlb_flush_sync(p2m_get_hostp2m(d));
+}
+
+void p2m_batch_end(struct domain *d)
+{
+    p2m_unlock(p2m_get_hostp2m(d));
+}
+
 mfn_t __get_gfn_type_access(struct p2m_domain *p2m, unsigned long gfn_l,
                     p2m_type_t *t, p2m_access_t *a, p2m_query_t q,
                     unsigned int *page_order, bool_t locked)
@@ -451,6 +474,12 @@ mfn_t __get_gfn_type_access(struct p2m_domain *p2m, unsigned long gfn_l,
         mfn = p2m->get_entry(p2m, gfn, t, a, q, page_order, NULL);
     }
 
+    /* Lazily populate forked domains from their parent. */
+    if ( (q & P2M_ALLOC) && p2m_is_hole(*t) && p2m_is_hostp2m(p2m) &&
+         mem_sharing_is_fork(p2m->domain) &&
+         !mem_sharing_fork_page(p2m->domain, gfn, q & P2M_UNSHARE) )
+        mfn = p2m->get_entry(p2m, gfn, t, a, q, page_order, NULL);
+
     if (unlikely((p2m_is_broken(*t))))
     {
         /* Return invalid_mfn to avoid caller's access */
@@ -715,22 +744,8 @@ p2m_remove_page(struct p2m_domain *p2m, unsigned long gfn_l, unsigned long mfn,
     p2m_access_t a;
 
     if ( !paging_mode_translate(p2m->domain) )
-    {
-        int rc = 0;
-
-        if ( need_iommu(p2m->domain) )
-        {
-            for ( i = 0; i < (1 << page_order); i++ )
-            {
-                int ret = iommu_unmap_page(p2m->domain, mfn + i);
-
-                if ( !rc )
-                    rc = ret;
-            }
-        }
-
-        return rc;
-    }
+        return need_iommu(p2m->domain)
+               ? iommu_unmap_pages(p2m->domain, mfn, page_order) : 0;
 
     ASSERT(gfn_locked_by_me(p2m, gfn));
     P2M_DEBUG("removing gfn=%#lx mfn=%#lx\n", gfn_l, mfn);
@@ -778,23 +793,8 @@ guest_physmap_add_entry(struct domain *d, gfn_t gfn, mfn_t mfn,
     if ( !paging_mode_translate(d) )
     {
         if ( need_iommu(d) && t == p2m_ram_rw )
-        {
-            for ( i = 0; i < (1 << page_order); i++ )
-            {
-                rc = iommu_map_page(d, mfn_x(mfn_add(mfn, i)),
-                                    mfn_x(mfn_add(mfn, i)),
-                                    IOMMUF_readable|IOMMUF_writable);
-                if ( rc != 0 )
-                {
-                    while ( i-- > 0 )
-                        /* If statement to satisfy __must_check. */
-                        if ( iommu_unmap_page(d, mfn_x(mfn_add(mfn, i))) )
-                            continue;
-
-                    return rc;
-                }
-            }
-        }
+            return iommu_map_pages(d, mfn_x(mfn), mfn_x(mfn), page_order,
+                                   IOMMUF_readable|IOMMUF_writable);
         return 0;
     }
 
@@ -1757,6 +1757,9 @@ p2m_flush_table_locked(struct p2m_domain *p2m)
     if ( p2m_is_nestedp2m(p2m) && p2m->np2m_base == P2M_BASE_EADDR )
         return;
 
+    if ( p2m_is_nestedp2m(p2m) )
+        perfc_incr(np2m_flush);
+
     /* This is no longer a valid nested p2m for any address space */
     p2m->np2m_base = P2M_BASE_EADDR;
     p2m->np2m_generation++;
@@ -1853,7 +1856,7 @@ p2m_get_nestedp2m_locked(struct vcpu *v)
 {
     struct nestedvcpu *nv = &vcpu_nestedhvm(v);
     struct domain *d = v->domain;
-    struct p2m_domain *p2m;
+    struct p2m_domain *p2m, *empty = NULL;
     uint64_t np2m_base = nhvm_vcpu_p2m_base(v);
     unsigned int i;
     bool needs_flush = true;
@@ -1876,6 +1879,7 @@ p2m_get_nestedp2m_locked(struct vcpu *v)
             if ( nv->np2m_generation == p2m->np2m_generation )
                 needs_flush = false;
             /* np2m is up-to-date */
+            perfc_incr(np2m_hit);
             goto found;
         }
         else if ( p2m->np2m_base != P2M_BASE_EADDR )
@@ -1893,13 +1897,34 @@ p2m_get_nestedp2m_locked(struct vcpu *v)
         p2m_lock(p2m);
 
         if ( p2m->np2m_base == np2m_base )
+        {
+            perfc_incr(np2m_shared);
             goto found;
+        }
+        if ( !empty && p2m->np2m_base == P2M_BASE_EADDR )
+            empty = p2m;
 
         p2m_unlock(p2m);
     }
 
-    /* All p2m's are or were in use. Take the least recent used one,
+    /*
+     * Prefer an np2m which is already empty (never used, or flushed by an
+     * L1 INVEPT) over evicting the shadow of another live L1 EPTP, which
+     * would otherwise have to be rebuilt by walking the L1 tables again.
+     * Only assignment under the nestedp2m lock makes an np2m non-empty, so
+     * it cannot have been claimed since the scan above.
+     */
+    if ( empty )
+    {
+        perfc_incr(np2m_reuse_empty);
+        p2m = empty;
+        p2m_lock(p2m);
+        goto found;
+    }
+
+    /* All p2m's are in use. Take the least recent used one,
      * flush it and reuse. */
+    perfc_incr(np2m_evict);
     p2m = p2m_getlru_nestedp2m(d, NULL);
     p2m_flush_table(p2m);
     p2m_lock(p2m);
@@ -2479,6 +2504,7 @@ int p2m_altp2m_propagate_change(struct domain *d, gfn_t gfn,
     unsigned int i;
     unsigned int reset_count = 0;
     unsigned int last_reset_idx = ~0;
+    bool need_flush = false;
     int ret = 0;
 
     if ( !altp2m_active(d) )
@@ -2527,7 +2553,21 @@ int p2m_altp2m_propagate_change(struct domain *d, gfn_t gfn,
         }
         else if ( !mfn_eq(m, INVALID_MFN) )
         {
-            int rc = p2m_set_entry(p2m, gfn, mfn, page_order, p2mt, p2ma);
+            int rc;
+
+            /*
+             * All a view's flush does beyond marking its EPTP for
+             * invalidation on next VM entry is kicking the domain's pCPUs
+             * out of the guest, which one IPI can do for all of them.
+             */
+            p2m->defer_flush++;
+            rc = p2m_set_entry(p2m, gfn, mfn, page_order, p2mt, p2ma);
+            p2m->defer_flush--;
+            if ( p2m->need_flush )
+            {
+                p2m->need_flush = 0;
+                need_flush = true;
+            }
 
             /* Best effort: Don't bail on error. */
             if ( !ret )
@@ -2537,6 +2577,9 @@ int p2m_altp2m_propagate_change(struct domain *d, gfn_t gfn,
         __put_gfn(p2m, gfn_x(gfn));
     }
 
+    if ( need_flush )
+        p2m_get_hostp2m(d)->tlb_flush(p2m_get_hostp2m(d));
+
     altp2m_list_unlock(d);
 
     return ret;
@@ -28,6 +28,7 @@
 #include <asm/event.h>
 #include <asm/hvm/nestedhvm.h>
 #include <xen/numa.h>
+#include <xen/vmap.h>
 #include <xsm/xsm.h>
 #include <public/sched.h> /* SHUTDOWN_suspend */
 
@@ -215,6 +216,37 @@ static int paging_free_log_dirty_bitmap(struct domain *d, int rc)
     return rc;
 }
 
+/* Upper bound on the number of dirty ring entries (32MB worth of them). */
+#define DIRTY_RING_MAX_ENTRIES (1u << 22)
+
+/* Replace (or, with entries == 0, free) the domain's dirty ring. */
+static int paging_dirty_ring_setup(struct domain *d, unsigned long entries)
+{
+    struct log_dirty_ring *ring = &d->arch.paging.log_dirty.ring;
+    uint64_t *gfns = NULL, *old;
+
+    if ( entries > DIRTY_RING_MAX_ENTRIES || (entries & (entries - 1)) )
+        return -EINVAL;
+
+    if ( entries && !(gfns = vmalloc(entries * sizeof(*gfns))) )
+        return -ENOMEM;
+
+    paging_lock(d);
+
+    old = ring->gfns;
+    /* Anything still queued is now only recorded in the bitmap. */
+    ring->overflow = old && (ring->overflow || ring->prod != ring->cons);
+    ring->gfns = gfns;
+    ring->size = entries;
+    ring->prod = ring->cons = 0;
+
+    paging_unlock(d);
+
+    vfree(old);
+
+    return 0;
+}
+
 int paging_log_dirty_enable(struct domain *d, bool_t log_global)
 {
     int ret;
@@ -251,6 +283,7 @@ static int paging_log_dirty_disable(struct domain *d, bool_t resuming)
             ret = d->arch.paging.log_dirty.ops->disable(d);
             ASSERT(ret <= 0);
         }
+        paging_dirty_ring_setup(d, 0);
     }
 
     ret = paging_free_log_dirty_bitmap(d, ret);
@@ -262,6 +295,23 @@ static int paging_log_dirty_disable(struct domain *d, bool_t resuming)
     return ret;
 }
 
+/* Queue a newly dirtied pfn on the dirty ring, if there is one. */
+static void paging_dirty_ring_push(struct domain *d, pfn_t pfn)
+{
+    struct log_dirty_ring *ring = &d->arch.paging.log_dirty.ring;
+
+    ASSERT(paging_locked_by_me(d));
+
+    if ( !ring->gfns )
+        return;
+
+    /* The bit stays set in the bitmap, so a CLEAN will still find it. */
+    if ( ring->prod - ring->cons == ring->size )
+        ring->overflow = true;
+    else
+        ring->gfns[ring->prod++ & (ring->size - 1)] = pfn_x(pfn);
+}
+
 /* Mark a page as dirty, with taking guest pfn as parameter */
 void paging_mark_pfn_dirty(struct domain *d, pfn_t pfn)
 {
@@ -292,6 +342,9 @@ void paging_mark_pfn_dirty(struct domain *d, pfn_t pfn)
     /* Recursive: this is called from inside the shadow code */
     paging_lock_recursive(d);
 
+    if ( hap_enabled(d) && d->arch.hvm_domain.dirty_vram )
+        hap_mark_dirty_vram(d, pfn_x(pfn));
+
     if ( unlikely(!mfn_valid(d->arch.paging.log_dirty.top)) ) 
     {
          d->arch.paging.log_dirty.top = paging_new_log_dirty_node(d);
@@ -332,6 +385,7 @@ void paging_mark_pfn_dirty(struct domain *d, pfn_t pfn)
                      "d%d: marked mfn %" PRI_mfn " (pfn %" PRI_pfn ")\n",
                      d->domain_id, mfn_x(mfn), pfn_x(pfn));
         d->arch.paging.log_dirty.dirty_count++;
+        paging_dirty_ring_push(d, pfn);
     }
 
 out:
@@ -401,6 +455,106 @@ int paging_mfn_is_dirty(struct domain *d, mfn_t gmfn)
     return rv;
 }
 
+/* Clear a pfn's bit in the log-dirty bitmap. */
+static void paging_clear_pfn_dirty(struct domain *d, pfn_t pfn)
+{
+    mfn_t mfn, *l4, *l3, *l2;
+    unsigned long *l1;
+
+    ASSERT(paging_locked_by_me(d));
+
+    mfn = d->arch.paging.log_dirty.top;
+    if ( !mfn_valid(mfn) )
+        return;
+
+    l4 = map_domain_page(mfn);
+    mfn = l4[L4_LOGDIRTY_IDX(pfn)];
+    unmap_domain_page(l4);
+    if ( !mfn_valid(mfn) )
+        return;
+
+    l3 = map_domain_page(mfn);
+    mfn = l3[L3_LOGDIRTY_IDX(pfn)];
+    unmap_domain_page(l3);
+    if ( !mfn_valid(mfn) )
+        return;
+
+    l2 = map_domain_page(mfn);
+    mfn = l2[L2_LOGDIRTY_IDX(pfn)];
+    unmap_domain_page(l2);
+    if ( !mfn_valid(mfn) )
+        return;
+
+    l1 = map_domain_page(mfn);
+    if ( __test_and_clear_bit(L1_LOGDIRTY_IDX(pfn), l1) )
+        d->arch.paging.log_dirty.dirty_count--;
+    unmap_domain_page(l1);
+}
+
+/*
+ * Hand GFNs off the dirty ring to the toolstack.  Only HAP guests are
+ * supported, as logging is re-armed by simply changing the p2m type back.
+ */
+#define DIRTY_RING_DRAIN_BATCH 64
+static int paging_dirty_ring_drain(struct domain *d,
+                                   struct xen_domctl_shadow_op *sc)
+{
+    struct log_dirty_ring *ring = &d->arch.paging.log_dirty.ring;
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    uint64_t batch[DIRTY_RING_DRAIN_BATCH];
+    unsigned long done = 0;
+    unsigned int i, n;
+    int rc = 0;
+
+    domain_pause(d);
+
+    /* Pull in whatever the hardware (i.e. PML) has logged so far. */
+    p2m_flush_hardware_cached_dirty(d);
+
+    p2m_lock(p2m);
+
+    do {
+        paging_lock(d);
+
+        if ( !ring->gfns )
+            rc = -ENXIO;
+        /* GFNs already handed out this time round must not get lost. */
+        else if ( ring->overflow && !done )
+            rc = -EOVERFLOW;
+
+        for ( n = 0; !rc && n < ARRAY_SIZE(batch) && done + n < sc->pages &&
+                     ring->cons != ring->prod; n++ )
+        {
+            batch[n] = ring->gfns[ring->cons++ & (ring->size - 1)];
+            paging_clear_pfn_dirty(d, _pfn(batch[n]));
+        }
+
+        sc->stats.fault_count = d->arch.paging.log_dirty.fault_count;
+        sc->stats.dirty_count = ring->prod - ring->cons;
+
+        paging_unlock(d);
+
+        /*
+         * The guest is paused, so it can't write to any of these pages
+         * between their bits getting cleared above and logging being
+         * re-armed here.
+         */
+        for ( i = 0; i < n; i++ )
+            p2m_change_type_one(d, batch[i], p2m_ram_rw, p2m_ram_logdirty);
+
+        if ( n && copy_to_guest_offset(sc->dirty_gfns, done, batch, n) )
+            rc = -EFAULT;
+        done += n;
+    } while ( !rc && n == ARRAY_SIZE(batch) && !hypercall_preempt_check() );
+
+    p2m_unlock(p2m);
+
+    domain_unpause(d);
+
+    sc->pages = done;
+
+    return rc;
+}
 
 /* Read a domain's log-dirty bitmap and stats.  If the operation is a CLEAN,
  * clear the bitmap and stats as well. */
@@ -546,6 +700,10 @@ static int paging_log_dirty_op(struct domain *d,
         {
             d->arch.paging.log_dirty.fault_count = 0;
             d->arch.paging.log_dirty.dirty_count = 0;
+            /* Everything on the ring has just been handed out. */
+            d->arch.paging.log_dirty.ring.cons =
+                d->arch.paging.log_dirty.ring.prod;
+            d->arch.paging.log_dirty.ring.overflow = false;
         }
     }
     else
@@ -592,6 +750,152 @@ static int paging_log_dirty_op(struct domain *d,
     return rv;
 }
 
+/*
+ * Map the log-dirty bitmap leaf covering @pfn.  If there is none, return
+ * NULL, with *@order set such that the naturally aligned 2^order pfns around
+ * @pfn are all known to be clean.
+ */
+static unsigned long *paging_map_log_dirty_leaf(struct domain *d, pfn_t pfn,
+                                                unsigned int *order)
+{
+    static const unsigned int shifts[] = {
+        PAGE_SHIFT + 3 + PAGETABLE_ORDER * 2,
+        PAGE_SHIFT + 3 + PAGETABLE_ORDER,
+        PAGE_SHIFT + 3,
+    };
+    mfn_t mfn = d->arch.paging.log_dirty.top;
+    unsigned int i;
+
+    ASSERT(paging_locked_by_me(d));
+
+    *order = shifts[0] + PAGETABLE_ORDER;
+    if ( !mfn_valid(mfn) )
+        return NULL;
+
+    for ( i = 0; i < ARRAY_SIZE(shifts); i++ )
+    {
+        mfn_t *node = map_domain_page(mfn);
+
+        mfn = node[(pfn_x(pfn) >> shifts[i]) & (LOGDIRTY_NODE_ENTRIES - 1)];
+        unmap_domain_page(node);
+        *order = shifts[i];
+        if ( !mfn_valid(mfn) )
+            return NULL;
+    }
+
+    return map_domain_page(mfn);
+}
+
+/*
+ * Report (and for CLEAN_RANGE, clear) the dirty pfns of a range as a list of
+ * non-empty 64-pfn chunks, skipping over unpopulated parts of the bitmap.
+ * No per-domain preemption state is involved, and the paging lock is only
+ * held while looking at one leaf, so that callers can work on disjoint
+ * ranges concurrently.
+ */
+#define DIRTY_CHUNK_PFNS 64
+static int paging_log_dirty_range_op(struct domain *d,
+                                     struct xen_domctl_shadow_op *sc)
+{
+    bool clean = (sc->op == XEN_DOMCTL_SHADOW_OP_CLEAN_RANGE);
+    unsigned long pfn = sc->first_gfn, end = sc->first_gfn + sc->nr_gfns;
+    unsigned long rearmed = pfn, done = 0;
+    bool full = false;
+    int rc = 0;
+
+    BUILD_BUG_ON(DIRTY_CHUNK_PFNS != BITS_PER_LONG);
+
+    if ( !paging_mode_log_dirty(d) )
+        return -EINVAL;
+
+    if ( (pfn & (DIRTY_CHUNK_PFNS - 1)) || end < pfn )
+        return -EINVAL;
+
+    /* The bitmap doesn't cover anything beyond here. */
+    end = min(end, 1UL << (PAGE_SHIFT + 3 + PAGETABLE_ORDER * 3));
+
+    /*
+     * Re-arm logging before clearing any bits, so that writes from here on
+     * are guaranteed to get recorded afresh.  Shadow mode can only do that
+     * for the whole domain.
+     */
+    if ( clean && !hap_enabled(d) )
+        d->arch.paging.log_dirty.ops->clean(d);
+
+    while ( pfn < end && !rc && !full )
+    {
+        unsigned long *l1, next;
+        unsigned int order;
+
+        paging_lock(d);
+
+        l1 = paging_map_log_dirty_leaf(d, _pfn(pfn), &order);
+        next = min(((pfn >> order) + 1) << order, end);
+
+        if ( !l1 )
+            pfn = next;
+        else if ( clean && hap_enabled(d) && rearmed < next )
+        {
+            /* Can't change p2m types with the paging lock held. */
+            unmap_domain_page(l1);
+            paging_unlock(d);
+
+            p2m_change_type_range(d, pfn, next, p2m_ram_rw, p2m_ram_logdirty);
+            rearmed = next;
+            continue;
+        }
+        else
+        {
+            for ( ; pfn < next; pfn += DIRTY_CHUNK_PFNS )
+            {
+                unsigned long *word = &l1[L1_LOGDIRTY_IDX(_pfn(pfn)) /
+                                          BITS_PER_LONG];
+                struct xen_domctl_shadow_dirty_chunk chunk = {
+                    .gfn = pfn,
+                    .mask = *word,
+                };
+
+                if ( end - pfn < DIRTY_CHUNK_PFNS )
+                    chunk.mask &= (1UL << (end - pfn)) - 1;
+                if ( !chunk.mask )
+                    continue;
+
+                if ( done == sc->pages )
+                {
+                    full = true;
+                    break;
+                }
+
+                if ( copy_to_guest_offset(sc->dirty_chunks, done, &chunk, 1) )
+                {
+                    rc = -EFAULT;
+                    break;
+                }
+                done++;
+
+                if ( clean )
+                {
+                    *word &= ~chunk.mask;
+                    d->arch.paging.log_dirty.dirty_count -=
+                        hweight64(chunk.mask);
+                }
+            }
+
+            unmap_domain_page(l1);
+        }
+
+        paging_unlock(d);
+
+        if ( hypercall_preempt_check() )
+            break;
+    }
+
+    sc->first_gfn = pfn;
+    sc->pages = done;
+
+    return rc;
+}
+
 void paging_log_dirty_range(struct domain *d,
                            unsigned long begin_pfn,
                            unsigned long nr,
@@ -745,6 +1049,24 @@ int paging_domctl(struct domain *d, struct xen_domctl_shadow_op *sc,
         if ( sc->mode & ~XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL )
             return -EINVAL;
         return paging_log_dirty_op(d, sc, resuming);
+
+    case XEN_DOMCTL_SHADOW_OP_PEEK_RANGE:
+    case XEN_DOMCTL_SHADOW_OP_CLEAN_RANGE:
+        if ( sc->mode )
+            return -EINVAL;
+        return paging_log_dirty_range_op(d, sc);
+
+    case XEN_DOMCTL_SHADOW_OP_DIRTY_RING_SETUP:
+        if ( !hap_enabled(d) )
+            return -EOPNOTSUPP;
+        if ( sc->pages && !paging_mode_log_dirty(d) )
+            return -EINVAL;
+        return paging_dirty_ring_setup(d, sc->pages);
+
+    case XEN_DOMCTL_SHADOW_OP_DIRTY_RING_DRAIN:
+        if ( !hap_enabled(d) )
+            return -EOPNOTSUPP;
+        return paging_dirty_ring_drain(d, sc);
     }
 
     /* Here, dispatch domctl to the appropriate paging code */
@@ -774,11 +1096,11 @@ long paging_domctl_continuation(XEN_GUEST_HANDLE_PARAM(xen_domctl_t) u_domctl)
     ret = xsm_domctl(XSM_OTHER, d, op.cmd);
     if ( !ret )
     {
-        if ( domctl_lock_acquire() )
+        if ( domctl_lock_acquire_domain(d) )
         {
             ret = paging_domctl(d, &op.u.shadow_op, u_domctl, 1);
 
-            domctl_lock_release();
+            domctl_lock_release_domain(d);
         }
         else
             ret = -ERESTART;
@@ -810,6 +1132,7 @@ int paging_teardown(struct domain *d)
         return -ERESTART;
 
     /* clean up log dirty resources. */
+    paging_dirty_ring_setup(d, 0);
     rc = paging_free_log_dirty_bitmap(d, 0);
     if ( rc == -ERESTART )
         return rc;
@@ -63,6 +63,7 @@ int shadow_domain_init(struct domain *d, unsigned int domcr_flags)
 #if (SHADOW_OPTIMIZATIONS & SHOPT_OUT_OF_SYNC)
     d->arch.paging.shadow.oos_active = 0;
     d->arch.paging.shadow.oos_off = (domcr_flags & DOMCRF_oos_off) ?  1 : 0;
+    d->arch.paging.shadow.oos_pages = SHADOW_OOS_PAGES;
 #endif
     d->arch.paging.shadow.pagetable_dying_op = 0;
 
@@ -80,7 +81,7 @@ void shadow_vcpu_init(struct vcpu *v)
 #if (SHADOW_OPTIMIZATIONS & SHOPT_OUT_OF_SYNC)
     int i, j;
 
-    for ( i = 0; i < SHADOW_OOS_PAGES; i++ )
+    for ( i = 0; i < SHADOW_OOS_MAX_PAGES; i++ )
     {
         v->arch.paging.shadow.oos[i] = INVALID_MFN;
         v->arch.paging.shadow.oos_snapshot[i] = INVALID_MFN;
@@ -441,14 +442,14 @@ static void sh_oos_audit(struct domain *d)
 
     for_each_vcpu(d, v)
     {
-        for ( idx = 0; idx < SHADOW_OOS_PAGES; idx++ )
+        for ( idx = 0; idx < SHADOW_OOS_MAX_PAGES; idx++ )
         {
             mfn_t *oos = v->arch.paging.shadow.oos;
             if ( !mfn_valid(oos[idx]) )
                 continue;
 
-            expected_idx = mfn_x(oos[idx]) % SHADOW_OOS_PAGES;
-            expected_idx_alt = ((expected_idx + 1) % SHADOW_OOS_PAGES);
+            expected_idx = mfn_x(oos[idx]) % d->arch.paging.shadow.oos_pages;
+            expected_idx_alt = ((expected_idx + 1) % d->arch.paging.shadow.oos_pages);
             if ( idx != expected_idx && idx != expected_idx_alt )
             {
                 printk("%s: idx %d contains gmfn %lx, expected at %d or %d.\n",
@@ -492,9 +493,9 @@ void oos_audit_hash_is_present(struct domain *d, mfn_t gmfn)
     for_each_vcpu(d, v)
     {
         oos = v->arch.paging.shadow.oos;
-        idx = mfn_x(gmfn) % SHADOW_OOS_PAGES;
+        idx = mfn_x(gmfn) % d->arch.paging.shadow.oos_pages;
         if ( mfn_x(oos[idx]) != mfn_x(gmfn) )
-            idx = (idx + 1) % SHADOW_OOS_PAGES;
+            idx = (idx + 1) % d->arch.paging.shadow.oos_pages;
 
         if ( mfn_x(oos[idx]) == mfn_x(gmfn) )
             return;
@@ -563,9 +564,9 @@ void oos_fixup_add(struct domain *d, mfn_t gmfn,
     {
         oos = v->arch.paging.shadow.oos;
         oos_fixup = v->arch.paging.shadow.oos_fixup;
-        idx = mfn_x(gmfn) % SHADOW_OOS_PAGES;
+        idx = mfn_x(gmfn) % d->arch.paging.shadow.oos_pages;
         if ( mfn_x(oos[idx]) != mfn_x(gmfn) )
-            idx = (idx + 1) % SHADOW_OOS_PAGES;
+            idx = (idx + 1) % d->arch.paging.shadow.oos_pages;
         if ( mfn_x(oos[idx]) == mfn_x(gmfn) )
         {
             int i;
@@ -691,6 +692,7 @@ static void _sh_resync(struct vcpu *v, mfn_t gmfn,
 /* Add an MFN to the list of out-of-sync guest pagetables */
 static void oos_hash_add(struct vcpu *v, mfn_t gmfn)
 {
+    struct domain *d = v->domain;
     int i, idx, oidx, swap = 0;
     void *gptr, *gsnpptr;
     mfn_t *oos = v->arch.paging.shadow.oos;
@@ -701,17 +703,18 @@ static void oos_hash_add(struct vcpu *v, mfn_t gmfn)
     for (i = 0; i < SHADOW_OOS_FIXUPS; i++ )
         fixup.smfn[i] = INVALID_MFN;
 
-    idx = mfn_x(gmfn) % SHADOW_OOS_PAGES;
+    idx = mfn_x(gmfn) % d->arch.paging.shadow.oos_pages;
     oidx = idx;
 
     if ( mfn_valid(oos[idx])
-         && (mfn_x(oos[idx]) % SHADOW_OOS_PAGES) == idx )
+         && (mfn_x(oos[idx]) % d->arch.paging.shadow.oos_pages) == idx )
     {
         /* Punt the current occupant into the next slot */
         SWAP(oos[idx], gmfn);
         SWAP(oos_fixup[idx], fixup);
         swap = 1;
-        idx = (idx + 1) % SHADOW_OOS_PAGES;
+        idx = (idx + 1) % d->arch.paging.shadow.oos_pages;
+        perfc_incr(shadow_unsync_swap);
     }
     if ( mfn_valid(oos[idx]) )
    {
@@ -744,9 +747,9 @@ static void oos_hash_remove(struct domain *d, mfn_t gmfn)
     for_each_vcpu(d, v)
     {
         oos = v->arch.paging.shadow.oos;
-        idx = mfn_x(gmfn) % SHADOW_OOS_PAGES;
+        idx = mfn_x(gmfn) % d->arch.paging.shadow.oos_pages;
         if ( mfn_x(oos[idx]) != mfn_x(gmfn) )
-            idx = (idx + 1) % SHADOW_OOS_PAGES;
+            idx = (idx + 1) % d->arch.paging.shadow.oos_pages;
         if ( mfn_x(oos[idx]) == mfn_x(gmfn) )
         {
             oos[idx] = INVALID_MFN;
@@ -769,9 +772,9 @@ mfn_t oos_snapshot_lookup(struct domain *d, mfn_t gmfn)
     {
         oos = v->arch.paging.shadow.oos;
         oos_snapshot = v->arch.paging.shadow.oos_snapshot;
-        idx = mfn_x(gmfn) % SHADOW_OOS_PAGES;
+        idx = mfn_x(gmfn) % d->arch.paging.shadow.oos_pages;
         if ( mfn_x(oos[idx]) != mfn_x(gmfn) )
-            idx = (idx + 1) % SHADOW_OOS_PAGES;
+            idx = (idx + 1) % d->arch.paging.shadow.oos_pages;
         if ( mfn_x(oos[idx]) == mfn_x(gmfn) )
         {
             return oos_snapshot[idx];
@@ -796,9 +799,9 @@ void sh_resync(struct domain *d, mfn_t gmfn)
         oos = v->arch.paging.shadow.oos;
         oos_fixup = v->arch.paging.shadow.oos_fixup;
         oos_snapshot = v->arch.paging.shadow.oos_snapshot;
-        idx = mfn_x(gmfn) % SHADOW_OOS_PAGES;
+        idx = mfn_x(gmfn) % d->arch.paging.shadow.oos_pages;
         if ( mfn_x(oos[idx]) != mfn_x(gmfn) )
-            idx = (idx + 1) % SHADOW_OOS_PAGES;
+            idx = (idx + 1) % d->arch.paging.shadow.oos_pages;
 
         if ( mfn_x(oos[idx]) == mfn_x(gmfn) )
         {
@@ -850,7 +853,7 @@ void sh_resync_all(struct vcpu *v, int skip, int this, int others)
         goto resync_others;
 
     /* First: resync all of this vcpu's oos pages */
-    for ( idx = 0; idx < SHADOW_OOS_PAGES; idx++ )
+    for ( idx = 0; idx < SHADOW_OOS_MAX_PAGES; idx++ )
         if ( mfn_valid(oos[idx]) )
         {
             /* Write-protect and sync contents */
@@ -872,7 +875,7 @@ void sh_resync_all(struct vcpu *v, int skip, int this, int others)
         oos_fixup = other->arch.paging.shadow.oos_fixup;
         oos_snapshot = other->arch.paging.shadow.oos_snapshot;
 
-        for ( idx = 0; idx < SHADOW_OOS_PAGES; idx++ )
+        for ( idx = 0; idx < SHADOW_OOS_MAX_PAGES; idx++ )
         {
             if ( !mfn_valid(oos[idx]) )
                 continue;
@@ -1532,6 +1535,8 @@ shadow_free_p2m_page(struct domain *d, struct page_info *pg)
     paging_unlock(d);
 }
 
+static void shadow_hash_resize(struct domain *d);
+
 int shadow_set_allocation(struct domain *d, unsigned int pages, bool *preempted)
 {
     struct page_info *sp;
@@ -1603,6 +1608,8 @@ int shadow_set_allocation(struct domain *d, unsigned int pages, bool *preempted)
         }
     }
 
+    shadow_hash_resize(d);
+
     return 0;
 }
 
@@ -1838,18 +1845,35 @@ void sh_emulate_unmap_dest(struct vcpu *v, void *addr, unsigned int bytes,
  * The table itself is an array of pointers to shadows; the shadows are then
  * threaded on a singly-linked list of shadows with the same hash value */
 
-#define SHADOW_HASH_BUCKETS 251
-/* Other possibly useful primes are 509, 1021, 2039, 4093, 8191, 16381 */
+/*
+ * The table grows and shrinks with the shadow pool, to about four pages of
+ * pool per bucket, so that a big guest's chains stay short.
+ */
+static const unsigned int shadow_hash_primes[] = {
+    251, 509, 1021, 2039, 4093, 8191, 16381
+};
+
+static unsigned int shadow_hash_size(const struct domain *d)
+{
+    unsigned int i;
+
+    for ( i = 0; i < ARRAY_SIZE(shadow_hash_primes) - 1; i++ )
+        if ( shadow_hash_primes[i] * 4 >= d->arch.paging.shadow.total_pages )
+            break;
+
+    return shadow_hash_primes[i];
+}
 
 /* Hash function that takes a gfn or mfn, plus another byte of type info */
 typedef u32 key_t;
-static inline key_t sh_hash(unsigned long n, unsigned int t)
+static inline key_t sh_hash(const struct domain *d, unsigned long n,
+                            unsigned int t)
 {
     unsigned char *p = (unsigned char *)&n;
     key_t k = t;
     int i;
     for ( i = 0; i < sizeof(n) ; i++ ) k = (u32)p[i] + (k<<6) + (k<<16) - k;
-    return k % SHADOW_HASH_BUCKETS;
+    return k % d->arch.paging.shadow.hash_buckets;
 }
 
 #if SHADOW_AUDIT & (SHADOW_AUDIT_HASH|SHADOW_AUDIT_HASH_FULL)
@@ -1875,7 +1899,7 @@ static void sh_hash_audit_bucket(struct domain *d, int bucket)
         /* Wrong page of a multi-page shadow? */
         BUG_ON( !sp->u.sh.head );
         /* Wrong bucket? */
-        BUG_ON( sh_hash(__backpointer(sp), sp->u.sh.type) != bucket );
+        BUG_ON( sh_hash(d, __backpointer(sp), sp->u.sh.type) != bucket );
         /* Duplicate entry? */
         for ( x = next_shadow(sp); x; x = next_shadow(x) )
             BUG_ON( x->v.sh.back == sp->v.sh.back &&
@@ -1940,7 +1964,7 @@ static void sh_hash_audit(struct domain *d)
     if ( !(SHADOW_AUDIT_ENABLE) )
         return;
 
-    for ( i = 0; i < SHADOW_HASH_BUCKETS; i++ )
+    for ( i = 0; i < d->arch.paging.shadow.hash_buckets; i++ )
     {
         sh_hash_audit_bucket(d, i);
     }
@@ -1955,16 +1979,55 @@ static void sh_hash_audit(struct domain *d)
 static int shadow_hash_alloc(struct domain *d)
 {
     struct page_info **table;
+    unsigned int buckets;
 
     ASSERT(paging_locked_by_me(d));
     ASSERT(!d->arch.paging.shadow.hash_table);
 
-    table = xzalloc_array(struct page_info *, SHADOW_HASH_BUCKETS);
+    buckets = shadow_hash_size(d);
+    table = xzalloc_array(struct page_info *, buckets);
     if ( !table ) return 1;
     d->arch.paging.shadow.hash_table = table;
+    d->arch.paging.shadow.hash_buckets = buckets;
     return 0;
 }
 
+/* Rehash into a table sized for the pool as it now is.  If the new table
+ * can't be had, carry on with the old one: it is only slower. */
+static void shadow_hash_resize(struct domain *d)
+{
+    struct page_info **old = d->arch.paging.shadow.hash_table;
+    struct page_info **table, *sp, *next;
+    unsigned int i, old_buckets = d->arch.paging.shadow.hash_buckets;
+    unsigned int buckets = shadow_hash_size(d);
+    key_t key;
+
+    ASSERT(paging_locked_by_me(d));
+
+    if ( !old || buckets == old_buckets ||
+         d->arch.paging.shadow.hash_walking )
+        return;
+
+    table = xzalloc_array(struct page_info *, buckets);
+    if ( !table )
+        return;
+
+    d->arch.paging.shadow.hash_table = table;
+    d->arch.paging.shadow.hash_buckets = buckets;
+
+    for ( i = 0; i < old_buckets; i++ )
+        for ( sp = old[i]; sp; sp = next )
+        {
+            next = next_shadow(sp);
+            key = sh_hash(d, __backpointer(sp), sp->u.sh.type);
+            set_next_shadow(sp, table[key]);
+            table[key] = sp;
+        }
+
+    xfree(old);
+    perfc_incr(shadow_hash_resizes);
+}
+
 /* Tear down the hash table and return all memory to Xen.
  * This function does not care whether the table is populated. */
 static void shadow_hash_teardown(struct domain *d)
@@ -1991,7 +2054,7 @@ mfn_t shadow_hash_lookup(struct domain *d, unsigned long n, unsigned int t)
     sh_hash_audit(d);
 
     perfc_incr(shadow_hash_lookups);
-    key = sh_hash(n, t);
+    key = sh_hash(d, n, t);
     sh_hash_audit_bucket(d, key);
 
     sp = d->arch.paging.shadow.hash_table[key];
@@ -2024,6 +2087,7 @@ mfn_t shadow_hash_lookup(struct domain *d, unsigned long n, unsigned int t)
         }
         prev = sp;
         sp = next_shadow(sp);
+        perfc_incr(shadow_hash_lookup_steps);
     }
 
     perfc_incr(shadow_hash_lookup_miss);
@@ -2044,7 +2108,7 @@ void shadow_hash_insert(struct domain *d, unsigned long n, unsigned int t,
     sh_hash_audit(d);
 
     perfc_incr(shadow_hash_inserts);
-    key = sh_hash(n, t);
+    key = sh_hash(d, n, t);
     sh_hash_audit_bucket(d, key);
 
     /* Insert this shadow at the top of the bucket */
@@ -2069,7 +2133,7 @@ void shadow_hash_delete(struct domain *d, unsigned long n, unsigned int t,
     sh_hash_audit(d);
 
     perfc_incr(shadow_hash_deletes);
-    key = sh_hash(n, t);
+    key = sh_hash(d, n, t);
     sh_hash_audit_bucket(d, key);
 
     sp = mfn_to_page(smfn);
@@ -2126,7 +2190,7 @@ static void hash_vcpu_foreach(struct vcpu *v, unsigned int callback_mask,
     ASSERT(d->arch.paging.shadow.hash_walking == 0);
     d->arch.paging.shadow.hash_walking = 1;
 
-    for ( i = 0; i < SHADOW_HASH_BUCKETS; i++ )
+    for ( i = 0; i < d->arch.paging.shadow.hash_buckets; i++ )
     {
         /* WARNING: This is not safe against changes to the hash table.
          * The callback *must* return non-zero if it has inserted or
@@ -2173,7 +2237,7 @@ static void hash_domain_foreach(struct domain *d,
     ASSERT(d->arch.paging.shadow.hash_walking == 0);
     d->arch.paging.shadow.hash_walking = 1;
 
-    for ( i = 0; i < SHADOW_HASH_BUCKETS; i++ )
+    for ( i = 0; i < d->arch.paging.shadow.hash_buckets; i++ )
     {
         /* WARNING: This is not safe against changes to the hash table.
          * The callback *must* return non-zero if it has inserted or
@@ -2884,7 +2948,7 @@ static void sh_update_paging_modes(struct vcpu *v)
     if ( mfn_eq(v->arch.paging.shadow.oos_snapshot[0], INVALID_MFN) )
     {
         int i;
-        for(i = 0; i < SHADOW_OOS_PAGES; i++)
+        for(i = 0; i < d->arch.paging.shadow.oos_pages; i++)
         {
             shadow_prealloc(d, SH_type_oos_snapshot, 1);
             v->arch.paging.shadow.oos_snapshot[i] =
@@ -3220,7 +3284,7 @@ void shadow_teardown(struct domain *d, bool *preempted)
         {
             int i;
             mfn_t *oos_snapshot = v->arch.paging.shadow.oos_snapshot;
-            for ( i = 0; i < SHADOW_OOS_PAGES; i++ )
+            for ( i = 0; i < SHADOW_OOS_MAX_PAGES; i++ )
                 if ( mfn_valid(oos_snapshot[i]) )
                 {
                     shadow_free(d, oos_snapshot[i]);
@@ -3403,7 +3467,7 @@ static int shadow_one_bit_disable(struct domain *d, u32 mode)
             {
                 int i;
                 mfn_t *oos_snapshot = v->arch.paging.shadow.oos_snapshot;
-                for ( i = 0; i < SHADOW_OOS_PAGES; i++ )
+                for ( i = 0; i < SHADOW_OOS_MAX_PAGES; i++ )
                     if ( mfn_valid(oos_snapshot[i]) )
                     {
                         shadow_free(d, oos_snapshot[i]);
@@ -3479,9 +3543,17 @@ static void sh_unshadow_for_p2m_change(struct domain *d, unsigned long gfn,
         p2m_type_t p2mt = p2m_flags_to_type(l1e_get_flags(*p));
         if ( (p2m_is_valid(p2mt) || p2m_is_grant(p2mt)) && mfn_valid(mfn) )
         {
+            struct p2m_domain *p2m = p2m_get_hostp2m(d);
+
             sh_remove_all_shadows_and_parents(d, mfn);
             if ( sh_remove_all_mappings(d, mfn, _gfn(gfn)) )
-                flush_tlb_mask(d->dirty_cpumask);
+            {
+                /* Leave the flush to p2m_unlock() if the p2m lock is held. */
+                if ( p2m->defer_flush )
+                    p2m->need_flush = 1;
+                else
+                    flush_tlb_mask(d->dirty_cpumask);
+            }
         }
     }
 
@@ -3622,10 +3694,16 @@ static void sh_clean_dirty_bitmap(struct domain *d)
 
 /**************************************************************************/
 /* VRAM dirty tracking support */
-int shadow_track_dirty_vram(struct domain *d,
-                            unsigned long begin_pfn,
-                            unsigned long nr,
-                            XEN_GUEST_HANDLE_PARAM(void) guest_dirty_bitmap)
+
+/*
+ * Fill @guest_bitmap, of BITS_TO_LONGS(nr) longs, with the pages of
+ * [begin_pfn, begin_pfn + nr) written since the last call.  Returns
+ * -ENODATA when tracking has only just been set up.  nr == 0 stops it.
+ */
+int shadow_dirty_vram_bitmap(struct domain *d,
+                             unsigned long begin_pfn,
+                             unsigned long nr,
+                             unsigned long *guest_bitmap)
 {
     int rc = 0;
     unsigned long end_pfn = begin_pfn + nr;
@@ -3635,7 +3713,7 @@ int shadow_track_dirty_vram(struct domain *d,
     p2m_type_t t;
     struct sh_dirty_vram *dirty_vram;
     struct p2m_domain *p2m = p2m_get_hostp2m(d);
-    uint8_t *dirty_bitmap = NULL;
+    uint8_t *dirty_bitmap = (uint8_t *)guest_bitmap;
 
     if ( end_pfn < begin_pfn || end_pfn > p2m->max_mapped_pfn + 1 )
         return -EINVAL;
@@ -3661,12 +3739,6 @@ int shadow_track_dirty_vram(struct domain *d,
     if ( !nr )
         goto out;
 
-    dirty_bitmap = vzalloc(dirty_size);
-    if ( dirty_bitmap == NULL )
-    {
-        rc = -ENOMEM;
-        goto out;
-    }
     /* This should happen seldomly (Video mode change),
      * no need to be careful. */
     if ( !dirty_vram )
@@ -3805,20 +3877,99 @@ out_dirty_vram:
 
 out:
     paging_unlock(d);
+    p2m_unlock(p2m_get_hostp2m(d));
+    return rc;
+}
+
+int shadow_track_dirty_vram(struct domain *d,
+                            unsigned long begin_pfn,
+                            unsigned long nr,
+                            XEN_GUEST_HANDLE_PARAM(void) guest_dirty_bitmap)
+{
+    unsigned long dirty_size = (nr + 7) / 8, i;
+    struct sh_dirty_vram *dirty_vram;
+    uint8_t *dirty_bitmap = NULL;
+    int rc;
+
+    if ( nr )
+    {
+        dirty_bitmap = vzalloc(BITS_TO_LONGS(nr) * sizeof(unsigned long));
+        if ( dirty_bitmap == NULL )
+            return -ENOMEM;
+    }
+
+    rc = shadow_dirty_vram_bitmap(d, begin_pfn, nr,
+                                  (unsigned long *)dirty_bitmap);
+
     if ( rc == 0 && dirty_bitmap != NULL &&
          copy_to_guest(guest_dirty_bitmap, dirty_bitmap, dirty_size) )
     {
+        /* Don't lose the dirty bits: the next call will report them. */
         paging_lock(d);
-        for ( i = 0; i < dirty_size; i++ )
-            dirty_vram->dirty_bitmap[i] |= dirty_bitmap[i];
+        dirty_vram = d->arch.hvm_domain.dirty_vram;
+        if ( dirty_vram && dirty_vram->begin_pfn == begin_pfn &&
+             dirty_vram->end_pfn == begin_pfn + nr )
+            for ( i = 0; i < dirty_size; i++ )
+                dirty_vram->dirty_bitmap[i] |= dirty_bitmap[i];
         paging_unlock(d);
         rc = -EFAULT;
     }
     vfree(dirty_bitmap);
-    p2m_unlock(p2m_get_hostp2m(d));
+
     return rc;
 }
 
+/* Change the number of out-of-sync slots each vcpu has.  The slot a page
+ * goes in depends on that number, so everything is resynced first. */
+static int shadow_set_oos_pages(struct domain *d, unsigned int nr)
+{
+#if (SHADOW_OPTIMIZATIONS & SHOPT_OUT_OF_SYNC)
+    struct vcpu *v;
+    unsigned int i;
+
+    if ( nr == 0 || nr > SHADOW_OOS_MAX_PAGES )
+        return -EINVAL;
+
+    domain_pause(d);
+    paging_lock(d);
+
+    for_each_vcpu ( d, v )
+        sh_resync_all(v, 0, 1, 0);
+
+    for_each_vcpu ( d, v )
+    {
+        mfn_t *oos_snapshot = v->arch.paging.shadow.oos_snapshot;
+
+        /* Vcpus yet to get snapshots will get the right number of them. */
+        if ( mfn_eq(oos_snapshot[0], INVALID_MFN) )
+            continue;
+
+        for ( i = nr; i < SHADOW_OOS_MAX_PAGES; i++ )
+            if ( mfn_valid(oos_snapshot[i]) )
+            {
+                shadow_free(d, oos_snapshot[i]);
+                oos_snapshot[i] = INVALID_MFN;
+            }
+
+        for ( i = 0; i < nr; i++ )
+            if ( !mfn_valid(oos_snapshot[i]) )
+            {
+                shadow_prealloc(d, SH_type_oos_snapshot, 1);
+                oos_snapshot[i] = shadow_alloc(d, SH_type_oos_snapshot, 0);
+            }
+    }
+
+    d->arch.paging.shadow.oos_pages = nr;
+
+    paging_unlock(d);
+    domain_unpause(d);
+
+    return 0;
+#else
+    return -EOPNOTSUPP;
+#endif
+}
+
 /**************************************************************************/
 /* Shadow-control XEN_DOMCTL dispatcher */
 
@@ -3869,6 +4020,17 @@ int shadow_domctl(struct domain *d,
             sc->mb = shadow_get_allocation(d);
         return rc;
 
+    case XEN_DOMCTL_SHADOW_OP_GET_OOS_PAGES:
+#if (SHADOW_OPTIMIZATIONS & SHOPT_OUT_OF_SYNC)
+        sc->oos_pages = d->arch.paging.shadow.oos_pages;
+        return 0;
+#else
+        return -EOPNOTSUPP;
+#endif
+
+    case XEN_DOMCTL_SHADOW_OP_SET_OOS_PAGES:
+        return shadow_set_oos_pages(d, sc->oos_pages);
+
     default:
         SHADOW_ERROR("Bad shadow op %u\n", sc->op);
         return -EINVAL;
@@ -17,6 +17,7 @@
 #include <asm/acpi.h>
 #include <xen/sched.h>
 #include <xen/softirq.h>
+#include <asm/p2m.h>
 
 static int numa_setup(const char *s);
 custom_param("numa", numa_setup);
@@ -438,6 +439,8 @@ static void dump_numa(unsigned char key)
         for_each_online_node ( i )
             printk("    Node %u: %u\n", i, page_num_node[i]);
 
+        numa_balance_dump(d);
+
         if ( !read_trylock(&d->vnuma_rwlock) )
             continue;
 
@@ -192,6 +192,24 @@ ret_t do_physdev_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
         ret = -EINVAL;
         if ( eoi.irq >= currd->nr_pirqs )
             break;
+
+        /*
+         * The common PV case needs no event lock: pirq_info() is lockless,
+         * and pirq_guest_eoi() copes with the pIRQ getting unmapped in the
+         * meantime through the irq descriptor lock.  Only unmasking the
+         * event channel, and emulated IRQs, need the event lock.
+         */
+        if ( is_pv_domain(currd) && !currd->arch.auto_unmask )
+        {
+            pirq = pirq_info(currd, eoi.irq);
+            if ( pirq )
+            {
+                pirq_guest_eoi(pirq);
+                ret = 0;
+            }
+            break;
+        }
+
         spin_lock(&currd->event_lock);
         pirq = pirq_info(currd, eoi.irq);
         if ( !pirq ) {
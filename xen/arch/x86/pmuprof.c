@@ -0,0 +1,419 @@
+/******************************************************************************
+ * arch/x86/pmuprof.c
+ *
+ * Statistical profiling of the hypervisor from performance counter
+ * overflow NMIs (XEN_SYSCTL_pmuprof_op).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Each pCPU counts unhalted core cycles in its first general purpose
+ * counter, started at -period so that it overflows, and raises an NMI,
+ * every period cycles.  The NMI handler records where it interrupted, and
+ * the call chain when that was Xen and it has frame pointers, into a ring
+ * of its own, which XEN_SYSCTL_PMUPROF_read drains from another pCPU: one
+ * producer and one consumer, so no locks are needed in NMI context.
+ */
+
+#include <xen/cpu.h>
+#include <xen/guest_access.h>
+#include <xen/sched.h>
+#include <xen/smp.h>
+#include <xen/time.h>
+#include <xen/xenoprof.h>
+#include <xen/xmalloc.h>
+#include <asm/apic.h>
+#include <asm/msr.h>
+#include <asm/nmi.h>
+#include <asm/pmuprof.h>
+#include <asm/processor.h>
+#include <asm/regs.h>
+#include <asm/vpmu.h>
+#include <public/sysctl.h>
+
+/* Event select bits, the same for Intel architectural and AMD counters. */
+#define PMUPROF_SEL_USR     (1u << 16)
+#define PMUPROF_SEL_OS      (1u << 17)
+#define PMUPROF_SEL_INT     (1u << 20)
+#define PMUPROF_SEL_EN      (1u << 22)
+
+#define PMUPROF_INTEL_CYCLES 0x3c /* UnHalted Core Cycles */
+#define PMUPROF_AMD_CYCLES   0x76 /* CPU Clocks not Halted */
+
+#define PMUPROF_MAX_SAMPLES  (1u << 16)
+
+struct pmuprof_buf {
+    unsigned int size;
+    unsigned int prod, cons;
+    uint64_t lost;
+    struct xen_sysctl_pmuprof_sample s[];
+};
+
+static struct pmuprof_buf *pmuprof_bufs[NR_CPUS];
+static bool pmuprof_running;
+
+static unsigned int pmuprof_sel_msr, pmuprof_ctr_msr;
+static uint64_t pmuprof_sel, pmuprof_reload, pmuprof_sign;
+static bool pmuprof_global_ctrl;        /* arch perfmon v2 and later */
+
+/* What we overwrite, restored on stop. */
+static struct {
+    uint64_t sel, ctr, global_ctrl;
+    uint32_t lvtpc;
+} pmuprof_saved[NR_CPUS];
+
+static unsigned int pmuprof_frames(const struct cpu_user_regs *regs,
+                                   uint64_t *frames)
+{
+    unsigned int n = 0;
+#ifdef CONFIG_FRAME_POINTER
+    unsigned long low = regs->rsp, high = get_stack_trace_bottom(regs->rsp);
+    unsigned long *frame, next = regs->rbp, addr;
+
+    /* As _show_trace(), but without trusting anything outside the stack. */
+    while ( n < XEN_SYSCTL_PMUPROF_DEPTH )
+    {
+        if ( (next < low) || (next >= high) )
+        {
+            /* exception frames are marked by an inverted frame pointer */
+            next = ~next;
+            if ( (next < low) || (next >= high) )
+                break;
+            frame = (unsigned long *)next;
+            next  = frame[0];
+            addr  = frame[(offsetof(struct cpu_user_regs, rip) -
+                           offsetof(struct cpu_user_regs, rbp))
+                         / BYTES_PER_LONG];
+        }
+        else
+        {
+            frame = (unsigned long *)next;
+            next  = frame[0];
+            addr  = frame[1];
+        }
+
+        if ( !is_active_kernel_text(addr) )
+            break;
+        frames[n++] = addr;
+        low = (unsigned long)&frame[2];
+    }
+#endif
+
+    return n;
+}
+
+static int pmuprof_nmi(const struct cpu_user_regs *regs, int cpu)
+{
+    struct pmuprof_buf *buf;
+    struct xen_sysctl_pmuprof_sample *s;
+    const struct vcpu *v = current;
+    uint64_t val;
+
+    buf = ACCESS_ONCE(pmuprof_bufs[cpu]);
+    if ( !buf )
+        return 0;
+
+    /* Still counting up towards 0 from -period: this NMI is not ours. */
+    rdmsrl(pmuprof_ctr_msr, val);
+    if ( val & pmuprof_sign )
+        return 0;
+
+    if ( buf->prod - buf->cons >= buf->size )
+        buf->lost++;
+    else
+    {
+        s = &buf->s[buf->prod & (buf->size - 1)];
+        s->time = NOW();
+        s->ip = regs->rip;
+        s->domid = v->domain->domain_id;
+        s->vcpu = v->vcpu_id;
+        if ( guest_mode(regs) )
+        {
+            s->flags = XEN_SYSCTL_PMUPROF_GUEST;
+            s->nr_frames = 0;
+        }
+        else
+        {
+            s->flags = 0;
+            s->nr_frames = pmuprof_frames(regs, s->frames);
+        }
+        smp_wmb();
+        buf->prod++;
+    }
+
+    wrmsrl(pmuprof_ctr_msr, pmuprof_reload);
+    if ( pmuprof_global_ctrl )
+        wrmsrl(MSR_CORE_PERF_GLOBAL_OVF_CTRL, 1);
+    /* Intel masks the LVT entry on delivery. */
+    apic_write(APIC_LVTPC, APIC_DM_NMI);
+
+    return 1;
+}
+
+static void pmuprof_cpu_start(void *unused)
+{
+    unsigned int cpu = smp_processor_id();
+
+    if ( !pmuprof_bufs[cpu] )
+        return;
+
+    rdmsrl(pmuprof_sel_msr, pmuprof_saved[cpu].sel);
+    rdmsrl(pmuprof_ctr_msr, pmuprof_saved[cpu].ctr);
+    pmuprof_saved[cpu].lvtpc = apic_read(APIC_LVTPC);
+
+    wrmsrl(pmuprof_sel_msr, 0);
+    wrmsrl(pmuprof_ctr_msr, pmuprof_reload);
+    if ( pmuprof_global_ctrl )
+    {
+        rdmsrl(MSR_CORE_PERF_GLOBAL_CTRL, pmuprof_saved[cpu].global_ctrl);
+        wrmsrl(MSR_CORE_PERF_GLOBAL_CTRL, pmuprof_saved[cpu].global_ctrl | 1);
+    }
+    apic_write(APIC_LVTPC, APIC_DM_NMI);
+    wrmsrl(pmuprof_sel_msr, pmuprof_sel | PMUPROF_SEL_EN);
+}
+
+static void pmuprof_cpu_stop(void *unused)
+{
+    unsigned int cpu = smp_processor_id();
+    uint32_t lvterr;
+
+    if ( !pmuprof_bufs[cpu] )
+        return;
+
+    wrmsrl(pmuprof_sel_msr, 0);
+    wrmsrl(pmuprof_ctr_msr, pmuprof_saved[cpu].ctr);
+    if ( pmuprof_global_ctrl )
+        wrmsrl(MSR_CORE_PERF_GLOBAL_CTRL, pmuprof_saved[cpu].global_ctrl);
+    wrmsrl(pmuprof_sel_msr, pmuprof_saved[cpu].sel);
+
+    /* As nmi_cpu_stop(): the saved LVT may hold a vector illegal for it. */
+    lvterr = apic_read(APIC_LVTERR);
+    apic_write(APIC_LVTERR, lvterr | APIC_LVT_MASKED);
+    apic_write(APIC_LVTPC, pmuprof_saved[cpu].lvtpc);
+    apic_write(APIC_LVTERR, lvterr);
+}
+
+static int pmuprof_setup(uint32_t period)
+{
+    unsigned int width;
+
+    switch ( boot_cpu_data.x86_vendor )
+    {
+    case X86_VENDOR_INTEL:
+    {
+        unsigned int eax, ebx, ecx, edx;
+
+        if ( boot_cpu_data.cpuid_level < 0xa )
+            return -EOPNOTSUPP;
+        cpuid(0xa, &eax, &ebx, &ecx, &edx);
+        /* version, # of counters, and whether cycles are counted */
+        if ( !(eax & 0xff) || !((eax >> 8) & 0xff) || (ebx & 1) )
+            return -EOPNOTSUPP;
+        width = (eax >> 16) & 0xff;
+        pmuprof_global_ctrl = (eax & 0xff) >= 2;
+        pmuprof_sel_msr = MSR_P6_EVNTSEL(0);
+        pmuprof_ctr_msr = MSR_P6_PERFCTR(0);
+        pmuprof_sel = PMUPROF_INTEL_CYCLES;
+        break;
+    }
+
+    case X86_VENDOR_AMD:
+        width = 48;
+        pmuprof_global_ctrl = false;
+        pmuprof_sel_msr = MSR_K7_EVNTSEL0;
+        pmuprof_ctr_msr = MSR_K7_PERFCTR0;
+        pmuprof_sel = PMUPROF_AMD_CYCLES;
+        break;
+
+    default:
+        return -EOPNOTSUPP;
+    }
+
+    /* Intel counter writes only take 32 bits, sign extended. */
+    if ( width < 32 || width > 63 || period >= (1u << 31) )
+        return -EINVAL;
+
+    pmuprof_sel |= PMUPROF_SEL_USR | PMUPROF_SEL_OS | PMUPROF_SEL_INT;
+    pmuprof_sign = 1ULL << (width - 1);
+    pmuprof_reload = -(uint64_t)period & ((1ULL << width) - 1);
+
+    return 0;
+}
+
+static void pmuprof_free(void)
+{
+    unsigned int cpu;
+
+    for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+    {
+        xfree(pmuprof_bufs[cpu]);
+        pmuprof_bufs[cpu] = NULL;
+    }
+}
+
+static int pmuprof_start(const struct xen_sysctl_pmuprof_op *op)
+{
+    unsigned int cpu;
+    int rc;
+
+    if ( pmuprof_running )
+        return -EBUSY;
+    /* The rings are indexed with free running counters: powers of 2 only. */
+    if ( !op->period || !op->nr_samples ||
+         op->nr_samples > PMUPROF_MAX_SAMPLES ||
+         (op->nr_samples & (op->nr_samples - 1)) )
+        return -EINVAL;
+    if ( vpmu_mode != XENPMU_MODE_OFF )
+        return -EBUSY;
+
+    rc = pmuprof_setup(op->period);
+    if ( rc )
+        return rc;
+
+    if ( !acquire_pmu_ownership(PMU_OWNER_PMUPROF) )
+        return -EBUSY;
+
+    /* Stops the NMI watchdog, which would otherwise share the counter. */
+    if ( reserve_lapic_nmi() )
+    {
+        release_pmu_ownership(PMU_OWNER_PMUPROF);
+        return -EBUSY;
+    }
+
+    if ( !get_cpu_maps() )
+    {
+        release_lapic_nmi();
+        release_pmu_ownership(PMU_OWNER_PMUPROF);
+        return -EBUSY;
+    }
+
+    for_each_online_cpu ( cpu )
+    {
+        struct pmuprof_buf *buf;
+
+        buf = _xzalloc(offsetof(struct pmuprof_buf, s[op->nr_samples]),
+                       __alignof__(*buf));
+        if ( !buf )
+        {
+            put_cpu_maps();
+            pmuprof_free();
+            release_lapic_nmi();
+            release_pmu_ownership(PMU_OWNER_PMUPROF);
+            return -ENOMEM;
+        }
+        buf->size = op->nr_samples;
+        pmuprof_bufs[cpu] = buf;
+    }
+
+    set_nmi_callback(pmuprof_nmi);
+    on_each_cpu(pmuprof_cpu_start, NULL, 1);
+    pmuprof_running = true;
+
+    put_cpu_maps();
+
+    return 0;
+}
+
+static void pmuprof_cpu_sync(void *unused)
+{
+}
+
+static int pmuprof_stop(void)
+{
+    if ( !pmuprof_running )
+        return -EINVAL;
+
+    on_each_cpu(pmuprof_cpu_stop, NULL, 1);
+    unset_nmi_callback();
+    smp_mb();
+
+    /*
+     * An NMI taken before the counters stopped, or before the callback got
+     * unhooked, may still be logging.  It holds off the IPI on its pCPU
+     * until it has returned, so once every pCPU got to handle one, none of
+     * them can still be using its buffer.
+     */
+    on_each_cpu(pmuprof_cpu_sync, NULL, 1);
+
+    pmuprof_free();
+    release_lapic_nmi();
+    release_pmu_ownership(PMU_OWNER_PMUPROF);
+    pmuprof_running = false;
+
+    return 0;
+}
+
+static int pmuprof_read(struct xen_sysctl_pmuprof_op *op)
+{
+    struct pmuprof_buf *buf;
+    unsigned int prod, cons, n, i;
+
+    if ( op->cpu >= nr_cpu_ids )
+        return -EINVAL;
+
+    buf = pmuprof_bufs[op->cpu];
+    if ( !buf )
+    {
+        op->nr_samples = 0;
+        op->lost = 0;
+        return 0;
+    }
+
+    cons = buf->cons;
+    prod = ACCESS_ONCE(buf->prod);
+    smp_rmb();
+
+    n = min(prod - cons, op->nr_samples);
+    for ( i = 0; i < n; i++ )
+    {
+        if ( copy_to_guest_offset(op->samples, i,
+                                  &buf->s[(cons + i) & (buf->size - 1)], 1) )
+            return -EFAULT;
+    }
+
+    /* Don't let the NMI handler reuse slots before we are done copying. */
+    smp_mb();
+    buf->cons = cons + n;
+
+    op->nr_samples = n;
+    op->lost = buf->lost;
+
+    return 0;
+}
+
+int pmuprof_control(struct xen_sysctl_pmuprof_op *op)
+{
+    switch ( op->cmd )
+    {
+    case XEN_SYSCTL_PMUPROF_start:
+        return pmuprof_start(op);
+
+    case XEN_SYSCTL_PMUPROF_stop:
+        return pmuprof_stop();
+
+    case XEN_SYSCTL_PMUPROF_read:
+        return pmuprof_read(op);
+    }
+
+    return -EINVAL;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -17,6 +17,9 @@
 #include <xen/err.h>
 #include <xen/init.h>
 #include <xen/sched.h>
+#include <xen/tasklet.h>
+#include <xen/timer.h>
+#include <xen/trace.h>
 #include <asm/psr.h>
 
 /*
@@ -37,6 +40,7 @@
 #define PSR_CAT        (1u << 1)
 #define PSR_CDP        (1u << 2)
 #define PSR_MBA        (1u << 3)
+#define PSR_CTRL       (1u << 4)
 
 #define CAT_CBM_LEN_MASK 0x1f
 #define CAT_COS_MAX_MASK 0xffff
@@ -606,7 +610,8 @@ static int __init parse_psr_param(const char *s)
         else if ( !parse_psr_bool(s, val_delim, ss, "cmt", PSR_CMT) &&
                   !parse_psr_bool(s, val_delim, ss, "cat", PSR_CAT) &&
                   !parse_psr_bool(s, val_delim, ss, "cdp", PSR_CDP) &&
-                  !parse_psr_bool(s, val_delim, ss, "mba", PSR_MBA) )
+                  !parse_psr_bool(s, val_delim, ss, "mba", PSR_MBA) &&
+                  !parse_psr_bool(s, val_delim, ss, "ctrl", PSR_CTRL) )
             rc = -EINVAL;
 
         s = ss + 1;
@@ -1482,16 +1487,302 @@ static void psr_alloc_cos(struct domain *d)
         printk(XENLOG_WARNING "Failed to alloc psr_cos_ids!\n");
 }
 
+/*
+ * Closed loop allocation controller.
+ *
+ * Once per period, read LLC occupancy and total memory bandwidth of every
+ * domain with an RMID on every socket, and move the allocation of domains
+ * consuming well beyond an equal share of the cache (bandwidth) one step
+ * towards a smaller CBM (a higher MBA throttle).  Domains falling back below
+ * their share get their allocation stepped back towards what it was when the
+ * controller took over.  Values changed behind the controller's back (by the
+ * toolstack) are treated as the new baseline.
+ */
+#define PSR_CTRL_PERIOD         SECONDS(1)
+
+/* MBM counters are guaranteed to be at least 24 bits wide. */
+#define PSR_MBM_CTR_MASK        ((1ull << 24) - 1)
+#define PSR_CMT_CTR_ERROR_MASK  (3ull << 62)
+
+/* Per domain and socket controller state. */
+struct psr_ctrl {
+    uint64_t mbm;           /* Last total MBM counter reading. */
+    bool mbm_valid;
+    uint32_t cbm_base;      /* Values in force when the controller took */
+    uint32_t thrtl_base;    /* over, restored once back below the share. */
+    uint32_t cbm;           /* Values last set by the controller, */
+    uint32_t thrtl;         /* meaningful only when 'managed'. */
+    bool cbm_managed;
+    bool thrtl_managed;
+};
+
+struct psr_ctrl_sample {
+    uint64_t occupancy;
+    uint64_t mbm;
+};
+
+static struct timer psr_ctrl_timer;
+static struct tasklet psr_ctrl_tasklet;
+/* Per RMID readings of the socket currently looked at. */
+static struct psr_ctrl_sample *psr_ctrl_samples;
+
+static uint64_t psr_cmt_read(unsigned int rmid, unsigned int evtid)
+{
+    uint64_t val;
+
+    wrmsrl(MSR_IA32_CMT_EVTSEL, ((uint64_t)rmid << 32) | evtid);
+    rdmsrl(MSR_IA32_CMT_CTR, val);
+
+    return val;
+}
+
+static void do_psr_ctrl_sample(void *unused)
+{
+    unsigned int rmid;
+    bool mbm = psr_cmt->l3.features & PSR_CMT_L3_TOTAL_MBM;
+
+    for ( rmid = 1; rmid <= psr_cmt->rmid_max; rmid++ )
+    {
+        struct psr_ctrl_sample *s = &psr_ctrl_samples[rmid];
+
+        s->occupancy = s->mbm = PSR_CMT_CTR_ERROR_MASK;
+        if ( psr_cmt->rmid_to_dom[rmid] == DOMID_INVALID )
+            continue;
+
+        s->occupancy = psr_cmt_read(rmid, PSR_CMT_EVTID_L3_OCCUPANCY);
+        if ( mbm )
+            s->mbm = psr_cmt_read(rmid, PSR_CMT_EVTID_L3_TOTAL_MBM);
+    }
+}
+
+/*
+ * Make the cache (bandwidth) allocation of @d on @socket one step less
+ * (@down_*) or more (@up_*) generous.
+ */
+static void psr_ctrl_step(struct domain *d, unsigned int socket,
+                          struct psr_ctrl *ctrl, bool down_cbm,
+                          bool up_cbm, bool down_bw, bool up_bw,
+                          uint64_t occupancy, uint64_t bw)
+{
+    const struct psr_socket_info *info = socket_info + socket;
+    const struct feat_node *feat;
+    uint32_t cur, val;
+    bool changed = false;
+
+    feat = info->features[FEAT_TYPE_L3_CAT];
+    if ( feat && (down_cbm || up_cbm) &&
+         !psr_get_val(d, socket, &cur, PSR_TYPE_L3_CBM) )
+    {
+        if ( ctrl->cbm_managed && cur != ctrl->cbm )
+            ctrl->cbm_managed = false;
+        if ( !ctrl->cbm_managed )
+            ctrl->cbm_base = cur;
+
+        val = cur;
+        if ( down_cbm && hweight32(cur) > 1 )
+            /* Drop the highest way of the (contiguous) mask. */
+            val = cur & ~(1u << (fls(cur) - 1));
+        else if ( up_cbm && ctrl->cbm_managed )
+            val = (cur | (cur << 1)) & ctrl->cbm_base;
+
+        if ( val != cur && !psr_set_val(d, socket, val, PSR_TYPE_L3_CBM) )
+        {
+            ctrl->cbm = val;
+            ctrl->cbm_managed = val != ctrl->cbm_base;
+            changed = true;
+        }
+    }
+
+    feat = info->features[FEAT_TYPE_MBA];
+    if ( feat && (down_bw || up_bw) &&
+         !psr_get_val(d, socket, &cur, PSR_TYPE_MBA_THRTL) )
+    {
+        unsigned int gran = 100 - feat->mba.thrtl_max;
+
+        if ( ctrl->thrtl_managed && cur != ctrl->thrtl )
+            ctrl->thrtl_managed = false;
+        if ( !ctrl->thrtl_managed )
+            ctrl->thrtl_base = cur;
+
+        val = cur;
+        if ( down_bw )
+            val = feat->mba.linear ? cur + gran : max(cur << 1, 1u);
+        else if ( up_bw && ctrl->thrtl_managed )
+            val = feat->mba.linear ? (cur > gran ? cur - gran : 0)
+                                   : cur >> 1;
+        val = max(min(val, feat->mba.thrtl_max), ctrl->thrtl_base);
+
+        if ( val != cur && !psr_set_val(d, socket, val, PSR_TYPE_MBA_THRTL) )
+        {
+            ctrl->thrtl = val;
+            ctrl->thrtl_managed = val != ctrl->thrtl_base;
+            changed = true;
+        }
+    }
+
+    if ( changed )
+    {
+        uint32_t cbm = 0, thrtl = 0;
+
+        psr_get_val(d, socket, &cbm, PSR_TYPE_L3_CBM);
+        psr_get_val(d, socket, &thrtl, PSR_TYPE_MBA_THRTL);
+        TRACE_6D(TRC_HW_PSR_CTRL, d->domain_id, socket, occupancy >> 10,
+                 bw >> 20, cbm, thrtl);
+    }
+}
+
+static void psr_ctrl_socket(unsigned int socket)
+{
+    unsigned int rmid, cpu = get_socket_cpu(socket), nr = 0;
+    uint64_t llc_size, share_occ, share_bw, total_bw = 0;
+    struct domain *d;
+
+    if ( cpu >= nr_cpu_ids || !socket_info[socket].feat_init )
+        return;
+
+    if ( cpu == smp_processor_id() )
+        do_psr_ctrl_sample(NULL);
+    else
+        on_selected_cpus(cpumask_of(cpu), do_psr_ctrl_sample, NULL, 1);
+
+    /*
+     * First pass: turn raw readings into bytes and bytes per period, and
+     * establish the shares.
+     */
+    for ( rmid = 1; rmid <= psr_cmt->rmid_max; rmid++ )
+    {
+        struct psr_ctrl_sample *s = &psr_ctrl_samples[rmid];
+        struct psr_ctrl *ctrl;
+        uint64_t mbm = s->mbm;
+
+        if ( s->occupancy & PSR_CMT_CTR_ERROR_MASK )
+            continue;
+        if ( (d = rcu_lock_domain_by_id(psr_cmt->rmid_to_dom[rmid])) == NULL )
+        {
+            s->occupancy = PSR_CMT_CTR_ERROR_MASK;
+            continue;
+        }
+
+        ctrl = d->arch.psr_ctrl ? &d->arch.psr_ctrl[socket] : NULL;
+        if ( !ctrl || d->arch.psr_rmid != rmid || d->is_dying )
+        {
+            s->occupancy = PSR_CMT_CTR_ERROR_MASK;
+            rcu_unlock_domain(d);
+            continue;
+        }
+
+        s->occupancy *= psr_cmt->l3.upscaling_factor;
+        s->mbm = 0;
+        if ( !(mbm & PSR_CMT_CTR_ERROR_MASK) )
+        {
+            if ( ctrl->mbm_valid )
+                s->mbm = ((mbm - ctrl->mbm) & PSR_MBM_CTR_MASK) *
+                         psr_cmt->l3.upscaling_factor;
+            ctrl->mbm = mbm;
+        }
+        ctrl->mbm_valid = !(mbm & PSR_CMT_CTR_ERROR_MASK);
+
+        total_bw += s->mbm;
+        nr++;
+        rcu_unlock_domain(d);
+    }
+
+    /* Nobody to protect anyone from. */
+    if ( nr < 2 )
+        return;
+
+    llc_size = (uint64_t)boot_cpu_data.x86_cache_size << 10;
+    share_occ = llc_size / nr;
+    share_bw = total_bw / nr;
+
+    for ( rmid = 1; rmid <= psr_cmt->rmid_max; rmid++ )
+    {
+        const struct psr_ctrl_sample *s = &psr_ctrl_samples[rmid];
+
+        if ( s->occupancy & PSR_CMT_CTR_ERROR_MASK ||
+             (d = rcu_lock_domain_by_id(psr_cmt->rmid_to_dom[rmid])) == NULL )
+            continue;
+
+        if ( d->arch.psr_rmid == rmid && !d->is_dying )
+            psr_ctrl_step(d, socket, &d->arch.psr_ctrl[socket],
+                          s->occupancy > share_occ + share_occ / 4,
+                          s->occupancy < share_occ - share_occ / 4,
+                          share_bw && s->mbm > share_bw * 2,
+                          s->mbm < share_bw,
+                          s->occupancy, s->mbm);
+
+        rcu_unlock_domain(d);
+    }
+}
+
+static void psr_ctrl_work(unsigned long unused)
+{
+    unsigned int socket;
+
+    /*
+     * Serialise against the toolstack changing allocations or RMIDs.  If
+     * it is busy doing so, just try again next period.
+     */
+    if ( domctl_lock_acquire() )
+    {
+        for ( socket = 0; socket < nr_sockets; socket++ )
+            psr_ctrl_socket(socket);
+        domctl_lock_release();
+    }
+
+    set_timer(&psr_ctrl_timer, NOW() + PSR_CTRL_PERIOD);
+}
+
+static void psr_ctrl_timer_fn(void *unused)
+{
+    /* Reading counters and writing MSRs remotely needs to be able to wait. */
+    tasklet_schedule(&psr_ctrl_tasklet);
+}
+
+static int __init psr_ctrl_init(void)
+{
+    if ( !(opt_psr & PSR_CTRL) )
+        return 0;
+
+    if ( !psr_cmt_enabled() ||
+         !(psr_cmt->l3.features & PSR_CMT_L3_OCCUPANCY) ||
+         !socket_info || boot_cpu_data.x86_cache_size <= 0 )
+    {
+        printk(XENLOG_WARNING
+               "PSR: allocation controller needs CMT and CAT or MBA\n");
+        return 0;
+    }
+
+    psr_ctrl_samples = xzalloc_array(struct psr_ctrl_sample,
+                                     psr_cmt->rmid_max + 1);
+    if ( !psr_ctrl_samples )
+        return -ENOMEM;
+
+    tasklet_init(&psr_ctrl_tasklet, psr_ctrl_work, 0);
+    init_timer(&psr_ctrl_timer, psr_ctrl_timer_fn, NULL, 0);
+    set_timer(&psr_ctrl_timer, NOW() + PSR_CTRL_PERIOD);
+
+    printk(XENLOG_INFO "PSR: allocation controller enabled\n");
+
+    return 0;
+}
+__initcall(psr_ctrl_init);
+
 void psr_domain_init(struct domain *d)
 {
     if ( psr_alloc_feat_enabled() )
         psr_alloc_cos(d);
+
+    if ( opt_psr & PSR_CTRL )
+        d->arch.psr_ctrl = xzalloc_array(struct psr_ctrl, nr_sockets);
 }
 
 void psr_domain_free(struct domain *d)
 {
     psr_free_rmid(d);
     psr_free_cos(d);
+    xfree(d->arch.psr_ctrl);
+    d->arch.psr_ctrl = NULL;
 }
 
 static void __init init_psr(void)
@@ -1032,7 +1032,7 @@ static int write_msr(unsigned int reg, uint64_t val,
     case MSR_SHADOW_GS_BASE:
         if ( is_pv_32bit_domain(currd) || !is_canonical_address(val) )
             break;
-        wrmsrl(MSR_SHADOW_GS_BASE, val);
+        wrgsshadow(val);
         curr->arch.pv_vcpu.gs_base_user = val;
         return X86EMUL_OKAY;
 
@@ -1323,6 +1323,133 @@ static const struct x86_emulate_ops priv_op_ops = {
     .wbinvd              = _wbinvd,
 };
 
+static bool fast_fetch(struct priv_op_ctxt *poc, unsigned long ip,
+                       uint8_t *byte)
+{
+    unsigned long offset = poc->ctxt.addr_size == 64 ? ip : (uint32_t)ip;
+
+    if ( insn_fetch(x86_seg_cs, offset, byte, 1,
+                    &poc->ctxt) == X86EMUL_OKAY )
+        return true;
+
+    /* Let the full emulator deal with (and report) any fetch fault. */
+    x86_emul_reset_event(&poc->ctxt);
+
+    return false;
+}
+
+/*
+ * Fast path for the privileged instructions PV kernels trap on most often:
+ * RDMSR, WRMSR, and non-string IN / OUT.  These are decoded here and
+ * handed straight to the respective handler, bypassing the generic
+ * emulator.  Returns false, without side effects, for anything else (any
+ * prefix other than a single operand size override on IN / OUT, 16-bit
+ * code, user mode MSR accesses, fetch faults), leaving it to x86_emulate().
+ * Otherwise *rc is set as x86_emulate() would have returned it.
+ */
+static bool priv_op_fast_path(struct priv_op_ctxt *poc, int *rc)
+{
+    struct x86_emulate_ctxt *ctxt = &poc->ctxt;
+    struct cpu_user_regs *regs = ctxt->regs;
+    unsigned long ip = regs->rip;
+    unsigned int port, bytes = 4;
+    uint8_t b;
+    uint64_t msr_val;
+    unsigned long io_val = 0;
+
+    if ( ctxt->addr_size < 32 || !fast_fetch(poc, ip++, &b) )
+        return false;
+
+    if ( b == 0x66 )
+    {
+        if ( !fast_fetch(poc, ip++, &b) || (b & ~0xa) != 0xe5 )
+            return false;
+        bytes = 2;
+    }
+
+    switch ( b )
+    {
+    case 0x0f:
+        if ( !guest_kernel_mode(current, regs) || !fast_fetch(poc, ip++, &b) )
+            return false;
+
+        switch ( b )
+        {
+        case 0x30: /* wrmsr */
+            perfc_incr(emulate_priv_fast_wrmsr);
+            *rc = write_msr(regs->ecx,
+                            ((uint64_t)regs->edx << 32) | regs->eax, ctxt);
+            break;
+
+        case 0x32: /* rdmsr */
+            perfc_incr(emulate_priv_fast_rdmsr);
+            *rc = read_msr(regs->ecx, &msr_val, ctxt);
+            if ( *rc == X86EMUL_OKAY )
+            {
+                regs->rdx = msr_val >> 32;
+                regs->rax = (uint32_t)msr_val;
+            }
+            break;
+
+        default:
+            return false;
+        }
+        break;
+
+    case 0xe4 ... 0xe7: /* in / out (immediate port) */
+    case 0xec ... 0xef: /* in / out (port in %dx) */
+        if ( b < 0xe8 )
+        {
+            uint8_t imm;
+
+            if ( !fast_fetch(poc, ip++, &imm) )
+                return false;
+            port = imm;
+        }
+        else
+            port = regs->dx;
+        if ( !(b & 1) )
+            bytes = 1;
+
+        ctxt->opcode = b;
+        if ( b & 2 )
+        {
+            perfc_incr(emulate_priv_fast_out);
+            *rc = write_io(port, bytes, regs->eax, ctxt);
+        }
+        else
+        {
+            perfc_incr(emulate_priv_fast_in);
+            *rc = read_io(port, bytes, &io_val, ctxt);
+            if ( *rc == X86EMUL_OKAY )
+            {
+                switch ( bytes )
+                {
+                case 1: regs->al = io_val; break;
+                case 2: regs->ax = io_val; break;
+                default: regs->rax = (uint32_t)io_val; break;
+                }
+            }
+        }
+        /* The access was carried out directly by the I/O stub. */
+        if ( *rc == X86EMUL_DONE )
+            *rc = X86EMUL_OKAY;
+        break;
+
+    default:
+        return false;
+    }
+
+    if ( *rc == X86EMUL_OKAY )
+    {
+        regs->rip = ctxt->addr_size == 64 ? ip : (uint32_t)ip;
+        regs->eflags &= ~X86_EFLAGS_RF;
+        ctxt->retire.singlestep = !!(regs->eflags & X86_EFLAGS_TF);
+    }
+
+    return true;
+}
+
 int pv_emulate_privileged_op(struct cpu_user_regs *regs)
 {
     struct vcpu *curr = current;
@@ -1354,7 +1481,8 @@ int pv_emulate_privileged_op(struct cpu_user_regs *regs)
 
     ctxt.ctxt.addr_size = ar & _SEGMENT_L ? 64 : ar & _SEGMENT_DB ? 32 : 16;
     /* Leave zero in ctxt.ctxt.sp_size, as it's not needed. */
-    rc = x86_emulate(&ctxt.ctxt, &priv_op_ops);
+    if ( !priv_op_fast_path(&ctxt, &rc) )
+        rc = x86_emulate(&ctxt.ctxt, &priv_op_ops);
 
     if ( ctxt.io_emul_stub )
         unmap_domain_page(ctxt.io_emul_stub);
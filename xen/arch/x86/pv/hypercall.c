@@ -23,6 +23,8 @@
 #include <xen/hypercall.h>
 #include <xen/trace.h>
 
+#include <asm/guest.h>
+
 #define HYPERCALL(x)                                                \
     [ __HYPERVISOR_ ## x ] = { (hypercall_fn_t *) do_ ## x,         \
                                (hypercall_fn_t *) do_ ## x }
@@ -91,6 +93,7 @@ void pv_hypercall(struct cpu_user_regs *regs)
 {
     struct vcpu *curr = current;
     unsigned long eax;
+    s_time_t start;
 
     ASSERT(guest_kernel_mode(curr, regs));
 
@@ -107,6 +110,7 @@ void pv_hypercall(struct cpu_user_regs *regs)
     }
 
     curr->hcall_preempted = false;
+    start = hypercall_stats_begin();
 
     if ( !is_pv_32bit_vcpu(curr) )
     {
@@ -129,7 +133,7 @@ void pv_hypercall(struct cpu_user_regs *regs)
         case 5: r9 = 0xdeadbeefdeadf00dUL;
         }
 #endif
-        if ( unlikely(tb_init_done) )
+        if ( tb_tracing() )
         {
             unsigned long args[6] = { rdi, rsi, rdx, r10, r8, r9 };
 
@@ -137,6 +141,7 @@ void pv_hypercall(struct cpu_user_regs *regs)
         }
 
         regs->rax = pv_hypercall_table[eax].native(rdi, rsi, rdx, r10, r8, r9);
+        hypercall_stats_end(eax, rdi, start);
 
 #ifndef NDEBUG
         if ( !curr->hcall_preempted )
@@ -176,7 +181,7 @@ void pv_hypercall(struct cpu_user_regs *regs)
         }
 #endif
 
-        if ( unlikely(tb_init_done) )
+        if ( tb_tracing() )
         {
             unsigned long args[6] = { ebx, ecx, edx, esi, edi, ebp };
 
@@ -186,6 +191,7 @@ void pv_hypercall(struct cpu_user_regs *regs)
         curr->hcall_compat = true;
         regs->eax = pv_hypercall_table[eax].compat(ebx, ecx, edx, esi, edi, ebp);
         curr->hcall_compat = false;
+        hypercall_stats_end(eax, ebx, start);
 
 #ifndef NDEBUG
         if ( !curr->hcall_preempted )
@@ -215,6 +221,35 @@ void pv_hypercall(struct cpu_user_regs *regs)
     perfc_incr(hypercalls);
 }
 
+/*
+ * TLB flushes put off by earlier sub-calls must be done before anything
+ * but a further page table update runs, e.g. one accessing guest memory.
+ * Event sends batched by the PV shim may wait for further event channel
+ * ops, which flush them as needed.
+ */
+static void multicall_flush_before(unsigned long op)
+{
+    switch ( op )
+    {
+    case __HYPERVISOR_mmu_update:
+    case __HYPERVISOR_update_va_mapping:
+    case __HYPERVISOR_mmuext_op:
+        break;
+
+    case __HYPERVISOR_event_channel_op:
+        if ( pv_shim )
+        {
+            multicall_flush_tlb();
+            break;
+        }
+        /* fall through */
+
+    default:
+        arch_multicall_flush();
+        break;
+    }
+}
+
 enum mc_disposition arch_do_multicall_call(struct mc_state *state)
 {
     struct vcpu *curr = current;
@@ -225,11 +260,18 @@ enum mc_disposition arch_do_multicall_call(struct mc_state *state)
         struct multicall_entry *call = &state->call;
 
         op = call->op;
+        multicall_flush_before(op);
         if ( (op < ARRAY_SIZE(pv_hypercall_table)) &&
              pv_hypercall_table[op].native )
+        {
+            unsigned long arg0 = call->args[0];
+            s_time_t start = hypercall_stats_begin();
+
             call->result = pv_hypercall_table[op].native(
                 call->args[0], call->args[1], call->args[2],
                 call->args[3], call->args[4], call->args[5]);
+            hypercall_stats_end(op, arg0, start);
+        }
         else
             call->result = -ENOSYS;
     }
@@ -239,11 +281,18 @@ enum mc_disposition arch_do_multicall_call(struct mc_state *state)
         struct compat_multicall_entry *call = &state->compat_call;
 
         op = call->op;
+        multicall_flush_before(op);
         if ( (op < ARRAY_SIZE(pv_hypercall_table)) &&
              pv_hypercall_table[op].compat )
+        {
+            unsigned int arg0 = call->args[0];
+            s_time_t start = hypercall_stats_begin();
+
             call->result = pv_hypercall_table[op].compat(
                 call->args[0], call->args[1], call->args[2],
                 call->args[3], call->args[4], call->args[5]);
+            hypercall_stats_end(op, arg0, start);
+        }
         else
             call->result = -ENOSYS;
     }
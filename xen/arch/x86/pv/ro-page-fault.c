@@ -20,9 +20,12 @@
  * along with this program; If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <xen/err.h>
+#include <xen/event.h>
 #include <xen/guest_access.h>
 #include <xen/rangeset.h>
 #include <xen/sched.h>
+#include <xen/softirq.h>
 #include <xen/trace.h>
 
 #include <asm/domain.h>
@@ -46,8 +49,16 @@
 struct ptwr_emulate_ctxt {
     unsigned long cr2;
     l1_pgentry_t  pte;
+    bool          batching; /* Emulating beyond the faulting instruction. */
 };
 
+/*
+ * Maximum number of instructions emulated per fault.  Guests commonly
+ * write runs of PTEs within one L1 table (e.g. when forking), and each
+ * further write would otherwise take its own fault and page lock.
+ */
+#define PTWR_MAX_BATCH 16
+
 static int ptwr_emulated_read(enum x86_segment seg, unsigned long offset,
                               void *p_data, unsigned int bytes,
                               struct x86_emulate_ctxt *ctxt)
@@ -82,6 +93,9 @@ static int ptwr_emulated_update(unsigned long addr, paddr_t old, paddr_t val,
     if ( unlikely(((addr ^ ptwr_ctxt->cr2) & PAGE_MASK) ||
                   (addr & (bytes - 1))) )
     {
+        /* Not an error if merely the end of a batch of PTE writes. */
+        if ( ptwr_ctxt->batching )
+            return X86EMUL_UNHANDLEABLE;
         gdprintk(XENLOG_WARNING, "bad access (cr2=%lx, addr=%lx, bytes=%u)\n",
                  ptwr_ctxt->cr2, addr, bytes);
         return X86EMUL_UNHANDLEABLE;
@@ -242,6 +256,40 @@ static const struct x86_emulate_ops ptwr_emulate_ops = {
     .cpuid      = pv_emul_cpuid,
 };
 
+/*
+ * Is the instruction at the current rIP a plain MOV of a whole, aligned PTE
+ * into the %cr2 page?  Anything else ends a batch, without being emulated.
+ */
+static bool ptwr_next_is_pte_store(struct x86_emulate_ctxt *ctxt,
+                                   unsigned long cr2)
+{
+    struct x86_emulate_state *state = x86_decode_insn(ctxt,
+                                                     ptwr_emulated_read);
+    enum x86_segment seg;
+    unsigned long ea;
+    unsigned int reg;
+    bool ok;
+
+    if ( IS_ERR_OR_NULL(state) )
+    {
+        if ( PTR_ERR(state) == -X86EMUL_EXCEPTION )
+            x86_emul_reset_event(ctxt);
+        return false;
+    }
+
+    ea = x86_insn_operand_ea(state, &seg);
+    ok = x86_insn_modrm(state, NULL, &reg) >= 0 &&
+         x86_insn_modrm(state, NULL, NULL) != 3 &&
+         (ctxt->opcode == 0x89 || (ctxt->opcode == 0xc7 && !reg)) &&
+         x86_insn_opsize(state) == sizeof(l1_pgentry_t) * 8 &&
+         seg != x86_seg_fs && seg != x86_seg_gs &&
+         !((ea ^ cr2) & PAGE_MASK) && !(ea & (sizeof(l1_pgentry_t) - 1));
+
+    x86_emulate_free_state(state);
+
+    return ok;
+}
+
 /* Write page fault handler: check if guest is trying to modify a PTE. */
 static int ptwr_do_page_fault(struct x86_emulate_ctxt *ctxt,
                               unsigned long addr, l1_pgentry_t pte)
@@ -251,6 +299,7 @@ static int ptwr_do_page_fault(struct x86_emulate_ctxt *ctxt,
         .pte = pte,
     };
     struct page_info *page;
+    unsigned int batch;
     int rc;
 
     page = get_page_from_mfn(l1e_get_mfn(pte), current->domain);
@@ -273,6 +322,37 @@ static int ptwr_do_page_fault(struct x86_emulate_ctxt *ctxt,
     ctxt->data = &ptwr_ctxt;
     rc = x86_emulate(ctxt, &ptwr_emulate_ops);
 
+    /*
+     * While still holding the page lock, carry on emulating for as long as
+     * the following instructions are PTE-sized MOVs into the same L1 table.
+     * The first one which isn't is left to be executed natively without
+     * having been emulated, as is one which fails for any reason, with no
+     * state change: it faults normally if need be.  Stop early if the guest needs to see an event or single-step
+     * trap, or if the table may no longer be mapped at the %cr2 page (the
+     * guest may, via a linear mapping, have rewritten that very PTE).
+     */
+    ptwr_ctxt.batching = true;
+    for ( batch = 1; rc == X86EMUL_OKAY && batch < PTWR_MAX_BATCH; batch++ )
+    {
+        int brc;
+
+        if ( ctxt->retire.singlestep || local_events_need_delivery() ||
+             softirq_pending(smp_processor_id()) ||
+             l1e_get_intpte(guest_get_eff_l1e(addr)) != l1e_get_intpte(pte) ||
+             !ptwr_next_is_pte_store(ctxt, addr) )
+            break;
+
+        brc = x86_emulate(ctxt, &ptwr_emulate_ops);
+        if ( brc != X86EMUL_OKAY )
+        {
+            if ( brc == X86EMUL_EXCEPTION )
+                x86_emul_reset_event(ctxt);
+            break;
+        }
+
+        perfc_incr(ptwr_batched_emulations);
+    }
+
     page_unlock(page);
     put_page(page);
 
@@ -148,6 +148,16 @@ static bool evtchn_handled(struct domain *d, unsigned int port)
     return evtchn_from_port(d, port)->state == ECS_VIRQ;
 }
 
+/*
+ * IPIs go from one vcpu of the guest to another, so the shim delivers them
+ * itself and L0 only keeps the port allocated for it.
+ */
+static bool evtchn_local(struct domain *d, unsigned int port)
+{
+    return port_is_valid(d, port) &&
+           evtchn_from_port(d, port)->state == ECS_IPI;
+}
+
 static void evtchn_assign_vcpu(struct domain *d, unsigned int port,
                                unsigned int vcpu)
 {
@@ -384,12 +394,73 @@ int pv_shim_shutdown(uint8_t reason)
     return 0;
 }
 
+/*
+ * Sends made by the sub-calls of a multicall go to L0 together, in one
+ * multicall of its own, once the guest's is done or moves on to anything
+ * other than another send.  The vCPU can't be descheduled in the meantime,
+ * so the batch is kept per pCPU.  The port was checked to be allocated, so
+ * L0 failing the send is not expected, and can't be reported anyway.
+ */
+#define SEND_BATCH 16
+
+struct send_batch {
+    unsigned int nr;
+    struct evtchn_send send[SEND_BATCH];
+    struct multicall_entry call[SEND_BATCH];
+};
+static DEFINE_PER_CPU(struct send_batch, send_batch);
+
+void pv_shim_flush_sends(void)
+{
+    struct send_batch *b = &this_cpu(send_batch);
+    unsigned int i;
+    long rc;
+
+    if ( !b->nr )
+        return;
+
+    for ( i = 0; i < b->nr; i++ )
+    {
+        b->call[i].op = __HYPERVISOR_event_channel_op;
+        b->call[i].args[0] = EVTCHNOP_send;
+        b->call[i].args[1] = (unsigned long)&b->send[i];
+    }
+
+    /* If the multicall itself failed, sending again is only spurious. */
+    rc = xen_hypercall_multicall(b->call, b->nr);
+    for ( i = 0; i < b->nr; i++ )
+    {
+        long res = rc ? xen_hypercall_evtchn_send(b->send[i].port)
+                      : (long)b->call[i].result;
+
+        if ( res )
+            gprintk(XENLOG_WARNING, "L0 failed send to port %u: %ld\n",
+                    b->send[i].port, res);
+    }
+
+    b->nr = 0;
+}
+
+static void queue_send(evtchn_port_t port)
+{
+    struct send_batch *b = &this_cpu(send_batch);
+
+    if ( b->nr == SEND_BATCH )
+        pv_shim_flush_sends();
+
+    b->send[b->nr++].port = port;
+}
+
 static long pv_shim_event_channel_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
 {
     struct domain *d = current->domain;
     struct evtchn_close close;
     long rc;
 
+    /* Anything but a send must come after the sends made before it. */
+    if ( cmd != EVTCHNOP_send )
+        pv_shim_flush_sends();
+
     switch ( cmd )
     {
 #define EVTCHN_FORWARD(cmd, port_field)                                     \
@@ -550,6 +621,7 @@ static long pv_shim_event_channel_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
 
         evtchn_assign_vcpu(d, ipi.port, ipi.vcpu);
         evtchn_reserve(d, ipi.port);
+        evtchn_from_port(d, ipi.port)->state = ECS_IPI;
         spin_unlock(&d->event_lock);
 
         if ( __copy_to_guest(arg, &ipi, 1) )
@@ -581,6 +653,22 @@ static long pv_shim_event_channel_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
             consoled_guest_rx();
             rc = 0;
         }
+        else if ( evtchn_local(d, send.port) )
+        {
+            struct evtchn *chn = evtchn_from_port(d, send.port);
+
+            spin_lock(&chn->lock);
+            evtchn_port_set_pending(d, chn->notify_vcpu_id, chn);
+            spin_unlock(&chn->lock);
+            rc = 0;
+        }
+        else if ( (current->mc_state.flags & MCSF_in_multicall) &&
+                  port_is_valid(d, send.port) &&
+                  evtchn_from_port(d, send.port)->state != ECS_FREE )
+        {
+            queue_send(send.port);
+            rc = 0;
+        }
         else
             rc = xen_hypercall_event_channel_op(EVTCHNOP_send, &send);
 
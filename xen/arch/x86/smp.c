@@ -8,6 +8,7 @@
  *	later.
  */
 
+#include <xen/cpu.h>
 #include <xen/irq.h>
 #include <xen/sched.h>
 #include <xen/delay.h>
@@ -197,21 +198,99 @@ void send_IPI_mask_phys(const cpumask_t *mask, int vector)
     local_irq_restore(flags);
 }
 
-static DEFINE_SPINLOCK(flush_lock);
-static cpumask_t flush_cpumask;
-static const void *flush_va;
-static unsigned int flush_flags;
+/*
+ * Remote flush requests are queued per target CPU.  A request finding
+ * another one still pending on a CPU gets merged into it, and only the
+ * requester which found nothing pending needs to send an IPI.  The target
+ * picks up everything queued so far as one batch, and requesters wait for
+ * the batch (rather than the whole IPI round) covering their request.
+ */
+struct flush_state {
+    spinlock_t lock;
+    unsigned int flags;
+    const void *va;
+    unsigned int started;   /* Batches picked up by the target CPU ... */
+    unsigned int done;      /* ... and those of them completed. */
+};
+
+static DEFINE_PER_CPU(struct flush_state, flush_state);
+static DEFINE_PER_CPU(cpumask_var_t, flush_ipi_mask);
+
+/* Widest area two pending requests get merged into, before going global. */
+#define FLUSH_MERGE_MAX_ORDER (2 * PAGETABLE_ORDER)
+
+#define FLUSH_AREA_OPS (FLUSH_TLB | FLUSH_TLB_GLOBAL | FLUSH_CACHE)
+
+static unsigned int flush_merge(unsigned int flags, const void **pva,
+                                unsigned int new, const void *new_va)
+{
+    unsigned int order, new_order;
+    unsigned long va = (unsigned long)*pva;
+
+    if ( !(flags & FLUSH_AREA_OPS) )
+    {
+        *pva = new_va;
+        return (flags & ~(FLUSH_ORDER_MASK | FLUSH_VA_VALID)) | new;
+    }
+
+    if ( !(new & FLUSH_AREA_OPS) )
+        return flags | (new & ~(FLUSH_ORDER_MASK | FLUSH_VA_VALID));
+
+    order = (flags - 1) & FLUSH_ORDER_MASK;
+    new_order = (new - 1) & FLUSH_ORDER_MASK;
+
+    /* Identical areas get merged as they are. */
+    if ( order == new_order && va == (unsigned long)new_va &&
+         ((flags ^ new) & FLUSH_VA_VALID) == 0 )
+        return flags | new;
+
+    flags = (flags | new) & ~(FLUSH_ORDER_MASK | FLUSH_VA_VALID);
+
+    /*
+     * Cache flushes can't be widened, as flush_area_local() may CLFLUSH the
+     * whole area, which needn't be mapped.  Fall back to flushing everything.
+     */
+    if ( flags & FLUSH_CACHE )
+        return flags;
+
+    /* Widen to the smallest naturally aligned area covering both. */
+    order = max(order, new_order);
+    while ( order <= FLUSH_MERGE_MAX_ORDER &&
+            (va >> (order + PAGE_SHIFT)) !=
+            ((unsigned long)new_va >> (order + PAGE_SHIFT)) )
+        ++order;
+
+    if ( order > FLUSH_MERGE_MAX_ORDER )
+        return flags;
+
+    *pva = (const void *)(va & ~((PAGE_SIZE << order) - 1));
+
+    return flags | FLUSH_ORDER(order);
+}
 
 void invalidate_interrupt(struct cpu_user_regs *regs)
 {
-    unsigned int flags = flush_flags;
+    struct flush_state *fs = &this_cpu(flush_state);
+    unsigned int flags, batch;
+    const void *va;
+
     ack_APIC_irq();
     perfc_incr(ipis);
+
+    spin_lock(&fs->lock);
+    flags = fs->flags;
+    va = fs->va;
+    fs->flags = 0;
+    batch = ++fs->started;
+    spin_unlock(&fs->lock);
+
     if ( (flags & FLUSH_VCPU_STATE) && __sync_local_execstate() )
         flags &= ~(FLUSH_TLB | FLUSH_TLB_GLOBAL);
     if ( flags & ~(FLUSH_VCPU_STATE | FLUSH_ORDER_MASK) )
-        flush_area_local(flush_va, flags);
-    cpumask_clear_cpu(smp_processor_id(), &flush_cpumask);
+        flush_area_local(va, flags);
+
+    smp_wmb();
+    write_atomic(&fs->done, batch);
 }
 
 void flush_area_mask(const cpumask_t *mask, const void *va, unsigned int flags)
@@ -227,18 +306,101 @@ void flush_area_mask(const cpumask_t *mask, const void *va, unsigned int flags)
     if ( (flags & ~FLUSH_ORDER_MASK) &&
          !cpumask_subset(mask, cpumask_of(cpu)) )
     {
-        spin_lock(&flush_lock);
-        cpumask_and(&flush_cpumask, mask, &cpu_online_map);
-        cpumask_clear_cpu(cpu, &flush_cpumask);
-        flush_va      = va;
-        flush_flags   = flags;
-        send_IPI_mask(&flush_cpumask, INVALIDATE_TLB_VECTOR);
-        while ( !cpumask_empty(&flush_cpumask) )
-            cpu_relax();
-        spin_unlock(&flush_lock);
+        cpumask_t *ipi_mask = this_cpu(flush_ipi_mask);
+        unsigned int target;
+
+        cpumask_clear(ipi_mask);
+
+        for_each_cpu ( target, mask )
+        {
+            struct flush_state *fs = &per_cpu(flush_state, target);
+            unsigned long irqfl;
+
+            if ( target == cpu || !cpu_online(target) )
+                continue;
+
+            perfc_incr(flush_remote_requests);
+            spin_lock_irqsave(&fs->lock, irqfl);
+            if ( !fs->flags )
+            {
+                fs->flags = flags;
+                fs->va = va;
+                __cpumask_set_cpu(target, ipi_mask);
+            }
+            else
+            {
+                fs->flags = flush_merge(fs->flags, &fs->va, flags, va);
+                perfc_incr(flush_remote_merged);
+            }
+            spin_unlock_irqrestore(&fs->lock, irqfl);
+        }
+
+        send_IPI_mask(ipi_mask, INVALIDATE_TLB_VECTOR);
+
+        for_each_cpu ( target, mask )
+        {
+            struct flush_state *fs = &per_cpu(flush_state, target);
+            unsigned long irqfl;
+            unsigned int ticket;
+
+            if ( target == cpu || !cpu_online(target) )
+                continue;
+
+            /*
+             * Our request is covered by the batch picked up next if anything
+             * is still pending, or else by the one picked up most recently.
+             */
+            spin_lock_irqsave(&fs->lock, irqfl);
+            ticket = fs->started + !!fs->flags;
+            spin_unlock_irqrestore(&fs->lock, irqfl);
+
+            while ( (int)(read_atomic(&fs->done) - ticket) < 0 )
+                cpu_relax();
+        }
+        smp_rmb();
     }
 }
 
+static int cpu_flush_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct flush_state *fs = &per_cpu(flush_state, cpu);
+    int rc = 0;
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        spin_lock_init(&fs->lock);
+        fs->flags = 0;
+        fs->started = fs->done = 0;
+        if ( !alloc_cpumask_var(&per_cpu(flush_ipi_mask, cpu)) )
+            rc = -ENOMEM;
+        break;
+    case CPU_UP_CANCELED:
+    case CPU_DEAD:
+        free_cpumask_var(per_cpu(flush_ipi_mask, cpu));
+        break;
+    }
+
+    return !rc ? NOTIFY_DONE : notifier_from_errno(rc);
+}
+
+static struct notifier_block cpu_flush_nfb = {
+    .notifier_call = cpu_flush_callback
+};
+
+static int __init flush_state_setup(void)
+{
+    void *cpu = (void *)(long)smp_processor_id();
+
+    cpu_flush_callback(&cpu_flush_nfb, CPU_UP_PREPARE, cpu);
+    register_cpu_notifier(&cpu_flush_nfb);
+
+    return 0;
+}
+presmp_initcall(flush_state_setup);
+
 /* Call with no locks held and interrupts enabled (e.g., softirq context). */
 void new_tlbflush_clock_period(void)
 {
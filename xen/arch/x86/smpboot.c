@@ -175,13 +175,17 @@ static void smp_callin(void)
     unsigned int cpu = smp_processor_id();
     int i, rc;
 
-    /* Wait 2s total for startup. */
+    /*
+     * Wait 2s total for startup.  Poll finely: we often get here while the
+     * boot CPU is still completing the STARTUP IPI sequence, and any slack
+     * here is paid once per AP, as APs are brought up one after the other.
+     */
     Dprintk("Waiting for CALLOUT.\n");
     for ( i = 0; cpu_state != CPU_STATE_CALLOUT; i++ )
     {
-        BUG_ON(i >= 200);
+        BUG_ON(i >= 200000);
         cpu_relax();
-        mdelay(10);
+        udelay(10);
     }
 
     /*
@@ -390,10 +394,23 @@ void start_secondary(void *unused)
 
 extern void *stack_start;
 
+/*
+ * The delays the MP specification asks for around INIT and STARTUP IPIs are
+ * only needed by CPUs older than P6 and K8, and at 10ms per AP they add up.
+ */
+static bool legacy_ipi_delays(void)
+{
+    return !((boot_cpu_data.x86_vendor == X86_VENDOR_INTEL &&
+              boot_cpu_data.x86 >= 6) ||
+             (boot_cpu_data.x86_vendor == X86_VENDOR_AMD &&
+              boot_cpu_data.x86 >= 0xf));
+}
+
 static int wakeup_secondary_cpu(int phys_apicid, unsigned long start_eip)
 {
     unsigned long send_status = 0, accept_status = 0;
     int maxlvt, timeout, i;
+    bool legacy = legacy_ipi_delays();
 
     /*
      * Be paranoid about clearing APIC errors.
@@ -419,7 +436,8 @@ static int wakeup_secondary_cpu(int phys_apicid, unsigned long start_eip)
             send_status = apic_read(APIC_ICR) & APIC_ICR_BUSY;
         } while ( send_status && (timeout++ < 1000) );
 
-        mdelay(10);
+        if ( legacy )
+            mdelay(10);
 
         Dprintk("Deasserting INIT.\n");
 
@@ -464,7 +482,7 @@ static int wakeup_secondary_cpu(int phys_apicid, unsigned long start_eip)
         if ( !x2apic_enabled )
         {
             /* Give the other CPU some time to accept the IPI. */
-            udelay(300);
+            udelay(legacy ? 300 : 10);
 
             Dprintk("Startup point 1.\n");
 
@@ -477,7 +495,7 @@ static int wakeup_secondary_cpu(int phys_apicid, unsigned long start_eip)
             } while ( send_status && (timeout++ < 1000) );
 
             /* Give the other CPU some time to accept the IPI. */
-            udelay(200);
+            udelay(legacy ? 200 : 10);
         }
 
         /* Due to the Pentium erratum 3AP. */
@@ -29,6 +29,7 @@
 #include <xen/cpu.h>
 #include <xsm/xsm.h>
 #include <asm/psr.h>
+#include <asm/pmuprof.h>
 #include <asm/cpuid.h>
 
 struct l3_cache_info {
@@ -53,7 +54,7 @@ long cpu_up_helper(void *data)
     if ( ret == -EBUSY )
     {
         /* On EBUSY, flush RCU work and have one more go. */
-        rcu_barrier();
+        rcu_barrier_expedited();
         ret = cpu_up(cpu);
     }
     return ret;
@@ -66,7 +67,7 @@ long cpu_down_helper(void *data)
     if ( ret == -EBUSY )
     {
         /* On EBUSY, flush RCU work and have one more go. */
-        rcu_barrier();
+        rcu_barrier_expedited();
         ret = cpu_down(cpu);
     }
     return ret;
@@ -295,6 +296,20 @@ long arch_do_sysctl(
         break;
     }
 
+    case XEN_SYSCTL_pmuprof_op:
+        ret = pmuprof_control(&sysctl->u.pmuprof_op);
+        if ( !ret && sysctl->u.pmuprof_op.cmd == XEN_SYSCTL_PMUPROF_read &&
+             __copy_to_guest(u_sysctl, sysctl, 1) )
+            ret = -EFAULT;
+        break;
+
+    case XEN_SYSCTL_hypercall_stats:
+        ret = hypercall_stats_control(&sysctl->u.hcstats_op);
+        if ( !ret && sysctl->u.hcstats_op.cmd == XEN_SYSCTL_HCSTATS_query &&
+             __copy_to_guest(u_sysctl, sysctl, 1) )
+            ret = -EFAULT;
+        break;
+
     default:
         ret = -ENOSYS;
         break;
@@ -9,6 +9,7 @@
  * Copyright (c) 1991, 1992, 1995  Linus Torvalds
  */
 
+#include <xen/cpu.h>
 #include <xen/errno.h>
 #include <xen/event.h>
 #include <xen/sched.h>
@@ -73,6 +74,42 @@ static DEFINE_PER_CPU(struct cpu_time, cpu_time);
 #define EPOCH MILLISECS(1000)
 static struct timer calibration_timer;
 
+/*
+ * time-calibration=local[:<drift>]: On hosts with invariant TSCs, have each
+ * CPU independently check its clock against the platform timer, instead of
+ * rendezvousing all CPUs.  The TSC scale (and hence what guests see) is only
+ * updated once the local clock has drifted by more than <drift> ns.
+ */
+static bool __initdata opt_local_calibration;
+static s_time_t __read_mostly local_calibration_drift = MICROSECS(1);
+static bool __read_mostly local_calibration;
+static DEFINE_PER_CPU(struct timer, local_calibration_timer);
+
+static int __init parse_time_calibration(const char *s)
+{
+    const char *ss;
+
+    if ( !strcmp(s, "rendezvous") )
+    {
+        opt_local_calibration = false;
+        return 0;
+    }
+
+    if ( strncmp(s, "local", 5) || (s[5] && s[5] != ':') )
+        return -EINVAL;
+
+    opt_local_calibration = true;
+    if ( s[5] == ':' )
+    {
+        local_calibration_drift = simple_strtoull(s + 6, &ss, 0);
+        if ( *ss )
+            return -EINVAL;
+    }
+
+    return 0;
+}
+custom_param("time-calibration", parse_time_calibration);
+
 /*
  * We simulate a 32-bit platform timer from the 16-bit PIT ch2 counter.
  * Otherwise overflow happens too quickly (~50ms) for us to guarantee that
@@ -1231,7 +1268,7 @@ static void local_time_calibration(void)
     /* The overall calibration scale multiplier. */
     u32 calibration_mul_frac;
 
-    if ( boot_cpu_has(X86_FEATURE_CONSTANT_TSC) )
+    if ( boot_cpu_has(X86_FEATURE_CONSTANT_TSC) && !local_calibration )
     {
         /* Atomically read cpu_calibration struct and write cpu_time struct. */
         local_irq_disable();
@@ -1257,6 +1294,15 @@ static void local_time_calibration(void)
            curr.master_stime - curr.local_stime);
 #endif
 
+    /*
+     * Without rendezvous, leave the current scale (and the guests' view of
+     * time) alone until it has drifted noticeably.  The next correction will
+     * then be based on the longer interval since the last one.
+     */
+    if ( local_calibration &&
+         ABS(curr.local_stime - curr.master_stime) <= local_calibration_drift )
+        goto out;
+
     /* Local time warps forward if it lags behind master time. */
     if ( curr.local_stime < curr.master_stime )
         curr.local_stime = curr.master_stime;
@@ -1338,9 +1384,13 @@ static void local_time_calibration(void)
     update_vcpu_system_time(current);
 
  out:
+    if ( local_calibration )
+        set_timer(&this_cpu(local_calibration_timer), NOW() + EPOCH);
+
     if ( smp_processor_id() == 0 )
     {
-        set_timer(&calibration_timer, NOW() + EPOCH);
+        if ( !local_calibration )
+            set_timer(&calibration_timer, NOW() + EPOCH);
         platform_time_calibration();
     }
 }
@@ -1564,6 +1614,10 @@ static void time_calibration(void *unused)
         .semaphore = ATOMIC_INIT(0)
     };
 
+    /* May still get armed by cpu_frequency_change(). */
+    if ( local_calibration )
+        return;
+
     if ( clocksource_is_tsc() )
     {
         local_irq_disable();
@@ -1579,6 +1633,89 @@ static void time_calibration(void *unused)
                      &r, 1);
 }
 
+/* Per-CPU calibration against the platform timer, without rendezvous. */
+static void local_calibration_timer_fn(void *data)
+{
+    struct cpu_time_stamp *c = &this_cpu(cpu_calibration);
+
+    /* Migrated away from a CPU going offline. */
+    if ( (unsigned long)data != smp_processor_id() )
+        return;
+
+    local_irq_disable();
+    c->master_stime = read_platform_stime(NULL);
+    c->local_tsc    = rdtsc_ordered();
+    c->local_stime  = get_s_time_fixed(c->local_tsc);
+    local_irq_enable();
+
+    raise_softirq(TIME_CALIBRATE_SOFTIRQ);
+}
+
+static int cpu_local_calibration_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct timer *timer = &per_cpu(local_calibration_timer, cpu);
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        init_timer(timer, local_calibration_timer_fn, hcpu, cpu);
+        break;
+    case CPU_ONLINE:
+        set_timer(timer, NOW() + EPOCH);
+        break;
+    case CPU_UP_CANCELED:
+    case CPU_DEAD:
+        kill_timer(timer);
+        break;
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cpu_local_calibration_nfb = {
+    .notifier_call = cpu_local_calibration_callback
+};
+
+static void __init local_calibration_init(void)
+{
+    unsigned int cpu;
+
+    if ( !opt_local_calibration )
+        return;
+
+    if ( !boot_cpu_has(X86_FEATURE_TSC_RELIABLE) ||
+         !boot_cpu_has(X86_FEATURE_CONSTANT_TSC) ||
+         !boot_cpu_has(X86_FEATURE_NONSTOP_TSC) )
+    {
+        printk(XENLOG_WARNING
+               "TSC not invariant, using rendezvous time calibration\n");
+        return;
+    }
+
+    kill_timer(&calibration_timer);
+
+    for_each_online_cpu ( cpu )
+        init_timer(&per_cpu(local_calibration_timer, cpu),
+                   local_calibration_timer_fn, (void *)(unsigned long)cpu, cpu);
+    register_cpu_notifier(&cpu_local_calibration_nfb);
+
+    /* Softirqs of a rendezvous still in progress may now arm the timers. */
+    local_calibration = true;
+    smp_wmb();
+
+    /* Spread the CPUs' platform timer accesses across the epoch. */
+    for_each_online_cpu ( cpu )
+        set_timer(&per_cpu(local_calibration_timer, cpu),
+                  NOW() + EPOCH + cpu * (EPOCH / nr_cpu_ids));
+
+    printk("Using rendezvous-free time calibration, max drift %"PRI_stime"ns\n",
+           local_calibration_drift);
+}
+
 static struct cpu_time_stamp ap_bringup_ref;
 
 void time_latch_stamps(void)
@@ -1752,6 +1889,8 @@ static int __init verify_tsc_reliability(void)
 
             printk("Switched to Platform timer %s TSC\n",
                    freq_string(plt_src.frequency));
+
+            local_calibration_init();
             return 0;
         }
     }
@@ -1772,6 +1911,8 @@ static int __init verify_tsc_reliability(void)
          !boot_cpu_has(X86_FEATURE_TSC_RELIABLE) )
         time_calibration_rendezvous_fn = time_calibration_tsc_rendezvous;
 
+    local_calibration_init();
+
     return 0;
 }
 __initcall(verify_tsc_reliability);
@@ -1897,6 +2038,8 @@ int time_suspend(void)
         cmos_utc_offset = -get_wallclock_time();
         cmos_utc_offset += get_sec();
         kill_timer(&calibration_timer);
+        if ( local_calibration )
+            stop_timer(&this_cpu(local_calibration_timer));
 
         /* Sync platform timer stamps. */
         platform_time_calibration();
@@ -1919,7 +2062,10 @@ int time_resume(void)
 
     init_percpu_time();
 
-    set_timer(&calibration_timer, NOW() + EPOCH);
+    if ( local_calibration )
+        set_timer(&this_cpu(local_calibration_timer), NOW() + EPOCH);
+    else
+        set_timer(&calibration_timer, NOW() + EPOCH);
 
     do_settime(get_wallclock_time() + cmos_utc_offset, 0, NOW());
 
@@ -1091,6 +1091,11 @@ void do_invalid_op(struct cpu_user_regs *regs)
 
 void do_int3(struct cpu_user_regs *regs)
 {
+#ifdef CONFIG_LIVEPATCH
+    if ( !guest_mode(regs) && arch_livepatch_int3(regs) )
+        return;
+#endif
+
     if ( debugger_trap_entry(TRAP_int3, regs) )
         return;
 
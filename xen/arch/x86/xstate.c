@@ -31,6 +31,14 @@ static unsigned int __read_mostly xstate_features;
 
 uint32_t __read_mostly mxcsr_mask = 0x0000ffbf;
 
+/*
+ * Whether vCPU state gets saved by XSAVES in compacted format, which only
+ * takes room for the components a vCPU has enabled.
+ */
+static bool __initdata opt_xsaves = true;
+boolean_param("xsaves", opt_xsaves);
+bool __read_mostly use_xsaves;
+
 /* Cached xcr0 for fast read */
 static DEFINE_PER_CPU(uint64_t, xcr0);
 
@@ -180,7 +188,19 @@ void expand_xsave_states(struct vcpu *v, void *dest, unsigned int size)
 
     if ( !(xsave->xsave_hdr.xcomp_bv & XSTATE_COMPACTION_ENABLED) )
     {
-        memcpy(dest, xsave, size);
+        /*
+         * A compacted format area not having been written by XSAVES yet
+         * holds at most legacy state, and may be smaller than @size.
+         */
+        if ( use_xsaves )
+        {
+            ASSERT(!(xstate_bv & ~XSTATE_FP_SSE));
+            memcpy(dest, xsave, XSTATE_AREA_MIN_SIZE);
+            memset(dest + XSTATE_AREA_MIN_SIZE, 0,
+                   size - XSTATE_AREA_MIN_SIZE);
+        }
+        else
+            memcpy(dest, xsave, size);
         return;
     }
 
@@ -243,7 +263,7 @@ void compress_xsave_states(struct vcpu *v, const void *src, unsigned int size)
 
     xstate_bv = ((const struct xsave_struct *)src)->xsave_hdr.xstate_bv;
 
-    if ( !(v->arch.xcr0_accum & XSTATE_XSAVES_ONLY) )
+    if ( !use_xsaves )
     {
         memcpy(xsave, src, size);
         return;
@@ -293,7 +313,7 @@ void xsave(struct vcpu *v, uint64_t mask)
     uint32_t lmask = mask;
     unsigned int fip_width = v->domain->arch.x87_fip_width;
 #define XSAVE(pfx) \
-        if ( v->arch.xcr0_accum & XSTATE_XSAVES_ONLY ) \
+        if ( use_xsaves ) \
             asm volatile ( ".byte " pfx "0x0f,0xc7,0x2f\n" /* xsaves */ \
                            : "=m" (*ptr) \
                            : "a" (lmask), "d" (hmask), "D" (ptr) ); \
@@ -406,7 +426,7 @@ void xrstor(struct vcpu *v, uint64_t mask)
                          [ptr] "D" (ptr) )
 
 #define XRSTOR(pfx) \
-        if ( v->arch.xcr0_accum & XSTATE_XSAVES_ONLY ) \
+        if ( use_xsaves ) \
         { \
             if ( unlikely(!(ptr->xsave_hdr.xcomp_bv & \
                             XSTATE_COMPACTION_ENABLED)) ) \
@@ -455,7 +475,7 @@ void xrstor(struct vcpu *v, uint64_t mask)
                   ((mask & XSTATE_YMM) &&
                    !(ptr->xsave_hdr.xcomp_bv & XSTATE_COMPACTION_ENABLED))) )
                 ptr->fpu_sse.mxcsr &= mxcsr_mask;
-            if ( v->arch.xcr0_accum & XSTATE_XSAVES_ONLY )
+            if ( use_xsaves )
             {
                 ptr->xsave_hdr.xcomp_bv &= this_cpu(xcr0) | this_cpu(xss);
                 ptr->xsave_hdr.xstate_bv &= ptr->xsave_hdr.xcomp_bv;
@@ -472,8 +492,8 @@ void xrstor(struct vcpu *v, uint64_t mask)
         case 2: /* Stage 2: Reset all state. */
             ptr->fpu_sse.mxcsr = MXCSR_DEFAULT;
             ptr->xsave_hdr.xstate_bv = 0;
-            ptr->xsave_hdr.xcomp_bv = v->arch.xcr0_accum & XSTATE_XSAVES_ONLY
-                                      ? XSTATE_COMPACTION_ENABLED : 0;
+            ptr->xsave_hdr.xcomp_bv = use_xsaves ? XSTATE_COMPACTION_ENABLED
+                                                 : 0;
             continue;
         }
 
@@ -493,6 +513,33 @@ bool xsave_enabled(const struct vcpu *v)
     return !!v->arch.xcr0_accum;
 }
 
+/*
+ * Size of a vCPU's save area for the given accumulated feature mask.
+ * Start out with room for legacy state only, the area gets grown by
+ * xstate_update_save_area() as the vCPU enables further components.
+ */
+static unsigned int xstate_area_size(uint64_t xcr0_accum)
+{
+    unsigned int i, size;
+
+    for ( size = XSTATE_AREA_MIN_SIZE, i = 2; i < xstate_features; ++i )
+    {
+        if ( !(xcr0_accum & (1ul << i)) )
+            continue;
+
+        if ( !use_xsaves )
+            size = max(size, xstate_offsets[i] + xstate_sizes[i]);
+        else
+        {
+            if ( test_bit(i, &xstate_align) )
+                size = ROUNDUP(size, 64);
+            size += xstate_sizes[i];
+        }
+    }
+
+    return size;
+}
+
 int xstate_alloc_save_area(struct vcpu *v)
 {
     struct xsave_struct *save_area;
@@ -501,11 +548,13 @@ int xstate_alloc_save_area(struct vcpu *v)
     if ( !cpu_has_xsave )
         return 0;
 
-    if ( !is_idle_vcpu(v) || !cpu_has_xsavec )
+    if ( !is_idle_vcpu(v) )
     {
-        size = xsave_cntxt_size;
+        size = xstate_area_size(0);
         BUG_ON(size < XSTATE_AREA_MIN_SIZE);
     }
+    else if ( !cpu_has_xsavec )
+        size = xsave_cntxt_size;
     else
     {
         /*
@@ -535,12 +584,47 @@ int xstate_alloc_save_area(struct vcpu *v)
     save_area->fpu_sse.mxcsr = MXCSR_DEFAULT;
 
     v->arch.xsave_area = save_area;
+    v->arch.xsave_size = size;
     v->arch.xcr0 = 0;
     v->arch.xcr0_accum = 0;
 
     return 0;
 }
 
+/*
+ * Make sure a vCPU's save area can hold the components in @xcr0_accum.  To
+ * be called before updating v->arch.xcr0_accum, with @v either paused or
+ * current.
+ */
+int xstate_update_save_area(struct vcpu *v, uint64_t xcr0_accum)
+{
+    struct xsave_struct *save_area;
+    unsigned int size;
+
+    ASSERT(!is_idle_vcpu(v));
+
+    if ( !v->arch.xsave_area )
+        return 0;
+
+    size = xstate_area_size(v->arch.xcr0_accum | xcr0_accum);
+    if ( size <= v->arch.xsave_size )
+        return 0;
+
+    save_area = _xzalloc(size, __alignof(*save_area));
+    if ( save_area == NULL )
+        return -ENOMEM;
+
+    /* Any compacted layout stays described by the copied header. */
+    memcpy(save_area, v->arch.xsave_area, v->arch.xsave_size);
+    xfree(v->arch.xsave_area);
+
+    v->arch.xsave_area = save_area;
+    v->arch.xsave_size = size;
+    v->arch.fpu_ctxt = &save_area->fpu_sse;
+
+    return 0;
+}
+
 void xstate_free_save_area(struct vcpu *v)
 {
     xfree(v->arch.xsave_area);
@@ -643,6 +727,13 @@ void xstate_init(struct cpuinfo_x86 *c)
 
     if ( setup_xstate_features(bsp) && bsp )
         BUG();
+
+    if ( bsp )
+    {
+        use_xsaves = opt_xsaves && cpu_has_xsaves;
+        if ( use_xsaves )
+            printk("xstate: using compacted format save areas\n");
+    }
 }
 
 static bool valid_xcr0(u64 xcr0)
@@ -706,6 +797,9 @@ int handle_xsetbv(u32 index, u64 new_bv)
     if ( is_pv_vcpu(curr) && (new_bv & XSTATE_PKRU) )
         return -EOPNOTSUPP;
 
+    if ( xstate_update_save_area(curr, new_bv) )
+        return -ENOMEM;
+
     if ( !set_xcr0(new_bv) )
         return -EFAULT;
 
@@ -14,6 +14,8 @@
 #include <xen/lib.h>
 #include <xen/init.h>
 #include <xen/cpumask.h>
+#include <xen/event.h>
+#include <xen/guest_access.h>
 #include <xen/percpu.h>
 #include <xen/sched.h>
 #include <xen/sched-if.h>
@@ -35,6 +37,8 @@ static cpumask_t cpupool_locked_cpus;
 static DEFINE_SPINLOCK(cpupool_lock);
 
 DEFINE_PER_CPU(struct cpupool *, cpupool);
+DEFINE_PER_CPU(unsigned int, cpupool_idle_latency);
+DEFINE_PER_CPU(unsigned int, cpupool_trust_group);
 
 #define cpupool_dprintk(x...) ((void)0)
 
@@ -257,6 +261,42 @@ int cpupool_move_domain(struct domain *d, struct cpupool *c)
     return ret;
 }
 
+static int cpupool_move_domain_by_id(domid_t domid, unsigned int poolid)
+{
+    struct cpupool *c;
+    struct domain *d;
+    int ret;
+
+    ret = rcu_lock_remote_domain_by_id(domid, &d);
+    if ( ret )
+        return ret;
+    if ( d->cpupool == NULL )
+    {
+        rcu_unlock_domain(d);
+        return -EINVAL;
+    }
+    if ( poolid == d->cpupool->cpupool_id )
+    {
+        rcu_unlock_domain(d);
+        return 0;
+    }
+    cpupool_dprintk("cpupool move_domain(dom=%d)->pool=%d\n",
+                    d->domain_id, poolid);
+    ret = -ENOENT;
+    spin_lock(&cpupool_lock);
+
+    c = cpupool_find_by_id(poolid);
+    if ( (c != NULL) && cpumask_weight(c->cpu_valid) )
+        ret = cpupool_move_domain_locked(d, c);
+
+    spin_unlock(&cpupool_lock);
+    cpupool_dprintk("cpupool move_domain(dom=%d)->pool=%d ret %d\n",
+                    d->domain_id, poolid, ret);
+    rcu_unlock_domain(d);
+
+    return ret;
+}
+
 /*
  * assign a specific cpu to a cpupool
  * cpupool_lock must be held
@@ -280,6 +320,8 @@ static int cpupool_assign_cpu_locked(struct cpupool *c, unsigned int cpu)
         cpupool_cpu_moving = NULL;
     }
     cpumask_set_cpu(cpu, c->cpu_valid);
+    per_cpu(cpupool_idle_latency, cpu) = c->idle_latency;
+    per_cpu(cpupool_trust_group, cpu) = c->trust_group;
 
     rcu_read_lock(&domlist_read_lock);
     for_each_domain_in_cpupool(d, c)
@@ -330,6 +372,8 @@ static long cpupool_unassign_cpu_helper(void *info)
             cpumask_clear_cpu(cpu, &cpupool_free_cpus);
         else
         {
+            per_cpu(cpupool_idle_latency, cpu) = 0;
+            per_cpu(cpupool_trust_group, cpu) = 0;
             cpupool_moving_cpu = -1;
             cpupool_put(cpupool_cpu_moving);
             cpupool_cpu_moving = NULL;
@@ -632,6 +676,7 @@ int cpupool_do_sysctl(struct xen_sysctl_cpupool_op *op)
         op->cpupool_id = c->cpupool_id;
         op->sched_id = c->sched->sched_id;
         op->n_dom = c->n_dom;
+        op->trust_group = c->trust_group;
         ret = cpumask_to_xenctl_bitmap(&op->cpumap, c->cpu_valid);
         cpupool_put(c);
     }
@@ -682,37 +727,29 @@ int cpupool_do_sysctl(struct xen_sysctl_cpupool_op *op)
     break;
 
     case XEN_SYSCTL_CPUPOOL_OP_MOVEDOMAIN:
+        ret = cpupool_move_domain_by_id(op->domid, op->cpupool_id);
+        break;
+
+    case XEN_SYSCTL_CPUPOOL_OP_MOVEDOMAINS:
     {
-        struct domain *d;
+        unsigned int done = 0;
+        uint32_t domid;
 
-        ret = rcu_lock_remote_domain_by_id(op->domid, &d);
-        if ( ret )
-            break;
-        if ( d->cpupool == NULL )
+        for ( ret = 0; op->n_dom < op->nr_domids; op->n_dom++ )
         {
-            ret = -EINVAL;
-            rcu_unlock_domain(d);
-            break;
-        }
-        if ( op->cpupool_id == d->cpupool->cpupool_id )
-        {
-            ret = 0;
-            rcu_unlock_domain(d);
-            break;
+            /* Each (re)start moves at least one domain. */
+            if ( done++ && hypercall_preempt_check() )
+            {
+                ret = -ERESTART;
+                break;
+            }
+            ret = -EFAULT;
+            if ( copy_from_guest_offset(&domid, op->domids, op->n_dom, 1) )
+                break;
+            ret = cpupool_move_domain_by_id(domid, op->cpupool_id);
+            if ( ret )
+                break;
         }
-        cpupool_dprintk("cpupool move_domain(dom=%d)->pool=%d\n",
-                        d->domain_id, op->cpupool_id);
-        ret = -ENOENT;
-        spin_lock(&cpupool_lock);
-
-        c = cpupool_find_by_id(op->cpupool_id);
-        if ( (c != NULL) && cpumask_weight(c->cpu_valid) )
-            ret = cpupool_move_domain_locked(d, c);
-
-        spin_unlock(&cpupool_lock);
-        cpupool_dprintk("cpupool move_domain(dom=%d)->pool=%d ret %d\n",
-                        d->domain_id, op->cpupool_id, ret);
-        rcu_unlock_domain(d);
     }
     break;
 
@@ -723,6 +760,28 @@ int cpupool_do_sysctl(struct xen_sysctl_cpupool_op *op)
     }
     break;
 
+    case XEN_SYSCTL_CPUPOOL_OP_SET_TRUST_GROUP:
+    {
+        unsigned int cpu;
+
+        ret = -EINVAL;
+        if ( op->trust_group >> 31 )
+            break;
+
+        spin_lock(&cpupool_lock);
+        c = cpupool_find_by_id(op->cpupool_id);
+        ret = -ENOENT;
+        if ( c != NULL )
+        {
+            c->trust_group = op->trust_group;
+            for_each_cpu ( cpu, c->cpu_valid )
+                per_cpu(cpupool_trust_group, cpu) = c->trust_group;
+            ret = 0;
+        }
+        spin_unlock(&cpupool_lock);
+    }
+    break;
+
     default:
         ret = -ENOSYS;
         break;
@@ -731,6 +790,42 @@ int cpupool_do_sysctl(struct xen_sysctl_cpupool_op *op)
     return ret;
 }
 
+int cpupool_get_idle_latency(int poolid, unsigned int *latency)
+{
+    struct cpupool *c = cpupool_get_by_id(poolid);
+
+    if ( c == NULL )
+        return -ENOENT;
+
+    *latency = c->idle_latency;
+    cpupool_put(c);
+
+    return 0;
+}
+
+int cpupool_set_idle_latency(int poolid, unsigned int latency)
+{
+    struct cpupool *c;
+    unsigned int cpu;
+
+    spin_lock(&cpupool_lock);
+
+    c = cpupool_find_by_id(poolid);
+    if ( c == NULL )
+    {
+        spin_unlock(&cpupool_lock);
+        return -ENOENT;
+    }
+
+    c->idle_latency = latency;
+    for_each_cpu ( cpu, c->cpu_valid )
+        per_cpu(cpupool_idle_latency, cpu) = latency;
+
+    spin_unlock(&cpupool_lock);
+
+    return 0;
+}
+
 static void print_cpumap(const char *str, const cpumask_t *map)
 {
     cpulist_scnprintf(keyhandler_scratch, sizeof(keyhandler_scratch), map);
@@ -1,13 +1,139 @@
 #include <xen/init.h>
 #include <xen/lib.h>
+#include <xen/lz4.h>
+#include <xen/smp.h>
 #include <xen/string.h>
 #include <xen/decompress.h>
+#include <xen/xmalloc.h>
+#include <asm/atomic.h>
+#include <asm/byteorder.h>
 
 static void __init error(const char *msg)
 {
     printk("%s\n", msg);
 }
 
+/*
+ * The legacy LZ4 format (as "lz4 -l" makes it, and Linux uses it) is a run
+ * of separately compressed chunks, each but the last inflating to 8MiB.
+ * Where each lands in the output is thus known up front, and the chunks
+ * can be shared out between all the CPUs there are by the time dom0 is
+ * built.
+ */
+#define LZ4_CHUNK_SIZE (8 << 20)
+#define LZ4_MAGIC 0x184C2102
+
+struct lz4_chunk {
+    const unsigned char *in;
+    size_t in_len;
+    unsigned char *out;
+    size_t out_len;
+};
+
+static struct {
+    struct lz4_chunk *chunk;
+    unsigned int nr;
+    atomic_t next, done;
+    bool failed;
+} lz4 __initdata;
+
+static uint32_t __init get_le32(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return le32_to_cpu(v);
+}
+
+static void __init lz4_worker(void *unused)
+{
+    unsigned int i;
+
+    while ( (i = atomic_inc_return(&lz4.next) - 1) < lz4.nr )
+    {
+        size_t len = lz4.chunk[i].in_len;
+
+        if ( lz4_decompress(lz4.chunk[i].in, &len, lz4.chunk[i].out,
+                            lz4.chunk[i].out_len) < 0 ||
+             len != lz4.chunk[i].in_len )
+            lz4.failed = true;
+        smp_wmb();
+        atomic_inc(&lz4.done);
+    }
+}
+
+static int __init unlz4_parallel(unsigned char *in, unsigned int len,
+                                 unsigned char *out)
+{
+    const unsigned char *p = in + 4, *end = in + len - 4;
+    size_t out_len = get_le32(end), chunk_len;
+    unsigned int max = out_len / LZ4_CHUNK_SIZE + 1;
+    cpumask_t others;
+    int rc = -1;
+
+    if ( get_le32(in) != LZ4_MAGIC )
+    {
+        error("invalid header");
+        return -1;
+    }
+
+    if ( max < 2 || num_online_cpus() < 2 )
+        return unlz4(in, len, NULL, NULL, out, NULL, error);
+
+    lz4.chunk = xmalloc_array(struct lz4_chunk, max);
+    if ( !lz4.chunk )
+        return unlz4(in, len, NULL, NULL, out, NULL, error);
+    lz4.nr = 0;
+
+    while ( p < end )
+    {
+        if ( end - p < 4 )
+            goto out;
+        chunk_len = get_le32(p);
+        p += 4;
+        if ( chunk_len == LZ4_MAGIC )
+            continue;
+        if ( chunk_len > end - p || !out_len || lz4.nr == max )
+            goto out;
+
+        lz4.chunk[lz4.nr].in = p;
+        lz4.chunk[lz4.nr].in_len = chunk_len;
+        lz4.chunk[lz4.nr].out = out;
+        lz4.chunk[lz4.nr].out_len = min_t(size_t, out_len, LZ4_CHUNK_SIZE);
+        out += lz4.chunk[lz4.nr].out_len;
+        out_len -= lz4.chunk[lz4.nr].out_len;
+        lz4.nr++;
+        p += chunk_len;
+    }
+
+    atomic_set(&lz4.next, 0);
+    atomic_set(&lz4.done, 0);
+    lz4.failed = false;
+
+    cpumask_andnot(&others, &cpu_online_map, cpumask_of(smp_processor_id()));
+    on_selected_cpus(&others, lz4_worker, NULL, 0);
+    lz4_worker(NULL);
+    while ( atomic_read(&lz4.done) != lz4.nr )
+        cpu_relax();
+    smp_rmb();
+
+    printk("LZ4: %u chunks over %u CPUs\n", lz4.nr,
+           min_t(unsigned int, lz4.nr, num_online_cpus()));
+
+    rc = lz4.failed;
+    if ( rc )
+        error("Decoding failed");
+
+ out:
+    if ( rc < 0 )
+        error("data corrupted");
+    xfree(lz4.chunk);
+    lz4.chunk = NULL;
+
+    return rc ? -1 : 0;
+}
+
 int __init decompress(void *inbuf, unsigned int len, void *outbuf)
 {
 #if 0 /* Not needed here yet. */
@@ -28,8 +154,8 @@ int __init decompress(void *inbuf, unsigned int len, void *outbuf)
     if ( len >= 5 && !memcmp(inbuf, "\x89LZO", 5) )
         return unlzo(inbuf, len, NULL, NULL, outbuf, NULL, error);
 
-    if ( len >= 2 && !memcmp(inbuf, "\x02\x21", 2) )
-	return unlz4(inbuf, len, NULL, NULL, outbuf, NULL, error);
+    if ( len >= 8 && !memcmp(inbuf, "\x02\x21", 2) )
+        return unlz4_parallel(inbuf, len, outbuf);
 
     return 1;
 }
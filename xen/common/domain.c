@@ -75,6 +75,20 @@ struct vcpu *idle_vcpu[NR_CPUS] __read_mostly;
 
 vcpu_info_t dummy_vcpu_info;
 
+/*
+ * Relinquish the resources of dying domains asynchronously: the destroy
+ * domctl returns as soon as the domain is dying (and hence unreachable),
+ * while its memory is handed back by a tasklet running on the NUMA node
+ * the domain lived on. VIRQ_DOM_EXC is raised once the domain is dead.
+ */
+static bool __read_mostly opt_async_destroy;
+boolean_param("async_destroy", opt_async_destroy);
+
+/* Protects relinquish_queue[] and domains' relinquish_list. */
+static DEFINE_SPINLOCK(relinquish_lock);
+static struct list_head relinquish_queue[MAX_NUMNODES];
+static struct tasklet relinquish_tasklet[MAX_NUMNODES];
+
 static void __domain_finalise_shutdown(struct domain *d)
 {
     struct vcpu *v;
@@ -290,8 +304,10 @@ struct domain *domain_create(domid_t domid, unsigned int domcr_flags,
     spin_lock_init_prof(d, domain_lock);
     spin_lock_init_prof(d, page_alloc_lock);
     spin_lock_init(&d->hypercall_deadlock_mutex);
+    spin_lock_init(&d->domctl_lock);
     INIT_PAGE_LIST_HEAD(&d->page_list);
     INIT_PAGE_LIST_HEAD(&d->xenpage_list);
+    INIT_LIST_HEAD(&d->relinquish_list);
 
     spin_lock_init(&d->node_affinity_lock);
     d->node_affinity = NODE_MASK_ALL;
@@ -552,6 +568,24 @@ struct domain *get_domain_by_id(domid_t dom)
 }
 
 
+struct domain *first_domain_from(domid_t dom)
+{
+    struct domain *d;
+
+    /* Continuing an enumeration usually starts from an existing domain. */
+    for ( d = rcu_dereference(domain_hash[DOMAIN_HASH(dom)]);
+          d != NULL;
+          d = rcu_dereference(d->next_in_hashbucket) )
+        if ( d->domain_id == dom )
+            return d;
+
+    for_each_domain ( d )
+        if ( d->domain_id >= dom )
+            break;
+
+    return d;
+}
+
 struct domain *rcu_lock_domain_by_id(domid_t dom)
 {
     struct domain *d = NULL;
@@ -610,10 +644,120 @@ int rcu_lock_live_remote_domain_by_id(domid_t dom, struct domain **d)
     return 0;
 }
 
+/* Caller must hold d->domain_lock. */
+static int domain_kill_finish(struct domain *d)
+{
+    struct vcpu *v;
+    int rc;
+
+    rc = domain_relinquish_resources(d);
+    if ( rc != 0 )
+        return rc;
+    if ( cpupool_move_domain(d, cpupool0) )
+        return -ERESTART;
+    for_each_vcpu ( d, v )
+        unmap_vcpu_info(v);
+    d->is_dying = DOMDYING_dead;
+    /* Mem event cleanup has to go here because the rings 
+     * have to be put before we call put_domain. */
+    vm_event_cleanup(d);
+    put_domain(d);
+    send_global_virq(VIRQ_DOM_EXC);
+
+    return 0;
+}
+
+static void domain_relinquish_work(unsigned long node)
+{
+    struct domain *d = NULL;
+    bool more = false;
+    int rc = 0;
+
+    spin_lock(&relinquish_lock);
+    if ( !list_empty(&relinquish_queue[node]) )
+        d = list_entry(relinquish_queue[node].next, struct domain,
+                       relinquish_list);
+    spin_unlock(&relinquish_lock);
+
+    if ( !d )
+        return;
+
+    domain_lock(d);
+    if ( d->is_dying == DOMDYING_dying )
+        rc = domain_kill_finish(d);
+    domain_unlock(d);
+
+    if ( rc != -ERESTART )
+    {
+        /*
+         * On failure the domain is left dying: another destroy domctl will
+         * queue it again.
+         */
+        if ( rc )
+            printk(XENLOG_G_ERR "d%d: failed to relinquish resources: %d\n",
+                   d->domain_id, rc);
+
+        spin_lock(&relinquish_lock);
+        list_del_init(&d->relinquish_list);
+        more = !list_empty(&relinquish_queue[node]);
+        spin_unlock(&relinquish_lock);
+
+        put_domain(d);
+    }
+
+    if ( rc == -ERESTART || more )
+        tasklet_schedule(&relinquish_tasklet[node]);
+}
+
+static void domain_queue_relinquish(struct domain *d)
+{
+    unsigned int node, cpu;
+
+    spin_lock(&relinquish_lock);
+
+    if ( !list_empty(&d->relinquish_list) )
+    {
+        spin_unlock(&relinquish_lock);
+        return;
+    }
+
+    /* Free memory from the node it (most likely) was allocated on. */
+    if ( nodes_weight(d->node_affinity) == 1 )
+        node = first_node(d->node_affinity);
+    else
+        node = domain_to_node(d);
+    if ( node >= MAX_NUMNODES || !node_online(node) )
+        node = cpu_to_node(smp_processor_id());
+
+    cpu = cpumask_any(&node_to_cpumask(node));
+    if ( cpu >= nr_cpu_ids || !cpu_online(cpu) )
+        cpu = smp_processor_id();
+
+    get_knownalive_domain(d);
+    list_add_tail(&d->relinquish_list, &relinquish_queue[node]);
+
+    spin_unlock(&relinquish_lock);
+
+    tasklet_schedule_on_cpu(&relinquish_tasklet[node], cpu);
+}
+
+static int __init domain_relinquish_init(void)
+{
+    unsigned int node;
+
+    for ( node = 0; node < MAX_NUMNODES; node++ )
+    {
+        INIT_LIST_HEAD(&relinquish_queue[node]);
+        tasklet_init(&relinquish_tasklet[node], domain_relinquish_work, node);
+    }
+
+    return 0;
+}
+__initcall(domain_relinquish_init);
+
 int domain_kill(struct domain *d)
 {
     int rc = 0;
-    struct vcpu *v;
 
     if ( d == current->domain )
         return -EINVAL;
@@ -641,20 +785,11 @@ int domain_kill(struct domain *d)
         d->tmem_client = NULL;
         /* fallthrough */
     case DOMDYING_dying:
-        rc = domain_relinquish_resources(d);
-        if ( rc != 0 )
-            break;
-        if ( cpupool_move_domain(d, cpupool0) )
-            return -ERESTART;
-        for_each_vcpu ( d, v )
-            unmap_vcpu_info(v);
-        d->is_dying = DOMDYING_dead;
-        /* Mem event cleanup has to go here because the rings 
-         * have to be put before we call put_domain. */
-        vm_event_cleanup(d);
-        put_domain(d);
-        send_global_virq(VIRQ_DOM_EXC);
-        /* fallthrough */
+        if ( opt_async_destroy )
+            domain_queue_relinquish(d);
+        else
+            rc = domain_kill_finish(d);
+        break;
     case DOMDYING_dead:
         break;
     }
@@ -849,6 +984,7 @@ static void complete_domain_destroy(struct rcu_head *head)
     xfree(d->vm_event_paging);
 #endif
     xfree(d->vm_event_monitor);
+    xfree(d->vm_event_monitor_groups);
 #ifdef CONFIG_HAS_MEM_SHARING
     xfree(d->vm_event_share);
 #endif
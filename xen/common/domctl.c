@@ -33,7 +33,12 @@
 #include <public/domctl.h>
 #include <xsm/xsm.h>
 
-static DEFINE_SPINLOCK(domctl_lock);
+/*
+ * Domctls acting on a single domain hold the global lock shared and that
+ * domain's domctl_lock; those with wider effects hold the global lock
+ * exclusively.
+ */
+static DEFINE_RWLOCK(domctl_lock);
 DEFINE_SPINLOCK(vcpu_alloc_lock);
 
 static int bitmap_to_xenctl_bitmap(struct xenctl_bitmap *xenctl_bitmap,
@@ -230,7 +235,7 @@ bool_t domctl_lock_acquire(void)
      * we could have one domain trying to pause another which is spinning
      * on domctl_lock -- results in deadlock.
      */
-    if ( spin_trylock(&domctl_lock) )
+    if ( write_trylock(&domctl_lock) )
         return 1;
 
     spin_unlock(&current->domain->hypercall_deadlock_mutex);
@@ -239,10 +244,74 @@ bool_t domctl_lock_acquire(void)
 
 void domctl_lock_release(void)
 {
-    spin_unlock(&domctl_lock);
+    write_unlock(&domctl_lock);
     spin_unlock(&current->domain->hypercall_deadlock_mutex);
 }
 
+/*
+ * Operations on the caller itself, or on domains which may themselves be
+ * pausing other domains from within domctls (or the like), remain fully
+ * serialised: two such domains pausing one another concurrently would each
+ * wait for the other's vCPU to get descheduled.  Pausing any other domain
+ * can't close such a cycle, and so neither needs the caller's
+ * hypercall_deadlock_mutex.
+ */
+static bool domctl_domain_needs_global(const struct domain *d)
+{
+    return d == current->domain || is_control_domain(d) || d->target;
+}
+
+/* As domctl_lock_acquire(), but only serialising against operations on @d. */
+bool domctl_lock_acquire_domain(struct domain *d)
+{
+    if ( domctl_domain_needs_global(d) )
+        return domctl_lock_acquire();
+
+    if ( !read_trylock(&domctl_lock) )
+        return false;
+
+    if ( spin_trylock(&d->domctl_lock) )
+        return true;
+
+    read_unlock(&domctl_lock);
+    return false;
+}
+
+void domctl_lock_release_domain(struct domain *d)
+{
+    if ( domctl_domain_needs_global(d) )
+    {
+        domctl_lock_release();
+        return;
+    }
+
+    spin_unlock(&d->domctl_lock);
+    read_unlock(&domctl_lock);
+}
+
+/*
+ * Whether a domctl needs to be serialised against all others, rather than
+ * just those on the same domain: those not acting on an existing domain,
+ * those updating global state not protected by locks of its own, and
+ * those changing what domctl_domain_needs_global() says about a domain.
+ */
+static bool domctl_is_global(const struct xen_domctl *op,
+                             const struct domain *d)
+{
+    if ( !d )
+        return true;
+
+    switch ( op->cmd )
+    {
+    case XEN_DOMCTL_set_target:
+    case XEN_DOMCTL_psr_cmt_op: /* RMID allocation. */
+    case XEN_DOMCTL_psr_alloc:
+        return true;
+    }
+
+    return false;
+}
+
 static inline
 int vcpuaffinity_params_invalid(const struct xen_domctl_vcpuaffinity *vcpuaff)
 {
@@ -253,6 +322,155 @@ int vcpuaffinity_params_invalid(const struct xen_domctl_vcpuaffinity *vcpuaff)
             guest_handle_is_null(vcpuaff->cpumap_soft.bitmap));
 }
 
+/*
+ * Set the hard and/or soft affinity of v, as per flags, from the guest's
+ * maps, putting the effective affinity back in them if write_back.
+ */
+static int vcpu_set_affinity_maps(struct vcpu *v, uint32_t flags,
+                                  struct xenctl_bitmap *cpumap_hard,
+                                  struct xenctl_bitmap *cpumap_soft,
+                                  bool write_back)
+{
+    cpumask_var_t new_affinity, old_affinity;
+    cpumask_t *online = cpupool_domain_cpumask(v->domain);
+    int ret = 0;
+
+    /*
+     * We want to be able to restore hard affinity if we are trying
+     * setting both and changing soft affinity (which happens later,
+     * when hard affinity has been succesfully chaged already) fails.
+     */
+    if ( !alloc_cpumask_var(&old_affinity) )
+        return -ENOMEM;
+
+    cpumask_copy(old_affinity, v->cpu_hard_affinity);
+
+    if ( !alloc_cpumask_var(&new_affinity) )
+    {
+        free_cpumask_var(old_affinity);
+        return -ENOMEM;
+    }
+
+    /* Undo a stuck SCHED_pin_override? */
+    if ( flags & XEN_VCPUAFFINITY_FORCE )
+        vcpu_pin_override(v, -1);
+
+    /*
+     * We both set a new affinity and report back to the caller what
+     * the scheduler will be effectively using.
+     */
+    if ( flags & XEN_VCPUAFFINITY_HARD )
+    {
+        ret = xenctl_bitmap_to_bitmap(cpumask_bits(new_affinity),
+                                      cpumap_hard, nr_cpu_ids);
+        if ( !ret )
+            ret = vcpu_set_hard_affinity(v, new_affinity);
+        if ( ret )
+            goto out;
+
+        /*
+         * For hard affinity, what we return is the intersection of
+         * cpupool's online mask and the new hard affinity.
+         */
+        if ( write_back )
+        {
+            cpumask_and(new_affinity, online, v->cpu_hard_affinity);
+            ret = cpumask_to_xenctl_bitmap(cpumap_hard, new_affinity);
+        }
+    }
+    if ( flags & XEN_VCPUAFFINITY_SOFT )
+    {
+        ret = xenctl_bitmap_to_bitmap(cpumask_bits(new_affinity),
+                                      cpumap_soft, nr_cpu_ids);
+        if ( !ret)
+            ret = vcpu_set_soft_affinity(v, new_affinity);
+        if ( ret )
+        {
+            /*
+             * Since we're returning error, the caller expects nothing
+             * happened, so we rollback the changes to hard affinity
+             * (if any).
+             */
+            if ( flags & XEN_VCPUAFFINITY_HARD )
+                vcpu_set_hard_affinity(v, old_affinity);
+            goto out;
+        }
+
+        /*
+         * For soft affinity, we return the intersection between the
+         * new soft affinity, the cpupool's online map and the (new)
+         * hard affinity.
+         */
+        if ( write_back )
+        {
+            cpumask_and(new_affinity, new_affinity, online);
+            cpumask_and(new_affinity, new_affinity, v->cpu_hard_affinity);
+            ret = cpumask_to_xenctl_bitmap(cpumap_soft, new_affinity);
+        }
+    }
+
+ out:
+    free_cpumask_var(new_affinity);
+    free_cpumask_var(old_affinity);
+
+    return ret;
+}
+
+static int vcpu_set_affinity_list(struct domain *d,
+                                  struct xen_domctl_vcpuaffinitylist *list)
+{
+    bool same = list->flags & XEN_VCPUAFFINITYLIST_SAME;
+    uint32_t flags = list->flags & ~XEN_VCPUAFFINITYLIST_SAME;
+    struct xenctl_bitmap hard = {
+        .bitmap = list->cpumap_hard,
+        .nr_bits = list->nr_cpumap_bytes * 8,
+    };
+    struct xenctl_bitmap soft = {
+        .bitmap = list->cpumap_soft,
+        .nr_bits = list->nr_cpumap_bytes * 8,
+    };
+    struct vcpu *v;
+    int ret;
+
+    if ( flags == 0 ||
+         (flags & ~(XEN_VCPUAFFINITY_HARD | XEN_VCPUAFFINITY_SOFT |
+                    XEN_VCPUAFFINITY_FORCE)) ||
+         list->nr_cpumap_bytes == 0 ||
+         list->nr_cpumap_bytes > (UINT_MAX / 8) ||
+         ((flags & XEN_VCPUAFFINITY_HARD) &&
+          guest_handle_is_null(list->cpumap_hard)) ||
+         ((flags & XEN_VCPUAFFINITY_SOFT) &&
+          guest_handle_is_null(list->cpumap_soft)) ||
+         list->vcpu >= d->max_vcpus ||
+         list->nr_vcpus > d->max_vcpus - list->vcpu )
+        return -EINVAL;
+
+    while ( list->nr_vcpus )
+    {
+        if ( (v = d->vcpu[list->vcpu]) == NULL )
+            return -ESRCH;
+
+        ret = vcpu_set_affinity_maps(v, flags, &hard, &soft, !same);
+        if ( ret )
+            return ret;
+
+        list->vcpu++;
+        list->nr_vcpus--;
+        if ( !same )
+        {
+            guest_handle_add_offset(hard.bitmap, list->nr_cpumap_bytes);
+            guest_handle_add_offset(soft.bitmap, list->nr_cpumap_bytes);
+            list->cpumap_hard = hard.bitmap;
+            list->cpumap_soft = soft.bitmap;
+        }
+
+        if ( list->nr_vcpus && hypercall_preempt_check() )
+            return -ERESTART;
+    }
+
+    return 0;
+}
+
 void vnuma_destroy(struct vnuma_info *vnuma)
 {
     if ( vnuma )
@@ -383,6 +601,7 @@ long do_domctl(XEN_GUEST_HANDLE_PARAM(xen_domctl_t) u_domctl)
     bool_t copyback = 0;
     struct xen_domctl curop, *op = &curop;
     struct domain *d;
+    bool global;
 
     if ( copy_from_guest(op, u_domctl, 1) )
         return -EFAULT;
@@ -411,7 +630,24 @@ long do_domctl(XEN_GUEST_HANDLE_PARAM(xen_domctl_t) u_domctl)
     if ( ret )
         goto domctl_out_unlock_domonly;
 
-    if ( !domctl_lock_acquire() )
+#ifdef CONFIG_X86
+    /*
+     * Ranged log-dirty operations only take the paging lock, a bitmap leaf
+     * at a time.  Keep them out from under the domctl lock, so that several
+     * toolstack threads can work on disjoint ranges of a domain at once.
+     */
+    if ( op->cmd == XEN_DOMCTL_shadow_op &&
+         (op->u.shadow_op.op == XEN_DOMCTL_SHADOW_OP_PEEK_RANGE ||
+          op->u.shadow_op.op == XEN_DOMCTL_SHADOW_OP_CLEAN_RANGE) )
+    {
+        ret = paging_domctl(d, &op->u.shadow_op, u_domctl, 0);
+        copyback = 1;
+        goto domctl_out_unlock_domonly;
+    }
+#endif
+
+    global = domctl_is_global(op, d);
+    if ( global ? !domctl_lock_acquire() : !domctl_lock_acquire_domain(d) )
     {
         if ( d )
             rcu_unlock_domain(d);
@@ -665,7 +901,7 @@ long do_domctl(XEN_GUEST_HANDLE_PARAM(xen_domctl_t) u_domctl)
         break;
 
     case XEN_DOMCTL_destroydomain:
-        domctl_lock_release();
+        domctl_lock_release_domain(d);
         domain_lock(d);
         ret = domain_kill(d);
         domain_unlock(d);
@@ -709,91 +945,9 @@ long do_domctl(XEN_GUEST_HANDLE_PARAM(xen_domctl_t) u_domctl)
             break;
 
         if ( op->cmd == XEN_DOMCTL_setvcpuaffinity )
-        {
-            cpumask_var_t new_affinity, old_affinity;
-            cpumask_t *online = cpupool_domain_cpumask(v->domain);
-
-            /*
-             * We want to be able to restore hard affinity if we are trying
-             * setting both and changing soft affinity (which happens later,
-             * when hard affinity has been succesfully chaged already) fails.
-             */
-            if ( !alloc_cpumask_var(&old_affinity) )
-            {
-                ret = -ENOMEM;
-                break;
-            }
-            cpumask_copy(old_affinity, v->cpu_hard_affinity);
-
-            if ( !alloc_cpumask_var(&new_affinity) )
-            {
-                free_cpumask_var(old_affinity);
-                ret = -ENOMEM;
-                break;
-            }
-
-            /* Undo a stuck SCHED_pin_override? */
-            if ( vcpuaff->flags & XEN_VCPUAFFINITY_FORCE )
-                vcpu_pin_override(v, -1);
-
-            ret = 0;
-
-            /*
-             * We both set a new affinity and report back to the caller what
-             * the scheduler will be effectively using.
-             */
-            if ( vcpuaff->flags & XEN_VCPUAFFINITY_HARD )
-            {
-                ret = xenctl_bitmap_to_bitmap(cpumask_bits(new_affinity),
-                                              &vcpuaff->cpumap_hard,
-                                              nr_cpu_ids);
-                if ( !ret )
-                    ret = vcpu_set_hard_affinity(v, new_affinity);
-                if ( ret )
-                    goto setvcpuaffinity_out;
-
-                /*
-                 * For hard affinity, what we return is the intersection of
-                 * cpupool's online mask and the new hard affinity.
-                 */
-                cpumask_and(new_affinity, online, v->cpu_hard_affinity);
-                ret = cpumask_to_xenctl_bitmap(&vcpuaff->cpumap_hard,
-                                               new_affinity);
-            }
-            if ( vcpuaff->flags & XEN_VCPUAFFINITY_SOFT )
-            {
-                ret = xenctl_bitmap_to_bitmap(cpumask_bits(new_affinity),
-                                              &vcpuaff->cpumap_soft,
-                                              nr_cpu_ids);
-                if ( !ret)
-                    ret = vcpu_set_soft_affinity(v, new_affinity);
-                if ( ret )
-                {
-                    /*
-                     * Since we're returning error, the caller expects nothing
-                     * happened, so we rollback the changes to hard affinity
-                     * (if any).
-                     */
-                    if ( vcpuaff->flags & XEN_VCPUAFFINITY_HARD )
-                        vcpu_set_hard_affinity(v, old_affinity);
-                    goto setvcpuaffinity_out;
-                }
-
-                /*
-                 * For soft affinity, we return the intersection between the
-                 * new soft affinity, the cpupool's online map and the (new)
-                 * hard affinity.
-                 */
-                cpumask_and(new_affinity, new_affinity, online);
-                cpumask_and(new_affinity, new_affinity, v->cpu_hard_affinity);
-                ret = cpumask_to_xenctl_bitmap(&vcpuaff->cpumap_soft,
-                                               new_affinity);
-            }
-
- setvcpuaffinity_out:
-            free_cpumask_var(new_affinity);
-            free_cpumask_var(old_affinity);
-        }
+            ret = vcpu_set_affinity_maps(v, vcpuaff->flags,
+                                         &vcpuaff->cpumap_hard,
+                                         &vcpuaff->cpumap_soft, true);
         else
         {
             if ( vcpuaff->flags & XEN_VCPUAFFINITY_HARD )
@@ -806,6 +960,14 @@ long do_domctl(XEN_GUEST_HANDLE_PARAM(xen_domctl_t) u_domctl)
         break;
     }
 
+    case XEN_DOMCTL_setvcpuaffinitylist:
+        ret = vcpu_set_affinity_list(d, &op->u.vcpuaffinitylist);
+        if ( ret == -ERESTART )
+            ret = hypercall_create_continuation(
+                __HYPERVISOR_domctl, "h", u_domctl);
+        copyback = 1;
+        break;
+
     case XEN_DOMCTL_scheduler_op:
         ret = sched_adjust(d, &op->u.scheduler_op);
         copyback = 1;
@@ -1163,7 +1325,10 @@ long do_domctl(XEN_GUEST_HANDLE_PARAM(xen_domctl_t) u_domctl)
         break;
     }
 
-    domctl_lock_release();
+    if ( global )
+        domctl_lock_release();
+    else
+        domctl_lock_release_domain(d);
 
  domctl_out_unlock_domonly:
     if ( d )
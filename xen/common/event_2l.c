@@ -13,10 +13,25 @@
 #include <xen/sched.h>
 #include <xen/event.h>
 
+static void evtchn_2l_notify(struct vcpu *v, struct evtchn *evtchn)
+{
+    struct domain *d = v->domain;
+    unsigned int port = evtchn->port;
+
+    if ( test_bit         (port, &shared_info(d, evtchn_pending)) &&
+         !test_bit        (port, &shared_info(d, evtchn_mask)) &&
+         !test_and_set_bit(port / BITS_PER_EVTCHN_WORD(d),
+                           &vcpu_info(v, evtchn_pending_sel)) )
+    {
+        vcpu_mark_events_pending(v);
+    }
+}
+
 static void evtchn_2l_set_pending(struct vcpu *v, struct evtchn *evtchn)
 {
     struct domain *d = v->domain;
     unsigned int port = evtchn->port;
+    bool was_pending;
 
     /*
      * The following bit operations must happen in strict order.
@@ -25,17 +40,20 @@ static void evtchn_2l_set_pending(struct vcpu *v, struct evtchn *evtchn)
      * others may require explicit memory barriers.
      */
 
-    if ( test_and_set_bit(port, &shared_info(d, evtchn_pending)) )
+    was_pending = test_and_set_bit(port, &shared_info(d, evtchn_pending));
+
+    /*
+     * On a moderated port, an already pending event may still be waiting
+     * for its notification, and this one may be the one to release it.
+     */
+    if ( was_pending && !evtchn->moderation )
         return;
 
-    if ( !test_bit        (port, &shared_info(d, evtchn_mask)) &&
-         !test_and_set_bit(port / BITS_PER_EVTCHN_WORD(d),
-                           &vcpu_info(v, evtchn_pending_sel)) )
-    {
-        vcpu_mark_events_pending(v);
-    }
+    if ( evtchn_moderate(evtchn) )
+        evtchn_2l_notify(v, evtchn);
 
-    evtchn_check_pollers(d, port);
+    if ( !was_pending )
+        evtchn_check_pollers(d, port);
 }
 
 static void evtchn_2l_clear_pending(struct domain *d, struct evtchn *evtchn)
@@ -89,6 +107,7 @@ static void evtchn_2l_print_state(struct domain *d,
 static const struct evtchn_port_ops evtchn_port_ops_2l =
 {
     .set_pending   = evtchn_2l_set_pending,
+    .notify        = evtchn_2l_notify,
     .clear_pending = evtchn_2l_clear_pending,
     .unmask        = evtchn_2l_unmask,
     .is_pending    = evtchn_2l_is_pending,
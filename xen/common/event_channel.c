@@ -29,6 +29,7 @@
 
 #include <public/xen.h>
 #include <public/event_channel.h>
+#include <public/sysctl.h>
 #include <xsm/xsm.h>
 
 #define ERROR_EXIT(_errno)                                          \
@@ -112,6 +113,104 @@ static bool virq_is_global(unsigned int virq)
 }
 
 
+/* Longest time a moderated port may hold back a notification. */
+#define EVTCHN_MODERATION_MAX_INTERVAL MILLISECS(10)
+
+struct evtchn_moderation {
+    spinlock_t lock;
+    struct timer timer;
+    struct domain *domain;
+    s_time_t interval;       /* 0 if moderation is off. */
+    unsigned int count;      /* 0 if there is no count threshold. */
+    unsigned int held;       /* Events held back since the last notification. */
+    s_time_t last;           /* Time of the last notification. */
+};
+
+bool evtchn_moderation_check(struct evtchn *evtchn)
+{
+    struct evtchn_moderation *m = evtchn->moderation;
+    unsigned long flags;
+    bool notify = true;
+    s_time_t now;
+
+    spin_lock_irqsave(&m->lock, flags);
+
+    if ( !m->interval )
+        goto out;
+
+    now = NOW();
+    m->held++;
+
+    if ( m->count ? m->held >= m->count : now - m->last >= m->interval )
+    {
+        m->held = 0;
+        m->last = now;
+        stop_timer(&m->timer);
+    }
+    else
+    {
+        notify = false;
+        /* Arm the timer for the first event held back. */
+        if ( m->held == 1 )
+            set_timer(&m->timer,
+                      (m->count ? now : m->last) + m->interval);
+    }
+
+ out:
+    spin_unlock_irqrestore(&m->lock, flags);
+
+    return notify;
+}
+
+/*
+ * Like evtchn_send(), this only holds the per-channel lock, which is enough:
+ * closing, rebinding or moving the port to another vCPU all happen with it
+ * held, and closing turns moderation off first, so a port which changed
+ * under our feet is seen as no longer moderated.
+ */
+static void evtchn_moderation_timer_fn(void *data)
+{
+    struct evtchn *evtchn = data;
+    struct evtchn_moderation *m = evtchn->moderation;
+    struct domain *d = m->domain;
+    unsigned long flags;
+    bool notify;
+
+    spin_lock(&evtchn->lock);
+
+    spin_lock_irqsave(&m->lock, flags);
+    notify = m->interval && m->held;
+    m->held = 0;
+    m->last = NOW();
+    spin_unlock_irqrestore(&m->lock, flags);
+
+    if ( notify )
+        d->evtchn_port_ops->notify(d->vcpu[evtchn->notify_vcpu_id], evtchn);
+
+    spin_unlock(&evtchn->lock);
+}
+
+/* Turn moderation off, returning whether any events were held back. */
+static bool evtchn_moderation_disable(struct evtchn *evtchn)
+{
+    struct evtchn_moderation *m = evtchn->moderation;
+    unsigned long flags;
+    bool held;
+
+    if ( !m )
+        return false;
+
+    spin_lock_irqsave(&m->lock, flags);
+    held = m->interval && m->held;
+    m->interval = 0;
+    m->count = 0;
+    m->held = 0;
+    stop_timer(&m->timer);
+    spin_unlock_irqrestore(&m->lock, flags);
+
+    return held;
+}
+
 static struct evtchn *alloc_evtchn_bucket(struct domain *d, unsigned int port)
 {
     struct evtchn *chn;
@@ -144,7 +243,14 @@ static void free_evtchn_bucket(struct domain *d, struct evtchn *bucket)
         return;
 
     for ( i = 0; i < EVTCHNS_PER_BUCKET; i++ )
+    {
+        if ( bucket[i].moderation )
+        {
+            kill_timer(&bucket[i].moderation->timer);
+            xfree(bucket[i].moderation);
+        }
         xsm_free_security_evtchn(bucket + i);
+    }
 
     xfree(bucket);
 }
@@ -208,6 +314,13 @@ void evtchn_free(struct domain *d, struct evtchn *chn)
 {
     /* Clear pending event to avoid unexpected behavior on re-bind. */
     evtchn_port_clear_pending(d, chn);
+    evtchn_moderation_disable(chn);
+
+    if ( chn->steerable )
+    {
+        chn->steerable = 0;
+        d->nr_steerable_evtchns--;
+    }
 
     /* Reset binding to vcpu0 when the channel is freed. */
     chn->state          = ECS_FREE;
@@ -1045,6 +1158,268 @@ static long evtchn_set_priority(const struct evtchn_set_priority *set_priority)
     return ret;
 }
 
+static long evtchn_set_moderation(const struct evtchn_set_moderation *set)
+{
+    struct domain *d = current->domain;
+    struct evtchn *chn;
+    struct evtchn_moderation *m;
+    unsigned long flags;
+    long ret = 0;
+
+    if ( set->interval_ns > EVTCHN_MODERATION_MAX_INTERVAL ||
+         (set->count && !set->interval_ns) )
+        return -EINVAL;
+
+    spin_lock(&d->event_lock);
+
+    if ( !port_is_valid(d, set->port) )
+    {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    chn = evtchn_from_port(d, set->port);
+    if ( chn->state == ECS_FREE || chn->state == ECS_RESERVED ||
+         consumer_is_xen(chn) )
+    {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if ( !set->interval_ns )
+    {
+        spin_lock(&chn->lock);
+        if ( evtchn_moderation_disable(chn) )
+            d->evtchn_port_ops->notify(d->vcpu[chn->notify_vcpu_id], chn);
+        spin_unlock(&chn->lock);
+        goto out;
+    }
+
+    m = chn->moderation;
+    if ( !m )
+    {
+        m = xzalloc(struct evtchn_moderation);
+        if ( !m )
+        {
+            ret = -ENOMEM;
+            goto out;
+        }
+        spin_lock_init(&m->lock);
+        m->domain = d;
+        init_timer(&m->timer, evtchn_moderation_timer_fn, chn,
+                   d->vcpu[chn->notify_vcpu_id]->processor);
+        smp_wmb();
+        chn->moderation = m;
+    }
+
+    spin_lock(&chn->lock);
+    spin_lock_irqsave(&m->lock, flags);
+    m->interval = set->interval_ns;
+    m->count = set->count;
+    spin_unlock_irqrestore(&m->lock, flags);
+    spin_unlock(&chn->lock);
+
+ out:
+    spin_unlock(&d->event_lock);
+
+    return ret;
+}
+
+/*
+ * Event channel steering: every opt_evtchn_steer_ms, per domain with
+ * steerable ports, move the busiest steerable port that fits the gap from
+ * the vCPU receiving most steerable notifications to the least loaded vCPU
+ * that is up and not (almost) continuously running.
+ */
+static unsigned int __read_mostly opt_evtchn_steer_ms;
+integer_param("evtchn_steer", opt_evtchn_steer_ms);
+
+/* Don't bother below this many notifications per period on a vCPU. */
+#define EVTCHN_STEER_MIN_LOAD 64
+
+static struct timer evtchn_steer_timer;
+
+static void evtchn_steer_domain(struct domain *d)
+{
+    s_time_t period = MILLISECS(opt_evtchn_steer_ms);
+    struct vcpu *v, *src = NULL, *dst = NULL;
+    struct evtchn *chn, *best = NULL;
+    unsigned int port, gap;
+
+    ASSERT(spin_is_locked(&d->event_lock));
+
+    for_each_vcpu ( d, v )
+        v->evtchn_steer_load = 0;
+
+    for ( port = 1; port_is_valid(d, port); port++ )
+    {
+        chn = evtchn_from_port(d, port);
+        if ( !chn->steerable || chn->state != ECS_INTERDOMAIN )
+            continue;
+
+        chn->steer_rate = chn->steer_count;
+        chn->steer_count = 0;
+        d->vcpu[chn->notify_vcpu_id]->evtchn_steer_load += chn->steer_rate;
+    }
+
+    for_each_vcpu ( d, v )
+    {
+        struct vcpu_runstate_info runstate;
+        bool busy;
+
+        vcpu_runstate_get(v, &runstate);
+        busy = runstate.time[RUNSTATE_running] - v->evtchn_steer_runtime >
+               period - period / 10;
+        v->evtchn_steer_runtime = runstate.time[RUNSTATE_running];
+
+        if ( !src || v->evtchn_steer_load > src->evtchn_steer_load )
+            src = v;
+        if ( !busy && !test_bit(_VPF_down, &v->pause_flags) &&
+             (!dst || v->evtchn_steer_load < dst->evtchn_steer_load) )
+            dst = v;
+    }
+
+    if ( !src || !dst || src == dst ||
+         src->evtchn_steer_load < EVTCHN_STEER_MIN_LOAD )
+        return;
+
+    gap = src->evtchn_steer_load - dst->evtchn_steer_load;
+    if ( gap <= src->evtchn_steer_load / 4 )
+        return;
+
+    /* Moving a port carrying less than the gap narrows the imbalance. */
+    for ( port = 1; port_is_valid(d, port); port++ )
+    {
+        chn = evtchn_from_port(d, port);
+        if ( chn->steerable && chn->state == ECS_INTERDOMAIN &&
+             chn->notify_vcpu_id == src->vcpu_id && chn->steer_rate < gap &&
+             (!best || chn->steer_rate > best->steer_rate) )
+            best = chn;
+    }
+
+    if ( best )
+        best->notify_vcpu_id = dst->vcpu_id;
+}
+
+static void evtchn_steer_timer_fn(void *unused)
+{
+    struct domain *d;
+
+    rcu_read_lock(&domlist_read_lock);
+
+    for_each_domain ( d )
+    {
+        /* Skip domains busy with event channel operations this time. */
+        if ( d->nr_steerable_evtchns && spin_trylock(&d->event_lock) )
+        {
+            evtchn_steer_domain(d);
+            spin_unlock(&d->event_lock);
+        }
+    }
+
+    rcu_read_unlock(&domlist_read_lock);
+
+    set_timer(&evtchn_steer_timer, NOW() + MILLISECS(opt_evtchn_steer_ms));
+}
+
+static int __init evtchn_steer_init(void)
+{
+    if ( !opt_evtchn_steer_ms )
+        return 0;
+
+    init_timer(&evtchn_steer_timer, evtchn_steer_timer_fn, NULL, 0);
+    set_timer(&evtchn_steer_timer, NOW() + MILLISECS(opt_evtchn_steer_ms));
+
+    return 0;
+}
+__initcall(evtchn_steer_init);
+
+static long evtchn_set_steerable(const struct evtchn_set_steerable *set)
+{
+    struct domain *d = current->domain;
+    struct evtchn *chn;
+    long ret = 0;
+
+    if ( !opt_evtchn_steer_ms )
+        return -EOPNOTSUPP;
+
+    spin_lock(&d->event_lock);
+
+    if ( !port_is_valid(d, set->port) )
+    {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    chn = evtchn_from_port(d, set->port);
+    if ( chn->state != ECS_INTERDOMAIN || consumer_is_xen(chn) )
+    {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if ( chn->steerable != !!set->steerable )
+    {
+        chn->steerable = !!set->steerable;
+        chn->steer_count = 0;
+        chn->steer_rate = 0;
+        if ( chn->steerable )
+            d->nr_steerable_evtchns++;
+        else
+            d->nr_steerable_evtchns--;
+    }
+
+ out:
+    spin_unlock(&d->event_lock);
+
+    return ret;
+}
+
+int evtchn_steering_info(struct xen_sysctl_evtchn_steering *op)
+{
+    struct domain *d;
+    unsigned int port, nr = 0;
+    int rc = 0;
+
+    d = rcu_lock_domain_by_id(op->domid);
+    if ( !d )
+        return -ESRCH;
+
+    op->period_ms = opt_evtchn_steer_ms;
+
+    spin_lock(&d->event_lock);
+
+    for ( port = 1; port_is_valid(d, port); port++ )
+    {
+        const struct evtchn *chn = evtchn_from_port(d, port);
+        struct xen_sysctl_evtchn_steer steer;
+
+        if ( !chn->steerable )
+            continue;
+
+        if ( nr < op->max_ports )
+        {
+            steer.port = port;
+            steer.vcpu = chn->notify_vcpu_id;
+            steer.rate = chn->steer_rate;
+            steer.pad = 0;
+            if ( copy_to_guest_offset(op->ports, nr, &steer, 1) )
+            {
+                rc = -EFAULT;
+                break;
+            }
+        }
+        nr++;
+    }
+
+    spin_unlock(&d->event_lock);
+    rcu_unlock_domain(d);
+
+    op->nr_ports = nr;
+
+    return rc;
+}
+
 long do_event_channel_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
 {
     long rc;
@@ -1188,6 +1563,22 @@ long do_event_channel_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
         break;
     }
 
+    case EVTCHNOP_set_moderation: {
+        struct evtchn_set_moderation set_moderation;
+        if ( copy_from_guest(&set_moderation, arg, 1) != 0 )
+            return -EFAULT;
+        rc = evtchn_set_moderation(&set_moderation);
+        break;
+    }
+
+    case EVTCHNOP_set_steerable: {
+        struct evtchn_set_steerable set_steerable;
+        if ( copy_from_guest(&set_steerable, arg, 1) != 0 )
+            return -EFAULT;
+        rc = evtchn_set_steerable(&set_steerable);
+        break;
+    }
+
     default:
         rc = -ENOSYS;
         break;
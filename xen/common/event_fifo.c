@@ -149,28 +149,12 @@ static bool_t evtchn_fifo_set_link(const struct domain *d, event_word_t *word,
     return 1;
 }
 
-static void evtchn_fifo_set_pending(struct vcpu *v, struct evtchn *evtchn)
+static void evtchn_fifo_link(struct vcpu *v, struct evtchn *evtchn,
+                             event_word_t *word)
 {
     struct domain *d = v->domain;
-    unsigned int port;
-    event_word_t *word;
+    unsigned int port = evtchn->port;
     unsigned long flags;
-    bool_t was_pending;
-
-    port = evtchn->port;
-    word = evtchn_fifo_word_from_port(d, port);
-
-    /*
-     * Event array page may not exist yet, save the pending state for
-     * when the page is added.
-     */
-    if ( unlikely(!word) )
-    {
-        evtchn->pending = 1;
-        return;
-    }
-
-    was_pending = test_and_set_bit(EVTCHN_FIFO_PENDING, word);
 
     /*
      * Link the event if it unmasked and not already linked.
@@ -191,7 +175,7 @@ static void evtchn_fifo_set_pending(struct vcpu *v, struct evtchn *evtchn)
         {
             printk(XENLOG_G_WARNING
                    "%pv has no FIFO event channel control block\n", v);
-            goto done;
+            return;
         }
 
         /*
@@ -203,12 +187,12 @@ static void evtchn_fifo_set_pending(struct vcpu *v, struct evtchn *evtchn)
 
         old_q = lock_old_queue(d, evtchn, &flags);
         if ( !old_q )
-            goto done;
+            return;
 
         if ( test_and_set_bit(EVTCHN_FIFO_LINKED, word) )
         {
             spin_unlock_irqrestore(&old_q->lock, flags);
-            goto done;
+            return;
         }
 
         /*
@@ -255,11 +239,45 @@ static void evtchn_fifo_set_pending(struct vcpu *v, struct evtchn *evtchn)
                                   &v->evtchn_fifo->control_block->ready) )
             vcpu_mark_events_pending(v);
     }
- done:
+}
+
+static void evtchn_fifo_set_pending(struct vcpu *v, struct evtchn *evtchn)
+{
+    struct domain *d = v->domain;
+    unsigned int port;
+    event_word_t *word;
+    bool_t was_pending;
+
+    port = evtchn->port;
+    word = evtchn_fifo_word_from_port(d, port);
+
+    /*
+     * Event array page may not exist yet, save the pending state for
+     * when the page is added.
+     */
+    if ( unlikely(!word) )
+    {
+        evtchn->pending = 1;
+        return;
+    }
+
+    was_pending = test_and_set_bit(EVTCHN_FIFO_PENDING, word);
+
+    if ( evtchn_moderate(evtchn) )
+        evtchn_fifo_link(v, evtchn, word);
+
     if ( !was_pending )
         evtchn_check_pollers(d, port);
 }
 
+static void evtchn_fifo_notify(struct vcpu *v, struct evtchn *evtchn)
+{
+    event_word_t *word = evtchn_fifo_word_from_port(v->domain, evtchn->port);
+
+    if ( word && test_bit(EVTCHN_FIFO_PENDING, word) )
+        evtchn_fifo_link(v, evtchn, word);
+}
+
 static void evtchn_fifo_clear_pending(struct domain *d, struct evtchn *evtchn)
 {
     event_word_t *word;
@@ -288,9 +306,9 @@ static void evtchn_fifo_unmask(struct domain *d, struct evtchn *evtchn)
 
     clear_bit(EVTCHN_FIFO_MASKED, word);
 
-    /* Relink if pending. */
+    /* Relink if pending, regardless of any moderation. */
     if ( test_bit(EVTCHN_FIFO_PENDING, word) )
-        evtchn_fifo_set_pending(v, evtchn);
+        evtchn_fifo_link(v, evtchn, word);
 }
 
 static bool evtchn_fifo_is_pending(const struct domain *d, evtchn_port_t port)
@@ -349,6 +367,7 @@ static const struct evtchn_port_ops evtchn_port_ops_fifo =
 {
     .init          = evtchn_fifo_init,
     .set_pending   = evtchn_fifo_set_pending,
+    .notify        = evtchn_fifo_notify,
     .clear_pending = evtchn_fifo_clear_pending,
     .unmask        = evtchn_fifo_unmask,
     .is_pending    = evtchn_fifo_is_pending,
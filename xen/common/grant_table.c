@@ -57,6 +57,12 @@ struct grant_table {
     /* Resource limits of the domain. */
     unsigned int          max_grant_frames;
     unsigned int          max_maptrack_frames;
+    /*
+     * Non-zero if the maptrack limit auto-scales: the baseline number of
+     * frames, grown with the number of other domains up to
+     * max_maptrack_frames.
+     */
+    unsigned int          maptrack_base_frames;
     /* Table size. Number of frames shared with guest */
     unsigned int          nr_grant_frames;
     /* Number of grant status frames shared with guest (for version 2) */
@@ -83,7 +89,7 @@ struct grant_table {
 };
 
 #ifndef DEFAULT_MAX_NR_GRANT_FRAMES /* to allow arch to override */
-/* Default maximum size of a grant table. [POLICY] */
+/* Default maximum size of a grant table. */
 #define DEFAULT_MAX_NR_GRANT_FRAMES   64
 #endif
 
@@ -97,6 +103,17 @@ static unsigned int __read_mostly max_maptrack_frames =
                                                DEFAULT_MAX_MAPTRACK_FRAMES;
 integer_runtime_param("gnttab_max_maptrack_frames", max_maptrack_frames);
 
+/*
+ * The hardware domain hosts the backends of all other domains, so its
+ * maptrack limit by default grows by this many frames per other domain,
+ * up to an overall cap.
+ */
+#define MAPTRACK_FRAMES_PER_DOMAIN  256
+#define MAX_AUTO_MAPTRACK_FRAMES    16384
+
+static bool __read_mostly opt_maptrack_autoscale = true;
+boolean_param("gnttab_maptrack_autoscale", opt_maptrack_autoscale);
+
 /*
  * Note that the three values below are effectively part of the ABI, even if
  * we don't need to make them a formal part of it: A guest suspended for
@@ -140,6 +157,26 @@ struct gnttab_unmap_common {
 /* Number of unmap operations that are done between each tlb flush */
 #define GNTTAB_UNMAP_BATCH_SIZE 32
 
+/* Number of map operations that share a domain lookup and IOMMU flush */
+#define GNTTAB_MAP_BATCH_SIZE 32
+
+/* State carried between the map operations of one batch */
+struct gnttab_map_batch {
+    /* Granting domain of the last op, RCU-locked until the batch ends. */
+    struct domain *rd;
+
+    /* Maptrack handles taken from the freelist in bulk, not yet used. */
+    unsigned int nr_handles;
+    grant_handle_t handles[GNTTAB_MAP_BATCH_SIZE];
+
+    /* Map operations of the batch not yet processed, including this one. */
+    unsigned int remaining;
+
+    /* Range of IOMMU mappings whose IOTLB flush has been deferred. */
+    unsigned long iommu_frame;
+    unsigned int iommu_count;
+    bool iommu_flush_all;
+};
 
 #define PIN_FAIL(_lbl, _rc, _f, _a...)          \
     do {                                        \
@@ -300,6 +337,42 @@ nr_active_grant_frames(struct grant_table *gt)
     return num_act_frames_from_sha_frames(nr_grant_frames(gt));
 }
 
+/*
+ * Active entry frames are allocated on the first use of an entry in them,
+ * rather than by gnttab_grow_table(), so that growing the table stays
+ * cheap however large max_grant_frames is.  A frame is published with a
+ * cmpxchg(), which orders its initialisation before it, by whoever gets
+ * there first, and is only freed with the table, so readers need no more
+ * than the read lock to look it up.
+ */
+static inline bool
+active_entry_present(const struct grant_table *t, grant_ref_t e)
+{
+    return ACCESS_ONCE(t->active[e / ACGNT_PER_PAGE]) != NULL;
+}
+
+static int
+active_entry_populate(struct grant_table *t, grant_ref_t e)
+{
+    struct active_grant_entry *act;
+    unsigned int i;
+
+    if ( likely(active_entry_present(t, e)) )
+        return 0;
+
+    if ( (act = alloc_xenheap_page()) == NULL )
+        return -ENOMEM;
+    clear_page(act);
+    for ( i = 0; i < ACGNT_PER_PAGE; i++ )
+        spin_lock_init(&act[i].lock);
+
+    if ( cmpxchg(&t->active[e / ACGNT_PER_PAGE], NULL, act) != NULL )
+        free_xenheap_page(act);
+
+    return 0;
+}
+
+/* The frame holding @e must be present, see active_entry_populate(). */
 static inline struct active_grant_entry *
 active_entry_acquire(struct grant_table *t, grant_ref_t e)
 {
@@ -405,54 +478,123 @@ double_gt_unlock(struct grant_table *lgt, struct grant_table *rgt)
 
 #define INVALID_MAPTRACK_HANDLE UINT_MAX
 
+/*
+ * Take up to nr entries off v's maptrack freelist, under a single
+ * acquisition of its lock.  Returns the number of handles obtained.
+ */
+static unsigned int
+_get_maptrack_handles(struct grant_table *t, struct vcpu *v,
+                      grant_handle_t *handles, unsigned int nr)
+{
+    unsigned int head, next, prev_head, got = 0;
+
+    spin_lock(&v->maptrack_freelist_lock);
+
+    while ( got < nr )
+    {
+        do {
+            /* No maptrack pages allocated for this VCPU yet? */
+            head = read_atomic(&v->maptrack_head);
+            if ( unlikely(head == MAPTRACK_TAIL) )
+                goto out;
+
+            /*
+             * Always keep one entry in the free list to make it easier to
+             * add free entries to the tail.
+             */
+            next = read_atomic(&maptrack_entry(t, head).ref);
+            if ( unlikely(next == MAPTRACK_TAIL) )
+                goto out;
+
+            prev_head = head;
+            head = cmpxchg(&v->maptrack_head, prev_head, next);
+        } while ( head != prev_head );
+
+        handles[got++] = head;
+    }
+
+ out:
+    spin_unlock(&v->maptrack_freelist_lock);
+
+    return got;
+}
+
 static inline grant_handle_t
 _get_maptrack_handle(struct grant_table *t, struct vcpu *v)
 {
-    unsigned int head, next, prev_head;
+    grant_handle_t handle;
+
+    if ( !_get_maptrack_handles(t, v, &handle, 1) )
+        return INVALID_MAPTRACK_HANDLE;
+
+    return handle;
+}
+
+/* Number of free maptrack entries taken from a victim VCPU at once */
+#define MAPTRACK_STEAL_BATCH 32
+
+/*
+ * Hand entries just stolen by v over to its own free list.  If v has no
+ * free list yet, the first of them becomes its tail sentinel.
+ */
+static void give_maptrack_handles(struct grant_table *t, struct vcpu *v,
+                                  const grant_handle_t *handles,
+                                  unsigned int nr)
+{
+    unsigned int i, prev_tail, cur_tail;
 
     spin_lock(&v->maptrack_freelist_lock);
 
-    do {
-        /* No maptrack pages allocated for this VCPU yet? */
-        head = read_atomic(&v->maptrack_head);
-        if ( unlikely(head == MAPTRACK_TAIL) )
-        {
-            spin_unlock(&v->maptrack_freelist_lock);
-            return INVALID_MAPTRACK_HANDLE;
-        }
+    if ( v->maptrack_tail == MAPTRACK_TAIL )
+    {
+        maptrack_entry(t, handles[0]).ref = MAPTRACK_TAIL;
+        v->maptrack_tail = handles[0];
+        if ( v->maptrack_head == MAPTRACK_TAIL )
+            write_atomic(&v->maptrack_head, handles[0]);
+        handles++;
+        nr--;
+    }
 
-        /*
-         * Always keep one entry in the free list to make it easier to
-         * add free entries to the tail.
-         */
-        next = read_atomic(&maptrack_entry(t, head).ref);
-        if ( unlikely(next == MAPTRACK_TAIL) )
-        {
-            spin_unlock(&v->maptrack_freelist_lock);
-            return INVALID_MAPTRACK_HANDLE;
-        }
+    if ( nr )
+    {
+        /* Chain the entries, then splice the chain onto the tail. */
+        for ( i = 0; i < nr - 1; i++ )
+            maptrack_entry(t, handles[i]).ref = handles[i + 1];
+        maptrack_entry(t, handles[nr - 1]).ref = MAPTRACK_TAIL;
 
-        prev_head = head;
-        head = cmpxchg(&v->maptrack_head, prev_head, next);
-    } while ( head != prev_head );
+        cur_tail = read_atomic(&v->maptrack_tail);
+        do {
+            prev_tail = cur_tail;
+            cur_tail = cmpxchg(&v->maptrack_tail, prev_tail,
+                               handles[nr - 1]);
+        } while ( cur_tail != prev_tail );
 
-    spin_unlock(&v->maptrack_freelist_lock);
+        write_atomic(&maptrack_entry(t, prev_tail).ref, handles[0]);
+    }
 
-    return head;
+    spin_unlock(&v->maptrack_freelist_lock);
 }
 
 /*
- * Try to "steal" a free maptrack entry from another VCPU.
+ * Try to "steal" free maptrack entries from another VCPU.
  *
- * A stolen entry is transferred to the thief, so the number of
- * entries for each VCPU should tend to the usage pattern.
+ * Stolen entries are transferred to the thief, so the number of
+ * entries for each VCPU should tend to the usage pattern.  Up to
+ * MAPTRACK_STEAL_BATCH entries are taken from the victim in one go, so
+ * that a VCPU which ran dry doesn't have to come back for every
+ * subsequent mapping.
  *
  * To avoid having to atomically count the number of free entries on
  * each VCPU and to avoid two VCPU repeatedly stealing entries from
  * each other, the initial victim VCPU is selected randomly.
+ *
+ * A thief without a free list of its own keeps one of the stolen entries
+ * as its tail sentinel, as get_maptrack_handle() does for a new frame, so
+ * that put_maptrack_handle() always has a tail entry to link to.  If only
+ * one could be taken, it becomes the sentinel and the search goes on.
  */
 static grant_handle_t steal_maptrack_handle(struct grant_table *t,
-                                            const struct vcpu *curr)
+                                            struct vcpu *curr)
 {
     const struct domain *currd = curr->domain;
     unsigned int first, i;
@@ -463,13 +605,21 @@ static grant_handle_t steal_maptrack_handle(struct grant_table *t,
     do {
         if ( currd->vcpu[i] )
         {
-            grant_handle_t handle;
+            grant_handle_t handles[MAPTRACK_STEAL_BATCH];
+            unsigned int j, nr;
+
+            nr = _get_maptrack_handles(t, currd->vcpu[i], handles,
+                                       ARRAY_SIZE(handles));
+            for ( j = 0; j < nr; j++ )
+                maptrack_entry(t, handles[j]).vcpu = curr->vcpu_id;
 
-            handle = _get_maptrack_handle(t, currd->vcpu[i]);
-            if ( handle != INVALID_MAPTRACK_HANDLE )
+            if ( nr == 1 && curr->maptrack_tail == MAPTRACK_TAIL )
+                give_maptrack_handles(t, curr, handles, 1);
+            else if ( nr )
             {
-                maptrack_entry(t, handle).vcpu = curr->vcpu_id;
-                return handle;
+                if ( nr > 1 )
+                    give_maptrack_handles(t, curr, handles, nr - 1);
+                return handles[nr - 1];
             }
         }
 
@@ -510,6 +660,32 @@ put_maptrack_handle(
     spin_unlock(&v->maptrack_freelist_lock);
 }
 
+/*
+ * Current limit on the number of maptrack frames.  For an auto-scaling
+ * table (see MAPTRACK_FRAMES_PER_DOMAIN) the other domains only get
+ * counted once the baseline has been used up.
+ */
+static unsigned int maptrack_frames_limit(struct grant_table *gt)
+{
+    const struct domain *d;
+    unsigned int nr = 0;
+
+    if ( !gt->maptrack_base_frames )
+        return gt->max_maptrack_frames;
+
+    if ( nr_maptrack_frames(gt) < gt->maptrack_base_frames )
+        return gt->maptrack_base_frames;
+
+    rcu_read_lock(&domlist_read_lock);
+    for_each_domain ( d )
+        if ( d != gt->domain && !d->is_dying )
+            nr++;
+    rcu_read_unlock(&domlist_read_lock);
+
+    return min(gt->maptrack_base_frames + nr * MAPTRACK_FRAMES_PER_DOMAIN,
+               gt->max_maptrack_frames);
+}
+
 static inline grant_handle_t
 get_maptrack_handle(
     struct grant_table *lgt)
@@ -528,32 +704,15 @@ get_maptrack_handle(
     /*
      * If we've run out of handles and still have frame headroom, try
      * allocating a new maptrack frame.  If there is no headroom, or we're
-     * out of memory, try stealing an entry from another VCPU (in case the
+     * out of memory, try stealing entries from another VCPU (in case the
      * guest isn't mapping across its VCPUs evenly).
      */
-    if ( nr_maptrack_frames(lgt) < lgt->max_maptrack_frames )
+    if ( nr_maptrack_frames(lgt) < maptrack_frames_limit(lgt) )
         new_mt = alloc_xenheap_page();
 
     if ( !new_mt )
     {
         spin_unlock(&lgt->maptrack_lock);
-
-        /*
-         * Uninitialized free list? Steal an extra entry for the tail
-         * sentinel.
-         */
-        if ( curr->maptrack_tail == MAPTRACK_TAIL )
-        {
-            handle = steal_maptrack_handle(lgt, curr);
-            if ( handle == INVALID_MAPTRACK_HANDLE )
-                return handle;
-            spin_lock(&curr->maptrack_freelist_lock);
-            maptrack_entry(lgt, handle).ref = MAPTRACK_TAIL;
-            curr->maptrack_tail = handle;
-            if ( curr->maptrack_head == MAPTRACK_TAIL )
-                write_atomic(&curr->maptrack_head, handle);
-            spin_unlock(&curr->maptrack_freelist_lock);
-        }
         return steal_maptrack_handle(lgt, curr);
     }
 
@@ -805,8 +964,12 @@ static struct active_grant_entry *grant_map_exists(const struct domain *ld,
                    nr_grant_entries(rgt));
     for ( ref = *cur_ref; ref < max_iter; ref++ )
     {
-        struct active_grant_entry *act = active_entry_acquire(rgt, ref);
+        struct active_grant_entry *act;
+
+        if ( !active_entry_present(rgt, ref) )
+            continue;
 
+        act = active_entry_acquire(rgt, ref);
         if ( act->pin && act->domid == ld->domain_id && act->frame == mfn )
             return act;
         active_entry_release(act);
@@ -857,6 +1020,109 @@ static unsigned int mapkind(
     return kind;
 }
 
+/*
+ * Look up the granting domain of a map operation.  Consecutive operations
+ * against the same domain share a single RCU reference, which is dropped
+ * by map_batch_finish().
+ */
+static struct domain *map_batch_get_domain(struct gnttab_map_batch *batch,
+                                           domid_t domid)
+{
+    if ( batch->rd )
+    {
+        if ( batch->rd->domain_id == domid )
+            return batch->rd;
+        rcu_unlock_domain(batch->rd);
+    }
+
+    batch->rd = rcu_lock_domain_by_id(domid);
+
+    return batch->rd;
+}
+
+static grant_handle_t map_batch_get_handle(struct gnttab_map_batch *batch,
+                                           struct grant_table *lgt)
+{
+    /*
+     * Refill from the local freelist for the rest of the batch in one go,
+     * falling back to the slow path (new maptrack frame, or stealing) when
+     * it has run dry.
+     */
+    if ( !batch->nr_handles && batch->remaining > 1 )
+        batch->nr_handles = _get_maptrack_handles(lgt, current,
+                                                  batch->handles,
+                                                  batch->remaining);
+
+    if ( batch->nr_handles )
+        return batch->handles[--batch->nr_handles];
+
+    return get_maptrack_handle(lgt);
+}
+
+static void map_batch_put_handle(struct gnttab_map_batch *batch,
+                                 grant_handle_t handle)
+{
+    ASSERT(batch->nr_handles < ARRAY_SIZE(batch->handles));
+    batch->handles[batch->nr_handles++] = handle;
+}
+
+/*
+ * Establish a 1:1 IOMMU mapping of frame, leaving the IOTLB flush to
+ * map_batch_finish().
+ */
+static int map_batch_iommu_map(struct gnttab_map_batch *batch,
+                               struct domain *ld, unsigned long frame,
+                               unsigned int flags)
+{
+    int err;
+
+    this_cpu(iommu_dont_flush_iotlb) = 1;
+    err = iommu_map_page(ld, frame, frame, flags);
+    this_cpu(iommu_dont_flush_iotlb) = 0;
+
+    if ( err )
+        return err;
+
+    if ( !batch->iommu_count )
+        batch->iommu_frame = frame;
+    else if ( frame + 1 == batch->iommu_frame )
+        batch->iommu_frame = frame;
+    else if ( frame != batch->iommu_frame + batch->iommu_count )
+        batch->iommu_flush_all = true;
+    batch->iommu_count++;
+
+    return 0;
+}
+
+static int map_batch_finish(struct gnttab_map_batch *batch)
+{
+    struct domain *ld = current->domain;
+    int rc = 0;
+
+    if ( batch->iommu_count )
+    {
+        if ( batch->iommu_flush_all )
+            rc = iommu_iotlb_flush_all(ld);
+        else
+            rc = iommu_iotlb_flush(ld, batch->iommu_frame,
+                                   batch->iommu_count);
+        batch->iommu_count = 0;
+        batch->iommu_flush_all = false;
+    }
+
+    while ( batch->nr_handles )
+        put_maptrack_handle(ld->grant_table,
+                            batch->handles[--batch->nr_handles]);
+
+    if ( batch->rd )
+    {
+        rcu_unlock_domain(batch->rd);
+        batch->rd = NULL;
+    }
+
+    return rc;
+}
+
 /*
  * Returns 0 if TLB flush / invalidate required by caller.
  * va will indicate the address to be invalidated.
@@ -866,7 +1132,7 @@ static unsigned int mapkind(
  */
 static void
 map_grant_ref(
-    struct gnttab_map_grant_ref *op)
+    struct gnttab_map_grant_ref *op, struct gnttab_map_batch *batch)
 {
     struct domain *ld, *rd, *owner = NULL;
     struct grant_table *lgt, *rgt;
@@ -904,7 +1170,7 @@ map_grant_ref(
         return;
     }
 
-    if ( unlikely((rd = rcu_lock_domain_by_id(op->dom)) == NULL) )
+    if ( unlikely((rd = map_batch_get_domain(batch, op->dom)) == NULL) )
     {
         gdprintk(XENLOG_INFO, "Could not find domain %d\n", op->dom);
         op->status = GNTST_bad_domain;
@@ -914,16 +1180,14 @@ map_grant_ref(
     rc = xsm_grant_mapref(XSM_HOOK, ld, rd, op->flags);
     if ( rc )
     {
-        rcu_unlock_domain(rd);
         op->status = GNTST_permission_denied;
         return;
     }
 
     lgt = ld->grant_table;
-    handle = get_maptrack_handle(lgt);
+    handle = map_batch_get_handle(batch, lgt);
     if ( unlikely(handle == INVALID_MAPTRACK_HANDLE) )
     {
-        rcu_unlock_domain(rd);
         gdprintk(XENLOG_INFO, "Failed to obtain maptrack handle\n");
         op->status = GNTST_no_device_space;
         return;
@@ -937,6 +1201,11 @@ map_grant_ref(
         PIN_FAIL(unlock_out, GNTST_bad_gntref, "Bad ref %#x for d%d\n",
                  op->ref, rgt->domain->domain_id);
 
+    if ( unlikely(active_entry_populate(rgt, op->ref)) )
+        PIN_FAIL(unlock_out, GNTST_general_error,
+                 "No memory for active entry %#x of d%d\n",
+                 op->ref, rgt->domain->domain_id);
+
     act = active_entry_acquire(rgt, op->ref);
     shah = shared_entry_header(rgt, op->ref);
     status = rgt->gt_version == 1 ? &shah->flags : &status_entry(rgt, op->ref);
@@ -1108,13 +1377,13 @@ map_grant_ref(
              !(old_pin & (GNTPIN_hstw_mask|GNTPIN_devw_mask)) )
         {
             if ( !(kind & MAPKIND_WRITE) )
-                err = iommu_map_page(ld, frame, frame,
-                                     IOMMUF_readable|IOMMUF_writable);
+                err = map_batch_iommu_map(batch, ld, frame,
+                                          IOMMUF_readable|IOMMUF_writable);
         }
         else if ( act_pin && !old_pin )
         {
             if ( !kind )
-                err = iommu_map_page(ld, frame, frame, IOMMUF_readable);
+                err = map_batch_iommu_map(batch, ld, frame, IOMMUF_readable);
         }
         if ( err )
         {
@@ -1147,7 +1416,6 @@ map_grant_ref(
     op->handle       = handle;
     op->status       = GNTST_okay;
 
-    rcu_unlock_domain(rd);
     return;
 
  undo_out:
@@ -1188,29 +1456,60 @@ map_grant_ref(
  unlock_out:
     grant_read_unlock(rgt);
     op->status = rc;
-    put_maptrack_handle(lgt, handle);
-    rcu_unlock_domain(rd);
+    map_batch_put_handle(batch, handle);
 }
 
 static long
 gnttab_map_grant_ref(
     XEN_GUEST_HANDLE_PARAM(gnttab_map_grant_ref_t) uop, unsigned int count)
 {
-    int i;
-    struct gnttab_map_grant_ref op;
+    unsigned int i, c, done = 0;
+    struct gnttab_map_grant_ref op[GNTTAB_MAP_BATCH_SIZE];
+    struct gnttab_map_batch batch = { .rd = NULL };
+    long rc = 0;
+    int err;
 
-    for ( i = 0; i < count; i++ )
+    while ( count != 0 )
     {
-        if ( i && hypercall_preempt_check() )
-            return i;
+        c = min(count, (unsigned int)GNTTAB_MAP_BATCH_SIZE);
 
-        if ( unlikely(__copy_from_guest_offset(&op, uop, i, 1)) )
-            return -EFAULT;
+        for ( i = 0; i < c; i++ )
+            if ( unlikely(__copy_from_guest_offset(&op[i], uop, done + i, 1)) )
+                break;
 
-        map_grant_ref(&op);
+        if ( unlikely(i < c) )
+        {
+            rc = -EFAULT;
+            c = i;
+        }
 
-        if ( unlikely(__copy_to_guest_offset(uop, i, &op, 1)) )
-            return -EFAULT;
+        for ( i = 0; i < c; i++ )
+        {
+            batch.remaining = c - i;
+            map_grant_ref(&op[i], &batch);
+        }
+
+        /*
+         * Handles and frame addresses are only reported back once the
+         * batch's IOMMU mappings have been flushed.  A failed flush has
+         * already crashed the domain, unless it is the hardware domain.
+         */
+        err = map_batch_finish(&batch);
+        if ( unlikely(err) && !rc )
+            rc = err;
+
+        for ( i = 0; i < c; i++ )
+            if ( unlikely(__copy_to_guest_offset(uop, done + i, &op[i], 1)) )
+                return -EFAULT;
+
+        if ( rc )
+            return rc;
+
+        count -= c;
+        done += c;
+
+        if ( count && hypercall_preempt_check() )
+            return done;
     }
 
     return 0;
@@ -1657,13 +1956,14 @@ gnttab_unpopulate_status_frames(struct domain *d, struct grant_table *gt)
 
 /*
  * Grow the grant table. The caller must hold the grant table's
- * write lock before calling this function.
+ * write lock before calling this function.  Only the shared (and status)
+ * frames are allocated here: active ones come with first use.
  */
 static int
 gnttab_grow_table(struct domain *d, unsigned int req_nr_frames)
 {
     struct grant_table *gt = d->grant_table;
-    unsigned int i, j;
+    unsigned int i;
 
     if ( unlikely(!gt->active) )
     {
@@ -1679,17 +1979,6 @@ gnttab_grow_table(struct domain *d, unsigned int req_nr_frames)
             "Expanding d%d grant table from %u to %u frames\n",
             d->domain_id, nr_grant_frames(gt), req_nr_frames);
 
-    /* Active */
-    for ( i = nr_active_grant_frames(gt);
-          i < num_act_frames_from_sha_frames(req_nr_frames); i++ )
-    {
-        if ( (gt->active[i] = alloc_xenheap_page()) == NULL )
-            goto active_alloc_failed;
-        clear_page(gt->active[i]);
-        for ( j = 0; j < ACGNT_PER_PAGE; j++ )
-            spin_lock_init(&gt->active[i][j].lock);
-    }
-
     /* Shared */
     for ( i = nr_grant_frames(gt); i < req_nr_frames; i++ )
     {
@@ -1718,13 +2007,6 @@ shared_alloc_failed:
         free_xenheap_page(gt->shared_raw[i]);
         gt->shared_raw[i] = NULL;
     }
-active_alloc_failed:
-    for ( i = nr_active_grant_frames(gt);
-          i < num_act_frames_from_sha_frames(req_nr_frames); i++ )
-    {
-        free_xenheap_page(gt->active[i]);
-        gt->active[i] = NULL;
-    }
     gdprintk(XENLOG_INFO, "Allocation failure when expanding d%d grant table\n",
              d->domain_id);
 
@@ -1961,6 +2243,10 @@ gnttab_prepare_for_transfer(
         goto fail;
     }
 
+    /* gnttab_transfer() takes the active entry lock once committed. */
+    if ( unlikely(active_entry_populate(rgt, ref)) )
+        goto fail;
+
     sha = shared_entry_header(rgt, ref);
 
     scombo.word = *(u32 *)&sha->flags;
@@ -2333,6 +2619,10 @@ acquire_grant_for_copy(
         PIN_FAIL(gt_unlock_out, GNTST_bad_gntref,
                  "Bad grant reference %#x\n", gref);
 
+    if ( unlikely(active_entry_populate(rgt, gref)) )
+        PIN_FAIL(gt_unlock_out, GNTST_general_error,
+                 "No memory for active entry %#x\n", gref);
+
     act = active_entry_acquire(rgt, gref);
     shah = shared_entry_header(rgt, gref);
     if ( rgt->gt_version == 1 )
@@ -2575,65 +2865,32 @@ struct gnttab_copy_buf {
     bool_t have_type;
 };
 
-static int gnttab_copy_lock_domain(domid_t domid, bool is_gref,
-                                   struct gnttab_copy_buf *buf)
-{
-    /* Only DOMID_SELF may reference via frame. */
-    if ( domid != DOMID_SELF && !is_gref )
-        return GNTST_permission_denied;
-
-    buf->domain = rcu_lock_domain_by_any_id(domid);
-
-    if ( !buf->domain )
-        return GNTST_bad_domain;
-
-    buf->ptr.domid = domid;
-
-    return GNTST_okay;
-}
+/* Number of distinct domains kept locked across the ops of one batch */
+#define GNTTAB_COPY_DOMAINS 4
+/* Number of claimed frames kept mapped per direction across ops */
+#define GNTTAB_COPY_BUFS 4
 
-static void gnttab_copy_unlock_domains(struct gnttab_copy_buf *src,
-                                       struct gnttab_copy_buf *dest)
-{
-    if ( src->domain )
-    {
-        rcu_unlock_domain(src->domain);
-        src->domain = NULL;
-    }
-    if ( dest->domain )
-    {
-        rcu_unlock_domain(dest->domain);
-        dest->domain = NULL;
-    }
-}
-
-static int gnttab_copy_lock_domains(const struct gnttab_copy *op,
-                                    struct gnttab_copy_buf *src,
-                                    struct gnttab_copy_buf *dest)
-{
-    int rc;
-
-    rc = gnttab_copy_lock_domain(op->source.domid,
-                                 op->flags & GNTCOPY_source_gref, src);
-    if ( rc < 0 )
-        goto error;
-    rc = gnttab_copy_lock_domain(op->dest.domid,
-                                 op->flags & GNTCOPY_dest_gref, dest);
-    if ( rc < 0 )
-        goto error;
+/*
+ * State shared by the ops of one gnttab_copy() invocation.  Backends
+ * typically alternate between a small number of peers, so rather than
+ * just remembering the last source and destination, keep a few domains
+ * RCU-locked and a few frames mapped in each direction until the end of
+ * the batch (or until evicted).
+ */
+struct gnttab_copy_state {
+    unsigned int nr_domains;
+    struct {
+        domid_t domid;
+        struct domain *domain;
+    } domains[GNTTAB_COPY_DOMAINS];
 
-    rc = xsm_grant_copy(XSM_HOOK, src->domain, dest->domain);
-    if ( rc < 0 )
-    {
-        rc = GNTST_permission_denied;
-        goto error;
-    }
-    return 0;
+    /* Last (source, dest) pair cleared by XSM. */
+    const struct domain *xsm_src, *xsm_dest;
 
- error:
-    gnttab_copy_unlock_domains(src, dest);
-    return rc;
-}
+    struct gnttab_copy_buf src[GNTTAB_COPY_BUFS];
+    struct gnttab_copy_buf dest[GNTTAB_COPY_BUFS];
+    unsigned int src_next, dest_next;
+};
 
 static void gnttab_copy_release_buf(struct gnttab_copy_buf *buf)
 {
@@ -2657,6 +2914,101 @@ static void gnttab_copy_release_buf(struct gnttab_copy_buf *buf)
         put_page(buf->page);
         buf->page = NULL;
     }
+    buf->domain = NULL;
+}
+
+static void gnttab_copy_release_bufs(struct gnttab_copy_state *state)
+{
+    unsigned int i;
+
+    for ( i = 0; i < GNTTAB_COPY_BUFS; i++ )
+    {
+        gnttab_copy_release_buf(&state->src[i]);
+        gnttab_copy_release_buf(&state->dest[i]);
+    }
+}
+
+static void gnttab_copy_unlock_domains(struct gnttab_copy_state *state)
+{
+    gnttab_copy_release_bufs(state);
+
+    while ( state->nr_domains )
+        rcu_unlock_domain(state->domains[--state->nr_domains].domain);
+
+    state->xsm_src = state->xsm_dest = NULL;
+}
+
+static int gnttab_copy_lock_domain(struct gnttab_copy_state *state,
+                                   domid_t domid, bool is_gref,
+                                   struct domain **d)
+{
+    unsigned int i;
+
+    /* Only DOMID_SELF may reference via frame. */
+    if ( domid != DOMID_SELF && !is_gref )
+        return GNTST_permission_denied;
+
+    for ( i = 0; i < state->nr_domains; i++ )
+        if ( state->domains[i].domid == domid )
+        {
+            *d = state->domains[i].domain;
+            return GNTST_okay;
+        }
+
+    /*
+     * Out of slots: start over.  This drops the frames claimed so far,
+     * which all belong to the domains being unlocked.
+     */
+    if ( state->nr_domains == GNTTAB_COPY_DOMAINS )
+        gnttab_copy_unlock_domains(state);
+
+    *d = rcu_lock_domain_by_any_id(domid);
+    if ( !*d )
+        return GNTST_bad_domain;
+
+    state->domains[state->nr_domains].domid = domid;
+    state->domains[state->nr_domains].domain = *d;
+    state->nr_domains++;
+
+    return GNTST_okay;
+}
+
+static int gnttab_copy_lock_domains(const struct gnttab_copy *op,
+                                    struct gnttab_copy_state *state,
+                                    struct domain **src, struct domain **dest)
+{
+    int rc;
+
+    rc = gnttab_copy_lock_domain(state, op->source.domid,
+                                 op->flags & GNTCOPY_source_gref, src);
+    if ( rc < 0 )
+        return rc;
+    rc = gnttab_copy_lock_domain(state, op->dest.domid,
+                                 op->flags & GNTCOPY_dest_gref, dest);
+    if ( rc < 0 )
+        return rc;
+
+    /* The source domain may have been evicted while locking dest. */
+    if ( op->source.domid != op->dest.domid &&
+         (rc = gnttab_copy_lock_domain(state, op->source.domid,
+                                       op->flags & GNTCOPY_source_gref,
+                                       src)) < 0 )
+        return rc;
+
+    if ( *src == state->xsm_src && *dest == state->xsm_dest )
+        return 0;
+
+    rc = xsm_grant_copy(XSM_HOOK, *src, *dest);
+    if ( rc < 0 )
+    {
+        state->xsm_src = state->xsm_dest = NULL;
+        return GNTST_permission_denied;
+    }
+
+    state->xsm_src = *src;
+    state->xsm_dest = *dest;
+
+    return 0;
 }
 
 static int gnttab_copy_claim_buf(const struct gnttab_copy *op,
@@ -2717,11 +3069,53 @@ static bool_t gnttab_copy_buf_valid(const struct gnttab_copy_ptr *p,
                                     const struct gnttab_copy_buf *b,
                                     bool_t has_gref)
 {
-    if ( !b->virt )
+    if ( !b->virt || p->domid != b->ptr.domid )
         return 0;
     if ( has_gref )
         return b->have_grant && p->u.ref == b->ptr.u.ref;
-    return p->u.gmfn == b->ptr.u.gmfn;
+    return !b->have_grant && p->u.gmfn == b->ptr.u.gmfn;
+}
+
+/*
+ * Find the buffer already holding the frame p refers to, or claim it into
+ * a free (or, failing that, the least recently claimed) slot.
+ */
+static int gnttab_copy_get_buf(const struct gnttab_copy *op,
+                               const struct gnttab_copy_ptr *p,
+                               struct domain *d,
+                               struct gnttab_copy_buf *bufs,
+                               unsigned int *next, unsigned int gref_flag,
+                               struct gnttab_copy_buf **buf)
+{
+    unsigned int i;
+    int rc;
+
+    for ( i = 0; i < GNTTAB_COPY_BUFS; i++ )
+        if ( gnttab_copy_buf_valid(p, &bufs[i], op->flags & gref_flag) )
+        {
+            *buf = &bufs[i];
+            return GNTST_okay;
+        }
+
+    for ( i = 0; i < GNTTAB_COPY_BUFS; i++ )
+        if ( !bufs[i].virt )
+            break;
+    if ( i == GNTTAB_COPY_BUFS )
+    {
+        i = *next;
+        *next = (i + 1) % GNTTAB_COPY_BUFS;
+    }
+
+    *buf = &bufs[i];
+    gnttab_copy_release_buf(*buf);
+    (*buf)->domain = d;
+    (*buf)->ptr.domid = p->domid;
+
+    rc = gnttab_copy_claim_buf(op, p, *buf, gref_flag);
+    if ( rc )
+        gnttab_copy_release_buf(*buf);
+
+    return rc;
 }
 
 static int gnttab_copy_buf(const struct gnttab_copy *op,
@@ -2748,8 +3142,12 @@ static int gnttab_copy_buf(const struct gnttab_copy *op,
                  op->dest.offset, dest->ptr.offset,
                  op->len, dest->len);
 
-    memcpy(dest->virt + op->dest.offset, src->virt + op->source.offset,
-           op->len);
+    /* Whole frames go through the architecture's page copy routine. */
+    if ( op->len == PAGE_SIZE )
+        copy_page(dest->virt, src->virt);
+    else
+        memcpy(dest->virt + op->dest.offset, src->virt + op->source.offset,
+               op->len);
     gnttab_mark_dirty(dest->domain, dest->frame);
     rc = GNTST_okay;
  out:
@@ -2757,42 +3155,25 @@ static int gnttab_copy_buf(const struct gnttab_copy *op,
 }
 
 static int gnttab_copy_one(const struct gnttab_copy *op,
-                           struct gnttab_copy_buf *dest,
-                           struct gnttab_copy_buf *src)
+                           struct gnttab_copy_state *state)
 {
+    struct domain *sd, *dd;
+    struct gnttab_copy_buf *src, *dest;
     int rc;
 
-    if ( !src->domain || op->source.domid != src->ptr.domid ||
-         !dest->domain || op->dest.domid != dest->ptr.domid )
-    {
-        gnttab_copy_release_buf(src);
-        gnttab_copy_release_buf(dest);
-        gnttab_copy_unlock_domains(src, dest);
-
-        rc = gnttab_copy_lock_domains(op, src, dest);
-        if ( rc < 0 )
-            goto out;
-    }
+    rc = gnttab_copy_lock_domains(op, state, &sd, &dd);
+    if ( rc < 0 )
+        goto out;
 
-    /* Different source? */
-    if ( !gnttab_copy_buf_valid(&op->source, src,
-                                op->flags & GNTCOPY_source_gref) )
-    {
-        gnttab_copy_release_buf(src);
-        rc = gnttab_copy_claim_buf(op, &op->source, src, GNTCOPY_source_gref);
-        if ( rc )
-            goto out;
-    }
+    rc = gnttab_copy_get_buf(op, &op->source, sd, state->src,
+                             &state->src_next, GNTCOPY_source_gref, &src);
+    if ( rc )
+        goto out;
 
-    /* Different dest? */
-    if ( !gnttab_copy_buf_valid(&op->dest, dest,
-                                op->flags & GNTCOPY_dest_gref) )
-    {
-        gnttab_copy_release_buf(dest);
-        rc = gnttab_copy_claim_buf(op, &op->dest, dest, GNTCOPY_dest_gref);
-        if ( rc )
-            goto out;
-    }
+    rc = gnttab_copy_get_buf(op, &op->dest, dd, state->dest,
+                             &state->dest_next, GNTCOPY_dest_gref, &dest);
+    if ( rc )
+        goto out;
 
     rc = gnttab_copy_buf(op, dest, src);
  out:
@@ -2812,8 +3193,7 @@ static long gnttab_copy(
 {
     unsigned int i;
     struct gnttab_copy op;
-    struct gnttab_copy_buf src = {};
-    struct gnttab_copy_buf dest = {};
+    struct gnttab_copy_state state = {};
     long rc = 0;
 
     for ( i = 0; i < count; i++ )
@@ -2830,17 +3210,14 @@ static long gnttab_copy(
             break;
         }
 
-        rc = gnttab_copy_one(&op, &dest, &src);
+        rc = gnttab_copy_one(&op, &state);
         if ( rc > 0 )
         {
             rc = count - i;
             break;
         }
         if ( rc != GNTST_okay )
-        {
-            gnttab_copy_release_buf(&src);
-            gnttab_copy_release_buf(&dest);
-        }
+            gnttab_copy_release_bufs(&state);
 
         op.status = rc;
         rc = 0;
@@ -2852,9 +3229,7 @@ static long gnttab_copy(
         guest_handle_add_offset(uop, 1);
     }
 
-    gnttab_copy_release_buf(&src);
-    gnttab_copy_release_buf(&dest);
-    gnttab_copy_unlock_domains(&src, &dest);
+    gnttab_copy_unlock_domains(&state);
 
     return rc;
 }
@@ -2889,7 +3264,8 @@ gnttab_set_version(XEN_GUEST_HANDLE_PARAM(gnttab_set_version_t) uop)
      */
     for ( i = GNTTAB_NR_RESERVED_ENTRIES; i < nr_grant_entries(gt); i++ )
     {
-        if ( read_atomic(&_active_entry(gt, i).pin) != 0 )
+        if ( active_entry_present(gt, i) &&
+             read_atomic(&_active_entry(gt, i).pin) != 0 )
         {
             gdprintk(XENLOG_WARNING,
                      "tried to change grant table version from %u to %u, but some grant entries still in use\n",
@@ -3136,6 +3512,10 @@ swap_grant_ref(grant_ref_t ref_a, grant_ref_t ref_b)
     if ( ref_a == ref_b )
         goto out;
 
+    if ( unlikely(active_entry_populate(gt, ref_a)) ||
+         unlikely(active_entry_populate(gt, ref_b)) )
+        PIN_FAIL(out, GNTST_general_error, "No memory for active entries\n");
+
     act_a = active_entry_acquire(gt, ref_a);
     if ( act_a->pin )
         PIN_FAIL(out, GNTST_eagain, "ref a %#x busy\n", ref_a);
@@ -3511,7 +3891,16 @@ grant_table_create(
 
     if ( d->domain_id == 0 )
     {
-        ret = grant_table_init(d, t, gnttab_dom0_frames(), max_maptrack_frames);
+        unsigned int maptrack_frames = max_maptrack_frames;
+
+        if ( opt_maptrack_autoscale && max_maptrack_frames &&
+             max_maptrack_frames < MAX_AUTO_MAPTRACK_FRAMES )
+        {
+            t->maptrack_base_frames = max_maptrack_frames;
+            maptrack_frames = MAX_AUTO_MAPTRACK_FRAMES;
+        }
+
+        ret = grant_table_init(d, t, gnttab_dom0_frames(), maptrack_frames);
     }
 
     return ret;
@@ -3637,6 +4026,9 @@ void grant_table_warn_active_grants(struct domain *d)
 
     for ( ref = 0; ref != nr_grant_entries(gt); ref++ )
     {
+        if ( !active_entry_present(gt, ref) )
+            continue;
+
         act = active_entry_acquire(gt, ref);
         if ( !act->pin )
         {
@@ -3833,6 +4225,9 @@ static void gnttab_usage_print(struct domain *rd)
         uint16_t status;
         uint64_t frame;
 
+        if ( !active_entry_present(gt, ref) )
+            continue;
+
         act = active_entry_acquire(gt, ref);
         if ( !act->pin )
         {
@@ -31,6 +31,9 @@ static irq_keyhandler_fn_t do_toggle_alt_key, dump_registers,
 
 char keyhandler_scratch[1024];
 
+/* Serialises the non-IRQ handlers, e.g. for their use of the scratch space. */
+static DEFINE_SPINLOCK(keyhandler_lock);
+
 static struct keyhandler {
     union {
         keyhandler_fn_t *fn;
@@ -87,12 +90,20 @@ void handle_keypress(unsigned char key, struct cpu_user_regs *regs)
     if ( key >= ARRAY_SIZE(key_table) || !(h = &key_table[key])->fn )
         return;
 
-    if ( !in_irq() || h->irq_callback )
+    if ( h->irq_callback )
     {
         console_start_log_everything();
-        h->irq_callback ? h->irq_fn(key, regs) : h->fn(key);
+        h->irq_fn(key, regs);
         console_end_log_everything();
     }
+    else if ( !in_irq() )
+    {
+        spin_lock(&keyhandler_lock);
+        console_start_log_everything();
+        h->fn(key);
+        console_end_log_everything();
+        spin_unlock(&keyhandler_lock);
+    }
     else
     {
         keypress_key = key;
@@ -100,6 +111,27 @@ void handle_keypress(unsigned char key, struct cpu_user_regs *regs)
     }
 }
 
+long keyhandler_dump(unsigned char key, char *buf, unsigned int size)
+{
+    const struct keyhandler *h;
+
+    if ( key >= ARRAY_SIZE(key_table) || !(h = &key_table[key])->fn )
+        return -ENOENT;
+
+    /* IRQ handlers may run elsewhere, or want the interrupted context. */
+    if ( h->irq_callback )
+        return -EOPNOTSUPP;
+
+    if ( !spin_trylock(&keyhandler_lock) )
+        return -EBUSY;
+
+    console_start_capture(buf, size);
+    h->fn(key);
+    spin_unlock(&keyhandler_lock);
+
+    return console_end_capture();
+}
+
 void register_keyhandler(unsigned char key, keyhandler_fn_t fn,
                          const char *desc, bool_t diagnostic)
 {
@@ -462,6 +494,7 @@ static void run_all_nonirq_keyhandlers(unsigned long unused)
     struct keyhandler *h;
     int k;
 
+    spin_lock(&keyhandler_lock);
     console_start_log_everything();
 
     for ( k = 0; k < ARRAY_SIZE(key_table); k++ )
@@ -475,6 +508,7 @@ static void run_all_nonirq_keyhandlers(unsigned long unused)
     }
 
     console_end_log_everything();
+    spin_unlock(&keyhandler_lock);
 }
 
 static DECLARE_TASKLET(run_all_keyhandlers_tasklet,
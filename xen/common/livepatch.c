@@ -81,6 +81,25 @@ struct payload {
     char name[XEN_LIVEPATCH_NAME_SIZE];  /* Name of it. */
 };
 
+/*
+ * Allow applying and reverting payloads without holding all CPUs in a
+ * rendezvous (see livepatch_live_action()), for those few where that is
+ * safe: a single function, which the architecture can switch over with one
+ * instruction, and no load or unload hooks, which are how a payload changes
+ * the meaning of data, atomically with switching code.
+ */
+static bool __read_mostly opt_livepatch_live;
+boolean_param("livepatch-live", opt_livepatch_live);
+
+static bool payload_live_ok(const struct payload *data, unsigned int cmd)
+{
+    return opt_livepatch_live && cmd != LIVEPATCH_ACTION_REPLACE &&
+           data->nfuncs == 1 && !data->n_load_funcs &&
+           !data->n_unload_funcs &&
+           arch_livepatch_live_ok(&data->funcs[0],
+                                  cmd == LIVEPATCH_ACTION_REVERT);
+}
+
 /* Defines an outstanding patching action. */
 struct livepatch_work
 {
@@ -90,6 +109,7 @@ struct livepatch_work
     struct payload *data;        /* The payload on which to act. */
     volatile bool_t do_work;     /* Signals work to do. */
     volatile bool_t ready;       /* Signals all CPUs synchronized. */
+    bool live;                   /* Patching without rendezvous. */
     unsigned int cmd;            /* Action request: LIVEPATCH_ACTION_* */
 };
 
@@ -690,6 +710,14 @@ static int prepare_payload(struct payload *payload,
 #endif
     }
 
+    /* Sites in payloads wouldn't be patched when keys get flipped. */
+    if ( livepatch_elf_sec_by_name(elf, ".static_keys") )
+    {
+        dprintk(XENLOG_ERR, LIVEPATCH "%s: We don't support static keys!\n",
+                elf->name);
+        return -EOPNOTSUPP;
+    }
+
     sec = livepatch_elf_sec_by_name(elf, ".ex_table");
     if ( sec )
     {
@@ -1139,6 +1167,20 @@ static int revert_payload(struct payload *data)
     return 0;
 }
 
+static void apply_payload_live(struct payload *data)
+{
+    unsigned int i;
+
+    printk(XENLOG_INFO LIVEPATCH "%s: Applying live\n", data->name);
+
+    /* The trap code needs to know about the new code before it can run. */
+    list_add_tail_rcu(&data->applied_list, &applied_list);
+    register_virtual_region(&data->region);
+
+    for ( i = 0; i < data->nfuncs; i++ )
+        arch_livepatch_apply_live(&data->funcs[i]);
+}
+
 /*
  * This function is executed having all other CPUs with no deep stack (we may
  * have cpu_idle on it) and IRQs disabled.
@@ -1228,6 +1270,7 @@ static int schedule_work(struct payload *data, uint32_t cmd, uint32_t timeout)
     livepatch_work.cmd = cmd;
     livepatch_work.data = data;
     livepatch_work.timeout = timeout ?: MILLISECS(30);
+    livepatch_work.live = payload_live_ok(data, cmd);
 
     dprintk(XENLOG_DEBUG, LIVEPATCH "%s: timeout is %"PRIu32"ns\n",
             data->name, livepatch_work.timeout);
@@ -1274,6 +1317,59 @@ static int livepatch_spin(atomic_t *counter, s_time_t timeout,
     return rc;
 }
 
+/*
+ * Patch code while all other CPUs keep running.  Each of them may keep
+ * executing the old version of any function until it next comes through
+ * check_for_livepatch_work(), where it can't have anything on its stack.
+ * For applying a payload that's of no concern: the old code stays around.
+ * The code of a reverted payload however must stay (and remain known to the
+ * trap code) until all CPUs acknowledged the revert from there, as the
+ * payload may be unloaded afterwards.  Failing that in time, the revert is
+ * undone.
+ */
+static void livepatch_live_action(void)
+{
+    struct payload *data = livepatch_work.data;
+    unsigned int i, cpus = num_online_cpus() - 1;
+    s_time_t timeout;
+
+    if ( livepatch_work.cmd == LIVEPATCH_ACTION_APPLY )
+    {
+        apply_payload_live(data);
+        data->state = LIVEPATCH_STATE_APPLIED;
+        data->rc = 0;
+        return;
+    }
+
+    ASSERT(livepatch_work.cmd == LIVEPATCH_ACTION_REVERT);
+
+    printk(XENLOG_INFO LIVEPATCH "%s: Reverting live\n", data->name);
+
+    for ( i = 0; i < data->nfuncs; i++ )
+        arch_livepatch_revert_live(&data->funcs[i]);
+
+    /* The semaphore is at 0, with this CPU having taken the master role. */
+    smp_wmb();
+    livepatch_work.ready = 1;
+    if ( cpus )
+        smp_call_function(reschedule_fn, NULL, 0);
+
+    timeout = livepatch_work.timeout + NOW();
+    if ( livepatch_spin(&livepatch_work.semaphore, timeout, cpus, "live") )
+    {
+        for ( i = 0; i < data->nfuncs; i++ )
+            arch_livepatch_apply_live(&data->funcs[i]);
+        return;
+    }
+
+    list_del_rcu(&data->applied_list);
+    unregister_virtual_region(&data->region);
+
+    data->reverted = true;
+    data->state = LIVEPATCH_STATE_CHECKED;
+    data->rc = 0;
+}
+
 /*
  * The main function which manages the work of quiescing the system and
  * patching code.
@@ -1328,6 +1424,13 @@ void check_for_livepatch_work(void)
              */
             return;
         }
+
+        if ( livepatch_work.live )
+        {
+            livepatch_live_action();
+            goto done;
+        }
+
         /* "Mask" NMIs. */
         arch_livepatch_mask();
 
@@ -1368,6 +1471,7 @@ void check_for_livepatch_work(void)
  abort:
         arch_livepatch_unmask();
 
+ done:
         per_cpu(work_to_do, cpu) = 0;
         livepatch_work.do_work = 0;
 
@@ -1377,6 +1481,16 @@ void check_for_livepatch_work(void)
         printk(XENLOG_INFO LIVEPATCH "%s finished %s with rc=%d\n",
                p->name, names[livepatch_work.cmd], p->rc);
     }
+    else if ( livepatch_work.live )
+    {
+        /*
+         * Only asked to come here once the master CPU is done patching.
+         * Nothing but this function being on the stack, incrementing the
+         * semaphore above acknowledged having left behind any old code.
+         */
+        ASSERT(livepatch_work.ready);
+        per_cpu(work_to_do, cpu) = 0;
+    }
     else
     {
         /* Wait for all CPUs to rendezvous. */
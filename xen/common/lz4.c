@@ -0,0 +1,92 @@
+/*
+ * lz4.c -- LZ4 compressor and bounds checked decompressor for runtime use
+ *
+ * lz4/decompress.c is only built into the init sections, to unpack boot
+ * modules, and trusts its input there. tmem keeps compressed pages for
+ * the lifetime of the host and wants both directions.
+ */
+
+#include <xen/lib.h>
+#include <xen/lz4.h>
+#include <xen/string.h>
+#include <xen/types.h>
+#include <asm/byteorder.h>
+
+#define INIT
+
+#define get_unaligned(_p) (*(_p))
+#define put_unaligned(_val,_p) (*(_p)=_val)
+
+#include "lz4/defs.h"
+#include "lz4/compress.c"
+
+int lz4_decompress_unknownoutputsize(const unsigned char *src, size_t src_len,
+		unsigned char *dest, size_t *dest_len)
+{
+	const BYTE *ip = src;
+	const BYTE *const iend = ip + src_len;
+	BYTE *op = dest;
+	BYTE *const oend = op + *dest_len;
+
+	while (ip < iend) {
+		unsigned int token = *ip++, s;
+		size_t length = token >> ML_BITS, offset;
+		const BYTE *ref;
+
+		/* get runlength */
+		if (length == RUN_MASK) {
+			do {
+				if (ip >= iend)
+					return -1;
+				s = *ip++;
+				length += s;
+			} while (s == 255);
+		}
+
+		/* copy literals */
+		if (length > (size_t)(iend - ip) ||
+		    length > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, length);
+		ip += length;
+		op += length;
+		if (ip == iend)
+			break; /* the last sequence has no match */
+
+		/* get offset */
+		if (iend - ip < 2)
+			return -1;
+		offset = get_unaligned_le16(ip);
+		ip += 2;
+		if (!offset || offset > (size_t)(op - dest))
+			return -1;
+		ref = op - offset;
+
+		/* get matchlength */
+		length = token & ML_MASK;
+		if (length == ML_MASK) {
+			do {
+				if (ip >= iend)
+					return -1;
+				s = *ip++;
+				length += s;
+			} while (s == 255);
+		}
+		length += MINMATCH;
+		if (length > (size_t)(oend - op))
+			return -1;
+
+		/* copy repeated sequence, which may overlap its own output */
+		if (offset >= length) {
+			memcpy(op, ref, length);
+			op += length;
+		} else {
+			while (length--)
+				*op++ = *ref++;
+		}
+	}
+
+	*dest_len = op - dest;
+
+	return 0;
+}
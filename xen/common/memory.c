@@ -23,6 +23,7 @@
 #include <xen/numa.h>
 #include <xen/mem_access.h>
 #include <xen/trace.h>
+#include <xen/vm_event.h>
 #include <asm/current.h>
 #include <asm/hardirq.h>
 #include <asm/p2m.h>
@@ -180,6 +181,16 @@ static void populate_physmap(struct memop_args *a)
         a->memflags |= MEMF_no_icache_flush;
     }
 
+    /* Superpages may come from the reserved pool, if there is one. */
+    if ( a->extent_order )
+        a->memflags |= MEMF_superpage;
+
+#ifdef CONFIG_HAS_PASSTHROUGH
+    /* Flush the IOTLB once for the whole batch. */
+    if ( need_iommu(d) )
+        this_cpu(iommu_dont_flush_iotlb) = 1;
+#endif
+
     for ( i = a->nr_done; i < a->nr_extents; i++ )
     {
         if ( i != a->nr_done && hypercall_preempt_check() )
@@ -268,6 +279,18 @@ static void populate_physmap(struct memop_args *a)
     }
 
 out:
+#ifdef CONFIG_HAS_PASSTHROUGH
+    if ( need_iommu(d) )
+    {
+        int rc;
+
+        this_cpu(iommu_dont_flush_iotlb) = 0;
+        rc = iommu_iotlb_flush_all(d);
+        /* Logged, and fatal to all but the hardware domain. */
+        ASSERT(!rc || is_hardware_domain(d) || d->is_shutting_down);
+    }
+#endif
+
     if ( need_tlbflush )
         filtered_flush_tlb_mask(tlbflush_timestamp);
 
@@ -277,7 +300,14 @@ out:
     a->nr_done = i;
 }
 
-int guest_remove_page(struct domain *d, unsigned long gmfn)
+/*
+ * If ppage is non-NULL, the reference to the removed page taken here is
+ * handed to the caller (via *ppage, which is NULL if there's none) rather
+ * than dropped, allowing the page to only be freed once some deferred TLB
+ * flush has been done.
+ */
+static int _guest_remove_page(struct domain *d, unsigned long gmfn,
+                              struct page_info **ppage)
 {
     struct page_info *page;
 #ifdef CONFIG_X86
@@ -286,6 +316,9 @@ int guest_remove_page(struct domain *d, unsigned long gmfn)
     mfn_t mfn;
     int rc;
 
+    if ( ppage )
+        *ppage = NULL;
+
 #ifdef CONFIG_X86
     mfn = get_gfn_query(d, gmfn, &p2mt);
     if ( unlikely(p2mt == p2m_invalid) || unlikely(p2mt == p2m_mmio_dm) )
@@ -377,7 +410,10 @@ int guest_remove_page(struct domain *d, unsigned long gmfn)
          test_and_clear_bit(_PGC_allocated, &page->count_info) )
         put_page(page);
 
-    put_page(page);
+    if ( !rc && ppage )
+        *ppage = page;
+    else
+        put_page(page);
  out_put_gfn: __maybe_unused
     put_gfn(d, gmfn);
 
@@ -388,74 +424,198 @@ int guest_remove_page(struct domain *d, unsigned long gmfn)
     return rc != -ENOENT ? rc : -EINVAL;
 }
 
+int guest_remove_page(struct domain *d, unsigned long gmfn)
+{
+    return _guest_remove_page(d, gmfn, NULL);
+}
+
+/*
+ * decrease_reservation() removes extents in batches: the GFNs of a batch
+ * are read from the guest up front, after which (on x86) the p2m stays
+ * locked across their removal, so that the TLB flushes the p2m updates
+ * require are coalesced. IOTLB flushes get deferred likewise, and the last
+ * reference to the removed pages is only dropped once both were done, so
+ * the pages go back to the heap in bulk.
+ */
+#define DECREASE_BATCH_EXTENTS 64U
+#define DECREASE_BATCH_PAGES   64U
+
+struct decrease_batch {
+    struct domain *d;
+    bool p2m_locked;
+    int rc;
+    unsigned int nr_pages;
+    struct page_info *pages[DECREASE_BATCH_PAGES];
+};
+
+static void decrease_batch_begin(struct decrease_batch *b, struct domain *d)
+{
+    b->d = d;
+    b->rc = 0;
+    b->nr_pages = 0;
+
+#ifdef CONFIG_X86
+    /*
+     * Dropping paged out pages may have to wait for room on the paging
+     * ring, which mustn't happen with the p2m lock held.
+     */
+    b->p2m_locked = paging_mode_translate(d) &&
+                    !vm_event_check_ring(d->vm_event_paging);
+    if ( b->p2m_locked )
+        p2m_batch_begin(d);
+#endif
+
+#ifdef CONFIG_HAS_PASSTHROUGH
+    if ( need_iommu(d) )
+        this_cpu(iommu_dont_flush_iotlb) = 1;
+#endif
+}
+
+static void decrease_batch_flush(struct decrease_batch *b)
+{
+    unsigned int i;
+
+#ifdef CONFIG_X86
+    if ( b->p2m_locked )
+        p2m_batch_flush(b->d);
+#endif
+
+#ifdef CONFIG_HAS_PASSTHROUGH
+    if ( need_iommu(b->d) )
+    {
+        int rc = iommu_iotlb_flush_all(b->d);
+
+        if ( unlikely(rc) && !b->rc )
+            b->rc = rc;
+    }
+#endif
+
+    for ( i = 0; i < b->nr_pages; i++ )
+        put_page(b->pages[i]);
+    b->nr_pages = 0;
+}
+
+static void decrease_batch_end(struct decrease_batch *b)
+{
+    decrease_batch_flush(b);
+
+#ifdef CONFIG_HAS_PASSTHROUGH
+    if ( need_iommu(b->d) )
+        this_cpu(iommu_dont_flush_iotlb) = 0;
+#endif
+
+#ifdef CONFIG_X86
+    if ( b->p2m_locked )
+        p2m_batch_end(b->d);
+#endif
+}
+
+static int decrease_batch_remove_page(struct decrease_batch *b,
+                                      unsigned long gmfn)
+{
+    struct page_info *page;
+    int rc = _guest_remove_page(b->d, gmfn, &page);
+
+    if ( page )
+    {
+        b->pages[b->nr_pages++] = page;
+        if ( b->nr_pages == DECREASE_BATCH_PAGES )
+            decrease_batch_flush(b);
+    }
+
+    return rc ?: b->rc;
+}
+
+static bool decrease_extent(struct memop_args *a, struct decrease_batch *b,
+                            xen_pfn_t gmfn)
+{
+    unsigned long j, pod_done;
+
+    if ( tb_init_done )
+    {
+        struct {
+            u64 gfn;
+            int d:16,order:16;
+        } t;
+
+        t.gfn = gmfn;
+        t.d = a->domain->domain_id;
+        t.order = a->extent_order;
+    
+        __trace_var(TRC_MEM_DECREASE_RESERVATION, 0, sizeof(t), &t);
+    }
+
+    /* See if populate-on-demand wants to handle this */
+    pod_done = is_hvm_domain(a->domain) ?
+               p2m_pod_decrease_reservation(a->domain, _gfn(gmfn),
+                                            a->extent_order) : 0;
+
+    /*
+     * Look for pages not handled by p2m_pod_decrease_reservation().
+     *
+     * guest_remove_page() will return -ENOENT for pages which have already
+     * been removed by p2m_pod_decrease_reservation(); so expect to see
+     * exactly pod_done failures.  Any more means that there were invalid
+     * entries before p2m_pod_decrease_reservation() was called.
+     */
+    for ( j = 0; j + pod_done < (1UL << a->extent_order); j++ )
+    {
+        switch ( decrease_batch_remove_page(b, gmfn + j) )
+        {
+        case 0:
+            break;
+        case -ENOENT:
+            if ( !pod_done )
+                return false;
+            --pod_done;
+            break;
+        default:
+            return false;
+        }
+    }
+
+    return true;
+}
+
 static void decrease_reservation(struct memop_args *a)
 {
-    unsigned long i, j;
-    xen_pfn_t gmfn;
+    unsigned long i, j, nr;
+    xen_pfn_t gmfns[DECREASE_BATCH_EXTENTS];
+    struct decrease_batch batch;
 
     if ( !guest_handle_subrange_okay(a->extent_list, a->nr_done,
                                      a->nr_extents-1) ||
          a->extent_order > max_order(current->domain) )
         return;
 
-    for ( i = a->nr_done; i < a->nr_extents; i++ )
+    for ( i = a->nr_done; i < a->nr_extents; i += nr )
     {
-        unsigned long pod_done;
-
         if ( i != a->nr_done && hypercall_preempt_check() )
         {
             a->preempted = 1;
-            goto out;
+            break;
         }
 
-        if ( unlikely(__copy_from_guest_offset(&gmfn, a->extent_list, i, 1)) )
-            goto out;
+        /* Keep batches of large extents to a similar number of pages. */
+        nr = min_t(unsigned long, a->nr_extents - i,
+                   max(DECREASE_BATCH_EXTENTS >> a->extent_order, 1U));
 
-        if ( tb_init_done )
-        {
-            struct {
-                u64 gfn;
-                int d:16,order:16;
-            } t;
-
-            t.gfn = gmfn;
-            t.d = a->domain->domain_id;
-            t.order = a->extent_order;
-        
-            __trace_var(TRC_MEM_DECREASE_RESERVATION, 0, sizeof(t), &t);
-        }
+        if ( unlikely(__copy_from_guest_offset(gmfns, a->extent_list, i, nr)) )
+            break;
 
-        /* See if populate-on-demand wants to handle this */
-        pod_done = is_hvm_domain(a->domain) ?
-                   p2m_pod_decrease_reservation(a->domain, _gfn(gmfn),
-                                                a->extent_order) : 0;
+        decrease_batch_begin(&batch, a->domain);
+        for ( j = 0; j < nr; j++ )
+            if ( !decrease_extent(a, &batch, gmfns[j]) )
+                break;
+        decrease_batch_end(&batch);
 
-        /*
-         * Look for pages not handled by p2m_pod_decrease_reservation().
-         *
-         * guest_remove_page() will return -ENOENT for pages which have already
-         * been removed by p2m_pod_decrease_reservation(); so expect to see
-         * exactly pod_done failures.  Any more means that there were invalid
-         * entries before p2m_pod_decrease_reservation() was called.
-         */
-        for ( j = 0; j + pod_done < (1UL << a->extent_order); j++ )
+        if ( j < nr )
         {
-            switch ( guest_remove_page(a->domain, gmfn + j) )
-            {
-            case 0:
-                break;
-            case -ENOENT:
-                if ( !pod_done )
-                    goto out;
-                --pod_done;
-                break;
-            default:
-                goto out;
-            }
+            i += j;
+            break;
         }
     }
 
- out:
     a->nr_done = i;
 }
 
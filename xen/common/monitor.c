@@ -92,8 +92,9 @@ int monitor_traps(struct vcpu *v, bool sync, vm_event_request_t *req)
 {
     int rc;
     struct domain *d = v->domain;
+    struct vm_event_domain *ved = vm_event_monitor_ring(v);
 
-    rc = vm_event_claim_slot(d, d->vm_event_monitor);
+    rc = vm_event_claim_slot(d, ved);
     switch ( rc )
     {
     case 0:
@@ -124,7 +125,7 @@ int monitor_traps(struct vcpu *v, bool sync, vm_event_request_t *req)
     }
 
     vm_event_fill_regs(req);
-    vm_event_put_request(d, d->vm_event_monitor, req);
+    vm_event_put_request(d, ved, req);
 
     return rc;
 }
@@ -14,6 +14,12 @@
 #include <asm/current.h>
 #include <asm/hardirq.h>
 
+/*
+ * Entries are read from the guest this many at a time, and the check for
+ * preemption is made between such batches rather than after every entry.
+ */
+#define MC_BATCH 8
+
 #ifndef COMPAT
 typedef long ret_t;
 #define xlat_multicall_entry(mcs)
@@ -38,7 +44,9 @@ do_multicall(
 {
     struct vcpu *curr = current;
     struct mc_state *mcs = &curr->mc_state;
+    multicall_entry_t batch[MC_BATCH];
     uint32_t         i;
+    unsigned int     nr = 0, next = 0;
     int              rc = 0;
     enum mc_disposition disp = mc_continue;
 
@@ -53,15 +61,22 @@ do_multicall(
 
     for ( i = 0; !rc && disp == mc_continue && i < nr_calls; i++ )
     {
-        if ( i && hypercall_preempt_check() )
-            goto preempted;
-
-        if ( unlikely(__copy_from_guest(&mcs->call, call_list, 1)) )
+        if ( next == nr )
         {
-            rc = -EFAULT;
-            break;
+            if ( i && hypercall_preempt_check() )
+                goto preempted;
+
+            nr = min_t(uint32_t, nr_calls - i, MC_BATCH);
+            next = 0;
+            if ( unlikely(__copy_from_guest(batch, call_list, nr)) )
+            {
+                rc = -EFAULT;
+                break;
+            }
         }
 
+        mcs->call = batch[next++];
+
         trace_multicall_call(&mcs->call);
 
         disp = arch_do_multicall_call(mcs);
@@ -113,12 +128,14 @@ do_multicall(
     if ( unlikely(disp == mc_preempt) && i < nr_calls )
         goto preempted;
 
+    arch_multicall_flush();
     perfc_incr(calls_to_multicall);
     perfc_add(calls_from_multicall, i);
     mcs->flags = 0;
     return rc;
 
  preempted:
+    arch_multicall_flush();
     perfc_add(calls_from_multicall, i);
     mcs->flags = 0;
     return hypercall_create_continuation(
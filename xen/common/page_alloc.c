@@ -121,6 +121,7 @@
  */
 
 #include <xen/init.h>
+#include <xen/cpu.h>
 #include <xen/types.h>
 #include <xen/lib.h>
 #include <xen/sched.h>
@@ -184,6 +185,17 @@ static bool __read_mostly scrub_debug;
 static unsigned int dma_bitsize;
 integer_param("dma_bits", dma_bitsize);
 
+/*
+ * Maximum number of order-0 pages each pCPU keeps cached in front of the
+ * buddy allocator (0 disables the caches).
+ */
+static unsigned int __read_mostly opt_percpu_pages = 64;
+integer_param("percpu_pages", opt_percpu_pages);
+
+/* Number of 1G pages to reserve on each node, for guest superpages. */
+static unsigned int __initdata opt_superpage_pool;
+integer_param("superpage_pool", opt_superpage_pool);
+
 /* Offlined page list, protected by heap_lock. */
 PAGE_LIST_HEAD(page_offlined_list);
 /* Broken page list, protected by heap_lock. */
@@ -399,15 +411,39 @@ mfn_t __init alloc_boot_pages(unsigned long nr_pfns, unsigned long pfn_align)
 #define page_to_zone(pg) (is_xen_heap_page(pg) ? MEMZONE_XEN :  \
                           (flsl(page_to_mfn(pg)) ? : 1))
 
+/* Is @zone one of the domain heap zones above the DMA ones? */
+static bool zone_above_dma(unsigned int zone)
+{
+    return zone > MEMZONE_XEN &&
+           (!dma_bitsize || zone > bits_to_zone(dma_bitsize));
+}
+
 typedef struct page_list_head heap_by_zone_and_order_t[NR_ZONES][MAX_ORDER+1];
 static heap_by_zone_and_order_t *_heap[MAX_NUMNODES];
 #define heap(node, zone, order) ((*_heap[node])[zone][order])
 
 static unsigned long node_need_scrub[MAX_NUMNODES];
 
+/* Per-node scrubbing statistics, protected by heap_lock. */
+static struct {
+    unsigned long idle_pages;   /* Pages scrubbed by idle pCPUs... */
+    s_time_t idle_time;         /* ... and the time it took them. */
+    unsigned long alloc_pages;  /* Pages scrubbed when being allocated. */
+} scrub_stats[MAX_NUMNODES];
+
 static unsigned long *avail[MAX_NUMNODES];
 static long total_avail_pages;
 
+/* Free pages sitting in the per-CPU caches, not accounted in avail[]. */
+static atomic_t pcp_avail[MAX_NUMNODES][NR_ZONES];
+static atomic_t total_pcp_pages;
+
+static bool pcp_drain_all(void);
+static struct page_info *pcp_alloc_page(unsigned int zone_lo,
+                                        unsigned int zone_hi,
+                                        unsigned int memflags,
+                                        struct domain *d);
+
 /* TMEM: Reserve a fraction of memory for mid-size (0<order<9) allocations.*/
 static long midsize_alloc_zone_pages;
 #define MIDSIZE_ALLOC_FRAC 128
@@ -453,6 +489,10 @@ int domain_set_outstanding_pages(struct domain *d, unsigned long pages)
     int ret = -ENOMEM;
     unsigned long claim, avail_pages;
 
+    /* Pages in the per-CPU caches can't be claimed: give them back first. */
+    if ( pages )
+        pcp_drain_all();
+
     /*
      * take the domain's page_alloc_lock, else all d->tot_page adjustments
      * must always take the global heap_lock rather than only in the much
@@ -869,6 +909,220 @@ static struct page_info *get_free_buddy(unsigned int zone_lo,
     }
 }
 
+/*
+ * Superpage pool.
+ *
+ * If requested, we keep a number of 1G chunks aside on each node, for the
+ * guest superpage allocations (MEMF_superpage) that would otherwise have
+ * to fall back to smaller pages when memory gets fragmented. The pool is
+ * filled at boot and, when it is below target, topped up from clean 1G (or
+ * larger) chunks as they form in the heap, either because of merging on
+ * free or because scrubbing completed.
+ *
+ * Chunks in the pool are free pages, and remain accounted in avail[]: they
+ * are only held back for as long as memory can be found elsewhere, and get
+ * broken up for any allocation which would otherwise fail.  Their head is
+ * on spool[node] (rather than on a heap list) and has PFN_ORDER set to
+ * SPOOL_ORDER_NONE, so that the buddy merging logic never considers it.
+ * Everything is protected by heap_lock.
+ */
+#define SPOOL_ORDER      (30 - PAGE_SHIFT)
+#define SPOOL_ORDER_NONE (~0U)
+
+static unsigned int __read_mostly spool_target;
+static unsigned int spool_nr[MAX_NUMNODES];
+static struct page_list_head spool[MAX_NUMNODES];
+
+/*
+ * Put (the first 1G of) a clean free chunk, which is not on any heap list,
+ * in the pool. If it doesn't need it, the chunk is left alone.
+ */
+static bool spool_absorb(struct page_info *pg, unsigned int node,
+                         unsigned int zone, unsigned int order)
+{
+    ASSERT(spin_is_locked(&heap_lock));
+
+    if ( order < SPOOL_ORDER || spool_nr[node] >= spool_target ||
+         !zone_above_dma(zone) )
+        return false;
+
+    ASSERT(pg->u.free.first_dirty == INVALID_DIRTY_IDX);
+
+    /* Give back what's above the first 1G. */
+    while ( order > SPOOL_ORDER )
+    {
+        order--;
+        page_list_add_scrub(pg + (1UL << order), node, zone, order,
+                            INVALID_DIRTY_IDX);
+    }
+
+    PFN_ORDER(pg) = SPOOL_ORDER_NONE;
+    pg->u.free.scrub_state = BUDDY_NOT_SCRUBBING;
+    page_list_add_tail(pg, &spool[node]);
+    spool_nr[node]++;
+
+    return true;
+}
+
+/* Take a chunk out of the pool, making it a regular 1G free buddy again. */
+static void spool_release(struct page_info *pg, unsigned int node)
+{
+    ASSERT(spin_is_locked(&heap_lock));
+    ASSERT(PFN_ORDER(pg) == SPOOL_ORDER_NONE);
+
+    page_list_del(pg, &spool[node]);
+    spool_nr[node]--;
+    PFN_ORDER(pg) = SPOOL_ORDER;
+}
+
+static struct page_info *spool_take(unsigned int node, unsigned int zone_lo,
+                                    unsigned int zone_hi)
+{
+    struct page_info *pg;
+
+    if ( node >= MAX_NUMNODES || !spool_nr[node] )
+        return NULL;
+
+    page_list_for_each ( pg, &spool[node] )
+    {
+        unsigned int zone = page_to_zone(pg);
+
+        if ( zone >= zone_lo && zone <= zone_hi )
+        {
+            spool_release(pg, node);
+            return pg;
+        }
+    }
+
+    return NULL;
+}
+
+/* Find a 1G chunk for a superpage allocation. */
+static struct page_info *spool_get(unsigned int zone_lo, unsigned int zone_hi,
+                                   unsigned int memflags,
+                                   const struct domain *d)
+{
+    nodeid_t node, req_node = MEMF_get_node(memflags);
+    nodemask_t nodemask = d ? d->node_affinity : node_online_map;
+    struct page_info *pg;
+
+    if ( !spool_target )
+        return NULL;
+
+    if ( req_node == NUMA_NO_NODE )
+    {
+        /* Prefer the local node, if the domain can have memory there. */
+        req_node = cpu_to_node(smp_processor_id());
+        if ( !node_isset(req_node, nodemask) )
+            req_node = NUMA_NO_NODE;
+    }
+    else if ( memflags & MEMF_exact_node )
+        return spool_take(req_node, zone_lo, zone_hi);
+
+    if ( (pg = spool_take(req_node, zone_lo, zone_hi)) != NULL )
+        return pg;
+
+    for_each_node_mask ( node, nodemask )
+        if ( (pg = spool_take(node, zone_lo, zone_hi)) != NULL )
+            return pg;
+
+    return NULL;
+}
+
+/* Put a 1G chunk back on the heap lists, for a request it can serve. */
+static bool spool_return(unsigned int zone_lo, unsigned int zone_hi,
+                         unsigned int memflags, const struct domain *d)
+{
+    struct page_info *pg = spool_get(zone_lo, zone_hi, memflags, d);
+
+    if ( !pg )
+        return false;
+
+    page_list_add_scrub(pg, phys_to_nid(page_to_maddr(pg)), page_to_zone(pg),
+                        SPOOL_ORDER, INVALID_DIRTY_IDX);
+
+    return true;
+}
+
+/* Find the pool chunk @pg belongs to, if any, and give it back to the heap. */
+static struct page_info *spool_find_and_release(struct page_info *pg)
+{
+    unsigned int node = phys_to_nid(page_to_maddr(pg));
+    unsigned int zone = page_to_zone(pg);
+    struct page_info *head;
+
+    if ( !spool_target )
+        return NULL;
+
+    page_list_for_each ( head, &spool[node] )
+        if ( head <= pg && head + (1UL << SPOOL_ORDER) > pg )
+        {
+            spool_release(head, node);
+            page_list_add_scrub(head, node, zone, SPOOL_ORDER,
+                                INVALID_DIRTY_IDX);
+            return head;
+        }
+
+    return NULL;
+}
+
+static void __init spool_init(void)
+{
+    unsigned int node, zone, order;
+    struct page_info *pg, *tmp;
+
+    for ( node = 0; node < MAX_NUMNODES; node++ )
+        INIT_PAGE_LIST_HEAD(&spool[node]);
+
+    BUILD_BUG_ON(SPOOL_ORDER > MAX_ORDER);
+    if ( !opt_superpage_pool )
+        return;
+
+    spin_lock(&heap_lock);
+
+    spool_target = opt_superpage_pool;
+    for_each_online_node ( node )
+    {
+        if ( !avail[node] )
+            continue;
+
+        for ( zone = NR_ZONES - 1; zone_above_dma(zone); zone-- )
+            for ( order = MAX_ORDER; order >= SPOOL_ORDER; order-- )
+                page_list_for_each_safe ( pg, tmp, &heap(node, zone, order) )
+                {
+                    /* Unscrubbed pages are always at the end of the list. */
+                    if ( spool_nr[node] >= spool_target ||
+                         pg->u.free.first_dirty != INVALID_DIRTY_IDX )
+                        break;
+
+                    page_list_del(pg, &heap(node, zone, order));
+                    spool_absorb(pg, node, zone, order);
+                }
+
+        printk(XENLOG_INFO "Superpage pool: node %u has %u of %u 1G pages\n",
+               node, spool_nr[node], spool_target);
+    }
+
+    spin_unlock(&heap_lock);
+}
+
+void get_superpage_pool(uint64_t *pages, uint64_t *target_pages)
+{
+    unsigned int node;
+
+    *pages = *target_pages = 0;
+
+    spin_lock(&heap_lock);
+    for_each_online_node ( node )
+    {
+        if ( !avail[node] )
+            continue;
+        *pages += (uint64_t)spool_nr[node] << SPOOL_ORDER;
+        *target_pages += (uint64_t)spool_target << SPOOL_ORDER;
+    }
+    spin_unlock(&heap_lock);
+}
+
 /* Allocate 2^@order contiguous pages. */
 static struct page_info *alloc_heap_pages(
     unsigned int zone_lo, unsigned int zone_hi,
@@ -882,6 +1136,7 @@ static struct page_info *alloc_heap_pages(
     bool need_tlbflush = false;
     uint32_t tlbflush_timestamp = 0;
     unsigned int dirty_cnt = 0;
+    bool drained = false;
 
     /* Make sure there are enough bits in memflags for nodeID. */
     BUILD_BUG_ON((_MEMF_bits - _MEMF_node) < (8 * sizeof(nodeid_t)));
@@ -892,6 +1147,10 @@ static struct page_info *alloc_heap_pages(
     if ( unlikely(order > MAX_ORDER) )
         return NULL;
 
+    if ( order == 0 && (pg = pcp_alloc_page(zone_lo, zone_hi, memflags, d)) )
+        return pg;
+
+ retry:
     spin_lock(&heap_lock);
 
     /*
@@ -904,6 +1163,8 @@ static struct page_info *alloc_heap_pages(
            !d || d->outstanding_pages < request) )
     {
         spin_unlock(&heap_lock);
+        if ( !drained && (drained = pcp_drain_all()) )
+            goto retry;
         return NULL;
     }
 
@@ -924,14 +1185,24 @@ static struct page_info *alloc_heap_pages(
     }
 
     pg = get_free_buddy(zone_lo, zone_hi, order, memflags, d);
+    /* For superpages, the pool is better than a dirty buddy. */
+    if ( !pg && order == SPOOL_ORDER && (memflags & MEMF_superpage) )
+        pg = spool_get(zone_lo, zone_hi, memflags, d);
     /* Try getting a dirty buddy if we couldn't get a clean one. */
     if ( !pg && !(memflags & MEMF_no_scrub) )
         pg = get_free_buddy(zone_lo, zone_hi, order,
                             memflags | MEMF_no_scrub, d);
+    /* The pool is part of the available memory: break a chunk up if need be. */
+    if ( !pg && order <= SPOOL_ORDER &&
+         spool_return(zone_lo, zone_hi, memflags, d) )
+        pg = get_free_buddy(zone_lo, zone_hi, order, memflags, d);
     if ( !pg )
     {
-        /* No suitable memory blocks. Fail the request. */
         spin_unlock(&heap_lock);
+        /* Give the pages cached on all pCPUs back to the heap, and retry. */
+        if ( !drained && (drained = pcp_drain_all()) )
+            goto retry;
+        /* No suitable memory blocks. Fail the request. */
         return NULL;
     }
 
@@ -1021,6 +1292,8 @@ static struct page_info *alloc_heap_pages(
         {
             spin_lock(&heap_lock);
             node_need_scrub[node] -= dirty_cnt;
+            if ( !(memflags & MEMF_no_scrub) )
+                scrub_stats[node].alloc_pages += dirty_cnt;
             spin_unlock(&heap_lock);
         }
     }
@@ -1241,6 +1514,7 @@ bool scrub_free_pages(void)
             {
                 unsigned int i, dirty_cnt;
                 struct scrub_wait_state st;
+                s_time_t start;
 
                 /* Unscrubbed pages are always at the end of the list. */
                 pg = page_list_last(&heap(node, zone, order));
@@ -1253,6 +1527,7 @@ bool scrub_free_pages(void)
                 spin_unlock(&heap_lock);
 
                 dirty_cnt = 0;
+                start = NOW();
 
                 for ( i = pg->u.free.first_dirty; i < (1U << order); i++)
                 {
@@ -1282,6 +1557,8 @@ bool scrub_free_pages(void)
 
                         spin_lock(&heap_lock);
                         node_need_scrub[node] -= dirty_cnt;
+                        scrub_stats[node].idle_pages += dirty_cnt;
+                        scrub_stats[node].idle_time += NOW() - start;
                         spin_unlock(&heap_lock);
                         goto out_nolock;
                     }
@@ -1309,9 +1586,12 @@ bool scrub_free_pages(void)
                 st.first_dirty = (i >= (1U << order) - 1) ?
                     INVALID_DIRTY_IDX : i + 1;
                 st.drop = false;
+                start = NOW() - start;
                 spin_lock_cb(&heap_lock, scrub_continue, &st);
 
                 node_need_scrub[node] -= dirty_cnt;
+                scrub_stats[node].idle_pages += dirty_cnt;
+                scrub_stats[node].idle_time += start;
 
                 if ( st.drop )
                     goto out;
@@ -1319,7 +1599,10 @@ bool scrub_free_pages(void)
                 if ( i >= (1U << order) - 1 )
                 {
                     page_list_del(pg, &heap(node, zone, order));
-                    page_list_add_scrub(pg, node, zone, order, INVALID_DIRTY_IDX);
+                    pg->u.free.first_dirty = INVALID_DIRTY_IDX;
+                    if ( !spool_absorb(pg, node, zone, order) )
+                        page_list_add_scrub(pg, node, zone, order,
+                                            INVALID_DIRTY_IDX);
                 }
                 else
                     pg->u.free.first_dirty = i + 1;
@@ -1340,8 +1623,8 @@ bool scrub_free_pages(void)
     return node_to_scrub(false) != NUMA_NO_NODE;
 }
 
-/* Free 2^@order set of pages. */
-static void free_heap_pages(
+/* Free 2^@order set of pages. The caller must hold heap_lock. */
+static void __free_heap_pages(
     struct page_info *pg, unsigned int order, bool need_scrub)
 {
     unsigned long mask, mfn = page_to_mfn(pg);
@@ -1350,8 +1633,7 @@ static void free_heap_pages(
 
     ASSERT(order <= MAX_ORDER);
     ASSERT(node >= 0);
-
-    spin_lock(&heap_lock);
+    ASSERT(spin_is_locked(&heap_lock));
 
     for ( i = 0; i < (1 << order); i++ )
     {
@@ -1451,14 +1733,323 @@ static void free_heap_pages(
         order++;
     }
 
-    page_list_add_scrub(pg, node, zone, order, pg->u.free.first_dirty);
-
     if ( tainted )
+    {
+        page_list_add_scrub(pg, node, zone, order, pg->u.free.first_dirty);
         reserve_offlined_page(pg);
+    }
+    else if ( pg->u.free.first_dirty != INVALID_DIRTY_IDX ||
+              !spool_absorb(pg, node, zone, order) )
+        page_list_add_scrub(pg, node, zone, order, pg->u.free.first_dirty);
+}
+
+/* Free 2^@order set of pages. */
+static void free_heap_pages(
+    struct page_info *pg, unsigned int order, bool need_scrub)
+{
+    spin_lock(&heap_lock);
+    __free_heap_pages(pg, order, need_scrub);
+    spin_unlock(&heap_lock);
+}
 
+/*
+ * Per-CPU page caches.
+ *
+ * Each pCPU keeps a small LIFO of order-0 pages of its own node, so that
+ * most single page allocations and frees do not have to take heap_lock.
+ * The cache is refilled from the buddy allocator 2^PCP_BATCH_ORDER pages at
+ * a time, and in batches of the same size it gives pages back when it grows
+ * beyond opt_percpu_pages.
+ *
+ * Pages in a cache are in state inuse, with a zero reference count and no
+ * owner, so that nothing else can merge, scrub or hand them out. Their
+ * u.free fields and tlbflush_timestamp are maintained the same way they are
+ * for free pages, and PGC_need_scrub tells whether they still need
+ * scrubbing (which then happens when they leave the cache). They are not
+ * accounted in avail[], but in pcp_avail[] instead.
+ *
+ * The caches are bypassed while there are outstanding claims (claims are
+ * checked against free memory in the buddy allocator, and staking one empties
+ * the caches) and when tmem is in use. They are emptied before giving up on
+ * an allocation, and before offlining a page.
+ */
+#define PCP_BATCH_ORDER 4
+#define PCP_BATCH       (1U << PCP_BATCH_ORDER)
+
+struct pcp_pages {
+    spinlock_t lock;
+    unsigned int count;
+    struct page_list_head list;
+};
+static DEFINE_PER_CPU(struct pcp_pages, pcp_pages);
+static bool __read_mostly pcp_enabled;
+
+static bool pcp_usable(unsigned int zone)
+{
+    return pcp_enabled && !tmem_enabled() && zone_above_dma(zone);
+}
+
+static void pcp_account(const struct page_info *pg, int nr)
+{
+    atomic_add(nr, &pcp_avail[phys_to_nid(page_to_maddr(pg))][page_to_zone(pg)]);
+    atomic_add(nr, &total_pcp_pages);
+}
+
+/* Give a list of pages taken out of some pCPU's cache back to the heap. */
+static void pcp_drain_list(struct page_list_head *list)
+{
+    struct page_info *pg, *tmp;
+
+    spin_lock(&heap_lock);
+    page_list_for_each_safe ( pg, tmp, list )
+    {
+        /*
+         * __free_heap_pages() only knows how to compute this for pages which
+         * still have an owner.  Carry over what was recorded when the page
+         * entered the cache (tlbflush_timestamp is left alone), so that the
+         * allocation handing it out again does the filtered flush, if any.
+         */
+        bool need_tlbflush = pg->u.free.need_tlbflush;
+
+        page_list_del(pg, list);
+        pcp_account(pg, -1);
+        __free_heap_pages(pg, 0, test_bit(_PGC_need_scrub, &pg->count_info));
+        pg->u.free.need_tlbflush = need_tlbflush;
+    }
     spin_unlock(&heap_lock);
 }
 
+static bool pcp_drain_cpu(unsigned int cpu)
+{
+    struct pcp_pages *pcp = &per_cpu(pcp_pages, cpu);
+    PAGE_LIST_HEAD(list);
+
+    spin_lock(&pcp->lock);
+    page_list_splice(&pcp->list, &list);
+    INIT_PAGE_LIST_HEAD(&pcp->list);
+    pcp->count = 0;
+    spin_unlock(&pcp->lock);
+
+    if ( page_list_empty(&list) )
+        return false;
+
+    pcp_drain_list(&list);
+
+    return true;
+}
+
+/* Empty all the caches. Returns whether any page went back to the heap. */
+static bool pcp_drain_all(void)
+{
+    unsigned int cpu;
+    bool drained = false;
+
+    if ( !pcp_enabled || !atomic_read(&total_pcp_pages) )
+        return false;
+
+    for_each_online_cpu ( cpu )
+        drained |= pcp_drain_cpu(cpu);
+
+    return drained;
+}
+
+static struct page_info *pcp_alloc_page(unsigned int zone_lo,
+                                        unsigned int zone_hi,
+                                        unsigned int memflags,
+                                        struct domain *d)
+{
+    unsigned int i, cpu = smp_processor_id();
+    nodeid_t node = cpu_to_node(cpu), req_node = MEMF_get_node(memflags);
+    struct pcp_pages *pcp = &per_cpu(pcp_pages, cpu);
+    struct page_info *pg;
+    bool empty, need_tlbflush = false;
+    uint32_t tlbflush_timestamp = 0;
+
+    if ( !pcp_usable(zone_lo) || ACCESS_ONCE(outstanding_claims) )
+        return NULL;
+
+    if ( req_node == NUMA_NO_NODE ?
+         d && !node_isset(node, d->node_affinity) : req_node != node )
+        return NULL;
+
+    spin_lock(&pcp->lock);
+    pg = page_list_first(&pcp->list);
+    empty = !pg;
+    if ( pg && page_to_zone(pg) >= zone_lo && page_to_zone(pg) <= zone_hi )
+    {
+        page_list_del(pg, &pcp->list);
+        pcp->count--;
+    }
+    else
+        pg = NULL;
+    spin_unlock(&pcp->lock);
+
+    if ( !pg )
+    {
+        /*
+         * Refill from the heap. All the pages come back scrubbed and with TLBs
+         * flushed already, so the one we return needs no further work.
+         */
+        if ( empty &&
+             (pg = alloc_heap_pages(zone_lo, zone_hi, PCP_BATCH_ORDER,
+                                    MEMF_node(node) | MEMF_exact_node,
+                                    NULL)) != NULL )
+        {
+            for ( i = 1; i < PCP_BATCH; i++ )
+                pg[i].u.free.need_tlbflush = false;
+
+            spin_lock(&pcp->lock);
+            for ( i = PCP_BATCH - 1; i > 0; i-- )
+                page_list_add(&pg[i], &pcp->list);
+            pcp->count += PCP_BATCH - 1;
+            spin_unlock(&pcp->lock);
+            pcp_account(pg, PCP_BATCH - 1);
+
+            if ( d != NULL )
+                d->last_alloc_node = node;
+        }
+
+        return pg;
+    }
+
+    pcp_account(pg, -1);
+
+    /* Don't hand out pages that got broken or offlined while cached. */
+    if ( unlikely((pg->count_info & ~PGC_need_scrub) != PGC_state_inuse) )
+    {
+        free_heap_pages(pg, 0, test_bit(_PGC_need_scrub, &pg->count_info));
+        return NULL;
+    }
+
+    if ( d != NULL )
+        d->last_alloc_node = node;
+
+    if ( !(memflags & MEMF_no_tlbflush) )
+        accumulate_tlbflush(&need_tlbflush, pg, &tlbflush_timestamp);
+
+    pg->u.inuse.type_info = 0;
+
+    if ( test_bit(_PGC_need_scrub, &pg->count_info) )
+    {
+        if ( !(memflags & MEMF_no_scrub) )
+            scrub_one_page(pg);
+        clear_bit(_PGC_need_scrub, &pg->count_info);
+    }
+    else if ( scrub_debug && !(memflags & MEMF_no_scrub) )
+        check_one_page(pg);
+
+    flush_page_to_ram(page_to_mfn(pg), !(memflags & MEMF_no_icache_flush));
+
+    if ( need_tlbflush )
+        filtered_flush_tlb_mask(tlbflush_timestamp);
+
+    return pg;
+}
+
+/* Try to put a page being freed in the local cache. */
+static bool pcp_free_page(struct page_info *pg, bool need_scrub)
+{
+    unsigned int i, cpu = smp_processor_id();
+    struct pcp_pages *pcp = &per_cpu(pcp_pages, cpu);
+    unsigned long x = pg->count_info;
+    PAGE_LIST_HEAD(list);
+
+    if ( !pcp_usable(page_to_zone(pg)) ||
+         phys_to_nid(page_to_maddr(pg)) != cpu_to_node(cpu) )
+        return false;
+
+    /*
+     * Leave the corner cases (see free_heap_pages()), as well as broken and
+     * offlining pages, to the heap. Racing with mark_page_offline() means the
+     * page should go there too.
+     */
+    if ( (x & (PGC_state | PGC_broken | PGC_count_mask)) != PGC_state_inuse ||
+         cmpxchg(&pg->count_info, x,
+                 PGC_state_inuse | (need_scrub ? PGC_need_scrub : 0)) != x )
+        return false;
+
+    /* If a page has no owner it will need no safety TLB flush. */
+    pg->u.free.need_tlbflush = (page_get_owner(pg) != NULL);
+    if ( pg->u.free.need_tlbflush )
+        page_set_tlbflush_timestamp(pg);
+
+    /* This page is not a guest frame any more. */
+    page_set_owner(pg, NULL); /* set_gpfn_from_mfn snoops pg owner */
+    set_gpfn_from_mfn(page_to_mfn(pg), INVALID_M2P_ENTRY);
+
+    if ( need_scrub )
+        poison_one_page(pg);
+
+    pcp_account(pg, 1);
+
+    spin_lock(&pcp->lock);
+    page_list_add(pg, &pcp->list);
+    if ( ++pcp->count > opt_percpu_pages )
+    {
+        /* Give back the coldest pages. */
+        for ( i = 0; i < PCP_BATCH; i++ )
+        {
+            struct page_info *cold = page_list_last(&pcp->list);
+
+            page_list_del(cold, &pcp->list);
+            page_list_add(cold, &list);
+        }
+        pcp->count -= PCP_BATCH;
+    }
+    spin_unlock(&pcp->lock);
+
+    if ( !page_list_empty(&list) )
+        pcp_drain_list(&list);
+
+    return true;
+}
+
+static int pcp_cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct pcp_pages *pcp = &per_cpu(pcp_pages, cpu);
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        spin_lock_init(&pcp->lock);
+        INIT_PAGE_LIST_HEAD(&pcp->list);
+        pcp->count = 0;
+        break;
+    case CPU_UP_CANCELED:
+    case CPU_DEAD:
+        pcp_drain_cpu(cpu);
+        break;
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block pcp_cpu_nfb = {
+    .notifier_call = pcp_cpu_callback
+};
+
+static int __init pcp_presmp_init(void)
+{
+    void *cpu = (void *)(long)smp_processor_id();
+
+    if ( !opt_percpu_pages )
+        return 0;
+
+    if ( opt_percpu_pages < 2 * PCP_BATCH )
+        opt_percpu_pages = 2 * PCP_BATCH;
+
+    pcp_cpu_callback(&pcp_cpu_nfb, CPU_UP_PREPARE, cpu);
+    register_cpu_notifier(&pcp_cpu_nfb);
+    pcp_enabled = true;
+
+    return 0;
+}
+presmp_initcall(pcp_presmp_init);
+
 
 /*
  * Following rules applied for page offline:
@@ -1515,6 +2106,10 @@ static int reserve_heap_page(struct page_info *pg)
         }
     }
 
+    /* The page may be in the superpage pool instead. */
+    if ( (head = spool_find_and_release(pg)) != NULL )
+        return reserve_offlined_page(head);
+
     return -EINVAL;
 
 }
@@ -1565,6 +2160,9 @@ int offline_page(unsigned long mfn, int broken, uint32_t *status)
         return 0;
     }
 
+    /* The page may be sitting in a per-CPU cache: give it back to the heap. */
+    pcp_drain_all();
+
     spin_lock(&heap_lock);
 
     old_info = mark_page_offline(pg, broken);
@@ -1774,7 +2372,8 @@ static unsigned long avail_heap_pages(
             continue;
         for ( zone = zone_lo; zone <= zone_hi; zone++ )
             if ( (node == -1) || (node == i) )
-                free_pages += avail[i][zone];
+                free_pages += avail[i][zone] +
+                              atomic_read(&pcp_avail[i][zone]);
     }
 
     return free_pages;
@@ -1782,7 +2381,8 @@ static unsigned long avail_heap_pages(
 
 unsigned long total_free_pages(void)
 {
-    return total_avail_pages - midsize_alloc_zone_pages;
+    return total_avail_pages + atomic_read(&total_pcp_pages) -
+           midsize_alloc_zone_pages;
 }
 
 void __init end_boot_allocator(void)
@@ -2033,6 +2633,8 @@ void __init heap_init_late(void)
 
     if ( opt_bootscrub )
         scrub_heap_pages();
+
+    spool_init();
 }
 
 
@@ -2146,7 +2748,8 @@ void free_xenheap_pages(void *v, unsigned int order)
     for ( i = 0; i < (1u << order); i++ )
         pg[i].count_info &= ~PGC_xen_heap;
 
-    free_heap_pages(pg, order, true);
+    if ( order || !pcp_free_page(pg, true) )
+        free_heap_pages(pg, order, true);
 }
 
 #endif
@@ -2323,7 +2926,8 @@ void free_domheap_pages(struct page_info *pg, unsigned int order)
             scrub = 1;
         }
 
-        free_heap_pages(pg, order, scrub);
+        if ( order || !pcp_free_page(pg, scrub) )
+            free_heap_pages(pg, order, scrub);
     }
 
     if ( drop_dom_ref )
@@ -2382,6 +2986,8 @@ static void pagealloc_info(unsigned char key)
     }
 
     printk("    Dom heap: %lukB free\n", total << (PAGE_SHIFT-10));
+    printk("    of which in per-CPU caches: %ukB\n",
+           atomic_read(&total_pcp_pages) << (PAGE_SHIFT-10));
 }
 
 static __init int pagealloc_keyhandler_init(void)
@@ -2426,9 +3032,20 @@ static void dump_heap(unsigned char key)
 
     for ( i = 0; i < MAX_NUMNODES; i++ )
     {
-        if ( !node_need_scrub[i] )
+        unsigned long ms;
+
+        if ( node_need_scrub[i] )
+            printk("Node %d has %lu unscrubbed pages\n", i, node_need_scrub[i]);
+
+        if ( !scrub_stats[i].idle_pages && !scrub_stats[i].alloc_pages )
             continue;
-        printk("Node %d has %lu unscrubbed pages\n", i, node_need_scrub[i]);
+
+        ms = scrub_stats[i].idle_time / MILLISECS(1);
+        printk("Node %d scrubbed %lu pages while idle, in %lums (%luMB/s),"
+               " and %lu pages on allocation\n",
+               i, scrub_stats[i].idle_pages, ms,
+               ms ? (scrub_stats[i].idle_pages << (PAGE_SHIFT - 10)) / ms : 0,
+               scrub_stats[i].alloc_pages);
     }
 }
 
@@ -1,5 +1,7 @@
 
 #include <xen/lib.h>
+#include <xen/cpu.h>
+#include <xen/init.h>
 #include <xen/smp.h>
 #include <xen/time.h>
 #include <xen/perfc.h>
@@ -27,6 +29,123 @@ static const struct {
 #define NR_PERFCTRS (sizeof(perfc_info) / sizeof(perfc_info[0]))
 
 DEFINE_PER_CPU(perfc_t[NUM_PERFCOUNTERS], perfcounters);
+DEFINE_PER_CPU(long, perfc_shift);
+
+static bool __initdata opt_perfc_shared;
+boolean_param("perfc_shared", opt_perfc_shared);
+
+/* Layout info of the shared counter pages, NULL if there are none. */
+static struct xen_sysctl_perfc_shared *perfc_shared;
+static unsigned int perfc_shared_order;
+
+static perfc_t *perfc_shared_counters(unsigned int cpu)
+{
+    const uint64_t *mfn = (void *)perfc_shared + perfc_shared->mfn_offset;
+
+    return mfn_to_virt(mfn[cpu]);
+}
+
+static int cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+
+    /*
+     * The per-CPU area was (re-)initialised by now, and the CPU isn't
+     * running yet.  Counts from an earlier time the CPU was online are
+     * retained in the shared pages.
+     */
+    if ( action == CPU_UP_PREPARE )
+        per_cpu(perfc_shift, cpu) = (char *)perfc_shared_counters(cpu) -
+                                    (char *)per_cpu(perfcounters, cpu);
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cpu_nfb = {
+    .notifier_call = cpu_callback
+};
+
+static int __init perfc_shared_init(void)
+{
+    struct xen_sysctl_perfc_shared *info;
+    unsigned int i, cpu, order, info_order, mfn_offset;
+    uint32_t *nr_slots;
+    uint64_t *mfn;
+    perfc_t *counters;
+    unsigned long flags;
+
+    if ( !opt_perfc_shared )
+        return 0;
+
+    order = get_order_from_bytes(sizeof(this_cpu(perfcounters)));
+    mfn_offset = ROUNDUP(sizeof(*info) + NR_PERFCTRS * sizeof(*nr_slots),
+                         sizeof(*mfn));
+    info_order = get_order_from_bytes(mfn_offset + nr_cpu_ids * sizeof(*mfn));
+
+    info = alloc_xenheap_pages(info_order, 0);
+    if ( !info )
+        goto nomem;
+    memset(info, 0, PAGE_SIZE << info_order);
+
+    info->nr_counters = NR_PERFCTRS;
+    info->nr_cpus = nr_cpu_ids;
+    info->cpu_frames = 1U << order;
+    info->mfn_offset = mfn_offset;
+
+    nr_slots = (uint32_t *)(info + 1);
+    for ( i = 0; i < NR_PERFCTRS; i++ )
+        nr_slots[i] = (perfc_info[i].type == TYPE_ARRAY ||
+                       perfc_info[i].type == TYPE_S_ARRAY)
+                      ? perfc_info[i].nr_elements : 1;
+
+    mfn = (void *)info + mfn_offset;
+    for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+    {
+        counters = alloc_xenheap_pages(order, 0);
+        if ( !counters )
+            goto nomem;
+        memset(counters, 0, PAGE_SIZE << order);
+        mfn[cpu] = virt_to_mfn(counters);
+    }
+
+    for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+        for ( i = 0; i < (1U << order); i++ )
+            share_xen_page_with_privileged_guests(
+                mfn_to_page(mfn[cpu] + i), XENSHARE_readonly);
+    for ( i = 0; i < (1U << info_order); i++ )
+        share_xen_page_with_privileged_guests(
+            virt_to_page(info) + i, XENSHARE_readonly);
+
+    perfc_shared = info;
+    perfc_shared_order = info_order;
+
+    /* Only the boot CPU is up: move what it counted so far over. */
+    counters = perfc_shared_counters(smp_processor_id());
+    local_irq_save(flags);
+    memcpy(counters, this_cpu(perfcounters), sizeof(this_cpu(perfcounters)));
+    this_cpu(perfc_shift) = (char *)counters - (char *)this_cpu(perfcounters);
+    local_irq_restore(flags);
+
+    register_cpu_notifier(&cpu_nfb);
+
+    printk("perfc: counters shared with privileged domains\n");
+
+    return 0;
+
+ nomem:
+    printk(XENLOG_WARNING "perfc: can't allocate shared counter pages\n");
+    if ( info )
+    {
+        for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+            if ( mfn[cpu] )
+                free_xenheap_pages(mfn_to_virt(mfn[cpu]), order);
+        free_xenheap_pages(info, info_order);
+    }
+
+    return -ENOMEM;
+}
+presmp_initcall(perfc_shared_init);
 
 void perfc_printall(unsigned char key)
 {
@@ -47,7 +166,7 @@ void perfc_printall(unsigned char key)
         case TYPE_SINGLE:
         case TYPE_S_SINGLE:
             for_each_online_cpu ( cpu )
-                sum += per_cpu(perfcounters, cpu)[j];
+                sum += per_cpu_perfc(cpu)[j];
             if ( perfc_info[i].type == TYPE_S_SINGLE ) 
                 sum = (perfc_t) sum;
             printk("TOTAL[%12Lu]", sum);
@@ -58,7 +177,7 @@ void perfc_printall(unsigned char key)
                 {
                     if ( k > 0 && (k % 4) == 0 )
                         printk("\n%53s", "");
-                    printk("  CPU%02u[%10"PRIperfc"u]", cpu, per_cpu(perfcounters, cpu)[j]);
+                    printk("  CPU%02u[%10"PRIperfc"u]", cpu, per_cpu_perfc(cpu)[j]);
                     ++k;
                 }
             }
@@ -68,7 +187,7 @@ void perfc_printall(unsigned char key)
         case TYPE_S_ARRAY:
             for_each_online_cpu ( cpu )
             {
-                perfc_t *counters = per_cpu(perfcounters, cpu) + j;
+                perfc_t *counters = per_cpu_perfc(cpu) + j;
 
                 for ( k = 0; k < perfc_info[i].nr_elements; k++ )
                     sum += counters[k];
@@ -83,7 +202,7 @@ void perfc_printall(unsigned char key)
                 {
                     sum = 0;
                     for_each_online_cpu ( cpu )
-                        sum += per_cpu(perfcounters, cpu)[j + k];
+                        sum += per_cpu_perfc(cpu)[j + k];
                     if ( perfc_info[i].type == TYPE_S_ARRAY ) 
                         sum = (perfc_t) sum;
                     if ( (k % 4) == 0 )
@@ -94,7 +213,7 @@ void perfc_printall(unsigned char key)
                 k = 0;
                 for_each_online_cpu ( cpu )
                 {
-                    perfc_t *counters = per_cpu(perfcounters, cpu) + j;
+                    perfc_t *counters = per_cpu_perfc(cpu) + j;
                     unsigned int n;
 
                     sum = 0;
@@ -135,13 +254,13 @@ void perfc_reset(unsigned char key)
         {
         case TYPE_SINGLE:
             for_each_online_cpu ( cpu )
-                per_cpu(perfcounters, cpu)[j] = 0;
+                per_cpu_perfc(cpu)[j] = 0;
         case TYPE_S_SINGLE:
             ++j;
             break;
         case TYPE_ARRAY:
             for_each_online_cpu ( cpu )
-                memset(per_cpu(perfcounters, cpu) + j, 0,
+                memset(per_cpu_perfc(cpu) + j, 0,
                        perfc_info[i].nr_elements * sizeof(perfc_t));
         case TYPE_S_ARRAY:
             j += perfc_info[i].nr_elements;
@@ -212,7 +331,7 @@ static int perfc_copy_info(XEN_GUEST_HANDLE_64(xen_sysctl_perfc_desc_t) desc,
         case TYPE_SINGLE:
         case TYPE_S_SINGLE:
             for_each_cpu ( cpu, &perfc_cpumap )
-                perfc_vals[v++] = per_cpu(perfcounters, cpu)[j];
+                perfc_vals[v++] = per_cpu_perfc(cpu)[j];
             ++j;
             break;
         case TYPE_ARRAY:
@@ -220,7 +339,7 @@ static int perfc_copy_info(XEN_GUEST_HANDLE_64(xen_sysctl_perfc_desc_t) desc,
             memset(perfc_vals + v, 0, perfc_d[i].nr_vals * sizeof(*perfc_vals));
             for_each_cpu ( cpu, &perfc_cpumap )
             {
-                perfc_t *counters = per_cpu(perfcounters, cpu) + j;
+                perfc_t *counters = per_cpu_perfc(cpu) + j;
                 unsigned int k;
 
                 for ( k = 0; k < perfc_d[i].nr_vals; k++ )
@@ -259,6 +378,17 @@ int perfc_control(struct xen_sysctl_perfc_op *pc)
         rc = perfc_copy_info(pc->desc, pc->val);
         break;
 
+    case XEN_SYSCTL_PERFCOP_shared:
+        if ( !perfc_shared )
+        {
+            rc = -EOPNOTSUPP;
+            break;
+        }
+        pc->info_mfn = virt_to_mfn(perfc_shared);
+        pc->info_frames = 1U << perfc_shared_order;
+        rc = 0;
+        break;
+
     default:
         rc = -EINVAL;
         break;
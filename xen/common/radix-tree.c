@@ -721,6 +721,10 @@ void radix_tree_init(struct radix_tree_root *root)
 	root->node_free = rcu_node_free;
 }
 
+/*
+ * A tree with these callbacks can only be looked up locklessly if node_free
+ * defers freeing the node until after an RCU grace period.
+ */
 void radix_tree_set_alloc_callbacks(
 	struct radix_tree_root *root,
 	radix_tree_alloc_fn_t *node_alloc,
@@ -10,11 +10,12 @@
 #include <xen/sched.h>
 #include <xen/errno.h>
 #include <xen/rangeset.h>
+#include <xen/rbtree.h>
 #include <xsm/xsm.h>
 
-/* An inclusive range [s,e] and pointer to next range in ascending order. */
+/* An inclusive range [s,e], and its node in the tree ordered by s. */
 struct range {
-    struct list_head list;
+    struct rb_node node;
     unsigned long s, e;
 };
 
@@ -23,8 +24,8 @@ struct rangeset {
     struct list_head rangeset_list;
     struct domain   *domain;
 
-    /* Ordered list of ranges contained in this set, and protecting lock. */
-    struct list_head range_list;
+    /* Tree of (disjoint) ranges contained in this set, and protecting lock. */
+    struct rb_root   range_tree;
 
     /* Number of ranges that can be allocated */
     long             nr_ranges;
@@ -37,21 +38,34 @@ struct rangeset {
     unsigned int     flags;
 };
 
+/* All the ranges come from here. */
+static struct xmem_cache *range_cache;
+
 /*****************************
- * Private range functions hide the underlying linked-list implemnetation.
+ * Private range functions hide the underlying red-black tree implementation.
+ * As ranges never overlap, ordering them by start also orders them by end,
+ * so callers may adjust the bounds of a range in place as long as it stays
+ * disjoint from its neighbours.
  */
 
 /* Find highest range lower than or containing s. NULL if no such range. */
 static struct range *find_range(
     struct rangeset *r, unsigned long s)
 {
-    struct range *x = NULL, *y;
+    struct rb_node *n = r->range_tree.rb_node;
+    struct range *x = NULL;
 
-    list_for_each_entry ( y, &r->range_list, list )
+    while ( n )
     {
+        struct range *y = rb_entry(n, struct range, node);
+
         if ( y->s > s )
-            break;
-        x = y;
+            n = n->rb_left;
+        else
+        {
+            x = y;
+            n = n->rb_right;
+        }
     }
 
     return x;
@@ -61,35 +75,59 @@ static struct range *find_range(
 static struct range *first_range(
     struct rangeset *r)
 {
-    if ( list_empty(&r->range_list) )
-        return NULL;
-    return list_entry(r->range_list.next, struct range, list);
+    struct rb_node *n = rb_first(&r->range_tree);
+
+    return n ? rb_entry(n, struct range, node) : NULL;
 }
 
 /* Return range following x in ascending order, or NULL if x is the highest. */
 static struct range *next_range(
     struct rangeset *r, struct range *x)
 {
-    if ( x->list.next == &r->range_list )
-        return NULL;
-    return list_entry(x->list.next, struct range, list);
+    struct rb_node *n = rb_next(&x->node);
+
+    return n ? rb_entry(n, struct range, node) : NULL;
 }
 
 /* Insert range y after range x in r. Insert as first range if x is NULL. */
 static void insert_range(
     struct rangeset *r, struct range *x, struct range *y)
 {
-    list_add(&y->list, (x != NULL) ? &x->list : &r->range_list);
+    struct rb_node **link, *parent;
+
+    /*
+     * y goes in as the leftmost node of x's right subtree, or of the whole
+     * tree if x is NULL.
+     */
+    if ( x == NULL )
+    {
+        parent = NULL;
+        link = &r->range_tree.rb_node;
+    }
+    else
+    {
+        parent = &x->node;
+        link = &x->node.rb_right;
+    }
+
+    while ( *link )
+    {
+        parent = *link;
+        link = &parent->rb_left;
+    }
+
+    rb_link_node(&y->node, parent, link);
+    rb_insert_color(&y->node, &r->range_tree);
 }
 
-/* Remove a range from its list and free it. */
+/* Remove a range from its tree and free it. */
 static void destroy_range(
     struct rangeset *r, struct range *x)
 {
     r->nr_ranges++;
 
-    list_del(&x->list);
-    xfree(x);
+    rb_erase(&x->node, &r->range_tree);
+    xmem_cache_free(range_cache, x);
 }
 
 /* Allocate a new range */
@@ -101,7 +139,7 @@ static struct range *alloc_range(
     if ( r->nr_ranges == 0 )
         return NULL;
 
-    x = xmalloc(struct range);
+    x = xmem_cache_alloc(range_cache);
     if ( x )
         --r->nr_ranges;
 
@@ -371,7 +409,7 @@ bool_t rangeset_contains_singleton(
 bool_t rangeset_is_empty(
     const struct rangeset *r)
 {
-    return ((r == NULL) || list_empty(&r->range_list));
+    return ((r == NULL) || RB_EMPTY_ROOT(&r->range_tree));
 }
 
 struct rangeset *rangeset_new(
@@ -379,12 +417,24 @@ struct rangeset *rangeset_new(
 {
     struct rangeset *r;
 
+    if ( unlikely(!range_cache) )
+    {
+        struct xmem_cache *c = xmem_cache_create("rangeset",
+                                                 sizeof(struct range),
+                                                 __alignof__(struct range));
+
+        if ( c == NULL )
+            return NULL;
+        if ( cmpxchg(&range_cache, NULL, c) != NULL )
+            xmem_cache_destroy(c);
+    }
+
     r = xmalloc(struct rangeset);
     if ( r == NULL )
         return NULL;
 
     rwlock_init(&r->lock);
-    INIT_LIST_HEAD(&r->range_list);
+    r->range_tree = RB_ROOT;
     r->nr_ranges = -1;
 
     BUG_ON(flags & ~RANGESETF_prettyprint_hex);
@@ -462,7 +512,7 @@ void rangeset_domain_destroy(
 
 void rangeset_swap(struct rangeset *a, struct rangeset *b)
 {
-    LIST_HEAD(tmp);
+    struct rb_root tmp;
 
     if ( a < b )
     {
@@ -475,9 +525,9 @@ void rangeset_swap(struct rangeset *a, struct rangeset *b)
         write_lock(&a->lock);
     }
 
-    list_splice_init(&a->range_list, &tmp);
-    list_splice_init(&b->range_list, &a->range_list);
-    list_splice(&tmp, &b->range_list);
+    tmp = a->range_tree;
+    a->range_tree = b->range_tree;
+    b->range_tree = tmp;
 
     write_unlock(&a->lock);
     write_unlock(&b->lock);
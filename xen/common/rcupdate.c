@@ -88,6 +88,12 @@ struct rcu_data {
     /* 3) idle CPUs handling */
     struct timer idle_timer;
     bool idle_timer_active;
+
+    /* 4) callbacks offloaded to this CPU by dedicated CPUs */
+    spinlock_t      offload_lock;
+    struct rcu_head *offlist;
+    struct rcu_head **offtail;
+    long            offqlen;
 };
 
 /*
@@ -140,6 +146,16 @@ static int qhimark = 10000;
 static int qlowmark = 100;
 static int rsinterval = 1000;
 
+/*
+ * If rcu-offload is set, pCPUs which are dedicated to a vCPU (see
+ * cpu_is_dedicated()) don't invoke their own RCU callbacks. As soon as the
+ * grace period for them is over, they hand them to a housekeeping pCPU,
+ * and it's there that they are run. This avoids stalling the vCPU for long
+ * when, e.g., a big domain, which was running there, is being destroyed.
+ */
+static bool __read_mostly rcu_offload;
+boolean_param("rcu-offload", rcu_offload);
+
 struct rcu_barrier_data {
     struct rcu_head head;
     atomic_t *cpu_count;
@@ -183,6 +199,80 @@ int rcu_barrier(void)
     return stop_machine_run(rcu_barrier_action, &cpu_count, NR_CPUS);
 }
 
+static DEFINE_SPINLOCK(rcu_expedited_lock);
+static atomic_t rcu_expedited_count;
+
+static void rcu_expedited_callback(struct rcu_head *head)
+{
+    atomic_inc(&rcu_expedited_count);
+}
+
+static void rcu_expedited_queue(void *unused)
+{
+    call_rcu(&this_cpu(rcu_data).barrier, rcu_expedited_callback);
+}
+
+/*
+ * Same as rcu_barrier(), i.e., wait for all the RCU callbacks queued so far
+ * on any CPU to have been invoked, but without stopping all the CPUs.
+ *
+ * A callback is queued on each online CPU, via IPI, and, every time a new
+ * grace period starts or ends, all the CPUs are poked with RCU_SOFTIRQ, so
+ * they quickly go through a quiescent state and/or invoke their callbacks,
+ * instead of waiting for that to happen on its own.
+ *
+ * Must be called with interrupts enabled and outside of any RCU read-side
+ * critical section. Returns -EBUSY if CPU hotplug is in progress.
+ */
+int rcu_barrier_expedited(void)
+{
+    struct rcu_ctrlblk *rcp = &rcu_ctrlblk;
+    long cur, completed;
+
+    ASSERT(local_irq_is_enabled());
+
+    /*
+     * Don't spin on the lock, or we'd not process softirqs, and the holder
+     * may be waiting for us to go through a quiescent state.
+     */
+    while ( !spin_trylock(&rcu_expedited_lock) )
+    {
+        process_pending_softirqs();
+        cpu_relax();
+    }
+
+    if ( !get_cpu_maps() )
+    {
+        spin_unlock(&rcu_expedited_lock);
+        return -EBUSY;
+    }
+
+    atomic_set(&rcu_expedited_count, 0);
+    on_selected_cpus(&cpu_online_map, rcu_expedited_queue, NULL, 1);
+
+    cur = rcp->cur;
+    completed = rcp->completed;
+    cpumask_raise_softirq(&cpu_online_map, RCU_SOFTIRQ);
+
+    while ( atomic_read(&rcu_expedited_count) != num_online_cpus() )
+    {
+        if ( cur != ACCESS_ONCE(rcp->cur) ||
+             completed != ACCESS_ONCE(rcp->completed) )
+        {
+            cur = rcp->cur;
+            completed = rcp->completed;
+            cpumask_raise_softirq(&cpu_online_map, RCU_SOFTIRQ);
+        }
+        process_pending_softirqs();
+        cpu_relax();
+    }
+
+    put_cpu_maps();
+    spin_unlock(&rcu_expedited_lock);
+
+    return 0;
+}
+
 /* Is batch a before batch b ? */
 static inline int rcu_batch_before(long a, long b)
 {
@@ -235,6 +325,54 @@ void call_rcu(struct rcu_head *head,
     local_irq_restore(flags);
 }
 
+/*
+ * Hand all the completed RCU callbacks of rdp->cpu to cpu, which will then
+ * invoke them.
+ */
+static void rcu_offload_batch(struct rcu_data *rdp, unsigned int cpu)
+{
+    struct rcu_data *hk_rdp = &per_cpu(rcu_data, cpu);
+    struct rcu_head *list;
+    unsigned long flags;
+    long count = 0;
+
+    for ( list = rdp->donelist; list != NULL; list = list->next )
+        count++;
+
+    spin_lock_irqsave(&hk_rdp->offload_lock, flags);
+    *hk_rdp->offtail = rdp->donelist;
+    hk_rdp->offtail = rdp->donetail;
+    hk_rdp->offqlen += count;
+    spin_unlock_irqrestore(&hk_rdp->offload_lock, flags);
+
+    rdp->donelist = NULL;
+    rdp->donetail = &rdp->donelist;
+    local_irq_disable();
+    rdp->qlen -= count;
+    local_irq_enable();
+
+    perfc_add(rcu_offloaded, count);
+    cpu_raise_softirq(cpu, RCU_SOFTIRQ);
+}
+
+/* Take the callbacks offloaded to us, and add them to our own done list. */
+static void rcu_take_offloaded(struct rcu_data *rdp)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&rdp->offload_lock, flags);
+    if ( rdp->offlist != NULL )
+    {
+        *rdp->donetail = rdp->offlist;
+        rdp->donetail = rdp->offtail;
+        rdp->qlen += rdp->offqlen;
+        rdp->offlist = NULL;
+        rdp->offtail = &rdp->offlist;
+        rdp->offqlen = 0;
+    }
+    spin_unlock_irqrestore(&rdp->offload_lock, flags);
+}
+
 /*
  * Invoke the completed RCU callbacks. They are expected to be in
  * a per-cpu list.
@@ -244,6 +382,17 @@ static void rcu_do_batch(struct rcu_data *rdp)
     struct rcu_head *next, *list;
     int count = 0;
 
+    if ( unlikely(rcu_offload) && cpu_is_dedicated(rdp->cpu) )
+    {
+        unsigned int cpu = sched_housekeeping_cpu(rdp->cpu);
+
+        if ( cpu != rdp->cpu )
+        {
+            rcu_offload_batch(rdp, cpu);
+            return;
+        }
+    }
+
     list = rdp->donelist;
     while (list) {
         next = rdp->donelist = list->next;
@@ -403,6 +552,8 @@ static void __rcu_process_callbacks(struct rcu_ctrlblk *rcp,
         local_irq_enable();
     }
     rcu_check_quiescent_state(rcp, rdp);
+    if ( unlikely(ACCESS_ONCE(rdp->offlist) != NULL) )
+        rcu_take_offloaded(rdp);
     if (rdp->donelist)
         rcu_do_batch(rdp);
 }
@@ -428,6 +579,10 @@ static int __rcu_pending(struct rcu_ctrlblk *rcp, struct rcu_data *rdp)
     if (rdp->donelist)
         return 1;
 
+    /* This cpu has callbacks, offloaded from another cpu, to invoke */
+    if (rdp->offlist)
+        return 1;
+
     /* The rcu core waits for a quiescent state from the cpu */
     if (rdp->quiescbatch != rcp->cur || rdp->qs_pending)
         return 1;
@@ -547,8 +702,11 @@ static void rcu_offline_cpu(struct rcu_data *this_rdp,
     rcu_move_batch(this_rdp, rdp->curlist, rdp->curtail);
     rcu_move_batch(this_rdp, rdp->nxtlist, rdp->nxttail);
 
+    /* Nobody can offload callbacks to an offline cpu, no need to lock. */
+    rcu_move_batch(this_rdp, rdp->offlist, rdp->offtail);
+
     local_irq_disable();
-    this_rdp->qlen += rdp->qlen;
+    this_rdp->qlen += rdp->qlen + rdp->offqlen;
     local_irq_enable();
 }
 
@@ -559,6 +717,8 @@ static void rcu_init_percpu_data(int cpu, struct rcu_ctrlblk *rcp,
     rdp->curtail = &rdp->curlist;
     rdp->nxttail = &rdp->nxtlist;
     rdp->donetail = &rdp->donelist;
+    rdp->offtail = &rdp->offlist;
+    spin_lock_init(&rdp->offload_lock);
     rdp->quiescbatch = rcp->completed;
     rdp->qs_pending = 0;
     rdp->cpu = cpu;
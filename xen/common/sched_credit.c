@@ -154,6 +154,10 @@ struct csched_pcpu {
 
     unsigned int tick;
     struct timer ticker;
+
+    /* Scratch space for csched_load_balance(), under our scheduler lock. */
+    cpumask_var_t stealable;
+    cpumask_var_t workers;
 };
 
 /*
@@ -208,6 +212,13 @@ struct csched_private {
 
     cpumask_var_t idlers;
     cpumask_var_t cpus;
+    /*
+     * pCPUs with at least one vCPU waiting in their runqueue, i.e., with
+     * some work that can be stolen. Load balancing looks at this, one
+     * core, one socket, and then one node at a time, rather than peeking
+     * at all the pCPUs' runqueues.
+     */
+    cpumask_var_t stealable;
     uint32_t *balance_bias;
     uint32_t runq_sort;
     unsigned int ratelimit_us;
@@ -253,12 +264,17 @@ static inline bool_t is_runq_idle(unsigned int cpu)
            is_idle_vcpu(__runq_elem(RUNQ(cpu)->next)->vcpu);
 }
 
+/*
+ * nr_runnable also accounts for the vCPU running on cpu (if any), so there
+ * is something to steal from cpu only if nr_runnable is at least 2. Keep the
+ * stealable mask in sync with that, as we go.
+ */
 static inline void
 inc_nr_runnable(unsigned int cpu)
 {
     ASSERT(spin_is_locked(per_cpu(schedule_data, cpu).schedule_lock));
-    CSCHED_PCPU(cpu)->nr_runnable++;
-
+    if ( ++CSCHED_PCPU(cpu)->nr_runnable == 2 )
+        cpumask_set_cpu(cpu, CSCHED_PRIV(per_cpu(scheduler, cpu))->stealable);
 }
 
 static inline void
@@ -266,7 +282,8 @@ dec_nr_runnable(unsigned int cpu)
 {
     ASSERT(spin_is_locked(per_cpu(schedule_data, cpu).schedule_lock));
     ASSERT(CSCHED_PCPU(cpu)->nr_runnable >= 1);
-    CSCHED_PCPU(cpu)->nr_runnable--;
+    if ( --CSCHED_PCPU(cpu)->nr_runnable == 1 )
+        cpumask_clear_cpu(cpu, CSCHED_PRIV(per_cpu(scheduler, cpu))->stealable);
 }
 
 static inline void
@@ -459,7 +476,7 @@ static inline void __runq_tickle(struct csched_vcpu *new)
 
     if ( !cpumask_empty(&mask) )
     {
-        if ( unlikely(tb_init_done) )
+        if ( tb_tracing() )
         {
             /* Avoid TRACE_*: saves checking !tb_init_done each step */
             for_each_cpu(cpu, &mask)
@@ -487,6 +504,7 @@ static void
 csched_free_pdata(const struct scheduler *ops, void *pcpu, int cpu)
 {
     struct csched_private *prv = CSCHED_PRIV(ops);
+    struct csched_pcpu *spc = pcpu;
 
     /*
      * pcpu either points to a valid struct csched_pcpu, or is NULL, if we're
@@ -497,7 +515,12 @@ csched_free_pdata(const struct scheduler *ops, void *pcpu, int cpu)
      */
     ASSERT(!cpumask_test_cpu(cpu, prv->cpus));
 
-    xfree(pcpu);
+    if ( spc )
+    {
+        free_cpumask_var(spc->stealable);
+        free_cpumask_var(spc->workers);
+    }
+    xfree(spc);
 }
 
 static void
@@ -523,6 +546,7 @@ csched_deinit_pdata(const struct scheduler *ops, void *pcpu, int cpu)
     prv->credit -= prv->credits_per_tslice;
     prv->ncpus--;
     cpumask_clear_cpu(cpu, prv->idlers);
+    cpumask_clear_cpu(cpu, prv->stealable);
     cpumask_clear_cpu(cpu, prv->cpus);
     if ( (prv->master == cpu) && (prv->ncpus > 0) )
     {
@@ -552,6 +576,14 @@ csched_alloc_pdata(const struct scheduler *ops, int cpu)
     if ( spc == NULL )
         return ERR_PTR(-ENOMEM);
 
+    if ( !zalloc_cpumask_var(&spc->stealable) ||
+         !zalloc_cpumask_var(&spc->workers) )
+    {
+        free_cpumask_var(spc->stealable);
+        xfree(spc);
+        return ERR_PTR(-ENOMEM);
+    }
+
     return spc;
 }
 
@@ -588,6 +620,7 @@ init_pdata(struct csched_private *prv, struct csched_pcpu *spc, int cpu)
     /* Start off idling... */
     BUG_ON(!is_idle_vcpu(curr_on_cpu(cpu)));
     cpumask_set_cpu(cpu, prv->idlers);
+    cpumask_clear_cpu(cpu, prv->stealable);
     spc->nr_runnable = 0;
 }
 
@@ -1683,15 +1716,113 @@ csched_runq_steal(int peer_cpu, int cpu, int pri, int balance_step)
     return NULL;
 }
 
+/*
+ * Try to steal work from the pCPUs in workers, starting from the one that
+ * follows *bias, and updating *bias to where we stole from, if we managed to.
+ */
+static struct csched_vcpu *
+csched_steal_from(int cpu, struct csched_vcpu *snext, const cpumask_t *workers,
+                  const cpumask_t *online, int bstep, uint32_t *bias)
+{
+    struct csched_vcpu *speer;
+    int peer_cpu, first_cpu;
+
+    first_cpu = cpumask_cycle(*bias, workers);
+    if ( first_cpu >= nr_cpu_ids )
+        return NULL;
+
+    peer_cpu = first_cpu;
+    do
+    {
+        spinlock_t *lock;
+
+        /*
+         * If there is only one runnable vCPU on peer_cpu, it means
+         * there's no one to be stolen in its runqueue, so skip it.
+         *
+         * Checking this (and the stealable mask, which is how we got here)
+         * without holding the lock is racy... But that's the whole point
+         * of this optimization!
+         *
+         * In more details:
+         * - if we race with dec_nr_runnable(), we may try to take the
+         *   lock and call csched_runq_steal() for no reason. This is
+         *   not a functional issue, and should be infrequent enough.
+         *   And we can avoid that by re-checking nr_runnable after
+         *   having grabbed the lock, if we want;
+         * - if we race with inc_nr_runnable(), we skip a pCPU that may
+         *   have runnable vCPUs in its runqueue, but that's not a
+         *   problem because:
+         *   + if racing with csched_vcpu_insert() or csched_vcpu_wake(),
+         *     __runq_tickle() will be called afterwords, so the vCPU
+         *     won't get stuck in the runqueue for too long;
+         *   + if racing with csched_runq_steal(), it may be that a
+         *     vCPU that we could have picked up, stays in a runqueue
+         *     until someone else tries to steal it again. But this is
+         *     no worse than what can happen already (without this
+         *     optimization), it the pCPU would schedule right after we
+         *     have taken the lock, and hence block on it.
+         */
+        if ( CSCHED_PCPU(peer_cpu)->nr_runnable <= 1 )
+        {
+            TRACE_2D(TRC_CSCHED_STEAL_CHECK, peer_cpu, /* skipp'n */ 0);
+            goto next_cpu;
+        }
+
+        /*
+         * Get ahold of the scheduler lock for this peer CPU.
+         *
+         * Note: We don't spin on this lock but simply try it. Spinning
+         * could cause a deadlock if the peer CPU is also load
+         * balancing and trying to lock this CPU.
+         */
+        lock = pcpu_schedule_trylock(peer_cpu);
+        SCHED_STAT_CRANK(steal_trylock);
+        if ( !lock )
+        {
+            SCHED_STAT_CRANK(steal_trylock_failed);
+            TRACE_2D(TRC_CSCHED_STEAL_CHECK, peer_cpu, /* skip */ 0);
+            goto next_cpu;
+        }
+
+        TRACE_2D(TRC_CSCHED_STEAL_CHECK, peer_cpu, /* checked */ 1);
+
+        /* Any work over there to steal? */
+        speer = cpumask_test_cpu(peer_cpu, online) ?
+            csched_runq_steal(peer_cpu, cpu, snext->pri, bstep) : NULL;
+        pcpu_schedule_unlock(lock, peer_cpu);
+
+        /* As soon as one vcpu is found, balancing ends */
+        if ( speer != NULL )
+        {
+            /*
+             * Next time we'll look for work to steal here, we will start
+             * from the next pCPU, with respect to this one, so we don't
+             * risk stealing always from the same ones.
+             */
+            *bias = peer_cpu;
+            return speer;
+        }
+
+ next_cpu:
+        peer_cpu = cpumask_cycle(peer_cpu, workers);
+
+    } while( peer_cpu != first_cpu );
+
+    return NULL;
+}
+
 static struct csched_vcpu *
 csched_load_balance(struct csched_private *prv, int cpu,
     struct csched_vcpu *snext, bool_t *stolen)
 {
     struct cpupool *c = per_cpu(cpupool, cpu);
+    struct csched_pcpu *spc = CSCHED_PCPU(cpu);
+    cpumask_t *stealable = spc->stealable, *workers = spc->workers;
     struct csched_vcpu *speer;
-    cpumask_t workers;
     cpumask_t *online;
-    int peer_cpu, first_cpu, peer_node, bstep;
+    int peer_node, bstep;
+    uint32_t bias;
     int node = cpu_to_node(cpu);
 
     BUG_ON( cpu != snext->vcpu->processor );
@@ -1711,6 +1842,20 @@ csched_load_balance(struct csched_private *prv, int cpu,
     else
         SCHED_STAT_CRANK(load_balance_other);
 
+    /*
+     * Only non-idle pCPUs with someone waiting in their runqueue are worth
+     * looking at. If there's none, we're done, without touching any of the
+     * other pCPUs' data, let alone their locks.
+     */
+    cpumask_and(stealable, online, prv->stealable);
+    cpumask_andnot(stealable, stealable, prv->idlers);
+    __cpumask_clear_cpu(cpu, stealable);
+    if ( cpumask_empty(stealable) )
+    {
+        SCHED_STAT_CRANK(steal_none);
+        goto out;
+    }
+
     /*
      * Let's look around for work to steal, taking both hard affinity
      * and soft affinity into account. More specifically, we check all
@@ -1721,105 +1866,48 @@ csched_load_balance(struct csched_private *prv, int cpu,
     for_each_affinity_balance_step( bstep )
     {
         /*
-         * We peek at the non-idling CPUs in a node-wise fashion. In fact,
-         * it is more likely that we find some affine work on our same
-         * node, not to mention that migrating vcpus within the same node
-         * could well expected to be cheaper than across-nodes (memory
-         * stays local, there might be some node-wide cache[s], etc.).
+         * We peek at the pCPUs that are closest to us first: our sibling
+         * hyperthreads, then the rest of our socket, and then go node-wise.
+         * In fact, migrating vcpus within the same core or socket can be
+         * expected to be cheaper (caches are shared), and the same is true
+         * for doing that within the same node, rather than across-nodes
+         * (memory stays local, there might be some node-wide cache[s], etc.).
+         * It is also more likely that we find some affine work on our same
+         * node.
          */
+        cpumask_and(workers, stealable, per_cpu(cpu_sibling_mask, cpu));
+        bias = cpu;
+        speer = csched_steal_from(cpu, snext, workers, online, bstep, &bias);
+        if ( speer != NULL )
+            goto stolen;
+
+        cpumask_and(workers, stealable, per_cpu(cpu_core_mask, cpu));
+        cpumask_andnot(workers, workers, per_cpu(cpu_sibling_mask, cpu));
+        bias = cpu;
+        speer = csched_steal_from(cpu, snext, workers, online, bstep, &bias);
+        if ( speer != NULL )
+            goto stolen;
+
         peer_node = node;
         do
         {
             /* Select the pCPUs in this node that have work we can steal. */
-            cpumask_andnot(&workers, online, prv->idlers);
-            cpumask_and(&workers, &workers, &node_to_cpumask(peer_node));
-            __cpumask_clear_cpu(cpu, &workers);
-
-            first_cpu = cpumask_cycle(prv->balance_bias[peer_node], &workers);
-            if ( first_cpu >= nr_cpu_ids )
-                goto next_node;
-            peer_cpu = first_cpu;
-            do
-            {
-                spinlock_t *lock;
-
-                /*
-                 * If there is only one runnable vCPU on peer_cpu, it means
-                 * there's no one to be stolen in its runqueue, so skip it.
-                 *
-                 * Checking this without holding the lock is racy... But that's
-                 * the whole point of this optimization!
-                 *
-                 * In more details:
-                 * - if we race with dec_nr_runnable(), we may try to take the
-                 *   lock and call csched_runq_steal() for no reason. This is
-                 *   not a functional issue, and should be infrequent enough.
-                 *   And we can avoid that by re-checking nr_runnable after
-                 *   having grabbed the lock, if we want;
-                 * - if we race with inc_nr_runnable(), we skip a pCPU that may
-                 *   have runnable vCPUs in its runqueue, but that's not a
-                 *   problem because:
-                 *   + if racing with csched_vcpu_insert() or csched_vcpu_wake(),
-                 *     __runq_tickle() will be called afterwords, so the vCPU
-                 *     won't get stuck in the runqueue for too long;
-                 *   + if racing with csched_runq_steal(), it may be that a
-                 *     vCPU that we could have picked up, stays in a runqueue
-                 *     until someone else tries to steal it again. But this is
-                 *     no worse than what can happen already (without this
-                 *     optimization), it the pCPU would schedule right after we
-                 *     have taken the lock, and hence block on it.
-                 */
-                if ( CSCHED_PCPU(peer_cpu)->nr_runnable <= 1 )
-                {
-                    TRACE_2D(TRC_CSCHED_STEAL_CHECK, peer_cpu, /* skipp'n */ 0);
-                    goto next_cpu;
-                }
-
-                /*
-                 * Get ahold of the scheduler lock for this peer CPU.
-                 *
-                 * Note: We don't spin on this lock but simply try it. Spinning
-                 * could cause a deadlock if the peer CPU is also load
-                 * balancing and trying to lock this CPU.
-                 */
-                lock = pcpu_schedule_trylock(peer_cpu);
-                SCHED_STAT_CRANK(steal_trylock);
-                if ( !lock )
-                {
-                    SCHED_STAT_CRANK(steal_trylock_failed);
-                    TRACE_2D(TRC_CSCHED_STEAL_CHECK, peer_cpu, /* skip */ 0);
-                    goto next_cpu;
-                }
-
-                TRACE_2D(TRC_CSCHED_STEAL_CHECK, peer_cpu, /* checked */ 1);
+            cpumask_and(workers, stealable, &node_to_cpumask(peer_node));
+            cpumask_andnot(workers, workers, per_cpu(cpu_core_mask, cpu));
 
-                /* Any work over there to steal? */
-                speer = cpumask_test_cpu(peer_cpu, online) ?
-                    csched_runq_steal(peer_cpu, cpu, snext->pri, bstep) : NULL;
-                pcpu_schedule_unlock(lock, peer_cpu);
+            speer = csched_steal_from(cpu, snext, workers, online, bstep,
+                                      &prv->balance_bias[peer_node]);
+            if ( speer != NULL )
+                goto stolen;
 
-                /* As soon as one vcpu is found, balancing ends */
-                if ( speer != NULL )
-                {
-                    *stolen = 1;
-                    /*
-                     * Next time we'll look for work to steal on this node, we
-                     * will start from the next pCPU, with respect to this one,
-                     * so we don't risk stealing always from the same ones.
-                     */
-                    prv->balance_bias[peer_node] = peer_cpu;
-                    return speer;
-                }
-
- next_cpu:
-                peer_cpu = cpumask_cycle(peer_cpu, &workers);
-
-            } while( peer_cpu != first_cpu );
-
- next_node:
             peer_node = cycle_node(peer_node, node_online_map);
         } while( peer_node != node );
     }
+    goto out;
+
+ stolen:
+    *stolen = 1;
+    return speer;
 
  out:
     /* Failed to find more important work elsewhere... */
@@ -1851,7 +1939,7 @@ csched_schedule(
      * don't care about packing. But scheduling happens very often, so it
      * actually is important that the record is as small as possible.
      */
-    if ( unlikely(tb_init_done) )
+    if ( tb_tracing() )
     {
         struct {
             unsigned cpu:16, tasklet:8, idle:8;
@@ -1918,7 +2006,7 @@ csched_schedule(
         tslice = MICROSECS(prv->ratelimit_us) - runtime;
         if ( unlikely(runtime < CSCHED_MIN_TIMER) )
             tslice = CSCHED_MIN_TIMER;
-        if ( unlikely(tb_init_done) )
+        if ( tb_tracing() )
         {
             struct {
                 unsigned vcpu:16, dom:16;
@@ -2176,9 +2264,11 @@ csched_init(struct scheduler *ops)
     }
 
     if ( !zalloc_cpumask_var(&prv->cpus) ||
-         !zalloc_cpumask_var(&prv->idlers) )
+         !zalloc_cpumask_var(&prv->idlers) ||
+         !zalloc_cpumask_var(&prv->stealable) )
     {
         free_cpumask_var(prv->cpus);
+        free_cpumask_var(prv->idlers);
         xfree(prv->balance_bias);
         xfree(prv);
         return -ENOMEM;
@@ -2225,6 +2315,7 @@ csched_deinit(struct scheduler *ops)
         ops->sched_data = NULL;
         free_cpumask_var(prv->cpus);
         free_cpumask_var(prv->idlers);
+        free_cpumask_var(prv->stealable);
         xfree(prv->balance_bias);
         xfree(prv);
     }
@@ -25,6 +25,7 @@
 #include <xen/trace.h>
 #include <xen/cpu.h>
 #include <xen/keyhandler.h>
+#include <xen/rbtree.h>
 
 /* Meant only for helping developers during debugging. */
 /* #define d2printk printk */
@@ -57,6 +58,7 @@
 #define TRC_CSCHED2_SCHEDULE         TRC_SCHED_CLASS_EVT(CSCHED2, 21)
 #define TRC_CSCHED2_RATELIMIT        TRC_SCHED_CLASS_EVT(CSCHED2, 22)
 #define TRC_CSCHED2_RUNQ_CAND_CHECK  TRC_SCHED_CLASS_EVT(CSCHED2, 23)
+#define TRC_CSCHED2_LOAD_LEVEL       TRC_SCHED_CLASS_EVT(CSCHED2, 24)
 
 /*
  * WARNING: This is still in an experimental phase.  Status and work can be found at the
@@ -388,6 +390,19 @@ static int __read_mostly opt_underload_balance_tolerance = 0;
 integer_param("credit2_balance_under", opt_underload_balance_tolerance);
 static int __read_mostly opt_overload_balance_tolerance = -3;
 integer_param("credit2_balance_over", opt_overload_balance_tolerance);
+/*
+ * Load balancing is hierarchical: we first try to balance with runqueues
+ * that share a core with us, then with the ones in the same socket, then
+ * in the same node, and only then with any other runqueue. Moving further
+ * away costs more (cache and memory locality), so each level the balancer
+ * climbs increases the tolerance by this many bits, i.e., with the default
+ * of 1, the load imbalance must double at each level for a migration to
+ * be considered worthwhile. It can't be more than BALANCE_LEVEL_COST_MAX,
+ * for the tolerance to remain a sensible shift of the load precision.
+ */
+#define BALANCE_LEVEL_COST_MAX 8
+static unsigned int __read_mostly opt_balance_level_cost = 1;
+integer_param("credit2_balance_level_cost", opt_balance_level_cost);
 /*
  * Domains subject to a cap receive a replenishment of their runtime budget
  * once every opt_cap_period interval. Default is 10 ms. The amount of budget
@@ -465,7 +480,7 @@ custom_param("credit2_runqueue", parse_credit2_runqueue);
 struct csched2_runqueue_data {
     spinlock_t lock;           /* Lock for this runqueue                     */
 
-    struct list_head runq;     /* Ordered list of runnable vms               */
+    struct rb_root runq;       /* Credit-ordered tree of runnable vms        */
     int id;                    /* ID of this runqueue (-1 if invalid)        */
 
     int load;                  /* Instantaneous load (num of non-idle vcpus) */
@@ -530,7 +545,7 @@ struct csched2_vcpu {
     s_time_t load_last_update;         /* Last time average was updated       */
     s_time_t avgload;                  /* Decaying queue load                 */
 
-    struct list_head runq_elem;        /* On the runqueue (rqd->runq)         */
+    struct rb_node runq_elem;          /* On the runqueue (rqd->runq)         */
     struct list_head parked_elem;      /* On the parked_vcpus list            */
     struct list_head rqd_elem;         /* On csched2_runqueue_data's svc list */
     struct csched2_runqueue_data *migrate_rqd; /* Pre-determined migr. target */
@@ -786,14 +801,34 @@ static s_time_t c2t(struct csched2_runqueue_data *rqd, s_time_t credit, struct c
  * Runqueue related code.
  */
 
+/*
+ * The runqueue is an rbtree, ordered by decreasing credit. vCPUs with equal
+ * credit are kept in FIFO order, i.e., a newly inserted vCPU goes after all
+ * the ones that already have the same credit as itself. This means the
+ * leftmost node is always the vCPU that a sorted list would have had at its
+ * head, and walking the tree with rb_next() yields the same order a scan of
+ * such list would have.
+ *
+ * Note that reset_credit() changes the credits of vCPUs while they are in
+ * the runqueue. That is fine, as it adds the same amount to all of them, and
+ * then clips them to the same maximum, which does not alter their relative
+ * ordering.
+ */
 static inline int vcpu_on_runq(struct csched2_vcpu *svc)
 {
-    return !list_empty(&svc->runq_elem);
+    return !RB_EMPTY_NODE(&svc->runq_elem);
 }
 
-static inline struct csched2_vcpu * runq_elem(struct list_head *elem)
+static inline struct csched2_vcpu * runq_elem(struct rb_node *elem)
 {
-    return list_entry(elem, struct csched2_vcpu, runq_elem);
+    return rb_entry(elem, struct csched2_vcpu, runq_elem);
+}
+
+static inline struct csched2_vcpu *runq_first(struct rb_root *runq)
+{
+    struct rb_node *node = rb_first(runq);
+
+    return node ? runq_elem(node) : NULL;
 }
 
 static void activate_runqueue(struct csched2_private *prv, int rqi)
@@ -807,7 +842,7 @@ static void activate_runqueue(struct csched2_private *prv, int rqi)
     rqd->max_weight = 1;
     rqd->id = rqi;
     INIT_LIST_HEAD(&rqd->svc);
-    INIT_LIST_HEAD(&rqd->runq);
+    rqd->runq = RB_ROOT;
     spin_lock_init(&rqd->lock);
 
     __cpumask_set_cpu(rqi, &prv->active_queues);
@@ -842,6 +877,30 @@ static inline bool same_core(unsigned int cpua, unsigned int cpub)
            cpu_to_core(cpua) == cpu_to_core(cpub);
 }
 
+/*
+ * Topology levels for load balancing, from the closest to the furthest. On
+ * x86 the LLC is shared at socket level, so we do not need a separate level
+ * for it.
+ */
+enum lb_level {
+    LB_LEVEL_CORE,      /* Sibling hyperthreads                       */
+    LB_LEVEL_SOCKET,    /* Same socket, hence same LLC                */
+    LB_LEVEL_NODE,      /* Same NUMA node, but different socket       */
+    LB_LEVEL_SYSTEM,    /* Anywhere else                              */
+    LB_LEVEL_NR
+};
+
+static inline enum lb_level lb_level(unsigned int cpua, unsigned int cpub)
+{
+    if ( same_core(cpua, cpub) )
+        return LB_LEVEL_CORE;
+    if ( same_socket(cpua, cpub) )
+        return LB_LEVEL_SOCKET;
+    if ( same_node(cpua, cpub) )
+        return LB_LEVEL_NODE;
+    return LB_LEVEL_SYSTEM;
+}
+
 static unsigned int
 cpu_to_runqueue(struct csched2_private *prv, unsigned int cpu)
 {
@@ -921,7 +980,7 @@ static void update_max_weight(struct csched2_runqueue_data *rqd, int new_weight,
         SCHED_STAT_CRANK(upd_max_weight_full);
     }
 
-    if ( unlikely(tb_init_done) )
+    if ( tb_tracing() )
     {
         struct {
             unsigned rqi:16, max_weight:16;
@@ -947,7 +1006,7 @@ _runq_assign(struct csched2_vcpu *svc, struct csched2_runqueue_data *rqd)
     /* Expected new load based on adding this vcpu */
     rqd->b_avgload += svc->avgload;
 
-    if ( unlikely(tb_init_done) )
+    if ( tb_tracing() )
     {
         struct {
             unsigned vcpu:16, dom:16;
@@ -1176,7 +1235,7 @@ update_runq_load(const struct scheduler *ops,
     /* Overflow, capable of making the load look negative, must not occur. */
     ASSERT(rqd->avgload >= 0 && rqd->b_avgload >= 0);
 
-    if ( unlikely(tb_init_done) )
+    if ( tb_tracing() )
     {
         struct {
             uint64_t rq_avgload, b_avgload;
@@ -1235,7 +1294,7 @@ update_svc_load(const struct scheduler *ops,
     /* Overflow, capable of making the load look negative, must not occur. */
     ASSERT(svc->avgload >= 0);
 
-    if ( unlikely(tb_init_done) )
+    if ( tb_tracing() )
     {
         struct {
             uint64_t v_avgload;
@@ -1267,9 +1326,9 @@ update_load(const struct scheduler *ops,
 static void
 runq_insert(const struct scheduler *ops, struct csched2_vcpu *svc)
 {
-    struct list_head *iter;
     unsigned int cpu = svc->vcpu->processor;
-    struct list_head * runq = &c2rqd(ops, cpu)->runq;
+    struct rb_root *runq = &c2rqd(ops, cpu)->runq;
+    struct rb_node **node = &runq->rb_node, *parent = NULL;
     int pos = 0;
 
     ASSERT(spin_is_locked(per_cpu(schedule_data, cpu).schedule_lock));
@@ -1282,18 +1341,27 @@ runq_insert(const struct scheduler *ops, struct csched2_vcpu *svc)
     ASSERT(!svc->vcpu->is_running);
     ASSERT(!(svc->flags & CSFLAG_scheduled));
 
-    list_for_each( iter, runq )
+    /*
+     * Descend the tree, going left only if we have strictly more credit than
+     * the node we're looking at, so we queue up after vCPUs with the same
+     * credit. pos is the depth at which we end up being inserted.
+     */
+    while ( *node )
     {
-        struct csched2_vcpu * iter_svc = runq_elem(iter);
+        struct csched2_vcpu * iter_svc = runq_elem(*node);
 
+        parent = *node;
         if ( svc->credit > iter_svc->credit )
-            break;
+            node = &parent->rb_left;
+        else
+            node = &parent->rb_right;
 
         pos++;
     }
-    list_add_tail(&svc->runq_elem, iter);
+    rb_link_node(&svc->runq_elem, parent, node);
+    rb_insert_color(&svc->runq_elem, runq);
 
-    if ( unlikely(tb_init_done) )
+    if ( tb_tracing() )
     {
         struct {
             unsigned vcpu:16, dom:16;
@@ -1311,7 +1379,8 @@ runq_insert(const struct scheduler *ops, struct csched2_vcpu *svc)
 static inline void runq_remove(struct csched2_vcpu *svc)
 {
     ASSERT(vcpu_on_runq(svc));
-    list_del_init(&svc->runq_elem);
+    rb_erase(&svc->runq_elem, &svc->rqd->runq);
+    RB_CLEAR_NODE(&svc->runq_elem);
 }
 
 void burn_credits(struct csched2_runqueue_data *rqd, struct csched2_vcpu *, s_time_t);
@@ -1393,7 +1462,7 @@ static s_time_t tickle_score(const struct scheduler *ops, s_time_t now,
             score += CSCHED2_CREDIT_INIT;
     }
 
-    if ( unlikely(tb_init_done) )
+    if ( tb_tracing() )
     {
         struct {
             unsigned vcpu:16, dom:16;
@@ -1439,7 +1508,7 @@ runq_tickle(const struct scheduler *ops, struct csched2_vcpu *new, s_time_t now)
 
     ASSERT(new->rqd == rqd);
 
-    if ( unlikely(tb_init_done) )
+    if ( tb_tracing() )
     {
         struct {
             unsigned vcpu:16, dom:16;
@@ -1569,7 +1638,7 @@ runq_tickle(const struct scheduler *ops, struct csched2_vcpu *new, s_time_t now)
  tickle:
     BUG_ON(ipid == -1);
 
-    if ( unlikely(tb_init_done) )
+    if ( tb_tracing() )
     {
         struct {
             unsigned cpu:16, pad:16;
@@ -1662,7 +1731,7 @@ static void reset_credit(const struct scheduler *ops, int cpu, s_time_t now,
 
         svc->start_time = now;
 
-        if ( unlikely(tb_init_done) )
+        if ( tb_tracing() )
         {
             struct {
                 unsigned vcpu:16, dom:16;
@@ -1718,7 +1787,7 @@ void burn_credits(struct csched2_runqueue_data *rqd,
     svc->start_time = now;
 
  out:
-    if ( unlikely(tb_init_done) )
+    if ( tb_tracing() )
     {
         struct {
             unsigned vcpu:16, dom:16;
@@ -2013,7 +2082,7 @@ csched2_alloc_vdata(const struct scheduler *ops, struct vcpu *vc, void *dd)
         return NULL;
 
     INIT_LIST_HEAD(&svc->rqd_elem);
-    INIT_LIST_HEAD(&svc->runq_elem);
+    RB_CLEAR_NODE(&svc->runq_elem);
 
     svc->sdom = dd;
     svc->vcpu = vc;
@@ -2376,7 +2445,7 @@ csched2_cpu_pick(const struct scheduler *ops, struct vcpu *vc)
  out_up:
     read_unlock(&prv->lock);
  out:
-    if ( unlikely(tb_init_done) )
+    if ( tb_tracing() )
     {
         struct {
             uint64_t b_avgload;
@@ -2447,7 +2516,7 @@ static void migrate(const struct scheduler *ops,
 {
     int cpu = svc->vcpu->processor;
 
-    if ( unlikely(tb_init_done) )
+    if ( tb_tracing() )
     {
         struct {
             unsigned vcpu:16, dom:16;
@@ -2523,10 +2592,82 @@ static bool vcpu_is_migrateable(struct csched2_vcpu *svc,
            cpumask_intersects(cpumask_scratch_cpu(cpu), &rqd->active);
 }
 
+/*
+ * Is the imbalance between st->lrqd and st->orqd (which is at the given
+ * topology level, wrt st->lrqd) big enough to justify trying to fix it?
+ */
+static bool balance_worthwhile(const struct csched2_private *prv,
+                               const balance_state_t *st,
+                               enum lb_level level)
+{
+    s_time_t load_max;
+    int cpus_max, i, tolerance;
+    bool ret;
+
+    load_max = st->lrqd->b_avgload;
+    if ( st->orqd->b_avgload > load_max )
+        load_max = st->orqd->b_avgload;
+
+    cpus_max = cpumask_weight(&st->lrqd->active);
+    i = cpumask_weight(&st->orqd->active);
+    if ( i > cpus_max )
+        cpus_max = i;
+
+    if ( tb_tracing() )
+    {
+        struct {
+            unsigned lrq_id:16, orq_id:16;
+            unsigned load_delta;
+        } d;
+        d.lrq_id = st->lrqd->id;
+        d.orq_id = st->orqd->id;
+        d.load_delta = st->load_delta;
+        __trace_var(TRC_CSCHED2_LOAD_CHECK, 1,
+                    sizeof(d),
+                    (unsigned char *)&d);
+    }
+
+    /*
+     * If we're under 100% capacaty, only shift if load difference
+     * is > 1.  otherwise, shift if under 12.5%. In both cases, the
+     * further away the other runqueue is, the bigger the difference
+     * must be.
+     */
+    if ( load_max < ((s_time_t)cpus_max << prv->load_precision_shift) )
+        tolerance = opt_underload_balance_tolerance;
+    else
+        tolerance = opt_overload_balance_tolerance;
+    tolerance += level * opt_balance_level_cost;
+
+    ret = st->load_delta >= (1ULL << (prv->load_precision_shift + tolerance));
+
+    if ( tb_tracing() )
+    {
+        struct {
+            unsigned lrq_id:16, orq_id:16;
+            unsigned level:16, ok:16;
+            unsigned load_delta;
+        } d;
+        d.lrq_id = st->lrqd->id;
+        d.orq_id = st->orqd->id;
+        d.level = level;
+        d.ok = ret;
+        d.load_delta = st->load_delta;
+        __trace_var(TRC_CSCHED2_LOAD_LEVEL, 1,
+                    sizeof(d),
+                    (unsigned char *)&d);
+    }
+
+    return ret;
+}
+
 static void balance_load(const struct scheduler *ops, int cpu, s_time_t now)
 {
     struct csched2_private *prv = csched2_priv(ops);
     int i, max_delta_rqi = -1;
+    int level_rqi[LB_LEVEL_NR];
+    s_time_t level_delta[LB_LEVEL_NR];
+    enum lb_level l;
     struct list_head *push_iter, *pull_iter;
     bool inner_load_updated = 0;
 
@@ -2534,7 +2675,9 @@ static void balance_load(const struct scheduler *ops, int cpu, s_time_t now)
 
     /*
      * Basic algorithm: Push, pull, or swap.
-     * - Find the runqueue with the furthest load distance
+     * - Find, for each topology level, the runqueue with the furthest load
+     *   distance, and pick the closest level at which such distance is big
+     *   enough to be worth fixing
      * - Find a pair that makes the difference the least (where one
      * on either side may be empty).
      */
@@ -2548,7 +2691,11 @@ retry:
     if ( !read_trylock(&prv->lock) )
         return;
 
-    st.load_delta = 0;
+    for ( l = 0; l < LB_LEVEL_NR; l++ )
+    {
+        level_rqi[l] = -1;
+        level_delta[l] = 0;
+    }
 
     for_each_cpu(i, &prv->active_queues)
     {
@@ -2566,10 +2713,11 @@ retry:
         if ( delta < 0 )
             delta = -delta;
 
-        if ( delta > st.load_delta )
+        l = lb_level(cpu, cpumask_first(&st.orqd->active));
+        if ( delta > level_delta[l] )
         {
-            st.load_delta = delta;
-            max_delta_rqi = i;
+            level_delta[l] = delta;
+            level_rqi[l] = i;
         }
 
         spin_unlock(&st.orqd->lock);
@@ -2577,53 +2725,25 @@ retry:
 
     /* Minimize holding the private scheduler lock. */
     read_unlock(&prv->lock);
-    if ( max_delta_rqi == -1 )
-        goto out;
 
+    /* Climb the topology, and stop at the first level worth balancing. */
+    for ( l = 0; l < LB_LEVEL_NR; l++ )
     {
-        s_time_t load_max;
-        int cpus_max;
-
-        
-        load_max = st.lrqd->b_avgload;
-        if ( st.orqd->b_avgload > load_max )
-            load_max = st.orqd->b_avgload;
-
-        cpus_max = cpumask_weight(&st.lrqd->active);
-        i = cpumask_weight(&st.orqd->active);
-        if ( i > cpus_max )
-            cpus_max = i;
+        if ( level_rqi[l] == -1 )
+            continue;
 
-        if ( unlikely(tb_init_done) )
-        {
-            struct {
-                unsigned lrq_id:16, orq_id:16;
-                unsigned load_delta;
-            } d;
-            d.lrq_id = st.lrqd->id;
-            d.orq_id = st.orqd->id;
-            d.load_delta = st.load_delta;
-            __trace_var(TRC_CSCHED2_LOAD_CHECK, 1,
-                        sizeof(d),
-                        (unsigned char *)&d);
-        }
+        st.orqd = prv->rqd + level_rqi[l];
+        st.load_delta = level_delta[l];
 
-        /*
-         * If we're under 100% capacaty, only shift if load difference
-         * is > 1.  otherwise, shift if under 12.5%
-         */
-        if ( load_max < ((s_time_t)cpus_max << prv->load_precision_shift) )
+        if ( balance_worthwhile(prv, &st, l) )
         {
-            if ( st.load_delta < (1ULL << (prv->load_precision_shift +
-                                           opt_underload_balance_tolerance)) )
-                 goto out;
+            max_delta_rqi = level_rqi[l];
+            break;
         }
-        else
-            if ( st.load_delta < (1ULL << (prv->load_precision_shift +
-                                           opt_overload_balance_tolerance)) )
-                goto out;
     }
-             
+    if ( max_delta_rqi == -1 )
+        goto out;
+
     /* Try to grab the other runqueue lock; if it's been taken in the
      * meantime, try the process over again.  This can't deadlock
      * because if it doesn't get any other rqd locks, it will simply
@@ -2636,7 +2756,7 @@ retry:
     if ( unlikely(st.orqd->id < 0) )
         goto out_up;
 
-    if ( unlikely(tb_init_done) )
+    if ( tb_tracing() )
     {
         struct {
             uint64_t lb_avgload, ob_avgload;
@@ -3094,7 +3214,7 @@ csched2_vcpu_insert(const struct scheduler *ops, struct vcpu *vc)
     spinlock_t *lock;
 
     ASSERT(!is_idle_vcpu(vc));
-    ASSERT(list_empty(&svc->runq_elem));
+    ASSERT(!vcpu_on_runq(svc));
 
     /* csched2_cpu_pick() expects the pcpu lock to be held */
     lock = vcpu_schedule_lock_irq(vc);
@@ -3132,7 +3252,7 @@ csched2_vcpu_remove(const struct scheduler *ops, struct vcpu *vc)
     spinlock_t *lock;
 
     ASSERT(!is_idle_vcpu(vc));
-    ASSERT(list_empty(&svc->runq_elem));
+    ASSERT(!vcpu_on_runq(svc));
 
     SCHED_STAT_CRANK(vcpu_remove);
 
@@ -3154,7 +3274,7 @@ csched2_runtime(const struct scheduler *ops, int cpu,
     s_time_t time, min_time;
     int rt_credit; /* Proposed runtime measured in credits */
     struct csched2_runqueue_data *rqd = c2rqd(ops, cpu);
-    struct list_head *runq = &rqd->runq;
+    struct csched2_vcpu *swait;
     struct csched2_private *prv = csched2_priv(ops);
 
     /*
@@ -3192,10 +3312,9 @@ csched2_runtime(const struct scheduler *ops, int cpu,
      * 2) If there's someone waiting whose credit is positive,
      *    run until your credit ~= his.
      */
-    if ( ! list_empty(runq) )
+    swait = runq_first(&rqd->runq);
+    if ( swait != NULL )
     {
-        struct csched2_vcpu *swait = runq_elem(runq->next);
-
         if ( ! is_idle_vcpu(swait->vcpu)
              && swait->credit > 0 )
         {
@@ -3251,7 +3370,7 @@ runq_candidate(struct csched2_runqueue_data *rqd,
                int cpu, s_time_t now,
                unsigned int *skipped)
 {
-    struct list_head *iter, *temp;
+    struct rb_node *iter;
     struct csched2_vcpu *snext = NULL;
     struct csched2_private *prv = csched2_priv(per_cpu(scheduler, cpu));
     bool yield = false, soft_aff_preempt = false;
@@ -3279,7 +3398,7 @@ runq_candidate(struct csched2_runqueue_data *rqd,
          (now - scurr->vcpu->runstate.state_entry_time) <
           MICROSECS(prv->ratelimit_us) )
     {
-        if ( unlikely(tb_init_done) )
+        if ( tb_tracing() )
         {
             struct {
                 unsigned vcpu:16, dom:16;
@@ -3330,17 +3449,18 @@ runq_candidate(struct csched2_runqueue_data *rqd,
      *
      * Of course, we also default to idle also if scurr is not runnable.
      */
-    if ( vcpu_runnable(scurr->vcpu) && !soft_aff_preempt )
+    if ( vcpu_runnable(scurr->vcpu) && !soft_aff_preempt &&
+         sched_core_allowed(cpu, scurr->vcpu) )
         snext = scurr;
     else
         snext = csched2_vcpu(idle_vcpu[cpu]);
 
  check_runq:
-    list_for_each_safe( iter, temp, &rqd->runq )
+    for ( iter = rb_first(&rqd->runq); iter != NULL; iter = rb_next(iter) )
     {
-        struct csched2_vcpu * svc = list_entry(iter, struct csched2_vcpu, runq_elem);
+        struct csched2_vcpu * svc = runq_elem(iter);
 
-        if ( unlikely(tb_init_done) )
+        if ( tb_tracing() )
         {
             struct {
                 unsigned vcpu:16, dom:16;
@@ -3359,6 +3479,17 @@ runq_candidate(struct csched2_runqueue_data *rqd,
             continue;
         }
 
+        /*
+         * With core scheduling, vcpus of a domain different from the one
+         * our sibling(s) are running must wait for them to stop doing so.
+         */
+        if ( !sched_core_allowed(cpu, svc->vcpu) )
+        {
+            (*skipped)++;
+            SCHED_STAT_CRANK(deferred_to_core_sibling);
+            continue;
+        }
+
         /*
          * If a vcpu is meant to be picked up by another processor, and such
          * processor has not scheduled yet, leave it in the runqueue for him.
@@ -3397,7 +3528,7 @@ runq_candidate(struct csched2_runqueue_data *rqd,
         break;
     }
 
-    if ( unlikely(tb_init_done) )
+    if ( tb_tracing() )
     {
         struct {
             unsigned vcpu:16, dom:16;
@@ -3464,7 +3595,7 @@ csched2_schedule(
         smt_idle_mask_set(cpu, cpumask_scratch, &rqd->smt_idle);
     }
 
-    if ( unlikely(tb_init_done) )
+    if ( tb_tracing() )
     {
         struct {
             unsigned cpu:16, rq_id:16;
@@ -3740,7 +3871,7 @@ csched2_dump(const struct scheduler *ops)
     for_each_cpu(i, &prv->active_queues)
     {
         struct csched2_runqueue_data *rqd = prv->rqd + i;
-        struct list_head *iter, *runq = &rqd->runq;
+        struct rb_node *iter;
         int loop = 0;
 
         /* We need the lock to scan the runqueue. */
@@ -3752,7 +3883,7 @@ csched2_dump(const struct scheduler *ops)
             dump_pcpu(ops, j);
 
         printk("RUNQ:\n");
-        list_for_each( iter, runq )
+        for ( iter = rb_first(&rqd->runq); iter != NULL; iter = rb_next(iter) )
         {
             struct csched2_vcpu *svc = runq_elem(iter);
 
@@ -3940,12 +4071,14 @@ csched2_init(struct scheduler *ops)
            XENLOG_INFO " load_window_shift: %d\n"
            XENLOG_INFO " underload_balance_tolerance: %d\n"
            XENLOG_INFO " overload_balance_tolerance: %d\n"
+           XENLOG_INFO " balance_level_cost: %u\n"
            XENLOG_INFO " runqueues arrangement: %s\n"
            XENLOG_INFO " cap enforcement granularity: %dms\n",
            opt_load_precision_shift,
            opt_load_window_shift,
            opt_underload_balance_tolerance,
            opt_overload_balance_tolerance,
+           opt_balance_level_cost,
            opt_runqueue_str[opt_runqueue],
            opt_cap_period);
 
@@ -3956,6 +4089,13 @@ csched2_init(struct scheduler *ops)
         opt_load_precision_shift = LOADAVG_PRECISION_SHIFT_MIN;
     }
 
+    if ( opt_balance_level_cost > BALANCE_LEVEL_COST_MAX )
+    {
+        printk("WARNING: %s: opt_balance_level_cost %u above max %d, resetting\n",
+               __func__, opt_balance_level_cost, BALANCE_LEVEL_COST_MAX);
+        opt_balance_level_cost = BALANCE_LEVEL_COST_MAX;
+    }
+
     if ( opt_load_window_shift <= LOADAVG_GRANULARITY_SHIFT )
     {
         printk("WARNING: %s: opt_load_window_shift %d too short, resetting\n",
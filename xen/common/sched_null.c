@@ -44,6 +44,14 @@
 #define TRC_SNULL_SCHEDULE      TRC_SCHED_CLASS_EVT(SNULL, 5)
 #define TRC_SNULL_TASKLET       TRC_SCHED_CLASS_EVT(SNULL, 6)
 
+/*
+ * If sched_null_dedicated is set, pCPUs with a vCPU assigned are marked as
+ * dedicated, so that tasklets scheduled from them, which would preempt the
+ * vCPU, are run on other pCPUs (see tasklet_schedule()).
+ */
+static bool __read_mostly opt_null_dedicated;
+boolean_param("sched_null_dedicated", opt_null_dedicated);
+
 /*
  * Locking:
  * - Scheduler-lock (a.k.a. runqueue lock):
@@ -195,6 +203,7 @@ static void null_deinit_pdata(const struct scheduler *ops, void *pcpu, int cpu)
     ASSERT(!pcpu);
 
     cpumask_clear_cpu(cpu, &prv->cpus_free);
+    cpumask_clear_cpu(cpu, &sched_dedicated_cpus);
     per_cpu(npc, cpu).vcpu = NULL;
 }
 
@@ -289,6 +298,27 @@ static void null_dom_destroy(const struct scheduler *ops, struct domain *d)
  *
  * So this is not part of any hot path.
  */
+/*
+ * With core scheduling, a vCPU can only run when the sibling hyperthreads
+ * of its pCPU are idle or running vCPUs of its same domain. We therefore
+ * prefer assigning vCPUs to pCPUs whose siblings are either free, or have
+ * vCPUs of the same domain assigned to them.
+ */
+static bool core_compatible(unsigned int cpu, const struct vcpu *v)
+{
+    unsigned int sibling;
+
+    for_each_cpu ( sibling, per_cpu(cpu_sibling_mask, cpu) )
+    {
+        const struct vcpu *sv = per_cpu(npc, sibling).vcpu;
+
+        if ( sibling != cpu && sv != NULL && sv->domain != v->domain )
+            return false;
+    }
+
+    return true;
+}
+
 static unsigned int pick_cpu(struct null_private *prv, struct vcpu *v)
 {
     unsigned int bs;
@@ -323,6 +353,14 @@ static unsigned int pick_cpu(struct null_private *prv, struct vcpu *v)
         /* If not, just go for a free pCPU, within our affinity, if any */
         cpumask_and(cpumask_scratch_cpu(cpu), cpumask_scratch_cpu(cpu),
                     &prv->cpus_free);
+
+        if ( sched_core_enabled )
+        {
+            for_each_cpu ( new_cpu, cpumask_scratch_cpu(cpu) )
+                if ( core_compatible(new_cpu, v) )
+                    goto out;
+        }
+
         new_cpu = cpumask_first(cpumask_scratch_cpu(cpu));
 
         if ( likely(new_cpu != nr_cpu_ids) )
@@ -344,7 +382,7 @@ static unsigned int pick_cpu(struct null_private *prv, struct vcpu *v)
     new_cpu = cpumask_any(cpumask_scratch_cpu(cpu));
 
  out:
-    if ( unlikely(tb_init_done) )
+    if ( tb_tracing() )
     {
         struct {
             uint16_t vcpu, dom;
@@ -365,10 +403,12 @@ static void vcpu_assign(struct null_private *prv, struct vcpu *v,
     per_cpu(npc, cpu).vcpu = v;
     v->processor = cpu;
     cpumask_clear_cpu(cpu, &prv->cpus_free);
+    if ( opt_null_dedicated )
+        cpumask_set_cpu(cpu, &sched_dedicated_cpus);
 
     dprintk(XENLOG_G_INFO, "%d <-- d%dv%d\n", cpu, v->domain->domain_id, v->vcpu_id);
 
-    if ( unlikely(tb_init_done) )
+    if ( tb_tracing() )
     {
         struct {
             uint16_t vcpu, dom;
@@ -386,10 +426,11 @@ static void vcpu_deassign(struct null_private *prv, struct vcpu *v,
 {
     per_cpu(npc, cpu).vcpu = NULL;
     cpumask_set_cpu(cpu, &prv->cpus_free);
+    cpumask_clear_cpu(cpu, &sched_dedicated_cpus);
 
     dprintk(XENLOG_G_INFO, "%d <-- NULL (d%dv%d)\n", cpu, v->domain->domain_id, v->vcpu_id);
 
-    if ( unlikely(tb_init_done) )
+    if ( tb_tracing() )
     {
         struct {
             uint16_t vcpu, dom;
@@ -614,7 +655,7 @@ static void null_vcpu_migrate(const struct scheduler *ops, struct vcpu *v,
     if ( v->processor == new_cpu )
         return;
 
-    if ( unlikely(tb_init_done) )
+    if ( tb_tracing() )
     {
         struct {
             uint16_t vcpu, dom;
@@ -728,7 +769,7 @@ static struct task_slice null_schedule(const struct scheduler *ops,
     SCHED_STAT_CRANK(schedule);
     NULL_VCPU_CHECK(current);
 
-    if ( unlikely(tb_init_done) )
+    if ( tb_tracing() )
     {
         struct {
             uint16_t tasklet, cpu;
@@ -801,6 +842,17 @@ static struct task_slice null_schedule(const struct scheduler *ops,
     if ( unlikely(ret.task == NULL || !vcpu_runnable(ret.task)) )
         ret.task = idle_vcpu[cpu];
 
+    /*
+     * With core scheduling, if our siblings are running another domain, we
+     * have to stay idle, until they stop doing that (when they do, they will
+     * poke us, see sched_core_kick_siblings()).
+     */
+    if ( unlikely(!sched_core_allowed(cpu, ret.task)) )
+    {
+        SCHED_STAT_CRANK(deferred_to_core_sibling);
+        ret.task = idle_vcpu[cpu];
+    }
+
     NULL_VCPU_CHECK(ret.task);
     return ret;
 }
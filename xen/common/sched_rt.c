@@ -30,6 +30,7 @@
 #include <xen/trace.h>
 #include <xen/err.h>
 #include <xen/guest_access.h>
+#include <xen/rbtree.h>
 
 /*
  * TODO:
@@ -171,6 +172,7 @@
 #define TRC_RTDS_BUDGET_REPLENISH TRC_SCHED_CLASS_EVT(RTDS, 4)
 #define TRC_RTDS_SCHED_TASKLET    TRC_SCHED_CLASS_EVT(RTDS, 5)
 #define TRC_RTDS_SCHEDULE         TRC_SCHED_CLASS_EVT(RTDS, 6)
+#define TRC_RTDS_REPL_HANDLER     TRC_SCHED_CLASS_EVT(RTDS, 7)
 
 static void repl_timer_handler(void *data);
 
@@ -183,11 +185,11 @@ struct rt_private {
     spinlock_t lock;            /* the global coarse-grained lock */
     struct list_head sdom;      /* list of availalbe domains, used for dump */
 
-    struct list_head runq;      /* ordered list of runnable vcpus */
+    struct rb_root runq;        /* ordered tree of runnable vcpus */
     struct list_head depletedq; /* unordered list of depleted vcpus */
 
     struct timer repl_timer;    /* replenishment timer */
-    struct list_head replq;     /* ordered list of vcpus that need replenishment */
+    struct rb_root replq;       /* ordered tree of vcpus that need replenishment */
 
     cpumask_t tickled;          /* cpus been tickled */
 };
@@ -196,8 +198,9 @@ struct rt_private {
  * Virtual CPU
  */
 struct rt_vcpu {
-    struct list_head q_elem;     /* on the runq/depletedq list */
-    struct list_head replq_elem; /* on the replenishment events list */
+    struct rb_node q_elem;       /* on the runq tree */
+    struct list_head depleted_elem; /* on the depletedq list */
+    struct rb_node replq_elem;   /* on the replenishment events tree */
 
     /* VCPU parameters, in nanoseconds */
     s_time_t period;
@@ -243,7 +246,7 @@ static inline struct rt_dom *rt_dom(const struct domain *dom)
     return dom->sched_priv;
 }
 
-static inline struct list_head *rt_runq(const struct scheduler *ops)
+static inline struct rb_root *rt_runq(const struct scheduler *ops)
 {
     return &rt_priv(ops)->runq;
 }
@@ -253,7 +256,7 @@ static inline struct list_head *rt_depletedq(const struct scheduler *ops)
     return &rt_priv(ops)->depletedq;
 }
 
-static inline struct list_head *rt_replq(const struct scheduler *ops)
+static inline struct rb_root *rt_replq(const struct scheduler *ops)
 {
     return &rt_priv(ops)->replq;
 }
@@ -266,29 +269,47 @@ static inline bool has_extratime(const struct rt_vcpu *svc)
 /*
  * Helper functions for manipulating the runqueue, the depleted queue,
  * and the replenishment events queue.
+ *
+ * The runqueue and the replenishment events queue are rbtrees, kept
+ * ordered by the vcpus' priority and deadline, so that both inserting
+ * a vcpu and finding the one with the earliest deadline only cost
+ * O(log(n)), even with many vcpus in the cpupool. The depleted queue
+ * is not ordered at all, so it can stay a plain list.
  */
+static inline bool
+vcpu_on_runq(const struct rt_vcpu *svc)
+{
+    return !RB_EMPTY_NODE(&svc->q_elem);
+}
+
+static inline bool
+vcpu_on_depletedq(const struct rt_vcpu *svc)
+{
+    return !list_empty(&svc->depleted_elem);
+}
+
 static int
 vcpu_on_q(const struct rt_vcpu *svc)
 {
-   return !list_empty(&svc->q_elem);
+   return vcpu_on_runq(svc) || vcpu_on_depletedq(svc);
 }
 
 static struct rt_vcpu *
-q_elem(struct list_head *elem)
+q_elem(struct rb_node *elem)
 {
-    return list_entry(elem, struct rt_vcpu, q_elem);
+    return rb_entry(elem, struct rt_vcpu, q_elem);
 }
 
 static struct rt_vcpu *
-replq_elem(struct list_head *elem)
+replq_elem(struct rb_node *elem)
 {
-    return list_entry(elem, struct rt_vcpu, replq_elem);
+    return rb_entry(elem, struct rt_vcpu, replq_elem);
 }
 
 static int
 vcpu_on_replq(const struct rt_vcpu *svc)
 {
-    return !list_empty(&svc->replq_elem);
+    return !RB_EMPTY_NODE(&svc->replq_elem);
 }
 
 /*
@@ -375,7 +396,9 @@ rt_dump_pcpu(const struct scheduler *ops, int cpu)
 static void
 rt_dump(const struct scheduler *ops)
 {
-    struct list_head *runq, *depletedq, *replq, *iter;
+    struct list_head *depletedq, *iter;
+    struct rb_root *runq, *replq;
+    struct rb_node *node;
     struct rt_private *prv = rt_priv(ops);
     struct rt_vcpu *svc;
     struct rt_dom *sdom;
@@ -391,23 +414,23 @@ rt_dump(const struct scheduler *ops)
     replq = rt_replq(ops);
 
     printk("Global RunQueue info:\n");
-    list_for_each ( iter, runq )
+    for ( node = rb_first(runq); node != NULL; node = rb_next(node) )
     {
-        svc = q_elem(iter);
+        svc = q_elem(node);
         rt_dump_vcpu(ops, svc);
     }
 
     printk("Global DepletedQueue info:\n");
     list_for_each ( iter, depletedq )
     {
-        svc = q_elem(iter);
+        svc = list_entry(iter, struct rt_vcpu, depleted_elem);
         rt_dump_vcpu(ops, svc);
     }
 
     printk("Global Replenishment Events info:\n");
-    list_for_each ( iter, replq )
+    for ( node = rb_first(replq); node != NULL; node = rb_next(node) )
     {
-        svc = replq_elem(iter);
+        svc = replq_elem(node);
         rt_dump_vcpu(ops, svc);
     }
 
@@ -494,34 +517,41 @@ rt_update_deadline(s_time_t now, struct rt_vcpu *svc)
  * are dealing with).
  */
 static inline bool
-deadline_queue_remove(struct list_head *queue, struct list_head *elem)
+deadline_queue_remove(struct rb_root *queue, struct rb_node *elem)
 {
-    int pos = 0;
+    bool first = rb_first(queue) == elem;
 
-    if ( queue->next != elem )
-        pos = 1;
-
-    list_del_init(elem);
-    return !pos;
+    rb_erase(elem, queue);
+    RB_CLEAR_NODE(elem);
+    return first;
 }
 
 static inline bool
-deadline_queue_insert(struct rt_vcpu * (*qelem)(struct list_head *),
-                      struct rt_vcpu *svc, struct list_head *elem,
-                      struct list_head *queue)
+deadline_queue_insert(struct rt_vcpu * (*qelem)(struct rb_node *),
+                      struct rt_vcpu *svc, struct rb_node *elem,
+                      struct rb_root *queue)
 {
-    struct list_head *iter;
-    int pos = 0;
+    struct rb_node **node = &queue->rb_node, *parent = NULL;
+    bool first = true;
 
-    list_for_each ( iter, queue )
+    /*
+     * Vcpus with the same priority and deadline as svc stay in front
+     * of it, as it would have happened if we were scanning a list.
+     */
+    while ( *node )
     {
-        struct rt_vcpu * iter_svc = (*qelem)(iter);
-        if ( compare_vcpu_priority(svc, iter_svc) > 0 )
-            break;
-        pos++;
+        parent = *node;
+        if ( compare_vcpu_priority(svc, (*qelem)(parent)) > 0 )
+            node = &parent->rb_left;
+        else
+        {
+            node = &parent->rb_right;
+            first = false;
+        }
     }
-    list_add_tail(elem, iter);
-    return !pos;
+    rb_link_node(elem, parent, node);
+    rb_insert_color(elem, queue);
+    return first;
 }
 #define deadline_runq_insert(...) \
   deadline_queue_insert(&q_elem, ##__VA_ARGS__)
@@ -529,17 +559,21 @@ deadline_queue_insert(struct rt_vcpu * (*qelem)(struct list_head *),
   deadline_queue_insert(&replq_elem, ##__VA_ARGS__)
 
 static inline void
-q_remove(struct rt_vcpu *svc)
+q_remove(const struct scheduler *ops, struct rt_vcpu *svc)
 {
     ASSERT( vcpu_on_q(svc) );
-    list_del_init(&svc->q_elem);
+
+    if ( vcpu_on_runq(svc) )
+        deadline_queue_remove(rt_runq(ops), &svc->q_elem);
+    else
+        list_del_init(&svc->depleted_elem);
 }
 
 static inline void
 replq_remove(const struct scheduler *ops, struct rt_vcpu *svc)
 {
     struct rt_private *prv = rt_priv(ops);
-    struct list_head *replq = rt_replq(ops);
+    struct rb_root *replq = rt_replq(ops);
 
     ASSERT( vcpu_on_replq(svc) );
 
@@ -551,9 +585,9 @@ replq_remove(const struct scheduler *ops, struct rt_vcpu *svc)
          * queue is due. If it is such vcpu that we just removed, we may
          * need to reprogram the timer.
          */
-        if ( !list_empty(replq) )
+        if ( !RB_EMPTY_ROOT(replq) )
         {
-            struct rt_vcpu *svc_next = replq_elem(replq->next);
+            struct rt_vcpu *svc_next = replq_elem(rb_first(replq));
             set_timer(&prv->repl_timer, svc_next->cur_deadline);
         }
         else
@@ -570,7 +604,7 @@ static void
 runq_insert(const struct scheduler *ops, struct rt_vcpu *svc)
 {
     struct rt_private *prv = rt_priv(ops);
-    struct list_head *runq = rt_runq(ops);
+    struct rb_root *runq = rt_runq(ops);
 
     ASSERT( spin_is_locked(&prv->lock) );
     ASSERT( !vcpu_on_q(svc) );
@@ -581,13 +615,13 @@ runq_insert(const struct scheduler *ops, struct rt_vcpu *svc)
          has_extratime(svc) )
         deadline_runq_insert(svc, &svc->q_elem, runq);
     else
-        list_add(&svc->q_elem, &prv->depletedq);
+        list_add(&svc->depleted_elem, &prv->depletedq);
 }
 
 static void
 replq_insert(const struct scheduler *ops, struct rt_vcpu *svc)
 {
-    struct list_head *replq = rt_replq(ops);
+    struct rb_root *replq = rt_replq(ops);
     struct rt_private *prv = rt_priv(ops);
 
     ASSERT( !vcpu_on_replq(svc) );
@@ -609,7 +643,7 @@ replq_insert(const struct scheduler *ops, struct rt_vcpu *svc)
 static void
 replq_reinsert(const struct scheduler *ops, struct rt_vcpu *svc)
 {
-    struct list_head *replq = rt_replq(ops);
+    struct rb_root *replq = rt_replq(ops);
     struct rt_vcpu *rearm_svc = svc;
     bool_t rearm = 0;
 
@@ -627,7 +661,7 @@ replq_reinsert(const struct scheduler *ops, struct rt_vcpu *svc)
     if ( deadline_queue_remove(replq, &svc->replq_elem) )
     {
         deadline_replq_insert(svc, &svc->replq_elem, replq);
-        rearm_svc = replq_elem(replq->next);
+        rearm_svc = replq_elem(rb_first(replq));
         rearm = 1;
     }
     else
@@ -678,9 +712,9 @@ rt_init(struct scheduler *ops)
 
     spin_lock_init(&prv->lock);
     INIT_LIST_HEAD(&prv->sdom);
-    INIT_LIST_HEAD(&prv->runq);
+    prv->runq = RB_ROOT;
     INIT_LIST_HEAD(&prv->depletedq);
-    INIT_LIST_HEAD(&prv->replq);
+    prv->replq = RB_ROOT;
 
     ops->sched_data = prv;
     rc = 0;
@@ -880,8 +914,9 @@ rt_alloc_vdata(const struct scheduler *ops, struct vcpu *vc, void *dd)
     if ( svc == NULL )
         return NULL;
 
-    INIT_LIST_HEAD(&svc->q_elem);
-    INIT_LIST_HEAD(&svc->replq_elem);
+    RB_CLEAR_NODE(&svc->q_elem);
+    INIT_LIST_HEAD(&svc->depleted_elem);
+    RB_CLEAR_NODE(&svc->replq_elem);
     svc->flags = 0U;
     svc->sdom = dd;
     svc->vcpu = vc;
@@ -959,7 +994,7 @@ rt_vcpu_remove(const struct scheduler *ops, struct vcpu *vc)
 
     lock = vcpu_schedule_lock_irq(vc);
     if ( vcpu_on_q(svc) )
-        q_remove(svc);
+        q_remove(ops, svc);
 
     if ( vcpu_on_replq(svc) )
         replq_remove(ops,svc);
@@ -1038,14 +1073,14 @@ burn_budget(const struct scheduler *ops, struct rt_vcpu *svc, s_time_t now)
 static struct rt_vcpu *
 runq_pick(const struct scheduler *ops, const cpumask_t *mask)
 {
-    struct list_head *runq = rt_runq(ops);
-    struct list_head *iter;
+    struct rb_root *runq = rt_runq(ops);
+    struct rb_node *iter;
     struct rt_vcpu *svc = NULL;
     struct rt_vcpu *iter_svc = NULL;
     cpumask_t cpu_common;
     cpumask_t *online;
 
-    list_for_each ( iter, runq )
+    for ( iter = rb_first(runq); iter != NULL; iter = rb_next(iter) )
     {
         iter_svc = q_elem(iter);
 
@@ -1147,7 +1182,7 @@ rt_schedule(const struct scheduler *ops, s_time_t now, bool_t tasklet_work_sched
     {
         if ( snext != scurr )
         {
-            q_remove(snext);
+            q_remove(ops, snext);
             __set_bit(__RTDS_scheduled, &snext->flags);
         }
         if ( snext->vcpu->processor != cpu )
@@ -1178,7 +1213,7 @@ rt_vcpu_sleep(const struct scheduler *ops, struct vcpu *vc)
         cpu_raise_softirq(vc->processor, SCHEDULE_SOFTIRQ);
     else if ( vcpu_on_q(svc) )
     {
-        q_remove(svc);
+        q_remove(ops, svc);
         replq_remove(ops, svc);
     }
     else if ( svc->flags & RTDS_delayed_runq_add )
@@ -1493,11 +1528,12 @@ static void repl_timer_handler(void *data){
     s_time_t now;
     struct scheduler *ops = data;
     struct rt_private *prv = rt_priv(ops);
-    struct list_head *replq = rt_replq(ops);
-    struct list_head *runq = rt_runq(ops);
-    struct list_head *iter, *tmp;
+    struct rb_root *replq = rt_replq(ops);
+    struct rb_root *runq = rt_runq(ops);
+    struct rb_root tmp_replq = RB_ROOT;
+    struct rb_node *node;
     struct rt_vcpu *svc;
-    LIST_HEAD(tmp_replq);
+    unsigned int nr_repl = 0;
 
     spin_lock_irq(&prv->lock);
 
@@ -1505,43 +1541,47 @@ static void repl_timer_handler(void *data){
 
     /*
      * Do the replenishment and move replenished vcpus
-     * to the temporary list to tickle.
+     * to the temporary queue to tickle.
      * If svc is on run queue, we need to put it at
      * the correct place since its deadline changes.
+     *
+     * Since the replenishment queue is ordered, we only ever look
+     * at the vcpus whose replenishment is actually due (plus one).
      */
-    list_for_each_safe ( iter, tmp, replq )
+    while ( (node = rb_first(replq)) != NULL )
     {
-        svc = replq_elem(iter);
+        svc = replq_elem(node);
 
         if ( now < svc->cur_deadline )
             break;
 
-        list_del(&svc->replq_elem);
+        deadline_queue_remove(replq, &svc->replq_elem);
         rt_update_deadline(now, svc);
-        list_add(&svc->replq_elem, &tmp_replq);
+        deadline_replq_insert(svc, &svc->replq_elem, &tmp_replq);
+        nr_repl++;
 
         if ( vcpu_on_q(svc) )
         {
-            q_remove(svc);
+            q_remove(ops, svc);
             runq_insert(ops, svc);
         }
     }
 
     /*
-     * Iterate through the list of updated vcpus.
+     * Iterate through the queue of updated vcpus.
      * If an updated vcpu is running, tickle the head of the
      * runqueue if it has a higher priority.
      * If an updated vcpu was depleted and on the runqueue, tickle it.
-     * Finally, reinsert the vcpus back to replenishement events list.
+     * Finally, reinsert the vcpus back to replenishement events queue.
      */
-    list_for_each_safe ( iter, tmp, &tmp_replq )
+    while ( (node = rb_first(&tmp_replq)) != NULL )
     {
-        svc = replq_elem(iter);
+        svc = replq_elem(node);
 
         if ( curr_on_cpu(svc->vcpu->processor) == svc->vcpu &&
-             !list_empty(runq) )
+             !RB_EMPTY_ROOT(runq) )
         {
-            struct rt_vcpu *next_on_runq = q_elem(runq->next);
+            struct rt_vcpu *next_on_runq = q_elem(rb_first(runq));
 
             if ( compare_vcpu_priority(svc, next_on_runq) < 0 )
                 runq_tickle(ops, next_on_runq);
@@ -1550,17 +1590,35 @@ static void repl_timer_handler(void *data){
                   vcpu_on_q(svc) )
             runq_tickle(ops, svc);
 
-        list_del(&svc->replq_elem);
+        deadline_queue_remove(&tmp_replq, &svc->replq_elem);
         deadline_replq_insert(svc, &svc->replq_elem, replq);
     }
 
     /*
-     * If there are vcpus left in the replenishment event list,
+     * If there are vcpus left in the replenishment event queue,
      * set the next replenishment to happen at the deadline of
      * the one in the front.
      */
-    if ( !list_empty(replq) )
-        set_timer(&prv->repl_timer, replq_elem(replq->next)->cur_deadline);
+    if ( !RB_EMPTY_ROOT(replq) )
+        set_timer(&prv->repl_timer, replq_elem(rb_first(replq))->cur_deadline);
+
+    /*
+     * Let's trace for how long we have been holding the global lock,
+     * and for how many vcpus, so that it is possible to check how
+     * much the handler is costing us.
+     */
+    if ( tb_tracing() )
+    {
+        struct __packed {
+            uint64_t hold_time;
+            unsigned nr_repl;
+        } d;
+        d.hold_time = NOW() - now;
+        d.nr_repl = nr_repl;
+        trace_var(TRC_RTDS_REPL_HANDLER, 1,
+                  sizeof(d),
+                  (unsigned char *) &d);
+    }
 
     spin_unlock_irq(&prv->lock);
 }
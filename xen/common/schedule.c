@@ -34,6 +34,8 @@
 #include <xen/cpu.h>
 #include <xen/preempt.h>
 #include <xen/event.h>
+#include <xen/pmstat.h>
+#include <xen/log2hist.h>
 #include <public/sched.h>
 #include <xsm/xsm.h>
 #include <xen/err.h>
@@ -49,6 +51,53 @@ string_param("sched", opt_sched);
 bool_t sched_smt_power_savings = 0;
 boolean_param("sched_smt_power_savings", sched_smt_power_savings);
 
+cpumask_t sched_dedicated_cpus;
+
+/*
+ * Pick an online pCPU, not dedicated to any vCPU, where work that would
+ * otherwise disturb cpu (which is dedicated) can be done instead. Falls
+ * back to cpu itself, if there are no such pCPUs.
+ */
+unsigned int sched_housekeeping_cpu(unsigned int cpu)
+{
+    unsigned int hk;
+
+    hk = cpumask_cycle(cpu, &cpu_online_map);
+    while ( hk != cpu )
+    {
+        if ( !cpu_is_dedicated(hk) )
+            return hk;
+        hk = cpumask_cycle(hk, &cpu_online_map);
+    }
+
+    return cpu;
+}
+
+/*
+ * if sched_smt_cosched is set, sibling hyperthreads are only ever handed
+ * vCPUs of the same domain at any given time (see sched_core_allowed()).
+ */
+bool __read_mostly sched_core_enabled;
+boolean_param("sched_smt_cosched", sched_core_enabled);
+
+static bool sched_core_supported(const struct scheduler *s)
+{
+    return s->sched_id == XEN_SCHEDULER_CREDIT2 ||
+           s->sched_id == XEN_SCHEDULER_NULL;
+}
+
+/*
+ * Serializes the scheduling decisions of the threads of a core, when core
+ * scheduling is enabled. The lock of the first thread of the core is used.
+ */
+static DEFINE_PER_CPU(spinlock_t, sched_core_lock);
+
+static inline spinlock_t *sched_core_lock(unsigned int cpu)
+{
+    return &per_cpu(sched_core_lock,
+                    cpumask_first(per_cpu(cpu_sibling_mask, cpu)));
+}
+
 /* Default scheduling rate limit: 1ms 
  * The behavior when sched_ratelimit_us is greater than sched_credit_tslice_ms is undefined
  * */
@@ -174,6 +223,185 @@ static inline void vcpu_urgent_count_update(struct vcpu *v)
     }
 }
 
+/*
+ * Scheduling latency statistics (XEN_SYSCTL_sched_stats). They are taken
+ * from the runstate changes, which all schedulers go through, and updated
+ * with the vCPU's scheduler lock held. A vCPU becoming runnable counts
+ * towards the depth of the pCPU it is on at that time until it runs, or
+ * stops being runnable, even if the scheduler moves it meanwhile.
+ */
+struct sched_vcpu_stats {
+    int cpu;                    /* pCPU whose depth we count in, or -1 */
+    bool woken;                 /* became runnable from blocked/offline */
+    s_time_t since;
+    uint64_t wait_count, wait_ns;
+    uint64_t wake_count, wake_ns;
+    uint32_t wait_hist[XEN_SYSCTL_SCHEDSTATS_BUCKETS];
+    uint32_t wake_hist[XEN_SYSCTL_SCHEDSTATS_BUCKETS];
+};
+
+static bool __read_mostly sched_stats_enabled;
+static atomic_t sched_stats_runnable[NR_CPUS];
+static uint32_t sched_stats_depth[NR_CPUS][XEN_SYSCTL_SCHEDSTATS_DEPTHS];
+
+static void sched_stats_runstate(struct vcpu *v, int new_state, s_time_t now)
+{
+    struct sched_vcpu_stats *st = v->sched_stats;
+    s_time_t delta;
+
+    if ( new_state == RUNSTATE_runnable )
+    {
+        if ( !sched_stats_enabled )
+            return;
+        st->woken = v->runstate.state != RUNSTATE_running;
+        st->since = now;
+        st->cpu = v->processor;
+        atomic_inc(&sched_stats_runnable[st->cpu]);
+        return;
+    }
+
+    if ( v->runstate.state != RUNSTATE_runnable || st->cpu < 0 )
+        return;
+
+    atomic_dec(&sched_stats_runnable[st->cpu]);
+    st->cpu = -1;
+
+    if ( new_state != RUNSTATE_running || !sched_stats_enabled )
+        return;
+
+    delta = max_t(s_time_t, now - st->since, 0);
+
+    /* Bucket 0 is < 1024ns. */
+    st->wait_count++;
+    st->wait_ns += delta;
+    log2_hist_add(st->wait_hist, XEN_SYSCTL_SCHEDSTATS_BUCKETS, delta, 10);
+    if ( st->woken )
+    {
+        st->wake_count++;
+        st->wake_ns += delta;
+        log2_hist_add(st->wake_hist, XEN_SYSCTL_SCHEDSTATS_BUCKETS, delta, 10);
+    }
+}
+
+static void sched_stats_sample(unsigned int cpu)
+{
+    unsigned int depth = atomic_read(&sched_stats_runnable[cpu]);
+
+    sched_stats_depth[cpu][min_t(unsigned int, depth,
+                                 XEN_SYSCTL_SCHEDSTATS_DEPTHS - 1)]++;
+}
+
+static void sched_stats_reset_vcpu(struct sched_vcpu_stats *st)
+{
+    st->wait_count = st->wait_ns = 0;
+    st->wake_count = st->wake_ns = 0;
+    memset(st->wait_hist, 0, sizeof(st->wait_hist));
+    memset(st->wake_hist, 0, sizeof(st->wake_hist));
+}
+
+static int sched_stats_query_vcpus(struct xen_sysctl_sched_stats *op)
+{
+    struct xen_sysctl_schedstats_vcpu data;
+    struct domain *d;
+    struct vcpu *v;
+    int rc = 0;
+
+    d = rcu_lock_domain_by_id(op->domid);
+    if ( d == NULL )
+        return -ESRCH;
+
+    op->nr_elem = d->max_vcpus;
+
+    if ( !guest_handle_is_null(op->vcpus) )
+        for_each_vcpu ( d, v )
+        {
+            const struct sched_vcpu_stats *st = v->sched_stats;
+
+            if ( v->vcpu_id >= op->max_elem )
+                break;
+
+            memset(&data, 0, sizeof(data));
+            data.vcpu = v->vcpu_id;
+            data.wait_count = st->wait_count;
+            data.wait_ns = st->wait_ns;
+            data.wake_count = st->wake_count;
+            data.wake_ns = st->wake_ns;
+            memcpy(data.wait_hist, st->wait_hist, sizeof(data.wait_hist));
+            memcpy(data.wake_hist, st->wake_hist, sizeof(data.wake_hist));
+
+            if ( copy_to_guest_offset(op->vcpus, v->vcpu_id, &data, 1) )
+            {
+                rc = -EFAULT;
+                break;
+            }
+        }
+
+    rcu_unlock_domain(d);
+
+    return rc;
+}
+
+static int sched_stats_query_cpus(struct xen_sysctl_sched_stats *op)
+{
+    struct xen_sysctl_schedstats_cpu data;
+    unsigned int cpu, i = 0;
+
+    op->nr_elem = num_online_cpus();
+
+    if ( guest_handle_is_null(op->cpus) )
+        return 0;
+
+    for_each_online_cpu ( cpu )
+    {
+        if ( i >= op->max_elem )
+            break;
+
+        data.cpu = cpu;
+        memcpy(data.hist, sched_stats_depth[cpu], sizeof(data.hist));
+        if ( copy_to_guest_offset(op->cpus, i, &data, 1) )
+            return -EFAULT;
+        i++;
+    }
+
+    return 0;
+}
+
+int sched_stats_control(struct xen_sysctl_sched_stats *op)
+{
+    struct domain *d;
+    struct vcpu *v;
+
+    switch ( op->cmd )
+    {
+    case XEN_SYSCTL_SCHEDSTATS_query_vcpus:
+        op->enabled = sched_stats_enabled;
+        return sched_stats_query_vcpus(op);
+
+    case XEN_SYSCTL_SCHEDSTATS_query_cpus:
+        op->enabled = sched_stats_enabled;
+        return sched_stats_query_cpus(op);
+
+    case XEN_SYSCTL_SCHEDSTATS_reset:
+        rcu_read_lock(&domlist_read_lock);
+        for_each_domain ( d )
+            for_each_vcpu ( d, v )
+                sched_stats_reset_vcpu(v->sched_stats);
+        rcu_read_unlock(&domlist_read_lock);
+        memset(sched_stats_depth, 0, sizeof(sched_stats_depth));
+        return 0;
+
+    case XEN_SYSCTL_SCHEDSTATS_enable:
+        sched_stats_enabled = true;
+        return 0;
+
+    case XEN_SYSCTL_SCHEDSTATS_disable:
+        sched_stats_enabled = false;
+        return 0;
+    }
+
+    return -EINVAL;
+}
+
 static inline void vcpu_runstate_change(
     struct vcpu *v, int new_state, s_time_t new_entry_time)
 {
@@ -186,6 +414,11 @@ static inline void vcpu_runstate_change(
 
     trace_runstate_change(v, new_state);
 
+    /* Idle vCPUs have no stats; a vCPU still counted must be uncounted. */
+    if ( v->sched_stats &&
+         unlikely(sched_stats_enabled || v->sched_stats->cpu >= 0) )
+        sched_stats_runstate(v, new_state, new_entry_time);
+
     delta = new_entry_time - v->runstate.state_entry_time;
     if ( delta > 0 )
     {
@@ -277,10 +510,22 @@ int sched_init_vcpu(struct vcpu *v, unsigned int processor)
     init_timer(&v->poll_timer, poll_timer_fn,
                v, v->processor);
 
+    if ( !is_idle_domain(d) )
+    {
+        v->sched_stats = xzalloc(struct sched_vcpu_stats);
+        if ( v->sched_stats == NULL )
+            return 1;
+        v->sched_stats->cpu = -1;
+    }
+
     v->sched_priv = SCHED_OP(dom_scheduler(d), alloc_vdata, v,
 		             d->sched_priv);
     if ( v->sched_priv == NULL )
+    {
+        xfree(v->sched_stats);
+        v->sched_stats = NULL;
         return 1;
+    }
 
     /* Idle VCPUs are scheduled immediately, so don't put them in runqueue. */
     if ( is_idle_domain(d) )
@@ -378,21 +623,24 @@ int sched_move_domain(struct domain *d, struct cpupool *c)
          */
         spin_unlock_irq(lock);
 
+        /* Hand the old data back through vcpu_priv[] to free it later. */
         v->sched_priv = vcpu_priv[v->vcpu_id];
+        vcpu_priv[v->vcpu_id] = vcpudata;
         if ( !d->is_dying )
             sched_move_irqs(v);
 
         new_p = cpumask_cycle(new_p, c->cpu_valid);
 
         SCHED_OP(c->sched, insert_vcpu, v);
-
-        SCHED_OP(old_ops, free_vdata, vcpudata);
     }
 
     domain_update_node_affinity(d);
 
     domain_unpause(d);
 
+    /* Nothing below needs the domain to be paused. */
+    for_each_vcpu ( d, v )
+        SCHED_OP(old_ops, free_vdata, vcpu_priv[v->vcpu_id]);
     SCHED_OP(old_ops, free_domdata, old_domdata);
 
     xfree(vcpu_priv);
@@ -409,6 +657,10 @@ void sched_destroy_vcpu(struct vcpu *v)
         atomic_dec(&per_cpu(schedule_data, v->processor).urgent_count);
     SCHED_OP(vcpu_scheduler(v), remove_vcpu, v);
     SCHED_OP(vcpu_scheduler(v), free_vdata, v->sched_priv);
+    if ( v->sched_stats && v->sched_stats->cpu >= 0 )
+        atomic_dec(&sched_stats_runnable[v->sched_stats->cpu]);
+    xfree(v->sched_stats);
+    v->sched_stats = NULL;
 }
 
 int sched_init_domain(struct domain *d, int poolid)
@@ -480,6 +732,8 @@ void vcpu_wake(struct vcpu *v)
         if ( v->runstate.state >= RUNSTATE_blocked )
             vcpu_runstate_change(v, RUNSTATE_runnable, NOW());
         SCHED_OP(vcpu_scheduler(v), wake, v);
+        cpufreq_sched_wake(v->processor,
+                           ACCESS_ONCE(v->domain->cpufreq_boost));
     }
     else if ( !(v->pause_flags & VPF_blocked) )
     {
@@ -917,12 +1171,12 @@ static long do_poll(struct sched_poll *sched_poll)
 {
     struct vcpu   *v = current;
     struct domain *d = v->domain;
-    evtchn_port_t  port;
+    evtchn_port_t  ports[128], port = 0;
     long           rc;
     unsigned int   i;
 
     /* Fairly arbitrary limit. */
-    if ( sched_poll->nr_ports > 128 )
+    if ( sched_poll->nr_ports > ARRAY_SIZE(ports) )
         return -EINVAL;
 
     if ( !guest_handle_okay(sched_poll->ports, sched_poll->nr_ports) )
@@ -954,11 +1208,14 @@ static long do_poll(struct sched_poll *sched_poll)
     if ( local_events_need_delivery() )
         goto out;
 
+    /* All the ports in one go, rather than a guest access per port. */
+    rc = -EFAULT;
+    if ( __copy_from_guest(ports, sched_poll->ports, sched_poll->nr_ports) )
+        goto out;
+
     for ( i = 0; i < sched_poll->nr_ports; i++ )
     {
-        rc = -EFAULT;
-        if ( __copy_from_guest_offset(&port, sched_poll->ports, i, 1) )
-            goto out;
+        port = ports[i];
 
         rc = -EINVAL;
         if ( port >= d->max_evtchns )
@@ -1373,6 +1630,20 @@ static void vcpu_periodic_timer_work(struct vcpu *v)
     set_timer(&v->periodic_timer, periodic_next_event);
 }
 
+/*
+ * We are not running prev's domain any longer, so our idle siblings may now
+ * be able to run something they had to skip because of us: have them go
+ * through the scheduler again.
+ */
+static void sched_core_kick_siblings(unsigned int cpu)
+{
+    unsigned int sibling;
+
+    for_each_cpu ( sibling, per_cpu(cpu_sibling_mask, cpu) )
+        if ( sibling != cpu && is_idle_vcpu(curr_on_cpu(sibling)) )
+            cpu_raise_softirq(sibling, SCHEDULE_SOFTIRQ);
+}
+
 /* 
  * The main function
  * - deschedule the current domain (scheduler independent).
@@ -1388,6 +1659,7 @@ static void schedule(void)
     struct schedule_data *sd;
     spinlock_t           *lock;
     struct task_slice     next_slice;
+    spinlock_t           *core_lock = NULL;
     int cpu = smp_processor_id();
 
     ASSERT_NOT_IN_ATOMIC();
@@ -1416,8 +1688,23 @@ static void schedule(void)
 
     lock = pcpu_schedule_lock_irq(cpu);
 
+    /*
+     * With core scheduling, siblings must not change what they're running
+     * while we decide, or they can pick a different domain at the same time.
+     * This nests inside the scheduler lock(s), and schedulers never take
+     * another pCPU's scheduler lock in do_schedule(), unless with a trylock.
+     */
+    if ( sched_core_enabled )
+    {
+        core_lock = sched_core_lock(cpu);
+        spin_lock(core_lock);
+    }
+
     now = NOW();
 
+    if ( unlikely(sched_stats_enabled) )
+        sched_stats_sample(cpu);
+
     stop_timer(&sd->s_timer);
     
     /* get policy-specific decision on scheduling... */
@@ -1428,6 +1715,13 @@ static void schedule(void)
 
     sd->curr = next;
 
+    if ( core_lock )
+    {
+        spin_unlock(core_lock);
+        if ( !is_idle_vcpu(prev) && next->domain != prev->domain )
+            sched_core_kick_siblings(cpu);
+    }
+
     if ( next_slice.time >= 0 ) /* -ve means no limit */
         set_timer(&sd->s_timer, now + next_slice.time);
 
@@ -1542,6 +1836,7 @@ static int cpu_schedule_up(unsigned int cpu)
 
     per_cpu(scheduler, cpu) = &ops;
     spin_lock_init(&sd->_lock);
+    spin_lock_init(&per_cpu(sched_core_lock, cpu));
     sd->schedule_lock = &sd->_lock;
     sd->curr = idle_vcpu[cpu];
     init_timer(&sd->s_timer, s_timer_fn, NULL, cpu);
@@ -1705,6 +2000,15 @@ void __init scheduler_init(void)
     register_cpu_notifier(&cpu_schedule_nfb);
 
     printk("Using scheduler: %s (%s)\n", ops.name, ops.opt_name);
+    if ( sched_core_enabled && !sched_core_supported(&ops) )
+    {
+        printk(XENLOG_WARNING
+               "WARNING: %s does not support core scheduling, disabling it\n",
+               ops.name);
+        sched_core_enabled = false;
+    }
+    else if ( sched_core_enabled )
+        printk("Core scheduling enabled\n");
     if ( SCHED_OP(&ops, init) )
         panic("scheduler returned error on init");
 
@@ -1768,6 +2072,10 @@ int schedule_cpu_switch(unsigned int cpu, struct cpupool *c)
     if ( old_ops == new_ops )
         goto out;
 
+    /* Siblings in a pool not enforcing core scheduling would escape it. */
+    if ( sched_core_enabled && !sched_core_supported(new_ops) )
+        return -EOPNOTSUPP;
+
     /*
      * To setup the cpu for the new scheduler we need:
      *  - a valid instance of per-CPU scheduler specific data, as it is
@@ -5,6 +5,7 @@
 #include <xen/spinlock.h>
 #include <xen/guest_access.h>
 #include <xen/preempt.h>
+#include <xen/hash.h>
 #include <public/sysctl.h>
 #include <asm/processor.h>
 #include <asm/atomic.h>
@@ -120,6 +121,132 @@ void spin_debug_disable(void)
 
 #endif
 
+/*
+ * Sampling lock contention profiler.
+ *
+ * Unlike CONFIG_LOCK_PROFILE, this is always built in, and costs nothing
+ * until it's enabled (via XEN_SYSCTL_lockhist_op), and next to nothing on
+ * uncontended acquisitions even then. One every lock_hist_rate contended
+ * acquisitions on each CPU is sampled: the time spent waiting for the lock
+ * is accounted in a per-lock histogram, together with who was waiting.
+ *
+ * Locks are identified by their address, in a small, open addressing hash
+ * table. Entries are claimed, and counters are updated, with atomic ops
+ * only, so that no lock is needed for profiling locks. Keeping track of
+ * the top contending call sites is done in a "space saving" fashion (when
+ * all the slots are taken, the least contending one is replaced), and is
+ * hence approximate.
+ */
+#define LOCK_HIST_BITS    8
+#define LOCK_HIST_SIZE    (1u << LOCK_HIST_BITS)
+#define LOCK_HIST_BUCKETS XEN_SYSCTL_LOCKHIST_BUCKETS
+#define LOCK_HIST_SITES   XEN_SYSCTL_LOCKHIST_SITES
+
+struct lock_hist {
+    const void *lock;
+    uint32_t hist[LOCK_HIST_BUCKETS];
+    struct {
+        const void *addr;
+        uint32_t cnt;
+    } site[LOCK_HIST_SITES];
+};
+
+static struct lock_hist lock_hists[LOCK_HIST_SIZE];
+static unsigned int __read_mostly lock_hist_rate;
+static atomic_t lock_hist_dropped;
+static DEFINE_PER_CPU(unsigned int, lock_hist_count);
+static DEFINE_PER_CPU(unsigned int, lock_hist_nested);
+
+/* Decide whether to sample this contended acquisition (0 means no). */
+static s_time_t lock_hist_sample(void)
+{
+    unsigned int *count = &this_cpu(lock_hist_count);
+
+    if ( likely(!lock_hist_rate) || this_cpu(lock_hist_nested) ||
+         ++*count < lock_hist_rate )
+        return 0;
+
+    *count = 0;
+    return NOW();
+}
+
+static void lock_hist_record(const void *lock, const void *caller,
+                             s_time_t wait)
+{
+    unsigned int i, idx, bucket, min;
+    struct lock_hist *e;
+
+    idx = hash_ptr((void *)lock, LOCK_HIST_BITS);
+    for ( i = 0; i < LOCK_HIST_SIZE; i++ )
+    {
+        e = &lock_hists[(idx + i) % LOCK_HIST_SIZE];
+        if ( ACCESS_ONCE(e->lock) == lock ||
+             (e->lock == NULL && (cmpxchg(&e->lock, NULL, lock) == NULL ||
+                                  e->lock == lock)) )
+            break;
+    }
+    if ( i == LOCK_HIST_SIZE )
+    {
+        atomic_inc(&lock_hist_dropped);
+        return;
+    }
+
+    /* Bucket 0 is < 256ns, bucket i is [2^(i+7),2^(i+8)), last is the rest. */
+    bucket = min_t(unsigned int, flsl((unsigned long)wait >> 8),
+                   LOCK_HIST_BUCKETS - 1);
+    (void)arch_fetch_and_add(&e->hist[bucket], 1);
+
+    for ( i = min = 0; i < LOCK_HIST_SITES; i++ )
+    {
+        if ( ACCESS_ONCE(e->site[i].addr) == caller ||
+             (e->site[i].addr == NULL &&
+              cmpxchg(&e->site[i].addr, NULL, caller) == NULL) )
+        {
+            (void)arch_fetch_and_add(&e->site[i].cnt, 1);
+            return;
+        }
+        if ( e->site[i].cnt < e->site[min].cnt )
+            min = i;
+    }
+
+    /* All slots taken: evict the least contending site. Racy, but fine. */
+    ACCESS_ONCE(e->site[min].addr) = caller;
+    write_atomic(&e->site[min].cnt, e->site[min].cnt + 1);
+}
+
+s_time_t lock_hist_begin(void)
+{
+    s_time_t start = lock_hist_sample();
+
+    /* Don't sample the spinlocks used internally by, e.g., rwlocks. */
+    this_cpu(lock_hist_nested)++;
+
+    return start;
+}
+
+void lock_hist_end(const void *lock, const void *caller, s_time_t start)
+{
+    this_cpu(lock_hist_nested)--;
+
+    if ( unlikely(start) )
+        lock_hist_record(lock, caller, NOW() - start);
+}
+
+#define LOCK_HIST_VAR                                                        \
+    s_time_t hist_block = 0;                                                 \
+    bool hist_checked = false
+#define LOCK_HIST_BLOCK                                                      \
+    if ( unlikely(!hist_checked) )                                           \
+    {                                                                        \
+        hist_checked = true;                                                 \
+        hist_block = lock_hist_sample();                                     \
+    }
+#define LOCK_HIST_GOT(caller)                                                \
+    if ( unlikely(hist_block) )                                              \
+        lock_hist_record(lock, caller, NOW() - hist_block);
+
+#ifndef CONFIG_QUEUED_SPINLOCKS
+
 static always_inline spinlock_tickets_t observe_lock(spinlock_tickets_t *t)
 {
     spinlock_tickets_t v;
@@ -135,9 +262,12 @@ static always_inline u16 observe_head(spinlock_tickets_t *t)
     return read_atomic(&t->head);
 }
 
-void inline _spin_lock_cb(spinlock_t *lock, void (*cb)(void *), void *data)
+static always_inline void spin_lock_common(spinlock_t *lock,
+                                           void (*cb)(void *), void *data,
+                                           const void *caller)
 {
     spinlock_tickets_t tickets = SPINLOCK_TICKET_INC;
+    LOCK_HIST_VAR;
     LOCK_PROFILE_VAR;
 
     check_lock(&lock->debug);
@@ -146,36 +276,17 @@ void inline _spin_lock_cb(spinlock_t *lock, void (*cb)(void *), void *data)
     while ( tickets.tail != observe_head(&lock->tickets) )
     {
         LOCK_PROFILE_BLOCK;
+        LOCK_HIST_BLOCK;
         if ( unlikely(cb) )
             cb(data);
         arch_lock_relax();
     }
     LOCK_PROFILE_GOT;
+    LOCK_HIST_GOT(caller);
     preempt_disable();
     arch_lock_acquire_barrier();
 }
 
-void _spin_lock(spinlock_t *lock)
-{
-     _spin_lock_cb(lock, NULL, NULL);
-}
-
-void _spin_lock_irq(spinlock_t *lock)
-{
-    ASSERT(local_irq_is_enabled());
-    local_irq_disable();
-    _spin_lock(lock);
-}
-
-unsigned long _spin_lock_irqsave(spinlock_t *lock)
-{
-    unsigned long flags;
-
-    local_irq_save(flags);
-    _spin_lock(lock);
-    return flags;
-}
-
 void _spin_unlock(spinlock_t *lock)
 {
     arch_lock_release_barrier();
@@ -185,18 +296,6 @@ void _spin_unlock(spinlock_t *lock)
     arch_lock_signal();
 }
 
-void _spin_unlock_irq(spinlock_t *lock)
-{
-    _spin_unlock(lock);
-    local_irq_enable();
-}
-
-void _spin_unlock_irqrestore(spinlock_t *lock, unsigned long flags)
-{
-    _spin_unlock(lock);
-    local_irq_restore(flags);
-}
-
 int _spin_is_locked(spinlock_t *lock)
 {
     check_lock(&lock->debug);
@@ -261,6 +360,271 @@ void _spin_barrier(spinlock_t *lock)
     smp_mb();
 }
 
+#else /* CONFIG_QUEUED_SPINLOCKS */
+
+/*
+ * Queued spinlocks.
+ *
+ * Waiters queue up in FIFO order, each one spinning on its own per-CPU
+ * node, rather than all spinning on the lock (and hence on the same cache
+ * line). Only the waiter at the head of the queue looks at the lock, and
+ * when it gets it, it passes the headship to the next node in the queue.
+ *
+ * A CPU may be queued on more than one lock at the same time, because of
+ * nesting (e.g., a lock taken in IRQ context while spinning on a lock in
+ * normal context), hence there is one node per nesting level. If we ever
+ * nest deeper than that, we just spin, trying to grab the lock.
+ */
+struct spin_qnode {
+    struct spin_qnode *next;
+    bool locked;
+};
+
+#define SPIN_QNODES 4 /* Normal, IRQ, NMI and MCE context. */
+
+static DEFINE_PER_CPU(struct spin_qnode, spin_qnodes[SPIN_QNODES]);
+static DEFINE_PER_CPU(unsigned int, spin_qnodes_used);
+
+static always_inline u16 encode_tail(unsigned int cpu, unsigned int idx)
+{
+    return ((cpu + 1) << 2) | idx;
+}
+
+static always_inline struct spin_qnode *decode_tail(u16 tail)
+{
+    return &per_cpu(spin_qnodes, (tail >> 2) - 1)[tail & 3];
+}
+
+static always_inline spinlock_queue_t observe_queue(spinlock_queue_t *q)
+{
+    spinlock_queue_t v;
+
+    smp_rmb();
+    v.val = read_atomic(&q->val);
+    return v;
+}
+
+/* Grab the lock, but only if it is free and there is nobody queued. */
+static always_inline bool queue_trylock(spinlock_queue_t *q)
+{
+    spinlock_queue_t old, new;
+
+    old = observe_queue(q);
+    if ( (old.owner & SPINLOCK_QUEUE_LOCKED) || old.tail )
+        return false;
+    new = old;
+    new.owner |= SPINLOCK_QUEUE_LOCKED;
+
+    return cmpxchg(&q->val, old.val, new.val) == old.val;
+}
+
+static always_inline void spin_lock_common(spinlock_t *lock,
+                                           void (*cb)(void *), void *data,
+                                           const void *caller)
+{
+    spinlock_queue_t old, new;
+    struct spin_qnode *node, *next;
+    unsigned int idx;
+    u16 tail;
+    LOCK_HIST_VAR;
+    LOCK_PROFILE_VAR;
+
+    /* Make sure the tail encoding can't overflow. */
+    BUILD_BUG_ON(NR_CPUS >= (1u << 14));
+
+    check_lock(&lock->debug);
+
+    if ( likely(queue_trylock(&lock->queue)) )
+        goto out;
+
+    LOCK_PROFILE_BLOCK;
+    LOCK_HIST_BLOCK;
+
+    idx = this_cpu(spin_qnodes_used)++;
+    if ( unlikely(idx >= SPIN_QNODES) )
+    {
+        while ( !queue_trylock(&lock->queue) )
+        {
+            if ( unlikely(cb) )
+                cb(data);
+            arch_lock_relax();
+        }
+        goto release_node;
+    }
+
+    node = &this_cpu(spin_qnodes)[idx];
+    node->next = NULL;
+    node->locked = false;
+    tail = encode_tail(smp_processor_id(), idx);
+
+    /* Become the new tail of the queue, and get to know who was there. */
+    do {
+        old = observe_queue(&lock->queue);
+        new = old;
+        new.tail = tail;
+    } while ( cmpxchg(&lock->queue.val, old.val, new.val) != old.val );
+
+    /* Link to our predecessor, if any, and wait for it to hand over. */
+    if ( old.tail )
+    {
+        ACCESS_ONCE(decode_tail(old.tail)->next) = node;
+        while ( !read_atomic(&node->locked) )
+        {
+            if ( unlikely(cb) )
+                cb(data);
+            arch_lock_relax();
+        }
+    }
+
+    /*
+     * We are the head of the queue. Wait for the owner to release the lock
+     * and take it. If we are the last in the queue too, empty it.
+     */
+    for ( ; ; )
+    {
+        old = observe_queue(&lock->queue);
+        if ( old.owner & SPINLOCK_QUEUE_LOCKED )
+        {
+            if ( unlikely(cb) )
+                cb(data);
+            arch_lock_relax();
+            continue;
+        }
+        new = old;
+        new.owner |= SPINLOCK_QUEUE_LOCKED;
+        if ( new.tail == tail )
+            new.tail = 0;
+        if ( cmpxchg(&lock->queue.val, old.val, new.val) == old.val )
+            break;
+    }
+
+    /* Someone queued behind us: make it the new head of the queue. */
+    if ( new.tail )
+    {
+        while ( (next = ACCESS_ONCE(node->next)) == NULL )
+            cpu_relax();
+        write_atomic(&next->locked, true);
+        arch_lock_signal();
+    }
+
+ release_node:
+    this_cpu(spin_qnodes_used)--;
+ out:
+    LOCK_PROFILE_GOT;
+    LOCK_HIST_GOT(caller);
+    preempt_disable();
+    arch_lock_acquire_barrier();
+}
+
+void _spin_unlock(spinlock_t *lock)
+{
+    arch_lock_release_barrier();
+    preempt_enable();
+    LOCK_PROFILE_REL;
+    /* Only the holder writes the owner field, while the lock is held. */
+    write_atomic(&lock->queue.owner,
+                 (u16)((lock->queue.owner + SPINLOCK_QUEUE_RELEASE) &
+                       ~SPINLOCK_QUEUE_LOCKED));
+    arch_lock_signal();
+}
+
+int _spin_is_locked(spinlock_t *lock)
+{
+    check_lock(&lock->debug);
+
+    /* See the comment in the ticket locks' version of this function. */
+    return lock->recurse_cpu == SPINLOCK_NO_CPU
+           ? (lock->queue.owner & SPINLOCK_QUEUE_LOCKED) || lock->queue.tail
+           : lock->recurse_cpu == smp_processor_id();
+}
+
+int _spin_trylock(spinlock_t *lock)
+{
+    check_lock(&lock->debug);
+    if ( !queue_trylock(&lock->queue) )
+        return 0;
+#ifdef CONFIG_LOCK_PROFILE
+    if (lock->profile)
+        lock->profile->time_locked = NOW();
+#endif
+    preempt_disable();
+    /*
+     * cmpxchg() is a full barrier so no need for an
+     * arch_lock_acquire_barrier().
+     */
+    return 1;
+}
+
+void _spin_barrier(spinlock_t *lock)
+{
+    spinlock_queue_t sample;
+#ifdef CONFIG_LOCK_PROFILE
+    s_time_t block = NOW();
+#endif
+
+    check_barrier(&lock->debug);
+    smp_mb();
+    sample = observe_queue(&lock->queue);
+    if ( sample.owner & SPINLOCK_QUEUE_LOCKED )
+    {
+        /* Wait for the release count to change, i.e., for an unlock. */
+        while ( observe_queue(&lock->queue).owner == sample.owner )
+            arch_lock_relax();
+#ifdef CONFIG_LOCK_PROFILE
+        if ( lock->profile )
+        {
+            lock->profile->time_block += NOW() - block;
+            lock->profile->block_cnt++;
+        }
+#endif
+    }
+    smp_mb();
+}
+
+#endif /* CONFIG_QUEUED_SPINLOCKS */
+
+/*
+ * The wrappers pass their own return address down, so that the lock
+ * contention profiler can tell who is actually contending on a lock.
+ */
+void _spin_lock_cb(spinlock_t *lock, void (*cb)(void *), void *data)
+{
+    spin_lock_common(lock, cb, data, __builtin_return_address(0));
+}
+
+void _spin_lock(spinlock_t *lock)
+{
+    spin_lock_common(lock, NULL, NULL, __builtin_return_address(0));
+}
+
+void _spin_lock_irq(spinlock_t *lock)
+{
+    ASSERT(local_irq_is_enabled());
+    local_irq_disable();
+    spin_lock_common(lock, NULL, NULL, __builtin_return_address(0));
+}
+
+unsigned long _spin_lock_irqsave(spinlock_t *lock)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    spin_lock_common(lock, NULL, NULL, __builtin_return_address(0));
+    return flags;
+}
+
+void _spin_unlock_irq(spinlock_t *lock)
+{
+    _spin_unlock(lock);
+    local_irq_enable();
+}
+
+void _spin_unlock_irqrestore(spinlock_t *lock, unsigned long flags)
+{
+    _spin_unlock(lock);
+    local_irq_restore(flags);
+}
+
 int _spin_trylock_recursive(spinlock_t *lock)
 {
     unsigned int cpu = smp_processor_id();
@@ -308,6 +672,63 @@ void _spin_unlock_recursive(spinlock_t *lock)
     }
 }
 
+/* Dom0 control of the lock contention profiler */
+int lock_hist_control(struct xen_sysctl_lockhist_op *op)
+{
+    struct xen_sysctl_lockhist_data elem;
+    unsigned int i, j;
+
+    switch ( op->cmd )
+    {
+    case XEN_SYSCTL_LOCKHIST_set_rate:
+        lock_hist_rate = op->rate;
+        break;
+
+    case XEN_SYSCTL_LOCKHIST_reset:
+        memset(lock_hists, 0, sizeof(lock_hists));
+        atomic_set(&lock_hist_dropped, 0);
+        break;
+
+    case XEN_SYSCTL_LOCKHIST_query:
+        op->rate = lock_hist_rate;
+        op->dropped = atomic_read(&lock_hist_dropped);
+        op->nr_elem = 0;
+        for ( i = 0; i < LOCK_HIST_SIZE; i++ )
+        {
+            const struct lock_hist *e = &lock_hists[i];
+
+            if ( e->lock == NULL )
+                continue;
+
+            if ( op->nr_elem < op->max_elem )
+            {
+                memset(&elem, 0, sizeof(elem));
+                elem.lock = (unsigned long)e->lock;
+                snprintf(elem.name, sizeof(elem.name), "%ps", e->lock);
+                memcpy(elem.hist, e->hist, sizeof(elem.hist));
+                for ( j = 0; j < LOCK_HIST_SITES; j++ )
+                {
+                    if ( e->site[j].addr == NULL )
+                        continue;
+                    elem.site[j].addr = (unsigned long)e->site[j].addr;
+                    elem.site[j].cnt = e->site[j].cnt;
+                    snprintf(elem.site[j].name, sizeof(elem.site[j].name),
+                             "%ps", e->site[j].addr);
+                }
+                if ( copy_to_guest_offset(op->data, op->nr_elem, &elem, 1) )
+                    return -EFAULT;
+            }
+            op->nr_elem++;
+        }
+        break;
+
+    default:
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
 #ifdef CONFIG_LOCK_PROFILE
 
 struct lock_profile_anc {
@@ -19,6 +19,7 @@
 #include <xen/iocap.h>
 #include <xen/guest_access.h>
 #include <xen/keyhandler.h>
+#include <xen/vmap.h>
 #include <asm/current.h>
 #include <xen/hypercall.h>
 #include <public/sysctl.h>
@@ -29,6 +30,103 @@
 #include <xen/livepatch.h>
 #include <xen/coverage.h>
 
+/* Changes of domains' information get stamped with increasing generations. */
+static uint64_t domaininfo_generation;
+
+/* FNV-1a over the reported information. */
+static uint64_t domaininfo_digest(const struct xen_domctl_getdomaininfo *info)
+{
+    const uint8_t *p = (const void *)info;
+    uint64_t digest = 0xcbf29ce484222325ULL;
+    unsigned int i;
+
+    for ( i = 0; i < sizeof(*info); i++ )
+        digest = (digest ^ p[i]) * 0x100000001b3ULL;
+
+    return digest;
+}
+
+static int copy_vcpu_affinity(XEN_GUEST_HANDLE_64(uint8) maps,
+                              unsigned int idx, unsigned int nr_bytes,
+                              const cpumask_t *affinity)
+{
+    struct xenctl_bitmap map = { .bitmap = maps, .nr_bits = nr_bytes * 8 };
+
+    if ( guest_handle_is_null(maps) )
+        return 0;
+
+    guest_handle_add_offset(map.bitmap, (unsigned long)idx * nr_bytes);
+
+    return cpumask_to_xenctl_bitmap(&map, affinity);
+}
+
+static int getvcpuinfolist(struct xen_sysctl_getvcpuinfolist *vil)
+{
+    struct xen_sysctl_vcpuinfo info = { 0 };
+    struct vcpu_runstate_info runstate;
+    struct domain *d;
+    struct vcpu *v;
+    unsigned int nr = 0, vcpu = vil->vcpu;
+    int ret = 0;
+
+    rcu_read_lock(&domlist_read_lock);
+
+    for ( d = first_domain_from(vil->domain); d != NULL;
+          d = rcu_dereference(d->next_in_list), vcpu = 0 )
+    {
+        if ( (vil->flags & XEN_SYSCTL_VCPUINFO_single_domain) &&
+             d->domain_id != vil->domain )
+        {
+            d = NULL;
+            break;
+        }
+
+        /* The same checks as for the domctls this replaces. */
+        if ( xsm_domctl(XSM_OTHER, d, XEN_DOMCTL_getvcpuinfo) ||
+             (vil->nr_cpumap_bytes &&
+              xsm_domctl(XSM_OTHER, d, XEN_DOMCTL_getvcpuaffinity)) )
+            continue;
+
+        for ( ; vcpu < d->max_vcpus && nr < vil->nr_vcpus && !ret; vcpu++ )
+        {
+            if ( (v = d->vcpu[vcpu]) == NULL )
+                continue;
+
+            vcpu_runstate_get(v, &runstate);
+
+            info.domain   = d->domain_id;
+            info.vcpu     = vcpu;
+            info.online   = !(v->pause_flags & VPF_down);
+            info.blocked  = !!(v->pause_flags & VPF_blocked);
+            info.running  = v->is_running;
+            info.cpu_time = runstate.time[RUNSTATE_running];
+            info.cpu      = v->processor;
+
+            if ( copy_to_guest_offset(vil->info, nr, &info, 1) )
+                ret = -EFAULT;
+            else if ( vil->nr_cpumap_bytes )
+                ret = copy_vcpu_affinity(vil->cpumap_hard, nr,
+                                         vil->nr_cpumap_bytes,
+                                         v->cpu_hard_affinity) ?:
+                      copy_vcpu_affinity(vil->cpumap_soft, nr,
+                                         vil->nr_cpumap_bytes,
+                                         v->cpu_soft_affinity);
+            nr++;
+        }
+
+        if ( ret || vcpu < d->max_vcpus )
+            break;
+    }
+
+    rcu_read_unlock(&domlist_read_lock);
+
+    vil->domain = d ? d->domain_id : DOMID_INVALID;
+    vil->vcpu = vcpu;
+    vil->nr_vcpus = nr;
+
+    return ret;
+}
+
 long do_sysctl(XEN_GUEST_HANDLE_PARAM(xen_sysctl_t) u_sysctl)
 {
     long ret = 0;
@@ -79,22 +177,33 @@ long do_sysctl(XEN_GUEST_HANDLE_PARAM(xen_sysctl_t) u_sysctl)
         struct domain *d;
         struct xen_domctl_getdomaininfo info = { 0 };
         u32 num_domains = 0;
+        uint64_t digest;
+
+        op->u.getdomaininfolist.generation = domaininfo_generation;
 
         rcu_read_lock(&domlist_read_lock);
 
-        for_each_domain ( d )
+        for ( d = first_domain_from(op->u.getdomaininfolist.first_domain);
+              d != NULL;
+              d = rcu_dereference(d->next_in_list) )
         {
-            if ( d->domain_id < op->u.getdomaininfolist.first_domain )
-                continue;
             if ( num_domains == op->u.getdomaininfolist.max_domains )
                 break;
 
-            ret = xsm_getdomaininfo(XSM_HOOK, d);
-            if ( ret )
+            if ( xsm_getdomaininfo(XSM_HOOK, d) )
                 continue;
 
             getdomaininfo(d, &info);
 
+            digest = domaininfo_digest(&info);
+            if ( digest != d->info_digest || !d->info_generation )
+            {
+                d->info_digest = digest;
+                d->info_generation = ++domaininfo_generation;
+            }
+            if ( d->info_generation <= op->u.getdomaininfolist.since )
+                continue;
+
             if ( copy_to_guest_offset(op->u.getdomaininfolist.buffer,
                                       num_domains, &info, 1) )
             {
@@ -111,9 +220,15 @@ long do_sysctl(XEN_GUEST_HANDLE_PARAM(xen_sysctl_t) u_sysctl)
             break;
         
         op->u.getdomaininfolist.num_domains = num_domains;
+        op->u.getdomaininfolist.next_domain = d ? d->domain_id
+                                                : DOMID_INVALID;
     }
     break;
 
+    case XEN_SYSCTL_getvcpuinfolist:
+        ret = getvcpuinfolist(&op->u.getvcpuinfolist);
+        break;
+
 #ifdef CONFIG_PERF_COUNTERS
     case XEN_SYSCTL_perfc_op:
         ret = perfc_control(&op->u.perfc_op);
@@ -125,6 +240,15 @@ long do_sysctl(XEN_GUEST_HANDLE_PARAM(xen_sysctl_t) u_sysctl)
         ret = spinlock_profile_control(&op->u.lockprof_op);
         break;
 #endif
+    case XEN_SYSCTL_lockhist_op:
+        ret = lock_hist_control(&op->u.lockhist_op);
+        break;
+    case XEN_SYSCTL_sched_stats:
+        ret = sched_stats_control(&op->u.sched_stats);
+        break;
+    case XEN_SYSCTL_evtchn_steering:
+        ret = evtchn_steering_info(&op->u.evtchn_steering);
+        break;
     case XEN_SYSCTL_debug_keys:
     {
         char c;
@@ -142,6 +266,31 @@ long do_sysctl(XEN_GUEST_HANDLE_PARAM(xen_sysctl_t) u_sysctl)
     }
     break;
 
+    case XEN_SYSCTL_debug_dump:
+    {
+        unsigned int size = min_t(unsigned int, op->u.debug_dump.size,
+                                  MB(1));
+        char *buf = vmalloc(max(size, 1u));
+        long len;
+
+        ret = -ENOMEM;
+        if ( !buf )
+            break;
+
+        len = keyhandler_dump(op->u.debug_dump.key, buf, size);
+        ret = len < 0 ? len : 0;
+        if ( !ret )
+        {
+            op->u.debug_dump.size = len;
+            if ( copy_to_guest(op->u.debug_dump.buffer, buf,
+                               min_t(unsigned long, len, size)) )
+                ret = -EFAULT;
+        }
+
+        vfree(buf);
+    }
+    break;
+
     case XEN_SYSCTL_getcpuinfo:
     {
         uint32_t i, nr_cpus;
@@ -242,6 +391,9 @@ long do_sysctl(XEN_GUEST_HANDLE_PARAM(xen_sysctl_t) u_sysctl)
 
     case XEN_SYSCTL_cpupool_op:
         ret = cpupool_do_sysctl(&op->u.cpupool_op);
+        /* The progress made is wanted on error, and to resume from. */
+        if ( op->u.cpupool_op.op == XEN_SYSCTL_CPUPOOL_OP_MOVEDOMAINS )
+            copyback = 1;
         break;
 
     case XEN_SYSCTL_scheduler_op:
@@ -264,6 +416,8 @@ long do_sysctl(XEN_GUEST_HANDLE_PARAM(xen_sysctl_t) u_sysctl)
         pi->total_pages = total_pages;
         /* Protected by lock */
         get_outstanding_claims(&pi->free_pages, &pi->outstanding_pages);
+        get_superpage_pool(&pi->superpage_pool_pages,
+                           &pi->superpage_pool_target_pages);
         pi->scrub_pages = 0;
         pi->cpu_khz = cpu_khz;
         pi->max_mfn = get_upper_mfn_bound();
@@ -514,6 +668,9 @@ long do_sysctl(XEN_GUEST_HANDLE_PARAM(xen_sysctl_t) u_sysctl)
     if ( copyback && (!ret || copyback > 0) &&
          __copy_to_guest(u_sysctl, op, 1) )
         ret = -EFAULT;
+    else if ( ret == -ERESTART )
+        ret = hypercall_create_continuation(__HYPERVISOR_sysctl, "h",
+                                            u_sysctl);
 
     return ret;
 }
@@ -72,7 +72,16 @@ void tasklet_schedule_on_cpu(struct tasklet *t, unsigned int cpu)
 
 void tasklet_schedule(struct tasklet *t)
 {
-    tasklet_schedule_on_cpu(t, smp_processor_id());
+    unsigned int cpu = smp_processor_id();
+
+    /*
+     * Running a vCPU context tasklet means preempting the vCPU running on
+     * cpu. If cpu is dedicated to a vCPU, do that somewhere else.
+     */
+    if ( unlikely(cpu_is_dedicated(cpu)) && !t->is_softirq )
+        cpu = sched_housekeeping_cpu(cpu);
+
+    tasklet_schedule_on_cpu(t, cpu);
 }
 
 static void do_tasklet_work(unsigned int cpu, struct list_head *list)
@@ -28,12 +28,36 @@
 static unsigned int timer_slop __read_mostly = 50000; /* 50 us */
 integer_param("timer_slop", timer_slop);
 
+/*
+ * Optionally, timers which are due soon go in a timer wheel, rather than in
+ * the heap. The wheel has TIMER_WHEEL_SIZE buckets, each covering a time
+ * slot 2^timer_wheel_shift ns wide (the largest power of 2 not above
+ * timer_slop), so adding and removing timers is O(1), and a whole bucket is
+ * expired at once. Timers due further in the future than what the wheel
+ * covers go in the heap, as usual.
+ */
+static bool __read_mostly opt_timer_wheel;
+boolean_param("timer_wheel", opt_timer_wheel);
+
+#define TIMER_WHEEL_BITS  9
+#define TIMER_WHEEL_SIZE  (1u << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK  (TIMER_WHEEL_SIZE - 1)
+
+static unsigned int __read_mostly timer_wheel_shift;
+
 struct timers {
     spinlock_t     lock;
     struct timer **heap;
     struct timer  *list;
     struct timer  *running;
     struct list_head inactive;
+
+    /* Buckets of the timer wheel, NULL if we don't have one. */
+    struct list_head *wheel;
+    DECLARE_BITMAP(wheel_busy, TIMER_WHEEL_SIZE);
+    unsigned int   wheel_nr;
+    /* Slot the wheel starts at. It covers [wheel_clk, wheel_clk + SIZE). */
+    s_time_t       wheel_clk;
 } __cacheline_aligned;
 
 static DEFINE_PER_CPU(struct timers, timers);
@@ -166,6 +190,67 @@ static int add_to_list(struct timer **pprev, struct timer *t)
 }
 
 
+/****************************************************************************
+ * TIMER WHEEL OPERATIONS.
+ */
+
+static inline s_time_t wheel_slot(const struct timers *ts, s_time_t expires)
+{
+    s_time_t slot = expires >> timer_wheel_shift;
+
+    /* Timers that are already expired go in the current slot. */
+    return slot < ts->wheel_clk ? ts->wheel_clk : slot;
+}
+
+static inline bool wheel_covers(const struct timers *ts, const struct timer *t)
+{
+    return ts->wheel != NULL &&
+           wheel_slot(ts, t->expires) < ts->wheel_clk + TIMER_WHEEL_SIZE;
+}
+
+/* Slot of the first non-empty bucket. The wheel must not be empty. */
+static s_time_t wheel_first_slot(const struct timers *ts)
+{
+    unsigned int idx = ts->wheel_clk & TIMER_WHEEL_MASK, next;
+
+    ASSERT(ts->wheel_nr != 0);
+
+    next = find_next_bit(ts->wheel_busy, TIMER_WHEEL_SIZE, idx);
+    if ( next >= TIMER_WHEEL_SIZE )
+        next = find_first_bit(ts->wheel_busy, TIMER_WHEEL_SIZE);
+
+    return ts->wheel_clk + ((next - idx) & TIMER_WHEEL_MASK);
+}
+
+static int remove_from_wheel(struct timers *ts, struct timer *t)
+{
+    struct list_head *bucket = t->wheel.next;
+
+    list_del(&t->wheel);
+    ts->wheel_nr--;
+
+    /* If we were the last timer in the bucket, what follows us is its head. */
+    if ( list_empty(bucket) )
+        __clear_bit(bucket - ts->wheel, ts->wheel_busy);
+
+    return 0;
+}
+
+/* Add @t to the wheel. Return TRUE if the CPU's deadline needs updating. */
+static int add_to_wheel(struct timers *ts, struct timer *t)
+{
+    s_time_t slot = wheel_slot(ts, t->expires);
+    s_time_t deadline = per_cpu(timer_deadline, t->cpu);
+    unsigned int idx = slot & TIMER_WHEEL_MASK;
+
+    list_add_tail(&t->wheel, &ts->wheel[idx]);
+    __set_bit(idx, ts->wheel_busy);
+    ts->wheel_nr++;
+
+    return (deadline == 0) || (((slot + 1) << timer_wheel_shift) < deadline);
+}
+
+
 /****************************************************************************
  * TIMER OPERATIONS.
  */
@@ -183,6 +268,9 @@ static int remove_entry(struct timer *t)
     case TIMER_STATUS_in_list:
         rc = remove_from_list(&timers->list, t);
         break;
+    case TIMER_STATUS_in_wheel:
+        rc = remove_from_wheel(timers, t);
+        break;
     default:
         rc = 0;
         BUG();
@@ -199,6 +287,13 @@ static int add_entry(struct timer *t)
 
     ASSERT(t->status == TIMER_STATUS_invalid);
 
+    /* Timers that are due soon enough go on the wheel, if there is one. */
+    if ( wheel_covers(timers, t) )
+    {
+        t->status = TIMER_STATUS_in_wheel;
+        return add_to_wheel(timers, t);
+    }
+
     /* Try to add to heap. t->heap_offset indicates whether we succeed. */
     t->heap_offset = 0;
     t->status = TIMER_STATUS_in_heap;
@@ -276,7 +371,7 @@ static inline void timer_unlock(struct timer *timer)
 static bool_t active_timer(struct timer *timer)
 {
     ASSERT(timer->status >= TIMER_STATUS_inactive);
-    ASSERT(timer->status <= TIMER_STATUS_in_list);
+    ASSERT(timer->status <= TIMER_STATUS_in_wheel);
     return (timer->status >= TIMER_STATUS_in_heap);
 }
 
@@ -489,6 +584,32 @@ static void timer_softirq_action(void)
         execute_timer(ts, t);
     }
 
+    /*
+     * Execute ready wheel timers, a whole bucket at a time. All the timers in
+     * a bucket are ready, as soon as the end of the bucket's slot is past.
+     */
+    if ( ts->wheel != NULL )
+    {
+        s_time_t now_slot = now >> timer_wheel_shift, slot;
+
+        while ( (ts->wheel_nr != 0) &&
+                ((slot = wheel_first_slot(ts)) < now_slot) )
+        {
+            struct list_head *bucket = &ts->wheel[slot & TIMER_WHEEL_MASK];
+
+            ts->wheel_clk = slot;
+            while ( !list_empty(bucket) )
+            {
+                t = list_first_entry(bucket, struct timer, wheel);
+                remove_from_wheel(ts, t);
+                execute_timer(ts, t);
+            }
+        }
+
+        if ( ts->wheel_clk < now_slot )
+            ts->wheel_clk = now_slot;
+    }
+
     /* Try to move timers from linked list to more efficient heap. */
     next = ts->list;
     ts->list = NULL;
@@ -505,6 +626,9 @@ static void timer_softirq_action(void)
         deadline = heap[1]->expires;
     if ( (ts->list != NULL) && (ts->list->expires < deadline) )
         deadline = ts->list->expires;
+    if ( ts->wheel_nr != 0 )
+        deadline = MIN(deadline,
+                       (wheel_first_slot(ts) + 1) << timer_wheel_shift);
     now = NOW();
     this_cpu(timer_deadline) =
         (deadline == STIME_MAX) ? 0 : MAX(deadline, now + timer_slop);
@@ -523,34 +647,80 @@ s_time_t align_timer(s_time_t firsttick, uint64_t period)
     return firsttick + (period - 1) - ((firsttick - 1) % period);
 }
 
-static void dump_timer(struct timer *t, s_time_t now)
+/*
+ * Timers are snapshotted under their queue's lock, but only printed after
+ * dropping it, so that dumping doesn't keep interrupts off on CPUs for as
+ * long as it takes to emit their entire queues.
+ */
+#define TIMER_DUMP_MAX 256u
+
+struct timer_snap {
+    const struct timer *timer;
+    s_time_t expires;
+    void (*function)(void *);
+    void *data;
+};
+
+static unsigned int snap_timer(struct timer_snap *snap, unsigned int nr,
+                               const struct timer *t)
 {
-    printk("  ex=%12"PRId64"us timer=%p cb=%ps(%p)\n",
-           (t->expires - now) / 1000, t, t->function, t->data);
+    if ( nr < TIMER_DUMP_MAX )
+    {
+        snap[nr].timer = t;
+        snap[nr].expires = t->expires;
+        snap[nr].function = t->function;
+        snap[nr].data = t->data;
+    }
+
+    return nr + 1;
 }
 
 static void dump_timerq(unsigned char key)
 {
+    struct timer_snap *snap;
     struct timer  *t;
     struct timers *ts;
     unsigned long  flags;
     s_time_t       now = NOW();
+    unsigned int   nr, k;
     int            i, j;
 
     printk("Dumping timer queues:\n");
 
+    snap = xmalloc_array(struct timer_snap, TIMER_DUMP_MAX);
+    if ( !snap )
+    {
+        printk("Out of memory\n");
+        return;
+    }
+
     for_each_online_cpu( i )
     {
         ts = &per_cpu(timers, i);
+        nr = 0;
 
-        printk("CPU%02d:\n", i);
         spin_lock_irqsave(&ts->lock, flags);
         for ( j = 1; j <= GET_HEAP_SIZE(ts->heap); j++ )
-            dump_timer(ts->heap[j], now);
-        for ( t = ts->list, j = 0; t != NULL; t = t->list_next, j++ )
-            dump_timer(t, now);
+            nr = snap_timer(snap, nr, ts->heap[j]);
+        for ( t = ts->list; t != NULL; t = t->list_next )
+            nr = snap_timer(snap, nr, t);
+        for ( j = 0; ts->wheel_nr != 0 && j < TIMER_WHEEL_SIZE; j++ )
+            list_for_each_entry ( t, &ts->wheel[j], wheel )
+                nr = snap_timer(snap, nr, t);
         spin_unlock_irqrestore(&ts->lock, flags);
+
+        printk("CPU%02d:\n", i);
+        for ( k = 0; k < min(nr, TIMER_DUMP_MAX); k++ )
+            printk("  ex=%12"PRId64"us timer=%p cb=%ps(%p)\n",
+                   (snap[k].expires - now) / 1000, snap[k].timer,
+                   snap[k].function, snap[k].data);
+        if ( nr > TIMER_DUMP_MAX )
+            printk("  ... and %u more\n", nr - TIMER_DUMP_MAX);
+
+        process_pending_softirqs();
     }
+
+    xfree(snap);
 }
 
 static void migrate_timers_from_cpu(unsigned int old_cpu)
@@ -584,6 +754,16 @@ static void migrate_timers_from_cpu(unsigned int old_cpu)
         notify |= add_entry(t);
     }
 
+    while ( old_ts->wheel_nr != 0 )
+    {
+        unsigned int idx = wheel_first_slot(old_ts) & TIMER_WHEEL_MASK;
+
+        t = list_first_entry(&old_ts->wheel[idx], struct timer, wheel);
+        remove_entry(t);
+        write_atomic(&t->cpu, new_cpu);
+        notify |= add_entry(t);
+    }
+
     while ( !list_empty(&old_ts->inactive) )
     {
         t = list_entry(old_ts->inactive.next, struct timer, inactive);
@@ -606,6 +786,7 @@ static int cpu_callback(
 {
     unsigned int cpu = (unsigned long)hcpu;
     struct timers *ts = &per_cpu(timers, cpu);
+    unsigned int i;
 
     switch ( action )
     {
@@ -613,6 +794,24 @@ static int cpu_callback(
         INIT_LIST_HEAD(&ts->inactive);
         spin_lock_init(&ts->lock);
         ts->heap = &dummy_heap;
+        /*
+         * The wheel survives the CPU going offline (it is empty by then).
+         * If we can't allocate it, this CPU just uses the heap only.
+         */
+        if ( timer_wheel_shift && ts->wheel == NULL )
+        {
+            struct list_head *wheel;
+
+            wheel = xmalloc_array(struct list_head, TIMER_WHEEL_SIZE);
+            if ( wheel == NULL )
+                break;
+            for ( i = 0; i < TIMER_WHEEL_SIZE; i++ )
+                INIT_LIST_HEAD(&wheel[i]);
+            bitmap_zero(ts->wheel_busy, TIMER_WHEEL_SIZE);
+            ts->wheel_nr = 0;
+            ts->wheel_clk = NOW() >> timer_wheel_shift;
+            ts->wheel = wheel;
+        }
         break;
     case CPU_UP_CANCELED:
     case CPU_DEAD:
@@ -643,6 +842,9 @@ void __init timer_init(void)
     SET_HEAP_SIZE(&dummy_heap, 0);
     SET_HEAP_LIMIT(&dummy_heap, 0);
 
+    if ( opt_timer_wheel && timer_slop != 0 )
+        timer_wheel_shift = fls(timer_slop) - 1;
+
     cpu_callback(&cpu_nfb, CPU_UP_PREPARE, cpu);
     register_cpu_notifier(&cpu_nfb);
 
@@ -248,6 +248,121 @@ static void tmem_persistent_pool_page_put(void *page_va)
     __tmem_free_page_thispool(pi);
 }
 
+/*
+ * Packed storage for compressed pages. Going through xmem_pool spreads
+ * objects of all sizes over the pool pages, and a page can go back only
+ * once every object on it is freed. zbud never puts more than two objects
+ * on a page, trading some density for pages which really get released.
+ */
+struct zbud_header {
+    struct list_head buddy; /* On an unbuddied list iff one object. */
+    uint16_t first_chunks, last_chunks;
+};
+
+#define ZBUD_FIRST(_zh) ((char *)(_zh) + ZBUD_CHUNK_SIZE)
+
+static void zbud_pool_init(struct tmem_zbud_pool *zp)
+{
+    unsigned int i;
+
+    spin_lock_init(&zp->lock);
+    for ( i = 0; i < ZBUD_NR_CHUNKS; i++ )
+        INIT_LIST_HEAD(&zp->unbuddied[i]);
+    zp->pages = 0;
+}
+
+static struct tmem_zbud_pool *zbud_pool(struct tmem_pool *pool)
+{
+    if ( pool != NULL && is_persistent(pool) )
+        return &pool->client->persistent_zbud;
+    return &tmem_global.zbud;
+}
+
+static unsigned int zbud_free_chunks(const struct zbud_header *zh)
+{
+    return ZBUD_NR_CHUNKS - 1 - zh->first_chunks - zh->last_chunks;
+}
+
+static void zbud_list_add(struct tmem_zbud_pool *zp, struct zbud_header *zh)
+{
+    unsigned int free = zbud_free_chunks(zh);
+
+    if ( free )
+        list_add(&zh->buddy, &zp->unbuddied[free]);
+    else
+        INIT_LIST_HEAD(&zh->buddy);
+}
+
+static void *tmem_zbud_alloc(size_t size, struct tmem_pool *pool)
+{
+    struct tmem_zbud_pool *zp = zbud_pool(pool);
+    unsigned int i, chunks = DIV_ROUND_UP(size, ZBUD_CHUNK_SIZE);
+    struct zbud_header *zh;
+    struct page_info *pfp;
+    void *p;
+
+    ASSERT(size && size <= ZBUD_MAX_SIZE);
+
+    spin_lock(&zp->lock);
+    for ( i = chunks; i < ZBUD_NR_CHUNKS; i++ )
+    {
+        if ( list_empty(&zp->unbuddied[i]) )
+            continue;
+        zh = list_first_entry(&zp->unbuddied[i], struct zbud_header, buddy);
+        list_del_init(&zh->buddy);
+        if ( !zh->first_chunks )
+        {
+            zh->first_chunks = chunks;
+            p = ZBUD_FIRST(zh);
+        }
+        else
+        {
+            zh->last_chunks = chunks;
+            p = (char *)zh + PAGE_SIZE - chunks * ZBUD_CHUNK_SIZE;
+        }
+        spin_unlock(&zp->lock);
+        return p;
+    }
+    spin_unlock(&zp->lock);
+
+    if ( (pfp = tmem_alloc_page(pool)) == NULL )
+        return NULL;
+    zh = page_to_virt(pfp);
+    zh->first_chunks = chunks;
+    zh->last_chunks = 0;
+
+    spin_lock(&zp->lock);
+    zp->pages++;
+    zbud_list_add(zp, zh);
+    spin_unlock(&zp->lock);
+
+    return ZBUD_FIRST(zh);
+}
+
+static void tmem_zbud_free(void *p, struct tmem_pool *pool)
+{
+    struct tmem_zbud_pool *zp = zbud_pool(pool);
+    struct zbud_header *zh = (void *)((unsigned long)p & PAGE_MASK);
+
+    spin_lock(&zp->lock);
+    if ( p == ZBUD_FIRST(zh) )
+        zh->first_chunks = 0;
+    else
+        zh->last_chunks = 0;
+    list_del_init(&zh->buddy);
+    if ( zh->first_chunks || zh->last_chunks )
+    {
+        zbud_list_add(zp, zh);
+        zh = NULL;
+    }
+    else
+        zp->pages--;
+    spin_unlock(&zp->lock);
+
+    if ( zh != NULL )
+        tmem_free_page(pool, virt_to_page(zh));
+}
+
 /*
  * Page content descriptor manipulation routines.
  */
@@ -295,13 +410,15 @@ static void pgp_free_data(struct tmem_page_descriptor *pgp, struct tmem_pool *po
     if ( pgp->pfp == NULL )
         return;
     if ( pgp_size )
-        tmem_free(pgp->cdata, pool);
+        tmem_zbud_free(pgp->cdata, pgp->us.obj->pool);
     else
         tmem_free_page(pgp->us.obj->pool,pgp->pfp);
     if ( pool != NULL && pgp_size )
     {
         pool->client->compressed_pages--;
         pool->client->compressed_sum_size -= pgp_size;
+        pool->compressed_pages--;
+        pool->compressed_sum_size -= pgp_size;
     }
     pgp->pfp = NULL;
     pgp->size = -1;
@@ -829,6 +946,7 @@ struct client *client_create(domid_t cli_id)
         tmem_client_err("failed... can't alloc persistent pool\n");
         goto fail;
     }
+    zbud_pool_init(&client->persistent_zbud);
 
     d = rcu_lock_domain_by_id(cli_id);
     if ( d == NULL ) {
@@ -1019,6 +1137,7 @@ static inline bool tmem_ensure_avail_pages(void)
 static int do_tmem_put_compress(struct tmem_page_descriptor *pgp, xen_pfn_t cmfn,
                                          tmem_cli_va_param_t clibuf)
 {
+    struct tmem_pool *pool;
     void *dst, *p;
     size_t size;
     int ret = 0;
@@ -1029,15 +1148,16 @@ static int do_tmem_put_compress(struct tmem_page_descriptor *pgp, xen_pfn_t cmfn
     ASSERT(pgp->us.obj->pool != NULL);
     ASSERT(pgp->us.obj->pool->client != NULL);
 
+    pool = pgp->us.obj->pool;
     if ( pgp->pfp != NULL )
-        pgp_free_data(pgp, pgp->us.obj->pool);
+        pgp_free_data(pgp, pool);
     ret = tmem_compress_from_client(cmfn, &dst, &size, clibuf);
     if ( ret <= 0 )
         goto out;
-    else if ( (size == 0) || (size >= tmem_mempool_maxalloc) ) {
+    else if ( (size == 0) || (size > ZBUD_MAX_SIZE) ) {
         ret = 0;
         goto out;
-    } else if ( (p = tmem_malloc(size,pgp->us.obj->pool)) == NULL ) {
+    } else if ( (p = tmem_zbud_alloc(size, pool)) == NULL ) {
         ret = -ENOMEM;
         goto out;
     } else {
@@ -1045,8 +1165,10 @@ static int do_tmem_put_compress(struct tmem_page_descriptor *pgp, xen_pfn_t cmfn
         pgp->cdata = p;
     }
     pgp->size = size;
-    pgp->us.obj->pool->client->compressed_pages++;
-    pgp->us.obj->pool->client->compressed_sum_size += size;
+    pool->client->compressed_pages++;
+    pool->client->compressed_sum_size += size;
+    pool->compressed_pages++;
+    pool->compressed_sum_size += size;
     ret = 1;
 
 out:
@@ -2071,6 +2193,7 @@ static int __init init_tmem(void)
 
     if ( !tmem_mempool_init() )
         return 0;
+    zbud_pool_init(&tmem_global.zbud);
 
     if ( tmem_init() )
     {
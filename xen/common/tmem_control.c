@@ -95,6 +95,14 @@ static int tmemc_flush_mem(domid_t cli_id, uint32_t kb)
  */
 #define BSIZE 1024
 
+/* Compressed size as a percentage of the original, 0 if nothing is. */
+static unsigned int compress_ratio(unsigned long pages, uint64_t size)
+{
+    if ( !pages )
+        return 0;
+    return (size * 100) / ((uint64_t)pages << PAGE_SHIFT);
+}
+
 static int tmemc_list_client(struct client *c, tmem_cli_va_param_t buf,
                              int off, uint32_t len, bool use_long)
 {
@@ -110,10 +118,13 @@ static int tmemc_list_client(struct client *c, tmem_cli_va_param_t buf,
         use_long ? ',' : '\n');
     if (use_long)
         n += scnprintf(info+n,BSIZE-n,
-             "Ec:%ld,Em:%ld,cp:%ld,cb:%"PRId64",cn:%ld,cm:%ld\n",
+             "Ec:%ld,Em:%ld,cp:%ld,cb:%"PRId64",cn:%ld,cm:%ld,"
+             "cr:%u,zp:%lu\n",
              c->eph_count, c->eph_count_max,
              c->compressed_pages, c->compressed_sum_size,
-             c->compress_poor, c->compress_nomem);
+             c->compress_poor, c->compress_nomem,
+             compress_ratio(c->compressed_pages, c->compressed_sum_size),
+             c->persistent_zbud.pages);
     if ( !copy_to_guest_offset(buf, off + sum, info, n + 1) )
         sum += n;
     for ( i = 0; i < MAX_POOLS_PER_DOMAIN; i++ )
@@ -132,14 +143,17 @@ static int tmemc_list_client(struct client *c, tmem_cli_va_param_t buf,
             n += scnprintf(info+n,BSIZE-n,
              "Pc:%d,Pm:%d,Oc:%ld,Om:%ld,Nc:%lu,Nm:%lu,"
              "ps:%lu,pt:%lu,pd:%lu,pr:%lu,px:%lu,gs:%lu,gt:%lu,"
-             "fs:%lu,ft:%lu,os:%lu,ot:%lu\n",
+             "fs:%lu,ft:%lu,os:%lu,ot:%lu,"
+             "cp:%lu,cb:%"PRIu64",cr:%u\n",
              _atomic_read(p->pgp_count), p->pgp_count_max,
              p->obj_count, p->obj_count_max,
              p->objnode_count, p->objnode_count_max,
              p->good_puts, p->puts,p->dup_puts_flushed, p->dup_puts_replaced,
              p->no_mem_puts,
              p->found_gets, p->gets,
-             p->flushs_found, p->flushs, p->flush_objs_found, p->flush_objs);
+             p->flushs_found, p->flushs, p->flush_objs_found, p->flush_objs,
+             p->compressed_pages, p->compressed_sum_size,
+             compress_ratio(p->compressed_pages, p->compressed_sum_size));
         if ( sum + n >= len )
             return sum;
         if ( !copy_to_guest_offset(buf, off + sum, info, n + 1) )
@@ -171,14 +185,17 @@ static int tmemc_list_shared(tmem_cli_va_param_t buf, int off, uint32_t len,
             n += scnprintf(info+n,BSIZE-n,
              "Pc:%d,Pm:%d,Oc:%ld,Om:%ld,Nc:%lu,Nm:%lu,"
              "ps:%lu,pt:%lu,pd:%lu,pr:%lu,px:%lu,gs:%lu,gt:%lu,"
-             "fs:%lu,ft:%lu,os:%lu,ot:%lu\n",
+             "fs:%lu,ft:%lu,os:%lu,ot:%lu,"
+             "cp:%lu,cb:%"PRIu64",cr:%u\n",
              _atomic_read(p->pgp_count), p->pgp_count_max,
              p->obj_count, p->obj_count_max,
              p->objnode_count, p->objnode_count_max,
              p->good_puts, p->puts,p->dup_puts_flushed, p->dup_puts_replaced,
              p->no_mem_puts,
              p->found_gets, p->gets,
-             p->flushs_found, p->flushs, p->flush_objs_found, p->flush_objs);
+             p->flushs_found, p->flushs, p->flush_objs_found, p->flush_objs,
+             p->compressed_pages, p->compressed_sum_size,
+             compress_ratio(p->compressed_pages, p->compressed_sum_size));
         if ( sum + n >= len )
             return sum;
         if ( !copy_to_guest_offset(buf, off + sum, info, n + 1) )
@@ -221,7 +238,7 @@ static int tmemc_list_global(tmem_cli_va_param_t buf, int off, uint32_t len,
     if (use_long)
         n += scnprintf(info+n,BSIZE-n,
           "Ec:%ld,Em:%ld,Oc:%d,Om:%d,Nc:%d,Nm:%d,Pc:%d,Pm:%d,"
-          "Fc:%d,Fm:%d,Sc:%d,Sm:%d,Ep:%lu,Gd:%lu,Zt:%lu,Gz:%lu\n",
+          "Fc:%d,Fm:%d,Sc:%d,Sm:%d,Ep:%lu,Gd:%lu,Zt:%lu,Gz:%lu,Zp:%lu\n",
           tmem_global.eph_count, tmem_stats.global_eph_count_max,
           _atomic_read(tmem_stats.global_obj_count), tmem_stats.global_obj_count_max,
           _atomic_read(tmem_stats.global_rtree_node_count), tmem_stats.global_rtree_node_count_max,
@@ -229,7 +246,7 @@ static int tmemc_list_global(tmem_cli_va_param_t buf, int off, uint32_t len,
           _atomic_read(tmem_stats.global_page_count), tmem_stats.global_page_count_max,
           _atomic_read(tmem_stats.global_pcd_count), tmem_stats.global_pcd_count_max,
          tmem_stats.tot_good_eph_puts,tmem_stats.deduped_puts,tmem_stats.pcd_tot_tze_size,
-         tmem_stats.pcd_tot_csize);
+         tmem_stats.pcd_tot_csize, tmem_global.zbud.pages);
     if ( sum + n >= len )
         return sum;
     if ( !copy_to_guest_offset(buf, off + sum, info, n + 1) )
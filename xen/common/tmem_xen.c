@@ -8,7 +8,7 @@
 
 #include <xen/tmem.h>
 #include <xen/tmem_xen.h>
-#include <xen/lzo.h> /* compression code */
+#include <xen/lz4.h> /* compression code */
 #include <xen/paging.h>
 #include <xen/domain_page.h>
 #include <xen/cpu.h>
@@ -28,8 +28,7 @@ atomic_t freeable_page_count = ATOMIC_INIT(0);
 
 /* these are a concurrency bottleneck, could be percpu and dynamically
  * allocated iff opt_tmem_compress */
-#define LZO_WORKMEM_BYTES LZO1X_1_MEM_COMPRESS
-#define LZO_DSTMEM_PAGES 2
+#define LZ4_DSTMEM_PAGES 2
 static DEFINE_PER_CPU_READ_MOSTLY(unsigned char *, workmem);
 static DEFINE_PER_CPU_READ_MOSTLY(unsigned char *, dstmem);
 static DEFINE_PER_CPU_READ_MOSTLY(void *, scratch_page);
@@ -146,8 +145,8 @@ int tmem_compress_from_client(xen_pfn_t cmfn,
     else if ( copy_from_guest(scratch, clibuf, PAGE_SIZE) )
         return -EFAULT;
     smp_mb();
-    ret = lzo1x_1_compress(cli_va ?: scratch, PAGE_SIZE, dmem, out_len, wmem);
-    ASSERT(ret == LZO_E_OK);
+    ret = lz4_compress(cli_va ?: scratch, PAGE_SIZE, dmem, out_len, wmem);
+    ASSERT(ret == 0);
     *out_va = dmem;
     if ( cli_va )
         cli_put_page(cli_va, cli_pfp, cli_mfn, 0);
@@ -202,8 +201,9 @@ int tmem_decompress_to_client(xen_pfn_t cmfn, void *tmem_va,
     }
     else if ( !scratch )
         return 0;
-    ret = lzo1x_decompress_safe(tmem_va, size, cli_va ?: scratch, &out_len);
-    ASSERT(ret == LZO_E_OK);
+    ret = lz4_decompress_unknownoutputsize(tmem_va, size, cli_va ?: scratch,
+                                           &out_len);
+    ASSERT(ret == 0);
     ASSERT(out_len == PAGE_SIZE);
     if ( cli_va )
         cli_put_page(cli_va, cli_pfp, cli_mfn, 1);
@@ -266,8 +266,8 @@ int __init tmem_init(void)
 {
     unsigned int cpu;
 
-    dstmem_order = get_order_from_pages(LZO_DSTMEM_PAGES);
-    workmem_order = get_order_from_bytes(LZO1X_1_MEM_COMPRESS);
+    dstmem_order = get_order_from_pages(LZ4_DSTMEM_PAGES);
+    workmem_order = get_order_from_bytes(LZ4_MEM_COMPRESS);
 
     for_each_online_cpu ( cpu )
     {
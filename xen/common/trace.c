@@ -29,7 +29,6 @@
 #include <xen/mm.h>
 #include <xen/percpu.h>
 #include <xen/pfn.h>
-#include <xen/cpu.h>
 #include <asm/atomic.h>
 #include <public/sysctl.h>
 
@@ -52,8 +51,11 @@ integer_param("tevt_mask", opt_tevt_mask);
 static struct t_info *t_info;
 static unsigned int t_info_pages;
 
+/*
+ * Each CPU is the only producer for its own buffer, and writes records with
+ * interrupts disabled, so no lock is needed to serialise writers.
+ */
 static DEFINE_PER_CPU_READ_MOSTLY(struct t_buf *, t_bufs);
-static DEFINE_PER_CPU_READ_MOSTLY(spinlock_t, t_lock);
 static u32 data_size __read_mostly;
 
 /* High water mark for trace buffers; */
@@ -67,6 +69,7 @@ static DEFINE_PER_CPU(unsigned long, lost_records_first_tsc);
 /* a flag recording whether initialization has been done */
 /* or more properly, if the tbuf subsystem is enabled right now */
 int tb_init_done __read_mostly;
+struct static_key tb_key = STATIC_KEY_INIT;
 
 /* which CPUs tracing is enabled on */
 static cpumask_t tb_cpu_mask;
@@ -78,21 +81,6 @@ static u32 tb_event_mask = TRC_ALL;
  * i.e., sizeof(_type) * ans >= _x. */
 #define fit_to_type(_type, _x) (((_x)+sizeof(_type)-1) / sizeof(_type))
 
-static int cpu_callback(
-    struct notifier_block *nfb, unsigned long action, void *hcpu)
-{
-    unsigned int cpu = (unsigned long)hcpu;
-
-    if ( action == CPU_UP_PREPARE )
-        spin_lock_init(&per_cpu(t_lock, cpu));
-
-    return NOTIFY_DONE;
-}
-
-static struct notifier_block cpu_nfb = {
-    .notifier_call = cpu_callback
-};
-
 static uint32_t calc_tinfo_first_offset(void)
 {
     int offset_in_bytes = offsetof(struct t_info, mfn_offset[NR_CPUS]);
@@ -159,6 +147,17 @@ static int calculate_tbuf_size(unsigned int pages, uint16_t t_info_first_offset)
     return pages;
 }
 
+/* tb_init_done may only be set with the hot paths' static key enabled. */
+static int tb_enable(void)
+{
+    int rc = static_key_enable(&tb_key);
+
+    if ( !rc )
+        tb_init_done = 1;
+
+    return rc;
+}
+
 /**
  * alloc_trace_bufs - performs initialization of the per-cpu trace buffers.
  *
@@ -229,8 +228,6 @@ static int alloc_trace_bufs(unsigned int pages)
         struct t_buf *buf;
         struct page_info *pg;
 
-        spin_lock_init(&per_cpu(t_lock, cpu));
-
         offset = t_info->mfn_offset[cpu];
 
         /* Initialize the buffer metadata */
@@ -259,7 +256,8 @@ static int alloc_trace_bufs(unsigned int pages)
 
     printk("xentrace: initialised\n");
     smp_wmb(); /* above must be visible before tb_init_done flag set */
-    tb_init_done = 1;
+    /* Failure (-EBUSY) leaves tracing to be enabled explicitly. */
+    tb_enable();
 
     return 0;
 
@@ -345,7 +343,6 @@ int trace_will_trace_event(u32 event)
 void __init init_trace_bufs(void)
 {
     cpumask_setall(&tb_cpu_mask);
-    register_cpu_notifier(&cpu_nfb);
 
     if ( opt_tbuf_size )
     {
@@ -360,11 +357,16 @@ void __init init_trace_bufs(void)
             printk("xentrace: Starting tracing, enabling mask %x\n",
                    opt_tevt_mask);
             tb_event_mask = opt_tevt_mask;
-            tb_init_done=1;
+            tb_enable();
         }
     }
 }
 
+static void clear_lost_records(void *unused)
+{
+    this_cpu(lost_records) = 0;
+}
+
 /**
  * tb_control - sysctl operations on trace buffers.
  * @tbc: a pointer to a struct xen_sysctl_tbuf_op to be filled out
@@ -406,7 +408,7 @@ int tb_control(struct xen_sysctl_tbuf_op *tbc)
         if ( opt_tbuf_size == 0 ) 
             rc = -EINVAL;
         else
-            tb_init_done = 1;
+            rc = tb_enable();
         break;
     case XEN_SYSCTL_TBUFOP_disable:
     {
@@ -414,20 +416,15 @@ int tb_control(struct xen_sysctl_tbuf_op *tbc)
          * Disable trace buffers. Just stops new records from being written,
          * does not deallocate any memory.
          */
-        int i;
-
         tb_init_done = 0;
         smp_wmb();
         /* Clear any lost-record info so we don't get phantom lost records next time we
-         * start tracing.  Grab the lock to make sure we're not racing anyone.  After this
-         * hypercall returns, no more records should be placed into the buffers. */
-        for_each_online_cpu(i)
-        {
-            unsigned long flags;
-            spin_lock_irqsave(&per_cpu(t_lock, i), flags);
-            per_cpu(lost_records, i)=0;
-            spin_unlock_irqrestore(&per_cpu(t_lock, i), flags);
-        }
+         * start tracing.  Records are written with interrupts disabled, so doing this
+         * from an IPI makes sure we're not racing anyone.  After this hypercall
+         * returns, no more records should be placed into the buffers. */
+        on_each_cpu(clear_lost_records, NULL, 1);
+        /* Failing this merely leaves the hot paths testing tb_init_done. */
+        static_key_disable(&tb_key);
     }
         break;
     default:
@@ -723,7 +720,7 @@ void __trace_var(u32 event, bool_t cycles, unsigned int extra,
     /* Read tb_init_done /before/ t_bufs. */
     smp_rmb();
 
-    spin_lock_irqsave(&this_cpu(t_lock), flags);
+    local_irq_save(flags);
 
     buf = this_cpu(t_bufs);
 
@@ -810,7 +807,7 @@ void __trace_var(u32 event, bool_t cycles, unsigned int extra,
     __insert_record(buf, event, extra, cycles, rec_size, extra_data);
 
 unlock:
-    spin_unlock_irqrestore(&this_cpu(t_lock), flags);
+    local_irq_restore(flags);
 
     /* Notify trace buffer consumer that we've crossed the high water mark. */
     if ( likely(buf!=NULL)
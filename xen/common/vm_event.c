@@ -39,16 +39,15 @@
 #define vm_event_ring_lock(_ved)       spin_lock(&(_ved)->ring_lock)
 #define vm_event_ring_unlock(_ved)     spin_unlock(&(_ved)->ring_lock)
 
-static int vm_event_enable(
+static int __vm_event_enable(
     struct domain *d,
     struct xen_domctl_vm_event_op *vec,
     struct vm_event_domain **ved,
     int pause_flag,
-    int param,
+    unsigned long ring_gfn,
     xen_event_channel_notification_t notification_fn)
 {
     int rc;
-    unsigned long ring_gfn = d->arch.hvm_domain.params[param];
 
     if ( !*ved )
         *ved = xzalloc(struct vm_event_domain);
@@ -81,6 +80,7 @@ static int vm_event_enable(
 
     /* Set the number of currently blocked vCPUs to 0. */
     (*ved)->blocked = 0;
+    (*ved)->nr_vcpus = d->max_vcpus;
 
     /* Allocate event channel */
     rc = alloc_unbound_xen_event_channel(d, 0, current->domain->domain_id,
@@ -114,6 +114,30 @@ static int vm_event_enable(
     return rc;
 }
 
+static int vm_event_enable(
+    struct domain *d,
+    struct xen_domctl_vm_event_op *vec,
+    struct vm_event_domain **ved,
+    int pause_flag,
+    int param,
+    xen_event_channel_notification_t notification_fn)
+{
+    return __vm_event_enable(d, vec, ved, pause_flag,
+                             d->arch.hvm_domain.params[param],
+                             notification_fn);
+}
+
+/*
+ * Only the monitor may have several rings, each serving a group of vCPUs:
+ * tell whether ved is the ring v puts its requests on.
+ */
+static bool vm_event_ring_serves(const struct vm_event_domain *ved,
+                                 const struct vcpu *v)
+{
+    return ved->pause_flag != _VPF_mem_access ||
+           vm_event_monitor_ring(v) == ved;
+}
+
 static unsigned int vm_event_ring_available(struct vm_event_domain *ved)
 {
     int avail_req = RING_FREE_REQUESTS(&ved->front_ring);
@@ -155,6 +179,9 @@ static void vm_event_wake_blocked(struct domain *d, struct vm_event_domain *ved)
             if ( !(ved->blocked) || avail_req == 0 )
                break;
 
+            if ( !vm_event_ring_serves(ved, v) )
+                continue;
+
             if ( test_and_clear_bit(ved->pause_flag, &v->pause_flags) )
             {
                 vcpu_unpause(v);
@@ -214,7 +241,8 @@ static int vm_event_disable(struct domain *d, struct vm_event_domain **ved)
         /* Unblock all vCPUs */
         for_each_vcpu ( d, v )
         {
-            if ( test_and_clear_bit((*ved)->pause_flag, &v->pause_flags) )
+            if ( vm_event_ring_serves(*ved, v) &&
+                 test_and_clear_bit((*ved)->pause_flag, &v->pause_flags) )
             {
                 vcpu_unpause(v);
                 (*ved)->blocked--;
@@ -224,7 +252,10 @@ static int vm_event_disable(struct domain *d, struct vm_event_domain **ved)
         destroy_ring_for_helper(&(*ved)->ring_page,
                                 (*ved)->ring_pg_struct);
 
-        vm_event_cleanup_domain(d);
+        /* vCPU groups' rings are torn down ahead of the main one. */
+        if ( (*ved)->pause_flag != _VPF_mem_access ||
+             *ved == d->vm_event_monitor )
+            vm_event_cleanup_domain(d);
 
         vm_event_ring_unlock(*ved);
     }
@@ -315,7 +346,7 @@ void vm_event_put_request(struct domain *d,
      * See the comments above wake_blocked() for more information
      * on how this mechanism works to avoid waiting. */
     avail_req = vm_event_ring_available(ved);
-    if( curr->domain == d && avail_req < d->max_vcpus &&
+    if( curr->domain == d && avail_req < ved->nr_vcpus &&
         !atomic_read(&curr->vm_event_pause_count) )
         vm_event_mark_and_pause(curr, ved);
 
@@ -545,6 +576,126 @@ static void monitor_notification(struct vcpu *v, unsigned int port)
         vm_event_resume(domain, domain->vm_event_monitor);
 }
 
+/* Registered with the event channels of the monitor's vCPU group rings. */
+static void monitor_group_notification(struct vcpu *v, unsigned int port)
+{
+    struct domain *domain = v->domain;
+    unsigned int i;
+
+    for ( i = 0; i < domain->nr_vm_event_monitor_groups; i++ )
+    {
+        struct vm_event_domain *ved = domain->vm_event_monitor_groups[i];
+
+        if ( likely(vm_event_check_ring(ved)) && ved->xen_port == port )
+        {
+            vm_event_resume(domain, ved);
+            break;
+        }
+    }
+}
+
+static void monitor_resume(struct domain *d)
+{
+    unsigned int i;
+
+    vm_event_resume(d, d->vm_event_monitor);
+
+    for ( i = 0; i < d->nr_vm_event_monitor_groups; i++ )
+        vm_event_resume(d, d->vm_event_monitor_groups[i]);
+}
+
+/*
+ * Move a group of vCPUs over to a monitor ring of their own.  They have to
+ * leave the main ring without holding slots on it, or being blocked on it.
+ */
+static int monitor_add_ring(struct domain *d,
+                            struct xen_domctl_vm_event_op *vec)
+{
+    struct vm_event_domain *main_ved = d->vm_event_monitor, **ved;
+    struct vcpu *v;
+    unsigned int i;
+    int rc;
+
+    if ( !vm_event_check_ring(main_ved) )
+        return -ENODEV;
+
+    if ( !vec->nr_vcpus || vec->first_vcpu >= d->max_vcpus ||
+         vec->nr_vcpus > d->max_vcpus - vec->first_vcpu )
+        return -EINVAL;
+
+    for ( i = vec->first_vcpu; i < vec->first_vcpu + vec->nr_vcpus; i++ )
+        if ( d->vcpu[i] && d->vcpu[i]->vm_event_monitor )
+            return -EBUSY;
+
+    /* Groups are disjoint and non-empty, so there can't be more of them. */
+    if ( !d->vm_event_monitor_groups )
+    {
+        d->vm_event_monitor_groups = xzalloc_array(struct vm_event_domain *,
+                                                   d->max_vcpus);
+        if ( !d->vm_event_monitor_groups )
+            return -ENOMEM;
+    }
+    ved = &d->vm_event_monitor_groups[d->nr_vm_event_monitor_groups];
+
+    domain_pause(d);
+
+    rc = -EBUSY;
+    if ( !list_empty(&main_ved->wq.list) )
+        goto out;
+
+    rc = __vm_event_enable(d, vec, ved, _VPF_mem_access, vec->ring_gfn,
+                           monitor_group_notification);
+    if ( rc )
+        goto out;
+
+    (*ved)->nr_vcpus = vec->nr_vcpus;
+    d->nr_vm_event_monitor_groups++;
+
+    vm_event_ring_lock(main_ved);
+    for ( i = vec->first_vcpu; i < vec->first_vcpu + vec->nr_vcpus; i++ )
+    {
+        if ( (v = d->vcpu[i]) == NULL )
+            continue;
+
+        if ( test_and_clear_bit(main_ved->pause_flag, &v->pause_flags) )
+        {
+            vcpu_unpause(v);
+            main_ved->blocked--;
+        }
+        v->vm_event_monitor = *ved;
+    }
+    vm_event_ring_unlock(main_ved);
+
+ out:
+    domain_unpause(d);
+
+    return rc;
+}
+
+/* Tear down the rings of all vCPU groups, moving them back to the main one. */
+static int monitor_disable_groups(struct domain *d)
+{
+    while ( d->nr_vm_event_monitor_groups )
+    {
+        struct vm_event_domain **ved =
+            &d->vm_event_monitor_groups[d->nr_vm_event_monitor_groups - 1];
+        struct vm_event_domain *old = *ved;
+        struct vcpu *v;
+        int rc = vm_event_disable(d, ved);
+
+        if ( rc )
+            return rc;
+
+        for_each_vcpu ( d, v )
+            if ( v->vm_event_monitor == old )
+                v->vm_event_monitor = NULL;
+
+        d->nr_vm_event_monitor_groups--;
+    }
+
+    return 0;
+}
+
 #ifdef CONFIG_HAS_MEM_SHARING
 /* Registered with Xen-bound event channel for incoming notifications. */
 static void mem_sharing_notification(struct vcpu *v, unsigned int port)
@@ -575,6 +726,11 @@ void vm_event_cleanup(struct domain *d)
 #endif
     if ( vm_event_check_ring(d->vm_event_monitor) )
     {
+        unsigned int i;
+
+        for ( i = 0; i < d->nr_vm_event_monitor_groups; i++ )
+            destroy_waitqueue_head(&d->vm_event_monitor_groups[i]->wq);
+        (void)monitor_disable_groups(d);
         destroy_waitqueue_head(&d->vm_event_monitor->wq);
         (void)vm_event_disable(d, &d->vm_event_monitor);
     }
@@ -703,19 +859,26 @@ int vm_event_domctl(struct domain *d, struct xen_domctl_vm_event_op *vec,
             if ( vm_event_check_ring(d->vm_event_monitor) )
             {
                 domain_pause(d);
-                rc = vm_event_disable(d, &d->vm_event_monitor);
-                arch_monitor_cleanup_domain(d);
+                rc = monitor_disable_groups(d);
+                if ( !rc )
+                    rc = vm_event_disable(d, &d->vm_event_monitor);
+                if ( !rc )
+                    arch_monitor_cleanup_domain(d);
                 domain_unpause(d);
             }
             break;
 
         case XEN_VM_EVENT_RESUME:
             if ( vm_event_check_ring(d->vm_event_monitor) )
-                vm_event_resume(d, d->vm_event_monitor);
+                monitor_resume(d);
             else
                 rc = -ENODEV;
             break;
 
+        case XEN_VM_EVENT_ADD_RING:
+            rc = monitor_add_ring(d, vec);
+            break;
+
         default:
             rc = -ENOSYS;
             break;
@@ -0,0 +1,496 @@
+/******************************************************************************
+ * xmem_cache.c
+ *
+ * Caches of fixed size objects, with per-CPU magazines.
+ *
+ * Objects live in slabs, i.e. naturally aligned chunks of Xen heap pages,
+ * with a small header at the beginning. On top of that, each pCPU keeps two
+ * magazines (small arrays of free objects): one it allocates from and frees
+ * to, and a previous one, so that alternating allocations and frees at a
+ * magazine boundary don't bounce. Only when both are exhausted (or both are
+ * full) the pCPU goes to the cache's depot of full and empty magazines, or
+ * to the slab layer, under the cache lock. This is the scheme described in
+ * Bonwick and Adams, "Magazines and Vmem", USENIX 2001.
+ *
+ * Like xmalloc(), caches can't be used in IRQ context. Since Xen is not
+ * preemptible, this means the local magazines can be accessed without any
+ * locking.
+ */
+
+#include <xen/cpu.h>
+#include <xen/init.h>
+#include <xen/irq.h>
+#include <xen/keyhandler.h>
+#include <xen/lib.h>
+#include <xen/list.h>
+#include <xen/mm.h>
+#include <xen/smp.h>
+#include <xen/spinlock.h>
+#include <xen/xmalloc.h>
+
+#define MAGAZINE_SIZE    15
+/* Full magazines the depot keeps, before giving objects back to the slabs. */
+#define DEPOT_MAX_FULL   8
+/* Minimum number of objects in a slab, and maximum order of a slab. */
+#define SLAB_MIN_OBJS    8
+#define SLAB_MAX_ORDER   3
+
+struct xmem_magazine {
+    struct list_head list;
+    unsigned int rounds;
+    void *objs[MAGAZINE_SIZE];
+};
+
+struct xmem_slab {
+    struct list_head list;
+    void *free;                 /* Free objects, linked via their 1st word. */
+    unsigned int inuse;
+};
+
+struct xmem_cache_cpu {
+    struct xmem_magazine *loaded, *prev;
+    unsigned long allocs, frees;
+    unsigned long alloc_hits, free_hits;    /* Served from the magazines. */
+};
+
+struct xmem_cache {
+    struct list_head list;
+    char name[16];
+    unsigned int size;          /* Object size, including alignment. */
+    unsigned int order;         /* Order of each slab. */
+    unsigned int offset;        /* Offset of the first object in a slab. */
+    unsigned int per_slab;      /* Objects in each slab. */
+
+    spinlock_t lock;            /* Protects everything below. */
+    struct list_head partial, full, empty;  /* Slabs. */
+    struct list_head mag_full, mag_empty;   /* The depot. */
+    unsigned int nr_slabs, nr_empty_slabs;
+    unsigned int nr_mag_full, nr_mag_empty;
+    unsigned long nr_inuse;     /* Objects handed out by the slab layer. */
+    unsigned long depot_ops;
+
+    struct xmem_cache_cpu *cpu; /* nr_cpu_ids entries. */
+};
+
+static LIST_HEAD(cache_list);
+static DEFINE_SPINLOCK(cache_list_lock);
+
+/*
+ * Slab layer. Called with the cache lock held.
+ */
+
+static void *slab_alloc(struct xmem_cache *c)
+{
+    struct xmem_slab *s;
+    void *obj;
+
+    if ( !list_empty(&c->partial) )
+        s = list_first_entry(&c->partial, struct xmem_slab, list);
+    else if ( !list_empty(&c->empty) )
+    {
+        s = list_first_entry(&c->empty, struct xmem_slab, list);
+        list_move(&s->list, &c->partial);
+        c->nr_empty_slabs--;
+    }
+    else
+    {
+        unsigned int i;
+
+        spin_unlock(&c->lock);
+        s = alloc_xenheap_pages(c->order, 0);
+        spin_lock(&c->lock);
+        if ( !s )
+            return NULL;
+
+        ASSERT(!((unsigned long)s & ((PAGE_SIZE << c->order) - 1)));
+        s->inuse = 0;
+        s->free = NULL;
+        for ( i = c->per_slab; i-- > 0; )
+        {
+            obj = (char *)s + c->offset + i * c->size;
+            *(void **)obj = s->free;
+            s->free = obj;
+        }
+        list_add(&s->list, &c->partial);
+        c->nr_slabs++;
+    }
+
+    obj = s->free;
+    s->free = *(void **)obj;
+    if ( ++s->inuse == c->per_slab )
+        list_move(&s->list, &c->full);
+    c->nr_inuse++;
+
+    return obj;
+}
+
+static void slab_free(struct xmem_cache *c, void *obj)
+{
+    struct xmem_slab *s = (void *)((unsigned long)obj &
+                                   ~((PAGE_SIZE << c->order) - 1));
+
+    ASSERT(s->inuse);
+    *(void **)obj = s->free;
+    s->free = obj;
+    c->nr_inuse--;
+
+    if ( s->inuse-- == c->per_slab )
+        list_move(&s->list, &c->partial);
+
+    if ( s->inuse )
+        return;
+
+    /* Keep one empty slab around, and give the others back. */
+    if ( c->nr_empty_slabs )
+    {
+        list_del(&s->list);
+        c->nr_slabs--;
+        free_xenheap_pages(s, c->order);
+    }
+    else
+    {
+        list_move(&s->list, &c->empty);
+        c->nr_empty_slabs++;
+    }
+}
+
+static void magazine_empty(struct xmem_cache *c, struct xmem_magazine *m)
+{
+    while ( m->rounds )
+        slab_free(c, m->objs[--m->rounds]);
+}
+
+/*
+ * Public interface.
+ */
+
+void *xmem_cache_alloc(struct xmem_cache *c)
+{
+    struct xmem_cache_cpu *cc = &c->cpu[smp_processor_id()];
+    struct xmem_magazine *m;
+    void *obj;
+
+    ASSERT(!in_irq());
+
+    cc->allocs++;
+
+    if ( (m = cc->loaded) != NULL && m->rounds )
+        goto hit;
+
+    if ( (m = cc->prev) != NULL && m->rounds )
+    {
+        cc->prev = cc->loaded;
+        cc->loaded = m;
+        goto hit;
+    }
+
+    spin_lock(&c->lock);
+    c->depot_ops++;
+
+    /* Both our magazines are empty: trade the previous one for a full one. */
+    if ( !list_empty(&c->mag_full) )
+    {
+        m = list_first_entry(&c->mag_full, struct xmem_magazine, list);
+        list_del(&m->list);
+        c->nr_mag_full--;
+
+        if ( cc->prev )
+        {
+            list_add(&cc->prev->list, &c->mag_empty);
+            c->nr_mag_empty++;
+        }
+        cc->prev = cc->loaded;
+        cc->loaded = m;
+
+        obj = m->objs[--m->rounds];
+    }
+    else
+        obj = slab_alloc(c);
+
+    spin_unlock(&c->lock);
+
+    return obj;
+
+ hit:
+    cc->alloc_hits++;
+    return m->objs[--m->rounds];
+}
+
+void *xmem_cache_zalloc(struct xmem_cache *c)
+{
+    void *obj = xmem_cache_alloc(c);
+
+    return obj ? memset(obj, 0, c->size) : obj;
+}
+
+void xmem_cache_free(struct xmem_cache *c, void *obj)
+{
+    struct xmem_cache_cpu *cc;
+    struct xmem_magazine *m;
+
+    if ( !obj )
+        return;
+
+    ASSERT(!in_irq());
+
+    cc = &c->cpu[smp_processor_id()];
+    cc->frees++;
+
+    if ( (m = cc->loaded) != NULL && m->rounds < MAGAZINE_SIZE )
+        goto hit;
+
+    if ( (m = cc->prev) != NULL && m->rounds < MAGAZINE_SIZE )
+    {
+        cc->prev = cc->loaded;
+        cc->loaded = m;
+        goto hit;
+    }
+
+    spin_lock(&c->lock);
+    c->depot_ops++;
+
+    /*
+     * Both our magazines are full (or missing): trade the previous one for
+     * an empty one. If the depot has enough full magazines already, just
+     * give the objects in it back to the slabs and reuse it.
+     */
+    if ( cc->prev && c->nr_mag_full >= DEPOT_MAX_FULL )
+    {
+        m = cc->prev;
+        magazine_empty(c, m);
+    }
+    else
+    {
+        if ( !list_empty(&c->mag_empty) )
+        {
+            m = list_first_entry(&c->mag_empty, struct xmem_magazine, list);
+            list_del(&m->list);
+            c->nr_mag_empty--;
+        }
+        else
+        {
+            spin_unlock(&c->lock);
+            m = xmalloc(struct xmem_magazine);
+            spin_lock(&c->lock);
+            if ( !m )
+            {
+                slab_free(c, obj);
+                spin_unlock(&c->lock);
+                return;
+            }
+            m->rounds = 0;
+        }
+
+        if ( cc->prev )
+        {
+            list_add(&cc->prev->list, &c->mag_full);
+            c->nr_mag_full++;
+        }
+    }
+
+    cc->prev = cc->loaded;
+    cc->loaded = m;
+    m->objs[m->rounds++] = obj;
+
+    spin_unlock(&c->lock);
+    return;
+
+ hit:
+    cc->free_hits++;
+    m->objs[m->rounds++] = obj;
+}
+
+struct xmem_cache *xmem_cache_create(const char *name, unsigned int size,
+                                     unsigned int align)
+{
+    struct xmem_cache *c;
+    unsigned int hdr;
+
+    ASSERT(!(align & (align - 1)));
+    if ( align < sizeof(void *) )
+        align = sizeof(void *);
+    size = ROUNDUP(max_t(unsigned int, size, sizeof(void *)), align);
+    hdr = ROUNDUP(sizeof(struct xmem_slab), align);
+
+    if ( size > (PAGE_SIZE << SLAB_MAX_ORDER) - hdr )
+        return NULL;
+
+    c = xzalloc(struct xmem_cache);
+    if ( !c )
+        return NULL;
+
+    c->cpu = xzalloc_array(struct xmem_cache_cpu, nr_cpu_ids);
+    if ( !c->cpu )
+    {
+        xfree(c);
+        return NULL;
+    }
+
+    strlcpy(c->name, name, sizeof(c->name));
+    c->size = size;
+    c->offset = hdr;
+    for ( c->order = 0; c->order < SLAB_MAX_ORDER; c->order++ )
+        if ( ((PAGE_SIZE << c->order) - hdr) / size >= SLAB_MIN_OBJS )
+            break;
+    c->per_slab = ((PAGE_SIZE << c->order) - hdr) / size;
+
+    spin_lock_init(&c->lock);
+    INIT_LIST_HEAD(&c->partial);
+    INIT_LIST_HEAD(&c->full);
+    INIT_LIST_HEAD(&c->empty);
+    INIT_LIST_HEAD(&c->mag_full);
+    INIT_LIST_HEAD(&c->mag_empty);
+
+    spin_lock(&cache_list_lock);
+    list_add_tail(&c->list, &cache_list);
+    spin_unlock(&cache_list_lock);
+
+    return c;
+}
+
+/* Give back all the objects held in @cpu's magazines, and the magazines. */
+static void cache_flush_cpu(struct xmem_cache *c, unsigned int cpu)
+{
+    struct xmem_cache_cpu *cc = &c->cpu[cpu];
+
+    spin_lock(&c->lock);
+    if ( cc->loaded )
+    {
+        magazine_empty(c, cc->loaded);
+        xfree(cc->loaded);
+        cc->loaded = NULL;
+    }
+    if ( cc->prev )
+    {
+        magazine_empty(c, cc->prev);
+        xfree(cc->prev);
+        cc->prev = NULL;
+    }
+    spin_unlock(&c->lock);
+}
+
+void xmem_cache_destroy(struct xmem_cache *c)
+{
+    struct xmem_magazine *m, *tmp;
+    struct xmem_slab *s, *stmp;
+    unsigned int cpu;
+
+    if ( !c )
+        return;
+
+    spin_lock(&cache_list_lock);
+    list_del(&c->list);
+    spin_unlock(&cache_list_lock);
+
+    for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+        cache_flush_cpu(c, cpu);
+
+    spin_lock(&c->lock);
+
+    list_for_each_entry_safe ( m, tmp, &c->mag_full, list )
+    {
+        magazine_empty(c, m);
+        xfree(m);
+    }
+    list_for_each_entry_safe ( m, tmp, &c->mag_empty, list )
+        xfree(m);
+
+    if ( c->nr_inuse )
+        printk(XENLOG_WARNING "xmem_cache %s: destroyed with %lu objects\n",
+               c->name, c->nr_inuse);
+    list_splice_init(&c->partial, &c->empty);
+    list_splice_init(&c->full, &c->empty);
+    list_for_each_entry_safe ( s, stmp, &c->empty, list )
+        free_xenheap_pages(s, c->order);
+
+    spin_unlock(&c->lock);
+
+    xfree(c->cpu);
+    xfree(c);
+}
+
+static void dump_xmem_caches(unsigned char key)
+{
+    struct xmem_cache *c;
+
+    printk("'%c' pressed -> dumping object caches\n", key);
+
+    spin_lock(&cache_list_lock);
+
+    list_for_each_entry ( c, &cache_list, list )
+    {
+        unsigned long allocs = 0, frees = 0, hits = 0, cached = 0;
+        unsigned int cpu;
+
+        for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+        {
+            const struct xmem_cache_cpu *cc = &c->cpu[cpu];
+            const struct xmem_magazine *m;
+
+            allocs += cc->allocs;
+            frees += cc->frees;
+            hits += cc->alloc_hits + cc->free_hits;
+            if ( (m = ACCESS_ONCE(cc->loaded)) != NULL )
+                cached += m->rounds;
+            if ( (m = ACCESS_ONCE(cc->prev)) != NULL )
+                cached += m->rounds;
+        }
+
+        spin_lock(&c->lock);
+        printk("%-16s size %4u: %u slabs of order %u (%u objects each), "
+               "%lu objects in use\n",
+               c->name, c->size, c->nr_slabs, c->order, c->per_slab,
+               c->nr_inuse - cached - c->nr_mag_full * MAGAZINE_SIZE);
+        printk("%-16s allocs %lu, frees %lu, %lu%% magazine hits, "
+               "%lu depot ops, %u+%u depot magazines\n", "",
+               allocs, frees,
+               allocs + frees ? hits * 100 / (allocs + frees) : 0,
+               c->depot_ops, c->nr_mag_full, c->nr_mag_empty);
+        spin_unlock(&c->lock);
+    }
+
+    spin_unlock(&cache_list_lock);
+}
+
+static int cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct xmem_cache *c;
+
+    switch ( action )
+    {
+    case CPU_DEAD:
+        spin_lock(&cache_list_lock);
+        list_for_each_entry ( c, &cache_list, list )
+            cache_flush_cpu(c, cpu);
+        spin_unlock(&cache_list_lock);
+        break;
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cpu_nfb = {
+    .notifier_call = cpu_callback
+};
+
+static int __init xmem_cache_init(void)
+{
+    register_cpu_notifier(&cpu_nfb);
+    register_keyhandler('k', dump_xmem_caches, "dump object caches", 1);
+    return 0;
+}
+__initcall(xmem_cache_init);
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
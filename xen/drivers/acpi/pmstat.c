@@ -485,6 +485,36 @@ int do_pm_op(struct xen_sysctl_pm_op *op)
         break;
     }
 
+    case XEN_SYSCTL_pm_op_get_domain_boost:
+    case XEN_SYSCTL_pm_op_set_domain_boost:
+    {
+        struct domain *d = rcu_lock_domain_by_id(op->u.domain_boost.domid);
+
+        if ( !d )
+        {
+            ret = -ESRCH;
+            break;
+        }
+
+        if ( op->cmd == XEN_SYSCTL_pm_op_set_domain_boost )
+            ACCESS_ONCE(d->cpufreq_boost) = op->u.domain_boost.boost;
+        else
+            op->u.domain_boost.boost = ACCESS_ONCE(d->cpufreq_boost);
+
+        rcu_unlock_domain(d);
+        break;
+    }
+
+    case XEN_SYSCTL_pm_op_get_cpupool_latency:
+        ret = cpupool_get_idle_latency(op->u.cpupool_latency.cpupool_id,
+                                       &op->u.cpupool_latency.latency);
+        break;
+
+    case XEN_SYSCTL_pm_op_set_cpupool_latency:
+        ret = cpupool_set_idle_latency(op->u.cpupool_latency.cpupool_id,
+                                       op->u.cpupool_latency.latency);
+        break;
+
     default:
         printk("not defined sub-hypercall @ do_pm_op\n");
         ret = -ENOSYS;
@@ -60,6 +60,14 @@ static const char __initconst warning_sync_console[] =
 
 /* console_to_ring: send guest (incl. dom 0) console data to console ring. */
 static bool_t __read_mostly opt_console_to_ring;
+
+/* console_async: queue console output for deferred emission once booted. */
+static bool __initdata opt_console_async = true;
+boolean_param("console_async", opt_console_async);
+
+/* guest_console_ratelimit: max. console lines per second per guest. */
+static unsigned int __read_mostly opt_guest_console_ratelimit = 100;
+integer_param("guest_console_ratelimit", opt_guest_console_ratelimit);
 boolean_param("console_to_ring", opt_console_to_ring);
 
 /* console_timestamps: include a timestamp prefix on every Xen console line. */
@@ -462,6 +470,41 @@ static inline void xen_console_write_debug_port(const char *buf, size_t len)
 }
 #endif
 
+static void async_ring_drain(void);
+
+/*
+ * Whether @cd may emit another line of console output, limiting every
+ * domain to opt_guest_console_ratelimit lines per second.
+ */
+static bool guest_console_ratelimit(struct domain *cd)
+{
+    s_time_t now = NOW();
+
+    ASSERT(spin_is_locked(&cd->pbuf_lock));
+
+    if ( !opt_guest_console_ratelimit )
+        return true;
+
+    if ( now - cd->console_rl_start >= SECONDS(1) )
+    {
+        if ( cd->console_rl_missed )
+            guest_printk(cd, XENLOG_G_DEBUG "%u console lines suppressed\n",
+                         cd->console_rl_missed);
+        cd->console_rl_start = now;
+        cd->console_rl_lines = 0;
+        cd->console_rl_missed = 0;
+    }
+
+    if ( cd->console_rl_lines < opt_guest_console_ratelimit )
+    {
+        cd->console_rl_lines++;
+        return true;
+    }
+
+    cd->console_rl_missed++;
+    return false;
+}
+
 static long guest_console_write(XEN_GUEST_HANDLE_PARAM(char) buffer, int count)
 {
     char kbuf[128];
@@ -485,6 +528,7 @@ static long guest_console_write(XEN_GUEST_HANDLE_PARAM(char) buffer, int count)
             /* Use direct console output as it could be interactive */
             spin_lock_irq(&console_lock);
 
+            async_ring_drain();
             sercon_puts(kbuf);
             video_puts(kbuf);
 
@@ -527,7 +571,8 @@ static long guest_console_write(XEN_GUEST_HANDLE_PARAM(char) buffer, int count)
             {
                 kcount = kin - kbuf;
                 cd->pbuf[cd->pbuf_idx] = '\0';
-                guest_printk(cd, XENLOG_G_DEBUG "%s%s\n", cd->pbuf, kbuf);
+                if ( guest_console_ratelimit(cd) )
+                    guest_printk(cd, XENLOG_G_DEBUG "%s%s\n", cd->pbuf, kbuf);
                 cd->pbuf_idx = 0;
             }
             else if ( cd->pbuf_idx + kcount < (DOMAIN_PBUF_SIZE - 1) )
@@ -539,7 +584,8 @@ static long guest_console_write(XEN_GUEST_HANDLE_PARAM(char) buffer, int count)
             else
             {
                 cd->pbuf[cd->pbuf_idx] = '\0';
-                guest_printk(cd, XENLOG_G_DEBUG "%s%s\n", cd->pbuf, kbuf);
+                if ( guest_console_ratelimit(cd) )
+                    guest_printk(cd, XENLOG_G_DEBUG "%s%s\n", cd->pbuf, kbuf);
                 cd->pbuf_idx = 0;
             }
             spin_unlock(&cd->pbuf_lock);
@@ -627,6 +673,190 @@ static void __putstr(const char *str)
         tasklet_schedule(&notify_dom0_con_ring_tasklet);
 }
 
+static void printk_start_of_line(const char *prefix,
+                                 void (*puts)(const char *));
+
+/*
+ * Once booted, printk() doesn't emit its output itself, but queues it on a
+ * lockless multi-producer ring, drained to the console devices from tasklet
+ * context.  Bursts of output hence don't throttle the producing CPUs to the
+ * serial line's speed (or make them contend for console_lock), at the price
+ * of dropping output while the ring is full.  Output is emitted directly
+ * again whenever all of it matters (sync_console, console_start_sync(),
+ * e.g. on crashes, console_start_log_everything()), with anything still
+ * queued emitted first.
+ *
+ * Producers reserve space for a record (a 32-bit header followed by the
+ * text) by advancing async_prod, fill it in, and finally publish it by
+ * setting ASYNC_REC_READY in its header.  The single consumer, serialised
+ * by console_lock, emits published records in order and zeroes them before
+ * advancing async_cons, so unpublished headers always read as not ready.
+ */
+#define ASYNC_RING_SIZE      (64 << 10)
+#define ASYNC_RING_IDX(i)    ((i) & (ASYNC_RING_SIZE - 1))
+#define ASYNC_REC_READY      (1u << 31)
+
+static char __aligned(sizeof(uint32_t)) async_ring[ASYNC_RING_SIZE];
+static uint32_t async_prod, async_cons;
+static atomic_t async_dropped = ATOMIC_INIT(0);
+static bool async_drain_pending, async_draining;
+static bool __read_mostly console_async_active;
+
+static bool console_async(void)
+{
+    return console_async_active && !atomic_read(&print_everything) &&
+           !console_locks_busted;
+}
+
+static uint32_t *async_rec_hdr(uint32_t idx)
+{
+    return (uint32_t *)&async_ring[ASYNC_RING_IDX(idx)];
+}
+
+static void async_drain_fn(unsigned long unused);
+static DECLARE_SOFTIRQ_TASKLET(async_drain_tasklet, async_drain_fn, 0);
+
+/* Queue @len bytes of output.  Safe against any number of producers. */
+static void async_ring_put(const char *str, unsigned int len)
+{
+    uint32_t p, need = ROUNDUP(sizeof(uint32_t) + len, sizeof(uint32_t));
+    unsigned int idx, n;
+
+    if ( !len )
+        return;
+
+    do {
+        p = read_atomic(&async_prod);
+        if ( need > ASYNC_RING_SIZE - (p - read_atomic(&async_cons)) )
+        {
+            atomic_inc(&async_dropped);
+            return;
+        }
+    } while ( cmpxchg(&async_prod, p, p + need) != p );
+
+    idx = ASYNC_RING_IDX(p + sizeof(uint32_t));
+    n = min(len, ASYNC_RING_SIZE - idx);
+    memcpy(&async_ring[idx], str, n);
+    memcpy(async_ring, str + n, len - n);
+
+    smp_wmb();
+    write_atomic(async_rec_hdr(p), len | ASYNC_REC_READY);
+
+    if ( !test_and_set_bool(async_drain_pending) )
+        tasklet_schedule(&async_drain_tasklet);
+}
+
+/* Emit the oldest queued record, if any.  Returns whether there was one. */
+static bool async_ring_drain_one(void)
+{
+    char chunk[128];
+    uint32_t c = async_cons, hdr = read_atomic(async_rec_hdr(c));
+    unsigned int len, need, off, idx, n, dropped;
+
+    ASSERT(spin_is_locked(&console_lock));
+
+    dropped = atomic_xchg(&async_dropped, 0);
+    if ( unlikely(dropped) )
+    {
+        snprintf(chunk, sizeof(chunk), "console: %u messages dropped\n",
+                 dropped);
+        printk_start_of_line("(XEN) ", __putstr);
+        __putstr(chunk);
+    }
+
+    if ( !(hdr & ASYNC_REC_READY) )
+        return false;
+    smp_rmb();
+
+    len = hdr & ~ASYNC_REC_READY;
+    need = ROUNDUP(sizeof(uint32_t) + len, sizeof(uint32_t));
+
+    for ( off = 0; off < len; off += n )
+    {
+        idx = ASYNC_RING_IDX(c + sizeof(uint32_t) + off);
+        n = min_t(unsigned int, min(len - off, ASYNC_RING_SIZE - idx),
+                  sizeof(chunk) - 1);
+        memcpy(chunk, &async_ring[idx], n);
+        chunk[n] = '\0';
+        __putstr(chunk);
+    }
+
+    idx = ASYNC_RING_IDX(c);
+    n = min(need, ASYNC_RING_SIZE - idx);
+    memset(&async_ring[idx], 0, n);
+    memset(async_ring, 0, need - n);
+
+    /* Zeroing must be visible before the space gets handed out again. */
+    smp_mb();
+    write_atomic(&async_cons, c + need);
+
+    return true;
+}
+
+/* Emit everything queued so far. */
+static void async_ring_drain(void)
+{
+    ASSERT(spin_is_locked(&console_lock));
+
+    /* Don't interfere with a drain interrupted on this CPU (NMI, #MC). */
+    if ( async_draining )
+        return;
+
+    async_draining = true;
+    while ( async_ring_drain_one() )
+        continue;
+    async_draining = false;
+}
+
+static void async_drain_fn(unsigned long unused)
+{
+    unsigned long flags;
+    bool more;
+
+    /* Records published from here on will schedule us again. */
+    write_atomic(&async_drain_pending, false);
+    smp_mb();
+
+    /* Don't keep interrupts off for longer than a record at a time. */
+    do {
+        spin_lock_irqsave(&console_lock, flags);
+        more = !async_draining && async_ring_drain_one();
+        spin_unlock_irqrestore(&console_lock, flags);
+    } while ( more );
+}
+
+/* Per-CPU staging of a printk()'s output, to queue it as few records. */
+struct async_stage {
+    unsigned int len;
+    char buf[512];
+};
+static DEFINE_PER_CPU(struct async_stage, async_stage);
+
+static void async_stage_flush(void)
+{
+    struct async_stage *st = &this_cpu(async_stage);
+
+    async_ring_put(st->buf, st->len);
+    st->len = 0;
+}
+
+static void async_stage_puts(const char *str)
+{
+    struct async_stage *st = &this_cpu(async_stage);
+    size_t len = strlen(str), n;
+
+    while ( len )
+    {
+        n = min(len, sizeof(st->buf) - st->len);
+        memcpy(st->buf + st->len, str, n);
+        st->len += n;
+        str += n;
+        len -= n;
+        if ( st->len == sizeof(st->buf) )
+            async_stage_flush();
+    }
+}
+
 static int printk_prefix_check(char *p, char **pp)
 {
     int loglvl = -1;
@@ -686,13 +916,51 @@ static int parse_console_timestamps(const char *s)
     return 0;
 }
 
-static void printk_start_of_line(const char *prefix)
+/* Redirection of a CPU's printk() output, active when buf is non-NULL. */
+struct console_capture {
+    char *buf;
+    unsigned int size, len;
+};
+static DEFINE_PER_CPU(struct console_capture, console_capture);
+
+static void capture_puts(const char *str)
+{
+    struct console_capture *cc = &this_cpu(console_capture);
+    unsigned int len = strlen(str);
+
+    if ( cc->len < cc->size )
+        memcpy(cc->buf + cc->len, str, min(len, cc->size - cc->len));
+    cc->len += len;
+}
+
+void console_start_capture(char *buf, unsigned int size)
+{
+    struct console_capture *cc = &this_cpu(console_capture);
+
+    ASSERT(buf && !cc->buf);
+
+    cc->size = size;
+    cc->len = 0;
+    cc->buf = buf;
+}
+
+unsigned int console_end_capture(void)
+{
+    struct console_capture *cc = &this_cpu(console_capture);
+
+    cc->buf = NULL;
+
+    return cc->len;
+}
+
+static void printk_start_of_line(const char *prefix,
+                                 void (*puts)(const char *))
 {
     struct tm tm;
     char tstr[32];
     uint64_t sec, nsec;
 
-    __putstr(prefix);
+    puts(prefix);
 
     switch ( opt_con_timestamp_mode )
     {
@@ -727,7 +995,7 @@ static void printk_start_of_line(const char *prefix)
         return;
     }
 
-    __putstr(tstr);
+    puts(tstr);
 }
 
 static void vprintk_common(const char *prefix, const char *fmt, va_list args)
@@ -736,16 +1004,33 @@ static void vprintk_common(const char *prefix, const char *fmt, va_list args)
         bool_t continued, do_print;
     }            *state;
     static DEFINE_PER_CPU(struct vps, state);
-    static char   buf[1024];
-    char         *p, *q;
+    static DEFINE_PER_CPU(char, printk_buf[1024]);
+    char         *buf, *p, *q;
     unsigned long flags;
+    bool          async, capture;
+    void        (*puts)(const char *);
 
-    /* console_lock can be acquired recursively from __printk_ratelimit(). */
     local_irq_save(flags);
-    spin_lock_recursive(&console_lock);
+    capture = !in_irq() && this_cpu(console_capture).buf;
+    async = !capture && console_async();
+    if ( capture )
+        puts = capture_puts;
+    else if ( async )
+        puts = async_stage_puts;
+    else
+    {
+        /*
+         * console_lock can be acquired recursively from
+         * __printk_ratelimit().
+         */
+        spin_lock_recursive(&console_lock);
+        async_ring_drain();
+        puts = __putstr;
+    }
     state = &this_cpu(state);
+    buf = this_cpu(printk_buf);
 
-    (void)vsnprintf(buf, sizeof(buf), fmt, args);
+    (void)vsnprintf(buf, sizeof(this_cpu(printk_buf)), fmt, args);
 
     p = buf;
 
@@ -753,13 +1038,13 @@ static void vprintk_common(const char *prefix, const char *fmt, va_list args)
     {
         *q = '\0';
         if ( !state->continued )
-            state->do_print = printk_prefix_check(p, &p);
+            state->do_print = printk_prefix_check(p, &p) || capture;
         if ( state->do_print )
         {
             if ( !state->continued )
-                printk_start_of_line(prefix);
-            __putstr(p);
-            __putstr("\n");
+                printk_start_of_line(prefix, puts);
+            puts(p);
+            puts("\n");
         }
         state->continued = 0;
         p = q + 1;
@@ -768,17 +1053,20 @@ static void vprintk_common(const char *prefix, const char *fmt, va_list args)
     if ( *p != '\0' )
     {
         if ( !state->continued )
-            state->do_print = printk_prefix_check(p, &p);
+            state->do_print = printk_prefix_check(p, &p) || capture;
         if ( state->do_print )
         {
             if ( !state->continued )
-                printk_start_of_line(prefix);
-            __putstr(p);
+                printk_start_of_line(prefix, puts);
+            puts(p);
         }
         state->continued = 1;
     }
 
-    spin_unlock_recursive(&console_lock);
+    if ( async )
+        async_stage_flush();
+    else if ( !capture )
+        spin_unlock_recursive(&console_lock);
     local_irq_restore(flags);
 }
 
@@ -925,6 +1213,8 @@ void __init console_endboot(void)
 
     video_endboot();
 
+    console_async_active = opt_console_async && !opt_sync_console;
+
     /*
      * If user specifies so, we fool the switch routine to redirect input
      * straight back to Xen. I use this convoluted method so we still print
@@ -1000,8 +1290,14 @@ void console_force_unlock(void)
 
 void console_start_sync(void)
 {
+    unsigned long flags;
+
     atomic_inc(&print_everything);
     serial_start_sync(sercon_handle);
+
+    flags = console_lock_recursive_irqsave();
+    async_ring_drain();
+    console_unlock_recursive_irqrestore(flags);
 }
 
 void console_end_sync(void)
@@ -1040,13 +1336,24 @@ int __printk_ratelimit(int ratelimit_ms, int ratelimit_burst)
         missed = 0;
         toks -= ratelimit_ms;
         spin_unlock(&ratelimit_lock);
-        if ( lost )
+        if ( lost && console_async() )
+        {
+            char lost_str[8];
+            snprintf(lost_str, sizeof(lost_str), "%d", lost);
+            /* Possibly in the middle of a printk() staging its output. */
+            printk_start_of_line("(XEN) ", async_stage_puts);
+            async_stage_puts("printk: ");
+            async_stage_puts(lost_str);
+            async_stage_puts(" messages suppressed.\n");
+            async_stage_flush();
+        }
+        else if ( lost )
         {
             char lost_str[8];
             snprintf(lost_str, sizeof(lost_str), "%d", lost);
             /* console_lock may already be acquired by printk(). */
             spin_lock_recursive(&console_lock);
-            printk_start_of_line("(XEN) ");
+            printk_start_of_line("(XEN) ", __putstr);
             __putstr("printk: ");
             __putstr(lost_str);
             __putstr(" messages suppressed.\n");
@@ -0,0 +1,273 @@
+/*
+ *  xen/drivers/cpufreq/cpufreq_schedutil.c
+ *
+ *  Utilization driven cpufreq governor.
+ *
+ *  Unlike ondemand, which only re-evaluates on a fixed sampling grid, this
+ *  governor reacts to the scheduler: the busy time it accounts (as idle
+ *  vCPU runstate time) drives the frequency choice, fresh wakeups on a CPU
+ *  which the governor had stopped looking at get re-evaluated after a
+ *  single short period, and wakeups of vCPUs of domains asking for a
+ *  performance boost immediately ramp their CPU up to the maximum.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <xen/init.h>
+#include <xen/lib.h>
+#include <xen/percpu.h>
+#include <xen/pmstat.h>
+#include <xen/sched.h>
+#include <xen/timer.h>
+#include <acpi/cpufreq/cpufreq.h>
+
+#define SUGOV_DEF_RATE          MILLISECS(10)
+#define SUGOV_MIN_RATE          MICROSECS(500)
+#define SUGOV_MAX_RATE          SECONDS(1)
+
+/* Utilization is tracked in units of 1/1024th of a CPU. */
+#define SUGOV_UTIL_SHIFT        10
+#define SUGOV_UTIL_MAX          (1u << SUGOV_UTIL_SHIFT)
+
+/* How many periods a boost request holds the maximum frequency. */
+#define SUGOV_BOOST_PERIODS     2
+
+/*
+ * The state of a policy lives with its first CPU.  cpufreq_sched_wake()
+ * never looks at the policy itself, which it could race with the freeing
+ * of: only at this per-CPU data, which is always there.
+ */
+struct sugov_cpu {
+    struct cpufreq_policy *policy;
+    struct timer timer;
+    uint64_t prev_idle;
+    s_time_t prev_wall;
+    unsigned int util;          /* Decaying average, SUGOV_UTIL_* units. */
+    unsigned int leader;        /* CPU holding the state of our policy, */
+    bool member;                /* if we're under this governor at all. */
+    s_time_t boost_until;
+    bool enable;
+    bool at_max;                /* Running at policy->max. */
+    bool deferred;              /* Fully idle, not periodically sampling. */
+};
+
+static DEFINE_PER_CPU(struct sugov_cpu, sugov_cpu);
+
+static s_time_t __read_mostly sugov_rate = SUGOV_DEF_RATE;
+
+static unsigned int sugov_cpu_util(struct sugov_cpu *sg, unsigned int cpu,
+                                   s_time_t now)
+{
+    uint64_t idle = get_cpu_idle_time(cpu), idle_ns, wall_ns;
+    unsigned int busy;
+
+    wall_ns = now - sg->prev_wall;
+    idle_ns = idle - sg->prev_idle;
+    sg->prev_wall = now;
+    sg->prev_idle = idle;
+
+    if ( !wall_ns || idle_ns >= wall_ns )
+        busy = 0;
+    else
+        busy = ((wall_ns - idle_ns) << SUGOV_UTIL_SHIFT) / wall_ns;
+
+    /* Follow increases immediately, but decay gradually. */
+    sg->util = busy >= sg->util ? busy : (sg->util + busy) / 2;
+
+    return sg->util;
+}
+
+static void sugov_update(struct sugov_cpu *this)
+{
+    struct cpufreq_policy *policy = this->policy;
+    s_time_t now = NOW();
+    uint64_t max_util_freq = 0;
+    unsigned int j, target;
+
+    if ( unlikely(policy->resume) || now < read_atomic(&this->boost_until) )
+    {
+        if ( policy->cur != policy->max )
+            __cpufreq_driver_target(policy, policy->max, CPUFREQ_RELATION_H);
+        ACCESS_ONCE(this->at_max) = policy->cur == policy->max;
+        set_timer(&this->timer, now + sugov_rate);
+        return;
+    }
+
+    for_each_cpu ( j, policy->cpus )
+    {
+        struct sugov_cpu *sg = &per_cpu(sugov_cpu, j);
+        uint64_t util_freq = (uint64_t)sugov_cpu_util(sg, j, now) *
+                             cpufreq_driver_getavg(j, GOV_GETAVG);
+
+        if ( util_freq > max_util_freq )
+            max_util_freq = util_freq;
+    }
+
+    /*
+     * Aim at running at 80% utilization at the chosen frequency, leaving
+     * headroom for the load to grow before the next evaluation.
+     */
+    target = min_t(uint64_t, (max_util_freq * 5 / 4) >> SUGOV_UTIL_SHIFT,
+                   policy->max);
+    target = max(target, policy->min);
+
+    if ( target != policy->cur )
+        __cpufreq_driver_target(policy, target, CPUFREQ_RELATION_L);
+    ACCESS_ONCE(this->at_max) = policy->cur == policy->max;
+
+    /*
+     * Don't keep waking up completely idle CPUs sitting at their lowest
+     * frequency.  The next wakeup will restart sampling.
+     */
+    if ( !max_util_freq && policy->cur == policy->min )
+        ACCESS_ONCE(this->deferred) = true;
+    else
+        set_timer(&this->timer, align_timer(now, sugov_rate));
+}
+
+static void sugov_timer_fn(void *data)
+{
+    struct sugov_cpu *sg = data;
+
+    if ( sg->enable )
+        sugov_update(sg);
+}
+
+/*
+ * Called by the scheduler whenever a vCPU becomes runnable on @cpu, with
+ * @boost set if its domain asked for latency over power efficiency.  May
+ * be called in any context.
+ *
+ * This runs under the waking vCPU's scheduler lock, not under any of the
+ * locks the governor state is updated with, hence the ACCESS_ONCE()s.  The
+ * races are benign: a wakeup seeing a stale member, leader or enable at
+ * governor start or stop finds the timer killed (which makes set_timer() a
+ * no-op), or misses restarting sampling until the next wakeup or period;
+ * one seeing a stale deferred or at_max merely causes or skips one early
+ * evaluation.
+ */
+void cpufreq_sched_wake(unsigned int cpu, bool boost)
+{
+    const struct sugov_cpu *me = &per_cpu(sugov_cpu, cpu);
+    struct sugov_cpu *sg;
+    s_time_t now;
+
+    if ( !ACCESS_ONCE(me->member) )
+        return;
+
+    sg = &per_cpu(sugov_cpu, ACCESS_ONCE(me->leader));
+    if ( !ACCESS_ONCE(sg->enable) )
+        return;
+
+    if ( boost )
+    {
+        now = NOW();
+        write_atomic(&sg->boost_until, now + SUGOV_BOOST_PERIODS * sugov_rate);
+        ACCESS_ONCE(sg->deferred) = false;
+        if ( !ACCESS_ONCE(sg->at_max) )
+            set_timer(&sg->timer, now);
+    }
+    else if ( ACCESS_ONCE(sg->deferred) )
+    {
+        ACCESS_ONCE(sg->deferred) = false;
+        set_timer(&sg->timer, NOW() + sugov_rate);
+    }
+}
+
+static int cpufreq_governor_schedutil(struct cpufreq_policy *policy,
+                                      unsigned int event)
+{
+    unsigned int cpu = policy->cpu, j;
+    struct sugov_cpu *this = &per_cpu(sugov_cpu, cpu);
+
+    switch ( event )
+    {
+    case CPUFREQ_GOV_START:
+        if ( !cpu_online(cpu) || !policy->cur )
+            return -EINVAL;
+
+        if ( this->enable )
+            break;
+
+        for_each_cpu ( j, policy->cpus )
+        {
+            struct sugov_cpu *sg = &per_cpu(sugov_cpu, j);
+
+            sg->prev_idle = get_cpu_idle_time(j);
+            sg->prev_wall = NOW();
+            sg->util = 0;
+            ACCESS_ONCE(sg->leader) = cpu;
+            ACCESS_ONCE(sg->member) = true;
+        }
+
+        this->policy = policy;
+        write_atomic(&this->boost_until, 0);
+        this->at_max = policy->cur == policy->max;
+        this->deferred = false;
+        init_timer(&this->timer, sugov_timer_fn, this, cpu);
+        smp_wmb();
+        ACCESS_ONCE(this->enable) = true;
+        set_timer(&this->timer, NOW() + sugov_rate);
+        break;
+
+    case CPUFREQ_GOV_STOP:
+        if ( !this->enable )
+            break;
+
+        ACCESS_ONCE(this->enable) = false;
+        for_each_cpu ( j, policy->cpus )
+            ACCESS_ONCE(per_cpu(sugov_cpu, j).member) = false;
+        kill_timer(&this->timer);
+        break;
+
+    case CPUFREQ_GOV_LIMITS:
+        if ( !this->enable )
+            return -EINVAL;
+
+        if ( policy->max < policy->cur )
+            __cpufreq_driver_target(policy, policy->max, CPUFREQ_RELATION_H);
+        else if ( policy->min > policy->cur )
+            __cpufreq_driver_target(policy, policy->min, CPUFREQ_RELATION_L);
+        break;
+
+    default:
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static bool_t __init cpufreq_schedutil_handle_option(const char *name,
+                                                     const char *val)
+{
+    if ( !strcmp(name, "rate") && val )
+    {
+        s_time_t rate = simple_strtoull(val, NULL, 0) * MICROSECS(1);
+
+        if ( rate < SUGOV_MIN_RATE || rate > SUGOV_MAX_RATE )
+        {
+            rate = rate < SUGOV_MIN_RATE ? SUGOV_MIN_RATE : SUGOV_MAX_RATE;
+            printk(XENLOG_WARNING "cpufreq/schedutil: "
+                   "specified rate out of range, using %"PRI_stime"us\n",
+                   rate / MICROSECS(1));
+        }
+        sugov_rate = rate;
+        return 1;
+    }
+
+    return 0;
+}
+
+struct cpufreq_governor cpufreq_gov_schedutil = {
+    .name = "schedutil",
+    .governor = cpufreq_governor_schedutil,
+    .handle_option = cpufreq_schedutil_handle_option
+};
+
+static int __init cpufreq_gov_schedutil_init(void)
+{
+    return cpufreq_register_governor(&cpufreq_gov_schedutil);
+}
+__initcall(cpufreq_gov_schedutil_init);
@@ -22,39 +22,61 @@
 #include <asm/hvm/svm/amd-iommu-proto.h>
 #include "../ats.h"
 
+/* How long to wait for room in, or completion of, the command buffer. */
+#define CMD_TIMEOUT MILLISECS(10)
+
+static void commit_iommu_command_buffer(struct amd_iommu *iommu)
+{
+    u32 tail = 0;
+
+    iommu_set_rb_pointer(&tail, iommu->cmd_buffer.tail);
+    writel(tail, iommu->mmio_base+IOMMU_CMD_BUFFER_TAIL_OFFSET);
+}
+
+/*
+ * Put a command into the command buffer, without making it visible to the
+ * IOMMU yet: commands get committed in batches, by flush_command_buffer() or
+ * once the buffer fills up.
+ */
 static int queue_iommu_command(struct amd_iommu *iommu, u32 cmd[])
 {
-    u32 tail, head, *cmd_buffer;
+    u32 tail, *cmd_buffer;
+    s_time_t deadline = 0;
     int i;
 
     tail = iommu->cmd_buffer.tail;
     if ( ++tail == iommu->cmd_buffer.entries )
         tail = 0;
 
-    head = iommu_get_rb_pointer(readl(iommu->mmio_base +
-                                      IOMMU_CMD_BUFFER_HEAD_OFFSET));
-    if ( head != tail )
+    while ( iommu_get_rb_pointer(readl(iommu->mmio_base +
+                                       IOMMU_CMD_BUFFER_HEAD_OFFSET)) == tail )
     {
-        cmd_buffer = (u32 *)(iommu->cmd_buffer.buffer +
-                             (iommu->cmd_buffer.tail *
-                             IOMMU_CMD_BUFFER_ENTRY_SIZE));
-
-        for ( i = 0; i < IOMMU_CMD_BUFFER_U32_PER_ENTRY; i++ )
-            cmd_buffer[i] = cmd[i];
-
-        iommu->cmd_buffer.tail = tail;
-        return 1;
+        if ( !deadline )
+        {
+            perfc_incr(amd_iommu_cmd_full);
+            commit_iommu_command_buffer(iommu);
+            deadline = NOW() + CMD_TIMEOUT;
+        }
+        else if ( NOW() > deadline )
+        {
+            AMD_IOMMU_DEBUG("Warning: command buffer full, dropping command\n");
+            return 0;
+        }
+        cpu_relax();
     }
 
-    return 0;
-}
+    cmd_buffer = (u32 *)(iommu->cmd_buffer.buffer +
+                         (iommu->cmd_buffer.tail *
+                         IOMMU_CMD_BUFFER_ENTRY_SIZE));
 
-static void commit_iommu_command_buffer(struct amd_iommu *iommu)
-{
-    u32 tail = 0;
+    for ( i = 0; i < IOMMU_CMD_BUFFER_U32_PER_ENTRY; i++ )
+        cmd_buffer[i] = cmd[i];
 
-    iommu_set_rb_pointer(&tail, iommu->cmd_buffer.tail);
-    writel(tail, iommu->mmio_base+IOMMU_CMD_BUFFER_TAIL_OFFSET);
+    iommu->cmd_buffer.tail = tail;
+    iommu->cmd_pending++;
+    perfc_incr(amd_iommu_cmds);
+
+    return 1;
 }
 
 int send_iommu_command(struct amd_iommu *iommu, u32 cmd[])
@@ -68,10 +90,16 @@ int send_iommu_command(struct amd_iommu *iommu, u32 cmd[])
     return 0;
 }
 
+/*
+ * Commit all queued commands, followed by a single COMPLETION_WAIT, and wait
+ * for the latter with exponential backoff between polls.
+ */
 static void flush_command_buffer(struct amd_iommu *iommu)
 {
     u32 cmd[4], status;
-    int loop_count, comp_wait;
+    unsigned int i, delay = 1;
+    int comp_wait;
+    s_time_t start, deadline;
 
     /* RW1C 'ComWaitInt' in status register */
     writel(IOMMU_STATUS_COMP_WAIT_INT_MASK,
@@ -85,17 +113,32 @@ static void flush_command_buffer(struct amd_iommu *iommu)
     set_field_in_reg_u32(IOMMU_CONTROL_ENABLED, 0,
                          IOMMU_COMP_WAIT_I_FLAG_MASK,
                          IOMMU_COMP_WAIT_I_FLAG_SHIFT, &cmd[0]);
+    /* Commands per completion wait, in power of 2 buckets. */
+    perfc_incra(amd_iommu_batch, min(fls(iommu->cmd_pending), 7));
+    iommu->cmd_pending = 0;
     send_iommu_command(iommu, cmd);
 
-    /* Make loop_count long enough for polling completion wait bit */
-    loop_count = 1000;
-    do {
+    start = NOW();
+    deadline = start + CMD_TIMEOUT;
+    for ( ; ; )
+    {
         status = readl(iommu->mmio_base + IOMMU_STATUS_MMIO_OFFSET);
         comp_wait = get_field_from_reg_u32(status,
                                            IOMMU_STATUS_COMP_WAIT_INT_MASK,
                                            IOMMU_STATUS_COMP_WAIT_INT_SHIFT);
-        --loop_count;
-    } while ( !comp_wait && loop_count );
+        if ( comp_wait || NOW() > deadline )
+            break;
+
+        /* Don't keep the IOMMU busy with MMIO reads while it works. */
+        for ( i = 0; i < delay; i++ )
+            cpu_relax();
+        if ( delay < 1024 )
+            delay <<= 1;
+    }
+
+    /* Wait times, in power of 2 buckets. */
+    perfc_incra(amd_iommu_wait_us,
+                min(fls((NOW() - start) / MICROSECS(1)), 7));
 
     if ( comp_wait )
     {
@@ -104,6 +147,7 @@ static void flush_command_buffer(struct amd_iommu *iommu)
                iommu->mmio_base + IOMMU_STATUS_MMIO_OFFSET);
         return;
     }
+    perfc_incr(amd_iommu_wait_timeout);
     AMD_IOMMU_DEBUG("Warning: ComWaitInt bit did not assert!\n");
 }
 
@@ -161,7 +205,7 @@ static void invalidate_iommu_pages(struct amd_iommu *iommu,
     cmd[3] = entry;
 
     cmd[0] = 0;
-    send_iommu_command(iommu, cmd);
+    queue_iommu_command(iommu, cmd);
 }
 
 static void invalidate_iotlb_pages(struct amd_iommu *iommu,
@@ -231,7 +275,7 @@ static void invalidate_iotlb_pages(struct amd_iommu *iommu,
                          IOMMU_INV_IOTLB_PAGES_ADDR_HIGH_SHIFT, &entry);
     cmd[3] = entry;
 
-    send_iommu_command(iommu, cmd);
+    queue_iommu_command(iommu, cmd);
 }
 
 static void invalidate_dev_table_entry(struct amd_iommu *iommu,
@@ -250,7 +294,7 @@ static void invalidate_dev_table_entry(struct amd_iommu *iommu,
                          &entry);
     cmd[1] = entry;
 
-    send_iommu_command(iommu, cmd);
+    queue_iommu_command(iommu, cmd);
 }
 
 static void invalidate_interrupt_table(struct amd_iommu *iommu, u16 device_id)
@@ -266,7 +310,7 @@ static void invalidate_interrupt_table(struct amd_iommu *iommu, u16 device_id)
                          IOMMU_CMD_OPCODE_MASK, IOMMU_CMD_OPCODE_SHIFT,
                          &entry);
     cmd[1] = entry;
-    send_iommu_command(iommu, cmd);
+    queue_iommu_command(iommu, cmd);
 }
 
 void invalidate_iommu_all(struct amd_iommu *iommu)
@@ -280,21 +324,19 @@ void invalidate_iommu_all(struct amd_iommu *iommu)
                          &entry);
     cmd[1] = entry;
 
-    send_iommu_command(iommu, cmd);
+    queue_iommu_command(iommu, cmd);
 }
 
-void amd_iommu_flush_iotlb(u8 devfn, const struct pci_dev *pdev,
-                           uint64_t gaddr, unsigned int order)
+/* The IOMMU to send device IOTLB invalidations for pdev to, if any. */
+static struct amd_iommu *ats_iommu(const struct pci_dev *pdev)
 {
-    unsigned long flags;
     struct amd_iommu *iommu;
-    unsigned int req_id, queueid, maxpend;
 
     if ( !ats_enabled )
-        return;
+        return NULL;
 
     if ( !pci_ats_enabled(pdev->seg, pdev->bus, pdev->devfn) )
-        return;
+        return NULL;
 
     iommu = find_iommu_for_device(pdev->seg, PCI_BDF2(pdev->bus, pdev->devfn));
 
@@ -303,62 +345,93 @@ void amd_iommu_flush_iotlb(u8 devfn, const struct pci_dev *pdev,
         AMD_IOMMU_DEBUG("%s: Can't find iommu for %04x:%02x:%02x.%u\n",
                         __func__, pdev->seg, pdev->bus,
                         PCI_SLOT(pdev->devfn), PCI_FUNC(pdev->devfn));
-        return;
+        return NULL;
     }
 
     if ( !iommu_has_cap(iommu, PCI_CAP_IOTLB_SHIFT) )
-        return;
+        return NULL;
+
+    return iommu;
+}
+
+static void queue_iotlb_flush(struct amd_iommu *iommu, u8 devfn,
+                              const struct pci_dev *pdev,
+                              uint64_t gaddr, unsigned int order)
+{
+    unsigned int req_id, queueid, maxpend;
+
+    ASSERT( spin_is_locked(&iommu->lock) );
 
     req_id = get_dma_requestor_id(iommu->seg, PCI_BDF2(pdev->bus, devfn));
     queueid = req_id;
     maxpend = pdev->ats.queue_depth & 0xff;
 
     /* send INVALIDATE_IOTLB_PAGES command */
-    spin_lock_irqsave(&iommu->lock, flags);
     invalidate_iotlb_pages(iommu, maxpend, 0, queueid, gaddr, req_id, order);
-    flush_command_buffer(iommu);
-    spin_unlock_irqrestore(&iommu->lock, flags);
 }
 
-static void amd_iommu_flush_all_iotlbs(struct domain *d, uint64_t gaddr,
-                                       unsigned int order)
+void amd_iommu_flush_iotlb(u8 devfn, const struct pci_dev *pdev,
+                           uint64_t gaddr, unsigned int order)
 {
-    struct pci_dev *pdev;
+    unsigned long flags;
+    struct amd_iommu *iommu = ats_iommu(pdev);
 
-    if ( !ats_enabled )
+    if ( !iommu )
         return;
 
-    for_each_pdev( d, pdev )
-    {
-        u8 devfn = pdev->devfn;
-
-        do {
-            amd_iommu_flush_iotlb(devfn, pdev, gaddr, order);
-            devfn += pdev->phantom_stride;
-        } while ( devfn != pdev->devfn &&
-                  PCI_SLOT(devfn) == PCI_SLOT(pdev->devfn) );
-    }
+    spin_lock_irqsave(&iommu->lock, flags);
+    queue_iotlb_flush(iommu, devfn, pdev, gaddr, order);
+    flush_command_buffer(iommu);
+    spin_unlock_irqrestore(&iommu->lock, flags);
 }
 
-/* Flush iommu cache after p2m changes. */
+/*
+ * Flush iommu cache after p2m changes.  All invalidations get issued to all
+ * IOMMUs before waiting for any of them, so they all work in parallel and
+ * there's only a single completion wait per IOMMU.
+ */
 static void _amd_iommu_flush_pages(struct domain *d,
                                    uint64_t gaddr, unsigned int order)
 {
     unsigned long flags;
     struct amd_iommu *iommu;
     unsigned int dom_id = d->domain_id;
+    struct pci_dev *pdev;
 
     /* send INVALIDATE_IOMMU_PAGES command */
     for_each_amd_iommu ( iommu )
     {
         spin_lock_irqsave(&iommu->lock, flags);
         invalidate_iommu_pages(iommu, gaddr, dom_id, order);
-        flush_command_buffer(iommu);
+        commit_iommu_command_buffer(iommu);
         spin_unlock_irqrestore(&iommu->lock, flags);
     }
 
     if ( ats_enabled )
-        amd_iommu_flush_all_iotlbs(d, gaddr, order);
+        for_each_pdev( d, pdev )
+        {
+            u8 devfn = pdev->devfn;
+
+            iommu = ats_iommu(pdev);
+            if ( !iommu )
+                continue;
+
+            spin_lock_irqsave(&iommu->lock, flags);
+            do {
+                queue_iotlb_flush(iommu, devfn, pdev, gaddr, order);
+                devfn += pdev->phantom_stride;
+            } while ( devfn != pdev->devfn &&
+                      PCI_SLOT(devfn) == PCI_SLOT(pdev->devfn) );
+            commit_iommu_command_buffer(iommu);
+            spin_unlock_irqrestore(&iommu->lock, flags);
+        }
+
+    for_each_amd_iommu ( iommu )
+    {
+        spin_lock_irqsave(&iommu->lock, flags);
+        flush_command_buffer(iommu);
+        spin_unlock_irqrestore(&iommu->lock, flags);
+    }
 }
 
 void amd_iommu_flush_all_pages(struct domain *d)
@@ -689,7 +689,7 @@ int amd_iommu_map_page(struct domain *d, unsigned long gfn, unsigned long mfn,
 
     /* 4K mapping for PV guests never changes, 
      * no need to flush if we trust non-present bits */
-    if ( is_hvm_domain(d) )
+    if ( is_hvm_domain(d) && !this_cpu(iommu_dont_flush_iotlb) )
         amd_iommu_flush_pages(d, gfn, 0);
 
     for ( merge_level = IOMMU_PAGING_MODE_LEVEL_2;
@@ -766,7 +766,33 @@ int amd_iommu_unmap_page(struct domain *d, unsigned long gfn)
     clear_iommu_pte_present(pt_mfn[1], gfn);
     spin_unlock(&hd->arch.mapping_lock);
 
-    amd_iommu_flush_pages(d, gfn, 0);
+    if ( !this_cpu(iommu_dont_flush_iotlb) )
+        amd_iommu_flush_pages(d, gfn, 0);
+
+    return 0;
+}
+
+int amd_iommu_flush_iotlb_pages(struct domain *d, unsigned long gfn,
+                                unsigned int page_count)
+{
+    unsigned long end = gfn + page_count - 1;
+
+    /* Invalidation commands can only cover 4k, 2M or 1G ranges. */
+    if ( page_count == 1 )
+        amd_iommu_flush_pages(d, gfn, 0);
+    else if ( (gfn >> PAGE_ORDER_2M) == (end >> PAGE_ORDER_2M) )
+        amd_iommu_flush_pages(d, gfn, PAGE_ORDER_2M);
+    else if ( (gfn >> PAGE_ORDER_1G) == (end >> PAGE_ORDER_1G) )
+        amd_iommu_flush_pages(d, gfn, PAGE_ORDER_1G);
+    else
+        amd_iommu_flush_all_pages(d);
+
+    return 0;
+}
+
+int amd_iommu_flush_iotlb_all(struct domain *d)
+{
+    amd_iommu_flush_all_pages(d);
 
     return 0;
 }
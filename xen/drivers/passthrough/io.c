@@ -889,6 +889,7 @@ static void hvm_dirq_assist(struct domain *d, struct hvm_pirq_dpci *pirq_dpci)
 
         if ( pirq_dpci->flags & HVM_IRQ_DPCI_GUEST_MSI )
         {
+            hvm_balance_pirq(d, pirq_dpci);
             vmsi_deliver_pirq(d, pirq_dpci);
             spin_unlock(&d->event_lock);
             return;
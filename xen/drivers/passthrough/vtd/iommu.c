@@ -52,6 +52,9 @@ bool __read_mostly untrusted_msi;
 
 int nr_iommus;
 
+/* Highest page table level leaf entries may live at on all IOMMUs. */
+static int __read_mostly vtd_sp_levels = 3;
+
 static struct tasklet vtd_fault_tasklet;
 
 static int setup_hwdom_device(u8 devfn, struct pci_dev *);
@@ -249,7 +252,50 @@ static u64 bus_to_context_maddr(struct iommu *iommu, u8 bus)
     return maddr;
 }
 
-static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr, int alloc)
+/*
+ * Replace the superpage entry *pte at @level by a pointer to a new table
+ * holding the equivalent next level entries.  Returns the new table's maddr,
+ * or 0 if it couldn't be allocated.
+ */
+static u64 dma_pte_split(struct domain *domain, struct dma_pte *pte, int level)
+{
+    struct acpi_drhd_unit *drhd =
+        acpi_find_matched_drhd_unit(pci_get_pdev_by_domain(domain, -1, -1, -1));
+    struct dma_pte *table, new = { 0 };
+    u64 maddr = alloc_pgtable_maddr(drhd, 1);
+    unsigned int i;
+
+    if ( !maddr )
+        return 0;
+
+    table = map_vtd_domain_page(maddr);
+    for ( i = 0; i < PTE_NUM; i++ )
+    {
+        table[i].val = pte->val + offset_level_address(i, level - 1);
+        if ( level == 2 )
+            table[i].val &= ~DMA_PTE_SP;
+    }
+    iommu_flush_cache_page(table, 1);
+    unmap_vtd_domain_page(table);
+
+    dma_set_pte_addr(new, maddr);
+    dma_set_pte_readable(new);
+    dma_set_pte_writable(new);
+    *pte = new;
+    iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
+
+    return maddr;
+}
+
+/*
+ * Return the maddr of the level @target page table (1 being the one holding
+ * 4k leaf entries) covering @addr, splitting superpages mapping @addr at
+ * higher levels.  Absent tables only get allocated with @alloc set, and 0 is
+ * returned otherwise.  A non-zero value below PAGE_SIZE indicates that a
+ * superpage couldn't be split for lack of memory.
+ */
+static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr,
+                                  int target, int alloc)
 {
     struct acpi_drhd_unit *drhd;
     struct pci_dev *pdev;
@@ -275,13 +321,22 @@ static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr, int alloc)
     }
 
     parent = (struct dma_pte *)map_vtd_domain_page(hd->arch.pgd_maddr);
-    while ( level > 1 )
+    while ( level > target )
     {
         offset = address_level_offset(addr, level);
         pte = &parent[offset];
 
         pte_maddr = dma_pte_addr(*pte);
-        if ( !pte_maddr )
+        if ( dma_pte_superpage(*pte) )
+        {
+            pte_maddr = dma_pte_split(domain, pte, level);
+            if ( !pte_maddr )
+            {
+                pte_maddr = level;
+                break;
+            }
+        }
+        else if ( !pte_maddr )
         {
             if ( !alloc )
                 break;
@@ -303,7 +358,7 @@ static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr, int alloc)
             iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
         }
 
-        if ( level == 2 )
+        if ( level == target + 1 )
             break;
 
         unmap_vtd_domain_page(parent);
@@ -645,7 +700,13 @@ static int __must_check iommu_flush_iotlb_all(struct domain *d)
 }
 
 /* clear one page's page table */
-static int __must_check dma_pte_clear_one(struct domain *domain, u64 addr)
+/*
+ * Clear the @level entry for @addr (and hence the whole naturally aligned
+ * range it covers).  Above level 1 this fails with -EEXIST if the entry
+ * points to a lower level table rather than being a superpage.
+ */
+static int __must_check dma_pte_clear(struct domain *domain, u64 addr,
+                                      int level)
 {
     struct domain_iommu *hd = dom_iommu(domain);
     struct dma_pte *page = NULL, *pte = NULL;
@@ -653,16 +714,15 @@ static int __must_check dma_pte_clear_one(struct domain *domain, u64 addr)
     int rc = 0;
 
     spin_lock(&hd->arch.mapping_lock);
-    /* get last level pte */
-    pg_maddr = addr_to_dma_page_maddr(domain, addr, 0);
-    if ( pg_maddr == 0 )
+    pg_maddr = addr_to_dma_page_maddr(domain, addr, level, 0);
+    if ( pg_maddr < PAGE_SIZE )
     {
         spin_unlock(&hd->arch.mapping_lock);
-        return 0;
+        return pg_maddr ? -ENOMEM : 0;
     }
 
     page = (struct dma_pte *)map_vtd_domain_page(pg_maddr);
-    pte = page + address_level_offset(addr, 1);
+    pte = page + address_level_offset(addr, level);
 
     if ( !dma_pte_present(*pte) )
     {
@@ -671,18 +731,31 @@ static int __must_check dma_pte_clear_one(struct domain *domain, u64 addr)
         return 0;
     }
 
+    if ( level > 1 && !dma_pte_superpage(*pte) )
+    {
+        spin_unlock(&hd->arch.mapping_lock);
+        unmap_vtd_domain_page(page);
+        return -EEXIST;
+    }
+
     dma_clear_pte(*pte);
     spin_unlock(&hd->arch.mapping_lock);
     iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
 
     if ( !this_cpu(iommu_dont_flush_iotlb) )
-        rc = iommu_flush_iotlb_pages(domain, addr >> PAGE_SHIFT_4K, 1);
+        rc = iommu_flush_iotlb_pages(domain, addr >> PAGE_SHIFT_4K,
+                                     1u << ((level - 1) * LEVEL_STRIDE));
 
     unmap_vtd_domain_page(page);
 
     return rc;
 }
 
+static int __must_check dma_pte_clear_one(struct domain *domain, u64 addr)
+{
+    return dma_pte_clear(domain, addr, 1);
+}
+
 static void iommu_free_pagetable(u64 pt_maddr, int level)
 {
     struct page_info *pg = maddr_to_page(pt_maddr);
@@ -711,7 +784,7 @@ static void iommu_free_page_table(struct page_info *pg)
         if ( !dma_pte_present(*pte) )
             continue;
 
-        if ( next_level >= 1 )
+        if ( next_level >= 1 && !dma_pte_superpage(*pte) )
             iommu_free_pagetable(dma_pte_addr(*pte), next_level);
 
         dma_clear_pte(*pte);
@@ -1403,7 +1476,7 @@ int domain_context_mapping_one(
         /* Ensure we have pagetables allocated down to leaf PTE. */
         if ( hd->arch.pgd_maddr == 0 )
         {
-            addr_to_dma_page_maddr(domain, 0, 1);
+            addr_to_dma_page_maddr(domain, 0, 1, 1);
             if ( hd->arch.pgd_maddr == 0 )
             {
             nomem:
@@ -1766,39 +1839,46 @@ static void iommu_domain_teardown(struct domain *d)
     spin_unlock(&hd->arch.mapping_lock);
 }
 
-static int __must_check intel_iommu_map_page(struct domain *d,
-                                             unsigned long gfn,
-                                             unsigned long mfn,
-                                             unsigned int flags)
+/*
+ * Install a @level leaf entry, i.e. a superpage above level 1, mapping gfn
+ * to mfn.  Superpages may only replace other superpages or empty entries,
+ * -EEXIST is returned if there is a lower level table in the way.
+ */
+static int __must_check dma_pte_set(struct domain *d, unsigned long gfn,
+                                    unsigned long mfn, int level,
+                                    unsigned int flags)
 {
     struct domain_iommu *hd = dom_iommu(d);
     struct dma_pte *page = NULL, *pte = NULL, old, new = { 0 };
     u64 pg_maddr;
     int rc = 0;
 
-    /* Do nothing if VT-d shares EPT page table */
-    if ( iommu_use_hap_pt(d) )
-        return 0;
-
-    /* Do nothing if hardware domain and iommu supports pass thru. */
-    if ( iommu_passthrough && is_hardware_domain(d) )
-        return 0;
-
     spin_lock(&hd->arch.mapping_lock);
 
-    pg_maddr = addr_to_dma_page_maddr(d, (paddr_t)gfn << PAGE_SHIFT_4K, 1);
-    if ( pg_maddr == 0 )
+    pg_maddr = addr_to_dma_page_maddr(d, (paddr_t)gfn << PAGE_SHIFT_4K,
+                                      level, 1);
+    if ( pg_maddr < PAGE_SIZE )
     {
         spin_unlock(&hd->arch.mapping_lock);
         return -ENOMEM;
     }
     page = (struct dma_pte *)map_vtd_domain_page(pg_maddr);
-    pte = page + (gfn & LEVEL_MASK);
+    pte = page + address_level_offset((paddr_t)gfn << PAGE_SHIFT_4K, level);
     old = *pte;
+
+    if ( level > 1 && dma_pte_present(old) && !dma_pte_superpage(old) )
+    {
+        spin_unlock(&hd->arch.mapping_lock);
+        unmap_vtd_domain_page(page);
+        return -EEXIST;
+    }
+
     dma_set_pte_addr(new, (paddr_t)mfn << PAGE_SHIFT_4K);
     dma_set_pte_prot(new,
                      ((flags & IOMMUF_readable) ? DMA_PTE_READ  : 0) |
                      ((flags & IOMMUF_writable) ? DMA_PTE_WRITE : 0));
+    if ( level > 1 )
+        dma_set_pte_superpage(new);
 
     /* Set the SNP on leaf page table if Snoop Control available */
     if ( iommu_snoop )
@@ -1817,11 +1897,28 @@ static int __must_check intel_iommu_map_page(struct domain *d,
     unmap_vtd_domain_page(page);
 
     if ( !this_cpu(iommu_dont_flush_iotlb) )
-        rc = iommu_flush_iotlb(d, gfn, dma_pte_present(old), 1);
+        rc = iommu_flush_iotlb(d, gfn, dma_pte_present(old),
+                               1u << ((level - 1) * LEVEL_STRIDE));
 
     return rc;
 }
 
+static int __must_check intel_iommu_map_page(struct domain *d,
+                                             unsigned long gfn,
+                                             unsigned long mfn,
+                                             unsigned int flags)
+{
+    /* Do nothing if VT-d shares EPT page table */
+    if ( iommu_use_hap_pt(d) )
+        return 0;
+
+    /* Do nothing if hardware domain and iommu supports pass thru. */
+    if ( iommu_passthrough && is_hardware_domain(d) )
+        return 0;
+
+    return dma_pte_set(d, gfn, mfn, 1, flags);
+}
+
 static int __must_check intel_iommu_unmap_page(struct domain *d,
                                                unsigned long gfn)
 {
@@ -1832,6 +1929,124 @@ static int __must_check intel_iommu_unmap_page(struct domain *d,
     return dma_pte_clear_one(d, (paddr_t)gfn << PAGE_SHIFT_4K);
 }
 
+/* Clear the @level range at gfn, descending where it isn't a superpage. */
+static int __must_check dma_pte_clear_range(struct domain *d,
+                                            unsigned long gfn, int level)
+{
+    unsigned int i;
+    int rc = dma_pte_clear(d, (paddr_t)gfn << PAGE_SHIFT_4K, level);
+
+    if ( rc != -EEXIST )
+        return rc;
+
+    for ( rc = 0, i = 0; i < PTE_NUM; i++ )
+    {
+        int ret = dma_pte_clear_range(
+            d, gfn + (i << ((level - 2) * LEVEL_STRIDE)), level - 1);
+
+        if ( !rc )
+            rc = ret;
+    }
+
+    return rc;
+}
+
+static int __must_check intel_iommu_map_pages(struct domain *d,
+                                              unsigned long gfn,
+                                              unsigned long mfn,
+                                              unsigned int order,
+                                              unsigned int flags)
+{
+    unsigned long i, j, nr = 1UL << order;
+    int level, rc = 0;
+
+    if ( iommu_use_hap_pt(d) )
+        return 0;
+
+    if ( iommu_passthrough && is_hardware_domain(d) )
+        return 0;
+
+    for ( i = 0; i < nr; i += 1UL << ((level - 1) * LEVEL_STRIDE) )
+    {
+        /* Use the largest suitably aligned superpage not in conflict. */
+        for ( level = vtd_sp_levels; level > 1; level-- )
+        {
+            unsigned long mask = (1UL << ((level - 1) * LEVEL_STRIDE)) - 1;
+
+            if ( i + mask >= nr || (((gfn + i) | (mfn + i)) & mask) )
+                continue;
+
+            rc = dma_pte_set(d, gfn + i, mfn + i, level, flags);
+            if ( rc != -EEXIST )
+                break;
+        }
+
+        if ( level == 1 )
+            rc = dma_pte_set(d, gfn + i, mfn + i, 1, flags);
+
+        if ( rc )
+        {
+            /*
+             * Unwind in the largest aligned chunks: whatever got mapped in
+             * there, superpages included, gets cleared without splitting.
+             */
+            for ( j = 0; j < i; j += 1UL << ((level - 1) * LEVEL_STRIDE) )
+            {
+                for ( level = vtd_sp_levels; level > 1; level-- )
+                {
+                    unsigned long mask =
+                        (1UL << ((level - 1) * LEVEL_STRIDE)) - 1;
+
+                    if ( j + mask < i && !(((gfn + j) | (mfn + j)) & mask) )
+                        break;
+                }
+
+                /* If statement to satisfy __must_check. */
+                if ( dma_pte_clear_range(d, gfn + j, level) )
+                    continue;
+            }
+            return rc;
+        }
+    }
+
+    return 0;
+}
+
+static int __must_check intel_iommu_unmap_pages(struct domain *d,
+                                                unsigned long gfn,
+                                                unsigned int order)
+{
+    unsigned long i, nr = 1UL << order;
+    int level, rc = 0;
+
+    if ( iommu_passthrough && is_hardware_domain(d) )
+        return 0;
+
+    /*
+     * Whole table ranges can be dealt with in one go, if not populated, so
+     * go by the largest aligned ones: superpages within them get cleared
+     * rather than split.
+     */
+    for ( i = 0; i < nr; i += 1UL << ((level - 1) * LEVEL_STRIDE) )
+    {
+        int ret;
+
+        for ( level = 3; level > 1; level-- )
+        {
+            unsigned long mask = (1UL << ((level - 1) * LEVEL_STRIDE)) - 1;
+
+            if ( i + mask < nr && !((gfn + i) & mask) )
+                break;
+        }
+
+        ret = dma_pte_clear_range(d, gfn + i, level);
+        if ( !rc )
+            rc = ret;
+    }
+
+    return rc;
+}
+
 int iommu_pte_flush(struct domain *d, u64 gfn, u64 *pte,
                     int order, int present)
 {
@@ -2260,9 +2475,13 @@ int __init intel_vtd_setup(void)
                iommu->index);
         if (cap_sps_2mb(iommu->cap))
             printk(", 2MB");
+        else
+            vtd_sp_levels = 1;
 
         if (cap_sps_1gb(iommu->cap))
             printk(", 1GB");
+        else if ( vtd_sp_levels > 2 )
+            vtd_sp_levels = 2;
 
         printk(".\n");
 
@@ -2622,14 +2841,15 @@ static void vtd_dump_p2m_table_level(paddr_t pt_maddr, int level, paddr_t gpa,
             continue;
 
         address = gpa + offset_level_address(i, level);
-        if ( next_level >= 1 ) 
+        if ( next_level >= 1 && !dma_pte_superpage(*pte) )
             vtd_dump_p2m_table_level(dma_pte_addr(*pte), next_level, 
                                      address, indent + 1);
         else
-            printk("%*sgfn: %08lx mfn: %08lx\n",
+            printk("%*sgfn: %08lx mfn: %08lx%s\n",
                    indent, "",
                    (unsigned long)(address >> PAGE_SHIFT_4K),
-                   (unsigned long)(dma_pte_addr(*pte) >> PAGE_SHIFT_4K));
+                   (unsigned long)(dma_pte_addr(*pte) >> PAGE_SHIFT_4K),
+                   next_level ? " (superpage)" : "");
     }
 
     unmap_vtd_domain_page(pt_vaddr);
@@ -2657,6 +2877,8 @@ const struct iommu_ops intel_iommu_ops = {
     .teardown = iommu_domain_teardown,
     .map_page = intel_iommu_map_page,
     .unmap_page = intel_iommu_unmap_page,
+    .map_pages = intel_iommu_map_pages,
+    .unmap_pages = intel_iommu_unmap_pages,
     .free_page_table = iommu_free_page_table,
     .reassign_device = reassign_device_ownership,
     .get_device_group_id = intel_iommu_group_id,
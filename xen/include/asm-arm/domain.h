@@ -39,6 +39,7 @@ struct vtimer {
         struct timer timer;
         uint32_t ctl;
         uint64_t cval;
+        bool armed;     /* timer set at save, to wake the vCPU */
 };
 
 struct arch_domain
@@ -114,7 +115,7 @@ struct arch_domain
         struct rb_root its_devices;         /* Devices mapped to an ITS */
         spinlock_t its_devices_lock;        /* Protects the its_devices tree */
         struct radix_tree_root pend_lpi_tree; /* Stores struct pending_irq's */
-        rwlock_t pend_lpi_tree_lock;        /* Protects the pend_lpi_tree */
+        rwlock_t pend_lpi_tree_lock;        /* Serialises pend_lpi_tree updates */
         struct list_head vits_list;         /* List of virtual ITSes */
         unsigned int intid_bits;
         /*
@@ -270,6 +271,8 @@ struct arch_vcpu
          * list and write it to the LR register.
          * lr_pending is a subset of vgic.inflight_irqs. */
         struct list_head lr_pending;
+        /* Where to insert into the above two lists, by priority. */
+        struct vgic_prio_index *inflight_index, *lr_pending_index;
         spinlock_t lock;
 
         /* GICv3: redistributor base and flags for this vCPU */
@@ -69,6 +69,13 @@ struct p2m_domain {
      */
     bool need_flush;
 
+    /*
+     * Intermediate tables unlinked from the p2m, to be freed once the TLBs
+     * (and walk caches) can't reference them anymore, i.e. after the next
+     * flush.
+     */
+    struct page_list_head freelist;
+
     /* Gather some statistics for information purposes only */
     struct {
         /* Number of mappings at each p2m tree level */
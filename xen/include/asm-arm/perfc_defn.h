@@ -71,6 +71,9 @@ PERFCOUNTER(phys_timer_irqs,  "Physical timer interrupts")
 PERFCOUNTER(virt_timer_irqs,  "Virtual timer interrupts")
 PERFCOUNTER(maintenance_irqs, "Maintenance interrupts")
 
+PERFCOUNTER(p2m_tlb_flush,        "p2m: TLB flushes")
+PERFCOUNTER(p2m_tlb_flush_merged, "p2m: TLB flushes merged")
+
 /*#endif*/ /* __XEN_PERFC_DEFN_H__ */
 
 /*
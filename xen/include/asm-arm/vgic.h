@@ -92,6 +92,18 @@ struct pending_irq
     struct list_head lr_queue;
 };
 
+/*
+ * Index into one of the per-vCPU lists of pending_irqs ordered by priority
+ * (inflight_irqs and lr_pending), to avoid walking the list upon insertion.
+ * A level corresponds to the priority as visible to the guest (i.e. after
+ * GIC_PRI_TO_GUEST()).
+ */
+#define VGIC_PRIO_LEVELS        32
+struct vgic_prio_index {
+    uint32_t levels;                            /* Non-empty levels. */
+    struct list_head *tail[VGIC_PRIO_LEVELS];   /* Last entry of a level. */
+};
+
 #define NR_INTERRUPT_PER_RANK   32
 #define INTERRUPT_RANK_MASK (NR_INTERRUPT_PER_RANK - 1)
 
@@ -207,6 +219,10 @@ extern void vgic_vcpu_inject_spi(struct domain *d, unsigned int virq);
 extern void vgic_remove_irq_from_queues(struct vcpu *v, struct pending_irq *p);
 extern void vgic_clear_pending_irqs(struct vcpu *v);
 extern void vgic_init_pending_irq(struct pending_irq *p, unsigned int virq);
+extern void vgic_prio_add(struct vgic_prio_index *idx, struct list_head *head,
+                          struct pending_irq *p, size_t link);
+extern void vgic_prio_del(struct vgic_prio_index *idx, struct list_head *head,
+                          struct pending_irq *p, size_t link);
 extern struct pending_irq *irq_to_pending(struct vcpu *v, unsigned int irq);
 extern struct pending_irq *spi_to_pending(struct domain *d, unsigned int irq);
 extern struct vgic_irq_rank *vgic_rank_offset(struct vcpu *v, int b, int n, int s);
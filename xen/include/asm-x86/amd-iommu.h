@@ -95,6 +95,7 @@ struct amd_iommu {
 
     struct table_struct dev_table;
     struct ring_buffer cmd_buffer;
+    unsigned int cmd_pending; /* queued since the last completion wait */
     struct ring_buffer event_log;
     struct ring_buffer ppr_log;
 
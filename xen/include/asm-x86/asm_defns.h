@@ -355,6 +355,8 @@ static always_inline void stac(void)
         pushq %rdx;                             \
         leaq __per_cpu_offset(%rip),%rdx;       \
         movq (%rdx,_cur,8),_cur;                \
+        leaq per_cpu__perfc_shift(%rip),%rdx;   \
+        addq (%rdx,_cur),_cur;                  \
         leaq per_cpu__perfcounters(%rip),%rdx;  \
         addq %rdx,_cur;                         \
         popq %rdx;                              \
@@ -42,8 +42,18 @@ struct trap_bounce {
 #define MAPHASH_HASHFN(pfn) ((pfn) & (MAPHASH_ENTRIES-1))
 #define MAPHASHENT_NOTINUSE ((u32)~0U)
 struct mapcache_vcpu {
-    /* Shadow of mapcache_domain.epoch. */
-    unsigned int shadow_epoch;
+    /*
+     * Each vCPU owns MAPCACHE_VCPU_ENTRIES entries of its domain's mapcache,
+     * which only it allocates from and frees to (with interrupts off), so no
+     * locking is needed.  Which of them are in use, and which are garbage to
+     * reap at the next flush?
+     */
+    unsigned long inuse;
+    unsigned long garbage;
+
+    /* When garbage was last reaped, and on which CPU we last checked that. */
+    u32 tlbflush_timestamp;
+    unsigned int flush_cpu;
 
     /* Lock-free per-VCPU hash of recently-used mappings. */
     struct vcpu_maphash_entry {
@@ -54,20 +64,11 @@ struct mapcache_vcpu {
 };
 
 struct mapcache_domain {
-    /* The number of array entries, and a cursor into the array. */
-    unsigned int entries;
-    unsigned int cursor;
-
-    /* Protects map_domain_page(). */
-    spinlock_t lock;
+    /* Is the mapcache in use at all? */
+    bool enabled;
 
-    /* Garbage mappings are flushed from TLBs in batches called 'epochs'. */
-    unsigned int epoch;
-    u32 tlbflush_timestamp;
-
-    /* Which mappings are in use, and which are garbage to reap next epoch? */
-    unsigned long *inuse;
-    unsigned long *garbage;
+    /* The number of array entries (MAPCACHE_VCPU_ENTRIES per vCPU). */
+    unsigned int entries;
 };
 
 int mapcache_domain_init(struct domain *);
@@ -110,6 +111,7 @@ struct shadow_domain {
 
     /* Shadow hashtable */
     struct page_info **hash_table;
+    unsigned int hash_buckets; /* Sized to total_pages, a prime */
     bool_t hash_walking;  /* Some function is walking the hash table */
 
     /* Fast MMIO path heuristic */
@@ -118,6 +120,7 @@ struct shadow_domain {
     /* OOS */
     bool_t oos_active;
     bool_t oos_off;
+    unsigned int oos_pages; /* Slots per vcpu, at most SHADOW_OOS_MAX_PAGES */
 
     /* Has this domain ever used HVMOP_pagetable_dying? */
     bool_t pagetable_dying_op;
@@ -142,13 +145,13 @@ struct shadow_vcpu {
     unsigned long last_emulated_mfn;
 
     /* Shadow out-of-sync: pages that this vcpu has let go out of sync */
-    mfn_t oos[SHADOW_OOS_PAGES];
-    mfn_t oos_snapshot[SHADOW_OOS_PAGES];
+    mfn_t oos[SHADOW_OOS_MAX_PAGES];
+    mfn_t oos_snapshot[SHADOW_OOS_MAX_PAGES];
     struct oos_fixup {
         int next;
         mfn_t smfn[SHADOW_OOS_FIXUPS];
         unsigned long off[SHADOW_OOS_FIXUPS];
-    } oos_fixup[SHADOW_OOS_PAGES];
+    } oos_fixup[SHADOW_OOS_MAX_PAGES];
 
     bool_t pagetable_dying;
 #endif
@@ -177,6 +180,14 @@ struct log_dirty_domain {
     unsigned int   fault_count;
     unsigned int   dirty_count;
 
+    /* optional ring of newly dirtied pfns, drained by the toolstack */
+    struct log_dirty_ring {
+        uint64_t      *gfns;
+        unsigned int   size;      /* # of entries, a power of two */
+        unsigned int   prod, cons;
+        bool           overflow;  /* entries were dropped since last clean */
+    } ring;
+
     /* functions which are paging mode specific */
     const struct log_dirty_ops {
         int        (*enable  )(struct domain *d, bool log_global);
@@ -290,6 +301,10 @@ struct arch_domain
 
     bool_t s3_integrity;
 
+    /* Speculative mitigation profile, see struct xen_domctl_spec_ctrl. */
+    unsigned int spec_trust_group;
+    bool spec_no_xpti;
+
     struct list_head pdev_list;
 
     union {
@@ -394,6 +409,8 @@ struct arch_domain
     unsigned int psr_rmid;
     /* COS assigned to the domain for each socket */
     unsigned int *psr_cos_ids;
+    /* Allocation controller state for each socket */
+    struct psr_ctrl *psr_ctrl;
 
     /* Shared page for notifying that explicit PIRQ EOI is required. */
     unsigned long *pirq_eoi_map;
@@ -563,6 +580,8 @@ struct arch_vcpu
     /* This variable determines whether nonlazy extended state has been used,
      * and thus should be saved/restored. */
     bool_t nonlazy_xstate_used;
+    /* Size of xsave_area, which grows along with xcr0_accum. */
+    unsigned int xsave_size;
 
     /*
      * The SMAP check policy when updating runstate_guest(v) and the
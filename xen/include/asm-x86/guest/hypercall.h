@@ -121,6 +121,12 @@ static inline long xen_hypercall_hvm_op(unsigned int op, void *arg)
     return _hypercall64_2(long, __HYPERVISOR_hvm_op, op, arg);
 }
 
+static inline long xen_hypercall_multicall(struct multicall_entry *calls,
+                                           unsigned int nr)
+{
+    return _hypercall64_2(long, __HYPERVISOR_multicall, calls, nr);
+}
+
 /*
  * Higher level hypercall helpers
  */
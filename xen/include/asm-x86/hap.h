@@ -44,6 +44,11 @@ int   hap_track_dirty_vram(struct domain *d,
                            unsigned long begin_pfn,
                            unsigned long nr,
                            XEN_GUEST_HANDLE_PARAM(void) dirty_bitmap);
+int   hap_dirty_vram_bitmap(struct domain *d,
+                            unsigned long begin_pfn,
+                            unsigned long nr,
+                            unsigned long *dirty_bitmap);
+void  hap_mark_dirty_vram(struct domain *d, unsigned long pfn);
 
 extern const struct paging_mode *hap_paging_get_mode(struct vcpu *);
 int hap_set_allocation(struct domain *d, unsigned int pages, bool *preempted);
@@ -69,8 +69,14 @@ struct hvm_ioreq_server {
     spinlock_t             bufioreq_lock;
     evtchn_port_t          bufioreq_evtchn;
     struct rangeset        *range[NR_IO_RANGE_TYPES];
+    /* Port/memory ranges (subsets of range[]) whose writes can be posted. */
+    struct rangeset        *buffered[XEN_DMOP_IO_RANGE_MEMORY + 1];
     bool                   enabled;
     bool                   bufioreq_atomic;
+    /* Suppress notifications for non-empty rings (..._BUFIOREQ_COALESCE). */
+    bool                   bufioreq_coalesce;
+    /* Emulator polls for synchronous requests (XEN_DMOP_IOREQ_SERVER_POLL). */
+    bool                   polled;
 };
 
 /*
@@ -112,6 +118,8 @@ struct hvm_domain {
         spinlock_t       lock;
         ioservid_t       id;
         struct list_head list;
+        /* Bumped whenever the outcome of server selection may change. */
+        unsigned int     gen;
     } ioreq_server;
     struct hvm_ioreq_server *default_ioreq_server;
 
@@ -154,6 +162,8 @@ struct hvm_domain {
 
     /* VRAM dirty support.  Protect with the domain paging lock. */
     struct sh_dirty_vram *dirty_vram;
+    /* See XEN_DMOP_track_dirty_vram_ranges. */
+    uint64_t               dirty_vram_gen;
 
     /* If one of vcpus of this domain is in no_fill_mode or
      * mtrr/pat between vcpus is not the same, set is_in_uc_mode
@@ -163,13 +173,17 @@ struct hvm_domain {
 
     /* hypervisor intercepted msix table */
     struct list_head       msixtbl_list;
+    struct msixtbl_entry  *msixtbl_last;   /* Last one looked up. */
 
     struct viridian_domain viridian;
 
     bool_t                 hap_enabled;
     bool_t                 mem_sharing_enabled;
+    /* Parent this domain was forked from (holds a reference), or NULL. */
+    struct domain         *fork_parent;
     bool_t                 qemu_mapcache_invalidate;
     bool_t                 is_s3_suspended;
+    bool                   exit_stats;  /* XEN_DOMCTL_hvm_exit_stats */
 
     /*
      * TSC value that VCPUs use to calculate their tsc_offset value.
@@ -192,6 +206,9 @@ struct hvm_domain {
 
     struct hvm_pi_ops pi_ops;
 
+    /* Background NUMA memory balancing state, if enabled. */
+    struct numa_balance *numa_balance;
+
     union {
         struct vmx_domain vmx;
         struct svm_domain svm;
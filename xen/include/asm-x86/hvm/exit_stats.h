@@ -0,0 +1,58 @@
+/*
+ * include/asm-x86/hvm/exit_stats.h
+ *
+ * Per exit reason VM exit counts and handling time histograms.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ASM_X86_HVM_EXIT_STATS_H__
+#define __ASM_X86_HVM_EXIT_STATS_H__
+
+#include <xen/sched.h>
+#include <asm/msr.h>
+#include <public/domctl.h>
+
+void hvm_exit_stats_account(struct vcpu *v);
+void hvm_exit_stats_destroy(struct vcpu *v);
+int hvm_exit_stats_domctl(struct domain *d,
+                          struct xen_domctl_hvm_exit_stats *op);
+
+/* At the start of the exit handler, with the (basic) exit reason. */
+static inline void hvm_exit_stats_begin(struct vcpu *v, unsigned int reason)
+{
+    if ( unlikely(v->domain->arch.hvm_domain.exit_stats) )
+    {
+        v->arch.hvm_vcpu.exit_reason = reason;
+        v->arch.hvm_vcpu.exit_tsc = rdtsc();
+    }
+}
+
+/* On VM entry, and when the vCPU gets descheduled. */
+static inline void hvm_exit_stats_end(struct vcpu *v)
+{
+    if ( unlikely(v->arch.hvm_vcpu.exit_tsc) )
+        hvm_exit_stats_account(v);
+}
+
+#endif /* __ASM_X86_HVM_EXIT_STATS_H__ */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
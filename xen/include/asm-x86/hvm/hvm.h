@@ -196,6 +196,8 @@ struct hvm_function_table {
     void (*deliver_posted_intr)(struct vcpu *v, u8 vector);
     void (*sync_pir_to_irr)(struct vcpu *v);
     bool (*test_pir)(const struct vcpu *v, uint8_t vector);
+    void (*posted_intr_batch_begin)(void);
+    void (*posted_intr_batch_finish)(void);
     void (*handle_eoi)(u8 vector);
 
     /*Walk nested p2m  */
@@ -390,10 +392,15 @@ bool hvm_set_guest_bndcfgs(struct vcpu *v, u64 val);
 #define has_viridian_apic_assist(d) \
     (is_viridian_domain(d) && (viridian_feature_mask(d) & HVMPV_apic_assist))
 
+#define has_viridian_synic(d) \
+    (is_viridian_domain(d) && (viridian_feature_mask(d) & HVMPV_synic))
+
 bool hvm_check_cpuid_faulting(struct vcpu *v);
 void hvm_migrate_timers(struct vcpu *v);
 void hvm_do_resume(struct vcpu *v);
 void hvm_migrate_pirqs(struct vcpu *v);
+struct hvm_pirq_dpci;
+void hvm_balance_pirq(struct domain *d, struct hvm_pirq_dpci *pirq_dpci);
 
 void hvm_inject_event(const struct x86_event *event);
 
@@ -451,6 +458,22 @@ static inline void hvm_cpu_down(void)
         hvm_funcs.cpu_down();
 }
 
+/*
+ * Defer posted interrupt notifications raised on this CPU until the batch
+ * is finished, so multicast deliveries send one IPI per pCPU.
+ */
+static inline void hvm_posted_intr_batch_begin(void)
+{
+    if ( hvm_funcs.posted_intr_batch_begin )
+        hvm_funcs.posted_intr_batch_begin();
+}
+
+static inline void hvm_posted_intr_batch_finish(void)
+{
+    if ( hvm_funcs.posted_intr_batch_finish )
+        hvm_funcs.posted_intr_batch_finish();
+}
+
 static inline unsigned int hvm_get_insn_bytes(struct vcpu *v, uint8_t *buf)
 {
     return (hvm_funcs.get_insn_bytes ? hvm_funcs.get_insn_bytes(v, buf) : 0);
@@ -103,6 +103,7 @@ int hvm_io_intercept(ioreq_t *p);
 
 struct hvm_io_handler *hvm_next_io_handler(struct domain *d);
 
+bool hvm_io_internal(const ioreq_t *p);
 bool_t hvm_mmio_internal(paddr_t gpa);
 
 void register_mmio_handler(struct domain *d,
@@ -136,6 +136,10 @@ struct hvm_gmsi_info {
     uint32_t gflags;
     int dest_vcpu_id; /* -1 :multi-dest, non-negative: dest_vcpu_id */
     bool posted; /* directly deliver to guest via VT-d PI? */
+    /* hvm_balance_pirq() state. */
+    unsigned int balance_cpu;
+    unsigned int balance_hits;
+    s_time_t balance_stamp;
 };
 
 struct hvm_girq_dpci_mapping {
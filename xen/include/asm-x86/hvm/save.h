@@ -94,9 +94,14 @@ static inline uint16_t hvm_load_instance(struct hvm_domain_context *h)
 /* Handler types for different types of save-file entry. 
  * The save handler may save multiple instances of a type into the buffer;
  * the load handler will be called once for each instance found when
- * restoring.  Both return non-zero on error. */
+ * restoring.  Both return non-zero on error.
+ * Per-vcpu types instead have a save handler called for each vcpu in turn,
+ * saving at most that vcpu's instance, so that single vcpus can be saved
+ * on their own. */
 typedef int (*hvm_save_handler) (struct domain *d, 
                                  hvm_domain_context_t *h);
+typedef int (*hvm_save_vcpu_handler) (struct vcpu *v,
+                                      hvm_domain_context_t *h);
 typedef int (*hvm_load_handler) (struct domain *d,
                                  hvm_domain_context_t *h);
 
@@ -107,6 +112,12 @@ void hvm_register_savevm(uint16_t typecode,
                          hvm_save_handler save_state,
                          hvm_load_handler load_state,
                          size_t size, int kind);
+/* ... or of a per-vcpu type, with the space needed for one vcpu */
+void hvm_register_savevm_vcpu(uint16_t typecode,
+                              const char *name,
+                              hvm_save_vcpu_handler save_state,
+                              hvm_load_handler load_state,
+                              size_t size);
 
 /* The space needed for saving can be per-domain or per-vcpu: */
 #define HVMSR_PER_DOM  0
@@ -128,6 +139,19 @@ static int __init __hvm_register_##_x##_save_and_restore(void)            \
 }                                                                         \
 __initcall(__hvm_register_##_x##_save_and_restore);
 
+#define HVM_REGISTER_SAVE_RESTORE_VCPU(_x, _save, _load)                   \
+static int __init __hvm_register_##_x##_save_and_restore(void)            \
+{                                                                         \
+    hvm_register_savevm_vcpu(HVM_SAVE_CODE(_x),                           \
+                             #_x,                                         \
+                             &_save,                                      \
+                             &_load,                                      \
+                             HVM_SAVE_LENGTH(_x)                          \
+                             + sizeof (struct hvm_save_descriptor));      \
+    return 0;                                                             \
+}                                                                         \
+__initcall(__hvm_register_##_x##_save_and_restore);
+
 
 /* Entry points for saving and restoring HVM domain state */
 size_t hvm_save_size(struct domain *d);
@@ -136,6 +160,18 @@ int hvm_save_one(struct domain *d, unsigned int typecode, unsigned int instance,
                  XEN_GUEST_HANDLE_64(uint8) handle, uint64_t *bufsz);
 int hvm_load(struct domain *d, hvm_domain_context_t *h);
 
+/*
+ * Saving in pieces: the header, per-domain records and end marker, then
+ * the per-vcpu records of a range of vcpus at a time.  Loading the latter
+ * takes only per-vcpu records, of the range given.
+ */
+size_t hvm_save_size_domain(struct domain *d);
+size_t hvm_save_size_vcpu(struct vcpu *v);
+int hvm_save_domain(struct domain *d, hvm_domain_context_t *h);
+int hvm_save_vcpu(struct vcpu *v, hvm_domain_context_t *h);
+int hvm_load_vcpus(struct domain *d, unsigned int first, unsigned int nr,
+                   hvm_domain_context_t *h);
+
 /* Arch-specific definitions. */
 struct hvm_save_header;
 void arch_hvm_save(struct domain *d, struct hvm_save_header *hdr);
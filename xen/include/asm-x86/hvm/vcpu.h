@@ -78,6 +78,21 @@ struct hvm_vcpu_io {
     /* For retries we shouldn't re-fetch the instruction. */
     unsigned int mmio_insn_bytes;
     unsigned char mmio_insn[16];
+
+    /*
+     * Translations of recently emulated instructions' addresses, along with
+     * the bytes found there.  See hvmemul_fetch_insn().
+     */
+    struct hvm_insn_cache {
+        unsigned long addr;
+        unsigned long cr3;
+        gfn_t gfn;
+        uint32_t pfec;
+        unsigned char insn[16];
+    } insn_cache[4];
+    unsigned int insn_cache_count;
+    unsigned int insn_cache_next;
+
     /*
      * For string instruction emulation we need to be able to signal a
      * necessary retry through other than function return codes.
@@ -89,6 +104,14 @@ struct hvm_vcpu_io {
     unsigned long msix_snoop_gpa;
 
     const struct g2m_ioport *g2m_ioport;
+
+    /* Last match of hvm_select_ioreq_server(), valid while gen is current. */
+    struct hvm_ioreq_sel {
+        struct hvm_ioreq_server *server;
+        unsigned int gen;
+        uint8_t type;
+        uint64_t start, end;
+    } ioreq_sel;
 };
 
 static inline bool_t hvm_vcpu_io_need_completion(const struct hvm_vcpu_io *vio)
@@ -97,6 +120,12 @@ static inline bool_t hvm_vcpu_io_need_completion(const struct hvm_vcpu_io *vio)
            !vio->io_req.data_is_ptr;
 }
 
+/* To be called whenever the guest's linear address translations may change. */
+static inline void hvm_vcpu_io_flush_insn_cache(struct hvm_vcpu_io *vio)
+{
+    vio->insn_cache_count = 0;
+}
+
 struct nestedvcpu {
     bool_t nv_guestmode; /* vcpu in guestmode? */
     void *nv_vvmcx; /* l1 guest virtual VMCB/VMCS */
@@ -160,14 +189,21 @@ struct hvm_vcpu {
     s64                 cache_tsc_offset;
     u64                 guest_time;
 
-    /* Lock and list for virtual platform timers. */
+    /* HPET register reads, which want the guest to use a TSC clocksource. */
+    unsigned long       hpet_reads;
+
+    /* Lock, list and (vpt-coalesce) host timer for virtual platform timers. */
     spinlock_t          tm_lock;
     struct list_head    tm_list;
+    struct timer        tm_timer;
 
     bool                flag_dr_dirty;
     bool                debug_state_latch;
     bool                single_step;
 
+    /* Running time as of the last flush of our PML buffer for VRAM. */
+    uint64_t            dirty_vram_ran;
+
     struct hvm_vcpu_asid n1asid;
 
     u32                 msr_tsc_aux;
@@ -206,6 +242,11 @@ struct hvm_vcpu {
     struct x86_event     inject_event;
 
     struct viridian_vcpu viridian;
+
+    /* VM exit histograms, see exit_stats.c. */
+    struct hvm_exit_stat *exit_stats;
+    uint64_t            exit_tsc;       /* of the exit being handled, or 0 */
+    unsigned int        exit_reason;
 };
 
 #endif /* __ASM_X86_HVM_VCPU_H__ */
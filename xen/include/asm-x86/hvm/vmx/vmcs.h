@@ -18,6 +18,8 @@
 #ifndef __ASM_X86_HVM_VMX_VMCS_H__
 #define __ASM_X86_HVM_VMX_VMCS_H__
 
+#include <xen/tasklet.h>
+#include <xen/timer.h>
 #include <asm/hvm/io.h>
 #include <irq_vectors.h>
 
@@ -55,8 +57,15 @@ struct ept_data {
     };
     /* Set of PCPUs needing an INVEPT before a VMENTER. */
     cpumask_var_t invalidate;
+    /* Folding of split superpages back together, see p2m-ept.c. */
+    struct timer coalesce_timer;
+    struct tasklet coalesce_tasklet;
+    unsigned long coalesce_gfn;
+    unsigned long coalesced_2m, coalesced_1g;
 };
 
+extern bool opt_ept_coalesce;
+
 #define _VMX_DOMAIN_PML_ENABLED    0
 #define VMX_DOMAIN_PML_ENABLED     (1ul << _VMX_DOMAIN_PML_ENABLED)
 struct vmx_domain {
@@ -95,6 +95,7 @@ typedef struct HPETState {
     uint64_t mc_offset;
     struct periodic_time pt[HPET_TIMER_NUM];
     rwlock_t lock;
+    unsigned int seq; /* Odd while the registers are being written. */
 } HPETState;
 
 typedef struct RTCState {
@@ -140,6 +141,8 @@ struct pl_time {    /* platform time */
     struct domain *domain;
 };
 
+void pt_vcpu_init(struct vcpu *v);
+void pt_vcpu_destroy(struct vcpu *v);
 void pt_save_timer(struct vcpu *v);
 void pt_restore_timer(struct vcpu *v);
 int pt_update_irq(struct vcpu *v);
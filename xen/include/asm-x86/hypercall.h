@@ -6,6 +6,7 @@
 #define __ASM_X86_HYPERCALL_H__
 
 #include <xen/types.h>
+#include <xen/time.h>
 #include <public/physdev.h>
 #include <public/event_channel.h>
 #include <public/arch-x86/xen-mca.h> /* for do_mca */
@@ -25,6 +26,25 @@ typedef struct {
 
 extern const hypercall_args_t hypercall_args_table[NR_hypercalls];
 
+/* Hypercall latency histograms (XEN_SYSCTL_hypercall_stats). */
+extern bool hypercall_stats_enabled;
+void hypercall_stats_record(unsigned int op, unsigned long arg0,
+                            s_time_t start);
+struct xen_sysctl_hcstats_op;
+int hypercall_stats_control(struct xen_sysctl_hcstats_op *op);
+
+static inline s_time_t hypercall_stats_begin(void)
+{
+    return unlikely(hypercall_stats_enabled) ? NOW() : 0;
+}
+
+static inline void hypercall_stats_end(unsigned int op, unsigned long arg0,
+                                       s_time_t start)
+{
+    if ( unlikely(start) )
+        hypercall_stats_record(op, arg0, start);
+}
+
 #ifdef CONFIG_PV
 extern const hypercall_table_t pv_hypercall_table[];
 void pv_hypercall(struct cpu_user_regs *regs);
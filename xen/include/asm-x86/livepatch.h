@@ -12,6 +12,9 @@
 #define ARCH_LIVEPATCH_RANGE SZ_2G
 #define LIVEPATCH_FEATURE    X86_FEATURE_ALWAYS
 
+struct cpu_user_regs;
+bool arch_livepatch_int3(struct cpu_user_regs *regs);
+
 #endif /* __XEN_X86_LIVEPATCH_H__ */
 
 /*
@@ -24,8 +24,13 @@
 #include <public/domctl.h>
 #include <public/memory.h>
 
-/* Auditing of memory sharing code? */
+/* Auditing of memory sharing code?  Debug builds only: it costs list
+ * manipulation on every share and unshare. */
+#ifndef NDEBUG
 #define MEM_SHARING_AUDIT 1
+#else
+#define MEM_SHARING_AUDIT 0
+#endif
 
 typedef uint64_t shr_handle_t; 
 
@@ -54,6 +59,11 @@ struct page_sharing_info
 #define sharing_supported(_d) \
     (is_hvm_domain(_d) && paging_mode_hap(_d)) 
 
+static inline bool mem_sharing_is_fork(const struct domain *d)
+{
+    return is_hvm_domain(d) && d->arch.hvm_domain.fork_parent;
+}
+
 unsigned int mem_sharing_get_nr_saved_mfns(void);
 unsigned int mem_sharing_get_nr_shared_mfns(void);
 
@@ -85,6 +95,13 @@ static inline int mem_sharing_unshare_page(struct domain *d,
  */
 int mem_sharing_notify_enomem(struct domain *d, unsigned long gfn,
                                 bool_t allow_sleep);
+
+/*
+ * Populate a hole in a forked domain's p2m from its parent: shared with
+ * the parent's frame where possible, or as a private copy when
+ * unsharing (or when the parent's frame cannot be shared).
+ */
+int mem_sharing_fork_page(struct domain *cd, gfn_t gfn, bool unsharing);
 int mem_sharing_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_sharing_op_t) arg);
 int mem_sharing_domctl(struct domain *d, 
                        struct xen_domctl_mem_sharing_op *mec);
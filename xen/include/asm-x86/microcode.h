@@ -8,11 +8,18 @@ struct ucode_cpu_info;
 
 struct microcode_ops {
     int (*microcode_resume_match)(unsigned int cpu, const void *mc);
+    /*
+     * Find the newest patch in @buf fitting this CPU and record it in its
+     * ucode_cpu_info.  If @apply, also load it, returning 0 on success.
+     * Otherwise return 1 if a patch newer than the running one was found.
+     */
     int (*cpu_request_microcode)(unsigned int cpu, const void *buf,
-                                 size_t size);
+                                 size_t size, bool apply);
     int (*collect_cpu_info)(unsigned int cpu, struct cpu_signature *csig);
     int (*apply_microcode)(unsigned int cpu);
     int (*start_update)(void);
+    /* Called on every CPU (with IRQs off) after a late update was loaded. */
+    void (*end_update_percpu)(void);
 };
 
 struct cpu_signature {
@@ -278,8 +278,14 @@ struct page_info
 
 #define PRtype_info "016lx"/* should only be used for printk's */
 
-/* The number of out-of-sync shadows we allow per vcpu (prime, please) */
+/*
+ * The number of out-of-sync shadows we allow per vcpu by default, and at
+ * most, as set through XEN_DOMCTL_SHADOW_OP_SET_OOS_PAGES (prime, please).
+ * The per-vcpu arrays are sized for the most, so that struct vcpu still
+ * fits in a page.
+ */
 #define SHADOW_OOS_PAGES 3
+#define SHADOW_OOS_MAX_PAGES 5
 
 /* OOS fixup entries */
 #define SHADOW_OOS_FIXUPS 2
@@ -619,6 +625,9 @@ extern const char zero_page[];
 /* Build a 32bit PSE page table using 4MB pages. */
 void write_32bit_pse_identmap(uint32_t *l2);
 
+/* Carry out the TLB flushes put off by the sub-calls of a multicall. */
+void multicall_flush_tlb(void);
+
 /*
  * x86 maps part of physical memory via the directmap region.
  * Return whether the input MFN falls in that range.
@@ -28,6 +28,7 @@
 
 #include <xen/paging.h>
 #include <xen/p2m-common.h>
+#include <xen/tasklet.h>
 #include <xen/mem_access.h>
 #include <asm/mem_sharing.h>
 #include <asm/page.h>    /* for pagetable_t */
@@ -253,6 +254,9 @@ struct p2m_domain {
     void               (*enable_hardware_log_dirty)(struct p2m_domain *p2m);
     void               (*disable_hardware_log_dirty)(struct p2m_domain *p2m);
     void               (*flush_hardware_cached_dirty)(struct p2m_domain *p2m);
+    void               (*flush_hardware_cached_dirty_vcpu)(
+                                                   struct p2m_domain *p2m,
+                                                   struct vcpu *v);
     void               (*change_entry_type_global)(struct p2m_domain *p2m,
                                                    p2m_type_t ot,
                                                    p2m_type_t nt);
@@ -336,6 +340,7 @@ struct p2m_domain {
         } mrp;
         mm_lock_t        lock;         /* Locking of private pod structs,   *
                                         * not relying on the p2m lock.      */
+        struct tasklet   sweeper;      /* Background reclaim of zero pages */
     } pod;
     union {
         struct ept_data ept;
@@ -401,6 +406,16 @@ static inline bool_t p2m_is_altp2m(const struct p2m_domain *p2m)
 void p2m_tlb_flush_sync(struct p2m_domain *p2m);
 void p2m_unlock_and_tlb_flush(struct p2m_domain *p2m);
 
+/*
+ * Hold the host p2m lock across a batch of updates, so that the TLB flushes
+ * they require are coalesced into one, done by p2m_batch_flush() or at the
+ * latest by p2m_batch_end().  Must not be used around anything that may
+ * need to wait, or take the p2m lock for reading (e.g. copying from guest).
+ */
+void p2m_batch_begin(struct domain *d);
+void p2m_batch_flush(struct domain *d);
+void p2m_batch_end(struct domain *d);
+
 /**** p2m query accessors. They lock p2m_lock, and thus serialize
  * lookups wrt modifications. They _do not_ release the lock on exit.
  * After calling any of the variants below, caller needs to use
@@ -596,6 +611,8 @@ void p2m_disable_hardware_log_dirty(struct domain *d);
 
 /* Flush hardware cached dirty GFNs */
 void p2m_flush_hardware_cached_dirty(struct domain *d);
+/* ... of just one, paused, vcpu */
+void p2m_flush_hardware_cached_dirty_vcpu(struct vcpu *v);
 
 /* Change types across all p2m entries in a domain */
 void p2m_change_entry_type_global(struct domain *d, 
@@ -640,6 +657,10 @@ int p2m_add_foreign(struct domain *tdom, unsigned long fgfn,
  * Populate-on-demand
  */
 
+/* Set up / tear down the populate-on-demand state of a p2m */
+void p2m_pod_init(struct p2m_domain *p2m);
+void p2m_pod_uninit(struct p2m_domain *p2m);
+
 /* Dump PoD information about the domain */
 void p2m_pod_dump_data(struct domain *d);
 
@@ -681,6 +702,12 @@ int p2m_mem_paging_prep(struct domain *d, unsigned long gfn, uint64_t buffer);
 /* Resume normal operation (in case a domain was paused) */
 void p2m_mem_paging_resume(struct domain *d, vm_event_response_t *rsp);
 
+/* Background migration of guest memory towards its vCPUs' NUMA node */
+int numa_balance_domain_init(struct domain *d);
+void numa_balance_domain_stop(struct domain *d);
+void numa_balance_domain_destroy(struct domain *d);
+void numa_balance_dump(const struct domain *d);
+
 /* 
  * Internal functions, only called by other p2m code
  */
@@ -183,6 +183,8 @@ struct sh_dirty_vram {
     paddr_t *sl1ma;
     uint8_t *dirty_bitmap;
     s_time_t last_dirty;
+    /* HAP: pages marked in dirty_bitmap by paging_mark_pfn_dirty() */
+    unsigned long nr_dirty;
 };
 
 /*****************************************************************************
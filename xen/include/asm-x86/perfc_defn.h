@@ -18,23 +18,38 @@ PERFCOUNTER(seg_fixups,             "segmentation fixups")
 PERFCOUNTER(apic_timer,             "apic timer interrupts")
 
 PERFCOUNTER(domain_page_tlb_flush,  "domain page tlb flushes")
+PERFCOUNTER(flush_remote_requests,  "remote flush requests")
+PERFCOUNTER(flush_remote_merged,    "remote flushes merged into pending ones")
+PERFCOUNTER(flush_area_invlpg,      "multi-page flushes done by invlpg")
 
 PERFCOUNTER(calls_to_mmuext_op,         "calls to mmuext_op")
 PERFCOUNTER(num_mmuext_ops,             "mmuext ops")
 PERFCOUNTER(calls_to_mmu_update,        "calls to mmu_update")
 PERFCOUNTER(num_page_updates,           "page updates")
 PERFCOUNTER(writable_mmu_updates,       "mmu_updates of writable pages")
+PERFCOUNTER(mmu_update_l1_batched,      "mmu_updates under held L1 lock")
 PERFCOUNTER(calls_to_update_va,         "calls to update_va_map")
+PERFCOUNTER(multicall_flushes_merged,   "multicall TLB flushes merged")
 PERFCOUNTER(page_faults,            "page faults")
 PERFCOUNTER(copy_user_faults,       "copy_user faults")
 
 PERFCOUNTER(map_domain_page_count,  "map_domain_page count")
+PERFCOUNTER(map_domain_page_hit,    "map_domain_page maphash hits")
+PERFCOUNTER(map_domain_page_miss,   "map_domain_page maphash misses")
+PERFCOUNTER(map_domain_page_evict,  "map_domain_page maphash evictions")
 PERFCOUNTER(ptwr_emulations,        "writable pt emulations")
+PERFCOUNTER(ptwr_batched_emulations, "writable pt emulations batched")
 PERFCOUNTER(mmio_ro_emulations,     "mmio ro emulations")
+PERFCOUNTER(emulate_priv_fast_rdmsr, "privop fast path rdmsr")
+PERFCOUNTER(emulate_priv_fast_wrmsr, "privop fast path wrmsr")
+PERFCOUNTER(emulate_priv_fast_in,    "privop fast path in")
+PERFCOUNTER(emulate_priv_fast_out,   "privop fast path out")
 
 PERFCOUNTER(exception_fixed,        "pre-exception fixed")
 
 PERFCOUNTER(guest_walk,            "guest pagetable walks")
+PERFCOUNTER(hvm_insn_cache_hit,    "hvm insn fetch translation cache hits")
+PERFCOUNTER(hvm_insn_cache_miss,   "hvm insn fetch translation cache misses")
 
 /* Shadow counters */
 PERFCOUNTER(shadow_alloc,          "calls to shadow_alloc")
@@ -73,6 +88,8 @@ PERFCOUNTER(shadow_validate_gl4e_calls, "calls to shadow_validate_gl4e")
 PERFCOUNTER(shadow_hash_lookups,   "calls to shadow_hash_lookup")
 PERFCOUNTER(shadow_hash_lookup_head, "shadow hash hit in bucket head")
 PERFCOUNTER(shadow_hash_lookup_miss, "shadow hash misses")
+PERFCOUNTER(shadow_hash_lookup_steps, "shadow hash chain entries walked")
+PERFCOUNTER(shadow_hash_resizes,   "shadow hash table resizes")
 PERFCOUNTER(shadow_get_shadow_status, "calls to get_shadow_status")
 PERFCOUNTER(shadow_hash_inserts,   "calls to shadow_hash_insert")
 PERFCOUNTER(shadow_hash_deletes,   "calls to shadow_hash_delete")
@@ -110,6 +127,7 @@ PERFCOUNTER(shadow_oos_fixup_add,  "shadow OOS fixup adds")
 PERFCOUNTER(shadow_oos_fixup_evict,"shadow OOS fixup evictions")
 PERFCOUNTER(shadow_unsync,         "shadow OOS unsyncs")
 PERFCOUNTER(shadow_unsync_evict,   "shadow OOS evictions")
+PERFCOUNTER(shadow_unsync_swap,    "shadow OOS moves to the other slot")
 PERFCOUNTER(shadow_resync,         "shadow OOS resyncs")
 
 PERFCOUNTER(mshv_call_sw_addr_space,    "MS Hv Switch Address Space")
@@ -117,6 +135,11 @@ PERFCOUNTER(mshv_call_flush_tlb_list,   "MS Hv Flush TLB list")
 PERFCOUNTER(mshv_call_flush_tlb_all,    "MS Hv Flush TLB all")
 PERFCOUNTER(mshv_call_long_wait,        "MS Hv Notify long wait")
 PERFCOUNTER(mshv_call_flush,            "MS Hv Flush TLB")
+PERFCOUNTER(mshv_call_flush_ex,         "MS Hv Flush TLB Ex")
+PERFCOUNTER(mshv_call_ipi,              "MS Hv Send IPI")
+PERFCOUNTER(mshv_call_ipi_ex,           "MS Hv Send IPI Ex")
+PERFCOUNTER(mshv_stimer_direct,         "MS Hv stimer direct expiry")
+PERFCOUNTER(mshv_stimer_message,        "MS Hv stimer message expiry")
 PERFCOUNTER(mshv_rdmsr_osid,            "MS Hv rdmsr Guest OS ID")
 PERFCOUNTER(mshv_rdmsr_hc_page,         "MS Hv rdmsr hypercall page")
 PERFCOUNTER(mshv_rdmsr_vp_index,        "MS Hv rdmsr vp index")
@@ -143,4 +166,31 @@ PERFCOUNTER(realmode_exits,      "vmexits from realmode")
 
 PERFCOUNTER(pauseloop_exits, "vmexits from Pause-Loop Detection")
 
+PERFCOUNTER(hvm_msi_balanced, "guest MSIs moved to their vCPU's pCPU")
+
+PERFCOUNTER(msixtbl_mask,       "MSI-X mask bit writes handled")
+PERFCOUNTER(msixtbl_same,       "MSI-X address/data rewritten unchanged")
+PERFCOUNTER(msixtbl_dm_read,    "MSI-X table reads sent to DM")
+PERFCOUNTER(msixtbl_dm_write,   "MSI-X table writes sent to DM")
+PERFCOUNTER(msixtbl_dm_unmask,  "MSI-X unmasks sent to DM")
+PERFCOUNTER(msixtbl_dm_unbound, "MSI-X unbound entry accesses")
+
+PERFCOUNTER(ept_coalesced_2m, "EPT 2M superpages restored")
+PERFCOUNTER(ept_coalesced_1g, "EPT 1G superpages restored")
+
+PERFCOUNTER(np2m_hit,         "np2m up-to-date for vCPU")
+PERFCOUNTER(np2m_shared,      "np2m shared with other vCPU")
+PERFCOUNTER(np2m_reuse_empty, "np2m empty slot reused")
+PERFCOUNTER(np2m_evict,       "np2m LRU evictions")
+PERFCOUNTER(np2m_flush,       "np2m flushes")
+
+PERFCOUNTER(ctxt_switch_ibpb,      "context switch IBPBs")
+PERFCOUNTER(ctxt_switch_ibpb_skip, "context switch IBPBs skipped")
+
+PERFCOUNTER(amd_iommu_cmds,         "AMD IOMMU commands")
+PERFCOUNTER(amd_iommu_cmd_full,     "AMD IOMMU command buffer full")
+PERFCOUNTER_ARRAY(amd_iommu_batch,  "AMD IOMMU cmds per wait (log2)", 8)
+PERFCOUNTER_ARRAY(amd_iommu_wait_us, "AMD IOMMU wait time (log2 us)", 8)
+PERFCOUNTER(amd_iommu_wait_timeout, "AMD IOMMU completion wait timeouts")
+
 /*#endif*/ /* __XEN_PERFC_DEFN_H__ */
@@ -0,0 +1,8 @@
+#ifndef __ASM_X86_PMUPROF_H__
+#define __ASM_X86_PMUPROF_H__
+
+#include <public/sysctl.h>
+
+int pmuprof_control(struct xen_sysctl_pmuprof_op *op);
+
+#endif /* __ASM_X86_PMUPROF_H__ */
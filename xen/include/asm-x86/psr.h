@@ -28,6 +28,11 @@
 
 /* L3 Monitoring Features */
 #define PSR_CMT_L3_OCCUPANCY            0x1
+#define PSR_CMT_L3_TOTAL_MBM            0x2
+
+/* L3 Monitoring Event IDs */
+#define PSR_CMT_EVTID_L3_OCCUPANCY      0x1
+#define PSR_CMT_EVTID_L3_TOTAL_MBM      0x2
 
 /* CDP Capability */
 #define PSR_CAT_CDP_CAPABILITY          (1u << 2)
@@ -37,6 +37,7 @@ void pv_shim_setup_dom(struct domain *d, l4_pgentry_t *l4start,
                        start_info_t *si);
 int pv_shim_shutdown(uint8_t reason);
 void pv_shim_inject_evtchn(unsigned int port);
+void pv_shim_flush_sends(void);
 long pv_shim_cpu_up(void *data);
 long pv_shim_cpu_down(void *data);
 void pv_shim_online_memory(unsigned int nr, unsigned int order);
@@ -64,6 +65,10 @@ static inline void pv_shim_inject_evtchn(unsigned int port)
 {
     ASSERT_UNREACHABLE();
 }
+static inline void pv_shim_flush_sends(void)
+{
+    ASSERT_UNREACHABLE();
+}
 static inline long pv_shim_cpu_up(void *data)
 {
     ASSERT_UNREACHABLE();
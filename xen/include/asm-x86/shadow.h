@@ -64,6 +64,10 @@ int shadow_track_dirty_vram(struct domain *d,
                             unsigned long first_pfn,
                             unsigned long nr,
                             XEN_GUEST_HANDLE_PARAM(void) dirty_bitmap);
+int shadow_dirty_vram_bitmap(struct domain *d,
+                             unsigned long first_pfn,
+                             unsigned long nr,
+                             unsigned long *dirty_bitmap);
 
 /* Handler for shadow control ops: operations from user-space to enable
  * and disable ephemeral shadow modes (test mode and log-dirty mode) and
@@ -98,6 +102,8 @@ int shadow_set_allocation(struct domain *d, unsigned int pages,
     ({ ASSERT(is_pv_domain(d)); -EOPNOTSUPP; })
 #define shadow_track_dirty_vram(d, begin_pfn, nr, bitmap) \
     ({ ASSERT_UNREACHABLE(); -EOPNOTSUPP; })
+#define shadow_dirty_vram_bitmap(d, begin_pfn, nr, bitmap) \
+    ({ ASSERT_UNREACHABLE(); -EOPNOTSUPP; })
 #define shadow_set_allocation(d, pages, preempted) \
     ({ ASSERT_UNREACHABLE(); -EOPNOTSUPP; })
 
@@ -0,0 +1,40 @@
+#ifndef __X86_STATIC_KEY_H__
+#define __X86_STATIC_KEY_H__
+
+#include <xen/stringify.h>
+#include <xen/types.h>
+#include <asm/nops.h>
+
+/* Length of the NOP / JMP rel32 at each site. */
+#define STATIC_KEY_INSN_LEN 5
+
+struct static_key_entry {
+    s32 code_offset;        /* site */
+    s32 target_offset;      /* where to jump to while enabled */
+    s32 key_offset;         /* struct static_key */
+};
+
+#define __SK_PTR(e, f)      ((void *)&(e)->f + (e)->f)
+#define SK_CODE_PTR(e)      ((u8 *)__SK_PTR(e, code_offset))
+#define SK_TARGET_PTR(e)    ((const u8 *)__SK_PTR(e, target_offset))
+#define SK_KEY_PTR(e)       ((const struct static_key *)__SK_PTR(e, key_offset))
+
+static always_inline bool arch_static_key_false(const struct static_key *key)
+{
+    /* A 5-byte NOP, becoming a JMP rel32 to the label while enabled. */
+    asm goto ( "1: .byte " __stringify(P6_NOP5) "\n\t"
+               ".pushsection .static_keys, \"a\", @progbits\n\t"
+               ".p2align 2\n\t"
+               ".long 1b - ., %l[enabled] - ., %c0 - .\n\t"
+               ".popsection"
+               :: "i" (key) :: enabled );
+
+    return false;
+
+ enabled:
+    return true;
+}
+
+int arch_static_key_update(const struct static_key *key);
+
+#endif /* __X86_STATIC_KEY_H__ */
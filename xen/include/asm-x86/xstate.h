@@ -63,6 +63,7 @@ extern uint32_t mxcsr_mask;
 #define XSTATE_ALIGN64 (1U << 1)
 
 extern u64 xfeature_mask;
+extern bool use_xsaves;
 extern u64 xstate_align;
 extern unsigned int *xstate_offsets;
 extern unsigned int *xstate_sizes;
@@ -125,19 +126,20 @@ void compress_xsave_states(struct vcpu *v, const void *src, unsigned int size);
 /* extended state init and cleanup functions */
 void xstate_free_save_area(struct vcpu *v);
 int xstate_alloc_save_area(struct vcpu *v);
+int __must_check xstate_update_save_area(struct vcpu *v, uint64_t xcr0_accum);
 void xstate_init(struct cpuinfo_x86 *c);
 unsigned int xstate_ctxt_size(u64 xcr0);
 
 static inline bool xstate_all(const struct vcpu *v)
 {
     /*
-     * XSTATE_FP_SSE may be excluded, because the offsets of XSTATE_FP_SSE
-     * (in the legacy region of xsave area) are fixed, so saving
-     * XSTATE_FP_SSE will not cause overwriting problem with XSAVES/XSAVEC.
+     * XSAVES lays out components according to the requested feature mask,
+     * and writes XSTATE_BV as that mask ANDed with XINUSE.  Saving just the
+     * non-lazy components would hence discard the lazy ones (FP/SSE
+     * included), so vCPUs with non-lazy state have all of it saved and
+     * restored together.
      */
-    return (v->arch.xsave_area->xsave_hdr.xcomp_bv &
-            XSTATE_COMPACTION_ENABLED) &&
-           (v->arch.xcr0_accum & XSTATE_LAZY & ~XSTATE_FP_SSE);
+    return use_xsaves && v->arch.nonlazy_xstate_used;
 }
 
 static inline bool __nonnull(1)
@@ -38,7 +38,7 @@
 #include "hvm/save.h"
 #include "memory.h"
 
-#define XEN_DOMCTL_INTERFACE_VERSION 0x00000010
+#define XEN_DOMCTL_INTERFACE_VERSION 0x00000011
 
 /*
  * NB. xen_domctl.domain is an IN/OUT parameter for this operation.
@@ -162,11 +162,49 @@ struct xen_domctl_getpageframeinfo3 {
 #define XEN_DOMCTL_SHADOW_OP_CLEAN       11
  /* Return the bitmap but do not modify internal copy. */
 #define XEN_DOMCTL_SHADOW_OP_PEEK        12
+ /*
+  * Set up a ring of GFNs newly marked dirty, so that they can be consumed
+  * incrementally rather than by fetching the whole bitmap.  @pages is the
+  * number of ring entries (a power of two; 0 tears the ring down).  HAP
+  * guests in log-dirty mode only.
+  */
+#define XEN_DOMCTL_SHADOW_OP_DIRTY_RING_SETUP 13
+ /*
+  * Copy up to @pages GFNs off the ring into @dirty_gfns, clearing them in
+  * the bitmap and re-arming logging for them.  Returns -EOVERFLOW if entries
+  * had to be dropped since the last CLEAN, in which case the caller has to
+  * fall back to a CLEAN (which also resets the ring).  On return @pages
+  * holds the number of GFNs copied and @stats.dirty_count the number of
+  * entries left on the ring.
+  */
+#define XEN_DOMCTL_SHADOW_OP_DIRTY_RING_DRAIN 14
+ /*
+  * Report the dirty GFNs in [@first_gfn, @first_gfn + @nr_gfns) as a list of
+  * non-empty xen_domctl_shadow_dirty_chunk entries, written to
+  * @dirty_chunks (@pages entries large).  CLEAN_RANGE also clears what got
+  * reported.  @first_gfn must be a multiple of 64.  Instead of using a
+  * continuation, these return once the buffer is full (or Xen needs to
+  * preempt), with @pages holding the number of chunks written and
+  * @first_gfn updated to where the caller should carry on; the range is done
+  * once @first_gfn has reached its end.  Callers may work on disjoint ranges
+  * of the same domain concurrently.  Pages still cached in hardware logs
+  * (e.g. PML) only show up once a CLEAN or PEEK flushes them.
+  */
+#define XEN_DOMCTL_SHADOW_OP_PEEK_RANGE  15
+#define XEN_DOMCTL_SHADOW_OP_CLEAN_RANGE 16
 
 /* Memory allocation accessors. */
 #define XEN_DOMCTL_SHADOW_OP_GET_ALLOCATION   30
 #define XEN_DOMCTL_SHADOW_OP_SET_ALLOCATION   31
 
+/*
+ * Out-of-sync pagetable slots per vcpu: more of them help guests which
+ * write to many pagetables at once, at the cost of a snapshot page each
+ * from the shadow pool.  Setting resyncs every page then out of sync.
+ */
+#define XEN_DOMCTL_SHADOW_OP_GET_OOS_PAGES    33
+#define XEN_DOMCTL_SHADOW_OP_SET_OOS_PAGES    34
+
 /* Legacy enable operations. */
  /* Equiv. to ENABLE with no mode flags. */
 #define XEN_DOMCTL_SHADOW_OP_ENABLE_TEST       1
@@ -211,6 +249,13 @@ struct xen_domctl_shadow_op_stats {
     uint32_t dirty_count;
 };
 
+struct xen_domctl_shadow_dirty_chunk {
+    uint64_aligned_t gfn;   /* First GFN covered, a multiple of 64. */
+    uint64_aligned_t mask;  /* Bit n set: (gfn + n) is dirty. */
+};
+typedef struct xen_domctl_shadow_dirty_chunk xen_domctl_shadow_dirty_chunk_t;
+DEFINE_XEN_GUEST_HANDLE(xen_domctl_shadow_dirty_chunk_t);
+
 struct xen_domctl_shadow_op {
     /* IN variables. */
     uint32_t       op;       /* XEN_DOMCTL_SHADOW_OP_* */
@@ -222,10 +267,21 @@ struct xen_domctl_shadow_op {
     /* OP_GET_ALLOCATION / OP_SET_ALLOCATION */
     uint32_t       mb;       /* Shadow memory allocation in MB */
 
+    /* OP_GET_OOS_PAGES / OP_SET_OOS_PAGES */
+    uint32_t       oos_pages;
+
     /* OP_PEEK / OP_CLEAN */
     XEN_GUEST_HANDLE_64(uint8) dirty_bitmap;
     uint64_aligned_t pages; /* Size of buffer. Updated with actual size. */
     struct xen_domctl_shadow_op_stats stats;
+
+    /* OP_DIRTY_RING_DRAIN */
+    XEN_GUEST_HANDLE_64(uint64) dirty_gfns;
+
+    /* OP_PEEK_RANGE / OP_CLEAN_RANGE */
+    uint64_aligned_t first_gfn;     /* Updated with where to resume. */
+    uint64_aligned_t nr_gfns;
+    XEN_GUEST_HANDLE_64(xen_domctl_shadow_dirty_chunk_t) dirty_chunks;
 };
 
 
@@ -301,6 +357,31 @@ struct xen_domctl_vcpuaffinity {
     struct xenctl_bitmap cpumap_soft;
 };
 
+/*
+ * XEN_DOMCTL_setvcpuaffinitylist
+ *
+ * XEN_DOMCTL_setvcpuaffinity for vcpus vcpu to vcpu + nr_vcpus - 1 at once.
+ * cpumap_hard and cpumap_soft point to nr_vcpus maps of nr_cpumap_bytes
+ * each, which are IN/OUT as for XEN_DOMCTL_setvcpuaffinity.  With
+ * XEN_VCPUAFFINITYLIST_SAME, they point to a single map each, which is
+ * IN only and applies to all the vcpus.
+ *
+ * The operation may be preempted and continued.  On failure, vcpu and
+ * nr_vcpus are left describing the vcpus not dealt with, the first one
+ * being the one which failed.
+ */
+struct xen_domctl_vcpuaffinitylist {
+    uint32_t vcpu;                         /* IN/OUT */
+    uint32_t nr_vcpus;                     /* IN/OUT */
+ /* Flags are the XEN_VCPUAFFINITY_* ones, plus: */
+#define _XEN_VCPUAFFINITYLIST_SAME 31
+#define XEN_VCPUAFFINITYLIST_SAME  (1U<<_XEN_VCPUAFFINITYLIST_SAME)
+    uint32_t flags;                        /* IN */
+    uint32_t nr_cpumap_bytes;              /* IN: size of each map */
+    XEN_GUEST_HANDLE_64(uint8) cpumap_hard;
+    XEN_GUEST_HANDLE_64(uint8) cpumap_soft;
+};
+
 
 /* XEN_DOMCTL_max_vcpus */
 struct xen_domctl_max_vcpus {
@@ -748,6 +829,7 @@ struct xen_domctl_gdbsx_domstatus {
 #define XEN_VM_EVENT_ENABLE               0
 #define XEN_VM_EVENT_DISABLE              1
 #define XEN_VM_EVENT_RESUME               2
+#define XEN_VM_EVENT_ADD_RING             3
 
 /*
  * Domain memory paging
@@ -786,6 +868,14 @@ struct xen_domctl_gdbsx_domstatus {
  * ENODEV - host lacks HAP support (EPT/NPT) or HAP is disabled in guest
  * EBUSY  - guest has or had access enabled, ring buffer still active
  *
+ * With the monitor ring enabled, XEN_VM_EVENT_ADD_RING moves the vCPUs
+ * [first_vcpu, first_vcpu + nr_vcpus) over to a ring of their own (at
+ * ring_gfn, set up like the HVM_PARAM_MONITOR_RING_PFN one) with a separate
+ * event channel, so that the requests of different vCPU groups don't
+ * contend for a single ring.  Responses have to be put on the ring the
+ * request came from.  Each vCPU can be in at most one such group, and the
+ * groups' rings get torn down along with the main ring.  XEN_VM_EVENT_RESUME
+ * pulls responses off all of the domain's monitor rings.
  */
 #define XEN_DOMCTL_VM_EVENT_OP_MONITOR           2
 
@@ -811,6 +901,12 @@ struct xen_domctl_vm_event_op {
     uint32_t       mode;         /* XEN_DOMCTL_VM_EVENT_OP_* */
 
     uint32_t port;              /* OUT: event channel for ring */
+
+    /* IN: XEN_VM_EVENT_ADD_RING only */
+    uint32_t first_vcpu;
+    uint32_t nr_vcpus;
+    uint32_t pad;
+    uint64_aligned_t ring_gfn;
 };
 
 /*
@@ -1072,6 +1168,91 @@ struct xen_domctl_set_gnttab_limits {
     uint32_t maptrack_frames;  /* IN */
 };
 
+/*
+ * XEN_DOMCTL_set_spec_ctrl / XEN_DOMCTL_get_spec_ctrl (x86 only)
+ *
+ * Speculative mitigation profile of a domain.
+ */
+struct xen_domctl_spec_ctrl {
+    /*
+     * vCPUs of domains sharing a (non-zero) trust group don't get isolated
+     * from one another (by IBPB) when switching between them.  Zero puts
+     * the domain in the trust group of its cpupool, if any, or otherwise
+     * isolates each of its vCPUs.  Values must be below 2^31.
+     */
+    uint32_t trust_group;
+/* PV only: run without Xen page table isolation (XPTI). */
+#define _XEN_DOMCTL_SPEC_CTRL_no_xpti 0
+#define XEN_DOMCTL_SPEC_CTRL_no_xpti  (1U << _XEN_DOMCTL_SPEC_CTRL_no_xpti)
+    uint32_t flags;
+};
+
+/*
+ * XEN_DOMCTL_hvm_exit_stats (x86 HVM only)
+ *
+ * Per exit reason counts and histograms of the time spent handling VM
+ * exits, from the exit to the following VM entry (or until the vCPU is
+ * descheduled), in TSC cycles.  Query sums them over the domain's vCPUs.
+ */
+#define XEN_DOMCTL_EXIT_STATS_query    0
+#define XEN_DOMCTL_EXIT_STATS_enable   1
+#define XEN_DOMCTL_EXIT_STATS_disable  2 /* keeps what was recorded */
+#define XEN_DOMCTL_EXIT_STATS_reset    3
+/*
+ * Bucket 0 counts exits handled in less than 256 cycles, bucket i > 0
+ * those in [2^(i+7), 2^(i+8)) cycles, and the last bucket also longer ones.
+ */
+#define XEN_DOMCTL_EXIT_STATS_BUCKETS  20
+/* Exits with reasons not accounted individually. */
+#define XEN_DOMCTL_EXIT_STATS_OTHER    (~0U)
+struct xen_domctl_exit_stat {
+    uint32_t reason;           /* VMX basic exit reason, or SVM exit code */
+    uint32_t pad;
+    uint64_aligned_t count;
+    uint64_aligned_t cycles;   /* total */
+    uint32_t hist[XEN_DOMCTL_EXIT_STATS_BUCKETS];
+};
+typedef struct xen_domctl_exit_stat xen_domctl_exit_stat_t;
+DEFINE_XEN_GUEST_HANDLE(xen_domctl_exit_stat_t);
+struct xen_domctl_hvm_exit_stats {
+    uint32_t cmd;              /* IN: XEN_DOMCTL_EXIT_STATS_* */
+    /* IN: size of the buffer; OUT (query): # of reasons with exits */
+    uint32_t nr_reasons;
+#define XEN_DOMCTL_EXIT_STATS_VMX      1
+#define XEN_DOMCTL_EXIT_STATS_SVM      2
+    uint32_t vendor;           /* OUT (query) */
+    uint32_t tsc_khz;          /* OUT (query) */
+    uint32_t enabled;          /* OUT (query) */
+    uint32_t pad;
+    XEN_GUEST_HANDLE_64(xen_domctl_exit_stat_t) stats;
+};
+
+/*
+ * XEN_DOMCTL_gethvmcontext_vcpus (x86 HVM only)
+ * XEN_DOMCTL_sethvmcontext_vcpus
+ *
+ * The HVM context of XEN_DOMCTL_gethvmcontext, in pieces: with
+ * XEN_DOMCTL_HVMCONTEXT_DOMAIN, the save header, the per-domain records
+ * and the end marker; otherwise, the per-vCPU records of vCPUs
+ * [first_vcpu, first_vcpu + nr_vcpus), each of them being paused only
+ * while its own state is gathered.  The domain piece must be got first,
+ * as it fixes the TSC the vCPUs' records are relative to.
+ *
+ * A NULL buffer queries the size needed.  The same concatenation is
+ * accepted by XEN_DOMCTL_sethvmcontext and, to load it in pieces, the domain
+ * piece can go to XEN_DOMCTL_sethvmcontext, which takes all vCPUs down, and
+ * the others to XEN_DOMCTL_sethvmcontext_vcpus, which loads only per-vCPU
+ * records of the range given.
+ */
+struct xen_domctl_hvmcontext_vcpus {
+    uint32_t first_vcpu;   /* IN */
+    uint32_t nr_vcpus;     /* IN */
+#define XEN_DOMCTL_HVMCONTEXT_DOMAIN (1U << 0)
+    uint32_t flags;        /* IN: XEN_DOMCTL_HVMCONTEXT_*, get only */
+    uint32_t size;         /* IN/OUT: size of buffer / bytes filled */
+    XEN_GUEST_HANDLE_64(uint8) buffer;
+};
+
 /* XEN_DOMCTL_vuart_op */
 struct xen_domctl_vuart_op {
 #define XEN_DOMCTL_VUART_OP_INIT  0
@@ -1172,6 +1353,12 @@ struct xen_domctl {
 #define XEN_DOMCTL_soft_reset                    79
 #define XEN_DOMCTL_set_gnttab_limits             80
 #define XEN_DOMCTL_vuart_op                      81
+#define XEN_DOMCTL_set_spec_ctrl                 82
+#define XEN_DOMCTL_get_spec_ctrl                 83
+#define XEN_DOMCTL_setvcpuaffinitylist           84
+#define XEN_DOMCTL_hvm_exit_stats                85
+#define XEN_DOMCTL_gethvmcontext_vcpus           86
+#define XEN_DOMCTL_sethvmcontext_vcpus           87
 #define XEN_DOMCTL_gdbsx_guestmemio            1000
 #define XEN_DOMCTL_gdbsx_pausevcpu             1001
 #define XEN_DOMCTL_gdbsx_unpausevcpu           1002
@@ -1184,6 +1371,7 @@ struct xen_domctl {
         struct xen_domctl_getpageframeinfo3 getpageframeinfo3;
         struct xen_domctl_nodeaffinity      nodeaffinity;
         struct xen_domctl_vcpuaffinity      vcpuaffinity;
+        struct xen_domctl_vcpuaffinitylist  vcpuaffinitylist;
         struct xen_domctl_shadow_op         shadow_op;
         struct xen_domctl_max_mem           max_mem;
         struct xen_domctl_vcpucontext       vcpucontext;
@@ -1234,6 +1422,9 @@ struct xen_domctl {
         struct xen_domctl_psr_alloc         psr_alloc;
         struct xen_domctl_set_gnttab_limits set_gnttab_limits;
         struct xen_domctl_vuart_op          vuart_op;
+        struct xen_domctl_spec_ctrl         spec_ctrl;
+        struct xen_domctl_hvm_exit_stats    hvm_exit_stats;
+        struct xen_domctl_hvmcontext_vcpus  hvmcontext_vcpus;
         uint8_t                             pad[128];
     } u;
 };
@@ -74,6 +74,8 @@
 #define EVTCHNOP_init_control    11
 #define EVTCHNOP_expand_array    12
 #define EVTCHNOP_set_priority    13
+#define EVTCHNOP_set_moderation  14
+#define EVTCHNOP_set_steerable   15
 /* ` } */
 
 typedef uint32_t evtchn_port_t;
@@ -312,6 +314,43 @@ struct evtchn_set_priority {
 };
 typedef struct evtchn_set_priority evtchn_set_priority_t;
 
+/*
+ * EVTCHNOP_set_moderation: coalesce the notifications (upcalls) raised by
+ * events on a local event channel.
+ *
+ * With only <interval_ns> set, a notification is raised at most once every
+ * <interval_ns>; events arriving in between are delivered when it elapses.
+ * With <count> set as well, a notification is raised as soon as <count>
+ * events have accumulated, or <interval_ns> after the first of them,
+ * whichever comes first.  <interval_ns> is limited to 10ms.
+ *
+ * Setting both to zero turns moderation off, delivering any events held
+ * back.  Events are always marked pending straight away; unmasking a port
+ * and polling it are unaffected.
+ */
+struct evtchn_set_moderation {
+    /* IN parameters. */
+    uint32_t port;
+    uint32_t count;
+    uint64_t interval_ns;
+};
+typedef struct evtchn_set_moderation evtchn_set_moderation_t;
+
+/*
+ * EVTCHNOP_set_steerable: allow (<steerable> != 0) or disallow Xen to move
+ * the notification of a local interdomain event channel to another vCPU of
+ * the domain, to spread notification load.  A guest setting this must be
+ * prepared to receive the event on any of its vCPUs; the current binding
+ * is reported by EVTCHNOP_status.  Fails with -EOPNOTSUPP if steering is
+ * not enabled in the hypervisor.
+ */
+struct evtchn_set_steerable {
+    /* IN parameters. */
+    uint32_t port;
+    uint32_t steerable;
+};
+typedef struct evtchn_set_steerable evtchn_set_steerable_t;
+
 /*
  * ` enum neg_errnoval
  * ` HYPERVISOR_event_channel_op_compat(struct evtchn_op *op)
@@ -64,13 +64,29 @@ typedef uint16_t ioservid_t;
  * hvm_op.h. If the value is HVM_IOREQSRV_BUFIOREQ_OFF then  the buffered
  * ioreq ring will not be allocated and hence all emulation requests to
  * this server will be synchronous.
+ *
+ * If XEN_DMOP_IOREQ_SERVER_POLL is set in <flags>, the emulator polls the
+ * synchronous ioreq structures for new requests.  Xen then only notifies
+ * the per-vCPU event channel if a request hasn't been picked up (i.e.
+ * moved past STATE_IOREQ_READY) within a short window, which the issuing
+ * vCPU spends spinning.  Completion is to be signalled as usual.
+ *
+ * If XEN_DMOP_IOREQ_SERVER_BUFIOREQ_COALESCE is set in <flags>, Xen only
+ * notifies the buffered ioreq event channel when posting to a ring found
+ * empty (read_pointer equal to the previous write_pointer).  The emulator
+ * then has to re-check write_pointer after updating read_pointer, with a
+ * full memory barrier in between, before going to sleep.
  */
 #define XEN_DMOP_create_ioreq_server 1
 
 struct xen_dm_op_create_ioreq_server {
     /* IN - should server handle buffered ioreqs */
     uint8_t handle_bufioreq;
-    uint8_t pad[3];
+    /* IN - XEN_DMOP_IOREQ_SERVER_* */
+    uint8_t flags;
+#define XEN_DMOP_IOREQ_SERVER_POLL             (1u << 0)
+#define XEN_DMOP_IOREQ_SERVER_BUFIOREQ_COALESCE (1u << 1)
+    uint8_t pad[2];
     /* OUT - server id */
     ioservid_t id;
 };
@@ -122,6 +138,14 @@ struct xen_dm_op_get_ioreq_server_info {
  *
  * NOTE: unless an emulation request falls entirely within a range mapped
  * by a secondary emulator, it will not be passed to that emulator.
+ *
+ * Port and memory ranges may be mapped with XEN_DMOP_IO_RANGE_BUFFERED
+ * set in <flags>, if the server has a buffered ioreq ring.  Single writes
+ * falling entirely within such a range are then posted to that ring (as
+ * long as they fit its format, and there is space), rather than being
+ * issued synchronously.  Emulators must drain the buffered ring before
+ * handling any synchronous request, to keep accesses ordered.  <flags>
+ * is ignored when unmapping; buffered eligibility goes with the range.
  */
 #define XEN_DMOP_map_io_range_to_ioreq_server 3
 #define XEN_DMOP_unmap_io_range_from_ioreq_server 4
@@ -129,7 +153,9 @@ struct xen_dm_op_get_ioreq_server_info {
 struct xen_dm_op_ioreq_server_range {
     /* IN - server id */
     ioservid_t id;
-    uint16_t pad;
+    /* IN - XEN_DMOP_IO_RANGE_* flags */
+    uint16_t flags;
+#define XEN_DMOP_IO_RANGE_BUFFERED (1u << 0)
     /* IN - type of range */
     uint32_t type;
 # define XEN_DMOP_IO_RANGE_PORT   0 /* I/O port range */
@@ -407,6 +433,49 @@ struct xen_dm_op_pin_memory_cacheattr {
     uint32_t pad;
 };
 
+/*
+ * XEN_DMOP_track_dirty_vram_ranges: As XEN_DMOP_track_dirty_vram, but
+ *                                   reporting the pages modified as a
+ *                                   list of ranges.
+ *
+ * DMOP buf 1 is an array of up to <nr_ranges> xen_dm_op_dirty_vram_range,
+ * filled in ascending order. Should there be more, the last range is
+ * extended over all the others and XEN_DMOP_DIRTY_VRAM_MERGED is set:
+ * the pages reported always include all the modified ones.
+ *
+ * <generation> identifies the state the caller last saw: it is bumped
+ * whenever a call consumes modifications, or tracking is (re)started.
+ * Callers pass back the value they were last given. Should it no longer
+ * be current, because tracking moved or another caller consumed changes,
+ * the whole range is reported with XEN_DMOP_DIRTY_VRAM_ALL. An unchanged
+ * range returns no ranges and the same generation, and, with HAP, costs
+ * no p2m walk and no pause of the domain's idle vcpus.
+ *
+ * A <nr> of 0 stops tracking, as for XEN_DMOP_track_dirty_vram.
+ */
+#define XEN_DMOP_track_dirty_vram_ranges 19
+
+struct xen_dm_op_track_dirty_vram_ranges {
+    /* IN - number of pages to be tracked */
+    uint32_t nr;
+    /* IN - size of buf 1, in ranges; OUT - ranges filled in */
+    uint32_t nr_ranges;
+    /* IN - first pfn to track */
+    uint64_aligned_t first_pfn;
+    /* IN - generation last returned; OUT - the current one */
+    uint64_aligned_t generation;
+    /* OUT - XEN_DMOP_DIRTY_VRAM_* */
+    uint32_t flags;
+#define XEN_DMOP_DIRTY_VRAM_ALL    (1u << 0)
+#define XEN_DMOP_DIRTY_VRAM_MERGED (1u << 1)
+    uint32_t pad;
+};
+
+struct xen_dm_op_dirty_vram_range {
+    uint64_aligned_t first_pfn;
+    uint64_aligned_t nr;
+};
+
 struct xen_dm_op {
     uint32_t op;
     uint32_t pad;
@@ -430,6 +499,7 @@ struct xen_dm_op {
         struct xen_dm_op_remote_shutdown remote_shutdown;
         struct xen_dm_op_relocate_memory relocate_memory;
         struct xen_dm_op_pin_memory_cacheattr pin_memory_cacheattr;
+        struct xen_dm_op_track_dirty_vram_ranges track_dirty_vram_ranges;
     } u;
 };
 
@@ -139,6 +139,22 @@
 #define _HVMPV_crash_ctl 6
 #define HVMPV_crash_ctl (1 << _HVMPV_crash_ctl)
 
+/* Use hypercall for (cluster) IPIs */
+#define _HVMPV_hcall_ipi 7
+#define HVMPV_hcall_ipi (1 << _HVMPV_hcall_ipi)
+
+/* Enable the sparse VP set ("Ex") variants of the above hypercalls */
+#define _HVMPV_ex_processor_masks 8
+#define HVMPV_ex_processor_masks (1 << _HVMPV_ex_processor_masks)
+
+/* Enable synthetic interrupt controller */
+#define _HVMPV_synic 9
+#define HVMPV_synic (1 << _HVMPV_synic)
+
+/* Enable synthetic timers (requires synic and time_ref_count) */
+#define _HVMPV_stimer 10
+#define HVMPV_stimer (1 << _HVMPV_stimer)
+
 #define HVMPV_feature_mask \
         (HVMPV_base_freq | \
          HVMPV_no_freq | \
@@ -146,7 +162,11 @@
          HVMPV_reference_tsc | \
          HVMPV_hcall_remote_tlb_flush | \
          HVMPV_apic_assist | \
-         HVMPV_crash_ctl)
+         HVMPV_crash_ctl | \
+         HVMPV_hcall_ipi | \
+         HVMPV_ex_processor_masks | \
+         HVMPV_synic | \
+         HVMPV_stimer)
 
 #endif
 
@@ -244,6 +244,56 @@ typedef struct __name##_back_ring __name##_back_ring_t
 #define RING_GET_RESPONSE(_r, _idx)                                     \
     (&((_r)->sring->ring[((_idx) & (RING_SIZE(_r) - 1))].rsp))
 
+/*
+ * Bulk transfer, for consumers and producers which handle messages in
+ * batches rather than one at a time.
+ *
+ * RING_COPY_REQUESTS() and RING_COPY_RESPONSES() copy up to _max
+ * unconsumed messages into the array _dst, advance the consumer index
+ * past them and set _nr to the number copied. As with
+ * RING_HAS_UNCONSUMED_REQUESTS(), a back end never takes more requests
+ * than it has response slots for, whatever req_prod claims.
+ *
+ * RING_PUT_REQUESTS() and RING_PUT_RESPONSES() queue _nr messages from
+ * the array _src at the private producer index. Make them visible to
+ * the other end with a single RING_PUSH_{REQUESTS,RESPONSES}[_AND_CHECK
+ * _NOTIFY]() once the batch is complete. Front ends must check
+ * RING_FREE_REQUESTS() first.
+ */
+#define RING_COPY_REQUESTS(_r, _dst, _max, _nr) do {                    \
+    RING_IDX __i, __n = RING_HAS_UNCONSUMED_REQUESTS(_r);               \
+    if (__n > (RING_IDX)(_max))                                         \
+        __n = (_max);                                                   \
+    xen_rmb(); /* see requests /after/ reading the producer index */    \
+    for (__i = 0; __i < __n; __i++)                                     \
+        RING_COPY_REQUEST(_r, (_r)->req_cons + __i, &(_dst)[__i]);      \
+    (_r)->req_cons += __n;                                              \
+    (_nr) = __n;                                                        \
+} while (0)
+
+#define RING_COPY_RESPONSES(_r, _dst, _max, _nr) do {                   \
+    RING_IDX __i, __n = RING_HAS_UNCONSUMED_RESPONSES(_r);              \
+    if (__n > (RING_IDX)(_max))                                         \
+        __n = (_max);                                                   \
+    xen_rmb(); /* see responses /after/ reading the producer index */   \
+    for (__i = 0; __i < __n; __i++)                                     \
+        (_dst)[__i] = *RING_GET_RESPONSE(_r, (_r)->rsp_cons + __i);     \
+    (_r)->rsp_cons += __n;                                              \
+    (_nr) = __n;                                                        \
+} while (0)
+
+#define RING_PUT_REQUESTS(_r, _src, _nr) do {                           \
+    RING_IDX __i;                                                       \
+    for (__i = 0; __i < (RING_IDX)(_nr); __i++)                         \
+        *RING_GET_REQUEST(_r, (_r)->req_prod_pvt++) = (_src)[__i];      \
+} while (0)
+
+#define RING_PUT_RESPONSES(_r, _src, _nr) do {                          \
+    RING_IDX __i;                                                       \
+    for (__i = 0; __i < (RING_IDX)(_nr); __i++)                         \
+        *RING_GET_RESPONSE(_r, (_r)->rsp_prod_pvt++) = (_src)[__i];     \
+} while (0)
+
 /* Loop termination condition: Would the specified index overflow the ring? */
 #define RING_REQUEST_CONS_OVERFLOW(_r, _cons)                           \
     (((_cons) - (_r)->rsp_prod_pvt) >= RING_SIZE(_r))
@@ -287,9 +337,16 @@ typedef struct __name##_back_ring __name##_back_ring_t
  *  These macros will set the req_event/rsp_event field to trigger a
  *  notification on the very next message that is enqueued. If you want to
  *  create batches of work (i.e., only receive a notification after several
- *  messages have been enqueued) then you will need to create a customised
- *  version of the FINAL_CHECK macro in your own code, which sets the event
- *  field appropriately.
+ *  messages have been enqueued) then use the _BATCH variants, which ask for
+ *  a notification only once _batch further messages are on the ring.
+ *
+ *  A receiver holding off notifications must not sleep indefinitely, since
+ *  fewer than _batch messages raise no event: it has to look at the ring
+ *  again on a timer of its own. RING_ADAPT_BATCH() picks the hold-off from
+ *  what the receiver finds each time it looks. A full batch means messages
+ *  are arriving faster than they are being signalled, and the hold-off
+ *  doubles, up to _max. Anything less halves it, so an idle or
+ *  latency-bound ring quickly drops back to a notification per message.
  */
 
 #define RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(_r, _notify) do {           \
@@ -312,22 +369,35 @@ typedef struct __name##_back_ring __name##_back_ring_t
                  (RING_IDX)(__new - __old));                            \
 } while (0)
 
-#define RING_FINAL_CHECK_FOR_REQUESTS(_r, _work_to_do) do {             \
+#define RING_FINAL_CHECK_FOR_REQUESTS_BATCH(_r, _batch, _work_to_do) do { \
     (_work_to_do) = RING_HAS_UNCONSUMED_REQUESTS(_r);                   \
     if (_work_to_do) break;                                             \
-    (_r)->sring->req_event = (_r)->req_cons + 1;                        \
+    (_r)->sring->req_event = (_r)->req_cons + (_batch);                 \
     xen_mb();                                                           \
     (_work_to_do) = RING_HAS_UNCONSUMED_REQUESTS(_r);                   \
 } while (0)
 
-#define RING_FINAL_CHECK_FOR_RESPONSES(_r, _work_to_do) do {            \
+#define RING_FINAL_CHECK_FOR_RESPONSES_BATCH(_r, _batch, _work_to_do) do { \
     (_work_to_do) = RING_HAS_UNCONSUMED_RESPONSES(_r);                  \
     if (_work_to_do) break;                                             \
-    (_r)->sring->rsp_event = (_r)->rsp_cons + 1;                        \
+    (_r)->sring->rsp_event = (_r)->rsp_cons + (_batch);                 \
     xen_mb();                                                           \
     (_work_to_do) = RING_HAS_UNCONSUMED_RESPONSES(_r);                  \
 } while (0)
 
+#define RING_FINAL_CHECK_FOR_REQUESTS(_r, _work_to_do)                  \
+    RING_FINAL_CHECK_FOR_REQUESTS_BATCH(_r, 1, _work_to_do)
+
+#define RING_FINAL_CHECK_FOR_RESPONSES(_r, _work_to_do)                 \
+    RING_FINAL_CHECK_FOR_RESPONSES_BATCH(_r, 1, _work_to_do)
+
+#define RING_ADAPT_BATCH(_batch, _found, _max) do {                     \
+    if ((_found) >= (_batch))                                           \
+        (_batch) = ((_batch) * 2 > (_max)) ? (_max) : (_batch) * 2;     \
+    else if ((_batch) > 1)                                              \
+        (_batch) /= 2;                                                  \
+} while (0)
+
 
 /*
  * DEFINE_XEN_FLEX_RING_AND_INTF defines two monodirectional rings and
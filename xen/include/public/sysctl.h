@@ -36,7 +36,7 @@
 #include "physdev.h"
 #include "tmem.h"
 
-#define XEN_SYSCTL_INTERFACE_VERSION 0x00000010
+#define XEN_SYSCTL_INTERFACE_VERSION 0x00000011
 
 /*
  * Read console content from Xen buffer ring.
@@ -103,6 +103,10 @@ struct xen_sysctl_physinfo {
     uint64_aligned_t outstanding_pages;
     uint64_aligned_t max_mfn; /* Largest possible MFN on this host */
     uint32_t hw_cap[8];
+    /* Pages kept in the 1G superpage pool (see "superpage_pool="), ... */
+    uint64_aligned_t superpage_pool_pages;
+    /* ... and how many it is meant to keep. */
+    uint64_aligned_t superpage_pool_target_pages;
 };
 
 /*
@@ -119,6 +123,7 @@ struct xen_sysctl_sched_id {
 /* Sub-operations: */
 #define XEN_SYSCTL_PERFCOP_reset 1   /* Reset all counters to zero. */
 #define XEN_SYSCTL_PERFCOP_query 2   /* Get perfctr information. */
+#define XEN_SYSCTL_PERFCOP_shared 3  /* Locate shared counter pages. */
 struct xen_sysctl_perfc_desc {
     char         name[80];             /* name of perf counter */
     uint32_t     nr_vals;              /* number of values for this counter */
@@ -138,16 +143,102 @@ struct xen_sysctl_perfc_op {
     XEN_GUEST_HANDLE_64(xen_sysctl_perfc_desc_t) desc;
     /* counter values (or NULL) */
     XEN_GUEST_HANDLE_64(xen_sysctl_perfc_val_t) val;
+    /* XEN_SYSCTL_PERFCOP_shared: where struct xen_sysctl_perfc_shared is. */
+    uint64_aligned_t info_mfn;        /*  first frame of the layout info */
+    uint32_t       info_frames;       /*  number of (contiguous) frames  */
+    uint32_t       pad;
 };
 
+/*
+ * When Xen was booted with "perfc_shared", each CPU's counters live in
+ * frames which privileged domains can map read-only (as DOMID_XEN pages),
+ * allowing them to be sampled without issuing any hypercall.  The layout
+ * info found through XEN_SYSCTL_PERFCOP_shared starts with this header,
+ * followed by
+ *   uint32_t nr_slots[nr_counters];  - slots taken by each counter, in the
+ *                                      order XEN_SYSCTL_PERFCOP_query
+ *                                      reports the descriptors in
+ * and, at byte offset mfn_offset,
+ *   uint64_t mfn[nr_cpus];           - first frame of each CPU's counters.
+ * Each CPU's counters are an array of xen_sysctl_perfc_val_t, spread over
+ * cpu_frames contiguous frames.  Values of offline CPUs are retained.
+ */
+struct xen_sysctl_perfc_shared {
+    uint32_t nr_counters;
+    uint32_t nr_cpus;
+    uint32_t cpu_frames;
+    uint32_t mfn_offset;
+};
+typedef struct xen_sysctl_perfc_shared xen_sysctl_perfc_shared_t;
+
 /* XEN_SYSCTL_getdomaininfolist */
 struct xen_sysctl_getdomaininfolist {
     /* IN variables. */
     domid_t               first_domain;
     uint32_t              max_domains;
     XEN_GUEST_HANDLE_64(xen_domctl_getdomaininfo_t) buffer;
+    /*
+     * Only report domains whose information changed after @since, a
+     * @generation returned earlier.  Zero reports all domains.
+     */
+    uint64_aligned_t      since;
     /* OUT variables. */
     uint32_t              num_domains;
+    /*
+     * Where to continue the enumeration (passed as @first_domain), or
+     * DOMID_INVALID if all domains have been looked at.
+     */
+    domid_t               next_domain;
+    /*
+     * Generation as of the start of the call.  Passing the one returned by
+     * the first call of an enumeration as @since to the calls of the next
+     * enumeration reports all changes in between (and possibly some more).
+     */
+    uint64_aligned_t      generation;
+};
+
+/*
+ * XEN_SYSCTL_getvcpuinfolist
+ *
+ * Get the state of the vCPUs of many domains at once: the state
+ * XEN_DOMCTL_getvcpuinfo returns and, optionally, the affinities returned
+ * by XEN_DOMCTL_getvcpuaffinity.  vCPUs are reported in the order of the
+ * domains of XEN_SYSCTL_getdomaininfolist, from vCPU @vcpu of the first
+ * domain from @domain on.  Domains the caller may not get the information
+ * of are skipped.
+ */
+struct xen_sysctl_vcpuinfo {
+    domid_t               domain;
+    uint8_t               online;      /* currently online (not hotplugged)? */
+    uint8_t               blocked;     /* blocked waiting for an event? */
+    uint8_t               running;     /* currently scheduled on its CPU? */
+    uint8_t               pad[3];
+    uint32_t              vcpu;
+    uint32_t              cpu;         /* current mapping */
+    uint64_aligned_t      cpu_time;    /* total cpu time consumed (ns) */
+};
+typedef struct xen_sysctl_vcpuinfo xen_sysctl_vcpuinfo_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_vcpuinfo_t);
+
+struct xen_sysctl_getvcpuinfolist {
+    /*
+     * IN: where to start; OUT: where to continue, @domain being
+     * DOMID_INVALID once all vCPUs have been reported.
+     */
+    domid_t               domain;
+#define XEN_SYSCTL_VCPUINFO_single_domain (1u << 0) /* only report @domain */
+    uint16_t              flags;       /* IN */
+    uint32_t              vcpu;
+    /* IN: number of entries of @info; OUT: number of entries filled in. */
+    uint32_t              nr_vcpus;
+    /*
+     * IN: size of each map in @cpumap_hard and @cpumap_soft, which hold
+     * one per entry of @info.  Zero if not getting affinities.
+     */
+    uint32_t              nr_cpumap_bytes;
+    XEN_GUEST_HANDLE_64(xen_sysctl_vcpuinfo_t) info;
+    XEN_GUEST_HANDLE_64(uint8) cpumap_hard;
+    XEN_GUEST_HANDLE_64(uint8) cpumap_soft;
 };
 
 /* Inject debug keys into Xen. */
@@ -218,6 +309,10 @@ struct pm_cx_stat {
      */
     XEN_GUEST_HANDLE_64(uint64) pc;
     XEN_GUEST_HANDLE_64(uint64) cc;
+    /* Idle governor prediction accuracy (OUT). */
+    uint64_aligned_t pred_total;        /* Cx selections */
+    uint64_aligned_t pred_too_deep;     /* woke before target residency */
+    uint64_aligned_t pred_too_shallow;  /* slept past next Cx's target */
 };
 
 struct xen_sysctl_get_pmstat {
@@ -316,6 +411,16 @@ struct xen_set_cpufreq_para {
     uint32_t ctrl_value;
 };
 
+struct xen_pm_domain_boost {
+    domid_t domid;      /* IN */
+    uint8_t boost;      /* IN for set, OUT for get */
+};
+
+struct xen_pm_cpupool_latency {
+    uint32_t cpupool_id;    /* IN */
+    uint32_t latency;       /* IN for set, OUT for get; 0 means no limit */
+};
+
 struct xen_sysctl_pm_op {
     #define PM_PARA_CATEGORY_MASK      0xf0
     #define CPUFREQ_PARA               0x10
@@ -341,6 +446,14 @@ struct xen_sysctl_pm_op {
     #define XEN_SYSCTL_pm_op_enable_turbo               0x26
     #define XEN_SYSCTL_pm_op_disable_turbo              0x27
 
+    /* get/set a domain's performance boost hint (schedutil governor) */
+    #define XEN_SYSCTL_pm_op_get_domain_boost           0x28
+    #define XEN_SYSCTL_pm_op_set_domain_boost           0x29
+
+    /* get/set the max C-state exit latency (us) of a cpupool's CPUs */
+    #define XEN_SYSCTL_pm_op_get_cpupool_latency        0x2a
+    #define XEN_SYSCTL_pm_op_set_cpupool_latency        0x2b
+
     uint32_t cmd;
     uint32_t cpuid;
     union {
@@ -353,6 +466,8 @@ struct xen_sysctl_pm_op {
         uint32_t                    set_max_cstate;
         uint32_t                    get_vcpu_migration_delay;
         uint32_t                    set_vcpu_migration_delay;
+        struct xen_pm_domain_boost  domain_boost;
+        struct xen_pm_cpupool_latency cpupool_latency;
     } u;
 };
 
@@ -435,6 +550,225 @@ struct xen_sysctl_lockprof_op {
     XEN_GUEST_HANDLE_64(xen_sysctl_lockprof_data_t) data;
 };
 
+/* XEN_SYSCTL_lockhist_op */
+/* Sub-operations: */
+#define XEN_SYSCTL_LOCKHIST_query    1 /* Get lock contention histograms. */
+#define XEN_SYSCTL_LOCKHIST_reset    2 /* Reset all histograms to zero. */
+#define XEN_SYSCTL_LOCKHIST_set_rate 3 /* Set the sampling rate. */
+/*
+ * Bucket 0 counts waits shorter than 256ns, bucket i > 0 counts waits in
+ * [2^(i+7), 2^(i+8)) ns, and the last bucket also everything longer.
+ */
+#define XEN_SYSCTL_LOCKHIST_BUCKETS  16
+#define XEN_SYSCTL_LOCKHIST_SITES    4 /* # of top contending call sites. */
+struct xen_sysctl_lockhist_data {
+    char     name[40];     /* lock symbol (or address) */
+    uint64_aligned_t lock; /* lock address */
+    uint32_t hist[XEN_SYSCTL_LOCKHIST_BUCKETS];
+    struct {
+        char     name[40]; /* call site symbol (or address) */
+        uint64_aligned_t addr; /* call site address (0 if unused) */
+        uint32_t cnt;      /* # of sampled waits from this call site */
+        uint32_t pad;
+    } site[XEN_SYSCTL_LOCKHIST_SITES];
+};
+typedef struct xen_sysctl_lockhist_data xen_sysctl_lockhist_data_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_lockhist_data_t);
+struct xen_sysctl_lockhist_op {
+    /* IN variables. */
+    uint32_t       cmd;               /* XEN_SYSCTL_LOCKHIST_??? */
+    uint32_t       max_elem;          /* size of output buffer */
+    /*
+     * IN (set_rate) / OUT (query): one every rate contended acquisitions,
+     * on each CPU, is sampled; 0 means the profiler is off.
+     */
+    uint32_t       rate;
+    /* OUT variables (query only). */
+    uint32_t       nr_elem;           /* number of elements available */
+    uint32_t       dropped;           /* # of samples that did not fit */
+    uint32_t       pad;
+    /* histograms (or NULL) */
+    XEN_GUEST_HANDLE_64(xen_sysctl_lockhist_data_t) data;
+};
+
+/* XEN_SYSCTL_evtchn_steering */
+struct xen_sysctl_evtchn_steer {
+    uint32_t port;
+    uint32_t vcpu;  /* vCPU currently notified */
+    uint32_t rate;  /* # of notifications in the last steering period */
+    uint32_t pad;
+};
+typedef struct xen_sysctl_evtchn_steer xen_sysctl_evtchn_steer_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_evtchn_steer_t);
+struct xen_sysctl_evtchn_steering {
+    /* IN variables. */
+    domid_t  domid;
+    uint16_t pad;
+    uint32_t max_ports;           /* size of the ports buffer */
+    /* OUT variables. */
+    uint32_t nr_ports;            /* # of steerable ports of the domain */
+    uint32_t period_ms;           /* steering period, 0 if disabled */
+    /* steerable ports (or NULL) */
+    XEN_GUEST_HANDLE_64(xen_sysctl_evtchn_steer_t) ports;
+};
+
+/*
+ * XEN_SYSCTL_debug_dump
+ *
+ * Run the diagnostic handler of a debug key, returning its output in the
+ * supplied buffer rather than sending it to the hypervisor console.
+ * Handlers run in interrupt context (e.g. 'd') are not supported.
+ */
+struct xen_sysctl_debug_dump {
+    /* IN variables. */
+    uint8_t  key;
+    uint8_t  pad[3];
+    /* IN: size of the buffer; OUT: bytes of output, not NUL terminated. */
+    uint32_t size;                /* exceeding the IN value if truncated */
+    XEN_GUEST_HANDLE_64(char) buffer;
+};
+
+/*
+ * XEN_SYSCTL_hypercall_stats
+ *
+ * Per-CPU latency histograms of the hypercalls guests make, and of the
+ * calls batched in multicalls, when enabled.  Each invocation is one
+ * sample, including those resuming a preempted hypercall; continuations
+ * counts the samples which were preempted and will be resumed.
+ */
+#define XEN_SYSCTL_HCSTATS_query     1 /* Get the histograms. */
+#define XEN_SYSCTL_HCSTATS_reset     2 /* Reset all histograms to zero. */
+#define XEN_SYSCTL_HCSTATS_enable    3
+#define XEN_SYSCTL_HCSTATS_disable   4
+/*
+ * Bucket 0 counts calls shorter than 256ns, bucket i > 0 counts calls in
+ * [2^(i+7), 2^(i+8)) ns, and the last bucket also everything longer.
+ */
+#define XEN_SYSCTL_HCSTATS_BUCKETS   20
+/*
+ * subop is the command of the hypercalls multiplexing several (the first
+ * argument, or the cmd field of the structure it points to for sysctl,
+ * domctl and platform_op), and XEN_SYSCTL_HCSTATS_NO_SUBOP for others.
+ */
+#define XEN_SYSCTL_HCSTATS_NO_SUBOP  (~0U)
+struct xen_sysctl_hcstats_data {
+    uint32_t cpu;
+    uint32_t op;                  /* __HYPERVISOR_* */
+    uint32_t subop;
+    uint32_t continuations;
+    uint64_aligned_t total_ns;
+    uint32_t hist[XEN_SYSCTL_HCSTATS_BUCKETS];
+};
+typedef struct xen_sysctl_hcstats_data xen_sysctl_hcstats_data_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_hcstats_data_t);
+struct xen_sysctl_hcstats_op {
+    /* IN variables. */
+    uint32_t cmd;                 /* XEN_SYSCTL_HCSTATS_??? */
+    uint32_t max_elem;            /* size of output buffer */
+    /* OUT variables (query only). */
+    uint32_t nr_elem;             /* number of elements available */
+    uint32_t enabled;
+    uint32_t dropped;             /* # of samples that did not fit */
+    uint32_t pad;
+    /* histograms (or NULL) */
+    XEN_GUEST_HANDLE_64(xen_sysctl_hcstats_data_t) data;
+};
+
+/*
+ * XEN_SYSCTL_sched_stats
+ *
+ * Scheduling latency statistics, gathered whichever scheduler a cpupool
+ * uses, when enabled.  Per vCPU: how long it waited runnable before
+ * running, every time (wait), and the subset of those waits which followed
+ * a wakeup rather than a preemption (wake).  Per pCPU: the number of vCPUs
+ * waiting on it, sampled each time it schedules.
+ */
+#define XEN_SYSCTL_SCHEDSTATS_query_vcpus 1 /* Get a domain's vCPU latencies. */
+#define XEN_SYSCTL_SCHEDSTATS_query_cpus  2 /* Get the pCPU depth samples. */
+#define XEN_SYSCTL_SCHEDSTATS_reset       3 /* Reset everything to zero. */
+#define XEN_SYSCTL_SCHEDSTATS_enable      4
+#define XEN_SYSCTL_SCHEDSTATS_disable     5
+/*
+ * Bucket 0 counts waits shorter than 1us, bucket i > 0 counts waits in
+ * [2^(i+9), 2^(i+10)) ns, and the last bucket also everything longer.
+ */
+#define XEN_SYSCTL_SCHEDSTATS_BUCKETS     20
+/* Bucket i counts samples of i waiting vCPUs, the last one also more. */
+#define XEN_SYSCTL_SCHEDSTATS_DEPTHS      16
+struct xen_sysctl_schedstats_vcpu {
+    uint32_t vcpu;
+    uint32_t pad;
+    uint64_aligned_t wait_count;
+    uint64_aligned_t wait_ns;
+    uint64_aligned_t wake_count;
+    uint64_aligned_t wake_ns;
+    uint32_t wait_hist[XEN_SYSCTL_SCHEDSTATS_BUCKETS];
+    uint32_t wake_hist[XEN_SYSCTL_SCHEDSTATS_BUCKETS];
+};
+typedef struct xen_sysctl_schedstats_vcpu xen_sysctl_schedstats_vcpu_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_schedstats_vcpu_t);
+struct xen_sysctl_schedstats_cpu {
+    uint32_t cpu;
+    uint32_t hist[XEN_SYSCTL_SCHEDSTATS_DEPTHS];
+};
+typedef struct xen_sysctl_schedstats_cpu xen_sysctl_schedstats_cpu_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_schedstats_cpu_t);
+struct xen_sysctl_sched_stats {
+    /* IN variables. */
+    uint32_t cmd;                 /* XEN_SYSCTL_SCHEDSTATS_??? */
+    domid_t domid;                /* query_vcpus only */
+    uint16_t pad;
+    uint32_t max_elem;            /* size of output buffer */
+    /* OUT variables (queries only). */
+    uint32_t nr_elem;             /* number of elements available */
+    uint32_t enabled;
+    uint32_t pad2;
+    /* query_vcpus output, indexed by vCPU id (or NULL) */
+    XEN_GUEST_HANDLE_64(xen_sysctl_schedstats_vcpu_t) vcpus;
+    /* query_cpus output, online pCPUs only (or NULL) */
+    XEN_GUEST_HANDLE_64(xen_sysctl_schedstats_cpu_t) cpus;
+};
+
+/*
+ * XEN_SYSCTL_pmuprof_op
+ *
+ * Statistical profiling of the hypervisor (x86 only): each pCPU takes a
+ * sample every period unhalted core cycles, from the overflow NMI of a
+ * performance counter, into a buffer of its own which the toolstack drains
+ * with XEN_SYSCTL_PMUPROF_read.  Excludes xenoprof, the NMI watchdog and
+ * vPMU for as long as it runs.
+ */
+#define XEN_SYSCTL_PMUPROF_start     1 /* Allocate buffers and start. */
+#define XEN_SYSCTL_PMUPROF_stop      2 /* Stop and free the buffers. */
+#define XEN_SYSCTL_PMUPROF_read      3 /* Take the samples of one pCPU. */
+#define XEN_SYSCTL_PMUPROF_DEPTH     16
+/* The sample interrupted guest context: ip is the guest's, no frames. */
+#define XEN_SYSCTL_PMUPROF_GUEST     (1u << 0)
+struct xen_sysctl_pmuprof_sample {
+    uint64_aligned_t time;        /* system time, in ns */
+    uint64_aligned_t ip;
+    uint16_t domid;               /* of current, DOMID_IDLE when idle */
+    uint16_t vcpu;
+    uint16_t flags;               /* XEN_SYSCTL_PMUPROF_* */
+    uint16_t nr_frames;
+    /* Return addresses, innermost first, if built with frame pointers. */
+    uint64_aligned_t frames[XEN_SYSCTL_PMUPROF_DEPTH];
+};
+typedef struct xen_sysctl_pmuprof_sample xen_sysctl_pmuprof_sample_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_pmuprof_sample_t);
+struct xen_sysctl_pmuprof_op {
+    uint32_t cmd;                 /* IN: XEN_SYSCTL_PMUPROF_??? */
+    uint32_t cpu;                 /* IN: read */
+    uint32_t period;              /* IN: start, cycles between samples */
+    /*
+     * IN: start, the size of each buffer, in samples; read, the size of
+     * the samples array.  OUT: read, the number of samples returned.
+     */
+    uint32_t nr_samples;
+    uint64_aligned_t lost;        /* OUT: read, # of samples not buffered */
+    XEN_GUEST_HANDLE_64(xen_sysctl_pmuprof_sample_t) samples;
+};
+
 /* XEN_SYSCTL_cputopoinfo */
 #define XEN_INVALID_CORE_ID     (~0U)
 #define XEN_INVALID_SOCKET_ID   (~0U)
@@ -513,15 +847,30 @@ struct xen_sysctl_numainfo {
 #define XEN_SYSCTL_CPUPOOL_OP_RMCPU                 5  /* R */
 #define XEN_SYSCTL_CPUPOOL_OP_MOVEDOMAIN            6  /* M */
 #define XEN_SYSCTL_CPUPOOL_OP_FREEINFO              7  /* F */
+#define XEN_SYSCTL_CPUPOOL_OP_SET_TRUST_GROUP       8  /* T */
+#define XEN_SYSCTL_CPUPOOL_OP_MOVEDOMAINS           9  /* V */
 #define XEN_SYSCTL_CPUPOOL_PAR_ANY     0xFFFFFFFF
 struct xen_sysctl_cpupool_op {
     uint32_t op;          /* IN */
-    uint32_t cpupool_id;  /* IN: CDIARM OUT: CI */
+    uint32_t cpupool_id;  /* IN: CDIARMTV OUT: CI */
     uint32_t sched_id;    /* IN: C      OUT: I  */
     uint32_t domid;       /* IN: M              */
     uint32_t cpu;         /* IN: AR             */
-    uint32_t n_dom;       /*            OUT: I  */
+    uint32_t n_dom;       /* IN: V      OUT: IV */
     struct xenctl_bitmap cpumap; /*     OUT: IF */
+    /*
+     * Trust group (see struct xen_domctl_spec_ctrl) of the pool's domains
+     * not having one of their own, 0 for none.
+     */
+    uint32_t trust_group; /* IN: T      OUT: I  */
+    /*
+     * Domains to move into cpupool_id.  n_dom is the number of them dealt
+     * with so far: the caller sets it to 0, and on return it tells how far
+     * the operation got, i.e. on error which domain it failed for.
+     * Domains already in the pool are skipped.
+     */
+    uint32_t nr_domids;   /* IN: V              */
+    XEN_GUEST_HANDLE_64(uint32) domids; /* IN: V */
 };
 
 /*
@@ -547,8 +896,9 @@ struct xen_sysctl_cpupool_op {
  * -EINVAL:
  *  XEN_SYSCTL_CPUPOOL_OP_ADDCPU, XEN_SYSCTL_CPUPOOL_OP_RMCPU: An illegal
  *    cpu was specified (cpu does not exist).
- *  XEN_SYSCTL_CPUPOOL_OP_MOVEDOMAIN: An illegal domain was specified
- *    (domain id illegal or not suitable for operation).
+ *  XEN_SYSCTL_CPUPOOL_OP_MOVEDOMAIN, XEN_SYSCTL_CPUPOOL_OP_MOVEDOMAINS: An
+ *    illegal domain was specified (domain id illegal or not suitable for
+ *    operation).
  * -ENODEV:
  *  XEN_SYSCTL_CPUPOOL_OP_ADDCPU, XEN_SYSCTL_CPUPOOL_OP_RMCPU: The specified
  *    cpu is either not free (add) or not member of the specified cpupool
@@ -1088,6 +1438,13 @@ struct xen_sysctl {
 #define XEN_SYSCTL_get_cpu_featureset            26
 #define XEN_SYSCTL_livepatch_op                  27
 #define XEN_SYSCTL_set_parameter                 28
+#define XEN_SYSCTL_lockhist_op                   29
+#define XEN_SYSCTL_evtchn_steering               30
+#define XEN_SYSCTL_debug_dump                    31
+#define XEN_SYSCTL_getvcpuinfolist               32
+#define XEN_SYSCTL_hypercall_stats               33
+#define XEN_SYSCTL_sched_stats                   34
+#define XEN_SYSCTL_pmuprof_op                    35
     uint32_t interface_version; /* XEN_SYSCTL_INTERFACE_VERSION */
     union {
         struct xen_sysctl_readconsole       readconsole;
@@ -1099,7 +1456,12 @@ struct xen_sysctl {
         struct xen_sysctl_sched_id          sched_id;
         struct xen_sysctl_perfc_op          perfc_op;
         struct xen_sysctl_getdomaininfolist getdomaininfolist;
+        struct xen_sysctl_getvcpuinfolist   getvcpuinfolist;
         struct xen_sysctl_debug_keys        debug_keys;
+        struct xen_sysctl_debug_dump        debug_dump;
+        struct xen_sysctl_hcstats_op        hcstats_op;
+        struct xen_sysctl_sched_stats       sched_stats;
+        struct xen_sysctl_pmuprof_op        pmuprof_op;
         struct xen_sysctl_getcpuinfo        getcpuinfo;
         struct xen_sysctl_availheap         availheap;
         struct xen_sysctl_get_pmstat        get_pmstat;
@@ -1117,6 +1479,8 @@ struct xen_sysctl {
         struct xen_sysctl_cpu_featureset    cpu_featureset;
         struct xen_sysctl_livepatch_op      livepatch;
         struct xen_sysctl_set_parameter     set_parameter;
+        struct xen_sysctl_lockhist_op       lockhist_op;
+        struct xen_sysctl_evtchn_steering   evtchn_steering;
         uint8_t                             pad[128];
     } u;
 };
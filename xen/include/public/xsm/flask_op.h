@@ -27,7 +27,7 @@
 
 #include "../event_channel.h"
 
-#define XEN_FLASK_INTERFACE_VERSION 1
+#define XEN_FLASK_INTERFACE_VERSION 2
 
 struct xen_flask_load {
     XEN_GUEST_HANDLE(char) buffer;
@@ -130,6 +130,9 @@ struct xen_flask_cache_stats {
     uint32_t allocations;
     uint32_t reclaims;
     uint32_t frees;
+    /* Lookups served / not served by the CPU's own front cache. */
+    uint32_t pcpu_hits;
+    uint32_t pcpu_misses;
 };
 
 struct xen_flask_ocontext {
@@ -31,6 +31,15 @@ void console_end_sync(void);
 void console_start_log_everything(void);
 void console_end_log_everything(void);
 
+/*
+ * Collect the current CPU's printk() output (other than from interrupt
+ * context) in @buf instead of sending it to the console.  Returns the
+ * number of bytes produced, which may exceed @size, in which case the
+ * output was truncated.
+ */
+void console_start_capture(char *buf, unsigned int size);
+unsigned int console_end_capture(void);
+
 /*
  * Steal output from the console. Returns +ve identifier, else -ve error.
  * Takes the handle of the serial line to steal, and steal callback function.
@@ -95,5 +95,7 @@ extern void cpuidle_wakeup_mwait(cpumask_t *mask);
 #define CPUIDLE_DRIVER_STATE_START  1
 
 extern void menu_get_trace_data(u32 *expected, u32 *pred);
+extern void menu_get_pred_stats(unsigned int cpu, u64 *total, u64 *too_deep,
+                                u64 *too_shallow);
 
 #endif /* _XEN_CPUIDLE_H */
@@ -85,6 +85,8 @@ int arch_vcpu_reset(struct vcpu *);
 extern spinlock_t vcpu_alloc_lock;
 bool_t domctl_lock_acquire(void);
 void domctl_lock_release(void);
+bool domctl_lock_acquire_domain(struct domain *d);
+void domctl_lock_release_domain(struct domain *d);
 
 /*
  * Continue the current hypercall via func(data) on specified cpu.
@@ -54,6 +54,10 @@ int evtchn_bind_virq(evtchn_bind_virq_t *bind, evtchn_port_t port);
 /* Get the status of an event channel port. */
 int evtchn_status(evtchn_status_t *status);
 
+/* Report the steerable event channels of a domain. */
+struct xen_sysctl_evtchn_steering;
+int evtchn_steering_info(struct xen_sysctl_evtchn_steering *op);
+
 /* Close an event channel. */
 int evtchn_close(struct domain *d1, int port1, bool guest);
 
@@ -147,9 +151,23 @@ int evtchn_reset(struct domain *d);
 /*
  * Low-level event channel port ops.
  */
+/*
+ * Account an event against the port's moderation settings, if any.
+ * Returns true if the notification is to be raised now; otherwise a timer
+ * raises it later through the notify port op.
+ */
+bool evtchn_moderation_check(struct evtchn *evtchn);
+
+static inline bool evtchn_moderate(struct evtchn *evtchn)
+{
+    return !evtchn->moderation || evtchn_moderation_check(evtchn);
+}
+
 struct evtchn_port_ops {
     void (*init)(struct domain *d, struct evtchn *evtchn);
     void (*set_pending)(struct vcpu *v, struct evtchn *evtchn);
+    /* Raise the notification held back for a pending event, if any. */
+    void (*notify)(struct vcpu *v, struct evtchn *evtchn);
     void (*clear_pending)(struct domain *d, struct evtchn *evtchn);
     void (*unmask)(struct domain *d, struct evtchn *evtchn);
     bool (*is_pending)(const struct domain *d, evtchn_port_t port);
@@ -174,6 +192,8 @@ static inline void evtchn_port_set_pending(struct domain *d,
                                            unsigned int vcpu_id,
                                            struct evtchn *evtchn)
 {
+    if ( unlikely(evtchn->steerable) )
+        evtchn->steer_count++;
     d->evtchn_port_ops->set_pending(d->vcpu[vcpu_id], evtchn);
 }
 
@@ -64,6 +64,18 @@ int __must_check iommu_map_page(struct domain *d, unsigned long gfn,
                                 unsigned long mfn, unsigned int flags);
 int __must_check iommu_unmap_page(struct domain *d, unsigned long gfn);
 
+/*
+ * (Un)map the naturally aligned 2^order pages at gfn (to mfn), with a single
+ * IOTLB flush at the end, or none if the caller has set
+ * iommu_dont_flush_iotlb (see below) in order to flush once for a larger
+ * batch of operations.  Partial mappings are undone upon failure.
+ */
+int __must_check iommu_map_pages(struct domain *d, unsigned long gfn,
+                                 unsigned long mfn, unsigned int order,
+                                 unsigned int flags);
+int __must_check iommu_unmap_pages(struct domain *d, unsigned long gfn,
+                                   unsigned int order);
+
 enum iommu_feature
 {
     IOMMU_FEAT_COHERENT_WALK,
@@ -155,6 +167,12 @@ struct iommu_ops {
     int __must_check (*map_page)(struct domain *d, unsigned long gfn,
                                  unsigned long mfn, unsigned int flags);
     int __must_check (*unmap_page)(struct domain *d, unsigned long gfn);
+    /* Optional, for IOMMUs able to deal with whole ranges more efficiently. */
+    int __must_check (*map_pages)(struct domain *d, unsigned long gfn,
+                                  unsigned long mfn, unsigned int order,
+                                  unsigned int flags);
+    int __must_check (*unmap_pages)(struct domain *d, unsigned long gfn,
+                                    unsigned int order);
     void (*free_page_table)(struct page_info *);
 #ifdef CONFIG_X86
     void (*update_ire_from_apic)(unsigned int apic, unsigned int reg, unsigned int value);
@@ -133,6 +133,11 @@ struct pirq {
     struct arch_pirq arch;
 };
 
+/*
+ * The lookup is lockless: struct pirq is only freed through RCU (see
+ * free_pirq_struct()).  Its fields remain protected by d->event_lock, or for
+ * what interrupt delivery touches, by the irq descriptor's lock.
+ */
 #define pirq_info(d, p) ((struct pirq *)radix_tree_lookup(&(d)->pirq_tree, p))
 
 /* Use this instead of pirq_info() if the structure may need allocating. */
@@ -48,6 +48,13 @@ void register_irq_keyhandler(unsigned char key,
 /* Inject a keypress into the key-handling subsystem. */
 extern void handle_keypress(unsigned char key, struct cpu_user_regs *regs);
 
+/*
+ * Run the (non-IRQ) handler for @key, collecting its output in @buf rather
+ * than sending it to the console.  Returns the number of bytes of output
+ * (possibly more than @size, if truncated), or -ve error.
+ */
+long keyhandler_dump(unsigned char key, char *buf, unsigned int size);
+
 /* Scratch space is available for use of any keyhandler. */
 extern char keyhandler_scratch[1024];
 
@@ -112,6 +112,18 @@ void arch_livepatch_post_action(void);
 
 void arch_livepatch_mask(void);
 void arch_livepatch_unmask(void);
+
+/*
+ * Patching (or reverting) of a single function while all other CPUs keep
+ * running, which the architecture may or may not support, and only for
+ * functions where no CPU can be stopped inside the bytes being replaced
+ * (see arch_livepatch_live_ok()).  Other CPUs may still execute either
+ * version of the function afterwards, until they next get to
+ * check_for_livepatch_work().  Called with interrupts enabled.
+ */
+bool arch_livepatch_live_ok(const struct livepatch_func *func, bool applied);
+void arch_livepatch_apply_live(struct livepatch_func *func);
+void arch_livepatch_revert_live(const struct livepatch_func *func);
 #else
 
 /*
@@ -0,0 +1,19 @@
+#ifndef __XEN_LOG2HIST_H__
+#define __XEN_LOG2HIST_H__
+
+#include <xen/bitops.h>
+#include <xen/kernel.h>
+#include <xen/types.h>
+
+/*
+ * Log2 histograms, the format all of the latency statistics interfaces
+ * hand out: bucket 0 counts values below 2^@shift, bucket i > 0 those
+ * in [2^(i+@shift-1), 2^(i+@shift)), and the last bucket the rest too.
+ */
+static inline void log2_hist_add(uint32_t *hist, unsigned int nr,
+                                 uint64_t val, unsigned int shift)
+{
+    hist[min_t(unsigned int, fls64(val >> shift), nr - 1)]++;
+}
+
+#endif /* __XEN_LOG2HIST_H__ */
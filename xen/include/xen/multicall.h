@@ -28,4 +28,10 @@ enum mc_disposition {
     mc_preempt,
 } arch_do_multicall_call(struct mc_state *mc);
 
+/*
+ * Carry out work which sub-calls have left to be done once for the whole
+ * batch (e.g. TLB flushes), before the multicall returns or is preempted.
+ */
+void arch_multicall_flush(void);
+
 #endif /* __XEN_MULTICALL_H__ */
@@ -52,25 +52,37 @@ enum perfcounter {
 typedef unsigned perfc_t;
 #define PRIperfc ""
 
+/*
+ * With "perfc_shared", the counters get moved into pages shared read-only
+ * with privileged domains; perfc_shift is the distance from a CPU's
+ * perfcounters[] to where its counters actually live (0 otherwise).
+ */
 DECLARE_PER_CPU(perfc_t[NUM_PERFCOUNTERS], perfcounters);
+DECLARE_PER_CPU(long, perfc_shift);
+
+#define per_cpu_perfc(cpu)                                              \
+    ((perfc_t *)((char *)per_cpu(perfcounters, cpu) +                   \
+                 per_cpu(perfc_shift, cpu)))
+#define this_cpu_perfc()                                                \
+    ((perfc_t *)((char *)this_cpu(perfcounters) + this_cpu(perfc_shift)))
 
-#define perfc_value(x)    this_cpu(perfcounters)[PERFC_ ## x]
+#define perfc_value(x)    this_cpu_perfc()[PERFC_ ## x]
 #define perfc_valuea(x,y)                                               \
     ( (y) <= PERFC_LAST_ ## x - PERFC_ ## x ?                           \
-	 this_cpu(perfcounters)[PERFC_ ## x + (y)] : 0 )
-#define perfc_set(x,v)    (this_cpu(perfcounters)[PERFC_ ## x] = (v))
+	 this_cpu_perfc()[PERFC_ ## x + (y)] : 0 )
+#define perfc_set(x,v)    (this_cpu_perfc()[PERFC_ ## x] = (v))
 #define perfc_seta(x,y,v)                                               \
     ( (y) <= PERFC_LAST_ ## x - PERFC_ ## x ?                           \
-	 this_cpu(perfcounters)[PERFC_ ## x + (y)] = (v) : (v) )
-#define perfc_incr(x)     (++this_cpu(perfcounters)[PERFC_ ## x])
-#define perfc_decr(x)     (--this_cpu(perfcounters)[PERFC_ ## x])
+	 this_cpu_perfc()[PERFC_ ## x + (y)] = (v) : (v) )
+#define perfc_incr(x)     (++this_cpu_perfc()[PERFC_ ## x])
+#define perfc_decr(x)     (--this_cpu_perfc()[PERFC_ ## x])
 #define perfc_incra(x,y)                                                \
     ( (y) <= PERFC_LAST_ ## x - PERFC_ ## x ?                           \
-	 ++this_cpu(perfcounters)[PERFC_ ## x + (y)] : 0 )
-#define perfc_add(x,v)    (this_cpu(perfcounters)[PERFC_ ## x] += (v))
+	 ++this_cpu_perfc()[PERFC_ ## x + (y)] : 0 )
+#define perfc_add(x,v)    (this_cpu_perfc()[PERFC_ ## x] += (v))
 #define perfc_adda(x,y,v)                                               \
     ( (y) <= PERFC_LAST_ ## x - PERFC_ ## x ?                           \
-	 this_cpu(perfcounters)[PERFC_ ## x + (y)] = (v) : (v) )
+	 this_cpu_perfc()[PERFC_ ## x + (y)] = (v) : (v) )
 
 /*
  * Histogram: special treatment for 0 and 1 count. After that equally spaced 
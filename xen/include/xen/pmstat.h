@@ -14,4 +14,10 @@ int pmstat_reset_cx_stat(uint32_t cpuid);
 int do_get_pm_info(struct xen_sysctl_get_pmstat *op);
 int do_pm_op(struct xen_sysctl_pm_op *op);
 
+#ifdef CONFIG_HAS_CPUFREQ
+void cpufreq_sched_wake(unsigned int cpu, bool boost);
+#else
+static inline void cpufreq_sched_wake(unsigned int cpu, bool boost) {}
+#endif
+
 #endif /* __XEN_PMSTAT_H_ */
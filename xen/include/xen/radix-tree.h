@@ -108,11 +108,22 @@ void radix_tree_destroy(
  * radix_tree_lookup_slot
  * radix_tree_gang_lookup
  * radix_tree_gang_lookup_slot
+ * radix_tree_next_hole
+ * radix_tree_prev_hole
  *
- * The first 7 functions are able to be called locklessly, using RCU. The
- * caller must ensure calls to these functions are made within rcu_read_lock()
+ * These functions are able to be called locklessly, using RCU. The caller
+ * must ensure calls to these functions are made within rcu_read_lock()
  * regions. Other readers (lock-free or otherwise) and modifications may be
- * running concurrently.
+ * running concurrently.  In Xen any code not giving up the CPU (e.g. by
+ * returning to guest context, or going idle) is within such a region
+ * already, be it a hypercall or an interrupt handler: rcu_read_lock() then
+ * only documents the lockless access.
+ *
+ * Lockless lookups rely on interior nodes being freed only after a grace
+ * period, which is what radix_tree_init() sets the tree up for.  A tree
+ * given its own node_free by radix_tree_set_alloc_callbacks() must defer
+ * freeing in the same way (e.g. with call_rcu()), or have every reader
+ * exclude modifications.
  *
  * It is still required that the caller manage the synchronization and lifetimes
  * of the items. So if RCU lock-free lookups are used, typically this would mean
@@ -119,9 +119,11 @@ typedef struct _rcu_read_lock rcu_read_lock_t;
  *
  * Inserts memory barriers on architectures that require them
  * (currently only the Alpha), and, more importantly, documents
- * exactly which pointers are protected by RCU.
+ * exactly which pointers are protected by RCU.  The pointer is
+ * read exactly once, so that the compiler can neither re-read
+ * it nor tear the read while writers update it concurrently.
  */
-#define rcu_dereference(p)     (p)
+#define rcu_dereference(p)     ACCESS_ONCE(p)
 
 /**
  * rcu_assign_pointer - assign (publicize) a pointer to a newly
@@ -145,6 +147,7 @@ void call_rcu(struct rcu_head *head,
               void (*func)(struct rcu_head *head));
 
 int rcu_barrier(void);
+int rcu_barrier_expedited(void);
 
 void rcu_idle_enter(unsigned int cpu);
 void rcu_idle_exit(unsigned int cpu);
@@ -47,6 +47,45 @@ DECLARE_PER_CPU(struct schedule_data, schedule_data);
 DECLARE_PER_CPU(struct scheduler *, scheduler);
 DECLARE_PER_CPU(struct cpupool *, cpupool);
 
+/*
+ * Core scheduling: if enabled, sibling hyperthreads only ever run vCPUs of
+ * the same domain (or idle). schedule() serializes the scheduling decisions
+ * of all the threads of a core, so when a scheduler is picking the next vCPU
+ * for a pCPU, what runs on the pCPU's siblings is stable, and schedulers
+ * that support core scheduling use sched_core_allowed() to skip the vCPUs
+ * that can't run there.
+ *
+ * This only covers which guest vCPUs get scheduled.  Siblings enter and
+ * leave Xen independently, so one of them may be running hypervisor code
+ * on behalf of another domain (for interrupts, hypercalls, softirqs, or
+ * between a scheduling decision and the context switch) while the other one
+ * runs a guest.
+ *
+ * Currently supported by Credit2 and null only: it is not enabled with any
+ * other scheduler as the default one, and pCPUs can't be moved to pools
+ * using other schedulers while it is enabled.
+ */
+extern bool sched_core_enabled;
+
+static inline bool sched_core_allowed(unsigned int cpu, const struct vcpu *v)
+{
+    unsigned int sibling;
+
+    if ( likely(!sched_core_enabled) || is_idle_vcpu(v) )
+        return true;
+
+    for_each_cpu ( sibling, per_cpu(cpu_sibling_mask, cpu) )
+    {
+        const struct vcpu *curr = curr_on_cpu(sibling);
+
+        if ( sibling != cpu && !is_idle_vcpu(curr) &&
+             curr->domain != v->domain )
+            return false;
+    }
+
+    return true;
+}
+
 /*
  * Scratch space, for avoiding having too many cpumask_t on the stack.
  * Within each scheduler, when using the scratch mask of one pCPU:
@@ -193,6 +232,8 @@ struct cpupool
     unsigned int     n_dom;
     struct scheduler *sched;
     atomic_t         refcnt;
+    unsigned int     idle_latency;   /* max C-state exit latency, 0 = any */
+    unsigned int     trust_group;    /* of domains without their own */
 };
 
 #define cpupool_online_cpumask(_pool) \
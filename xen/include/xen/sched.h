@@ -92,6 +92,7 @@ struct evtchn
     u8  state;             /* ECS_* */
     u8  xen_consumer:XEN_CONSUMER_BITS; /* Consumer in Xen if nonzero */
     u8  pending:1;
+    u8  steerable:1;       /* Xen may change notify_vcpu_id (interdomain) */
     u16 notify_vcpu_id;    /* VCPU for local delivery notification */
     u32 port;
     union {
@@ -112,6 +113,9 @@ struct evtchn
     u8 priority;
     u8 last_priority;
     u16 last_vcpu_id;
+    u32 steer_count;       /* Notifications in the current steering period */
+    u32 steer_rate;        /* Notifications in the last steering period */
+    struct evtchn_moderation *moderation; /* EVTCHNOP_set_moderation state */
 #ifdef CONFIG_XSM
     union {
 #ifdef XSM_NEED_GENERIC_EVTCHN_SSID
@@ -159,6 +163,7 @@ struct vcpu
     struct timer     poll_timer;    /* timeout for SCHEDOP_poll */
 
     void            *sched_priv;    /* scheduler-specific data */
+    struct sched_vcpu_stats *sched_stats; /* see XEN_SYSCTL_sched_stats */
 
     struct vcpu_runstate_info runstate;
 #ifndef CONFIG_COMPAT
@@ -229,6 +234,8 @@ struct vcpu
 
     /* VCPU paused for vm_event replies. */
     atomic_t         vm_event_pause_count;
+    /* Monitor ring of the VCPU's group, if not the domain's main one. */
+    struct vm_event_domain *vm_event_monitor;
     /* VCPU paused by system controller. */
     int              controller_pause_count;
 
@@ -264,6 +271,10 @@ struct vcpu
 
     struct evtchn_fifo_vcpu *evtchn_fifo;
 
+    /* Event channel steering: notification load, and running time seen. */
+    unsigned int     evtchn_steer_load;
+    uint64_t         evtchn_steer_runtime;
+
     struct arch_vcpu arch;
 };
 
@@ -294,6 +305,8 @@ struct vm_event_domain
     unsigned int blocked;
     /* The last vcpu woken up */
     unsigned int last_vcpu_wake_up;
+    /* the number of vCPUs putting requests on the ring */
+    unsigned int nr_vcpus;
 };
 
 struct evtchn_port_ops;
@@ -339,6 +352,7 @@ struct domain
     unsigned int     max_evtchns;     /* number supported by ABI */
     unsigned int     max_evtchn_port; /* max permitted port number */
     unsigned int     valid_evtchns;   /* number of allocated event channels */
+    unsigned int     nr_steerable_evtchns; /* see EVTCHNOP_set_steerable */
     spinlock_t       event_lock;
     const struct evtchn_port_ops *evtchn_port_ops;
     struct evtchn_fifo_domain *evtchn_fifo;
@@ -356,6 +370,8 @@ struct domain
 
     /* Is this guest dying (i.e., a zombie)? */
     enum { DOMDYING_alive, DOMDYING_dying, DOMDYING_dead } is_dying;
+    /* On a relinquish queue, when destroyed asynchronously. */
+    struct list_head relinquish_list;
 
     /* Domain is paused by controller software? */
     int              controller_pause_count;
@@ -380,6 +396,8 @@ struct domain
     bool             disable_migrate;
     /* Is this guest being debugged by dom0? */
     bool             debugger_attached;
+    /* Should wakeups of this guest's VCPUs ramp up CPU frequency? */
+    bool             cpufreq_boost;
     /*
      * Set to true at the very end of domain creation, when the domain is
      * unpaused for the first time by the systemcontroller.
@@ -431,6 +449,10 @@ struct domain
     char       *pbuf;
     unsigned    pbuf_idx;
     spinlock_t  pbuf_lock;
+    /* Console output rate limiting, protected by pbuf_lock. */
+    s_time_t    console_rl_start;
+    unsigned int console_rl_lines;
+    unsigned int console_rl_missed;
 
     /* OProfile support. */
     struct xenoprof *xenoprof;
@@ -449,6 +471,13 @@ struct domain
      */
     spinlock_t hypercall_deadlock_mutex;
 
+    /* Serialises the domctls (and foreign updates) acting on this domain. */
+    spinlock_t domctl_lock;
+
+    /* Change tracking for XEN_SYSCTL_getdomaininfolist, under its lock. */
+    uint64_t info_digest;
+    uint64_t info_generation;
+
     /* transcendent memory, auto-allocated on first tmem op by each domain */
     struct client *tmem_client;
 
@@ -466,6 +495,9 @@ struct domain
 #endif
     /* VM event monitor support */
     struct vm_event_domain *vm_event_monitor;
+    /* Further monitor rings, each serving a group of vCPUs */
+    struct vm_event_domain **vm_event_monitor_groups;
+    unsigned int nr_vm_event_monitor_groups;
 
     /*
      * Can be specified by the user. If that is not the case, it is
@@ -601,6 +633,13 @@ static inline struct domain *rcu_lock_current_domain(void)
 }
 
 struct domain *get_domain_by_id(domid_t dom);
+
+/*
+ * The first domain in domain_list with an ID of at least @dom.  Caller must
+ * hold the domlist_read_lock.
+ */
+struct domain *first_domain_from(domid_t dom);
+
 void domain_destroy(struct domain *d);
 int domain_kill(struct domain *d);
 int domain_shutdown(struct domain *d, u8 reason);
@@ -649,6 +688,7 @@ void sched_destroy_domain(struct domain *d);
 int sched_move_domain(struct domain *d, struct cpupool *c);
 long sched_adjust(struct domain *, struct xen_domctl_scheduler_op *);
 long sched_adjust_global(struct xen_sysctl_scheduler_op *);
+int sched_stats_control(struct xen_sysctl_sched_stats *);
 int  sched_id(void);
 void sched_tick_suspend(void);
 void sched_tick_resume(void);
@@ -713,13 +753,14 @@ static inline void hypercall_cancel_continuation(struct vcpu *v)
 }
 
 /*
- * For long-running operations that must be in hypercall context, check
- * if there is background work to be done that should interrupt this
- * operation.
+ * For long-running operations that must be in hypercall context (or are
+ * continued from a tasklet on the idle vcpu, like the relinquishing of
+ * a dying domain's resources), check if there is background work to be
+ * done that should interrupt this operation.
  */
-#define hypercall_preempt_check() (unlikely(    \
-        softirq_pending(smp_processor_id()) |   \
-        local_events_need_delivery()            \
+#define hypercall_preempt_check() (unlikely(                        \
+        softirq_pending(smp_processor_id()) |                       \
+        (!is_idle_vcpu(current) && local_events_need_delivery())    \
     ))
 
 /*
@@ -908,6 +949,14 @@ unsigned int get_vcpu_migration_delay(void);
 
 extern bool sched_smt_power_savings;
 
+/*
+ * pCPUs dedicated to running one single vCPU (e.g., by the null scheduler),
+ * which we want to disturb as little as possible with deferred Xen work.
+ */
+extern cpumask_t sched_dedicated_cpus;
+#define cpu_is_dedicated(cpu) cpumask_test_cpu(cpu, &sched_dedicated_cpus)
+unsigned int sched_housekeeping_cpu(unsigned int cpu);
+
 extern enum cpufreq_controller {
     FREQCTL_none, FREQCTL_dom0_kernel, FREQCTL_xen
 } cpufreq_controller;
@@ -920,6 +969,12 @@ int cpupool_add_domain(struct domain *d, int poolid);
 void cpupool_rm_domain(struct domain *d);
 int cpupool_move_domain(struct domain *d, struct cpupool *c);
 int cpupool_do_sysctl(struct xen_sysctl_cpupool_op *op);
+int cpupool_get_idle_latency(int poolid, unsigned int *latency);
+int cpupool_set_idle_latency(int poolid, unsigned int latency);
+/* Max C-state exit latency (us) of the CPU's cpupool, 0 for no limit. */
+DECLARE_PER_CPU(unsigned int, cpupool_idle_latency);
+/* Trust group of the CPU's cpupool, 0 for none. */
+DECLARE_PER_CPU(unsigned int, cpupool_trust_group);
 void schedule_dump(struct cpupool *c);
 extern void dump_runq(unsigned char key);
 
@@ -127,6 +127,8 @@ struct lock_profile_qhead { };
 
 #endif
 
+#ifndef CONFIG_QUEUED_SPINLOCKS
+
 typedef union {
     u32 head_tail;
     struct {
@@ -137,8 +139,27 @@ typedef union {
 
 #define SPINLOCK_TICKET_INC { .head_tail = 0x10000, }
 
+#else
+
+typedef union {
+    u32 val;
+    struct {
+        u16 owner;  /* Bit 0: lock is held; bits 1-15: # of releases. */
+        u16 tail;   /* Last waiter in the queue: (cpu + 1) << 2 | nesting. */
+    };
+} spinlock_queue_t;
+
+#define SPINLOCK_QUEUE_LOCKED  1u
+#define SPINLOCK_QUEUE_RELEASE 2u
+
+#endif
+
 typedef struct spinlock {
+#ifndef CONFIG_QUEUED_SPINLOCKS
     spinlock_tickets_t tickets;
+#else
+    spinlock_queue_t queue;
+#endif
     u16 recurse_cpu:12;
 #define SPINLOCK_NO_CPU 0xfffu
     u16 recurse_cnt:4;
@@ -194,6 +215,16 @@ void _spin_unlock_recursive(spinlock_t *lock);
 
 #define spin_lock_kick(l)             arch_lock_signal_wmb()
 
+/*
+ * Lock contention profiler hooks, for other lock types. The time spent
+ * between begin and end is accounted as contention on lock, by caller.
+ */
+s64 lock_hist_begin(void);
+void lock_hist_end(const void *lock, const void *caller, s64 start);
+
+struct xen_sysctl_lockhist_op;
+int lock_hist_control(struct xen_sysctl_lockhist_op *op);
+
 /* Ensure a lock is quiescent between two critical operations. */
 #define spin_barrier(l)               _spin_barrier(l)
 
@@ -0,0 +1,58 @@
+#ifndef __XEN_STATIC_KEY_H__
+#define __XEN_STATIC_KEY_H__
+
+/*
+ * Static keys: flags tested in hot paths, which get flipped rarely.  Where
+ * supported, testing one costs a NOP while it is disabled, with each site
+ * being patched into a jump when it gets enabled.
+ *
+ * Flipping a key synchronises with all CPUs (and may hence fail with
+ * -EBUSY), so can only be done with interrupts enabled and no locks held
+ * which other CPUs may be spinning on.  Sites must not be in NMI or #MC
+ * context, nor in livepatch payloads.
+ */
+
+#include <xen/types.h>
+
+struct static_key {
+    bool enabled;
+};
+
+#define STATIC_KEY_INIT { .enabled = false }
+
+#if defined(CONFIG_HAS_STATIC_KEY) && !defined(__clang__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 5))
+
+#include <asm/static_key.h>
+
+#define STATIC_KEY_PATCHING
+
+#define static_key_false(key) arch_static_key_false(key)
+
+/* Updates of any one key need to be serialised by the callers. */
+
+int static_key_enable(struct static_key *key);
+int static_key_disable(struct static_key *key);
+
+#else
+
+static inline bool static_key_false(const struct static_key *key)
+{
+    return unlikely(key->enabled);
+}
+
+static inline int static_key_enable(struct static_key *key)
+{
+    key->enabled = true;
+    return 0;
+}
+
+static inline int static_key_disable(struct static_key *key)
+{
+    key->enabled = false;
+    return 0;
+}
+
+#endif
+
+#endif /* __XEN_STATIC_KEY_H__ */
@@ -262,8 +262,27 @@ struct tmem_statistics {
 } while (0)
 
 #define MAX_GLOBAL_SHARED_POOLS  16
+/*
+ * Compressed pages are packed zbud style: a backing page is cut into
+ * chunks, the first holding the header, and stores at most two objects,
+ * one right after the header and one ending at the end of the page.
+ * Pages with a single object sit on the unbuddied list indexed by their
+ * number of free chunks.
+ */
+#define ZBUD_CHUNK_SHIFT 6
+#define ZBUD_CHUNK_SIZE (1U << ZBUD_CHUNK_SHIFT)
+#define ZBUD_NR_CHUNKS (PAGE_SIZE >> ZBUD_CHUNK_SHIFT)
+#define ZBUD_MAX_SIZE ((ZBUD_NR_CHUNKS - 1) * ZBUD_CHUNK_SIZE)
+
+struct tmem_zbud_pool {
+    spinlock_t lock;
+    struct list_head unbuddied[ZBUD_NR_CHUNKS];
+    unsigned long pages; /* Protected by lock. */
+};
+
 struct tmem_global {
     struct list_head ephemeral_page_list;  /* All pages in ephemeral pools. */
+    struct tmem_zbud_pool zbud; /* Compressed data of ephemeral pools. */
     struct list_head client_list;
     struct tmem_pool *shared_pools[MAX_GLOBAL_SHARED_POOLS];
     bool shared_auth;
@@ -281,6 +300,7 @@ struct client {
     struct tmem_pool *pools[MAX_POOLS_PER_DOMAIN];
     struct domain *domain;
     struct xmem_pool *persistent_pool;
+    struct tmem_zbud_pool persistent_zbud;
     struct list_head ephemeral_page_list;
     long eph_count, eph_count_max;
     domid_t cli_id;
@@ -326,6 +346,8 @@ struct tmem_pool {
     long obj_count;  /* Atomicity depends on pool_rwlock held for write. */
     long obj_count_max;
     unsigned long objnode_count, objnode_count_max;
+    unsigned long compressed_pages;
+    uint64_t compressed_sum_size;
     uint64_t sum_life_cycles;
     uint64_t sum_evicted_cycles;
     unsigned long puts, good_puts, no_mem_puts;
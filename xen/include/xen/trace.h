@@ -21,8 +21,14 @@
 #ifndef __XEN_TRACE_H__
 #define __XEN_TRACE_H__
 
+#include <xen/static_key.h>
+
 extern int tb_init_done;
 
+/* Enabled whenever tb_init_done may be set, for hot paths to test first. */
+extern struct static_key tb_key;
+#define tb_tracing() (static_key_false(&tb_key) && unlikely(tb_init_done))
+
 #include <public/sysctl.h>
 #include <public/trace.h>
 #include <asm/trace.h>
@@ -40,7 +46,7 @@ void __trace_var(u32 event, bool_t cycles, unsigned int extra, const void *);
 static inline void trace_var(u32 event, int cycles, int extra,
                              const void *extra_data)
 {
-    if ( unlikely(tb_init_done) )
+    if ( tb_tracing() )
         __trace_var(event, cycles, extra, extra_data);
 }
 
@@ -55,7 +61,7 @@ void __trace_hypercall(uint32_t event, unsigned long op,
   
 #define TRACE_1D(_e,d1)                                         \
     do {                                                        \
-        if ( unlikely(tb_init_done) )                           \
+        if ( tb_tracing() )                                     \
         {                                                       \
             u32 _d[1];                                          \
             _d[0] = d1;                                         \
@@ -65,7 +71,7 @@ void __trace_hypercall(uint32_t event, unsigned long op,
  
 #define TRACE_2D(_e,d1,d2)                                      \
     do {                                                        \
-        if ( unlikely(tb_init_done) )                           \
+        if ( tb_tracing() )                                     \
         {                                                       \
             u32 _d[2];                                          \
             _d[0] = d1;                                         \
@@ -76,7 +82,7 @@ void __trace_hypercall(uint32_t event, unsigned long op,
  
 #define TRACE_3D(_e,d1,d2,d3)                                   \
     do {                                                        \
-        if ( unlikely(tb_init_done) )                           \
+        if ( tb_tracing() )                                     \
         {                                                       \
             u32 _d[3];                                          \
             _d[0] = d1;                                         \
@@ -88,7 +94,7 @@ void __trace_hypercall(uint32_t event, unsigned long op,
  
 #define TRACE_4D(_e,d1,d2,d3,d4)                                \
     do {                                                        \
-        if ( unlikely(tb_init_done) )                           \
+        if ( tb_tracing() )                                     \
         {                                                       \
             u32 _d[4];                                          \
             _d[0] = d1;                                         \
@@ -101,7 +107,7 @@ void __trace_hypercall(uint32_t event, unsigned long op,
  
 #define TRACE_5D(_e,d1,d2,d3,d4,d5)                             \
     do {                                                        \
-        if ( unlikely(tb_init_done) )                           \
+        if ( tb_tracing() )                                     \
         {                                                       \
             u32 _d[5];                                          \
             _d[0] = d1;                                         \
@@ -115,7 +121,7 @@ void __trace_hypercall(uint32_t event, unsigned long op,
 
 #define TRACE_6D(_e,d1,d2,d3,d4,d5,d6)                             \
     do {                                                        \
-        if ( unlikely(tb_init_done) )                           \
+        if ( tb_tracing() )                                     \
         {                                                       \
             u32 _d[6];                                          \
             _d[0] = d1;                                         \
@@ -61,6 +61,13 @@ static inline int vm_event_claim_slot_nosleep(struct domain *d,
 
 void vm_event_cancel_slot(struct domain *d, struct vm_event_domain *ved);
 
+/* The monitor ring v's requests go to. */
+static inline struct vm_event_domain *vm_event_monitor_ring(
+    const struct vcpu *v)
+{
+    return v->vm_event_monitor ?: v->domain->vm_event_monitor;
+}
+
 void vm_event_put_request(struct domain *d, struct vm_event_domain *ved,
                           vm_event_request_t *req);
 
@@ -123,4 +123,45 @@ unsigned long xmem_pool_get_used_size(struct xmem_pool *pool);
  */
 unsigned long xmem_pool_get_total_size(struct xmem_pool *pool);
 
+/*
+ * Object cache interface.
+ */
+
+struct xmem_cache;
+
+/**
+ * xmem_cache_create - create a cache of fixed size objects
+ * @name: name of the cache
+ * @size: size of each object (in bytes)
+ * @align: alignment of each object (in bytes)
+ *
+ * Objects are kept in slabs of Xen heap pages, with per-CPU magazines of
+ * free objects in front of them, so that most allocations and frees do not
+ * need to take any lock.
+ */
+struct xmem_cache *xmem_cache_create(const char *name, unsigned int size,
+                                     unsigned int align);
+
+/**
+ * xmem_cache_destroy - cleanup given cache
+ * @cache: Cache to be destroyed
+ *
+ * All objects allocated from the cache must be freed before destroying it.
+ */
+void xmem_cache_destroy(struct xmem_cache *cache);
+
+/**
+ * xmem_cache_alloc - allocate an object from given cache
+ * @cache: cache to allocate from
+ */
+void *xmem_cache_alloc(struct xmem_cache *cache);
+void *xmem_cache_zalloc(struct xmem_cache *cache);
+
+/**
+ * xmem_cache_free - free an object
+ * @cache: cache the object was allocated from
+ * @ptr: object to be freed
+ */
+void xmem_cache_free(struct xmem_cache *cache, void *ptr);
+
 #endif /* __XMALLOC_H__ */
@@ -55,6 +55,7 @@ const struct selinux_class_perm selinux_class_perm = {
 #define AVC_CACHE_SLOTS            512
 #define AVC_DEF_CACHE_THRESHOLD        512
 #define AVC_CACHE_RECLAIM        16
+#define AVC_PCPU_SLOTS            16
 
 #ifdef CONFIG_FLASK_AVC_STATS
 #define avc_cache_stats_incr(field)                 \
@@ -97,11 +98,45 @@ static struct avc_cache avc_cache;
 
 static DEFINE_RCU_READ_LOCK(avc_rcu_lock);
 
+/*
+ * Small per-CPU front end of the AVC, holding recently granted decisions so
+ * that the hot lookups don't need to touch the shared hash chains.  Entries
+ * are only valid for the generation they were filled in, which gets bumped
+ * whenever cached decisions change (policy load, permissive updates).
+ * Generation 0 is never current, so zeroed entries are invalid.
+ */
+struct avc_pcpu_entry {
+    u32            ssid;
+    u32            tsid;
+    u16            tclass;
+    u32            generation;
+    struct av_decision    avd;
+};
+
+static DEFINE_PER_CPU(struct avc_pcpu_entry, avc_pcpu_cache[AVC_PCPU_SLOTS]);
+static atomic_t avc_generation = ATOMIC_INIT(1);
+
 static inline int avc_hash(u32 ssid, u32 tsid, u16 tclass)
 {
     return (ssid ^ (tsid<<2) ^ (tclass<<4)) & (AVC_CACHE_SLOTS - 1);
 }
 
+static inline struct avc_pcpu_entry *avc_pcpu_slot(u32 ssid, u32 tsid,
+                                                   u16 tclass)
+{
+    unsigned int h = (ssid * 31 + tsid) * 31 + tclass;
+
+    return &this_cpu(avc_pcpu_cache)[h & (AVC_PCPU_SLOTS - 1)];
+}
+
+static void avc_pcpu_invalidate(void)
+{
+    /* Order the cache update before readers seeing the new generation. */
+    smp_wmb();
+    if ( unlikely(atomic_inc_and_test(&avc_generation)) )
+        atomic_inc(&avc_generation);
+}
+
 /* no use making this larger than the printk buffer */
 #define AVC_BUF_SIZE 1024
 static DEFINE_SPINLOCK(avc_emerg_lock);
@@ -664,6 +699,7 @@ static int avc_update_node(u32 perms, u32 ssid, u32 tsid, u16 tclass,
 
     node->ae.avd.allowed |= perms;
     avc_node_replace(node, orig);
+    avc_pcpu_invalidate();
  out_unlock:
     spin_unlock_irqrestore(lock, flag);
  out:
@@ -696,6 +732,7 @@ int avc_ss_reset(u32 seqno)
         spin_unlock_irqrestore(lock, flag);
     }
     
+    avc_pcpu_invalidate();
     avc_latest_notif_update(seqno, 0);
     return rc;
 }
@@ -724,11 +761,31 @@ int avc_has_perm_noaudit(u32 ssid, u32 tsid, u16 tclass, u32 requested,
 {
     struct avc_node *node;
     struct av_decision avd_entry, *avd;
+    struct avc_pcpu_entry *pe = NULL;
+    unsigned int generation = 0;
     int rc = 0;
     u32 denied;
 
     BUG_ON(!requested);
 
+    /* Interrupt context might race with an update of this CPU's cache. */
+    if ( !in_irq() )
+    {
+        generation = atomic_read(&avc_generation);
+        smp_rmb();
+        pe = avc_pcpu_slot(ssid, tsid, tclass);
+        if ( pe->generation == generation && pe->ssid == ssid &&
+             pe->tsid == tsid && pe->tclass == tclass &&
+             !(requested & ~pe->avd.allowed) )
+        {
+            avc_cache_stats_incr(pcpu_hits);
+            if ( in_avd )
+                *in_avd = pe->avd;
+            return 0;
+        }
+        avc_cache_stats_incr(pcpu_misses);
+    }
+
     rcu_read_lock(&avc_rcu_lock);
 
     node = avc_lookup(ssid, tsid, tclass);
@@ -761,6 +818,14 @@ int avc_has_perm_noaudit(u32 ssid, u32 tsid, u16 tclass, u32 requested,
         else
             rc = -EACCES;
     }
+    else if ( pe )
+    {
+        pe->ssid = ssid;
+        pe->tsid = tsid;
+        pe->tclass = tclass;
+        pe->avd = *avd;
+        pe->generation = generation;
+    }
 
     rcu_read_unlock(&avc_rcu_lock);
  out:
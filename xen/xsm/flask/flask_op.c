@@ -444,6 +444,8 @@ static int flask_security_avc_cachestats(struct xen_flask_cache_stats *arg)
     arg->allocations = st->allocations;
     arg->reclaims = st->reclaims;
     arg->frees = st->frees;
+    arg->pcpu_hits = st->pcpu_hits;
+    arg->pcpu_misses = st->pcpu_misses;
 
     return 0;
 }
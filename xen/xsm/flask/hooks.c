@@ -626,6 +626,7 @@ static int flask_domctl(struct domain *d, int cmd)
         return current_has_perm(d, SECCLASS_DOMAIN, DOMAIN__UNPAUSE);
 
     case XEN_DOMCTL_setvcpuaffinity:
+    case XEN_DOMCTL_setvcpuaffinitylist:
     case XEN_DOMCTL_setnodeaffinity:
         return current_has_perm(d, SECCLASS_DOMAIN, DOMAIN__SETAFFINITY);
 
@@ -673,10 +674,12 @@ static int flask_domctl(struct domain *d, int cmd)
         return current_has_perm(d, SECCLASS_DOMAIN, DOMAIN__HYPERCALL);
 
     case XEN_DOMCTL_sethvmcontext:
+    case XEN_DOMCTL_sethvmcontext_vcpus:
         return current_has_perm(d, SECCLASS_HVM, HVM__SETHVMC);
 
     case XEN_DOMCTL_gethvmcontext:
     case XEN_DOMCTL_gethvmcontext_partial:
+    case XEN_DOMCTL_gethvmcontext_vcpus:
         return current_has_perm(d, SECCLASS_HVM, HVM__GETHVMC);
 
     case XEN_DOMCTL_set_address_size:
@@ -704,13 +707,18 @@ static int flask_domctl(struct domain *d, int cmd)
     case XEN_DOMCTL_gdbsx_pausevcpu:
     case XEN_DOMCTL_gdbsx_unpausevcpu:
     case XEN_DOMCTL_gdbsx_domstatus:
+    case XEN_DOMCTL_hvm_exit_stats:
         return current_has_perm(d, SECCLASS_DOMAIN, DOMAIN__SETDEBUGGING);
 
     case XEN_DOMCTL_subscribe:
     case XEN_DOMCTL_disable_migrate:
     case XEN_DOMCTL_suppress_spurious_page_faults:
+    case XEN_DOMCTL_set_spec_ctrl:
         return current_has_perm(d, SECCLASS_DOMAIN, DOMAIN__SET_MISC_INFO);
 
+    case XEN_DOMCTL_get_spec_ctrl:
+        return current_has_perm(d, SECCLASS_DOMAIN, DOMAIN__GETDOMAININFO);
+
     case XEN_DOMCTL_set_virq_handler:
         return current_has_perm(d, SECCLASS_DOMAIN, DOMAIN__SET_VIRQ_HANDLER);
 
@@ -758,6 +766,7 @@ static int flask_sysctl(int cmd)
     /* These have individual XSM hooks */
     case XEN_SYSCTL_readconsole:
     case XEN_SYSCTL_getdomaininfolist:
+    case XEN_SYSCTL_getvcpuinfolist:
     case XEN_SYSCTL_page_offline_op:
     case XEN_SYSCTL_scheduler_op:
 #ifdef CONFIG_X86
@@ -772,9 +781,13 @@ static int flask_sysctl(int cmd)
         return domain_has_xen(current->domain, XEN__GETSCHEDULER);
 
     case XEN_SYSCTL_perfc_op:
+    case XEN_SYSCTL_hypercall_stats:
+    case XEN_SYSCTL_sched_stats:
+    case XEN_SYSCTL_pmuprof_op:
         return domain_has_xen(current->domain, XEN__PERFCONTROL);
 
     case XEN_SYSCTL_debug_keys:
+    case XEN_SYSCTL_debug_dump:
         return domain_has_xen(current->domain, XEN__DEBUG);
 
     case XEN_SYSCTL_getcpuinfo:
@@ -790,6 +803,7 @@ static int flask_sysctl(int cmd)
         return domain_has_xen(current->domain, XEN__PM_OP);
 
     case XEN_SYSCTL_lockprof_op:
+    case XEN_SYSCTL_lockhist_op:
         return domain_has_xen(current->domain, XEN__LOCKPROF);
 
     case XEN_SYSCTL_cpupool_op:
@@ -828,6 +842,9 @@ static int flask_sysctl(int cmd)
     case XEN_SYSCTL_set_parameter:
         return avc_current_has_perm(SECINITSID_XEN, SECCLASS_XEN2,
                                     XEN2__SET_PARAMETER, NULL);
+    case XEN_SYSCTL_evtchn_steering:
+        return avc_current_has_perm(SECINITSID_XEN, SECCLASS_XEN2,
+                                    XEN2__EVTCHN_STEERING, NULL);
 
     default:
         return avc_unknown_permission("sysctl", cmd);
@@ -1497,6 +1514,10 @@ static int flask_shadow_control(struct domain *d, uint32_t op)
     case XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY:
     case XEN_DOMCTL_SHADOW_OP_PEEK:
     case XEN_DOMCTL_SHADOW_OP_CLEAN:
+    case XEN_DOMCTL_SHADOW_OP_DIRTY_RING_SETUP:
+    case XEN_DOMCTL_SHADOW_OP_DIRTY_RING_DRAIN:
+    case XEN_DOMCTL_SHADOW_OP_PEEK_RANGE:
+    case XEN_DOMCTL_SHADOW_OP_CLEAN_RANGE:
         perm = SHADOW__LOGDIRTY;
         break;
     default:
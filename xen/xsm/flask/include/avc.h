@@ -73,6 +73,8 @@ struct avc_cache_stats
     unsigned int allocations;
     unsigned int reclaims;
     unsigned int frees;
+    unsigned int pcpu_hits;
+    unsigned int pcpu_misses;
 };
 
 /*